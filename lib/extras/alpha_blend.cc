@@ -8,6 +8,8 @@
 #include <jxl/types.h>
 
 #include <cstddef>
+#include <utility>
+#include <vector>
 
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/status.h"
@@ -25,31 +27,34 @@ Status AlphaBlend(PackedFrame* frame, const float background[3]) {
     return true;
   }
   --format.num_channels;
+  const size_t num_color = format.num_channels;
   JXL_ASSIGN_OR_RETURN(PackedImage blended,
                        PackedImage::Create(im.xsize, im.ysize, format));
-  // TODO(szabadka) SIMDify this and make it work for float16.
+  // Planar float rows of the color channels and alpha, blended in place, so
+  // that the blending loop vectorizes.
+  // TODO(szabadka) Make this work for float16.
+  std::vector<float> rows((num_color + 1) * im.xsize);
+  float* JXL_RESTRICT alpha = rows.data() + num_color * im.xsize;
   for (size_t y = 0; y < im.ysize; ++y) {
     for (size_t x = 0; x < im.xsize; ++x) {
-      if (format.num_channels == 2) {
-        float g = im.GetPixelValue(y, x, 0);
-        float a = im.GetPixelValue(y, x, 1);
-        float out = g * a + background[0] * (1 - a);
-        blended.SetPixelValue(y, x, 0, out);
-      } else {
-        float r = im.GetPixelValue(y, x, 0);
-        float g = im.GetPixelValue(y, x, 1);
-        float b = im.GetPixelValue(y, x, 2);
-        float a = im.GetPixelValue(y, x, 3);
-        float out_r = r * a + background[0] * (1 - a);
-        float out_g = g * a + background[1] * (1 - a);
-        float out_b = b * a + background[2] * (1 - a);
-        blended.SetPixelValue(y, x, 0, out_r);
-        blended.SetPixelValue(y, x, 1, out_g);
-        blended.SetPixelValue(y, x, 2, out_b);
+      for (size_t c = 0; c <= num_color; ++c) {
+        rows[c * im.xsize + x] = im.GetPixelValue(y, x, c);
+      }
+    }
+    for (size_t c = 0; c < num_color; ++c) {
+      float* JXL_RESTRICT row = rows.data() + c * im.xsize;
+      const float bg = background[c];
+      for (size_t x = 0; x < im.xsize; ++x) {
+        row[x] = row[x] * alpha[x] + bg * (1 - alpha[x]);
+      }
+    }
+    for (size_t x = 0; x < im.xsize; ++x) {
+      for (size_t c = 0; c < num_color; ++c) {
+        blended.SetPixelValue(y, x, c, rows[c * im.xsize + x]);
       }
     }
   }
-  frame->color = blended.Copy();
+  frame->color = std::move(blended);
   return true;
 }
 
@@ -5,7 +5,14 @@
 
 #include <jxl/codestream_header.h>
 #include <jxl/color_encoding.h>
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
 #include <jxl/encode.h>
+#include <jxl/parallel_runner.h>
+#include <jxl/resizable_parallel_runner.h>
+#include <jxl/resizable_parallel_runner_cxx.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
 #include <jxl/types.h>
 
 #include <algorithm>
@@ -23,7 +30,11 @@
 #include "lib/extras/common.h"
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/jxl.h"
+#include "lib/extras/dec/pnm.h"
+#include "lib/extras/enc/apng.h"
 #include "lib/extras/enc/encode.h"
+#include "lib/extras/enc/jxl.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/compiler_specific.h"
@@ -391,6 +402,246 @@ TEST(CodecTest, LosslessPNMRoundtrip) {
   }
 }
 
+// Decodes a lossless 16-bit image to packed RGB10_A2 pixels, with and without
+// alpha, and reads them back through the PackedImage accessors.
+TEST(CodecTest, PackedRGB10A2Roundtrip) {
+  const size_t xsize = 37;
+  const size_t ysize = 19;
+  JxlPixelFormat format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  PackedPixelFile ppf;
+  ppf.info.xsize = xsize;
+  ppf.info.ysize = ysize;
+  ppf.info.bits_per_sample = 16;
+  ppf.info.alpha_bits = 16;
+  ppf.info.num_color_channels = 3;
+  ppf.info.num_extra_channels = 1;
+  ppf.color_encoding = CreateTestColorEncoding(/*is_gray=*/false);
+  JXL_TEST_ASSIGN_OR_DIE(PackedFrame frame,
+                         PackedFrame::Create(xsize, ysize, format));
+  FillPackedImage(16, &frame.color);
+  ppf.frames.emplace_back(std::move(frame));
+  const PackedImage& input = ppf.frames[0].color;
+
+  for (JxlEndianness endianness : {JXL_LITTLE_ENDIAN, JXL_BIG_ENDIAN}) {
+    for (uint32_t num_channels : {3, 4}) {
+      JXLCompressParams cparams = test::CompressParamsForLossless();
+      JXLDecompressParams dparams;
+      dparams.accepted_formats = {
+          {num_channels, JXL_TYPE_UINT32_RGB10_A2, endianness, 0}};
+      PackedPixelFile ppf_out;
+      test::Roundtrip(ppf, cparams, dparams, nullptr, &ppf_out);
+      ASSERT_EQ(1, ppf_out.frames.size());
+      EXPECT_EQ(10, ppf_out.info.bits_per_sample);
+      if (num_channels == 4) EXPECT_EQ(2, ppf_out.info.alpha_bits);
+      const PackedImage& output = ppf_out.frames[0].color;
+      ASSERT_EQ(JXL_TYPE_UINT32_RGB10_A2, output.format.data_type);
+      EXPECT_EQ(4, output.pixel_stride());
+      EXPECT_EQ(xsize * 4, output.stride);
+      EXPECT_EQ(ysize * xsize * 4, output.pixels_size);
+      for (size_t y = 0; y < ysize; ++y) {
+        for (size_t x = 0; x < xsize; ++x) {
+          for (size_t c = 0; c < 3; ++c) {
+            ASSERT_NEAR(input.GetPixelValue(y, x, c),
+                        output.GetPixelValue(y, x, c), 0.5f / 1023 + 1e-5f)
+                << "y = " << y << " x = " << x << " c = " << c;
+          }
+          const float alpha = output.GetPixelValue(y, x, 3);
+          if (num_channels == 3) {
+            ASSERT_EQ(1.0f, alpha);
+          } else {
+            ASSERT_NEAR(input.GetPixelValue(y, x, 3), alpha, 0.5f / 3 + 1e-5f);
+          }
+        }
+      }
+
+      // Writing the values back gives the same packed pixels.
+      JXL_TEST_ASSIGN_OR_DIE(
+          PackedImage copy, PackedImage::Create(xsize, ysize, output.format));
+      memset(copy.pixels(), 0, copy.pixels_size);
+      for (size_t y = 0; y < ysize; ++y) {
+        for (size_t x = 0; x < xsize; ++x) {
+          for (size_t c = 0; c < num_channels; ++c) {
+            copy.SetPixelValue(y, x, c, output.GetPixelValue(y, x, c));
+          }
+        }
+      }
+      EXPECT_EQ(0, memcmp(output.pixels(), copy.pixels(), output.pixels_size));
+    }
+  }
+}
+
+// The JXL encoder and decoder describe the frame to an autotuned resizable
+// runner, which keeps a frame of a single group on one thread.
+TEST(CodecTest, ResizableRunnerWorkload) {
+  const size_t xsize = 64;
+  const size_t ysize = 64;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  PackedPixelFile ppf;
+  ppf.info.xsize = xsize;
+  ppf.info.ysize = ysize;
+  ppf.info.bits_per_sample = 16;
+  ppf.info.num_color_channels = 3;
+  ppf.color_encoding = CreateTestColorEncoding(/*is_gray=*/false);
+  JXL_TEST_ASSIGN_OR_DIE(PackedFrame frame,
+                         PackedFrame::Create(xsize, ysize, format));
+  FillPackedImage(16, &frame.color);
+  ppf.frames.emplace_back(std::move(frame));
+
+  JxlResizableParallelRunnerPtr runner =
+      JxlResizableParallelRunnerMake(nullptr);
+  ASSERT_TRUE(runner);
+  JxlResizableParallelRunnerSetThreads(runner.get(), 8);
+  JxlResizableParallelRunnerSetAutotune(runner.get(), JXL_TRUE);
+  size_t max_threads = 0;
+  JxlParallelRunnerTracer tracer = {};
+  tracer.opaque = &max_threads;
+  tracer.run_begin = [](void* opaque, uint64_t run_id, uint32_t start_range,
+                        uint32_t end_range, size_t num_threads) {
+    size_t* max = static_cast<size_t*>(opaque);
+    *max = std::max(*max, num_threads);
+  };
+  JxlResizableParallelRunnerSetTracer(runner.get(), &tracer);
+
+  JXLCompressParams cparams;
+  cparams.distance = 1.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 3);
+  cparams.runner = JxlResizableParallelRunner;
+  cparams.runner_opaque = runner.get();
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(EncodeImageJXL(cparams, ppf, nullptr, &compressed));
+  EXPECT_EQ(1, max_threads);
+
+  max_threads = 0;
+  JXLDecompressParams dparams;
+  dparams.accepted_formats = {format};
+  dparams.runner = JxlResizableParallelRunner;
+  dparams.runner_opaque = runner.get();
+  PackedPixelFile ppf_out;
+  ASSERT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                             nullptr, &ppf_out));
+  EXPECT_EQ(1, max_threads);
+  ASSERT_EQ(1, ppf_out.frames.size());
+}
+
+// Frames that blend over and are kept as references are encoded concurrently
+// without changing the output.
+TEST(CodecTest, FramesInFlightWithBlending) {
+  const size_t xsize = 64;
+  const size_t ysize = 48;
+  const size_t kNumFrames = 6;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  PackedPixelFile ppf;
+  ppf.info.xsize = xsize;
+  ppf.info.ysize = ysize;
+  ppf.info.bits_per_sample = 16;
+  ppf.info.num_color_channels = 3;
+  ppf.info.have_animation = JXL_TRUE;
+  ppf.info.animation.tps_numerator = 1000;
+  ppf.info.animation.tps_denominator = 1;
+  ppf.color_encoding = CreateTestColorEncoding(/*is_gray=*/false);
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    JXL_TEST_ASSIGN_OR_DIE(PackedFrame frame,
+                           PackedFrame::Create(xsize, ysize, format));
+    FillPackedImage(16, &frame.color);
+    uint8_t* bytes = static_cast<uint8_t*>(frame.color.pixels());
+    for (size_t j = 0; j < frame.color.pixels_size; j += 7) {
+      bytes[j] ^= static_cast<uint8_t>(i * 37);
+    }
+    frame.frame_info.duration = 10;
+    JxlLayerInfo& layer_info = frame.frame_info.layer_info;
+    // Every frame but the last is kept in slot 1, which the next one adds to.
+    if (i + 1 < kNumFrames) layer_info.save_as_reference = 1;
+    if (i > 0) {
+      layer_info.blend_info.blendmode = JXL_BLEND_ADD;
+      layer_info.blend_info.source = 1;
+    }
+    ppf.frames.emplace_back(std::move(frame));
+  }
+
+  const auto encode = [&](size_t max_frames_in_flight) {
+    JxlThreadParallelRunnerPtr runner =
+        JxlThreadParallelRunnerMake(nullptr, /*num_worker_threads=*/4);
+    JXLCompressParams cparams;
+    cparams.distance = 1.0f;
+    cparams.runner_opaque = runner.get();
+    cparams.max_frames_in_flight = max_frames_in_flight;
+    std::vector<uint8_t> compressed;
+    EXPECT_TRUE(EncodeImageJXL(cparams, ppf, nullptr, &compressed));
+    return compressed;
+  };
+  const std::vector<uint8_t> expected = encode(1);
+  ASSERT_FALSE(expected.empty());
+  EXPECT_EQ(expected, encode(4));
+
+  // The frames are written as they were given.
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  ASSERT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetCoalescing(dec.get(), JXL_FALSE));
+  ASSERT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME));
+  ASSERT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec.get(), expected.data(), expected.size()));
+  JxlDecoderCloseInput(dec.get());
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    ASSERT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+    JxlFrameHeader header;
+    ASSERT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetFrameHeader(dec.get(), &header));
+    EXPECT_EQ(i + 1 < kNumFrames ? 1u : 0u,
+              header.layer_info.save_as_reference);
+    EXPECT_EQ(i > 0 ? JXL_BLEND_ADD : JXL_BLEND_REPLACE,
+              header.layer_info.blend_info.blendmode);
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+}
+
+// Reads a rect of each file through the chunked decoder, which maps the file,
+// and compares it with the same pixels decoded in memory. The PFM has its
+// rows stored bottom to top.
+TEST(CodecTest, ChunkedPNM) {
+  for (const char* filename : {"jxl/flower/flower_small.g.depth12.pgm",
+                               "jxl/flower/flower_small.rgb.depth16.ppm",
+                               "jxl/flower/flower_small.rgba.depth8.pam",
+                               "jxl/splines.pfm"}) {
+    const std::vector<uint8_t> orig = jxl::test::ReadTestData(filename);
+    PackedPixelFile ppf;
+    ASSERT_TRUE(DecodeBytes(Bytes(orig), ColorHints(), &ppf));
+    ASSERT_EQ(1, ppf.frames.size());
+    const PackedImage& color = ppf.frames[0].color;
+
+    const std::string path = jxl::test::GetTestDataPath(filename);
+    JXL_TEST_ASSIGN_OR_DIE(ChunkedPNMDecoder dec,
+                           ChunkedPNMDecoder::Init(path.c_str()));
+    PackedPixelFile chunked_ppf;
+    ASSERT_TRUE(dec.InitializePPF(ColorHints(), &chunked_ppf));
+    ASSERT_EQ(1, chunked_ppf.chunked_frames.size());
+    EXPECT_EQ(ppf.info.bits_per_sample, chunked_ppf.info.bits_per_sample);
+    EXPECT_EQ(ppf.info.alpha_bits, chunked_ppf.info.alpha_bits);
+    ChunkedPackedFrame& frame = chunked_ppf.chunked_frames[0];
+    EXPECT_EQ(color.format.num_channels, frame.format.num_channels);
+    EXPECT_EQ(color.format.data_type, frame.format.data_type);
+    EXPECT_EQ(color.format.endianness, frame.format.endianness);
+
+    const size_t x0 = color.xsize / 3;
+    const size_t y0 = color.ysize / 3;
+    const size_t xsize = color.xsize / 2;
+    const size_t ysize = color.ysize / 2;
+    JxlChunkedFrameInputSource input = frame.GetInputSource();
+    size_t row_offset;
+    const void* buffer = input.get_color_channel_data_at(
+        input.opaque, x0, y0, xsize, ysize, &row_offset);
+    ASSERT_NE(nullptr, buffer);
+    const size_t pixel_size = color.pixel_stride();
+    for (size_t y = 0; y < ysize; ++y) {
+      const uint8_t* expected = reinterpret_cast<const uint8_t*>(
+                                    color.pixels()) +
+                                (y0 + y) * color.stride + x0 * pixel_size;
+      const uint8_t* actual =
+          reinterpret_cast<const uint8_t*>(buffer) + y * row_offset;
+      EXPECT_EQ(0, memcmp(expected, actual, xsize * pixel_size)) << filename;
+    }
+    input.release_buffer(input.opaque, buffer);
+  }
+}
+
 TEST(CodecTest, TestPNM) {
   size_t u = 77777;  // Initialized to wrong value.
   double d = 77.77;
@@ -499,6 +750,100 @@ TEST(CodecTest, EncodeToPNG) {
                   decoded_ppf.info.bits_per_sample);
 }
 
+TEST(CodecTest, ParallelAPNGFrames) {
+  std::unique_ptr<Encoder> encoder = GetAPNGEncoder();
+  if (!encoder || !CanDecode(Codec::kPNG)) {
+    fprintf(stderr, "Skipping test because of missing codec support.\n");
+    return;
+  }
+  TestImageParams params;
+  params.codec = Codec::kPNG;
+  params.xsize = 29;
+  params.ysize = 17;
+  params.bits_per_sample = 8;
+  params.is_gray = false;
+  params.add_alpha = true;
+  params.big_endian = false;
+  params.add_extra_channels = false;
+  PackedPixelFile ppf;
+  CreateTestImage(params, &ppf);
+  ppf.info.have_animation = JXL_TRUE;
+  ppf.info.animation.tps_numerator = 1000;
+  ppf.info.animation.tps_denominator = 1;
+  for (size_t i = 1; i < 5; ++i) {
+    PackedPixelFile frame;
+    CreateTestImage(params, &frame);
+    uint8_t* pixels = static_cast<uint8_t*>(frame.frames[0].color.pixels());
+    for (size_t j = 0; j < frame.frames[0].color.pixels_size; ++j) {
+      pixels[j] ^= static_cast<uint8_t>(i * 37);
+    }
+    ppf.frames.emplace_back(std::move(frame.frames[0]));
+  }
+  for (PackedFrame& frame : ppf.frames) frame.frame_info.duration = 10;
+  EncodedImage encoded;
+  ASSERT_TRUE(encoder->Encode(ppf, &encoded, nullptr));
+  ASSERT_EQ(encoded.bitstreams.size(), 1);
+
+  ThreadPoolForTests pool(4);
+  PackedPixelFile decoded;
+  ASSERT_TRUE(DecodeBytes(Bytes(encoded.bitstreams[0]), ColorHints(),
+                          &decoded, nullptr, nullptr, pool.get()));
+  ASSERT_EQ(decoded.frames.size(), ppf.frames.size());
+  for (size_t i = 0; i < ppf.frames.size(); ++i) {
+    VerifySameImage(ppf.frames[i].color, 8, decoded.frames[i].color,
+                    decoded.info.bits_per_sample);
+  }
+}
+
+TEST(CodecTest, PNGStreamWriter) {
+  for (size_t bits_per_sample : {8, 16}) {
+    for (bool add_alpha : {false, true}) {
+      std::vector<uint8_t> png;
+      std::unique_ptr<PixelSink> writer = GetPNGStreamWriter(
+          [&png](const uint8_t* data, size_t size) -> Status {
+            png.insert(png.end(), data, data + size);
+            return true;
+          },
+          /*rows_per_block=*/3);
+      if (!writer) {
+        fprintf(stderr, "Skipping test because of missing codec support.\n");
+        return;
+      }
+      TestImageParams params;
+      params.codec = Codec::kPNG;
+      params.xsize = 37;
+      params.ysize = 11;
+      params.bits_per_sample = bits_per_sample;
+      params.is_gray = false;
+      params.add_alpha = add_alpha;
+      params.big_endian = false;
+      params.add_extra_channels = false;
+      PackedPixelFile ppf;
+      CreateTestImage(params, &ppf);
+      const PackedImage& image = ppf.frames[0].color;
+      ASSERT_TRUE(writer->StartFrame(ppf, image.format));
+      // The decoder gives the rows in any order, and in pieces.
+      const size_t split = image.xsize / 3;
+      const size_t pixel_size = image.pixel_stride();
+      for (size_t y = image.ysize; y-- > 0;) {
+        const uint8_t* row =
+            static_cast<const uint8_t*>(image.pixels()) + y * image.stride;
+        writer->SetPixels(split, y, image.xsize - split,
+                          row + split * pixel_size);
+        writer->SetPixels(0, y, split, row);
+      }
+      ASSERT_TRUE(writer->Finish(ppf));
+
+      PackedPixelFile decoded;
+      ASSERT_TRUE(DecodeBytes(Bytes(png), ColorHints(), &decoded));
+      ASSERT_EQ(decoded.frames.size(), 1);
+      EXPECT_EQ(decoded.info.alpha_bits, add_alpha ? bits_per_sample : 0);
+      VerifySameImage(image, bits_per_sample, decoded.frames[0].color,
+                      decoded.info.bits_per_sample);
+    }
+  }
+}
+
 }  // namespace
 }  // namespace extras
 }  // namespace jxl
@@ -41,6 +41,7 @@
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/size_constraints.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 
@@ -51,7 +52,7 @@ namespace extras {
 bool CanDecodeAPNG() { return false; }
 Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                        const ColorHints& color_hints, PackedPixelFile* ppf,
-                       const SizeConstraints* constraints) {
+                       const SizeConstraints* constraints, ThreadPool* pool) {
   return false;
 }
 }  // namespace extras
@@ -458,29 +459,17 @@ constexpr uint32_t MakeTag(uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
   return a | (b << 8) | (c << 16) | (d << 24);
 }
 
-/** Reusable image data container. */
+/** Rows the PNG decoder writes to. */
 struct Pixels {
-  // Use array instead of vector to avoid memory initialization.
-  std::unique_ptr<uint8_t[]> pixels;
-  size_t pixels_size = 0;
   std::vector<uint8_t*> rows;
   std::atomic<bool> has_error{false};
 
-  Status Resize(size_t row_bytes, size_t num_rows) {
-    size_t new_size = row_bytes * num_rows;  // it is assumed size is sane
-    if (new_size > pixels_size) {
-      pixels.reset(new uint8_t[new_size]);
-      if (!pixels) {
-        // TODO(szabadka): use specialized OOM error code
-        return JXL_FAILURE("Failed to allocate memory for image buffer");
-      }
-      pixels_size = new_size;
-    }
-    rows.resize(num_rows);
-    for (size_t y = 0; y < num_rows; y++) {
-      rows[y] = pixels.get() + y * row_bytes;
+  // Makes the decoder write the rows of `image` in place.
+  void Attach(PackedImage* image) {
+    rows.resize(image->ysize);
+    for (size_t y = 0; y < image->ysize; y++) {
+      rows[y] = static_cast<uint8_t*>(image->pixels()) + y * image->stride;
     }
-    return true;
   }
 };
 
@@ -693,6 +682,52 @@ struct Frame {
   FrameControl metadata;
 };
 
+// The chunks of a frame, which are decoded once all the frames are known.
+struct FrameChunks {
+  FrameControl metadata;
+  // IDAT and fdAT chunks, and the other chunks that come after the start of
+  // the pixel data of the frame, in order.
+  std::vector<Bytes> chunks;
+};
+
+// Decodes the pixels of a frame into `frame`, with a PNG decoder of its own,
+// so that frames are decoded in parallel.
+Status DecodeFrame(const std::array<uint8_t, 25>& ihdr,
+                   const std::vector<Bytes>& passthrough_chunks,
+                   const FrameChunks& frame_chunks, Frame* frame,
+                   PackedMetadata* metadata) {
+  Context ctx;
+  ctx.ihdr = ihdr;
+  ctx.frameRaw.Attach(&frame->pixels);
+  if (!ctx.InitPngDecoder(passthrough_chunks, frame_chunks.metadata.viewport)) {
+    return JXL_FAILURE("Failed to initialize PNG decoder");
+  }
+  for (const Bytes& chunk : frame_chunks.chunks) {
+    if (LoadLE32(chunk.data() + 4) != MakeTag('f', 'd', 'A', 'T')) {
+      if (!ctx.FeedChunks(chunk)) {
+        return JXL_FAILURE("PNG decoder failed to process chunk");
+      }
+      continue;
+    }
+    // Turn 'fdAT' to 'IDAT' by cutting sequence number and replacing tag.
+    std::array<uint8_t, 8> preamble;
+    png_save_uint_32(preamble.data(), chunk.size() - 16);
+    memcpy(preamble.data() + 4, "IDAT", 4);
+    // Cut-off 'size', 'type' and 'sequence_number'
+    Bytes chunk_tail(chunk.data() + 12, chunk.size() - 12);
+    if (!ctx.FeedChunks(Bytes(preamble), chunk_tail)) {
+      return JXL_FAILURE("Decoding fdAT failed");
+    }
+  }
+  if (!ctx.FinalizeStream(metadata)) {
+    return JXL_FAILURE("Failed to finalize PNG substream");
+  }
+  if (ctx.frameRaw.has_error) {
+    return JXL_FAILURE("Internal error");
+  }
+  return true;
+}
+
 bool ValidateViewport(const RectT<uint64_t>& r) {
   constexpr uint32_t kMaxPngDim = 1000000UL;
   return (r.xsize() <= kMaxPngDim) && (r.ysize() <= kMaxPngDim);
@@ -804,7 +839,7 @@ bool CanDecodeAPNG() { return true; }
  */
 Status DecodeImageAPNG(const Span<const uint8_t> bytes,
                        const ColorHints& color_hints, PackedPixelFile* ppf,
-                       const SizeConstraints* constraints) {
+                       const SizeConstraints* constraints, ThreadPool* pool) {
   // Initialize output (default settings in case e.g. only gAMA is given).
   ppf->frames.clear();
   ppf->info.exponent_bits_per_sample = 0;
@@ -866,34 +901,19 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
   uint32_t num_channels;
   JxlPixelFormat format = {};
   size_t bytes_per_pixel = 0;
-  std::vector<Frame> frames;
-  FrameControl current_frame = {/*delay_num=*/1, /*delay_den=*/10, image_rect,
-                                DisposeOp::NONE, BlendOp::SOURCE};
+  // The chunks of each frame are only gathered here; `ctx` only decodes the
+  // header, and the frames are decoded in parallel after the last one.
+  std::vector<FrameChunks> frame_chunks;
+  FrameChunks current_frame = {{/*delay_num=*/1, /*delay_den=*/10, image_rect,
+                                DisposeOp::NONE, BlendOp::SOURCE},
+                               {}};
 
-  // Copies frame pixels / metadata from temporary storage.
-  // TODO(eustas): avoid copying.
   const auto finalize_frame = [&]() -> Status {
     if (!seen_pixel_data) {
       return JXL_FAILURE("Frame / image without fdAT / IDAT chunks");
     }
-    if (!ctx.FinalizeStream(&ppf->metadata)) {
-      return JXL_FAILURE("Failed to finalize PNG substream");
-    }
-    if (ctx.frameRaw.has_error) {
-      return JXL_FAILURE("Internal error");
-    }
-    // Allocates the frame buffer.
-    const RectT<uint64_t>& vp = current_frame.viewport;
-    size_t xsize = static_cast<size_t>(vp.xsize());
-    size_t ysize = static_cast<size_t>(vp.ysize());
-    JXL_ASSIGN_OR_RETURN(PackedImage image,
-                         PackedImage::Create(xsize, ysize, format));
-    for (size_t y = 0; y < ysize; ++y) {
-      // TODO(eustas): ensure multiplication is safe
-      memcpy(static_cast<uint8_t*>(image.pixels()) + image.stride * y,
-             ctx.frameRaw.rows[y], bytes_per_pixel * xsize);
-    }
-    frames.push_back(Frame{std::move(image), current_frame});
+    frame_chunks.push_back(std::move(current_frame));
+    current_frame.chunks.clear();
     seen_pixel_data = false;
     return true;
   };
@@ -985,16 +1005,13 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
           }
         } else {
           JXL_RETURN_IF_ERROR(finalize_frame());
-          if (!ctx.InitPngDecoder(passthrough_chunks, next_frame.viewport)) {
-            return JXL_FAILURE("Failed to initialize PNG decoder");
-          }
         }
-        current_frame = next_frame;
+        current_frame.metadata = next_frame;
         continue;
       }
 
       case MakeTag('I', 'D', 'A', 'T'): {
-        if (!frames.empty()) {
+        if (!frame_chunks.empty()) {
           return JXL_FAILURE("IDAT after default image is over");
         }
         if (!seen_idat) {
@@ -1033,14 +1050,9 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
           if (image_rect.ysize() > max_rows) {
             return JXL_FAILURE("Image too big.");
           }
-          // TODO(eustas): drop frameRaw
-          JXL_RETURN_IF_ERROR(
-              ctx.frameRaw.Resize(row_bytes, image_rect.ysize()));
         }
 
-        if (!ctx.FeedChunks(chunk)) {
-          return JXL_FAILURE("Decoding IDAT failed");
-        }
+        current_frame.chunks.push_back(chunk);
         seen_pixel_data = true;
         continue;
       }
@@ -1057,15 +1069,7 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
         if (payload.size() < 4) {
           return JXL_FAILURE("Corrupted fdAT chunk");
         }
-        // Turn 'fdAT' to 'IDAT' by cutting sequence number and replacing tag.
-        std::array<uint8_t, 8> preamble;
-        png_save_uint_32(preamble.data(), payload.size() - 4);
-        memcpy(preamble.data() + 4, "IDAT", 4);
-        // Cut-off 'size', 'type' and 'sequence_number'
-        Bytes chunk_tail(chunk.data() + 12, chunk.size() - 12);
-        if (!ctx.FeedChunks(Bytes(preamble), chunk_tail)) {
-          return JXL_FAILURE("Decoding fdAT failed");
-        }
+        current_frame.chunks.push_back(chunk);
         seen_pixel_data = true;
         continue;
       }
@@ -1155,19 +1159,44 @@ Status DecodeImageAPNG(const Span<const uint8_t> bytes,
         continue;
 
       default:
-        // We don't know what is that, just pass through.
+        // We don't know what is that, just pass through. If it happens before
+        // IDAT, we consider it metadata and pass to all sub-decoders.
+        if (seen_idat) {
+          current_frame.chunks.push_back(chunk);
+          continue;
+        }
         if (!ctx.FeedChunks(chunk)) {
           return JXL_FAILURE("PNG decoder failed to process chunk");
         }
-        // If it happens before IDAT, we consider it metadata and pass to all
-        // sub-decoders.
-        if (!seen_idat) {
-          passthrough_chunks.push_back(chunk);
-        }
+        passthrough_chunks.push_back(chunk);
         continue;
     }
   }
 
+  // Allocates the frame buffers, which the sub-decoders write to in place.
+  std::vector<Frame> frames;
+  frames.reserve(frame_chunks.size());
+  for (const FrameChunks& chunks : frame_chunks) {
+    const RectT<uint64_t>& vp = chunks.metadata.viewport;
+    JXL_ASSIGN_OR_RETURN(
+        PackedImage image,
+        PackedImage::Create(static_cast<size_t>(vp.xsize()),
+                            static_cast<size_t>(vp.ysize()), format));
+    frames.push_back(Frame{std::move(image), chunks.metadata});
+  }
+  std::vector<PackedMetadata> frame_metadata(frames.size());
+  const auto decode_frame = [&](const uint32_t i, size_t /*thread*/) -> Status {
+    return DecodeFrame(ctx.ihdr, passthrough_chunks, frame_chunks[i],
+                       &frames[i], &frame_metadata[i]);
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, frames.size(), ThreadPool::NoInit,
+                                decode_frame, "DecodeAPNGFrames"));
+  // Text chunks of later frames override the earlier ones.
+  for (PackedMetadata& metadata : frame_metadata) {
+    if (!metadata.exif.empty()) ppf->metadata.exif = std::move(metadata.exif);
+    if (!metadata.xmp.empty()) ppf->metadata.xmp = std::move(metadata.xmp);
+  }
+
   bool color_is_already_set = (color_info_type != ColorInfoType::NONE);
   bool is_gray = (ppf->info.num_color_channels == 1);
   JXL_RETURN_IF_ERROR(
@@ -10,6 +10,7 @@
 
 #include <cstdint>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 
@@ -24,10 +25,12 @@ class PackedPixelFile;
 
 bool CanDecodeAPNG();
 
-// Decodes `bytes` into `ppf`.
+// Decodes `bytes` into `ppf`. The frames of an animation are decoded in
+// parallel on `pool`, and keep the crop and blending of their frame control.
 Status DecodeImageAPNG(Span<const uint8_t> bytes, const ColorHints& color_hints,
                        PackedPixelFile* ppf,
-                       const SizeConstraints* constraints = nullptr);
+                       const SizeConstraints* constraints = nullptr,
+                       ThreadPool* pool = nullptr);
 
 }  // namespace extras
 }  // namespace jxl
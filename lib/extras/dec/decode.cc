@@ -115,7 +115,8 @@ std::string ListOfDecodeCodecs() {
 
 Status DecodeBytes(const Span<const uint8_t> bytes,
                    const ColorHints& color_hints, extras::PackedPixelFile* ppf,
-                   const SizeConstraints* constraints, Codec* orig_codec) {
+                   const SizeConstraints* constraints, Codec* orig_codec,
+                   ThreadPool* pool) {
   if (bytes.size() < kMinBytes) return JXL_FAILURE("Too few bytes");
 
   *ppf = extras::PackedPixelFile();
@@ -125,7 +126,7 @@ Status DecodeBytes(const Span<const uint8_t> bytes,
   ppf->info.orientation = JXL_ORIENT_IDENTITY;
 
   const auto choose_codec = [&]() -> Codec {
-    if (DecodeImageAPNG(bytes, color_hints, ppf, constraints)) {
+    if (DecodeImageAPNG(bytes, color_hints, ppf, constraints, pool)) {
       return Codec::kPNG;
     }
     if (DecodeImagePGX(bytes, color_hints, ppf, constraints)) {
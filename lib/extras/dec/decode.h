@@ -15,6 +15,7 @@
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 
@@ -48,10 +49,11 @@ Codec CodecFromPath(const std::string& path,
 
 // Decodes "bytes" info *ppf.
 // color_space_hint may specify the color space, otherwise, defaults to sRGB.
+// The frames of APNG animations are decoded in parallel on `pool`.
 Status DecodeBytes(Span<const uint8_t> bytes, const ColorHints& color_hints,
                    extras::PackedPixelFile* ppf,
                    const SizeConstraints* constraints = nullptr,
-                   Codec* orig_codec = nullptr);
+                   Codec* orig_codec = nullptr, ThreadPool* pool = nullptr);
 
 }  // namespace extras
 }  // namespace jxl
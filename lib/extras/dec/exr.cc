@@ -19,6 +19,28 @@ namespace jxl {
 namespace extras {
 bool CanDecodeEXR() { return false; }
 
+struct ChunkedEXRDecoderImpl {};
+
+ChunkedEXRDecoder::ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::~ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::ChunkedEXRDecoder(ChunkedEXRDecoder&&) noexcept = default;
+ChunkedEXRDecoder& ChunkedEXRDecoder::operator=(ChunkedEXRDecoder&&) noexcept =
+    default;
+
+StatusOr<ChunkedEXRDecoder> ChunkedEXRDecoder::Init(const char* file_path,
+                                                    int num_threads) {
+  (void)file_path;
+  (void)num_threads;
+  return JXL_FAILURE("EXR is not supported");
+}
+
+Status ChunkedEXRDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  (void)color_hints;
+  (void)ppf;
+  return JXL_FAILURE("EXR is not supported");
+}
+
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints) {
@@ -39,15 +61,19 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
 #include <ImfStandardAttributes.h>
 #include <OpenEXRConfig.h>
 #include <jxl/color_encoding.h>
+#include <jxl/encode.h>
 #include <jxl/types.h>
 
 #include <algorithm>
 #include <cstddef>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <utility>
 #include <vector>
 
+#include "lib/extras/mmap.h"
+#include "lib/jxl/base/c_callback_support.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 
@@ -123,8 +149,243 @@ class InMemoryIStream : public OpenEXR::IStream {
   size_t pos_ = 0;
 };
 
+JxlPixelFormat EXRPixelFormat(bool has_alpha) {
+  const JxlDataType data_type =
+      kExrBitsPerSample == 16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT;
+  return {
+      /*num_channels=*/3u + (has_alpha ? 1u : 0u),
+      /*data_type=*/data_type,
+      /*endianness=*/JXL_NATIVE_ENDIAN,
+      /*align=*/0,
+  };
+}
+
+// Sets the basic info and the color encoding of `ppf` from the header.
+void SetInfoFromHeader(const OpenEXR::RgbaInputFile& input, bool has_alpha,
+                       PackedPixelFile* ppf) {
+  auto image_size = input.displayWindow().size();
+  // Size is computed as max - min, but both bounds are inclusive.
+  ppf->info.xsize = image_size.x + 1;
+  ppf->info.ysize = image_size.y + 1;
+  ppf->info.num_color_channels = 3;
+
+  ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_LINEAR;
+  ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
+  ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
+  ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
+  if (OpenEXR::hasChromaticities(input.header())) {
+    ppf->color_encoding.primaries = JXL_PRIMARIES_CUSTOM;
+    ppf->color_encoding.white_point = JXL_WHITE_POINT_CUSTOM;
+    const auto& chromaticities = OpenEXR::chromaticities(input.header());
+    ppf->color_encoding.primaries_red_xy[0] = chromaticities.red.x;
+    ppf->color_encoding.primaries_red_xy[1] = chromaticities.red.y;
+    ppf->color_encoding.primaries_green_xy[0] = chromaticities.green.x;
+    ppf->color_encoding.primaries_green_xy[1] = chromaticities.green.y;
+    ppf->color_encoding.primaries_blue_xy[0] = chromaticities.blue.x;
+    ppf->color_encoding.primaries_blue_xy[1] = chromaticities.blue.y;
+    ppf->color_encoding.white_point_xy[0] = chromaticities.white.x;
+    ppf->color_encoding.white_point_xy[1] = chromaticities.white.y;
+  }
+
+  // EXR uses binary16 or binary32 floating point format.
+  ppf->info.bits_per_sample = kExrBitsPerSample;
+  ppf->info.exponent_bits_per_sample = kExrBitsPerSample == 16 ? 5 : 8;
+  if (has_alpha) {
+    ppf->info.alpha_bits = kExrAlphaBits;
+    ppf->info.alpha_exponent_bits = ppf->info.exponent_bits_per_sample;
+    ppf->info.alpha_premultiplied = JXL_TRUE;
+  }
+  ppf->info.intensity_target = OpenEXR::hasWhiteLuminance(input.header())
+                                   ? OpenEXR::whiteLuminance(input.header())
+                                   : 0;
+}
+
 }  // namespace
 
+struct ChunkedEXRDecoderImpl {
+  // Decompresses the rows of the band [ypos, ypos + ysize) of the image, if
+  // it is not the last band that was decompressed. Must be called with
+  // `mutex` held.
+  bool LoadBand(size_t ypos, size_t ysize) {
+    if (ypos == band_y0 && ysize == band_ysize) return true;
+    const auto& data_window = input->dataWindow();
+    const auto& display_window = input->displayWindow();
+    const int row_size = data_window.size().x + 1;
+    const int first_y = display_window.min.y + static_cast<int>(ypos);
+    const int start_y = std::max<int>(data_window.min.y, first_y);
+    const int end_y =
+        std::min<int>(data_window.max.y, first_y + static_cast<int>(ysize) - 1);
+    band_y0 = ypos;
+    band_ysize = ysize;
+    band_exr_y0 = start_y;
+    band.clear();
+    if (start_y > end_y) return true;
+    band.resize(static_cast<size_t>(row_size) * (end_y - start_y + 1));
+#ifdef __EXCEPTIONS
+    try {
+#endif
+      input->setFrameBuffer(
+          band.data() - data_window.min.x - start_y * row_size,
+          /*xStride=*/1, /*yStride=*/row_size);
+      input->readPixels(start_y, end_y);
+#ifdef __EXCEPTIONS
+    } catch (...) {
+      band_ysize = 0;
+      return false;
+    }
+#endif
+    return true;
+  }
+
+  // Returns `num_channels` channels of the pixels of the rect, starting at
+  // `channel`, in a buffer that ReleaseCurrentData frees. The pixels of the
+  // display window that are outside of the data window are zero.
+  const void* GetChannelsAt(size_t channel, size_t num_channels, size_t xpos,
+                            size_t ypos, size_t xsize, size_t ysize,
+                            size_t* row_offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!LoadBand(ypos, ysize)) {
+      JXL_WARNING("Failed to read EXR pixels");
+      return nullptr;
+    }
+    const auto& data_window = input->dataWindow();
+    const auto& display_window = input->displayWindow();
+    const size_t row_size = data_window.size().x + 1;
+    const size_t num_band_rows = band.size() / row_size;
+    const size_t sample_size = kExrBitsPerSample / 8;
+    const size_t pixel_size = num_channels * sample_size;
+    *row_offset = xsize * pixel_size;
+    uint8_t* out = new uint8_t[ysize * *row_offset]();
+    for (size_t y = 0; y < ysize; ++y) {
+      const int exr_y = display_window.min.y + static_cast<int>(ypos + y);
+      if (exr_y < band_exr_y0 ||
+          static_cast<size_t>(exr_y - band_exr_y0) >= num_band_rows) {
+        continue;
+      }
+      const OpenEXR::Rgba* const JXL_RESTRICT input_row =
+          &band[(exr_y - band_exr_y0) * row_size];
+      uint8_t* row_out = out + y * *row_offset;
+      for (size_t x = 0; x < xsize; ++x) {
+        const int exr_x = display_window.min.x + static_cast<int>(xpos + x);
+        if (exr_x < data_window.min.x || exr_x > data_window.max.x) continue;
+        // TODO(eustas): UB: OpenEXR::Rgba is not TriviallyCopyable
+        memcpy(row_out + x * pixel_size,
+               reinterpret_cast<const uint8_t*>(
+                   input_row + (exr_x - data_window.min.x)) +
+                   channel * sample_size,
+               pixel_size);
+      }
+    }
+    return out;
+  }
+
+  MemoryMappedFile file;
+  std::unique_ptr<InMemoryIStream> stream;
+  std::unique_ptr<OpenEXR::RgbaInputFile> input;
+  bool has_alpha = false;
+
+  std::mutex mutex;
+  // Last band of rows that was requested, in image coordinates, and its rows
+  // that are in the data window, starting at `band_exr_y0`.
+  size_t band_y0 = 0;
+  size_t band_ysize = 0;
+  int band_exr_y0 = 0;
+  std::vector<OpenEXR::Rgba> band;
+};
+
+struct EXRChunkedInputFrame {
+  JxlChunkedFrameInputSource operator()() {
+    return JxlChunkedFrameInputSource{
+        this,
+        METHOD_TO_C_CALLBACK(
+            &EXRChunkedInputFrame::GetColorChannelsPixelFormat),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetColorChannelDataAt),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetExtraChannelPixelFormat),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::GetExtraChannelDataAt),
+        METHOD_TO_C_CALLBACK(&EXRChunkedInputFrame::ReleaseCurrentData)};
+  }
+
+  void /* NOLINT */ GetColorChannelsPixelFormat(JxlPixelFormat* pixel_format) {
+    *pixel_format = format;
+  }
+
+  const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t xsize,
+                                    size_t ysize, size_t* row_offset) {
+    return impl->GetChannelsAt(0, format.num_channels, xpos, ypos, xsize,
+                               ysize, row_offset);
+  }
+
+  void GetExtraChannelPixelFormat(size_t ec_index,
+                                  JxlPixelFormat* pixel_format) {
+    *pixel_format = {1, format.data_type, format.endianness, 0};
+  }
+
+  // The only extra channel is the alpha channel.
+  const void* GetExtraChannelDataAt(size_t ec_index, size_t xpos, size_t ypos,
+                                    size_t xsize, size_t ysize,
+                                    size_t* row_offset) {
+    return impl->GetChannelsAt(3, 1, xpos, ypos, xsize, ysize, row_offset);
+  }
+
+  void ReleaseCurrentData(const void* buffer) {
+    delete[] reinterpret_cast<const uint8_t*>(buffer);
+  }
+
+  JxlPixelFormat format;
+  ChunkedEXRDecoderImpl* impl;
+};
+
+ChunkedEXRDecoder::ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::~ChunkedEXRDecoder() = default;
+ChunkedEXRDecoder::ChunkedEXRDecoder(ChunkedEXRDecoder&&) noexcept = default;
+ChunkedEXRDecoder& ChunkedEXRDecoder::operator=(ChunkedEXRDecoder&&) noexcept =
+    default;
+
+StatusOr<ChunkedEXRDecoder> ChunkedEXRDecoder::Init(const char* file_path,
+                                                    int num_threads) {
+  ChunkedEXRDecoder dec;
+  dec.impl_ = jxl::make_unique<ChunkedEXRDecoderImpl>();
+  ChunkedEXRDecoderImpl& impl = *dec.impl_;
+  JXL_ASSIGN_OR_RETURN(impl.file, MemoryMappedFile::Init(file_path));
+  impl.stream = jxl::make_unique<InMemoryIStream>(
+      Bytes(impl.file.data(), impl.file.size()));
+#ifdef __EXCEPTIONS
+  try {
+    impl.input = jxl::make_unique<OpenEXR::RgbaInputFile>(*impl.stream,
+                                                          num_threads);
+  } catch (...) {
+    return JXL_FAILURE("Not an EXR file");
+  }
+#else
+  impl.input =
+      jxl::make_unique<OpenEXR::RgbaInputFile>(*impl.stream, num_threads);
+#endif
+  const OpenEXR::RgbaChannels channels = impl.input->channels();
+  if ((channels & OpenEXR::RgbaChannels::WRITE_RGB) !=
+      OpenEXR::RgbaChannels::WRITE_RGB) {
+    return JXL_FAILURE("only RGB OpenEXR files are supported");
+  }
+  impl.has_alpha = (channels & OpenEXR::RgbaChannels::WRITE_A) ==
+                   OpenEXR::RgbaChannels::WRITE_A;
+  return dec;
+}
+
+Status ChunkedEXRDecoder::InitializePPF(const ColorHints& color_hints,
+                                        PackedPixelFile* ppf) {
+  // As for DecodeImageEXR, color_hints are ignored.
+  (void)color_hints;
+  SetInfoFromHeader(*impl_->input, impl_->has_alpha, ppf);
+  ppf->info.orientation = JXL_ORIENT_IDENTITY;
+  ppf->info.num_extra_channels = impl_->has_alpha ? 1 : 0;
+  ppf->extra_channels_info.clear();
+
+  EXRChunkedInputFrame frame;
+  frame.format = EXRPixelFormat(impl_->has_alpha);
+  frame.impl = impl_.get();
+  ppf->chunked_frames.emplace_back(ppf->info.xsize, ppf->info.ysize, frame);
+  return true;
+}
+
 bool CanDecodeEXR() { return true; }
 
 Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
@@ -152,33 +413,15 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
   const bool has_alpha = (input.channels() & OpenEXR::RgbaChannels::WRITE_A) ==
                          OpenEXR::RgbaChannels::WRITE_A;
 
-  const float intensity_target = OpenEXR::hasWhiteLuminance(input.header())
-                                     ? OpenEXR::whiteLuminance(input.header())
-                                     : 0;
-
-  auto image_size = input.displayWindow().size();
-  // Size is computed as max - min, but both bounds are inclusive.
-  ++image_size.x;
-  ++image_size.y;
-
-  ppf->info.xsize = image_size.x;
-  ppf->info.ysize = image_size.y;
-  ppf->info.num_color_channels = 3;
+  SetInfoFromHeader(input, has_alpha, ppf);
 
-  const JxlDataType data_type =
-      kExrBitsPerSample == 16 ? JXL_TYPE_FLOAT16 : JXL_TYPE_FLOAT;
-  const JxlPixelFormat format{
-      /*num_channels=*/3u + (has_alpha ? 1u : 0u),
-      /*data_type=*/data_type,
-      /*endianness=*/JXL_NATIVE_ENDIAN,
-      /*align=*/0,
-  };
+  const JxlPixelFormat format = EXRPixelFormat(has_alpha);
   ppf->frames.clear();
   // Allocates the frame buffer.
   {
     JXL_ASSIGN_OR_RETURN(
         PackedFrame frame,
-        PackedFrame::Create(image_size.x, image_size.y, format));
+        PackedFrame::Create(ppf->info.xsize, ppf->info.ysize, format));
     ppf->frames.emplace_back(std::move(frame));
   }
   const auto& frame = ppf->frames.back();
@@ -223,33 +466,6 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
     }
   }
 
-  ppf->color_encoding.transfer_function = JXL_TRANSFER_FUNCTION_LINEAR;
-  ppf->color_encoding.color_space = JXL_COLOR_SPACE_RGB;
-  ppf->color_encoding.primaries = JXL_PRIMARIES_SRGB;
-  ppf->color_encoding.white_point = JXL_WHITE_POINT_D65;
-  if (OpenEXR::hasChromaticities(input.header())) {
-    ppf->color_encoding.primaries = JXL_PRIMARIES_CUSTOM;
-    ppf->color_encoding.white_point = JXL_WHITE_POINT_CUSTOM;
-    const auto& chromaticities = OpenEXR::chromaticities(input.header());
-    ppf->color_encoding.primaries_red_xy[0] = chromaticities.red.x;
-    ppf->color_encoding.primaries_red_xy[1] = chromaticities.red.y;
-    ppf->color_encoding.primaries_green_xy[0] = chromaticities.green.x;
-    ppf->color_encoding.primaries_green_xy[1] = chromaticities.green.y;
-    ppf->color_encoding.primaries_blue_xy[0] = chromaticities.blue.x;
-    ppf->color_encoding.primaries_blue_xy[1] = chromaticities.blue.y;
-    ppf->color_encoding.white_point_xy[0] = chromaticities.white.x;
-    ppf->color_encoding.white_point_xy[1] = chromaticities.white.y;
-  }
-
-  // EXR uses binary16 or binary32 floating point format.
-  ppf->info.bits_per_sample = kExrBitsPerSample;
-  ppf->info.exponent_bits_per_sample = kExrBitsPerSample == 16 ? 5 : 8;
-  if (has_alpha) {
-    ppf->info.alpha_bits = kExrAlphaBits;
-    ppf->info.alpha_exponent_bits = ppf->info.exponent_bits_per_sample;
-    ppf->info.alpha_premultiplied = JXL_TRUE;
-  }
-  ppf->info.intensity_target = intensity_target;
   return true;
 }
 
@@ -9,6 +9,7 @@
 // Decodes OpenEXR images in memory.
 
 #include <cstdint>
+#include <memory>
 
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
@@ -29,6 +30,28 @@ Status DecodeImageEXR(Span<const uint8_t> bytes, const ColorHints& color_hints,
                       PackedPixelFile* ppf,
                       const SizeConstraints* constraints = nullptr);
 
+struct ChunkedEXRDecoderImpl;
+
+// Decodes an OpenEXR file as a chunked frame, for encoding large HDR images
+// with bounded memory: only the scanlines or tiles of the band of rows that
+// the encoder asks for are decompressed, on `num_threads` OpenEXR threads, and
+// the file is memory-mapped. color_hints are ignored.
+class ChunkedEXRDecoder {
+ public:
+  static StatusOr<ChunkedEXRDecoder> Init(const char* file_path,
+                                          int num_threads);
+  // Initializes `ppf` with a pointer to this `ChunkedEXRDecoder`.
+  Status InitializePPF(const ColorHints& color_hints, PackedPixelFile* ppf);
+
+  ChunkedEXRDecoder();                                         // NOLINT
+  ~ChunkedEXRDecoder();                                        // NOLINT
+  ChunkedEXRDecoder(ChunkedEXRDecoder&&) noexcept;             // NOLINT
+  ChunkedEXRDecoder& operator=(ChunkedEXRDecoder&&) noexcept;  // NOLINT
+
+ private:
+  std::unique_ptr<ChunkedEXRDecoderImpl> impl_;
+};
+
 }  // namespace extras
 }  // namespace jxl
 
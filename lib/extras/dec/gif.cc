@@ -325,18 +325,24 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
       }
     }
 
-    // Update the canvas by creating a copy first.
-    JXL_ASSIGN_OR_RETURN(
-        PackedImage new_canvas_image,
-        PackedImage::Create(canvas.color.xsize, canvas.color.ysize,
-                            canvas.color.format));
-    memcpy(new_canvas_image.pixels(), canvas.color.pixels(),
-           new_canvas_image.pixels_size);
+    // Update the canvas in place. Only the area of a frame that is disposed
+    // to the previous canvas is saved first, so that frames cost their own
+    // size instead of the size of the canvas.
+    std::vector<PackedRgba> saved_area;
+    if (gcb.DisposalMode == DISPOSE_PREVIOUS) {
+      saved_area.reserve(image_rect.xsize() * image_rect.ysize());
+      for (size_t y = 0; y < image_rect.ysize(); ++y) {
+        const PackedRgba* row =
+            static_cast<const PackedRgba*>(canvas.color.pixels()) +
+            (y + image_rect.y0()) * canvas.color.xsize + image_rect.x0();
+        saved_area.insert(saved_area.end(), row, row + image_rect.xsize());
+      }
+    }
     for (size_t y = 0, byte_index = 0; y < image_rect.ysize(); ++y) {
       // Assumes format.align == 0. row points to the beginning of the y row in
       // the image_rect.
-      PackedRgba* row = static_cast<PackedRgba*>(new_canvas_image.pixels()) +
-                        (y + image_rect.y0()) * new_canvas_image.xsize +
+      PackedRgba* row = static_cast<PackedRgba*>(canvas.color.pixels()) +
+                        (y + image_rect.y0()) * canvas.color.xsize +
                         image_rect.x0();
       for (size_t x = 0; x < image_rect.xsize(); ++x, ++byte_index) {
         const GifByteType byte = image.RasterBits[byte_index];
@@ -354,11 +360,11 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
     }
     const PackedImage& sub_frame_image = frame->color;
     if (replace) {
-      // Copy from the new canvas image to the subframe
+      // Copy from the updated canvas to the subframe
       for (size_t y = 0; y < total_rect.ysize(); ++y) {
         const PackedRgba* row_in =
-            static_cast<const PackedRgba*>(new_canvas_image.pixels()) +
-            (y + total_rect.y0()) * new_canvas_image.xsize + total_rect.x0();
+            static_cast<const PackedRgba*>(canvas.color.pixels()) +
+            (y + total_rect.y0()) * canvas.color.xsize + total_rect.x0();
         PackedRgb* row_out = static_cast<PackedRgb*>(sub_frame_image.pixels()) +
                              y * sub_frame_image.xsize;
         for (size_t x = 0; x < sub_frame_image.xsize; ++x) {
@@ -400,7 +406,6 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
 
     switch (gcb.DisposalMode) {
       case DISPOSE_DO_NOT:
-        canvas.color = std::move(new_canvas_image);
         break;
 
       case DISPOSE_BACKGROUND:
@@ -410,6 +415,13 @@ Status DecodeImageGIF(Span<const uint8_t> bytes, const ColorHints& color_hints,
         break;
 
       case DISPOSE_PREVIOUS:
+        for (size_t y = 0; y < image_rect.ysize(); ++y) {
+          PackedRgba* row = static_cast<PackedRgba*>(canvas.color.pixels()) +
+                            (y + image_rect.y0()) * canvas.color.xsize +
+                            image_rect.x0();
+          std::copy_n(saved_area.data() + y * image_rect.xsize(),
+                      image_rect.xsize(), row);
+        }
         break;
 
       case DISPOSAL_UNSPECIFIED:
@@ -242,6 +242,10 @@ Status DecodeJpeg(const std::vector<uint8_t>& compressed,
 
     jpegli_set_output_format(&cinfo, ConvertDataType(dparams.output_data_type),
                              ConvertEndianness(dparams.output_endianness));
+    if (pool != nullptr) {
+      jpegli_set_decompress_parallel_runner(&cinfo, pool->runner(),
+                                            pool->runner_opaque());
+    }
 
     if (dparams.num_colors > 0) {
       cinfo.quantize_colors = TRUE;
@@ -10,14 +10,17 @@
 #include <jxl/color_encoding.h>
 #include <jxl/decode.h>
 #include <jxl/decode_cxx.h>
+#include <jxl/resizable_parallel_runner.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <cinttypes>  // PRIu32
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <limits>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -117,12 +120,18 @@ void SetBitDepthFromDataType(JxlDataType data_type, uint32_t* bits_per_sample,
       *bits_per_sample = 32;
       *exponent_bits_per_sample = 8;
       break;
+    case JXL_TYPE_UINT32_RGB10_A2:
+      *bits_per_sample = 10;
+      *exponent_bits_per_sample = 0;
+      break;
   }
 }
 
 template <typename T>
 void UpdateBitDepth(JxlBitDepth bit_depth, JxlDataType data_type, T* info) {
-  if (bit_depth.type == JXL_BIT_DEPTH_FROM_PIXEL_FORMAT) {
+  // The bit depth of packed pixels is that of the pixel format.
+  if (bit_depth.type == JXL_BIT_DEPTH_FROM_PIXEL_FORMAT ||
+      data_type == JXL_TYPE_UINT32_RGB10_A2) {
     SetBitDepthFromDataType(data_type, &info->bits_per_sample,
                             &info->exponent_bits_per_sample);
   } else if (bit_depth.type == JXL_BIT_DEPTH_CUSTOM) {
@@ -131,15 +140,52 @@ void UpdateBitDepth(JxlBitDepth bit_depth, JxlDataType data_type, T* info) {
   }
 }
 
-}  // namespace
+// Returns where to store the contents of a box of the given type, or null if
+// the box is not kept.
+std::vector<uint8_t>* GetBoxData(const JxlBoxType box_type,
+                                 PackedMetadata* metadata) {
+  if (memcmp(box_type, "Exif", 4) == 0) return &metadata->exif;
+  if (memcmp(box_type, "iptc", 4) == 0) return &metadata->iptc;
+  if (memcmp(box_type, "jumb", 4) == 0) return &metadata->jumbf;
+  if (memcmp(box_type, "jhgm", 4) == 0) return &metadata->jhgm;
+  if (memcmp(box_type, "xml ", 4) == 0) return &metadata->xmp;
+  return nullptr;
+}
 
-bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
-                    const JXLDecompressParams& dparams, size_t* decoded_bytes,
-                    PackedPixelFile* ppf, std::vector<uint8_t>* jpeg_bytes) {
-  JxlSignature sig = JxlSignatureCheck(bytes, bytes_size);
-  // silently return false if this is not a JXL file
-  if (sig == JXL_SIG_INVALID) return false;
+void FinalizeExif(std::vector<uint8_t>* exif_box) {
+  if (exif_box->empty()) return;
+  // Verify that Exif box has a valid TIFF header at the specified offset.
+  // Discard bytes preceding the header.
+  if (exif_box->size() >= 4) {
+    uint32_t offset = LoadBE32(exif_box->data());
+    if (offset <= exif_box->size() - 8) {
+      std::vector<uint8_t> exif(exif_box->begin() + 4 + offset,
+                                exif_box->end());
+      bool bigendian;
+      if (IsExif(exif, &bigendian)) {
+        *exif_box = std::move(exif);
+      } else {
+        fprintf(stderr, "Warning: invalid TIFF header in Exif\n");
+      }
+    } else {
+      fprintf(stderr, "Warning: invalid Exif offset: %" PRIu32 "\n", offset);
+    }
+  } else {
+    fprintf(stderr, "Warning: invalid Exif length: %" PRIuS "\n",
+            exif_box->size());
+  }
+}
+
+constexpr size_t kAllFrames = std::numeric_limits<size_t>::max();
 
+// Decodes "num_frames" frames, starting at "first_frame". The metadata boxes
+// are only read if all frames are decoded, and the preview only if the first
+// frame is.
+bool DecodeFrames(const uint8_t* bytes, size_t bytes_size,
+                  const JXLDecompressParams& dparams, size_t first_frame,
+                  size_t num_frames, size_t* decoded_bytes,
+                  PackedPixelFile* ppf, std::vector<uint8_t>* jpeg_bytes) {
+  const bool read_boxes = first_frame == 0 && num_frames == kAllFrames;
   auto decoder = JxlDecoderMake(dparams.memory_manager);
   JxlDecoder* dec = decoder.get();
   ppf->frames.clear();
@@ -150,6 +196,12 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
     fprintf(stderr, "JxlEncoderSetParallelRunner failed\n");
     return false;
   }
+  // The frames are only all decoded here by a single decoder.
+  if (dparams.stats != nullptr && read_boxes &&
+      JXL_DEC_SUCCESS != JxlDecoderCollectStats(dec, dparams.stats)) {
+    fprintf(stderr, "JxlDecoderCollectStats failed\n");
+    return false;
+  }
 
   JxlPixelFormat format = {};  // Initialize to calm down clang-tidy.
   std::vector<JxlPixelFormat> accepted_formats = dparams.accepted_formats;
@@ -190,8 +242,9 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
   if (jpeg_bytes != nullptr) {
     events |= JXL_DEC_JPEG_RECONSTRUCTION;
   } else {
-    events |= (JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME | JXL_DEC_PREVIEW_IMAGE |
-               JXL_DEC_BOX);
+    events |= (JXL_DEC_COLOR_ENCODING | JXL_DEC_FRAME);
+    if (first_frame == 0) events |= JXL_DEC_PREVIEW_IMAGE;
+    if (read_boxes) events |= JXL_DEC_BOX;
     if (accepted_formats.empty()) {
       // decoding just the metadata, not the pixel data
       events ^= (JXL_DEC_FULL_IMAGE | JXL_DEC_PREVIEW_IMAGE);
@@ -232,6 +285,10 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
     fprintf(stderr, "Decoder failed to set input\n");
     return false;
   }
+  if (first_frame > 0) {
+    // Only decodes the earlier frames which the requested ones depend on.
+    JxlDecoderSkipFrames(dec, first_frame);
+  }
   uint32_t progression_index = 0;
   bool codestream_done = jpeg_bytes == nullptr && accepted_formats.empty();
   BoxProcessor boxes(dec);
@@ -267,18 +324,7 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         fprintf(stderr, "JxlDecoderGetBoxType failed\n");
         return false;
       }
-      std::vector<uint8_t>* box_data = nullptr;
-      if (memcmp(box_type, "Exif", 4) == 0) {
-        box_data = &ppf->metadata.exif;
-      } else if (memcmp(box_type, "iptc", 4) == 0) {
-        box_data = &ppf->metadata.iptc;
-      } else if (memcmp(box_type, "jumb", 4) == 0) {
-        box_data = &ppf->metadata.jumbf;
-      } else if (memcmp(box_type, "jhgm", 4) == 0) {
-        box_data = &ppf->metadata.jhgm;
-      } else if (memcmp(box_type, "xml ", 4) == 0) {
-        box_data = &ppf->metadata.xmp;
-      }
+      std::vector<uint8_t>* box_data = GetBoxData(box_type, &ppf->metadata);
       if (box_data) {
         if (!boxes.InitializeOutput(box_data)) {
           return false;
@@ -322,6 +368,13 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         fprintf(stderr, "JxlDecoderGetBasicInfo failed\n");
         return false;
       }
+      // Reconstructed JPEGs are always VarDCT and have no JXL_DEC_FRAME event.
+      if (jpeg_bytes != nullptr && dparams.runner_opaque != nullptr &&
+          dparams.runner == JxlResizableParallelRunner) {
+        JxlResizableParallelRunnerSetWorkload(
+            dparams.runner_opaque, ppf->info.xsize, ppf->info.ysize,
+            /*modular=*/JXL_FALSE, /*effort=*/0);
+      }
       if (accepted_formats.empty()) continue;
       if (num_color_channels != 0) {
         // Mark the change in number of color channels due to the requested
@@ -422,12 +475,14 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         ppf->primary_color_representation = PackedPixelFile::kIccIsPrimary;
       }
     } else if (status == JXL_DEC_FRAME) {
-      auto frame_or = jxl::extras::PackedFrame::Create(ppf->info.xsize,
-                                                       ppf->info.ysize, format);
-      JXL_ASSIGN_OR_QUIT(jxl::extras::PackedFrame frame,
-                         jxl::extras::PackedFrame::Create(
-                             ppf->info.xsize, ppf->info.ysize, format),
-                         "Failed to create image frame.");
+      // With a pixel sink, the frame only keeps its header.
+      const bool to_sink = dparams.pixel_sink != nullptr;
+      JXL_ASSIGN_OR_QUIT(
+          jxl::extras::PackedFrame frame,
+          jxl::extras::PackedFrame::Create(to_sink ? 1 : ppf->info.xsize,
+                                           to_sink ? 1 : ppf->info.ysize,
+                                           format),
+          "Failed to create image frame.");
       if (JXL_DEC_SUCCESS != JxlDecoderGetFrameHeader(dec, &frame.frame_info)) {
         fprintf(stderr, "JxlDecoderGetFrameHeader failed\n");
         return false;
@@ -440,6 +495,17 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         return false;
       }
       frame.name.resize(frame.frame_info.name_length);
+      if (dparams.runner_opaque != nullptr &&
+          dparams.runner == JxlResizableParallelRunner) {
+        JXL_BOOL modular;
+        if (JXL_DEC_SUCCESS != JxlDecoderGetFrameIsModular(dec, &modular)) {
+          fprintf(stderr, "JxlDecoderGetFrameIsModular failed\n");
+          return false;
+        }
+        JxlResizableParallelRunnerSetWorkload(
+            dparams.runner_opaque, frame.frame_info.layer_info.xsize,
+            frame.frame_info.layer_info.ysize, modular, /*effort=*/0);
+      }
       ppf->frames.emplace_back(std::move(frame));
       progression_index = 0;
     } else if (status == JXL_DEC_FRAME_PROGRESSION) {
@@ -495,13 +561,25 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         return false;
       }
       jxl::extras::PackedFrame& frame = ppf->frames.back();
-      if (buffer_size != frame.color.pixels_size) {
+      if (dparams.pixel_sink == nullptr &&
+          buffer_size != frame.color.pixels_size) {
         fprintf(stderr, "Invalid out buffer size %" PRIuS " %" PRIuS "\n",
                 buffer_size, frame.color.pixels_size);
         return false;
       }
 
-      if (dparams.use_image_callback) {
+      if (dparams.pixel_sink != nullptr) {
+        auto callback = [](void* opaque, size_t x, size_t y, size_t num_pixels,
+                           const void* pixels) {
+          static_cast<PixelSink*>(opaque)->SetPixels(x, y, num_pixels, pixels);
+        };
+        if (JXL_DEC_SUCCESS !=
+            JxlDecoderSetImageOutCallback(dec, &format, callback,
+                                          dparams.pixel_sink)) {
+          fprintf(stderr, "JxlDecoderSetImageOutCallback failed\n");
+          return false;
+        }
+      } else if (dparams.use_image_callback) {
         auto callback = [](void* opaque, size_t x, size_t y, size_t num_pixels,
                            const void* pixels) {
           auto* ppf = reinterpret_cast<jxl::extras::PackedPixelFile*>(opaque);
@@ -535,9 +613,23 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
         // Interleaved alpha channels has the same bit depth as color channels.
         ppf->info.alpha_bits = ppf->info.bits_per_sample;
         ppf->info.alpha_exponent_bits = ppf->info.exponent_bits_per_sample;
+        if (format.data_type == JXL_TYPE_UINT32_RGB10_A2) {
+          ppf->info.alpha_bits = 2;
+        }
+      }
+      if (dparams.pixel_sink != nullptr) {
+        if (!dparams.pixel_sink->StartFrame(*ppf, format)) {
+          fprintf(stderr, "Failed to start a frame of the pixel sink\n");
+          return false;
+        }
+        continue;
       }
       JxlPixelFormat ec_format = format;
       ec_format.num_channels = 1;
+      // Extra channels are not packed.
+      if (format.data_type == JXL_TYPE_UINT32_RGB10_A2) {
+        ec_format.data_type = JXL_TYPE_UINT16;
+      }
       for (auto& eci : ppf->extra_channels_info) {
         JXL_ASSIGN_OR_QUIT(jxl::extras::PackedImage image,
                            jxl::extras::PackedImage::Create(
@@ -577,6 +669,7 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
       if (jpeg_bytes != nullptr || ppf->frames.back().frame_info.is_last) {
         codestream_done = true;
       }
+      if (ppf->frames.size() == num_frames) break;
     } else {
       fprintf(stderr, "Error: unexpected status: %d\n",
               static_cast<int>(status));
@@ -584,28 +677,7 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
     }
   }
   boxes.FinalizeOutput();
-  if (!ppf->metadata.exif.empty()) {
-    // Verify that Exif box has a valid TIFF header at the specified offset.
-    // Discard bytes preceding the header.
-    if (ppf->metadata.exif.size() >= 4) {
-      uint32_t offset = LoadBE32(ppf->metadata.exif.data());
-      if (offset <= ppf->metadata.exif.size() - 8) {
-        std::vector<uint8_t> exif(ppf->metadata.exif.begin() + 4 + offset,
-                                  ppf->metadata.exif.end());
-        bool bigendian;
-        if (IsExif(exif, &bigendian)) {
-          ppf->metadata.exif = std::move(exif);
-        } else {
-          fprintf(stderr, "Warning: invalid TIFF header in Exif\n");
-        }
-      } else {
-        fprintf(stderr, "Warning: invalid Exif offset: %" PRIu32 "\n", offset);
-      }
-    } else {
-      fprintf(stderr, "Warning: invalid Exif length: %" PRIuS "\n",
-              ppf->metadata.exif.size());
-    }
-  }
+  if (read_boxes) FinalizeExif(&ppf->metadata.exif);
   if (jpeg_bytes != nullptr) {
     if (!can_reconstruct_jpeg) return false;
     size_t used_jpeg_output =
@@ -619,5 +691,137 @@ bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
   return true;
 }
 
+// Reads the metadata boxes into "metadata" and counts the frames, without
+// decoding any pixels.
+bool ReadBoxesAndCountFrames(const uint8_t* bytes, size_t bytes_size,
+                             const JXLDecompressParams& dparams,
+                             size_t* decoded_bytes, PackedMetadata* metadata,
+                             size_t* num_frames) {
+  auto decoder = JxlDecoderMake(dparams.memory_manager);
+  JxlDecoder* dec = decoder.get();
+  if (JXL_DEC_SUCCESS !=
+          JxlDecoderSubscribeEvents(dec, JXL_DEC_FRAME | JXL_DEC_BOX) ||
+      JXL_DEC_SUCCESS != JxlDecoderSetDecompressBoxes(dec, JXL_TRUE) ||
+      JXL_DEC_SUCCESS != JxlDecoderSetInput(dec, bytes, bytes_size)) {
+    fprintf(stderr, "Failed to set up the frame counting decoder\n");
+    return false;
+  }
+  JxlDecoderCloseInput(dec);
+  *num_frames = 0;
+  BoxProcessor boxes(dec);
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_FRAME) {
+      ++*num_frames;
+    } else if (status == JXL_DEC_BOX) {
+      boxes.FinalizeOutput();
+      JxlBoxType box_type;
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBoxType(dec, box_type, JXL_TRUE)) {
+        fprintf(stderr, "JxlDecoderGetBoxType failed\n");
+        return false;
+      }
+      std::vector<uint8_t>* box_data = GetBoxData(box_type, metadata);
+      if (box_data && !boxes.InitializeOutput(box_data)) {
+        return false;
+      }
+    } else if (status == JXL_DEC_BOX_NEED_MORE_OUTPUT) {
+      if (!boxes.AddMoreOutput()) {
+        return false;
+      }
+    } else if (status == JXL_DEC_SUCCESS) {
+      break;
+    } else {
+      fprintf(stderr, "Failed to read frame headers\n");
+      return false;
+    }
+  }
+  boxes.FinalizeOutput();
+  FinalizeExif(&metadata->exif);
+  if (decoded_bytes) {
+    *decoded_bytes = bytes_size - JxlDecoderReleaseInput(dec);
+  }
+  return true;
+}
+
+// Splits the frames into contiguous ranges, one per frame decoder, and
+// decodes the ranges concurrently.
+bool DecodeFramesConcurrently(const uint8_t* bytes, size_t bytes_size,
+                              const JXLDecompressParams& dparams,
+                              size_t* decoded_bytes, PackedPixelFile* ppf) {
+  size_t num_frames;
+  if (!ReadBoxesAndCountFrames(bytes, bytes_size, dparams, decoded_bytes,
+                               &ppf->metadata, &num_frames)) {
+    return false;
+  }
+  const size_t num_decoders = std::min(dparams.num_frame_decoders, num_frames);
+  if (num_decoders < 2) {
+    return DecodeFrames(bytes, bytes_size, dparams, 0, kAllFrames,
+                        decoded_bytes, ppf, /*jpeg_bytes=*/nullptr);
+  }
+  const auto range_begin = [&](size_t i) {
+    return num_frames * i / num_decoders;
+  };
+  std::vector<PackedPixelFile> ranges(num_decoders - 1);
+  std::vector<char> ok(num_decoders - 1);
+  std::vector<std::thread> threads;
+  threads.reserve(num_decoders - 1);
+  for (size_t i = 1; i < num_decoders; ++i) {
+    threads.emplace_back([&, i]() {
+      const size_t begin = range_begin(i);
+      ok[i - 1] = static_cast<char>(DecodeFrames(
+          bytes, bytes_size, dparams, begin, range_begin(i + 1) - begin,
+          /*decoded_bytes=*/nullptr, &ranges[i - 1], /*jpeg_bytes=*/nullptr));
+    });
+  }
+  // The first range also decodes the preview, directly into "ppf".
+  const bool first_ok =
+      DecodeFrames(bytes, bytes_size, dparams, 0, range_begin(1),
+                   /*decoded_bytes=*/nullptr, ppf, /*jpeg_bytes=*/nullptr);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  if (!first_ok) return false;
+  for (size_t i = 1; i < num_decoders; ++i) {
+    if (!ok[i - 1]) return false;
+    for (PackedFrame& frame : ranges[i - 1].frames) {
+      ppf->frames.emplace_back(std::move(frame));
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
+                    const JXLDecompressParams& dparams, size_t* decoded_bytes,
+                    PackedPixelFile* ppf, std::vector<uint8_t>* jpeg_bytes) {
+  JxlSignature sig = JxlSignatureCheck(bytes, bytes_size);
+  // silently return false if this is not a JXL file
+  if (sig == JXL_SIG_INVALID) return false;
+
+  // Concurrent frame decoders and pixel sinks require the whole input, and
+  // all passes of all frames decoded to pixels.
+  const bool complete_decode =
+      jpeg_bytes == nullptr && !dparams.accepted_formats.empty() &&
+      !dparams.allow_partial_input &&
+      dparams.max_passes == std::numeric_limits<uint32_t>::max() &&
+      dparams.max_downsampling == 1;
+  if (dparams.pixel_sink != nullptr) {
+    if (!complete_decode) {
+      fprintf(stderr, "A pixel sink needs a complete decode to pixels\n");
+      return false;
+    }
+    return DecodeFrames(bytes, bytes_size, dparams, 0, kAllFrames,
+                        decoded_bytes, ppf, /*jpeg_bytes=*/nullptr) &&
+           static_cast<bool>(dparams.pixel_sink->Finish(*ppf));
+  }
+  if (dparams.num_frame_decoders > 1 && complete_decode) {
+    return DecodeFramesConcurrently(bytes, bytes_size, dparams, decoded_bytes,
+                                    ppf);
+  }
+  return DecodeFrames(bytes, bytes_size, dparams, 0, kAllFrames, decoded_bytes,
+                      ppf, jpeg_bytes);
+}
+
 }  // namespace extras
 }  // namespace jxl
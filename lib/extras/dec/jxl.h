@@ -8,6 +8,7 @@
 
 // Decodes JPEG XL images in memory.
 
+#include <jxl/decode_stats.h>
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
 #include <jxl/types.h>
@@ -18,11 +19,34 @@
 #include <string>
 #include <vector>
 
+#include "lib/jxl/base/status.h"
+
 namespace jxl {
 namespace extras {
 
 class PackedPixelFile;
 
+// Receives the pixels of the color channels, with interleaved alpha, while the
+// decoder produces them, see JXLDecompressParams::pixel_sink.
+class PixelSink {
+ public:
+  virtual ~PixelSink() = default;
+
+  // Called before the pixels of each frame, once `ppf` has the basic info, the
+  // color encoding and, as its last frame, the header of the frame.
+  virtual Status StartFrame(const PackedPixelFile& ppf,
+                            const JxlPixelFormat& format) = 0;
+
+  // Called from the threads of the parallel runner, in any order, with
+  // `num_pixels` pixels of row `y` starting at column `x`. Each pixel is given
+  // exactly once.
+  virtual void SetPixels(size_t x, size_t y, size_t num_pixels,
+                         const void* pixels) = 0;
+
+  // Called after the last frame, once `ppf` also has the metadata boxes.
+  virtual Status Finish(const PackedPixelFile& ppf) = 0;
+};
+
 struct JXLDecompressParams {
   // If empty, little endian float formats will be accepted.
   std::vector<JxlPixelFormat> accepted_formats;
@@ -61,6 +85,26 @@ struct JXLDecompressParams {
 
   // Controls the effective bit depth of the output pixels.
   JxlBitDepth output_bitdepth = {JXL_BIT_DEPTH_FROM_PIXEL_FORMAT, 0, 0};
+
+  // If larger than 1, the frames of an animation are split into this many
+  // consecutive ranges, which are decoded concurrently by separate decoders.
+  // Each decoder skips to its range with JxlDecoderSkipFrames, so it only
+  // decodes the earlier frames that its frames reference. All decoders share
+  // the parallel runner, which then must support concurrent calls, such as
+  // JxlSharedParallelRunner. Only used when decoding all passes of complete
+  // input to pixels.
+  size_t num_frame_decoders = 1;
+
+  // If set, the pixels go to this sink instead of the frames of the
+  // PackedPixelFile, which then only keep their headers, and extra channels
+  // are not decoded. Only used when decoding all passes of complete input to
+  // pixels, and not together with num_frame_decoders.
+  PixelSink* pixel_sink = nullptr;
+
+  // If set, the decoder adds the time it spends, and the counters set with
+  // JxlDecoderStatsSetCounters, to these stats. Only used when a single
+  // decoder decodes all the frames.
+  JxlDecoderStats* stats = nullptr;
 };
 
 bool DecodeImageJXL(const uint8_t* bytes, size_t bytes_size,
@@ -347,32 +347,84 @@ struct PNMChunkedInputFrame {
 
   const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t xsize,
                                     size_t ysize, size_t* row_offset) {
-    const size_t bytes_per_channel =
-        DivCeil(dec->header_.bits_per_sample, jxl::kBitsPerByte);
-    const size_t num_channels = dec->header_.is_gray ? 1 : 3;
-    const size_t bytes_per_pixel = num_channels * bytes_per_channel;
-    *row_offset = dec->header_.xsize * bytes_per_pixel;
-    const size_t offset = ypos * *row_offset + xpos * bytes_per_pixel;
-    return dec->pnm_.data() + offset + dec->data_start_;
+    return GetChannelsAt(0, format.num_channels, xpos, ypos, xsize, ysize,
+                         row_offset);
   }
 
   void GetExtraChannelPixelFormat(size_t ec_index,
                                   JxlPixelFormat* pixel_format) {
-    (void)this;
-    *pixel_format = {};
-    JXL_DEBUG_ABORT("Not implemented");
+    *pixel_format = {1, format.data_type, format.endianness, 0};
   }
 
+  // Extra channels follow the color channels in the file, in the order of the
+  // metadata, starting with the alpha channel if there is one.
   const void* GetExtraChannelDataAt(size_t ec_index, size_t xpos, size_t ypos,
                                     size_t xsize, size_t ysize,
                                     size_t* row_offset) {
-    (void)this;
-    *row_offset = 0;
-    JXL_DEBUG_ABORT("Not implemented");
-    return nullptr;
+    const size_t num_color_channels = dec->header_.is_gray ? 1 : 3;
+    return GetChannelsAt(num_color_channels + ec_index, 1, xpos, ypos, xsize,
+                         ysize, row_offset);
   }
 
-  void ReleaseCurrentData(const void* buffer) {}
+  void ReleaseCurrentData(const void* buffer) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(buffer);
+    const uint8_t* file_begin = dec->pnm_.data();
+    const uint8_t* file_end = file_begin + dec->pnm_.size();
+    if (data != nullptr && (data < file_begin || data >= file_end)) {
+      delete[] data;
+    }
+  }
+
+  // Returns `num_channels` channels of the pixels of the rect, starting at
+  // `channel`. Points into the mapped file when its rows can be used as they
+  // are; otherwise, i.e. for some of the channels of a PAM, or for a PFM whose
+  // rows are stored bottom to top, copies the rect into a buffer that
+  // ReleaseCurrentData frees. Either way, only the pages of the file that hold
+  // the rect are read.
+  const void* GetChannelsAt(size_t channel, size_t num_channels, size_t xpos,
+                            size_t ypos, size_t xsize, size_t ysize,
+                            size_t* row_offset) {
+    const HeaderPNM& header = dec->header_;
+    const size_t bytes_per_sample =
+        DivCeil(header.bits_per_sample, jxl::kBitsPerByte);
+    const size_t file_pixel_size = dec->num_channels_ * bytes_per_sample;
+    const size_t file_row_size = header.xsize * file_pixel_size;
+    const uint8_t* data = dec->pnm_.data() + dec->data_start_;
+    const bool flipped_y = header.floating_point;
+    // The encoder requests the rects from top to bottom, so that the rows
+    // below this rect come next: have them read while it encodes this one.
+    const size_t next_ypos = ypos + ysize;
+    if (next_ypos < header.ysize) {
+      const size_t next_ysize = std::min(ysize, header.ysize - next_ypos);
+      const size_t next_y_in =
+          flipped_y ? header.ysize - next_ypos - next_ysize : next_ypos;
+      dec->pnm_.Prefetch(dec->data_start_ + next_y_in * file_row_size,
+                         next_ysize * file_row_size);
+    }
+    if (num_channels == dec->num_channels_ && !flipped_y) {
+      *row_offset = file_row_size;
+      return data + ypos * file_row_size + xpos * file_pixel_size;
+    }
+    const size_t pixel_size = num_channels * bytes_per_sample;
+    *row_offset = xsize * pixel_size;
+    uint8_t* out = new uint8_t[ysize * *row_offset];
+    for (size_t y = 0; y < ysize; ++y) {
+      const size_t y_in = flipped_y ? header.ysize - 1 - (ypos + y) : ypos + y;
+      const uint8_t* row_in = data + y_in * file_row_size +
+                              xpos * file_pixel_size +
+                              channel * bytes_per_sample;
+      uint8_t* row_out = out + y * *row_offset;
+      if (num_channels == dec->num_channels_) {
+        memcpy(row_out, row_in, xsize * pixel_size);
+        continue;
+      }
+      for (size_t x = 0; x < xsize; ++x) {
+        memcpy(row_out + x * pixel_size, row_in + x * file_pixel_size,
+               pixel_size);
+      }
+    }
+    return out;
+  }
 
   JxlPixelFormat format;
   const ChunkedPNMDecoder* dec;
@@ -393,17 +445,16 @@ StatusOr<ChunkedPNMDecoder> ChunkedPNMDecoder::Init(const char* path) {
   }
   dec.data_start_ = pos - span.data();
 
-  if (header.bits_per_sample == 0 || header.bits_per_sample > 16) {
+  if (header.bits_per_sample == 0 || header.bits_per_sample > 32 ||
+      (header.bits_per_sample > 16 && !header.floating_point)) {
     return JXL_FAILURE("Invalid bits_per_sample");
   }
-  if (header.has_alpha || !header.ec_types.empty() || header.floating_point) {
-    return JXL_FAILURE("Only PGM and PPM inputs are supported");
-  }
 
   const size_t bytes_per_channel =
       DivCeil(dec.header_.bits_per_sample, jxl::kBitsPerByte);
-  const size_t num_channels = dec.header_.is_gray ? 1 : 3;
-  const size_t bytes_per_pixel = num_channels * bytes_per_channel;
+  dec.num_channels_ = (header.is_gray ? 1 : 3) + (header.has_alpha ? 1 : 0) +
+                      header.ec_types.size();
+  const size_t bytes_per_pixel = dec.num_channels_ * bytes_per_channel;
   size_t row_size = dec.header_.xsize * bytes_per_pixel;
   if (size < header.ysize * row_size + dec.data_start_) {
     return JXL_FAILURE("PNM file too small");
@@ -422,17 +473,32 @@ jxl::Status ChunkedPNMDecoder::InitializePPF(const ColorHints& color_hints,
   ppf->info.xsize = header_.xsize;
   ppf->info.ysize = header_.ysize;
   ppf->info.bits_per_sample = header_.bits_per_sample;
-  ppf->info.exponent_bits_per_sample = 0;
+  ppf->info.exponent_bits_per_sample = header_.floating_point ? 8 : 0;
   ppf->info.orientation = JXL_ORIENT_IDENTITY;
-  ppf->info.alpha_bits = 0;
+  ppf->info.alpha_bits = header_.has_alpha ? ppf->info.bits_per_sample : 0;
   ppf->info.alpha_exponent_bits = 0;
   ppf->info.num_color_channels = (header_.is_gray ? 1 : 3);
-  ppf->info.num_extra_channels = 0;
+  const uint32_t num_alpha_channels = header_.has_alpha ? 1 : 0;
+  ppf->info.num_extra_channels = num_alpha_channels + header_.ec_types.size();
+  ppf->extra_channels_info.clear();
+  for (auto type : header_.ec_types) {
+    PackedExtraChannel pec = {};
+    pec.ec_info.bits_per_sample = ppf->info.bits_per_sample;
+    pec.ec_info.type = type;
+    ppf->extra_channels_info.emplace_back(std::move(pec));
+  }
+  if (!header_.floating_point) {
+    ppf->input_bitdepth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
+  }
 
-  const JxlDataType data_type =
-      header_.bits_per_sample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
+  JxlDataType data_type = JXL_TYPE_FLOAT;
+  if (!header_.floating_point) {
+    data_type = header_.bits_per_sample > 8 ? JXL_TYPE_UINT16 : JXL_TYPE_UINT8;
+  }
+  // Alpha is interleaved with the color channels, other extra channels are
+  // given separately.
   const JxlPixelFormat format{
-      /*num_channels=*/ppf->info.num_color_channels,
+      /*num_channels=*/ppf->info.num_color_channels + num_alpha_channels,
       /*data_type=*/data_type,
       /*endianness=*/header_.big_endian ? JXL_BIG_ENDIAN : JXL_LITTLE_ENDIAN,
       /*align=*/0,
@@ -46,6 +46,8 @@ struct HeaderPNM {
   std::vector<JxlExtraChannelType> ec_types;  // PAM
 };
 
+// Decodes PGM, PPM, PAM and PFM files as a chunked frame, reading the pixels
+// of each rect requested by the encoder from a memory mapping of the file.
 class ChunkedPNMDecoder {
  public:
   static StatusOr<ChunkedPNMDecoder> Init(const char* file_path);
@@ -56,6 +58,8 @@ class ChunkedPNMDecoder {
  private:
   HeaderPNM header_ = {};
   size_t data_start_ = 0;
+  // Channels interleaved in each pixel of the file.
+  size_t num_channels_ = 0;
   MemoryMappedFile pnm_;
 
   friend struct PNMChunkedInputFrame;
@@ -47,6 +47,10 @@
 namespace jxl {
 namespace extras {
 std::unique_ptr<Encoder> GetAPNGEncoder() { return nullptr; }
+std::unique_ptr<PixelSink> GetPNGStreamWriter(PNGWriteFunc write,
+                                              size_t rows_per_block) {
+  return nullptr;
+}
 }  // namespace extras
 }  // namespace jxl
 
@@ -56,13 +60,18 @@ std::unique_ptr<Encoder> GetAPNGEncoder() { return nullptr; }
 #include <jxl/color_encoding.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "lib/extras/dec/jxl.h"
 #include "lib/extras/exif.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/byte_order.h"
@@ -71,7 +80,9 @@ std::unique_ptr<Encoder> GetAPNGEncoder() { return nullptr; }
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/base/span.h"
 #include "png.h" /* original (unpatched) libpng is ok */
+#include "zlib.h"
 
 namespace jxl {
 namespace extras {
@@ -306,6 +317,68 @@ void MaybeAddCLLi(const JxlColorEncoding& c_enc, const float intensity_target,
   png_set_unknown_chunks(png_ptr, info_ptr, &chunk, 1);
 }
 
+// Converts `num_samples` samples of `format`, with `bits_per_sample`
+// significant bits, to the big-endian 8 or 16-bit samples of PNG.
+void ConvertToPNGSamples(const uint8_t* in, const JxlPixelFormat& format,
+                         uint32_t bits_per_sample, size_t num_samples,
+                         uint8_t* out) {
+  if (format.data_type == JXL_TYPE_UINT8) {
+    if (bits_per_sample < 8) {
+      float mul = 255.0 / ((1u << bits_per_sample) - 1);
+      for (size_t i = 0; i < num_samples; ++i) {
+        out[i] = static_cast<uint8_t>(std::lroundf(in[i] * mul));
+      }
+    } else {
+      memcpy(out, in, num_samples);
+    }
+  } else if (format.data_type == JXL_TYPE_UINT16) {
+    if (bits_per_sample < 16 || format.endianness != JXL_BIG_ENDIAN) {
+      float mul = 65535.0 / ((1u << bits_per_sample) - 1);
+      const uint8_t* p_in = in;
+      uint8_t* p_out = out;
+      for (size_t i = 0; i < num_samples; ++i, p_in += 2, p_out += 2) {
+        uint32_t val = (format.endianness == JXL_BIG_ENDIAN ? LoadBE16(p_in)
+                                                            : LoadLE16(p_in));
+        StoreBE16(static_cast<uint32_t>(std::lroundf(val * mul)), p_out);
+      }
+    } else {
+      memcpy(out, in, num_samples * 2);
+    }
+  } else if (format.data_type == JXL_TYPE_FLOAT) {
+    constexpr float kMul = 65535.0;
+    const uint8_t* p_in = in;
+    uint8_t* p_out = out;
+    for (size_t i = 0; i < num_samples;
+         ++i, p_in += sizeof(float), p_out += 2) {
+      float val =
+          Clamp1(format.endianness == JXL_BIG_ENDIAN ? LoadBEFloat(p_in)
+                 : format.endianness == JXL_LITTLE_ENDIAN
+                     ? LoadLEFloat(p_in)
+                     : *reinterpret_cast<const float*>(p_in),
+                 0.f, 1.f);
+      StoreBE16(static_cast<uint32_t>(std::lroundf(val * kMul)), p_out);
+    }
+  }
+}
+
+// Sets the chunks that describe the colors of `ppf`.
+void AddColorChunks(const PackedPixelFile& ppf, png_structp png_ptr,
+                    png_infop info_ptr) {
+  if (!MaybeAddSRGB(ppf.color_encoding, png_ptr, info_ptr)) {
+    if (ppf.primary_color_representation != PackedPixelFile::kIccIsPrimary) {
+      MaybeAddCICP(ppf.color_encoding, png_ptr, info_ptr);
+    }
+    if (!ppf.icc.empty()) {
+      png_set_benign_errors(png_ptr, 1);
+      png_set_iCCP(png_ptr, info_ptr, "1", 0, ppf.icc.data(), ppf.icc.size());
+    }
+    MaybeAddCHRM(ppf.color_encoding, png_ptr, info_ptr);
+    MaybeAddGAMA(ppf.color_encoding, png_ptr, info_ptr);
+  }
+  MaybeAddCLLi(ppf.color_encoding, ppf.info.intensity_target, png_ptr,
+               info_ptr);
+}
+
 Status APNGEncoder::EncodePackedPixelFileToAPNG(
     const PackedPixelFile& ppf, ThreadPool* pool, std::vector<uint8_t>* bytes,
     bool encode_extra_channels, size_t extra_channel_index) const {
@@ -358,44 +431,7 @@ Status APNGEncoder::EncodePackedPixelFileToAPNG(
     size_t out_stride = xsize * num_channels * out_bytes_per_sample;
     size_t out_size = ysize * out_stride;
     std::vector<uint8_t> out(out_size);
-
-    if (format.data_type == JXL_TYPE_UINT8) {
-      if (bits_per_sample < 8) {
-        float mul = 255.0 / ((1u << bits_per_sample) - 1);
-        for (size_t i = 0; i < num_samples; ++i) {
-          out[i] = static_cast<uint8_t>(std::lroundf(in[i] * mul));
-        }
-      } else {
-        memcpy(out.data(), in, out_size);
-      }
-    } else if (format.data_type == JXL_TYPE_UINT16) {
-      if (bits_per_sample < 16 || format.endianness != JXL_BIG_ENDIAN) {
-        float mul = 65535.0 / ((1u << bits_per_sample) - 1);
-        const uint8_t* p_in = in;
-        uint8_t* p_out = out.data();
-        for (size_t i = 0; i < num_samples; ++i, p_in += 2, p_out += 2) {
-          uint32_t val = (format.endianness == JXL_BIG_ENDIAN ? LoadBE16(p_in)
-                                                              : LoadLE16(p_in));
-          StoreBE16(static_cast<uint32_t>(std::lroundf(val * mul)), p_out);
-        }
-      } else {
-        memcpy(out.data(), in, out_size);
-      }
-    } else if (format.data_type == JXL_TYPE_FLOAT) {
-      constexpr float kMul = 65535.0;
-      const uint8_t* p_in = in;
-      uint8_t* p_out = out.data();
-      for (size_t i = 0; i < num_samples;
-           ++i, p_in += sizeof(float), p_out += 2) {
-        float val =
-            Clamp1(format.endianness == JXL_BIG_ENDIAN ? LoadBEFloat(p_in)
-                   : format.endianness == JXL_LITTLE_ENDIAN
-                       ? LoadLEFloat(p_in)
-                       : *reinterpret_cast<const float*>(p_in),
-                   0.f, 1.f);
-        StoreBE16(static_cast<uint32_t>(std::lroundf(val * kMul)), p_out);
-      }
-    }
+    ConvertToPNGSamples(in, format, bits_per_sample, num_samples, out.data());
     png_structp png_ptr;
     png_infop info_ptr;
 
@@ -422,21 +458,7 @@ Status APNGEncoder::EncodePackedPixelFileToAPNG(
                  PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
                  PNG_FILTER_TYPE_BASE);
     if (count == 0 && !encode_extra_channels) {
-      if (!MaybeAddSRGB(ppf.color_encoding, png_ptr, info_ptr)) {
-        if (ppf.primary_color_representation !=
-            PackedPixelFile::kIccIsPrimary) {
-          MaybeAddCICP(ppf.color_encoding, png_ptr, info_ptr);
-        }
-        if (!ppf.icc.empty()) {
-          png_set_benign_errors(png_ptr, 1);
-          png_set_iCCP(png_ptr, info_ptr, "1", 0, ppf.icc.data(),
-                       ppf.icc.size());
-        }
-        MaybeAddCHRM(ppf.color_encoding, png_ptr, info_ptr);
-        MaybeAddGAMA(ppf.color_encoding, png_ptr, info_ptr);
-      }
-      MaybeAddCLLi(ppf.color_encoding, ppf.info.intensity_target, png_ptr,
-                   info_ptr);
+      AddColorChunks(ppf, png_ptr, info_ptr);
 
       std::vector<std::string> textstrings;
       JXL_RETURN_IF_ERROR(BlobsWriterPNG::Encode(ppf.metadata, &textstrings));
@@ -520,12 +542,253 @@ Status APNGEncoder::EncodePackedPixelFileToAPNG(
   return true;
 }
 
+class PNGStreamWriter : public PixelSink {
+ public:
+  PNGStreamWriter(PNGWriteFunc write, size_t rows_per_block)
+      : write_(std::move(write)),
+        rows_per_block_(std::max<size_t>(rows_per_block, 1)) {}
+
+  Status StartFrame(const PackedPixelFile& ppf,
+                    const JxlPixelFormat& format) override {
+    if (started_) {
+      return JXL_FAILURE("PNG stream writer only writes still images");
+    }
+    started_ = true;
+    JXL_RETURN_IF_ERROR(Encoder::VerifyBasicInfo(ppf.info));
+    if (format.data_type != JXL_TYPE_UINT8 &&
+        format.data_type != JXL_TYPE_UINT16 &&
+        format.data_type != JXL_TYPE_FLOAT) {
+      return JXL_FAILURE("Unsupported data type for PNG");
+    }
+    format_ = format;
+    bits_per_sample_ = ppf.info.bits_per_sample;
+    xsize_ = ppf.info.xsize;
+    ysize_ = ppf.info.ysize;
+    sample_size_ = format.data_type == JXL_TYPE_UINT8 ? 1 : 2;
+    // Each row starts with its filter type.
+    row_size_ = 1 + xsize_ * format.num_channels * sample_size_;
+    // The blocks are compressed in one deflate call.
+    constexpr size_t kMaxBlockSize = size_t{1} << 30;
+    if (row_size_ > kMaxBlockSize) return JXL_FAILURE("Image too wide");
+    rows_per_block_ = std::min(rows_per_block_, kMaxBlockSize / row_size_);
+    blocks_.resize(DivCeil(ysize_, rows_per_block_));
+    for (size_t b = 0; b < blocks_.size(); ++b) {
+      blocks_[b].pixels_left = BlockRows(b) * xsize_;
+    }
+    return WriteHeader(ppf);
+  }
+
+  void SetPixels(size_t x, size_t y, size_t num_pixels,
+                 const void* pixels) override {
+    const size_t b = y / rows_per_block_;
+    Block& block = blocks_[b];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (block.rows.empty()) block.rows.resize(BlockRows(b) * row_size_);
+    }
+    const size_t num_channels = format_.num_channels;
+    uint8_t* out = block.rows.data() + (y % rows_per_block_) * row_size_ + 1 +
+                   x * num_channels * sample_size_;
+    ConvertToPNGSamples(reinterpret_cast<const uint8_t*>(pixels), format_,
+                        bits_per_sample_, num_pixels * num_channels, out);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      block.pixels_left -= num_pixels;
+      if (block.pixels_left != 0) return;
+    }
+    // The thread that completes a block compresses it, so that the threads of
+    // the decoder compress different blocks at the same time.
+    Status status = CompressBlock(b);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status) {
+      status_ = status;
+      return;
+    }
+    block.compressed_done = true;
+    while (status_ && next_block_ < blocks_.size() &&
+           blocks_[next_block_].compressed_done) {
+      status_ = WriteBlock(next_block_++);
+    }
+  }
+
+  Status Finish(const PackedPixelFile& ppf) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    JXL_RETURN_IF_ERROR(status_);
+    if (!started_ || next_block_ != blocks_.size()) {
+      return JXL_FAILURE("Not all pixels were given");
+    }
+    uint8_t adler[4];
+    StoreBE32(adler_, adler);
+    JXL_RETURN_IF_ERROR(WriteChunk("IDAT", {Bytes(adler, sizeof(adler))}));
+    // The metadata goes after the pixels, since the decoder may only get the
+    // metadata boxes after the codestream.
+    std::vector<std::string> textstrings;
+    JXL_RETURN_IF_ERROR(BlobsWriterPNG::Encode(ppf.metadata, &textstrings));
+    for (size_t kk = 0; kk + 1 < textstrings.size(); kk += 2) {
+      const std::string& text = textstrings[kk + 1];
+      uLongf size = compressBound(text.size());
+      std::vector<uint8_t> compressed(size);
+      if (compress2(compressed.data(), &size,
+                    reinterpret_cast<const Bytef*>(text.data()), text.size(),
+                    Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return JXL_FAILURE("Failed to compress PNG text");
+      }
+      // Keyword, its terminator and the compression method.
+      std::vector<uint8_t> key(textstrings[kk].begin(), textstrings[kk].end());
+      key.resize(key.size() + 2, 0);
+      JXL_RETURN_IF_ERROR(
+          WriteChunk("zTXt", {Bytes(key), Bytes(compressed.data(), size)}));
+    }
+    return WriteChunk("IEND", {});
+  }
+
+ private:
+  struct Block {
+    // Filtered rows.
+    std::vector<uint8_t> rows;
+    size_t pixels_left = 0;
+    // Raw deflate data of the rows, and their Adler-32 checksum.
+    std::vector<uint8_t> compressed;
+    size_t raw_size = 0;
+    uLong adler = 0;
+    bool compressed_done = false;
+  };
+
+  size_t BlockRows(size_t b) const {
+    return std::min(rows_per_block_, ysize_ - b * rows_per_block_);
+  }
+
+  static void PngWriteCallback(png_structp png_ptr, png_bytep data,
+                               png_size_t length) {
+    PNGStreamWriter* self =
+        static_cast<PNGStreamWriter*>(png_get_io_ptr(png_ptr));
+    if (self->status_) self->status_ = self->write_(data, length);
+  }
+
+  // Writes the signature and the chunks before the pixels with libpng.
+  Status WriteHeader(const PackedPixelFile& ppf) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                                  nullptr, nullptr, nullptr);
+    if (!png_ptr) return JXL_FAILURE("Could not init png encoder");
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_write_struct(&png_ptr, nullptr);
+      return JXL_FAILURE("Could not init png info struct");
+    }
+    png_set_write_fn(png_ptr, this, PngWriteCallback, nullptr);
+    png_set_flush(png_ptr, 0);
+    png_byte color_type =
+        format_.num_channels < 3 ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+    if (format_.num_channels == 2 || format_.num_channels == 4) {
+      color_type |= PNG_COLOR_MASK_ALPHA;
+    }
+    png_set_IHDR(png_ptr, info_ptr, xsize_, ysize_, sample_size_ * 8,
+                 color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+                 PNG_FILTER_TYPE_BASE);
+    AddColorChunks(ppf, png_ptr, info_ptr);
+    png_write_info(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return status_;
+  }
+
+  // The first row of each block is not filtered, so that the blocks do not
+  // depend on each other; the others use the Up filter.
+  Status CompressBlock(size_t b) {
+    Block& block = blocks_[b];
+    uint8_t* rows = block.rows.data();
+    for (size_t y = BlockRows(b); y-- > 1;) {
+      uint8_t* row = rows + y * row_size_;
+      const uint8_t* prev = row - row_size_;
+      row[0] = 2;
+      for (size_t i = 1; i < row_size_; ++i) row[i] -= prev[i];
+    }
+    rows[0] = 0;
+    block.raw_size = block.rows.size();
+    block.adler = adler32(adler32(0, Z_NULL, 0), rows, block.raw_size);
+    // Blocks end on a byte boundary with a sync flush, so that their raw
+    // deflate data can be concatenated; the last one ends the stream.
+    const bool last = b + 1 == blocks_.size();
+    z_stream strm = {};
+    if (deflateInit2(&strm, /*level=*/1, Z_DEFLATED, /*windowBits=*/-15,
+                     /*memLevel=*/8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return JXL_FAILURE("deflateInit2 failed");
+    }
+    // Room for the empty stored block of the sync flush.
+    block.compressed.resize(deflateBound(&strm, block.raw_size) + 8);
+    strm.next_in = rows;
+    strm.avail_in = block.raw_size;
+    strm.next_out = block.compressed.data();
+    strm.avail_out = block.compressed.size();
+    const int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool ok = last ? ret == Z_STREAM_END
+                         : ret == Z_OK && strm.avail_in == 0;
+    block.compressed.resize(strm.total_out);
+    deflateEnd(&strm);
+    std::vector<uint8_t>().swap(block.rows);
+    if (!ok) return JXL_FAILURE("deflate failed");
+    return true;
+  }
+
+  // Called in the order of the blocks, with the mutex held.
+  Status WriteBlock(size_t b) {
+    Block& block = blocks_[b];
+    // The zlib header, for a window of 32 KiB and the fastest level.
+    static const uint8_t kZlibHeader[2] = {0x78, 0x01};
+    const Bytes header(kZlibHeader, b == 0 ? sizeof(kZlibHeader) : 0);
+    JXL_RETURN_IF_ERROR(WriteChunk("IDAT", {header, Bytes(block.compressed)}));
+    adler_ = b == 0 ? block.adler
+                    : adler32_combine(adler_, block.adler, block.raw_size);
+    std::vector<uint8_t>().swap(block.compressed);
+    return true;
+  }
+
+  Status WriteChunk(const char* type, const std::vector<Bytes>& parts) {
+    size_t size = 0;
+    for (const Bytes& part : parts) size += part.size();
+    JXL_ENSURE(size < (size_t{1} << 31));
+    uint8_t header[8];
+    StoreBE32(size, header);
+    memcpy(header + 4, type, 4);
+    JXL_RETURN_IF_ERROR(write_(header, sizeof(header)));
+    uLong crc = crc32(0, header + 4, 4);
+    for (const Bytes& part : parts) {
+      if (part.empty()) continue;
+      crc = crc32(crc, part.data(), part.size());
+      JXL_RETURN_IF_ERROR(write_(part.data(), part.size()));
+    }
+    uint8_t trailer[4];
+    StoreBE32(crc, trailer);
+    return write_(trailer, sizeof(trailer));
+  }
+
+  PNGWriteFunc write_;
+  size_t rows_per_block_;
+  bool started_ = false;
+  JxlPixelFormat format_ = {};
+  uint32_t bits_per_sample_ = 0;
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  size_t sample_size_ = 0;
+  size_t row_size_ = 0;
+
+  std::mutex mutex_;
+  std::vector<Block> blocks_;
+  size_t next_block_ = 0;
+  uLong adler_ = 0;
+  Status status_ = true;
+};
+
 }  // namespace
 
 std::unique_ptr<Encoder> GetAPNGEncoder() {
   return jxl::make_unique<APNGEncoder>();
 }
 
+std::unique_ptr<PixelSink> GetPNGStreamWriter(PNGWriteFunc write,
+                                              size_t rows_per_block) {
+  return jxl::make_unique<PNGStreamWriter>(std::move(write), rows_per_block);
+}
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -6,17 +6,34 @@
 #ifndef LIB_EXTRAS_ENC_APNG_H_
 #define LIB_EXTRAS_ENC_APNG_H_
 
-// Encodes APNG images in memory.
+// Encodes APNG images in memory, or still PNG images while they are decoded.
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
 #include <memory>
 
+#include "lib/extras/dec/jxl.h"
 #include "lib/extras/enc/encode.h"
+#include "lib/jxl/base/status.h"
 
 namespace jxl {
 namespace extras {
 
 std::unique_ptr<Encoder> GetAPNGEncoder();
 
+using PNGWriteFunc = std::function<Status(const uint8_t* data, size_t size)>;
+
+// Returns a sink that writes a still PNG to `write` while the decoder gives it
+// the pixels, in any order: the rows are filtered and deflated in blocks of
+// `rows_per_block` rows, by the thread that completes the block, so that
+// blocks are compressed in parallel when the decoder runs on several threads,
+// and each block is written as soon as the blocks before it are. Only the
+// color channels and interleaved alpha are written. Returns nullptr if PNG
+// support is not compiled in.
+std::unique_ptr<PixelSink> GetPNGStreamWriter(PNGWriteFunc write,
+                                              size_t rows_per_block = 64);
+
 }  // namespace extras
 }  // namespace jxl
 
@@ -411,6 +411,9 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     cinfo.client_data = static_cast<void*>(&env);
     jpegli_create_compress(&cinfo);
     jpegli_mem_dest(&cinfo, &output_buffer, &output_size);
+    if (pool != nullptr) {
+      jpegli_set_parallel_runner(&cinfo, pool->runner(), pool->runner_opaque());
+    }
     const JxlBasicInfo& info = ppf.info;
     cinfo.image_width = info.xsize;
     cinfo.image_height = info.ysize;
@@ -461,6 +464,8 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
     }
     jpegli_enable_adaptive_quantization(
         &cinfo, TO_JXL_BOOL(jpeg_settings.use_adaptive_quantization));
+    jpegli_enable_fast_adaptive_quantization(
+        &cinfo, TO_JXL_BOOL(jpeg_settings.fast_adaptive_quantization));
     if (jpeg_settings.psnr_target > 0.0) {
       jpegli_set_psnr(&cinfo, jpeg_settings.psnr_target,
                       jpeg_settings.search_tolerance,
@@ -472,6 +477,8 @@ Status EncodeJpeg(const PackedPixelFile& ppf, const JpegSettings& jpeg_settings,
       jpegli_set_distance(&cinfo, jpeg_settings.distance, TRUE);
     }
     jpegli_set_progressive_level(&cinfo, jpeg_settings.progressive_level);
+    jpegli_enable_scan_script_search(
+        &cinfo, TO_JXL_BOOL(jpeg_settings.search_scan_script));
     cinfo.optimize_coding = TO_JXL_BOOL(jpeg_settings.optimize_coding);
     if (!jpeg_settings.app_data.empty()) {
       // Make sure jpegli_start_compress() does not write any APP markers.
@@ -27,8 +27,10 @@ struct JpegSettings {
   float quality = 0.0f;
   float distance = 1.f;
   bool use_adaptive_quantization = true;
+  bool fast_adaptive_quantization = false;
   bool use_std_quant_tables = false;
   int progressive_level = 2;
+  bool search_scan_script = false;
   bool optimize_coding = true;
   std::string chroma_subsampling;
   int libjpeg_quality = 0;
@@ -8,6 +8,7 @@
 #include <jxl/codestream_header.h>
 #include <jxl/encode.h>
 #include <jxl/encode_cxx.h>
+#include <jxl/resizable_parallel_runner.h>
 #include <jxl/types.h>
 
 #include <algorithm>
@@ -15,10 +16,13 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <utility>
 #include <vector>
 
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/exif.h"
+#include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/status.h"
 
 namespace jxl {
 namespace extras {
@@ -95,6 +99,142 @@ bool SetupFrame(JxlEncoder* enc, JxlEncoderFrameSettings* settings,
   return true;
 }
 
+namespace {
+
+// Returns whether the frames of `ppf` can be encoded as the rects that changed
+// since the previous frame: they must make an animation of frames that cover
+// the whole canvas, replace it, and are not kept as references for others.
+bool CanCropUnchangedRegions(const PackedPixelFile& ppf) {
+  if (!ppf.info.have_animation || ppf.frames.size() < 2) return false;
+  const PackedFrame& first = ppf.frames[0];
+  for (const PackedFrame& frame : ppf.frames) {
+    const JxlLayerInfo& layer_info = frame.frame_info.layer_info;
+    if (layer_info.have_crop || layer_info.save_as_reference != 0 ||
+        layer_info.blend_info.blendmode != JXL_BLEND_REPLACE ||
+        frame.color.xsize != ppf.info.xsize ||
+        frame.color.ysize != ppf.info.ysize ||
+        frame.color.stride != first.color.stride ||
+        frame.color.pixel_stride() != first.color.pixel_stride() ||
+        frame.extra_channels.size() != first.extra_channels.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < frame.extra_channels.size(); ++i) {
+      if (frame.extra_channels[i].stride != first.extra_channels[i].stride ||
+          frame.extra_channels[i].pixel_stride() !=
+              first.extra_channels[i].pixel_stride()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Rect of pixels, with exclusive x1 and y1.
+struct ChangedRect {
+  size_t x0;
+  size_t y0;
+  size_t x1;
+  size_t y1;
+};
+
+// Extends `rect` to the pixels in which `image` differs from `prev`. Whole
+// rows are compared first, so that only the rows that changed are scanned
+// for the first and last pixels that did.
+void ExtendChangedRect(const PackedImage& prev, const PackedImage& image,
+                       ChangedRect* rect) {
+  const size_t pixel_size = image.pixel_stride();
+  const size_t row_size = image.xsize * pixel_size;
+  const uint8_t* pixels_prev = reinterpret_cast<const uint8_t*>(prev.pixels());
+  const uint8_t* pixels = reinterpret_cast<const uint8_t*>(image.pixels());
+  for (size_t y = 0; y < image.ysize; ++y) {
+    const uint8_t* row_prev = pixels_prev + y * prev.stride;
+    const uint8_t* row = pixels + y * image.stride;
+    if (memcmp(row_prev, row, row_size) == 0) continue;
+    rect->y0 = std::min(rect->y0, y);
+    rect->y1 = y + 1;
+    size_t x0 = 0;
+    while (x0 < rect->x0 && memcmp(row_prev + x0 * pixel_size,
+                                   row + x0 * pixel_size, pixel_size) == 0) {
+      ++x0;
+    }
+    rect->x0 = x0;
+    size_t x1 = image.xsize;
+    while (x1 > rect->x1 &&
+           memcmp(row_prev + (x1 - 1) * pixel_size,
+                  row + (x1 - 1) * pixel_size, pixel_size) == 0) {
+      --x1;
+    }
+    rect->x1 = x1;
+  }
+}
+
+// Returns the rect in which `frame` differs from `prev`, which is a single
+// pixel if the frames are the same.
+ChangedRect FindChangedRect(const PackedFrame& prev, const PackedFrame& frame) {
+  ChangedRect rect = {frame.color.xsize, frame.color.ysize, 0, 0};
+  ExtendChangedRect(prev.color, frame.color, &rect);
+  for (size_t i = 0; i < frame.extra_channels.size(); ++i) {
+    ExtendChangedRect(prev.extra_channels[i], frame.extra_channels[i], &rect);
+  }
+  if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0) return {0, 0, 1, 1};
+  return rect;
+}
+
+StatusOr<PackedImage> CropImage(const PackedImage& image,
+                                const ChangedRect& rect) {
+  JXL_ASSIGN_OR_RETURN(PackedImage cropped,
+                       PackedImage::Create(rect.x1 - rect.x0,
+                                           rect.y1 - rect.y0, image.format));
+  const size_t pixel_size = image.pixel_stride();
+  for (size_t y = 0; y < cropped.ysize; ++y) {
+    memcpy(reinterpret_cast<uint8_t*>(cropped.pixels()) + y * cropped.stride,
+           reinterpret_cast<const uint8_t*>(image.pixels()) +
+               (rect.y0 + y) * image.stride + rect.x0 * pixel_size,
+           cropped.xsize * pixel_size);
+  }
+  return cropped;
+}
+
+StatusOr<PackedFrame> CropFrame(const PackedFrame& frame,
+                                const ChangedRect& rect) {
+  JXL_ASSIGN_OR_RETURN(PackedImage color, CropImage(frame.color, rect));
+  PackedFrame cropped(std::move(color));
+  cropped.frame_info = frame.frame_info;
+  cropped.name = frame.name;
+  for (const PackedImage& ec : frame.extra_channels) {
+    JXL_ASSIGN_OR_RETURN(PackedImage cropped_ec, CropImage(ec, rect));
+    cropped.extra_channels.emplace_back(std::move(cropped_ec));
+  }
+  return cropped;
+}
+
+bool AddPackedFrame(JxlEncoderFrameSettings* settings, const PackedFrame& frame,
+                    size_t num_interleaved_alpha) {
+  const PackedImage& pimage = frame.color;
+  JxlPixelFormat ppixelformat = pimage.format;
+  if (JXL_ENC_SUCCESS != JxlEncoderAddImageFrame(settings, &ppixelformat,
+                                                 pimage.pixels(),
+                                                 pimage.pixels_size)) {
+    fprintf(stderr, "JxlEncoderAddImageFrame() failed.\n");
+    return false;
+  }
+  // Only set extra channel buffer if it is provided non-interleaved.
+  for (size_t i = 0; i < frame.extra_channels.size(); ++i) {
+    if (JXL_ENC_SUCCESS !=
+        JxlEncoderSetExtraChannelBuffer(settings, &ppixelformat,
+                                        frame.extra_channels[i].pixels(),
+                                        frame.extra_channels[i].stride *
+                                            frame.extra_channels[i].ysize,
+                                        num_interleaved_alpha + i)) {
+      fprintf(stderr, "JxlEncoderSetExtraChannelBuffer() failed.\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
 bool ReadCompressedOutput(JxlEncoder* enc, std::vector<uint8_t>* compressed) {
   compressed->clear();
   compressed->resize(4096);
@@ -134,6 +274,28 @@ bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
     fprintf(stderr, "JxlEncoderSetParallelRunner failed\n");
     return false;
   }
+  if (params.runner_opaque != nullptr &&
+      params.runner == JxlResizableParallelRunner) {
+    bool modular = params.distance == 0.0f;
+    uint32_t effort = 7;
+    for (const JXLOption& option : params.options) {
+      if (option.is_float || option.frame_index != 0) continue;
+      if (option.id == JXL_ENC_FRAME_SETTING_MODULAR && option.ival >= 0) {
+        modular = option.ival == 1;
+      } else if (option.id == JXL_ENC_FRAME_SETTING_EFFORT) {
+        effort = static_cast<uint32_t>(option.ival);
+      }
+    }
+    JxlResizableParallelRunnerSetWorkload(params.runner_opaque, ppf.info.xsize,
+                                          ppf.info.ysize, modular, effort);
+  }
+
+  if (params.max_frames_in_flight > 1 &&
+      JXL_ENC_SUCCESS !=
+          JxlEncoderSetMaxFramesInFlight(enc, params.max_frames_in_flight)) {
+    fprintf(stderr, "JxlEncoderSetMaxFramesInFlight failed\n");
+    return false;
+  }
 
   if (params.HasOutputProcessor() &&
       JXL_ENC_SUCCESS !=
@@ -326,33 +488,54 @@ bool EncodeImageJXL(const JXLCompressParams& params, const PackedPixelFile& ppf,
       JxlEncoderCloseBoxes(enc);
     }
 
+    // Each frame but the last is kept in reference slot 1, over which the
+    // next frame replaces the rect that changed.
+    const bool crop_unchanged_regions =
+        params.crop_unchanged_regions && CanCropUnchangedRegions(ppf);
     for (size_t num_frame = 0; num_frame < ppf.frames.size(); ++num_frame) {
       const jxl::extras::PackedFrame& pframe = ppf.frames[num_frame];
-      const jxl::extras::PackedImage& pimage = pframe.color;
-      JxlPixelFormat ppixelformat = pimage.format;
       size_t num_interleaved_alpha =
-          (ppixelformat.num_channels - ppf.info.num_color_channels);
-      if (!SetupFrame(enc, settings, pframe.frame_info, params, ppf, num_frame,
-                      num_alpha_channels, num_interleaved_alpha, option_idx)) {
-        return false;
+          (pframe.color.format.num_channels - ppf.info.num_color_channels);
+      JxlFrameHeader frame_header = pframe.frame_info;
+      ChangedRect rect = {0, 0, pframe.color.xsize, pframe.color.ysize};
+      if (crop_unchanged_regions) {
+        if (num_frame + 1 < ppf.frames.size()) {
+          frame_header.layer_info.save_as_reference = 1;
+        }
+        if (num_frame > 0) {
+          rect = FindChangedRect(ppf.frames[num_frame - 1], pframe);
+        }
       }
-      if (JXL_ENC_SUCCESS != JxlEncoderAddImageFrame(settings, &ppixelformat,
-                                                     pimage.pixels(),
-                                                     pimage.pixels_size)) {
-        fprintf(stderr, "JxlEncoderAddImageFrame() failed.\n");
+      const bool cropped = rect.x0 != 0 || rect.y0 != 0 ||
+                           rect.x1 != pframe.color.xsize ||
+                           rect.y1 != pframe.color.ysize;
+      if (cropped) {
+        JxlLayerInfo& layer_info = frame_header.layer_info;
+        layer_info.have_crop = JXL_TRUE;
+        layer_info.crop_x0 = static_cast<int32_t>(rect.x0);
+        layer_info.crop_y0 = static_cast<int32_t>(rect.y0);
+        layer_info.xsize = rect.x1 - rect.x0;
+        layer_info.ysize = rect.y1 - rect.y0;
+        layer_info.blend_info.source = 1;
+      }
+      if (!SetupFrame(enc, settings, frame_header, params, ppf, num_frame,
+                      num_alpha_channels, num_interleaved_alpha, option_idx)) {
         return false;
       }
-      // Only set extra channel buffer if it is provided non-interleaved.
-      for (size_t i = 0; i < pframe.extra_channels.size(); ++i) {
-        if (JXL_ENC_SUCCESS !=
-            JxlEncoderSetExtraChannelBuffer(settings, &ppixelformat,
-                                            pframe.extra_channels[i].pixels(),
-                                            pframe.extra_channels[i].stride *
-                                                pframe.extra_channels[i].ysize,
-                                            num_interleaved_alpha + i)) {
-          fprintf(stderr, "JxlEncoderSetExtraChannelBuffer() failed.\n");
+      if (!cropped) {
+        if (!AddPackedFrame(settings, pframe, num_interleaved_alpha)) {
           return false;
         }
+        continue;
+      }
+      StatusOr<PackedFrame> cropped_frame = CropFrame(pframe, rect);
+      if (!cropped_frame.ok()) {
+        fprintf(stderr, "Failed to crop frame %" PRIuS ".\n", num_frame);
+        return false;
+      }
+      if (!AddPackedFrame(settings, std::move(cropped_frame).value_(),
+                          num_interleaved_alpha)) {
+        return false;
       }
     }
     for (size_t fi = 0; fi < ppf.chunked_frames.size(); ++fi) {
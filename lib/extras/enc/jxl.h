@@ -55,6 +55,10 @@ struct JXLCompressParams {
   // Whether to create brob boxes.
   bool compress_boxes = true;
 
+  // Whether to encode each frame of an animation of full frames as only the
+  // rect in which it differs from the previous frame, blended over it.
+  bool crop_unchanged_regions = false;
+
   // Upper bound on the intensity level present in the image in nits (zero means
   // that the library chooses a default).
   float intensity_target = 0;
@@ -69,6 +73,9 @@ struct JXLCompressParams {
   // If runner_opaque is set, the encoder uses this parallel runner.
   JxlParallelRunner runner = JxlThreadParallelRunner;
   void* runner_opaque = nullptr;
+  // Number of frames that the encoder may encode concurrently, see
+  // JxlEncoderSetMaxFramesInFlight. Only has an effect with a runner.
+  size_t max_frames_in_flight = 1;
 
   // If memory_manager is set, encoder uses it.
   JxlMemoryManager* memory_manager = nullptr;
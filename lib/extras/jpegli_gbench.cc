@@ -0,0 +1,101 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#if JPEGXL_ENABLE_JPEGLI
+
+#include <cstddef>
+#include <cstdint>
+#include <hwy/targets.h>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/jpegli.h"
+#include "lib/extras/enc/jpegli.h"
+#include "lib/extras/packed_image.h"
+#include "lib/jxl/base/span.h"
+#include "tools/file_io.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+Status ReadFlower(extras::PackedPixelFile* ppf) {
+  std::vector<uint8_t> png;
+  JXL_RETURN_IF_ERROR(jpegxl::tools::ReadFile(
+      std::string(TEST_DATA_PATH "/jxl/flower/flower.png"), &png));
+  return extras::DecodeBytes(Bytes(png), extras::ColorHints(), ppf);
+}
+
+// Encodes flower.png from the test data with jpegli at distance 1, with the
+// code of `target`. Items are pixels.
+void BM_JpegliEncode(benchmark::State& state, int64_t target) {
+  extras::PackedPixelFile ppf;
+  BM_CHECK(ReadFlower(&ppf));
+  extras::JpegSettings settings;
+  hwy::SetSupportedTargetsForTest(target);
+  for (auto _ : state) {
+    (void)_;
+    std::vector<uint8_t> compressed;
+    BM_CHECK(extras::EncodeJpeg(ppf, settings, /*pool=*/nullptr, &compressed));
+    benchmark::DoNotOptimize(compressed.size());
+  }
+  hwy::SetSupportedTargetsForTest(0);
+  state.SetItemsProcessed(ppf.info.xsize * ppf.info.ysize *
+                          state.iterations());
+}
+
+// Decodes flower.png, encoded with jpegli at distance 1, to 8-bit RGB with the
+// code of `target`. Items are pixels.
+void BM_JpegliDecode(benchmark::State& state, int64_t target) {
+  extras::PackedPixelFile ppf;
+  BM_CHECK(ReadFlower(&ppf));
+  std::vector<uint8_t> compressed;
+  BM_CHECK(extras::EncodeJpeg(ppf, extras::JpegSettings(), /*pool=*/nullptr,
+                              &compressed));
+  extras::JpegDecompressParams dparams;
+  hwy::SetSupportedTargetsForTest(target);
+  for (auto _ : state) {
+    (void)_;
+    extras::PackedPixelFile decoded;
+    BM_CHECK(extras::DecodeJpeg(compressed, dparams, /*pool=*/nullptr,
+                                &decoded));
+    benchmark::DoNotOptimize(decoded.frames.size());
+  }
+  hwy::SetSupportedTargetsForTest(0);
+  state.SetItemsProcessed(ppf.info.xsize * ppf.info.ysize *
+                          state.iterations());
+}
+
+}  // namespace
+}  // namespace jxl
+
+#endif  // JPEGXL_ENABLE_JPEGLI
+
+// Registers the jpegli benchmarks, once for each SIMD target, as
+// "<name>/<target>". Registers nothing in builds without jpegli.
+void RegisterJpegliBenchmarks();
+
+void RegisterJpegliBenchmarks() {
+#if JPEGXL_ENABLE_JPEGLI
+  for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+    const std::string suffix = std::string("/") + hwy::TargetName(target);
+    benchmark::RegisterBenchmark(("JpegliEncode" + suffix).c_str(),
+                                 jxl::BM_JpegliEncode, target);
+    benchmark::RegisterBenchmark(("JpegliDecode" + suffix).c_str(),
+                                 jxl::BM_JpegliDecode, target);
+  }
+#endif  // JPEGXL_ENABLE_JPEGLI
+}
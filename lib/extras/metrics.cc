@@ -8,14 +8,24 @@
 #include <jxl/cms_interface.h>
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <limits>
+#include <utility>
+#include <vector>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
+#include "lib/jxl/enc_butteraugli_comparator.h"
+#include "lib/jxl/enc_comparator.h"
+#include "lib/jxl/enc_image_bundle.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_metadata.h"
 #include "lib/jxl/image_ops.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -26,6 +36,7 @@
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/cms/transfer_functions-inl.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/memory_manager_internal.h"
 HWY_BEFORE_NAMESPACE();
@@ -143,6 +154,34 @@ StatusOr<double> ComputeDistanceP(const ImageF& distmap,
   }
 }
 
+constexpr float kYuvMatrix[3][3] = {{0.299, 0.587, 0.114},
+                                    {-0.14713, -0.28886, 0.436},
+                                    {0.615, -0.51499, -0.10001}};
+
+// Adds the squared differences of the YUV channels of two rows of sRGB pixels
+// to sum_of_squares.
+void AddSquaredYuvDiffs(const float* JXL_RESTRICT const row1[3],
+                        const float* JXL_RESTRICT const row2[3],
+                        size_t xsize, double sum_of_squares[3]) {
+  // TODO(veluca): SIMD.
+  for (size_t x = 0; x < xsize; ++x) {
+    float cdiff[3] = {};
+    // YUV conversion is linear, so we can run it on the difference.
+    for (size_t j = 0; j < 3; j++) {
+      cdiff[j] = row1[j][x] - row2[j][x];
+    }
+    float yuvdiff[3] = {};
+    for (size_t j = 0; j < 3; j++) {
+      for (size_t k = 0; k < 3; k++) {
+        yuvdiff[j] += kYuvMatrix[j][k] * cdiff[k];
+      }
+    }
+    for (size_t j = 0; j < 3; j++) {
+      sum_of_squares[j] += yuvdiff[j] * yuvdiff[j];
+    }
+  }
+}
+
 void ComputeSumOfSquares(const ImageBundle& ib1, const ImageBundle& ib2,
                          const JxlCmsInterface& cms, double sum_of_squares[3]) {
   sum_of_squares[0] = sum_of_squares[1] = sum_of_squares[2] =
@@ -167,10 +206,6 @@ void ComputeSumOfSquares(const ImageBundle& ib1, const ImageBundle& ib2,
 
   sum_of_squares[0] = sum_of_squares[1] = sum_of_squares[2] = 0.0;
 
-  // TODO(veluca): SIMD.
-  float yuvmatrix[3][3] = {{0.299, 0.587, 0.114},
-                           {-0.14713, -0.28886, 0.436},
-                           {0.615, -0.51499, -0.10001}};
   for (size_t y = 0; y < srgb1->ysize(); ++y) {
     const float* JXL_RESTRICT row1[3];
     const float* JXL_RESTRICT row2[3];
@@ -178,25 +213,79 @@ void ComputeSumOfSquares(const ImageBundle& ib1, const ImageBundle& ib2,
       row1[j] = srgb1->ConstPlaneRow(j, y);
       row2[j] = srgb2->ConstPlaneRow(j, y);
     }
-    for (size_t x = 0; x < srgb1->xsize(); ++x) {
-      float cdiff[3] = {};
-      // YUV conversion is linear, so we can run it on the difference.
-      for (size_t j = 0; j < 3; j++) {
-        cdiff[j] = row1[j][x] - row2[j][x];
-      }
-      float yuvdiff[3] = {};
-      for (size_t j = 0; j < 3; j++) {
-        for (size_t k = 0; k < 3; k++) {
-          yuvdiff[j] += yuvmatrix[j][k] * cdiff[k];
-        }
-      }
-      for (size_t j = 0; j < 3; j++) {
-        sum_of_squares[j] += yuvdiff[j] * yuvdiff[j];
-      }
+    AddSquaredYuvDiffs(row1, row2, srgb1->xsize(), sum_of_squares);
+  }
+}
+
+// Converts rows of linear sRGB pixels to sRGB. The rows must be padded to a
+// multiple of the vector size.
+void SrgbRowsFromLinear(const float* JXL_RESTRICT const linear[3],
+                        size_t xsize, float* JXL_RESTRICT const srgb[3]) {
+  const HWY_FULL(float) d;
+  const TF_SRGB tf_srgb;
+  for (size_t c = 0; c < 3; ++c) {
+    for (size_t x = 0; x < xsize; x += Lanes(d)) {
+      const auto display = Load(d, linear[c] + x);
+      Store(tf_srgb.EncodedFromDisplay(d, display), d, srgb[c] + x);
     }
   }
 }
 
+Status SrgbFromLinear(const Image3F& linear, ThreadPool* pool, Image3F* srgb) {
+  const auto convert_row = [&](const uint32_t y, size_t /*thread*/) -> Status {
+    const float* JXL_RESTRICT row_in[3];
+    float* JXL_RESTRICT row_out[3];
+    for (size_t c = 0; c < 3; ++c) {
+      row_in[c] = linear.ConstPlaneRow(c, y);
+      row_out[c] = srgb->PlaneRow(c, y);
+    }
+    SrgbRowsFromLinear(row_in, linear.xsize(), row_out);
+    return true;
+  };
+  return RunOnPool(pool, 0, linear.ysize(), ThreadPool::NoInit, convert_row,
+                   "SrgbFromLinear");
+}
+
+// Same as ComputeSumOfSquares of the sRGB image `srgb` and the linear sRGB
+// image `linear`, which is converted to sRGB one row at a time.
+Status SumOfSquaresFromLinear(const Image3F& srgb, const Image3F& linear,
+                              ThreadPool* pool, double sum_of_squares[3]) {
+  JxlMemoryManager* memory_manager = linear.memory_manager();
+  const size_t xsize = linear.xsize();
+  const size_t ysize = linear.ysize();
+  // Sums of every row, added in order for a result independent of the
+  // threads.
+  std::vector<double> row_sums(3 * ysize);
+  Image3F encoded;
+  const auto init = [&](size_t num_threads) -> Status {
+    JXL_ASSIGN_OR_RETURN(encoded,
+                         Image3F::Create(memory_manager, xsize, num_threads));
+    return true;
+  };
+  const auto process_row = [&](const uint32_t y, size_t thread) -> Status {
+    const float* JXL_RESTRICT row_in[3];
+    float* JXL_RESTRICT row_encoded[3];
+    const float* JXL_RESTRICT row_ref[3];
+    for (size_t c = 0; c < 3; ++c) {
+      row_in[c] = linear.ConstPlaneRow(c, y);
+      row_encoded[c] = encoded.PlaneRow(c, thread);
+      row_ref[c] = srgb.ConstPlaneRow(c, y);
+    }
+    SrgbRowsFromLinear(row_in, xsize, row_encoded);
+    AddSquaredYuvDiffs(row_ref, row_encoded, xsize, &row_sums[3 * y]);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(
+      RunOnPool(pool, 0, ysize, init, process_row, "SumOfSquaresFromLinear"));
+  sum_of_squares[0] = sum_of_squares[1] = sum_of_squares[2] = 0.0;
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t j = 0; j < 3; ++j) {
+      sum_of_squares[j] += row_sums[3 * y + j];
+    }
+  }
+  return true;
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -211,11 +300,12 @@ StatusOr<double> ComputeDistanceP(const ImageF& distmap,
 }
 
 HWY_EXPORT(ComputeSumOfSquares);
+HWY_EXPORT(SrgbFromLinear);
+HWY_EXPORT(SumOfSquaresFromLinear);
 
-double ComputeDistance2(const ImageBundle& ib1, const ImageBundle& ib2,
-                        const JxlCmsInterface& cms) {
-  double sum_of_squares[3] = {};
-  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(ib1, ib2, cms, sum_of_squares);
+namespace {
+
+double Distance2FromSumOfSquares(const double sum_of_squares[3]) {
   // Weighted PSNR as in JPEG-XL: chroma counts 1/8.
   const float weights[3] = {6.0f / 8, 1.0f / 8, 1.0f / 8};
   // Avoid squaring the weight - 1/64 is too extreme.
@@ -227,14 +317,10 @@ double ComputeDistance2(const ImageBundle& ib1, const ImageBundle& ib2,
   return norm * norm;
 }
 
-double ComputePSNR(const ImageBundle& ib1, const ImageBundle& ib2,
-                   const JxlCmsInterface& cms) {
-  if (!SameSize(ib1, ib2)) return 0.0;
-  double sum_of_squares[3] = {};
-  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(ib1, ib2, cms, sum_of_squares);
+double PsnrFromSumOfSquares(const double sum_of_squares[3],
+                            size_t input_pixels) {
   constexpr double kChannelWeights[3] = {6.0 / 8, 1.0 / 8, 1.0 / 8};
   double avg_psnr = 0;
-  const size_t input_pixels = ib1.xsize() * ib1.ysize();
   for (int i = 0; i < 3; ++i) {
     const double rmse = std::sqrt(sum_of_squares[i] / input_pixels);
     const double psnr =
@@ -244,5 +330,112 @@ double ComputePSNR(const ImageBundle& ib1, const ImageBundle& ib2,
   return avg_psnr;
 }
 
+}  // namespace
+
+double ComputeDistance2(const ImageBundle& ib1, const ImageBundle& ib2,
+                        const JxlCmsInterface& cms) {
+  double sum_of_squares[3] = {};
+  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(ib1, ib2, cms, sum_of_squares);
+  return Distance2FromSumOfSquares(sum_of_squares);
+}
+
+double ComputePSNR(const ImageBundle& ib1, const ImageBundle& ib2,
+                   const JxlCmsInterface& cms) {
+  if (!SameSize(ib1, ib2)) return 0.0;
+  double sum_of_squares[3] = {};
+  HWY_DYNAMIC_DISPATCH(ComputeSumOfSquares)(ib1, ib2, cms, sum_of_squares);
+  return PsnrFromSumOfSquares(sum_of_squares, ib1.xsize() * ib1.ysize());
+}
+
+StatusOr<MetricsReference> MetricsReference::Create(
+    const ImageBundle& ref, const ButteraugliParams& params,
+    const JxlCmsInterface& cms, bool ignore_alpha, ThreadPool* pool) {
+  JxlMemoryManager* memory_manager = ref.memory_manager();
+  MetricsReference result(params, cms);
+  ImageMetadata metadata = *ref.metadata();
+  ImageBundle store(memory_manager, &metadata);
+  const ImageBundle* linear;
+  JXL_RETURN_IF_ERROR(TransformIfNeeded(ref,
+                                        ColorEncoding::LinearSRGB(ref.IsGray()),
+                                        cms, pool, &store, &linear));
+  JXL_ASSIGN_OR_RETURN(
+      result.srgb_, Image3F::Create(memory_manager, ref.xsize(), ref.ysize()));
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SrgbFromLinear)(
+      linear->color(), pool, &result.srgb_));
+
+  result.blend_ = !ignore_alpha && ref.HasAlpha();
+  std::vector<float> backgrounds = {0.0f};
+  if (result.blend_) backgrounds.push_back(1.0f);
+  for (const float background : backgrounds) {
+    Background b;
+    b.linear = background;
+    b.comparator = jxl::make_unique<JxlButteraugliComparator>(params, cms);
+    if (result.blend_) {
+      JXL_ASSIGN_OR_RETURN(ImageBundle blended, linear->Copy());
+      AlphaBlend(background, &blended);
+      JXL_RETURN_IF_ERROR(b.comparator->SetReferenceImage(blended));
+    } else {
+      JXL_RETURN_IF_ERROR(b.comparator->SetReferenceImage(*linear));
+    }
+    result.backgrounds_.push_back(std::move(b));
+  }
+  return result;
+}
+
+StatusOr<ImageMetrics> MetricsReference::Compare(const ImageBundle& distorted,
+                                                  double p, ThreadPool* pool,
+                                                  ImageF* distmap) {
+  JxlMemoryManager* memory_manager = distorted.memory_manager();
+  const size_t xsize = srgb_.xsize();
+  const size_t ysize = srgb_.ysize();
+  if (distorted.xsize() != xsize || distorted.ysize() != ysize) {
+    return JXL_FAILURE("Images must have same size");
+  }
+  // The only color conversion of the distorted image.
+  ImageMetadata metadata = *distorted.metadata();
+  ImageBundle store(memory_manager, &metadata);
+  const ImageBundle* linear;
+  JXL_RETURN_IF_ERROR(TransformIfNeeded(
+      distorted, ColorEncoding::LinearSRGB(distorted.IsGray()), cms_, pool,
+      &store, &linear));
+
+  ImageMetrics metrics;
+  ImageF diffmap;
+  for (Background& background : backgrounds_) {
+    ImageF background_diffmap;
+    float score;
+    if (blend_) {
+      JXL_ASSIGN_OR_RETURN(ImageBundle blended, linear->Copy());
+      AlphaBlend(background.linear, &blended);
+      JXL_RETURN_IF_ERROR(background.comparator->CompareWith(
+          blended, &background_diffmap, &score));
+    } else {
+      JXL_RETURN_IF_ERROR(background.comparator->CompareWith(
+          *linear, &background_diffmap, &score));
+    }
+    metrics.butteraugli = std::max(metrics.butteraugli, score);
+    if (diffmap.xsize() == 0) {
+      diffmap = std::move(background_diffmap);
+      continue;
+    }
+    for (size_t y = 0; y < ysize; ++y) {
+      const float* JXL_RESTRICT row_in = background_diffmap.ConstRow(y);
+      float* JXL_RESTRICT row_out = diffmap.Row(y);
+      for (size_t x = 0; x < xsize; ++x) {
+        row_out[x] = std::max(row_out[x], row_in[x]);
+      }
+    }
+  }
+  JXL_ASSIGN_OR_RETURN(metrics.pnorm, ComputeDistanceP(diffmap, params_, p));
+
+  double sum_of_squares[3];
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(SumOfSquaresFromLinear)(
+      srgb_, linear->color(), pool, sum_of_squares));
+  metrics.psnr = PsnrFromSumOfSquares(sum_of_squares, xsize * ysize);
+  metrics.distance2 = Distance2FromSumOfSquares(sum_of_squares);
+  if (distmap != nullptr) distmap->Swap(diffmap);
+  return metrics;
+}
+
 }  // namespace jxl
 #endif
@@ -8,8 +8,14 @@
 
 #include <jxl/cms_interface.h>
 
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
+#include "lib/jxl/enc_butteraugli_comparator.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 
@@ -25,6 +31,56 @@ double ComputeDistance2(const ImageBundle& ib1, const ImageBundle& ib2,
 double ComputePSNR(const ImageBundle& ib1, const ImageBundle& ib2,
                    const JxlCmsInterface& cms);
 
+// Scores of a distorted image against the reference of a MetricsReference.
+struct ImageMetrics {
+  // Butteraugli distance, and p-norm of its distmap.
+  float butteraugli = 0.0f;
+  double pnorm = 0.0;
+  // Same as ComputePSNR and ComputeDistance2.
+  double psnr = 0.0;
+  double distance2 = 0.0;
+};
+
+// The part of the metrics above that only depends on the reference image: its
+// butteraugli frequency decomposition and its sRGB image. Comparing many
+// distorted images, e.g. encodes at several distances, with the same reference
+// only computes it once. Every distorted image is converted to linear sRGB
+// once for all the metrics, and the sRGB image of the PSNR is computed from
+// it, together with the sums of squares, in a single pass split on the pool.
+class MetricsReference {
+ public:
+  // If the reference has alpha and `ignore_alpha` is false, the butteraugli
+  // distance is the largest of the ones of the images blended against black
+  // and white, like ComputeScore. The PSNR ignores alpha.
+  static StatusOr<MetricsReference> Create(const ImageBundle& ref,
+                                           const ButteraugliParams& params,
+                                           const JxlCmsInterface& cms,
+                                           bool ignore_alpha = false,
+                                           ThreadPool* pool = nullptr);
+
+  // 'distorted' must have the same size as the reference. The p-norm is of
+  // order `p`. If not null, `distmap` is set to the butteraugli distmap.
+  StatusOr<ImageMetrics> Compare(const ImageBundle& distorted, double p,
+                                 ThreadPool* pool = nullptr,
+                                 ImageF* distmap = nullptr);
+
+ private:
+  MetricsReference(const ButteraugliParams& params, const JxlCmsInterface& cms)
+      : params_(params), cms_(cms) {}
+
+  // Butteraugli distance of the blended images, for one background.
+  struct Background {
+    float linear;
+    std::unique_ptr<JxlButteraugliComparator> comparator;
+  };
+
+  ButteraugliParams params_;
+  JxlCmsInterface cms_;
+  bool blend_ = false;
+  std::vector<Background> backgrounds_;
+  Image3F srgb_;
+};
+
 }  // namespace jxl
 
 #endif  // LIB_EXTRAS_METRICS_H_
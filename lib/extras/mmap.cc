@@ -5,6 +5,7 @@
 
 #include "mmap.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -43,6 +44,16 @@ struct MemoryMappedFileImpl {
   const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(ptr); }
   size_t size() const { return mmap_len; }
 
+  void Prefetch(size_t offset, size_t size) const {
+    if (offset >= mmap_len) return;
+    size = std::min(size, mmap_len - offset);
+    // The address given to posix_madvise must be aligned to a page.
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t begin = offset - offset % page_size;
+    (void)posix_madvise(reinterpret_cast<uint8_t*>(ptr) + begin,
+                        offset + size - begin, POSIX_MADV_WILLNEED);
+  }
+
   ~MemoryMappedFileImpl() {
     if (fd != -1) {
       close(fd);
@@ -75,6 +86,25 @@ struct HandleDeleter {
 using HandleUniquePtr =
     std::unique_ptr<std::remove_pointer<HANDLE>::type, HandleDeleter>;
 
+// PrefetchVirtualMemory only exists since Windows 8, so it is looked up at
+// runtime. The range has the layout of WIN32_MEMORY_RANGE_ENTRY.
+struct MemoryRange {
+  PVOID address;
+  SIZE_T size;
+};
+using PrefetchVirtualMemoryFn = BOOL(WINAPI*)(HANDLE, ULONG_PTR, MemoryRange*,
+                                              ULONG);
+
+PrefetchVirtualMemoryFn GetPrefetchVirtualMemory() {
+  static const PrefetchVirtualMemoryFn fn = [] {
+    HMODULE kernel32 = GetModuleHandleW(L"kernel32.dll");
+    if (kernel32 == nullptr) return PrefetchVirtualMemoryFn{nullptr};
+    return reinterpret_cast<PrefetchVirtualMemoryFn>(
+        GetProcAddress(kernel32, "PrefetchVirtualMemory"));
+  }();
+  return fn;
+}
+
 }  // namespace
 
 namespace jxl {
@@ -107,6 +137,16 @@ struct MemoryMappedFileImpl {
   const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(ptr); }
   size_t size() const { return fsize.QuadPart; }
 
+  void Prefetch(size_t offset, size_t size) const {
+    const size_t file_size = fsize.QuadPart;
+    if (ptr == nullptr || offset >= file_size) return;
+    const PrefetchVirtualMemoryFn prefetch = GetPrefetchVirtualMemory();
+    if (prefetch == nullptr) return;
+    MemoryRange range = {reinterpret_cast<uint8_t*>(ptr) + offset,
+                         std::min(size, file_size - offset)};
+    (void)prefetch(GetCurrentProcess(), 1, &range, 0);
+  }
+
   HandleUniquePtr handle;
   HandleUniquePtr handle_mapping;
   LARGE_INTEGER fsize;
@@ -127,6 +167,7 @@ struct MemoryMappedFileImpl {
 
   const uint8_t* data() const { return nullptr; }
   size_t size() const { return 0; }
+  void Prefetch(size_t offset, size_t size) const {}
 };
 
 }  // namespace jxl
@@ -150,4 +191,7 @@ MemoryMappedFile& MemoryMappedFile::operator=(MemoryMappedFile&&) noexcept =
 
 const uint8_t* MemoryMappedFile::data() const { return impl_->data(); }
 size_t MemoryMappedFile::size() const { return impl_->size(); }
+void MemoryMappedFile::Prefetch(size_t offset, size_t size) const {
+  impl_->Prefetch(offset, size);
+}
 }  // namespace jxl
@@ -20,6 +20,10 @@ class MemoryMappedFile {
   static StatusOr<MemoryMappedFile> Init(const char* path);
   const uint8_t* data() const;
   size_t size() const;
+  // Asks the system to start reading `size` bytes at `offset` of the file in
+  // the background, so that accessing them later does not wait for the disk.
+  // Only a hint; does nothing where it is not supported.
+  void Prefetch(size_t offset, size_t size) const;
   MemoryMappedFile();                                        // NOLINT
   ~MemoryMappedFile();                                       // NOLINT
   MemoryMappedFile(MemoryMappedFile&&) noexcept;             // NOLINT
@@ -98,6 +98,8 @@ class PackedImage {
         return 32;
       case JXL_TYPE_FLOAT16:
         return 16;
+      case JXL_TYPE_UINT32_RGB10_A2:
+        return 10;
       default:
         JXL_DEBUG_ABORT("Unreachable");
         return 0;
@@ -119,6 +121,14 @@ class PackedImage {
         memcpy(&val, data, 4);
         return swap_endianness_ ? BSwapFloat(val) : val;
       }
+      case JXL_TYPE_UINT32_RGB10_A2: {
+        // All the channels of a pixel share its 32-bit word.
+        uint32_t val;
+        memcpy(&val, data, 4);
+        if (swap_endianness_) val = JXL_BSWAP32(val);
+        if (c == 3) return (val >> 30) * (1.0f / 3);
+        return ((val >> (10 * c)) & 0x3FF) * (1.0f / 1023);
+      }
       default:
         JXL_DEBUG_ABORT("Unreachable");
         return 0.0f;
@@ -146,6 +156,21 @@ class PackedImage {
         memcpy(data, &val, 4);
         break;
       }
+      case JXL_TYPE_UINT32_RGB10_A2: {
+        uint32_t val32;
+        memcpy(&val32, data, 4);
+        if (swap_endianness_) val32 = JXL_BSWAP32(val32);
+        const size_t shift = 10 * c;
+        const uint32_t max_value = c == 3 ? 3 : 0x3FF;
+        const uint32_t field =
+            Clamp1(std::round(val * max_value), 0.0f, 1.0f * max_value);
+        val32 = (val32 & ~(max_value << shift)) | (field << shift);
+        // Pixels without alpha are opaque.
+        if (format.num_channels == 3) val32 |= 3u << 30;
+        if (swap_endianness_) val32 = JXL_BSWAP32(val32);
+        memcpy(data, &val32, 4);
+        break;
+      }
       default:
         JXL_DEBUG_ABORT("Unreachable");
     }
@@ -161,19 +186,26 @@ class PackedImage {
         pixels_size(ysize * stride),
         pixels_(malloc(std::max<size_t>(1, pixels_size)), free) {
     bytes_per_channel_ = BitsPerChannel(format.data_type) / jxl::kBitsPerByte;
-    pixel_stride_ = format.num_channels * bytes_per_channel_;
+    pixel_stride_ = BitsPerPixel(format) / jxl::kBitsPerByte;
+    // The channels of packed pixels are not addressed by bytes.
+    if (format.data_type == JXL_TYPE_UINT32_RGB10_A2) bytes_per_channel_ = 0;
     swap_endianness_ = SwapEndianness(format.endianness);
   }
 
   static size_t CalcStride(const JxlPixelFormat& format, size_t xsize) {
-    size_t stride = xsize * (BitsPerChannel(format.data_type) *
-                             format.num_channels / jxl::kBitsPerByte);
+    size_t stride = xsize * (BitsPerPixel(format) / jxl::kBitsPerByte);
     if (format.align > 1) {
       stride = jxl::DivCeil(stride, format.align) * format.align;
     }
     return stride;
   }
 
+  static size_t BitsPerPixel(const JxlPixelFormat& format) {
+    // Packed pixels take 32 bits, whether they have alpha or not.
+    if (format.data_type == JXL_TYPE_UINT32_RGB10_A2) return 32;
+    return BitsPerChannel(format.data_type) * format.num_channels;
+  }
+
   size_t bytes_per_channel_;
   size_t pixel_stride_;
   bool swap_endianness_;
@@ -0,0 +1,157 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/extras/progression_index.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+namespace extras {
+
+namespace {
+
+// Part of the codestream, in a jxlc or jxlp box.
+struct CodestreamChunk {
+  uint64_t codestream_pos;
+  uint64_t file_pos;
+  uint64_t size;
+};
+
+class VarIntReader {
+ public:
+  explicit VarIntReader(Span<const uint8_t> data) : data_(data) {}
+
+  Status Read(uint64_t* value) {
+    *value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+      if (pos_ >= data_.size()) return JXL_FAILURE("Truncated jxpi box");
+      const uint8_t byte = data_[pos_++];
+      *value |= static_cast<uint64_t>(byte & 127) << shift;
+      if ((byte & 128) == 0) return true;
+    }
+    return JXL_FAILURE("Invalid varint in jxpi box");
+  }
+
+ private:
+  Span<const uint8_t> data_;
+  size_t pos_ = 0;
+};
+
+// Offset in the file of the byte at offset `pos` of the codestream.
+Status FilePosition(const std::vector<CodestreamChunk>& chunks, uint64_t pos,
+                    uint64_t* file_pos) {
+  for (const CodestreamChunk& chunk : chunks) {
+    if (pos >= chunk.codestream_pos &&
+        pos - chunk.codestream_pos < chunk.size) {
+      *file_pos = chunk.file_pos + (pos - chunk.codestream_pos);
+      return true;
+    }
+  }
+  return JXL_FAILURE("Offset outside of the codestream");
+}
+
+// Size of the prefix of the file that holds the first `end` bytes of the
+// codestream.
+Status FileEnd(const std::vector<CodestreamChunk>& chunks, uint64_t end,
+               uint64_t* file_end) {
+  if (end == 0) return JXL_FAILURE("Empty part in jxpi box");
+  JXL_RETURN_IF_ERROR(FilePosition(chunks, end - 1, file_end));
+  ++*file_end;
+  return true;
+}
+
+}  // namespace
+
+Status ReadProgressionIndex(Span<const uint8_t> file, ProgressionIndex* index) {
+  std::vector<CodestreamChunk> chunks;
+  uint64_t codestream_size = 0;
+  Span<const uint8_t> index_box;
+  bool has_index = false;
+  size_t pos = 0;
+  while (pos < file.size()) {
+    if (file.size() - pos < 8) return JXL_FAILURE("Truncated box header");
+    uint64_t box_size = LoadBE32(file.data() + pos);
+    const uint8_t* type = file.data() + pos + 4;
+    size_t header_size = 8;
+    if (box_size == 1) {
+      if (file.size() - pos < 16) return JXL_FAILURE("Truncated box header");
+      box_size = LoadBE64(file.data() + pos + 8);
+      header_size = 16;
+    } else if (box_size == 0) {
+      box_size = file.size() - pos;
+    }
+    if (box_size < header_size || box_size > file.size() - pos) {
+      return JXL_FAILURE("Invalid box size");
+    }
+    const size_t contents_pos = pos + header_size;
+    const size_t contents_size = box_size - header_size;
+    if (memcmp(type, "jxlc", 4) == 0) {
+      chunks.push_back({codestream_size, contents_pos, contents_size});
+      codestream_size += contents_size;
+    } else if (memcmp(type, "jxlp", 4) == 0) {
+      // Skips the index of the box.
+      if (contents_size < 4) return JXL_FAILURE("Truncated jxlp box");
+      chunks.push_back({codestream_size, contents_pos + 4, contents_size - 4});
+      codestream_size += contents_size - 4;
+    } else if (memcmp(type, "jxpi", 4) == 0) {
+      index_box = Bytes(file.data() + contents_pos, contents_size);
+      has_index = true;
+    }
+    pos += box_size;
+  }
+  if (!has_index) return JXL_FAILURE("No jxpi box");
+
+  VarIntReader reader(index_box);
+  uint64_t num_frames;
+  JXL_RETURN_IF_ERROR(reader.Read(&num_frames));
+  if (num_frames > index_box.size()) {
+    return JXL_FAILURE("Too many frames in jxpi box");
+  }
+  index->frames.clear();
+  for (uint64_t i = 0; i < num_frames; i++) {
+    ProgressionIndex::Frame frame;
+    uint64_t frame_pos;
+    uint64_t dc_end;
+    JXL_RETURN_IF_ERROR(reader.Read(&frame_pos));
+    JXL_RETURN_IF_ERROR(FilePosition(chunks, frame_pos, &frame.start));
+    JXL_RETURN_IF_ERROR(reader.Read(&dc_end));
+    JXL_RETURN_IF_ERROR(FileEnd(chunks, frame_pos + dc_end, &frame.dc_end));
+    uint64_t num_passes;
+    JXL_RETURN_IF_ERROR(reader.Read(&num_passes));
+    if (num_passes > index_box.size()) {
+      return JXL_FAILURE("Too many passes in jxpi box");
+    }
+    frame.pass_end.resize(num_passes);
+    for (uint64_t& end : frame.pass_end) {
+      uint64_t pass_end;
+      JXL_RETURN_IF_ERROR(reader.Read(&pass_end));
+      JXL_RETURN_IF_ERROR(FileEnd(chunks, frame_pos + pass_end, &end));
+    }
+    uint64_t num_sections;
+    JXL_RETURN_IF_ERROR(reader.Read(&num_sections));
+    if (num_sections > index_box.size()) {
+      return JXL_FAILURE("Too many sections in jxpi box");
+    }
+    frame.section_start.resize(num_sections);
+    for (uint64_t& start : frame.section_start) {
+      uint64_t section_start;
+      JXL_RETURN_IF_ERROR(reader.Read(&section_start));
+      JXL_RETURN_IF_ERROR(
+          FilePosition(chunks, frame_pos + section_start, &start));
+    }
+    index->frames.push_back(std::move(frame));
+  }
+  return true;
+}
+
+}  // namespace extras
+}  // namespace jxl
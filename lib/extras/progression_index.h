@@ -0,0 +1,47 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_EXTRAS_PROGRESSION_INDEX_H_
+#define LIB_EXTRAS_PROGRESSION_INDEX_H_
+
+// Reads the jxpi box that the encoder stores for the frames encoded with
+// JXL_ENC_FRAME_SETTING_PROGRESSION_INDEX_BOX.
+
+#include <cstdint>
+#include <vector>
+
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+namespace extras {
+
+// Offsets in the file of the parts of the indexed frames. The end of a part is
+// the size of the prefix of the file that holds it, and everything before it
+// in the codestream, so that a server can send the prefix for a given level
+// of progression.
+struct ProgressionIndex {
+  struct Frame {
+    // Start of the frame, or of the frames of its patches and progressive DC
+    // that come first.
+    uint64_t start;
+    // End of its DC, from which it can be rendered at 1:8.
+    uint64_t dc_end;
+    // End of each of its progressive passes.
+    std::vector<uint64_t> pass_end;
+    // Start of each section, in the order of the TOC.
+    std::vector<uint64_t> section_start;
+  };
+  std::vector<Frame> frames;
+};
+
+// Reads the index from the boxes of `file`, without parsing the codestream.
+// Fails if the file has no jxpi box.
+Status ReadProgressionIndex(Span<const uint8_t> file, ProgressionIndex* index);
+
+}  // namespace extras
+}  // namespace jxl
+
+#endif  // LIB_EXTRAS_PROGRESSION_INDEX_H_
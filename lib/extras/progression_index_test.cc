@@ -0,0 +1,106 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/extras/progression_index.h"
+
+#include <jxl/codestream_header.h>
+#include <jxl/color_encoding.h>
+#include <jxl/encode.h>
+#include <jxl/encode_cxx.h>
+#include <jxl/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/test_image.h"
+#include "lib/jxl/test_utils.h"
+#include "lib/jxl/testing.h"
+
+namespace jxl {
+namespace extras {
+namespace {
+
+std::vector<uint8_t> EncodeWithIndex(size_t xsize, size_t ysize) {
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  std::vector<uint8_t> pixels = test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlBasicInfo basic_info;
+  test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_FALSE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(
+                frame_settings, JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(
+                frame_settings, JXL_ENC_FRAME_SETTING_PROGRESSION_INDEX_BOX,
+                1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(), pixels.size()));
+  JxlEncoderCloseInput(enc.get());
+
+  std::vector<uint8_t> compressed(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
+  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+    process_result = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
+    if (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
+      size_t offset = next_out - compressed.data();
+      compressed.resize(compressed.size() * 2);
+      next_out = compressed.data() + offset;
+      avail_out = compressed.size() - offset;
+    }
+  }
+  EXPECT_EQ(JXL_ENC_SUCCESS, process_result);
+  compressed.resize(next_out - compressed.data());
+  return compressed;
+}
+
+TEST(ProgressionIndexTest, ReadsEncodedIndex) {
+  const std::vector<uint8_t> compressed = EncodeWithIndex(600, 400);
+  ProgressionIndex index;
+  ASSERT_TRUE(ReadProgressionIndex(Bytes(compressed), &index));
+  ASSERT_EQ(1u, index.frames.size());
+  const ProgressionIndex::Frame& frame = index.frames[0];
+  ASSERT_GT(frame.pass_end.size(), 1u);
+  EXPECT_LT(frame.start, frame.dc_end);
+  EXPECT_LE(frame.dc_end, frame.pass_end[0]);
+  for (size_t i = 1; i < frame.pass_end.size(); i++) {
+    EXPECT_LE(frame.pass_end[i - 1], frame.pass_end[i]);
+  }
+  for (uint64_t start : frame.section_start) {
+    EXPECT_GT(start, frame.start);
+    EXPECT_LT(start, frame.pass_end.back());
+  }
+  // The codestream is in a single jxlc box, followed by the jxpi box.
+  ASSERT_LT(frame.pass_end.back() + 8, compressed.size());
+  EXPECT_EQ(0, memcmp(compressed.data() + frame.pass_end.back() + 4, "jxpi",
+                      4));
+}
+
+TEST(ProgressionIndexTest, FailsWithoutIndex) {
+  // A bare codestream has no boxes.
+  const std::vector<uint8_t> codestream = {0xff, 0x0a, 0, 0, 0, 0, 0, 0};
+  ProgressionIndex index;
+  EXPECT_FALSE(ReadProgressionIndex(Bytes(codestream), &index));
+}
+
+}  // namespace
+}  // namespace extras
+}  // namespace jxl
@@ -32,29 +32,11 @@ namespace HWY_NAMESPACE {
 
 static constexpr Vector3 rec2020_luminances{0.2627f, 0.6780f, 0.0593f};
 
-Status ToneMapFrame(const Range& display_nits, ImageBundle* const ib,
-                    ThreadPool* const pool) {
-  // Perform tone mapping as described in Report ITU-R BT.2390-8, section 5.4
-  // (pp. 23-25).
-  // https://www.itu.int/pub/R-REP-BT.2390-8-2020
-
+template <typename ToneMapper>
+Status ApplyToneMapper(const ToneMapper& tone_mapper, ImageBundle* const ib,
+                       ThreadPool* const pool) {
   HWY_FULL(float) df;
   using V = decltype(Zero(df));
-
-  ColorEncoding linear_rec2020;
-  linear_rec2020.SetColorSpace(ColorSpace::kRGB);
-  JXL_RETURN_IF_ERROR(linear_rec2020.SetPrimariesType(Primaries::k2100));
-  JXL_RETURN_IF_ERROR(linear_rec2020.SetWhitePointType(WhitePoint::kD65));
-  linear_rec2020.Tf().SetTransferFunction(TransferFunction::kLinear);
-  JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
-  JXL_RETURN_IF_ERROR(
-      ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
-
-  Rec2408ToneMapper<decltype(df)> tone_mapper(
-      {ib->metadata()->tone_mapping.min_nits,
-       ib->metadata()->IntensityTarget()},
-      display_nits, rec2020_luminances);
-
   const auto process_row = [&](const uint32_t y,
                                size_t /* thread */) -> Status {
     float* const JXL_RESTRICT row_r = ib->color()->PlaneRow(0, y);
@@ -76,10 +58,38 @@ Status ToneMapFrame(const Range& display_nits, ImageBundle* const ib,
   return true;
 }
 
+Status ToneMapFrame(const Range& display_nits, size_t lut_bits,
+                    ImageBundle* const ib, ThreadPool* const pool) {
+  // Perform tone mapping as described in Report ITU-R BT.2390-8, section 5.4
+  // (pp. 23-25).
+  // https://www.itu.int/pub/R-REP-BT.2390-8-2020
+
+  HWY_FULL(float) df;
+
+  ColorEncoding linear_rec2020;
+  linear_rec2020.SetColorSpace(ColorSpace::kRGB);
+  JXL_RETURN_IF_ERROR(linear_rec2020.SetPrimariesType(Primaries::k2100));
+  JXL_RETURN_IF_ERROR(linear_rec2020.SetWhitePointType(WhitePoint::kD65));
+  linear_rec2020.Tf().SetTransferFunction(TransferFunction::kLinear);
+  JXL_RETURN_IF_ERROR(linear_rec2020.CreateICC());
+  JXL_RETURN_IF_ERROR(
+      ib->TransformTo(linear_rec2020, *JxlGetDefaultCms(), pool));
+
+  const Range source_range = {ib->metadata()->tone_mapping.min_nits,
+                              ib->metadata()->IntensityTarget()};
+  if (lut_bits == 0) {
+    const Rec2408ToneMapper<decltype(df)> tone_mapper(
+        source_range, display_nits, rec2020_luminances);
+    return ApplyToneMapper(tone_mapper, ib, pool);
+  }
+  const Rec2408ToneMapperLut<decltype(df)> tone_mapper(
+      source_range, display_nits, rec2020_luminances, lut_bits);
+  return ApplyToneMapper(tone_mapper, ib, pool);
+}
+
 Status GamutMapFrame(ImageBundle* const ib, float preserve_saturation,
                      ThreadPool* const pool) {
   HWY_FULL(float) df;
-  using V = decltype(Zero(df));
 
   ColorEncoding linear_rec2020;
   linear_rec2020.SetColorSpace(ColorSpace::kRGB);
@@ -126,10 +136,11 @@ HWY_EXPORT(GamutMapFrame);
 }  // namespace
 
 Status ToneMapTo(const Range& display_nits, CodecInOut* const io,
-                 ThreadPool* const pool) {
+                 ThreadPool* const pool, size_t lut_bits) {
+  JXL_ENSURE(lut_bits <= 16);
   const auto tone_map_frame = HWY_DYNAMIC_DISPATCH(ToneMapFrame);
   for (ImageBundle& ib : io->frames) {
-    JXL_RETURN_IF_ERROR(tone_map_frame(display_nits, &ib, pool));
+    JXL_RETURN_IF_ERROR(tone_map_frame(display_nits, lut_bits, &ib, pool));
   }
   io->metadata.m.SetIntensityTarget(display_nits[1]);
   return true;
@@ -6,6 +6,7 @@
 #ifndef LIB_EXTRAS_TONE_MAPPING_H_
 #define LIB_EXTRAS_TONE_MAPPING_H_
 
+#include <cstddef>
 #include <utility>
 
 #include "lib/jxl/base/data_parallel.h"
@@ -17,8 +18,11 @@ namespace jxl {
 // Important: after calling this, the result will contain many out-of-gamut
 // colors. It is very strongly recommended to call GamutMap afterwards to
 // rectify this.
+//
+// If `lut_bits` is not 0, the tone curve is interpolated from a table of
+// 2^lut_bits + 1 values, which is faster but less exact.
 Status ToneMapTo(const Range& display_nits, CodecInOut* io,
-                 ThreadPool* pool = nullptr);
+                 ThreadPool* pool = nullptr, size_t lut_bits = 0);
 
 // `preserve_saturation` indicates to what extent to favor saturation over
 // luminance when mapping out-of-gamut colors to Rec. 2020. 0 preserves
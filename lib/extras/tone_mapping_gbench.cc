@@ -5,6 +5,7 @@
 
 #include <jxl/memory_manager.h>
 
+#include <cstddef>
 #include <utility>
 
 #include "benchmark/benchmark.h"
@@ -27,8 +28,11 @@ namespace jxl {
     QUIT(#C)        \
   }
 
+// The argument is the number of bits of the tone curve table, 0 for the exact
+// curve.
 static void BM_ToneMapping(benchmark::State& state) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const size_t lut_bits = state.range(0);
   JXL_ASSIGN_OR_QUIT(Image3F color, Image3F::Create(memory_manager, 2268, 1512),
                      "Failed to allocate color plane");
   FillImage(0.5f, &color);
@@ -56,11 +60,12 @@ static void BM_ToneMapping(benchmark::State& state) {
     tone_mapping_input.metadata.m.SetIntensityTarget(255);
     state.ResumeTiming();
 
-    BM_CHECK(ToneMapTo({0.1, 100}, &tone_mapping_input));
+    BM_CHECK(ToneMapTo({0.1, 100}, &tone_mapping_input, /*pool=*/nullptr,
+                       lut_bits));
   }
 
   state.SetItemsProcessed(state.iterations() * color.xsize() * color.ysize());
 }
-BENCHMARK(BM_ToneMapping);
+BENCHMARK(BM_ToneMapping)->Arg(0)->Arg(8)->Arg(10)->Arg(12);
 
 }  // namespace jxl
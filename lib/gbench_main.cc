@@ -5,7 +5,11 @@
 
 #include "benchmark/benchmark.h"
 
+void RegisterANSBenchmarks();
 void RegisterDctBenchmarks();
+void RegisterEncoderBenchmarks();
+void RegisterJpegliBenchmarks();
+void RegisterRenderPipelineBenchmarks();
 
 int main(int argc, char** argv) {
   char arg0_default[] = "benchmark";
@@ -14,7 +18,11 @@ int main(int argc, char** argv) {
     argc = 1;
     argv = &args_default;
   }
+  RegisterANSBenchmarks();
   RegisterDctBenchmarks();
+  RegisterEncoderBenchmarks();
+  RegisterJpegliBenchmarks();
+  RegisterRenderPipelineBenchmarks();
   ::benchmark ::Initialize(&argc, argv);
   if (::benchmark ::ReportUnrecognizedArguments(argc, argv)) return 1;
   ::benchmark ::RunSpecifiedBenchmarks();
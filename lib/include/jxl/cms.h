@@ -17,6 +17,24 @@ extern "C" {
 
 JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms();
 
+/** Returns a CMS like @ref JxlGetDefaultCms, except that the color transforms
+ * from RGB and CMYK profiles are baked at init into a lookup table of the
+ * output colors at a grid of input colors, applied with tetrahedral
+ * interpolation. This trades some accuracy for speed with profiles defined by
+ * lookup tables, such as CMYK and printer profiles, whose transforms are slow
+ * to run on every pixel.
+ *
+ * Transforms between equivalent profiles and from PQ profiles are not baked,
+ * and input values are clamped to [0, 1]. Tables are shared by the transforms
+ * between the same profiles.
+ *
+ * @param grid_size number of points of the grid along each input axis: 17, 33
+ *     or 65. Larger grids are more accurate, but slower to create and larger.
+ *     CMYK inputs use at most 17 points.
+ * @return the CMS, or NULL if @p grid_size is not supported.
+ */
+JXL_CMS_EXPORT const JxlCmsInterface* JxlGetLutCms(uint32_t grid_size);
+
 #ifdef __cplusplus
 }
 #endif
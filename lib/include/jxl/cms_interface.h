@@ -108,7 +108,8 @@ typedef void* (*jpegxl_cms_init_func)(void* init_data, size_t num_threads,
 
 /** Returns a buffer that can be used by callers of the interface to store the
  * input of the conversion or read its result, if they pass it as the input or
- * output of the @c run function.
+ * output of the @c run function. Like @c run, it must be possible to call
+ * this from different threads with different values for @p thread.
  * @param user_data the data returned by @c init.
  * @param thread the index of the thread for which to return a buffer.
  * @return A buffer that can be used by the caller for passing to @c run.
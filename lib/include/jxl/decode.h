@@ -16,6 +16,8 @@
 #include <jxl/cms_interface.h>
 #include <jxl/codestream_header.h>
 #include <jxl/color_encoding.h>
+#include <jxl/decode_stats.h>
+#include <jxl/gain_map.h>
 #include <jxl/jxl_export.h>
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
@@ -189,6 +191,18 @@ typedef enum {
    */
   JXL_DEC_BOX_NEED_MORE_OUTPUT = 7,
 
+  /** Decoding failed because the memory limit set with @ref
+   * JxlDecoderSetMemoryLimit does not allow a buffer the decoder needs. The
+   * decoder must be rewound or reset before it can be used again.
+   */
+  JXL_DEC_MEMORY_LIMIT = 8,
+
+  /** The callback set with @ref JxlDecoderSetImageOutRowCallback asked to
+   * pause. Call @ref JxlDecoderProcessInput again to continue decoding once
+   * the callback can take more rows.
+   */
+  JXL_DEC_IMAGE_OUT_PAUSED = 9,
+
   /** Informative event by @ref JxlDecoderProcessInput
    * "JxlDecoderProcessInput": Basic information such as image dimensions and
    * extra channels. This event occurs max once per image.
@@ -371,7 +385,8 @@ typedef enum {
  * the beginning of the file and the decoder will emit events from the beginning
  * again. When rewinding (as opposed to @ref JxlDecoderReset), the decoder can
  * keep state about the image, which it can use to skip to a requested frame
- * more efficiently with @ref JxlDecoderSkipFrames. Settings such as parallel
+ * more efficiently with @ref JxlDecoderSkipFrames, and it does not decompress
+ * the ICC profile of the image again. Settings such as parallel
  * runner or subscribed events are kept. After rewind, @ref
  * JxlDecoderSubscribeEvents can be used again, and it is feasible to leave out
  * events that were already handled before, such as ::JXL_DEC_BASIC_INFO
@@ -385,13 +400,28 @@ typedef enum {
  *  - @ref JxlDecoderSetKeepOrientation,
  *  - @ref JxlDecoderSetUnpremultiplyAlpha,
  *  - @ref JxlDecoderSetParallelRunner,
- *  - @ref JxlDecoderSetRenderSpotcolors, and
+ *  - @ref JxlDecoderSetRenderSpotcolors,
+ *  - @ref JxlDecoderSetGainMap, and
  *  - @ref JxlDecoderSubscribeEvents.
  *
  * @param dec decoder object
  */
 JXL_EXPORT void JxlDecoderRewind(JxlDecoder* dec);
 
+/** Prepares the decoder for a new input, like @ref JxlDecoderRewind keeping
+ * the settings, but keeps the buffers of the last decoded frame for the next
+ * image to reuse where it needs buffers of the same size. This is intended for
+ * sequences of images with the same dimensions and channels, such as camera
+ * bursts or the tiles of an image pyramid, and saves most of the setup of each
+ * image. Buffers that the next image cannot use are freed once it needs its
+ * own. Settings that @ref JxlDecoderRewind keeps are kept, and so is a @ref
+ * JxlDecoderSetCms setting; the frames saved for reference by the previous
+ * image are not.
+ *
+ * @param dec decoder object
+ */
+JXL_EXPORT void JxlDecoderSoftReset(JxlDecoder* dec);
+
 /** Makes the decoder skip the next `amount` frames. It still needs to process
  * the input, but will not output the frame events. It can be more efficient
  * when skipping frames, and even more so when using this after @ref
@@ -556,6 +586,152 @@ JxlDecoderSetRenderSpotcolors(JxlDecoder* dec, JXL_BOOL render_spotcolors);
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec,
                                                     JXL_BOOL coalescing);
 
+/** Downsamples the image output by an integer factor, e.g. to decode
+ * thumbnails. The output buffers, as given by @ref JxlDecoderImageOutBufferSize
+ * and @ref JxlDecoderExtraChannelBufferSize, and the coordinates passed to
+ * the pixel callbacks are those of the smaller image, whose dimensions are
+ * those of the full image divided by the factor and rounded up. Each output
+ * pixel is the average of the corresponding block of the full image.
+ * The image and frame headers still describe the full image, and the preview
+ * is not downsampled.
+ *
+ * With a factor of 8, VarDCT frames are rendered from their DC coefficients
+ * only, skipping the decoding of the AC coefficients, unless other frames
+ * depend on them.
+ *
+ * Must be called before the first ::JXL_DEC_FRAME event, e.g. on
+ * ::JXL_DEC_BASIC_INFO, so that the factor can be chosen from the image
+ * dimensions.
+ *
+ * @param dec decoder object
+ * @param factor downsampling factor: 1 (default), 2, 4 or 8.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetOutputDownsampling(JxlDecoder* dec,
+                                                            uint32_t factor);
+
+/** Enables or disables computing the pixels of frames recompressed from JPEG
+ * with the integer inverse DCT of libjpeg (its default "islow" method), from
+ * the JPEG coefficients. The output then matches libjpeg up to the chroma
+ * upsampling and the conversion to RGB, which remain those of JPEG XL, but
+ * may differ slightly from the output specified by JPEG XL. The pixels of
+ * other frames are not affected. The default is disabled.
+ *
+ * Must be called before ::JxlDecoderProcessInput.
+ *
+ * @param dec decoder object
+ * @param enabled ::JXL_TRUE to enable the integer IDCT, ::JXL_FALSE to use the
+ * IDCT of JPEG XL.
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetJPEGIntegerIDCT(JxlDecoder* dec,
+                                                         JXL_BOOL enabled);
+
+/** Restricts decoding to a region of interest, so that only the parts of the
+ * image needed to render it are decoded. This makes decoding a small region of
+ * a large image much faster. The output buffers and callbacks keep the size of
+ * the full image or frame, but only the pixels inside of the region are
+ * guaranteed to be correct: the other pixels are unspecified and callbacks
+ * may not be called for them at all.
+ *
+ * The region is given in the coordinates of the output image, i.e. after
+ * orientation is applied unless @ref JxlDecoderSetKeepOrientation is set, and
+ * applies to all subsequent frames. Frames that other frames depend on, JPEG
+ * reconstruction and some modular images are always decoded fully; with
+ * coalescing, so are frames that do not cover the whole image.
+ *
+ * @param dec decoder object
+ * @param x0 left edge of the region.
+ * @param y0 top edge of the region.
+ * @param xsize width of the region, or 0 to decode the whole image (default).
+ * @param ysize height of the region, or 0 to decode the whole image (default).
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec,
+                                                    uint32_t x0, uint32_t y0,
+                                                    uint32_t xsize,
+                                                    uint32_t ysize);
+
+/** Enables or disables rendering on demand. With it, the pixels of a frame are
+ * not written to the output buffers when the frame is decoded: the decoder
+ * keeps the decoded frame, in floating point, and only renders the regions
+ * requested with @ref JxlDecoderRenderRegion after the ::JXL_DEC_FULL_IMAGE
+ * event. This saves the rendering of the parts of a large image that are never
+ * displayed.
+ *
+ * Only applies to frames decoded to a buffer set with @ref
+ * JxlDecoderSetImageOutBuffer that no other frame depends on and that are not
+ * blended, and not to JPEG reconstruction or when a region is set with @ref
+ * JxlDecoderSetCropRegion; other frames are rendered as usual. @ref
+ * JxlDecoderFlushImage renders nothing for frames rendered on demand.
+ *
+ * Must be called before decoding starts.
+ *
+ * @param dec decoder object
+ * @param render_on_demand ::JXL_TRUE to render on demand, ::JXL_FALSE to
+ *     render frames while they are decoded (default).
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus
+JxlDecoderSetRenderOnDemand(JxlDecoder* dec, JXL_BOOL render_on_demand);
+
+/** Enables or disables rendering on the GPU. With it, the conversion from XYB,
+ * the Gaborish filter and the upsampling of the frames are run with CUDA on
+ * the whole frame, and the other rendering steps on a single thread, once all
+ * the groups of a pass are decoded. The decoding of the groups, including the
+ * inverse DCT, and the edge-preserving filter stay on the CPU. The pixels may
+ * differ from those rendered on the CPU by rounding errors.
+ *
+ * Has no effect if libjxl is built without JPEGXL_ENABLE_CUDA, which is the
+ * default, or if there is no CUDA device, or for frames rendered on demand or
+ * restricted to a region set with @ref JxlDecoderSetCropRegion.
+ *
+ * Must be called before decoding starts.
+ *
+ * @param dec decoder object
+ * @param gpu_rendering ::JXL_TRUE to render on the GPU when possible,
+ *     ::JXL_FALSE to render on the CPU (default).
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetGPURendering(JxlDecoder* dec,
+                                                      JXL_BOOL gpu_rendering);
+
+/**
+ * Limits the memory the decoder allocates through its memory manager, which
+ * holds all image buffers. An allocation that would exceed the limit fails,
+ * after which @ref JxlDecoderProcessInput returns ::JXL_DEC_MEMORY_LIMIT and
+ * the decoder can only be rewound or reset. Under a limit, the buffers of the
+ * last frame and of the frames saved for later frames are also released as
+ * soon as the last frame is decoded.
+ *
+ * May be called at any time; allocations that were already made count towards
+ * the new limit. The limit stays set on @ref JxlDecoderRewind and is removed by
+ * @ref JxlDecoderReset.
+ *
+ * @param dec decoder object
+ * @param max_bytes maximum number of bytes allocated at any time, or 0 for no
+ *     limit (default).
+ * @return ::JXL_DEC_SUCCESS.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec,
+                                                     uint64_t max_bytes);
+
+/**
+ * Makes the decoder add the time it spends in each phase, and the bytes it
+ * allocates, to the given stats object. Collecting stats costs some time for
+ * every row processed by the render pipeline, so it is off by default.
+ *
+ * Must be called before decoding starts. The stats object must outlive the
+ * decoding, or another call with NULL.
+ *
+ * @param dec decoder object
+ * @param stats object that can be used to query the gathered stats (created
+ *   by @ref JxlDecoderStatsCreate), or NULL to stop collecting stats
+ * @return ::JXL_DEC_SUCCESS if no error, ::JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderCollectStats(JxlDecoder* dec,
+                                                   JxlDecoderStats* stats);
+
 /**
  * Decodes JPEG XL file using the available bytes. Requires input has been
  * set with @ref JxlDecoderSetInput. After @ref JxlDecoderProcessInput, input
@@ -606,6 +782,11 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec);
  * JxlDecoderReleaseInput was not yet called, and cannot be called after @ref
  * JxlDecoderCloseInput indicating the end of input was called.
  *
+ * Frame data is read in place from this buffer, also when it is split across
+ * multiple partial codestream boxes of the container format, as long as those
+ * boxes are all contained in it. Passing the whole file at once therefore
+ * avoids any copy of the codestream.
+ *
  * @param dec decoder object
  * @param data pointer to next bytes to read from
  * @param size amount of bytes available starting from data
@@ -841,6 +1022,38 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetPreferredColorProfile(
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetDesiredIntensityTarget(
     JxlDecoder* dec, float desired_intensity_target);
 
+/** Makes the decoder apply a gain map to the displayed frames, for a display
+ * whose HDR headroom is @c display_hdr_headroom (a log2 value), instead of
+ * rendering the base image. The gain map is applied to the linear colors of
+ * the output color profile, while the pixels are rendered, and is upsampled
+ * bilinearly to the size of the image before orientation; frames that do not
+ * cover the whole image and the preview are rendered without it.
+ *
+ * The gain map itself, such as the one of a jhgm box read with @ref
+ * JxlGainMapReadBundle, must have been decoded separately: @c buffer holds its
+ * @c xsize by @c ysize pixels in @c format, which must have 1 or 3 channels of
+ * ::JXL_TYPE_UINT8, ::JXL_TYPE_UINT16 or ::JXL_TYPE_FLOAT. It is copied, so
+ * that @c buffer can be released after this call. Parsing @c params from the
+ * gain map metadata is left to the caller.
+ *
+ * This function must be called at the beginning, before decoding is performed.
+ *
+ * @param dec decoder object
+ * @param params parameters of the gain map, or NULL to render the base image
+ * @param format format of the pixels of the gain map
+ * @param buffer pixels of the gain map, ignored if @c params is NULL
+ * @param size size of @c buffer in bytes
+ * @param xsize width of the gain map
+ * @param ysize height of the gain map
+ * @param display_hdr_headroom log2 of the HDR headroom of the display
+ * @return ::JXL_DEC_SUCCESS if the gain map was set successfully, @ref
+ * JXL_DEC_ERROR otherwise.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetGainMap(
+    JxlDecoder* dec, const JxlGainMapParams* params,
+    const JxlPixelFormat* format, const void* buffer, size_t size,
+    uint32_t xsize, uint32_t ysize, float display_hdr_headroom);
+
 /**
  * Sets the desired output color profile of the decoded image either from a
  * color encoding or an ICC profile. Valid calls of this function have either @c
@@ -966,6 +1179,22 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameHeader(const JxlDecoder* dec,
 JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameName(const JxlDecoder* dec,
                                                    char* name, size_t size);
 
+/**
+ * Outputs whether the current frame is encoded with modular mode rather than
+ * VarDCT, which mostly determines how expensive it is to decode, for example
+ * to pick the number of threads. This function can be called once the
+ * ::JXL_DEC_FRAME event occurred for the current frame.
+ *
+ * @param dec decoder object
+ * @param modular set to ::JXL_TRUE for a modular frame, ::JXL_FALSE for a
+ *     VarDCT frame.
+ * @return ::JXL_DEC_SUCCESS if the value is available, @ref
+ *     JXL_DEC_NEED_MORE_INPUT if not yet available, ::JXL_DEC_ERROR in
+ *     case of other error conditions.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderGetFrameIsModular(const JxlDecoder* dec,
+                                                        JXL_BOOL* modular);
+
 /**
  * Outputs the blend information for the current frame for a specific extra
  * channel. This function can be called once the ::JXL_DEC_FRAME event occurred
@@ -1151,6 +1380,128 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
     JxlImageOutInitCallback init_callback, JxlImageOutRunCallback run_callback,
     JxlImageOutDestroyCallback destroy_callback, void* init_opaque);
 
+/**
+ * Function type for @ref JxlDecoderSetImageOutRowCallback.
+ *
+ * @param opaque optional user data, as given to @ref
+ *     JxlDecoderSetImageOutRowCallback.
+ * @param y vertical position of the row.
+ * @param row pixel data of the full row, in the format passed to @ref
+ *     JxlDecoderSetImageOutRowCallback, without padding. The memory is not
+ *     owned by the user, and is only valid during the time the callback is
+ *     running.
+ * @return ::JXL_TRUE to continue decoding, ::JXL_FALSE to pause it after this
+ *     row.
+ */
+typedef JXL_BOOL (*JxlImageOutRowCallback)(void* opaque, size_t y,
+                                           const void* row);
+
+/**
+ * Sets a pixel output callback that receives full rows in order, top to
+ * bottom. This is an alternative to @ref JxlDecoderSetImageOutCallback for
+ * users that stream the rows out, for example to an encoder of another format,
+ * and can be set at the same times. It is not available for the preview, nor
+ * together with @ref JxlDecoderFlushImage.
+ *
+ * Rows are delivered as soon as they and all the rows above them are decoded,
+ * so only the rows decoded ahead of the next one to deliver are kept by the
+ * decoder. These are at most about two rows of groups, unless the image is
+ * oriented upside down or the frame consists of a single section. The
+ * callback may be called from different threads, but never concurrently.
+ *
+ * When the callback returns ::JXL_FALSE, the decoder stops decoding more of
+ * the frame, and @ref JxlDecoderProcessInput returns
+ * ::JXL_DEC_IMAGE_OUT_PAUSED once the rows of the group row being decoded are
+ * done. The next call to @ref JxlDecoderProcessInput first delivers the rows
+ * that are due, and continues decoding unless the callback pauses again.
+ *
+ * @param dec decoder object
+ * @param format format of the pixels. Object owned by user; its contents are
+ *     copied internally.
+ * @param callback the callback function receiving the rows.
+ * @param opaque optional user data, which will be passed on to the callback,
+ *     may be NULL.
+ * @return ::JXL_DEC_SUCCESS on success, ::JXL_DEC_ERROR on error, such
+ *     as @ref JxlDecoderSetImageOutBuffer already set.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutRowCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutRowCallback callback, void* opaque);
+
+/**
+ * Layout of the planes of a @ref JxlPlanarImageOutBuffer. The samples are
+ * full range YCbCr, as in JFIF.
+ */
+typedef enum {
+  /** Separate Y, Cb and Cr planes of the size of the image.
+   */
+  JXL_PLANAR_YCBCR_444 = 0,
+  /** Separate Y, Cb and Cr planes, with Cb and Cr subsampled by 2 in both
+   * directions: they have ceil(xsize / 2) x ceil(ysize / 2) samples.
+   */
+  JXL_PLANAR_YCBCR_420 = 1,
+  /** A Y plane followed by a single plane of interleaved Cb and Cr samples,
+   * subsampled as for ::JXL_PLANAR_YCBCR_420. planes[2] is not used.
+   */
+  JXL_SEMIPLANAR_NV12 = 2,
+} JxlPlanarLayout;
+
+/**
+ * Planar output buffers, see @ref JxlDecoderSetImageOutPlanes. The buffers are
+ * owned by the caller.
+ */
+typedef struct {
+  /** Layout of the planes. */
+  JxlPlanarLayout layout;
+  /** Type of the samples, ::JXL_TYPE_UINT8 or ::JXL_TYPE_UINT16. */
+  JxlDataType data_type;
+  /** For ::JXL_TYPE_UINT16, the number of significant bits of the samples,
+   * between 9 and 16, stored in their most significant bits: for example 10
+   * with ::JXL_SEMIPLANAR_NV12 gives P010 and 12 gives P012. 0 means all the
+   * bits of data_type.
+   */
+  uint32_t bits_per_sample;
+  /** Endianness of ::JXL_TYPE_UINT16 samples. */
+  JxlEndianness endianness;
+  /** Y, Cb and Cr planes, or Y and CbCr planes for ::JXL_SEMIPLANAR_NV12. */
+  void* planes[3];
+  /** Length of a row of each plane in bytes, or 0 for rows without padding.
+   */
+  size_t strides[3];
+  /** Size of each plane in bytes. */
+  size_t plane_sizes[3];
+} JxlPlanarImageOutBuffer;
+
+/**
+ * Sets planar YCbCr buffers to write the full resolution image to, instead of
+ * an interleaved buffer as set by @ref JxlDecoderSetImageOutBuffer. This can be
+ * used at the same times as @ref JxlDecoderSetImageOutBuffer and replaces any
+ * image out buffer or callback of the current frame.
+ *
+ * The color channels, in the color space of @ref
+ * JxlDecoderGetColorAsEncodedProfile for ::JXL_COLOR_PROFILE_TARGET_DATA, are
+ * converted to YCbCr with the BT.601 matrix. Frames of recompressed JPEG
+ * images, which are already stored as YCbCr, are written without converting
+ * them to RGB and back. Extra channels, including alpha, are not written. The
+ * chroma sample of a block of 2x2 pixels in the subsampled layouts is the
+ * average of the four pixels of the block.
+ *
+ * Each plane must be at least as large as stride * (rows - 1) + row size,
+ * where the row size is the number of samples of a row times the size of a
+ * sample. Only the identity orientation is supported, so @ref
+ * JxlDecoderSetKeepOrientation must be enabled for images with another
+ * orientation. Downscaled output and extra channel buffers cannot be combined
+ * with planar output.
+ *
+ * @param dec decoder object
+ * @param buffer the planes to output the pixel data to. Object owned by user
+ *     and its contents are copied internally.
+ * @return ::JXL_DEC_SUCCESS on success, ::JXL_DEC_ERROR on error, such as
+ *     a plane that is too small or an unsupported orientation.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderSetImageOutPlanes(
+    JxlDecoder* dec, const JxlPlanarImageOutBuffer* buffer);
+
 /**
  * Returns the minimum size in bytes of an extra channel pixel buffer for the
  * given format. This is the buffer for @ref JxlDecoderSetExtraChannelBuffer.
@@ -1406,6 +1757,65 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeRaw(const JxlDecoder* dec,
 JXL_EXPORT JxlDecoderStatus JxlDecoderGetBoxSizeContents(const JxlDecoder* dec,
                                                          uint64_t* size);
 
+/**
+ * Location of a box of a container file, as found by @ref JxlIndexBoxes.
+ */
+typedef struct {
+  /** Type of the box, such as "Exif", "xml " or "jxlp".
+   */
+  JxlBoxType type;
+  /** For a "brob" box, the type of the compressed box, otherwise the same as
+   * @c type.
+   */
+  JxlBoxType decompressed_type;
+  /** Offset of the box header in the file.
+   */
+  uint64_t offset;
+  /** Size of the box header, 8 or 16 bytes not counting the 4 bytes of the
+   * type of a "brob" box.
+   */
+  uint64_t header_size;
+  /** Size of the box including its header, or 0 if the box extends to the end
+   * of the file.
+   */
+  uint64_t size;
+} JxlBoxIndexEntry;
+
+/**
+ * Lists the boxes of a container file from their headers, without reading
+ * their contents nor decoding the codestream. This only needs the bytes of
+ * the box headers, so a file that is accessed by range requests can be indexed
+ * with one small read per box, and only the boxes of interest read next.
+ *
+ * Each call parses the box headers found in @p data, which holds the bytes of
+ * the file from offset @p data_offset on, the first call starting at offset 0.
+ * Parsing stops at the first header that is not fully in @p data, after @p
+ * max_entries boxes, or after a box that extends to the end of the file.
+ * Contents of "jxlc", "jxlp" and other boxes are skipped, so they need not be
+ * in @p data. A bare codestream without container has no boxes.
+ *
+ * @param data bytes of the file starting at @p data_offset.
+ * @param size number of bytes in @p data.
+ * @param data_offset file offset of the first byte of @p data, which must be
+ *     the start of a box header, or 0.
+ * @param entries array receiving the boxes found.
+ * @param max_entries number of elements of @p entries.
+ * @param num_entries receives the number of boxes found.
+ * @param next_offset receives the file offset of the next box header to parse,
+ *     which may be past the end of @p data.
+ * @return ::JXL_DEC_SUCCESS if the last box of the file was found or the
+ *     codestream is bare, ::JXL_DEC_NEED_MORE_INPUT if more boxes may follow:
+ *     the caller can call again with the bytes from @p next_offset on, unless
+ *     the file ends there, and ::JXL_DEC_ERROR if the file is not a JPEG XL
+ *     file or a box header is invalid.
+ */
+JXL_EXPORT JxlDecoderStatus JxlIndexBoxes(const uint8_t* data, size_t size,
+                                          uint64_t data_offset,
+                                          JxlBoxIndexEntry* entries,
+                                          size_t max_entries,
+                                          size_t* num_entries,
+                                          uint64_t* next_offset);
+
 /**
  * Configures at which progressive steps in frame decoding these @ref
  * JXL_DEC_FRAME_PROGRESSION event occurs. The default value for the level
@@ -1439,6 +1849,14 @@ JXL_EXPORT size_t JxlDecoderGetIntendedDownsamplingRatio(JxlDecoder* dec);
  * JXL_DEC_NEED_MORE_INPUT, after the ::JXL_DEC_FRAME event already occurred
  * and before the ::JXL_DEC_FULL_IMAGE event occurred for a frame.
  *
+ * Flushes are incremental: only the groups of the image that were decoded
+ * further since the previous flush of the frame are rendered again, and passed
+ * to the image out callback if one is set. The other groups keep the pixels of
+ * that flush in the output buffer.
+ *
+ * With @ref JxlDecoderSetOutputDownsampling, the partial image is flushed to
+ * the downsampled output buffer.
+ *
  * @param dec decoder object
  * @return ::JXL_DEC_SUCCESS if image data was flushed to the output buffer,
  *     or ::JXL_DEC_ERROR when no flush was done, e.g. if not enough image
@@ -1448,6 +1866,31 @@ JXL_EXPORT size_t JxlDecoderGetIntendedDownsamplingRatio(JxlDecoder* dec);
  */
 JXL_EXPORT JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec);
 
+/**
+ * Renders a region of the current frame, decoded with @ref
+ * JxlDecoderSetRenderOnDemand, into the buffer set with @ref
+ * JxlDecoderSetImageOutBuffer and the extra channel buffers. Rendering is done
+ * by group, so pixels around the region may be rendered too, and the groups
+ * rendered by a previous call are not rendered again.
+ *
+ * The region is given in the coordinates of the output image, like the one of
+ * @ref JxlDecoderSetCropRegion. Can be called after the ::JXL_DEC_FULL_IMAGE
+ * event of the frame, until the next call to @ref JxlDecoderProcessInput. The
+ * output buffers must still be valid.
+ *
+ * @param dec decoder object
+ * @param x0 left edge of the region.
+ * @param y0 top edge of the region.
+ * @param xsize width of the region.
+ * @param ysize height of the region.
+ * @return ::JXL_DEC_SUCCESS if the region was rendered, ::JXL_DEC_ERROR if
+ *     the frame was not decoded with rendering on demand, or is not complete.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderRenderRegion(JxlDecoder* dec,
+                                                   uint32_t x0, uint32_t y0,
+                                                   uint32_t xsize,
+                                                   uint32_t ysize);
+
 /**
  * Sets the bit depth of the output buffer or callback.
  *
@@ -1463,6 +1906,62 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec);
 JXL_EXPORT JxlDecoderStatus
 JxlDecoderSetImageOutBitDepth(JxlDecoder* dec, const JxlBitDepth* bit_depth);
 
+/**
+ * One image of a @ref JxlDecoderDecodeBatch call.
+ */
+typedef struct {
+  /** Complete JPEG XL file or codestream of the image. */
+  const uint8_t* data;
+  /** Size of data in bytes. */
+  size_t size;
+  /** Format of the pixels written to buffer. */
+  JxlPixelFormat format;
+  /** Output buffer for the pixels of the first frame, see @ref
+   * JxlDecoderSetImageOutBuffer. May be NULL to only get the dimensions.
+   */
+  void* buffer;
+  /** Size of buffer in bytes. */
+  size_t buffer_size;
+  /** Output: dimensions of the image, as in @ref JxlBasicInfo, set as soon as
+   * the basic info of the image could be decoded.
+   */
+  uint32_t xsize;
+  uint32_t ysize;
+  /** Output: ::JXL_DEC_SUCCESS if the image was decoded into buffer,
+   * ::JXL_DEC_NEED_IMAGE_OUT_BUFFER if buffer was NULL or too small, in which
+   * case the call can be repeated with a large enough buffer, or
+   * ::JXL_DEC_ERROR if the image could not be decoded.
+   */
+  JxlDecoderStatus status;
+} JxlDecoderBatchImage;
+
+/**
+ * Decodes the first frame of each of the images into its buffer, as a
+ * decoder with default settings and the ::JXL_DEC_FULL_IMAGE event would.
+ *
+ * This is meant for many small images, for which creating or resetting a
+ * decoder per image is expensive and which are too small to keep the threads
+ * of a runner busy on their own: the images are decoded in parallel, one per
+ * thread, by decoders that are reused for all the images the thread decodes.
+ * The groups of a single image are therefore not decoded in parallel.
+ *
+ * @param memory_manager custom allocator function. It may be NULL. The memory
+ *     manager will be copied internally.
+ * @param parallel_runner function pointer to runner for multithreading. It may
+ *     be NULL to use the default, single-threaded, runner.
+ * @param parallel_runner_opaque opaque pointer for parallel_runner.
+ * @param images the images to decode; their status and dimensions are set by
+ *     this function.
+ * @param num_images number of images.
+ * @return ::JXL_DEC_SUCCESS if all the images were decoded, ::JXL_DEC_ERROR if
+ *     the status of any image is not ::JXL_DEC_SUCCESS or the decoders could
+ *     not be created.
+ */
+JXL_EXPORT JxlDecoderStatus JxlDecoderDecodeBatch(
+    const JxlMemoryManager* memory_manager, JxlParallelRunner parallel_runner,
+    void* parallel_runner_opaque, JxlDecoderBatchImage* images,
+    size_t num_images);
+
 #ifdef __cplusplus
 }
 #endif
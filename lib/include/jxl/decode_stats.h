@@ -0,0 +1,217 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_decoder
+ * @{
+ * @file decode_stats.h
+ * @brief API to collect the time spent by the JXL decoder in each phase, and
+ * optionally counts of events such as cache misses.
+ */
+
+#ifndef JXL_DECODE_STATS_H_
+#define JXL_DECODE_STATS_H_
+
+#include <jxl/jxl_export.h>
+#include <jxl/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Opaque structure that holds the decoder statistics.
+ *
+ * Allocated and initialized with @ref JxlDecoderStatsCreate().
+ * Cleaned up and deallocated with @ref JxlDecoderStatsDestroy().
+ */
+typedef struct JxlDecoderStatsStruct JxlDecoderStats;
+
+/**
+ * Creates an instance of JxlDecoderStats and initializes it.
+ *
+ * @return pointer to initialized @ref JxlDecoderStats instance
+ */
+JXL_EXPORT JxlDecoderStats* JxlDecoderStatsCreate(void);
+
+/**
+ * Deinitializes and frees JxlDecoderStats instance.
+ *
+ * @param stats instance to be cleaned up and deallocated. No-op if stats is
+ * null pointer.
+ */
+JXL_EXPORT void JxlDecoderStatsDestroy(JxlDecoderStats* stats);
+
+/** Data type for querying @ref JxlDecoderStats object. Times are in
+ * nanoseconds; the times of work done on several threads are summed over the
+ * threads.
+ */
+typedef enum {
+  /** Wall time spent in @ref JxlDecoderProcessInput.
+   */
+  JXL_DEC_STAT_TOTAL_NS,
+  /** Time spent decoding the DC global section of the frames.
+   */
+  JXL_DEC_STAT_DC_GLOBAL_NS,
+  /** Time spent decoding the DC groups, including the rendering they do.
+   */
+  JXL_DEC_STAT_DC_GROUPS_NS,
+  /** Time spent decoding the AC global section of the frames.
+   */
+  JXL_DEC_STAT_AC_GLOBAL_NS,
+  /** Time spent decoding the AC groups, including the rendering they do.
+   */
+  JXL_DEC_STAT_AC_GROUPS_NS,
+  /** Time spent finishing the frames once all their groups are decoded.
+   */
+  JXL_DEC_STAT_FINALIZE_NS,
+  /** Time spent in the stages of the render pipeline, see @ref
+   * JxlDecoderStatsStageTime.
+   */
+  JXL_DEC_STAT_RENDER_NS,
+  /** Time spent converting colors with the CMS.
+   */
+  JXL_DEC_STAT_CMS_NS,
+  /** Time spent writing the output, including in the image out callbacks.
+   */
+  JXL_DEC_STAT_OUTPUT_NS,
+  /** Bytes allocated through the memory manager of the decoder, summed over
+   * the allocations.
+   */
+  JXL_DEC_STAT_BYTES_ALLOCATED,
+  /** Highest number of bytes allocated through the memory manager of the
+   * decoder at any time.
+   */
+  JXL_DEC_STAT_PEAK_BYTES,
+  JXL_DEC_NUM_STATS,
+} JxlDecoderStatsKey;
+
+/** Returns the value of the statistics corresponding the given key.
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param key the particular statistics to query
+ *
+ * @return the value of the statistics
+ */
+JXL_EXPORT uint64_t JxlDecoderStatsGet(const JxlDecoderStats* stats,
+                                       JxlDecoderStatsKey key);
+
+/** Returns the number of render pipeline stages that ran, counting the stages
+ * with the same name once.
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ *
+ * @return the number of stages
+ */
+JXL_EXPORT size_t JxlDecoderStatsNumStages(const JxlDecoderStats* stats);
+
+/** Returns the name of a render pipeline stage, such as "EPF0" or "Cms".
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param index index of the stage, smaller than @ref JxlDecoderStatsNumStages
+ *
+ * @return the name of the stage, valid until @p stats is destroyed, or NULL if
+ *   @p index is out of range
+ */
+JXL_EXPORT const char* JxlDecoderStatsStageName(const JxlDecoderStats* stats,
+                                                size_t index);
+
+/** Returns the time spent in a render pipeline stage, in nanoseconds summed
+ * over the threads.
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param index index of the stage, smaller than @ref JxlDecoderStatsNumStages
+ *
+ * @return the time spent in the stage, or 0 if @p index is out of range
+ */
+JXL_EXPORT uint64_t JxlDecoderStatsStageTime(const JxlDecoderStats* stats,
+                                             size_t index);
+
+/** Maximum number of counters for @ref JxlDecoderStatsSetCounters.
+ */
+#define JXL_DEC_STATS_MAX_COUNTERS 8
+
+/**
+ * Function type for @ref JxlDecoderStatsSetCounters. Writes the current values
+ * of the counters of the calling thread to @p values, one per counter. The
+ * counters must only increase, and may be read concurrently from several
+ * threads.
+ *
+ * @param opaque user supplied parameter, passed to @ref
+ *   JxlDecoderStatsSetCounters
+ * @param values output for the values of the counters
+ */
+typedef void (*JxlDecoderStatsCounterReader)(void* opaque, uint64_t* values);
+
+/** Makes the decoder also measure user supplied counters, such as hardware
+ * performance counters, in each phase and render pipeline stage, by reading
+ * them with @p reader at the start and the end of each. Must be called before
+ * @ref JxlDecoderCollectStats.
+ *
+ * @param stats object that will be passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param num_counters number of counters, at most @ref
+ *   JXL_DEC_STATS_MAX_COUNTERS, or 0 to measure no counters
+ * @param reader function that reads the counters
+ * @param opaque user supplied parameter for @p reader
+ *
+ * @return JXL_TRUE on success, JXL_FALSE if @p num_counters is too large or
+ *   @p reader is NULL while @p num_counters is not 0
+ */
+JXL_EXPORT JXL_BOOL JxlDecoderStatsSetCounters(
+    JxlDecoderStats* stats, size_t num_counters,
+    JxlDecoderStatsCounterReader reader, void* opaque);
+
+/** Returns the increase of a counter set with @ref JxlDecoderStatsSetCounters
+ * during the time of a statistics, summed over the threads.
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param key one of the time statistics, from @ref JXL_DEC_STAT_TOTAL_NS to
+ *   @ref JXL_DEC_STAT_OUTPUT_NS
+ * @param counter index of the counter
+ *
+ * @return the increase of the counter, or 0 if @p key is not a time or
+ *   @p counter is out of range
+ */
+JXL_EXPORT uint64_t JxlDecoderStatsGetCounter(const JxlDecoderStats* stats,
+                                              JxlDecoderStatsKey key,
+                                              size_t counter);
+
+/** Returns the increase of a counter set with @ref JxlDecoderStatsSetCounters
+ * in a render pipeline stage, summed over the threads.
+ *
+ * @param stats object that was passed to the decoder with @ref
+ *   JxlDecoderCollectStats
+ * @param index index of the stage, smaller than @ref JxlDecoderStatsNumStages
+ * @param counter index of the counter
+ *
+ * @return the increase of the counter, or 0 if @p index or @p counter is out
+ *   of range
+ */
+JXL_EXPORT uint64_t JxlDecoderStatsStageCounter(const JxlDecoderStats* stats,
+                                                size_t index, size_t counter);
+
+/** Updates the values of the given stats object with that of an other.
+ *
+ * @param stats object whose values will be updated (usually added together)
+ * @param other stats object whose values will be merged with stats
+ */
+JXL_EXPORT void JxlDecoderStatsMerge(JxlDecoderStats* stats,
+                                     const JxlDecoderStats* other);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JXL_DECODE_STATS_H_ */
+
+/** @}*/
@@ -56,6 +56,15 @@ typedef struct JxlEncoderStruct JxlEncoder;
  */
 typedef struct JxlEncoderFrameSettingsStruct JxlEncoderFrameSettings;
 
+/**
+ * Analysis of an image that does not depend on the distance, shared by the
+ * encodes of the same image at several distances.
+ *
+ * Allocated and initialized with @ref JxlEncoderAnalysisCacheCreate().
+ * Cleaned up and deallocated with @ref JxlEncoderAnalysisCacheDestroy().
+ */
+typedef struct JxlEncoderAnalysisCacheStruct JxlEncoderAnalysisCache;
+
 /**
  * Return value for multiple encoder functions.
  */
@@ -132,8 +141,13 @@ typedef enum {
   JXL_ENC_FRAME_SETTING_EFFORT = 0,
 
   /** Sets the decoding speed tier for the provided options. Minimum is 0
-   * (slowest to decode, best quality/density), and maximum is 4 (fastest to
-   * decode, at the cost of some quality/density). Default is 0.
+   * (slowest to decode, best quality/density), and maximum is 5 (fastest to
+   * decode, at the cost of some quality/density). At 4, the entropy coding
+   * uses prefix codes instead of ANS. At 5, which bounds the work of the
+   * decoder on each pixel, VarDCT frames also only use the 8x8, 8x16, 16x8
+   * and 16x16 DCTs, and no loop filters, even if
+   * ::JXL_ENC_FRAME_SETTING_EPF or ::JXL_ENC_FRAME_SETTING_GABORISH ask for
+   * them. Default is 0.
    */
   JXL_ENC_FRAME_SETTING_DECODING_SPEED = 1,
 
@@ -209,7 +223,10 @@ typedef enum {
 
   /** Determines the order in which 256x256 regions are stored in the codestream
    * for progressive rendering. Use -1 for the encoder
-   * default, 0 for scanline order, 1 for center-first order.
+   * default, 0 for scanline order, 1 for center-first order, 2 for
+   * saliency-first order, where the regions that the adaptive quantization
+   * of VarDCT frames finds the most sensitive come first. Frames without
+   * adaptive quantization use the center-first order instead.
    */
   JXL_ENC_FRAME_SETTING_GROUP_ORDER = 13,
 
@@ -311,7 +328,10 @@ typedef enum {
   JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS = 29,
 
   /** Enable or disable CFL (chroma-from-luma) for lossless JPEG recompression.
-   * -1 = default, 0 = disable CFL, 1 = enable CFL.
+   * -1 = default, 0 = disable CFL, 1 = enable CFL. By default, CFL is enabled
+   * except at efforts 1 and 2, which make a fast recompression mode: no CFL,
+   * static coefficient orders and a fixed histogram clustering. The
+   * recompressed JPEG is reconstructed exactly at every effort.
    */
   JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL = 30,
 
@@ -393,6 +413,119 @@ typedef enum {
    */
   JXL_ENC_FRAME_SETTING_DISABLE_PERCEPTUAL_HEURISTICS = 39,
 
+  /** Approximate size in bytes that lossy VarDCT frames should not exceed.
+   * The encoder runs its heuristics once at the distance that was set, then
+   * scales the quantization of the AC coefficients until the frame gets close
+   * to this size. Ignored for lossless, modular and recompressed JPEG frames,
+   * and for frames with progressive DC. Setting this disables streaming
+   * encoding. 0 or -1 = disabled (default).
+   */
+  JXL_ENC_FRAME_SETTING_TARGET_SIZE = 40,
+
+  /** Content-adaptive effort for lossy VarDCT frames. If enabled, the parts of
+   * the frame that are much flatter than the rest choose their block sizes
+   * and their color correlation with the searches of an effort up to two
+   * lower, but not lower than 5, which makes slow efforts cheaper on images
+   * with large flat areas. Has no effect at effort 5 and below.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT = 41,
+
+  /** Reuse the prefix codes of the previous lossless frame encoded at effort 1
+   * for this lossless frame at effort 1, instead of sampling the frame to
+   * build new ones. This makes the encoding of animations whose frames have
+   * similar content, such as screen recordings, faster. The codes are not
+   * reused if the frames have a different number of channels, or if either
+   * of them uses a palette.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_FAST_LOSSLESS_REUSE_CODES = 42,
+
+  /** Decoding time to aim for, in nanoseconds per pixel on one thread, as
+   * estimated by a model of the decoder. Lossy VarDCT frames drop passes of
+   * the edge-preserving filter and then Gaborish, if they were not set
+   * explicitly, and modular frames learn their MA tree again without the
+   * weighted predictor, if no predictor was set, until the estimate fits. The
+   * budget is a target, not a guarantee: frames that cannot fit it are
+   * encoded as best they can. Use this more precise budget instead of
+   * ::JXL_ENC_FRAME_SETTING_DECODING_SPEED, or on top of it.
+   * Float option, 0 or -1 = disabled (default).
+   */
+  JXL_ENC_FRAME_SETTING_DECODING_BUDGET = 43,
+
+  /** How the encoder allocates the buffers of 16 MiB or more, such as the
+   * planes of large images, while encoding this frame. Bit 0 asks the OS to
+   * back them with transparent huge pages, which makes the passes over
+   * columns of very large images faster, and bit 1 faults their pages in when
+   * they are allocated, in parallel on the parallel runner of the encoder,
+   * rather than one page at a time later. Both only apply where the OS
+   * supports them, and may increase the memory use.
+   * -1 or 0 = neither (default), 1 = huge pages, 2 = pre-faulting, 3 = both.
+   */
+  JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS = 44,
+
+  /** Read the pixels of this frame straight from the buffers given to
+   * @ref JxlEncoderAddImageFrame and @ref JxlEncoderSetExtraChannelBuffer,
+   * instead of copying them first, which saves the memory of a copy of the
+   * frame. The caller must then keep the buffers valid and unchanged until
+   * the frame is encoded, i.e. until @ref JxlEncoderProcessOutput returns
+   * ::JXL_ENC_SUCCESS after the frames are closed, until
+   * @ref JxlEncoderFlushInput returns, or until the encoder is reset or
+   * destroyed. Does not apply to @ref JxlEncoderAddChunkedFrame.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS = 45,
+
+  /** Record where the DC, each progressive pass and each group of this frame
+   * end in the codestream, in a jxpi box stored after the last frame, so that
+   * a server can find the prefix of the file to send for a given level of
+   * progression without parsing the codestream. Enabling it makes the encoder
+   * use the container, and must then be done before any output is written.
+   * The box holds varints, like the frame index box: the number of indexed
+   * frames, then for each of them its offset in the codestream, the end of its
+   * DC, the number of passes and the end of each, and the number of sections
+   * and the start of each in the order of the TOC, all relative to the offset
+   * of the frame. Offsets count the codestream bytes only, without the headers
+   * of the jxlp boxes.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_PROGRESSION_INDEX_BOX = 46,
+
+  /** Compare large images approximately in the butteraugli iterations of
+   * efforts 8 and above: at half resolution, and at full resolution only in
+   * sampled tiles that calibrate the rest of the comparison. This makes these
+   * efforts faster on large images, at the cost of a less exact adaptive
+   * quantization.
+   * -1 = default (off), 0 = off, 1 = on.
+   */
+  JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI = 47,
+
+  /** Reuse the coefficient orders and the clustering of the AC histograms of
+   * the previous lossy frame of this encoder that used this setting, when
+   * this frame has the same size and similar block types and histograms,
+   * instead of computing them again. This makes the encoding of animations
+   * whose frames have similar content faster, and may make them slightly
+   * larger. Frames that use this setting are not encoded concurrently, see
+   * @ref JxlEncoderSetMaxFramesInFlight, and frames encoded in streaming mode
+   * neither use nor update what is reused.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING = 48,
+
+  /** Reuse the MA trees and histograms of the first lossless modular frame of
+   * this encoder that used this setting for this frame, instead of learning
+   * new ones. Frames that learn a tree per group reuse those of the groups at
+   * the same position, if they have the same size in groups as the first
+   * frame. The trees are kept when the encoder is reset, so that a batch of
+   * similar images encoded with the same encoder shares them. This makes the
+   * encoding faster, at the cost of a larger size if the images differ.
+   * Frames that use this setting are not encoded concurrently, see
+   * @ref JxlEncoderSetMaxFramesInFlight, and frames encoded in streaming mode
+   * neither use nor fill the trees.
+   * 0 = disabled (default), 1 = enabled.
+   */
+  JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE = 49,
+
   /** Enum value not to be used as an option. This value is added to force the
    * C compiler to have the enum to take a known size.
    */
@@ -419,10 +552,36 @@ JXL_EXPORT JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager);
  * another image. All state and settings are reset as if the object was
  * newly created with @ref JxlEncoderCreate, but the memory manager is kept.
  *
+ * The memory that the encoder used for the intermediate buffers of the last
+ * frame is also kept, and reused for the frames of the next image, until the
+ * encoder is destroyed. So are the color transforms that its frames needed,
+ * for the next images with the same color profiles, unless another CMS is set
+ * with @ref JxlEncoderSetCms. See also @ref JxlEncoderPrewarm.
+ *
  * @param enc instance to be re-initialized.
  */
 JXL_EXPORT void JxlEncoderReset(JxlEncoder* enc);
 
+/**
+ * Prepares the encoder for frames of the current image that are encoded with
+ * @p frame_settings, by encoding a synthetic frame of the size that they
+ * would have and discarding it. The memory of its intermediate buffers and
+ * its color transforms are then kept as when a real frame is done, so that
+ * the first real frame does not have to allocate or create them, also after
+ * @ref JxlEncoderReset. This does not add a frame, nor write any output.
+ *
+ * May be called after @ref JxlEncoderSetBasicInfo and, if it is not sRGB,
+ * @ref JxlEncoderSetColorEncoding or @ref JxlEncoderSetICCProfile. A service
+ * that encodes many images of the same size and settings can call it once,
+ * and then reset the encoder after each image.
+ *
+ * @param frame_settings settings of the frames to prepare for.
+ * @return ::JXL_ENC_SUCCESS if the encoder was prepared, ::JXL_ENC_ERROR
+ * otherwise.
+ */
+JXL_EXPORT JxlEncoderStatus
+JxlEncoderPrewarm(const JxlEncoderFrameSettings* frame_settings);
+
 /**
  * Deinitializes and frees a @ref JxlEncoder instance.
  *
@@ -457,6 +616,28 @@ JXL_EXPORT JxlEncoderStatus
 JxlEncoderSetParallelRunner(JxlEncoder* enc, JxlParallelRunner parallel_runner,
                             void* parallel_runner_opaque);
 
+/**
+ * Sets how many frames the encoder may encode at the same time. With a value
+ * larger than 1 and a parallel runner set, the encoder encodes several of the
+ * frames queued with @ref JxlEncoderAddImageFrame concurrently, so that the
+ * threads stay busy across frame boundaries, for example for animations with
+ * small frames. The frames are still written in the order they were added and
+ * the output is the same as with a value of 1, but up to this many encoded
+ * frames are buffered in memory until they can be written.
+ *
+ * Frames added with @ref JxlEncoderAddJPEGFrame, frames added with @ref
+ * JxlEncoderAddChunkedFrame in streaming mode, and frames for which statistics
+ * are collected, are always encoded one at a time.
+ *
+ * @param enc encoder object.
+ * @param max_frames_in_flight maximum number of frames encoded concurrently.
+ *        The default is 1.
+ * @return ::JXL_ENC_SUCCESS if the value was set, ::JXL_ENC_ERROR if
+ * max_frames_in_flight is 0.
+ */
+JXL_EXPORT JxlEncoderStatus
+JxlEncoderSetMaxFramesInFlight(JxlEncoder* enc, size_t max_frames_in_flight);
+
 /**
  * Get the (last) error code in case ::JXL_ENC_ERROR was returned.
  *
@@ -691,7 +872,8 @@ JxlEncoderAddJPEGFrame(const JxlEncoderFrameSettings* frame_settings,
  * @param pixel_format format for pixels. Object owned by the caller and its
  * contents are copied internally.
  * @param buffer buffer type to input the pixel data from. Owned by the caller
- * and its contents are copied internally.
+ * and its contents are copied internally, unless
+ * ::JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS is set.
  * @param size size of buffer in bytes. This size should match what is implied
  * by the frame dimensions and the pixel format.
  * @return ::JXL_ENC_SUCCESS on success, ::JXL_ENC_ERROR on error
@@ -975,7 +1157,8 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderAddChunkedFrame(
  * contents are copied internally. The num_channels value is ignored, since the
  * number of channels for an extra channel is always assumed to be one.
  * @param buffer buffer type to input the pixel data from. Owned by the caller
- * and its contents are copied internally.
+ * and its contents are copied internally, unless
+ * ::JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS is set.
  * @param size size of buffer in bytes. This size should match what is implied
  * by the frame dimensions and the pixel format.
  * @param index index of the extra channel to use.
@@ -1514,6 +1697,49 @@ JXL_EXPORT float JxlEncoderDistanceFromQuality(float quality);
 JXL_EXPORT JxlEncoderFrameSettings* JxlEncoderFrameSettingsCreate(
     JxlEncoder* enc, const JxlEncoderFrameSettings* source);
 
+/**
+ * Creates an analysis cache, for encoding the same image at several distances,
+ * for example to produce several qualities of it. The encodes that are given
+ * the cache with @ref JxlEncoderFrameSettingsSetAnalysisCache reuse the
+ * conversion to XYB and the distance independent parts of the adaptive
+ * quantization of the first one, which gives the same codestreams as encoding
+ * without the cache.
+ *
+ * The cache is keyed on the pixels and color encoding of the frame: a frame
+ * with another content replaces the analysis in the cache, so giving the cache
+ * to the encode of a different image is slower but still correct. It is only
+ * used for lossy VarDCT frames, and not in streaming mode (see @ref
+ * JXL_ENC_FRAME_SETTING_BUFFERING), which encoders given a cache do not use.
+ * The other frame settings should be the same for all the encodes, and a cache
+ * must not be used by two encoders at the same time.
+ *
+ * @param memory_manager custom allocator for the analysis, which can outlive
+ * the encoders that fill it, or NULL to use the default allocator.
+ * @return the new cache, or NULL if the allocation failed.
+ */
+JXL_EXPORT JxlEncoderAnalysisCache* JxlEncoderAnalysisCacheCreate(
+    const JxlMemoryManager* memory_manager);
+
+/**
+ * Deallocates an analysis cache. The frame settings that were given the cache
+ * still hold the analysis until they are destroyed or reset.
+ *
+ * @param cache the cache, or NULL.
+ */
+JXL_EXPORT void JxlEncoderAnalysisCacheDestroy(JxlEncoderAnalysisCache* cache);
+
+/**
+ * Makes the frames encoded with @p frame_settings use @p cache, see @ref
+ * JxlEncoderAnalysisCacheCreate.
+ *
+ * @param frame_settings set of options and metadata for this frame. Also
+ * includes reference to the encoder object.
+ * @param cache the cache, or NULL to not use one.
+ * @return ::JXL_ENC_SUCCESS on success, ::JXL_ENC_ERROR otherwise.
+ */
+JXL_EXPORT JxlEncoderStatus JxlEncoderFrameSettingsSetAnalysisCache(
+    JxlEncoderFrameSettings* frame_settings, JxlEncoderAnalysisCache* cache);
+
 /**
  * Sets a color encoding to be sRGB.
  *
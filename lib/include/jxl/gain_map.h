@@ -62,6 +62,29 @@ typedef struct {
   const uint8_t* gain_map;
 } JxlGainMapBundle;
 
+/**
+ * Parameters of a gain map for @ref JxlDecoderSetGainMap, as given by the
+ * metadata that ISO 21496-1 defines. The gain map goes from the base image to
+ * the alternate image; for each color channel c, a value g in [0, 1] of the
+ * gain map turns a linear color p of the base image into
+ *
+ *   (p + base_offset[c]) * 2^(w * (gain_map_min[c] + g^(1 / gamma[c]) *
+ *   (gain_map_max[c] - gain_map_min[c]))) - alternate_offset[c]
+ *
+ * where the weight w in [0, 1] of the gain map is given by where the HDR
+ * headroom of the display lies between base_hdr_headroom and
+ * alternate_hdr_headroom. The gain and headroom values are log2 values.
+ */
+typedef struct {
+  float gain_map_min[3];
+  float gain_map_max[3];
+  float gamma[3];
+  float base_offset[3];
+  float alternate_offset[3];
+  float base_hdr_headroom;
+  float alternate_hdr_headroom;
+} JxlGainMapParams;
+
 /**
  * Calculates the total size required to serialize the gain map bundle into a
  * binary buffer. This function accounts for all the necessary space to
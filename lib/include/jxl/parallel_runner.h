@@ -37,6 +37,7 @@
 #ifndef JXL_PARALLEL_RUNNER_H_
 #define JXL_PARALLEL_RUNNER_H_
 
+#include <jxl/jxl_export.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -128,6 +129,56 @@ typedef JxlParallelRetCode (*JxlParallelRunner)(
     void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
     JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
 
+/** Callbacks receiving the events of a parallel runner, to trace how long its
+ * tasks take and how long its worker threads wait for work. Runners of the
+ * jpegxl_threads library accept them with
+ * @ref JxlThreadParallelRunnerSetTracer and
+ * @ref JxlResizableParallelRunnerSetTracer. Any of the callbacks may be @c
+ * NULL. They are called synchronously, possibly concurrently from all threads
+ * of the runner, so they must be thread-safe and should be cheap.
+ */
+typedef struct {
+  /** Opaque pointer passed to all the callbacks. */
+  void* opaque;
+
+  /** Called on the thread calling the runner, before any task of the call
+   * runs. @p run_id identifies the call among the calls of the same runner.
+   * @ref JxlParallelRunTag returns the library stage making the call.
+   */
+  void (*run_begin)(void* opaque, uint64_t run_id, uint32_t start_range,
+                    uint32_t end_range, size_t num_threads);
+
+  /** Called on the thread calling the runner once all tasks of the call are
+   * done.
+   */
+  void (*run_end)(void* opaque, uint64_t run_id);
+
+  /** Called on the thread with number @p thread right before it runs @p task
+   * of call @p run_id.
+   */
+  void (*task_begin)(void* opaque, uint64_t run_id, uint32_t task,
+                     size_t thread);
+
+  /** Called on the thread with number @p thread right after it ran @p task of
+   * call @p run_id.
+   */
+  void (*task_end)(void* opaque, uint64_t run_id, uint32_t task,
+                   size_t thread);
+
+  /** Called on a worker thread with number @p thread when it gets new work
+   * after having waited for @p wait_ns nanoseconds.
+   */
+  void (*wait)(void* opaque, size_t thread, uint64_t wait_ns);
+} JxlParallelRunnerTracer;
+
+/** Returns the name of the stage of the JPEG XL library, for example
+ * "DecodeGroup", which is making the @ref JxlParallelRunner call running on
+ * the calling thread, or @c NULL if there is none. The name is a static
+ * string. Meant to be called from the @c run_begin callback of a
+ * ::JxlParallelRunnerTracer, or from a custom runner.
+ */
+JXL_EXPORT const char* JxlParallelRunTag(void);
+
 /* The following is an example of a @ref JxlParallelRunner that doesn't use any
  * multi-threading. Note that this implementation doesn't store any state
  * between multiple calls of the ExampleSequentialRunner function, so the
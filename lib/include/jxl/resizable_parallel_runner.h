@@ -33,6 +33,7 @@
 #include <jxl/jxl_threads_export.h>
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
+#include <jxl/types.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -59,6 +60,73 @@ JXL_THREADS_EXPORT void* JxlResizableParallelRunnerCreate(
 JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetThreads(
     void* runner_opaque, size_t num_threads);
 
+/** Pins worker thread @c i of the runner to the CPU @c cpus[i % num_cpus].
+ * This also applies to workers created by later calls to
+ * @ref JxlResizableParallelRunnerSetThreads. The calling thread, which also
+ * runs tasks, is not affected. Must not be called concurrently with
+ * @ref JxlResizableParallelRunner on the same runner.
+ *
+ * @param runner_opaque the runner.
+ * @param cpus array of @p num_cpus CPU indices, as numbered by the OS.
+ * @param num_cpus number of CPU indices, must be positive.
+ * @return ::JXL_TRUE on success.
+ * @return ::JXL_FALSE if the platform does not support thread affinity or any
+ * of the CPUs can not be used.
+ */
+JXL_THREADS_EXPORT JXL_BOOL JxlResizableParallelRunnerSetCpuAffinity(
+    void* runner_opaque, const uint32_t* cpus, size_t num_cpus);
+
+/** Restricts all worker threads of the runner, including the ones created by
+ * later calls to @ref JxlResizableParallelRunnerSetThreads, to the CPUs of NUMA
+ * node @p node. Must not be called concurrently with
+ * @ref JxlResizableParallelRunner on the same runner.
+ *
+ * @return ::JXL_TRUE on success.
+ * @return ::JXL_FALSE if the node does not exist or the platform does not
+ * support thread affinity.
+ */
+JXL_THREADS_EXPORT JXL_BOOL
+JxlResizableParallelRunnerSetNumaNode(void* runner_opaque, uint32_t node);
+
+/** Enables or disables autotuning of the number of active threads. When
+ * enabled, every @ref JxlResizableParallelRunner call uses at most the number
+ * of threads set by @ref JxlResizableParallelRunnerSetThreads, but fewer if
+ * the call or the frame described by @ref JxlResizableParallelRunnerSetWorkload
+ * has too little work to amortize waking up more threads. Threads that are not
+ * needed by a call stay idle. Disabled by default. Must not be called
+ * concurrently with @ref JxlResizableParallelRunner on the same runner.
+ *
+ * @param runner_opaque the runner.
+ * @param enabled ::JXL_TRUE to enable autotuning.
+ */
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetAutotune(
+    void* runner_opaque, JXL_BOOL enabled);
+
+/** Describes the frames that the next @ref JxlResizableParallelRunner calls
+ * work on, for autotuning. Without this, autotuning only looks at the number
+ * of tasks of each call. Must not be called concurrently with
+ * @ref JxlResizableParallelRunner on the same runner.
+ *
+ * @param runner_opaque the runner.
+ * @param xsize width of the frame.
+ * @param ysize height of the frame.
+ * @param modular ::JXL_TRUE if the frame is encoded with modular mode,
+ *        ::JXL_FALSE for VarDCT.
+ * @param effort encoder effort (1-10) when encoding, 0 when decoding.
+ */
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetWorkload(
+    void* runner_opaque, uint64_t xsize, uint64_t ysize, JXL_BOOL modular,
+    uint32_t effort);
+
+/** Sets the tracer receiving the events of the runner, or disables tracing if
+ * @p tracer is @c NULL. The tracer is copied. The calling thread of
+ * @ref JxlResizableParallelRunner has thread number 0, worker threads the
+ * following ones. Must not be called concurrently with
+ * @ref JxlResizableParallelRunner on the same runner.
+ */
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetTracer(
+    void* runner_opaque, const JxlParallelRunnerTracer* tracer);
+
 /** Suggests a number of threads to use for an image of given size.
  */
 JXL_THREADS_EXPORT uint32_t
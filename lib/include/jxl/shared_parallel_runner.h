@@ -0,0 +1,106 @@
+/* Copyright (c) the JPEG XL Project Authors. All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file.
+ */
+
+/** @addtogroup libjxl_threads
+ * @{
+ * @file shared_parallel_runner.h
+ * @brief implementation using std::thread of a ::JxlParallelRunner whose
+ * worker threads are shared by many encoder and decoder instances.
+ */
+
+/** Implementation of JxlParallelRunner that lets many JPEG XL encoder and
+ * decoder instances share a single, process-wide set of worker threads.
+ *
+ * A pool, created with @ref JxlSharedParallelRunnerPoolCreate, owns the worker
+ * threads. Every encoder or decoder instance gets its own lightweight runner
+ * from @ref JxlSharedParallelRunnerCreate, which is used as the opaque runner
+ * of @ref JxlSharedParallelRunner. Calls from different runners of the same
+ * pool may happen concurrently from different threads; only one concurrent
+ * @ref JxlSharedParallelRunner call per runner is allowed at a time.
+ *
+ * Every runner has a priority. Whenever a worker thread picks up new work, it
+ * picks it from the call with the highest priority, and among those from the
+ * oldest one. The thread calling @ref JxlSharedParallelRunner also runs tasks
+ * of its own call, so that every call makes progress even when all workers
+ * are busy with calls of higher priority.
+ */
+
+#ifndef JXL_SHARED_PARALLEL_RUNNER_H_
+#define JXL_SHARED_PARALLEL_RUNNER_H_
+
+#include <jxl/jxl_threads_export.h>
+#include <jxl/memory_manager.h>
+#include <jxl/parallel_runner.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Default priority of the runners created by
+ * @ref JxlSharedParallelRunnerCreate. Larger values are more urgent.
+ */
+#define JXL_SHARED_PARALLEL_RUNNER_DEFAULT_PRIORITY (0)
+
+/** Parallel runner internally using the worker threads of a shared pool. Use
+ * as @ref JxlParallelRunner, with a runner created by
+ * @ref JxlSharedParallelRunnerCreate as the opaque runner.
+ */
+JXL_THREADS_EXPORT JxlParallelRetCode JxlSharedParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range);
+
+/** Creates a pool of worker threads to be shared by the runners created by
+ * @ref JxlSharedParallelRunnerCreate.
+ *
+ * @param memory_manager custom allocator function. It may be NULL. The memory
+ *        manager will be copied internally.
+ * @param num_worker_threads the number of worker threads to create. If zero,
+ *        all tasks run on the threads calling @ref JxlSharedParallelRunner.
+ * @return @c NULL if the instance can not be allocated or initialized
+ * @return pointer to initialized pool otherwise
+ */
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerPoolCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads);
+
+/** Destroys the pool created by @ref JxlSharedParallelRunnerPoolCreate. All
+ * runners of this pool must have been destroyed before.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerPoolDestroy(void* pool);
+
+/** Creates a runner submitting its work to the threads of @p pool. Use as the
+ * opaque runner of @ref JxlSharedParallelRunner.
+ *
+ * @param pool pool created by @ref JxlSharedParallelRunnerPoolCreate. It must
+ *        outlive the runner.
+ * @param priority priority of the work of this runner relative to the work of
+ *        the other runners of the same pool. Larger values are more urgent.
+ * @return @c NULL if the instance can not be allocated or initialized
+ * @return pointer to initialized runner otherwise
+ */
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreate(void* pool,
+                                                      int32_t priority);
+
+/** Changes the priority of a runner created by
+ * @ref JxlSharedParallelRunnerCreate. This applies to the calls of
+ * @ref JxlSharedParallelRunner started after this function returns, and must
+ * not be called concurrently with a call using the same runner.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerSetPriority(void* runner_opaque,
+                                                          int32_t priority);
+
+/** Destroys the runner created by @ref JxlSharedParallelRunnerCreate.
+ */
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroy(void* runner_opaque);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JXL_SHARED_PARALLEL_RUNNER_H_ */
+
+/** @}*/
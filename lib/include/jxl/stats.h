@@ -14,7 +14,9 @@
 #define JXL_STATS_H_
 
 #include <jxl/jxl_export.h>
+#include <jxl/types.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -43,7 +45,13 @@ JXL_EXPORT JxlEncoderStats* JxlEncoderStatsCreate(void);
  */
 JXL_EXPORT void JxlEncoderStatsDestroy(JxlEncoderStats* stats);
 
-/** Data type for querying @ref JxlEncoderStats object
+/** Data type for querying @ref JxlEncoderStats object.
+ *
+ * The keys ending in _WALL_US, _CPU_US and _PEAK_BYTES give, for each encoding
+ * phase, the wall-clock time and the CPU time of the process in microseconds,
+ * and the highest number of bytes allocated by the encoder during the phase.
+ * Phases that run within another one, like clustering within writing, are not
+ * counted in the outer one.
  */
 typedef enum {
   JXL_ENC_STAT_HEADER_BITS,
@@ -72,6 +80,38 @@ typedef enum {
   JXL_ENC_STAT_NUM_DCT32X64_BLOCKS,
   JXL_ENC_STAT_NUM_DCT64_BLOCKS,
   JXL_ENC_STAT_NUM_BUTTERAUGLI_ITERS,
+  JXL_ENC_STAT_TO_XYB_WALL_US,
+  JXL_ENC_STAT_TO_XYB_CPU_US,
+  JXL_ENC_STAT_TO_XYB_PEAK_BYTES,
+  JXL_ENC_STAT_AC_STRATEGY_WALL_US,
+  JXL_ENC_STAT_AC_STRATEGY_CPU_US,
+  JXL_ENC_STAT_AC_STRATEGY_PEAK_BYTES,
+  JXL_ENC_STAT_ADAPTIVE_QUANTIZATION_WALL_US,
+  JXL_ENC_STAT_ADAPTIVE_QUANTIZATION_CPU_US,
+  JXL_ENC_STAT_ADAPTIVE_QUANTIZATION_PEAK_BYTES,
+  JXL_ENC_STAT_CHROMA_FROM_LUMA_WALL_US,
+  JXL_ENC_STAT_CHROMA_FROM_LUMA_CPU_US,
+  JXL_ENC_STAT_CHROMA_FROM_LUMA_PEAK_BYTES,
+  JXL_ENC_STAT_PATCHES_WALL_US,
+  JXL_ENC_STAT_PATCHES_CPU_US,
+  JXL_ENC_STAT_PATCHES_PEAK_BYTES,
+  JXL_ENC_STAT_TREE_LEARNING_WALL_US,
+  JXL_ENC_STAT_TREE_LEARNING_CPU_US,
+  JXL_ENC_STAT_TREE_LEARNING_PEAK_BYTES,
+  JXL_ENC_STAT_CLUSTERING_WALL_US,
+  JXL_ENC_STAT_CLUSTERING_CPU_US,
+  JXL_ENC_STAT_CLUSTERING_PEAK_BYTES,
+  JXL_ENC_STAT_TOKENIZATION_WALL_US,
+  JXL_ENC_STAT_TOKENIZATION_CPU_US,
+  JXL_ENC_STAT_TOKENIZATION_PEAK_BYTES,
+  JXL_ENC_STAT_WRITING_WALL_US,
+  JXL_ENC_STAT_WRITING_CPU_US,
+  JXL_ENC_STAT_WRITING_PEAK_BYTES,
+  /** Decoding time of the frames on one thread, in nanoseconds, as estimated
+   * by the model of the decoder that ::JXL_ENC_FRAME_SETTING_DECODING_BUDGET
+   * uses. Frames encoded in streaming mode are not counted.
+   */
+  JXL_ENC_STAT_ESTIMATED_DECODE_NS,
   JXL_ENC_NUM_STATS,
 } JxlEncoderStatsKey;
 
@@ -86,6 +126,57 @@ typedef enum {
 JXL_EXPORT size_t JxlEncoderStatsGet(const JxlEncoderStats* stats,
                                      JxlEncoderStatsKey key);
 
+/** Maximum number of counters for @ref JxlEncoderStatsSetCounters.
+ */
+#define JXL_ENC_STATS_MAX_COUNTERS 8
+
+/**
+ * Function type for @ref JxlEncoderStatsSetCounters. Writes the current values
+ * of the counters of the calling thread to @p values, one per counter. The
+ * counters must only increase.
+ *
+ * @param opaque user supplied parameter, passed to @ref
+ *   JxlEncoderStatsSetCounters
+ * @param values output for the values of the counters
+ */
+typedef void (*JxlEncoderStatsCounterReader)(void* opaque, uint64_t* values);
+
+/** Makes the encoder also measure user supplied counters, such as hardware
+ * performance counters, in each encoding phase, by reading them with @p reader
+ * at the start and the end of each. The counters are read on the thread that
+ * calls the encoder, and the phases that run within another one are not
+ * counted in the outer one, like for the times.
+ *
+ * @param stats object that will be passed to the encoder with a @ref
+ *   JxlEncoderCollectStats function
+ * @param num_counters number of counters, at most @ref
+ *   JXL_ENC_STATS_MAX_COUNTERS, or 0 to measure no counters
+ * @param reader function that reads the counters
+ * @param opaque user supplied parameter for @p reader
+ *
+ * @return JXL_TRUE on success, JXL_FALSE if @p num_counters is too large or
+ *   @p reader is NULL while @p num_counters is not 0
+ */
+JXL_EXPORT JXL_BOOL JxlEncoderStatsSetCounters(
+    JxlEncoderStats* stats, size_t num_counters,
+    JxlEncoderStatsCounterReader reader, void* opaque);
+
+/** Returns the increase of a counter set with @ref JxlEncoderStatsSetCounters
+ * during an encoding phase.
+ *
+ * @param stats object that was passed to the encoder with a @ref
+ *   JxlEncoderCollectStats function
+ * @param key any of the three keys of the phase, for example @ref
+ *   JXL_ENC_STAT_TO_XYB_WALL_US
+ * @param counter index of the counter
+ *
+ * @return the increase of the counter, or 0 if @p key is not the key of a
+ *   phase or @p counter is out of range
+ */
+JXL_EXPORT uint64_t JxlEncoderStatsGetCounter(const JxlEncoderStats* stats,
+                                              JxlEncoderStatsKey key,
+                                              size_t counter);
+
 /** Updates the values of the given stats object with that of an other.
  *
  * @param stats object whose values will be updated (usually added together)
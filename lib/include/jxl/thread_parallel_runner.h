@@ -33,6 +33,7 @@
 #include <jxl/jxl_threads_export.h>
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
+#include <jxl/types.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -41,6 +42,24 @@
 extern "C" {
 #endif
 
+/** Scheduling strategy used by the worker threads of a
+ * @ref JxlThreadParallelRunner instance.
+ */
+typedef enum {
+  /** All workers reserve chunks of tasks from a single shared counter and are
+   * woken up through a single condition variable on every call. This is the
+   * default used by @ref JxlThreadParallelRunnerCreate.
+   */
+  JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER = 0,
+
+  /** Every worker owns a contiguous slice of the range and steals half of the
+   * remaining tasks of another worker once its own slice is exhausted. Idle
+   * workers briefly spin before parking, which lowers the wake-up cost of
+   * back-to-back calls with small ranges on machines with many cores.
+   */
+  JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING = 1,
+} JxlThreadParallelRunnerMode;
+
 /** Parallel runner internally using std::thread. Use as @ref JxlParallelRunner.
  */
 JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunner(
@@ -53,10 +72,58 @@ JXL_THREADS_EXPORT JxlParallelRetCode JxlThreadParallelRunner(
 JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreate(
     const JxlMemoryManager* memory_manager, size_t num_worker_threads);
 
+/** Creates the runner for @ref JxlThreadParallelRunner using the given
+ * scheduling @p mode. Use as the opaque runner. @ref
+ * JxlThreadParallelRunnerCreate is equivalent to calling this function with
+ * ::JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER.
+ *
+ * @return @c NULL if the instance can not be allocated or @p mode is not a
+ * valid ::JxlThreadParallelRunnerMode value.
+ */
+JXL_THREADS_EXPORT void* JxlThreadParallelRunnerCreateWithMode(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    JxlThreadParallelRunnerMode mode);
+
 /** Destroys the runner created by @ref JxlThreadParallelRunnerCreate.
  */
 JXL_THREADS_EXPORT void JxlThreadParallelRunnerDestroy(void* runner_opaque);
 
+/** Pins worker thread @c i of the runner created by
+ * @ref JxlThreadParallelRunnerCreate to the CPU @c cpus[i % num_cpus]. Must
+ * not be called concurrently with @ref JxlThreadParallelRunner on the same
+ * runner.
+ *
+ * @param runner_opaque the runner.
+ * @param cpus array of @p num_cpus CPU indices, as numbered by the OS.
+ * @param num_cpus number of CPU indices, must be positive.
+ * @return ::JXL_TRUE on success.
+ * @return ::JXL_FALSE if the platform does not support thread affinity or any
+ * of the CPUs can not be used, in which case the placement of some workers may
+ * be unchanged.
+ */
+JXL_THREADS_EXPORT JXL_BOOL JxlThreadParallelRunnerSetCpuAffinity(
+    void* runner_opaque, const uint32_t* cpus, size_t num_cpus);
+
+/** Restricts all worker threads of the runner created by
+ * @ref JxlThreadParallelRunnerCreate to the CPUs of NUMA node @p node, so that
+ * memory allocated by the workers stays local to that node. Must not be called
+ * concurrently with @ref JxlThreadParallelRunner on the same runner.
+ *
+ * @return ::JXL_TRUE on success.
+ * @return ::JXL_FALSE if the node does not exist or the platform does not
+ * support thread affinity.
+ */
+JXL_THREADS_EXPORT JXL_BOOL
+JxlThreadParallelRunnerSetNumaNode(void* runner_opaque, uint32_t node);
+
+/** Sets the tracer receiving the events of the runner created by
+ * @ref JxlThreadParallelRunnerCreate, or disables tracing if @p tracer is @c
+ * NULL. The tracer is copied. Must not be called concurrently with
+ * @ref JxlThreadParallelRunner on the same runner.
+ */
+JXL_THREADS_EXPORT void JxlThreadParallelRunnerSetTracer(
+    void* runner_opaque, const JxlParallelRunnerTracer* tracer);
+
 /** Returns a default num_worker_threads value for
  * @ref JxlThreadParallelRunnerCreate.
  */
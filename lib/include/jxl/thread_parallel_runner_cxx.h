@@ -61,6 +61,26 @@ static inline JxlThreadParallelRunnerPtr JxlThreadParallelRunnerMake(
       JxlThreadParallelRunnerCreate(memory_manager, num_worker_threads));
 }
 
+/// Creates an instance of JxlThreadParallelRunner using the given scheduling
+/// mode into a JxlThreadParallelRunnerPtr and initializes it.
+///
+/// See @ref JxlThreadParallelRunnerCreateWithMode for details on the instance
+/// creation.
+///
+/// @param memory_manager custom allocator function. It may be NULL. The memory
+///        manager will be copied internally.
+/// @param num_worker_threads the number of worker threads to create.
+/// @param mode the scheduling strategy of the worker threads.
+/// @return a @c NULL JxlThreadParallelRunnerPtr if the instance can not be
+/// allocated or initialized
+/// @return initialized JxlThreadParallelRunnerPtr instance otherwise.
+static inline JxlThreadParallelRunnerPtr JxlThreadParallelRunnerMakeWithMode(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    JxlThreadParallelRunnerMode mode) {
+  return JxlThreadParallelRunnerPtr(JxlThreadParallelRunnerCreateWithMode(
+      memory_manager, num_worker_threads, mode));
+}
+
 #endif  // JXL_THREAD_PARALLEL_RUNNER_CXX_H_
 
 /// @}
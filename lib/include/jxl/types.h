@@ -55,6 +55,15 @@ typedef enum {
 
   /** Use 16-bit IEEE 754 half-precision floating point values */
   JXL_TYPE_FLOAT16 = 5,
+
+  /** Use packed 32-bit pixels of type uint32_t, with 10 bits for each color
+   * channel and 2 bits for alpha: red is in the 10 least significant bits and
+   * alpha in the 2 most significant ones, as in
+   * DXGI_FORMAT_R10G10B10A2_UNORM. Only supported for image and preview output
+   * of 3 or 4 channels; with 3 channels, alpha is set to 3. The output bit
+   * depth setting does not apply to this type. May clip wide color gamut data.
+   */
+  JXL_TYPE_UINT32_RGB10_A2 = 6,
 } JxlDataType;
 
 /** Ordering of multi-byte data.
@@ -93,7 +102,8 @@ typedef struct {
   JxlDataType data_type;
 
   /** Whether multi-byte data types are represented in big endian or little
-   * endian format. This applies to ::JXL_TYPE_UINT16 and ::JXL_TYPE_FLOAT.
+   * endian format. This applies to ::JXL_TYPE_UINT16, ::JXL_TYPE_FLOAT and
+   * the 32-bit words of ::JXL_TYPE_UINT32_RGB10_A2.
    */
   JxlEndianness endianness;
 
@@ -45,6 +45,7 @@ using hwy::HWY_NAMESPACE::ShiftLeft;
 using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sqrt;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
 constexpr float kInputScaling = 1.0f / 255.0f;
@@ -263,16 +264,18 @@ V SimpleGamma(const D d, V v) {
 }
 */
 
+// With "fast", only every other row of the block is used.
 template <class D, class V>
 V GammaModulation(const D d, const size_t x, const size_t y,
-                  const RowBuffer<float>& input, const V out_val) {
+                  const RowBuffer<float>& input, const V out_val, bool fast) {
   static const float kBias = 0.16f / kInputScaling;
   static const float kScale = kInputScaling / 64.0f;
+  const size_t dy_step = fast ? 2 : 1;
   auto overall_ratio = Zero(d);
   const auto bias = Set(d, kBias);
-  const auto scale = Set(d, kScale);
+  const auto scale = Set(d, kScale * dy_step);
   const float* const JXL_RESTRICT block_start = input.Row(y) + x;
-  for (size_t dy = 0; dy < 8; ++dy) {
+  for (size_t dy = 0; dy < 8; dy += dy_step) {
     const float* const JXL_RESTRICT row_in = block_start + dy * input.stride();
     for (size_t dx = 0; dx < 8; dx += Lanes(d)) {
       const auto iny = Add(Load(d, row_in + dx), bias);
@@ -323,7 +326,7 @@ V HfModulation(const D d, const size_t x, const size_t y,
 }
 
 void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
-                         const size_t yb0, const size_t yblen,
+                         const size_t yb0, const size_t yblen, bool fast,
                          RowBuffer<float>* aq_map) {
   static const float kAcQuant = 0.841f;
   float base_level = 0.48f * kAcQuant;
@@ -349,7 +352,7 @@ void PerBlockModulations(const float y_quant_01, const RowBuffer<float>& input,
       auto out_val = Set(df, row_out[ix]);
       out_val = ComputeMask(df, out_val);
       out_val = HfModulation(df, x, y, input, out_val);
-      out_val = GammaModulation(df, x, y, input, out_val);
+      out_val = GammaModulation(df, x, y, input, out_val, fast);
       // We want multiplicative quantization field, so everything
       // until this point has been modulating the exponent.
       row_out[ix] = FastPow2f(GetLane(out_val) * 1.442695041f) * mul + add;
@@ -495,6 +498,58 @@ void ComputePreErosion(const RowBuffer<float>& input, const size_t xsize,
   }
 }
 
+// Approximation of ComputePreErosion, which computes the local differences of
+// only one pixel of each 2x2 square, the top-left one, so that the output is
+// the sum of 4 differences instead of 4 times the average of 16.
+void ComputePreErosionFast(const RowBuffer<float>& input, const size_t xsize,
+                           const size_t y0, const size_t ylen, int border,
+                           float* diff_buffer, RowBuffer<float>* pre_erosion) {
+  const size_t xsize_out = xsize / 4;
+  const size_t y0_out = y0 / 4;
+  static const float match_gamma_offset = 0.019 / kInputScaling;
+  // At most 4 lanes, so that the interleaved loads of the even pixels do not
+  // read past the border of the rows, since xsize is a multiple of 8.
+  const HWY_CAPPED(float, 4) df;
+  static const float limit = 0.2f;
+  // Only one half of each interleaved load is used, except for the input row.
+  Vec<decltype(df)> in, in_r, in_l, in_t, in_b, unused;  // NOLINT
+  for (size_t iy = 0; iy < ylen; iy += 2) {
+    size_t y = y0 + iy;
+    const float* row_in = input.Row(y);
+    const float* row_in1 = input.Row(y + 1);
+    const float* row_in2 = input.Row(y - 1);
+    float* JXL_RESTRICT row_out = diff_buffer;
+    const auto match_gamma_offset_v = Set(df, match_gamma_offset);
+    const auto quarter = Set(df, 0.25f);
+    for (size_t x = 0; x < xsize / 2; x += Lanes(df)) {
+      LoadInterleaved2(df, row_in + 2 * x, in, in_r);
+      LoadInterleaved2(df, row_in + 2 * x - 1, in_l, unused);
+      LoadInterleaved2(df, row_in2 + 2 * x, in_t, unused);
+      LoadInterleaved2(df, row_in1 + 2 * x, in_b, unused);
+      const auto base = Mul(quarter, Add(Add(in_r, in_l), Add(in_t, in_b)));
+      const auto gammacv =
+          RatioOfDerivativesOfCubicRootToSimpleGamma</*invert=*/false>(
+              df, Add(in, match_gamma_offset_v));
+      auto diff = Mul(gammacv, Sub(in, base));
+      diff = Mul(diff, diff);
+      diff = Min(diff, Set(df, limit));
+      diff = MaskingSqrt(df, diff);
+      if ((iy & 3) != 0) {
+        diff = Add(diff, LoadU(df, row_out + x));
+      }
+      StoreU(diff, df, row_out + x);
+    }
+    if (iy % 4 == 2) {
+      size_t y_out = y0_out + iy / 4;
+      float* row_d_out = pre_erosion->Row(y_out);
+      for (size_t x = 0; x < xsize_out; x++) {
+        row_d_out[x] = row_out[x * 2] + row_out[x * 2 + 1];
+      }
+      pre_erosion->PadRow(y_out, xsize_out, border);
+    }
+  }
+}
+
 }  // namespace
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -505,6 +560,7 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jpegli {
 HWY_EXPORT(ComputePreErosion);
+HWY_EXPORT(ComputePreErosionFast);
 HWY_EXPORT(FuzzyErosion);
 HWY_EXPORT(PerBlockModulations);
 
@@ -544,8 +600,15 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   if (m->next_iMCU_row + 1 == cinfo->total_iMCU_rows) {
     ylen -= 4;
   }
-  HWY_DYNAMIC_DISPATCH(ComputePreErosion)
-  (input, xsize, y0, ylen, kPreErosionBorder, m->diff_buffer, &m->pre_erosion);
+  if (m->fast_adaptive_quantization) {
+    HWY_DYNAMIC_DISPATCH(ComputePreErosionFast)
+    (input, xsize, y0, ylen, kPreErosionBorder, m->diff_buffer,
+     &m->pre_erosion);
+  } else {
+    HWY_DYNAMIC_DISPATCH(ComputePreErosion)
+    (input, xsize, y0, ylen, kPreErosionBorder, m->diff_buffer,
+     &m->pre_erosion);
+  }
   if (y0 == 0) {
     m->pre_erosion.CopyRow(-1, 0, kPreErosionBorder);
   }
@@ -556,7 +619,8 @@ void ComputeAdaptiveQuantField(j_compress_ptr cinfo) {
   HWY_DYNAMIC_DISPATCH(FuzzyErosion)
   (m->pre_erosion, yb0, yblen, &m->fuzzy_erosion_tmp, &m->quant_field);
   HWY_DYNAMIC_DISPATCH(PerBlockModulations)
-  (y_quant_01, input, yb0, yblen, &m->quant_field);
+  (y_quant_01, input, yb0, yblen, m->fast_adaptive_quantization,
+   &m->quant_field);
   for (int y = 0; y < cinfo->max_v_samp_factor; ++y) {
     float* row = m->quant_field.Row(yb0 + y);
     for (size_t x = 0; x < xsize_blocks; ++x) {
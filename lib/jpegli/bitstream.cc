@@ -457,4 +457,12 @@ void WriteScanData(j_compress_ptr cinfo, int scan_index) {
   }
 }
 
+void WriteBufferedTokens(j_compress_ptr cinfo) {
+  JpegBitWriter* bw = &cinfo->master->bw;
+  WriteTokens(cinfo, 0, bw);
+  if (!bw->healthy) {
+    JPEGLI_ERROR("Unknown Huffman coded symbol found in scan 0");
+  }
+}
+
 }  // namespace jpegli
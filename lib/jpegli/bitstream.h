@@ -42,6 +42,9 @@ void WriteBlock(const int32_t* JXL_RESTRICT symbols,
                 const HuffmanCodeTable* JXL_RESTRICT ac_code,
                 JpegBitWriter* JXL_RESTRICT bw);
 void WriteScanData(j_compress_ptr cinfo, int scan_index);
+// Writes the tokens of the single scan of a streaming encoder so far, without
+// ending the scan, so that the next iMCU rows can be written after them.
+void WriteBufferedTokens(j_compress_ptr cinfo);
 
 }  // namespace jpegli
 
@@ -21,7 +21,69 @@
 #include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jpegli/color_quantize.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+HWY_BEFORE_NAMESPACE();
 namespace jpegli {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::Sub;
+
+// Returns the position of the color nearest to "pixel" among the "num_padded"
+// colors of a candidate table, which has the weighted values of each
+// component in a separate row. The first of the nearest colors is returned,
+// like a scalar search would.
+size_t FindNearestColor(const int32_t* JXL_RESTRICT colors, size_t num_padded,
+                        int ncomp, const int32_t* JXL_RESTRICT pixel) {
+  const HWY_CAPPED(int32_t, kColorTableAlign) di;
+  const size_t N = Lanes(di);
+  auto best_dist = Set(di, std::numeric_limits<int32_t>::max());
+  auto best_pos = Zero(di);
+  auto pos = Iota(di, 0);
+  const auto step = Set(di, static_cast<int32_t>(N));
+  for (size_t i = 0; i < num_padded; i += N) {
+    auto dist = Zero(di);
+    for (int c = 0; c < ncomp; ++c) {
+      const auto d =
+          Sub(LoadU(di, colors + c * num_padded + i), Set(di, pixel[c]));
+      dist = Add(dist, Mul(d, d));
+    }
+    const auto better = Lt(dist, best_dist);
+    best_dist = IfThenElse(better, dist, best_dist);
+    best_pos = IfThenElse(better, pos, best_pos);
+    pos = Add(pos, step);
+  }
+  HWY_ALIGN int32_t dists[kColorTableAlign];
+  HWY_ALIGN int32_t positions[kColorTableAlign];
+  Store(best_dist, di, dists);
+  Store(best_pos, di, positions);
+  size_t best = 0;
+  for (size_t k = 1; k < N; ++k) {
+    if (dists[k] < dists[best] ||
+        (dists[k] == dists[best] && positions[k] < positions[best])) {
+      best = k;
+    }
+  }
+  return positions[best];
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jpegli
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jpegli {
+
+HWY_EXPORT(FindNearestColor);
 
 namespace {
 
@@ -196,20 +258,10 @@ void AddToRGBPalette(const uint8_t* red, const uint8_t* green,
   }
 }
 
-struct RGBPixelHasher {
-  // A quick but good-enough hash to get 24 bits of RGB into the lower 12 bits.
-  size_t operator()(uint32_t a) const { return (a ^ (a >> 12)) * 0x9e3779b9; }
-};
-
 struct WangHasher {
-  // Thomas Wang's Hash.  Nearly perfect and still quite fast.  Above (for
-  // pixels) we use a simpler hash because the number of hash calls is
-  // proportional to the number of pixels and that hash dominates; we want the
-  // cost to be minimal and we start with a large table.  We can use a better
-  // hash for the histogram since the number of hash calls is proportional to
-  // the number of unique colors in the image, which is hopefully much smaller.
-  // Note that the difference is slight; e.g. replacing RGBPixelHasher with
-  // WangHasher only slows things down by 5% on an Opteron.
+  // Thomas Wang's Hash.  Nearly perfect and still quite fast. The number of
+  // hash calls is proportional to the number of unique colors in the image,
+  // which is hopefully much smaller than the number of pixels.
   size_t operator()(uint32_t a) const {
     a = (a ^ 61) ^ (a >> 16);
     a = a + (a << 3);
@@ -224,34 +276,24 @@ struct WangHasher {
 // image. To do this we map the 24 bit RGB representation of the colors
 // to a unique integer index assigned to the different colors in order of
 // appearance in the image.  Return the number of unique colors found.
-// The colors are pre-quantized to 3 * 6 bits precision.
+// The colors are pre-quantized to 3 * 6 bits precision, so the index of a
+// color is looked up in a table of all the 2^18 pre-quantized colors.
 int BuildRGBColorIndex(const uint8_t* const image, int const num_pixels,
                        int* const count, uint8_t* const red,
                        uint8_t* const green, uint8_t* const blue) {
-  // Impossible because rgb are in the low 24 bits, and the upper 8 bits is 0.
-  const uint32_t impossible_pixel_value = 0x10000000;
-  std::unordered_map<uint32_t, int, RGBPixelHasher> index_map(1 << 12);
-  std::unordered_map<uint32_t, int, RGBPixelHasher>::iterator index_map_lookup;
+  std::vector<int> index_map(1 << 18, -1);
   const uint8_t* imagep = &image[0];
-  uint32_t prev_pixel = impossible_pixel_value;
-  int index = 0;
   int n = 0;
   for (int i = 0; i < num_pixels; ++i) {
-    uint8_t r = ((*imagep++) & 0xfc) + 2;
-    uint8_t g = ((*imagep++) & 0xfc) + 2;
-    uint8_t b = ((*imagep++) & 0xfc) + 2;
-    uint32_t pixel = (b << 16) | (g << 8) | r;
-    if (pixel != prev_pixel) {
-      prev_pixel = pixel;
-      index_map_lookup = index_map.find(pixel);
-      if (index_map_lookup != index_map.end()) {
-        index = index_map_lookup->second;
-      } else {
-        index_map[pixel] = index = n++;
-        red[index] = r;
-        green[index] = g;
-        blue[index] = b;
-      }
+    uint32_t r = (*imagep++) >> 2;
+    uint32_t g = (*imagep++) >> 2;
+    uint32_t b = (*imagep++) >> 2;
+    int& index = index_map[(b << 12) | (g << 6) | r];
+    if (index < 0) {
+      index = n++;
+      red[index] = (r << 2) + 2;
+      green[index] = (g << 2) + 2;
+      blue[index] = (b << 2) + 2;
     }
     ++count[index];
   }
@@ -453,11 +495,23 @@ void CreateInverseColorMap(j_decompress_ptr cinfo) {
     num_cells *= (1 << kNumColorCellBits[c]);
   }
   m->candidate_lists_.resize(num_cells);
+  m->candidate_colors_.resize(num_cells);
 
   int next_cell[kMaxComponents] = {0};
   for (int i = 0; i < num_cells; ++i) {
-    m->candidate_lists_[i].clear();
-    FindCandidatesForCell(cinfo, ncomp, next_cell, &m->candidate_lists_[i]);
+    std::vector<uint8_t>& candidates = m->candidate_lists_[i];
+    candidates.clear();
+    FindCandidatesForCell(cinfo, ncomp, next_cell, &candidates);
+    // The padding colors are farther from any pixel than the palette colors.
+    size_t num_padded = RoundUpTo(candidates.size(), kColorTableAlign);
+    std::vector<int32_t>& colors = m->candidate_colors_[i];
+    colors.assign(ncomp * num_padded, 1 << 14);
+    for (int c = 0; c < ncomp; ++c) {
+      for (size_t j = 0; j < candidates.size(); ++j) {
+        colors[c * num_padded + j] =
+            cinfo->colormap[c][candidates[j]] * kCompW[c];
+      }
+    }
     int c = ncomp - 1;
     while (c > 0 && next_cell[c] + 1 == (1 << kNumColorCellBits[c])) {
       next_cell[c--] = 0;
@@ -483,19 +537,16 @@ int LookupColorIndex(j_decompress_ptr cinfo, const JSAMPLE* pixel) {
       stride <<= kNumColorCellBits[c];
     }
     JPEGLI_CHECK(cell_idx < m->candidate_lists_.size());
-    int mindist = std::numeric_limits<int>::max();
     const auto& candidates = m->candidate_lists_[cell_idx];
-    for (uint8_t i : candidates) {
-      int dist = 0;
-      for (int c = 0; c < num_channels; ++c) {
-        int d = (cinfo->colormap[c][i] - pixel[c]) * kCompW[c];
-        dist += d * d;
-      }
-      if (dist < mindist) {
-        mindist = dist;
-        index = i;
-      }
+    const auto& colors = m->candidate_colors_[cell_idx];
+    int32_t weighted_pixel[kMaxComponents];
+    for (int c = 0; c < num_channels; ++c) {
+      weighted_pixel[c] = pixel[c] * kCompW[c];
     }
+    size_t pos = HWY_DYNAMIC_DISPATCH(FindNearestColor)(
+        colors.data(), colors.size() / num_channels, num_channels,
+        weighted_pixel);
+    index = candidates[pos];
   }
   JPEGLI_CHECK(index < cinfo->actual_number_of_colors);
   return index;
@@ -543,3 +594,4 @@ void InitFSDitherState(j_decompress_ptr cinfo) {
 }
 
 }  // namespace jpegli
+#endif  // HWY_ONCE
@@ -6,10 +6,16 @@
 #ifndef LIB_JPEGLI_COLOR_QUANTIZE_H_
 #define LIB_JPEGLI_COLOR_QUANTIZE_H_
 
+#include <cstddef>
+
 #include "lib/jpegli/common.h"
 
 namespace jpegli {
 
+// The candidate color tables of CreateInverseColorMap are padded to a multiple
+// of this many colors.
+constexpr size_t kColorTableAlign = 8;
+
 void ChooseColorMap1Pass(j_decompress_ptr cinfo);
 
 void ChooseColorMap2Pass(j_decompress_ptr cinfo);
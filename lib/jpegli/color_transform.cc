@@ -32,6 +32,7 @@ using hwy::HWY_NAMESPACE::Div;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
 using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
 
 template <int kRed, int kGreen, int kBlue, int kAlpha>
 void YCbCrToExtRGB(float* row[kMaxComponents], size_t xsize) {
@@ -106,17 +107,12 @@ void YCCKToCMYK(float* row[kMaxComponents], size_t xsize) {
   }
 }
 
-template <int kRed, int kGreen, int kBlue>
-void ExtRGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
-  const HWY_CAPPED(float, 8) df;
-  const float* row_r = row[kRed];
-  const float* row_g = row[kGreen];
-  const float* row_b = row[kBlue];
-  float* row_y = row[0];
-  float* row_cb = row[1];
-  float* row_cr = row[2];
-  // Full-range BT.601 as defined by JFIF Clause 7:
-  // https://www.itu.int/rec/T-REC-T.871-201105-I/en
+using DF = HWY_CAPPED(float, 8);
+
+// Full-range BT.601 as defined by JFIF Clause 7:
+// https://www.itu.int/rec/T-REC-T.871-201105-I/en
+HWY_INLINE void RGBToYCbCrVec(DF df, Vec<DF> r, Vec<DF> g, Vec<DF> b,
+                              Vec<DF>* y, Vec<DF>* cb, Vec<DF>* cr) {
   const auto c128 = Set(df, 128.0f);
   const auto kR = Set(df, 0.299f);  // NTSC luma
   const auto kG = Set(df, 0.587f);
@@ -127,25 +123,98 @@ void ExtRGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
   const auto kDiffB = Add(kAmpB, kB);
   const auto kNormR = Div(Set(df, 1.0f), (Add(kAmpR, Add(kG, kB))));
   const auto kNormB = Div(Set(df, 1.0f), (Add(kR, Add(kG, kAmpB))));
+  const auto r_base = Mul(r, kR);
+  const auto r_diff = Mul(r, kDiffR);
+  const auto g_base = Mul(g, kG);
+  const auto b_base = Mul(b, kB);
+  const auto b_diff = Mul(b, kDiffB);
+  *y = Add(r_base, Add(g_base, b_base));
+  *cb = MulAdd(Sub(b_diff, *y), kNormB, c128);
+  *cr = MulAdd(Sub(r_diff, *y), kNormR, c128);
+}
 
+template <int kRed, int kGreen, int kBlue>
+void ExtRGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
+  const DF df;
+  const float* row_r = row[kRed];
+  const float* row_g = row[kGreen];
+  const float* row_b = row[kBlue];
+  float* row_y = row[0];
+  float* row_cb = row[1];
+  float* row_cr = row[2];
+  Vec<DF> y, cb, cr;  // NOLINT
   for (size_t x = 0; x < xsize; x += Lanes(df)) {
     const auto r = Load(df, row_r + x);
     const auto g = Load(df, row_g + x);
     const auto b = Load(df, row_b + x);
-    const auto r_base = Mul(r, kR);
-    const auto r_diff = Mul(r, kDiffR);
-    const auto g_base = Mul(g, kG);
-    const auto b_base = Mul(b, kB);
-    const auto b_diff = Mul(b, kDiffB);
-    const auto y_base = Add(r_base, Add(g_base, b_base));
-    const auto cb_vec = MulAdd(Sub(b_diff, y_base), kNormB, c128);
-    const auto cr_vec = MulAdd(Sub(r_diff, y_base), kNormR, c128);
-    Store(y_base, df, row_y + x);
-    Store(cb_vec, df, row_cb + x);
-    Store(cr_vec, df, row_cr + x);
+    RGBToYCbCrVec(df, r, g, b, &y, &cb, &cr);
+    Store(y, df, row_y + x);
+    Store(cb, df, row_cb + x);
+    Store(cr, df, row_cr + x);
   }
 }
 
+// Same as ExtRGBToYCbCr followed by Downsample2x1 (kVFactor = 1) or
+// Downsample2x2 (kVFactor = 2) of the chroma, with the same results, but
+// without storing the chroma at full resolution. With kVFactor = 2, the first
+// row of a pair (iy = 0) stores its horizontal sums, which the second one adds
+// to its own.
+template <int kRed, int kGreen, int kBlue, int kVFactor>
+void ExtRGBToYCbCrDownsampled(float* row[kMaxComponents], size_t len, int iy,
+                              float* row_cb, float* row_cr) {
+  const DF df;
+  const size_t N = Lanes(df);
+  const size_t len_out = len / 2;
+  const float* row_r = row[kRed];
+  const float* row_g = row[kGreen];
+  const float* row_b = row[kBlue];
+  float* row_y = row[0];
+  const auto mul = Set(df, kVFactor == 2 ? 0.25f : 0.5f);
+  Vec<DF> r0, r1, g0, g1, b0, b1;     // NOLINT
+  Vec<DF> y0, y1, cb0, cb1, cr0, cr1;  // NOLINT
+  for (size_t x = 0; x < len_out; x += N) {
+    LoadInterleaved2(df, row_r + 2 * x, r0, r1);
+    LoadInterleaved2(df, row_g + 2 * x, g0, g1);
+    LoadInterleaved2(df, row_b + 2 * x, b0, b1);
+    RGBToYCbCrVec(df, r0, g0, b0, &y0, &cb0, &cr0);
+    RGBToYCbCrVec(df, r1, g1, b1, &y1, &cb1, &cr1);
+    StoreInterleaved2(y0, y1, df, row_y + 2 * x);
+    auto cb = Add(cb0, cb1);
+    auto cr = Add(cr0, cr1);
+    if (kVFactor == 2 && iy == 0) {
+      Store(cb, df, row_cb + x);
+      Store(cr, df, row_cr + x);
+      continue;
+    }
+    if (kVFactor == 2) {
+      cb = Add(Load(df, row_cb + x), cb);
+      cr = Add(Load(df, row_cr + x), cr);
+    }
+    Store(Mul(mul, cb), df, row_cb + x);
+    Store(Mul(mul, cr), df, row_cr + x);
+  }
+}
+
+void RGBToYCbCr422(float* row[kMaxComponents], size_t len, int iy,
+                   float* row_cb, float* row_cr) {
+  ExtRGBToYCbCrDownsampled<0, 1, 2, 1>(row, len, iy, row_cb, row_cr);
+}
+
+void RGBToYCbCr420(float* row[kMaxComponents], size_t len, int iy,
+                   float* row_cb, float* row_cr) {
+  ExtRGBToYCbCrDownsampled<0, 1, 2, 2>(row, len, iy, row_cb, row_cr);
+}
+
+void BGRToYCbCr422(float* row[kMaxComponents], size_t len, int iy,
+                   float* row_cb, float* row_cr) {
+  ExtRGBToYCbCrDownsampled<2, 1, 0, 1>(row, len, iy, row_cb, row_cr);
+}
+
+void BGRToYCbCr420(float* row[kMaxComponents], size_t len, int iy,
+                   float* row_cb, float* row_cr) {
+  ExtRGBToYCbCrDownsampled<2, 1, 0, 2>(row, len, iy, row_cb, row_cr);
+}
+
 void RGBToYCbCr(float* row[kMaxComponents], size_t xsize) {
   ExtRGBToYCbCr<0, 1, 2>(row, xsize);
 }
@@ -196,6 +265,10 @@ HWY_EXPORT(RGBToYCbCr);
 HWY_EXPORT(BGRToYCbCr);
 HWY_EXPORT(ARGBToYCbCr);
 HWY_EXPORT(ABGRToYCbCr);
+HWY_EXPORT(RGBToYCbCr422);
+HWY_EXPORT(RGBToYCbCr420);
+HWY_EXPORT(BGRToYCbCr422);
+HWY_EXPORT(BGRToYCbCr420);
 
 bool CheckColorSpaceComponents(int num_components, J_COLOR_SPACE colorspace) {
   switch (colorspace) {
@@ -299,6 +372,68 @@ void RGBToABGR(float* row[kMaxComponents], size_t len) {
   }
 }
 
+// Only the input color spaces with the red, green and blue channels first are
+// supported, since the padding of the input rows only pads num_components
+// channels.
+void ChooseDownsampledColorTransform(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->downsampled_color_transform = nullptr;
+  if (cinfo->jpeg_color_space != JCS_YCbCr || cinfo->smoothing_factor != 0) {
+    return;
+  }
+  const jpeg_component_info* comp = cinfo->comp_info;
+  if (comp[0].h_samp_factor != cinfo->max_h_samp_factor ||
+      comp[0].v_samp_factor != cinfo->max_v_samp_factor) {
+    return;
+  }
+  for (int c = 1; c < 3; ++c) {
+    if (comp[c].h_samp_factor * 2 != cinfo->max_h_samp_factor ||
+        comp[c].v_samp_factor != comp[1].v_samp_factor) {
+      return;
+    }
+  }
+  int v_factor;
+  if (comp[1].v_samp_factor == cinfo->max_v_samp_factor) {
+    v_factor = 1;
+  } else if (comp[1].v_samp_factor * 2 == cinfo->max_v_samp_factor) {
+    v_factor = 2;
+  } else {
+    return;
+  }
+  bool bgr = false;
+  switch (cinfo->in_color_space) {
+    case JCS_RGB:
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_RGB:
+    case JCS_EXT_RGBX:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_RGBA:
+#endif
+      break;
+#ifdef JCS_EXTENSIONS
+    case JCS_EXT_BGR:
+    case JCS_EXT_BGRX:
+#endif
+#ifdef JCS_ALPHA_EXTENSIONS
+    case JCS_EXT_BGRA:
+#endif
+      bgr = true;
+      break;
+    default:
+      return;
+  }
+  if (bgr) {
+    m->downsampled_color_transform =
+        v_factor == 1 ? HWY_DYNAMIC_DISPATCH(BGRToYCbCr422)
+                      : HWY_DYNAMIC_DISPATCH(BGRToYCbCr420);
+  } else {
+    m->downsampled_color_transform =
+        v_factor == 1 ? HWY_DYNAMIC_DISPATCH(RGBToYCbCr422)
+                      : HWY_DYNAMIC_DISPATCH(RGBToYCbCr420);
+  }
+}
+
 void ChooseColorTransform(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   if (!CheckColorSpaceComponents(cinfo->input_components,
@@ -311,6 +446,7 @@ void ChooseColorTransform(j_compress_ptr cinfo) {
     JPEGLI_ERROR("Invalid number of components %d for colorspace %d",
                  cinfo->num_components, cinfo->jpeg_color_space);
   }
+  ChooseDownsampledColorTransform(cinfo);
   if (cinfo->jpeg_color_space == cinfo->in_color_space) {
     if (cinfo->num_components != cinfo->input_components) {
       JPEGLI_ERROR("Input/output components mismatch:  %d vs %d",
@@ -30,6 +30,7 @@ enum State {
   kEncHeader,
   kEncReadImage,
   kEncWriteCoeffs,
+  kEncWriteCoeffRows,
 };
 
 template <typename T1, typename T2>
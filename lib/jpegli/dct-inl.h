@@ -237,25 +237,34 @@ void QuantizeBlock(const float* dct, const float* qmc, float aq_strength,
   }
 }
 
+// Computes the quantized coefficients of a block in natural order. The DC
+// coefficient is rounded on its own, its unrounded value and zero-bias
+// threshold are stored in *dc and *dc_threshold for SnapDCCoefficient.
 template <typename T>
 void ComputeCoefficientBlock(const float* JXL_RESTRICT pixels, size_t stride,
-                             const float* JXL_RESTRICT qmc,
-                             int16_t last_dc_coeff, float aq_strength,
+                             const float* JXL_RESTRICT qmc, float aq_strength,
                              const float* zero_bias_offset,
                              const float* zero_bias_mul,
-                             float* JXL_RESTRICT tmp, T* block) {
+                             float* JXL_RESTRICT tmp, T* block, float* dc,
+                             float* dc_threshold) {
   float* JXL_RESTRICT dct = tmp;
   float* JXL_RESTRICT scratch_space = tmp + DCTSIZE2;
   TransformFromPixels(pixels, stride, dct, scratch_space);
   QuantizeBlock(dct, qmc, aq_strength, zero_bias_offset, zero_bias_mul, block);
   // Center DC values around zero.
   static constexpr float kDCBias = 128.0f;
-  const float dc = (dct[0] - kDCBias) * qmc[0];
-  float dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+  *dc = (dct[0] - kDCBias) * qmc[0];
+  *dc_threshold = zero_bias_offset[0] + aq_strength * zero_bias_mul[0];
+  block[0] = std::round(*dc);
+}
+
+// Replaces the DC coefficient of a block by the one of the previous block of
+// the component if it is within the zero-bias threshold of it.
+template <typename T>
+void SnapDCCoefficient(float dc, float dc_threshold, int16_t last_dc_coeff,
+                       T* block) {
   if (std::abs(dc - last_dc_coeff) < dc_threshold) {
     block[0] = last_dc_coeff;
-  } else {
-    block[0] = std::round(dc);
   }
 }
 
@@ -997,6 +997,66 @@ jvirt_barray_ptr* jpegli_read_coefficients(j_decompress_ptr cinfo) {
   return m->coef_arrays;
 }
 
+JDIMENSION jpegli_read_coefficient_rows(j_decompress_ptr cinfo,
+                                        JBLOCKIMAGE coef_rows) {
+  jpeg_decomp_master* m = cinfo->master;
+  if (cinfo->buffered_image) {
+    JPEGLI_ERROR("jpegli_read_coefficient_rows: buffered image mode is set");
+  }
+  if (cinfo->global_state == jpegli::kDecHeaderDone) {
+    m->streaming_mode_ = !m->is_multiscan_;
+    jpegli::AllocateCoefficientBuffer(cinfo);
+    jpegli_calc_output_dimensions(cinfo);
+    jpegli::InitProgressMonitor(cinfo, /*coef_only=*/true);
+    jpegli::PrepareForScan(cinfo);
+  }
+  if (cinfo->global_state != jpegli::kDecProcessScan &&
+      cinfo->global_state != jpegli::kDecProcessMarkers) {
+    JPEGLI_ERROR("jpegli_read_coefficient_rows: unexpected state %d",
+                 cinfo->global_state);
+  }
+  j_common_ptr comptr = reinterpret_cast<j_common_ptr>(cinfo);
+  if (m->clear_coef_rows_) {
+    // The blocks are decoded into the buffers of the returned iMCU row.
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+          comptr, m->coef_arrays[c], 0, comp->v_samp_factor, TRUE);
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        memset(&blocks[iy][0][0], 0, comp->width_in_blocks * sizeof(JBLOCK));
+      }
+    }
+    m->clear_coef_rows_ = false;
+  }
+  // In streaming mode, the input does not get ahead of the returned rows.
+  while (!m->found_eoi_ &&
+         (!m->streaming_mode_ ||
+          cinfo->input_iMCU_row <= cinfo->output_iMCU_row)) {
+    jpegli::ProgressMonitorInputPass(cinfo);
+    if (jpegli::ConsumeInput(cinfo) == JPEG_SUSPENDED) {
+      return 0;
+    }
+  }
+  if (cinfo->output_iMCU_row >= cinfo->total_iMCU_rows) {
+    return 0;
+  }
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    int by0 = cinfo->output_iMCU_row * comp->v_samp_factor;
+    int block_rows_left = comp->height_in_blocks - by0;
+    int max_block_rows = std::min(comp->v_samp_factor, block_rows_left);
+    int offset = m->streaming_mode_ ? 0 : by0;
+    coef_rows[c] = (*cinfo->mem->access_virt_barray)(
+        comptr, m->coef_arrays[c], offset, max_block_rows, TRUE);
+  }
+  m->clear_coef_rows_ = m->streaming_mode_;
+  ++cinfo->output_iMCU_row;
+  if (cinfo->output_iMCU_row == cinfo->total_iMCU_rows) {
+    cinfo->output_scanline = cinfo->output_height;
+  }
+  return 1;
+}
+
 boolean jpegli_finish_decompress(j_decompress_ptr cinfo) {
   if (cinfo->global_state != jpegli::kDecProcessScan &&
       cinfo->global_state != jpegli::kDecProcessMarkers) {
@@ -1067,3 +1127,10 @@ void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
       JPEGLI_ERROR("Unsupported endianness %d", endianness);
   }
 }
+
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void* runner_opaque) {
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
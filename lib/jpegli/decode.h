@@ -20,6 +20,8 @@
 #ifndef LIB_JPEGLI_DECODE_H_
 #define LIB_JPEGLI_DECODE_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <cstddef>
 #include <cstdio>
 
@@ -103,6 +105,24 @@ void jpegli_new_colormap(j_decompress_ptr cinfo);
 void jpegli_set_output_format(j_decompress_ptr cinfo, JpegliDataType data_type,
                               JpegliEndianness endianness);
 
+// Sets the parallel runner that computes the inverse DCT of the blocks of each
+// iMCU row in parallel. The output does not depend on the runner. By default,
+// and if "runner" is NULL, everything runs on the calling thread. Takes effect
+// from the next iMCU row that is decoded.
+void jpegli_set_decompress_parallel_runner(j_decompress_ptr cinfo,
+                                           JxlParallelRunner runner,
+                                           void *runner_opaque);
+
+// Reads the quantized coefficients of the next iMCU row, which can be called
+// after jpegli_read_header() instead of jpegli_read_coefficients(). Sets
+// coef_rows[c] to the v_samp_factor block rows of component c, which stay
+// valid until the next call. If the input has a single scan, only one iMCU
+// row of coefficients is kept in memory, otherwise the first call reads the
+// whole input. Returns 1 if an iMCU row was read, and 0 if the input was
+// suspended or all the iMCU rows were read.
+JDIMENSION jpegli_read_coefficient_rows(j_decompress_ptr cinfo,
+                                        JBLOCKIMAGE coef_rows);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -539,6 +539,36 @@ TEST(DecodeAPITest, ReuseCinfoSameStdSource) {
   fclose(tmpf);
 }
 
+TEST(DecodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    // Wide enough to have several tasks per block row.
+    config.input.xsize = 1100;
+    GeneratePixels(&config.input);
+    std::vector<uint8_t> compressed;
+    ASSERT_TRUE(EncodeWithJpegli(config.input, config.jparams, &compressed));
+    TestImage output[2];
+    for (int parallel : {0, 1}) {
+      jpeg_decompress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_decompress(&cinfo);
+        jpegli_mem_src(&cinfo, compressed.data(), compressed.size());
+        if (parallel) {
+          jpegli_set_decompress_parallel_runner(&cinfo, FourThreadsRunner,
+                                                nullptr);
+        }
+        TestAPINonBuffered(config.jparams, DecompressParams(), config.input,
+                           &cinfo, &output[parallel]);
+        return true;
+      };
+      ASSERT_TRUE(try_catch_block());
+      jpegli_destroy_decompress(&cinfo);
+    }
+    EXPECT_EQ(output[0].pixels, output[1].pixels);
+  }
+}
+
 TEST(DecodeAPITest, AbbreviatedStreams) {
   uint8_t* table_stream = nullptr;
   unsigned long table_stream_size = 0;  // NOLINT
@@ -758,6 +788,20 @@ std::vector<TestConfig> GenerateTests(bool buffered) {
     }
   }
 
+  // Tests for the fast integer inverse transform, compared to the one of
+  // libjpeg.
+  for (JpegIOMode output_mode : {PIXELS, RAW_DATA}) {
+    for (int samp : {1, 2}) {
+      TestConfig config;
+      config.dparams.output_mode = output_mode;
+      config.dparams.fast_idct = true;
+      config.jparams.h_sampling = {samp, 1, 1};
+      config.jparams.v_sampling = {samp, 1, 1};
+      config.max_rms_dist = 1.5f;
+      all_tests.push_back(config);
+    }
+  }
+
   // Tests for partial input.
   for (float size_factor : {0.1f, 0.33f, 0.5f, 0.75f}) {
     for (int progr : {0, 1, 3}) {
@@ -1292,6 +1336,9 @@ std::ostream& operator<<(std::ostream& os, const DecompressParams& dparams) {
   if (!dparams.do_fancy_upsampling) {
     os << "NoFancyUpsampling";
   }
+  if (dparams.fast_idct) {
+    os << "FastIDCT";
+  }
   if (dparams.scale_num != 1 || dparams.scale_denom != 1) {
     os << "Scale" << dparams.scale_num << "_" << dparams.scale_denom;
   }
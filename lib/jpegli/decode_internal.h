@@ -6,6 +6,8 @@
 #ifndef LIB_JPEGLI_DECODE_INTERNAL_H_
 #define LIB_JPEGLI_DECODE_INTERNAL_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <cstddef>
 #include <cstdint>
 #include <vector>
@@ -52,6 +54,9 @@ struct jpeg_decomp_master {
   JBLOCKARRAY coeff_rows[jpegli::kMaxComponents];
 
   bool streaming_mode_;
+  // Set when jpegli_read_coefficient_rows() returned the only iMCU row of the
+  // coefficient buffers, which must be cleared before the next one is decoded.
+  bool clear_coef_rows_ = false;
 
   //
   // Marker data processing state.
@@ -125,6 +130,10 @@ struct jpeg_decomp_master {
   float* upsample_scratch_;
   uint8_t* output_scratch_;
   int16_t* smoothing_scratch_;
+  // Runner of the inverse transforms, set by
+  // jpegli_set_decompress_parallel_runner().
+  JxlParallelRunner runner = nullptr;
+  void* runner_opaque = nullptr;
   float* dequant_;
   // 1 = 1pass, 2 = 2pass, 3 = external
   int quant_mode_;
@@ -134,6 +143,9 @@ struct jpeg_decomp_master {
   uint8_t* pixels_;
   JSAMPARRAY scanlines_;
   std::vector<std::vector<uint8_t>> candidate_lists_;
+  // Weighted components of the colors of each candidate list, see
+  // CreateInverseColorMap.
+  std::vector<std::vector<int32_t>> candidate_colors_;
   float* dither_[jpegli::kMaxComponents];
   float* error_row_[2 * jpegli::kMaxComponents];
   size_t dither_size_;
@@ -233,6 +233,11 @@ void ChooseDownsampleMethods(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   for (int c = 0; c < cinfo->num_components; c++) {
     m->downsample_method[c] = nullptr;
+    if (c > 0 && m->downsampled_color_transform != nullptr) {
+      // The color transform already downsampled the chroma.
+      m->downsample_method[c] = NullDownsample;
+      continue;
+    }
     jpeg_component_info* comp = &cinfo->comp_info[c];
     const int h_factor = cinfo->max_h_samp_factor / comp->h_samp_factor;
     const int v_factor = cinfo->max_v_samp_factor / comp->v_samp_factor;
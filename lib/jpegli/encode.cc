@@ -34,6 +34,7 @@
 #include "lib/jpegli/quant.h"
 #include "lib/jpegli/simd.h"
 #include "lib/jpegli/types.h"
+#include "lib/jxl/base/data_parallel.h"
 
 namespace jpegli {
 
@@ -242,6 +243,166 @@ void ValidateScanScript(j_compress_ptr cinfo) {
   }
 }
 
+// Sets up the token and context info of each scan of the scan script.
+void ProcessScanScript(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
+                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
+  ValidateScanScript(cinfo);
+  m->scan_token_info =
+      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
+  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
+  size_t num_ac_contexts = 0;
+  for (int i = 0; i < cinfo->num_scans; ++i) {
+    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
+    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
+    if (scan_info->Se > 0) {
+      num_ac_contexts += scan_info->comps_in_scan;
+    }
+    if (num_ac_contexts > 252) {
+      JPEGLI_ERROR("Too many AC scans in image");
+    }
+    ScanTokenInfo* sti = &m->scan_token_info[i];
+    if (scan_info->comps_in_scan == 1) {
+      int comp_idx = scan_info->component_index[0];
+      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+      sti->MCUs_per_row = comp->width_in_blocks;
+      sti->MCU_rows_in_scan = comp->height_in_blocks;
+      sti->blocks_in_MCU = 1;
+    } else {
+      sti->MCUs_per_row =
+          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
+      sti->MCU_rows_in_scan =
+          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
+      sti->blocks_in_MCU = 0;
+      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
+        int comp_idx = scan_info->component_index[j];
+        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
+      }
+    }
+    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
+    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
+    if (cinfo->restart_in_rows <= 0) {
+      sti->restart_interval = cinfo->restart_interval;
+    } else {
+      sti->restart_interval =
+          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
+    }
+    sti->num_restarts = sti->restart_interval > 0
+                            ? DivCeil(num_MCUs, sti->restart_interval)
+                            : 1;
+    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
+  }
+  m->num_contexts = 4 + num_ac_contexts;
+}
+
+// AC scans of a component in the candidate scripts of SearchScanScript(). The
+// first one is that of progressive level 2.
+std::vector<std::vector<ProgressiveScan>> ACScanCandidates() {
+  return {
+      {{1, 2, 0, 0, false},
+       {3, 63, 0, 2, false},
+       {3, 63, 2, 1, false},
+       {3, 63, 1, 0, false}},
+      {{1, 63, 0, 0, false}},
+      {{1, 63, 0, 1, false}, {1, 63, 1, 0, false}},
+      {{1, 2, 0, 0, false}, {3, 63, 0, 0, false}},
+      {{1, 2, 0, 0, false}, {3, 63, 0, 1, false}, {3, 63, 1, 0, false}},
+      {{1, 5, 0, 0, false},
+       {6, 63, 0, 2, false},
+       {6, 63, 2, 1, false},
+       {6, 63, 1, 0, false}},
+      {{1, 5, 0, 0, false}, {6, 63, 0, 1, false}, {6, 63, 1, 0, false}},
+      {{1, 9, 0, 0, false}, {10, 63, 0, 1, false}, {10, 63, 1, 0, false}},
+  };
+}
+
+// Replaces the default progressive scan script with the DC scans of the
+// default script followed by the candidate AC scans of each component with
+// the smallest estimated size. The estimates of the candidates run in
+// parallel on the runner of the encoder.
+void SearchScanScript(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  const std::vector<std::vector<ProgressiveScan>> candidates =
+      ACScanCandidates();
+  const size_t num_candidates = candidates.size();
+  const int num_comps = cinfo->num_components;
+  std::vector<float> bits(num_comps * num_candidates);
+  const auto estimate = [&](const uint32_t task,
+                            size_t /*thread*/) -> jxl::Status {
+    jpeg_scan_info si = {};
+    si.comps_in_scan = 1;
+    si.component_index[0] = task / num_candidates;
+    for (const ProgressiveScan& scan : candidates[task % num_candidates]) {
+      si.Ss = scan.Ss;
+      si.Se = scan.Se;
+      si.Ah = scan.Ah;
+      si.Al = scan.Al;
+      bits[task] += EstimateACScanBits(cinfo, si);
+    }
+    return true;
+  };
+  jxl::ThreadPool pool(m->runner, m->runner_opaque);
+  if (!jxl::RunOnPool(&pool, 0, bits.size(), jxl::ThreadPool::NoInit,
+                      estimate, "EstimateScans")) {
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
+
+  std::vector<const std::vector<ProgressiveScan>*> ac_scans(num_comps);
+  size_t max_ac_scans = 0;
+  const bool interleave_dc =
+      (cinfo->max_h_samp_factor == 1 && cinfo->max_v_samp_factor == 1);
+  const int dc_comps = interleave_dc ? MAX_COMPS_IN_SCAN : 1;
+  cinfo->script_space_size = DivCeil(num_comps, dc_comps);
+  for (int c = 0; c < num_comps; ++c) {
+    const float* comp_bits = &bits[c * num_candidates];
+    size_t best = 0;
+    for (size_t i = 1; i < num_candidates; ++i) {
+      if (comp_bits[i] < comp_bits[best]) best = i;
+    }
+    ac_scans[c] = &candidates[best];
+    max_ac_scans = std::max(max_ac_scans, ac_scans[c]->size());
+    cinfo->script_space_size += ac_scans[c]->size();
+  }
+  cinfo->script_space =
+      Allocate<jpeg_scan_info>(cinfo, cinfo->script_space_size);
+  jpeg_scan_info* next_scan = cinfo->script_space;
+  for (int c = 0; c < num_comps; c += dc_comps) {
+    next_scan->Ss = next_scan->Se = next_scan->Ah = next_scan->Al = 0;
+    next_scan->comps_in_scan = std::min(dc_comps, num_comps - c);
+    for (int j = 0; j < next_scan->comps_in_scan; ++j) {
+      next_scan->component_index[j] = c + j;
+    }
+    ++next_scan;
+  }
+  // Like in the default script, each step of the AC scans is sent for all
+  // components before the next one.
+  for (size_t i = 0; i < max_ac_scans; ++i) {
+    for (int c = 0; c < num_comps; ++c) {
+      if (i >= ac_scans[c]->size()) continue;
+      const ProgressiveScan& scan = (*ac_scans[c])[i];
+      next_scan->Ss = scan.Ss;
+      next_scan->Se = scan.Se;
+      next_scan->Ah = scan.Ah;
+      next_scan->Al = scan.Al;
+      next_scan->comps_in_scan = 1;
+      next_scan->component_index[0] = c;
+      ++next_scan;
+    }
+  }
+  JPEGLI_CHECK(next_scan - cinfo->script_space == cinfo->script_space_size);
+  cinfo->scan_info = cinfo->script_space;
+  cinfo->num_scans = cinfo->script_space_size;
+  ProcessScanScript(cinfo);
+  // The token arrays were allocated for the number of scans of the default
+  // script.
+  int num_arrays = cinfo->num_scans * DivCeil(cinfo->image_height, DCTSIZE);
+  m->token_arrays = Allocate<TokenArray>(cinfo, num_arrays, JPOOL_IMAGE);
+  memset(m->token_arrays, 0, num_arrays * sizeof(TokenArray));
+}
+
 void ProcessCompressionParams(j_compress_ptr cinfo) {
   if (cinfo->dest == nullptr) {
     JPEGLI_ERROR("Missing destination.");
@@ -323,6 +484,7 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
     comp->height_in_blocks = DivCeil(comp->downsampled_height, DCTSIZE);
     blocks_per_iMCU += comp->h_samp_factor * comp->v_samp_factor;
   }
+  m->blocks_per_iMCU = blocks_per_iMCU;
   m->blocks_per_iMCU_row = total_iMCU_cols * blocks_per_iMCU;
   // Disable adaptive quantization for subsampled luma channel.
   int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
@@ -331,59 +493,11 @@ void ProcessCompressionParams(j_compress_ptr cinfo) {
       y_comp->v_samp_factor != cinfo->max_v_samp_factor) {
     m->use_adaptive_quantization = false;
   }
+  m->default_scan_script = cinfo->scan_info == nullptr;
   if (cinfo->scan_info == nullptr) {
     SetDefaultScanScript(cinfo);
   }
-  cinfo->progressive_mode = TO_JXL_BOOL(cinfo->scan_info->Ss != 0 ||
-                                        cinfo->scan_info->Se != DCTSIZE2 - 1);
-  ValidateScanScript(cinfo);
-  m->scan_token_info =
-      Allocate<ScanTokenInfo>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  memset(m->scan_token_info, 0, cinfo->num_scans * sizeof(ScanTokenInfo));
-  m->ac_ctx_offset = Allocate<uint8_t>(cinfo, cinfo->num_scans, JPOOL_IMAGE);
-  size_t num_ac_contexts = 0;
-  for (int i = 0; i < cinfo->num_scans; ++i) {
-    const jpeg_scan_info* scan_info = &cinfo->scan_info[i];
-    m->ac_ctx_offset[i] = 4 + num_ac_contexts;
-    if (scan_info->Se > 0) {
-      num_ac_contexts += scan_info->comps_in_scan;
-    }
-    if (num_ac_contexts > 252) {
-      JPEGLI_ERROR("Too many AC scans in image");
-    }
-    ScanTokenInfo* sti = &m->scan_token_info[i];
-    if (scan_info->comps_in_scan == 1) {
-      int comp_idx = scan_info->component_index[0];
-      jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-      sti->MCUs_per_row = comp->width_in_blocks;
-      sti->MCU_rows_in_scan = comp->height_in_blocks;
-      sti->blocks_in_MCU = 1;
-    } else {
-      sti->MCUs_per_row =
-          DivCeil(cinfo->image_width, DCTSIZE * cinfo->max_h_samp_factor);
-      sti->MCU_rows_in_scan =
-          DivCeil(cinfo->image_height, DCTSIZE * cinfo->max_v_samp_factor);
-      sti->blocks_in_MCU = 0;
-      for (int j = 0; j < scan_info->comps_in_scan; ++j) {
-        int comp_idx = scan_info->component_index[j];
-        jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
-        sti->blocks_in_MCU += comp->h_samp_factor * comp->v_samp_factor;
-      }
-    }
-    size_t num_MCUs = sti->MCU_rows_in_scan * sti->MCUs_per_row;
-    sti->num_blocks = num_MCUs * sti->blocks_in_MCU;
-    if (cinfo->restart_in_rows <= 0) {
-      sti->restart_interval = cinfo->restart_interval;
-    } else {
-      sti->restart_interval =
-          std::min<size_t>(sti->MCUs_per_row * cinfo->restart_in_rows, 65535u);
-    }
-    sti->num_restarts = sti->restart_interval > 0
-                            ? DivCeil(num_MCUs, sti->restart_interval)
-                            : 1;
-    sti->restarts = Allocate<size_t>(cinfo, sti->num_restarts, JPOOL_IMAGE);
-  }
-  m->num_contexts = 4 + num_ac_contexts;
+  ProcessScanScript(cinfo);
 }
 
 bool IsStreamingSupported(j_compress_ptr cinfo) {
@@ -403,6 +517,20 @@ bool IsStreamingSupported(j_compress_ptr cinfo) {
   return true;
 }
 
+void AllocateCoefficientBuffers(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  m->coeff_buffers =
+      Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    const size_t xsize_blocks = comp->width_in_blocks;
+    const size_t ysize_blocks = comp->height_in_blocks;
+    m->coeff_buffers[c] = (*cinfo->mem->request_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
+        /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
+  }
+}
+
 void AllocateBuffers(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   memset(m->last_dc_coeff, 0, sizeof(m->last_dc_coeff));
@@ -418,6 +546,17 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   if (cinfo->global_state == kEncWriteCoeffs) {
     return;
   }
+  if (cinfo->global_state == kEncWriteCoeffRows) {
+    // The coefficients of each iMCU row are given by the application, only
+    // the buffers of the entropy coding or of the whole image are needed.
+    m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
+    m->imcu_coeffs = Allocate<int32_t>(
+        cinfo, m->blocks_per_iMCU_row * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
+    if (!IsStreamingSupported(cinfo)) {
+      AllocateCoefficientBuffers(cinfo);
+    }
+    return;
+  }
   size_t iMCU_width = DCTSIZE * cinfo->max_h_samp_factor;
   size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
   size_t total_iMCU_cols = DivCeil(cinfo->image_width, iMCU_width);
@@ -451,17 +590,13 @@ void AllocateBuffers(j_compress_ptr cinfo) {
   }
   m->dct_buffer = Allocate<float>(cinfo, 2 * DCTSIZE2, JPOOL_IMAGE_ALIGNED);
   m->block_tmp = Allocate<int32_t>(cinfo, DCTSIZE2 * 4, JPOOL_IMAGE_ALIGNED);
+  m->imcu_coeffs = Allocate<int32_t>(cinfo, m->blocks_per_iMCU_row * DCTSIZE2,
+                                     JPOOL_IMAGE_ALIGNED);
+  m->imcu_dc = Allocate<float>(cinfo, m->blocks_per_iMCU_row, JPOOL_IMAGE);
+  m->imcu_dc_threshold =
+      Allocate<float>(cinfo, m->blocks_per_iMCU_row, JPOOL_IMAGE);
   if (!IsStreamingSupported(cinfo)) {
-    m->coeff_buffers =
-        Allocate<jvirt_barray_ptr>(cinfo, cinfo->num_components, JPOOL_IMAGE);
-    for (int c = 0; c < cinfo->num_components; ++c) {
-      jpeg_component_info* comp = &cinfo->comp_info[c];
-      const size_t xsize_blocks = comp->width_in_blocks;
-      const size_t ysize_blocks = comp->height_in_blocks;
-      m->coeff_buffers[c] = (*cinfo->mem->request_virt_barray)(
-          reinterpret_cast<j_common_ptr>(cinfo), JPOOL_IMAGE,
-          /*pre_zero=*/FALSE, xsize_blocks, ysize_blocks, comp->v_samp_factor);
-    }
+    AllocateCoefficientBuffers(cinfo);
   }
   if (m->use_adaptive_quantization) {
     int y_channel = cinfo->jpeg_color_space == JCS_RGB ? 1 : 0;
@@ -506,14 +641,15 @@ void InitProgressMonitor(j_compress_ptr cinfo) {
 }
 
 // Common setup code between streaming and transcoding code paths. Called in
-// both jpegli_start_compress() and jpegli_write_coefficients().
+// jpegli_start_compress(), jpegli_write_coefficients() and
+// jpegli_start_transcode().
 void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
   jpeg_comp_master* m = cinfo->master;
   (*cinfo->err->reset_error_mgr)(reinterpret_cast<j_common_ptr>(cinfo));
   ProcessCompressionParams(cinfo);
   InitProgressMonitor(cinfo);
   AllocateBuffers(cinfo);
-  if (cinfo->global_state != kEncWriteCoeffs) {
+  if (cinfo->global_state == kEncHeader) {
     ChooseInputMethod(cinfo);
     if (!cinfo->raw_data_in) {
       ChooseColorTransform(cinfo);
@@ -534,6 +670,7 @@ void InitCompress(j_compress_ptr cinfo, boolean write_all_tables) {
   WriteFileHeader(cinfo);
   JpegBitWriterInit(cinfo);
   m->next_iMCU_row = 0;
+  m->sampled_codes_written = false;
   m->last_restart_interval = 0;
   m->next_dht_index = 0;
 }
@@ -595,23 +732,70 @@ void PadInputBuffer(j_compress_ptr cinfo, float* row[kMaxComponents]) {
   }
 }
 
-void ProcessiMCURow(j_compress_ptr cinfo) {
-  JPEGLI_CHECK(cinfo->master->next_iMCU_row < cinfo->total_iMCU_rows);
-  if (!cinfo->raw_data_in) {
-    ApplyInputSmoothing(cinfo);
-    DownsampleInputBuffer(cinfo);
+// Applies the downsampled color transform to the input rows from "y0" on,
+// which are the last input row and, after the last one, the padding rows
+// below the image.
+void ApplyDownsampledColorTransform(j_compress_ptr cinfo, size_t y0) {
+  jpeg_comp_master* m = cinfo->master;
+  const size_t len = m->xsize_blocks * DCTSIZE;
+  const int v_factor = m->v_factor[1];
+  float* rows[kMaxComponents];
+  for (size_t y = y0; y < m->next_input_row; ++y) {
+    for (int c = 0; c < cinfo->input_components; ++c) {
+      rows[c] = m->input_buffer[c].Row(y);
+    }
+    float* row_cb = m->raw_data[1]->Row(y / v_factor);
+    float* row_cr = m->raw_data[2]->Row(y / v_factor);
+    (*m->downsampled_color_transform)(rows, len, y % v_factor, row_cb, row_cr);
+    // Restore the border of the luma for the adaptive quant field.
+    rows[0][-1] = rows[0][0];
+    rows[0][len] = rows[0][len - 1];
   }
-  ComputeAdaptiveQuantField(cinfo);
+}
+
+// Builds the Huffman codes from the tokens of the first iMCU rows, and writes
+// the headers and these tokens. The next iMCU rows are then written directly,
+// without keeping their tokens.
+void WriteSampledHuffmanCodes(j_compress_ptr cinfo) {
+  OptimizeHuffmanCodesForSample(cinfo);
+  InitEntropyCoder(cinfo);
+  WriteFrameHeader(cinfo);
+  WriteScanHeader(cinfo, 0);
+  WriteBufferedTokens(cinfo);
+  cinfo->master->sampled_codes_written = true;
+}
+
+// Encodes the current iMCU row, or only keeps its tokens or coefficients if
+// the bitstream can not be written yet. If "coef_rows" is not null, it has the
+// quantized coefficients of the iMCU row.
+void EncodeiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(m->next_iMCU_row < cinfo->total_iMCU_rows);
   if (IsStreamingSupported(cinfo)) {
-    if (cinfo->optimize_coding) {
-      ComputeTokensForiMCURow(cinfo);
+    if (cinfo->optimize_coding && !m->sampled_codes_written) {
+      ComputeTokensForiMCURow(cinfo, coef_rows);
+      if (m->next_iMCU_row + 1 == m->huffman_sample_rows &&
+          m->huffman_sample_rows < cinfo->total_iMCU_rows) {
+        WriteSampledHuffmanCodes(cinfo);
+      }
     } else {
-      WriteiMCURow(cinfo);
+      WriteiMCURow(cinfo, coef_rows);
     }
   } else {
-    ComputeCoefficientsForiMCURow(cinfo);
+    ComputeCoefficientsForiMCURow(cinfo, coef_rows);
   }
-  ++cinfo->master->next_iMCU_row;
+  ++m->next_iMCU_row;
+}
+
+void ProcessiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  JPEGLI_CHECK(m->next_iMCU_row < cinfo->total_iMCU_rows);
+  if (!cinfo->raw_data_in) {
+    ApplyInputSmoothing(cinfo);
+    DownsampleInputBuffer(cinfo);
+  }
+  ComputeAdaptiveQuantField(cinfo);
+  EncodeiMCURow(cinfo, /*coef_rows=*/nullptr);
 }
 
 void ProcessiMCURows(j_compress_ptr cinfo) {
@@ -692,10 +876,16 @@ void jpegli_CreateCompress(j_compress_ptr cinfo, int version,
   cinfo->master->cicp_transfer_function = 2;  // unknown transfer function code
   cinfo->master->use_std_tables = false;
   cinfo->master->use_adaptive_quantization = true;
+  cinfo->master->fast_adaptive_quantization = false;
   cinfo->master->progressive_level = jpegli::kDefaultProgressiveLevel;
+  cinfo->master->search_scan_script = false;
+  cinfo->master->default_scan_script = false;
   cinfo->master->data_type = JPEGLI_TYPE_UINT8;
   cinfo->master->endianness = JPEGLI_NATIVE_ENDIAN;
   cinfo->master->coeff_buffers = nullptr;
+  cinfo->master->runner = nullptr;
+  cinfo->master->runner_opaque = nullptr;
+  cinfo->master->huffman_sample_rows = 0;
 }
 
 void jpegli_set_xyb_mode(j_compress_ptr cinfo) {
@@ -926,6 +1116,12 @@ void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value) {
   cinfo->master->use_adaptive_quantization = FROM_JXL_BOOL(value);
 }
 
+void jpegli_enable_fast_adaptive_quantization(j_compress_ptr cinfo,
+                                              boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->fast_adaptive_quantization = FROM_JXL_BOOL(value);
+}
+
 void jpegli_simple_progression(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   jpegli_set_progressive_level(cinfo, 2);
@@ -939,6 +1135,26 @@ void jpegli_set_progressive_level(j_compress_ptr cinfo, int level) {
   cinfo->master->progressive_level = level;
 }
 
+void jpegli_enable_scan_script_search(j_compress_ptr cinfo, boolean value) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->search_scan_script = FROM_JXL_BOOL(value);
+}
+
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->master->runner = runner;
+  cinfo->master->runner_opaque = runner_opaque;
+}
+
+void jpegli_set_huffman_sample_rows(j_compress_ptr cinfo, int num_rows) {
+  CheckState(cinfo, jpegli::kEncStart);
+  if (num_rows < 0) {
+    JPEGLI_ERROR("Invalid number of Huffman sample rows %d", num_rows);
+  }
+  cinfo->master->huffman_sample_rows = num_rows;
+}
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness) {
   CheckState(cinfo, jpegli::kEncStart);
@@ -1040,6 +1256,14 @@ void jpegli_write_coefficients(j_compress_ptr cinfo,
   cinfo->master->next_input_row = cinfo->image_height;
 }
 
+void jpegli_start_transcode(j_compress_ptr cinfo) {
+  CheckState(cinfo, jpegli::kEncStart);
+  cinfo->global_state = jpegli::kEncWriteCoeffRows;
+  jpegli::InitCompress(cinfo, /*write_all_tables=*/TRUE);
+  cinfo->next_scanline = 0;
+  cinfo->master->next_input_row = 0;
+}
+
 void jpegli_write_tables(j_compress_ptr cinfo) {
   CheckState(cinfo, jpegli::kEncStart);
   if (cinfo->dest == nullptr) {
@@ -1063,7 +1287,11 @@ void jpegli_write_tables(j_compress_ptr cinfo) {
 
 void jpegli_write_m_header(j_compress_ptr cinfo, int marker,
                            unsigned int datalen) {
-  CheckState(cinfo, jpegli::kEncHeader, jpegli::kEncWriteCoeffs);
+  // When transcoding iMCU rows, the markers must be written before the rows.
+  if (cinfo->global_state != jpegli::kEncWriteCoeffRows ||
+      cinfo->next_scanline > 0) {
+    CheckState(cinfo, jpegli::kEncHeader, jpegli::kEncWriteCoeffs);
+  }
   if (datalen > jpegli::kMaxBytesInMarker) {
     JPEGLI_ERROR("Invalid marker length %u", datalen);
   }
@@ -1149,9 +1377,17 @@ JDIMENSION jpegli_write_scanlines(j_compress_ptr cinfo, JSAMPARRAY scanlines,
   }
   float* rows[jpegli::kMaxComponents];
   for (size_t i = input_lag; i < num_lines; ++i) {
+    size_t y0 = m->next_input_row;
     jpegli::ReadInputRow(cinfo, scanlines[i], rows);
-    (*m->color_transform)(rows, cinfo->image_width);
-    jpegli::PadInputBuffer(cinfo, rows);
+    if (m->downsampled_color_transform != nullptr) {
+      // Padding before the color transform gives the same result, since the
+      // transform is applied to each pixel separately.
+      jpegli::PadInputBuffer(cinfo, rows);
+      jpegli::ApplyDownsampledColorTransform(cinfo, y0);
+    } else {
+      (*m->color_transform)(rows, cinfo->image_width);
+      jpegli::PadInputBuffer(cinfo, rows);
+    }
     jpegli::ProcessiMCURows(cinfo);
     if (!jpegli::EmptyBitWriterBuffer(&m->bw)) {
       break;
@@ -1219,12 +1455,40 @@ JDIMENSION jpegli_write_raw_data(j_compress_ptr cinfo, JSAMPIMAGE data,
   return iMCU_height;
 }
 
+JDIMENSION jpegli_write_coefficient_rows(j_compress_ptr cinfo,
+                                         JBLOCKIMAGE coef_rows) {
+  CheckState(cinfo, jpegli::kEncWriteCoeffRows);
+  jpeg_comp_master* m = cinfo->master;
+  if (cinfo->next_scanline >= cinfo->image_height) {
+    return 0;
+  }
+  jpegli::ProgressMonitorInputPass(cinfo);
+  size_t iMCU_height = DCTSIZE * cinfo->max_v_samp_factor;
+  // If the output was suspended, the iMCU row was already encoded.
+  if (m->next_iMCU_row == cinfo->next_scanline / iMCU_height) {
+    if (m->next_iMCU_row == 0 && jpegli::IsStreamingSupported(cinfo) &&
+        !cinfo->optimize_coding) {
+      jpegli::WriteFrameHeader(cinfo);
+      jpegli::WriteScanHeader(cinfo, 0);
+    }
+    jpegli::EncodeiMCURow(cinfo, coef_rows);
+  }
+  if (!jpegli::EmptyBitWriterBuffer(&m->bw)) {
+    return 0;
+  }
+  cinfo->next_scanline = std::min<size_t>(
+      cinfo->image_height, cinfo->next_scanline + iMCU_height);
+  return 1;
+}
+
 //
 // Non-streaming part
 //
 
 void jpegli_finish_compress(j_compress_ptr cinfo) {
-  CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
+  if (cinfo->global_state != jpegli::kEncWriteCoeffRows) {
+    CheckState(cinfo, jpegli::kEncReadImage, jpegli::kEncWriteCoeffs);
+  }
   jpeg_comp_master* m = cinfo->master;
   if (cinfo->next_scanline < cinfo->image_height) {
     JPEGLI_ERROR("Incomplete image, expected %d rows, got %d",
@@ -1243,13 +1507,20 @@ void jpegli_finish_compress(j_compress_ptr cinfo) {
 
   const bool tokens_done = jpegli::IsStreamingSupported(cinfo);
   const bool bitstream_done =
-      tokens_done && !FROM_JXL_BOOL(cinfo->optimize_coding);
+      tokens_done &&
+      (!FROM_JXL_BOOL(cinfo->optimize_coding) || m->sampled_codes_written);
+
+  if (!tokens_done && m->search_scan_script && m->default_scan_script &&
+      cinfo->progressive_mode) {
+    jpegli::SearchScanScript(cinfo);
+  }
 
   if (!tokens_done) {
     jpegli::TokenizeJpeg(cinfo);
   }
 
-  if (cinfo->optimize_coding || cinfo->progressive_mode) {
+  if (!bitstream_done &&
+      (cinfo->optimize_coding || cinfo->progressive_mode)) {
     jpegli::OptimizeHuffmanCodes(cinfo);
     jpegli::InitEntropyCoder(cinfo);
   }
@@ -20,6 +20,8 @@
 #ifndef LIB_JPEGLI_ENCODE_H_
 #define LIB_JPEGLI_ENCODE_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <cstddef>
 #include <cstdio>
 
@@ -111,6 +113,24 @@ void jpegli_destroy_compress(j_compress_ptr cinfo);
 // the future.
 //
 
+// Starts a transcoding like jpegli_write_coefficients(), with the quantized
+// coefficients given one iMCU row at a time with
+// jpegli_write_coefficient_rows(), for example as returned by
+// jpegli_read_coefficient_rows(). If the output has a single scan without
+// restart markers, the iMCU rows are encoded when they are given, so that the
+// coefficients of the whole image are never kept in memory. With
+// optimize_coding, only their tokens are kept, or only those of the iMCU rows
+// set by jpegli_set_huffman_sample_rows(). Otherwise, the coefficients are
+// copied and encoded by jpegli_finish_compress().
+void jpegli_start_transcode(j_compress_ptr cinfo);
+
+// Writes the next iMCU row of quantized coefficients. coef_rows[c] has the
+// v_samp_factor block rows of component c, in natural order. Returns 1 if the
+// iMCU row was written, and 0 if the output was suspended, in which case the
+// call must be repeated, or all the iMCU rows were written.
+JDIMENSION jpegli_write_coefficient_rows(j_compress_ptr cinfo,
+                                         JBLOCKIMAGE coef_rows);
+
 // Sets the butteraugli target distance for the compressor. This may override
 // the default quantization table indexes based on jpeg colorspace, therefore
 // it must be called after jpegli_set_defaults() or after the last
@@ -136,6 +156,23 @@ void jpegli_set_xyb_mode(j_compress_ptr cinfo);
 // quantization tables.
 void jpegli_set_cicp_transfer_function(j_compress_ptr cinfo, int code);
 
+// Sets the parallel runner that computes the DCT coefficients of the blocks of
+// each iMCU row in parallel. The output does not depend on the runner. By
+// default, and if "runner" is NULL, everything runs on the calling thread.
+// Must be called before jpegli_start_compress().
+void jpegli_set_parallel_runner(j_compress_ptr cinfo, JxlParallelRunner runner,
+                                void* runner_opaque);
+
+// With optimize_coding, builds the Huffman codes from the first "num_rows" iMCU
+// rows and writes the rest of the image with them, instead of keeping the
+// tokens of the whole image until jpegli_finish_compress(). The codes can
+// encode every symbol, so the only cost is that they fit the rest of the image
+// less well. This keeps the memory use independent of the image height, but
+// only applies to sequential images without restart markers, and the output
+// can not be suspended while the first rows are written. Zero, the default,
+// uses the whole image. Must be called before jpegli_start_compress().
+void jpegli_set_huffman_sample_rows(j_compress_ptr cinfo, int num_rows);
+
 void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
                              JpegliEndianness endianness);
 
@@ -144,10 +181,26 @@ void jpegli_set_input_format(j_compress_ptr cinfo, JpegliDataType data_type,
 // Enabled by default.
 void jpegli_enable_adaptive_quantization(j_compress_ptr cinfo, boolean value);
 
+// Sets whether or not the adaptive quantization field is approximated from
+// the local differences of a quarter of the pixels, which makes it about twice
+// as fast to compute, for slightly larger or lower quality outputs. Has no
+// effect if adaptive quantization is disabled. Disabled by default.
+void jpegli_enable_fast_adaptive_quantization(j_compress_ptr cinfo,
+                                              boolean value);
+
 // Sets the default progression parameters, where level 0 is sequential, and
 // greater level value means more progression steps. Default is 2.
 void jpegli_set_progressive_level(j_compress_ptr cinfo, int level);
 
+// If enabled, progressive encodes with the scan script of the progressive level
+// choose, for each component, among a few splits of its AC coefficients into
+// spectral selection and successive approximation scans the one with the
+// smallest estimated size, computed from the symbol statistics of the
+// quantized coefficients, on the parallel runner if one is set. Single-scan
+// encodes and explicit scan scripts are not changed. Disabled by default.
+// Must be called before jpegli_start_compress().
+void jpegli_enable_scan_script_search(j_compress_ptr cinfo, boolean value);
+
 // If this function is called before starting compression, the quality and
 // linear quality parameters will be used to scale the standard quantization
 // tables from Annex K of the JPEG standard. By default jpegli uses a different
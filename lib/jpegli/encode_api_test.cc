@@ -151,6 +151,120 @@ TEST(EncodeAPITest, ReuseCinfoSameMemOutput) {
   if (buffer) free(buffer);
 }
 
+TEST(EncodeAPITest, ParallelRunnerSameOutput) {
+  std::vector<TestConfig> all_configs = GenerateBasicConfigs();
+  for (TestConfig& config : all_configs) {
+    // Wide enough to have several tasks per iMCU row.
+    config.input.xsize = 1100;
+    GeneratePixels(&config.input);
+    std::vector<uint8_t> compressed[2];
+    for (int parallel : {0, 1}) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        if (parallel) {
+          jpegli_set_parallel_runner(&cinfo, FourThreadsRunner, nullptr);
+        }
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      compressed[parallel].assign(buffer, buffer + buffer_size);
+      if (buffer) free(buffer);
+    }
+    ASSERT_EQ(compressed[0].size(), compressed[1].size());
+    EXPECT_EQ(0, memcmp(compressed[0].data(), compressed[1].data(),
+                        compressed[0].size()));
+  }
+}
+
+TEST(EncodeAPITest, HuffmanSampleRows) {
+  for (int samp : {1, 2}) {
+    TestConfig config;
+    config.input.xsize = 417;
+    config.input.ysize = 1003;
+    config.jparams.h_sampling = {samp, 1, 1};
+    config.jparams.v_sampling = {samp, 1, 1};
+    config.jparams.progressive_mode = 0;
+    config.jparams.optimize_coding = 1;
+    GeneratePixels(&config.input);
+    const int kTotalRows = DivCeil(config.input.ysize, 8 * samp);
+    std::vector<uint8_t> compressed[4];
+    const int sample_rows[4] = {0, 1, 8, kTotalRows};
+    for (int i = 0; i < 4; ++i) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_set_huffman_sample_rows(&cinfo, sample_rows[i]);
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      compressed[i].assign(buffer, buffer + buffer_size);
+      if (buffer) free(buffer);
+      TestImage output;
+      DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed[i],
+                        &output);
+      VerifyOutputImage(config.input, output, 2.4f);
+    }
+    // Sampling all the rows is the same as not sampling.
+    EXPECT_EQ(compressed[0], compressed[3]);
+    EXPECT_LT(compressed[2].size(), compressed[0].size() * 1.2);
+  }
+}
+
+TEST(EncodeAPITest, ScanScriptSearch) {
+  for (int samp : {1, 2}) {
+    TestConfig config;
+    config.input.xsize = 417;
+    config.input.ysize = 313;
+    config.jparams.h_sampling = {samp, 1, 1};
+    config.jparams.v_sampling = {samp, 1, 1};
+    config.jparams.progressive_mode = 2;
+    GeneratePixels(&config.input);
+    // The default script, then the searched one without and with a runner.
+    std::vector<uint8_t> compressed[3];
+    for (int i = 0; i < 3; ++i) {
+      uint8_t* buffer = nullptr;
+      unsigned long buffer_size = 0;  // NOLINT
+      jpeg_compress_struct cinfo;
+      const auto try_catch_block = [&]() -> bool {
+        ERROR_HANDLER_SETUP(jpegli);
+        jpegli_create_compress(&cinfo);
+        jpegli_mem_dest(&cinfo, &buffer, &buffer_size);
+        jpegli_enable_scan_script_search(&cinfo, i > 0 ? TRUE : FALSE);
+        if (i == 2) {
+          jpegli_set_parallel_runner(&cinfo, FourThreadsRunner, nullptr);
+        }
+        EncodeWithJpegli(config.input, config.jparams, &cinfo);
+        return true;
+      };
+      EXPECT_TRUE(try_catch_block());
+      jpegli_destroy_compress(&cinfo);
+      compressed[i].assign(buffer, buffer + buffer_size);
+      if (buffer) free(buffer);
+      TestImage output;
+      DecodeWithLibjpeg(config.jparams, DecompressParams(), compressed[i],
+                        &output);
+      VerifyOutputImage(config.input, output, 2.4f);
+    }
+    EXPECT_EQ(compressed[1], compressed[2]);
+    // The default script is one of the candidates, the estimates are not
+    // exact.
+    EXPECT_LT(compressed[1].size(), compressed[0].size() * 1.01);
+  }
+}
+
 TEST(EncodeAPITest, ReuseCinfoSameStdOutput) {
   std::vector<TestConfig> all_configs = GenerateBasicConfigs();
   FILE* tmpf = tmpfile();
@@ -394,6 +508,14 @@ std::vector<TestConfig> GenerateTests() {
     config.max_dist = 2.7;
     all_tests.push_back(config);
   }
+  {
+    TestConfig config;
+    config.jparams.quality = 80;
+    config.jparams.fast_adaptive_quantization = true;
+    config.max_bpp = 1.1;
+    config.max_dist = 2.8;
+    all_tests.push_back(config);
+  }
   for (int samp : {1, 2}) {
     for (int progr : {0, 2}) {
       for (int optimize : {0, 1}) {
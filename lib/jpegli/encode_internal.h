@@ -6,6 +6,8 @@
 #ifndef LIB_JPEGLI_ENCODE_INTERNAL_H_
 #define LIB_JPEGLI_ENCODE_INTERNAL_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <cstddef>
 #include <cstdint>
 
@@ -74,9 +76,15 @@ struct jpeg_comp_master {
   uint8_t cicp_transfer_function;
   bool use_std_tables;
   bool use_adaptive_quantization;
+  bool fast_adaptive_quantization;
   int progressive_level;
+  // Set by jpegli_enable_scan_script_search(). The search only replaces the
+  // scan script of the progressive level, i.e. if default_scan_script.
+  bool search_scan_script;
+  bool default_scan_script;
   size_t xsize_blocks;
   size_t ysize_blocks;
+  size_t blocks_per_iMCU;
   size_t blocks_per_iMCU_row;
   jpegli::ScanTokenInfo* scan_token_info;
   JpegliDataType data_type;
@@ -84,6 +92,14 @@ struct jpeg_comp_master {
   void (*input_method)(const uint8_t* row_in, size_t len,
                        float* row_out[jpegli::kMaxComponents]);
   void (*color_transform)(float* row[jpegli::kMaxComponents], size_t len);
+  // If not null, the color transform of the RGB to YCbCr, 4:2:2 or 4:2:0
+  // encodes without input smoothing, which also downsamples the chroma of the
+  // input rows straight into raw_data[1] and raw_data[2] instead of keeping it
+  // at full resolution. "iy" is the index of the input row in its pair of
+  // rows in the 4:2:0 case.
+  void (*downsampled_color_transform)(float* row[jpegli::kMaxComponents],
+                                      size_t len, int iy, float* row_cb,
+                                      float* row_cr);
   void (*downsample_method[jpegli::kMaxComponents])(
       float* rows_in[MAX_SAMP_FACTOR], size_t len, float* row_out);
   float* quant_mul[jpegli::kMaxComponents];
@@ -120,12 +136,24 @@ struct jpeg_comp_master {
   jvirt_barray_ptr* coeff_buffers;
   size_t next_input_row;
   size_t next_iMCU_row;
+  // If not zero, in streaming mode with optimize_coding the Huffman codes are
+  // built from the tokens of this many iMCU rows, and the rest are written
+  // directly with them.
+  size_t huffman_sample_rows;
+  bool sampled_codes_written;
   size_t next_dht_index;
   size_t last_restart_interval;
   JCOEF last_dc_coeff[MAX_COMPS_IN_SCAN];
   jpegli::JpegBitWriter bw;
   float* dct_buffer;
   int32_t* block_tmp;
+  // Coefficients of the blocks of the current iMCU row in MCU order, with the
+  // unrounded values and zero-bias thresholds of their DC coefficients.
+  int32_t* imcu_coeffs;
+  float* imcu_dc;
+  float* imcu_dc_threshold;
+  JxlParallelRunner runner;
+  void* runner_opaque;
   jpegli::TokenArray* token_arrays;
   size_t cur_token_array;
   jpegli::Token* next_token;
@@ -17,8 +17,11 @@
 #include "lib/jpegli/common_internal.h"
 #include "lib/jpegli/encode_internal.h"
 #include "lib/jpegli/entropy_coding.h"
+#include "lib/jpegli/error.h"
 #include "lib/jpegli/memory_manager.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jpegli/encode_streaming.cc"
@@ -36,6 +39,9 @@ static const int kStreamingModeCoefficients = 0;
 static const int kStreamingModeTokens = 1;
 static const int kStreamingModeBits = 2;
 
+// Number of MCUs of an iMCU row whose coefficients are computed by one task.
+static const int kMCUsPerTask = 16;
+
 namespace {
 void ZigZagShuffle(int32_t* JXL_RESTRICT block) {
   // TODO(szabadka) SIMDify this.
@@ -108,18 +114,121 @@ void ZigZagShuffle(int32_t* JXL_RESTRICT block) {
 }
 }  // namespace
 
+// Computes the coefficients of the blocks of the MCUs in [mcu_x0, mcu_x1) of
+// the current iMCU row, in MCU order, into the iMCU row buffers. Only reads
+// the encoder state, so that several ranges can be computed concurrently.
+void ComputeBlocksForMCUs(j_compress_ptr cinfo, int mcu_x0, int mcu_x1) {
+  jpeg_comp_master* m = cinfo->master;
+  HWY_ALIGN float dct_buffer[2 * DCTSIZE2];
+  int mcu_y = m->next_iMCU_row;
+  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
+  const float* imcu_start[kMaxComponents];
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    jpeg_component_info* comp = &cinfo->comp_info[c];
+    imcu_start[c] = m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
+  }
+  const float* qf = nullptr;
+  if (adaptive_quant) {
+    qf = m->quant_field.Row(0);
+  }
+  const size_t qf_stride = m->quant_field.stride();
+  size_t block_idx = mcu_x0 * m->blocks_per_iMCU;
+  for (int mcu_x = mcu_x0; mcu_x < mcu_x1; ++mcu_x) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      const float* JXL_RESTRICT qmc = m->quant_mul[c];
+      const size_t stride = m->raw_data[c]->stride();
+      const int h_factor = m->h_factor[c];
+      const float* zero_bias_offset = m->zero_bias_offset[c];
+      const float* zero_bias_mul = m->zero_bias_mul[c];
+      float aq_strength = 0.0f;
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        for (int ix = 0; ix < comp->h_samp_factor; ++ix, ++block_idx) {
+          size_t by = mcu_y * comp->v_samp_factor + iy;
+          size_t bx = mcu_x * comp->h_samp_factor + ix;
+          if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
+            continue;
+          }
+          if (adaptive_quant) {
+            aq_strength = qf[iy * qf_stride + bx * h_factor];
+          }
+          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
+          ComputeCoefficientBlock(pixels, stride, qmc, aq_strength,
+                                  zero_bias_offset, zero_bias_mul, dct_buffer,
+                                  m->imcu_coeffs + block_idx * DCTSIZE2,
+                                  &m->imcu_dc[block_idx],
+                                  &m->imcu_dc_threshold[block_idx]);
+        }
+      }
+    }
+  }
+}
+
+// Computes the coefficients of the current iMCU row, in parallel on the
+// runner of the encoder if it has one.
+void ComputeBlocksForiMCURow(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  int xsize_mcus = DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  if (m->runner == nullptr || xsize_mcus <= kMCUsPerTask) {
+    ComputeBlocksForMCUs(cinfo, 0, xsize_mcus);
+    return;
+  }
+  jxl::ThreadPool pool(m->runner, m->runner_opaque);
+  const auto compute = [&](const uint32_t task,
+                           size_t /*thread*/) -> jxl::Status {
+    int mcu_x0 = task * kMCUsPerTask;
+    ComputeBlocksForMCUs(cinfo, mcu_x0,
+                         std::min(mcu_x0 + kMCUsPerTask, xsize_mcus));
+    return true;
+  };
+  if (!jxl::RunOnPool(&pool, 0, DivCeil(xsize_mcus, kMCUsPerTask),
+                      jxl::ThreadPool::NoInit, compute, "ComputeBlocks")) {
+    JPEGLI_ERROR("Parallel runner failed.");
+  }
+}
+
+// Copies the quantized coefficients of the current iMCU row from "coef_rows",
+// which has the block rows of the iMCU row of each component, into the iMCU
+// row buffers, in the same order as ComputeBlocksForMCUs.
+void CopyBlocksForiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  jpeg_comp_master* m = cinfo->master;
+  int xsize_mcus = DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
+  int mcu_y = m->next_iMCU_row;
+  size_t block_idx = 0;
+  for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
+    for (int c = 0; c < cinfo->num_components; ++c) {
+      jpeg_component_info* comp = &cinfo->comp_info[c];
+      for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
+        for (int ix = 0; ix < comp->h_samp_factor; ++ix, ++block_idx) {
+          size_t by = mcu_y * comp->v_samp_factor + iy;
+          size_t bx = mcu_x * comp->h_samp_factor + ix;
+          if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
+            continue;
+          }
+          const JCOEF* src = &coef_rows[c][iy][bx][0];
+          int32_t* dst = m->imcu_coeffs + block_idx * DCTSIZE2;
+          for (int k = 0; k < DCTSIZE2; ++k) {
+            dst[k] = src[k];
+          }
+        }
+      }
+    }
+  }
+}
+
+// Processes the current iMCU row, whose coefficients are computed from the
+// input pixels, or, if "coef_rows" is not null, taken from it.
 template <int kMode>
-void ProcessiMCURow(j_compress_ptr cinfo) {
+void ProcessiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
   jpeg_comp_master* m = cinfo->master;
   JpegBitWriter* bw = &m->bw;
   int xsize_mcus = DivCeil(cinfo->image_width, 8 * cinfo->max_h_samp_factor);
   int ysize_mcus = DivCeil(cinfo->image_height, 8 * cinfo->max_v_samp_factor);
   int mcu_y = m->next_iMCU_row;
-  int32_t* block = m->block_tmp;
+  int32_t* block_tmp = m->block_tmp;
   int32_t* symbols = m->block_tmp + DCTSIZE2;
   int32_t* nonzero_idx = m->block_tmp + 3 * DCTSIZE2;
   coeff_t* JXL_RESTRICT last_dc_coeff = m->last_dc_coeff;
-  bool adaptive_quant = m->use_adaptive_quantization && m->psnr_target == 0;
   JBLOCKARRAY blocks[kMaxComponents];
   if (kMode == kStreamingModeCoefficients) {
     for (int c = 0; c < cinfo->num_components; ++c) {
@@ -141,25 +250,28 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
         ++m->cur_token_array;
         ta = &m->token_arrays[m->cur_token_array];
       }
+      // Only the sampled iMCU rows are tokenized if there are fewer of them.
+      int token_rows = ysize_mcus;
+      if (m->huffman_sample_rows > 0) {
+        token_rows = std::min<int>(token_rows, m->huffman_sample_rows);
+      }
       m->num_tokens =
-          EstimateNumTokens(cinfo, mcu_y, ysize_mcus, m->total_num_tokens,
+          EstimateNumTokens(cinfo, mcu_y, token_rows, m->total_num_tokens,
                             max_tokens_per_mcu_row);
       ta->tokens = Allocate<Token>(cinfo, m->num_tokens, JPOOL_IMAGE);
       m->next_token = ta->tokens;
     }
   }
-  const float* imcu_start[kMaxComponents];
-  for (int c = 0; c < cinfo->num_components; ++c) {
-    jpeg_component_info* comp = &cinfo->comp_info[c];
-    imcu_start[c] = m->raw_data[c]->Row(mcu_y * comp->v_samp_factor * DCTSIZE);
-  }
-  const float* qf = nullptr;
-  if (adaptive_quant) {
-    qf = m->quant_field.Row(0);
+  if (coef_rows != nullptr) {
+    CopyBlocksForiMCURow(cinfo, coef_rows);
+  } else {
+    ComputeBlocksForiMCURow(cinfo);
   }
+  // The DC coefficients and the entropy coding depend on the previous blocks,
+  // so the rest is done in order.
   HuffmanCodeTable* dc_code = nullptr;
   HuffmanCodeTable* ac_code = nullptr;
-  const size_t qf_stride = m->quant_field.stride();
+  size_t block_idx = 0;
   for (int mcu_x = 0; mcu_x < xsize_mcus; ++mcu_x) {
     for (int c = 0; c < cinfo->num_components; ++c) {
       jpeg_component_info* comp = &cinfo->comp_info[c];
@@ -167,14 +279,8 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
         dc_code = &m->coding_tables[m->context_map[c]];
         ac_code = &m->coding_tables[m->context_map[c + 4]];
       }
-      float* JXL_RESTRICT qmc = m->quant_mul[c];
-      const size_t stride = m->raw_data[c]->stride();
-      const int h_factor = m->h_factor[c];
-      const float* zero_bias_offset = m->zero_bias_offset[c];
-      const float* zero_bias_mul = m->zero_bias_mul[c];
-      float aq_strength = 0.0f;
       for (int iy = 0; iy < comp->v_samp_factor; ++iy) {
-        for (int ix = 0; ix < comp->h_samp_factor; ++ix) {
+        for (int ix = 0; ix < comp->h_samp_factor; ++ix, ++block_idx) {
           size_t by = mcu_y * comp->v_samp_factor + iy;
           size_t bx = mcu_x * comp->h_samp_factor + ix;
           if (bx >= comp->width_in_blocks || by >= comp->height_in_blocks) {
@@ -187,13 +293,12 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
             }
             continue;
           }
-          if (adaptive_quant) {
-            aq_strength = qf[iy * qf_stride + bx * h_factor];
+          int32_t* block = m->imcu_coeffs + block_idx * DCTSIZE2;
+          if (coef_rows == nullptr) {
+            SnapDCCoefficient(m->imcu_dc[block_idx],
+                              m->imcu_dc_threshold[block_idx],
+                              last_dc_coeff[c], block);
           }
-          const float* pixels = imcu_start[c] + (iy * stride + bx) * DCTSIZE;
-          ComputeCoefficientBlock(pixels, stride, qmc, last_dc_coeff[c],
-                                  aq_strength, zero_bias_offset, zero_bias_mul,
-                                  m->dct_buffer, block);
           if (kMode == kStreamingModeCoefficients) {
             JCOEF* cblock = &blocks[c][iy][bx][0];
             for (int k = 0; k < DCTSIZE2; ++k) {
@@ -206,6 +311,9 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
             ComputeTokensForBlock<int32_t, false>(block, 0, c, c + 4,
                                                   &m->next_token);
           } else if (kMode == kStreamingModeBits) {
+            // CompactBlock may write past the end of the block.
+            memcpy(block_tmp, block, DCTSIZE2 * sizeof(block[0]));
+            block = block_tmp;
             ZigZagShuffle(block);
             const int num_nonzeros = CompactBlock(block, nonzero_idx);
             const bool emit_eob = nonzero_idx[num_nonzeros - 1] < 1008;
@@ -226,16 +334,17 @@ void ProcessiMCURow(j_compress_ptr cinfo) {
   }
 }
 
-void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeCoefficients>(cinfo);
+void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo,
+                                   JBLOCKIMAGE coef_rows) {
+  ProcessiMCURow<kStreamingModeCoefficients>(cinfo, coef_rows);
 }
 
-void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeTokens>(cinfo);
+void ComputeTokensForiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  ProcessiMCURow<kStreamingModeTokens>(cinfo, coef_rows);
 }
 
-void WriteiMCURow(j_compress_ptr cinfo) {
-  ProcessiMCURow<kStreamingModeBits>(cinfo);
+void WriteiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  ProcessiMCURow<kStreamingModeBits>(cinfo, coef_rows);
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -249,16 +358,17 @@ HWY_EXPORT(ComputeCoefficientsForiMCURow);
 HWY_EXPORT(ComputeTokensForiMCURow);
 HWY_EXPORT(WriteiMCURow);
 
-void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURow)(cinfo);
+void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo,
+                                   JBLOCKIMAGE coef_rows) {
+  HWY_DYNAMIC_DISPATCH(ComputeCoefficientsForiMCURow)(cinfo, coef_rows);
 }
 
-void ComputeTokensForiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(ComputeTokensForiMCURow)(cinfo);
+void ComputeTokensForiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  HWY_DYNAMIC_DISPATCH(ComputeTokensForiMCURow)(cinfo, coef_rows);
 }
 
-void WriteiMCURow(j_compress_ptr cinfo) {
-  HWY_DYNAMIC_DISPATCH(WriteiMCURow)(cinfo);
+void WriteiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows) {
+  HWY_DYNAMIC_DISPATCH(WriteiMCURow)(cinfo, coef_rows);
 }
 
 }  // namespace jpegli
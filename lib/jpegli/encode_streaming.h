@@ -10,11 +10,16 @@
 
 namespace jpegli {
 
-void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo);
+// These process the current iMCU row, whose quantized coefficients are
+// computed from the input pixels if "coef_rows" is null, or taken from the
+// block rows of its components in "coef_rows" when transcoding.
 
-void ComputeTokensForiMCURow(j_compress_ptr cinfo);
+void ComputeCoefficientsForiMCURow(j_compress_ptr cinfo,
+                                   JBLOCKIMAGE coef_rows);
 
-void WriteiMCURow(j_compress_ptr cinfo);
+void ComputeTokensForiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows);
+
+void WriteiMCURow(j_compress_ptr cinfo, JBLOCKIMAGE coef_rows);
 
 }  // namespace jpegli
 
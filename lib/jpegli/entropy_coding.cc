@@ -9,6 +9,7 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstdlib>
 #include <cstdint>
 #include <cstring>
 #include <vector>
@@ -686,6 +687,62 @@ void BuildJpegHuffmanTable(const Histogram& histo, JHUFF_TBL* table) {
 
 }  // namespace
 
+float EstimateACScanBits(j_compress_ptr cinfo, const jpeg_scan_info& si) {
+  jpeg_comp_master* m = cinfo->master;
+  const int comp_idx = si.component_index[0];
+  const jpeg_component_info* comp = &cinfo->comp_info[comp_idx];
+  const int Al = si.Al;
+  const bool is_refinement = si.Ah > 0;
+  Histogram histo;
+  size_t extra_bits = 0;
+  int eob_run = 0;
+  const auto emit_eob_run = [&]() {
+    int nbits = jxl::FloorLog2Nonzero<uint32_t>(eob_run);
+    ++histo.count[nbits << 4u];
+    extra_bits += nbits;
+    eob_run = 0;
+  };
+  for (JDIMENSION by = 0; by < comp->height_in_blocks; ++by) {
+    JBLOCKARRAY blocks = (*cinfo->mem->access_virt_barray)(
+        reinterpret_cast<j_common_ptr>(cinfo), m->coeff_buffers[comp_idx], by,
+        1, FALSE);
+    for (JDIMENSION bx = 0; bx < comp->width_in_blocks; ++bx) {
+      const coeff_t* block = &blocks[0][bx][0];
+      int r = 0;
+      // Refinement bits of the coefficients that were already nonzero, after
+      // the last newly nonzero one.
+      int num_refinement_bits = 0;
+      for (int k = si.Ss; k <= si.Se; ++k) {
+        int absval = std::abs(static_cast<int>(block[k])) >> Al;
+        if (absval == 0) {
+          r++;
+          continue;
+        }
+        if (is_refinement && absval > 1) {
+          ++extra_bits;
+          ++num_refinement_bits;
+          continue;
+        }
+        if (eob_run > 0) emit_eob_run();
+        for (; r > 15; r -= 16) ++histo.count[0xf0];
+        // Refinement scans send the sign of newly nonzero coefficients.
+        int nbits =
+            is_refinement ? 1 : jxl::FloorLog2Nonzero<uint32_t>(absval) + 1;
+        ++histo.count[(r << 4u) + nbits];
+        extra_bits += nbits;
+        num_refinement_bits = 0;
+        r = 0;
+      }
+      if (r > 0 || num_refinement_bits > 0) {
+        ++eob_run;
+        if (eob_run == 0x7FFF) emit_eob_run();
+      }
+    }
+  }
+  if (eob_run > 0) emit_eob_run();
+  return HistogramCost(histo) + extra_bits;
+}
+
 void CopyHuffmanTables(j_compress_ptr cinfo) {
   jpeg_comp_master* m = cinfo->master;
   size_t max_huff_tables = 2 * cinfo->num_components;
@@ -720,12 +777,11 @@ void CopyHuffmanTables(j_compress_ptr cinfo) {
   }
 }
 
-void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
-  jpeg_comp_master* m = cinfo->master;
-  // Build DC and AC histograms.
-  std::vector<Histogram> histograms(m->num_contexts);
-  BuildHistograms(cinfo, histograms.data());
+namespace {
 
+void BuildHuffmanCodes(j_compress_ptr cinfo,
+                       const std::vector<Histogram>& histograms) {
+  jpeg_comp_master* m = cinfo->master;
   // Cluster DC histograms.
   JpegClusteredHistograms dc_clusters;
   ClusterJpegHistograms(cinfo, histograms.data(), cinfo->num_components,
@@ -767,6 +823,40 @@ void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
   }
 }
 
+}  // namespace
+
+void OptimizeHuffmanCodes(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  // Build DC and AC histograms.
+  std::vector<Histogram> histograms(m->num_contexts);
+  BuildHistograms(cinfo, histograms.data());
+  BuildHuffmanCodes(cinfo, histograms);
+}
+
+void OptimizeHuffmanCodesForSample(j_compress_ptr cinfo) {
+  jpeg_comp_master* m = cinfo->master;
+  std::vector<Histogram> histograms(m->num_contexts);
+  BuildHistograms(cinfo, histograms.data());
+  // Give every symbol that the rest of the scan may need a code. The count of
+  // one makes their codes long, which only costs a few bytes in the tables.
+  for (int c = 0; c < cinfo->num_components; ++c) {
+    int* dc_histo = &histograms[c].count[0];
+    int* ac_histo = &histograms[c + 4].count[0];
+    for (int nbits = 0; nbits < 16; ++nbits) {
+      dc_histo[nbits] = std::max(dc_histo[nbits], 1);
+    }
+    ac_histo[0] = std::max(ac_histo[0], 1);
+    ac_histo[0xf0] = std::max(ac_histo[0xf0], 1);
+    for (int run = 0; run < 16; ++run) {
+      for (int nbits = 1; nbits < 16; ++nbits) {
+        int symbol = (run << 4) | nbits;
+        ac_histo[symbol] = std::max(ac_histo[symbol], 1);
+      }
+    }
+  }
+  BuildHuffmanCodes(cinfo, histograms);
+}
+
 namespace {
 
 constexpr uint8_t kNumExtraBits[256] = {
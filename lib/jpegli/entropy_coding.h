@@ -19,10 +19,19 @@ size_t EstimateNumTokens(j_compress_ptr cinfo, size_t mcu_y, size_t ysize_mcus,
 
 void TokenizeJpeg(j_compress_ptr cinfo);
 
+// Estimated size in bits of the progressive AC scan "si" of a single
+// component, with a Huffman code of its own, from the statistics of its
+// symbols. Does not store tokens, so it can run on several threads.
+float EstimateACScanBits(j_compress_ptr cinfo, const jpeg_scan_info& si);
+
 void CopyHuffmanTables(j_compress_ptr cinfo);
 
 void OptimizeHuffmanCodes(j_compress_ptr cinfo);
 
+// Like OptimizeHuffmanCodes() for the tokens of the single scan so far, but
+// the codes can also encode every DC and AC symbol that is missing from them.
+void OptimizeHuffmanCodesForSample(j_compress_ptr cinfo);
+
 void InitEntropyCoder(j_compress_ptr cinfo);
 
 }  // namespace jpegli
@@ -47,6 +47,9 @@ constexpr DI di;
 using D8 = HWY_CAPPED(float, 8);
 constexpr D8 d8;
 
+using D16 = HWY_CAPPED(int16_t, 8);
+constexpr D16 d16;
+
 void DequantBlock(const int16_t* JXL_RESTRICT qblock,
                   const float* JXL_RESTRICT dequant,
                   const float* JXL_RESTRICT biases, float* JXL_RESTRICT block) {
@@ -202,6 +205,60 @@ void InverseTransformBlock8x8(const int16_t* JXL_RESTRICT qblock,
   ComputeScaledIDCT(block0, block1, output, output_stride);
 }
 
+// The reduced-size inverse transforms below only use the top-left dctsize x
+// dctsize coefficients of the block, like libjpeg's scaled IDCTs do.
+
+void InverseTransformBlock4x4(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block0 = scratch_space;
+  float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
+  float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
+  DequantBlock(qblock, dequant, biases, block0);
+  // Only the first four rows and columns of the intermediate blocks are used.
+  Transpose8x8Block(block0, block1);
+  IDCT1D<4>(block1, block0, 8);
+  Transpose8x8Block(block0, block1);
+  IDCT1D<4>(block1, block2, 8);
+  for (size_t iy = 0; iy < 4; ++iy) {
+    for (size_t ix = 0; ix < 4; ++ix) {
+      output[iy * output_stride + ix] = block2[iy * 8 + ix];
+    }
+  }
+}
+
+void InverseTransformBlock2x2(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block = scratch_space;
+  DequantBlock(qblock, dequant, biases, block);
+  const float even0 = block[0] + block[8];
+  const float even1 = block[0] - block[8];
+  const float odd0 = block[1] + block[9];
+  const float odd1 = block[1] - block[9];
+  output[0] = even0 + odd0;
+  output[1] = even0 - odd0;
+  output[output_stride] = even1 + odd1;
+  output[output_stride + 1] = even1 - odd1;
+}
+
+void InverseTransformBlock1x1(const int16_t* JXL_RESTRICT qblock,
+                              const float* JXL_RESTRICT dequant,
+                              const float* JXL_RESTRICT biases,
+                              float* JXL_RESTRICT scratch_space,
+                              float* JXL_RESTRICT output, size_t output_stride,
+                              size_t dctsize) {
+  float* JXL_RESTRICT block = scratch_space;
+  DequantBlock(qblock, dequant, biases, block);
+  *output = block[0];
+}
+
 // Computes the N-point IDCT of in[], and stores the result in out[]. The in[]
 // array is at most 8 values long, values in[8:N-1] are assumed to be 0.
 void Compute1dIDCT(const float* in, float* out, size_t N) {
@@ -630,47 +687,124 @@ void InverseTransformBlockGeneric(const int16_t* JXL_RESTRICT qblock,
   float* JXL_RESTRICT block0 = scratch_space;
   float* JXL_RESTRICT block1 = scratch_space + DCTSIZE2;
   DequantBlock(qblock, dequant, biases, block0);
-  if (dctsize == 1) {
-    *output = *block0;
-  } else if (dctsize == 2 || dctsize == 4) {
-    float* JXL_RESTRICT block2 = scratch_space + 2 * DCTSIZE2;
-    ComputeScaledIDCT(block0, block1, block2, 8);
-    if (dctsize == 4) {
-      for (size_t iy = 0; iy < 4; ++iy) {
-        for (size_t ix = 0; ix < 4; ++ix) {
-          float* block = &block2[16 * iy + 2 * ix];
-          output[iy * output_stride + ix] =
-              0.25f * (block[0] + block[1] + block[8] + block[9]);
-        }
-      }
-    } else {
-      for (size_t iy = 0; iy < 2; ++iy) {
-        for (size_t ix = 0; ix < 2; ++ix) {
-          float* block = &block2[32 * iy + 4 * ix];
-          output[iy * output_stride + ix] =
-              0.0625f *
-              (block[0] + block[1] + block[2] + block[3] + block[8] + block[9] +
-               block[10] + block[11] + block[16] + block[17] + block[18] +
-               block[19] + block[24] + block[25] + block[26] + block[27]);
-        }
-      }
-    }
-  } else {
-    float dctin[DCTSIZE];
-    float dctout[DCTSIZE * 2];
-    size_t insize = std::min<size_t>(dctsize, DCTSIZE);
-    for (size_t ix = 0; ix < insize; ++ix) {
-      for (size_t iy = 0; iy < insize; ++iy) {
-        dctin[iy] = block0[iy * DCTSIZE + ix];
-      }
-      Compute1dIDCT(dctin, dctout, dctsize);
-      for (size_t iy = 0; iy < dctsize; ++iy) {
-        block1[iy * dctsize + ix] = dctout[iy];
-      }
+  float dctin[DCTSIZE];
+  float dctout[DCTSIZE * 2];
+  size_t insize = std::min<size_t>(dctsize, DCTSIZE);
+  for (size_t ix = 0; ix < insize; ++ix) {
+    for (size_t iy = 0; iy < insize; ++iy) {
+      dctin[iy] = block0[iy * DCTSIZE + ix];
     }
+    Compute1dIDCT(dctin, dctout, dctsize);
     for (size_t iy = 0; iy < dctsize; ++iy) {
-      Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride,
-                    dctsize);
+      block1[iy * dctsize + ix] = dctout[iy];
+    }
+  }
+  for (size_t iy = 0; iy < dctsize; ++iy) {
+    Compute1dIDCT(block1 + iy * dctsize, output + iy * output_stride, dctsize);
+  }
+}
+
+// The fast inverse transform below is the AAN integer IDCT of libjpeg's
+// jidctfst.c on int16 lanes. The dequantization multipliers include the AAN
+// scale factors, and the coefficients are kept with kFastPassBits fractional
+// bits in both passes.
+
+void DequantBlockFast(const int16_t* JXL_RESTRICT qblock,
+                      const float* JXL_RESTRICT dequant,
+                      int16_t* JXL_RESTRICT block) {
+  const Rebind<int16_t, DI> di16;
+  for (size_t k = 0; k < 64; k += Lanes(d)) {
+    const auto mul = Load(d, dequant + k);
+    const Vec<DI> quant_i = PromoteTo(di, Load(di16, qblock + k));
+    const auto deq = NearestInt(Mul(ConvertTo(d, quant_i), mul));
+    Store(DemoteTo(di16, deq), di16, block + k);
+  }
+}
+
+// Computes the 1D IDCT of the columns of from[] and stores them in to[]. The
+// multiplications by constants greater than one are split into a sum of the
+// input and a fixed-point multiplication.
+void IDCT1DFast(const int16_t* JXL_RESTRICT from, int16_t* JXL_RESTRICT to) {
+  const auto k0414 = Set(d16, 13573);  // 1.414213562 - 1
+  const auto k0848 = Set(d16, 27780);  // 1.847759065 - 1
+  const auto k0082 = Set(d16, 2700);   // 1.082392200 - 1
+  const auto k0613 = Set(d16, 20091);  // 2.613125930 - 2
+  for (size_t i = 0; i < 8; i += Lanes(d16)) {
+    const auto in0 = Load(d16, from + 0 * 8 + i);
+    const auto in1 = Load(d16, from + 1 * 8 + i);
+    const auto in2 = Load(d16, from + 2 * 8 + i);
+    const auto in3 = Load(d16, from + 3 * 8 + i);
+    const auto in4 = Load(d16, from + 4 * 8 + i);
+    const auto in5 = Load(d16, from + 5 * 8 + i);
+    const auto in6 = Load(d16, from + 6 * 8 + i);
+    const auto in7 = Load(d16, from + 7 * 8 + i);
+    // Even part.
+    const auto tmp10 = Add(in0, in4);
+    const auto tmp11 = Sub(in0, in4);
+    const auto tmp13 = Add(in2, in6);
+    const auto diff26 = Sub(in2, in6);
+    const auto tmp12 = Sub(Add(diff26, MulFixedPoint15(diff26, k0414)), tmp13);
+    const auto even0 = Add(tmp10, tmp13);
+    const auto even3 = Sub(tmp10, tmp13);
+    const auto even1 = Add(tmp11, tmp12);
+    const auto even2 = Sub(tmp11, tmp12);
+    // Odd part.
+    const auto z13 = Add(in5, in3);
+    const auto z10 = Sub(in5, in3);
+    const auto z11 = Add(in1, in7);
+    const auto z12 = Sub(in1, in7);
+    const auto odd7 = Add(z11, z13);
+    const auto diff1113 = Sub(z11, z13);
+    const auto odd11 = Add(diff1113, MulFixedPoint15(diff1113, k0414));
+    const auto sum1012 = Add(z10, z12);
+    const auto z5 = Add(sum1012, MulFixedPoint15(sum1012, k0848));
+    const auto odd10 = Sub(Add(z12, MulFixedPoint15(z12, k0082)), z5);
+    const auto odd12 = Sub(z5, Add(Add(z10, z10), MulFixedPoint15(z10, k0613)));
+    const auto odd6 = Sub(odd12, odd7);
+    const auto odd5 = Sub(odd11, odd6);
+    const auto odd4 = Add(odd10, odd5);
+    Store(Add(even0, odd7), d16, to + 0 * 8 + i);
+    Store(Sub(even0, odd7), d16, to + 7 * 8 + i);
+    Store(Add(even1, odd6), d16, to + 1 * 8 + i);
+    Store(Sub(even1, odd6), d16, to + 6 * 8 + i);
+    Store(Add(even2, odd5), d16, to + 2 * 8 + i);
+    Store(Sub(even2, odd5), d16, to + 5 * 8 + i);
+    Store(Add(even3, odd4), d16, to + 4 * 8 + i);
+    Store(Sub(even3, odd4), d16, to + 3 * 8 + i);
+  }
+}
+
+void InverseTransformBlock8x8Fast(const int16_t* JXL_RESTRICT qblock,
+                                  const float* JXL_RESTRICT dequant,
+                                  const float* JXL_RESTRICT biases,
+                                  float* JXL_RESTRICT scratch_space,
+                                  float* JXL_RESTRICT output,
+                                  size_t output_stride, size_t dctsize) {
+  HWY_ALIGN int16_t block0[DCTSIZE2];
+  HWY_ALIGN int16_t block1[DCTSIZE2];
+  DequantBlockFast(qblock, dequant, block0);
+  IDCT1DFast(block0, block1);
+  for (size_t iy = 0; iy < 8; ++iy) {
+    for (size_t ix = 0; ix < 8; ++ix) {
+      block0[ix * 8 + iy] = block1[iy * 8 + ix];
+    }
+  }
+  IDCT1DFast(block0, block1);
+  // The output of the second pass is transposed, and scaled by 8 and by the
+  // fractional bits of the coefficients.
+  float* JXL_RESTRICT fblock0 = scratch_space;
+  float* JXL_RESTRICT fblock1 = scratch_space + DCTSIZE2;
+  const auto scale = Set(d, 1.0f / (8 * 255 * (1 << kFastPassBits)));
+  const Rebind<int16_t, DI> di16;
+  for (size_t k = 0; k < 64; k += Lanes(d)) {
+    const Vec<DI> pixel_i = PromoteTo(di, Load(di16, block1 + k));
+    Store(Mul(ConvertTo(d, pixel_i), scale), d, fblock0 + k);
+  }
+  Transpose8x8Block(fblock0, fblock1);
+  for (size_t iy = 0; iy < 8; ++iy) {
+    for (size_t ix = 0; ix < 8; ix += Lanes(d8)) {
+      StoreU(Load(d8, fblock1 + iy * 8 + ix), d8,
+             output + iy * output_stride + ix);
     }
   }
 }
@@ -684,7 +818,34 @@ HWY_AFTER_NAMESPACE();
 namespace jpegli {
 
 HWY_EXPORT(InverseTransformBlock8x8);
+HWY_EXPORT(InverseTransformBlock4x4);
+HWY_EXPORT(InverseTransformBlock2x2);
+HWY_EXPORT(InverseTransformBlock1x1);
 HWY_EXPORT(InverseTransformBlockGeneric);
+HWY_EXPORT(InverseTransformBlock8x8Fast);
+
+bool UseFastInverseTransform(j_decompress_ptr cinfo, int c) {
+  return cinfo->dct_method == JDCT_IFAST &&
+         cinfo->master->scaled_dct_size[c] == DCTSIZE;
+}
+
+void ComputeFastDequantMultipliers(const JQUANT_TBL* table, float* dequant) {
+  // 1 for k = 0, cos(k * pi / 16) * sqrt(2) otherwise.
+  static constexpr float kAANScales[DCTSIZE] = {
+      1.0f,
+      1.387039845f,
+      1.306562965f,
+      1.175875602f,
+      1.0f,
+      0.785694958f,
+      0.541196100f,
+      0.275899379f,
+  };
+  for (size_t k = 0; k < DCTSIZE2; ++k) {
+    dequant[k] = table->quantval[k] * kAANScales[k / DCTSIZE] *
+                 kAANScales[k % DCTSIZE] * (1 << kFastPassBits);
+  }
+}
 
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
@@ -693,8 +854,17 @@ jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo) {
     if (dct_size < 1 || dct_size > 16) {
       return JXL_FAILURE("Compute1dIDCT does not support N=%d", dct_size);
     }
-    if (dct_size == DCTSIZE) {
+    if (UseFastInverseTransform(cinfo, c)) {
+      m->inverse_transform[c] =
+          HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8Fast);
+    } else if (dct_size == DCTSIZE) {
       m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock8x8);
+    } else if (dct_size == 4) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock4x4);
+    } else if (dct_size == 2) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock2x2);
+    } else if (dct_size == 1) {
+      m->inverse_transform[c] = HWY_DYNAMIC_DISPATCH(InverseTransformBlock1x1);
     } else {
       m->inverse_transform[c] =
           HWY_DYNAMIC_DISPATCH(InverseTransformBlockGeneric);
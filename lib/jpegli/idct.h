@@ -11,6 +11,17 @@
 
 namespace jpegli {
 
+// Number of fractional bits of the coefficients in the fast inverse transform.
+constexpr int kFastPassBits = 2;
+
+// Returns true if component "c" is decoded with the fast integer inverse
+// transform, which is used for unscaled 8x8 blocks if dct_method is JDCT_IFAST.
+// It trades accuracy for speed and does not use dequantization biases.
+bool UseFastInverseTransform(j_decompress_ptr cinfo, int c);
+
+// Fills in the 64 dequantization multipliers of the fast inverse transform.
+void ComputeFastDequantMultipliers(const JQUANT_TBL* table, float* dequant);
+
 jxl::Status ChooseInverseTransform(j_decompress_ptr cinfo);
 
 }  // namespace jpegli
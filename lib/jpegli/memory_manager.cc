@@ -10,6 +10,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <hwy/aligned_allocator.h>
+#include <map>
 #include <vector>
 
 #include "lib/jpegli/common.h"
@@ -32,14 +33,57 @@ namespace jpegli {
 
 namespace {
 
+// The blocks of the image pools are not freed when the pool is freed, but
+// kept for the allocations of the next image, which are looked up by their size
+// rounded up to one of these size classes. Blocks are only kept for one image,
+// so the memory held by an idle manager is at most what the last image used.
 struct MemoryManager {
   struct jpeg_memory_mgr pub;
-  std::vector<void*> owned_ptrs[2 * JPOOL_NUMPOOLS];
+  struct Block {
+    void* ptr;
+    size_t size;
+  };
+  std::vector<Block> owned_blocks[2 * JPOOL_NUMPOOLS];
+  // Blocks of the last image that were not reused yet, by size class, for the
+  // unaligned and the aligned image pool.
+  std::map<size_t, std::vector<void*>> free_blocks[2];
   uint64_t pool_memory_usage[2 * JPOOL_NUMPOOLS];
   uint64_t total_memory_usage;
   uint64_t peak_memory_usage;
 };
 
+bool IsImagePool(int pool_id) {
+  return pool_id == JPOOL_IMAGE || pool_id == JPOOL_NUMPOOLS + JPOOL_IMAGE;
+}
+
+// Rounds up "size" to a size class, with four classes per power of two, so
+// that at most a fifth of the retained memory is not used.
+size_t SizeClass(size_t size) {
+  if (size <= 64) return 64;
+  size_t shift = 0;
+  while ((size - 1) >> (shift + 3)) ++shift;
+  return RoundUpTo(size, static_cast<size_t>(1) << shift);
+}
+
+void FreeBlock(void* ptr, bool aligned) {
+  if (aligned) {
+    hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
+  } else {
+    free(ptr);
+  }
+}
+
+void ReleaseFreeBlocks(MemoryManager* mem) {
+  for (int aligned = 0; aligned < 2; ++aligned) {
+    for (auto& size_and_blocks : mem->free_blocks[aligned]) {
+      for (void* ptr : size_and_blocks.second) {
+        FreeBlock(ptr, aligned);
+      }
+    }
+    mem->free_blocks[aligned].clear();
+  }
+}
+
 void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
   if (pool_id < 0 || pool_id >= 2 * JPOOL_NUMPOOLS) {
@@ -51,16 +95,28 @@ void* Alloc(j_common_ptr cinfo, int pool_id, size_t sizeofobject) {
     JPEGLI_ERROR("Total memory usage exceeding %ld",
                  mem->pub.max_memory_to_use);
   }
-  void* p;
-  if (pool_id < JPOOL_NUMPOOLS) {
-    p = malloc(sizeofobject);
-  } else {
-    p = hwy::AllocateAlignedBytes(sizeofobject, nullptr, nullptr);
+  const bool aligned = pool_id >= JPOOL_NUMPOOLS;
+  size_t size = sizeofobject;
+  void* p = nullptr;
+  if (IsImagePool(pool_id)) {
+    size = SizeClass(sizeofobject);
+    auto it = mem->free_blocks[aligned].find(size);
+    if (it != mem->free_blocks[aligned].end() && !it->second.empty()) {
+      p = it->second.back();
+      it->second.pop_back();
+    }
+  }
+  if (p == nullptr) {
+    if (aligned) {
+      p = hwy::AllocateAlignedBytes(size, nullptr, nullptr);
+    } else {
+      p = malloc(size);
+    }
   }
   if (p == nullptr) {
     JPEGLI_ERROR("Out of memory");
   }
-  mem->owned_ptrs[pool_id].push_back(p);
+  mem->owned_blocks[pool_id].push_back({p, size});
   mem->pool_memory_usage[pool_id] += sizeofobject;
   mem->total_memory_usage += sizeofobject;
   mem->peak_memory_usage =
@@ -131,7 +187,7 @@ T** AccessVirtualArray(j_common_ptr cinfo, Control* ptr, JDIMENSION start_row,
 
 void ClearPool(j_common_ptr cinfo, int pool_id) {
   MemoryManager* mem = reinterpret_cast<MemoryManager*>(cinfo->mem);
-  mem->owned_ptrs[pool_id].clear();
+  mem->owned_blocks[pool_id].clear();
   mem->total_memory_usage -= mem->pool_memory_usage[pool_id];
   mem->pool_memory_usage[pool_id] = 0;
 }
@@ -141,12 +197,30 @@ void FreePool(j_common_ptr cinfo, int pool_id) {
   if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
     JPEGLI_ERROR("Invalid pool id %d", pool_id);
   }
-  for (void* ptr : mem->owned_ptrs[pool_id]) {
-    free(ptr);
+  if (pool_id == JPOOL_IMAGE) {
+    const int aligned_pool_id = JPOOL_NUMPOOLS + pool_id;
+    if (mem->owned_blocks[pool_id].empty() &&
+        mem->owned_blocks[aligned_pool_id].empty()) {
+      // Keep the blocks of the last image if the pool is freed again.
+      return;
+    }
+    // The blocks that the image did not reuse are not kept for the next one.
+    ReleaseFreeBlocks(mem);
+    for (int aligned = 0; aligned < 2; ++aligned) {
+      const int id = aligned ? aligned_pool_id : pool_id;
+      for (const auto& block : mem->owned_blocks[id]) {
+        mem->free_blocks[aligned][block.size].push_back(block.ptr);
+      }
+      ClearPool(cinfo, id);
+    }
+    return;
+  }
+  for (const auto& block : mem->owned_blocks[pool_id]) {
+    FreeBlock(block.ptr, /*aligned=*/false);
   }
   ClearPool(cinfo, pool_id);
-  for (void* ptr : mem->owned_ptrs[JPOOL_NUMPOOLS + pool_id]) {
-    hwy::FreeAlignedBytes(ptr, nullptr, nullptr);
+  for (const auto& block : mem->owned_blocks[JPOOL_NUMPOOLS + pool_id]) {
+    FreeBlock(block.ptr, /*aligned=*/true);
   }
   ClearPool(cinfo, JPOOL_NUMPOOLS + pool_id);
 }
@@ -156,6 +230,7 @@ void SelfDestruct(j_common_ptr cinfo) {
   for (int pool_id = 0; pool_id < JPOOL_NUMPOOLS; ++pool_id) {
     FreePool(cinfo, pool_id);
   }
+  ReleaseFreeBlocks(mem);
   delete mem;
   cinfo->mem = nullptr;
 }
@@ -26,6 +26,8 @@
 #include "lib/jpegli/upsample.h"
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
 
 #ifdef MEMORY_SANITIZER
 #define JXL_MEMORY_SANITIZER 1
@@ -293,6 +295,10 @@ HWY_EXPORT(GatherBlockStats);
 HWY_EXPORT(WriteToOutput);
 HWY_EXPORT(DecenterRow);
 
+// Number of blocks of a block row whose inverse transform is computed by one
+// task of the parallel runner.
+static const size_t kIDCTBlocksPerTask = 64;
+
 void GatherBlockStats(const int16_t* JXL_RESTRICT coeffs,
                       const size_t coeffs_size, int32_t* JXL_RESTRICT nonzeros,
                       int32_t* JXL_RESTRICT sumabs) {
@@ -312,6 +318,7 @@ void DecenterRow(float* row, size_t xsize) {
 
 bool ShouldApplyDequantBiases(j_decompress_ptr cinfo, int ci) {
   const auto& compinfo = cinfo->comp_info[ci];
+  if (UseFastInverseTransform(cinfo, ci)) return false;
   return (compinfo.h_samp_factor == cinfo->max_h_samp_factor &&
           compinfo.v_samp_factor == cinfo->max_v_samp_factor);
 }
@@ -393,9 +400,8 @@ bool do_smoothing(j_decompress_ptr cinfo) {
 }
 
 void PredictSmooth(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int component,
-                   size_t bx, int iy) {
+                   size_t bx, int iy, int16_t* scratch) {
   const size_t imcu_row = cinfo->output_iMCU_row;
-  int16_t* scratch = cinfo->master->smoothing_scratch_;
   std::vector<int> Q_VAL(SAVED_COEFS);
   int* coef_bits;
 
@@ -568,6 +574,10 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
     const auto& comp = cinfo->comp_info[c];
     JQUANT_TBL* table = comp.quant_table;
     if (table == nullptr) continue;
+    if (UseFastInverseTransform(cinfo, c)) {
+      ComputeFastDequantMultipliers(table, &m->dequant_[c * DCTSIZE2]);
+      continue;
+    }
     for (size_t k = 0; k < DCTSIZE2; ++k) {
       m->dequant_[c * DCTSIZE2 + k] = table->quantval[k] * kDequantScale;
     }
@@ -576,6 +586,32 @@ void PrepareForOutput(j_decompress_ptr cinfo) {
   ChooseColorTransform(cinfo);
 }
 
+// Writes the inverse transform of the blocks [bx0, bx1) of block row "iy" of
+// the current iMCU row of component "c" to its raw output.
+void InverseTransformBlocks(j_decompress_ptr cinfo, JBLOCKARRAY blocks, int c,
+                            int iy, size_t bx0, size_t bx1,
+                            float* JXL_RESTRICT idct_scratch,
+                            int16_t* JXL_RESTRICT smoothing_scratch) {
+  jpeg_decomp_master* m = cinfo->master;
+  const auto& compinfo = cinfo->comp_info[c];
+  size_t k0 = c * DCTSIZE2;
+  size_t by = cinfo->output_iMCU_row * compinfo.v_samp_factor + iy;
+  size_t dctsize = m->scaled_dct_size[c];
+  RowBuffer<float>* raw_out = &m->raw_output_[c];
+  int16_t* JXL_RESTRICT row_in = &blocks[iy][0][0];
+  float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
+  for (size_t bx = bx0; bx < bx1; ++bx) {
+    const int16_t* qblock = &row_in[bx * DCTSIZE2];
+    if (m->apply_smoothing) {
+      PredictSmooth(cinfo, blocks, c, bx, iy, smoothing_scratch);
+      qblock = smoothing_scratch;
+    }
+    (*m->inverse_transform[c])(qblock, &m->dequant_[k0], &m->biases_[k0],
+                               idct_scratch, &row_out[bx * dctsize],
+                               raw_out->stride(), dctsize);
+  }
+}
+
 void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
   jpeg_decomp_master* m = cinfo->master;
   const size_t imcu_row = cinfo->output_iMCU_row;
@@ -613,31 +649,41 @@ void DecodeCurrentiMCURow(j_decompress_ptr cinfo) {
                                       &m->biases_[k0]);
       }
     }
-    RowBuffer<float>* raw_out = &m->raw_output_[c];
-    for (int iy = 0; iy < compinfo.v_samp_factor; ++iy) {
-      size_t by = block_row + iy;
-      if (by >= compinfo.height_in_blocks) {
-        continue;
+    int num_rows = std::min<int>(compinfo.v_samp_factor,
+                                 compinfo.height_in_blocks - block_row);
+    if (m->runner == nullptr ||
+        compinfo.width_in_blocks <= kIDCTBlocksPerTask) {
+      for (int iy = 0; iy < num_rows; ++iy) {
+        InverseTransformBlocks(cinfo, blocks[c], c, iy, 0,
+                               compinfo.width_in_blocks, m->idct_scratch_,
+                               m->smoothing_scratch_);
       }
-      size_t dctsize = m->scaled_dct_size[c];
-      int16_t* JXL_RESTRICT row_in = &blocks[c][iy][0][0];
-      float* JXL_RESTRICT row_out = raw_out->Row(by * dctsize);
-      for (size_t bx = 0; bx < compinfo.width_in_blocks; ++bx) {
-        if (m->apply_smoothing) {
-          PredictSmooth(cinfo, blocks[c], c, bx, iy);
-          (*m->inverse_transform[c])(m->smoothing_scratch_, &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        } else {
-          (*m->inverse_transform[c])(&row_in[bx * DCTSIZE2], &m->dequant_[k0],
-                                     &m->biases_[k0], m->idct_scratch_,
-                                     &row_out[bx * dctsize], raw_out->stride(),
-                                     dctsize);
-        }
+    } else {
+      // The blocks of each row are split into tasks, which keep their scratch
+      // space on the stack.
+      size_t tasks_per_row =
+          DivCeil(compinfo.width_in_blocks, kIDCTBlocksPerTask);
+      jxl::ThreadPool pool(m->runner, m->runner_opaque);
+      const auto transform = [&](const uint32_t task,
+                                 size_t /*thread*/) -> jxl::Status {
+        HWY_ALIGN float idct_scratch[5 * DCTSIZE2];
+        HWY_ALIGN int16_t smoothing_scratch[DCTSIZE2];
+        size_t bx0 = (task % tasks_per_row) * kIDCTBlocksPerTask;
+        size_t bx1 = std::min<size_t>(bx0 + kIDCTBlocksPerTask,
+                                      compinfo.width_in_blocks);
+        InverseTransformBlocks(cinfo, blocks[c], c, task / tasks_per_row, bx0,
+                               bx1, idct_scratch, smoothing_scratch);
+        return true;
+      };
+      if (!jxl::RunOnPool(&pool, 0, num_rows * tasks_per_row,
+                          jxl::ThreadPool::NoInit, transform, "IDCT")) {
+        JPEGLI_ERROR("Parallel runner failed.");
       }
-      if (m->streaming_mode_) {
-        memset(row_in, 0, compinfo.width_in_blocks * sizeof(JBLOCK));
+    }
+    if (m->streaming_mode_) {
+      for (int iy = 0; iy < num_rows; ++iy) {
+        memset(&blocks[c][iy][0][0], 0,
+               compinfo.width_in_blocks * sizeof(JBLOCK));
       }
     }
   }
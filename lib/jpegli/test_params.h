@@ -105,6 +105,7 @@ struct CompressParams {
   bool xyb_mode = false;
   bool libjpeg_mode = false;
   bool use_adaptive_quantization = true;
+  bool fast_adaptive_quantization = false;
   std::vector<uint8_t> icc;
 
   int h_samp(int c) const { return h_sampling.empty() ? 1 : h_sampling[c]; }
@@ -150,6 +151,7 @@ struct DecompressParams {
   bool crop_output = false;
   bool do_block_smoothing = false;
   bool do_fancy_upsampling = true;
+  bool fast_idct = false;
   bool skip_scans = false;
   int scale_num = 1;
   int scale_denom = 1;
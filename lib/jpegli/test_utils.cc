@@ -5,6 +5,7 @@
 
 #include "lib/jpegli/test_utils.h"
 
+#include <jxl/parallel_runner.h>
 #include <jxl/types.h>
 
 #include <algorithm>
@@ -19,6 +20,7 @@
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -305,6 +307,8 @@ std::ostream& operator<<(std::ostream& os, const CompressParams& jparams) {
   }
   if (!jparams.use_adaptive_quantization) {
     os << "NoAQ";
+  } else if (jparams.fast_adaptive_quantization) {
+    os << "FastAQ";
   }
   if (jparams.restart_interval > 0) {
     os << "R" << jparams.restart_interval;
@@ -639,6 +643,8 @@ void EncodeWithJpegli(const TestImage& input, const CompressParams& jparams,
   jpegli_set_input_format(cinfo, input.data_type, input.endianness);
   jpegli_enable_adaptive_quantization(
       cinfo, TO_JXL_BOOL(jparams.use_adaptive_quantization));
+  jpegli_enable_fast_adaptive_quantization(
+      cinfo, TO_JXL_BOOL(jparams.fast_adaptive_quantization));
   cinfo->restart_interval = jparams.restart_interval;
   cinfo->restart_in_rows = jparams.restart_in_rows;
   cinfo->smoothing_factor = jparams.smoothing_factor;
@@ -876,4 +882,23 @@ void VerifyOutputImage(const TestImage& input, const TestImage& output,
   }
 }
 
+JxlParallelRetCode FourThreadsRunner(void* runner_opaque, void* jpegxl_opaque,
+                                     JxlParallelRunInit init,
+                                     JxlParallelRunFunction func,
+                                     uint32_t start_range, uint32_t end_range) {
+  constexpr size_t kNumThreads = 4;
+  JxlParallelRetCode ret = init(jpegxl_opaque, kNumThreads);
+  if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([=]() {
+      for (uint32_t i = start_range + t; i < end_range; i += kNumThreads) {
+        func(jpegxl_opaque, i, t);
+      }
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
 }  // namespace jpegli
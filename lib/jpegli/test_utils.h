@@ -6,6 +6,8 @@
 #ifndef LIB_JPEGLI_TEST_UTILS_H_
 #define LIB_JPEGLI_TEST_UTILS_H_
 
+#include <jxl/parallel_runner.h>
+
 #include <csetjmp>
 #include <cstddef>
 #include <cstdint>
@@ -122,6 +124,12 @@ void VerifyOutputImage(const TestImage& input, const TestImage& output,
 
 void Check(bool ok);
 
+// JxlParallelRunner that runs every fourth task on each of four threads.
+JxlParallelRetCode FourThreadsRunner(void* runner_opaque, void* jpegxl_opaque,
+                                     JxlParallelRunInit init,
+                                     JxlParallelRunFunction func,
+                                     uint32_t start_range, uint32_t end_range);
+
 }  // namespace jpegli
 
 #endif  // LIB_JPEGLI_TEST_UTILS_H_
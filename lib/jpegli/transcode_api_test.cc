@@ -24,7 +24,7 @@ namespace jpegli {
 namespace {
 
 void TranscodeWithJpegli(const std::vector<uint8_t>& jpeg_input,
-                         const CompressParams& jparams,
+                         const CompressParams& jparams, bool use_rows,
                          std::vector<uint8_t>* jpeg_output) {
   jpeg_decompress_struct dinfo = {};
   jpeg_compress_struct cinfo = {};
@@ -38,14 +38,24 @@ void TranscodeWithJpegli(const std::vector<uint8_t>& jpeg_input,
     jpegli_mem_src(&dinfo, jpeg_input.data(), jpeg_input.size());
     EXPECT_EQ(JPEG_REACHED_SOS,
               jpegli_read_header(&dinfo, /*require_image=*/TRUE));
-    jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&dinfo);
-    JPEGLI_TEST_ENSURE_TRUE(coef_arrays != nullptr);
     jpegli_create_compress(&cinfo);
     jpegli_mem_dest(&cinfo, &transcoded_data, &transcoded_size);
     jpegli_copy_critical_parameters(&dinfo, &cinfo);
     jpegli_set_progressive_level(&cinfo, jparams.progressive_mode);
     cinfo.optimize_coding = jparams.optimize_coding;
-    jpegli_write_coefficients(&cinfo, coef_arrays);
+    if (use_rows) {
+      jpegli_start_transcode(&cinfo);
+      JBLOCKARRAY coef_rows[MAX_COMPONENTS];
+      while (jpegli_read_coefficient_rows(&dinfo, coef_rows) == 1) {
+        JPEGLI_TEST_ENSURE_TRUE(
+            jpegli_write_coefficient_rows(&cinfo, coef_rows) == 1);
+      }
+      JPEGLI_TEST_ENSURE_TRUE(dinfo.output_iMCU_row == dinfo.total_iMCU_rows);
+    } else {
+      jvirt_barray_ptr* coef_arrays = jpegli_read_coefficients(&dinfo);
+      JPEGLI_TEST_ENSURE_TRUE(coef_arrays != nullptr);
+      jpegli_write_coefficients(&cinfo, coef_arrays);
+    }
     jpegli_finish_compress(&cinfo);
     jpegli_finish_decompress(&dinfo);
     return true;
@@ -85,7 +95,20 @@ TEST_P(TranscodeAPITestParam, TestAPI) {
     std::vector<uint8_t> transcoded;
     jparams.progressive_mode = progr;
     jparams.optimize_coding = 1;
-    TranscodeWithJpegli(compressed, jparams, &transcoded);
+    TranscodeWithJpegli(compressed, jparams, /*use_rows=*/false, &transcoded);
+
+    // Transcoding iMCU row by iMCU row gives the same image, also when the
+    // output has several scans and the coefficients have to be kept.
+    std::vector<uint8_t> transcoded_rows;
+    TranscodeWithJpegli(compressed, jparams, /*use_rows=*/true,
+                        &transcoded_rows);
+    TestImage output_rows;
+    DecodeWithLibjpeg(jparams, DecompressParams(), transcoded_rows,
+                      &output_rows);
+    ASSERT_EQ(output0.pixels.size(), output_rows.pixels.size());
+    EXPECT_EQ(0, memcmp(output0.pixels.data(), output_rows.pixels.data(),
+                        output0.pixels.size()));
+    EXPECT_LT(transcoded_rows.size(), compressed.size() * 0.98f);
 
     // We expect a size reduction of at least 2%.
     EXPECT_LT(transcoded.size(), compressed.size() * 0.98f);
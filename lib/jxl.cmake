@@ -44,6 +44,25 @@ else()
   list(APPEND JPEGXL_INTERNAL_FLAGS -DJPEGXL_ENABLE_BOXES=0)
 endif ()
 
+set(JPEGXL_DEC_CUDA_OBJECTS)
+if (JPEGXL_ENABLE_CUDA)
+  enable_language(CUDA)
+  find_package(CUDAToolkit REQUIRED)
+  list(APPEND JPEGXL_INTERNAL_FLAGS -DJPEGXL_ENABLE_CUDA=1)
+  list(APPEND JPEGXL_DEC_INTERNAL_LIBS CUDA::cudart)
+  list(APPEND JPEGXL_INTERNAL_LIBS CUDA::cudart)
+  # The kernels of the render pipeline offload only include the CUDA runtime,
+  # and are built without the C++ compile options of the directory.
+  add_library(jxl_cuda-obj OBJECT jxl/render_pipeline/gpu_offload_kernels.cu)
+  set_property(TARGET jxl_cuda-obj PROPERTY COMPILE_OPTIONS "")
+  set_property(TARGET jxl_cuda-obj PROPERTY POSITION_INDEPENDENT_CODE ON)
+  target_include_directories(jxl_cuda-obj PRIVATE
+    "$<BUILD_INTERFACE:${PROJECT_SOURCE_DIR}>")
+  set(JPEGXL_DEC_CUDA_OBJECTS $<TARGET_OBJECTS:jxl_cuda-obj>)
+else()
+  list(APPEND JPEGXL_INTERNAL_FLAGS -DJPEGXL_ENABLE_CUDA=0)
+endif ()
+
 set(OBJ_COMPILE_DEFINITIONS
   # Used to determine if we are building the library when defined or just
   # including the library when not defined. This is public so libjxl shared
@@ -147,6 +166,7 @@ set_target_properties(jxl_enc-obj PROPERTIES
 # for tests.
 add_library(jxl_dec-internal STATIC
   $<TARGET_OBJECTS:jxl_dec-obj>
+  ${JPEGXL_DEC_CUDA_OBJECTS}
   ${JXL_CMS_OBJECTS}
 )
 target_link_libraries(jxl_dec-internal PUBLIC
@@ -159,6 +179,7 @@ target_link_libraries(jxl_dec-internal PUBLIC
 set(JPEGXL_INTERNAL_OBJECTS
   $<TARGET_OBJECTS:jxl_enc-obj>
   $<TARGET_OBJECTS:jxl_dec-obj>
+  ${JPEGXL_DEC_CUDA_OBJECTS}
 )
 
 # Private static library. This exposes all the internal functions and is used
@@ -213,7 +234,7 @@ set_target_properties(jxl PROPERTIES
   SOVERSION ${JPEGXL_LIBRARY_SOVERSION})
 
 # Public decoder library.
-add_library(jxl_dec $<TARGET_OBJECTS:jxl_dec-obj>)
+add_library(jxl_dec $<TARGET_OBJECTS:jxl_dec-obj> ${JPEGXL_DEC_CUDA_OBJECTS})
 strip_internal(JPEGXL_DEC_INTERNAL_SHARED_LIBS JPEGXL_DEC_INTERNAL_LIBS)
 target_link_libraries(jxl_dec PUBLIC ${JPEGXL_COVERAGE_FLAGS} jxl_base)
 target_link_libraries(jxl_dec PRIVATE ${JPEGXL_DEC_INTERNAL_SHARED_LIBS})
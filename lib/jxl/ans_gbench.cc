@@ -0,0 +1,223 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/memory_manager.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <hwy/targets.h>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_ans.h"
+#include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_ans_params.h"
+#include "lib/jxl/enc_aux_out.h"
+#include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_cluster.h"
+#include "lib/jxl/enc_context_map.h"
+#include "tools/no_memory_manager.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+constexpr size_t kNumContexts = 16;
+
+// Tokens distributed like AC coefficients: mostly small values, with a
+// distribution that gets flatter in the later contexts.
+std::vector<Token> MakeTokens(size_t num) {
+  Rng rng(0);
+  std::vector<Rng::GeometricDistribution> dists;
+  for (size_t i = 0; i < kNumContexts; i++) {
+    dists.push_back(Rng::MakeGeometric(0.5f / (1 + i / 2)));
+  }
+  std::vector<Token> tokens;
+  tokens.reserve(num);
+  for (size_t i = 0; i < num; i++) {
+    const uint32_t context = rng.UniformU(0, kNumContexts);
+    tokens.emplace_back(context, rng.Geometric(dists[context]));
+  }
+  return tokens;
+}
+
+// Decodes the histograms and 1M tokens encoded with ANS if the argument is 0,
+// or with prefix codes if it is 1. Items are tokens.
+void BM_ANSDecode(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const std::vector<Token> tokens = MakeTokens(1 << 20);
+  HistogramParams params;
+  params.force_huffman = state.range(0) != 0;
+
+  BitWriter writer{memory_manager};
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+  std::vector<std::vector<Token>> tokens_vec = {tokens};
+  JXL_ASSIGN_OR_QUIT(
+      size_t cost,
+      BuildAndEncodeHistograms(memory_manager, params, kNumContexts,
+                               tokens_vec, &codes, &context_map, &writer,
+                               LayerType::Header, nullptr),
+      "Failed to encode the histograms.");
+  (void)cost;
+  BM_CHECK(WriteTokens(tokens, codes, context_map, 0, &writer,
+                       LayerType::Header, nullptr));
+  BM_CHECK(writer.WithMaxBits(8, LayerType::Header, nullptr, [&] {
+    writer.ZeroPadToByte();
+    return true;
+  }));
+
+  for (auto _ : state) {
+    (void)_;
+    BitReader br(writer.GetSpan());
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    BM_CHECK(DecodeHistograms(memory_manager, &br, kNumContexts,
+                              &decoded_codes, &dec_context_map));
+    JXL_ASSIGN_OR_QUIT(ANSSymbolReader reader,
+                       ANSSymbolReader::Create(&decoded_codes, &br),
+                       "Failed to create the reader.");
+    uint32_t sum = 0;
+    for (const Token& token : tokens) {
+      sum += reader.ReadHybridUint(token.context, &br, dec_context_map);
+    }
+    benchmark::DoNotOptimize(sum);
+    BM_CHECK(reader.CheckANSFinalState());
+    BM_CHECK(br.Close());
+  }
+
+  state.SetItemsProcessed(tokens.size() * state.iterations());
+}
+
+BENCHMARK(BM_ANSDecode)->Arg(0)->Arg(1);
+
+// Reads 1M fields of 1 to 2 * argument - 1 bits, each with its own refill,
+// like the decoding of the extra bits of hybrid integers. Items are fields.
+void BM_BitReaderReadBits(benchmark::State& state) {
+  const size_t max_bits = 2 * state.range(0) - 1;
+  Rng rng(0);
+  std::vector<uint8_t> widths(1 << 20);
+  size_t total_bits = 0;
+  for (uint8_t& width : widths) {
+    width = static_cast<uint8_t>(rng.UniformU(1, max_bits + 1));
+    total_bits += width;
+  }
+  std::vector<uint8_t> data(DivCeil(total_bits, kBitsPerByte));
+  for (uint8_t& byte : data) byte = static_cast<uint8_t>(rng.UniformU(0, 256));
+  const Bytes bytes(data);
+
+  for (auto _ : state) {
+    (void)_;
+    BitReader br(bytes);
+    uint64_t sum = 0;
+    for (uint8_t width : widths) sum += br.ReadBits(width);
+    benchmark::DoNotOptimize(sum);
+    BM_CHECK(br.Close());
+  }
+
+  state.SetItemsProcessed(widths.size() * state.iterations());
+}
+
+BENCHMARK(BM_BitReaderReadBits)->Arg(1)->Arg(8)->Arg(16);
+
+// Reads 1 MiB split into sections of the first argument bytes, in fields of 1
+// to 15 bits that end each section exactly. With a second argument of 1, the
+// next section is slack for the refills, as in the decoder. Items are bytes.
+void BM_BitReaderSections(benchmark::State& state) {
+  const size_t section_size = state.range(0);
+  const bool slack = state.range(1) != 0;
+  Rng rng(0);
+  std::vector<uint8_t> widths;
+  size_t section_bits = 0;
+  while (section_bits + 16 < section_size * kBitsPerByte) {
+    widths.push_back(static_cast<uint8_t>(rng.UniformU(1, 16)));
+    section_bits += widths.back();
+  }
+  widths.push_back(section_size * kBitsPerByte - section_bits);
+  std::vector<uint8_t> data(1 << 20);
+  for (uint8_t& byte : data) byte = static_cast<uint8_t>(rng.UniformU(0, 256));
+
+  for (auto _ : state) {
+    (void)_;
+    uint64_t sum = 0;
+    for (size_t pos = 0; pos < data.size(); pos += section_size) {
+      const Bytes bytes(data.data() + pos, section_size);
+      BitReader br(bytes, slack ? data.size() - pos - section_size : 0);
+      for (uint8_t width : widths) sum += br.ReadBits(width);
+      BM_CHECK(br.Close());
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+
+  state.SetItemsProcessed(data.size() * state.iterations());
+}
+
+BENCHMARK(BM_BitReaderSections)
+    ->Args({64, 0})
+    ->Args({64, 1})
+    ->Args({1024, 0})
+    ->Args({1024, 1})
+    ->Args({65536, 0})
+    ->Args({65536, 1});
+
+// Clusters 1024 histograms into at most kClustersLimit with the code of
+// `target`, as done for the AC contexts of large images. Items are histograms.
+void BM_ClusterHistograms(benchmark::State& state, int64_t target) {
+  constexpr size_t kNumHistograms = 1024;
+  Rng rng(0);
+  std::vector<Histogram> histograms(kNumHistograms);
+  for (size_t i = 0; i < kNumHistograms; i++) {
+    const Rng::GeometricDistribution dist =
+        Rng::MakeGeometric(0.05f + (i % 32) * 0.02f);
+    const size_t num = rng.UniformU(100, 10000);
+    for (size_t j = 0; j < num; j++) {
+      histograms[i].Add(std::min<uint32_t>(rng.Geometric(dist), 63));
+    }
+  }
+
+  hwy::SetSupportedTargetsForTest(target);
+  for (auto _ : state) {
+    (void)_;
+    std::vector<Histogram> clustered;
+    std::vector<uint32_t> symbols;
+    BM_CHECK(ClusterHistograms(HistogramParams(), histograms, kClustersLimit,
+                               &clustered, &symbols));
+    benchmark::DoNotOptimize(clustered.size());
+  }
+  hwy::SetSupportedTargetsForTest(0);
+
+  state.SetItemsProcessed(kNumHistograms * state.iterations());
+}
+
+}  // namespace
+}  // namespace jxl
+
+// Registers the benchmarks of the entropy coding code that depends on the SIMD
+// target, once for each target, as "<name>/<target>".
+void RegisterANSBenchmarks();
+
+void RegisterANSBenchmarks() {
+  for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+    std::string name =
+        std::string("ClusterHistograms/") + hwy::TargetName(target);
+    benchmark::RegisterBenchmark(name.c_str(), jxl::BM_ClusterHistograms,
+                                 target);
+  }
+}
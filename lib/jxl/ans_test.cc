@@ -5,6 +5,7 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <vector>
@@ -25,7 +26,9 @@ namespace jxl {
 namespace {
 
 void RoundtripTestcase(int n_histograms, int alphabet_size,
-                       const std::vector<Token>& input_values) {
+                       const std::vector<Token>& input_values,
+                       const HistogramParams& params = HistogramParams(),
+                       std::vector<int8_t>* flat_log_freqs = nullptr) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   constexpr uint16_t kMagic1 = 0x9e33;
   constexpr uint16_t kMagic2 = 0x8b04;
@@ -44,7 +47,7 @@ void RoundtripTestcase(int n_histograms, int alphabet_size,
 
   JXL_TEST_ASSIGN_OR_DIE(
       size_t cost,
-      BuildAndEncodeHistograms(memory_manager, HistogramParams(), n_histograms,
+      BuildAndEncodeHistograms(memory_manager, params, n_histograms,
                                input_values_vec, &codes, &context_map, &writer,
                                LayerType::Header, nullptr));
   (void)cost;
@@ -69,6 +72,7 @@ void RoundtripTestcase(int n_histograms, int alphabet_size,
   ASSERT_TRUE(DecodeHistograms(memory_manager, &br, n_histograms,
                                &decoded_codes, &dec_context_map));
   ASSERT_EQ(dec_context_map, context_map);
+  if (flat_log_freqs) *flat_log_freqs = decoded_codes.flat_log_freqs;
   JXL_TEST_ASSIGN_OR_DIE(ANSSymbolReader reader,
                          ANSSymbolReader::Create(&decoded_codes, &br));
 
@@ -97,6 +101,53 @@ TEST(ANSTest, SingleSymbolRoundtrip) {
   }
 }
 
+// Symbols of a context with a single symbol, which are decoded without reading
+// the stream, interleaved with those of a context with several symbols and
+// with values larger than the tokens.
+TEST(ANSTest, DegenerateContextRoundtrip) {
+  Rng rng(0);
+  std::vector<Token> symbols;
+  for (size_t i = 0; i < 4096; i++) {
+    symbols.emplace_back(0, 3);
+    symbols.emplace_back(1, rng.UniformU(0, 1000));
+    if (i % 3 == 0) symbols.emplace_back(0, 3);
+  }
+  RoundtripTestcase(2, ANS_MAX_ALPHABET_SIZE, symbols);
+}
+
+// Symbols of a context whose 32 tokens are equally frequent, which are decoded
+// without the alias table, interleaved with those of a context that is not
+// flat.
+TEST(ANSTest, FlatContextRoundtrip) {
+  // One value for each of the first 32 tokens of kHybridUint420Config.
+  std::vector<uint32_t> values;
+  for (uint32_t token = 0; token < 32; token++) {
+    if (token < 16) {
+      values.push_back(token);
+    } else {
+      const uint32_t n = (token - 16) / 4 + 4;
+      values.push_back((1u << n) | (((token - 16) % 4) << (n - 2)));
+    }
+  }
+  Rng rng(0);
+  std::vector<Token> symbols;
+  for (size_t i = 0; i < 64; i++) {
+    for (uint32_t value : values) {
+      symbols.emplace_back(0, value);
+      if (value % 3 == 0) symbols.emplace_back(1, rng.UniformU(0, 8));
+    }
+  }
+  rng.Shuffle(symbols.data(), symbols.size());
+  HistogramParams params;
+  params.uint_method = HistogramParams::HybridUintMethod::kNone;
+  std::vector<int8_t> flat_log_freqs;
+  RoundtripTestcase(2, ANS_MAX_ALPHABET_SIZE, symbols, params,
+                    &flat_log_freqs);
+  ASSERT_EQ(flat_log_freqs.size(), 2);
+  EXPECT_EQ(flat_log_freqs[0], ANS_LOG_TAB_SIZE - 5);
+  EXPECT_EQ(flat_log_freqs[1], -1);
+}
+
 #if defined(ADDRESS_SANITIZER) || defined(MEMORY_SANITIZER) || \
     defined(THREAD_SANITIZER)
 constexpr size_t kReps = 3;
@@ -297,5 +348,161 @@ TEST(ANSTest, TestCheckpointingPrefixLZ77) {
   TestCheckpointing(/*ans=*/false, /*lz77=*/true);
 }
 
+void TestBatch(bool lz77) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  std::vector<std::vector<Token>> input_values(1);
+  Rng rng(0);
+  for (size_t i = 0; i < 1024; i++) {
+    input_values[0].emplace_back(0, i % 4);
+  }
+  // A run, for matches at distance 1.
+  for (size_t i = 0; i < 3000; i++) {
+    input_values[0].emplace_back(0, 7);
+  }
+  // Up to the lz77 window size, with matches that wrap around it.
+  for (size_t i = 0; i < (1 << 20); i++) {
+    input_values[0].emplace_back(
+        0, i % 1000 < 500 ? (i % 5) + 4 : rng.UniformU(0, 64));
+  }
+  for (size_t i = 0; i < 1024; i++) {
+    input_values[0].emplace_back(0, i % 4);
+  }
+
+  std::vector<uint8_t> context_map;
+  EntropyEncodingData codes;
+  HistogramParams params;
+  params.lz77_method = lz77 ? HistogramParams::LZ77Method::kLZ77
+                            : HistogramParams::LZ77Method::kNone;
+
+  BitWriter writer{memory_manager};
+  {
+    auto input_values_copy = input_values;
+    JXL_TEST_ASSIGN_OR_DIE(
+        size_t cost, BuildAndEncodeHistograms(
+                         memory_manager, params, 1, input_values_copy, &codes,
+                         &context_map, &writer, LayerType::Header, nullptr));
+    (void)cost;
+    ASSERT_TRUE(WriteTokens(input_values_copy[0], codes, context_map, 0,
+                            &writer, LayerType::Header, nullptr));
+    writer.ZeroPadToByte();
+  }
+
+  BitReader br(writer.GetSpan());
+  Status status = true;
+  {
+    BitReaderScopedCloser bc(br, status);
+    std::vector<uint8_t> dec_context_map;
+    ANSCode decoded_codes;
+    ASSERT_TRUE(DecodeHistograms(memory_manager, &br, 1, &decoded_codes,
+                                 &dec_context_map));
+    JXL_TEST_ASSIGN_OR_DIE(ANSSymbolReader reader,
+                           ANSSymbolReader::Create(&decoded_codes, &br));
+    std::vector<uint32_t> values(4096);
+    size_t batch_size = 1;
+    for (size_t i = 0; i < input_values[0].size(); i += batch_size) {
+      batch_size = std::min<size_t>(batch_size * 3 % 4093 + 1,
+                                    input_values[0].size() - i);
+      reader.ReadHybridUintClusteredBatch</*uses_lz77=*/true>(
+          dec_context_map[0], &br, values.data(), batch_size);
+      for (size_t j = 0; j < batch_size; j++) {
+        ASSERT_EQ(input_values[0][i + j].value, values[j]) << "i = " << i + j;
+      }
+    }
+    ASSERT_TRUE(reader.CheckANSFinalState());
+  }
+  EXPECT_TRUE(status);
+}
+
+TEST(ANSTest, TestBatch) { TestBatch(/*lz77=*/false); }
+
+TEST(ANSTest, TestBatchLZ77) { TestBatch(/*lz77=*/true); }
+
+TEST(ANSTest, ClusteringOnPool) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  // Many contexts with a few distributions, so that clusters get merged.
+  constexpr size_t kNumContexts = 500;
+  std::vector<std::vector<Token>> input_values(1);
+  Rng rng(0);
+  for (size_t i = 0; i < 100000; i++) {
+    const uint32_t ctx = rng.UniformU(0, kNumContexts);
+    input_values[0].emplace_back(ctx, rng.UniformU(0, 4 + ctx % 7 * 5));
+  }
+  HistogramParams params;
+  params.lz77_method = HistogramParams::LZ77Method::kNone;
+
+  // The clusters found on a pool are the same as those found without.
+  std::vector<uint8_t> context_maps[2];
+  std::vector<uint8_t> bytes[2];
+  test::ThreadPoolForTests pool(4);
+  for (size_t i = 0; i < 2; i++) {
+    params.pool = i == 0 ? nullptr : pool.get();
+    EntropyEncodingData codes;
+    BitWriter writer{memory_manager};
+    auto input_values_copy = input_values;
+    JXL_TEST_ASSIGN_OR_DIE(
+        size_t cost,
+        BuildAndEncodeHistograms(memory_manager, params, kNumContexts,
+                                 input_values_copy, &codes, &context_maps[i],
+                                 &writer, LayerType::Header, nullptr));
+    (void)cost;
+    ASSERT_TRUE(WriteTokens(input_values_copy[0], codes, context_maps[i], 0,
+                            &writer, LayerType::Header, nullptr));
+    writer.ZeroPadToByte();
+    bytes[i] = writer.GetSpan().Copy();
+  }
+  EXPECT_EQ(context_maps[0], context_maps[1]);
+  EXPECT_EQ(bytes[0], bytes[1]);
+}
+
+TEST(ANSTest, LZ77OnPool) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  constexpr size_t kNumContexts = 4;
+  // Streams with repeated runs of values, so that LZ77 is enabled.
+  std::vector<std::vector<Token>> input_values(8);
+  Rng rng(0);
+  for (auto& stream : input_values) {
+    for (size_t i = 0; i < 10000; i++) {
+      if (i >= 64 && rng.UniformU(0, 4) == 0) {
+        const size_t dist = rng.UniformU(1, 64);
+        const size_t len = rng.UniformU(3, 40);
+        for (size_t j = 0; j < len; j++) {
+          const Token token = stream[stream.size() - dist];
+          stream.push_back(token);
+        }
+      } else {
+        stream.emplace_back(rng.UniformU(0, kNumContexts),
+                            rng.UniformU(0, 256));
+      }
+    }
+  }
+  HistogramParams params;
+  params.lz77_method = HistogramParams::LZ77Method::kOptimal;
+
+  // The streams encoded on a pool are the same as those encoded without.
+  std::vector<uint8_t> bytes[2];
+  test::ThreadPoolForTests pool(4);
+  for (size_t i = 0; i < 2; i++) {
+    params.pool = i == 0 ? nullptr : pool.get();
+    EntropyEncodingData codes;
+    std::vector<uint8_t> context_map;
+    BitWriter writer{memory_manager};
+    auto input_values_copy = input_values;
+    JXL_TEST_ASSIGN_OR_DIE(
+        size_t cost,
+        BuildAndEncodeHistograms(memory_manager, params, kNumContexts,
+                                 input_values_copy, &codes, &context_map,
+                                 &writer, LayerType::Header, nullptr));
+    (void)cost;
+    EXPECT_TRUE(codes.lz77.enabled);
+    for (const auto& stream : input_values_copy) {
+      ASSERT_TRUE(WriteTokens(stream, codes, context_map, 0, &writer,
+                              LayerType::Header, nullptr));
+    }
+    writer.ZeroPadToByte();
+    bytes[i] = writer.GetSpan().Copy();
+  }
+  EXPECT_EQ(bytes[0], bytes[1]);
+}
+
 }  // namespace
 }  // namespace jxl
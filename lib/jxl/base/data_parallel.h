@@ -11,11 +11,16 @@
 
 #include <jxl/parallel_runner.h>
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>  //NOLINT
 #include <cstddef>
 #include <cstdint>
+#include <mutex>  //NOLINT
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/scratch_arena.h"
 #include "lib/jxl/base/status.h"
 #if JXL_COMPILER_MSVC
 // suppress warnings about the const & applied to function types
@@ -42,7 +47,10 @@ class ThreadPool {
   // thread(s) for every task in [begin, end). init_func() must return a Status
   // indicating whether the initialization succeeded.
   // "thread" is an integer smaller than num_threads.
-  // Not thread-safe - no two calls to Run may overlap.
+  // Not thread-safe - no two calls to Run may overlap, except for nested calls
+  // made by data_func on the same pool. Those run on the calling thread with
+  // its "thread" number and number of threads, or are folded into the work of
+  // the enclosing call if it was started with RunNestable.
   // Subsequent calls will reuse the same threads.
   //
   // Precondition: begin <= end.
@@ -51,7 +59,11 @@ class ThreadPool {
              const DataFunc& data_func, const char* caller) {
     JXL_ENSURE(begin <= end);
     if (begin == end) return true;
-    RunCallState<InitFunc, DataFunc> call_state(init_func, data_func);
+    if (Nesting().pool == this) {
+      return RunNested(begin, end, init_func, data_func, caller);
+    }
+    RunCallState<InitFunc, DataFunc> call_state(this, nullptr, init_func,
+                                                data_func);
     // The runner_ uses the C convention and returns 0 in case of error, so we
     // convert it to a Status.
     if (!runner_) {
@@ -68,9 +80,59 @@ class ThreadPool {
       }
       return true;
     }
+    const char* outer_caller = CurrentCaller();
+    CurrentCaller() = caller;
     JxlParallelRetCode ret = (*runner_)(
         runner_opaque_, static_cast<void*>(&call_state),
         &call_state.CallInitFunc, &call_state.CallDataFunc, begin, end);
+    CurrentCaller() = outer_caller;
+
+    if (ret != JXL_PARALLEL_RET_SUCCESS || call_state.HasError()) {
+      return JXL_FAILURE("[%s] failed", caller);
+    }
+    return true;
+  }
+
+  // Like Run, but Run calls made by data_func on this pool are folded into the
+  // work of this call: their tasks are executed by all the threads of the
+  // runner, including the ones that would otherwise be idle because there are
+  // fewer tasks in [begin, end) than threads. Calls nested deeper than that
+  // run on the calling thread.
+  //
+  // The init_func of nested calls is called from the thread making the call,
+  // possibly concurrently with other nested calls, and the data_func of nested
+  // calls may run on any thread, so their state must be private to the call.
+  // The "thread" number of nested tasks is unique among the tasks running at
+  // the same time, like for the tasks of this call.
+  template <class InitFunc, class DataFunc>
+  Status RunNestable(uint32_t begin, uint32_t end, const InitFunc& init_func,
+                     const DataFunc& data_func, const char* caller) {
+    JXL_ENSURE(begin <= end);
+    if (begin == end) return true;
+    if (!runner_ || Nesting().pool == this) {
+      return Run(begin, end, init_func, data_func, caller);
+    }
+    size_t num_threads = 0;
+    JXL_RETURN_IF_ERROR(NumRunnerThreads(&num_threads));
+
+    NestScope scope;
+    RunCallState<InitFunc, DataFunc> call_state(this, &scope, init_func,
+                                                data_func);
+    scope.outer_func = &call_state.CallDataFunc;
+    scope.outer_opaque = static_cast<void*>(&call_state);
+    scope.next_outer = begin;
+    scope.end_outer = end;
+    scope.num_outer_left = end - begin;
+    // One work loop per thread; each of them runs tasks of this call and of
+    // the nested calls until all tasks of this call are done.
+    const char* outer_caller = CurrentCaller();
+    CurrentCaller() = caller;
+    JxlParallelRetCode ret = (*runner_)(
+        runner_opaque_, static_cast<void*>(&call_state),
+        &call_state.CallInitFunc,
+        &NestScope::CallWorkLoop<RunCallState<InitFunc, DataFunc>>, 0,
+        num_threads);
+    CurrentCaller() = outer_caller;
 
     if (ret != JXL_PARALLEL_RET_SUCCESS || call_state.HasError()) {
       return JXL_FAILURE("[%s] failed", caller);
@@ -81,19 +143,205 @@ class ThreadPool {
   // Use this as init_func when no initialization is needed.
   static constexpr ThreadPoolNoInit NoInit{};
 
+  // Per-thread scratch objects kept for as long as this pool exists.
+  ScratchArena* scratch() { return &scratch_; }
+
+  // The "caller" of the Run or RunNestable call on the calling thread which is
+  // currently waiting for the runner, or null. See JxlParallelRunTag.
+  static const char*& CurrentCaller() {
+    static thread_local const char* caller;
+    return caller;
+  }
+
+  // Returns the NUMA node of the CPU the calling thread currently runs on, or 0
+  // if it is unknown. When the workers of the runner are kept on one node (see
+  // JxlThreadParallelRunnerSetNumaNode), data_func can use this to allocate its
+  // per-thread scratch memory node-locally.
+  static uint32_t CurrentNumaNode();
+
  private:
+  // A Run call nested in a RunNestable call, waiting for its tasks to be
+  // executed. Guarded by the mutex of the enclosing NestScope.
+  struct NestedRange {
+    JxlParallelRunFunction func;
+    void* opaque;
+    uint32_t next;
+    uint32_t end;
+    // Number of tasks that are not finished yet.
+    uint32_t num_left;
+  };
+
+  // Shared state of a RunNestable call.
+  struct NestScope {
+    // Runs tasks of the enclosing RunNestable call and of the nested calls on
+    // "thread" until all tasks of the enclosing call are done. Used as
+    // JxlParallelRunFunction; the opaque pointer is the CallState.
+    template <class CallState>
+    static void CallWorkLoop(void* jpegxl_opaque, uint32_t /* loop */,
+                             size_t thread) {
+      const RunCallStateBase* call_state =
+          static_cast<CallState*>(jpegxl_opaque);
+      NestScope* self = call_state->scope_;
+      std::unique_lock<std::mutex> lock(self->mutex);
+      for (;;) {
+        // Prefer nested tasks, whose callers are blocked waiting for them.
+        if (!self->pending.empty()) {
+          self->RunNestedTask(self->pending.front(), thread, &lock);
+          continue;
+        }
+        if (self->next_outer < self->end_outer) {
+          const uint32_t task = self->next_outer++;
+          lock.unlock();
+          self->outer_func(self->outer_opaque, task, thread);
+          lock.lock();
+          if (--self->num_outer_left == 0) self->cv.notify_all();
+          continue;
+        }
+        if (self->num_outer_left == 0) return;
+        self->cv.wait(lock);
+      }
+    }
+
+    // Publishes "range" to the other threads and runs its tasks on "thread"
+    // until all of them are done.
+    void RunNestedRange(NestedRange* range, size_t thread) {
+      std::unique_lock<std::mutex> lock(mutex);
+      pending.push_back(range);
+      cv.notify_all();
+      // Only run tasks of this range here: the suspended caller may hold
+      // per-thread state of the enclosing call for "thread".
+      for (;;) {
+        if (range->next < range->end) {
+          RunNestedTask(range, thread, &lock);
+        } else if (range->num_left == 0) {
+          return;
+        } else {
+          cv.wait(lock);
+        }
+      }
+    }
+
+    // Reserves and runs the next task of "range", which must have some left.
+    // Called with the mutex held by "lock", which is released meanwhile.
+    void RunNestedTask(NestedRange* range, size_t thread,
+                       std::unique_lock<std::mutex>* lock) {
+      const uint32_t task = range->next++;
+      if (range->next == range->end) {
+        pending.erase(std::find(pending.begin(), pending.end(), range));
+      }
+      lock->unlock();
+      range->func(range->opaque, task, thread);
+      lock->lock();
+      // The caller may return as soon as the mutex is released, so this is
+      // the last access to the range.
+      if (--range->num_left == 0) cv.notify_all();
+    }
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Nested calls with unreserved tasks.
+    std::vector<NestedRange*> pending;
+    JxlParallelRunFunction outer_func;
+    void* outer_opaque;
+    uint32_t next_outer;
+    uint32_t end_outer;
+    uint32_t num_outer_left;
+  };
+
+  // The pool, thread number and number of threads of the task running on the
+  // current thread, if any, and the scope of its RunNestable call. Zero
+  // initialized, like all thread_local variables.
+  struct NestingContext {
+    ThreadPool* pool;
+    size_t thread;
+    size_t num_threads;
+    NestScope* scope;
+  };
+  static NestingContext& Nesting() {
+    static thread_local NestingContext nesting;
+    return nesting;
+  }
+
+  // Returns in "num_threads" the number of threads the runner uses, which is
+  // asked from the runner on first use.
+  Status NumRunnerThreads(size_t* num_threads) {
+    size_t cached = num_runner_threads_.load(std::memory_order_relaxed);
+    if (cached == 0) {
+      const auto init = [&cached](size_t num) -> Status {
+        cached = num;
+        return true;
+      };
+      const auto noop = [](uint32_t /* task */, size_t /* thread */) -> Status {
+        return true;
+      };
+      JXL_RETURN_IF_ERROR(Run(0, 1, init, noop, "NumRunnerThreads"));
+      JXL_ENSURE(cached != 0);
+      num_runner_threads_.store(cached, std::memory_order_relaxed);
+    }
+    *num_threads = cached;
+    return true;
+  }
+
+  // Runs a call nested in a task of this pool.
+  template <class InitFunc, class DataFunc>
+  Status RunNested(uint32_t begin, uint32_t end, const InitFunc& init_func,
+                   const DataFunc& data_func, const char* caller) {
+    const NestingContext outer = Nesting();
+    RunCallState<InitFunc, DataFunc> call_state(this, nullptr, init_func,
+                                                data_func);
+    void* jpegxl_opaque = static_cast<void*>(&call_state);
+    if (call_state.CallInitFunc(jpegxl_opaque, outer.num_threads) !=
+        JXL_PARALLEL_RET_SUCCESS) {
+      return JXL_FAILURE("Failed to initialize thread");
+    }
+    if (outer.scope != nullptr) {
+      NestedRange range = {&call_state.CallDataFunc, jpegxl_opaque, begin, end,
+                           end - begin};
+      outer.scope->RunNestedRange(&range, outer.thread);
+    } else {
+      for (uint32_t i = begin; i < end; i++) {
+        call_state.CallDataFunc(jpegxl_opaque, i, outer.thread);
+      }
+    }
+    if (call_state.HasError()) {
+      return JXL_FAILURE("[%s] failed", caller);
+    }
+    return true;
+  }
+
+  // Non-template part of RunCallState.
+  class RunCallStateBase {
+   public:
+    RunCallStateBase(ThreadPool* pool, NestScope* scope)
+        : pool_(pool), scope_(scope) {}
+
+    bool HasError() const { return has_error_; }
+
+   protected:
+    friend struct NestScope;
+    ThreadPool* const pool_;
+    // Scope of the RunNestable call, or null for Run calls.
+    NestScope* const scope_;
+    size_t num_threads_ = 0;
+    std::atomic<bool> has_error_{false};
+  };
+
   // class holding the state of a Run() call to pass to the runner_ as an
   // opaque_jpegxl pointer.
   template <class InitFunc, class DataFunc>
-  class RunCallState final {
+  class RunCallState final : public RunCallStateBase {
    public:
-    RunCallState(const InitFunc& init_func, const DataFunc& data_func)
-        : init_func_(init_func), data_func_(data_func) {}
+    RunCallState(ThreadPool* pool, NestScope* scope, const InitFunc& init_func,
+                 const DataFunc& data_func)
+        : RunCallStateBase(pool, scope),
+          init_func_(init_func),
+          data_func_(data_func) {}
 
     // JxlParallelRunInit interface.
     static int CallInitFunc(void* jpegxl_opaque, size_t num_threads) {
       auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
+      self->num_threads_ = num_threads;
       // Returns -1 when the internal init function returns false Status to
       // indicate an error.
       if (!self->init_func_(num_threads)) {
@@ -109,22 +357,29 @@ class ThreadPool {
       auto* self =
           static_cast<RunCallState<InitFunc, DataFunc>*>(jpegxl_opaque);
       if (self->has_error_) return;
-      if (!self->data_func_(value, thread_id)) {
+      // Lets Run calls made by data_func detect that they are nested.
+      const NestingContext outer = Nesting();
+      Nesting() = {self->pool_, thread_id, self->num_threads_, self->scope_};
+      const bool ok = static_cast<bool>(self->data_func_(value, thread_id));
+      Nesting() = outer;
+      if (!ok) {
         self->has_error_ = true;
       }
     }
 
-    bool HasError() const { return has_error_; }
-
    private:
     const InitFunc& init_func_;
     const DataFunc& data_func_;
-    std::atomic<bool> has_error_{false};
   };
 
   // The caller supplied runner function and its opaque void*.
   const JxlParallelRunner runner_;
   void* const runner_opaque_;
+
+  // Number of threads of the runner, or 0 if not known yet.
+  std::atomic<size_t> num_runner_threads_{0};
+
+  ScratchArena scratch_;
 };
 
 template <class InitFunc, class DataFunc>
@@ -147,6 +402,28 @@ Status RunOnPool(ThreadPool* pool, const uint32_t begin, const uint32_t end,
   return RunOnPool(pool, begin, end, init_func, data_func, caller);
 }
 
+// Like RunOnPool, but using ThreadPool::RunNestable.
+template <class InitFunc, class DataFunc>
+Status RunNestableOnPool(ThreadPool* pool, const uint32_t begin,
+                         const uint32_t end, const InitFunc& init_func,
+                         const DataFunc& data_func, const char* caller) {
+  if (pool == nullptr) {
+    ThreadPool default_pool(nullptr, nullptr);
+    return default_pool.Run(begin, end, init_func, data_func, caller);
+  } else {
+    return pool->RunNestable(begin, end, init_func, data_func, caller);
+  }
+}
+
+template <class DataFunc>
+Status RunNestableOnPool(ThreadPool* pool, const uint32_t begin,
+                         const uint32_t end,
+                         const ThreadPoolNoInit& no_init_func,
+                         const DataFunc& data_func, const char* caller) {
+  const auto init_func = [](size_t num_threads) -> Status { return true; };
+  return RunNestableOnPool(pool, begin, end, init_func, data_func, caller);
+}
+
 }  // namespace jxl
 #if JXL_COMPILER_MSVC
 #pragma warning(default : 4180)
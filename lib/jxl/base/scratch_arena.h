@@ -0,0 +1,122 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_BASE_SCRATCH_ARENA_H_
+#define LIB_JXL_BASE_SCRATCH_ARENA_H_
+
+// Per-thread scratch objects that outlive individual ThreadPool::Run calls.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/status.h"
+
+namespace jxl {
+
+// Identifies the kind of scratch object a stage requests from a ScratchArena.
+// Every key is always used with the same type.
+enum class ScratchKey : uint32_t {
+  // GroupDecCache of FrameDecoder::ProcessACGroup.
+  kGroupDecCache,
+  // Coefficient buffers of AcStrategyHeuristics::ProcessRect.
+  kAcStrategyHeuristics,
+  // Keys from kFirstTestKey on are never used by the library, so that tests
+  // can define their own with TestScratchKey.
+  kFirstTestKey,
+  kNumKeys = kFirstTestKey + 2,
+};
+
+// The key number "i" of the range reserved for tests.
+constexpr ScratchKey TestScratchKey(uint32_t i) {
+  return static_cast<ScratchKey>(
+      static_cast<uint32_t>(ScratchKey::kFirstTestKey) + i);
+}
+
+// Owns scratch objects, identified by a key and an index, which is usually the
+// "thread" argument of the data_func of a ThreadPool::Run call. The objects are
+// created on first use and kept until the arena is destroyed, so that stages
+// running for every group, pass or frame do not allocate them again each time.
+// The arena of a ThreadPool (see ThreadPool::scratch) lives as long as the
+// encoder or decoder keeps its parallel runner, i.e. until JxlEncoderReset or
+// JxlDecoderReset.
+//
+// Get is thread-safe, but the objects of an index must only be used by one
+// thread at a time. This holds for objects indexed by "thread", since no two
+// tasks running at the same time have the same "thread", as long as a task does
+// not keep using an object while a Run call nested in it uses the same key.
+// Each index has its own slots, so that Get does not need a lock: block b holds
+// the slots of the 2^b indices starting at 2^b - 1, and is allocated by the
+// first thread asking for one of them.
+class ScratchArena {
+ public:
+  ScratchArena() = default;
+  ScratchArena(const ScratchArena&) = delete;
+  ScratchArena& operator=(const ScratchArena&) = delete;
+  ~ScratchArena() { Clear(); }
+
+  // Returns the object of type T for "key" and "index", value-initialized on
+  // first use. Its contents are whatever the previous user left in it.
+  template <typename T>
+  T* Get(ScratchKey key, size_t index) {
+    const size_t block = FloorLog2Nonzero(index + 1);
+    JXL_DASSERT(block < kNumBlocks);
+    IndexSlots* slots = blocks_[block].load(std::memory_order_acquire);
+    if (slots == nullptr) {
+      IndexSlots* new_slots = new IndexSlots[size_t{1} << block]();
+      if (blocks_[block].compare_exchange_strong(slots, new_slots,
+                                                 std::memory_order_acq_rel)) {
+        slots = new_slots;
+      } else {
+        delete[] new_slots;
+      }
+    }
+    Slot& slot = slots[index + 1 - (size_t{1} << block)]
+                     .slots[static_cast<size_t>(key)];
+    if (slot.object == nullptr) {
+      slot.object = new T();
+      slot.destroy = &Destroy<T>;
+    }
+    JXL_DASSERT(slot.destroy == &Destroy<T>);
+    return static_cast<T*>(slot.object);
+  }
+
+  // Destroys all the objects. Must not be called concurrently with Get.
+  void Clear() {
+    for (size_t block = 0; block < kNumBlocks; ++block) {
+      IndexSlots* slots = blocks_[block].exchange(nullptr);
+      if (slots == nullptr) continue;
+      for (size_t i = 0; i < (size_t{1} << block); ++i) {
+        for (Slot& slot : slots[i].slots) {
+          if (slot.object != nullptr) slot.destroy(slot.object);
+        }
+      }
+      delete[] slots;
+    }
+  }
+
+ private:
+  struct Slot {
+    void* object = nullptr;
+    void (*destroy)(void*) = nullptr;
+  };
+  struct IndexSlots {
+    Slot slots[static_cast<size_t>(ScratchKey::kNumKeys)];
+  };
+
+  template <typename T>
+  static void Destroy(void* object) {
+    delete static_cast<T*>(object);
+  }
+
+  // Enough for any 32-bit index.
+  static constexpr size_t kNumBlocks = 33;
+  std::atomic<IndexSlots*> blocks_[kNumBlocks] = {};
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_BASE_SCRATCH_ARENA_H_
@@ -5,6 +5,7 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <utility>
@@ -272,5 +273,80 @@ TEST(BitReaderTest, MoveTest) {
   EXPECT_TRUE(reader2.Close());
 }
 
+// Reading a byte sequence split into chunks gives the same values, also when
+// skipping across chunk boundaries.
+TEST(BitReaderTest, TestChunks) {
+  Rng rng(0);
+  std::vector<uint8_t> data(300);
+  for (uint8_t& byte : data) byte = rng.UniformU(0, 256);
+  for (size_t iter = 0; iter < 100; ++iter) {
+    std::vector<Span<const uint8_t>> chunks;
+    size_t pos = 0;
+    while (pos < data.size()) {
+      // Includes empty chunks and chunks shorter than a refill.
+      const size_t size =
+          std::min<size_t>(rng.UniformU(0, 40), data.size() - pos);
+      chunks.push_back(Bytes(data.data() + pos, size));
+      pos += size;
+    }
+    BitReader expected(Bytes(data.data(), data.size()));
+    BitReader reader(chunks.data(), chunks.size());
+    EXPECT_EQ(data.size(), reader.TotalBytes());
+    size_t remaining = data.size() * kBitsPerByte;
+    while (remaining != 0) {
+      if (rng.UniformU(0, 4) == 0) {
+        const size_t skip = std::min<size_t>(rng.UniformU(0, 200), remaining);
+        remaining -= skip;
+        expected.SkipBits(skip);
+        reader.SkipBits(skip);
+      } else {
+        const size_t bits = std::min<size_t>(
+            rng.UniformU(1, BitReader::kMaxBitsPerCall + 1), remaining);
+        remaining -= bits;
+        ASSERT_EQ(expected.ReadBits(bits), reader.ReadBits(bits));
+      }
+      ASSERT_EQ(expected.TotalBitsConsumed(), reader.TotalBitsConsumed());
+    }
+    EXPECT_TRUE(expected.Close());
+    EXPECT_TRUE(reader.Close());
+  }
+}
+
+// Reading with slack after the bytes gives the same values and counters, and
+// reading into the slack still fails.
+TEST(BitReaderTest, TestSlack) {
+  Rng rng(0);
+  std::vector<uint8_t> data(100);
+  for (uint8_t& byte : data) byte = rng.UniformU(0, 256);
+  for (size_t iter = 0; iter < 100; ++iter) {
+    const size_t size = rng.UniformU(0, data.size() + 1);
+    const Bytes bytes(data.data(), size);
+    BitReader expected(bytes);
+    BitReader reader(bytes, data.size() - size);
+    EXPECT_EQ(size, reader.TotalBytes());
+    size_t remaining = size * kBitsPerByte;
+    while (remaining != 0) {
+      if (rng.UniformU(0, 4) == 0) {
+        const size_t skip = std::min<size_t>(rng.UniformU(0, 200), remaining);
+        remaining -= skip;
+        expected.SkipBits(skip);
+        reader.SkipBits(skip);
+      } else {
+        const size_t bits = std::min<size_t>(
+            rng.UniformU(1, BitReader::kMaxBitsPerCall + 1), remaining);
+        remaining -= bits;
+        ASSERT_EQ(expected.ReadBits(bits), reader.ReadBits(bits));
+      }
+      ASSERT_EQ(expected.TotalBitsConsumed(), reader.TotalBitsConsumed());
+    }
+    EXPECT_TRUE(expected.AllReadsWithinBounds());
+    EXPECT_TRUE(reader.AllReadsWithinBounds());
+    reader.ReadBits(1 + rng.UniformU(0, BitReader::kMaxBitsPerCall));
+    EXPECT_FALSE(reader.AllReadsWithinBounds());
+    EXPECT_TRUE(expected.Close());
+    EXPECT_TRUE(reader.Close());
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -7,6 +7,7 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstring>
 #include <vector>
@@ -39,27 +40,23 @@ bool NeedsBlending(const FrameHeader& frame_header) {
   return true;
 }
 
-Status PerformBlending(
-    JxlMemoryManager* memory_manager, const float* const* bg,
-    const float* const* fg, float* const* out, size_t x0, size_t xsize,
-    const PatchBlending& color_blending, const PatchBlending* ec_blending,
-    const std::vector<ExtraChannelInfo>& extra_channel_info) {
-  bool has_alpha = false;
+namespace {
+
+// Blends pixels [x0, x0 + xsize) of `bg` and `fg` into the first `xsize`
+// pixels of the rows of `tmp`, which must not alias the inputs.
+void BlendToTemporary(const float* const* bg, const float* const* fg,
+                      size_t x0, size_t xsize,
+                      const PatchBlending& color_blending,
+                      const PatchBlending* ec_blending,
+                      const std::vector<ExtraChannelInfo>& extra_channel_info,
+                      bool has_alpha, float* const* tmp) {
   size_t num_ec = extra_channel_info.size();
-  for (size_t i = 0; i < num_ec; i++) {
-    if (extra_channel_info[i].type == jxl::ExtraChannel::kAlpha) {
-      has_alpha = true;
-      break;
-    }
-  }
-  JXL_ASSIGN_OR_RETURN(ImageF tmp,
-                       ImageF::Create(memory_manager, xsize, 3 + num_ec));
   // Blend extra channels first so that we use the pre-blending alpha.
   for (size_t i = 0; i < num_ec; i++) {
     switch (ec_blending[i].mode) {
       case PatchBlendMode::kAdd:
         for (size_t x = 0; x < xsize; x++) {
-          tmp.Row(3 + i)[x] = bg[3 + i][x + x0] + fg[3 + i][x + x0];
+          tmp[3 + i][x] = bg[3 + i][x + x0] + fg[3 + i][x + x0];
         }
         continue;
 
@@ -67,7 +64,7 @@ Status PerformBlending(
         size_t alpha = ec_blending[i].alpha_channel;
         bool is_premultiplied = extra_channel_info[alpha].alpha_associated;
         PerformAlphaBlending(bg[3 + i] + x0, bg[3 + alpha] + x0, fg[3 + i] + x0,
-                             fg[3 + alpha] + x0, tmp.Row(3 + i), xsize,
+                             fg[3 + alpha] + x0, tmp[3 + i], xsize,
                              is_premultiplied, ec_blending[i].clamp);
         continue;
       }
@@ -76,7 +73,7 @@ Status PerformBlending(
         size_t alpha = ec_blending[i].alpha_channel;
         bool is_premultiplied = extra_channel_info[alpha].alpha_associated;
         PerformAlphaBlending(fg[3 + i] + x0, fg[3 + alpha] + x0, bg[3 + i] + x0,
-                             bg[3 + alpha] + x0, tmp.Row(3 + i), xsize,
+                             bg[3 + alpha] + x0, tmp[3 + i], xsize,
                              is_premultiplied, ec_blending[i].clamp);
         continue;
       }
@@ -84,7 +81,7 @@ Status PerformBlending(
       case PatchBlendMode::kAlphaWeightedAddAbove: {
         size_t alpha = ec_blending[i].alpha_channel;
         PerformAlphaWeightedAdd(bg[3 + i] + x0, fg[3 + i] + x0,
-                                fg[3 + alpha] + x0, tmp.Row(3 + i), xsize,
+                                fg[3 + alpha] + x0, tmp[3 + i], xsize,
                                 ec_blending[i].clamp);
         continue;
       }
@@ -92,22 +89,22 @@ Status PerformBlending(
       case PatchBlendMode::kAlphaWeightedAddBelow: {
         size_t alpha = ec_blending[i].alpha_channel;
         PerformAlphaWeightedAdd(fg[3 + i] + x0, bg[3 + i] + x0,
-                                bg[3 + alpha] + x0, tmp.Row(3 + i), xsize,
+                                bg[3 + alpha] + x0, tmp[3 + i], xsize,
                                 ec_blending[i].clamp);
         continue;
       }
 
       case PatchBlendMode::kMul:
-        PerformMulBlending(bg[3 + i] + x0, fg[3 + i] + x0, tmp.Row(3 + i),
+        PerformMulBlending(bg[3 + i] + x0, fg[3 + i] + x0, tmp[3 + i],
                            xsize, ec_blending[i].clamp);
         continue;
 
       case PatchBlendMode::kReplace:
-        if (xsize) memcpy(tmp.Row(3 + i), fg[3 + i] + x0, xsize * sizeof(**fg));
+        if (xsize) memcpy(tmp[3 + i], fg[3 + i] + x0, xsize * sizeof(**fg));
         continue;
 
       case PatchBlendMode::kNone:
-        if (xsize) memcpy(tmp.Row(3 + i), bg[3 + i] + x0, xsize * sizeof(**fg));
+        if (xsize) memcpy(tmp[3 + i], bg[3 + i] + x0, xsize * sizeof(**fg));
         continue;
     }
   }
@@ -115,7 +112,7 @@ Status PerformBlending(
 
   const auto add = [&]() {
     for (int p = 0; p < 3; p++) {
-      float* out = tmp.Row(p);
+      float* out = tmp[p];
       for (size_t x = 0; x < xsize; x++) {
         out[x] = bg[p][x + x0] + fg[p][x + x0];
       }
@@ -129,7 +126,7 @@ Status PerformBlending(
         {bottom[0] + x0, bottom[1] + x0, bottom[2] + x0,
          bottom[3 + alpha] + x0},
         {top[0] + x0, top[1] + x0, top[2] + x0, top[3 + alpha] + x0},
-        {tmp.Row(0), tmp.Row(1), tmp.Row(2), tmp.Row(3 + alpha)}, xsize,
+        {tmp[0], tmp[1], tmp[2], tmp[3 + alpha]}, xsize,
         is_premultiplied, color_blending.clamp);
   };
 
@@ -137,13 +134,13 @@ Status PerformBlending(
                                 const float* const* top) {
     for (size_t c = 0; c < 3; c++) {
       PerformAlphaWeightedAdd(bottom[c] + x0, top[c] + x0, top[3 + alpha] + x0,
-                              tmp.Row(c), xsize, color_blending.clamp);
+                              tmp[c], xsize, color_blending.clamp);
     }
   };
 
   const auto copy = [&](const float* const* src) {
     for (size_t p = 0; p < 3; p++) {
-      memcpy(tmp.Row(p), src[p] + x0, xsize * sizeof(**src));
+      memcpy(tmp[p], src[p] + x0, xsize * sizeof(**src));
     }
   };
 
@@ -170,7 +167,7 @@ Status PerformBlending(
 
     case PatchBlendMode::kMul:
       for (int p = 0; p < 3; p++) {
-        PerformMulBlending(bg[p] + x0, fg[p] + x0, tmp.Row(p), xsize,
+        PerformMulBlending(bg[p] + x0, fg[p] + x0, tmp[p], xsize,
                            color_blending.clamp);
       }
       break;
@@ -182,9 +179,52 @@ Status PerformBlending(
     case PatchBlendMode::kNone:
       copy(bg);
   }
+}
 
-  for (size_t i = 0; i < 3 + num_ec; i++) {
-    if (xsize != 0) memcpy(out[i] + x0, tmp.Row(i), xsize * sizeof(**out));
+}  // namespace
+
+Status PerformBlending(
+    JxlMemoryManager* memory_manager, const float* const* bg,
+    const float* const* fg, float* const* out, size_t x0, size_t xsize,
+    const PatchBlending& color_blending, const PatchBlending* ec_blending,
+    const std::vector<ExtraChannelInfo>& extra_channel_info) {
+  bool has_alpha = false;
+  size_t num_ec = extra_channel_info.size();
+  for (size_t i = 0; i < num_ec; i++) {
+    if (extra_channel_info[i].type == jxl::ExtraChannel::kAlpha) {
+      has_alpha = true;
+      break;
+    }
+  }
+  const size_t num_c = 3 + num_ec;
+  // Every pixel only depends on the input pixels at the same position, so
+  // images with few channels, such as RGBA, are blended in chunks through a
+  // buffer on the stack instead of allocating one for every call; this is
+  // what patches, which blend many short segments, mostly do.
+  constexpr size_t kChunkXSize = 256;
+  constexpr size_t kMaxChunkChannels = 4;
+  if (num_c <= kMaxChunkChannels) {
+    float storage[kMaxChunkChannels][kChunkXSize];
+    float* tmp[kMaxChunkChannels];
+    for (size_t i = 0; i < num_c; i++) tmp[i] = storage[i];
+    for (size_t x = 0; x < xsize; x += kChunkXSize) {
+      const size_t chunk_xsize = std::min(kChunkXSize, xsize - x);
+      BlendToTemporary(bg, fg, x0 + x, chunk_xsize, color_blending,
+                       ec_blending, extra_channel_info, has_alpha, tmp);
+      for (size_t i = 0; i < num_c; i++) {
+        memcpy(out[i] + x0 + x, tmp[i], chunk_xsize * sizeof(**out));
+      }
+    }
+    return true;
+  }
+  JXL_ASSIGN_OR_RETURN(ImageF tmp_image,
+                       ImageF::Create(memory_manager, xsize, num_c));
+  std::vector<float*> tmp(num_c);
+  for (size_t i = 0; i < num_c; i++) tmp[i] = tmp_image.Row(i);
+  BlendToTemporary(bg, fg, x0, xsize, color_blending, ec_blending,
+                   extra_channel_info, has_alpha, tmp.data());
+  for (size_t i = 0; i < num_c; i++) {
+    if (xsize != 0) memcpy(out[i] + x0, tmp[i], xsize * sizeof(**out));
   }
   return true;
 }
@@ -3,8 +3,10 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/memory_manager.h>
 #include <jxl/types.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <sstream>
 #include <utility>
@@ -13,7 +15,12 @@
 #include "lib/extras/dec/decode.h"
 #include "lib/extras/dec/jxl.h"
 #include "lib/extras/packed_image.h"
+#include "lib/jxl/alpha.h"
 #include "lib/jxl/base/span.h"
+#include "lib/jxl/blending.h"
+#include "lib/jxl/dec_patch_dictionary.h"
+#include "lib/jxl/image_metadata.h"
+#include "lib/jxl/test_memory_manager.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testing.h"
 
@@ -53,5 +60,49 @@ TEST(BlendingTest, Crops) {
   }
 }
 
+// Blending in place must give the same result as blending into a separate
+// output, also over segments that are longer than the chunks used for images
+// with few channels.
+TEST(BlendingTest, InPlaceBlendAbove) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  constexpr size_t kXSize = 600;
+  constexpr size_t kX0 = 7;
+  constexpr size_t kBlendXSize = 550;
+  std::vector<ExtraChannelInfo> extra_channel_info(1);
+  extra_channel_info[0].type = ExtraChannel::kAlpha;
+  extra_channel_info[0].alpha_associated = false;
+  std::vector<std::vector<float>> bg(4, std::vector<float>(kXSize));
+  std::vector<std::vector<float>> fg(4, std::vector<float>(kXSize));
+  for (size_t c = 0; c < 4; c++) {
+    for (size_t x = 0; x < kXSize; x++) {
+      bg[c][x] = ((x * 7 + c * 3) % 17) / 16.0f;
+      fg[c][x] = ((x * 5 + c * 11) % 13) / 12.0f;
+    }
+  }
+  std::vector<std::vector<float>> out = bg;
+  std::vector<std::vector<float>> expected = bg;
+  PerformAlphaBlending({&bg[0][kX0], &bg[1][kX0], &bg[2][kX0], &bg[3][kX0]},
+                       {&fg[0][kX0], &fg[1][kX0], &fg[2][kX0], &fg[3][kX0]},
+                       {&expected[0][kX0], &expected[1][kX0],
+                        &expected[2][kX0], &expected[3][kX0]},
+                       kBlendXSize, /*alpha_is_premultiplied=*/false,
+                       /*clamp=*/false);
+
+  float* out_rows[4] = {out[0].data(), out[1].data(), out[2].data(),
+                        out[3].data()};
+  const float* fg_rows[4] = {fg[0].data(), fg[1].data(), fg[2].data(),
+                             fg[3].data()};
+  const PatchBlending color_blending = {PatchBlendMode::kBlendAbove, 0, false};
+  const PatchBlending ec_blending = {PatchBlendMode::kBlendAbove, 0, false};
+  ASSERT_TRUE(PerformBlending(memory_manager, out_rows, fg_rows, out_rows,
+                              kX0, kBlendXSize, color_blending, &ec_blending,
+                              extra_channel_info));
+  for (size_t c = 0; c < 4; c++) {
+    for (size_t x = 0; x < kXSize; x++) {
+      ASSERT_EQ(expected[c][x], out[c][x]) << "c " << c << " x " << x;
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -35,6 +35,7 @@
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/convolve.h"
 #include "lib/jxl/image.h"
@@ -85,32 +86,42 @@ std::vector<float> ComputeKernel(float sigma) {
   return kernel;
 }
 
-void ConvolveBorderColumn(const ImageF& in, const std::vector<float>& kernel,
-                          const size_t x, float* BUTTERAUGLI_RESTRICT row_out) {
-  const size_t offset = kernel.size() / 2;
-  int minx = x < offset ? 0 : x - offset;
-  int maxx = std::min<int>(in.xsize() - 1, x + offset);
-  float weight = 0.0f;
-  for (int j = minx; j <= maxx; ++j) {
-    weight += kernel[j - x + offset];
-  }
-  float scale = 1.0f / weight;
-  for (size_t y = 0; y < in.ysize(); ++y) {
-    const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y);
-    float sum = 0.0f;
-    for (int j = minx; j <= maxx; ++j) {
-      sum += row_in[j] * kernel[j - x + offset];
-    }
-    row_out[y] = sum * scale;
-  }
-}
+// Allows PaddedMaltaUnit to call either function via overloading.
+struct MaltaTagLF {};
+struct MaltaTag {};
+
+}  // namespace jxl
+
+#endif  // JXL_BUTTERAUGLI_ONCE
+
+#include <hwy/highway.h>
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Abs;
+using hwy::HWY_NAMESPACE::Div;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::IfThenElseZero;
+using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::MulSub;
+using hwy::HWY_NAMESPACE::Neg;
+using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Vec;
+using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
-// Computes a horizontal convolution and transposes the result.
-Status ConvolutionWithTranspose(const ImageF& in,
-                                const std::vector<float>& kernel,
-                                ImageF* BUTTERAUGLI_RESTRICT out) {
-  JXL_ENSURE(out->xsize() == in.ysize());
-  JXL_ENSURE(out->ysize() == in.xsize());
+// Convolves the rows of `in` with the symmetric `kernel`. Near the left and
+// right borders, the weights are normalized by their sum within the image.
+void ConvolveRows(const ImageF& in, const std::vector<float>& kernel,
+                  ImageF* BUTTERAUGLI_RESTRICT out) {
+  const HWY_FULL(float) d;
+  const size_t N = Lanes(d);
+  const size_t xsize = in.xsize();
   const size_t len = kernel.size();
   const size_t offset = len / 2;
   float weight_no_border = 0.0f;
@@ -118,108 +129,93 @@ Status ConvolutionWithTranspose(const ImageF& in,
     weight_no_border += kernel[j];
   }
   const float scale_no_border = 1.0f / weight_no_border;
-  const size_t border1 = std::min(in.xsize(), offset);
-  const size_t border2 = in.xsize() > offset ? in.xsize() - offset : 0;
-  std::vector<float> scaled_kernel(len / 2 + 1);
-  for (size_t i = 0; i <= len / 2; ++i) {
+  std::vector<float> scaled_kernel(offset + 1);
+  for (size_t i = 0; i <= offset; ++i) {
     scaled_kernel[i] = kernel[i] * scale_no_border;
   }
+  const size_t border1 = std::min(xsize, offset);
+  const size_t border2 = xsize > offset ? xsize - offset : 0;
 
-  // middle
-  switch (len) {
-    case 7: {
-      const float sk0 = scaled_kernel[0];
-      const float sk1 = scaled_kernel[1];
-      const float sk2 = scaled_kernel[2];
-      const float sk3 = scaled_kernel[3];
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          const float sum0 = (row_in[0] + row_in[6]) * sk0;
-          const float sum1 = (row_in[1] + row_in[5]) * sk1;
-          const float sum2 = (row_in[2] + row_in[4]) * sk2;
-          const float sum = (row_in[3]) * sk3 + sum0 + sum1 + sum2;
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum;
-        }
-      }
-    } break;
-    case 13: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[12]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[11]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[10]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[9]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[8]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[7]) * scaled_kernel[5];
-          const float sum = (row_in[6]) * scaled_kernel[6];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
-        }
-      }
-      break;
+  const auto border_pixel = [&](const float* BUTTERAUGLI_RESTRICT row_in,
+                                size_t x) {
+    const size_t minx = x < offset ? 0 : x - offset;
+    const size_t maxx = std::min(xsize - 1, x + offset);
+    float weight = 0.0f;
+    float sum = 0.0f;
+    for (size_t j = minx; j <= maxx; ++j) {
+      weight += kernel[j + offset - x];
+      sum += row_in[j] * kernel[j + offset - x];
     }
-    case 15: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[14]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[13]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[12]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[11]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[10]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[9]) * scaled_kernel[5];
-          sum2 += (row_in[6] + row_in[8]) * scaled_kernel[6];
-          const float sum = (row_in[7]) * scaled_kernel[7];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
-        }
+    return sum / weight;
+  };
+
+  for (size_t y = 0; y < in.ysize(); ++y) {
+    const float* BUTTERAUGLI_RESTRICT row_in = in.ConstRow(y);
+    float* BUTTERAUGLI_RESTRICT row_out = out->Row(y);
+    // middle
+    size_t x = border1;
+    for (; x + N <= border2; x += N) {
+      const float* BUTTERAUGLI_RESTRICT p = row_in + x - offset;
+      auto sum = Mul(LoadU(d, p + offset), Set(d, scaled_kernel[offset]));
+      for (size_t k = 0; k < offset; ++k) {
+        const auto pair = Add(LoadU(d, p + k), LoadU(d, p + len - 1 - k));
+        sum = MulAdd(pair, Set(d, scaled_kernel[k]), sum);
       }
-      break;
+      StoreU(sum, d, row_out + x);
     }
-    case 33: {
-      for (size_t y = 0; y < in.ysize(); ++y) {
-        const float* BUTTERAUGLI_RESTRICT row_in = in.Row(y) + border1 - offset;
-        for (size_t x = border1; x < border2; ++x, ++row_in) {
-          float sum0 = (row_in[0] + row_in[32]) * scaled_kernel[0];
-          float sum1 = (row_in[1] + row_in[31]) * scaled_kernel[1];
-          float sum2 = (row_in[2] + row_in[30]) * scaled_kernel[2];
-          float sum3 = (row_in[3] + row_in[29]) * scaled_kernel[3];
-          sum0 += (row_in[4] + row_in[28]) * scaled_kernel[4];
-          sum1 += (row_in[5] + row_in[27]) * scaled_kernel[5];
-          sum2 += (row_in[6] + row_in[26]) * scaled_kernel[6];
-          sum3 += (row_in[7] + row_in[25]) * scaled_kernel[7];
-          sum0 += (row_in[8] + row_in[24]) * scaled_kernel[8];
-          sum1 += (row_in[9] + row_in[23]) * scaled_kernel[9];
-          sum2 += (row_in[10] + row_in[22]) * scaled_kernel[10];
-          sum3 += (row_in[11] + row_in[21]) * scaled_kernel[11];
-          sum0 += (row_in[12] + row_in[20]) * scaled_kernel[12];
-          sum1 += (row_in[13] + row_in[19]) * scaled_kernel[13];
-          sum2 += (row_in[14] + row_in[18]) * scaled_kernel[14];
-          sum3 += (row_in[15] + row_in[17]) * scaled_kernel[15];
-          const float sum = (row_in[16]) * scaled_kernel[16];
-          float* BUTTERAUGLI_RESTRICT row_out = out->Row(x);
-          row_out[y] = sum + sum0 + sum1 + sum2 + sum3;
-        }
+    for (; x < border2; ++x) {
+      const float* BUTTERAUGLI_RESTRICT p = row_in + x - offset;
+      float sum = p[offset] * scaled_kernel[offset];
+      for (size_t k = 0; k < offset; ++k) {
+        sum += (p[k] + p[len - 1 - k]) * scaled_kernel[k];
       }
-      break;
+      row_out[x] = sum;
+    }
+    // left and right borders
+    for (x = 0; x < border1; ++x) {
+      row_out[x] = border_pixel(row_in, x);
+    }
+    for (x = std::max(border1, border2); x < xsize; ++x) {
+      row_out[x] = border_pixel(row_in, x);
     }
-    default:
-      return JXL_UNREACHABLE("kernel size %d not implemented",
-                             static_cast<int>(len));
-  }
-  // left border
-  for (size_t x = 0; x < border1; ++x) {
-    ConvolveBorderColumn(in, kernel, x, out->Row(x));
   }
+}
 
-  // right border
-  for (size_t x = border2; x < in.xsize(); ++x) {
-    ConvolveBorderColumn(in, kernel, x, out->Row(x));
+// Convolves the columns of `in` with the symmetric `kernel`, with the same
+// normalization at the top and bottom borders. Every output row is computed a
+// vector of columns at a time, from the rows within the kernel, so that the
+// image does not need to be transposed.
+void ConvolveColumns(const ImageF& in, const std::vector<float>& kernel,
+                     ImageF* BUTTERAUGLI_RESTRICT out) {
+  const HWY_FULL(float) d;
+  const size_t xsize = in.xsize();
+  const size_t ysize = in.ysize();
+  const size_t len = kernel.size();
+  const size_t offset = len / 2;
+  std::vector<float> weights(len);
+  std::vector<const float*> rows(len);
+  for (size_t y = 0; y < ysize; ++y) {
+    const size_t miny = y < offset ? 0 : y - offset;
+    const size_t maxy = std::min(ysize - 1, y + offset);
+    const size_t num_rows = maxy - miny + 1;
+    float weight = 0.0f;
+    for (size_t j = miny; j <= maxy; ++j) {
+      weight += kernel[j + offset - y];
+    }
+    const float scale = 1.0f / weight;
+    for (size_t i = 0; i < num_rows; ++i) {
+      weights[i] = kernel[miny + i + offset - y] * scale;
+      rows[i] = in.ConstRow(miny + i);
+    }
+    float* BUTTERAUGLI_RESTRICT row_out = out->Row(y);
+    for (size_t x = 0; x < xsize; x += Lanes(d)) {
+      auto sum = Mul(Load(d, rows[0] + x), Set(d, weights[0]));
+      for (size_t i = 1; i < num_rows; ++i) {
+        sum = MulAdd(Load(d, rows[i] + x), Set(d, weights[i]), sum);
+      }
+      Store(sum, d, row_out + x);
+    }
   }
-  return true;
 }
 
 // A blur somewhat similar to a 2D Gaussian blur.
@@ -229,9 +225,8 @@ Status ConvolutionWithTranspose(const ImageF& in,
 // gauss_blur.cc (runtime independent of sigma, closer to a 4*sigma truncated
 // Gaussian and our 2.25 in ComputeKernel), but its boundary conditions are
 // zero-valued. This leads to noticeable differences at the edges of diffmaps.
-// We retain a special case for 5x5 kernels (even faster than gauss_blur),
-// optionally use gauss_blur followed by fixup of the borders for large images,
-// or fall back to the previous truncated FIR followed by a transpose.
+// We retain a special case for 5x5 kernels (even faster than gauss_blur), and
+// otherwise use a separable truncated FIR, vectorized in both directions.
 Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
             BlurTemp* temp, ImageF* out) {
   std::vector<float> kernel = ComputeKernel(sigma);
@@ -255,42 +250,14 @@ Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
     return true;
   }
 
-  ImageF* temp_t;
-  JXL_RETURN_IF_ERROR(temp->GetTransposed(in, &temp_t));
-  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(in, kernel, temp_t));
-  JXL_RETURN_IF_ERROR(ConvolutionWithTranspose(*temp_t, kernel, out));
+  // The vertical pass only reads the temporary image, so `out` may alias `in`.
+  ImageF* temp_image;
+  JXL_RETURN_IF_ERROR(temp->GetTemp(in, &temp_image));
+  ConvolveRows(in, kernel, temp_image);
+  ConvolveColumns(*temp_image, kernel, out);
   return true;
 }
 
-// Allows PaddedMaltaUnit to call either function via overloading.
-struct MaltaTagLF {};
-struct MaltaTag {};
-
-}  // namespace jxl
-
-#endif  // JXL_BUTTERAUGLI_ONCE
-
-#include <hwy/highway.h>
-HWY_BEFORE_NAMESPACE();
-namespace jxl {
-namespace HWY_NAMESPACE {
-
-// These templates are not found via ADL.
-using hwy::HWY_NAMESPACE::Abs;
-using hwy::HWY_NAMESPACE::Div;
-using hwy::HWY_NAMESPACE::Gt;
-using hwy::HWY_NAMESPACE::IfThenElse;
-using hwy::HWY_NAMESPACE::IfThenElseZero;
-using hwy::HWY_NAMESPACE::Lt;
-using hwy::HWY_NAMESPACE::Max;
-using hwy::HWY_NAMESPACE::Mul;
-using hwy::HWY_NAMESPACE::MulAdd;
-using hwy::HWY_NAMESPACE::MulSub;
-using hwy::HWY_NAMESPACE::Neg;
-using hwy::HWY_NAMESPACE::Sub;
-using hwy::HWY_NAMESPACE::Vec;
-using hwy::HWY_NAMESPACE::ZeroIfNegative;
-
 template <class D, class V>
 HWY_INLINE V MaximumClamp(D d, V v, double kMaxVal) {
   static const double kMul = 0.724216145665;
@@ -1670,6 +1637,7 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 
 HWY_EXPORT(SeparateFrequencies);       // Local function.
+HWY_EXPORT(Blur);                      // Local function.
 HWY_EXPORT(MaskPsychoImage);           // Local function.
 HWY_EXPORT(L2DiffAsymmetric);          // Local function.
 HWY_EXPORT(L2Diff);                    // Local function.
@@ -1890,6 +1858,11 @@ Status MaltaDiffMapLF(const ImageF& lum0, const ImageF& lum1,
 
 }  // namespace
 
+Status Blur(const ImageF& in, float sigma, const ButteraugliParams& params,
+            BlurTemp* temp, ImageF* out) {
+  return HWY_DYNAMIC_DISPATCH(Blur)(in, sigma, params, temp, out);
+}
+
 Status ButteraugliComparator::DiffmapPsychoImage(const PsychoImage& pi1,
                                                  ImageF& diffmap) const {
   JxlMemoryManager* memory_manager = diffmap.memory_manager();
@@ -2029,6 +2002,56 @@ Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
   return true;
 }
 
+Status ButteraugliDiffmap(const Image3F& rgb0, const Image3F& rgb1,
+                          const ButteraugliParams& params, size_t tile_dim,
+                          ThreadPool* pool, ImageF& diffmap) {
+  const size_t xsize = rgb0.xsize();
+  const size_t ysize = rgb0.ysize();
+  if (!SameSize(rgb0, rgb1)) {
+    return JXL_FAILURE("Size mismatch");
+  }
+  // Images too small for the recursion are padded as a whole.
+  if (tile_dim == 0 || (xsize <= tile_dim && ysize <= tile_dim) ||
+      xsize < 8 || ysize < 8) {
+    return ButteraugliDiffmap(rgb0, rgb1, params, diffmap);
+  }
+  // Crops start at even coordinates, where they have the same half resolution
+  // pixels as the whole images.
+  tile_dim = RoundUpTo(tile_dim, 2);
+  JxlMemoryManager* memory_manager = rgb0.memory_manager();
+  JXL_ASSIGN_OR_RETURN(diffmap, ImageF::Create(memory_manager, xsize, ysize));
+  const Rect image_rect(0, 0, xsize, ysize);
+  const size_t xtiles = DivCeil(xsize, tile_dim);
+  const size_t ytiles = DivCeil(ysize, tile_dim);
+  const auto process_tile = [&](const uint32_t task,
+                                size_t /* thread */) -> Status {
+    const size_t tx = task % xtiles;
+    const size_t ty = task / xtiles;
+    const Rect tile(tx * tile_dim, ty * tile_dim, tile_dim, tile_dim, xsize,
+                    ysize);
+    const Rect crop = tile.Extend(kButteraugliDiffmapSupport, image_rect);
+    JXL_ASSIGN_OR_RETURN(
+        Image3F crop0,
+        Image3F::Create(memory_manager, crop.xsize(), crop.ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(crop, rgb0, Rect(crop0), &crop0));
+    JXL_ASSIGN_OR_RETURN(
+        Image3F crop1,
+        Image3F::Create(memory_manager, crop.xsize(), crop.ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(crop, rgb1, Rect(crop1), &crop1));
+    ImageF crop_diffmap;
+    JXL_RETURN_IF_ERROR(
+        ButteraugliDiffmap(crop0, crop1, params, crop_diffmap));
+    const Rect tile_in_crop(tile.x0() - crop.x0(), tile.y0() - crop.y0(),
+                            tile.xsize(), tile.ysize());
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(tile_in_crop, crop_diffmap, tile, &diffmap));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, xtiles * ytiles, ThreadPool::NoInit,
+                                process_tile, "ButteraugliTile"));
+  return true;
+}
+
 bool ButteraugliInterface(const Image3F& rgb0, const Image3F& rgb1,
                           float hf_asymmetry, float xmul, ImageF& diffmap,
                           double& diffvalue) {
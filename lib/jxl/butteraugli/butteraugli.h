@@ -17,6 +17,7 @@
 #include <memory>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image.h"
 
@@ -146,23 +147,27 @@ struct PsychoImage {
   Image3F lf;     // XYB
 };
 
-// Blur needs a transposed image.
+// Blur needs a temporary image of the size of its input.
 // Hold it here and only allocate on demand to reduce memory usage.
 struct BlurTemp {
-  Status GetTransposed(const ImageF &in, ImageF **out) {
+  Status GetTemp(const ImageF &in, ImageF **out) {
     JxlMemoryManager *memory_manager = in.memory_manager();
-    if (transposed_temp.xsize() == 0) {
+    if (temp.xsize() != in.xsize() || temp.ysize() != in.ysize()) {
       JXL_ASSIGN_OR_RETURN(
-          transposed_temp,
-          ImageF::Create(memory_manager, in.ysize(), in.xsize()));
+          temp, ImageF::Create(memory_manager, in.xsize(), in.ysize()));
     }
-    *out = &transposed_temp;
+    *out = &temp;
     return true;
   }
 
-  ImageF transposed_temp;
+  ImageF temp;
 };
 
+// Blurs `in` into `out`, which may alias `in`, with the separable kernel of
+// the given sigma that the comparator uses.
+Status Blur(const ImageF &in, float sigma, const ButteraugliParams &params,
+            BlurTemp *temp, ImageF *out);
+
 class ButteraugliComparator {
  public:
   // Butteraugli is calibrated at xmul = 1.0. We add a multiplier here so that
@@ -212,6 +217,22 @@ Status ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
 Status ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
                           const ButteraugliParams &params, ImageF &diffmap);
 
+// Distance in pixels up to which a change of one of the images can change the
+// diffmap. The blurs and Malta filters of the full resolution comparison reach
+// about 40 pixels, and those of the half resolution one twice as far.
+constexpr size_t kButteraugliDiffmapSupport = 96;
+
+// Same as above, but computes the diffmap in tiles of tile_dim x tile_dim
+// pixels, in parallel on `pool`. Every tile is compared with
+// kButteraugliDiffmapSupport pixels of context on each side, so that the
+// diffmap matches the one of the whole images up to rounding, while only the
+// intermediate images of the tiles being processed are allocated. The overlap
+// makes the total work larger, less so for larger tiles. A tile_dim of 0
+// compares the whole images on one thread.
+Status ButteraugliDiffmap(const Image3F &rgb0, const Image3F &rgb1,
+                          const ButteraugliParams &params, size_t tile_dim,
+                          ThreadPool *pool, ImageF &diffmap);
+
 double ButteraugliScoreFromDiffmap(const ImageF &diffmap,
                                    const ButteraugliParams *params = nullptr);
 
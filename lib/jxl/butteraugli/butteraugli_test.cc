@@ -5,9 +5,11 @@
 
 #include "lib/jxl/butteraugli/butteraugli.h"
 
+#include <jxl/cms.h>
 #include <jxl/memory_manager.h>
 
 #include <algorithm>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <utility>
@@ -15,7 +17,12 @@
 #include "lib/extras/metrics.h"
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/random.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/enc_butteraugli_comparator.h"
+#include "lib/jxl/enc_comparator.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/image_bundle.h"
+#include "lib/jxl/image_metadata.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/test_image.h"
 #include "lib/jxl/test_memory_manager.h"
@@ -111,5 +118,189 @@ TEST(ButteraugliInPlaceTest, LargeImage) {
   EXPECT_NEAR(distp, distp2, 1e-7);
 }
 
+TEST(ButteraugliTest, Tiled) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 1000;
+  const size_t ysize = 700;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+  AddUniformNoise(&rgb1, 0.02f, 7777);
+  // Across the boundaries of the tiles.
+  AddEdge(&rgb1, 0.1f, 254, 200);
+  ButteraugliParams butteraugli_params;
+  ImageF diffmap;
+  ASSERT_TRUE(ButteraugliDiffmap(rgb0, rgb1, butteraugli_params, diffmap));
+  test::ThreadPoolForTests pool(4);
+  ImageF tiled_diffmap;
+  ASSERT_TRUE(ButteraugliDiffmap(rgb0, rgb1, butteraugli_params,
+                                 /*tile_dim=*/256, pool.get(), tiled_diffmap));
+  ASSERT_EQ(xsize, tiled_diffmap.xsize());
+  ASSERT_EQ(ysize, tiled_diffmap.ysize());
+  float max_error = 0.0f;
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      max_error = std::max(
+          max_error, std::abs(diffmap.Row(y)[x] - tiled_diffmap.Row(y)[x]));
+    }
+  }
+  EXPECT_LT(max_error, 1e-3f);
+}
+
+TEST(ButteraugliComparatorTest, Incremental) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 1024;
+  const size_t ysize = 1024;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+  AddUniformNoise(&rgb1, 0.02f, 7777);
+  ButteraugliParams butteraugli_params;
+  JxlButteraugliComparator comparator(butteraugli_params, *JxlGetDefaultCms());
+  JxlButteraugliComparator incremental(butteraugli_params,
+                                       *JxlGetDefaultCms());
+  incremental.SetIncremental(true);
+  ASSERT_TRUE(comparator.SetLinearReferenceImage(rgb0));
+  ASSERT_TRUE(incremental.SetLinearReferenceImage(rgb0));
+  ImageMetadata metadata;
+  metadata.color_encoding = ColorEncoding::LinearSRGB();
+  // A full comparison, then two that only recompute around the edge.
+  for (size_t i = 0; i < 3; ++i) {
+    if (i > 0) AddEdge(&rgb1, 0.1f, 300 * i, 200);
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1_copy,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(rgb1, &rgb1_copy));
+    ImageBundle actual(memory_manager, &metadata);
+    ASSERT_TRUE(actual.SetFromImage(std::move(rgb1_copy),
+                                    ColorEncoding::LinearSRGB()));
+    ImageF diffmap;
+    float score;
+    ASSERT_TRUE(comparator.CompareWith(actual, &diffmap, &score));
+    ImageF incremental_diffmap;
+    float incremental_score;
+    ASSERT_TRUE(incremental.CompareWith(actual, &incremental_diffmap,
+                                        &incremental_score));
+    EXPECT_NEAR(score, incremental_score, 1e-4);
+    float max_error = 0.0f;
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        max_error =
+            std::max(max_error, std::abs(diffmap.Row(y)[x] -
+                                         incremental_diffmap.Row(y)[x]));
+      }
+    }
+    EXPECT_LT(max_error, 1e-3f);
+  }
+}
+
+TEST(ButteraugliComparatorTest, Approximate) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 1024;
+  const size_t ysize = 1024;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  ASSERT_TRUE(CopyImageTo(rgb0, &rgb1));
+  AddUniformNoise(&rgb1, 0.02f, 7777);
+  ButteraugliParams butteraugli_params;
+  JxlButteraugliComparator comparator(butteraugli_params, *JxlGetDefaultCms());
+  JxlButteraugliComparator approximate(butteraugli_params,
+                                       *JxlGetDefaultCms());
+  approximate.SetApproximate(true, /*pool=*/nullptr);
+  ASSERT_TRUE(comparator.SetLinearReferenceImage(rgb0));
+  ASSERT_TRUE(approximate.SetLinearReferenceImage(rgb0));
+  ImageMetadata metadata;
+  metadata.color_encoding = ColorEncoding::LinearSRGB();
+  ImageBundle actual(memory_manager, &metadata);
+  ASSERT_TRUE(
+      actual.SetFromImage(std::move(rgb1), ColorEncoding::LinearSRGB()));
+  ImageF diffmap;
+  float score;
+  ASSERT_TRUE(comparator.CompareWith(actual, &diffmap, &score));
+  ImageF approximate_diffmap;
+  float approximate_score;
+  ASSERT_TRUE(approximate.CompareWith(actual, &approximate_diffmap,
+                                      &approximate_score));
+  EXPECT_NEAR(score, approximate_score, 0.15 * score);
+  // The tile from 256 to 512 in both directions is compared at full
+  // resolution, and the rest of the diffmap is scaled to the same average.
+  double sum = 0.0;
+  double approximate_sum = 0.0;
+  float max_error = 0.0f;
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      sum += diffmap.Row(y)[x];
+      approximate_sum += approximate_diffmap.Row(y)[x];
+      if (x >= 256 && x < 512 && y >= 256 && y < 512) {
+        max_error =
+            std::max(max_error, std::abs(diffmap.Row(y)[x] -
+                                         approximate_diffmap.Row(y)[x]));
+      }
+    }
+  }
+  EXPECT_LT(max_error, 1e-3f);
+  EXPECT_NEAR(sum, approximate_sum, 0.05 * sum);
+}
+
+TEST(MetricsReferenceTest, SameAsSeparateMetrics) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 256;
+  const size_t ysize = 128;
+  TestImage img;
+  ASSERT_TRUE(img.SetDimensions(xsize, ysize));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, img.AddFrame());
+  frame.RandomFill(777);
+  JXL_TEST_ASSIGN_OR_DIE(Image3F rgb0, GetColorImage(img.ppf()));
+  ImageMetadata metadata;
+  metadata.color_encoding = ColorEncoding::LinearSRGB();
+  ImageBundle ref(memory_manager, &metadata);
+  ASSERT_TRUE(ref.SetFromImage(std::move(rgb0), ColorEncoding::LinearSRGB()));
+  const JxlCmsInterface& cms = *JxlGetDefaultCms();
+  ButteraugliParams butteraugli_params;
+  JXL_TEST_ASSIGN_OR_DIE(
+      MetricsReference reference,
+      MetricsReference::Create(ref, butteraugli_params, cms));
+  // Several distorted images are compared with the same reference.
+  for (float noise : {0.01f, 0.03f}) {
+    JXL_TEST_ASSIGN_OR_DIE(Image3F rgb1,
+                           Image3F::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(*ref.color(), &rgb1));
+    AddUniformNoise(&rgb1, noise, 7777);
+    ImageBundle distorted(memory_manager, &metadata);
+    ASSERT_TRUE(
+        distorted.SetFromImage(std::move(rgb1), ColorEncoding::LinearSRGB()));
+    JXL_TEST_ASSIGN_OR_DIE(ImageMetrics metrics,
+                           reference.Compare(distorted, 3.0));
+
+    JxlButteraugliComparator comparator(butteraugli_params, cms);
+    float distance;
+    ImageF distmap;
+    ASSERT_TRUE(
+        ComputeScore(ref, distorted, &comparator, cms, &distance, &distmap));
+    JXL_TEST_ASSIGN_OR_DIE(
+        double pnorm, ComputeDistanceP(distmap, butteraugli_params, 3.0));
+    EXPECT_NEAR(metrics.butteraugli, distance, 1e-4);
+    EXPECT_NEAR(metrics.pnorm, pnorm, 1e-4);
+    // The sRGB images are computed without the CMS.
+    EXPECT_NEAR(metrics.psnr, ComputePSNR(ref, distorted, cms), 0.05);
+    EXPECT_NEAR(metrics.distance2, ComputeDistance2(ref, distorted, cms),
+                0.02 * metrics.distance2);
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -17,7 +17,11 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/cms/jxl_cms.cc"
@@ -51,12 +55,38 @@ namespace {
 
 using ::jxl::cms::ColorEncoding;
 
-struct JxlCms {
+// A transform baked into the values of the CMS at a grid of points, see
+// JxlGetLutCms.
+struct ColorLut {
+  // Points along each input axis, 0 if the transform is not baked.
+  size_t grid_size = 0;
+  // 3 or 4.
+  size_t in_channels;
+  // 1 or 3.
+  size_t out_channels;
+  // Whether the grid is uniform in the square root of the inputs rather than
+  // in the inputs, for linear inputs.
+  bool sqrt_shaper;
+  // One plane of grid_size^in_channels values per output channel. The third
+  // input channel has a stride of 1, and the fourth one, if any, the largest
+  // stride.
+  std::vector<float> values;
+  size_t plane_size;
+};
+
+// The part of a transform that only depends on the input and output profiles.
+// It is not modified once created, so that it can be shared by the transforms
+// of several threads and decoders, see TransformCache.
+struct JxlCmsTransform {
 #if JPEGXL_ENABLE_SKCMS
+  // The profiles point into these.
   IccBytes icc_src, icc_dst;
   skcms_ICCProfile profile_src, profile_dst;
 #else
-  void* lcms_transform;
+  void* lcms_transform = nullptr;
+  ~JxlCmsTransform() {
+    if (lcms_transform != nullptr) cmsDeleteTransform(lcms_transform);
+  }
 #endif
 
   // These fields are used when the HLG OOTF or inverse OOTF must be applied.
@@ -68,15 +98,65 @@ struct JxlCms {
   size_t channels_src;
   size_t channels_dst;
 
-  std::vector<float> src_storage;
-  std::vector<float*> buf_src;
-  std::vector<float> dst_storage;
-  std::vector<float*> buf_dst;
-
-  float intensity_target;
   bool skip_lcms = false;
   ExtraTF preprocess = ExtraTF::kNone;
   ExtraTF postprocess = ExtraTF::kNone;
+
+  // Replaces the CMS when not empty.
+  ColorLut lut;
+};
+
+// The configuration of a JxlCmsInterface, which its init_data points to.
+struct JxlCmsConfig {
+  JxlCmsInterface cms;
+  uint32_t lut_grid_size;
+};
+
+// Returns a row of at least "length" floats in "storage", aligned and padded
+// for vector loads and stores.
+float* AllocateRow(size_t length, std::vector<float>* storage) {
+  constexpr size_t kAlign = 128 / sizeof(float);
+  storage->resize(RoundUpTo(length, kAlign) + kAlign);
+  intptr_t addr = reinterpret_cast<intptr_t>(storage->data());
+  size_t offset =
+      (RoundUpTo(addr, kAlign * sizeof(float)) - addr) / sizeof(float);
+  return storage->data() + offset;
+}
+
+struct JxlCms {
+  std::shared_ptr<const JxlCmsTransform> xform;
+
+  // Lengths of the rows of the buffers of each thread. They are allocated when
+  // the thread first uses them, so that threads of the runner that never run
+  // the transform do not cost memory.
+  size_t src_length;
+  size_t dst_length;
+  struct ThreadBuffers {
+    std::vector<float> src_storage;
+    std::vector<float> dst_storage;
+    float* src = nullptr;
+    float* dst = nullptr;
+  };
+  // Each thread only accesses its own entry.
+  std::vector<ThreadBuffers> thread_buffers;
+
+  float intensity_target;
+
+  float* BufSrc(size_t thread) {
+    ThreadBuffers& buffers = thread_buffers[thread];
+    if (buffers.src == nullptr) {
+      buffers.src = AllocateRow(src_length, &buffers.src_storage);
+    }
+    return buffers.src;
+  }
+
+  float* BufDst(size_t thread) {
+    ThreadBuffers& buffers = thread_buffers[thread];
+    if (buffers.dst == nullptr) {
+      buffers.dst = AllocateRow(dst_length, &buffers.dst_storage);
+    }
+    return buffers.dst;
+  }
 };
 
 Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
@@ -97,7 +177,7 @@ const size_t kX = 0;  // pixel index, multiplied by 3 for RGB
 // xform_src = UndoGammaCompression(buf_src).
 Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
                        size_t buf_size) {
-  switch (t->preprocess) {
+  switch (t->xform->preprocess) {
     case ExtraTF::kNone:
       JXL_ENSURE(false);  // unreachable
       break;
@@ -123,7 +203,7 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
         xform_src[i] = static_cast<float>(
             TF_HLG_Base::DisplayFromEncoded(static_cast<double>(buf_src[i])));
       }
-      if (t->apply_hlg_ootf) {
+      if (t->xform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, xform_src, buf_size, /*forward=*/true));
       }
@@ -153,7 +233,7 @@ Status BeforeTransform(JxlCms* t, const float* buf_src, float* xform_src,
 
 // Applies gamma compression in-place.
 Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
-  switch (t->postprocess) {
+  switch (t->xform->postprocess) {
     case ExtraTF::kNone:
       JXL_DEBUG_ABORT("Unreachable");
       break;
@@ -172,7 +252,7 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
       break;
     }
     case ExtraTF::kHLG:
-      if (t->apply_hlg_ootf) {
+      if (t->xform->apply_hlg_ootf) {
         JXL_RETURN_IF_ERROR(
             ApplyHlgOotf(t, buf_dst, buf_size, /*forward=*/false));
       }
@@ -201,25 +281,137 @@ Status AfterTransform(JxlCms* t, float* JXL_RESTRICT buf_dst, size_t buf_size) {
   return true;
 }
 
+// Swaps the fractions and the strides of two axes if fa < fb.
+template <class DI, class VF, class VI>
+JXL_INLINE void SortAxes(DI di, VF* fa, VI* sa, VF* fb, VI* sb) {
+  const auto swap = Lt(*fa, *fb);
+  const auto swap_i = RebindMask(di, swap);
+  const VF f = *fa;
+  *fa = IfThenElse(swap, *fb, *fa);
+  *fb = IfThenElse(swap, f, *fb);
+  const VI stride = *sa;
+  *sa = IfThenElse(swap_i, *sb, *sa);
+  *sb = IfThenElse(swap_i, stride, *sb);
+}
+
+// Interpolates "lut" at one vector of interleaved pixels of "src" into "dst",
+// which may be the same buffer.
+void ApplyColorLutVector(const ColorLut& lut, const float* src, float* dst) {
+  const HWY_FULL(float) df;
+  const RebindToSigned<decltype(df)> di;
+  using VF = decltype(Zero(df));
+  using VI = decltype(Zero(di));
+  const size_t n = lut.grid_size;
+  const int32_t strides[4] = {static_cast<int32_t>(n * n),
+                              static_cast<int32_t>(n), 1,
+                              static_cast<int32_t>(n * n * n)};
+
+  VF v[4];
+  if (lut.in_channels == 4) {
+    LoadInterleaved4(df, src, v[0], v[1], v[2], v[3]);
+  } else {
+    LoadInterleaved3(df, src, v[0], v[1], v[2]);
+  }
+  const VF one = Set(df, 1.0f);
+  const VF scale = Set(df, static_cast<float>(n - 1));
+  const VI max_index = Set(di, static_cast<int32_t>(n - 2));
+  VI base = Zero(di);
+  VF frac[4];
+  for (size_t c = 0; c < lut.in_channels; ++c) {
+    VF u = Min(Max(v[c], Zero(df)), one);
+    if (lut.sqrt_shaper) u = Sqrt(u);
+    u = Mul(u, scale);
+    const VI index = Min(ConvertTo(di, u), max_index);
+    frac[c] = Sub(u, ConvertTo(df, index));
+    base = Add(base, Mul(index, Set(di, strides[c])));
+  }
+
+  // The tetrahedron containing the pixel goes from the base corner to the
+  // opposite one along the axes in decreasing order of their fractions.
+  VF f0 = frac[0];
+  VF f1 = frac[1];
+  VF f2 = frac[2];
+  VI s0 = Set(di, strides[0]);
+  VI s1 = Set(di, strides[1]);
+  VI s2 = Set(di, strides[2]);
+  SortAxes(di, &f0, &s0, &f1, &s1);
+  SortAxes(di, &f1, &s1, &f2, &s2);
+  SortAxes(di, &f0, &s0, &f1, &s1);
+  const VF w[4] = {Sub(one, f0), Sub(f0, f1), Sub(f1, f2), f2};
+  VI corners[4];
+  corners[0] = base;
+  corners[1] = Add(corners[0], s0);
+  corners[2] = Add(corners[1], s1);
+  corners[3] = Add(base, Set(di, strides[0] + strides[1] + strides[2]));
+
+  VF out[3];
+  for (size_t c = 0; c < lut.out_channels; ++c) {
+    const float* JXL_RESTRICT plane = lut.values.data() + c * lut.plane_size;
+    VF result = Mul(w[0], GatherIndex(df, plane, corners[0]));
+    for (size_t i = 1; i < 4; ++i) {
+      result = MulAdd(w[i], GatherIndex(df, plane, corners[i]), result);
+    }
+    if (lut.in_channels == 4) {
+      // Linear interpolation between the tetrahedra of two slices of the
+      // fourth axis.
+      const float* JXL_RESTRICT next = plane + strides[3];
+      VF result_next = Mul(w[0], GatherIndex(df, next, corners[0]));
+      for (size_t i = 1; i < 4; ++i) {
+        result_next =
+            MulAdd(w[i], GatherIndex(df, next, corners[i]), result_next);
+      }
+      result = MulAdd(frac[3], Sub(result_next, result), result);
+    }
+    out[c] = result;
+  }
+  if (lut.out_channels == 3) {
+    StoreInterleaved3(out[0], out[1], out[2], df, dst);
+  } else {
+    StoreU(out[0], df, dst);
+  }
+}
+
+void ApplyColorLut(const ColorLut& lut, const float* src, float* dst,
+                   size_t xsize) {
+  const HWY_FULL(float) df;
+  const size_t lanes = Lanes(df);
+  size_t x = 0;
+  for (; x + lanes <= xsize; x += lanes) {
+    ApplyColorLutVector(lut, src + x * lut.in_channels,
+                        dst + x * lut.out_channels);
+  }
+  if (x == xsize) return;
+  // The interleaved loads and stores of the last pixels would go past the end
+  // of the rows.
+  HWY_ALIGN float src_tail[4 * HWY_MAX_BYTES / sizeof(float)] = {};
+  HWY_ALIGN float dst_tail[3 * HWY_MAX_BYTES / sizeof(float)];
+  memcpy(src_tail, src + x * lut.in_channels,
+         (xsize - x) * lut.in_channels * sizeof(*src));
+  ApplyColorLutVector(lut, src_tail, dst_tail);
+  memcpy(dst + x * lut.out_channels, dst_tail,
+         (xsize - x) * lut.out_channels * sizeof(*dst));
+}
+
 Status DoColorSpaceTransform(void* cms_data, const size_t thread,
                              const float* buf_src, float* buf_dst,
                              size_t xsize) {
   // No lock needed.
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
+  const JxlCmsTransform* xform = t->xform.get();
 
   const float* xform_src = buf_src;  // Read-only.
-  if (t->preprocess != ExtraTF::kNone) {
-    float* mutable_xform_src = t->buf_src[thread];  // Writable buffer.
+  if (xform->preprocess != ExtraTF::kNone) {
+    float* mutable_xform_src = t->BufSrc(thread);  // Writable buffer.
     JXL_RETURN_IF_ERROR(BeforeTransform(t, buf_src, mutable_xform_src,
-                                        xsize * t->channels_src));
+                                        xsize * xform->channels_src));
     xform_src = mutable_xform_src;
   }
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_src == 1 && !t->skip_lcms) {
+  if (xform->channels_src == 1 && !xform->skip_lcms) {
     // Expand from 1 to 3 channels, starting from the end in case
-    // xform_src == t->buf_src[thread].
-    float* mutable_xform_src = t->buf_src[thread];
+    // xform_src == t->BufSrc(thread).
+    float* mutable_xform_src = t->BufSrc(thread);
     for (size_t i = 0; i < xsize; ++i) {
       const size_t x = xsize - i - 1;
       mutable_xform_src[x * 3] = mutable_xform_src[x * 3 + 1] =
@@ -228,9 +420,10 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
     xform_src = mutable_xform_src;
   }
 #else
-  if (t->channels_src == 4 && !t->skip_lcms) {
+  if (xform->channels_src == 4 && !xform->skip_lcms &&
+      xform->lut.grid_size == 0) {
     // LCMS does CMYK in a weird way: 0 = white, 100 = max ink
-    float* mutable_xform_src = t->buf_src[thread];
+    float* mutable_xform_src = t->BufSrc(thread);
     for (size_t x = 0; x < xsize * 4; ++x) {
       mutable_xform_src[x] = 100.f - 100.f * mutable_xform_src[x];
     }
@@ -245,34 +438,38 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   const float in2 = xform_src[3 * kX + 2];
 #endif
 
-  if (t->skip_lcms) {
+  if (xform->skip_lcms) {
     if (buf_dst != xform_src) {
-      memcpy(buf_dst, xform_src, xsize * t->channels_src * sizeof(*buf_dst));
+      memcpy(buf_dst, xform_src,
+             xsize * xform->channels_src * sizeof(*buf_dst));
     }  // else: in-place, no need to copy
+  } else if (xform->lut.grid_size != 0) {
+    ApplyColorLut(xform->lut, xform_src, buf_dst, xsize);
   } else {
 #if JPEGXL_ENABLE_SKCMS
     JXL_ENSURE(
         skcms_Transform(xform_src,
-                        (t->channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
-                                              : skcms_PixelFormat_RGB_fff),
-                        skcms_AlphaFormat_Opaque, &t->profile_src, buf_dst,
+                        (xform->channels_src == 4 ? skcms_PixelFormat_RGBA_ffff
+                                                  : skcms_PixelFormat_RGB_fff),
+                        skcms_AlphaFormat_Opaque, &xform->profile_src, buf_dst,
                         skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
-                        &t->profile_dst, xsize));
+                        &xform->profile_dst, xsize));
 #else   // JPEGXL_ENABLE_SKCMS
-    cmsDoTransform(t->lcms_transform, xform_src, buf_dst,
+    cmsDoTransform(xform->lcms_transform, xform_src, buf_dst,
                    static_cast<cmsUInt32Number>(xsize));
 #endif  // JPEGXL_ENABLE_SKCMS
   }
 #if JXL_CMS_VERBOSE >= 2
   printf("xform skip%d: %.4f %.4f %.4f (%p) -> (%p) %.4f %.4f %.4f\n",
-         t->skip_lcms, in0, in1, in2, xform_src, buf_dst, buf_dst[3 * kX],
+         xform->skip_lcms, in0, in1, in2, xform_src, buf_dst, buf_dst[3 * kX],
          buf_dst[3 * kX + 1], buf_dst[3 * kX + 2]);
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (t->channels_dst == 1 && !t->skip_lcms) {
+  if (xform->channels_dst == 1 && !xform->skip_lcms &&
+      xform->lut.grid_size == 0) {
     // Contract back from 3 to 1 channel, this time forward.
-    float* grayscale_buf_dst = t->buf_dst[thread];
+    float* grayscale_buf_dst = t->BufDst(thread);
     for (size_t x = 0; x < xsize; ++x) {
       grayscale_buf_dst[x] = buf_dst[x * 3];
     }
@@ -280,8 +477,9 @@ Status DoColorSpaceTransform(void* cms_data, const size_t thread,
   }
 #endif
 
-  if (t->postprocess != ExtraTF::kNone) {
-    JXL_RETURN_IF_ERROR(AfterTransform(t, buf_dst, xsize * t->channels_dst));
+  if (xform->postprocess != ExtraTF::kNone) {
+    JXL_RETURN_IF_ERROR(
+        AfterTransform(t, buf_dst, xsize * xform->channels_dst));
   }
   return true;
 }
@@ -863,7 +1061,7 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
   float gamma = 1.2f * std::pow(1.111f, std::log2(t->intensity_target * 1e-3f));
   if (!forward) gamma = 1.f / gamma;
 
-  switch (t->hlg_ootf_num_channels) {
+  switch (t->xform->hlg_ootf_num_channels) {
     case 1:
       for (size_t x = 0; x < xsize; ++x) {
         buf[x] = std::pow(buf[x], gamma);
@@ -872,9 +1070,9 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     case 3:
       for (size_t x = 0; x < xsize; x += 3) {
-        const float luminance = buf[x] * t->hlg_ootf_luminances[0] +
-                                buf[x + 1] * t->hlg_ootf_luminances[1] +
-                                buf[x + 2] * t->hlg_ootf_luminances[2];
+        const float luminance = buf[x] * t->xform->hlg_ootf_luminances[0] +
+                                buf[x + 1] * t->xform->hlg_ootf_luminances[1] +
+                                buf[x + 2] * t->xform->hlg_ootf_luminances[2];
         const float ratio = std::pow(luminance, gamma - 1);
         if (std::isfinite(ratio)) {
           buf[x] *= ratio;
@@ -903,7 +1101,7 @@ Status ApplyHlgOotf(JxlCms* t, float* JXL_RESTRICT buf, size_t xsize,
 
     default:
       return JXL_FAILURE("HLG OOTF not implemented for %" PRIuS " channels",
-                         t->hlg_ootf_num_channels);
+                         t->xform->hlg_ootf_num_channels);
   }
   return true;
 }
@@ -1081,46 +1279,79 @@ namespace {
 void JxlCmsDestroy(void* cms_data) {
   if (cms_data == nullptr) return;
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
-#if !JPEGXL_ENABLE_SKCMS
-  TransformDeleter()(t->lcms_transform);
-#endif
   delete t;
 }
 
-void AllocateBuffer(size_t length, size_t num_threads,
-                    std::vector<float>* storage, std::vector<float*>* view) {
-  constexpr size_t kAlign = 128 / sizeof(float);
-  size_t stride = RoundUpTo(length, kAlign);
-  storage->resize(stride * num_threads + kAlign);
-  intptr_t addr = reinterpret_cast<intptr_t>(storage->data());
-  size_t offset =
-      (RoundUpTo(addr, kAlign * sizeof(float)) - addr) / sizeof(float);
-  view->clear();
-  view->reserve(num_threads);
-  for (size_t i = 0; i < num_threads; ++i) {
-    view->emplace_back(storage->data() + offset + i * stride);
+// CMYK LUTs have one more dimension.
+constexpr size_t kMaxCmykGridSize = 17;
+
+// Fills xform->lut with the output of the CMS at the points of a grid of
+// "grid_size" points along each input axis.
+Status BakeColorLut(size_t grid_size, JxlCmsTransform* xform) {
+  ColorLut& lut = xform->lut;
+  const size_t n = grid_size;
+  lut.in_channels = xform->channels_src;
+  lut.out_channels = xform->channels_dst;
+  // The CMS input is linear after these.
+  lut.sqrt_shaper = xform->preprocess != ExtraTF::kNone;
+  lut.plane_size = n * n * n * (lut.in_channels == 4 ? n : 1);
+  lut.values.resize(lut.plane_size * lut.out_channels);
+  std::vector<float> nodes(n);
+  for (size_t i = 0; i < n; ++i) {
+    nodes[i] = static_cast<float>(i) / (n - 1);
+    if (lut.sqrt_shaper) nodes[i] *= nodes[i];
   }
-}
 
-void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
-                 const JxlColorProfile* input, const JxlColorProfile* output,
-                 float intensity_target) {
-  if (init_data == nullptr) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: init_data is nullptr");
-    return nullptr;
+  // Every row of the grid along the last of the first three axes is one row
+  // of pixels for the CMS.
+  std::vector<float> src(n * lut.in_channels);
+  std::vector<float> dst(n * 3);
+  for (size_t row = 0; row < lut.plane_size / n; ++row) {
+    const size_t i1 = row % n;
+    const size_t i0 = (row / n) % n;
+    const size_t i3 = row / (n * n);
+    for (size_t i2 = 0; i2 < n; ++i2) {
+      float* pixel = &src[i2 * lut.in_channels];
+      pixel[0] = nodes[i0];
+      pixel[1] = nodes[i1];
+      pixel[2] = nodes[i2];
+      if (lut.in_channels == 4) pixel[3] = nodes[i3];
+    }
+#if JPEGXL_ENABLE_SKCMS
+    const size_t dst_channels = 3;
+    JXL_ENSURE(skcms_Transform(
+        src.data(),
+        lut.in_channels == 4 ? skcms_PixelFormat_RGBA_ffff
+                             : skcms_PixelFormat_RGB_fff,
+        skcms_AlphaFormat_Opaque, &xform->profile_src, dst.data(),
+        skcms_PixelFormat_RGB_fff, skcms_AlphaFormat_Opaque,
+        &xform->profile_dst, n));
+#else   // JPEGXL_ENABLE_SKCMS
+    const size_t dst_channels = lut.out_channels;
+    if (lut.in_channels == 4) {
+      // See DoColorSpaceTransform.
+      for (float& value : src) value = 100.f - 100.f * value;
+    }
+    cmsDoTransform(xform->lcms_transform, src.data(), dst.data(),
+                   static_cast<cmsUInt32Number>(n));
+#endif  // JPEGXL_ENABLE_SKCMS
+    for (size_t c = 0; c < lut.out_channels; ++c) {
+      float* JXL_RESTRICT plane = &lut.values[c * lut.plane_size + row * n];
+      for (size_t i2 = 0; i2 < n; ++i2) {
+        plane[i2] = dst[i2 * dst_channels + c];
+      }
+    }
   }
-  const auto* cms = static_cast<const JxlCmsInterface*>(init_data);
-  auto t = jxl::make_unique<JxlCms>();
+  lut.grid_size = grid_size;
+  return true;
+}
+
+std::shared_ptr<const JxlCmsTransform> CreateTransform(
+    const JxlCmsInterface* cms, const JxlColorProfile* input,
+    const JxlColorProfile* output, uint32_t lut_grid_size) {
+  auto xform = std::make_shared<JxlCmsTransform>();
   IccBytes icc_src;
   IccBytes icc_dst;
-  if (input->icc.size == 0) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: empty input ICC");
-    return nullptr;
-  }
-  if (output->icc.size == 0) {
-    JXL_NOTIFY_ERROR("JxlCmsInit: empty OUTPUT ICC");
-    return nullptr;
-  }
   icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
   ColorEncoding c_src;
   if (!c_src.SetFieldsFromICC(std::move(icc_src), *cms)) {
@@ -1138,11 +1369,15 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
 #endif
 
 #if JPEGXL_ENABLE_SKCMS
-  if (!DecodeProfile(input->icc.data, input->icc.size, &t->profile_src)) {
+  xform->icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+  xform->icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
+  if (!DecodeProfile(xform->icc_src.data(), xform->icc_src.size(),
+                     &xform->profile_src)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse input ICC");
     return nullptr;
   }
-  if (!DecodeProfile(output->icc.data, output->icc.size, &t->profile_dst)) {
+  if (!DecodeProfile(xform->icc_dst.data(), xform->icc_dst.size(),
+                     &xform->profile_dst)) {
     JXL_NOTIFY_ERROR("JxlCmsInit: skcms failed to parse output ICC");
     return nullptr;
   }
@@ -1159,20 +1394,20 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   }
 #endif  // JPEGXL_ENABLE_SKCMS
 
-  t->skip_lcms = false;
+  xform->skip_lcms = false;
   if (c_src.SameColorEncoding(c_dst)) {
-    t->skip_lcms = true;
+    xform->skip_lcms = true;
 #if JXL_CMS_VERBOSE
     printf("Skip CMS\n");
 #endif
   }
 
-  t->apply_hlg_ootf = c_src.tf.IsHLG() != c_dst.tf.IsHLG();
-  if (t->apply_hlg_ootf) {
+  xform->apply_hlg_ootf = c_src.tf.IsHLG() != c_dst.tf.IsHLG();
+  if (xform->apply_hlg_ootf) {
     const ColorEncoding* c_hlg = c_src.tf.IsHLG() ? &c_src : &c_dst;
-    t->hlg_ootf_num_channels = c_hlg->Channels();
-    if (t->hlg_ootf_num_channels == 3 &&
-        !GetPrimariesLuminances(*c_hlg, t->hlg_ootf_luminances.data())) {
+    xform->hlg_ootf_num_channels = c_hlg->Channels();
+    if (xform->hlg_ootf_num_channels == 3 &&
+        !GetPrimariesLuminances(*c_hlg, xform->hlg_ootf_luminances.data())) {
       JXL_NOTIFY_ERROR(
           "JxlCmsInit: failed to compute the luminances of primaries");
       return nullptr;
@@ -1205,18 +1440,19 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
       printf("Special HLG/PQ/sRGB -> linear\n");
 #endif
 #if JPEGXL_ENABLE_SKCMS
-      t->icc_src = std::move(icc_src);
-      t->profile_src = new_src;
+      xform->icc_src = std::move(icc_src);
+      xform->profile_src = new_src;
 #else   // JPEGXL_ENABLE_SKCMS
       profile_src.swap(new_src);
 #endif  // JPEGXL_ENABLE_SKCMS
-      t->preprocess = c_src.tf.IsSRGB()
-                          ? ExtraTF::kSRGB
-                          : (c_src.tf.IsPQ() ? ExtraTF::kPQ : ExtraTF::kHLG);
+      xform->preprocess =
+          c_src.tf.IsSRGB()
+              ? ExtraTF::kSRGB
+              : (c_src.tf.IsPQ() ? ExtraTF::kPQ : ExtraTF::kHLG);
       c_src = c_linear_src;
       src_linear = true;
     } else {
-      if (t->apply_hlg_ootf) {
+      if (xform->apply_hlg_ootf) {
         JXL_NOTIFY_ERROR(
             "Failed to create extra linear source profile, and HLG OOTF "
             "required");
@@ -1246,17 +1482,18 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
       printf("Special linear -> HLG/PQ/sRGB\n");
 #endif
 #if JPEGXL_ENABLE_SKCMS
-      t->icc_dst = std::move(icc_dst);
-      t->profile_dst = new_dst;
+      xform->icc_dst = std::move(icc_dst);
+      xform->profile_dst = new_dst;
 #else   // JPEGXL_ENABLE_SKCMS
       profile_dst.swap(new_dst);
 #endif  // JPEGXL_ENABLE_SKCMS
-      t->postprocess = c_dst.tf.IsSRGB()
-                           ? ExtraTF::kSRGB
-                           : (c_dst.tf.IsPQ() ? ExtraTF::kPQ : ExtraTF::kHLG);
+      xform->postprocess =
+          c_dst.tf.IsSRGB()
+              ? ExtraTF::kSRGB
+              : (c_dst.tf.IsPQ() ? ExtraTF::kPQ : ExtraTF::kHLG);
       c_dst = c_linear_dst;
     } else {
-      if (t->apply_hlg_ootf) {
+      if (xform->apply_hlg_ootf) {
         JXL_NOTIFY_ERROR(
             "Failed to create extra linear destination profile, and inverse "
             "HLG OOTF required");
@@ -1270,11 +1507,11 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
 #if JXL_CMS_VERBOSE
     printf("Same intermediary linear profiles, skipping CMS\n");
 #endif
-    t->skip_lcms = true;
+    xform->skip_lcms = true;
   }
 
 #if JPEGXL_ENABLE_SKCMS
-  if (!skcms_MakeUsableAsDestination(&t->profile_dst)) {
+  if (!skcms_MakeUsableAsDestination(&xform->profile_dst)) {
     JXL_NOTIFY_ERROR(
         "Failed to make %s usable as a color transform destination",
         ColorEncodingDescription(c_dst.ToExternal()).c_str());
@@ -1286,8 +1523,7 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   const size_t channels_src = (c_src.cmyk ? 4 : c_src.Channels());
   const size_t channels_dst = c_dst.Channels();
 #if JXL_CMS_VERBOSE
-  printf("Channels: %" PRIuS "; Threads: %" PRIuS "\n", channels_src,
-         num_threads);
+  printf("Channels: %" PRIuS "\n", channels_src);
 #endif
 
 #if !JPEGXL_ENABLE_SKCMS
@@ -1299,25 +1535,143 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   // cmsDoTransform() thread-safe.
   const uint32_t flags = cmsFLAGS_NOCACHE | cmsFLAGS_BLACKPOINTCOMPENSATION |
                          cmsFLAGS_HIGHRESPRECALC;
-  t->lcms_transform =
+  xform->lcms_transform =
       cmsCreateTransformTHR(context, profile_src.get(), type_src,
                             profile_dst.get(), type_dst, intent, flags);
-  if (t->lcms_transform == nullptr) {
+  if (xform->lcms_transform == nullptr) {
     JXL_NOTIFY_ERROR("Failed to create transform");
     return nullptr;
   }
 #endif  // !JPEGXL_ENABLE_SKCMS
 
+  xform->channels_src = channels_src;
+  xform->channels_dst = channels_dst;
+
+  // The linear values of PQ inputs are not bounded, and would be clamped.
+  if (lut_grid_size != 0 && !xform->skip_lcms && channels_src >= 3 &&
+      xform->preprocess != ExtraTF::kPQ) {
+    const size_t grid_size =
+        channels_src == 4 ? std::min<size_t>(lut_grid_size, kMaxCmykGridSize)
+                          : lut_grid_size;
+    if (!BakeColorLut(grid_size, xform.get())) {
+      JXL_NOTIFY_ERROR("JxlCmsInit: failed to bake the transform");
+      return nullptr;
+    }
+  }
+  return xform;
+}
+
+// Process-wide cache of the most recently used transforms, keyed by the bytes
+// of their input and output ICC profiles, which include the rendering intent,
+// and the size of their LUT.
+// It saves the parsing and matching of the profiles, and the creation of the
+// CMS transform, when many images share a handful of profiles.
+class TransformCache {
+ public:
+  static TransformCache* Get() {
+    // Never destroyed, so that it can be used until the end of the process.
+    static TransformCache* cache = new TransformCache();
+    return cache;
+  }
+
+  std::shared_ptr<const JxlCmsTransform> Find(const JxlColorProfile* input,
+                                              const JxlColorProfile* output,
+                                              uint32_t lut_grid_size) {
+    const uint64_t hash = Hash(input, output);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      if (it->hash == hash && it->lut_grid_size == lut_grid_size &&
+          Equal(it->icc_src, input) && Equal(it->icc_dst, output)) {
+        // Move the entry to the front, as the most recently used one.
+        entries_.splice(entries_.begin(), entries_, it);
+        return it->xform;
+      }
+    }
+    return nullptr;
+  }
+
+  void Insert(const JxlColorProfile* input, const JxlColorProfile* output,
+              uint32_t lut_grid_size,
+              std::shared_ptr<const JxlCmsTransform> xform) {
+    Entry entry;
+    entry.hash = Hash(input, output);
+    entry.lut_grid_size = lut_grid_size;
+    entry.icc_src.assign(input->icc.data, input->icc.data + input->icc.size);
+    entry.icc_dst.assign(output->icc.data, output->icc.data + output->icc.size);
+    entry.xform = std::move(xform);
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.push_front(std::move(entry));
+    if (entries_.size() > kMaxEntries) entries_.pop_back();
+  }
+
+ private:
+  static constexpr size_t kMaxEntries = 16;
+
+  struct Entry {
+    uint64_t hash;
+    uint32_t lut_grid_size;
+    IccBytes icc_src, icc_dst;
+    std::shared_ptr<const JxlCmsTransform> xform;
+  };
+
+  static bool Equal(const IccBytes& icc, const JxlColorProfile* profile) {
+    return icc.size() == profile->icc.size &&
+           memcmp(icc.data(), profile->icc.data, icc.size()) == 0;
+  }
+
+  // FNV-1a of both profiles.
+  static uint64_t Hash(const JxlColorProfile* input,
+                       const JxlColorProfile* output) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const JxlColorProfile* profile : {input, output}) {
+      for (size_t i = 0; i < profile->icc.size; ++i) {
+        hash = (hash ^ profile->icc.data[i]) * 0x100000001b3ull;
+      }
+      hash = (hash ^ profile->icc.size) * 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+};
+
+void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
+                 const JxlColorProfile* input, const JxlColorProfile* output,
+                 float intensity_target) {
+  if (init_data == nullptr) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: init_data is nullptr");
+    return nullptr;
+  }
+  const auto* config = static_cast<const JxlCmsConfig*>(init_data);
+  const JxlCmsInterface* cms = &config->cms;
+  if (input->icc.size == 0) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: empty input ICC");
+    return nullptr;
+  }
+  if (output->icc.size == 0) {
+    JXL_NOTIFY_ERROR("JxlCmsInit: empty OUTPUT ICC");
+    return nullptr;
+  }
+  auto t = jxl::make_unique<JxlCms>();
+  TransformCache* cache = TransformCache::Get();
+  t->xform = cache->Find(input, output, config->lut_grid_size);
+  if (t->xform == nullptr) {
+    t->xform = CreateTransform(cms, input, output, config->lut_grid_size);
+    if (t->xform == nullptr) return nullptr;
+    cache->Insert(input, output, config->lut_grid_size, t->xform);
+  }
+  const size_t channels_src = t->xform->channels_src;
+  const size_t channels_dst = t->xform->channels_dst;
+
   // Ideally LCMS would convert directly from External to Image3. However,
   // cmsDoTransformLineStride only accepts 32-bit BytesPerPlaneIn, whereas our
   // planes can be more than 4 GiB apart. Hence, transform inputs/outputs must
   // be interleaved. Calling cmsDoTransform for each pixel is expensive
   // (indirect call). We therefore transform rows, which requires per-thread
-  // buffers. To avoid separate allocations, we use the rows of an image.
-  // Because LCMS apparently also cannot handle <= 16 bit inputs and 32-bit
-  // outputs (or vice versa), we use floating point input/output.
-  t->channels_src = channels_src;
-  t->channels_dst = channels_dst;
+  // buffers, see JxlCms::BufSrc. Because LCMS apparently also cannot handle
+  // <= 16 bit inputs and 32-bit outputs (or vice versa), we use floating point
+  // input/output.
 #if !JPEGXL_ENABLE_SKCMS
   size_t actual_channels_src = channels_src;
   size_t actual_channels_dst = channels_dst;
@@ -1327,39 +1681,55 @@ void* JxlCmsInit(void* init_data, size_t num_threads, size_t xsize,
   size_t actual_channels_src = (channels_src == 4 ? 4 : 3);
   size_t actual_channels_dst = 3;
 #endif
-  AllocateBuffer(xsize * actual_channels_src, num_threads, &t->src_storage,
-                 &t->buf_src);
-  AllocateBuffer(xsize * actual_channels_dst, num_threads, &t->dst_storage,
-                 &t->buf_dst);
+  t->src_length = xsize * actual_channels_src;
+  t->dst_length = xsize * actual_channels_dst;
+  t->thread_buffers.resize(num_threads);
   t->intensity_target = intensity_target;
   return t.release();
 }
 
 float* JxlCmsGetSrcBuf(void* cms_data, size_t thread) {
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
-  return t->buf_src[thread];
+  return t->BufSrc(thread);
 }
 
 float* JxlCmsGetDstBuf(void* cms_data, size_t thread) {
   JxlCms* t = reinterpret_cast<JxlCms*>(cms_data);
-  return t->buf_dst[thread];
+  return t->BufDst(thread);
+}
+
+template <uint32_t kLutGridSize>
+const JxlCmsInterface* GetCms() {
+  static constexpr JxlCmsConfig kConfig = {
+      {/*set_fields_data=*/nullptr,
+       /*set_fields_from_icc=*/&JxlCmsSetFieldsFromICC,
+       /*init_data=*/const_cast<void*>(static_cast<const void*>(&kConfig)),
+       /*init=*/&JxlCmsInit,
+       /*get_src_buf=*/&JxlCmsGetSrcBuf,
+       /*get_dst_buf=*/&JxlCmsGetDstBuf,
+       /*run=*/&DoColorSpaceTransform,
+       /*destroy=*/&JxlCmsDestroy},
+      kLutGridSize};
+  return &kConfig.cms;
 }
 
 }  // namespace
 
 extern "C" {
 
-JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms() {
-  static constexpr JxlCmsInterface kInterface = {
-      /*set_fields_data=*/nullptr,
-      /*set_fields_from_icc=*/&JxlCmsSetFieldsFromICC,
-      /*init_data=*/const_cast<void*>(static_cast<const void*>(&kInterface)),
-      /*init=*/&JxlCmsInit,
-      /*get_src_buf=*/&JxlCmsGetSrcBuf,
-      /*get_dst_buf=*/&JxlCmsGetDstBuf,
-      /*run=*/&DoColorSpaceTransform,
-      /*destroy=*/&JxlCmsDestroy};
-  return &kInterface;
+JXL_CMS_EXPORT const JxlCmsInterface* JxlGetDefaultCms() { return GetCms<0>(); }
+
+JXL_CMS_EXPORT const JxlCmsInterface* JxlGetLutCms(uint32_t grid_size) {
+  switch (grid_size) {
+    case 17:
+      return GetCms<17>();
+    case 33:
+      return GetCms<33>();
+    case 65:
+      return GetCms<65>();
+    default:
+      return nullptr;
+  }
 }
 
 }  // extern "C"
@@ -3,7 +3,11 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
 
 #include "lib/jxl/base/matrix_ops.h"
 
@@ -99,6 +103,63 @@ class Rec2408ToneMapper : Rec2408ToneMapperBase {
   const TF_PQ tf_pq_ = TF_PQ(/*display_intensity_target=*/1.0);
 };
 
+// Rec2408ToneMapper with the gain of its tone curve, which only depends on the
+// luminance, precomputed at 2^lut_bits + 1 points uniformly spaced in the
+// square root of the luminance relative to the source peak, and interpolated
+// linearly. This replaces the two PQ conversions of every pixel with a square
+// root and two lookups. More bits follow the curve more closely.
+template <typename D>
+class Rec2408ToneMapperLut : Rec2408ToneMapperBase {
+ private:
+  using V = hwy::HWY_NAMESPACE::Vec<D>;
+
+ public:
+  Rec2408ToneMapperLut(const Range& source_range, const Range& target_range,
+                       const Vector3& primaries_luminances,
+                       size_t lut_bits = 10)
+      : Rec2408ToneMapperBase(source_range, target_range,
+                              primaries_luminances),
+        lut_size_(1 << lut_bits),
+        gain_(lut_size_ + 1) {
+    for (size_t i = 0; i <= lut_size_; ++i) {
+      const float x = static_cast<float>(i) / lut_size_;
+      const float luminance = std::max(source_range_[1] * x * x, 1e-6f);
+      gain_[i] = ToneMappedLuminance(luminance) / luminance;
+    }
+  }
+
+  void ToneMap(V* red, V* green, V* blue) const {
+    const hwy::HWY_NAMESPACE::RebindToSigned<D> di;
+    const V one = Set(df_, 1.0f);
+    const V relative_luminance = MulAdd(
+        Set(df_, red_Y_), *red,
+        MulAdd(Set(df_, green_Y_), *green, Mul(Set(df_, blue_Y_), *blue)));
+    const V luminance = Mul(Set(df_, source_range_[1]), relative_luminance);
+    const V clamped = Min(ZeroIfNegative(relative_luminance), one);
+    const V pos = Mul(Sqrt(clamped), Set(df_, lut_size_));
+    // Clamped both ways, so that garbage in padding lanes stays in bounds.
+    const auto index = Clamp(ConvertTo(di, pos), Zero(di),
+                             Set(di, static_cast<int32_t>(lut_size_ - 1)));
+    const V frac = Sub(pos, ConvertTo(df_, index));
+    const V lower = GatherIndex(df_, gain_.data(), index);
+    const V upper = GatherIndex(df_, gain_.data() + 1, index);
+    // Above the source peak, the curve is flat.
+    const V gain = Div(MulAdd(frac, Sub(upper, lower), lower),
+                       Max(relative_luminance, one));
+    const auto use_cap = Le(luminance, Set(df_, 1e-6f));
+    const V cap = Mul(Mul(gain, luminance), Set(df_, inv_target_peak_));
+    const V multiplier = Mul(gain, Set(df_, normalizer_));
+    for (V* const val : {red, green, blue}) {
+      *val = IfThenElse(use_cap, cap, Mul(*val, multiplier));
+    }
+  }
+
+ private:
+  D df_;
+  size_t lut_size_;
+  std::vector<float> gain_;
+};
+
 class HlgOOTF : HlgOOTF_Base {
  public:
   using HlgOOTF_Base::HlgOOTF_Base;
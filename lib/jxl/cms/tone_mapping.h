@@ -36,6 +36,20 @@ class Rec2408ToneMapperBase {
     const float luminance =
         source_range_[1] *
         (red_Y_ * rgb[0] + green_Y_ * rgb[1] + blue_Y_ * rgb[2]);
+    const float new_luminance = ToneMappedLuminance(luminance);
+    const float min_luminance = 1e-6f;
+    const bool use_cap = (luminance <= min_luminance);
+    const float ratio = new_luminance / std::max(luminance, min_luminance);
+    const float cap = new_luminance * inv_target_peak_;
+    const float multiplier = ratio * normalizer_;
+    for (size_t idx : {0, 1, 2}) {
+      rgb[idx] = use_cap ? cap : rgb[idx] * multiplier;
+    }
+  }
+
+ protected:
+  // The tone curve, from and to nits.
+  float ToneMappedLuminance(const float luminance) const {
     const float normalized_pq =
         std::min(1.f, (InvEOTF(luminance) - pq_mastering_min_) *
                           inv_pq_mastering_range_);
@@ -47,18 +61,9 @@ class Rec2408ToneMapperBase {
     const float e4 = e3 * pq_mastering_range_ + pq_mastering_min_;
     const float d4 =
         TF_PQ_Base::DisplayFromEncoded(/*display_intensity_target=*/1.0, e4);
-    const float new_luminance = Clamp1(d4, 0.f, target_range_[1]);
-    const float min_luminance = 1e-6f;
-    const bool use_cap = (luminance <= min_luminance);
-    const float ratio = new_luminance / std::max(luminance, min_luminance);
-    const float cap = new_luminance * inv_target_peak_;
-    const float multiplier = ratio * normalizer_;
-    for (size_t idx : {0, 1, 2}) {
-      rgb[idx] = use_cap ? cap : rgb[idx] * multiplier;
-    }
+    return Clamp1(d4, 0.f, target_range_[1]);
   }
 
- protected:
   static float InvEOTF(const float luminance) {
     return TF_PQ_Base::EncodedFromDisplay(/*display_intensity_target=*/1.0,
                                           luminance);
@@ -65,6 +65,41 @@ HWY_NOINLINE void TestRec2408ToneMap() {
   printf("max abs err %e\n", static_cast<double>(max_abs_err));
 }
 
+HWY_NOINLINE void TestRec2408ToneMapLut() {
+  constexpr size_t kNumTrials = 1 << 10;
+  constexpr size_t kNumColors = 1 << 10;
+  Rng rng(1);
+  float max_abs_err = 0;
+  HWY_FULL(float) d;
+  for (size_t i = 0; i < kNumTrials; i++) {
+    float src = 11000.0 + rng.UniformF(-150.0f, 150.0f);
+    float tgt = 250 + rng.UniformF(-5.0f, 5.0f);
+    Vector3 luminances{rng.UniformF(0.2f, 0.4f), rng.UniformF(0.2f, 0.4f),
+                       rng.UniformF(0.2f, 0.4f)};
+    Rec2408ToneMapperLut<decltype(d)> tone_mapper({0.0f, src}, {0.0f, tgt},
+                                                  luminances);
+    Rec2408ToneMapperBase tone_mapper_base({0.0f, src}, {0.0f, tgt},
+                                           luminances);
+    for (size_t j = 0; j < kNumColors; j++) {
+      Color rgb{rng.UniformF(0.0f, 1.0f), rng.UniformF(0.0f, 1.0f),
+                rng.UniformF(0.0f, 1.0f)};
+      auto r = Set(d, rgb[0]);
+      auto g = Set(d, rgb[1]);
+      auto b = Set(d, rgb[2]);
+      tone_mapper.ToneMap(&r, &g, &b);
+      tone_mapper_base.ToneMap(rgb);
+      const float abs_err_r = std::abs(rgb[0] - GetLane(r));
+      const float abs_err_g = std::abs(rgb[1] - GetLane(g));
+      const float abs_err_b = std::abs(rgb[2] - GetLane(b));
+      EXPECT_LT(abs_err_r, 1e-4);
+      EXPECT_LT(abs_err_g, 1e-4);
+      EXPECT_LT(abs_err_b, 1e-4);
+      max_abs_err = std::max({max_abs_err, abs_err_r, abs_err_g, abs_err_b});
+    }
+  }
+  printf("max abs err %e\n", static_cast<double>(max_abs_err));
+}
+
 HWY_NOINLINE void TestHlgOotfApply() {
   constexpr size_t kNumTrials = 1 << 23;
   Rng rng(1);
@@ -147,6 +182,7 @@ class ToneMappingTargetTest : public hwy::TestWithParamTarget {};
 HWY_TARGET_INSTANTIATE_TEST_SUITE_P(ToneMappingTargetTest);
 
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestRec2408ToneMap);
+HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestRec2408ToneMapLut);
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestHlgOotfApply);
 HWY_EXPORT_AND_TEST_P(ToneMappingTargetTest, TestGamutMap);
 
@@ -20,6 +20,7 @@
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/cms/color_encoding_cms.h"
 #include "lib/jxl/cms/opsin_params.h"
@@ -270,6 +271,79 @@ TEST_F(ColorManagementTest, D2700ToSRGB) {
   EXPECT_ARRAY_NEAR(sRGB_values, sRGB_expected, 1e-3);
 }
 
+// The second transform between the same profiles shares the state of the
+// first one, but must still get buffers for its own size and threads.
+TEST_F(ColorManagementTest, SameProfilesTwice) {
+  std::vector<uint8_t> icc_data =
+      jxl::test::ReadTestData("jxl/color_management/sRGB-D2700.icc");
+  IccBytes icc;
+  Bytes(icc_data).AppendTo(icc);
+  ColorEncoding sRGB_D2700;
+  ASSERT_TRUE(sRGB_D2700.SetICC(std::move(icc), JxlGetDefaultCms()));
+
+  ColorSpaceTransform transform1(*JxlGetDefaultCms());
+  ASSERT_TRUE(transform1.Init(sRGB_D2700, ColorEncoding::SRGB(),
+                              kDefaultIntensityTarget, 1, 1));
+  ColorSpaceTransform transform2(*JxlGetDefaultCms());
+  ASSERT_TRUE(transform2.Init(sRGB_D2700, ColorEncoding::SRGB(),
+                              kDefaultIntensityTarget, 4, 2));
+  Color sRGB_D2700_values{0.863, 0.737, 0.490};
+  Color expected;
+  ASSERT_TRUE(transform1.Run(0, sRGB_D2700_values.data(), expected.data(), 1));
+  for (size_t thread = 0; thread < 2; ++thread) {
+    float* src = transform2.BufSrc(thread);
+    for (size_t i = 0; i < 4 * 3; ++i) src[i] = sRGB_D2700_values[i % 3];
+    float* dst = transform2.BufDst(thread);
+    ASSERT_TRUE(transform2.Run(thread, src, dst, 4));
+    for (size_t x = 0; x < 4; ++x) {
+      Color actual{dst[3 * x], dst[3 * x + 1], dst[3 * x + 2]};
+      EXPECT_ARRAY_NEAR(actual, expected, 1e-6);
+    }
+  }
+}
+
+TEST_F(ColorManagementTest, LutCms) {
+  EXPECT_EQ(nullptr, JxlGetLutCms(16));
+  ColorEncoding p3;
+  p3.SetColorSpace(ColorSpace::kRGB);
+  ASSERT_TRUE(p3.SetWhitePointType(WhitePoint::kD65));
+  ASSERT_TRUE(p3.SetPrimariesType(Primaries::kP3));
+  p3.Tf().SetTransferFunction(TransferFunction::kSRGB);
+  ASSERT_TRUE(p3.CreateICC());
+  ColorEncoding rec2020_linear = p3;
+  ASSERT_TRUE(rec2020_linear.SetPrimariesType(Primaries::k2100));
+  rec2020_linear.Tf().SetTransferFunction(TransferFunction::kLinear);
+  ASSERT_TRUE(rec2020_linear.CreateICC());
+
+  // Covers both a linear and a gamma-encoded LUT input, and a row that is not
+  // a multiple of the vectors.
+  constexpr size_t kXsize = 1000;
+  for (const auto& profiles : {std::make_pair(p3, rec2020_linear),
+                                std::make_pair(rec2020_linear, p3)}) {
+    ColorSpaceTransform exact(*JxlGetDefaultCms());
+    ASSERT_TRUE(exact.Init(profiles.first, profiles.second,
+                           kDefaultIntensityTarget, kXsize, 1));
+    ColorSpaceTransform baked(*JxlGetLutCms(33));
+    ASSERT_TRUE(baked.Init(profiles.first, profiles.second,
+                           kDefaultIntensityTarget, kXsize, 1));
+    Rng rng(0);
+    std::vector<float> src(3 * kXsize);
+    for (float& value : src) value = rng.UniformF(0.0f, 1.0f);
+    std::copy(src.begin(), src.end(), exact.BufSrc(0));
+    std::copy(src.begin(), src.end(), baked.BufSrc(0));
+    ASSERT_TRUE(exact.Run(0, exact.BufSrc(0), exact.BufDst(0), kXsize));
+    ASSERT_TRUE(baked.Run(0, baked.BufSrc(0), baked.BufDst(0), kXsize));
+    float max_error = 0.0f;
+    for (size_t i = 0; i < 3 * kXsize; ++i) {
+      // Out of gamut colors of the output are clamped by the CMS, or not.
+      if (exact.BufDst(0)[i] < 0.0f || exact.BufDst(0)[i] > 1.0f) continue;
+      max_error = std::max(max_error,
+                           std::abs(exact.BufDst(0)[i] - baked.BufDst(0)[i]));
+    }
+    EXPECT_LT(max_error, 2e-3f);
+  }
+}
+
 TEST_F(ColorManagementTest, P3HlgTo2020Hlg) {
   ColorEncoding p3_hlg;
   p3_hlg.SetColorSpace(ColorSpace::kRGB);
@@ -24,6 +24,11 @@
 #define JPEGXL_ENABLE_BOXES 1
 #endif  // JPEGXL_ENABLE_BOXES
 
+// Macro that defines whether the render pipeline stages can run with CUDA.
+#ifndef JPEGXL_ENABLE_CUDA
+#define JPEGXL_ENABLE_CUDA 0
+#endif  // JPEGXL_ENABLE_CUDA
+
 namespace jxl {
 // Some enums and typedefs used by more than one header file.
 
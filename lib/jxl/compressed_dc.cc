@@ -125,6 +125,64 @@ JXL_INLINE void ComputePixel(
   Store(out, d, out_rows[2] + x);
 }
 
+// Smooths the pixels [x0, x1) of row y of `dc` into `smoothed`. Pixels on the
+// border of the image are copied.
+void SmoothDCRow(const float* JXL_RESTRICT dc_factors, const Image3F& dc,
+                 size_t y, size_t x0, size_t x1, Image3F* smoothed) {
+  const size_t xsize = dc.xsize();
+  const size_t ysize = dc.ysize();
+  float* JXL_RESTRICT rows_out[3] = {
+      smoothed->PlaneRow(0, y),
+      smoothed->PlaneRow(1, y),
+      smoothed->PlaneRow(2, y),
+  };
+  const float* JXL_RESTRICT rows[3] = {
+      dc.ConstPlaneRow(0, y),
+      dc.ConstPlaneRow(1, y),
+      dc.ConstPlaneRow(2, y),
+  };
+  if (y == 0 || y + 1 >= ysize || xsize <= 2) {
+    for (size_t c = 0; c < 3; c++) {
+      memcpy(rows_out[c] + x0, rows[c] + x0, (x1 - x0) * sizeof(float));
+    }
+    return;
+  }
+  const float* JXL_RESTRICT rows_top[3]{
+      dc.ConstPlaneRow(0, y - 1),
+      dc.ConstPlaneRow(1, y - 1),
+      dc.ConstPlaneRow(2, y - 1),
+  };
+  const float* JXL_RESTRICT rows_bottom[3] = {
+      dc.ConstPlaneRow(0, y + 1),
+      dc.ConstPlaneRow(1, y + 1),
+      dc.ConstPlaneRow(2, y + 1),
+  };
+  for (size_t x : {static_cast<size_t>(0), xsize - 1}) {
+    if (x < x0 || x >= x1) continue;
+    for (size_t c = 0; c < 3; c++) {
+      rows_out[c][x] = rows[c][x];
+    }
+  }
+
+  size_t x = std::max<size_t>(x0, 1);
+  const size_t end = std::min(x1, xsize - 1);
+  // First pixels, up to the first aligned vector.
+  const size_t N = Lanes(D());
+  for (; x < end && x % N != 0; x++) {
+    ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
+                          x);
+  }
+  // Full vectors.
+  for (; x + N <= end; x += N) {
+    ComputePixel<D>(dc_factors, rows_top, rows, rows_bottom, rows_out, x);
+  }
+  // Last pixels.
+  for (; x < end; x++) {
+    ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
+                          x);
+  }
+}
+
 Status AdaptiveDCSmoothing(JxlMemoryManager* memory_manager,
                            const float* dc_factors, Image3F* dc,
                            ThreadPool* pool) {
@@ -132,71 +190,33 @@ Status AdaptiveDCSmoothing(JxlMemoryManager* memory_manager,
   const size_t ysize = dc->ysize();
   if (ysize <= 2 || xsize <= 2) return true;
 
-  // TODO(veluca): use tile-based processing?
   // TODO(veluca): decide if changes to the y channel should be propagated to
   // the x and b channels through color correlation.
   JXL_ENSURE(w1 + w2 < 0.25f);
 
   JXL_ASSIGN_OR_RETURN(Image3F smoothed,
                        Image3F::Create(memory_manager, xsize, ysize));
-  // Fill in borders that the loop below will not. First and last are unused.
-  for (size_t c = 0; c < 3; c++) {
-    for (size_t y : {static_cast<size_t>(0), ysize - 1}) {
-      memcpy(smoothed.PlaneRow(c, y), dc->PlaneRow(c, y),
-             xsize * sizeof(float));
-    }
-  }
   auto process_row = [&](const uint32_t y, size_t /*thread*/) -> Status {
-    const float* JXL_RESTRICT rows_top[3]{
-        dc->ConstPlaneRow(0, y - 1),
-        dc->ConstPlaneRow(1, y - 1),
-        dc->ConstPlaneRow(2, y - 1),
-    };
-    const float* JXL_RESTRICT rows[3] = {
-        dc->ConstPlaneRow(0, y),
-        dc->ConstPlaneRow(1, y),
-        dc->ConstPlaneRow(2, y),
-    };
-    const float* JXL_RESTRICT rows_bottom[3] = {
-        dc->ConstPlaneRow(0, y + 1),
-        dc->ConstPlaneRow(1, y + 1),
-        dc->ConstPlaneRow(2, y + 1),
-    };
-    float* JXL_RESTRICT rows_out[3] = {
-        smoothed.PlaneRow(0, y),
-        smoothed.PlaneRow(1, y),
-        smoothed.PlaneRow(2, y),
-    };
-    for (size_t x : {static_cast<size_t>(0), xsize - 1}) {
-      for (size_t c = 0; c < 3; c++) {
-        rows_out[c][x] = rows[c][x];
-      }
-    }
-
-    size_t x = 1;
-    // First pixels
-    const size_t N = Lanes(D());
-    for (; x < std::min(N, xsize - 1); x++) {
-      ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
-                            x);
-    }
-    // Full vectors.
-    for (; x + N <= xsize - 1; x += N) {
-      ComputePixel<D>(dc_factors, rows_top, rows, rows_bottom, rows_out, x);
-    }
-    // Last pixels.
-    for (; x < xsize - 1; x++) {
-      ComputePixel<DScalar>(dc_factors, rows_top, rows, rows_bottom, rows_out,
-                            x);
-    }
+    SmoothDCRow(dc_factors, *dc, y, 0, xsize, &smoothed);
     return true;
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 1, ysize - 1, ThreadPool::NoInit,
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize, ThreadPool::NoInit,
                                 process_row, "DCSmoothingRow"));
   dc->Swap(smoothed);
   return true;
 }
 
+Status AdaptiveDCSmoothingRect(const float* dc_factors, const Image3F& dc,
+                               const Rect& rect, Image3F* smoothed) {
+  JXL_ENSURE(smoothed->xsize() == dc.xsize() &&
+             smoothed->ysize() == dc.ysize());
+  JXL_ENSURE(rect.IsInside(dc));
+  for (size_t y = rect.y0(); y < rect.y1(); y++) {
+    SmoothDCRow(dc_factors, dc, y, rect.x0(), rect.x1(), smoothed);
+  }
+  return true;
+}
+
 // DC dequantization.
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
@@ -303,6 +323,13 @@ Status AdaptiveDCSmoothing(JxlMemoryManager* memory_manager,
                                                    dc, pool);
 }
 
+HWY_EXPORT(AdaptiveDCSmoothingRect);
+Status AdaptiveDCSmoothing(const float* dc_factors, const Image3F& dc,
+                           const Rect& rect, Image3F* smoothed) {
+  return HWY_DYNAMIC_DISPATCH(AdaptiveDCSmoothingRect)(dc_factors, dc, rect,
+                                                       smoothed);
+}
+
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
                const YCbCrChromaSubsampling& chroma_subsampling,
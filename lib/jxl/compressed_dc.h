@@ -26,6 +26,12 @@ Status AdaptiveDCSmoothing(JxlMemoryManager* memory_manager,
                            const float* dc_factors, Image3F* dc,
                            ThreadPool* pool);
 
+// Same, but only for the pixels of `rect` of `dc`, which are written to the
+// same pixels of `smoothed`. Only reads `dc` up to one pixel around `rect`, so
+// that the decoder can smooth each DC group once its neighbours are decoded.
+Status AdaptiveDCSmoothing(const float* dc_factors, const Image3F& dc,
+                           const Rect& rect, Image3F* smoothed);
+
 void DequantDC(const Rect& r, Image3F* dc, ImageB* quant_dc, const Image& in,
                const float* dc_factors, float mul, const float* cfl_factors,
                const YCbCrChromaSubsampling& chroma_subsampling,
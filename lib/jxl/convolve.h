@@ -61,6 +61,12 @@ Status Symmetric5(const ImageF& in, const Rect& in_rect,
                   const WeightsSymmetric5& weights, ThreadPool* pool,
                   ImageF* JXL_RESTRICT out, const Rect& out_rect);
 
+// Same as Symmetric5 with `in_out` as both input and output. Processes stripes
+// of rows from a copy of a few rows per thread, instead of reading from another
+// image of the same size.
+Status Symmetric5InPlace(const Rect& rect, const WeightsSymmetric5& weights,
+                         ThreadPool* pool, ImageF* in_out);
+
 Status Separable5(const ImageF& in, const Rect& rect,
                   const WeightsSeparable5& weights, ThreadPool* pool,
                   ImageF* out);
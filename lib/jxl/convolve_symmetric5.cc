@@ -3,10 +3,14 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/memory_manager.h>
+
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -176,6 +180,86 @@ Status Symmetric5(const ImageF& in, const Rect& in_rect,
   return true;
 }
 
+Status Symmetric5InPlace(const Rect& rect, const WeightsSymmetric5& weights,
+                         ThreadPool* pool, ImageF* in_out) {
+  constexpr size_t kStripeRows = 64;
+  constexpr int64_t kRadius = 2;
+  JxlMemoryManager* memory_manager = in_out->memory_manager();
+  const size_t xsize = in_out->xsize();
+  const int64_t ysize = in_out->ysize();
+  const int64_t y0 = rect.y0();
+  const int64_t y1 = rect.y1();
+  const size_t num_stripes = DivCeil(rect.ysize(), kStripeRows);
+  const auto stripe_begin = [&](size_t stripe) {
+    return y0 + static_cast<int64_t>(stripe * kStripeRows);
+  };
+  const auto stripe_end = [&](size_t stripe) {
+    return std::min(stripe_begin(stripe) + static_cast<int64_t>(kStripeRows),
+                    y1);
+  };
+  // The first and last two rows of every stripe, which the neighbouring stripes
+  // read after the stripe already overwrote them.
+  JXL_ASSIGN_OR_RETURN(
+      ImageF halo, ImageF::Create(memory_manager, xsize, num_stripes * 4));
+  const auto copy_halo = [&](const uint32_t stripe,
+                             size_t /*thread*/) -> Status {
+    const int64_t begin = stripe_begin(stripe);
+    const int64_t end = stripe_end(stripe);
+    for (int64_t i = 0; i < 4; ++i) {
+      const int64_t y = i < 2 ? begin + i : end - 4 + i;
+      if (y < begin || y >= end) continue;
+      memcpy(halo.Row(stripe * 4 + i), in_out->ConstRow(y),
+             xsize * sizeof(float));
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(num_stripes),
+                                ThreadPool::NoInit, copy_halo,
+                                "Symmetric5InPlaceHalo"));
+
+  std::vector<ImageF> rows;
+  const auto init = [&](const size_t num_threads) -> Status {
+    rows.resize(num_threads);
+    for (ImageF& thread_rows : rows) {
+      JXL_ASSIGN_OR_RETURN(thread_rows,
+                           ImageF::Create(memory_manager, xsize,
+                                          kStripeRows + 2 * kRadius));
+    }
+    return true;
+  };
+  const auto process_stripe = [&](const uint32_t stripe,
+                                  size_t thread) -> Status {
+    const int64_t begin = stripe_begin(stripe);
+    const int64_t end = stripe_end(stripe);
+    ImageF& in = rows[thread];
+    // Rows of the stripe are still unchanged, rows of other stripes come from
+    // the halo and rows outside of `rect` are never written.
+    for (int64_t y = begin - kRadius; y < end + kRadius; ++y) {
+      const int64_t iy = Mirror(y, ysize);
+      const float* JXL_RESTRICT row_in = in_out->ConstRow(iy);
+      if ((iy < begin || iy >= end) && iy >= y0 && iy < y1) {
+        const size_t other = (iy - y0) / kStripeRows;
+        const int64_t other_begin = stripe_begin(other);
+        const int64_t other_end = stripe_end(other);
+        JXL_ENSURE(iy < other_begin + 2 || iy >= other_end - 2);
+        const int64_t i =
+            iy < other_begin + 2 ? iy - other_begin : iy - other_end + 4;
+        row_in = halo.ConstRow(other * 4 + i);
+      }
+      memcpy(in.Row(y - begin + kRadius), row_in, xsize * sizeof(float));
+    }
+    for (int64_t y = begin; y < end; ++y) {
+      Symmetric5Row<WrapUnchanged>(in, rect, y - begin + kRadius, weights,
+                                   in_out->Row(y) + rect.x0());
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(num_stripes),
+                                init, process_stripe,
+                                "Symmetric5x5InPlaceConvolution"));
+  return true;
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -192,5 +276,11 @@ Status Symmetric5(const ImageF& in, const Rect& in_rect,
                                           out_rect);
 }
 
+HWY_EXPORT(Symmetric5InPlace);
+Status Symmetric5InPlace(const Rect& rect, const WeightsSymmetric5& weights,
+                         ThreadPool* pool, ImageF* in_out) {
+  return HWY_DYNAMIC_DISPATCH(Symmetric5InPlace)(rect, weights, pool, in_out);
+}
+
 }  // namespace jxl
 #endif  // HWY_ONCE
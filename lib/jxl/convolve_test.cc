@@ -149,6 +149,32 @@ void VerifySymmetric5(const size_t xsize, const size_t ysize, ThreadPool* pool,
   }
 }
 
+// Ensures Symmetric5InPlace matches Symmetric5 on a copy of the input.
+void VerifySymmetric5InPlace(const size_t xsize, const size_t ysize,
+                             ThreadPool* pool, Rng* rng) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  JXL_TEST_ASSIGN_OR_DIE(ImageF in,
+                         ImageF::Create(memory_manager, xsize, ysize));
+  GenerateImage(*rng, &in, 0.0f, 1.0f);
+
+  for (const Rect& rect : GenerateTestRectangles(xsize, ysize)) {
+    JXL_TEST_ASSIGN_OR_DIE(ImageF out_expected,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    JXL_TEST_ASSIGN_OR_DIE(ImageF out_actual,
+                           ImageF::Create(memory_manager, xsize, ysize));
+    ASSERT_TRUE(CopyImageTo(in, &out_expected));
+    ASSERT_TRUE(CopyImageTo(in, &out_actual));
+
+    ASSERT_TRUE(Symmetric5(in, rect, WeightsSymmetric5Lowpass(), pool,
+                           &out_expected, rect));
+    ASSERT_TRUE(
+        Symmetric5InPlace(rect, WeightsSymmetric5Lowpass(), pool, &out_actual));
+
+    JXL_TEST_ASSERT_OK(
+        VerifyRelativeError(out_expected, out_actual, 1E-5f, 1E-5f, _));
+  }
+}
+
 void VerifySeparable5(const size_t xsize, const size_t ysize, ThreadPool* pool,
                       Rng* rng) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
@@ -197,11 +223,17 @@ void TestConvolve() {
       JXL_DEBUG(JXL_DEBUG_CONVOLVE, "Sym5------------------");
       VerifySymmetric5(xsize, ysize, null_pool, &rng);
       VerifySymmetric5(xsize, ysize, pool3.get(), &rng);
+      VerifySymmetric5InPlace(xsize, ysize, null_pool, &rng);
+      VerifySymmetric5InPlace(xsize, ysize, pool3.get(), &rng);
 
       JXL_DEBUG(JXL_DEBUG_CONVOLVE, "Sep5------------------");
       VerifySeparable5(xsize, ysize, null_pool, &rng);
       VerifySeparable5(xsize, ysize, pool3.get(), &rng);
     }
+    // Several stripes of rows, the last one possibly shorter than the border.
+    for (size_t ysize : {64, 65, 129, 143}) {
+      VerifySymmetric5InPlace(xsize, ysize, pool3.get(), &rng);
+    }
     return true;
   };
   EXPECT_EQ(true, RunOnPool(pool.get(), kConvolveMaxRadius, 40,
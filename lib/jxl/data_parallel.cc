@@ -0,0 +1,34 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/base/data_parallel.h"
+
+#include <jxl/parallel_runner.h>
+
+#include <cstdint>
+
+#include "lib/jxl/base/os_macros.h"
+
+#if JXL_OS_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jxl {
+
+uint32_t ThreadPool::CurrentNumaNode() {
+#if JXL_OS_LINUX && defined(SYS_getcpu)
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) return node;
+#endif
+  return 0;
+}
+
+}  // namespace jxl
+
+const char* JxlParallelRunTag(void) {
+  return jxl::ThreadPool::CurrentCaller();
+}
@@ -6,10 +6,14 @@
 #include "lib/jxl/base/data_parallel.h"
 
 #include <jxl/parallel_runner.h>
+#include <jxl/thread_parallel_runner.h>
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
+#include "lib/jxl/base/scratch_arena.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testing.h"
@@ -17,6 +21,10 @@
 namespace jxl {
 namespace {
 
+// Keys of std::vector<uint32_t> objects.
+constexpr ScratchKey kTestValues = TestScratchKey(0);
+constexpr ScratchKey kTestOtherValues = TestScratchKey(1);
+
 class DataParallelTest : public ::testing::Test {
  protected:
   // A fake class to verify that DataParallel is properly calling the
@@ -99,4 +107,128 @@ TEST_F(DataParallelTest, RunnerNotCalledOnEmptyRange) {
   EXPECT_EQ(0, runner_called_);
 }
 
+// Runs "num_outer" outer tasks, each of which makes a nested Run call, and
+// checks that every nested task runs once with a "thread" number that is in
+// range and not in use by another running task.
+void TestNested(ThreadPool* pool, bool nestable, uint32_t num_outer) {
+  const uint32_t kNumInner = 50;
+  std::vector<std::atomic<int>> busy(256);
+  std::vector<std::atomic<int>> visits(num_outer * kNumInner);
+  const auto outer_task = [&](const uint32_t task,
+                              const size_t /* thread */) -> Status {
+    size_t num_threads = 0;
+    const auto init = [&num_threads](const size_t num) -> Status {
+      num_threads = num;
+      return true;
+    };
+    const auto inner_task = [&](const uint32_t inner,
+                                const size_t thread) -> Status {
+      EXPECT_LT(thread, num_threads);
+      EXPECT_EQ(0, busy[thread].fetch_add(1));
+      visits[task * kNumInner + inner].fetch_add(1);
+      busy[thread].fetch_sub(1);
+      return true;
+    };
+    return pool->Run(0, kNumInner, init, inner_task, "Inner");
+  };
+  if (nestable) {
+    EXPECT_TRUE(RunNestableOnPool(pool, 0, num_outer, ThreadPool::NoInit,
+                                  outer_task, "Outer"));
+  } else {
+    EXPECT_TRUE(RunOnPool(pool, 0, num_outer, ThreadPool::NoInit, outer_task,
+                          "Outer"));
+  }
+  for (const auto& count : visits) {
+    EXPECT_EQ(1, count.load());
+  }
+}
+
+TEST(DataParallelNestingTest, NestedRunWithoutThreads) {
+  ThreadPool pool(nullptr, nullptr);
+  TestNested(&pool, /*nestable=*/false, 3);
+  TestNested(&pool, /*nestable=*/true, 3);
+}
+
+TEST(DataParallelNestingTest, NestedRunInline) {
+  test::ThreadPoolForTests pool(4);
+  for (uint32_t num_outer : {1, 3, 17}) {
+    TestNested(pool.get(), /*nestable=*/false, num_outer);
+  }
+}
+
+TEST(DataParallelNestingTest, NestedRunFolded) {
+  for (JxlThreadParallelRunnerMode mode :
+       {JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER,
+        JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING}) {
+    test::ThreadPoolForTests pool(4, mode);
+    for (uint32_t num_outer : {1, 3, 17}) {
+      TestNested(pool.get(), /*nestable=*/true, num_outer);
+    }
+  }
+}
+
+TEST(DataParallelNestingTest, NestedFailurePropagates) {
+  test::ThreadPoolForTests pool(4);
+  const auto outer_task = [&](const uint32_t task,
+                              const size_t /* thread */) -> Status {
+    return RunOnPool(
+        pool.get(), 0, 10, ThreadPool::NoInit,
+        [task](const uint32_t inner, const size_t /* thread */) -> Status {
+          if (task == 1 && inner == 5) return JXL_FAILURE("inner");
+          return true;
+        },
+        "Inner");
+  };
+  EXPECT_FALSE(RunNestableOnPool(pool.get(), 0, 2, ThreadPool::NoInit,
+                                 outer_task, "Outer"));
+  EXPECT_FALSE(RunOnPool(pool.get(), 0, 2, ThreadPool::NoInit, outer_task,
+                         "Outer"));
+}
+
+TEST(DataParallelScratchTest, ScratchPersistsAcrossRuns) {
+  test::ThreadPoolForTests pool(4);
+  ScratchArena* scratch = pool.get()->scratch();
+  const uint32_t kNumTasks = 100;
+  size_t num_threads = 0;
+  const auto init = [&num_threads](const size_t num) -> Status {
+    num_threads = num;
+    return true;
+  };
+  const auto task = [&](const uint32_t value, const size_t thread) -> Status {
+    scratch->Get<std::vector<uint32_t>>(kTestValues, thread)->push_back(value);
+    return true;
+  };
+  const auto count_values = [&]() {
+    size_t count = 0;
+    for (size_t thread = 0; thread < num_threads; ++thread) {
+      count += scratch->Get<std::vector<uint32_t>>(kTestValues, thread)->size();
+      // Other keys have their own objects.
+      EXPECT_TRUE(scratch->Get<std::vector<uint32_t>>(kTestOtherValues, thread)
+                      ->empty());
+    }
+    return count;
+  };
+  EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks, init, task, "First"));
+  EXPECT_EQ(kNumTasks, count_values());
+  EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks, init, task, "Second"));
+  EXPECT_EQ(2 * kNumTasks, count_values());
+  scratch->Clear();
+  EXPECT_EQ(0u, count_values());
+}
+
+TEST(DataParallelScratchTest, ScratchIndicesHaveTheirOwnObjects) {
+  ScratchArena scratch;
+  const size_t kIndices[] = {0, 1, 2, 3, 6, 7, 1000};
+  for (size_t index : kIndices) {
+    scratch.Get<std::vector<uint32_t>>(kTestValues, index)->push_back(index);
+  }
+  for (size_t index : kIndices) {
+    const std::vector<uint32_t>& values =
+        *scratch.Get<std::vector<uint32_t>>(kTestValues, index);
+    ASSERT_EQ(1u, values.size());
+    EXPECT_EQ(index, values[0]);
+  }
+  EXPECT_TRUE(scratch.Get<std::vector<uint32_t>>(kTestValues, 999)->empty());
+}
+
 }  // namespace jxl
@@ -3,7 +3,13 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
 #include "benchmark/benchmark.h"
+#include "lib/jxl/ac_strategy.h"
 #include "lib/jxl/base/compiler_specific.h"
 
 #ifndef SIZE_LIST
@@ -34,10 +40,12 @@
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/dct_gbench.cc"
+#include <hwy/aligned_allocator.h>
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
 #include "lib/jxl/dct-inl.h"
+#include "lib/jxl/dec_transforms-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
@@ -96,6 +104,25 @@ void RunIdct(benchmark::State& state, float* JXL_RESTRICT values1,
 SIZE_LIST(IMPL_BM)
 #undef IMPL_BM
 
+// Inverse transform of a whole varblock, as done by the decoder, so that
+// every AcStrategyType is measured including the transposes it needs.
+HWY_NOINLINE void BM_TransformToPixels(benchmark::State& state,
+                                       uint8_t raw_strategy,
+                                       float* JXL_RESTRICT pixels,
+                                       size_t pixels_stride,
+                                       float* JXL_RESTRICT coefficients,
+                                       float* JXL_RESTRICT scratch_space) {
+  const AcStrategy acs = AcStrategy::FromRawStrategy(raw_strategy);
+  for (auto _ : state) {
+    (void)_;
+    TransformToPixels(acs.Strategy(), coefficients, pixels, pixels_stride,
+                      scratch_space);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * acs.covered_blocks_x() *
+                          acs.covered_blocks_y() * kDCTBlockSize);
+}
+
 }  // namespace
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
@@ -131,6 +158,26 @@ namespace {
 SIZE_LIST(DEFINE_BM)
 #undef DEFINE_BM
 
+HWY_EXPORT(BM_TransformToPixels);
+void BM_TransformToPixels(benchmark::State& state, int64_t target,
+                          uint8_t raw_strategy) {
+  hwy::SetSupportedTargetsForTest(target);
+  constexpr size_t kSize = 256 * 256;
+  auto pixels = hwy::AllocateAligned<float>(kSize);
+  auto coeffs = hwy::AllocateAligned<float>(kSize);
+  auto scratch = hwy::AllocateAligned<float>(4 * kSize);
+  if (!pixels || !coeffs || !scratch) {
+    state.SkipWithError("allocation failed");
+    return;
+  }
+  std::fill(pixels.get(), pixels.get() + kSize, 0.0f);
+  std::fill(coeffs.get(), coeffs.get() + kSize, 0.0f);
+  std::fill(scratch.get(), scratch.get() + 4 * kSize, 0.0f);
+  HWY_DYNAMIC_DISPATCH(BM_TransformToPixels)
+  (state, raw_strategy, pixels.get(), 256, coeffs.get(), scratch.get());
+  hwy::SetSupportedTargetsForTest(0);
+}
+
 }  // namespace
 }  // namespace jxl
 
@@ -152,6 +199,14 @@ void JXL_MAYBE_UNUSED RegisterDctBenchmarks() {
   }
   SIZE_LIST(REGISTER_BM)
 #undef REGISTER_BM
+  for (uint8_t i = 0; i < jxl::AcStrategy::kNumValidStrategies; i++) {
+    for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+      std::string name = "TransformToPixels/" + std::to_string(i) + "/" +
+                         hwy::TargetName(target);
+      benchmark::RegisterBenchmark(name.c_str(), jxl::BM_TransformToPixels,
+                                   target, i);
+    }
+  }
 }
 
 #endif
@@ -191,6 +191,32 @@ Status ReadHistogram(int precision_bits, std::vector<int32_t>* counts,
   return true;
 }
 
+// Returns log2 of the frequency of the symbols of `counts` if they all have
+// the same one and `table` maps them to consecutive slots, as described for
+// ANSCode::flat_log_freqs, or -1.
+int8_t FlatLogFreq(const std::vector<int32_t>& counts, size_t log_alpha_size,
+                   const AliasTable::Entry* table) {
+  const size_t num_symbols = counts.size();
+  if (num_symbols < 2 || (num_symbols & (num_symbols - 1)) != 0) return -1;
+  const uint32_t freq = ANS_TAB_SIZE / num_symbols;
+  for (int32_t count : counts) {
+    if (count != static_cast<int32_t>(freq)) return -1;
+  }
+  const uint32_t log_freq = FloorLog2Nonzero(freq);
+  const uint32_t log_entry_size = ANS_LOG_TAB_SIZE - log_alpha_size;
+  const uint32_t entry_size_minus_1 = (1 << log_entry_size) - 1;
+  for (uint32_t res = 0; res < ANS_TAB_SIZE; res++) {
+    const AliasTable::Symbol symbol =
+        AliasTable::Lookup(table, res, log_entry_size, entry_size_minus_1);
+    if (symbol.value != (res >> log_freq) ||
+        symbol.offset != (res & (freq - 1)) ||
+        symbol.freq != freq) {
+      return -1;
+    }
+  }
+  return static_cast<int8_t>(log_freq);
+}
+
 }  // namespace
 
 Status DecodeANSCodes(JxlMemoryManager* memory_manager,
@@ -199,6 +225,7 @@ Status DecodeANSCodes(JxlMemoryManager* memory_manager,
                       ANSCode* result) {
   result->memory_manager = memory_manager;
   result->degenerate_symbols.resize(num_histograms, -1);
+  result->flat_log_freqs.resize(num_histograms, -1);
   if (result->use_prefix_code) {
     JXL_ENSURE(max_alphabet_size <= 1 << PREFIX_MAX_BITS);
     result->huffman_data.resize(num_histograms);
@@ -224,6 +251,7 @@ Status DecodeANSCodes(JxlMemoryManager* memory_manager,
         // 0-bit codes does not require extension tables.
         result->huffman_data[c].table_.clear();
         result->huffman_data[c].table_.resize(1u << kHuffmanTableBits);
+        result->degenerate_symbols[c] = 0;
       }
       for (const auto& h : result->huffman_data[c].table_) {
         if (h.bits <= kHuffmanTableBits) {
@@ -267,6 +295,11 @@ Status DecodeANSCodes(JxlMemoryManager* memory_manager,
       JXL_RETURN_IF_ERROR(
           InitAliasTable(counts, ANS_LOG_TAB_SIZE, result->log_alpha_size,
                          alias_tables + c * (1 << result->log_alpha_size)));
+      if (degenerate_symbol < 0) {
+        result->flat_log_freqs[c] = FlatLogFreq(
+            counts, result->log_alpha_size,
+            alias_tables + c * (1 << result->log_alpha_size));
+      }
     }
   }
   return true;
@@ -397,6 +430,8 @@ ANSSymbolReader::ANSSymbolReader(const ANSCode* code,
                                  AlignedMemory&& lz77_window_storage)
     : alias_tables_(code->alias_tables.address<AliasTable::Entry>()),
       huffman_data_(code->huffman_data.data()),
+      degenerate_symbols_(code->degenerate_symbols.data()),
+      flat_log_freqs_(code->flat_log_freqs.data()),
       use_prefix_code_(code->use_prefix_code),
       configs(code->uint_config.data()),
       lz77_window_storage_(std::move(lz77_window_storage)) {
@@ -146,7 +146,15 @@ struct ANSCode {
   AlignedMemory alias_tables;
   std::vector<HuffmanDecodingData> huffman_data;
   std::vector<HybridUintConfig> uint_config;
+  // For each histogram, the only symbol it can decode, or -1 if there are
+  // several. Decoding such a symbol leaves the state unchanged and consumes
+  // no bits, so it can be skipped.
   std::vector<int> degenerate_symbols;
+  // For each ANS histogram, log2 of the frequency of its symbols if they all
+  // have the same one and the alias table maps each slot `res` of the state to
+  // the symbol `res >> log_freq` at offset `res & (freq - 1)`, or -1. Such
+  // symbols are decoded without the alias table.
+  std::vector<int8_t> flat_log_freqs;
   bool use_prefix_code;
   uint8_t log_alpha_size;  // for ANS.
   LZ77Params lz77;
@@ -169,12 +177,27 @@ class ANSSymbolReader {
                                                BitReader* JXL_RESTRICT br) {
     const uint32_t res = state_ & (ANS_TAB_SIZE - 1u);
 
+    const int flat_log_freq = flat_log_freqs_[histo_idx];
+    if (flat_log_freq >= 0) {
+      const uint32_t offset = res & ((1u << flat_log_freq) - 1u);
+      state_ = ((state_ >> ANS_LOG_TAB_SIZE) << flat_log_freq) + offset;
+      Renormalize(br);
+      return res >> flat_log_freq;
+    }
+
     const AliasTable::Entry* table =
         &alias_tables_[histo_idx << log_alpha_size_];
     const AliasTable::Symbol symbol =
         AliasTable::Lookup(table, res, log_entry_size_, entry_size_minus_1_);
     state_ = symbol.freq * (state_ >> ANS_LOG_TAB_SIZE) + symbol.offset;
+    Renormalize(br);
+    const uint32_t next_res = state_ & (ANS_TAB_SIZE - 1u);
+    AliasTable::Prefetch(table, next_res, log_entry_size_);
+
+    return symbol.value;
+  }
 
+  JXL_INLINE void Renormalize(BitReader* JXL_RESTRICT br) {
 #if JXL_TRUE
     // Branchless version is about equally fast on SKX.
     const uint32_t new_state =
@@ -188,10 +211,6 @@ class ANSSymbolReader {
       br->Consume(16);
     }
 #endif
-    const uint32_t next_res = state_ & (ANS_TAB_SIZE - 1u);
-    AliasTable::Prefetch(table, next_res, log_entry_size_);
-
-    return symbol.value;
   }
 
   JXL_INLINE size_t ReadSymbolHuffWithoutRefill(const size_t histo_idx,
@@ -281,6 +300,7 @@ class ANSSymbolReader {
     return true;
   }
   bool UsesLZ77() { return lz77_window_ != nullptr; }
+  bool UsesPrefixCode() const { return use_prefix_code_; }
 
   // Takes a *clustered* idx. Inlined, for use in hot paths.
   template <bool uses_lz77>
@@ -296,7 +316,9 @@ class ANSSymbolReader {
     }
 
     br->Refill();  // covers ReadSymbolWithoutRefill + PeekBits
-    size_t token = ReadSymbolWithoutRefill(ctx, br);
+    const int degenerate_symbol = degenerate_symbols_[ctx];
+    size_t token = degenerate_symbol >= 0 ? degenerate_symbol
+                                          : ReadSymbolWithoutRefill(ctx, br);
     if (uses_lz77) {
       if (JXL_UNLIKELY(token >= lz77_threshold_)) {
         num_to_copy_ = ReadHybridUintConfig(lz77_length_uint_,
@@ -342,6 +364,46 @@ class ANSSymbolReader {
     return ret;
   }
 
+  // Takes a *clustered* idx. Reads `num` values into `values`, copying the
+  // LZ77 matches in bulk instead of one value per call.
+  template <bool uses_lz77>
+  void ReadHybridUintClusteredBatch(size_t ctx, BitReader* JXL_RESTRICT br,
+                                    uint32_t* JXL_RESTRICT values, size_t num) {
+    size_t i = 0;
+    while (i < num) {
+      if (!uses_lz77 || num_to_copy_ == 0) {
+        values[i++] = ReadHybridUintClusteredInlined<uses_lz77>(ctx, br);
+        continue;
+      }
+      const size_t distance = num_decoded_ - copy_pos_;
+      const size_t src = copy_pos_ & kWindowMask;
+      const size_t dst = num_decoded_ & kWindowMask;
+      size_t n = std::min<size_t>(num - i, num_to_copy_);
+      if (distance == 1) {
+        // A run of the last value.
+        const uint32_t v = lz77_window_[src];
+        n = std::min(n, kWindowSize - dst);
+        std::fill(values + i, values + i + n, v);
+        std::fill(lz77_window_ + dst, lz77_window_ + dst + n, v);
+      } else {
+        // Neither range may wrap around the window, and the part of the match
+        // written to the window may not overlap the part read from it, unless
+        // they coincide, which happens when the distance is 0 or the window
+        // size.
+        n = std::min(n, kWindowSize - std::max(src, dst));
+        if (src != dst) n = std::min({n, distance, kWindowSize - distance});
+        memcpy(values + i, lz77_window_ + src, n * sizeof(*values));
+        if (src != dst) {
+          memcpy(lz77_window_ + dst, lz77_window_ + src, n * sizeof(*values));
+        }
+      }
+      i += n;
+      copy_pos_ += n;
+      num_decoded_ += n;
+      num_to_copy_ -= n;
+    }
+  }
+
   // same but not inlined
   template <bool uses_lz77>
   size_t ReadHybridUintClustered(size_t ctx, BitReader* JXL_RESTRICT br) {
@@ -367,6 +429,22 @@ class ANSSymbolReader {
     return ReadHybridUintClustered<uses_lz77>(context_map[ctx], br);
   }
 
+  // Same as ReadHybridUintInlined</*uses_lz77=*/false>, for streams that use
+  // prefix codes and no LZ77, without choosing between ANS and prefix codes
+  // for each symbol.
+  JXL_INLINE size_t
+  ReadHybridUintPrefixCodeInlined(size_t ctx, BitReader* JXL_RESTRICT br,
+                                  const std::vector<uint8_t>& context_map) {
+    JXL_DASSERT(use_prefix_code_ && lz77_window_ == nullptr);
+    const size_t clustered_ctx = context_map[ctx];
+    br->Refill();  // covers ReadSymbolHuffWithoutRefill + PeekBits
+    const int degenerate_symbol = degenerate_symbols_[clustered_ctx];
+    size_t token = degenerate_symbol >= 0
+                       ? degenerate_symbol
+                       : ReadSymbolHuffWithoutRefill(clustered_ctx, br);
+    return ReadHybridUintConfig(configs[clustered_ctx], token, br);
+  }
+
   // not inlined, for use in non-hot paths
   size_t ReadHybridUint(size_t ctx, BitReader* JXL_RESTRICT br,
                         const std::vector<uint8_t>& context_map) {
@@ -377,20 +455,15 @@ class ANSSymbolReader {
   // This function will modify the ANS state as if `count` symbols have been
   // decoded.
   bool IsSingleValueAndAdvance(size_t ctx, uint32_t* value, size_t count) {
-    // TODO(veluca): No optimization for Huffman mode yet.
-    if (use_prefix_code_) return false;
-    // TODO(eustas): propagate "degenerate_symbol" to simplify this method.
-    const uint32_t res = state_ & (ANS_TAB_SIZE - 1u);
-    const AliasTable::Entry* table = &alias_tables_[ctx << log_alpha_size_];
-    AliasTable::Symbol symbol =
-        AliasTable::Lookup(table, res, log_entry_size_, entry_size_minus_1_);
-    if (symbol.freq != ANS_TAB_SIZE) return false;
-    if (configs[ctx].split_token <= symbol.value) return false;
-    if (symbol.value >= lz77_threshold_) return false;
-    *value = symbol.value;
+    const int symbol = degenerate_symbols_[ctx];
+    if (symbol < 0) return false;
+    const uint32_t symbol_value = static_cast<uint32_t>(symbol);
+    if (configs[ctx].split_token <= symbol_value) return false;
+    if (symbol_value >= lz77_threshold_) return false;
+    *value = symbol_value;
     if (lz77_window_) {
       for (size_t i = 0; i < count; i++) {
-        lz77_window_[(num_decoded_++) & kWindowMask] = symbol.value;
+        lz77_window_[(num_decoded_++) & kWindowMask] = symbol_value;
       }
     }
     return true;
@@ -452,6 +525,8 @@ class ANSSymbolReader {
 
   const AliasTable::Entry* JXL_RESTRICT alias_tables_;  // not owned
   const HuffmanDecodingData* huffman_data_;
+  const int* degenerate_symbols_;  // not owned
+  const int8_t* flat_log_freqs_;   // not owned
   bool use_prefix_code_;
   uint32_t state_ = ANS_SIGNATURE << 16u;
   const HybridUintConfig* JXL_RESTRICT configs;
@@ -18,6 +18,10 @@ void BitReader::BoundsCheckedRefill() {
 
   // Read whole bytes until we have [56, 64) bits (same as LoadLE64)
   for (; bits_in_buf_ < 64 - kBitsPerByte; bits_in_buf_ += kBitsPerByte) {
+    while (next_byte_ >= end && next_chunk_ != chunks_end_) {
+      NextChunk();
+      end = end_minus_8_ + 8;
+    }
     if (next_byte_ >= end) break;
     buf_ |= static_cast<uint64_t>(*next_byte_++) << bits_in_buf_;
   }
@@ -20,6 +20,7 @@
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 
 namespace jxl {
@@ -47,7 +48,39 @@ class BitReader {
         next_byte_(bytes.data()),
         // Assumes first_byte_ >= 8.
         end_minus_8_(bytes.data() - 8 + bytes.size()),
-        first_byte_(bytes.data()) {
+        first_byte_(bytes.data()),
+        total_bytes_(bytes.size()) {
+    Refill();
+  }
+
+  // Like the constructor above, for bytes that are followed by `slack` more
+  // readable bytes, e.g. the next sections of the same buffer. Up to 16 of them
+  // are loaded like the bytes themselves, so that the last refills within the
+  // bytes skip the bounds-checked path. Bits past the end are then those of
+  // the slack instead of zeros, and reading them still fails Close().
+  BitReader(Span<const uint8_t> bytes, size_t slack)
+      : buf_(0),
+        bits_in_buf_(0),
+        next_byte_(bytes.data()),
+        end_minus_8_(bytes.data() - 8 + bytes.size() +
+                     (slack < 16 ? slack : 16)),
+        first_byte_(bytes.data()),
+        total_bytes_(bytes.size()) {
+    Refill();
+  }
+
+  // Reads the concatenation of `num_chunks` chunks, e.g. the parts of a section
+  // that is split across boxes, without copying them. `chunks` must outlive
+  // the BitReader. Reads within a chunk are as fast as with a single one.
+  BitReader(const Span<const uint8_t>* chunks, size_t num_chunks)
+      : buf_(0),
+        bits_in_buf_(0),
+        next_byte_(chunks[0].data()),
+        end_minus_8_(chunks[0].data() - 8 + chunks[0].size()),
+        first_byte_(chunks[0].data()),
+        next_chunk_(chunks + 1),
+        chunks_end_(chunks + num_chunks) {
+    for (size_t i = 0; i < num_chunks; ++i) total_bytes_ += chunks[i].size();
     Refill();
   }
   ~BitReader() {
@@ -69,6 +102,10 @@ class BitReader {
     next_byte_ = other.next_byte_;
     end_minus_8_ = other.end_minus_8_;
     first_byte_ = other.first_byte_;
+    next_chunk_ = other.next_chunk_;
+    chunks_end_ = other.chunks_end_;
+    chunk_offset_ = other.chunk_offset_;
+    total_bytes_ = other.total_bytes_;
     overread_bytes_ = other.overread_bytes_;
     close_called_ = other.close_called_;
 
@@ -178,10 +215,15 @@ class BitReader {
     buf_ = 0;
 
     // Skip whole bytes
-    const size_t whole_bytes = skip / kBitsPerByte;
+    size_t whole_bytes = skip / kBitsPerByte;
     skip %= kBitsPerByte;
-    if (JXL_UNLIKELY(whole_bytes >
-                     static_cast<size_t>(end_minus_8_ + 8 - next_byte_))) {
+    while (JXL_UNLIKELY(whole_bytes >
+                        static_cast<size_t>(end_minus_8_ + 8 - next_byte_))) {
+      if (next_chunk_ != chunks_end_) {
+        whole_bytes -= static_cast<size_t>(end_minus_8_ + 8 - next_byte_);
+        NextChunk();
+        continue;
+      }
       // This is already an overflow condition (skipping past the end of the bit
       // stream). However if we increase next_byte_ too much we risk overflowing
       // that value and potentially making it valid again (next_byte_ < end).
@@ -190,16 +232,17 @@ class BitReader {
       // incorrect (still larger than the TotalBytes()).
       next_byte_ = end_minus_8_ + 8;
       skip += kBitsPerByte;
-    } else {
-      next_byte_ += whole_bytes;
+      whole_bytes = 0;
     }
+    next_byte_ += whole_bytes;
 
     Refill();
     Consume(skip);
   }
 
   size_t TotalBitsConsumed() const {
-    const size_t bytes_read = static_cast<size_t>(next_byte_ - first_byte_);
+    const size_t bytes_read =
+        chunk_offset_ + static_cast<size_t>(next_byte_ - first_byte_);
     return (bytes_read + overread_bytes_) * kBitsPerByte - bits_in_buf_;
   }
 
@@ -213,11 +256,9 @@ class BitReader {
   }
 
   // For interoperability with other bitreaders (for resuming at
-  // non-byte-aligned positions).
+  // non-byte-aligned positions). Only meaningful with a single chunk.
   const uint8_t* FirstByte() const { return first_byte_; }
-  size_t TotalBytes() const {
-    return static_cast<size_t>(end_minus_8_ + 8 - first_byte_);
-  }
+  size_t TotalBytes() const { return total_bytes_; }
 
   // Returns whether all the bits read so far have been within the input bounds.
   // When reading past the EOF, the Read*() and Consume() functions return zeros
@@ -253,6 +294,16 @@ class BitReader {
   // Separate function avoids inlining this relatively cold code into callers.
   JXL_NOINLINE void BoundsCheckedRefill();
 
+  // Continues reading at the start of the next chunk, once next_byte_ reached
+  // the end of the current one.
+  void NextChunk() {
+    chunk_offset_ += static_cast<size_t>(end_minus_8_ + 8 - first_byte_);
+    next_byte_ = next_chunk_->data();
+    end_minus_8_ = next_chunk_->data() - 8 + next_chunk_->size();
+    first_byte_ = next_chunk_->data();
+    ++next_chunk_;
+  }
+
   JXL_NOINLINE uint32_t BoundsCheckedReadByteAlignedWord() {
     if (next_byte_ + 1 < end_minus_8_ + 8) {
       uint32_t ret = LoadLE16(next_byte_);
@@ -268,6 +319,12 @@ class BitReader {
   const uint8_t* JXL_RESTRICT next_byte_;
   const uint8_t* end_minus_8_;  // for refill bounds check
   const uint8_t* first_byte_;   // for GetSpan
+  // Chunks after the current one, if reading several (see constructor).
+  const Span<const uint8_t>* next_chunk_ = nullptr;
+  const Span<const uint8_t>* chunks_end_ = nullptr;
+  // Total size of the chunks before the current one.
+  size_t chunk_offset_ = 0;
+  size_t total_bytes_ = 0;
 
   // Number of bytes past the end that were loaded into the buf_. These bytes
   // are not read from memory, but instead assumed 0. It is an error (likely due
@@ -6,10 +6,12 @@
 #include "lib/jxl/dec_cache.h"
 
 #include <jxl/memory_manager.h>
+#include <jxl/types.h>
 
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <utility>
 
 #include "lib/jxl/ac_strategy.h"
@@ -25,13 +27,16 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/memory_manager_internal.h"
+#include "lib/jxl/render_pipeline/gpu_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/stage_blending.h"
 #include "lib/jxl/render_pipeline/stage_chroma_upsampling.h"
 #include "lib/jxl/render_pipeline/stage_cms.h"
 #include "lib/jxl/render_pipeline/stage_epf.h"
 #include "lib/jxl/render_pipeline/stage_from_linear.h"
 #include "lib/jxl/render_pipeline/stage_gaborish.h"
+#include "lib/jxl/render_pipeline/stage_gain_map.h"
 #include "lib/jxl/render_pipeline/stage_noise.h"
 #include "lib/jxl/render_pipeline/stage_patches.h"
 #include "lib/jxl/render_pipeline/stage_splines.h"
@@ -45,6 +50,86 @@
 
 namespace jxl {
 
+namespace {
+
+// Whether the samples of a modular frame are the output pixels, and the
+// modular decoder can thus write them to the image buffer itself: the frame
+// has no filters or features, nor color stages, and is neither blended nor
+// referenced, and the buffer takes all the color channels and alpha as
+// integers of the same bit depth, without reorientation or downsampling.
+bool CanWriteModularOutputDirectly(
+    const PassesDecoderState& state, const FrameHeader& frame_header,
+    const ImageMetadata& metadata,
+    const PassesDecoderState::PipelineOptions& options) {
+  if (frame_header.encoding != FrameEncoding::kModular ||
+      frame_header.color_transform != ColorTransform::kNone ||
+      !frame_header.chroma_subsampling.Is444() ||
+      frame_header.loop_filter.gab || frame_header.loop_filter.epf_iters != 0 ||
+      frame_header.upsampling != 1 || frame_header.dc_level != 0 ||
+      frame_header.custom_size_or_origin || frame_header.CanBeReferenced()) {
+    return false;
+  }
+  constexpr uint64_t kFeatures =
+      FrameHeader::kPatches | FrameHeader::kSplines | FrameHeader::kNoise;
+  if ((frame_header.flags & kFeatures) != 0) return false;
+  for (uint32_t ecups : frame_header.extra_channel_upsampling) {
+    if (ecups != 1) return false;
+  }
+  if (options.coalescing && NeedsBlending(frame_header)) return false;
+  if (options.render_spotcolors && metadata.Find(ExtraChannel::kSpotColor)) {
+    return false;
+  }
+
+  const ImageOutput& main_output = state.main_output;
+  if (main_output.buffer == nullptr || main_output.planar ||
+      main_output.callback.IsPresent()) {
+    return false;
+  }
+  for (const ImageOutput& extra : state.extra_output) {
+    if (extra.buffer != nullptr || extra.callback.IsPresent()) return false;
+  }
+  if (state.unpremul_alpha ||
+      state.undo_orientation != Orientation::kIdentity ||
+      state.output_downsampling != 1 ||
+      state.width != state.shared->frame_dim.xsize ||
+      state.height != state.shared->frame_dim.ysize) {
+    return false;
+  }
+  const OutputEncodingInfo& info = state.output_encoding_info;
+  if (!info.color_encoding_is_original || info.orig_color_encoding.IsCMYK() ||
+      info.desired_intensity_target != info.orig_intensity_target) {
+    return false;
+  }
+
+  const JxlPixelFormat& format = main_output.format;
+  size_t max_bits;
+  if (format.data_type == JXL_TYPE_UINT8) {
+    max_bits = 8;
+  } else if (format.data_type == JXL_TYPE_UINT16) {
+    max_bits = 16;
+  } else {
+    return false;
+  }
+  const size_t bits = main_output.bits_per_sample;
+  if (bits == 0 || bits > max_bits) return false;
+  const size_t num_color = format.num_channels < 3 ? 1 : 3;
+  if (num_color != (metadata.color_encoding.IsGray() ? 1 : 3)) return false;
+  if (metadata.bit_depth.floating_point_sample ||
+      metadata.bit_depth.bits_per_sample != bits) {
+    return false;
+  }
+  // Without an alpha channel, the alpha of the output is opaque.
+  const ExtraChannelInfo* alpha = metadata.Find(ExtraChannel::kAlpha);
+  if (alpha && (format.num_channels == 2 || format.num_channels == 4) &&
+      (alpha->bit_depth.floating_point_sample ||
+       alpha->bit_depth.bits_per_sample != bits)) {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
 Status GroupDecCache::InitOnce(JxlMemoryManager* memory_manager,
                                size_t num_passes, size_t used_acs) {
   for (size_t i = 0; i < num_passes; i++) {
@@ -111,6 +196,38 @@ Status PassesDecoderState::InitForAC(size_t num_passes, ThreadPool* pool) {
   return true;
 }
 
+void PassesDecoderState::ReuseFrameBuffers(PassesDecoderState* other) {
+  if (other->render_pipeline) {
+    other->render_pipeline->ReleaseBuffersTo(&spare_pipeline_buffers);
+  }
+  sigma = std::move(other->sigma);
+  PassesSharedState& from = other->shared_storage;
+  shared_storage.ac_strategy = std::move(from.ac_strategy);
+  shared_storage.raw_quant_field = std::move(from.raw_quant_field);
+  shared_storage.epf_sharpness = std::move(from.epf_sharpness);
+  shared_storage.quant_dc = std::move(from.quant_dc);
+  shared_storage.dc_storage = std::move(from.dc_storage);
+  shared_storage.coeff_orders = std::move(from.coeff_orders);
+}
+
+void PassesDecoderState::ReleaseFrameBuffers() {
+  JxlMemoryManager* memory_manager = this->memory_manager();
+  render_pipeline.reset();
+  spare_pipeline_buffers.clear();
+  coefficients = make_unique<ACImageT<int32_t>>();
+  sigma = ImageF();
+  frame_storage_for_referencing = ImageBundle(memory_manager);
+  for (Image3F& dc_frame : shared_storage.dc_frames) dc_frame = Image3F();
+  for (ReferenceFrame& reference_frame : shared_storage.reference_frames) {
+    *reference_frame.frame = ImageBundle(memory_manager);
+  }
+  shared_storage.ac_strategy = AcStrategyImage();
+  shared_storage.raw_quant_field = ImageI();
+  shared_storage.epf_sharpness = ImageB();
+  shared_storage.quant_dc = ImageB();
+  shared_storage.dc_storage = Image3F();
+}
+
 Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
                                            const ImageMetadata* metadata,
                                            ImageBundle* decoded,
@@ -126,14 +243,52 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
     frame_storage_for_referencing = ImageBundle(memory_manager, metadata);
   }
 
+  // The gain map covers the whole image, so that it is only applied to the
+  // frames that are displayed as they are.
+  std::unique_ptr<RenderPipelineStage> gain_map_stage;
+  if (gain_map && frame_header.dc_level == 0 &&
+      !frame_header.custom_size_or_origin &&
+      (frame_header.frame_type == FrameType::kRegularFrame ||
+       frame_header.frame_type == FrameType::kSkipProgressive)) {
+    const FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+    gain_map_stage = GetGainMapStage(*gain_map, frame_dim.xsize_upsampled,
+                                     frame_dim.ysize_upsampled);
+    // The fast paths of 8-bit output do not go through linear colors.
+    fast_xyb_srgb8_conversion = false;
+    fast_ycbcr_rgb8_conversion = false;
+  }
+
+  direct_modular_output =
+      !gain_map_stage &&
+      CanWriteModularOutputDirectly(*this, frame_header, *metadata, options);
+
   RenderPipeline::Builder builder(memory_manager, num_c + num_tmp_c);
+  // Extra channels that are neither written to the output nor needed by the
+  // stages are not rendered, nor are any channels if the modular decoder
+  // writes the output.
+  builder.DropUnusedChannels(direct_modular_output ? 0 : 3);
 
   if (options.use_slow_render_pipeline) {
     builder.UseSimpleImplementation();
+  } else {
+    // Frames with many channels or passes of EPF are rendered in narrower
+    // strips, so that the rows of all the stages stay in the L2 cache.
+    builder.UseColumnStrips();
+    if (options.defer_rendering) builder.DeferRendering();
+  }
+  if (options.use_gpu_offload && !options.defer_rendering) {
+    std::unique_ptr<RenderPipelineOffload> offload =
+        CreateGPURenderPipelineOffload();
+    if (offload) builder.UseOffload(std::move(offload));
   }
 
   if (!frame_header.chroma_subsampling.Is444()) {
     for (size_t c = 0; c < 3; c++) {
+      if (frame_header.chroma_subsampling.HShift(c) != 0 &&
+          frame_header.chroma_subsampling.VShift(c) != 0) {
+        JXL_RETURN_IF_ERROR(builder.AddStage(GetChromaUpsampling2x2Stage(c)));
+        continue;
+      }
       if (frame_header.chroma_subsampling.HShift(c) != 0) {
         JXL_RETURN_IF_ERROR(
             builder.AddStage(GetChromaUpsamplingStage(c, /*horizontal=*/true)));
@@ -232,7 +387,19 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
     }
   }
 
-  if (fast_xyb_srgb8_conversion) {
+  // The other color stages are only needed to blend, to save the frame for
+  // reference or to render spot colors.
+  const bool fast_ycbcr_rgb8 =
+      fast_ycbcr_rgb8_conversion && !main_output.planar &&
+      !(options.coalescing && NeedsBlending(frame_header)) &&
+      !(options.coalescing && frame_header.CanBeReferenced() &&
+        !frame_header.save_before_color_transform) &&
+      !(options.render_spotcolors && metadata->Find(ExtraChannel::kSpotColor));
+
+  if (direct_modular_output) {
+    // The pipeline only keeps track of the decoded groups.
+    JXL_RETURN_IF_ERROR(builder.AddStage(GetDirectOutputStage()));
+  } else if (fast_xyb_srgb8_conversion) {
 #if !JXL_HIGH_PRECISION
     JXL_ENSURE(!NeedsBlending(frame_header));
     JXL_ENSURE(!frame_header.CanBeReferenced() ||
@@ -245,14 +412,90 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
         GetFastXYBTosRGB8Stage(rgb_output, main_output.stride, width, height,
                                is_rgba, has_alpha, alpha_c)));
 #endif
+  } else if (fast_ycbcr_rgb8) {
+    bool is_rgba = (main_output.format.num_channels == 4);
+    uint8_t* rgb_output = reinterpret_cast<uint8_t*>(main_output.buffer);
+    JXL_RETURN_IF_ERROR(builder.AddStage(
+        GetFastYCbCrToRGB8Stage(rgb_output, main_output.stride, width, height,
+                                is_rgba, has_alpha, alpha_c)));
   } else {
     bool linear = false;
+    const bool render_spotcolors =
+        options.render_spotcolors &&
+        frame_header.nonserialized_metadata->m.Find(ExtraChannel::kSpotColor);
+    // Blending and saving the frame for reference need the non-linear colors,
+    // before the output stages.
+    const bool needs_rgb_before_output =
+        (options.coalescing && NeedsBlending(frame_header)) ||
+        (options.coalescing && frame_header.CanBeReferenced() &&
+         !frame_header.save_before_color_transform);
+    const size_t channels_src =
+        (output_encoding_info.orig_color_encoding.IsCMYK()
+             ? 4
+             : output_encoding_info.orig_color_encoding.Channels());
+    const size_t channels_dst = output_encoding_info.color_encoding.Channels();
+    const bool mixing_color_and_grey = (channels_dst != channels_src);
+    // Whether the final conversion from linear is done without the cms, see
+    // below.
+    const bool from_linear_without_cms =
+        output_encoding_info.color_encoding_is_original ||
+        !output_encoding_info.cms_set || mixing_color_and_grey ||
+        output_encoding_info.CanConvertFromLinearWithoutCms();
+    // The tone mapping stage then also does that conversion.
+    auto tone_mapping_stage = GetToneMappingStage(
+        output_encoding_info, /*from_linear=*/from_linear_without_cms);
+    // Planar output of a kYCbCr frame, such as a recompressed JPEG, does not
+    // need the conversion to RGB and back if no stage needs RGB.
+    const bool write_ycbcr_planes =
+        main_output.planar &&
+        frame_header.color_transform == ColorTransform::kYCbCr &&
+        !needs_rgb_before_output && !render_spotcolors && !tone_mapping_stage &&
+        !gain_map_stage;
+    // Unless a stage needs the linear colors, the conversion from linear
+    // directly follows the XYB one, and a single stage does both.
+    const bool xyb_then_from_linear =
+        needs_rgb_before_output ||
+        (!render_spotcolors && !tone_mapping_stage && !gain_map_stage &&
+         from_linear_without_cms);
+    // If nothing comes between them either, the same stage also writes the
+    // pixels to the image buffer. This does not cover the features of the
+    // output stage that need the whole converted row: orientation,
+    // downsampling, unpremultiplied alpha and extra channel outputs.
+    std::unique_ptr<RenderPipelineStage> xyb_to_output_stage;
+    if (frame_header.color_transform == ColorTransform::kXYB &&
+        xyb_then_from_linear && !needs_rgb_before_output &&
+        !main_output.planar && main_output.buffer &&
+        !main_output.callback.IsPresent() && !(has_alpha && unpremul_alpha) &&
+        undo_orientation == Orientation::kIdentity &&
+        output_downsampling == 1 &&
+        std::none_of(extra_output.begin(), extra_output.end(),
+                     [](const ImageOutput& out) {
+                       return out.buffer || out.callback.IsPresent();
+                     })) {
+      xyb_to_output_stage =
+          GetXYBToOutputStage(output_encoding_info, main_output, width, height,
+                              has_alpha, alpha_c, memory_manager);
+    }
+    bool wrote_output = false;
     if (frame_header.color_transform == ColorTransform::kYCbCr) {
-      JXL_RETURN_IF_ERROR(builder.AddStage(GetYCbCrStage()));
+      if (!write_ycbcr_planes) {
+        JXL_RETURN_IF_ERROR(builder.AddStage(GetYCbCrStage()));
+      }
     } else if (frame_header.color_transform == ColorTransform::kXYB) {
-      JXL_RETURN_IF_ERROR(builder.AddStage(GetXYBStage(output_encoding_info)));
-      if (output_encoding_info.color_encoding.GetColorSpace() !=
+      if (output_encoding_info.color_encoding.GetColorSpace() ==
           ColorSpace::kXYB) {
+        JXL_RETURN_IF_ERROR(
+            builder.AddStage(GetXYBStage(output_encoding_info)));
+      } else if (xyb_to_output_stage) {
+        JXL_RETURN_IF_ERROR(builder.AddStage(std::move(xyb_to_output_stage)));
+        wrote_output = true;
+      } else if (xyb_then_from_linear) {
+        // Saves a pass over the color channels.
+        JXL_RETURN_IF_ERROR(
+            builder.AddStage(GetXYBFromLinearStage(output_encoding_info)));
+      } else {
+        JXL_RETURN_IF_ERROR(
+            builder.AddStage(GetXYBStage(output_encoding_info)));
         linear = true;
       }
     }  // Nothing to do for kNone.
@@ -278,8 +521,7 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
           &frame_storage_for_referencing, output_encoding_info)));
     }
 
-    if (options.render_spotcolors &&
-        frame_header.nonserialized_metadata->m.Find(ExtraChannel::kSpotColor)) {
+    if (render_spotcolors) {
       for (size_t i = 0; i < metadata->extra_channel_info.size(); i++) {
         // Don't use Find() because there may be multiple spot color channels.
         const ExtraChannelInfo& eci = metadata->extra_channel_info[i];
@@ -290,36 +532,39 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
       }
     }
 
-    auto tone_mapping_stage = GetToneMappingStage(output_encoding_info);
-    if (tone_mapping_stage) {
-      if (!linear) {
-        auto to_linear_stage = GetToLinearStage(output_encoding_info);
-        if (!to_linear_stage) {
-          if (!output_encoding_info.cms_set) {
-            return JXL_FAILURE("Cannot tonemap this colorspace without a CMS");
-          }
-          auto cms_stage = GetCmsStage(output_encoding_info);
-          if (cms_stage) {
-            JXL_RETURN_IF_ERROR(builder.AddStage(std::move(cms_stage)));
-          }
-        } else {
-          JXL_RETURN_IF_ERROR(builder.AddStage(std::move(to_linear_stage)));
+    // Brings the colors back to the linear space of the output encoding for
+    // the stages that need it.
+    const auto ensure_linear = [&](const char* what) -> Status {
+      if (linear) return true;
+      auto to_linear_stage = GetToLinearStage(output_encoding_info);
+      if (!to_linear_stage) {
+        if (!output_encoding_info.cms_set) {
+          return JXL_FAILURE("Cannot %s this colorspace without a CMS", what);
         }
-        linear = true;
+        auto cms_stage = GetCmsStage(output_encoding_info);
+        if (cms_stage) {
+          JXL_RETURN_IF_ERROR(builder.AddStage(std::move(cms_stage)));
+        }
+      } else {
+        JXL_RETURN_IF_ERROR(builder.AddStage(std::move(to_linear_stage)));
       }
+      linear = true;
+      return true;
+    };
+
+    if (gain_map_stage) {
+      JXL_RETURN_IF_ERROR(ensure_linear("apply a gain map to"));
+      JXL_RETURN_IF_ERROR(builder.AddStage(std::move(gain_map_stage)));
+    }
+
+    if (tone_mapping_stage) {
+      JXL_RETURN_IF_ERROR(ensure_linear("tonemap"));
       JXL_RETURN_IF_ERROR(builder.AddStage(std::move(tone_mapping_stage)));
+      if (from_linear_without_cms) linear = false;
     }
 
     if (linear) {
-      const size_t channels_src =
-          (output_encoding_info.orig_color_encoding.IsCMYK()
-               ? 4
-               : output_encoding_info.orig_color_encoding.Channels());
-      const size_t channels_dst =
-          output_encoding_info.color_encoding.Channels();
-      bool mixing_color_and_grey = (channels_dst != channels_src);
-      if ((output_encoding_info.color_encoding_is_original) ||
-          (!output_encoding_info.cms_set) || mixing_color_and_grey) {
+      if (from_linear_without_cms) {
         // in those cases we only need a linear stage in other cases we attempt
         // to obtain a cms stage: the cases are
         // - output_encoding_info.color_encoding_is_original: no cms stage
@@ -327,6 +572,8 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
         // - !output_encoding_info.cms_set: can't use the cms, so no point in
         // trying to add a cms stage
         // - mixing_color_and_grey: cms stage can't handle that
+        // - CanConvertFromLinearWithoutCms(): the output encoding only needs
+        // its transfer function, which the linear stage applies analytically
         // TODO(firsching): remove "mixing_color_and_grey" condition after
         // adding support for greyscale to cms stage.
         JXL_RETURN_IF_ERROR(
@@ -344,17 +591,32 @@ Status PassesDecoderState::PreparePipeline(const FrameHeader& frame_header,
     }
     (void)linear;
 
-    if (main_output.callback.IsPresent() || main_output.buffer) {
+    if (wrote_output) {
+      // Done by the XYBToOutput stage.
+    } else if (main_output.planar) {
+      JXL_RETURN_IF_ERROR(builder.AddStage(GetWriteToPlanarStage(
+          main_output, width, height,
+          output_encoding_info.color_encoding.IsGray(), write_ycbcr_planes)));
+    } else if (main_output.callback.IsPresent() || main_output.buffer) {
       JXL_RETURN_IF_ERROR(builder.AddStage(GetWriteToOutputStage(
           main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-          undo_orientation, extra_output, memory_manager)));
+          undo_orientation, output_downsampling, extra_output,
+          memory_manager)));
     } else {
       JXL_RETURN_IF_ERROR(builder.AddStage(
           GetWriteToImageBundleStage(decoded, output_encoding_info)));
     }
   }
-  JXL_ASSIGN_OR_RETURN(render_pipeline,
+  JXL_ASSIGN_OR_RETURN(std::unique_ptr<RenderPipeline> pipeline,
                        std::move(builder).Finalize(shared->frame_dim));
+  // Frames of the same size, as in an animation or a sequence of images
+  // decoded after JxlDecoderSoftReset, mostly need buffers of the same size.
+  if (render_pipeline) {
+    render_pipeline->ReleaseBuffersTo(&spare_pipeline_buffers);
+  }
+  pipeline->ReuseBuffers(&spare_pipeline_buffers);
+  if (stats != nullptr) pipeline->SetStats(stats);
+  render_pipeline = std::move(pipeline);
   return render_pipeline->IsInitialized();
 }
 
@@ -24,6 +24,7 @@
 #include "lib/jxl/common.h"
 #include "lib/jxl/dct_util.h"
 #include "lib/jxl/dec_ans.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/frame_header.h"
@@ -34,6 +35,7 @@
 #include "lib/jxl/passes_state.h"
 #include "lib/jxl/render_pipeline/render_pipeline.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+#include "lib/jxl/render_pipeline/stage_gain_map.h"
 #include "lib/jxl/render_pipeline/stage_upsampling.h"
 
 namespace jxl {
@@ -79,6 +81,10 @@ struct ImageOutput {
   size_t buffer_size;
   // Length of a row of image_buffer in bytes (based on oriented width).
   size_t stride;
+  // If set, the color channels are written to the YCbCr planes of "planes",
+  // whose strides are never 0, instead of to the callback or buffer.
+  bool planar = false;
+  JxlPlanarImageOutBuffer planes;
 };
 
 // Per-frame decoder state. All the images here should be accessed through a
@@ -115,6 +121,16 @@ struct PassesDecoderState {
   // Whether to use int16 float-XYB-to-uint8-srgb conversion.
   bool fast_xyb_srgb8_conversion;
 
+  // Whether to use int16 YCbCr-to-uint8-RGB conversion, for frames that need
+  // no other color stage.
+  bool fast_ycbcr_rgb8_conversion;
+
+  // Whether the modular decoder writes the integer samples of the frame to
+  // main_output.buffer itself, instead of converting them to floats for a
+  // render pipeline that would only write them back. Set by PreparePipeline
+  // for modular frames whose output needs no other stage.
+  bool direct_modular_output;
+
   // If true, the RGBA output will be unpremultiplied before writing to the
   // output.
   bool unpremul_alpha;
@@ -123,6 +139,14 @@ struct PassesDecoderState {
   // intended display orientation.
   Orientation undo_orientation;
 
+  // Factor by which the image output is downsampled; width and height are
+  // those of the downsampled output.
+  size_t output_downsampling;
+
+  // Whether the pixels of recompressed JPEG frames are computed with the
+  // integer IDCT of libjpeg.
+  bool jpeg_integer_idct;
+
   // Used for seeding noise.
   size_t visible_frame_index = 0;
   size_t nonvisible_frame_index = 0;
@@ -135,15 +159,30 @@ struct PassesDecoderState {
 
   // Rendering pipeline.
   std::unique_ptr<RenderPipeline> render_pipeline;
+  // Buffers of an earlier pipeline, for the next one to reuse.
+  std::vector<RenderPipeline::SpareBuffer> spare_pipeline_buffers;
+
+  // Where the frame decoder and the render pipeline add the time they spend,
+  // if the user collects stats.
+  DecoderStats* stats = nullptr;
 
   // Storage for the current frame if it can be referenced by future frames.
   ImageBundle frame_storage_for_referencing;
 
+  // Gain map that the render pipeline applies to the displayed frames, owned
+  // by the caller; nullptr to render the base image.
+  const GainMap* gain_map = nullptr;
+
   struct PipelineOptions {
     bool use_slow_render_pipeline;
     bool coalescing;
     bool render_spotcolors;
     bool render_noise;
+    // See RenderPipeline::Builder::DeferRendering.
+    bool defer_rendering;
+    // Whether to run the stages that CreateGPURenderPipelineOffload supports
+    // on the GPU, if there is one.
+    bool use_gpu_offload = false;
   };
 
   JxlMemoryManager* memory_manager() const { return shared->memory_manager; }
@@ -163,31 +202,48 @@ struct PassesDecoderState {
 
     main_output.callback = PixelCallback();
     main_output.buffer = nullptr;
+    main_output.planar = false;
     extra_output.clear();
 
     fast_xyb_srgb8_conversion = false;
+    fast_ycbcr_rgb8_conversion = false;
+    direct_modular_output = false;
     unpremul_alpha = false;
     undo_orientation = Orientation::kIdentity;
+    output_downsampling = 1;
+    jpeg_integer_idct = false;
 
     used_acs = 0;
 
     upsampler8x = GetUpsamplingStage(shared->metadata->transform_data, 0, 3);
-    if (frame_header.loop_filter.epf_iters > 0) {
+    const size_t sigma_xsize =
+        shared->frame_dim.xsize_blocks + 2 * kSigmaPadding;
+    const size_t sigma_ysize =
+        shared->frame_dim.ysize_blocks + 2 * kSigmaPadding;
+    if (frame_header.loop_filter.epf_iters > 0 &&
+        (sigma.xsize() != sigma_xsize || sigma.ysize() != sigma_ysize)) {
       JXL_ASSIGN_OR_RETURN(
-          sigma,
-          ImageF::Create(memory_manager,
-                         shared->frame_dim.xsize_blocks + 2 * kSigmaPadding,
-                         shared->frame_dim.ysize_blocks + 2 * kSigmaPadding));
+          sigma, ImageF::Create(memory_manager, sigma_xsize, sigma_ysize));
     }
     return true;
   }
 
   // Initialize the decoder state after all of DC is decoded.
   Status InitForAC(size_t num_passes, ThreadPool* pool);
+
+  // Takes the buffers of the last frame of "other", the state of an earlier
+  // image, for frames of the same size to reuse them. The frames that "other"
+  // saved for referencing are not taken.
+  void ReuseFrameBuffers(PassesDecoderState* other);
+
+  // Frees the buffers of the last frame and the frames saved for referencing,
+  // keeping the output settings. Only to be called after the last frame.
+  void ReleaseFrameBuffers();
 };
 
 // Temp images required for decoding a single group. Reduces memory allocations
-// for large images because we only initialize min(#threads, #groups) instances.
+// for large images because we only initialize one instance per thread, which
+// the ScratchArena of the pool keeps across frames.
 struct HWY_ALIGN_MAX GroupDecCache {
   Status InitOnce(JxlMemoryManager* memory_manager, size_t num_passes,
                   size_t used_acs);
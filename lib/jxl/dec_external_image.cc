@@ -22,6 +22,7 @@
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/image_ops.h"
+#include "lib/jxl/simd_util.h"
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/dec_external_image.cc"
@@ -41,52 +42,132 @@ namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Clamp;
+using hwy::HWY_NAMESPACE::Div;
+using hwy::HWY_NAMESPACE::Max;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::NearestInt;
-
-// TODO(jon): check if this can be replaced by a FloatToU16 function
-void FloatToU32(const float* in, uint32_t* out, size_t num, float mul,
-                size_t bits_per_sample) {
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::Or;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+
+// Converts the "num_channels" rows of "in" to half precision floats and
+// interleaves them into "out", which must have room for a whole number of
+// vectors of every channel.
+void FloatToF16Interleaved(const float* JXL_RESTRICT* in, size_t num_channels,
+                           size_t num, bool swap_endianness, uint16_t* out) {
   const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<uint32_t, decltype(d)> du;
+  const hwy::HWY_NAMESPACE::Rebind<hwy::float16_t, decltype(d)> df16;
+  const hwy::HWY_NAMESPACE::Rebind<uint16_t, decltype(d)> du;
 
   // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run NearestInt() on the vector, which triggers MSAN even
-  // it is safe to do so since the values are not mixed between lanes.
+  // This is because we run DemoteTo() on the vector which triggers msan.
   const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
+  for (size_t c = 0; c < num_channels; ++c) {
+    msan::UnpoisonMemory(in[c] + num, sizeof(in[c][0]) * (num_round_up - num));
+  }
 
-  const auto one = Set(d, 1.0f);
-  const auto scale = Set(d, mul);
+  const auto convert = [&](const float* row, size_t x) {
+    auto v = BitCast(du, DemoteTo(df16, Load(d, row + x)));
+    if (swap_endianness) v = Or(ShiftRight<8>(v), ShiftLeft<8>(v));
+    return v;
+  };
   for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
-    // Clamp turns NaN to 'min'.
-    v = Clamp(v, Zero(d), one);
-    auto i = NearestInt(Mul(v, scale));
-    Store(BitCast(du, i), du, out + x);
+    if (num_channels == 1) {
+      StoreU(convert(in[0], x), du, out + x);
+    } else if (num_channels == 2) {
+      StoreInterleaved2(convert(in[0], x), convert(in[1], x), du, out + 2 * x);
+    } else if (num_channels == 3) {
+      StoreInterleaved3(convert(in[0], x), convert(in[1], x),
+                        convert(in[2], x), du, out + 3 * x);
+    } else {
+      StoreInterleaved4(convert(in[0], x), convert(in[1], x),
+                        convert(in[2], x), convert(in[3], x), du, out + 4 * x);
+    }
   }
 
   // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
+  msan::PoisonMemory(out + num * num_channels,
+                     sizeof(out[0]) * (num_round_up - num) * num_channels);
 }
 
-void FloatToF16(const float* in, hwy::float16_t* out, size_t num) {
+// Converts the "num_channels" rows of "in", clamped to [0, 1], to unsigned
+// integers in [0, mul] and interleaves them into "out", which must have room
+// for a whole number of vectors of every channel.
+template <typename T>
+void FloatToUintInterleaved(const float* JXL_RESTRICT* in, size_t num_channels,
+                            size_t num, float mul, bool swap_endianness,
+                            T* out) {
   const HWY_FULL(float) d;
-  const hwy::HWY_NAMESPACE::Rebind<hwy::float16_t, decltype(d)> du;
+  const Rebind<int32_t, decltype(d)> di;
+  const Rebind<T, decltype(d)> du;
 
   // Unpoison accessing partially-uninitialized vectors with memory sanitizer.
-  // This is because we run DemoteTo() on the vector which triggers msan.
+  // This is because we run NearestInt() on the vector which triggers msan.
   const size_t num_round_up = RoundUpTo(num, Lanes(d));
-  msan::UnpoisonMemory(in + num, sizeof(in[0]) * (num_round_up - num));
+  for (size_t c = 0; c < num_channels; ++c) {
+    msan::UnpoisonMemory(in[c] + num, sizeof(in[c][0]) * (num_round_up - num));
+  }
 
+  const auto one = Set(d, 1.0f);
+  const auto scale = Set(d, mul);
+  const auto low_byte = Set(di, 0xFF);
+  // Byte swapping is done before the demotion, where it works for both the
+  // 8 and 16-bit lanes; it is only requested for the latter.
+  const auto convert = [&](const float* row, size_t x) {
+    // Clamp turns NaN to 'min'.
+    const auto v = Clamp(Load(d, row + x), Zero(d), one);
+    auto i = NearestInt(Mul(v, scale));
+    if (swap_endianness) {
+      i = Or(ShiftLeft<8>(And(i, low_byte)), ShiftRight<8>(i));
+    }
+    return DemoteTo(du, i);
+  };
   for (size_t x = 0; x < num; x += Lanes(d)) {
-    auto v = Load(d, in + x);
-    auto v16 = DemoteTo(du, v);
-    Store(v16, du, out + x);
+    if (num_channels == 1) {
+      StoreU(convert(in[0], x), du, out + x);
+    } else if (num_channels == 2) {
+      StoreInterleaved2(convert(in[0], x), convert(in[1], x), du, out + 2 * x);
+    } else if (num_channels == 3) {
+      StoreInterleaved3(convert(in[0], x), convert(in[1], x),
+                        convert(in[2], x), du, out + 3 * x);
+    } else {
+      StoreInterleaved4(convert(in[0], x), convert(in[1], x),
+                        convert(in[2], x), convert(in[3], x), du, out + 4 * x);
+    }
   }
 
   // Poison back the output.
-  msan::PoisonMemory(out + num, sizeof(out[0]) * (num_round_up - num));
+  msan::PoisonMemory(out + num * num_channels,
+                     sizeof(out[0]) * (num_round_up - num) * num_channels);
+}
+
+void FloatToU8Interleaved(const float* JXL_RESTRICT* in, size_t num_channels,
+                          size_t num, float mul, uint8_t* out) {
+  FloatToUintInterleaved(in, num_channels, num, mul, false, out);
+}
+
+void FloatToU16Interleaved(const float* JXL_RESTRICT* in, size_t num_channels,
+                           size_t num, float mul, bool swap_endianness,
+                           uint16_t* out) {
+  FloatToUintInterleaved(in, num_channels, num, mul, swap_endianness, out);
+}
+
+// Divides the "num_channels" rows of "in" by "alpha" into "out", which must
+// have room for a whole number of vectors.
+void UnpremultiplyRows(const float* JXL_RESTRICT* in, size_t num_channels,
+                       const float* JXL_RESTRICT alpha, size_t num,
+                       float* JXL_RESTRICT* out) {
+  const HWY_FULL(float) d;
+  const auto one = Set(d, 1.0f);
+  const auto small_alpha = Set(d, kSmallAlpha);
+  for (size_t x = 0; x < num; x += Lanes(d)) {
+    const auto mul = Div(one, Max(small_alpha, LoadU(d, alpha + x)));
+    for (size_t c = 0; c < num_channels; c++) {
+      StoreU(Mul(LoadU(d, in[c] + x), mul), d, out[c] + x);
+    }
+  }
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -228,24 +309,13 @@ Status UndoOrientation(jxl::Orientation undo_orientation, const Plane<T>& image,
 }
 }  // namespace
 
-HWY_EXPORT(FloatToU32);
-HWY_EXPORT(FloatToF16);
+HWY_EXPORT(FloatToF16Interleaved);
+HWY_EXPORT(FloatToU8Interleaved);
+HWY_EXPORT(FloatToU16Interleaved);
+HWY_EXPORT(UnpremultiplyRows);
 
 namespace {
 
-using StoreFuncType = void(uint32_t value, uint8_t* dest);
-template <StoreFuncType StoreFunc>
-void StoreUintRow(uint32_t* JXL_RESTRICT* rows_u32, size_t num_channels,
-                  size_t xsize, size_t bytes_per_sample,
-                  uint8_t* JXL_RESTRICT out) {
-  for (size_t x = 0; x < xsize; ++x) {
-    for (size_t c = 0; c < num_channels; c++) {
-      StoreFunc(rows_u32[c][x],
-                out + (num_channels * x + c) * bytes_per_sample);
-    }
-  }
-}
-
 template <void(StoreFunc)(float, uint8_t*)>
 void StoreFloatRow(const float* JXL_RESTRICT* rows_in, size_t num_channels,
                    size_t xsize, uint8_t* JXL_RESTRICT out) {
@@ -256,8 +326,6 @@ void StoreFloatRow(const float* JXL_RESTRICT* rows_in, size_t num_channels,
   }
 }
 
-void JXL_INLINE Store8(uint32_t value, uint8_t* dest) { *dest = value & 0xff; }
-
 }  // namespace
 
 Status ConvertChannelsToExternal(const ImageF* in_channels[],
@@ -266,7 +334,8 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
                                  size_t stride, jxl::ThreadPool* pool,
                                  void* out_image, size_t out_size,
                                  const PixelCallback& out_callback,
-                                 jxl::Orientation undo_orientation) {
+                                 jxl::Orientation undo_orientation,
+                                 const ImageF* premultiplied_alpha) {
   JXL_ENSURE(num_channels != 0 && num_channels <= kConvertMaxChannels);
   JXL_ENSURE(in_channels[0] != nullptr);
   JxlMemoryManager* memory_manager = in_channels[0]->memory_manager();
@@ -279,6 +348,13 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
   }
   std::vector<const ImageF*> channels;
   channels.assign(in_channels, in_channels + num_channels);
+  // Channels divided by premultiplied_alpha: all of them, or all but the last
+  // one if it is the alpha channel itself.
+  size_t num_unpremul = 0;
+  if (premultiplied_alpha) {
+    num_unpremul = num_channels;
+    if (channels[num_channels - 1] == premultiplied_alpha) num_unpremul--;
+  }
 
   const size_t bytes_per_channel = DivCeil(bits_per_sample, jxl::kBitsPerByte);
   const size_t bytes_per_pixel = num_channels * bytes_per_channel;
@@ -303,6 +379,7 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
 
   // Channels used to store the transformed original channels if needed.
   ImageF temp_channels[kConvertMaxChannels];
+  ImageF temp_alpha;
   if (undo_orientation != Orientation::kIdentity) {
     for (size_t c = 0; c < num_channels; ++c) {
       if (channels[c]) {
@@ -311,6 +388,14 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
         channels[c] = &(temp_channels[c]);
       }
     }
+    if (num_unpremul == num_channels) {
+      JXL_RETURN_IF_ERROR(UndoOrientation(undo_orientation,
+                                          *premultiplied_alpha, temp_alpha,
+                                          pool));
+      premultiplied_alpha = &temp_alpha;
+    } else if (premultiplied_alpha) {
+      premultiplied_alpha = channels[num_channels - 1];
+    }
   }
 
   // First channel may not be nullptr.
@@ -341,48 +426,60 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
     }
   }
 
+  // The unpremultiplied rows of each thread, with room for whole vectors.
+  Plane<float> unpremul_cache;
+  const auto InitThreads = [&](size_t num_threads) -> Status {
+    if (num_unpremul != 0) {
+      JXL_ASSIGN_OR_RETURN(
+          unpremul_cache,
+          Plane<float>::Create(memory_manager, xsize + MaxVectorSize(),
+                               num_threads * num_unpremul));
+    }
+    return InitOutCallback(num_threads);
+  };
+  const auto GetRows = [&](size_t y, size_t thread,
+                           const float* JXL_RESTRICT* row_in) {
+    for (size_t c = 0; c < num_channels; c++) {
+      row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
+    }
+    if (num_unpremul == 0) return;
+    float* JXL_RESTRICT row_unpremul[kConvertMaxChannels];
+    for (size_t c = 0; c < num_unpremul; c++) {
+      row_unpremul[c] = unpremul_cache.Row(thread * num_unpremul + c);
+    }
+    HWY_DYNAMIC_DISPATCH(UnpremultiplyRows)
+    (row_in, num_unpremul, premultiplied_alpha->Row(y), xsize, row_unpremul);
+    for (size_t c = 0; c < num_unpremul; c++) row_in[c] = row_unpremul[c];
+  };
+
   if (float_out) {
     if (bits_per_sample == 16) {
       bool swap_endianness = little_endian != IsLittleEndian();
-      Plane<hwy::float16_t> f16_cache;
+      // One interleaved row per thread, with room for the whole vectors that
+      // FloatToF16Interleaved stores past the end of the row.
+      Plane<uint16_t> f16_cache;
       const auto init_cache = [&](size_t num_threads) -> Status {
         JXL_ASSIGN_OR_RETURN(
-            f16_cache, Plane<hwy::float16_t>::Create(
-                           memory_manager, xsize, num_channels * num_threads));
-        JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
+            f16_cache,
+            Plane<uint16_t>::Create(memory_manager,
+                                    (xsize + MaxVectorSize()) * num_channels,
+                                    num_threads));
+        JXL_RETURN_IF_ERROR(InitThreads(num_threads));
         return true;
       };
       const auto process_row = [&](const uint32_t task,
                                    const size_t thread) -> Status {
         const int64_t y = task;
         const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-        }
-        hwy::float16_t* JXL_RESTRICT row_f16[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_f16[c] = f16_cache.Row(c + thread * num_channels);
-          HWY_DYNAMIC_DISPATCH(FloatToF16)
-          (row_in[c], row_f16[c], xsize);
-        }
+        GetRows(y, thread, row_in);
+        uint16_t* JXL_RESTRICT row_f16 = f16_cache.Row(thread);
+        HWY_DYNAMIC_DISPATCH(FloatToF16Interleaved)
+        (row_in, num_channels, xsize, swap_endianness, row_f16);
         uint8_t* row_out =
             out_callback.IsPresent()
                 ? row_out_callback[thread].data()
                 : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
-        // interleave the one scanline
-        hwy::float16_t* row_f16_out =
-            reinterpret_cast<hwy::float16_t*>(row_out);
-        for (size_t x = 0; x < xsize; x++) {
-          for (size_t c = 0; c < num_channels; c++) {
-            row_f16_out[x * num_channels + c] = row_f16[c][x];
-          }
-        }
-        if (swap_endianness) {
-          size_t size = xsize * num_channels * 2;
-          for (size_t i = 0; i < size; i += 2) {
-            std::swap(row_out[i + 0], row_out[i + 1]);
-          }
-        }
+        memcpy(row_out, row_f16, xsize * num_channels * sizeof(uint16_t));
         if (out_callback.IsPresent()) {
           out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
         }
@@ -392,7 +489,7 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
                                     init_cache, process_row, "ConvertF16"));
     } else if (bits_per_sample == 32) {
       const auto init_cache = [&](size_t num_threads) -> Status {
-        JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
+        JXL_RETURN_IF_ERROR(InitThreads(num_threads));
         return true;
       };
       const auto process_row = [&](const uint32_t task,
@@ -403,9 +500,7 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
                 ? row_out_callback[thread].data()
                 : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
         const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-        for (size_t c = 0; c < num_channels; c++) {
-          row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-        }
+        GetRows(y, thread, row_in);
         if (little_endian) {
           StoreFloatRow<StoreLEFloat>(row_in, num_channels, xsize, row_out);
         } else {
@@ -425,12 +520,19 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
     // Multiplier to convert from floating point 0-1 range to the integer
     // range.
     float mul = (1ull << bits_per_sample) - 1;
-    Plane<uint32_t> u32_cache;
+    bool swap_endianness = little_endian != IsLittleEndian();
+    // One interleaved row per thread, with room for the whole vectors that
+    // FloatToU8Interleaved and FloatToU16Interleaved store past the end of
+    // the row.
+    Plane<uint8_t> uint_cache;
     const auto init_cache = [&](size_t num_threads) -> Status {
-      JXL_ASSIGN_OR_RETURN(u32_cache,
-                           Plane<uint32_t>::Create(memory_manager, xsize,
-                                                   num_channels * num_threads));
-      JXL_RETURN_IF_ERROR(InitOutCallback(num_threads));
+      JXL_ASSIGN_OR_RETURN(
+          uint_cache,
+          Plane<uint8_t>::Create(
+              memory_manager,
+              (xsize + MaxVectorSize()) * num_channels * bytes_per_channel,
+              num_threads));
+      JXL_RETURN_IF_ERROR(InitThreads(num_threads));
       return true;
     };
     const auto process_row = [&](const uint32_t task,
@@ -441,27 +543,17 @@ Status ConvertChannelsToExternal(const ImageF* in_channels[],
               ? row_out_callback[thread].data()
               : &(reinterpret_cast<uint8_t*>(out_image))[stride * y];
       const float* JXL_RESTRICT row_in[kConvertMaxChannels];
-      for (size_t c = 0; c < num_channels; c++) {
-        row_in[c] = channels[c] ? channels[c]->Row(y) : ones.Row(0);
-      }
-      uint32_t* JXL_RESTRICT row_u32[kConvertMaxChannels];
-      for (size_t c = 0; c < num_channels; c++) {
-        row_u32[c] = u32_cache.Row(c + thread * num_channels);
-        // row_u32[] is a per-thread temporary row storage, this isn't
-        // intended to be initialized on a previous run.
-        msan::PoisonMemory(row_u32[c], xsize * sizeof(row_u32[c][0]));
-        HWY_DYNAMIC_DISPATCH(FloatToU32)
-        (row_in[c], row_u32[c], xsize, mul, bits_per_sample);
-      }
+      GetRows(y, thread, row_in);
+      uint8_t* JXL_RESTRICT row_uint = uint_cache.Row(thread);
       if (bits_per_sample <= 8) {
-        StoreUintRow<Store8>(row_u32, num_channels, xsize, 1, row_out);
+        HWY_DYNAMIC_DISPATCH(FloatToU8Interleaved)
+        (row_in, num_channels, xsize, mul, row_uint);
       } else {
-        if (little_endian) {
-          StoreUintRow<StoreLE16>(row_u32, num_channels, xsize, 2, row_out);
-        } else {
-          StoreUintRow<StoreBE16>(row_u32, num_channels, xsize, 2, row_out);
-        }
+        HWY_DYNAMIC_DISPATCH(FloatToU16Interleaved)
+        (row_in, num_channels, xsize, mul, swap_endianness,
+         reinterpret_cast<uint16_t*>(row_uint));
       }
+      memcpy(row_out, row_uint, xsize * bytes_per_pixel);
       if (out_callback.IsPresent()) {
         out_callback.run(out_run_opaque.get(), thread, 0, y, xsize, row_out);
       }
@@ -484,21 +576,10 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
   size_t color_channels = num_channels <= 2 ? 1 : 3;
 
   const Image3F* color = &ib.color();
-  JxlMemoryManager* memory_manager = color->memory_manager();
-  // Undo premultiplied alpha.
-  Image3F unpremul;
+  // Premultiplied alpha is undone row by row during the conversion.
+  const ImageF* premultiplied_alpha = nullptr;
   if (ib.AlphaIsPremultiplied() && ib.HasAlpha() && unpremul_alpha) {
-    JXL_ASSIGN_OR_RETURN(
-        unpremul,
-        Image3F::Create(memory_manager, color->xsize(), color->ysize()));
-    JXL_RETURN_IF_ERROR(CopyImageTo(*color, &unpremul));
-    const ImageF* alpha = ib.alpha();
-    for (size_t y = 0; y < unpremul.ysize(); y++) {
-      UnpremultiplyAlpha(unpremul.PlaneRow(0, y), unpremul.PlaneRow(1, y),
-                         unpremul.PlaneRow(2, y), alpha->Row(y),
-                         unpremul.xsize());
-    }
-    color = &unpremul;
+    premultiplied_alpha = ib.alpha();
   }
 
   const ImageF* channels[kConvertMaxChannels];
@@ -513,7 +594,8 @@ Status ConvertToExternal(const jxl::ImageBundle& ib, size_t bits_per_sample,
 
   return ConvertChannelsToExternal(
       channels, num_channels, bits_per_sample, float_out, endianness, stride,
-      pool, out_image, out_size, out_callback, undo_orientation);
+      pool, out_image, out_size, out_callback, undo_orientation,
+      premultiplied_alpha);
 }
 
 }  // namespace jxl
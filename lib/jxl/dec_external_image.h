@@ -32,13 +32,15 @@ const size_t kConvertMaxChannels = 4;
 // instead. This is useful for handling when a user requests an alpha channel
 // from an image that doesn't have one. The first channel in the list may not
 // be nullptr, since it is used to determine the image size.
-Status ConvertChannelsToExternal(const ImageF* in_channels[],
-                                 size_t num_channels, size_t bits_per_sample,
-                                 bool float_out, JxlEndianness endianness,
-                                 size_t stride, jxl::ThreadPool* pool,
-                                 void* out_image, size_t out_size,
-                                 const PixelCallback& out_callback,
-                                 jxl::Orientation undo_orientation);
+//
+// If premultiplied_alpha is not nullptr, the channels are divided by it as
+// they are converted, except for the last one if it is premultiplied_alpha.
+Status ConvertChannelsToExternal(
+    const ImageF* in_channels[], size_t num_channels, size_t bits_per_sample,
+    bool float_out, JxlEndianness endianness, size_t stride,
+    jxl::ThreadPool* pool, void* out_image, size_t out_size,
+    const PixelCallback& out_callback, jxl::Orientation undo_orientation,
+    const ImageF* premultiplied_alpha = nullptr);
 
 // Converts ib to interleaved void* pixel buffer with the given format.
 // bits_per_sample: must be 16 or 32 if float_out is true, and at most 16
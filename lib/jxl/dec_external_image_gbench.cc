@@ -12,6 +12,7 @@
 #include <vector>
 
 #include "benchmark/benchmark.h"
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/dec_external_image.h"
@@ -33,8 +34,10 @@ namespace {
     QUIT(#C)        \
   }
 
-// Decoder case, interleaves an internal float image.
-void BM_DecExternalImage_ConvertImageRGBA(benchmark::State& state) {
+// Decoder case, interleaves an internal float image to samples of
+// "bits_per_sample" bits.
+void ConvertImageRGBA(benchmark::State& state, size_t bits_per_sample,
+                      bool float_out) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
   const size_t kNumIter = 5;
   size_t xsize = state.range();
@@ -54,16 +57,15 @@ void BM_DecExternalImage_ConvertImageRGBA(benchmark::State& state) {
   ZeroFillImage(&alpha);
   BM_CHECK(ib.SetAlpha(std::move(alpha)));
 
-  const size_t bytes_per_row = xsize * num_channels;
+  const size_t bytes_per_row =
+      xsize * num_channels * DivCeil(bits_per_sample, kBitsPerByte);
   std::vector<uint8_t> interleaved(bytes_per_row * ysize);
 
   for (auto _ : state) {
     (void)_;
     for (size_t i = 0; i < kNumIter; ++i) {
       BM_CHECK(ConvertToExternal(
-          ib,
-          /*bits_per_sample=*/8,
-          /*float_out=*/false, num_channels, JXL_NATIVE_ENDIAN,
+          ib, bits_per_sample, float_out, num_channels, JXL_NATIVE_ENDIAN,
           /*stride*/ bytes_per_row,
           /*thread_pool=*/nullptr, interleaved.data(), interleaved.size(),
           /*out_callback=*/{},
@@ -76,9 +78,27 @@ void BM_DecExternalImage_ConvertImageRGBA(benchmark::State& state) {
   state.SetBytesProcessed(kNumIter * state.iterations() * interleaved.size());
 }
 
+void BM_DecExternalImage_ConvertImageRGBA(benchmark::State& state) {
+  ConvertImageRGBA(state, /*bits_per_sample=*/8, /*float_out=*/false);
+}
+
+void BM_DecExternalImage_ConvertImageRGBA16(benchmark::State& state) {
+  ConvertImageRGBA(state, /*bits_per_sample=*/16, /*float_out=*/false);
+}
+
+void BM_DecExternalImage_ConvertImageRGBAF16(benchmark::State& state) {
+  ConvertImageRGBA(state, /*bits_per_sample=*/16, /*float_out=*/true);
+}
+
 BENCHMARK(BM_DecExternalImage_ConvertImageRGBA)
     ->RangeMultiplier(2)
     ->Range(256, 2048);
+BENCHMARK(BM_DecExternalImage_ConvertImageRGBA16)
+    ->RangeMultiplier(2)
+    ->Range(256, 2048);
+BENCHMARK(BM_DecExternalImage_ConvertImageRGBAF16)
+    ->RangeMultiplier(2)
+    ->Range(256, 2048);
 
 }  // namespace
 }  // namespace jxl
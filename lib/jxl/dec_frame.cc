@@ -26,6 +26,7 @@
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/blending.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
@@ -39,6 +40,7 @@
 #include "lib/jxl/dec_modular.h"
 #include "lib/jxl/dec_noise.h"
 #include "lib/jxl/dec_patch_dictionary.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/entropy_coder.h"
 #include "lib/jxl/epf.h"
 #include "lib/jxl/fields.h"
@@ -109,7 +111,9 @@ Status DecodeFrame(PassesDecoderState* dec_state, ThreadPool* JXL_RESTRICT pool,
     size_t index = 0;
     for (auto toc_entry : frame_decoder.Toc()) {
       JXL_RETURN_IF_ERROR(pos + toc_entry.size <= avail_in);
-      auto br = make_unique<BitReader>(Bytes(next_in + pos, toc_entry.size));
+      // The next sections, if any, are slack for the refills.
+      auto br = make_unique<BitReader>(Bytes(next_in + pos, toc_entry.size),
+                                       avail_in - pos - toc_entry.size);
       section_info.emplace_back(
           FrameDecoder::SectionInfo{br.get(), toc_entry.id, index++});
       section_closers.emplace_back(
@@ -256,10 +260,33 @@ Status FrameDecoder::InitFrameOutput() {
   num_sections_done_ = 0;
   decoded_dc_groups_.clear();
   decoded_dc_groups_.resize(frame_dim_.num_dc_groups);
+  if (SmoothsDC()) {
+    if (smoothed_dc_.xsize() != frame_dim_.xsize_blocks ||
+        smoothed_dc_.ysize() != frame_dim_.ysize_blocks) {
+      JXL_ASSIGN_OR_RETURN(
+          smoothed_dc_,
+          Image3F::Create(dec_state_->memory_manager(), frame_dim_.xsize_blocks,
+                          frame_dim_.ysize_blocks));
+    }
+    const size_t xsize = frame_dim_.xsize_dc_groups;
+    const size_t ysize = frame_dim_.ysize_dc_groups;
+    std::vector<std::atomic<uint8_t>>(xsize * ysize)
+        .swap(dc_smoothing_counters_);
+    for (size_t gy = 0; gy < ysize; gy++) {
+      const size_t num_y = std::min(gy + 2, ysize) - (gy > 0 ? gy - 1 : 0);
+      for (size_t gx = 0; gx < xsize; gx++) {
+        const size_t num_x = std::min(gx + 2, xsize) - (gx > 0 ? gx - 1 : 0);
+        dc_smoothing_counters_[gy * xsize + gx] = num_x * num_y;
+      }
+    }
+  }
   decoded_passes_per_ac_group_.clear();
   decoded_passes_per_ac_group_.resize(frame_dim_.num_groups, 0);
   processed_section_.clear();
   processed_section_.resize(toc_.size());
+  ac_group_needed_.clear();
+  draw_from_dc_ = false;
+  flushed_passes_per_ac_group_.clear();
   allocated_ = false;
   return true;
 }
@@ -328,27 +355,49 @@ Status FrameDecoder::ProcessDCGroup(size_t dc_group_id, BitReader* br) {
       frame_header_, mrect, br, 3, 1000,
       ModularStreamId::ModularDC(dc_group_id),
       /*zerofill=*/false, nullptr, nullptr,
-      /*allow_truncated=*/false));
+      /*allow_truncated=*/false, pool_));
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeAcMetadata(
         frame_header_, dc_group_id, br, dec_state_));
   } else if (lf.epf_iters > 0) {
     FillImage(kInvSigmaNum / lf.epf_sigma_for_modular, &dec_state_->sigma);
   }
+  if (SmoothsDC()) JXL_RETURN_IF_ERROR(SmoothDCAround(dc_group_id));
   decoded_dc_groups_[dc_group_id] = JXL_TRUE;
   return true;
 }
 
+bool FrameDecoder::SmoothsDC() const {
+  return frame_header_.encoding == FrameEncoding::kVarDCT &&
+         !(frame_header_.flags & FrameHeader::kSkipAdaptiveDCSmoothing) &&
+         !(frame_header_.flags & FrameHeader::kUseDcFrame);
+}
+
+Status FrameDecoder::SmoothDCAround(size_t dc_group_id) {
+  const size_t xsize = frame_dim_.xsize_dc_groups;
+  const size_t ysize = frame_dim_.ysize_dc_groups;
+  const size_t gx = dc_group_id % xsize;
+  const size_t gy = dc_group_id / xsize;
+  for (size_t y = (gy > 0 ? gy - 1 : 0); y < std::min(gy + 2, ysize); y++) {
+    for (size_t x = (gx > 0 ? gx - 1 : 0); x < std::min(gx + 2, xsize); x++) {
+      const size_t id = y * xsize + x;
+      // The acquire-release semantics of the decrement make the DC of the
+      // other neighbours visible to the thread that smooths the group.
+      if (dc_smoothing_counters_[id].fetch_sub(1) != 1) continue;
+      JXL_RETURN_IF_ERROR(AdaptiveDCSmoothing(
+          dec_state_->shared->quantizer.MulDC(),
+          dec_state_->shared_storage.dc_storage, frame_dim_.DCGroupRect(id),
+          &smoothed_dc_));
+    }
+  }
+  return true;
+}
+
 Status FrameDecoder::FinalizeDC() {
-  // Do Adaptive DC smoothing if enabled. This *must* happen between all the
-  // ProcessDCGroup and ProcessACGroup.
-  JxlMemoryManager* memory_manager = dec_state_->memory_manager();
-  if (frame_header_.encoding == FrameEncoding::kVarDCT &&
-      !(frame_header_.flags & FrameHeader::kSkipAdaptiveDCSmoothing) &&
-      !(frame_header_.flags & FrameHeader::kUseDcFrame)) {
-    JXL_RETURN_IF_ERROR(AdaptiveDCSmoothing(
-        memory_manager, dec_state_->shared->quantizer.MulDC(),
-        &dec_state_->shared_storage.dc_storage, pool_));
+  // Adaptive DC smoothing reads the DC around each pixel, so the smoothed DC
+  // only replaces the DC once all the DC groups are smoothed.
+  if (SmoothsDC()) {
+    dec_state_->shared_storage.dc_storage.Swap(smoothed_dc_);
   }
 
   finalized_dc_ = true;
@@ -479,7 +528,8 @@ Status FrameDecoder::ProcessACGlobal(BitReader* br) {
 Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
                                     BitReader* JXL_RESTRICT* br,
                                     size_t num_passes, size_t thread,
-                                    bool force_draw, bool dc_only) {
+                                    size_t storage, bool force_draw,
+                                    bool dc_only) {
   size_t group_dim = frame_dim_.group_dim;
   const size_t gx = ac_group_id % frame_dim_.xsize_groups;
   const size_t gy = ac_group_id / frame_dim_.xsize_groups;
@@ -493,16 +543,21 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
               decoded_passes_per_ac_group_[ac_group_id], num_passes);
 
   RenderPipelineInput render_pipeline_input =
-      dec_state_->render_pipeline->GetInputBuffers(ac_group_id, thread);
+      dec_state_->render_pipeline->GetInputBuffers(ac_group_id, storage);
 
   bool should_run_pipeline = true;
 
   if (frame_header_.encoding == FrameEncoding::kVarDCT) {
-    JXL_RETURN_IF_ERROR(group_dec_caches_[thread].InitOnce(
+    // Indexed by thread rather than by storage location: other FrameDecoders
+    // may use the same pool concurrently, but never on the same thread at the
+    // same time.
+    GroupDecCache* group_dec_cache =
+        scratch()->Get<GroupDecCache>(ScratchKey::kGroupDecCache, thread);
+    JXL_RETURN_IF_ERROR(group_dec_cache->InitOnce(
         memory_manager, frame_header_.passes.num_passes, dec_state_->used_acs));
     JXL_RETURN_IF_ERROR(DecodeGroup(
         frame_header_, br, num_passes, ac_group_id, dec_state_,
-        &group_dec_caches_[thread], thread, render_pipeline_input,
+        group_dec_cache, storage, render_pipeline_input,
         decoded_->jpeg_data.get(), decoded_passes_per_ac_group_[ac_group_id],
         force_draw, dc_only, &should_run_pipeline));
   }
@@ -528,13 +583,13 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
           frame_header_, mrect, br[i - pass0], minShift, maxShift,
           ModularStreamId::ModularAC(ac_group_id, i),
           /*zerofill=*/false, dec_state_, &render_pipeline_input,
-          /*allow_truncated=*/false, &modular_pass_ready));
+          /*allow_truncated=*/false, pool_, &modular_pass_ready));
     } else {
       JXL_RETURN_IF_ERROR(modular_frame_decoder_.DecodeGroup(
           frame_header_, mrect, nullptr, minShift, maxShift,
           ModularStreamId::ModularAC(ac_group_id, i), /*zerofill=*/true,
           dec_state_, &render_pipeline_input,
-          /*allow_truncated=*/false, &modular_pass_ready));
+          /*allow_truncated=*/false, pool_, &modular_pass_ready));
     }
     if (modular_pass_ready) modular_ready = true;
   }
@@ -542,7 +597,7 @@ Status FrameDecoder::ProcessACGroup(size_t ac_group_id,
 
   if ((frame_header_.flags & FrameHeader::kNoise) != 0) {
     PrepareNoiseInput(*dec_state_, frame_dim_, frame_header_, ac_group_id,
-                      thread);
+                      storage);
   }
 
   if (!modular_frame_decoder_.UsesFullImage() && !decoded_->IsJPEG()) {
@@ -566,29 +621,69 @@ void FrameDecoder::MarkSections(const SectionInfo* sections, size_t num,
   }
 }
 
+void FrameDecoder::ComputeNeededACGroups() {
+  ac_group_needed_.clear();
+  draw_from_dc_ = false;
+  if (use_slow_rendering_pipeline_ || decoded_->IsJPEG() ||
+      frame_header_.CanBeReferenced() ||
+      (frame_header_.frame_type != FrameType::kRegularFrame &&
+       frame_header_.frame_type != FrameType::kSkipProgressive) ||
+      modular_frame_decoder_.UsesFullImage()) {
+    return;
+  }
+  // At 1:8, the output has one pixel per block, which the DC already gives.
+  draw_from_dc_ = dec_state_->output_downsampling == 8 &&
+                  frame_header_.encoding == FrameEncoding::kVarDCT;
+  if (!has_crop_region_) return;
+  // Pixels within the group border of a group boundary are only rendered once
+  // all the groups around them are done, so the region is grown by the border
+  // before looking for the groups it touches.
+  const std::pair<size_t, size_t> border =
+      dec_state_->render_pipeline->GroupBorder();
+  const size_t upsampling = frame_header_.upsampling;
+  const size_t x0 = crop_region_.x0() / upsampling;
+  const size_t y0 = crop_region_.y0() / upsampling;
+  const size_t x1 = DivCeil(crop_region_.x1(), upsampling) + border.first;
+  const size_t y1 = DivCeil(crop_region_.y1(), upsampling) + border.second;
+  const size_t group_dim = frame_dim_.group_dim;
+  const size_t gx0 = (x0 - std::min(x0, border.first)) / group_dim;
+  const size_t gy0 = (y0 - std::min(y0, border.second)) / group_dim;
+  const size_t gx1 = std::min(frame_dim_.xsize_groups, DivCeil(x1, group_dim));
+  const size_t gy1 = std::min(frame_dim_.ysize_groups, DivCeil(y1, group_dim));
+  ac_group_needed_.assign(frame_dim_.num_groups, 0);
+  for (size_t gy = gy0; gy < gy1; gy++) {
+    for (size_t gx = gx0; gx < gx1; gx++) {
+      ac_group_needed_[gy * frame_dim_.xsize_groups + gx] = 1;
+    }
+  }
+}
+
 Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
                                      SectionStatus* section_status) {
   if (num == 0) return true;  // Nothing to process
   std::fill(section_status, section_status + num, SectionStatus::kSkipped);
+  const size_t num_passes = frame_header_.passes.num_passes;
   size_t dc_global_sec = num;
   size_t ac_global_sec = num;
-  std::vector<size_t> dc_group_sec(frame_dim_.num_dc_groups, num);
-  std::vector<std::vector<size_t>> ac_group_sec(
-      frame_dim_.num_groups,
-      std::vector<size_t>(frame_header_.passes.num_passes, num));
+  // The section index of every DC group and AC group pass, or num if it is not
+  // among "sections". The scratch vectors are kept across calls, since with
+  // incremental input there are many calls with a few sections each.
+  dc_group_sec_.assign(frame_dim_.num_dc_groups, num);
+  ac_group_sec_.assign(frame_dim_.num_groups * num_passes, num);
+  const auto ac_group_sec = [&](size_t group, size_t pass) -> size_t& {
+    return ac_group_sec_[group * num_passes + pass];
+  };
   // This keeps track of the number of ac passes we want to process during this
   // call of ProcessSections.
-  std::vector<size_t> desired_num_ac_passes(frame_dim_.num_groups);
-  bool single_section =
-      frame_dim_.num_groups == 1 && frame_header_.passes.num_passes == 1;
+  desired_num_ac_passes_.assign(frame_dim_.num_groups, 0);
+  bool single_section = frame_dim_.num_groups == 1 && num_passes == 1;
   if (single_section) {
     JXL_ENSURE(num == 1);
     JXL_ENSURE(sections[0].id == 0);
     if (processed_section_[0] == JXL_FALSE) {
       processed_section_[0] = JXL_TRUE;
-      ac_group_sec[0].resize(1);
-      dc_global_sec = ac_global_sec = dc_group_sec[0] = ac_group_sec[0][0] = 0;
-      desired_num_ac_passes[0] = 1;
+      dc_global_sec = ac_global_sec = dc_group_sec_[0] = ac_group_sec(0, 0) = 0;
+      desired_num_ac_passes_[0] = 1;
     } else {
       section_status[0] = SectionStatus::kDuplicate;
     }
@@ -603,35 +698,44 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
       if (sections[i].id == 0) {
         dc_global_sec = i;
       } else if (sections[i].id < ac_global_index) {
-        dc_group_sec[sections[i].id - 1] = i;
+        dc_group_sec_[sections[i].id - 1] = i;
       } else if (sections[i].id == ac_global_index) {
         ac_global_sec = i;
       } else {
         size_t ac_idx = sections[i].id - ac_global_index - 1;
         size_t acg = ac_idx % frame_dim_.num_groups;
         size_t acp = ac_idx / frame_dim_.num_groups;
-        if (acp >= frame_header_.passes.num_passes) {
+        if (acp >= num_passes) {
           return JXL_FAILURE("Invalid section ID");
         }
-        ac_group_sec[acg][acp] = i;
+        ac_group_sec(acg, acp) = i;
       }
       processed_section_[sections[i].id] = JXL_TRUE;
     }
     // Count number of new passes per group.
-    for (size_t g = 0; g < ac_group_sec.size(); g++) {
+    for (size_t g = 0; g < frame_dim_.num_groups; g++) {
       size_t j = 0;
-      for (; j + decoded_passes_per_ac_group_[g] <
-             frame_header_.passes.num_passes;
-           j++) {
-        if (ac_group_sec[g][j + decoded_passes_per_ac_group_[g]] == num) {
+      for (; j + decoded_passes_per_ac_group_[g] < num_passes; j++) {
+        if (ac_group_sec(g, j + decoded_passes_per_ac_group_[g]) == num) {
           break;
         }
       }
-      desired_num_ac_passes[g] = j;
+      desired_num_ac_passes_[g] = j;
     }
   }
+  // A call with a single group to decode runs it on the calling thread instead
+  // of waking up the runner, as happens with incremental input that only
+  // completes one section at a time. The Run calls that the task makes on
+  // pool_ still use the threads of the runner.
+  const auto group_pool = [this]() {
+    return groups_to_decode_.size() == 1 ? nullptr : pool_;
+  };
+  DecoderStats* stats = dec_state_->stats;
   if (dc_global_sec != num) {
+    const DecoderStats::Start start =
+        stats ? stats->Begin() : DecoderStats::Start();
     Status dc_global_status = ProcessDCGlobal(sections[dc_global_sec].br);
+    if (stats) stats->AddTime(DecoderStats::kDcGlobal, start);
     if (dc_global_status.IsFatalError()) return dc_global_status;
     if (dc_global_status) {
       section_status[dc_global_sec] = SectionStatus::kDone;
@@ -641,18 +745,27 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   }
 
   if (decoded_dc_global_) {
-    const auto process_section = [this, &dc_group_sec, &num, &sections,
-                                  &section_status](size_t i,
-                                                   size_t thread) -> Status {
-      if (dc_group_sec[i] != num) {
-        JXL_RETURN_IF_ERROR(ProcessDCGroup(i, sections[dc_group_sec[i]].br));
-        section_status[dc_group_sec[i]] = SectionStatus::kDone;
-      }
+    // Only dispatch the groups that have a section in this call, so that calls
+    // with a few sections do not pay for a pass over all the groups.
+    groups_to_decode_.clear();
+    for (size_t i = 0; i < dc_group_sec_.size(); i++) {
+      if (dc_group_sec_[i] != num) groups_to_decode_.push_back(i);
+    }
+    const auto process_section = [this, &sections, &section_status, stats](
+                                     size_t task, size_t thread) -> Status {
+      const size_t i = groups_to_decode_[task];
+      const DecoderStats::Start start =
+          stats ? stats->Begin() : DecoderStats::Start();
+      JXL_RETURN_IF_ERROR(ProcessDCGroup(i, sections[dc_group_sec_[i]].br));
+      if (stats) stats->AddTime(DecoderStats::kDcGroups, start);
+      section_status[dc_group_sec_[i]] = SectionStatus::kDone;
       return true;
     };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, dc_group_sec.size(),
-                                  ThreadPool::NoInit, process_section,
-                                  "DecodeDCGroup"));
+    // Nestable, so that the transforms and conversions of modular groups use
+    // the threads left idle when there are fewer groups than threads.
+    JXL_RETURN_IF_ERROR(RunNestableOnPool(
+        group_pool(), 0, groups_to_decode_.size(), ThreadPool::NoInit,
+        process_section, "DecodeDCGroup"));
   }
 
   if (!HasDcGroupToDecode() && !finalized_dc_) {
@@ -661,9 +774,23 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
     pipeline_options.coalescing = coalescing_;
     pipeline_options.render_spotcolors = render_spotcolors_;
     pipeline_options.render_noise = true;
+    // Only the input of the groups is kept, which is all that frames that are
+    // neither blended nor referenced need to be rendered later.
+    defer_rendering_ =
+        render_on_demand_ && !use_slow_rendering_pipeline_ &&
+        !has_crop_region_ && !decoded_->IsJPEG() &&
+        !frame_header_.CanBeReferenced() &&
+        frame_header_.frame_type == FrameType::kRegularFrame &&
+        !(coalescing_ && NeedsBlending(frame_header_)) &&
+        dec_state_->main_output.buffer != nullptr;
+    pipeline_options.defer_rendering = defer_rendering_;
+    pipeline_options.use_gpu_offload =
+        gpu_rendering_ && !defer_rendering_ && !has_crop_region_;
+    rendered_groups_.assign(defer_rendering_ ? frame_dim_.num_groups : 0, 0);
     JXL_RETURN_IF_ERROR(dec_state_->PreparePipeline(
         frame_header_, &frame_header_.nonserialized_metadata->m, decoded_,
         pipeline_options));
+    ComputeNeededACGroups();
     JXL_RETURN_IF_ERROR(FinalizeDC());
     JXL_RETURN_IF_ERROR(AllocateOutput());
     if (progressive_detail_ >= JxlProgressiveDetail::kDC) {
@@ -673,58 +800,76 @@ Status FrameDecoder::ProcessSections(const SectionInfo* sections, size_t num,
   }
 
   if (finalized_dc_ && ac_global_sec != num && !decoded_ac_global_) {
+    const DecoderStats::Start start =
+        stats ? stats->Begin() : DecoderStats::Start();
     JXL_RETURN_IF_ERROR(ProcessACGlobal(sections[ac_global_sec].br));
+    if (stats) stats->AddTime(DecoderStats::kAcGlobal, start);
     section_status[ac_global_sec] = SectionStatus::kDone;
   }
 
   if (progressive_detail_ >= JxlProgressiveDetail::kLastPasses) {
     // Mark that we only want the next progression pass.
     size_t target_complete_passes = NextNumPassesToPause();
-    for (size_t i = 0; i < ac_group_sec.size(); i++) {
-      desired_num_ac_passes[i] =
-          std::min(desired_num_ac_passes[i],
+    for (size_t i = 0; i < frame_dim_.num_groups; i++) {
+      desired_num_ac_passes_[i] =
+          std::min(desired_num_ac_passes_[i],
                    target_complete_passes - decoded_passes_per_ac_group_[i]);
     }
   }
 
   if (decoded_ac_global_) {
-    // Mark all the AC groups that we received as not complete yet.
-    for (size_t i = 0; i < ac_group_sec.size(); i++) {
-      if (desired_num_ac_passes[i] != 0) {
-        dec_state_->render_pipeline->ClearDone(i);
+    groups_to_decode_.clear();
+    for (size_t i = 0; i < frame_dim_.num_groups; i++) {
+      if (desired_num_ac_passes_[i] == 0) continue;
+      if (!IsACGroupNeeded(i) || draw_from_dc_) {
+        // Outside of the crop region or only drawn from DC: the sections count
+        // as processed, so that the frame completes, but they are not decoded.
+        for (size_t j = 0; j < desired_num_ac_passes_[i]; j++) {
+          const size_t pass = decoded_passes_per_ac_group_[i] + j;
+          section_status[ac_group_sec(i, pass)] = SectionStatus::kDone;
+        }
+        decoded_passes_per_ac_group_[i] += desired_num_ac_passes_[i];
+        continue;
       }
+      groups_to_decode_.push_back(i);
+    }
+    // Mark all the AC groups that we received as not complete yet.
+    for (size_t g : groups_to_decode_) {
+      dec_state_->render_pipeline->ClearDone(g);
     }
 
     const auto prepare_storage = [this](size_t num_threads) -> Status {
       JXL_RETURN_IF_ERROR(
-          PrepareStorage(num_threads, decoded_passes_per_ac_group_.size()));
+          PrepareStorage(num_threads, groups_to_decode_.size()));
       return true;
     };
-    const auto process_group = [this, &ac_group_sec, &desired_num_ac_passes,
-                                &num, &sections, &section_status](
-                                   size_t g, size_t thread) -> Status {
-      if (desired_num_ac_passes[g] == 0) {
-        // no new AC pass, nothing to do
-        return true;
-      }
+    const auto process_group = [this, &ac_group_sec, &num, &sections,
+                                &section_status, stats](
+                                   size_t task, size_t thread) -> Status {
+      const size_t g = groups_to_decode_[task];
       (void)num;
+      const DecoderStats::Start start =
+          stats ? stats->Begin() : DecoderStats::Start();
       size_t first_pass = decoded_passes_per_ac_group_[g];
       BitReader* JXL_RESTRICT readers[kMaxNumPasses];
-      for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
-        JXL_ENSURE(ac_group_sec[g][first_pass + i] != num);
-        readers[i] = sections[ac_group_sec[g][first_pass + i]].br;
+      for (size_t i = 0; i < desired_num_ac_passes_[g]; i++) {
+        JXL_ENSURE(ac_group_sec(g, first_pass + i) != num);
+        readers[i] = sections[ac_group_sec(g, first_pass + i)].br;
       }
       JXL_RETURN_IF_ERROR(ProcessACGroup(
-          g, readers, desired_num_ac_passes[g], GetStorageLocation(thread, g),
+          g, readers, desired_num_ac_passes_[g], thread,
+          GetStorageLocation(thread, task),
           /*force_draw=*/false, /*dc_only=*/false));
-      for (size_t i = 0; i < desired_num_ac_passes[g]; i++) {
-        section_status[ac_group_sec[g][first_pass + i]] = SectionStatus::kDone;
+      if (stats) stats->AddTime(DecoderStats::kAcGroups, start);
+      for (size_t i = 0; i < desired_num_ac_passes_[g]; i++) {
+        section_status[ac_group_sec(g, first_pass + i)] = SectionStatus::kDone;
       }
       return true;
     };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, ac_group_sec.size(),
-                                  prepare_storage, process_group,
-                                  "DecodeGroup"));
+    JXL_RETURN_IF_ERROR(RunNestableOnPool(group_pool(), 0,
+                                          groups_to_decode_.size(),
+                                          prepare_storage, process_group,
+                                          "DecodeGroup"));
   }
 
   MarkSections(sections, num, section_status);
@@ -754,37 +899,7 @@ Status FrameDecoder::Flush() {
   }
   JXL_RETURN_IF_ERROR(AllocateOutput());
 
-  uint32_t completely_decoded_ac_pass = *std::min_element(
-      decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
-  if (completely_decoded_ac_pass < frame_header_.passes.num_passes) {
-    // We don't have all AC yet: force a draw of all the missing areas.
-    // Mark all sections as not complete.
-    for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
-      if (decoded_passes_per_ac_group_[i] < frame_header_.passes.num_passes) {
-        dec_state_->render_pipeline->ClearDone(i);
-      }
-    }
-    const auto prepare_storage = [this](const size_t num_threads) -> Status {
-      JXL_RETURN_IF_ERROR(
-          PrepareStorage(num_threads, decoded_passes_per_ac_group_.size()));
-      return true;
-    };
-    const auto process_group = [this](const uint32_t g,
-                                      size_t thread) -> Status {
-      if (decoded_passes_per_ac_group_[g] == frame_header_.passes.num_passes) {
-        // This group was drawn already, nothing to do.
-        return true;
-      }
-      BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
-      JXL_RETURN_IF_ERROR(ProcessACGroup(
-          g, readers, /*num_passes=*/0, GetStorageLocation(thread, g),
-          /*force_draw=*/true, /*dc_only=*/!decoded_ac_global_));
-      return true;
-    };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, decoded_passes_per_ac_group_.size(),
-                                  prepare_storage, process_group,
-                                  "ForceDrawGroup"));
-  }
+  JXL_RETURN_IF_ERROR(ForceDrawGroups());
 
   // undo global modular transforms and copy int pixel buffers to float ones
   JXL_RETURN_IF_ERROR(modular_frame_decoder_.FinalizeDecoding(
@@ -793,6 +908,92 @@ Status FrameDecoder::Flush() {
   return true;
 }
 
+Status FrameDecoder::ForceDrawGroups() {
+  uint32_t completely_decoded_ac_pass = *std::min_element(
+      decoded_passes_per_ac_group_.begin(), decoded_passes_per_ac_group_.end());
+  if (completely_decoded_ac_pass >= frame_header_.passes.num_passes) {
+    return true;
+  }
+  // We don't have all AC yet: force a draw of the missing areas that changed
+  // since the previous flush, or of all of them if the groups are now drawn
+  // with their AC.
+  const bool dc_only = !decoded_ac_global_ || draw_from_dc_;
+  if (dc_only != flushed_dc_only_) flushed_passes_per_ac_group_.clear();
+  flushed_passes_per_ac_group_.resize(decoded_passes_per_ac_group_.size(),
+                                      kNotFlushed);
+  std::vector<uint32_t> groups_to_draw;
+  for (size_t i = 0; i < decoded_passes_per_ac_group_.size(); i++) {
+    // Groups with all their passes were drawn already, and the others are not
+    // drawn at all if they are not needed or were drawn from the same passes.
+    if (decoded_passes_per_ac_group_[i] == frame_header_.passes.num_passes ||
+        !IsACGroupNeeded(i) ||
+        flushed_passes_per_ac_group_[i] == decoded_passes_per_ac_group_[i]) {
+      continue;
+    }
+    // Mark the section as not complete.
+    dec_state_->render_pipeline->ClearDone(i);
+    groups_to_draw.push_back(i);
+  }
+  const auto prepare_storage = [this](const size_t num_threads) -> Status {
+    JXL_RETURN_IF_ERROR(
+        PrepareStorage(num_threads, decoded_passes_per_ac_group_.size()));
+    return true;
+  };
+  const auto process_group = [&](const uint32_t i, size_t thread) -> Status {
+    const uint32_t g = groups_to_draw[i];
+    BitReader* JXL_RESTRICT readers[kMaxNumPasses] = {};
+    JXL_RETURN_IF_ERROR(ProcessACGroup(
+        g, readers, /*num_passes=*/0, thread, GetStorageLocation(thread, g),
+        /*force_draw=*/true, dc_only));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, groups_to_draw.size(),
+                                prepare_storage, process_group,
+                                "ForceDrawGroup"));
+  for (uint32_t g : groups_to_draw) {
+    flushed_passes_per_ac_group_[g] = decoded_passes_per_ac_group_[g];
+  }
+  flushed_dc_only_ = dc_only;
+  return true;
+}
+
+Status FrameDecoder::RenderRegion(const Rect& rect) {
+  JXL_ENSURE(defer_rendering_ && is_finalized_);
+  const size_t upsampling = frame_header_.upsampling;
+  const size_t group_dim = frame_dim_.group_dim;
+  const size_t gx0 = rect.x0() / upsampling / group_dim;
+  const size_t gy0 = rect.y0() / upsampling / group_dim;
+  const size_t gx1 =
+      std::min(frame_dim_.xsize_groups,
+               DivCeil(DivCeil(rect.x1(), upsampling), group_dim));
+  const size_t gy1 =
+      std::min(frame_dim_.ysize_groups,
+               DivCeil(DivCeil(rect.y1(), upsampling), group_dim));
+  groups_to_decode_.clear();
+  for (size_t gy = gy0; gy < gy1; gy++) {
+    for (size_t gx = gx0; gx < gx1; gx++) {
+      const size_t g = gy * frame_dim_.xsize_groups + gx;
+      if (!rendered_groups_[g]) groups_to_decode_.push_back(g);
+    }
+  }
+  const auto prepare_storage = [this](const size_t num_threads) -> Status {
+    JXL_RETURN_IF_ERROR(dec_state_->render_pipeline->PrepareForThreads(
+        num_threads, /*use_group_ids=*/true));
+    return true;
+  };
+  const auto render_group = [this](const uint32_t task,
+                                   size_t thread) -> Status {
+    const size_t g = groups_to_decode_[task];
+    JXL_RETURN_IF_ERROR(dec_state_->render_pipeline->RenderGroup(g, thread));
+    rendered_groups_[g] = 1;
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, groups_to_decode_.size(),
+                                prepare_storage, render_group,
+                                "RenderGroup"));
+  return true;
+}
+
 int FrameDecoder::SavedAs(const FrameHeader& header) {
   if (header.frame_type == FrameType::kDCFrame) {
     // bits 16, 32, 64, 128 for DC level
@@ -864,6 +1065,15 @@ Status FrameDecoder::FinalizeFrame() {
     return true;
   }
 
+  if (draw_from_dc_) {
+    // The AC sections were only counted as decoded so that the frame could
+    // complete, so now the groups are drawn as if none of them had arrived.
+    std::fill(decoded_passes_per_ac_group_.begin(),
+              decoded_passes_per_ac_group_.end(), 0);
+    flushed_passes_per_ac_group_.clear();
+    JXL_RETURN_IF_ERROR(ForceDrawGroups());
+  }
+
   // undo global modular transforms and copy int pixel buffers to float ones
   JXL_RETURN_IF_ERROR(
       modular_frame_decoder_.FinalizeDecoding(frame_header_, dec_state_, pool_,
@@ -10,6 +10,7 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <limits>
@@ -19,12 +20,15 @@
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/rect.h"
+#include "lib/jxl/base/scratch_arena.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_modular.h"
 #include "lib/jxl/frame_header.h"
+#include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 
@@ -55,6 +59,56 @@ class FrameDecoder {
   void SetRenderSpotcolors(bool rsc) { render_spotcolors_ = rsc; }
   void SetCoalescing(bool c) { coalescing_ = c; }
 
+  // Restricts decoding to `rect`, in frame coordinates after upsampling: AC
+  // groups are only decoded if they are needed to render some pixel of `rect`,
+  // and the rest of the output is left unspecified. Ignored for frames that
+  // other frames may reference, for JPEG reconstruction and when the modular
+  // image is transformed as a whole, since all of these need every group.
+  void SetCropRegion(const Rect& rect) {
+    crop_region_ = rect;
+    has_crop_region_ = true;
+  }
+
+  // Makes the frame keep the input of all its groups instead of rendering
+  // them, so that RenderRegion renders parts of it on demand. Only applies to
+  // frames written to an image buffer that are not blended, not needed by
+  // other frames and not restricted to a crop region; the others are rendered
+  // while they are decoded.
+  void SetRenderOnDemand(bool render_on_demand) {
+    render_on_demand_ = render_on_demand;
+  }
+
+  // Runs the stages that the GPU render pipeline offload supports on the GPU,
+  // and the others on the simple render pipeline, if there is such an offload
+  // (see CreateGPURenderPipelineOffload). Does not apply to frames restricted
+  // to a crop region or rendered on demand.
+  void SetGPURendering(bool gpu_rendering) { gpu_rendering_ = gpu_rendering; }
+
+  // Whether the frame is rendered by RenderRegion, known once the render
+  // pipeline is prepared.
+  bool RendersOnDemand() const { return defer_rendering_; }
+
+  // Renders the groups of a frame that RendersOnDemand which have pixels in
+  // `rect`, in frame coordinates after upsampling, into the image buffer,
+  // except those that were already rendered. Requires FinalizeFrame.
+  Status RenderRegion(const Rect& rect);
+
+  // Downsamples the image output by `factor`, which is 1, 2, 4 or 8; must be
+  // called before SetImageOutput, whose sizes are then those of the smaller
+  // output. With a factor of 8, VarDCT frames are rendered from their DC alone
+  // and their AC is not decoded, unless the frame is needed in full as for
+  // SetCropRegion.
+  void SetOutputDownsampling(size_t factor) {
+    dec_state_->output_downsampling = factor;
+  }
+
+  // Computes the pixels of recompressed JPEG frames from their JPEG
+  // coefficients with the integer IDCT of libjpeg, instead of the IDCT of
+  // JPEG XL. Other frames, and blocks that are not DCT-8, are not affected.
+  void SetJPEGIntegerIDCT(bool enabled) {
+    dec_state_->jpeg_integer_idct = enabled;
+  }
+
   // Read FrameHeader and table of contents from the given BitReader.
   Status InitFrame(BitReader* JXL_RESTRICT br, ImageBundle* decoded,
                    bool is_preview);
@@ -96,7 +150,9 @@ class FrameDecoder {
   Status ProcessSections(const SectionInfo* sections, size_t num,
                          SectionStatus* section_status);
 
-  // Flushes all the data decoded so far to pixels.
+  // Flushes all the data decoded so far to pixels. Only the groups that were
+  // decoded further since the previous flush are drawn again, the others are
+  // still in the output from that flush.
   Status Flush();
 
   // Runs final operations once a frame data is decoded.
@@ -120,6 +176,15 @@ class FrameDecoder {
   uint64_t SumSectionSizes() const { return section_sizes_sum_; }
   const std::vector<TocEntry>& Toc() const { return toc_; }
 
+  // Returns the row of groups of the AC group section with TOC id "id", or 0
+  // for the other sections.
+  size_t SectionGroupRow(size_t id) const {
+    const size_t ac_global_index = frame_dim_.num_dc_groups + 1;
+    if (toc_.size() == 1 || id <= ac_global_index) return 0;
+    const size_t group = (id - ac_global_index - 1) % frame_dim_.num_groups;
+    return group / frame_dim_.xsize_groups;
+  }
+
   const FrameHeader& GetFrameHeader() const { return frame_header_; }
 
   // Returns whether a DC image has been decoded, accessible at low resolution
@@ -132,6 +197,21 @@ class FrameDecoder {
                              decoded_passes_per_ac_group_.end());
   }
 
+  // Returns the number of rows of the frame, from the top, whose AC groups
+  // have all their passes decoded.
+  size_t NumDecodedRows() const {
+    const size_t num_passes = frame_header_.passes.num_passes;
+    for (size_t gy = 0; gy < frame_dim_.ysize_groups; gy++) {
+      for (size_t gx = 0; gx < frame_dim_.xsize_groups; gx++) {
+        const size_t g = gy * frame_dim_.xsize_groups + gx;
+        if (decoded_passes_per_ac_group_[g] < num_passes) {
+          return gy * frame_dim_.group_dim;
+        }
+      }
+    }
+    return frame_dim_.ysize;
+  }
+
   // If enabled, ProcessSections will stop and return true when the DC
   // sections have been processed, instead of starting the AC sections. This
   // will only occur if supported (that is, flushing will produce a valid
@@ -218,6 +298,7 @@ class FrameDecoder {
         (format.data_type == JXL_TYPE_UINT8) && (format.num_channels >= 3) &&
         !dec_state_->unpremul_alpha &&
         (dec_state_->undo_orientation == Orientation::kIdentity) &&
+        (dec_state_->output_downsampling == 1) &&
         decoded_->metadata()->xyb_encoded &&
         dec_state_->output_encoding_info.color_encoding.IsSRGB() &&
         dec_state_->output_encoding_info.all_default_opsin &&
@@ -226,9 +307,32 @@ class FrameDecoder {
         HasFastXYBTosRGB8() && frame_header_.needs_color_transform()) {
       dec_state_->fast_xyb_srgb8_conversion = true;
     }
+    if (dec_state_->main_output.buffer &&
+        (format.data_type == JXL_TYPE_UINT8) && (format.num_channels >= 3) &&
+        !dec_state_->unpremul_alpha &&
+        (dec_state_->undo_orientation == Orientation::kIdentity) &&
+        (dec_state_->output_downsampling == 1) &&
+        frame_header_.color_transform == ColorTransform::kYCbCr &&
+        dec_state_->output_encoding_info.color_encoding_is_original &&
+        (dec_state_->output_encoding_info.desired_intensity_target ==
+         dec_state_->output_encoding_info.orig_intensity_target)) {
+      dec_state_->fast_ycbcr_rgb8_conversion = true;
+    }
 #endif
   }
 
+  // Sets the planar YCbCr buffers where the color channels will be decoded,
+  // instead of the pixel callback or image buffer of SetImageOutput. The
+  // strides of "planes" must not be 0.
+  void SetImageOutPlanes(const JxlPlanarImageOutBuffer& planes, size_t xsize,
+                         size_t ysize) const {
+    dec_state_->width = xsize;
+    dec_state_->height = ysize;
+    dec_state_->main_output.planar = true;
+    dec_state_->main_output.planes = planes;
+    dec_state_->extra_output.clear();
+  }
+
   void AddExtraChannelOutput(void* buffer, size_t buffer_size, size_t xsize,
                              JxlPixelFormat format, size_t bits_per_sample) {
     ImageOutput out;
@@ -243,14 +347,28 @@ class FrameDecoder {
  private:
   Status ProcessDCGlobal(BitReader* br);
   Status ProcessDCGroup(size_t dc_group_id, BitReader* br);
+  // Whether the frame uses adaptive DC smoothing.
+  bool SmoothsDC() const;
+  // Smooths the DC groups around `dc_group_id`, which was just decoded, whose
+  // neighbours are now all decoded.
+  Status SmoothDCAround(size_t dc_group_id);
   Status FinalizeDC();
   Status AllocateOutput();
   Status ProcessACGlobal(BitReader* br);
   Status ProcessACGroup(size_t ac_group_id, BitReader* JXL_RESTRICT* br,
-                        size_t num_passes, size_t thread, bool force_draw,
-                        bool dc_only);
+                        size_t num_passes, size_t thread, size_t storage,
+                        bool force_draw, bool dc_only);
   void MarkSections(const SectionInfo* sections, size_t num,
                     const SectionStatus* section_status);
+  // Fills ac_group_needed_ from the crop region and decides whether to draw the
+  // frame from its DC only. Requires the render pipeline.
+  void ComputeNeededACGroups();
+  // Renders the needed AC groups that are not fully decoded yet from what was
+  // decoded so far.
+  Status ForceDrawGroups();
+  bool IsACGroupNeeded(size_t g) const {
+    return ac_group_needed_.empty() || ac_group_needed_[g];
+  }
 
   // Allocates storage for parallel decoding using up to `num_threads` threads
   // of up to `num_tasks` tasks. The value of `thread` passed to
@@ -259,9 +377,6 @@ class FrameDecoder {
   // than the value of `num_tasks` passed here.
   Status PrepareStorage(size_t num_threads, size_t num_tasks) {
     size_t storage_size = std::min(num_threads, num_tasks);
-    if (storage_size > group_dec_caches_.size()) {
-      group_dec_caches_.resize(storage_size);
-    }
     use_task_id_ = num_threads > num_tasks;
     bool use_noise = (frame_header_.flags & FrameHeader::kNoise) != 0;
     bool use_group_ids =
@@ -286,8 +401,11 @@ class FrameDecoder {
   }
 
   static size_t GetStride(const size_t xsize, JxlPixelFormat format) {
-    size_t stride =
-        (xsize * BytesPerChannel(format.data_type) * format.num_channels);
+    // Packed pixels take 4 bytes, whether they have alpha or not.
+    size_t stride = (format.data_type == JXL_TYPE_UINT32_RGB10_A2
+                         ? xsize * 4
+                         : (xsize * BytesPerChannel(format.data_type) *
+                            format.num_channels));
     if (format.align > 1) {
       stride = (jxl::DivCeil(stride, format.align) * format.align);
     }
@@ -314,6 +432,11 @@ class FrameDecoder {
   std::vector<uint8_t> processed_section_;
   std::vector<uint8_t> decoded_passes_per_ac_group_;
   std::vector<uint8_t> decoded_dc_groups_;
+  // The DC after adaptive smoothing, which FinalizeDC swaps in, and the number
+  // of DC groups around each DC group, itself included, that are not decoded
+  // yet. The last of them to be decoded smooths the group.
+  Image3F smoothed_dc_;
+  std::vector<std::atomic<uint8_t>> dc_smoothing_counters_;
   bool decoded_dc_global_;
   bool decoded_ac_global_;
   bool HasEverything() const;
@@ -322,7 +445,40 @@ class FrameDecoder {
   bool is_finalized_ = true;
   bool allocated_ = false;
 
-  std::vector<GroupDecCache> group_dec_caches_;
+  bool has_crop_region_ = false;
+  Rect crop_region_;
+  // Whether each AC group is needed to render the crop region, or empty if
+  // all of them are.
+  std::vector<uint8_t> ac_group_needed_;
+  // Whether the AC groups are only drawn from DC, once all the sections are
+  // processed, since the output is downsampled by 8.
+  bool draw_from_dc_ = false;
+  // Number of passes of each AC group when it was last drawn by Flush, or
+  // kNotFlushed, and whether that flush drew the groups from DC only. Empty
+  // when no group was flushed yet.
+  static constexpr uint8_t kNotFlushed = 0xFF;
+  std::vector<uint8_t> flushed_passes_per_ac_group_;
+  bool flushed_dc_only_ = false;
+
+  bool render_on_demand_ = false;
+  bool gpu_rendering_ = false;
+  // Whether the render pipeline of this frame defers rendering to
+  // RenderRegion, and which of the groups it already rendered.
+  bool defer_rendering_ = false;
+  std::vector<uint8_t> rendered_groups_;
+
+  // Returns the arena holding the GroupDecCache of every thread, which is the
+  // one of the pool if there is one, so that they are reused across frames.
+  ScratchArena* scratch() {
+    return pool_ != nullptr ? pool_->scratch() : &local_scratch_;
+  }
+  ScratchArena local_scratch_;
+
+  // Scratch space of ProcessSections.
+  std::vector<size_t> dc_group_sec_;
+  std::vector<size_t> ac_group_sec_;
+  std::vector<size_t> desired_num_ac_passes_;
+  std::vector<size_t> groups_to_decode_;
 
   // Whether or not the task id should be used for storage indexing, instead of
   // the thread id.
@@ -9,6 +9,7 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -26,6 +27,7 @@
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
+#include "lib/jxl/jpeg/dec_jpeg_idct.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 #include "lib/jxl/render_pipeline/render_pipeline.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
@@ -62,9 +64,13 @@ struct AuxOut;
 class GetBlock {
  public:
   virtual void StartRow(size_t by) = 0;
+  // Adds the quantized coefficients of the block to `block` and sets
+  // `num_nzeros` to an upper bound of the number of non-zero AC coefficients
+  // of each channel of the result.
   virtual Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs,
                            size_t size, size_t log2_covered_blocks,
-                           ACPtr block[3], ACType ac_type) = 0;
+                           ACPtr block[3], ACType ac_type,
+                           size_t num_nzeros[3]) = 0;
   virtual ~GetBlock() {}
 };
 
@@ -91,6 +97,7 @@ using hwy::HWY_NAMESPACE::MaskFromVec;
 using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
 using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Zero;
 
 using D = HWY_FULL(float);
 using DU = HWY_FULL(uint32_t);
@@ -111,19 +118,13 @@ void Transpose8x8InPlace(int32_t* JXL_RESTRICT block) {
   }
 }
 
-template <ACType ac_type>
-void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
-                 Vec<D> scaled_dequant_b,
-                 const float* JXL_RESTRICT dequant_matrices, size_t size,
-                 size_t k, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
-                 const float* JXL_RESTRICT biases, ACPtr qblock[3],
-                 float* JXL_RESTRICT block) {
-  const auto x_mul = Mul(Load(d, dequant_matrices + k), scaled_dequant_x);
-  const auto y_mul =
-      Mul(Load(d, dequant_matrices + size + k), scaled_dequant_y);
-  const auto b_mul =
-      Mul(Load(d, dequant_matrices + 2 * size + k), scaled_dequant_b);
-
+// Dequantizes the coefficients at `k` with the given multipliers. If `clear`,
+// the quantized coefficients are zeroed as they are read.
+template <ACType ac_type, bool clear>
+void DequantLaneWithMul(Vec<D> x_mul, Vec<D> y_mul, Vec<D> b_mul, size_t size,
+                        size_t k, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
+                        const float* JXL_RESTRICT biases, ACPtr qblock[3],
+                        float* JXL_RESTRICT block) {
   Vec<DI> quantized_x_int;
   Vec<DI> quantized_y_int;
   Vec<DI> quantized_b_int;
@@ -131,10 +132,18 @@ void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
     quantized_x_int = PromoteTo(di, Load(di16, qblock[0].ptr16 + k));
     quantized_y_int = PromoteTo(di, Load(di16, qblock[1].ptr16 + k));
     quantized_b_int = PromoteTo(di, Load(di16, qblock[2].ptr16 + k));
+    if (clear) {
+      for (size_t c = 0; c < 3; c++) {
+        Store(Zero(di16), di16, qblock[c].ptr16 + k);
+      }
+    }
   } else {
     quantized_x_int = Load(di, qblock[0].ptr32 + k);
     quantized_y_int = Load(di, qblock[1].ptr32 + k);
     quantized_b_int = Load(di, qblock[2].ptr32 + k);
+    if (clear) {
+      for (size_t c = 0; c < 3; c++) Store(Zero(di), di, qblock[c].ptr32 + k);
+    }
   }
 
   const auto dequant_x_cc =
@@ -151,7 +160,40 @@ void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
   Store(dequant_b, d, block + 2 * size + k);
 }
 
-template <ACType ac_type>
+template <ACType ac_type, bool clear>
+void DequantLane(Vec<D> scaled_dequant_x, Vec<D> scaled_dequant_y,
+                 Vec<D> scaled_dequant_b,
+                 const float* JXL_RESTRICT dequant_matrices, size_t size,
+                 size_t k, Vec<D> x_cc_mul, Vec<D> b_cc_mul,
+                 const float* JXL_RESTRICT biases, ACPtr qblock[3],
+                 float* JXL_RESTRICT block) {
+  const auto x_mul = Mul(Load(d, dequant_matrices + k), scaled_dequant_x);
+  const auto y_mul =
+      Mul(Load(d, dequant_matrices + size + k), scaled_dequant_y);
+  const auto b_mul =
+      Mul(Load(d, dequant_matrices + 2 * size + k), scaled_dequant_b);
+  DequantLaneWithMul<ac_type, clear>(x_mul, y_mul, b_mul, size, k, x_cc_mul,
+                                     b_cc_mul, biases, qblock, block);
+}
+
+// Y part of DequantLaneWithMul.
+template <ACType ac_type, bool clear>
+void DequantYLaneWithMul(Vec<D> y_mul, size_t k,
+                         const float* JXL_RESTRICT biases, ACPtr qblock[3],
+                         float* JXL_RESTRICT block_y) {
+  Vec<DI> quantized_y_int;
+  if (ac_type == ACType::k16) {
+    quantized_y_int = PromoteTo(di, Load(di16, qblock[1].ptr16 + k));
+    if (clear) Store(Zero(di16), di16, qblock[1].ptr16 + k);
+  } else {
+    quantized_y_int = Load(di, qblock[1].ptr32 + k);
+    if (clear) Store(Zero(di), di, qblock[1].ptr32 + k);
+  }
+  Store(Mul(AdjustQuantBias(di, 1, quantized_y_int, biases), y_mul), d,
+        block_y + k);
+}
+
+template <ACType ac_type, bool clear>
 void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
                   float x_dm_multiplier, float b_dm_multiplier, Vec<D> x_cc_mul,
                   Vec<D> b_cc_mul, AcStrategyType kind, size_t size,
@@ -170,9 +212,9 @@ void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
   const float* dequant_matrices = quantizer.DequantMatrix(kind, 0);
 
   for (size_t k = 0; k < covered_blocks * kDCTBlockSize; k += Lanes(d)) {
-    DequantLane<ac_type>(scaled_dequant_x, scaled_dequant_y, scaled_dequant_b,
-                         dequant_matrices, size, k, x_cc_mul, b_cc_mul, biases,
-                         qblock, block);
+    DequantLane<ac_type, clear>(scaled_dequant_x, scaled_dequant_y,
+                                scaled_dequant_b, dequant_matrices, size, k,
+                                x_cc_mul, b_cc_mul, biases, qblock, block);
   }
   for (size_t c = 0; c < 3; c++) {
     LowestFrequenciesFromDC(acs.Strategy(), dc_row[c] + sbx[c], dc_stride,
@@ -180,6 +222,100 @@ void DequantBlock(const AcStrategy& acs, float inv_global_scale, int quant,
   }
 }
 
+// Like DequantBlock, but only for the Y channel. Used for the blocks of frames
+// with chroma subsampling that have no X and B blocks at their position, such
+// as three out of four blocks in 4:2:0, since chroma from luma only changes X
+// and B.
+template <ACType ac_type, bool clear>
+void DequantYBlock(const AcStrategy& acs, float inv_global_scale, int quant,
+                   AcStrategyType kind, size_t size, const Quantizer& quantizer,
+                   size_t covered_blocks, const size_t* sbx,
+                   const float* JXL_RESTRICT* JXL_RESTRICT dc_row,
+                   size_t dc_stride, const float* JXL_RESTRICT biases,
+                   ACPtr qblock[3], float* JXL_RESTRICT block,
+                   float* JXL_RESTRICT scratch) {
+  const auto scaled_dequant_y = Set(d, inv_global_scale / quant);
+  const float* dequant_matrix = quantizer.DequantMatrix(kind, 1);
+  float* JXL_RESTRICT block_y = block + size;
+
+  for (size_t k = 0; k < covered_blocks * kDCTBlockSize; k += Lanes(d)) {
+    const auto y_mul = Mul(Load(d, dequant_matrix + k), scaled_dequant_y);
+    DequantYLaneWithMul<ac_type, clear>(y_mul, k, biases, qblock, block_y);
+  }
+  LowestFrequenciesFromDC(acs.Strategy(), dc_row[1] + sbx[1], dc_stride,
+                          block_y, scratch);
+}
+
+// Dequantization multipliers of the DCT-8 blocks with a given quantization
+// value, as DequantBlock computes them. Recompressed JPEGs only have DCT-8
+// blocks, mostly with the same quantization value, so their multipliers are
+// computed once for a run of blocks instead of once per block.
+struct DCTDequantMul {
+  void Update(float inv_global_scale, int quant, float x_dm_multiplier,
+              float b_dm_multiplier, const Quantizer& quantizer) {
+    if (quant == this->quant) return;
+    this->quant = quant;
+    const float scaled_dequant_s = inv_global_scale / quant;
+    const float scales[3] = {scaled_dequant_s * x_dm_multiplier,
+                             scaled_dequant_s,
+                             scaled_dequant_s * b_dm_multiplier};
+    const float* dequant_matrices =
+        quantizer.DequantMatrix(AcStrategyType::DCT, 0);
+    for (size_t c = 0; c < 3; c++) {
+      const auto scale = Set(d, scales[c]);
+      for (size_t k = 0; k < kDCTBlockSize; k += Lanes(d)) {
+        const size_t i = c * kDCTBlockSize + k;
+        Store(Mul(Load(d, dequant_matrices + i), scale), d, mul + i);
+      }
+    }
+  }
+
+  // Zero is not a valid quantization value.
+  int quant = 0;
+  HWY_ALIGN float mul[3 * kDCTBlockSize];
+};
+
+// Like DequantBlock and DequantYBlock for a DCT-8 block, with the multipliers
+// of `dct_mul`.
+template <ACType ac_type, bool clear>
+void DequantDCTBlock(const DCTDequantMul& dct_mul, bool y_only,
+                     Vec<D> x_cc_mul, Vec<D> b_cc_mul, const size_t* sbx,
+                     const float* JXL_RESTRICT* JXL_RESTRICT dc_row,
+                     const float* JXL_RESTRICT biases, ACPtr qblock[3],
+                     float* JXL_RESTRICT block) {
+  const float* JXL_RESTRICT mul = dct_mul.mul;
+  if (y_only) {
+    for (size_t k = 0; k < kDCTBlockSize; k += Lanes(d)) {
+      DequantYLaneWithMul<ac_type, clear>(Load(d, mul + kDCTBlockSize + k), k,
+                                          biases, qblock,
+                                          block + kDCTBlockSize);
+    }
+    block[kDCTBlockSize] = dc_row[1][sbx[1]];
+    return;
+  }
+  for (size_t k = 0; k < kDCTBlockSize; k += Lanes(d)) {
+    DequantLaneWithMul<ac_type, clear>(
+        Load(d, mul + k), Load(d, mul + kDCTBlockSize + k),
+        Load(d, mul + 2 * kDCTBlockSize + k), kDCTBlockSize, k, x_cc_mul,
+        b_cc_mul, biases, qblock, block);
+  }
+  for (size_t c = 0; c < 3; c++) {
+    block[c * kDCTBlockSize] = dc_row[c][sbx[c]];
+  }
+}
+
+// The inverse DCT of a 8x8 block without AC coefficients, whose pixels are all
+// equal to its DC.
+void FillFlatBlock(float dc, float* JXL_RESTRICT pixels, size_t pixels_stride) {
+  const HWY_CAPPED(float, kBlockDim) d8;
+  const auto value = Set(d8, dc);
+  for (size_t y = 0; y < kBlockDim; y++) {
+    for (size_t x = 0; x < kBlockDim; x += Lanes(d8)) {
+      StoreU(value, d8, pixels + y * pixels_stride + x);
+    }
+  }
+}
+
 Status DecodeGroupImpl(const FrameHeader& frame_header,
                        GetBlock* JXL_RESTRICT get_block,
                        GroupDecCache* JXL_RESTRICT group_dec_cache,
@@ -212,11 +348,36 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
   HWY_ALIGN int32_t scaled_qtable[64 * 3];
 
   ACType ac_type = dec_state->coefficients->Type();
-  auto dequant_block = ac_type == ACType::k16 ? DequantBlock<ACType::k16>
-                                              : DequantBlock<ACType::k32>;
   // Whether or not coefficients should be stored for future usage, and/or read
   // from past usage.
   bool accumulate = !dec_state->coefficients->IsEmpty();
+  // Without accumulation, the coefficients of each varblock are decoded into
+  // the scratch block of the group cache, the three channels one after the
+  // other in natural order. Zeroing it before each varblock dominates for the
+  // large transforms of smooth areas, so instead the dequantization zeroes the
+  // coefficients it reads. zeroed_qblock is the number of leading entries of
+  // the scratch block known to be zero; the others are zeroed the first time
+  // a varblock of the group needs them.
+  size_t zeroed_qblock = 0;
+  auto dequant_block =
+      ac_type == ACType::k16
+          ? (accumulate ? DequantBlock<ACType::k16, false>
+                        : DequantBlock<ACType::k16, true>)
+          : (accumulate ? DequantBlock<ACType::k32, false>
+                        : DequantBlock<ACType::k32, true>);
+  auto dequant_y_block =
+      ac_type == ACType::k16
+          ? (accumulate ? DequantYBlock<ACType::k16, false>
+                        : DequantYBlock<ACType::k16, true>)
+          : (accumulate ? DequantYBlock<ACType::k32, false>
+                        : DequantYBlock<ACType::k32, true>);
+  auto dequant_dct_block =
+      ac_type == ACType::k16
+          ? (accumulate ? DequantDCTBlock<ACType::k16, false>
+                        : DequantDCTBlock<ACType::k16, true>)
+          : (accumulate ? DequantDCTBlock<ACType::k32, false>
+                        : DequantDCTBlock<ACType::k32, true>);
+  DCTDequantMul dct_mul;
   // Offset of the current block in the group.
   size_t offset = 0;
 
@@ -226,6 +387,26 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
 
   // TODO(veluca): all of this should be done only once per image.
   const ColorCorrelation& color_correlation = dec_state->shared->cmap.base();
+  const std::vector<QuantEncoding>& qe =
+      dec_state->shared->matrices.encodings();
+  // When decoding a recompressed JPEG to pixels, its DCT-8 blocks can be
+  // converted back to JPEG coefficients and go through the integer IDCT of
+  // libjpeg instead, as set with JxlDecoderSetJPEGIntegerIDCT.
+  bool integer_idct = false;
+  // The JPEG quantization tables, in the natural order of JPEG.
+  int32_t jpeg_qtable[64 * 3];
+  if (!jpeg_data && dec_state->jpeg_integer_idct &&
+      frame_header.color_transform != ColorTransform::kXYB &&
+      color_correlation.IsJPEGCompatible()) {
+    integer_idct =
+        !qe.empty() && qe[0].mode == QuantEncoding::Mode::kQuantModeRAW &&
+        std::abs(qe[0].qraw.qtable_den - 1.f / (8 * 255)) <= 1e-8f &&
+        qe[0].qraw.qtable->size() == 3 * 8 * 8;
+    for (size_t i = 0; integer_idct && i < 3 * 64; i++) {
+      const int q = (*qe[0].qraw.qtable)[i];
+      integer_idct = q > 0 && q < 65536;
+    }
+  }
   if (jpeg_data) {
     if (!color_correlation.IsJPEGCompatible()) {
       return JXL_FAILURE("The CfL map is not JPEG-compatible");
@@ -233,8 +414,8 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
     jpeg_is_gray = (jpeg_data->components.size() == 1);
     JXL_ENSURE(frame_header.color_transform != ColorTransform::kXYB);
     jpeg_c_map = JpegOrder(frame_header.color_transform, jpeg_is_gray);
-    const std::vector<QuantEncoding>& qe =
-        dec_state->shared->matrices.encodings();
+  }
+  if (jpeg_data || integer_idct) {
     if (qe.empty() || qe[0].mode != QuantEncoding::Mode::kQuantModeRAW ||
         std::abs(qe[0].qraw.qtable_den - 1.f / (8 * 255)) > 1e-8f) {
       return JXL_FAILURE(
@@ -255,6 +436,7 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
         }
         scaled_qtable[64 * c + (i % 8) * 8 + (i / 8)] =
             (1 << kCFLFixedPointPrecision) * num / den;
+        jpeg_qtable[64 * c + (i % 8) * 8 + (i / 8)] = den;
       }
     }
   }
@@ -341,21 +523,28 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
           // drawing.
           JXL_ENSURE(draw == kDraw);
           if (ac_type == ACType::k16) {
-            memset(group_dec_cache->dec_group_qblock16, 0,
-                   size * 3 * sizeof(int16_t));
+            if (zeroed_qblock < 3 * size) {
+              memset(group_dec_cache->dec_group_qblock16 + zeroed_qblock, 0,
+                     (3 * size - zeroed_qblock) * sizeof(int16_t));
+            }
             for (size_t c = 0; c < 3; c++) {
               qblock[c].ptr16 = group_dec_cache->dec_group_qblock16 + c * size;
             }
           } else {
-            memset(group_dec_cache->dec_group_qblock, 0,
-                   size * 3 * sizeof(int32_t));
+            if (zeroed_qblock < 3 * size) {
+              memset(group_dec_cache->dec_group_qblock + zeroed_qblock, 0,
+                     (3 * size - zeroed_qblock) * sizeof(int32_t));
+            }
             for (size_t c = 0; c < 3; c++) {
               qblock[c].ptr32 = group_dec_cache->dec_group_qblock + c * size;
             }
           }
+          zeroed_qblock = std::max(zeroed_qblock, 3 * size);
         }
-        JXL_RETURN_IF_ERROR(get_block->LoadBlock(
-            bx, by, acs, size, log2_covered_blocks, qblock, ac_type));
+        size_t num_nzeros[3];
+        JXL_RETURN_IF_ERROR(get_block->LoadBlock(bx, by, acs, size,
+                                                 log2_covered_blocks, qblock,
+                                                 ac_type, num_nzeros));
         offset += size;
         if (draw == kDontDraw) {
           bx += llf_x;
@@ -427,22 +616,122 @@ Status DecodeGroupImpl(const FrameHeader& frame_header,
               return JXL_FAILURE("JPEG DCT coefficients out of range");
             }
           }
+          if (!accumulate) {
+            memset(qblock[0].ptr32, 0, 3 * size * sizeof(int32_t));
+          }
         } else {
           HWY_ALIGN float* const block = group_dec_cache->dec_group_block;
+          bool has_block[3];
+          for (size_t c = 0; c < 3; c++) {
+            has_block[c] =
+                (sbx[c] << hshift[c] == bx) && (sby[c] << vshift[c] == by);
+          }
+          if (integer_idct && acs.Strategy() == AcStrategyType::DCT) {
+            // The JPEG coefficients, as they are written to the JPEG data
+            // above, dequantized with the JPEG quantization tables.
+            int32_t jpeg_y[kDCTBlockSize];
+            int32_t coeffs[kDCTBlockSize];
+            uint8_t pixels[kDCTBlockSize];
+            const float offset =
+                frame_header.color_transform == ColorTransform::kNone ? 0.0f
+                                                                      : -128.0f;
+            for (size_t c : {1, 0, 2}) {
+              if (!has_block[c]) continue;
+              const int32_t* JXL_RESTRICT qt = jpeg_qtable + c * kDCTBlockSize;
+              const bool cfl =
+                  c != 1 && cs.Is444() && row_cmap[c][abs_tx] != 0;
+              const int64_t cfl_scale =
+                  cfl ? ColorCorrelation::RatioJPEG(row_cmap[c][abs_tx]) : 0;
+              const int64_t round = 1 << (kCFLFixedPointPrecision - 1);
+              for (size_t i = 1; i < kDCTBlockSize; i++) {
+                // JPEG XL is transposed, JPEG is not.
+                const size_t k = (i % 8) * 8 + i / 8;
+                int64_t coeff = ac_type == ACType::k16 ? qblock[c].ptr16[k]
+                                                       : qblock[c].ptr32[k];
+                if (cfl) {
+                  const int64_t coeff_scale =
+                      (scaled_qtable[c * kDCTBlockSize + i] * cfl_scale +
+                       round) >>
+                      kCFLFixedPointPrecision;
+                  coeff += (jpeg_y[i] * coeff_scale + round) >>
+                           kCFLFixedPointPrecision;
+                }
+                coeff = Clamp1<int64_t>(coeff, -32767, 32767);
+                if (c == 1) jpeg_y[i] = static_cast<int32_t>(coeff);
+                coeffs[i] = static_cast<int32_t>(coeff * qt[i]);
+              }
+              // The DC is dequantized with the same table, and includes the
+              // level shift of frames without a color transform.
+              const float dc = Clamp1(dc_rows[c][sbx[c]] * (8 * 255), -1e8f,
+                                      1e8f);
+              coeffs[0] = static_cast<int32_t>(std::lround(dc)) -
+                          dcoff[c] * qt[0];
+              jpeg::InverseDCTIntegerISlow(coeffs, pixels, kBlockDim);
+              float* JXL_RESTRICT idct_pos = idct_row[c] + sbx[c] * kBlockDim;
+              for (size_t y = 0; y < kBlockDim; y++) {
+                for (size_t x = 0; x < kBlockDim; x++) {
+                  idct_pos[y * idct_stride[c] + x] =
+                      (pixels[y * kBlockDim + x] + offset) * (1.0f / 255);
+                }
+              }
+            }
+            if (!accumulate) {
+              memset(qblock[0].ptr32, 0,
+                     3 * size *
+                         (ac_type == ACType::k16 ? sizeof(int16_t)
+                                                 : sizeof(int32_t)));
+            }
+            bx += llf_x;
+            continue;
+          }
+          // Smooth areas of low-bitrate images have many DCT blocks without AC
+          // coefficients, whose pixels only depend on their DC. Chroma from
+          // luma only adds the AC of Y to X and B, so it cannot change them.
+          if (acs.Strategy() == AcStrategyType::DCT &&
+              (!has_block[0] || num_nzeros[0] == 0) &&
+              (!has_block[1] || num_nzeros[1] == 0) &&
+              (!has_block[2] || num_nzeros[2] == 0)) {
+            for (size_t c : {1, 0, 2}) {
+              if (!has_block[c]) continue;
+              FillFlatBlock(dc_rows[c][sbx[c]],
+                            idct_row[c] + sbx[c] * kBlockDim, idct_stride[c]);
+            }
+            bx += llf_x;
+            continue;
+          }
           // Dequantize and add predictions.
-          dequant_block(
-              acs, inv_global_scale, row_quant[bx], dec_state->x_dm_multiplier,
-              dec_state->b_dm_multiplier, x_cc_mul, b_cc_mul, acs.Strategy(),
-              size, dec_state->shared->quantizer,
-              acs.covered_blocks_y() * acs.covered_blocks_x(), sbx, dc_rows,
-              dc_stride,
-              dec_state->output_encoding_info.opsin_params.quant_biases, qblock,
-              block, group_dec_cache->scratch_space);
+          const bool y_only = has_block[1] && !has_block[0] && !has_block[2];
+          if (acs.Strategy() == AcStrategyType::DCT) {
+            dct_mul.Update(inv_global_scale, row_quant[bx],
+                           dec_state->x_dm_multiplier,
+                           dec_state->b_dm_multiplier,
+                           dec_state->shared->quantizer);
+            dequant_dct_block(
+                dct_mul, y_only, x_cc_mul, b_cc_mul, sbx, dc_rows,
+                dec_state->output_encoding_info.opsin_params.quant_biases,
+                qblock, block);
+          } else if (y_only) {
+            dequant_y_block(
+                acs, inv_global_scale, row_quant[bx], acs.Strategy(), size,
+                dec_state->shared->quantizer,
+                acs.covered_blocks_y() * acs.covered_blocks_x(), sbx, dc_rows,
+                dc_stride,
+                dec_state->output_encoding_info.opsin_params.quant_biases,
+                qblock, block, group_dec_cache->scratch_space);
+          } else {
+            dequant_block(
+                acs, inv_global_scale, row_quant[bx],
+                dec_state->x_dm_multiplier, dec_state->b_dm_multiplier,
+                x_cc_mul, b_cc_mul, acs.Strategy(), size,
+                dec_state->shared->quantizer,
+                acs.covered_blocks_y() * acs.covered_blocks_x(), sbx, dc_rows,
+                dc_stride,
+                dec_state->output_encoding_info.opsin_params.quant_biases,
+                qblock, block, group_dec_cache->scratch_space);
+          }
 
           for (size_t c : {1, 0, 2}) {
-            if ((sbx[c] << hshift[c] != bx) || (sby[c] << vshift[c] != by)) {
-              continue;
-            }
+            if (!has_block[c]) continue;
             // IDCT
             float* JXL_RESTRICT idct_pos = idct_row[c] + sbx[c] * kBlockDim;
             TransformToPixels(acs.Strategy(), block + c * size, idct_pos,
@@ -464,9 +753,21 @@ HWY_AFTER_NAMESPACE();
 #if HWY_ONCE
 namespace jxl {
 namespace {
+// Reads a token of the AC coefficients. Streams of the fastest decoding speed
+// tiers use prefix codes, which have their own path.
+template <bool uses_lz77, bool prefix_code>
+JXL_INLINE size_t ReadACToken(size_t ctx, BitReader* JXL_RESTRICT br,
+                              ANSSymbolReader* JXL_RESTRICT decoder,
+                              const std::vector<uint8_t>& context_map) {
+  if (prefix_code) {
+    return decoder->ReadHybridUintPrefixCodeInlined(ctx, br, context_map);
+  }
+  return decoder->ReadHybridUintInlined<uses_lz77>(ctx, br, context_map);
+}
+
 // Decode quantized AC coefficients of DCT blocks.
 // LLF components in the output block will not be modified.
-template <ACType ac_type, bool uses_lz77>
+template <ACType ac_type, bool uses_lz77, bool prefix_code>
 Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
                         int32_t* JXL_RESTRICT row_nzeros,
                         const int32_t* JXL_RESTRICT row_nzeros_top,
@@ -478,7 +779,7 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
                         const std::vector<uint8_t>& context_map,
                         const uint8_t* qdc_row, const int32_t* qf_row,
                         const BlockCtxMap& block_ctx_map, ACPtr block,
-                        size_t shift = 0) {
+                        size_t* JXL_RESTRICT num_nzeros, size_t shift = 0) {
   // Equal to number of LLF coefficients.
   const size_t covered_blocks = 1 << log2_covered_blocks;
   const size_t size = covered_blocks * kDCTBlockSize;
@@ -493,13 +794,14 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
   const int32_t nzero_ctx =
       block_ctx_map.NonZeroContext(predicted_nzeros, block_ctx) + ctx_offset;
 
-  size_t nzeros =
-      decoder->ReadHybridUintInlined<uses_lz77>(nzero_ctx, br, context_map);
+  size_t nzeros = ReadACToken<uses_lz77, prefix_code>(nzero_ctx, br, decoder,
+                                                      context_map);
   if (nzeros > size - covered_blocks) {
     return JXL_FAILURE("Invalid AC: nzeros %" PRIuS " too large for %" PRIuS
                        " 8x8 blocks",
                        nzeros, covered_blocks);
   }
+  *num_nzeros += nzeros;
   for (size_t y = 0; y < acs.covered_blocks_y(); y++) {
     for (size_t x = 0; x < acs.covered_blocks_x(); x++) {
       row_nzeros[bx + x + y * nzeros_stride] =
@@ -516,7 +818,7 @@ Status DecodeACVarBlock(size_t ctx_offset, size_t log2_covered_blocks,
         histo_offset + ZeroDensityContext(nzeros, k, covered_blocks,
                                           log2_covered_blocks, prev);
     const size_t u_coeff =
-        decoder->ReadHybridUintInlined<uses_lz77>(ctx, br, context_map);
+        ReadACToken<uses_lz77, prefix_code>(ctx, br, decoder, context_map);
     // Hand-rolled version of UnpackSigned, shifting before the conversion to
     // signed integer to avoid undefined behavior of shifting negative numbers.
     const size_t magnitude = u_coeff >> 1;
@@ -563,10 +865,11 @@ struct GetBlockFromBitstream : public GetBlock {
   }
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
-    ;
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   size_t num_nzeros[3]) override {
     for (size_t c : {1, 0, 2}) {
+      // The coefficients of earlier passes are already in the block.
+      num_nzeros[c] = has_earlier_passes ? size : 0;
       size_t sbx = bx >> hshift[c];
       size_t sby = by >> vshift[c];
       if (JXL_UNLIKELY((sbx << hshift[c] != bx) || (sby << vshift[c] != by))) {
@@ -574,18 +877,22 @@ struct GetBlockFromBitstream : public GetBlock {
       }
 
       for (size_t pass = 0; JXL_UNLIKELY(pass < num_passes); pass++) {
+        const bool k16 = ac_type == ACType::k16;
         auto decode_ac_varblock =
             decoders[pass].UsesLZ77()
-                ? (ac_type == ACType::k16 ? DecodeACVarBlock<ACType::k16, 1>
-                                          : DecodeACVarBlock<ACType::k32, 1>)
-                : (ac_type == ACType::k16 ? DecodeACVarBlock<ACType::k16, 0>
-                                          : DecodeACVarBlock<ACType::k32, 0>);
+                ? (k16 ? DecodeACVarBlock<ACType::k16, 1, 0>
+                       : DecodeACVarBlock<ACType::k32, 1, 0>)
+            : decoders[pass].UsesPrefixCode()
+                ? (k16 ? DecodeACVarBlock<ACType::k16, 0, 1>
+                       : DecodeACVarBlock<ACType::k32, 0, 1>)
+                : (k16 ? DecodeACVarBlock<ACType::k16, 0, 0>
+                       : DecodeACVarBlock<ACType::k32, 0, 0>);
         JXL_RETURN_IF_ERROR(decode_ac_varblock(
             ctx_offset[pass], log2_covered_blocks, row_nzeros[pass][c],
             row_nzeros_top[pass][c], nzeros_stride, c, sbx, sby, bx, acs,
             &coeff_orders[pass * coeff_order_size], readers[pass],
             &decoders[pass], context_map[pass], quant_dc_row, qf_row,
-            *block_ctx_map, block[c], shift_for_pass[pass]));
+            *block_ctx_map, block[c], &num_nzeros[c], shift_for_pass[pass]));
       }
     }
     return true;
@@ -607,6 +914,7 @@ struct GetBlockFromBitstream : public GetBlock {
     readers = readers_;
     num_passes = num_passes_;
     shift_for_pass = frame_header.passes.shift + first_pass;
+    has_earlier_passes = first_pass != 0;
     group_dec_cache = group_dec_cache_;
     rect = rect_;
     block_ctx_map = &dec_state->shared->block_ctx_map;
@@ -645,6 +953,7 @@ struct GetBlockFromBitstream : public GetBlock {
   ANSSymbolReader decoders[kMaxNumPasses];
   BitReader* JXL_RESTRICT* JXL_RESTRICT readers;
   size_t num_passes;
+  bool has_earlier_passes;
   size_t ctx_offset[kMaxNumPasses];
   size_t nzeros_stride;
   int32_t* JXL_RESTRICT row_nzeros[kMaxNumPasses][3];
@@ -663,10 +972,11 @@ struct GetBlockFromEncoder : public GetBlock {
   void StartRow(size_t by) override {}
 
   Status LoadBlock(size_t bx, size_t by, const AcStrategy& acs, size_t size,
-                   size_t log2_covered_blocks, ACPtr block[3],
-                   ACType ac_type) override {
+                   size_t log2_covered_blocks, ACPtr block[3], ACType ac_type,
+                   size_t num_nzeros[3]) override {
     JXL_ENSURE(ac_type == ACType::k32);
     for (size_t c = 0; c < 3; c++) {
+      num_nzeros[c] = size;
       // for each pass
       for (size_t i = 0; i < quantized_ac->size(); i++) {
         for (size_t k = 0; k < size; k++) {
@@ -10,6 +10,7 @@
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/huffman_table.h"
 
@@ -23,7 +24,21 @@ struct HuffmanDecodingData {
   // Returns false if the Huffman code lengths can not de decoded.
   bool ReadFromBitStream(size_t alphabet_size, BitReader* br);
 
-  uint16_t ReadSymbol(BitReader* br) const;
+  // Decodes the next Huffman coded symbol from the bit-stream. Inline, since
+  // it is called for every symbol of prefix-coded streams.
+  JXL_INLINE uint16_t ReadSymbol(BitReader* br) const {
+    const HuffmanCode* table = table_.data();
+    table += br->PeekBits(kHuffmanTableBits);
+    size_t n_bits = table->bits;
+    if (n_bits > kHuffmanTableBits) {
+      br->Consume(kHuffmanTableBits);
+      n_bits -= kHuffmanTableBits;
+      table += table->value;
+      table += br->PeekBits(n_bits);
+    }
+    br->Consume(table->bits);
+    return table->value;
+  }
 
   std::vector<HuffmanCode> table_;
 };
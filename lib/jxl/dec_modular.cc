@@ -6,16 +6,19 @@
 #include "lib/jxl/dec_modular.h"
 
 #include <jxl/memory_manager.h>
+#include <jxl/types.h>
 
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 #include <utility>
 #include <vector>
 
 #include "lib/jxl/ac_strategy.h"
 #include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/chroma_from_luma.h"
@@ -112,6 +115,25 @@ HWY_EXPORT(MultiplySum);       // Local function
 HWY_EXPORT(RgbFromSingle);     // Local function
 HWY_EXPORT(SingleFromSingle);  // Local function
 
+namespace {
+
+// Whether each group can undo `transforms` on its own samples: RCTs only read
+// the channels of the same pixel and palettes without deltas also read the
+// palette, while Squeeze and delta palettes read neighbouring samples.
+bool UndoablePerGroup(const std::vector<Transform>& transforms) {
+  for (const Transform& t : transforms) {
+    if (t.id == TransformId::kRCT) continue;
+    if (t.id == TransformId::kPalette && t.nb_deltas == 0 &&
+        t.predictor == Predictor::Zero) {
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
 // Slow conversion using double precision multiplication, only
 // needed when the bit depth is too high for single precision
 void SingleFromSingleAccurate(const size_t xsize,
@@ -295,26 +317,130 @@ Status ModularFrameDecoder::DecodeGlobalInfo(BitReader* reader,
       have_something = true;
   }
   // move global transforms to groups if possible
-  if (!have_something && all_same_shift) {
-    if (gi.transform.size() == 1 && gi.transform[0].id == TransformId::kRCT) {
-      global_transform = gi.transform;
-      gi.transform.clear();
-      // TODO(jon): also move no-delta-palette out (trickier though)
-    }
+  if (!have_something && all_same_shift && UndoablePerGroup(gi.transform)) {
+    global_transform = gi.transform;
+    gi.transform.clear();
   }
   full_image = std::move(gi);
   JXL_DEBUG_V(6, "DecodeGlobalInfo: full_image (with transforms) %s",
               full_image.DebugString().c_str());
+  JXL_RETURN_IF_ERROR(InitCompactChannels(metadata));
   return dec_status;
 }
 
+Status ModularFrameDecoder::InitCompactChannels(
+    const ImageMetadata& metadata) {
+  compact_channels_.clear();
+  // Such frames drop full_image, see MaybeDropFullImage.
+  if (full_image.transform.empty() && !have_something && all_same_shift) {
+    return true;
+  }
+  // Transforms such as RCT and Squeeze add a bit or two to the samples, which
+  // thus mostly fit in int16 for up to 13 bits per sample. The groups whose
+  // samples do not fit keep them aside.
+  bool fp = metadata.bit_depth.floating_point_sample;
+  uint32_t bits = metadata.bit_depth.bits_per_sample;
+  for (const ExtraChannelInfo& eci : metadata.extra_channel_info) {
+    fp = fp || eci.bit_depth.floating_point_sample;
+    bits = std::max(bits, eci.bit_depth.bits_per_sample);
+  }
+  if (fp || bits > 13) return true;
+
+  // The groups decode the channels from the first bigger-than-groupsize
+  // non-metachannel, see DecodeGroup.
+  size_t c = full_image.nb_meta_channels;
+  for (; c < full_image.channel.size(); c++) {
+    const Channel& fc = full_image.channel[c];
+    if (fc.w > frame_dim.group_dim || fc.h > frame_dim.group_dim) break;
+  }
+  const size_t num_groups =
+      std::max(frame_dim.num_groups, frame_dim.num_dc_groups);
+  compact_channels_.resize(full_image.channel.size());
+  for (; c < full_image.channel.size(); c++) {
+    Channel& fc = full_image.channel[c];
+    if (fc.w == 0 || fc.h == 0) continue;
+    CompactChannel& compact = compact_channels_[c];
+    JXL_ASSIGN_OR_RETURN(compact.plane,
+                         Plane<int16_t>::Create(memory_manager_, fc.w, fc.h));
+    compact.overflow.resize(num_groups);
+    fc.plane = Plane<pixel_type>();
+  }
+  return true;
+}
+
+Status ModularFrameDecoder::StoreGroupChannel(size_t c, const Rect& rect,
+                                              size_t group_id,
+                                              const Plane<pixel_type>* from) {
+  const Rect from_rect(0, 0, rect.xsize(), rect.ysize());
+  if (c >= compact_channels_.size() ||
+      compact_channels_[c].plane.xsize() == 0) {
+    Channel& fc = full_image.channel[c];
+    if (from) return CopyImageTo(from_rect, *from, rect, &fc.plane);
+    for (size_t y = 0; y < rect.ysize(); ++y) {
+      pixel_type* const JXL_RESTRICT row_out = rect.Row(&fc.plane, y);
+      memset(row_out, 0, rect.xsize() * sizeof(*row_out));
+    }
+    return true;
+  }
+  CompactChannel& compact = compact_channels_[c];
+  JXL_ENSURE(group_id < compact.overflow.size());
+  std::pair<Rect, Plane<pixel_type>>& overflow = compact.overflow[group_id];
+  bool fits = true;
+  for (size_t y = 0; y < rect.ysize() && fits; ++y) {
+    int16_t* const JXL_RESTRICT row_out = rect.Row(&compact.plane, y);
+    if (!from) {
+      memset(row_out, 0, rect.xsize() * sizeof(*row_out));
+      continue;
+    }
+    const pixel_type* const JXL_RESTRICT row_in = from->ConstRow(y);
+    pixel_type min = 0;
+    pixel_type max = 0;
+    for (size_t x = 0; x < rect.xsize(); ++x) {
+      row_out[x] = static_cast<int16_t>(row_in[x]);
+      min = std::min(min, row_in[x]);
+      max = std::max(max, row_in[x]);
+    }
+    fits = min >= std::numeric_limits<int16_t>::min() &&
+           max <= std::numeric_limits<int16_t>::max();
+  }
+  if (fits) {
+    // Replaces the samples of an earlier, zero-filled, decoding of the group.
+    overflow.second = Plane<pixel_type>();
+    return true;
+  }
+  JXL_ASSIGN_OR_RETURN(overflow.second,
+                       Plane<pixel_type>::Create(memory_manager_, rect.xsize(),
+                                                 rect.ysize()));
+  overflow.first = rect;
+  return CopyImageTo(*from, &overflow.second);
+}
+
+Status ModularFrameDecoder::ExpandCompactChannel(size_t c,
+                                                 Plane<pixel_type>* to) const {
+  const CompactChannel& compact = compact_channels_[c];
+  JXL_ENSURE(SameSize(compact.plane, *to));
+  for (size_t y = 0; y < to->ysize(); ++y) {
+    const int16_t* const JXL_RESTRICT row_in = compact.plane.ConstRow(y);
+    pixel_type* const JXL_RESTRICT row_out = to->Row(y);
+    for (size_t x = 0; x < to->xsize(); ++x) row_out[x] = row_in[x];
+  }
+  for (const auto& overflow : compact.overflow) {
+    if (overflow.second.xsize() == 0) continue;
+    JXL_RETURN_IF_ERROR(CopyImageTo(Rect(overflow.second), overflow.second,
+                                    overflow.first, to));
+  }
+  return true;
+}
+
 void ModularFrameDecoder::MaybeDropFullImage() {
   if (full_image.transform.empty() && !have_something && all_same_shift) {
     use_full_image = false;
     JXL_DEBUG_V(6, "Dropping full image");
-    for (auto& ch : full_image.channel) {
+    // Keep the palettes, which the groups need to undo global_transform.
+    for (size_t c = full_image.nb_meta_channels; c < full_image.channel.size();
+         c++) {
       // keep metadata on channels around, but dealloc their planes
-      ch.plane = Plane<pixel_type>();
+      full_image.channel[c].plane = Plane<pixel_type>();
     }
   }
 }
@@ -323,7 +449,7 @@ Status ModularFrameDecoder::DecodeGroup(
     const FrameHeader& frame_header, const Rect& rect, BitReader* reader,
     int minShift, int maxShift, const ModularStreamId& stream, bool zerofill,
     PassesDecoderState* dec_state, RenderPipelineInput* render_pipeline_input,
-    bool allow_truncated, bool* should_run_pipeline) {
+    bool allow_truncated, jxl::ThreadPool* pool, bool* should_run_pipeline) {
   JXL_DEBUG_V(6, "Decoding %s with rect %s and shift bracket %d..%d %s",
               stream.DebugString().c_str(), Description(rect).c_str(), minShift,
               maxShift, zerofill ? "using zerofill" : "");
@@ -349,10 +475,7 @@ Status ModularFrameDecoder::DecodeGroup(
            rect.xsize() >> fc.hshift, rect.ysize() >> fc.vshift, fc.w, fc.h);
     if (r.xsize() == 0 || r.ysize() == 0) continue;
     if (zerofill && use_full_image) {
-      for (size_t y = 0; y < r.ysize(); ++y) {
-        pixel_type* const JXL_RESTRICT row_out = r.Row(&fc.plane, y);
-        memset(row_out, 0, r.xsize() * sizeof(*row_out));
-      }
+      JXL_RETURN_IF_ERROR(StoreGroupChannel(c, r, stream.group_id, nullptr));
     } else {
       JXL_ASSIGN_OR_RETURN(
           Channel gc, Channel::Create(memory_manager_, r.xsize(), r.ysize()));
@@ -381,18 +504,33 @@ Status ModularFrameDecoder::DecodeGroup(
   if (!zerofill) {
     auto status = ModularGenericDecompress(
         reader, gi, /*header=*/nullptr, stream.ID(frame_dim), &options,
-        /*undo_transforms=*/true, &tree, &code, &context_map, allow_truncated);
+        /*undo_transforms=*/true, &tree, &code, &context_map, allow_truncated,
+        pool);
     if (!allow_truncated) JXL_RETURN_IF_ERROR(status);
     if (status.IsFatalError()) return status;
   }
   // Undo global transforms that have been pushed to the group level
   if (!use_full_image) {
     JXL_ENSURE(render_pipeline_input);
-    for (const auto& t : global_transform) {
-      JXL_RETURN_IF_ERROR(t.Inverse(gi, global_header.wp_header));
+    // Without small channels, the group channels start right after the meta
+    // channels, so that the channel indices of the transforms still hold once
+    // the palettes are put in front of them.
+    JXL_ENSURE(beginc == full_image.nb_meta_channels);
+    for (size_t i = 0; i < full_image.nb_meta_channels; i++) {
+      const Channel& fc = full_image.channel[i];
+      JXL_ASSIGN_OR_RETURN(Channel meta,
+                           Channel::Create(memory_manager_, fc.w, fc.h,
+                                           fc.hshift, fc.vshift));
+      JXL_RETURN_IF_ERROR(CopyImageTo(fc.plane, &meta.plane));
+      gi.channel.insert(gi.channel.begin() + i, std::move(meta));
+    }
+    gi.nb_meta_channels = full_image.nb_meta_channels;
+    for (auto t = global_transform.rbegin(); t != global_transform.rend();
+         ++t) {
+      JXL_RETURN_IF_ERROR(t->Inverse(gi, global_header.wp_header, pool));
     }
     JXL_RETURN_IF_ERROR(ModularImageToDecodedRect(
-        frame_header, gi, dec_state, nullptr, *render_pipeline_input,
+        frame_header, gi, dec_state, pool, *render_pipeline_input,
         Rect(0, 0, gi.w, gi.h)));
     return true;
   }
@@ -407,9 +545,7 @@ Status ModularFrameDecoder::DecodeGroup(
     if (r.xsize() == 0 || r.ysize() == 0) continue;
     JXL_ENSURE(use_full_image);
     JXL_RETURN_IF_ERROR(
-        CopyImageTo(/*rect_from=*/Rect(0, 0, r.xsize(), r.ysize()),
-                    /*from=*/gi.channel[gic].plane,
-                    /*rect_to=*/r, /*to=*/&fc.plane));
+        StoreGroupChannel(c, r, stream.group_id, &gi.channel[gic].plane));
     gic++;
   }
   return true;
@@ -552,6 +688,96 @@ Status ModularFrameDecoder::DecodeAcMetadata(const FrameHeader& frame_header,
   return true;
 }
 
+// Stores the samples of `row_in`, clamped to [0, max_value], as every
+// `num_channels`-th sample of type T of `row_out`, or `max_value` if `row_in`
+// is null.
+template <typename T>
+void StoreInterleavedSamples(const pixel_type* JXL_RESTRICT row_in,
+                             size_t xsize, size_t num_channels,
+                             pixel_type max_value, bool swap_endianness,
+                             uint8_t* JXL_RESTRICT row_out) {
+  const size_t step = num_channels * sizeof(T);
+  for (size_t x = 0; x < xsize; x++) {
+    const pixel_type v =
+        row_in ? Clamp1<pixel_type>(row_in[x], 0, max_value) : max_value;
+    T sample = static_cast<T>(v);
+    if (swap_endianness) sample = static_cast<T>(JXL_BSWAP16(sample));
+    memcpy(row_out + x * step, &sample, sizeof(T));
+  }
+}
+
+Status ModularFrameDecoder::ModularImageToOutput(
+    const FrameHeader& frame_header, const Image& gi,
+    const PassesDecoderState& dec_state, jxl::ThreadPool* pool,
+    size_t group_id, Rect modular_rect) const {
+  const auto* metadata = frame_header.nonserialized_metadata;
+  const ImageOutput& output = dec_state.main_output;
+  const size_t num_channels = output.format.num_channels;
+  const size_t num_color = num_channels < 3 ? 1 : 3;
+  const bool want_alpha = (num_channels == 2 || num_channels == 4);
+  const size_t sample_size =
+      output.format.data_type == JXL_TYPE_UINT8 ? 1 : sizeof(uint16_t);
+  const bool swap_endianness =
+      sample_size != 1 && SwapEndianness(output.format.endianness);
+  const pixel_type max_value = (1u << output.bits_per_sample) - 1;
+
+  // The modular channel of each output channel, or null for opaque alpha.
+  const Channel* channels[4] = {};
+  for (size_t c = 0; c < num_color; c++) {
+    JXL_ENSURE(c < gi.channel.size());
+    channels[c] = &gi.channel[c];
+  }
+  if (want_alpha) {
+    for (size_t ec = 0; ec < metadata->m.num_extra_channels; ec++) {
+      if (metadata->m.extra_channel_info[ec].type == ExtraChannel::kAlpha) {
+        JXL_ENSURE(num_color + ec < gi.channel.size());
+        channels[num_color] = &gi.channel[num_color + ec];
+        break;
+      }
+    }
+  }
+  const Rect r = dec_state.shared->frame_dim.GroupRect(group_id);
+  Rect mr[4];
+  for (size_t c = 0; c < num_channels; c++) {
+    if (!channels[c]) continue;
+    const Channel& ch_in = *channels[c];
+    JXL_ENSURE(ch_in.hshift == 0 && ch_in.vshift == 0);
+    mr[c] = modular_rect.Crop(ch_in.plane);
+    if (r.ysize() != mr[c].ysize() || r.xsize() != mr[c].xsize()) {
+      return JXL_FAILURE("Dimension mismatch: trying to fit a %" PRIuS
+                         "x%" PRIuS
+                         " modular channel into "
+                         "a %" PRIuS "x%" PRIuS " rect",
+                         mr[c].xsize(), mr[c].ysize(), r.xsize(), r.ysize());
+    }
+  }
+
+  const auto process_row = [&](const uint32_t task,
+                               size_t /* thread */) -> Status {
+    const size_t y = task;
+    uint8_t* JXL_RESTRICT row_out = static_cast<uint8_t*>(output.buffer) +
+                                    (r.y0() + y) * output.stride +
+                                    r.x0() * num_channels * sample_size;
+    for (size_t c = 0; c < num_channels; c++) {
+      const pixel_type* JXL_RESTRICT row_in =
+          channels[c] ? mr[c].ConstRow(channels[c]->plane, y) : nullptr;
+      if (sample_size == 1) {
+        StoreInterleavedSamples<uint8_t>(row_in, r.xsize(), num_channels,
+                                         max_value, swap_endianness,
+                                         row_out + c);
+      } else {
+        StoreInterleavedSamples<uint16_t>(row_in, r.xsize(), num_channels,
+                                          max_value, swap_endianness,
+                                          row_out + c * sample_size);
+      }
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, r.ysize(), ThreadPool::NoInit,
+                                process_row, "ModularToOutput"));
+  return true;
+}
+
 Status ModularFrameDecoder::ModularImageToDecodedRect(
     const FrameHeader& frame_header, Image& gi, PassesDecoderState* dec_state,
     jxl::ThreadPool* pool, RenderPipelineInput& render_pipeline_input,
@@ -559,6 +785,12 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
   const auto* metadata = frame_header.nonserialized_metadata;
   JXL_ENSURE(gi.transform.empty());
 
+  if (dec_state->direct_modular_output) {
+    return ModularImageToOutput(frame_header, gi, *dec_state, pool,
+                                render_pipeline_input.group_id(),
+                                modular_rect);
+  }
+
   auto get_row = [&](size_t c, size_t y) {
     const auto& buffer = render_pipeline_input.GetBuffer(c);
     return buffer.second.Row(buffer.first, y);
@@ -687,6 +919,9 @@ Status ModularFrameDecoder::ModularImageToDecodedRect(
   }
   size_t num_extra_channels = metadata->m.num_extra_channels;
   for (size_t ec = 0; ec < num_extra_channels; ec++, c++) {
+    // Extra channels that nothing renders, such as the alpha channel of an
+    // image decoded to RGB, have no pipeline buffer.
+    if (!dec_state->render_pipeline->IsChannelUsed(3 + ec)) continue;
     const ExtraChannelInfo& eci = metadata->m.extra_channel_info[ec];
     int bits = eci.bit_depth.bits_per_sample;
     int exp_bits = eci.bit_depth.exponent_bits_per_sample;
@@ -740,6 +975,14 @@ Status ModularFrameDecoder::FinalizeDecoding(const FrameHeader& frame_header,
   } else {
     JXL_ASSIGN_OR_RETURN(gi, Image::Clone(full_image));
   }
+  for (size_t c = 0; c < compact_channels_.size(); c++) {
+    if (compact_channels_[c].plane.xsize() == 0) continue;
+    Channel& ch = gi.channel[c];
+    JXL_ASSIGN_OR_RETURN(ch.plane,
+                         Plane<pixel_type>::Create(memory_manager, ch.w, ch.h));
+    JXL_RETURN_IF_ERROR(ExpandCompactChannel(c, &ch.plane));
+    if (inplace) compact_channels_[c] = CompactChannel();
+  }
   size_t xsize = gi.w;
   size_t ysize = gi.h;
 
@@ -11,6 +11,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
@@ -20,6 +21,8 @@
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/frame_header.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_metadata.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/modular_image.h"
@@ -91,6 +94,16 @@ struct ModularStreamId {
   std::string DebugString() const;
 };
 
+// Decodes the modular streams of a frame. How much memory it needs depends on
+// the global transforms of the frame:
+// - with no transforms, RCTs and palettes without deltas, and channels that
+//   are all larger than a group and have the same shift, each group undoes the
+//   transforms and is rendered as it is decoded, so that the decoder only
+//   keeps the palettes and the groups in flight (see MaybeDropFullImage);
+// - with Squeeze, delta palettes, subsampled or upsampled channels, or
+//   channels that fit in a group, the decoder keeps the samples of the whole
+//   frame until FinalizeDecoding, in int16 when they mostly fit (see
+//   InitCompactChannels) and in int32 otherwise.
 class ModularFrameDecoder {
  public:
   explicit ModularFrameDecoder(JxlMemoryManager* memory_manager)
@@ -103,7 +116,8 @@ class ModularFrameDecoder {
                      const ModularStreamId& stream, bool zerofill,
                      PassesDecoderState* dec_state,
                      RenderPipelineInput* render_pipeline_input,
-                     bool allow_truncated, bool* should_run_pipeline = nullptr);
+                     bool allow_truncated, jxl::ThreadPool* pool,
+                     bool* should_run_pipeline = nullptr);
   // Decodes a VarDCT DC group (`group_id`) from the given `reader`.
   Status DecodeVarDCTDC(const FrameHeader& frame_header, size_t group_id,
                         BitReader* reader, PassesDecoderState* dec_state);
@@ -135,6 +149,31 @@ class ModularFrameDecoder {
                                    jxl::ThreadPool* pool,
                                    RenderPipelineInput& render_pipeline_input,
                                    Rect modular_rect) const;
+  // Writes `modular_rect` of `gi`, the samples of group `group_id`, to the
+  // image buffer, see PassesDecoderState::direct_modular_output.
+  Status ModularImageToOutput(const FrameHeader& frame_header, const Image& gi,
+                              const PassesDecoderState& dec_state,
+                              jxl::ThreadPool* pool, size_t group_id,
+                              Rect modular_rect) const;
+
+  // Storage of a channel of full_image that the groups decode, as int16 while
+  // their samples fit, which halves the memory that frames with few bits per
+  // sample need until FinalizeDecoding. The plane of the channel is empty.
+  struct CompactChannel {
+    Plane<int16_t> plane;
+    // Rect and samples of each DC or AC group that does not fit, by group id.
+    std::vector<std::pair<Rect, Plane<pixel_type>>> overflow;
+  };
+  // Sets up compact_channels_ for the channels of full_image that the groups
+  // decode, if the bit depths in `metadata` leave enough headroom.
+  Status InitCompactChannels(const ImageMetadata& metadata);
+  // Stores the samples of `from`, or zeros if it is null, in `rect` of channel
+  // `c` of full_image, decoded by DC or AC group `group_id`.
+  Status StoreGroupChannel(size_t c, const Rect& rect, size_t group_id,
+                           const Plane<pixel_type>* from);
+  // Converts compact channel `c` to `to`, of the size of the channel.
+  Status ExpandCompactChannel(size_t c, Plane<pixel_type>* to) const;
+
   JxlMemoryManager* memory_manager_;
   Image full_image;
   std::vector<Transform> global_transform;
@@ -147,6 +186,9 @@ class ModularFrameDecoder {
   ANSCode code;
   std::vector<uint8_t> context_map;
   GroupHeader global_header;
+  // Indexed by channel of full_image, with an empty plane for the channels
+  // that are not compact.
+  std::vector<CompactChannel> compact_channels_;
 };
 
 }  // namespace jxl
@@ -185,6 +185,15 @@ int PatchDictionary::GetReferences() const {
   return result;
 }
 
+size_t PatchDictionary::NumPatchPixels() const {
+  size_t num_pixels = 0;
+  for (const PatchPosition& pos : positions_) {
+    const PatchReferencePosition& ref_pos = ref_positions_[pos.ref_pos_idx];
+    num_pixels += ref_pos.xsize * ref_pos.ysize;
+  }
+  return num_pixels;
+}
+
 namespace {
 struct PatchInterval {
   size_t idx;
@@ -348,6 +357,23 @@ Status PatchDictionary::AddOneRow(
               ref_pos.y0 + iy) +
           ref_pos.x0 + x0 - bx;
     }
+    bool all_add = true;
+    for (size_t i = 0; i < num_ec + 1; i++) {
+      all_add &= blendings_[blending_idx + i].mode == PatchBlendMode::kAdd;
+    }
+    if (all_add) {
+      // The common case of patches that are added to the image: the channels
+      // are independent and the patch never aliases the row, so no temporary
+      // is needed.
+      for (size_t c = 0; c < 3 + num_ec; c++) {
+        float* JXL_RESTRICT row = inout[c];
+        const float* JXL_RESTRICT fg_row = fg_ptrs[c];
+        for (size_t x = patch_x0 - x0; x < patch_x1 - x0; x++) {
+          row[x] += fg_row[x];
+        }
+      }
+      continue;
+    }
     JXL_RETURN_IF_ERROR(PerformBlending(
         memory_manager_, inout, fg_ptrs.data(), inout, patch_x0 - x0,
         patch_x1 - patch_x0, blendings_[blending_idx],
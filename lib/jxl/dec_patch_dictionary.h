@@ -132,6 +132,10 @@ class PatchDictionary {
   // bit mask: bits 0-3 indicate reference frame 0-3.
   int GetReferences() const;
 
+  // Number of pixels covered by the patches, counting overlaps once for each
+  // patch.
+  size_t NumPatchPixels() const;
+
   std::vector<size_t> GetPatchesForRow(size_t y) const;
 
  private:
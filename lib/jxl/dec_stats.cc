@@ -0,0 +1,67 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/dec_stats.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace jxl {
+
+size_t DecoderStats::StageIndex(const char* name) {
+  for (size_t i = 0; i < stages_.size(); i++) {
+    if (stages_[i].name == name) return i;
+  }
+  stages_.emplace_back(name);
+  return stages_.size() - 1;
+}
+
+uint64_t DecoderStats::StagesTime(const char* prefix) const {
+  uint64_t total = 0;
+  for (const Stage& stage : stages_) {
+    if (stage.name.compare(0, std::char_traits<char>::length(prefix), prefix) ==
+        0) {
+      total += stage.ns.load(std::memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+uint64_t DecoderStats::StagesCount(size_t counter, const char* prefix) const {
+  uint64_t total = 0;
+  for (const Stage& stage : stages_) {
+    if (stage.name.compare(0, std::char_traits<char>::length(prefix), prefix) ==
+        0) {
+      total += stage.counts[counter].load(std::memory_order_relaxed);
+    }
+  }
+  return total;
+}
+
+void DecoderStats::Merge(const DecoderStats& other) {
+  for (size_t i = 0; i < kNumPhases; i++) {
+    phase_ns_[i].fetch_add(other.phase_ns_[i].load(std::memory_order_relaxed),
+                           std::memory_order_relaxed);
+    for (size_t j = 0; j < kMaxCounters; j++) {
+      phase_counts_[i][j].fetch_add(
+          other.phase_counts_[i][j].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+  }
+  for (const Stage& stage : other.stages_) {
+    Stage& merged = stages_[StageIndex(stage.name.c_str())];
+    merged.ns.fetch_add(stage.ns.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+    for (size_t j = 0; j < kMaxCounters; j++) {
+      merged.counts[j].fetch_add(
+          stage.counts[j].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+  }
+  AddBytes(other.bytes_allocated_, other.peak_bytes_);
+}
+
+}  // namespace jxl
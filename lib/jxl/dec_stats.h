@@ -0,0 +1,143 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_DEC_STATS_H_
+#define LIB_JXL_DEC_STATS_H_
+
+// Time spent by the decoder in each of its phases and render pipeline stages,
+// and optionally counts of events such as cache misses, collected when the
+// user asks for it with JxlDecoderCollectStats.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+namespace jxl {
+
+class DecoderStats {
+ public:
+  enum Phase {
+    kTotal,
+    kDcGlobal,
+    kDcGroups,
+    kAcGlobal,
+    kAcGroups,
+    kFinalize,
+    kNumPhases
+  };
+
+  // Same as JXL_DEC_STATS_MAX_COUNTERS.
+  static constexpr size_t kMaxCounters = 8;
+  // Reads the counters of the calling thread, see SetCounters.
+  using CounterReader = void (*)(void* opaque, uint64_t* values);
+
+  struct Stage {
+    explicit Stage(const char* name) : name(name) {}
+    std::string name;
+    std::atomic<uint64_t> ns{0};
+    std::atomic<uint64_t> counts[kMaxCounters] = {};
+  };
+
+  // Time and counters at the start of a timed part of the decoding.
+  struct Start {
+    uint64_t ns = 0;
+    uint64_t counts[kMaxCounters] = {};
+  };
+
+  // Monotonic time in nanoseconds.
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Makes Begin, AddTime and AddStageTime also measure `num_counters` counters
+  // read by `reader`, such as hardware performance counters. Must be called
+  // before the decoder uses these stats.
+  void SetCounters(size_t num_counters, CounterReader reader, void* opaque) {
+    num_counters_ = num_counters;
+    counter_reader_ = reader;
+    counter_opaque_ = opaque;
+  }
+  size_t num_counters() const { return num_counters_; }
+
+  // Returns the time and counters now, on the calling thread.
+  Start Begin() const {
+    Start start;
+    start.ns = Now();
+    if (num_counters_ != 0) counter_reader_(counter_opaque_, start.counts);
+    return start;
+  }
+
+  // Adds the time and counters since `start`, a value of Begin() on the same
+  // thread, to `phase`. May be called from any thread.
+  void AddTime(Phase phase, const Start& start) {
+    phase_ns_[phase].fetch_add(Now() - start.ns, std::memory_order_relaxed);
+    AddCounts(start, phase_counts_[phase]);
+  }
+  uint64_t PhaseTime(Phase phase) const {
+    return phase_ns_[phase].load(std::memory_order_relaxed);
+  }
+  uint64_t PhaseCount(Phase phase, size_t counter) const {
+    return phase_counts_[phase][counter].load(std::memory_order_relaxed);
+  }
+
+  // Returns the index of the stage called `name`, adding it if it is new. Must
+  // not be called concurrently with itself, which the decoder only does when it
+  // builds render pipelines.
+  size_t StageIndex(const char* name);
+
+  // Adds the time and counters since `start` to stage `index`. May be called
+  // from any thread.
+  void AddStageTime(size_t index, const Start& start) {
+    stages_[index].ns.fetch_add(Now() - start.ns, std::memory_order_relaxed);
+    AddCounts(start, stages_[index].counts);
+  }
+  const std::deque<Stage>& stages() const { return stages_; }
+
+  // Sum of the times of the stages whose name starts with `prefix`.
+  uint64_t StagesTime(const char* prefix = "") const;
+  // Sum of the counts of `counter` of the same stages.
+  uint64_t StagesCount(size_t counter, const char* prefix = "") const;
+
+  // Adds the bytes allocated through the memory budget of the decoder since
+  // the last call, and keeps the highest of the peaks.
+  void AddBytes(uint64_t allocated, uint64_t peak) {
+    bytes_allocated_ += allocated;
+    if (peak > peak_bytes_) peak_bytes_ = peak;
+  }
+  uint64_t bytes_allocated() const { return bytes_allocated_; }
+  uint64_t peak_bytes() const { return peak_bytes_; }
+
+  // Adds the times and bytes of `other`, matching the stages by name.
+  void Merge(const DecoderStats& other);
+
+ private:
+  void AddCounts(const Start& start, std::atomic<uint64_t>* counts) const {
+    if (num_counters_ == 0) return;
+    uint64_t now[kMaxCounters];
+    counter_reader_(counter_opaque_, now);
+    for (size_t i = 0; i < num_counters_; i++) {
+      counts[i].fetch_add(now[i] - start.counts[i], std::memory_order_relaxed);
+    }
+  }
+
+  std::atomic<uint64_t> phase_ns_[kNumPhases] = {};
+  std::atomic<uint64_t> phase_counts_[kNumPhases][kMaxCounters] = {};
+  size_t num_counters_ = 0;
+  CounterReader counter_reader_ = nullptr;
+  void* counter_opaque_ = nullptr;
+  // A deque, since stages are not movable.
+  std::deque<Stage> stages_;
+  uint64_t bytes_allocated_ = 0;
+  uint64_t peak_bytes_ = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_DEC_STATS_H_
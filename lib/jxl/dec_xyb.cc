@@ -177,6 +177,16 @@ Status OutputEncodingInfo::MaybeSetColorEncoding(
   return SetColorEncoding(c_desired);
 }
 
+bool OutputEncodingInfo::CanConvertFromLinearWithoutCms() const {
+  if (color_encoding.IsCMYK() || !CanOutputToColorEncoding(color_encoding)) {
+    return false;
+  }
+  // The CMS encodes PQ relative to the desired intensity target, the render
+  // pipeline relative to the original one.
+  return !color_encoding.Tf().IsPQ() ||
+         desired_intensity_target == orig_intensity_target;
+}
+
 Status OutputEncodingInfo::SetColorEncoding(const ColorEncoding& c_desired) {
   color_encoding = c_desired;
   linear_color_encoding = color_encoding;
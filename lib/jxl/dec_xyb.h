@@ -71,6 +71,11 @@ struct OutputEncodingInfo {
   Status SetFromMetadata(const CodecMetadata& metadata);
   Status MaybeSetColorEncoding(const ColorEncoding& c_desired);
 
+  // Whether color_encoding is described by its fields, so that the conversion
+  // from linear_color_encoding, which only applies its transfer function, can
+  // be done without the CMS and gives the same results.
+  bool CanConvertFromLinearWithoutCms() const;
+
  private:
   Status SetColorEncoding(const ColorEncoding& c_desired);
 };
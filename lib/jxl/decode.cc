@@ -15,11 +15,14 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>  // NOLINT
 #include <utility>
 #include <vector>
 
@@ -27,11 +30,13 @@
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/dec_bit_reader.h"
 #include "lib/jxl/dec_cache.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 #include "lib/jxl/padded_bytes.h"
@@ -170,11 +175,20 @@ size_t BitsPerChannel(JxlDataType data_type) {
       return 32;
     case JXL_TYPE_FLOAT16:
       return 16;
+    case JXL_TYPE_UINT32_RGB10_A2:
+      return 10;
     default:
       return 0;  // signals unhandled JxlDataType
   }
 }
 
+// Size of one pixel of interleaved output without padding.
+size_t BytesPerPixel(const JxlPixelFormat& format) {
+  if (format.data_type == JXL_TYPE_UINT32_RGB10_A2) return 4;
+  return format.num_channels * BitsPerChannel(format.data_type) /
+         jxl::kBitsPerByte;
+}
+
 template <typename T>
 uint32_t GetBitDepth(JxlBitDepth bit_depth, const T& metadata,
                      JxlPixelFormat format) {
@@ -204,6 +218,7 @@ enum class FrameStage : uint32_t {
   kHeader,  // Must parse frame header.
   kTOC,     // Must parse TOC
   kFull,    // Must parse full pixels
+  kRows,    // Must deliver the remaining rows to the row callback
 };
 
 enum class BoxStage : uint32_t {
@@ -312,6 +327,99 @@ struct ExtraChannelOutput {
   size_t buffer_size;
 };
 
+// Delivers the rows of the image output to a JxlImageOutRowCallback in order,
+// top to bottom. The render pipeline produces row segments from any thread and
+// in group order, so the rows rendered ahead of the next row to deliver are
+// kept until they can be delivered.
+class OrderedRowOutput {
+ public:
+  void Init(JxlImageOutRowCallback callback, void* opaque, size_t xsize,
+            size_t ysize, size_t bytes_per_pixel) {
+    if (xsize != xsize_ || bytes_per_pixel != bytes_per_pixel_) {
+      free_rows_.clear();
+    }
+    callback_ = callback;
+    opaque_ = opaque;
+    xsize_ = xsize;
+    bytes_per_pixel_ = bytes_per_pixel;
+    rows_.clear();
+    rows_.resize(ysize);
+    missing_pixels_.assign(ysize, xsize);
+    next_row_ = 0;
+    paused_ = false;
+  }
+
+  // Run callback of the pixel callback of the frame. Thread-safe.
+  void Run(size_t x, size_t y, size_t num_pixels, const void* pixels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (y == next_row_ && !paused_ && num_pixels == xsize_) {
+      // Nothing to keep for rows rendered in one segment when they are due.
+      missing_pixels_[y] = 0;
+      Deliver(pixels);
+    } else {
+      std::vector<uint8_t>& row = rows_[y];
+      if (row.empty()) {
+        if (free_rows_.empty()) {
+          row.resize(xsize_ * bytes_per_pixel_);
+        } else {
+          row.swap(free_rows_.back());
+          free_rows_.pop_back();
+        }
+      }
+      memcpy(row.data() + x * bytes_per_pixel_, pixels,
+             num_pixels * bytes_per_pixel_);
+      missing_pixels_[y] -= num_pixels;
+    }
+    DeliverComplete();
+  }
+
+  // Delivers the complete rows that are due. Returns false if the callback
+  // asked to pause again.
+  bool Resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    paused_ = false;
+    DeliverComplete();
+    return !paused_;
+  }
+
+  bool paused() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return paused_;
+  }
+
+ private:
+  // Requires mutex_.
+  void Deliver(const void* pixels) {
+    paused_ = !callback_(opaque_, next_row_, pixels);
+    ++next_row_;
+  }
+
+  // Requires mutex_.
+  void DeliverComplete() {
+    while (!paused_ && next_row_ < rows_.size() &&
+           missing_pixels_[next_row_] == 0) {
+      std::vector<uint8_t>& row = rows_[next_row_];
+      Deliver(row.data());
+      free_rows_.emplace_back();
+      free_rows_.back().swap(row);
+    }
+  }
+
+  JxlImageOutRowCallback callback_ = nullptr;
+  void* opaque_ = nullptr;
+  size_t xsize_ = 0;
+  size_t bytes_per_pixel_ = 0;
+
+  std::mutex mutex_;
+  // Pixels of the rows rendered ahead of next_row_, empty for the others.
+  std::vector<std::vector<uint8_t>> rows_;
+  // Buffers of delivered rows, reused for later ones.
+  std::vector<std::vector<uint8_t>> free_rows_;
+  std::vector<size_t> missing_pixels_;
+  size_t next_row_ = 0;
+  bool paused_ = false;
+};
+
 }  // namespace
 
 namespace jxl {
@@ -358,11 +466,21 @@ typedef struct JxlDecoderFrameIndexBoxStruct {
 
 }  // namespace jxl
 
+struct JxlDecoderStatsStruct {
+  jxl::DecoderStats stats;
+};
+
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
 struct JxlDecoderStruct {
   JxlDecoderStruct() = default;
 
+  // Allocates through memory_budget from the memory manager of the user.
   JxlMemoryManager memory_manager;
+  jxl::MemoryBudget memory_budget;
+  // Allocates the state of the frames through frame_arena from
+  // memory_manager. Declared before everything that may hold its allocations.
+  jxl::MemoryArena frame_arena;
+  JxlMemoryManager frame_memory_manager;
   std::unique_ptr<jxl::ThreadPool> thread_pool;
 
   DecoderStage stage;
@@ -381,6 +499,11 @@ struct JxlDecoderStruct {
   bool got_all_headers;     // Codestream metadata headers.
   bool post_headers;        // Already decoding pixels.
   std::unique_ptr<jxl::ICCReader> icc_reader;
+  // ICC profile decoded from the input, and the size of the ICC stream up to
+  // the end of the headers, kept across JxlDecoderRewind so that decoding the
+  // same input again skips the decompression of the profile.
+  jxl::IccBytes rewind_icc;
+  size_t rewind_icc_stream_size;
   jxl::JxlDecoderFrameIndexBox frame_index_box;
   // This means either we actually got the preview image, or determined we
   // cannot get it or there is none.
@@ -425,7 +548,22 @@ struct JxlDecoderStruct {
   bool unpremul_alpha;
   bool render_spotcolors;
   bool coalescing;
+  bool render_on_demand;
+  bool gpu_rendering;
   float desired_intensity_target;
+  // Set with JxlDecoderSetGainMap, without values if there is none.
+  jxl::GainMap gain_map;
+  size_t output_downsampling;
+  bool jpeg_integer_idct;
+  // Region set with JxlDecoderSetCropRegion, empty if there is none.
+  uint32_t crop_x0;
+  uint32_t crop_y0;
+  uint32_t crop_xsize;
+  uint32_t crop_ysize;
+  // Set with JxlDecoderCollectStats, and memory_budget.allocated() when the
+  // bytes were last added to it.
+  JxlDecoderStats* stats = nullptr;
+  uint64_t stats_allocated = 0;
 
   // Bitfield, for which informative events (JXL_DEC_BASIC_INFO, etc...) the
   // decoder returns a status. By default, do not return for any of the events,
@@ -466,6 +604,20 @@ struct JxlDecoderStruct {
   JxlPixelFormat image_out_format;
   JxlBitDepth image_out_bit_depth;
 
+  // Set by JxlDecoderSetImageOutPlanes instead of image_out_buffer, with the
+  // strides of the planes resolved.
+  bool image_out_planar;
+  JxlPlanarImageOutBuffer image_out_planes;
+
+  // Set by JxlDecoderSetImageOutRowCallback, on top of the pixel callback that
+  // feeds row_output.
+  bool image_out_rows;
+  JxlImageOutRowCallback image_out_row_callback;
+  void* image_out_row_opaque;
+  // Whether row_output was initialized for the current frame.
+  bool row_output_started;
+  OrderedRowOutput row_output;
+
   // For extra channels. Empty if no extra channels are requested, and they are
   // reset each frame
   std::vector<ExtraChannelOutput> extra_channel_output;
@@ -507,6 +659,10 @@ struct JxlDecoderStruct {
   size_t internal_frames;
   size_t external_frames;
 
+  // Whether JxlDecoderRenderRegion can render parts of the frame of the last
+  // JXL_DEC_FULL_IMAGE event, i.e. until the next JxlDecoderProcessInput.
+  bool can_render_region;
+
   std::vector<FrameRef> frame_refs;
 
   // Translates external frame index to internal frame index. The external
@@ -670,6 +826,12 @@ struct JxlDecoderStruct {
 
 namespace {
 
+// Whether the pixels of the current frame go to a row callback.
+bool StreamsRows(const JxlDecoder* dec) {
+  return dec->image_out_buffer_set && dec->image_out_rows &&
+         !dec->preview_frame;
+}
+
 bool CheckSizeLimit(JxlDecoder* dec, size_t xsize, size_t ysize) {
   if (xsize == 0 || ysize == 0) return true;
   size_t padded_xsize = jxl::DivCeil(xsize, 32) * 32;
@@ -721,6 +883,7 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->recon_exif_size = 0;
   dec->recon_xmp_size = 0;
   dec->recon_output_jpeg = JpegReconStage::kNone;
+  dec->jpeg_decoder.ResetOutput();
 #endif
 
   dec->events_wanted = dec->orig_events_wanted;
@@ -736,6 +899,10 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->image_out_init_opaque = nullptr;
   dec->image_out_size = 0;
   dec->image_out_bit_depth.type = JXL_BIT_DEPTH_FROM_PIXEL_FORMAT;
+  dec->image_out_planar = false;
+  dec->image_out_rows = false;
+  dec->image_out_row_callback = nullptr;
+  dec->image_out_row_opaque = nullptr;
   dec->extra_channel_output.clear();
   dec->next_in = nullptr;
   dec->avail_in = 0;
@@ -743,6 +910,7 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
 
   dec->passes_state.reset();
   dec->frame_dec.reset();
+  dec->frame_arena.ReleaseFreeSlabs();
   dec->next_section = 0;
   dec->section_processed.clear();
 
@@ -764,6 +932,8 @@ void JxlDecoderRewindDecodingState(JxlDecoder* dec) {
   dec->skipping_frame = false;
   dec->internal_frames = 0;
   dec->external_frames = 0;
+  dec->can_render_region = false;
+  dec->memory_budget.ClearExceeded();
 }
 
 void JxlDecoderReset(JxlDecoder* dec) {
@@ -774,12 +944,25 @@ void JxlDecoderReset(JxlDecoder* dec) {
   dec->unpremul_alpha = false;
   dec->render_spotcolors = true;
   dec->coalescing = true;
+  dec->render_on_demand = false;
+  dec->gpu_rendering = false;
   dec->desired_intensity_target = 0;
+  dec->gain_map = jxl::GainMap();
+  dec->output_downsampling = 1;
+  dec->jpeg_integer_idct = false;
+  dec->memory_budget.SetLimit(0);
+  dec->crop_x0 = 0;
+  dec->crop_y0 = 0;
+  dec->crop_xsize = 0;
+  dec->crop_ysize = 0;
+  dec->stats = nullptr;
   dec->orig_events_wanted = 0;
   dec->events_wanted = 0;
   dec->frame_refs.clear();
   dec->frame_external_to_internal.clear();
   dec->frame_required.clear();
+  dec->rewind_icc.clear();
+  dec->rewind_icc_stream_size = 0;
   dec->decompress_boxes = false;
 }
 
@@ -793,7 +976,8 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
   if (!alloc) return nullptr;
   // Placement new constructor on allocated memory
   JxlDecoder* dec = new (alloc) JxlDecoder();
-  dec->memory_manager = local_memory_manager;
+  dec->memory_budget.Init(local_memory_manager, &dec->memory_manager);
+  dec->frame_arena.Init(dec->memory_manager, &dec->frame_memory_manager);
 
   JxlDecoderReset(dec);
 
@@ -802,7 +986,7 @@ JxlDecoder* JxlDecoderCreate(const JxlMemoryManager* memory_manager) {
 
 void JxlDecoderDestroy(JxlDecoder* dec) {
   if (dec) {
-    JxlMemoryManager local_memory_manager = dec->memory_manager;
+    JxlMemoryManager local_memory_manager = dec->memory_budget.inner();
     // Call destructor directly since custom free function is used.
     dec->~JxlDecoder();
     jxl::MemoryManagerFree(&local_memory_manager, dec);
@@ -811,6 +995,28 @@ void JxlDecoderDestroy(JxlDecoder* dec) {
 
 void JxlDecoderRewind(JxlDecoder* dec) { JxlDecoderRewindDecodingState(dec); }
 
+void JxlDecoderSoftReset(JxlDecoder* dec) {
+  std::unique_ptr<jxl::PassesDecoderState> previous =
+      std::move(dec->passes_state);
+  JxlDecoderRewindDecodingState(dec);
+  // Unlike on rewind, the next input is a different image.
+  dec->frame_refs.clear();
+  dec->frame_external_to_internal.clear();
+  dec->frame_required.clear();
+  dec->rewind_icc.clear();
+  dec->rewind_icc_stream_size = 0;
+  if (!previous) return;
+  dec->passes_state =
+      jxl::make_unique<jxl::PassesDecoderState>(&dec->frame_memory_manager);
+  dec->passes_state->ReuseFrameBuffers(previous.get());
+  const jxl::OutputEncodingInfo& info = previous->output_encoding_info;
+  if (info.cms_set) {
+    dec->passes_state->output_encoding_info.color_management_system =
+        info.color_management_system;
+    dec->passes_state->output_encoding_info.cms_set = true;
+  }
+}
+
 void JxlDecoderSkipFrames(JxlDecoder* dec, size_t amount) {
   // Increment amount, rather than set it: making the amount smaller is
   // impossible because the decoder may already have skipped frames required to
@@ -920,6 +1126,77 @@ JxlDecoderStatus JxlDecoderSetCoalescing(JxlDecoder* dec, JXL_BOOL coalescing) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetRenderOnDemand(JxlDecoder* dec,
+                                            JXL_BOOL render_on_demand) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set render on demand option before starting");
+  }
+  dec->render_on_demand = FROM_JXL_BOOL(render_on_demand);
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetGPURendering(JxlDecoder* dec,
+                                           JXL_BOOL gpu_rendering) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set GPU rendering option before starting");
+  }
+  dec->gpu_rendering = FROM_JXL_BOOL(gpu_rendering);
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetOutputDownsampling(JxlDecoder* dec,
+                                                 uint32_t factor) {
+  // The factor is given to the frame decoder when the output buffer of a frame
+  // is set, so it can change until the header of the first frame is read.
+  if (dec->internal_frames != 0) {
+    return JXL_API_ERROR("Must set output downsampling before the first frame");
+  }
+  if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+    return JXL_API_ERROR("Invalid output downsampling factor");
+  }
+  dec->output_downsampling = factor;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetJPEGIntegerIDCT(JxlDecoder* dec,
+                                              JXL_BOOL enabled) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set JPEG integer IDCT option before starting");
+  }
+  dec->jpeg_integer_idct = FROM_JXL_BOOL(enabled);
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetMemoryLimit(JxlDecoder* dec, uint64_t max_bytes) {
+  dec->memory_budget.SetLimit(max_bytes);
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderCollectStats(JxlDecoder* dec,
+                                        JxlDecoderStats* stats) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must collect stats before starting");
+  }
+  dec->stats = stats;
+  dec->stats_allocated = dec->memory_budget.allocated();
+  dec->memory_budget.ResetPeak();
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetCropRegion(JxlDecoder* dec, uint32_t x0,
+                                         uint32_t y0, uint32_t xsize,
+                                         uint32_t ysize) {
+  if (xsize == 0 || ysize == 0) {
+    xsize = 0;
+    ysize = 0;
+  }
+  dec->crop_x0 = x0;
+  dec->crop_y0 = y0;
+  dec->crop_xsize = xsize;
+  dec->crop_ysize = ysize;
+  return JXL_DEC_SUCCESS;
+}
+
 namespace {
 // helper function to get the dimensions of the current image buffer
 void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
@@ -940,8 +1217,72 @@ void GetCurrentDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
     }
   }
 }
+
+// Dimensions of the current image output, i.e. GetCurrentDimensions after
+// JxlDecoderSetOutputDownsampling.
+void GetOutputDimensions(const JxlDecoder* dec, size_t& xsize, size_t& ysize) {
+  GetCurrentDimensions(dec, xsize, ysize);
+  if (!dec->frame_header->nonserialized_is_preview) {
+    xsize = jxl::DivCeil(xsize, dec->output_downsampling);
+    ysize = jxl::DivCeil(ysize, dec->output_downsampling);
+  }
+}
+
+// Returns a region of the output image in the coordinates of the current frame
+// after upsampling, as used by FrameDecoder::SetCropRegion and RenderRegion.
+jxl::Rect GetRegionInFrame(const JxlDecoder* dec, size_t region_x0,
+                           size_t region_y0, size_t region_xsize,
+                           size_t region_ysize) {
+  // Clamp the region to the image, as returned to the user.
+  const bool keep_orientation = dec->keep_orientation;
+  const size_t image_xsize = dec->metadata.oriented_xsize(keep_orientation);
+  const size_t image_ysize = dec->metadata.oriented_ysize(keep_orientation);
+  size_t x0 = std::min(region_x0, image_xsize);
+  size_t y0 = std::min(region_y0, image_ysize);
+  size_t xsize = std::min(region_xsize, image_xsize - x0);
+  size_t ysize = std::min(region_ysize, image_ysize - y0);
+  const uint32_t orientation =
+      static_cast<uint32_t>(dec->metadata.m.GetOrientation());
+  if (!keep_orientation) {
+    // Undo the orientation, the inverse of the mapping of the crop offset in
+    // JxlDecoderGetFrameHeader.
+    size_t o = (orientation - 1) & 3;
+    if (o > 0 && o < 3) x0 = image_xsize - xsize - x0;
+    if (o > 1) y0 = image_ysize - ysize - y0;
+    if (orientation > 4) {
+      std::swap(x0, y0);
+      std::swap(xsize, ysize);
+    }
+  }
+  // Move the region to the frame, which may be at any position of the image.
+  const jxl::FrameDimensions frame_dim = dec->frame_header->ToFrameDimensions();
+  int64_t fx0 = static_cast<int64_t>(x0);
+  int64_t fy0 = static_cast<int64_t>(y0);
+  int64_t fx1 = fx0 + static_cast<int64_t>(xsize);
+  int64_t fy1 = fy0 + static_cast<int64_t>(ysize);
+  if (dec->frame_header->custom_size_or_origin) {
+    fx0 -= dec->frame_header->frame_origin.x0;
+    fy0 -= dec->frame_header->frame_origin.y0;
+    fx1 -= dec->frame_header->frame_origin.x0;
+    fy1 -= dec->frame_header->frame_origin.y0;
+  }
+  const auto clamp = [](int64_t v, size_t size) -> size_t {
+    return static_cast<size_t>(
+        std::min<int64_t>(std::max<int64_t>(v, 0), size));
+  };
+  const size_t rx0 = clamp(fx0, frame_dim.xsize_upsampled);
+  const size_t ry0 = clamp(fy0, frame_dim.ysize_upsampled);
+  const size_t rx1 = clamp(fx1, frame_dim.xsize_upsampled);
+  const size_t ry1 = clamp(fy1, frame_dim.ysize_upsampled);
+  return jxl::Rect(rx0, ry0, rx1 - rx0, ry1 - ry0);
+}
 }  // namespace
 
+static JxlDecoderStatus ParseBoxHeader(const uint8_t* in, size_t size,
+                                       size_t pos, size_t file_pos,
+                                       JxlBoxType type, uint64_t* box_size,
+                                       uint64_t* header_size);
+
 namespace jxl {
 namespace {
 
@@ -950,18 +1291,23 @@ namespace {
 template <class T>
 JxlDecoderStatus ReadBundle(JxlDecoder* dec, Span<const uint8_t> data,
                             BitReader* reader, T* JXL_RESTRICT t) {
-  // Use a copy of the bit reader because CanRead advances bits.
+  // Read from a copy of the bit reader, which may run out of input, and only
+  // advance `reader` once the bundle was read. This parses the bundle once,
+  // also when it is complete, instead of checking with CanRead first.
   BitReader reader2(data);
-  reader2.SkipBits(reader->TotalBitsConsumed());
-  bool can_read = Bundle::CanRead(&reader2, t);
+  const size_t start = reader->TotalBitsConsumed();
+  reader2.SkipBits(start);
+  const Status status = Bundle::Read(&reader2, t);
+  const size_t bits = reader2.TotalBitsConsumed() - start;
   JXL_API_RETURN_IF_ERROR(reader2.Close());
 
-  if (!can_read) {
+  if (status.code() == StatusCode::kNotEnoughBytes) {
     return dec->RequestMoreInput();
   }
-  if (!Bundle::Read(reader, t)) {
+  if (!status) {
     return JXL_DEC_ERROR;
   }
+  reader->SkipBits(bits);
   return JXL_DEC_SUCCESS;
 }
 
@@ -1018,6 +1364,24 @@ JxlDecoderStatus JxlDecoderReadBasicInfo(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
+// Sets up the output encoding once all codestream headers are read.
+JxlDecoderStatus JxlDecoderInitOutputEncoding(JxlDecoder* dec) {
+  if (!dec->passes_state) {
+    dec->passes_state =
+        jxl::make_unique<jxl::PassesDecoderState>(&dec->frame_memory_manager);
+  }
+
+  JXL_API_RETURN_IF_ERROR(
+      dec->passes_state->output_encoding_info.SetFromMetadata(dec->metadata));
+  if (dec->desired_intensity_target > 0) {
+    dec->passes_state->output_encoding_info.desired_intensity_target =
+        dec->desired_intensity_target;
+  }
+  dec->image_metadata = dec->metadata.m;
+
+  return JXL_DEC_SUCCESS;
+}
+
 // Reads all codestream headers (but not frame headers)
 JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec) {
   if (!dec->got_transform_data) {
@@ -1035,8 +1399,34 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec) {
     dec->got_transform_data = true;
   }
 
+  if (dec->metadata.m.color_encoding.WantICC() && !dec->rewind_icc.empty()) {
+    // The input is the same as before JxlDecoderRewind.
+    IccBytes icc = dec->rewind_icc;
+    dec->metadata.m.color_encoding.SetICCRaw(std::move(icc));
+    dec->got_all_headers = true;
+    dec->AdvanceCodestream(dec->rewind_icc_stream_size);
+    dec->codestream_bits_ahead = 0;
+    return JxlDecoderInitOutputEncoding(dec);
+  }
+
   Span<const uint8_t> span;
   JXL_API_RETURN_IF_ERROR(dec->GetCodestreamInput(&span));
+
+  if (dec->metadata.m.color_encoding.WantICC()) {
+    IccBytes icc;
+    size_t stream_size =
+        jxl::LookupDecodedICC(span, dec->codestream_bits_ahead, &icc);
+    if (stream_size != 0) {
+      dec->rewind_icc = icc;
+      dec->rewind_icc_stream_size = stream_size;
+      dec->metadata.m.color_encoding.SetICCRaw(std::move(icc));
+      dec->got_all_headers = true;
+      dec->AdvanceCodestream(stream_size);
+      dec->codestream_bits_ahead = 0;
+      return JxlDecoderInitOutputEncoding(dec);
+    }
+  }
+
   auto reader = GetBitReader(span);
   reader->SkipBits(dec->codestream_bits_ahead);
 
@@ -1074,43 +1464,105 @@ JxlDecoderStatus JxlDecoderReadAllHeaders(JxlDecoder* dec) {
   dec->got_all_headers = true;
   JXL_API_RETURN_IF_ERROR(reader->JumpToByteBoundary());
 
+  if (dec->metadata.m.color_encoding.WantICC()) {
+    dec->rewind_icc = dec->metadata.m.color_encoding.ICC();
+    dec->rewind_icc_stream_size =
+        reader->TotalBitsConsumed() / jxl::kBitsPerByte;
+    jxl::CacheDecodedICC(
+        Span<const uint8_t>(span.data(), dec->rewind_icc_stream_size),
+        dec->codestream_bits_ahead, dec->rewind_icc);
+  }
   dec->AdvanceCodestream(reader->TotalBitsConsumed() / jxl::kBitsPerByte);
   dec->codestream_bits_ahead = 0;
 
-  if (!dec->passes_state) {
-    dec->passes_state =
-        jxl::make_unique<jxl::PassesDecoderState>(&dec->memory_manager);
-  }
-
-  JXL_API_RETURN_IF_ERROR(
-      dec->passes_state->output_encoding_info.SetFromMetadata(dec->metadata));
-  if (dec->desired_intensity_target > 0) {
-    dec->passes_state->output_encoding_info.desired_intensity_target =
-        dec->desired_intensity_target;
+  return JxlDecoderInitOutputEncoding(dec);
+}
+
+// Appends to "parts" the contents of the jxlp boxes that follow the current
+// codestream box and are already available in the input, up to the last one,
+// without their index. Nothing is appended if the current box is the last one.
+// The contents stay valid until the input is released.
+void GetLaterCodestreamParts(const JxlDecoder* dec,
+                             std::vector<Span<const uint8_t>>* parts) {
+  if (dec->box_contents_unbounded || dec->last_codestream_seen) return;
+  size_t pos = dec->box_contents_end - dec->file_pos;
+  while (pos < dec->avail_in) {
+    JxlBoxType type;
+    uint64_t box_size;
+    uint64_t header_size;
+    if (ParseBoxHeader(dec->next_in, dec->avail_in, pos, dec->file_pos + pos,
+                       type, &box_size, &header_size) != JXL_DEC_SUCCESS) {
+      return;
+    }
+    const bool unbounded = (box_size == 0);
+    if (unbounded) box_size = dec->avail_in - pos;
+    if (memcmp(type, "jxlp", 4) == 0) {
+      if (box_size < header_size + 4) return;
+      const size_t begin = pos + header_size + 4;
+      if (begin > dec->avail_in) return;
+      const bool last = unbounded || (dec->next_in[begin - 4] & 0x80);
+      const size_t size = std::min<uint64_t>(box_size - header_size - 4,
+                                             dec->avail_in - begin);
+      if (size != 0) parts->push_back(Bytes(dec->next_in + begin, size));
+      if (last || begin + size < pos + box_size) return;
+    } else if (memcmp(type, "jxlc", 4) == 0 || memcmp(type, "JXL ", 4) == 0 ||
+               unbounded) {
+      return;
+    }
+    pos += box_size;
   }
-  dec->image_metadata = dec->metadata.m;
-
-  return JXL_DEC_SUCCESS;
 }
 
-JxlDecoderStatus JxlDecoderProcessSections(JxlDecoder* dec) {
+// Processes the available sections, except for the AC groups below group row
+// "max_group_row".
+JxlDecoderStatus ProcessSectionsUpTo(JxlDecoder* dec, size_t max_group_row) {
   Span<const uint8_t> span;
   JXL_API_RETURN_IF_ERROR(dec->GetCodestreamInput(&span));
   const auto& toc = dec->frame_dec->Toc();
+  // Sections that continue past the current box are read in place from the
+  // following jxlp boxes, as a chunk list per section.
+  std::vector<Span<const uint8_t>> parts{span};
+  GetLaterCodestreamParts(dec, &parts);
+  size_t total_size = 0;
+  for (const auto& part : parts) total_size += part.size();
+  std::vector<std::vector<Span<const uint8_t>>> section_chunks;
+  section_chunks.reserve(toc.size());
   size_t pos = 0;
   std::vector<jxl::FrameDecoder::SectionInfo> section_info;
   std::vector<jxl::FrameDecoder::SectionStatus> section_status;
   for (size_t i = dec->next_section; i < toc.size(); ++i) {
-    if (dec->section_processed[i]) {
+    if (dec->section_processed[i] ||
+        dec->frame_dec->SectionGroupRow(toc[i].id) > max_group_row) {
       pos += toc[i].size;
       continue;
     }
     size_t id = toc[i].id;
     size_t size = toc[i].size;
-    if (OutOfBounds(pos, size, span.size())) {
+    if (OutOfBounds(pos, size, total_size)) {
       break;
     }
-    auto* br = new jxl::BitReader(jxl::Bytes(span.data() + pos, size));
+    jxl::BitReader* br;
+    if (size == 0) {
+      br = new jxl::BitReader(jxl::Bytes(span.data(), 0));
+    } else if (!OutOfBounds(pos, size, span.size())) {
+      // The next sections, if any, are slack for the refills.
+      br = new jxl::BitReader(jxl::Bytes(span.data() + pos, size),
+                              span.size() - pos - size);
+    } else {
+      section_chunks.emplace_back();
+      std::vector<Span<const uint8_t>>& chunks = section_chunks.back();
+      size_t part_begin = 0;
+      for (const auto& part : parts) {
+        const size_t begin = std::max(pos, part_begin);
+        const size_t end = std::min(pos + size, part_begin + part.size());
+        if (begin < end) {
+          chunks.push_back(
+              Bytes(part.data() + (begin - part_begin), end - begin));
+        }
+        part_begin += part.size();
+      }
+      br = new jxl::BitReader(chunks.data(), chunks.size());
+    }
     section_info.emplace_back(jxl::FrameDecoder::SectionInfo{br, id, i});
     section_status.emplace_back();
     pos += size;
@@ -1159,6 +1611,53 @@ JxlDecoderStatus JxlDecoderProcessSections(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderProcessSections(JxlDecoder* dec) {
+  if (!StreamsRows(dec) ||
+      dec->frame_prog_detail != JxlProgressiveDetail::kFrames) {
+    return ProcessSectionsUpTo(dec, std::numeric_limits<size_t>::max());
+  }
+  // For a row callback, the AC groups are decoded one group row at a time, so
+  // that decoding stops soon after the callback asks to pause, with about two
+  // group rows of output kept until it resumes.
+  const auto& toc = dec->frame_dec->Toc();
+  const auto num_processed = [dec]() {
+    return std::count(dec->section_processed.begin(),
+                      dec->section_processed.end(), 1);
+  };
+  while (!dec->row_output.paused()) {
+    size_t group_row = std::numeric_limits<size_t>::max();
+    for (size_t i = dec->next_section; i < toc.size(); ++i) {
+      if (dec->section_processed[i]) continue;
+      group_row =
+          std::min(group_row, dec->frame_dec->SectionGroupRow(toc[i].id));
+    }
+    if (group_row == std::numeric_limits<size_t>::max()) break;
+    const auto processed_before = num_processed();
+    JXL_API_RETURN_IF_ERROR(ProcessSectionsUpTo(dec, group_row));
+    // Sections of the group row that are still missing need more input.
+    if (num_processed() == processed_before) break;
+  }
+  return JXL_DEC_SUCCESS;
+}
+
+#if JPEGXL_ENABLE_TRANSCODE_JPEG
+// Copies the Exif and XMP boxes to the markers of the reconstructed JPEG.
+JxlDecoderStatus SetJpegReconMetadata(JxlDecoder* dec) {
+  jxl::jpeg::JPEGData* jpeg_data = dec->ib->jpeg_data.get();
+  if (dec->recon_exif_size) {
+    JxlDecoderStatus status = jxl::JxlToJpegDecoder::SetExif(
+        dec->exif_metadata.data(), dec->exif_metadata.size(), jpeg_data);
+    if (status != JXL_DEC_SUCCESS) return status;
+  }
+  if (dec->recon_xmp_size) {
+    JxlDecoderStatus status = jxl::JxlToJpegDecoder::SetXmp(
+        dec->xmp_metadata.data(), dec->xmp_metadata.size(), jpeg_data);
+    if (status != JXL_DEC_SUCCESS) return status;
+  }
+  return JXL_DEC_SUCCESS;
+}
+#endif
+
 // TODO(eustas): no CodecInOut -> no image size reinforcement -> possible OOM.
 JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
   // If no parallel runner is set, use the default
@@ -1242,6 +1741,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       if (!dec->jpeg_decoder.SetImageBundleJpegData(dec->ib.get()))
         return JXL_DEC_ERROR;
 #endif
+      dec->passes_state->stats = dec->stats ? &dec->stats->stats : nullptr;
       dec->frame_dec = jxl::make_unique<FrameDecoder>(
           dec->passes_state.get(), dec->metadata, dec->thread_pool.get(),
           /*use_slow_rendering_pipeline=*/false);
@@ -1358,7 +1858,23 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
 
     if (dec->frame_stage == FrameStage::kTOC) {
       dec->frame_dec->SetRenderSpotcolors(dec->render_spotcolors);
+      dec->passes_state->gain_map =
+          (dec->preview_frame || dec->gain_map.values.empty())
+              ? nullptr
+              : &dec->gain_map;
       dec->frame_dec->SetCoalescing(dec->coalescing);
+      dec->frame_dec->SetRenderOnDemand(dec->render_on_demand &&
+                                        !dec->preview_frame);
+      dec->frame_dec->SetGPURendering(dec->gpu_rendering);
+      // With coalescing, the parts of the image outside of a frame are rendered
+      // together with the groups of the frame, so a frame that does not cover
+      // the whole image must be decoded fully.
+      if (dec->crop_xsize != 0 && !dec->preview_frame &&
+          (!dec->coalescing || !dec->frame_header->custom_size_or_origin)) {
+        dec->frame_dec->SetCropRegion(GetRegionInFrame(
+            dec, dec->crop_x0, dec->crop_y0, dec->crop_xsize,
+            dec->crop_ysize));
+      }
 
       if (!dec->preview_frame &&
           (dec->events_wanted & JXL_DEC_FRAME_PROGRESSION)) {
@@ -1372,6 +1888,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       dec->next_section = 0;
       dec->section_processed.clear();
       dec->section_processed.resize(dec->frame_dec->Toc().size(), 0);
+      dec->row_output_started = false;
 
       // If we don't need pixels, we can skip actually decoding the frames.
       if (dec->preview_frame || (dec->events_wanted & JXL_DEC_FULL_IMAGE)) {
@@ -1386,6 +1903,9 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
     }
 
     if (dec->frame_stage == FrameStage::kFull) {
+      if (StreamsRows(dec) && !dec->row_output.Resume()) {
+        return JXL_DEC_IMAGE_OUT_PAUSED;
+      }
       if (!dec->image_out_buffer_set) {
         if (dec->preview_frame) {
           return JXL_DEC_NEED_PREVIEW_OUT_BUFFER;
@@ -1406,16 +1926,31 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       if (dec->image_out_buffer_set) {
         size_t xsize;
         size_t ysize;
-        GetCurrentDimensions(dec, xsize, ysize);
+        GetOutputDimensions(dec, xsize, ysize);
+        if (!dec->preview_frame) {
+          dec->frame_dec->SetOutputDownsampling(dec->output_downsampling);
+        }
+        dec->frame_dec->SetJPEGIntegerIDCT(dec->jpeg_integer_idct);
         size_t bits_per_sample = GetBitDepth(
             dec->image_out_bit_depth, dec->metadata.m, dec->image_out_format);
-        dec->frame_dec->SetImageOutput(
-            PixelCallback{
-                dec->image_out_init_callback, dec->image_out_run_callback,
-                dec->image_out_destroy_callback, dec->image_out_init_opaque},
-            reinterpret_cast<uint8_t*>(dec->image_out_buffer),
-            dec->image_out_size, xsize, ysize, dec->image_out_format,
-            bits_per_sample, dec->unpremul_alpha, !dec->keep_orientation);
+        if (StreamsRows(dec) && !dec->row_output_started) {
+          dec->row_output.Init(dec->image_out_row_callback,
+                               dec->image_out_row_opaque, xsize, ysize,
+                               BytesPerPixel(dec->image_out_format));
+          dec->row_output_started = true;
+        }
+        if (dec->image_out_planar && !dec->preview_frame) {
+          dec->frame_dec->SetImageOutPlanes(dec->image_out_planes, xsize,
+                                            ysize);
+        } else {
+          dec->frame_dec->SetImageOutput(
+              PixelCallback{
+                  dec->image_out_init_callback, dec->image_out_run_callback,
+                  dec->image_out_destroy_callback, dec->image_out_init_opaque},
+              reinterpret_cast<uint8_t*>(dec->image_out_buffer),
+              dec->image_out_size, xsize, ysize, dec->image_out_format,
+              bits_per_sample, dec->unpremul_alpha, !dec->keep_orientation);
+        }
         for (size_t i = 0; i < dec->extra_channel_output.size(); ++i) {
           const auto& extra = dec->extra_channel_output[i];
           size_t ec_bits_per_sample =
@@ -1430,6 +1965,9 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
       size_t next_num_passes_to_pause = dec->frame_dec->NextNumPassesToPause();
 
       JXL_API_RETURN_IF_ERROR(JxlDecoderProcessSections(dec));
+      if (StreamsRows(dec) && dec->row_output.paused()) {
+        return JXL_DEC_IMAGE_OUT_PAUSED;
+      }
 
       bool all_sections_done = dec->frame_dec->HasDecodedAll();
       bool got_dc_only = !all_sections_done && dec->frame_dec->HasDecodedDC();
@@ -1453,6 +1991,24 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
         return JXL_DEC_FRAME_PROGRESSION;
       }
 
+#if JPEGXL_ENABLE_TRANSCODE_JPEG
+      // The reconstructed JPEG is written as the rows of groups of the frame
+      // are decoded, when its metadata boxes are already read. Its last rows
+      // are written with the rest of it once the frame is finalized.
+      if (!all_sections_done && dec->jpeg_decoder.IsOutputSet() &&
+          dec->ib->jpeg_data != nullptr && !dec->JbrdNeedMoreBoxes()) {
+        const size_t num_rows = std::min<size_t>(
+            dec->frame_dec->NumDecodedRows(), dec->ib->jpeg_data->height - 1);
+        if (num_rows != 0) {
+          JxlDecoderStatus status = SetJpegReconMetadata(dec);
+          if (status != JXL_DEC_SUCCESS) return status;
+          status = dec->jpeg_decoder.WriteOutput(
+              *dec->ib->jpeg_data, dec->thread_pool.get(), num_rows);
+          if (status != JXL_DEC_SUCCESS) return status;
+        }
+      }
+#endif
+
       if (!all_sections_done) {
         // Not all sections have been processed yet
         return dec->RequestMoreInput();
@@ -1470,9 +2026,14 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
             dec->frame_dec->References();
       }
 
+      const jxl::DecoderStats::Start start =
+          dec->stats ? dec->stats->stats.Begin() : jxl::DecoderStats::Start();
       if (!dec->frame_dec->FinalizeFrame()) {
         return JXL_INPUT_ERROR("decoding frame failed");
       }
+      if (dec->stats) {
+        dec->stats->stats.AddTime(jxl::DecoderStats::kFinalize, start);
+      }
 #if JPEGXL_ENABLE_TRANSCODE_JPEG
       // If jpeg output was requested, we merely return the JXL_DEC_FULL_IMAGE
       // status without outputting pixels.
@@ -1482,6 +2043,15 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
         return JXL_DEC_FULL_IMAGE;
       }
 #endif
+      dec->frame_stage = FrameStage::kRows;
+    }
+
+    if (dec->frame_stage == FrameStage::kRows) {
+      // Rows rendered while the row callback was paused, or when the frame
+      // was finalized, are delivered before the frame completes.
+      if (StreamsRows(dec) && !dec->row_output.Resume()) {
+        return JXL_DEC_IMAGE_OUT_PAUSED;
+      }
       if (dec->preview_frame || dec->is_last_of_still) {
         dec->image_out_buffer_set = false;
         dec->extra_channel_output.clear();
@@ -1493,6 +2063,18 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
     // The pixels have been output or are not needed, do not keep them in
     // memory here.
     dec->ib.reset();
+    if (dec->is_last_total && !dec->preview_frame &&
+        dec->memory_budget.limited() && !dec->frame_dec->RendersOnDemand()) {
+      // No later frame can refer to this one or the saved ones, so under a
+      // memory limit their buffers are released right away rather than when
+      // the decoder is rewound or reset.
+      dec->frame_dec.reset();
+      dec->passes_state->ReleaseFrameBuffers();
+      dec->thread_pool->scratch()->Clear();
+      dec->frame_arena.ReleaseFreeSlabs();
+    } else {
+      dec->frame_arena.Reset();
+    }
     if (dec->preview_frame) {
       dec->got_preview_image = true;
       dec->preview_frame = false;
@@ -1501,6 +2083,7 @@ JxlDecoderStatus JxlDecoderProcessCodestream(JxlDecoder* dec) {
     } else if (dec->is_last_of_still &&
                (dec->events_wanted & JXL_DEC_FULL_IMAGE) &&
                !dec->skipping_frame) {
+      dec->can_render_region = dec->frame_dec->RendersOnDemand();
       return JXL_DEC_FULL_IMAGE;
     }
   }
@@ -1608,6 +2191,52 @@ static JxlDecoderStatus ParseBoxHeader(const uint8_t* in, size_t size,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlIndexBoxes(const uint8_t* data, size_t size,
+                               uint64_t data_offset, JxlBoxIndexEntry* entries,
+                               size_t max_entries, size_t* num_entries,
+                               uint64_t* next_offset) {
+  *num_entries = 0;
+  *next_offset = data_offset;
+  if (data_offset == 0) {
+    JxlSignature signature = JxlSignatureCheck(data, size);
+    if (signature == JXL_SIG_CODESTREAM) return JXL_DEC_SUCCESS;
+    if (signature == JXL_SIG_NOT_ENOUGH_BYTES) return JXL_DEC_NEED_MORE_INPUT;
+    if (signature != JXL_SIG_CONTAINER) {
+      return JXL_INPUT_ERROR("not a JPEG XL file");
+    }
+  }
+  size_t pos = 0;
+  while (*num_entries < max_entries) {
+    JxlBoxIndexEntry* entry = &entries[*num_entries];
+    uint64_t box_size;
+    uint64_t header_size;
+    JxlDecoderStatus status = ParseBoxHeader(
+        data, size, pos, *next_offset, entry->type, &box_size, &header_size);
+    if (status != JXL_DEC_SUCCESS) return status;
+    if (memcmp(entry->type, "brob", 4) == 0) {
+      if (box_size != 0 && box_size < header_size + 4) {
+        return JXL_INPUT_ERROR("brob box too small");
+      }
+      if (OutOfBounds(pos + header_size, 4, size)) {
+        return JXL_DEC_NEED_MORE_INPUT;
+      }
+      memcpy(entry->decompressed_type, data + pos + header_size, 4);
+    } else {
+      memcpy(entry->decompressed_type, entry->type, 4);
+    }
+    entry->offset = *next_offset;
+    entry->header_size = header_size;
+    entry->size = box_size;
+    ++*num_entries;
+    if (box_size == 0) return JXL_DEC_SUCCESS;
+    *next_offset += box_size;
+    // The contents of the box are skipped, the next header may be past "data".
+    if (*next_offset - data_offset >= size) break;
+    pos = *next_offset - data_offset;
+  }
+  return JXL_DEC_NEED_MORE_INPUT;
+}
+
 // This includes handling the codestream if it is not a box-based jxl file.
 static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
   // Box handling loop
@@ -1685,24 +2314,16 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
 #if JPEGXL_ENABLE_TRANSCODE_JPEG
     if (dec->recon_output_jpeg == JpegReconStage::kSettingMetadata &&
         !dec->JbrdNeedMoreBoxes()) {
-      jxl::jpeg::JPEGData* jpeg_data = dec->ib->jpeg_data.get();
-      if (dec->recon_exif_size) {
-        JxlDecoderStatus status = jxl::JxlToJpegDecoder::SetExif(
-            dec->exif_metadata.data(), dec->exif_metadata.size(), jpeg_data);
-        if (status != JXL_DEC_SUCCESS) return status;
-      }
-      if (dec->recon_xmp_size) {
-        JxlDecoderStatus status = jxl::JxlToJpegDecoder::SetXmp(
-            dec->xmp_metadata.data(), dec->xmp_metadata.size(), jpeg_data);
-        if (status != JXL_DEC_SUCCESS) return status;
-      }
+      JxlDecoderStatus status = jxl::SetJpegReconMetadata(dec);
+      if (status != JXL_DEC_SUCCESS) return status;
       dec->recon_output_jpeg = JpegReconStage::kOutputting;
     }
 
     if (dec->recon_output_jpeg == JpegReconStage::kOutputting &&
         !dec->JbrdNeedMoreBoxes()) {
       JxlDecoderStatus status =
-          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data);
+          dec->jpeg_decoder.WriteOutput(*dec->ib->jpeg_data,
+                                        dec->thread_pool.get());
       if (status != JXL_DEC_SUCCESS) return status;
       dec->recon_output_jpeg = JpegReconStage::kNone;
       dec->ib.reset();
@@ -2020,7 +2641,9 @@ static JxlDecoderStatus HandleBoxes(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
-JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
+namespace {
+
+JxlDecoderStatus ProcessInput(JxlDecoder* dec) {
   if (dec->stage == DecoderStage::kInited) {
     dec->stage = DecoderStage::kStarted;
   }
@@ -2071,6 +2694,30 @@ JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
   return status;
 }
 
+}  // namespace
+
+JxlDecoderStatus JxlDecoderProcessInput(JxlDecoder* dec) {
+  dec->can_render_region = false;
+  const jxl::DecoderStats::Start start =
+      dec->stats ? dec->stats->stats.Begin() : jxl::DecoderStats::Start();
+  JxlDecoderStatus status = ProcessInput(dec);
+  if (dec->stats) {
+    jxl::DecoderStats& stats = dec->stats->stats;
+    stats.AddTime(jxl::DecoderStats::kTotal, start);
+    const uint64_t allocated = dec->memory_budget.allocated();
+    stats.AddBytes(allocated - dec->stats_allocated,
+                   dec->memory_budget.peak());
+    dec->stats_allocated = allocated;
+  }
+  if (status == JXL_DEC_ERROR && dec->memory_budget.exceeded()) {
+    // Some allocation failed because of the limit, which is what made decoding
+    // fail: the state of the decoder is not recoverable.
+    dec->stage = DecoderStage::kError;
+    return JXL_DEC_MEMORY_LIMIT;
+  }
+  return status;
+}
+
 // To ensure ABI forward-compatibility, this struct has a constant size.
 static_assert(sizeof(JxlBasicInfo) == 204,
               "JxlBasicInfo struct size should remain constant");
@@ -2312,6 +2959,10 @@ JxlDecoderStatus PrepareSizeCheck(const JxlDecoder* dec,
   if (*bits == 0) {
     return JXL_API_ERROR("Invalid/unsupported data type");
   }
+  if (format->data_type == JXL_TYPE_UINT32_RGB10_A2 &&
+      format->num_channels < 3) {
+    return JXL_API_ERROR("Packed RGB10_A2 output needs 3 or 4 channels");
+  }
 
   return JXL_DEC_SUCCESS;
 }
@@ -2324,6 +2975,8 @@ size_t JxlDecoderGetIntendedDownsamplingRatio(JxlDecoder* dec) {
 
 JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
   if (!dec->image_out_buffer_set) return JXL_DEC_ERROR;
+  // Rows are delivered once, when they are final.
+  if (dec->image_out_rows) return JXL_DEC_ERROR;
   if (dec->frame_stage != FrameStage::kFull) {
     return JXL_DEC_ERROR;
   }
@@ -2341,11 +2994,29 @@ JxlDecoderStatus JxlDecoderFlushImage(JxlDecoder* dec) {
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderRenderRegion(JxlDecoder* dec, uint32_t x0,
+                                        uint32_t y0, uint32_t xsize,
+                                        uint32_t ysize) {
+  if (!dec->can_render_region) {
+    return JXL_API_ERROR("No frame to render on demand");
+  }
+  // The region is in the coordinates of the downsampled output, the frame
+  // decoder renders pixels of the full image.
+  const size_t factor = dec->output_downsampling;
+  const jxl::Rect rect = GetRegionInFrame(
+      dec, static_cast<size_t>(x0) * factor, static_cast<size_t>(y0) * factor,
+      static_cast<size_t>(xsize) * factor, static_cast<size_t>(ysize) * factor);
+  if (!dec->frame_dec->RenderRegion(rect)) {
+    return JXL_API_ERROR("Failed to render the region");
+  }
+  return JXL_DEC_SUCCESS;
+}
+
 JXL_EXPORT JxlDecoderStatus JxlDecoderSetCms(JxlDecoder* dec,
                                              const JxlCmsInterface cms) {
   if (!dec->passes_state) {
     dec->passes_state =
-        jxl::make_unique<jxl::PassesDecoderState>(&dec->memory_manager);
+        jxl::make_unique<jxl::PassesDecoderState>(&dec->frame_memory_manager);
   }
   dec->passes_state->output_encoding_info.color_management_system = cms;
   dec->passes_state->output_encoding_info.cms_set = true;
@@ -2365,11 +3036,14 @@ static JxlDecoderStatus GetMinSize(const JxlDecoder* dec,
     xsize = dec->metadata.oriented_preview_xsize(dec->keep_orientation);
     ysize = dec->metadata.oriented_preview_ysize(dec->keep_orientation);
   } else {
-    GetCurrentDimensions(dec, xsize, ysize);
+    GetOutputDimensions(dec, xsize, ysize);
   }
   if (num_channels == 0) num_channels = format->num_channels;
-  size_t row_size =
-      jxl::DivCeil(xsize * num_channels * bits, jxl::kBitsPerByte);
+  // Packed pixels take 32 bits, whether they have alpha or not.
+  const size_t bits_per_pixel = format->data_type == JXL_TYPE_UINT32_RGB10_A2
+                                    ? 32
+                                    : num_channels * bits;
+  size_t row_size = jxl::DivCeil(xsize * bits_per_pixel, jxl::kBitsPerByte);
   size_t last_row_size = row_size;
   if (format->align > 1) {
     row_size = jxl::DivCeil(row_size, format->align) * format->align;
@@ -2411,6 +3085,8 @@ JXL_EXPORT JxlDecoderStatus JxlDecoderSetPreviewOutBuffer(
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
   dec->image_out_format = *format;
+  dec->image_out_planar = false;
+  dec->image_out_rows = false;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2452,6 +3128,8 @@ JxlDecoderStatus JxlDecoderSetImageOutBuffer(JxlDecoder* dec,
   dec->image_out_buffer = buffer;
   dec->image_out_size = size;
   dec->image_out_format = *format;
+  dec->image_out_planar = false;
+  dec->image_out_rows = false;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2467,6 +3145,9 @@ JxlDecoderStatus JxlDecoderExtraChannelBufferSize(const JxlDecoder* dec,
   if (index >= dec->metadata.m.num_extra_channels) {
     return JXL_API_ERROR("Invalid extra channel index");
   }
+  if (format->data_type == JXL_TYPE_UINT32_RGB10_A2) {
+    return JXL_API_ERROR("Packed RGB10_A2 output is only for color");
+  }
 
   return GetMinSize(dec, format, 1, size, false);
 }
@@ -2475,6 +3156,9 @@ JxlDecoderStatus JxlDecoderSetExtraChannelBuffer(JxlDecoder* dec,
                                                  const JxlPixelFormat* format,
                                                  void* buffer, size_t size,
                                                  uint32_t index) {
+  if (dec->image_out_buffer_set && dec->image_out_planar) {
+    return JXL_API_ERROR("Planar output cannot have extra channel buffers");
+  }
   size_t min_size;
   // This also checks whether the format and index are valid and supported and
   // basic info is available.
@@ -2549,6 +3233,107 @@ JxlDecoderStatus JxlDecoderSetMultithreadedImageOutCallback(
   dec->image_out_destroy_callback = destroy_callback;
   dec->image_out_init_opaque = init_opaque;
   dec->image_out_format = *format;
+  dec->image_out_planar = false;
+  dec->image_out_rows = false;
+
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetImageOutRowCallback(
+    JxlDecoder* dec, const JxlPixelFormat* format,
+    JxlImageOutRowCallback callback, void* opaque) {
+  if (dec->preview_frame) {
+    return JXL_API_ERROR("Row callbacks are only for the main image");
+  }
+  if (callback == nullptr) return JXL_API_ERROR("The callback is required");
+  const auto init_callback =
+      +[](void* init_opaque, size_t num_threads, size_t num_pixels_per_thread) {
+        return init_opaque;
+      };
+  const auto run_callback =
+      +[](void* run_opaque, size_t thread_id, size_t x, size_t y,
+          size_t num_pixels, const void* pixels) {
+        static_cast<OrderedRowOutput*>(run_opaque)->Run(x, y, num_pixels,
+                                                         pixels);
+      };
+  const auto destroy_callback = +[](void* run_opaque) {};
+  JxlDecoderStatus status = JxlDecoderSetMultithreadedImageOutCallback(
+      dec, format, init_callback, run_callback, destroy_callback,
+      &dec->row_output);
+  if (status != JXL_DEC_SUCCESS) return status;
+  dec->image_out_rows = true;
+  dec->image_out_row_callback = callback;
+  dec->image_out_row_opaque = opaque;
+  return JXL_DEC_SUCCESS;
+}
+
+JxlDecoderStatus JxlDecoderSetImageOutPlanes(
+    JxlDecoder* dec, const JxlPlanarImageOutBuffer* buffer) {
+  if (!dec->got_basic_info || !(dec->orig_events_wanted & JXL_DEC_FULL_IMAGE)) {
+    return JXL_API_ERROR("No image out buffer needed at this time");
+  }
+  if (!dec->coalescing &&
+      (!dec->frame_header || dec->frame_stage == FrameStage::kHeader)) {
+    return JXL_API_ERROR("Don't know frame dimensions yet");
+  }
+  if (buffer->layout != JXL_PLANAR_YCBCR_444 &&
+      buffer->layout != JXL_PLANAR_YCBCR_420 &&
+      buffer->layout != JXL_SEMIPLANAR_NV12) {
+    return JXL_API_ERROR("Invalid planar layout");
+  }
+  if (buffer->data_type != JXL_TYPE_UINT8 &&
+      buffer->data_type != JXL_TYPE_UINT16) {
+    return JXL_API_ERROR("Invalid/unsupported data type for planar output");
+  }
+  if (buffer->bits_per_sample != 0 &&
+      (buffer->data_type != JXL_TYPE_UINT16 || buffer->bits_per_sample < 9 ||
+       buffer->bits_per_sample > 16)) {
+    return JXL_API_ERROR("Invalid bit depth %u for planar output",
+                         buffer->bits_per_sample);
+  }
+  if (!dec->keep_orientation &&
+      dec->metadata.m.GetOrientation() != jxl::Orientation::kIdentity) {
+    return JXL_API_ERROR("Planar output requires the identity orientation");
+  }
+  if (dec->output_downsampling != 1) {
+    return JXL_API_ERROR("Planar output cannot be downsampled");
+  }
+  if (!dec->extra_channel_output.empty()) {
+    return JXL_API_ERROR("Planar output cannot have extra channel buffers");
+  }
+  size_t xsize;
+  size_t ysize;
+  GetOutputDimensions(dec, xsize, ysize);
+  JxlPlanarImageOutBuffer planes = *buffer;
+  const size_t num_planes = (planes.layout == JXL_SEMIPLANAR_NV12 ? 2 : 3);
+  const size_t sample_size =
+      BitsPerChannel(planes.data_type) / jxl::kBitsPerByte;
+  for (size_t i = 0; i < num_planes; ++i) {
+    const bool subsampled = (i > 0 && planes.layout != JXL_PLANAR_YCBCR_444);
+    const size_t plane_xsize = subsampled ? jxl::DivCeil(xsize, 2) : xsize;
+    const size_t plane_ysize = subsampled ? jxl::DivCeil(ysize, 2) : ysize;
+    const size_t samples_per_pixel =
+        (i == 1 && planes.layout == JXL_SEMIPLANAR_NV12) ? 2 : 1;
+    const size_t row_size = plane_xsize * samples_per_pixel * sample_size;
+    if (planes.strides[i] == 0) planes.strides[i] = row_size;
+    if (planes.planes[i] == nullptr || planes.strides[i] < row_size ||
+        planes.plane_sizes[i] <
+            planes.strides[i] * (plane_ysize - 1) + row_size) {
+      return JXL_API_ERROR("Plane %d is too small", static_cast<int>(i));
+    }
+  }
+
+  dec->image_out_buffer_set = true;
+  dec->image_out_buffer = nullptr;
+  dec->image_out_init_callback = nullptr;
+  dec->image_out_run_callback = nullptr;
+  dec->image_out_destroy_callback = nullptr;
+  dec->image_out_init_opaque = nullptr;
+  dec->image_out_size = 0;
+  dec->image_out_format = {3, planes.data_type, planes.endianness, 0};
+  dec->image_out_planar = true;
+  dec->image_out_rows = false;
+  dec->image_out_planes = planes;
 
   return JXL_DEC_SUCCESS;
 }
@@ -2652,6 +3437,16 @@ JxlDecoderStatus JxlDecoderGetFrameName(const JxlDecoder* dec, char* name,
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderGetFrameIsModular(const JxlDecoder* dec,
+                                             JXL_BOOL* modular) {
+  if (!dec->frame_header || dec->frame_stage == FrameStage::kHeader) {
+    return JXL_API_ERROR("no frame header available");
+  }
+  *modular = TO_JXL_BOOL(dec->frame_header->encoding ==
+                         jxl::FrameEncoding::kModular);
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetPreferredColorProfile(
     JxlDecoder* dec, const JxlColorEncoding* color_encoding) {
   return JxlDecoderSetOutputColorProfile(dec, color_encoding,
@@ -2722,6 +3517,94 @@ JxlDecoderStatus JxlDecoderSetDesiredIntensityTarget(
   return JXL_DEC_SUCCESS;
 }
 
+JxlDecoderStatus JxlDecoderSetGainMap(JxlDecoder* dec,
+                                      const JxlGainMapParams* params,
+                                      const JxlPixelFormat* format,
+                                      const void* buffer, size_t size,
+                                      uint32_t xsize, uint32_t ysize,
+                                      float display_hdr_headroom) {
+  if (dec->stage != DecoderStage::kInited) {
+    return JXL_API_ERROR("Must set the gain map before starting");
+  }
+  dec->gain_map = jxl::GainMap();
+  if (params == nullptr) return JXL_DEC_SUCCESS;
+  if (format->num_channels != 1 && format->num_channels != 3) {
+    return JXL_API_ERROR("gain map must have 1 or 3 channels");
+  }
+  size_t bytes_per_sample;
+  if (format->data_type == JXL_TYPE_UINT8) {
+    bytes_per_sample = 1;
+  } else if (format->data_type == JXL_TYPE_UINT16) {
+    bytes_per_sample = 2;
+  } else if (format->data_type == JXL_TYPE_FLOAT) {
+    bytes_per_sample = 4;
+  } else {
+    return JXL_API_ERROR("unsupported data type of the gain map");
+  }
+  if (xsize == 0 || ysize == 0) {
+    return JXL_API_ERROR("empty gain map");
+  }
+  const size_t row_size = xsize * format->num_channels * bytes_per_sample;
+  size_t stride = row_size;
+  if (format->align > 1) {
+    stride = jxl::DivCeil(row_size, format->align) * format->align;
+  }
+  if (size < stride * (ysize - 1) + row_size) {
+    return JXL_API_ERROR("gain map buffer too small");
+  }
+  for (size_t c = 0; c < 3; c++) {
+    if (!(params->gamma[c] > 0)) {
+      return JXL_API_ERROR("gamma of the gain map must be positive");
+    }
+  }
+
+  const float base = params->base_hdr_headroom;
+  const float alternate = params->alternate_hdr_headroom;
+  float weight = 0;
+  if (alternate != base) {
+    weight = jxl::Clamp1((display_hdr_headroom - base) / (alternate - base),
+                         0.0f, 1.0f);
+  }
+  // With no weight, the gain map leaves the colors of the base image as they
+  // are, so that it does not need to be applied.
+  if (weight == 0) return JXL_DEC_SUCCESS;
+
+  jxl::GainMap& gain_map = dec->gain_map;
+  for (size_t c = 0; c < 3; c++) {
+    gain_map.log2_min[c] = weight * params->gain_map_min[c];
+    gain_map.log2_max[c] = weight * params->gain_map_max[c];
+    gain_map.inv_gamma[c] = 1.0f / params->gamma[c];
+    gain_map.base_offset[c] = params->base_offset[c];
+    gain_map.alternate_offset[c] = params->alternate_offset[c];
+  }
+  gain_map.xsize = xsize;
+  gain_map.ysize = ysize;
+  gain_map.channels = format->num_channels;
+  const bool big_endian =
+      format->endianness == JXL_BIG_ENDIAN ||
+      (format->endianness == JXL_NATIVE_ENDIAN && !IsLittleEndian());
+  const size_t row_samples = xsize * format->num_channels;
+  gain_map.values.resize(row_samples * ysize);
+  for (size_t y = 0; y < ysize; y++) {
+    const uint8_t* row = static_cast<const uint8_t*>(buffer) + y * stride;
+    float* out = gain_map.values.data() + y * row_samples;
+    for (size_t i = 0; i < row_samples; i++) {
+      const uint8_t* p = row + i * bytes_per_sample;
+      float v;
+      if (format->data_type == JXL_TYPE_UINT8) {
+        v = p[0] * (1.0f / 255);
+      } else if (format->data_type == JXL_TYPE_UINT16) {
+        v = (big_endian ? LoadBE16(p) : LoadLE16(p)) * (1.0f / 65535);
+      } else {
+        v = jxl::Clamp1(big_endian ? LoadBEFloat(p) : LoadLEFloat(p), 0.0f,
+                        1.0f);
+      }
+      out[i] = v;
+    }
+  }
+  return JXL_DEC_SUCCESS;
+}
+
 JxlDecoderStatus JxlDecoderSetBoxBuffer(JxlDecoder* dec, uint8_t* data,
                                         size_t size) {
   if (dec->box_out_buffer_set) {
@@ -2841,3 +3724,194 @@ JxlDecoderStatus JxlDecoderSetImageOutBitDepth(JxlDecoder* dec,
   dec->image_out_bit_depth = *bit_depth;
   return JXL_DEC_SUCCESS;
 }
+
+namespace {
+
+// Decodes the first frame of "image" with "dec", which stays subscribed to the
+// basic info and full image events.
+JxlDecoderStatus DecodeBatchImage(JxlDecoder* dec,
+                                  JxlDecoderBatchImage* image) {
+  JxlDecoderRewind(dec);
+  JXL_API_RETURN_IF_ERROR(JxlDecoderSetInput(dec, image->data, image->size));
+  JxlDecoderCloseInput(dec);
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+    if (status == JXL_DEC_BASIC_INFO) {
+      image->xsize = dec->metadata.oriented_xsize(dec->keep_orientation);
+      image->ysize = dec->metadata.oriented_ysize(dec->keep_orientation);
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t buffer_size;
+      JXL_API_RETURN_IF_ERROR(
+          JxlDecoderImageOutBufferSize(dec, &image->format, &buffer_size));
+      if (image->buffer == nullptr || image->buffer_size < buffer_size) {
+        return JXL_DEC_NEED_IMAGE_OUT_BUFFER;
+      }
+      JXL_API_RETURN_IF_ERROR(JxlDecoderSetImageOutBuffer(
+          dec, &image->format, image->buffer, image->buffer_size));
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      return JXL_DEC_SUCCESS;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      return JXL_INPUT_ERROR("truncated input");
+    } else {
+      return JXL_DEC_ERROR;
+    }
+  }
+}
+
+}  // namespace
+
+JxlDecoderStatus JxlDecoderDecodeBatch(const JxlMemoryManager* memory_manager,
+                                       JxlParallelRunner parallel_runner,
+                                       void* parallel_runner_opaque,
+                                       JxlDecoderBatchImage* images,
+                                       size_t num_images) {
+  if (num_images > std::numeric_limits<uint32_t>::max()) {
+    return JXL_API_ERROR("too many images");
+  }
+  jxl::ThreadPool pool(parallel_runner, parallel_runner_opaque);
+  // One decoder per thread, reused for all the images that thread decodes.
+  std::vector<JxlDecoder*> decoders;
+  const auto init = [&](size_t num_threads) -> jxl::Status {
+    while (decoders.size() < num_threads) {
+      JxlDecoder* dec = JxlDecoderCreate(memory_manager);
+      if (dec == nullptr) return JXL_FAILURE("failed to create decoder");
+      decoders.push_back(dec);
+      const int events = JXL_DEC_BASIC_INFO | JXL_DEC_FULL_IMAGE;
+      if (JxlDecoderSubscribeEvents(dec, events) != JXL_DEC_SUCCESS) {
+        return JXL_FAILURE("failed to subscribe events");
+      }
+    }
+    return true;
+  };
+  std::atomic<bool> all_decoded{true};
+  const auto decode = [&](const uint32_t i,
+                          const size_t thread) -> jxl::Status {
+    JxlDecoderBatchImage* image = &images[i];
+    image->xsize = 0;
+    image->ysize = 0;
+    image->status = DecodeBatchImage(decoders[thread], image);
+    JxlDecoderReleaseInput(decoders[thread]);
+    if (image->status != JXL_DEC_SUCCESS) {
+      all_decoded.store(false, std::memory_order_relaxed);
+    }
+    return true;
+  };
+  const bool ok = static_cast<bool>(jxl::RunOnPool(
+      &pool, 0, num_images, init, decode, "DecodeBatch"));
+  for (JxlDecoder* dec : decoders) JxlDecoderDestroy(dec);
+  if (!ok) return JXL_API_ERROR("batch decoding failed");
+  return all_decoded.load() ? JXL_DEC_SUCCESS : JXL_DEC_ERROR;
+}
+
+JxlDecoderStats* JxlDecoderStatsCreate() { return new JxlDecoderStats(); }
+
+void JxlDecoderStatsDestroy(JxlDecoderStats* stats) { delete stats; }
+
+uint64_t JxlDecoderStatsGet(const JxlDecoderStats* stats,
+                            JxlDecoderStatsKey key) {
+  if (!stats) return 0;
+  using jxl::DecoderStats;
+  const DecoderStats& s = stats->stats;
+  switch (key) {
+    case JXL_DEC_STAT_TOTAL_NS:
+      return s.PhaseTime(DecoderStats::kTotal);
+    case JXL_DEC_STAT_DC_GLOBAL_NS:
+      return s.PhaseTime(DecoderStats::kDcGlobal);
+    case JXL_DEC_STAT_DC_GROUPS_NS:
+      return s.PhaseTime(DecoderStats::kDcGroups);
+    case JXL_DEC_STAT_AC_GLOBAL_NS:
+      return s.PhaseTime(DecoderStats::kAcGlobal);
+    case JXL_DEC_STAT_AC_GROUPS_NS:
+      return s.PhaseTime(DecoderStats::kAcGroups);
+    case JXL_DEC_STAT_FINALIZE_NS:
+      return s.PhaseTime(DecoderStats::kFinalize);
+    case JXL_DEC_STAT_RENDER_NS:
+      return s.StagesTime();
+    case JXL_DEC_STAT_CMS_NS:
+      return s.StagesTime("Cms");
+    case JXL_DEC_STAT_OUTPUT_NS:
+      return s.StagesTime("Write") + s.StagesTime("DirectOutput");
+    case JXL_DEC_STAT_BYTES_ALLOCATED:
+      return s.bytes_allocated();
+    case JXL_DEC_STAT_PEAK_BYTES:
+      return s.peak_bytes();
+    default:
+      return 0;
+  }
+}
+
+size_t JxlDecoderStatsNumStages(const JxlDecoderStats* stats) {
+  return stats ? stats->stats.stages().size() : 0;
+}
+
+const char* JxlDecoderStatsStageName(const JxlDecoderStats* stats,
+                                     size_t index) {
+  if (index >= JxlDecoderStatsNumStages(stats)) return nullptr;
+  return stats->stats.stages()[index].name.c_str();
+}
+
+uint64_t JxlDecoderStatsStageTime(const JxlDecoderStats* stats, size_t index) {
+  if (index >= JxlDecoderStatsNumStages(stats)) return 0;
+  return stats->stats.stages()[index].ns.load(std::memory_order_relaxed);
+}
+
+static_assert(jxl::DecoderStats::kMaxCounters == JXL_DEC_STATS_MAX_COUNTERS,
+              "counter limits differ");
+
+JXL_BOOL JxlDecoderStatsSetCounters(JxlDecoderStats* stats,
+                                    size_t num_counters,
+                                    JxlDecoderStatsCounterReader reader,
+                                    void* opaque) {
+  if (!stats || num_counters > JXL_DEC_STATS_MAX_COUNTERS ||
+      (num_counters != 0 && !reader)) {
+    return JXL_FALSE;
+  }
+  stats->stats.SetCounters(num_counters, reader, opaque);
+  return JXL_TRUE;
+}
+
+uint64_t JxlDecoderStatsGetCounter(const JxlDecoderStats* stats,
+                                   JxlDecoderStatsKey key, size_t counter) {
+  if (!stats || counter >= JXL_DEC_STATS_MAX_COUNTERS) return 0;
+  using jxl::DecoderStats;
+  const DecoderStats& s = stats->stats;
+  switch (key) {
+    case JXL_DEC_STAT_TOTAL_NS:
+      return s.PhaseCount(DecoderStats::kTotal, counter);
+    case JXL_DEC_STAT_DC_GLOBAL_NS:
+      return s.PhaseCount(DecoderStats::kDcGlobal, counter);
+    case JXL_DEC_STAT_DC_GROUPS_NS:
+      return s.PhaseCount(DecoderStats::kDcGroups, counter);
+    case JXL_DEC_STAT_AC_GLOBAL_NS:
+      return s.PhaseCount(DecoderStats::kAcGlobal, counter);
+    case JXL_DEC_STAT_AC_GROUPS_NS:
+      return s.PhaseCount(DecoderStats::kAcGroups, counter);
+    case JXL_DEC_STAT_FINALIZE_NS:
+      return s.PhaseCount(DecoderStats::kFinalize, counter);
+    case JXL_DEC_STAT_RENDER_NS:
+      return s.StagesCount(counter);
+    case JXL_DEC_STAT_CMS_NS:
+      return s.StagesCount(counter, "Cms");
+    case JXL_DEC_STAT_OUTPUT_NS:
+      return s.StagesCount(counter, "Write") +
+             s.StagesCount(counter, "DirectOutput");
+    default:
+      return 0;
+  }
+}
+
+uint64_t JxlDecoderStatsStageCounter(const JxlDecoderStats* stats,
+                                     size_t index, size_t counter) {
+  if (index >= JxlDecoderStatsNumStages(stats) ||
+      counter >= JXL_DEC_STATS_MAX_COUNTERS) {
+    return 0;
+  }
+  return stats->stats.stages()[index].counts[counter].load(
+      std::memory_order_relaxed);
+}
+
+void JxlDecoderStatsMerge(JxlDecoderStats* stats,
+                          const JxlDecoderStats* other) {
+  if (!stats || !other) return;
+  stats->stats.Merge(other->stats);
+}
@@ -0,0 +1,71 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/encode.h>
+#include <jxl/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/jxl.h"
+#include "lib/extras/enc/jxl.h"
+#include "lib/extras/packed_image.h"
+#include "lib/jxl/base/span.h"
+#include "tools/file_io.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+// Decodes flower.png from the test data, encoded either as VarDCT at distance
+// 1 if the argument is 0, or losslessly with modular and an MA tree if it is
+// 1, on a single thread. Items are pixels.
+void BM_DecodeFlower(benchmark::State& state) {
+  const bool lossless = state.range(0) != 0;
+  std::vector<uint8_t> png;
+  BM_CHECK(jpegxl::tools::ReadFile(
+      std::string(TEST_DATA_PATH "/jxl/flower/flower.png"), &png));
+  extras::PackedPixelFile ppf;
+  BM_CHECK(extras::DecodeBytes(Bytes(png), extras::ColorHints(), &ppf));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = lossless ? 0.0f : 1.0f;
+  if (lossless) cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR, 1);
+  std::vector<uint8_t> compressed;
+  BM_CHECK(extras::EncodeImageJXL(cparams, ppf, /*jpeg_bytes=*/nullptr,
+                                  &compressed));
+
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0}};
+  for (auto _ : state) {
+    (void)_;
+    extras::PackedPixelFile decoded;
+    size_t decoded_bytes;
+    BM_CHECK(extras::DecodeImageJXL(compressed.data(), compressed.size(),
+                                    dparams, &decoded_bytes, &decoded));
+    benchmark::DoNotOptimize(decoded.frames.size());
+  }
+
+  state.SetItemsProcessed(ppf.info.xsize * ppf.info.ysize *
+                          state.iterations());
+}
+
+BENCHMARK(BM_DecodeFlower)->Arg(0)->Arg(1);
+
+}  // namespace
+}  // namespace jxl
@@ -19,10 +19,13 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
 #include <ostream>
 #include <set>
 #include <sstream>
@@ -45,6 +48,7 @@
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/common.h"  // SpeedTier
 #include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/dec_external_image.h"
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_external_image.h"
@@ -65,6 +69,7 @@
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 #include "lib/jxl/padded_bytes.h"
+#include "lib/jxl/render_pipeline/gpu_offload.h"
 #include "lib/jxl/test_image.h"
 #include "lib/jxl/test_memory_manager.h"
 #include "lib/jxl/test_utils.h"
@@ -1167,6 +1172,33 @@ TEST(DecodeTest, IccProfileTestXybEncoded) {
   JxlDecoderDestroy(dec);
 }
 
+// Decoders of the same input, after the first one, get the profile from the
+// process-wide cache of decoded profiles.
+TEST(DecodeTest, IccProfileCachedAcrossDecoders) {
+  jxl::IccBytes icc_profile = GetIccTestProfile();
+  std::vector<uint8_t> data = GetIccTestHeader(icc_profile, false);
+
+  for (size_t i = 0; i < 3; i++) {
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_COLOR_ENCODING));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, data.data(), data.size()));
+    EXPECT_EQ(JXL_DEC_COLOR_ENCODING, JxlDecoderProcessInput(dec));
+    size_t dec_profile_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetICCProfileSize(
+                  dec, JXL_COLOR_PROFILE_TARGET_ORIGINAL, &dec_profile_size));
+    ASSERT_EQ(icc_profile.size(), dec_profile_size);
+    jxl::IccBytes icc_profile2(icc_profile.size());
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetColorAsICCProfile(
+                                   dec, JXL_COLOR_PROFILE_TARGET_ORIGINAL,
+                                   icc_profile2.data(), icc_profile2.size()));
+    EXPECT_EQ(icc_profile, icc_profile2);
+    JxlDecoderDestroy(dec);
+  }
+}
+
 // Test decoding ICC from partial files byte for byte.
 // This test must pass also if JXL_CRASH_ON_ERROR is enabled, that is, the
 // decoding of the ANS histogram and stream of the encoded ICC profile must also
@@ -1619,6 +1651,95 @@ TEST(DecodeTest, PixelTestWithICCProfileLossless) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, RewindKeepsICCProfile) {
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  params.add_icc_profile = true;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  std::vector<uint8_t> icc;
+  std::vector<uint8_t> pixels2 = jxl::DecodeWithAPI(
+      dec.get(), jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true, &icc);
+  EXPECT_FALSE(icc.empty());
+
+  // The second decode takes the profile kept from the first one.
+  JxlDecoderRewind(dec.get());
+  std::vector<uint8_t> icc2;
+  std::vector<uint8_t> pixels3 = jxl::DecodeWithAPI(
+      dec.get(), jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true, &icc2);
+  EXPECT_EQ(icc, icc2);
+  EXPECT_EQ(pixels2, pixels3);
+}
+
+TEST(DecodeTest, GainMapTest) {
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  std::vector<uint8_t> base = jxl::DecodeWithAPI(
+      dec.get(), jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+
+  // A gain of 1/2 everywhere for a display halfway between the headrooms of
+  // the base and alternate images, whatever the value of the gain map.
+  JxlGainMapParams gain_params;
+  for (size_t c = 0; c < 3; c++) {
+    gain_params.gain_map_min[c] = -2.0f;
+    gain_params.gain_map_max[c] = -2.0f;
+    gain_params.gamma[c] = 1.0f;
+    gain_params.base_offset[c] = 0.0f;
+    gain_params.alternate_offset[c] = 0.0f;
+  }
+  gain_params.base_hdr_headroom = 0.0f;
+  gain_params.alternate_hdr_headroom = 2.0f;
+  const std::vector<uint8_t> gain_map = {0, 64, 128, 255};
+  JxlPixelFormat gain_format = {1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  JxlDecoderReset(dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetGainMap(dec.get(), &gain_params, &gain_format,
+                                 gain_map.data(), gain_map.size(), 2, 2,
+                                 /*display_hdr_headroom=*/1.0f));
+  std::vector<uint8_t> mapped = jxl::DecodeWithAPI(
+      dec.get(), jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  ASSERT_EQ(base.size(), mapped.size());
+
+  const auto to_linear = [](float v) {
+    return v <= 0.04045f ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+  };
+  for (size_t i = 0; i < base.size(); i += 4) {
+    float b;
+    float m;
+    memcpy(&b, &base[i], 4);
+    memcpy(&m, &mapped[i], 4);
+    EXPECT_NEAR(to_linear(b) * 0.5f, to_linear(m), 1e-3f);
+  }
+}
+
 TEST(DecodeTest, PixelTestWithICCProfileLossy) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   JxlDecoder* dec = JxlDecoderCreate(nullptr);
@@ -2027,6 +2148,65 @@ TEST_P(DecodeAllEncodingsWithCMSTest, DecodeWithCMS) {
   EXPECT_LT(dist, .1);
 }
 
+// An output profile that the decoder recognizes as an enum color encoding is
+// converted to without the CMS, even if one is set, and that conversion
+// matches the one of the CMS.
+TEST(DecodeTest, DecodeToRecognizedIccWithoutCms) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  size_t xsize = 177;
+  size_t ysize = 123;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> data = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+      jxl::TestCodestreamParams());
+  jxl::ColorEncoding srgb = jxl::ColorEncoding::SRGB(/*is_gray=*/false);
+  jxl::ColorEncoding display_p3;
+  display_p3.SetColorSpace(jxl::ColorSpace::kRGB);
+  ASSERT_TRUE(display_p3.SetWhitePointType(jxl::WhitePoint::kD65));
+  ASSERT_TRUE(display_p3.SetPrimariesType(jxl::Primaries::kP3));
+  display_p3.Tf().SetTransferFunction(jxl::TransferFunction::kSRGB);
+
+  std::vector<uint8_t> out_with_cms;
+  JxlBasicInfo info_with_cms;
+  DecodeImageWithColorEncoding(data, display_p3, true, out_with_cms,
+                               info_with_cms);
+  std::vector<uint8_t> out_without_cms;
+  JxlBasicInfo info_without_cms;
+  DecodeImageWithColorEncoding(data, display_p3, false, out_without_cms,
+                               info_without_cms);
+  EXPECT_EQ(out_with_cms, out_without_cms);
+
+  // Reference: the image in its original sRGB, converted by the CMS.
+  std::vector<uint8_t> out_srgb;
+  JxlBasicInfo info_srgb;
+  DecodeImageWithColorEncoding(data, srgb, false, out_srgb, info_srgb);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  jxl::ImageMetadata metadata;
+  metadata.SetUintSamples(16);
+  metadata.color_encoding = srgb;
+  jxl::ImageBundle reference(memory_manager, &metadata);
+  ASSERT_TRUE(jxl::ConvertFromExternal(
+      jxl::Bytes(out_srgb.data(), out_srgb.size()), xsize, ysize, srgb,
+      /*bits_per_sample=*/16, format, /*pool=*/nullptr, &reference));
+  ASSERT_TRUE(reference.TransformTo(display_p3, *JxlGetDefaultCms()));
+
+  ASSERT_EQ(xsize * ysize * 3 * 2, out_without_cms.size());
+  float max_error = 0.0f;
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        const uint8_t* p = &out_without_cms[((y * xsize + x) * 3 + c) * 2];
+        const float value = ((p[0] << 8) | p[1]) / 65535.0f;
+        const float expected = reference.color()->ConstPlaneRow(c, y)[x];
+        max_error = std::max(max_error, std::abs(value - expected));
+      }
+    }
+  }
+  // The profiles only differ by their primaries, so that a wrong matrix would
+  // be off by much more than this on the saturated colors of the image.
+  EXPECT_LT(max_error, 4e-3f);
+}
+
 // Tests the case of lossy sRGB image without alpha channel, decoded to RGB8
 // and to RGBA8
 TEST(DecodeTest, PixelTestOpaqueSrgbLossy) {
@@ -2476,121 +2656,1289 @@ TEST(DecodeTest, DCNotGettableTest) {
 
   EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
 
-  // Since the image is only 1x1 pixel, there is only 1 group, the decoder is
-  // unable to get DC size from this, and will not return the DC at all. Since
-  // no full image is requested either, it is expected to return success.
-  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+  // Since the image is only 1x1 pixel, there is only 1 group, the decoder is
+  // unable to get DC size from this, and will not return the DC at all. Since
+  // no full image is requested either, it is expected to return success.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+
+  JxlDecoderDestroy(dec);
+}
+
+TEST(DecodeTest, PreviewTest) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  size_t xsize = 77;
+  size_t ysize = 120;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format_orig = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  for (jxl::PreviewMode mode : {jxl::kSmallPreview, jxl::kBigPreview}) {
+    jxl::TestCodestreamParams params;
+    params.preview_mode = mode;
+
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+
+    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    const uint8_t* next_in = compressed.data();
+    size_t avail_in = compressed.size();
+
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(
+                  dec, JXL_DEC_BASIC_INFO | JXL_DEC_PREVIEW_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, next_in, avail_in));
+
+    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
+    JxlBasicInfo info;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec, &info));
+    size_t buffer_size;
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderPreviewOutBufferSize(dec, &format, &buffer_size));
+
+    jxl::ColorEncoding c_srgb = jxl::ColorEncoding::SRGB(false);
+    jxl::CodecInOut io0{memory_manager};
+    EXPECT_TRUE(jxl::ConvertFromExternal(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, c_srgb,
+        /*bits_per_sample=*/16, format_orig, /*pool=*/nullptr, &io0.Main()));
+    GeneratePreview(params.preview_mode, &io0.Main());
+
+    size_t xsize_preview = io0.Main().xsize();
+    size_t ysize_preview = io0.Main().ysize();
+    EXPECT_EQ(xsize_preview, info.preview.xsize);
+    EXPECT_EQ(ysize_preview, info.preview.ysize);
+    EXPECT_EQ(xsize_preview * ysize_preview * 3, buffer_size);
+
+    EXPECT_EQ(JXL_DEC_NEED_PREVIEW_OUT_BUFFER, JxlDecoderProcessInput(dec));
+
+    std::vector<uint8_t> preview(buffer_size);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetPreviewOutBuffer(dec, &format, preview.data(),
+                                            preview.size()));
+
+    EXPECT_EQ(JXL_DEC_PREVIEW_IMAGE, JxlDecoderProcessInput(dec));
+
+    jxl::CodecInOut io1{memory_manager};
+    EXPECT_TRUE(
+        jxl::ConvertFromExternal(jxl::Bytes(preview.data(), preview.size()),
+                                 xsize_preview, ysize_preview, c_srgb,
+                                 /*bits_per_sample=*/8, format,
+                                 /*pool=*/nullptr, &io1.Main()));
+
+    jxl::ButteraugliParams butteraugli_params;
+    // TODO(lode): this ButteraugliDistance silently returns 0 (dangerous for
+    // tests) if xsize or ysize is < 8, no matter how different the images, a
+    // tiny size that could happen for a preview. ButteraugliDiffmap does
+    // support smaller than 8x8, but jxl's ButteraugliDistance does not. Perhaps
+    // move butteraugli's <8x8 handling from ButteraugliDiffmap to
+    // ButteraugliComparator::Diffmap in butteraugli.cc.
+    EXPECT_LE(ButteraugliDistance(io0.frames, io1.frames, butteraugli_params,
+                                  *JxlGetDefaultCms(),
+                                  /*distmap=*/nullptr, nullptr),
+              mode == jxl::kSmallPreview ? 0.7f : 1.2f);
+
+    JxlDecoderDestroy(dec);
+  }
+}
+
+TEST(DecodeTest, AlignTest) {
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  JxlPixelFormat format_orig = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  jxl::TestCodestreamParams params;
+  // Lossless to verify pixels exactly after roundtrip.
+  params.cparams.SetLossless();
+  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+
+  size_t align = 17;
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, align};
+  // On purpose not using jxl::RoundUpTo to test it independently.
+  size_t expected_line_size_last = 1 * 3 * xsize;
+  size_t expected_line_size =
+      ((expected_line_size_last + align - 1) / align) * align;
+  size_t expected_pixels_size =
+      expected_line_size * (ysize - 1) + expected_line_size_last;
+
+  for (bool use_callback : {false, true}) {
+    std::vector<uint8_t> pixels2 = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format, use_callback,
+        /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    EXPECT_EQ(expected_pixels_size, pixels2.size());
+    EXPECT_EQ(0u, jxl::test::ComparePixels(pixels.data(), pixels2.data(), xsize,
+                                           ysize, format_orig, format));
+  }
+}
+
+// Lossless modular frames decoded to an integer image buffer are written by
+// the modular decoder itself, the pixel callback gets them through the render
+// pipeline.
+TEST(DecodeTest, DirectModularOutputTest) {
+  size_t xsize = 300;
+  size_t ysize = 270;
+  for (uint32_t orig_channels = 1; orig_channels <= 4; ++orig_channels) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, orig_channels, 0);
+    jxl::TestCodestreamParams params;
+    params.cparams.SetLossless();
+    params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, orig_channels,
+        params);
+    // Gray images to gray formats and color images to color formats, with or
+    // without alpha.
+    const uint32_t num_color = orig_channels <= 2 ? 1 : 3;
+    for (uint32_t channels : {num_color, num_color + 1}) {
+      for (JxlEndianness endianness : {JXL_LITTLE_ENDIAN, JXL_BIG_ENDIAN}) {
+        JxlPixelFormat format = {channels, JXL_TYPE_UINT16, endianness, 0};
+        std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+            jxl::Bytes(compressed.data(), compressed.size()), format,
+            /*use_callback=*/true, /*set_buffer_early=*/false,
+            /*use_resizable_runner=*/false, /*require_boxes=*/false,
+            /*expect_success=*/true);
+        std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+            jxl::Bytes(compressed.data(), compressed.size()), format,
+            /*use_callback=*/false, /*set_buffer_early=*/false,
+            /*use_resizable_runner=*/true, /*require_boxes=*/false,
+            /*expect_success=*/true);
+        EXPECT_EQ(expected, decoded);
+      }
+    }
+  }
+}
+
+TEST(DecodeTest, CropRegionTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  const uint32_t x0 = 300;
+  const uint32_t y0 = 280;
+  const uint32_t crop_xsize = 120;
+  const uint32_t crop_ysize = 70;
+  for (bool lossless : {false, true}) {
+    for (JxlOrientation orientation :
+         {JXL_ORIENT_IDENTITY, JXL_ORIENT_ROTATE_90_CW}) {
+      jxl::TestCodestreamParams params;
+      params.orientation = orientation;
+      if (lossless) params.cparams.SetLossless();
+      std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+          jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+      std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+          jxl::Bytes(compressed.data(), compressed.size()), format,
+          /*use_callback=*/false, /*set_buffer_early=*/false,
+          /*use_resizable_runner=*/false, /*require_boxes=*/false,
+          /*expect_success=*/true);
+
+      JxlDecoder* dec = JxlDecoderCreate(nullptr);
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetCropRegion(dec, x0, y0, crop_xsize, crop_ysize));
+      std::vector<uint8_t> cropped = jxl::DecodeWithAPI(
+          dec, jxl::Bytes(compressed.data(), compressed.size()), format,
+          /*use_callback=*/false, /*set_buffer_early=*/false,
+          /*use_resizable_runner=*/false, /*require_boxes=*/false,
+          /*expect_success=*/true);
+      JxlDecoderDestroy(dec);
+
+      ASSERT_EQ(expected.size(), cropped.size());
+      const size_t out_xsize =
+          orientation == JXL_ORIENT_IDENTITY ? xsize : ysize;
+      const size_t stride = out_xsize * 3;
+      for (size_t y = y0; y < y0 + crop_ysize; y++) {
+        const size_t begin = y * stride + x0 * 3;
+        const size_t end = begin + crop_xsize * 3;
+        EXPECT_TRUE(std::equal(expected.begin() + begin,
+                               expected.begin() + end, cropped.begin() + begin))
+            << "row " << y << " lossless: " << lossless
+            << " orientation: " << orientation;
+      }
+    }
+  }
+}
+
+TEST(DecodeTest, RenderOnDemandTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  const size_t stride = xsize * 3;
+  // Regions in distinct groups, the second one overlapping the first.
+  const uint32_t regions[][4] = {{20, 30, 100, 40}, {100, 50, 300, 120}};
+  for (bool lossless : {false, true}) {
+    jxl::TestCodestreamParams params;
+    if (lossless) params.cparams.SetLossless();
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetRenderOnDemand(dec, JXL_TRUE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetInput(dec, compressed.data(), compressed.size()));
+    JxlDecoderCloseInput(dec);
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderRenderRegion(dec, 0, 0, 10, 10));
+    const uint8_t kUnrendered = 0x5A;
+    std::vector<uint8_t> output(xsize * ysize * 3, kUnrendered);
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutBuffer(
+                                   dec, &format, output.data(), output.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec));
+    // Nothing is rendered before it is requested.
+    EXPECT_TRUE(std::all_of(output.begin(), output.end(),
+                            [&](uint8_t v) { return v == kUnrendered; }));
+    for (const auto& region : regions) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderRenderRegion(dec, region[0], region[1], region[2],
+                                       region[3]));
+      for (size_t y = region[1]; y < region[1] + region[3]; y++) {
+        const size_t begin = y * stride + region[0] * 3;
+        const size_t end = begin + region[2] * 3;
+        EXPECT_TRUE(std::equal(expected.begin() + begin,
+                               expected.begin() + end, output.begin() + begin))
+            << "row " << y << " lossless: " << lossless;
+      }
+    }
+    // The last group is outside of the regions.
+    EXPECT_EQ(kUnrendered, output.back());
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec));
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderRenderRegion(dec, 0, 0, 10, 10));
+    JxlDecoderDestroy(dec);
+  }
+}
+
+TEST(DecodeTest, GPURenderingTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  // Without a CUDA device, the frames are rendered on the CPU as usual.
+  const bool has_gpu = jxl::CreateGPURenderPipelineOffload() != nullptr;
+  for (size_t resampling : {1, 2}) {
+    jxl::TestCodestreamParams params;
+    params.cparams.resampling = resampling;
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+
+    JxlDecoder* dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetGPURendering(dec, JXL_TRUE));
+    std::vector<uint8_t> rendered = jxl::DecodeWithAPI(
+        dec, jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderDestroy(dec);
+
+    ASSERT_EQ(expected.size(), rendered.size());
+    if (!has_gpu) {
+      EXPECT_EQ(expected, rendered) << "resampling: " << resampling;
+      continue;
+    }
+    // The GPU results differ from those of the CPU by rounding errors.
+    for (size_t i = 0; i < expected.size(); i++) {
+      ASSERT_NEAR(expected[i], rendered[i], 1)
+          << "index " << i << " resampling: " << resampling;
+    }
+  }
+}
+
+TEST(DecodeTest, OutputDownsamplingTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  // Not 8-bit, which would use a faster conversion for the full decode.
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_LITTLE_ENDIAN, 0};
+  const size_t bytes_per_pixel = 6;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+      jxl::TestCodestreamParams());
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+
+  JxlDecoder* dec = JxlDecoderCreate(nullptr);
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetOutputDownsampling(dec, 3));
+  JxlDecoderDestroy(dec);
+
+  for (uint32_t factor : {2, 4, 8}) {
+    dec = JxlDecoderCreate(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetOutputDownsampling(dec, factor));
+    std::vector<uint8_t> downsampled = jxl::DecodeWithAPI(
+        dec, jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderDestroy(dec);
+
+    const size_t out_xsize = jxl::DivCeil(xsize, factor);
+    const size_t out_ysize = jxl::DivCeil(ysize, factor);
+    ASSERT_EQ(out_xsize * out_ysize * bytes_per_pixel, downsampled.size());
+    // Every output pixel is the average of its block in the full decode, up to
+    // the rounding of both to 16 bits. At 1:8 the image is rendered from DC
+    // only, which is the average of the blocks before the color conversion
+    // and the filters, so it is only close to it on average.
+    double total_error = 0;
+    for (size_t y = 0; y < out_ysize; y++) {
+      for (size_t x = 0; x < out_xsize; x++) {
+        for (size_t c = 0; c < 3; c++) {
+          double sum = 0;
+          size_t num = 0;
+          for (size_t iy = y * factor; iy < std::min(ysize, (y + 1) * factor);
+               iy++) {
+            for (size_t ix = x * factor;
+                 ix < std::min(xsize, (x + 1) * factor); ix++) {
+              sum += LoadLE16(&expected[((iy * xsize + ix) * 3 + c) * 2]);
+              num++;
+            }
+          }
+          const double value =
+              LoadLE16(&downsampled[((y * out_xsize + x) * 3 + c) * 2]);
+          const double error = std::abs(value - sum / num);
+          total_error += error;
+          if (factor != 8) {
+            ASSERT_LE(error, 2.0) << "factor " << factor << " x " << x << " y "
+                                  << y << " c " << c;
+          }
+        }
+      }
+    }
+    EXPECT_LE(total_error / (out_xsize * out_ysize * 3), 0.03 * 65535)
+        << "factor " << factor;
+  }
+}
+
+// The factor can be chosen from the basic info, as thumbnailers do, but not
+// once the first frame started.
+TEST(DecodeTest, OutputDownsamplingAfterBasicInfoTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+      jxl::TestCodestreamParams());
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                                     JXL_DEC_FRAME |
+                                                     JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetOutputDownsampling(dec.get(), 4));
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetOutputDownsampling(dec.get(), 2));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+  EXPECT_EQ(jxl::DivCeil(xsize, 4) * jxl::DivCeil(ysize, 4) * 3, buffer_size);
+  std::vector<uint8_t> output(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, output.data(),
+                                        output.size()));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+}
+
+TEST(DecodeTest, FrameIsModularTest) {
+  size_t xsize = 90;
+  size_t ysize = 70;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  for (bool modular : {false, true}) {
+    jxl::TestCodestreamParams params;
+    params.cparams.modular_mode = modular;
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    JXL_BOOL is_modular = JXL_FALSE;
+    EXPECT_EQ(JXL_DEC_ERROR,
+              JxlDecoderGetFrameIsModular(dec.get(), &is_modular));
+    EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderGetFrameIsModular(dec.get(), &is_modular));
+    EXPECT_EQ(TO_JXL_BOOL(modular), is_modular);
+  }
+}
+
+TEST(DecodeTest, MemoryLimitTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> output(xsize * ysize * 3);
+  const auto decode = [&](JxlDecoder* dec) -> JxlDecoderStatus {
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec, JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec);
+    for (;;) {
+      JxlDecoderStatus status = JxlDecoderProcessInput(dec);
+      if (status != JXL_DEC_NEED_IMAGE_OUT_BUFFER) return status;
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetImageOutBuffer(dec, &format, output.data(),
+                                            output.size()));
+    }
+  };
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  // Not even enough for the modular image of a single channel.
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec.get(), 100000));
+  EXPECT_EQ(JXL_DEC_MEMORY_LIMIT, decode(dec.get()));
+  EXPECT_EQ(JXL_DEC_MEMORY_LIMIT, JxlDecoderProcessInput(dec.get()));
+  JxlDecoderReleaseInput(dec.get());
+
+  JxlDecoderRewind(dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetMemoryLimit(dec.get(), 1 << 30));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, decode(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  JxlDecoderReleaseInput(dec.get());
+
+  JxlDecoderReset(dec.get());
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, decode(dec.get()));
+}
+
+TEST(DecodeTest, CollectStatsTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  // Float output, so that no fast path writes it without an output stage.
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  std::vector<float> output(xsize * ysize * 3);
+
+  JxlDecoderStats* stats = JxlDecoderStatsCreate();
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderCollectStats(dec.get(), stats));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, output.data(),
+                                        output.size() * sizeof(float)));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  // Collecting stats must be requested before decoding.
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderCollectStats(dec.get(), nullptr));
+
+  const uint64_t total = JxlDecoderStatsGet(stats, JXL_DEC_STAT_TOTAL_NS);
+  EXPECT_GT(JxlDecoderStatsGet(stats, JXL_DEC_STAT_DC_GLOBAL_NS), 0u);
+  EXPECT_GT(JxlDecoderStatsGet(stats, JXL_DEC_STAT_DC_GROUPS_NS), 0u);
+  EXPECT_GT(JxlDecoderStatsGet(stats, JXL_DEC_STAT_AC_GROUPS_NS), 0u);
+  EXPECT_GT(JxlDecoderStatsGet(stats, JXL_DEC_STAT_OUTPUT_NS), 0u);
+  EXPECT_LE(JxlDecoderStatsGet(stats, JXL_DEC_STAT_OUTPUT_NS),
+            JxlDecoderStatsGet(stats, JXL_DEC_STAT_RENDER_NS));
+  EXPECT_GT(total, 0u);
+  const uint64_t peak = JxlDecoderStatsGet(stats, JXL_DEC_STAT_PEAK_BYTES);
+  EXPECT_GT(peak, 0u);
+  EXPECT_GE(JxlDecoderStatsGet(stats, JXL_DEC_STAT_BYTES_ALLOCATED), peak);
+
+  // One stage per name, and the stages add up to the render time.
+  const size_t num_stages = JxlDecoderStatsNumStages(stats);
+  ASSERT_GT(num_stages, 0u);
+  std::set<std::string> names;
+  uint64_t stages_ns = 0;
+  for (size_t i = 0; i < num_stages; i++) {
+    names.insert(JxlDecoderStatsStageName(stats, i));
+    stages_ns += JxlDecoderStatsStageTime(stats, i);
+  }
+  EXPECT_EQ(num_stages, names.size());
+  EXPECT_EQ(1, names.count("WritePixelCB"));
+  EXPECT_EQ(stages_ns, JxlDecoderStatsGet(stats, JXL_DEC_STAT_RENDER_NS));
+  EXPECT_EQ(nullptr, JxlDecoderStatsStageName(stats, num_stages));
+
+  JxlDecoderStats* merged = JxlDecoderStatsCreate();
+  JxlDecoderStatsMerge(merged, stats);
+  JxlDecoderStatsMerge(merged, stats);
+  EXPECT_EQ(num_stages, JxlDecoderStatsNumStages(merged));
+  EXPECT_EQ(2 * total, JxlDecoderStatsGet(merged, JXL_DEC_STAT_TOTAL_NS));
+  EXPECT_EQ(peak, JxlDecoderStatsGet(merged, JXL_DEC_STAT_PEAK_BYTES));
+  JxlDecoderStatsDestroy(merged);
+  JxlDecoderStatsDestroy(stats);
+}
+
+TEST(DecodeTest, CollectStatsCountersTest) {
+  size_t xsize = 600;
+  size_t ysize = 500;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  std::vector<float> output(xsize * ysize * 3);
+
+  // A counter that increases with each read, from any thread.
+  std::atomic<uint64_t> reads{0};
+  const auto read_counters = [](void* opaque, uint64_t* values) {
+    values[0] = static_cast<std::atomic<uint64_t>*>(opaque)->fetch_add(1) + 1;
+  };
+  JxlDecoderStats* stats = JxlDecoderStatsCreate();
+  EXPECT_FALSE(JxlDecoderStatsSetCounters(stats, JXL_DEC_STATS_MAX_COUNTERS + 1,
+                                          read_counters, &reads));
+  ASSERT_TRUE(JxlDecoderStatsSetCounters(stats, 1, read_counters, &reads));
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderCollectStats(dec.get(), stats));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, output.data(),
+                                        output.size() * sizeof(float)));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+
+  EXPECT_GT(JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_TOTAL_NS, 0), 0u);
+  EXPECT_GT(JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_DC_GROUPS_NS, 0),
+            0u);
+  EXPECT_GT(JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_AC_GROUPS_NS, 0),
+            0u);
+  EXPECT_EQ(0u, JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_PEAK_BYTES, 0));
+  EXPECT_EQ(0u, JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_TOTAL_NS,
+                                          JXL_DEC_STATS_MAX_COUNTERS));
+
+  // Every stage that ran was counted, and the stages add up to the render
+  // counts.
+  const size_t num_stages = JxlDecoderStatsNumStages(stats);
+  ASSERT_GT(num_stages, 0u);
+  uint64_t stages_count = 0;
+  for (size_t i = 0; i < num_stages; i++) {
+    EXPECT_GT(JxlDecoderStatsStageCounter(stats, i, 0), 0u);
+    stages_count += JxlDecoderStatsStageCounter(stats, i, 0);
+  }
+  EXPECT_EQ(stages_count,
+            JxlDecoderStatsGetCounter(stats, JXL_DEC_STAT_RENDER_NS, 0));
+  EXPECT_EQ(0u, JxlDecoderStatsStageCounter(stats, num_stages, 0));
+
+  JxlDecoderStats* merged = JxlDecoderStatsCreate();
+  JxlDecoderStatsMerge(merged, stats);
+  JxlDecoderStatsMerge(merged, stats);
+  EXPECT_EQ(2 * stages_count,
+            JxlDecoderStatsGetCounter(merged, JXL_DEC_STAT_RENDER_NS, 0));
+  JxlDecoderStatsDestroy(merged);
+  JxlDecoderStatsDestroy(stats);
+}
+
+TEST(DecodeTest, BatchDecodeTest) {
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  const size_t kNumImages = 12;
+  std::vector<std::vector<uint8_t>> compressed(kNumImages);
+  std::vector<std::vector<uint8_t>> expected(kNumImages);
+  std::vector<std::vector<uint8_t>> outputs(kNumImages);
+  std::vector<JxlDecoderBatchImage> images(kNumImages);
+  for (size_t i = 0; i < kNumImages; ++i) {
+    const size_t xsize = 40 + 17 * i;
+    const size_t ysize = 30 + 11 * i;
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, i);
+    jxl::TestCodestreamParams params;
+    if (i % 2) params.cparams.SetLossless();
+    compressed[i] = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+    expected[i] = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed[i].data(), compressed[i].size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    images[i].data = compressed[i].data();
+    images[i].size = compressed[i].size();
+    images[i].format = format;
+    // Every third image gets no buffer and only reports its size.
+    if (i % 3) outputs[i].resize(xsize * ysize * 3);
+    images[i].buffer = outputs[i].empty() ? nullptr : outputs[i].data();
+    images[i].buffer_size = outputs[i].size();
+  }
+  const std::vector<uint8_t> garbage = {0xff, 0x0a, 0x12, 0x34};
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderDecodeBatch(nullptr, JxlThreadParallelRunner,
+                                  runner.get(), images.data(), kNumImages));
+  for (size_t i = 0; i < kNumImages; ++i) {
+    EXPECT_EQ(40 + 17 * i, images[i].xsize);
+    EXPECT_EQ(30 + 11 * i, images[i].ysize);
+    if (i % 3) {
+      EXPECT_EQ(JXL_DEC_SUCCESS, images[i].status);
+      EXPECT_EQ(expected[i], outputs[i]) << "image " << i;
+    } else {
+      EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, images[i].status);
+    }
+  }
+
+  // Once all the images have a buffer, the whole batch succeeds, also without
+  // a runner.
+  for (size_t i = 0; i < kNumImages; ++i) {
+    outputs[i].assign(images[i].xsize * images[i].ysize * 3, 0);
+    images[i].buffer = outputs[i].data();
+    images[i].buffer_size = outputs[i].size();
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderDecodeBatch(nullptr, JxlThreadParallelRunner,
+                                  runner.get(), images.data(), kNumImages));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderDecodeBatch(nullptr, nullptr, nullptr,
+                                                   images.data(), kNumImages));
+  for (size_t i = 0; i < kNumImages; ++i) {
+    EXPECT_EQ(JXL_DEC_SUCCESS, images[i].status);
+    EXPECT_EQ(expected[i], outputs[i]) << "image " << i;
+  }
+
+  // Invalid images only fail themselves.
+  images[5].data = garbage.data();
+  images[5].size = garbage.size();
+  EXPECT_EQ(JXL_DEC_ERROR,
+            JxlDecoderDecodeBatch(nullptr, JxlThreadParallelRunner,
+                                  runner.get(), images.data(), kNumImages));
+  EXPECT_EQ(JXL_DEC_ERROR, images[5].status);
+  EXPECT_EQ(JXL_DEC_SUCCESS, images[6].status);
+}
+
+TEST(DecodeTest, PlanarOutputTest) {
+  size_t xsize = 57;
+  size_t ysize = 33;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  jxl::TestCodestreamParams params;
+  params.cparams.SetLossless();
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat rgb_format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> rgb_bytes = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), rgb_format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  std::vector<float> rgb(xsize * ysize * 3);
+  ASSERT_EQ(rgb.size() * sizeof(float), rgb_bytes.size());
+  memcpy(rgb.data(), rgb_bytes.data(), rgb_bytes.size());
+  // Expected YCbCr of pixel (x, y), scaled to [0, 255].
+  const auto ycbcr = [&](size_t x, size_t y, size_t c) -> float {
+    const float* p = &rgb[(y * xsize + x) * 3];
+    const float luma = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    if (c == 0) return luma * 255;
+    if (c == 1) return 128 + (p[2] - luma) * (0.5f / 0.886f) * 255;
+    return 128 + (p[0] - luma) * (0.5f / 0.701f) * 255;
+  };
+
+  const auto decode = [&](JxlPlanarLayout layout, size_t padding,
+                          std::vector<uint8_t> (&planes)[3]) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    JxlPlanarImageOutBuffer buffer = {};
+    buffer.layout = layout;
+    buffer.data_type = JXL_TYPE_UINT8;
+    const size_t cxsize = (layout == JXL_PLANAR_YCBCR_444 ? xsize : 29);
+    const size_t cysize = (layout == JXL_PLANAR_YCBCR_444 ? ysize : 17);
+    for (size_t i = 0; i < 3; ++i) {
+      if (i == 2 && layout == JXL_SEMIPLANAR_NV12) break;
+      size_t row_size = (i == 0 ? xsize : cxsize);
+      if (i == 1 && layout == JXL_SEMIPLANAR_NV12) row_size *= 2;
+      buffer.strides[i] = padding == 0 ? 0 : row_size + padding;
+      const size_t stride = row_size + padding;
+      const size_t rows = (i == 0 ? ysize : cysize);
+      planes[i].assign(stride * (rows - 1) + row_size, 0);
+      buffer.planes[i] = planes[i].data();
+      buffer.plane_sizes[i] = planes[i].size() - 1;
+      // Too small by one byte.
+      EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+      buffer.plane_sizes[i] = planes[i].size();
+    }
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+  };
+
+  std::vector<uint8_t> planes[3];
+  decode(JXL_PLANAR_YCBCR_444, 0, planes);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      for (size_t c = 0; c < 3; ++c) {
+        EXPECT_NEAR(ycbcr(x, y, c), planes[c][y * xsize + x], 0.6f);
+      }
+    }
+  }
+
+  // The chroma of a 2x2 block is the average of its pixels, of which there
+  // are fewer in the last column and row.
+  const auto chroma = [&](size_t cx, size_t cy, size_t c) -> float {
+    float sum = 0;
+    size_t num = 0;
+    for (size_t y = cy * 2; y < std::min(cy * 2 + 2, ysize); ++y) {
+      for (size_t x = cx * 2; x < std::min(cx * 2 + 2, xsize); ++x) {
+        sum += ycbcr(x, y, c);
+        num++;
+      }
+    }
+    return sum / num;
+  };
+  const size_t padding = 3;
+  decode(JXL_PLANAR_YCBCR_420, padding, planes);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      EXPECT_NEAR(ycbcr(x, y, 0), planes[0][y * (xsize + padding) + x], 0.6f);
+    }
+  }
+  for (size_t cy = 0; cy < 17; ++cy) {
+    for (size_t cx = 0; cx < 29; ++cx) {
+      for (size_t c = 1; c < 3; ++c) {
+        EXPECT_NEAR(chroma(cx, cy, c), planes[c][cy * (29 + padding) + cx],
+                    0.6f);
+      }
+    }
+  }
+
+  decode(JXL_SEMIPLANAR_NV12, 0, planes);
+  for (size_t cy = 0; cy < 17; ++cy) {
+    for (size_t cx = 0; cx < 29; ++cx) {
+      EXPECT_NEAR(chroma(cx, cy, 1), planes[1][cy * 58 + cx * 2], 0.6f);
+      EXPECT_NEAR(chroma(cx, cy, 2), planes[1][cy * 58 + cx * 2 + 1], 0.6f);
+    }
+  }
+
+  // P010: 10 significant bits in the high bits of little endian samples.
+  {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    std::vector<uint16_t> luma(xsize * ysize);
+    std::vector<uint16_t> chroma_plane(58 * 17);
+    JxlPlanarImageOutBuffer buffer = {};
+    buffer.layout = JXL_SEMIPLANAR_NV12;
+    buffer.data_type = JXL_TYPE_UINT16;
+    buffer.endianness = JXL_LITTLE_ENDIAN;
+    buffer.bits_per_sample = 10;
+    buffer.planes[0] = luma.data();
+    buffer.plane_sizes[0] = luma.size() * sizeof(uint16_t);
+    buffer.planes[1] = chroma_plane.data();
+    buffer.plane_sizes[1] = chroma_plane.size() * sizeof(uint16_t);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    const auto sample = [](const uint16_t* p) -> float {
+      const uint8_t* bytes = reinterpret_cast<const uint8_t*>(p);
+      const uint32_t value = bytes[0] | (bytes[1] << 8);
+      EXPECT_EQ(0, value & 63);
+      return (value >> 6) * (255.0f / 1023);
+    };
+    for (size_t y = 0; y < ysize; ++y) {
+      for (size_t x = 0; x < xsize; ++x) {
+        EXPECT_NEAR(ycbcr(x, y, 0), sample(&luma[y * xsize + x]), 0.3f);
+      }
+    }
+    // Chroma is centered on 512 rather than 128 * 1023 / 255.
+    const float offset = 512 * (255.0f / 1023) - 128;
+    for (size_t cy = 0; cy < 17; ++cy) {
+      for (size_t cx = 0; cx < 29; ++cx) {
+        EXPECT_NEAR(chroma(cx, cy, 1) + offset,
+                    sample(&chroma_plane[cy * 58 + cx * 2]), 0.3f);
+        EXPECT_NEAR(chroma(cx, cy, 2) + offset,
+                    sample(&chroma_plane[cy * 58 + cx * 2 + 1]), 0.3f);
+      }
+    }
+
+    // Bit depths other than 9 to 16 bits of 16-bit samples are rejected.
+    buffer.bits_per_sample = 8;
+    EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+  }
+
+  // Planar output is not combined with downscaled output.
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetOutputDownsampling(dec.get(), 2));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  JxlPlanarImageOutBuffer buffer = {};
+  buffer.layout = JXL_PLANAR_YCBCR_444;
+  buffer.data_type = JXL_TYPE_UINT8;
+  for (size_t i = 0; i < 3; ++i) {
+    buffer.planes[i] = planes[0].data();
+    buffer.plane_sizes[i] = planes[0].size();
+  }
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+}
+
+TEST(DecodeTest, SoftResetTest) {
+  // Two images of the same size, then a larger and a smaller lossless one.
+  const size_t sizes[4][2] = {{300, 200}, {300, 200}, {520, 260}, {90, 70}};
+  JxlPixelFormat format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  for (size_t i = 0; i < 4; ++i) {
+    const size_t xsize = sizes[i][0];
+    const size_t ysize = sizes[i][1];
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, /*seed=*/i);
+    jxl::TestCodestreamParams params;
+    if (i == 3) params.cparams.SetLossless();
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+    std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    JxlDecoderSoftReset(dec.get());
+    std::vector<uint8_t> decoded = jxl::DecodeWithAPI(
+        dec.get(), jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    EXPECT_EQ(expected, decoded) << "image " << i;
+  }
+}
+
+TEST(DecodeTest, ImageOutRowCallbackTest) {
+  size_t xsize = 600;
+  size_t ysize = 700;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+      jxl::TestCodestreamParams());
+  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+
+  struct RowSink {
+    size_t row_size;
+    std::vector<uint8_t> image;
+    size_t next_row = 0;
+    // Rows accepted before the callback pauses.
+    size_t rows_per_pause = 100;
+    size_t rows_since_pause = 0;
+  };
+  RowSink sink;
+  sink.row_size = xsize * 3;
+  const auto callback = [](void* opaque, size_t y,
+                           const void* row) -> JXL_BOOL {
+    RowSink* sink = static_cast<RowSink*>(opaque);
+    EXPECT_EQ(sink->next_row, y);
+    const uint8_t* bytes = static_cast<const uint8_t*>(row);
+    sink->image.insert(sink->image.end(), bytes, bytes + sink->row_size);
+    ++sink->next_row;
+    if (++sink->rows_since_pause < sink->rows_per_pause) return JXL_TRUE;
+    sink->rows_since_pause = 0;
+    return JXL_FALSE;
+  };
+
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 4);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutRowCallback(
+                                 dec.get(), &format, callback, &sink));
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderFlushImage(dec.get()));
+  size_t num_pauses = 0;
+  JxlDecoderStatus status;
+  while ((status = JxlDecoderProcessInput(dec.get())) ==
+         JXL_DEC_IMAGE_OUT_PAUSED) {
+    // No rows are delivered while the callback is paused.
+    EXPECT_EQ((num_pauses + 1) * sink.rows_per_pause, sink.next_row);
+    ++num_pauses;
+  }
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, status);
+  EXPECT_EQ(ysize / sink.rows_per_pause, num_pauses);
+  EXPECT_EQ(ysize, sink.next_row);
+  EXPECT_EQ(expected, sink.image);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderProcessInput(dec.get()));
+}
+
+// The groups of a frame with a single group and pass are decoded on the calling
+// thread, without a runner call.
+TEST(DecodeTest, SingleGroupFrameSkipsGroupDispatchTest) {
+  struct TagRecorder {
+    std::mutex mutex;
+    std::set<std::string> tags;
+  };
+  JxlParallelRunnerTracer tracer = {};
+  tracer.run_begin = [](void* opaque, uint64_t run_id, uint32_t start_range,
+                        uint32_t end_range, size_t num_threads) {
+    TagRecorder* recorder = static_cast<TagRecorder*>(opaque);
+    const char* tag = JxlParallelRunTag();
+    std::lock_guard<std::mutex> lock(recorder->mutex);
+    recorder->tags.insert(tag != nullptr ? tag : "");
+  };
+  const auto decode_tags = [&](size_t xsize, size_t ysize) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3,
+        jxl::TestCodestreamParams());
+    TagRecorder recorder;
+    tracer.opaque = &recorder;
+    JxlThreadParallelRunnerPtr runner =
+        JxlThreadParallelRunnerMake(nullptr, 4);
+    JxlThreadParallelRunnerSetTracer(runner.get(), &tracer);
+    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER,
+              JxlDecoderProcessInput(dec.get()));
+    std::vector<uint8_t> decoded(xsize * ysize * 3);
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, decoded.data(),
+                                          decoded.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    return std::move(recorder.tags);
+  };
+
+  const std::set<std::string> single_group_tags = decode_tags(200, 150);
+  EXPECT_EQ(0u, single_group_tags.count("DecodeDCGroup"));
+  EXPECT_EQ(0u, single_group_tags.count("DecodeGroup"));
+  const std::set<std::string> multi_group_tags = decode_tags(600, 500);
+  EXPECT_EQ(1u, multi_group_tags.count("DecodeGroup"));
+}
 
-  JxlDecoderDestroy(dec);
+// Decoding XYB frames to an image buffer converts and writes the pixels in a
+// single stage, which must give the same pixels as the separate stages used
+// with a pixel callback.
+TEST(DecodeTest, XYBToOutputBufferMatchesCallbackTest) {
+  size_t xsize = 131;
+  size_t ysize = 67;
+  for (uint32_t num_channels = 3; num_channels <= 4; ++num_channels) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+    std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, num_channels,
+        jxl::TestCodestreamParams());
+    for (JxlDataType data_type :
+         {JXL_TYPE_UINT8, JXL_TYPE_UINT16, JXL_TYPE_FLOAT}) {
+#if !JXL_HIGH_PRECISION
+      // The fixed point conversion to 8-bit sRGB is approximate.
+      if (data_type == JXL_TYPE_UINT8 && jxl::HasFastXYBTosRGB8()) continue;
+#endif
+      for (JxlEndianness endianness : {JXL_LITTLE_ENDIAN, JXL_BIG_ENDIAN}) {
+        JxlPixelFormat format = {num_channels, data_type, endianness, 0};
+        std::vector<uint8_t> expected = jxl::DecodeWithAPI(
+            jxl::Bytes(compressed.data(), compressed.size()), format,
+            /*use_callback=*/true, /*set_buffer_early=*/false,
+            /*use_resizable_runner=*/false, /*require_boxes=*/false,
+            /*expect_success=*/true);
+        std::vector<uint8_t> actual = jxl::DecodeWithAPI(
+            jxl::Bytes(compressed.data(), compressed.size()), format,
+            /*use_callback=*/false, /*set_buffer_early=*/false,
+            /*use_resizable_runner=*/false, /*require_boxes=*/false,
+            /*expect_success=*/true);
+        EXPECT_EQ(expected, actual) << "channels " << num_channels << " type "
+                                    << data_type << " endianness "
+                                    << endianness;
+      }
+    }
+  }
 }
 
-TEST(DecodeTest, PreviewTest) {
-  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
-  size_t xsize = 77;
-  size_t ysize = 120;
-  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
-  JxlPixelFormat format_orig = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
-  for (jxl::PreviewMode mode : {jxl::kSmallPreview, jxl::kBigPreview}) {
+TEST(DecodeTest, PackedRGB10A2OutputTest) {
+  size_t xsize = 61;
+  size_t ysize = 37;
+  for (uint32_t num_channels = 3; num_channels <= 4; ++num_channels) {
+    std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
     jxl::TestCodestreamParams params;
-    params.preview_mode = mode;
-
+    params.cparams.SetLossless();
     std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
-        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
-
-    JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
-
-    JxlDecoder* dec = JxlDecoderCreate(nullptr);
-    const uint8_t* next_in = compressed.data();
-    size_t avail_in = compressed.size();
+        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, num_channels,
+        params);
+    JxlPixelFormat float_format = {num_channels, JXL_TYPE_FLOAT,
+                                   JXL_LITTLE_ENDIAN, 0};
+    std::vector<uint8_t> float_bytes = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), float_format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
+        /*use_resizable_runner=*/false, /*require_boxes=*/false,
+        /*expect_success=*/true);
+    std::vector<float> expected(xsize * ysize * num_channels);
+    ASSERT_EQ(expected.size() * sizeof(float), float_bytes.size());
+    memcpy(expected.data(), float_bytes.data(), float_bytes.size());
 
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
     EXPECT_EQ(JXL_DEC_SUCCESS,
-              JxlDecoderSubscribeEvents(
-                  dec, JXL_DEC_BASIC_INFO | JXL_DEC_PREVIEW_IMAGE));
-    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec, next_in, avail_in));
-
-    EXPECT_EQ(JXL_DEC_BASIC_INFO, JxlDecoderProcessInput(dec));
-    JxlBasicInfo info;
-    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBasicInfo(dec, &info));
+              JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                  compressed.size()));
+    JxlDecoderCloseInput(dec.get());
+    EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+    JxlPixelFormat format = {num_channels, JXL_TYPE_UINT32_RGB10_A2,
+                             JXL_BIG_ENDIAN, 0};
     size_t buffer_size;
     EXPECT_EQ(JXL_DEC_SUCCESS,
-              JxlDecoderPreviewOutBufferSize(dec, &format, &buffer_size));
-
-    jxl::ColorEncoding c_srgb = jxl::ColorEncoding::SRGB(false);
-    jxl::CodecInOut io0{memory_manager};
-    EXPECT_TRUE(jxl::ConvertFromExternal(
-        jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, c_srgb,
-        /*bits_per_sample=*/16, format_orig, /*pool=*/nullptr, &io0.Main()));
-    GeneratePreview(params.preview_mode, &io0.Main());
-
-    size_t xsize_preview = io0.Main().xsize();
-    size_t ysize_preview = io0.Main().ysize();
-    EXPECT_EQ(xsize_preview, info.preview.xsize);
-    EXPECT_EQ(ysize_preview, info.preview.ysize);
-    EXPECT_EQ(xsize_preview * ysize_preview * 3, buffer_size);
-
-    EXPECT_EQ(JXL_DEC_NEED_PREVIEW_OUT_BUFFER, JxlDecoderProcessInput(dec));
-
-    std::vector<uint8_t> preview(buffer_size);
+              JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+    ASSERT_EQ(xsize * ysize * 4, buffer_size);
+    std::vector<uint8_t> packed(buffer_size);
     EXPECT_EQ(JXL_DEC_SUCCESS,
-              JxlDecoderSetPreviewOutBuffer(dec, &format, preview.data(),
-                                            preview.size()));
-
-    EXPECT_EQ(JXL_DEC_PREVIEW_IMAGE, JxlDecoderProcessInput(dec));
+              JxlDecoderSetImageOutBuffer(dec.get(), &format, packed.data(),
+                                          packed.size()));
+    EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+    for (size_t i = 0; i < xsize * ysize; ++i) {
+      const uint8_t* p = &packed[i * 4];
+      const uint32_t word = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+      for (size_t c = 0; c < 3; ++c) {
+        const float value = expected[i * num_channels + c] * 1023;
+        EXPECT_NEAR(value, (word >> (c * 10)) & 1023, 0.51f);
+      }
+      // Without an alpha channel, alpha is opaque.
+      const float alpha = num_channels == 4 ? expected[i * 4 + 3] * 3 : 3;
+      EXPECT_NEAR(alpha, word >> 30, 0.51f);
+    }
+  }
 
-    jxl::CodecInOut io1{memory_manager};
-    EXPECT_TRUE(
-        jxl::ConvertFromExternal(jxl::Bytes(preview.data(), preview.size()),
-                                 xsize_preview, ysize_preview, c_srgb,
-                                 /*bits_per_sample=*/8, format,
-                                 /*pool=*/nullptr, &io1.Main()));
+  // Only for interleaved color output.
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 1, 0);
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 1,
+      jxl::TestCodestreamParams());
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  JxlPixelFormat gray_format = {1, JXL_TYPE_UINT32_RGB10_A2,
+                                JXL_NATIVE_ENDIAN, 0};
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_ERROR, JxlDecoderImageOutBufferSize(
+                               dec.get(), &gray_format, &buffer_size));
+}
 
-    jxl::ButteraugliParams butteraugli_params;
-    // TODO(lode): this ButteraugliDistance silently returns 0 (dangerous for
-    // tests) if xsize or ysize is < 8, no matter how different the images, a
-    // tiny size that could happen for a preview. ButteraugliDiffmap does
-    // support smaller than 8x8, but jxl's ButteraugliDistance does not. Perhaps
-    // move butteraugli's <8x8 handling from ButteraugliDiffmap to
-    // ButteraugliComparator::Diffmap in butteraugli.cc.
-    EXPECT_LE(ButteraugliDistance(io0.frames, io1.frames, butteraugli_params,
-                                  *JxlGetDefaultCms(),
-                                  /*distmap=*/nullptr, nullptr),
-              mode == jxl::kSmallPreview ? 0.7f : 1.2f);
+TEST(DecodeTest, PlanarOutputSubsampledGroupsTest) {
+  // A lossy image of several groups, so that the group borders are rendered
+  // apart, whose chroma alternates between rows.
+  size_t xsize = 300;
+  size_t ysize = 270;
+  std::vector<uint8_t> pixels(xsize * ysize * 3 * 2);
+  for (size_t y = 0; y < ysize; ++y) {
+    for (size_t x = 0; x < xsize; ++x) {
+      const uint16_t r = (y % 2 == 0 ? 50000 : 10000);
+      const uint16_t g = x * 65535 / xsize;
+      const uint16_t b = (y % 2 == 0 ? 10000 : 50000);
+      uint8_t* p = &pixels[(y * xsize + x) * 6];
+      StoreBE16(r, p);
+      StoreBE16(g, p + 2);
+      StoreBE16(b, p + 4);
+    }
+  }
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat rgb_format = {3, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> rgb_bytes = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), rgb_format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  std::vector<float> rgb(xsize * ysize * 3);
+  ASSERT_EQ(rgb.size() * sizeof(float), rgb_bytes.size());
+  memcpy(rgb.data(), rgb_bytes.data(), rgb_bytes.size());
 
-    JxlDecoderDestroy(dec);
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      nullptr, JxlThreadParallelRunnerDefaultNumWorkerThreads());
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetParallelRunner(dec.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  const size_t cxsize = xsize / 2;
+  const size_t cysize = ysize / 2;
+  std::vector<uint8_t> planes[3];
+  planes[0].resize(xsize * ysize);
+  planes[1].resize(cxsize * cysize);
+  planes[2].resize(cxsize * cysize);
+  JxlPlanarImageOutBuffer buffer = {};
+  buffer.layout = JXL_PLANAR_YCBCR_420;
+  buffer.data_type = JXL_TYPE_UINT8;
+  for (size_t i = 0; i < 3; ++i) {
+    buffer.planes[i] = planes[i].data();
+    buffer.plane_sizes[i] = planes[i].size();
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+
+  const auto cb_cr = [&](size_t x, size_t y, size_t c) -> float {
+    const float* p = &rgb[(y * xsize + x) * 3];
+    const float luma = 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+    if (c == 1) return 128 + (p[2] - luma) * (0.5f / 0.886f) * 255;
+    return 128 + (p[0] - luma) * (0.5f / 0.701f) * 255;
+  };
+  for (size_t cy = 0; cy < cysize; ++cy) {
+    for (size_t cx = 0; cx < cxsize; ++cx) {
+      for (size_t c = 1; c < 3; ++c) {
+        const float average =
+            0.25f * (cb_cr(2 * cx, 2 * cy, c) + cb_cr(2 * cx + 1, 2 * cy, c) +
+                     cb_cr(2 * cx, 2 * cy + 1, c) +
+                     cb_cr(2 * cx + 1, 2 * cy + 1, c));
+        const float expected = std::min(std::max(average, 0.0f), 255.0f);
+        EXPECT_NEAR(expected, planes[c][cy * cxsize + cx], 0.6f)
+            << "cx=" << cx << " cy=" << cy << " c=" << c;
+      }
+    }
   }
 }
 
-TEST(DecodeTest, AlignTest) {
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, PlanarOutputJPEGTest) {
+  TEST_LIBJPEG_SUPPORT();
   size_t xsize = 123;
   size_t ysize = 77;
-  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
-  JxlPixelFormat format_orig = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
-
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> jpeg_codestream;
   jxl::TestCodestreamParams params;
-  // Lossless to verify pixels exactly after roundtrip.
-  params.cparams.SetLossless();
-  params.cparams.speed_tier = jxl::SpeedTier::kThunder;
+  params.cparams.color_transform = jxl::ColorTransform::kNone;
+  params.box_format = kCSBF_Single;
+  params.jpeg_codestream = &jpeg_codestream;
   std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
-      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat rgb_format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0};
+  std::vector<uint8_t> rgb = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), rgb_format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
 
-  size_t align = 17;
-  JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, align};
-  // On purpose not using jxl::RoundUpTo to test it independently.
-  size_t expected_line_size_last = 1 * 3 * xsize;
-  size_t expected_line_size =
-      ((expected_line_size_last + align - 1) / align) * align;
-  size_t expected_pixels_size =
-      expected_line_size * (ysize - 1) + expected_line_size_last;
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetInput(dec.get(), compressed.data(),
+                                                compressed.size()));
+  JxlDecoderCloseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_NEED_IMAGE_OUT_BUFFER, JxlDecoderProcessInput(dec.get()));
+  std::vector<uint8_t> planes[3];
+  JxlPlanarImageOutBuffer buffer = {};
+  buffer.layout = JXL_PLANAR_YCBCR_444;
+  buffer.data_type = JXL_TYPE_UINT8;
+  for (size_t i = 0; i < 3; ++i) {
+    planes[i].resize(xsize * ysize);
+    buffer.planes[i] = planes[i].data();
+    buffer.plane_sizes[i] = planes[i].size();
+  }
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetImageOutPlanes(dec.get(), &buffer));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
 
-  for (bool use_callback : {false, true}) {
-    std::vector<uint8_t> pixels2 = jxl::DecodeWithAPI(
-        jxl::Bytes(compressed.data(), compressed.size()), format, use_callback,
-        /*set_buffer_early=*/false,
+  // The YCbCr samples of the JPEG, converted to RGB, give the RGB output up to
+  // the rounding of both outputs.
+  const auto clamp = [](float v) {
+    return std::min(std::max(v, 0.0f), 255.0f);
+  };
+  for (size_t i = 0; i < xsize * ysize; ++i) {
+    const float y = planes[0][i];
+    const float cb = planes[1][i] - 128.0f;
+    const float cr = planes[2][i] - 128.0f;
+    EXPECT_NEAR(rgb[i * 3 + 0], clamp(y + 1.402f * cr), 2.5f);
+    EXPECT_NEAR(rgb[i * 3 + 1], clamp(y - 0.344136f * cb - 0.714136f * cr),
+                2.5f);
+    EXPECT_NEAR(rgb[i * 3 + 2], clamp(y + 1.772f * cb), 2.5f);
+  }
+}
+
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, RGB8OutputJPEGTest) {
+  TEST_LIBJPEG_SUPPORT();
+  size_t xsize = 123;
+  size_t ysize = 77;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  std::vector<uint8_t> jpeg_codestream;
+  jxl::TestCodestreamParams params;
+  params.cparams.color_transform = jxl::ColorTransform::kNone;
+  params.box_format = kCSBF_Single;
+  params.jpeg_codestream = &jpeg_codestream;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 3, params);
+  JxlPixelFormat float_format = {3, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> float_pixels = jxl::DecodeWithAPI(
+      jxl::Bytes(compressed.data(), compressed.size()), float_format,
+      /*use_callback=*/false, /*set_buffer_early=*/false,
+      /*use_resizable_runner=*/false, /*require_boxes=*/false,
+      /*expect_success=*/true);
+  const float* reference = reinterpret_cast<const float*>(float_pixels.data());
+
+  // 8-bit output of a buffer is converted from YCbCr with fixed point
+  // arithmetic and without dithering, so it is the float output rounded, up
+  // to the error of the fixed point arithmetic.
+#if JXL_HIGH_PRECISION
+  const float max_error = 1.0f;
+#else
+  const float max_error = 0.6f;
+#endif
+  for (uint32_t num_channels : {3, 4}) {
+    JxlPixelFormat format = {num_channels, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN,
+                             0};
+    std::vector<uint8_t> rgb = jxl::DecodeWithAPI(
+        jxl::Bytes(compressed.data(), compressed.size()), format,
+        /*use_callback=*/false, /*set_buffer_early=*/false,
         /*use_resizable_runner=*/false, /*require_boxes=*/false,
         /*expect_success=*/true);
-    EXPECT_EQ(expected_pixels_size, pixels2.size());
-    EXPECT_EQ(0u, jxl::test::ComparePixels(pixels.data(), pixels2.data(), xsize,
-                                           ysize, format_orig, format));
+    ASSERT_EQ(xsize * ysize * num_channels, rgb.size());
+    for (size_t i = 0; i < xsize * ysize; ++i) {
+      for (size_t c = 0; c < 3; ++c) {
+        const float v =
+            std::min(std::max(reference[i * 3 + c], 0.0f), 1.0f) * 255.0f;
+        EXPECT_NEAR(rgb[i * num_channels + c], v, max_error);
+      }
+      if (num_channels == 4) EXPECT_EQ(255, rgb[i * 4 + 3]);
+    }
   }
 }
 
@@ -4447,6 +5795,58 @@ TEST(DecodeTest, FlushTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, IncrementalFlushTest) {
+  size_t xsize = 333;
+  size_t ysize = 300;
+  uint32_t num_channels = 3;
+  std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, num_channels, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> data =
+      jxl::CreateTestJXLCodestream(jxl::Bytes(pixels.data(), pixels.size()),
+                                   xsize, ysize, num_channels, params);
+  JxlPixelFormat format = {num_channels, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(),
+                                      JXL_DEC_FRAME | JXL_DEC_FULL_IMAGE));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetOutputDownsampling(dec.get(), 2));
+  // All but the last group are complete.
+  size_t first_part = data.size() - 1;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec.get(), data.data(), first_part));
+  EXPECT_EQ(JXL_DEC_FRAME, JxlDecoderProcessInput(dec.get()));
+
+  // The partial image is flushed to the downsampled buffer.
+  size_t buffer_size;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size));
+  EXPECT_EQ(167u * 150u * num_channels * 2, buffer_size);
+  std::vector<uint8_t> pixels2(buffer_size);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetImageOutBuffer(dec.get(), &format, pixels2.data(),
+                                        pixels2.size()));
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT, JxlDecoderProcessInput(dec.get()));
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderFlushImage(dec.get()));
+  EXPECT_TRUE(std::any_of(pixels2.begin(), pixels2.end(),
+                          [](uint8_t v) { return v != 0; }));
+
+  // Nothing was decoded since the previous flush, so nothing is drawn again.
+  std::vector<uint8_t> flushed = pixels2;
+  std::fill(pixels2.begin(), pixels2.end(), 0);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderFlushImage(dec.get()));
+  EXPECT_TRUE(std::all_of(pixels2.begin(), pixels2.end(),
+                          [](uint8_t v) { return v == 0; }));
+
+  std::copy(flushed.begin(), flushed.end(), pixels2.begin());
+  size_t consumed = first_part - JxlDecoderReleaseInput(dec.get());
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSetInput(dec.get(), data.data() + consumed,
+                               data.size() - consumed));
+  EXPECT_EQ(JXL_DEC_FULL_IMAGE, JxlDecoderProcessInput(dec.get()));
+}
+
 TEST(DecodeTest, FlushTestImageOutCallback) {
   // Size large enough for multiple groups, required to have progressive
   // stages
@@ -4981,27 +6381,31 @@ JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructTestCodestream) {
   VerifyJPEGReconstruction(jxl::Bytes(compressed), jxl::Bytes(jpeg_codestream));
 }
 
-JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionTest) {
+namespace {
+
+// Recompresses the JPEG at "jpeg_path" into a container with its JPEG
+// reconstruction data, and returns the JPEG in "jpeg".
+std::vector<uint8_t> JPEGReconstructionContainer(const std::string& jpeg_path,
+                                                 std::vector<uint8_t>* jpeg) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
-  const std::string jpeg_path = "jxl/flower/flower.png.im_q85_420.jpg";
-  const std::vector<uint8_t> orig = jxl::test::ReadTestData(jpeg_path);
+  *jpeg = jxl::test::ReadTestData(jpeg_path);
   jxl::CodecInOut orig_io{memory_manager};
-  ASSERT_TRUE(jxl::jpeg::DecodeImageJPG(jxl::Bytes(orig), &orig_io));
+  EXPECT_TRUE(jxl::jpeg::DecodeImageJPG(jxl::Bytes(*jpeg), &orig_io));
   jxl::jpeg::JPEGData jpeg_data_copy = *orig_io.Main().jpeg_data;
   orig_io.metadata.m.xyb_encoded = false;
   jxl::BitWriter writer{memory_manager};
-  ASSERT_TRUE(WriteCodestreamHeaders(&orig_io.metadata, &writer, nullptr));
+  EXPECT_TRUE(WriteCodestreamHeaders(&orig_io.metadata, &writer, nullptr));
   writer.ZeroPadToByte();
   jxl::CompressParams cparams;
   cparams.color_transform = jxl::ColorTransform::kNone;
-  ASSERT_TRUE(jxl::EncodeFrame(memory_manager, cparams, jxl::FrameInfo{},
+  EXPECT_TRUE(jxl::EncodeFrame(memory_manager, cparams, jxl::FrameInfo{},
                                &orig_io.metadata, orig_io.Main(),
                                *JxlGetDefaultCms(),
                                /*pool=*/nullptr, &writer,
                                /*aux_out=*/nullptr));
 
   std::vector<uint8_t> jpeg_data;
-  ASSERT_TRUE(
+  EXPECT_TRUE(
       EncodeJPEGData(memory_manager, jpeg_data_copy, &jpeg_data, cparams));
   std::vector<uint8_t> container;
   jxl::Bytes(jxl::kContainerHeader).AppendTo(container);
@@ -5011,6 +6415,16 @@ JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionTest) {
   jxl::AppendBoxHeader(jxl::MakeBoxType("jxlc"), 0, true, &container);
   jxl::PaddedBytes codestream = std::move(writer).TakeBytes();
   jxl::Bytes(codestream).AppendTo(container);
+  return container;
+}
+
+}  // namespace
+
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionTest) {
+  const std::string jpeg_path = "jxl/flower/flower.png.im_q85_420.jpg";
+  std::vector<uint8_t> orig;
+  const std::vector<uint8_t> container =
+      JPEGReconstructionContainer(jpeg_path, &orig);
   VerifyJPEGReconstruction(jxl::Bytes(container), jxl::Bytes(orig));
 }
 
@@ -5022,6 +6436,116 @@ JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionMetadataTest) {
   VerifyJPEGReconstruction(jxl::Bytes(jxl), jxl::Bytes(jpeg));
 }
 
+// The reconstructed JPEG can be read through a buffer smaller than it.
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionInChunksTest) {
+  const std::string jpeg_path = "jxl/jpeg_reconstruction/1x1_exif_xmp.jpg";
+  const std::string jxl_path = "jxl/jpeg_reconstruction/1x1_exif_xmp.jxl";
+  const std::vector<uint8_t> jpeg = jxl::test::ReadTestData(jpeg_path);
+  const std::vector<uint8_t> jxl = jxl::test::ReadTestData(jxl_path);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE));
+  JxlDecoderSetInput(dec.get(), jxl.data(), jxl.size());
+  EXPECT_EQ(JXL_DEC_JPEG_RECONSTRUCTION, JxlDecoderProcessInput(dec.get()));
+  std::vector<uint8_t> chunk(64);
+  std::vector<uint8_t> reconstructed;
+  JxlDecoderStatus process_result = JXL_DEC_JPEG_NEED_MORE_OUTPUT;
+  while (process_result == JXL_DEC_JPEG_NEED_MORE_OUTPUT) {
+    EXPECT_EQ(JXL_DEC_SUCCESS,
+              JxlDecoderSetJPEGBuffer(dec.get(), chunk.data(), chunk.size()));
+    process_result = JxlDecoderProcessInput(dec.get());
+    size_t used = chunk.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+    reconstructed.insert(reconstructed.end(), chunk.begin(),
+                         chunk.begin() + used);
+  }
+  ASSERT_EQ(JXL_DEC_FULL_IMAGE, process_result);
+  EXPECT_GT(jpeg.size(), chunk.size());
+  EXPECT_EQ(jpeg, reconstructed);
+}
+
+// With incremental input, the scan of a reconstructed JPEG is written as the
+// rows of groups are decoded, before the whole frame is.
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGReconstructionStreamingTest) {
+  const std::string jpeg_path = "jxl/flower/flower.png.im_q85_420.jpg";
+  std::vector<uint8_t> jpeg;
+  const std::vector<uint8_t> container =
+      JPEGReconstructionContainer(jpeg_path, &jpeg);
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(
+                dec.get(), JXL_DEC_JPEG_RECONSTRUCTION | JXL_DEC_FULL_IMAGE));
+  std::vector<uint8_t> reconstructed(jpeg.size() + 1);
+  size_t used = 0;
+  size_t input_end = 0;
+  JxlDecoderStatus status;
+  while (true) {
+    status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_JPEG_RECONSTRUCTION) {
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetJPEGBuffer(dec.get(), reconstructed.data(),
+                                        reconstructed.size()));
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      ASSERT_LT(input_end, container.size());
+      const size_t remaining = JxlDecoderReleaseInput(dec.get());
+      const size_t input_begin = input_end - remaining;
+      input_end = std::min(container.size(), input_end + 1024);
+      EXPECT_EQ(JXL_DEC_SUCCESS,
+                JxlDecoderSetInput(dec.get(), container.data() + input_begin,
+                                   input_end - input_begin));
+      if (input_end == container.size()) {
+        // All of the frame but at most its last 1 KiB is decoded, and so is
+        // written to the JPEG buffer.
+        used = reconstructed.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+        EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetJPEGBuffer(
+                                       dec.get(), reconstructed.data() + used,
+                                       reconstructed.size() - used));
+        JxlDecoderCloseInput(dec.get());
+      }
+    } else {
+      break;
+    }
+  }
+  ASSERT_EQ(JXL_DEC_FULL_IMAGE, status);
+  EXPECT_GT(used, jpeg.size() / 2);
+  const size_t size =
+      reconstructed.size() - JxlDecoderReleaseJPEGBuffer(dec.get());
+  reconstructed.resize(size);
+  EXPECT_EQ(jpeg, reconstructed);
+}
+
+// The integer IDCT of libjpeg changes the pixels of a recompressed JPEG by
+// at most a few levels.
+JXL_TRANSCODE_JPEG_TEST(DecodeTest, JPEGIntegerIDCTTest) {
+  const std::string jpeg_path = "jxl/flower/flower.png.im_q85_420.jpg";
+  std::vector<uint8_t> jpeg;
+  const std::vector<uint8_t> container =
+      JPEGReconstructionContainer(jpeg_path, &jpeg);
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels[2];
+  for (int integer_idct = 0; integer_idct < 2; integer_idct++) {
+    JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetJPEGIntegerIDCT(
+                                   dec.get(), TO_JXL_BOOL(integer_idct)));
+    pixels[integer_idct] = jxl::DecodeWithAPI(
+        dec.get(), jxl::Bytes(container), format, /*use_callback=*/false,
+        /*set_buffer_early=*/false, /*use_resizable_runner=*/false,
+        /*require_boxes=*/false, /*expect_success=*/true);
+  }
+  ASSERT_EQ(pixels[0].size(), pixels[1].size());
+  ASSERT_FALSE(pixels[0].empty());
+  int max_diff = 0;
+  double sum_diff = 0;
+  for (size_t i = 0; i < pixels[0].size(); i++) {
+    const int diff = std::abs(pixels[0][i] - pixels[1][i]);
+    max_diff = std::max(max_diff, diff);
+    sum_diff += diff;
+  }
+  EXPECT_GT(max_diff, 0);
+  EXPECT_LE(max_diff, 8);
+  EXPECT_LT(sum_diff / pixels[0].size(), 1.0);
+}
+
 TEST(DecodeTest, ContinueFinalNonEssentialBoxTest) {
   size_t xsize = 80;
   size_t ysize = 90;
@@ -5125,6 +6649,83 @@ TEST(DecodeTest, ExtendedBoxSizeTest) {
   JxlDecoderDestroy(dec);
 }
 
+TEST(DecodeTest, IndexBoxesTest) {
+  size_t xsize = 1;
+  size_t ysize = 1;
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  jxl::TestCodestreamParams params;
+  std::vector<uint8_t> codestream = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+  params.box_format = kCSBF_Brob_Exif;
+  std::vector<uint8_t> compressed = jxl::CreateTestJXLCodestream(
+      jxl::Bytes(pixels.data(), pixels.size()), xsize, ysize, 4, params);
+
+  JxlBoxIndexEntry entries[8];
+  size_t num_entries;
+  uint64_t next_offset;
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlIndexBoxes(compressed.data(), compressed.size(), 0, entries, 8,
+                          &num_entries, &next_offset));
+  ASSERT_EQ(4, num_entries);
+  const char* types[] = {"JXL ", "ftyp", "brob", "jxlc"};
+  const char* decompressed_types[] = {"JXL ", "ftyp", "Exif", "jxlc"};
+  const uint64_t offsets[] = {0, 12, 32, 32 + box_brob_exif_size};
+  for (size_t i = 0; i < num_entries; ++i) {
+    EXPECT_TRUE(BoxTypeEquals(types[i], entries[i].type));
+    EXPECT_TRUE(
+        BoxTypeEquals(decompressed_types[i], entries[i].decompressed_type));
+    EXPECT_EQ(offsets[i], entries[i].offset);
+    EXPECT_EQ(8, entries[i].header_size);
+  }
+  EXPECT_EQ(box_brob_exif_size, entries[2].size);
+  EXPECT_EQ(compressed.size() - offsets[3], entries[3].size);
+  EXPECT_EQ(compressed.size(), next_offset);
+
+  // Reads only small ranges, as if the file was fetched by range requests, one
+  // box at a time.
+  const size_t kRangeSize = 12;
+  std::vector<JxlBoxIndexEntry> ranged;
+  uint64_t offset = 0;
+  JxlDecoderStatus status = JXL_DEC_NEED_MORE_INPUT;
+  while (status == JXL_DEC_NEED_MORE_INPUT && offset < compressed.size()) {
+    size_t range = std::min<size_t>(kRangeSize, compressed.size() - offset);
+    status = JxlIndexBoxes(compressed.data() + offset, range, offset, entries,
+                           1, &num_entries, &next_offset);
+    ranged.insert(ranged.end(), entries, entries + num_entries);
+    EXPECT_LE(num_entries, 1);
+    EXPECT_GE(next_offset, offset);
+    offset = next_offset;
+  }
+  EXPECT_EQ(compressed.size(), offset);
+  ASSERT_EQ(4, ranged.size());
+  for (size_t i = 0; i < ranged.size(); ++i) {
+    EXPECT_TRUE(
+        BoxTypeEquals(decompressed_types[i], ranged[i].decompressed_type));
+    EXPECT_EQ(offsets[i], ranged[i].offset);
+  }
+
+  // A bare codestream has no boxes.
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlIndexBoxes(codestream.data(), codestream.size(), 0, entries, 8,
+                          &num_entries, &next_offset));
+  EXPECT_EQ(0, num_entries);
+
+  // Too few bytes to tell, then a truncated box header.
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT,
+            JxlIndexBoxes(compressed.data(), 1, 0, entries, 8, &num_entries,
+                          &next_offset));
+  EXPECT_EQ(JXL_DEC_NEED_MORE_INPUT,
+            JxlIndexBoxes(compressed.data(), 36, 0, entries, 8, &num_entries,
+                          &next_offset));
+  EXPECT_EQ(2, num_entries);
+  EXPECT_EQ(32, next_offset);
+
+  // Neither a container nor a codestream.
+  const uint8_t not_jxl[] = {'G', 'I', 'F', '8', '9', 'a', 0, 0, 0, 0, 0, 0};
+  EXPECT_EQ(JXL_DEC_ERROR, JxlIndexBoxes(not_jxl, sizeof(not_jxl), 0, entries,
+                                         8, &num_entries, &next_offset));
+}
+
 JXL_BOXES_TEST(DecodeTest, BoxTest) {
   size_t xsize = 1;
   size_t ysize = 1;
@@ -20,6 +20,8 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"  // JPEGXL_ENABLE_TRANSCODE_JPEG
 #include "lib/jxl/image_bundle.h"
@@ -117,30 +119,35 @@ class JxlToJpegDecoder {
     return true;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data) {
-    // Copy JPEG bytestream if desired.
-    uint8_t* tmp_next_out = next_out_;
-    size_t tmp_avail_size = avail_size_;
-    auto write = [&tmp_next_out, &tmp_avail_size](const uint8_t* buf,
-                                                  size_t len) {
-      size_t to_write = std::min<size_t>(tmp_avail_size, len);
-      if (to_write != 0) memcpy(tmp_next_out, buf, to_write);
-      tmp_next_out += to_write;
-      tmp_avail_size -= to_write;
+  // Writes the JPEG bytes, encoding the scans on "pool" when possible. When
+  // the output buffer is full, the bytes written so far are kept, and the next
+  // call continues after them. While the frame is decoded, "num_rows" is the
+  // number of rows of pixels whose coefficients are decoded, and the JPEG is
+  // written up to them: the next call also continues after that.
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& jpeg_data,
+                               ThreadPool* pool,
+                               size_t num_rows = ~static_cast<size_t>(0)) {
+    if (!writer_) writer_ = jxl::make_unique<jpeg::JPEGWriter>(jpeg_data, pool);
+    writer_->SetAvailableRows(num_rows);
+    auto write = [this](const uint8_t* buf, size_t len) {
+      size_t to_write = std::min<size_t>(avail_size_, len);
+      if (to_write != 0) memcpy(next_out_, buf, to_write);
+      next_out_ += to_write;
+      avail_size_ -= to_write;
       return to_write;
     };
-    Status write_result = jpeg::WriteJpeg(jpeg_data, write);
-    if (!write_result) {
-      if (tmp_avail_size == 0) {
-        return JXL_DEC_JPEG_NEED_MORE_OUTPUT;
-      }
-      return JXL_DEC_ERROR;
+    Status write_result = writer_->Write(write);
+    if (!write_result && avail_size_ == 0) {
+      return JXL_DEC_JPEG_NEED_MORE_OUTPUT;
     }
-    next_out_ = tmp_next_out;
-    avail_size_ = tmp_avail_size;
-    return JXL_DEC_SUCCESS;
+    if (write_result && !writer_->IsDone()) return JXL_DEC_SUCCESS;
+    writer_.reset();
+    return write_result ? JXL_DEC_SUCCESS : JXL_DEC_ERROR;
   }
 
+  // Discards the state of a WriteOutput that needed more output.
+  void ResetOutput() { writer_.reset(); }
+
  private:
   // Content of the most recently parsed JPEG reconstruction box if any.
   std::vector<uint8_t> buffer_;
@@ -163,6 +170,9 @@ class JxlToJpegDecoder {
   uint8_t* next_out_ = nullptr;
   // Available bytes to write JPEG reconstruction to.
   size_t avail_size_ = 0;
+
+  // State of the JPEG output, between WriteOutput calls needing more output.
+  std::unique_ptr<jpeg::JPEGWriter> writer_;
 };
 
 #else
@@ -208,9 +218,13 @@ class JxlToJpegDecoder {
     return JXL_DEC_ERROR;
   }
 
-  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */) {
+  JxlDecoderStatus WriteOutput(const jpeg::JPEGData& /* jpeg_data */,
+                               ThreadPool* /* pool */,
+                               size_t /* num_rows */ = 0) {
     return JXL_DEC_SUCCESS;
   }
+
+  void ResetOutput() {}
 };
 
 #endif  // JPEGXL_ENABLE_TRANSCODE_JPEG
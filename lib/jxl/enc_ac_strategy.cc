@@ -360,21 +360,61 @@ bool MultiBlockTransformCrossesVerticalBoundary(
   return false;
 }
 
+// Terms of the EstimateEntropy of the transforms tried in the 8x8 blocks of
+// a ProcessRectACS call, which do not depend on the entropy multiplier. The
+// searches for merged transforms try most of them several times.
+class EntropyCache {
+ public:
+  struct Entry {
+    bool valid;
+    float entropy;
+    float loss;
+  };
+
+  // bx, by addresses the 64x64 block at 8x8 subresolution.
+  EntropyCache(size_t bx, size_t by) : bx_(bx), by_(by) {}
+
+  // x, y are the pixel coordinates of the transform.
+  Entry* Get(AcStrategyType strategy, size_t x, size_t y) {
+    const size_t cx = x / kBlockDim - bx_;
+    const size_t cy = y / kBlockDim - by_;
+    JXL_DASSERT(cx < 8 && cy < 8);
+    return &entries_[static_cast<size_t>(strategy)][cy * 8 + cx];
+  }
+
+ private:
+  size_t bx_;
+  size_t by_;
+  Entry entries_[AcStrategy::kNumValidStrategies][64] = {};
+};
+
 Status EstimateEntropy(const AcStrategy& acs, float entropy_mul, size_t x,
                        size_t y, const ACSConfig& config,
                        const float* JXL_RESTRICT cmap_factors, float* block,
                        float* full_scratch_space, uint32_t* quantized,
-                       float& entropy) {
+                       float& entropy, EntropyCache* cache = nullptr,
+                       const float* JXL_RESTRICT coefficients = nullptr) {
+  EntropyCache::Entry* cached =
+      cache != nullptr ? cache->Get(acs.Strategy(), x, y) : nullptr;
+  if (cached != nullptr && cached->valid) {
+    entropy = cached->entropy * entropy_mul;
+    entropy += cached->loss;
+    return true;
+  }
   entropy = 0.0f;
   float* mem = full_scratch_space;
   float* scratch_space = full_scratch_space + AcStrategy::kMaxCoeffArea;
   const size_t size = (1 << acs.log2_covered_blocks()) * kDCTBlockSize;
 
-  // Apply transform.
-  for (size_t c = 0; c < 3; c++) {
-    float* JXL_RESTRICT block_c = block + size * c;
-    TransformFromPixels(acs.Strategy(), &config.Pixel(c, x, y),
-                        config.src_stride, block_c, scratch_space);
+  // Apply transform, unless the coefficients of the 3 channels are given.
+  if (coefficients != nullptr) {
+    memcpy(block, coefficients, 3 * size * sizeof(float));
+  } else {
+    for (size_t c = 0; c < 3; c++) {
+      float* JXL_RESTRICT block_c = block + size * c;
+      TransformFromPixels(acs.Strategy(), &config.Pixel(c, x, y),
+                          config.src_stride, block_c, scratch_space);
+    }
   }
   HWY_FULL(float) df;
 
@@ -490,8 +530,10 @@ Status EstimateEntropy(const AcStrategy& acs, float entropy_mul, size_t x,
       pow(GetLane(SumOfLanes(df8, loss)) / (num_blocks * kDCTBlockSize),
           1.0 / 8.0) *
       (num_blocks * kDCTBlockSize) / quant_norm16;
+  const float loss = config.info_loss_multiplier * loss_scalar;
+  if (cached != nullptr) *cached = {true, entropy, loss};
   entropy *= entropy_mul;
-  entropy += config.info_loss_multiplier * loss_scalar;
+  entropy += loss;
   return true;
 }
 
@@ -501,7 +543,8 @@ Status FindBest8x8Transform(size_t x, size_t y, int encoding_speed_tier,
                             AcStrategyImage* JXL_RESTRICT ac_strategy,
                             float* block, float* scratch_space,
                             uint32_t* quantized, float* entropy_out,
-                            AcStrategyType& best_tx) {
+                            AcStrategyType& best_tx,
+                            const float* JXL_RESTRICT dct8_coefficients) {
   struct TransformTry8x8 {
     AcStrategyType type;
     int encoding_speed_tier_max_limit;
@@ -585,9 +628,10 @@ Status FindBest8x8Transform(size_t x, size_t y, int encoding_speed_tier,
       entropy_mul += kAvoidEntropyOfTransforms * mul;
     }
     float entropy;
-    JXL_RETURN_IF_ERROR(EstimateEntropy(acs, entropy_mul, x, y, config,
-                                        cmap_factors, block, scratch_space,
-                                        quantized, entropy));
+    JXL_RETURN_IF_ERROR(EstimateEntropy(
+        acs, entropy_mul, x, y, config, cmap_factors, block, scratch_space,
+        quantized, entropy, /*cache=*/nullptr,
+        tx.type == AcStrategyType::DCT ? dct8_coefficients : nullptr));
     if (entropy < best) {
       best_tx = tx.type;
       best = entropy;
@@ -606,7 +650,8 @@ Status TryMergeAcs(AcStrategyType acs_raw, size_t bx, size_t by, size_t cx,
                    AcStrategyImage* JXL_RESTRICT ac_strategy,
                    const float entropy_mul, const uint8_t candidate_priority,
                    uint8_t* priority, float* JXL_RESTRICT entropy_estimate,
-                   float* block, float* scratch_space, uint32_t* quantized) {
+                   float* block, float* scratch_space, uint32_t* quantized,
+                   EntropyCache* cache) {
   AcStrategy acs = AcStrategy::FromRawStrategy(acs_raw);
   float entropy_current = 0;
   for (size_t iy = 0; iy < acs.covered_blocks_y(); ++iy) {
@@ -623,7 +668,7 @@ Status TryMergeAcs(AcStrategyType acs_raw, size_t bx, size_t by, size_t cx,
   float entropy_candidate;
   JXL_RETURN_IF_ERROR(EstimateEntropy(
       acs, entropy_mul, (bx + cx) * 8, (by + cy) * 8, config, cmap_factors,
-      block, scratch_space, quantized, entropy_candidate));
+      block, scratch_space, quantized, entropy_candidate, cache));
   if (entropy_candidate >= entropy_current) return true;
   // Accept the candidate.
   for (size_t iy = 0; iy < acs.covered_blocks_y(); iy++) {
@@ -690,7 +735,8 @@ Status FindBestFirstLevelDivisionForSquare(
     size_t cy, const ACSConfig& config, const float* JXL_RESTRICT cmap_factors,
     AcStrategyImage* JXL_RESTRICT ac_strategy, const float entropy_mul_JXK,
     const float entropy_mul_JXJ, float* JXL_RESTRICT entropy_estimate,
-    float* block, float* scratch_space, uint32_t* quantized) {
+    float* block, float* scratch_space, uint32_t* quantized,
+    EntropyCache* cache) {
   // We denote J for the larger dimension here, and K for the smaller.
   // For example, for 32x32 block splitting, J would be 32, K 16.
   const size_t blocks_half = blocks / 2;
@@ -717,6 +763,23 @@ Status FindBestFirstLevelDivisionForSquare(
                                                  by + cy, by + cy + blocks)) {
     return true;  // not suitable for JxJ analysis, some transforms leak out.
   }
+  if (blocks >= 4 && config.large_transform_max_detail <= 1.0f) {
+    // Squares where most 8x8 blocks are best coded with a transform for
+    // detailed content hardly ever gain from a single large transform.
+    size_t num_detailed = 0;
+    for (size_t dy = 0; dy < blocks; ++dy) {
+      AcStrategyRow row = ac_strategy->ConstRow(by + cy + dy);
+      for (size_t dx = 0; dx < blocks; ++dx) {
+        const AcStrategy acs = row[bx + cx + dx];
+        if (!acs.IsMultiblock() && acs.Strategy() != AcStrategyType::DCT) {
+          ++num_detailed;
+        }
+      }
+    }
+    if (num_detailed >= config.large_transform_max_detail * blocks * blocks) {
+      return true;
+    }
+  }
   // For floating transforms there may be
   // already blocks selected that make either or both JXK and
   // KXJ not feasible for this location.
@@ -741,26 +804,29 @@ Status FindBestFirstLevelDivisionForSquare(
     if (row0[bx + cx + 0].Strategy() != acs_rawJXK) {
       JXL_RETURN_IF_ERROR(EstimateEntropy(
           acsJXK, entropy_mul_JXK, (bx + cx + 0) * 8, (by + cy + 0) * 8, config,
-          cmap_factors, block, scratch_space, quantized, entropy_JXK_left));
+          cmap_factors, block, scratch_space, quantized, entropy_JXK_left,
+          cache));
     }
     if (row0[bx + cx + blocks_half].Strategy() != acs_rawJXK) {
       JXL_RETURN_IF_ERROR(
           EstimateEntropy(acsJXK, entropy_mul_JXK, (bx + cx + blocks_half) * 8,
                           (by + cy + 0) * 8, config, cmap_factors, block,
-                          scratch_space, quantized, entropy_JXK_right));
+                          scratch_space, quantized, entropy_JXK_right, cache));
     }
   }
   if (allow_KXJ) {
     if (row0[bx + cx].Strategy() != acs_rawKXJ) {
       JXL_RETURN_IF_ERROR(EstimateEntropy(
           acsKXJ, entropy_mul_JXK, (bx + cx + 0) * 8, (by + cy + 0) * 8, config,
-          cmap_factors, block, scratch_space, quantized, entropy_KXJ_top));
+          cmap_factors, block, scratch_space, quantized, entropy_KXJ_top,
+          cache));
     }
     if (row1[bx + cx].Strategy() != acs_rawKXJ) {
       JXL_RETURN_IF_ERROR(
           EstimateEntropy(acsKXJ, entropy_mul_JXK, (bx + cx + 0) * 8,
                           (by + cy + blocks_half) * 8, config, cmap_factors,
-                          block, scratch_space, quantized, entropy_KXJ_bottom));
+                          block, scratch_space, quantized, entropy_KXJ_bottom,
+                          cache));
     }
   }
   if (allow_square_transform) {
@@ -769,7 +835,7 @@ Status FindBestFirstLevelDivisionForSquare(
     // exploring 16x32 and 32x16.
     JXL_RETURN_IF_ERROR(EstimateEntropy(
         acsJXJ, entropy_mul_JXJ, (bx + cx + 0) * 8, (by + cy + 0) * 8, config,
-        cmap_factors, block, scratch_space, quantized, entropy_JXJ));
+        cmap_factors, block, scratch_space, quantized, entropy_JXJ, cache));
   }
 
   // Test if this block should have JXK or KXJ transforms,
@@ -809,10 +875,12 @@ Status FindBestFirstLevelDivisionForSquare(
   return true;
 }
 
-Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
-                      const Rect& rect, const ColorCorrelationMap& cmap,
+Status ProcessRectACS(const CompressParams& cparams, SpeedTier speed_tier,
+                      const ACSConfig& config, const Rect& rect,
+                      const ColorCorrelationMap& cmap,
                       float* JXL_RESTRICT block,
                       uint32_t* JXL_RESTRICT quantized,
+                      const float* JXL_RESTRICT dct8_coefficients,
                       AcStrategyImage* ac_strategy) {
   // Main philosophy here:
   // 1. First find best 8x8 transform for each area.
@@ -837,7 +905,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
       0.0f,
       cmap.base().YtoBRatio(cmap.ytob_map.ConstRow(ty)[tx]),
   };
-  if (cparams.speed_tier > SpeedTier::kHare) return true;
+  if (speed_tier > SpeedTier::kHare) return true;
   // First compute the best 8x8 transform for each square. Later, we do not
   // experiment with different combinations, but only use the best of the 8x8s
   // when DCT8X8 is specified in the tree search.
@@ -849,18 +917,28 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
   static const float k8x8mul2 = 1.0;
   static const float k8x8base = 1.4;
   const float mul8x8 = k8x8mul2 + k8x8mul1 / (butteraugli_target + k8x8base);
+  // At decoding speed tier 5, only DCT8 is tried among the 8x8 transforms, as
+  // at the fastest encoding speed tier.
+  const int speed_tier_8x8 = cparams.decoding_speed_tier >= 5
+                                 ? static_cast<int>(SpeedTier::kLightning)
+                                 : static_cast<int>(speed_tier);
   for (size_t iy = 0; iy < rect.ysize(); iy++) {
     for (size_t ix = 0; ix < rect.xsize(); ix++) {
       float entropy = 0.0;
       AcStrategyType best_of_8x8s;
+      const float* block_dct8 =
+          dct8_coefficients != nullptr
+              ? dct8_coefficients + (iy * 8 + ix) * 3 * kDCTBlockSize
+              : nullptr;
       JXL_RETURN_IF_ERROR(FindBest8x8Transform(
-          8 * (bx + ix), 8 * (by + iy), static_cast<int>(cparams.speed_tier),
-          butteraugli_target, config, cmap_factors, ac_strategy, block,
-          scratch_space, quantized, &entropy, best_of_8x8s));
+          8 * (bx + ix), 8 * (by + iy), speed_tier_8x8, butteraugli_target,
+          config, cmap_factors, ac_strategy, block, scratch_space, quantized,
+          &entropy, best_of_8x8s, block_dct8));
       JXL_RETURN_IF_ERROR(ac_strategy->Set(bx + ix, by + iy, best_of_8x8s));
       entropy_estimate[iy * 8 + ix] = entropy * mul8x8;
     }
   }
+  EntropyCache entropy_cache(bx, by);
   // Merge when a larger transform is better than the previously
   // searched best combination of 8x8 transforms.
   struct MergeTry {
@@ -890,8 +968,8 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
   // e.g. by not applying the multiplier when storing the new entropy
   // estimates in TryMergeToACSCandidate().
   const MergeTry kTransformsForMerge[9] = {
-      {AcStrategyType::DCT16X8, 2, 4, 5, entropy_mul16X8},
-      {AcStrategyType::DCT8X16, 2, 4, 5, entropy_mul16X8},
+      {AcStrategyType::DCT16X8, 2, 5, 5, entropy_mul16X8},
+      {AcStrategyType::DCT8X16, 2, 5, 5, entropy_mul16X8},
       // FindBestFirstLevelDivisionForSquare looks for DCT16X16 and its
       // subdivisions. {AcStrategyType::DCT16X16, 3, entropy_mul16X16},
       {AcStrategyType::DCT16X32, 4, 4, 4, entropy_mul16X32},
@@ -937,7 +1015,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
               JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
                   8, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
                   mt.entropy_mul, entropy_mul64X64, entropy_estimate, block,
-                  scratch_space, quantized));
+                  scratch_space, quantized, &entropy_cache));
             }
             continue;
           } else if (mt.type == AcStrategyType::DCT32X16) {
@@ -961,7 +1039,8 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
               JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
                   4, enable_32x32, bx, by, cx, cy, config, cmap_factors,
                   ac_strategy, mt.entropy_mul, entropy_mul32X32,
-                  entropy_estimate, block, scratch_space, quantized));
+                  entropy_estimate, block, scratch_space, quantized,
+                  &entropy_cache));
             }
             continue;
           } else if (mt.type == AcStrategyType::DCT32X16) {
@@ -984,7 +1063,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
               JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
                   2, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
                   mt.entropy_mul, entropy_mul16X16, entropy_estimate, block,
-                  scratch_space, quantized));
+                  scratch_space, quantized, &entropy_cache));
             }
             continue;
           } else if (mt.type == AcStrategyType::DCT16X8) {
@@ -1008,11 +1087,12 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
         JXL_RETURN_IF_ERROR(
             TryMergeAcs(mt.type, bx, by, cx, cy, config, cmap_factors,
                         ac_strategy, mt.entropy_mul, mt.priority, &priority[0],
-                        entropy_estimate, block, scratch_space, quantized));
+                        entropy_estimate, block, scratch_space, quantized,
+                        &entropy_cache));
       }
     }
   }
-  if (cparams.speed_tier >= SpeedTier::kHare) {
+  if (speed_tier >= SpeedTier::kHare) {
     return true;
   }
   // Here we still try to do some non-aligned matching, find a few more
@@ -1023,12 +1103,13 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
         JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
             2, true, bx, by, cx, cy, config, cmap_factors, ac_strategy,
             entropy_mul16X8, entropy_mul16X16, entropy_estimate, block,
-            scratch_space, quantized));
+            scratch_space, quantized, &entropy_cache));
       }
     }
   }
   // Non-aligned matching for 32X32, 16X32 and 32X16.
-  size_t step = cparams.speed_tier >= SpeedTier::kTortoise ? 2 : 1;
+  if (cparams.decoding_speed_tier >= 5) return true;
+  size_t step = speed_tier >= SpeedTier::kTortoise ? 2 : 1;
   for (size_t cy = 0; cy + 3 < rect.ysize(); cy += step) {
     for (size_t cx = 0; cx + 3 < rect.xsize(); cx += step) {
       if ((cy | cx) % 4 == 0) {
@@ -1037,7 +1118,7 @@ Status ProcessRectACS(const CompressParams& cparams, const ACSConfig& config,
       JXL_RETURN_IF_ERROR(FindBestFirstLevelDivisionForSquare(
           4, enable_32x32, bx, by, cx, cy, config, cmap_factors, ac_strategy,
           entropy_mul16X32, entropy_mul32X32, entropy_estimate, block,
-          scratch_space, quantized));
+          scratch_space, quantized, &entropy_cache));
     }
   }
   return true;
@@ -1052,6 +1133,16 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 HWY_EXPORT(ProcessRectACS);
 
+namespace {
+
+// Per-thread buffers of AcStrategyHeuristics::ProcessRect.
+struct AcStrategyScratch {
+  AlignedMemory mem;
+  AlignedMemory qmem;
+};
+
+}  // namespace
+
 Status AcStrategyHeuristics::Init(const Image3F& src, const Rect& rect_in,
                                   const ImageF& quant_field, const ImageF& mask,
                                   const ImageF& mask1x1,
@@ -1106,34 +1197,45 @@ Status AcStrategyHeuristics::Init(const Image3F& src, const Rect& rect_in,
   config.info_loss_multiplier *= std::pow(ratio, kPow1);
   config.zeros_mul *= std::pow(ratio, kPow2);
   config.cost_delta *= std::pow(ratio, kPow3);
+  config.large_transform_max_detail = cparams.large_transform_max_detail;
   return true;
 }
 
-Status AcStrategyHeuristics::PrepareForThreads(std::size_t num_threads) {
+Status AcStrategyHeuristics::PrepareForThreads(ThreadPool* pool) {
   const size_t dct_scratch_size =
       3 * (MaxVectorSize() / sizeof(float)) * AcStrategy::kMaxBlockDim;
   mem_per_thread = 6 * AcStrategy::kMaxCoeffArea + dct_scratch_size;
-  size_t mem_bytes = num_threads * mem_per_thread * sizeof(float);
-  JXL_ASSIGN_OR_RETURN(mem, AlignedMemory::Create(memory_manager, mem_bytes));
   qmem_per_thread = AcStrategy::kMaxCoeffArea;
-  size_t qmem_bytes = num_threads * qmem_per_thread * sizeof(uint32_t);
-  JXL_ASSIGN_OR_RETURN(qmem, AlignedMemory::Create(memory_manager, qmem_bytes));
+  // The buffers are allocated on first use by every thread, and kept by the
+  // pool for the next frames.
+  scratch = pool != nullptr ? pool->scratch() : &local_scratch;
   return true;
 }
 
 Status AcStrategyHeuristics::ProcessRect(const Rect& rect,
                                          const ColorCorrelationMap& cmap,
                                          AcStrategyImage* ac_strategy,
-                                         size_t thread) {
+                                         size_t thread, SpeedTier speed_tier,
+                                         const float* dct8_coefficients) {
   // In Falcon mode, use DCT8 everywhere and uniform quantization.
   if (cparams.speed_tier >= SpeedTier::kCheetah) {
     ac_strategy->FillDCT8(rect);
     return true;
   }
+  AcStrategyScratch* buffers = scratch->Get<AcStrategyScratch>(
+      ScratchKey::kAcStrategyHeuristics, thread);
+  if (!buffers->mem) {
+    JXL_ASSIGN_OR_RETURN(
+        buffers->mem, AlignedMemory::Create(memory_manager,
+                                            mem_per_thread * sizeof(float)));
+    JXL_ASSIGN_OR_RETURN(
+        buffers->qmem,
+        AlignedMemory::Create(memory_manager,
+                              qmem_per_thread * sizeof(uint32_t)));
+  }
   return HWY_DYNAMIC_DISPATCH(ProcessRectACS)(
-      cparams, config, rect, cmap,
-      mem.address<float>() + thread * mem_per_thread,
-      qmem.address<uint32_t>() + thread * qmem_per_thread, ac_strategy);
+      cparams, speed_tier, config, rect, cmap, buffers->mem.address<float>(),
+      buffers->qmem.address<uint32_t>(), dct8_coefficients, ac_strategy);
 }
 
 Status AcStrategyHeuristics::Finalize(const FrameDimensions& frame_dim,
@@ -11,7 +11,9 @@
 #include <cstddef>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
+#include "lib/jxl/base/scratch_arena.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/enc_cache.h"
@@ -45,6 +47,8 @@ struct ACSConfig {
   float info_loss_multiplier;
   float cost_delta;
   float zeros_mul;
+  // See CompressParams::large_transform_max_detail.
+  float large_transform_max_detail;
   const float& Pixel(size_t c, size_t x, size_t y) const {
     return src_rows[c][y * src_stride + x];
   }
@@ -72,18 +76,26 @@ struct AcStrategyHeuristics {
   Status Init(const Image3F& src, const Rect& rect_in,
               const ImageF& quant_field, const ImageF& mask,
               const ImageF& mask1x1, DequantMatrices* matrices);
-  Status PrepareForThreads(std::size_t num_threads);
+  Status PrepareForThreads(ThreadPool* pool);
+  // Searches the transforms of `rect` at `speed_tier`, which may be faster
+  // than cparams.speed_tier for the tiles that do not need the full search.
+  // `dct8_coefficients`, if not null, are those of the blocks of `rect` as
+  // given by CfLHeuristics::Dct8Coefficients, which are then not recomputed.
   Status ProcessRect(const Rect& rect, const ColorCorrelationMap& cmap,
-                     AcStrategyImage* ac_strategy, size_t thread);
+                     AcStrategyImage* ac_strategy, size_t thread,
+                     SpeedTier speed_tier,
+                     const float* dct8_coefficients = nullptr);
   Status Finalize(const FrameDimensions& frame_dim,
                   const AcStrategyImage& ac_strategy, AuxOut* aux_out);
   JxlMemoryManager* memory_manager;
   const CompressParams& cparams;
   ACSConfig config = {};
   size_t mem_per_thread;
-  AlignedMemory mem;
   size_t qmem_per_thread;
-  AlignedMemory qmem;
+  // Holds the per-thread buffers: the arena of the pool, or local_scratch if
+  // there is no pool.
+  ScratchArena* scratch = nullptr;
+  ScratchArena local_scratch;
 };
 
 }  // namespace jxl
@@ -38,6 +38,7 @@
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/fast_math-inl.h"
 #include "lib/jxl/base/rect.h"
+#include "lib/jxl/base/scope_guard.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/convolve.h"
@@ -474,11 +475,22 @@ struct AdaptiveQuantizationImpl {
     return true;
   }
 
+  // If `cache` is not null, the differences before erosion are read from it
+  // if `reuse_cache`, and stored in it otherwise; reusing them also skips
+  // `mask1x1`.
   Status ComputeTile(float butteraugli_target, float scale, const Image3F& xyb,
                      const Rect& rect_in, const Rect& rect_out,
-                     const int thread, ImageF* mask, ImageF* mask1x1) {
+                     const int thread, ImageF* mask, ImageF* mask1x1,
+                     FrameAnalysisCache* cache, bool reuse_cache) {
     JXL_ENSURE(rect_in.x0() % kBlockDim == 0);
     JXL_ENSURE(rect_in.y0() % kBlockDim == 0);
+    // The cache holds the differences of the whole frame.
+    const Rect cache_rect(rect_out.x0() * 2, rect_out.y0() * 2,
+                          rect_out.xsize() * 2, rect_out.ysize() * 2);
+    if (reuse_cache) {
+      return FinishTile(butteraugli_target, scale, xyb, rect_in, rect_out,
+                        cache_rect, cache->pre_erosion, mask);
+    }
     const size_t xsize = xyb.xsize();
     const size_t ysize = xyb.ysize();
 
@@ -624,8 +636,20 @@ struct AdaptiveQuantizationImpl {
     JXL_ENSURE(y_start % (kBlockDim / 2) == 0);
     Rect from_rect(x_start % 8 == 0 ? 0 : 1, y_start % 8 == 0 ? 0 : 1,
                    rect_out.xsize() * 2, rect_out.ysize() * 2);
-    JXL_RETURN_IF_ERROR(FuzzyErosion(butteraugli_target, from_rect,
-                                     pre_erosion[thread], rect_out, &aq_map));
+    if (cache) {
+      JXL_RETURN_IF_ERROR(CopyImageTo(from_rect, pre_erosion[thread],
+                                      cache_rect, &cache->pre_erosion));
+    }
+    return FinishTile(butteraugli_target, scale, xyb, rect_in, rect_out,
+                      from_rect, pre_erosion[thread], mask);
+  }
+
+  // The part of ComputeTile that depends on the distance.
+  Status FinishTile(float butteraugli_target, float scale, const Image3F& xyb,
+                    const Rect& rect_in, const Rect& rect_out,
+                    const Rect& from_rect, const ImageF& from, ImageF* mask) {
+    JXL_RETURN_IF_ERROR(
+        FuzzyErosion(butteraugli_target, from_rect, from, rect_out, &aq_map));
     for (size_t y = 0; y < rect_out.ysize(); ++y) {
       const float* aq_map_row = rect_out.ConstRow(aq_map, y);
       float* mask_row = rect_out.Row(mask, y);
@@ -680,19 +704,38 @@ Status Blur1x1Masking(JxlMemoryManager* memory_manager, ThreadPool* pool,
 StatusOr<ImageF> AdaptiveQuantizationMap(const float butteraugli_target,
                                          const Image3F& xyb, const Rect& rect,
                                          float scale, ThreadPool* pool,
-                                         ImageF* mask, ImageF* mask1x1) {
+                                         ImageF* mask, ImageF* mask1x1,
+                                         FrameAnalysisCache* cache) {
   JXL_ENSURE(rect.xsize() % kBlockDim == 0);
   JXL_ENSURE(rect.ysize() % kBlockDim == 0);
   AdaptiveQuantizationImpl impl;
   const size_t xsize_blocks = rect.xsize() / kBlockDim;
   const size_t ysize_blocks = rect.ysize() / kBlockDim;
   JxlMemoryManager* memory_manager = xyb.memory_manager();
+  JXL_ENSURE(!cache || (rect.x0() == 0 && rect.y0() == 0));
+  // The cache fits if it was filled for a frame of the same size.
+  const bool reuse_cache = cache && SameSize(cache->mask1x1, rect) &&
+                           cache->pre_erosion.xsize() == xsize_blocks * 2 &&
+                           cache->pre_erosion.ysize() == ysize_blocks * 2;
   JXL_ASSIGN_OR_RETURN(
       impl.aq_map, ImageF::Create(memory_manager, xsize_blocks, ysize_blocks));
   JXL_ASSIGN_OR_RETURN(
       *mask, ImageF::Create(memory_manager, xsize_blocks, ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(
-      *mask1x1, ImageF::Create(memory_manager, xyb.xsize(), xyb.ysize()));
+  if (reuse_cache) {
+    JXL_ASSIGN_OR_RETURN(*mask1x1,
+                         ImageF::Create(memory_manager, cache->mask1x1.xsize(),
+                                        cache->mask1x1.ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(cache->mask1x1, mask1x1));
+  } else {
+    JXL_ASSIGN_OR_RETURN(
+        *mask1x1, ImageF::Create(memory_manager, xyb.xsize(), xyb.ysize()));
+    if (cache) {
+      JXL_ASSIGN_OR_RETURN(
+          cache->pre_erosion,
+          ImageF::Create(cache->MemoryManager(memory_manager),
+                         xsize_blocks * 2, ysize_blocks * 2));
+    }
+  }
   const auto prepare = [&](const size_t num_threads) -> Status {
     JXL_RETURN_IF_ERROR(impl.PrepareBuffers(memory_manager, num_threads));
     return true;
@@ -708,7 +751,8 @@ StatusOr<ImageF> AdaptiveQuantizationMap(const float butteraugli_target,
     size_t bx1 = std::min((tx + 1) * kEncTileDimInBlocks, xsize_blocks);
     Rect rect_out(bx0, by0, bx1 - bx0, by1 - by0);
     JXL_RETURN_IF_ERROR(impl.ComputeTile(butteraugli_target, scale, xyb, rect,
-                                         rect_out, thread, mask, mask1x1));
+                                         rect_out, thread, mask, mask1x1,
+                                         cache, reuse_cache));
     return true;
   };
   size_t num_tiles = DivCeil(xsize_blocks, kEncTileDimInBlocks) *
@@ -716,7 +760,16 @@ StatusOr<ImageF> AdaptiveQuantizationMap(const float butteraugli_target,
   JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_tiles, prepare, process_tile,
                                 "AQ DiffPrecompute"));
 
-  JXL_RETURN_IF_ERROR(Blur1x1Masking(memory_manager, pool, mask1x1, rect));
+  if (!reuse_cache) {
+    JXL_RETURN_IF_ERROR(Blur1x1Masking(memory_manager, pool, mask1x1, rect));
+    if (cache) {
+      JXL_ASSIGN_OR_RETURN(
+          cache->mask1x1,
+          ImageF::Create(cache->MemoryManager(memory_manager),
+                         mask1x1->xsize(), mask1x1->ysize()));
+      JXL_RETURN_IF_ERROR(CopyImageTo(*mask1x1, &cache->mask1x1));
+    }
+  }
   return std::move(impl).aq_map;
 }
 
@@ -894,6 +947,7 @@ StatusOr<ImageBundle> RoundtripImage(const FrameHeader& frame_header,
   options.coalescing = false;
   options.render_spotcolors = false;
   options.render_noise = false;
+  options.defer_rendering = false;
 
   // Same as frame_header.nonserialized_metadata->m
   const ImageMetadata& metadata = *decoded.metadata();
@@ -924,6 +978,7 @@ StatusOr<ImageBundle> RoundtripImage(const FrameHeader& frame_header,
         frame_header, enc_state->coeffs, group_index, dec_state.get(),
         &group_dec_caches[thread], thread, input, nullptr, nullptr));
     for (size_t c = 0; c < metadata.num_extra_channels; c++) {
+      if (!dec_state->render_pipeline->IsChannelUsed(3 + c)) continue;
       std::pair<ImageF*, Rect> ri = input.GetBuffer(3 + c);
       FillPlane(0.0f, ri.first, ri.second);
     }
@@ -967,8 +1022,42 @@ Status FindBestQuantization(const FrameHeader& frame_header,
       tf.IsPQ() || tf.IsHLG()
           ? frame_header.nonserialized_metadata->m.IntensityTarget()
           : 80.f;
-  JxlButteraugliComparator comparator(params, cms);
-  JXL_RETURN_IF_ERROR(comparator.SetLinearReferenceImage(linear));
+  // The reference does not depend on the distance, so it is kept in the
+  // analysis cache for the next encodes of the frame.
+  FrameAnalysisCache* analysis_cache = cparams.analysis_cache.get();
+  std::unique_ptr<JxlButteraugliComparator> local_comparator;
+  std::unique_ptr<JxlButteraugliComparator>& comparator_ptr =
+      analysis_cache ? analysis_cache->butteraugli : local_comparator;
+  if (comparator_ptr &&
+      comparator_ptr->HasReference(linear.xsize(), linear.ysize())) {
+    comparator_ptr->Reuse(cms, pool);
+  } else {
+    comparator_ptr = jxl::make_unique<JxlButteraugliComparator>(params, cms);
+    // The iterations that only raise the quantization of the tiles above the
+    // target leave most of the image unchanged.
+    comparator_ptr->SetIncremental(true);
+    // Only compared approximately on request, since it changes the output.
+    comparator_ptr->SetApproximate(
+        cparams.approximate_butteraugli == Override::kOn, pool);
+    if (analysis_cache && analysis_cache->own_memory_manager) {
+      // The reference is allocated like the rest of the cache, which may
+      // outlive the encoder.
+      JXL_ASSIGN_OR_RETURN(
+          Image3F reference,
+          Image3F::Create(analysis_cache->MemoryManager(memory_manager),
+                          linear.xsize(), linear.ysize()));
+      JXL_RETURN_IF_ERROR(CopyImageTo(linear, &reference));
+      JXL_RETURN_IF_ERROR(comparator_ptr->SetLinearReferenceImage(reference));
+    } else {
+      JXL_RETURN_IF_ERROR(comparator_ptr->SetLinearReferenceImage(linear));
+    }
+  }
+  JxlButteraugliComparator& comparator = *comparator_ptr;
+  // The compared images are the encoder's, so a cached comparator must not
+  // keep the last one.
+  const auto forget_last_image = MakeScopeGuard([&]() {
+    if (analysis_cache) comparator.ForgetLastImage();
+  });
   bool lower_is_better =
       (comparator.GoodQualityScore() < comparator.BadQualityScore());
   const float initial_quant_dc = InitialQuantDC(butteraugli_target);
@@ -1280,10 +1369,12 @@ float InitialQuantDC(float butteraugli_target) {
 StatusOr<ImageF> InitialQuantField(const float butteraugli_target,
                                    const Image3F& opsin, const Rect& rect,
                                    ThreadPool* pool, float rescale,
-                                   ImageF* mask, ImageF* mask1x1) {
+                                   ImageF* mask, ImageF* mask1x1,
+                                   FrameAnalysisCache* analysis_cache) {
   const float quant_ac = kAcQuant / butteraugli_target;
   return HWY_DYNAMIC_DISPATCH(AdaptiveQuantizationMap)(
-      butteraugli_target, opsin, rect, quant_ac * rescale, pool, mask, mask1x1);
+      butteraugli_target, opsin, rect, quant_ac * rescale, pool, mask, mask1x1,
+      analysis_cache);
 }
 
 Status FindBestQuantizer(const FrameHeader& frame_header, const Image3F* linear,
@@ -31,12 +31,15 @@ class AcStrategyImage;
 // more fine-grained quantization should be used in the corresponding block
 // of the input image, while a value less than 1.0 indicates that less
 // fine-grained quantization should be enough. Returns a mask, too, which
-// can later be used to make better decisions about ac strategy.
-StatusOr<ImageF> InitialQuantField(float butteraugli_target,
-                                   const Image3F& opsin, const Rect& rect,
-                                   ThreadPool* pool, float rescale,
-                                   ImageF* initial_quant_mask,
-                                   ImageF* initial_quant_mask1x1);
+// can later be used to make better decisions about ac strategy. If
+// `analysis_cache` is not null, the parts that do not depend on the distance
+// are reused from it if it was filled for a frame of the same size, and stored
+// in it otherwise; `rect` must then cover the whole frame.
+StatusOr<ImageF> InitialQuantField(
+    float butteraugli_target, const Image3F& opsin, const Rect& rect,
+    ThreadPool* pool, float rescale, ImageF* initial_quant_mask,
+    ImageF* initial_quant_mask1x1,
+    FrameAnalysisCache* analysis_cache = nullptr);
 
 float InitialQuantDC(float butteraugli_target);
 
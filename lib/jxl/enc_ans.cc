@@ -22,7 +22,7 @@
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
-#include "lib/jxl/base/fast_math-inl.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"
 #include "lib/jxl/dec_ans.h"
@@ -35,8 +35,71 @@
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/fields.h"
 
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/enc_ans.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/fast_math-inl.h"
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::ConvertTo;
+using hwy::HWY_NAMESPACE::LoadU;
+using hwy::HWY_NAMESPACE::Max;
+using hwy::HWY_NAMESPACE::SumOfLanes;
+
+// Returns the bits of the symbols of `histogram` coded with the normalized
+// `counts`, which are not zero where `histogram` is not.
+float EstimateDataBits(const ANSHistBin* histogram, const ANSHistBin* counts,
+                       size_t len) {
+#if JXL_IS_DEBUG_BUILD
+  int total_histogram = 0;
+  int total_counts = 0;
+  for (size_t i = 0; i < len; ++i) {
+    total_histogram += histogram[i];
+    total_counts += counts[i];
+    JXL_DASSERT(histogram[i] == 0 || counts[i] > 0);
+  }
+  JXL_DASSERT(total_histogram == 0 || total_counts == ANS_TAB_SIZE);
+#endif
+  const HWY_FULL(float) df;
+  const Rebind<int32_t, decltype(df)> di;
+  const size_t N = Lanes(df);
+  const auto one = Set(df, 1.0f);
+  const auto log_tab_size = Set(df, ANS_LOG_TAB_SIZE);
+  auto sum_lanes = Zero(df);
+  size_t i = 0;
+  for (; i + N <= len; i += N) {
+    const auto histo = ConvertTo(df, LoadU(di, histogram + i));
+    // Symbols that do not occur have no count, but also add no bits.
+    const auto count = Max(ConvertTo(df, LoadU(di, counts + i)), one);
+    // += histogram[i] * -log(counts[i]/total_counts)
+    const auto bits = Max(Zero(df), Sub(log_tab_size, FastLog2f(df, count)));
+    sum_lanes = MulAdd(histo, bits, sum_lanes);
+  }
+  float sum = GetLane(SumOfLanes(df, sum_lanes));
+  for (; i < len; ++i) {
+    if (histogram[i] > 0) {
+      sum += histogram[i] *
+             std::max(0.0f, ANS_LOG_TAB_SIZE - FastLog2f(counts[i]));
+    }
+  }
+  return sum;
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
 namespace jxl {
 
+HWY_EXPORT(EstimateDataBits);  // Local function
+
 namespace {
 
 #if (!JXL_IS_DEBUG_BUILD)
@@ -72,29 +135,6 @@ void ANSBuildInfoTable(const ANSHistBin* counts, const AliasTable::Entry* table,
   }
 }
 
-float EstimateDataBits(const ANSHistBin* histogram, const ANSHistBin* counts,
-                       size_t len) {
-  float sum = 0.0f;
-  int total_histogram = 0;
-  int total_counts = 0;
-  for (size_t i = 0; i < len; ++i) {
-    total_histogram += histogram[i];
-    total_counts += counts[i];
-    if (histogram[i] > 0) {
-      JXL_DASSERT(counts[i] > 0);
-      // += histogram[i] * -log(counts[i]/total_counts)
-      sum += histogram[i] *
-             std::max(0.0f, ANS_LOG_TAB_SIZE - FastLog2f(counts[i]));
-    }
-  }
-  if (total_histogram > 0) {
-    // Used only in assert.
-    (void)total_counts;
-    JXL_DASSERT(total_counts == ANS_TAB_SIZE);
-  }
-  return sum;
-}
-
 float EstimateDataBitsFlat(const ANSHistBin* histogram, size_t len) {
   const float flat_bits = std::max(FastLog2f(len), 0.0f);
   float total_histogram = 0;
@@ -398,7 +438,8 @@ StatusOr<float> ComputeHistoAndDataCost(const ANSHistBin* histogram,
   (void)EncodeCounts(counts.data(), alphabet_size, omit_pos, num_symbols, shift,
                      symbols, &writer);
   return writer.size +
-         EstimateDataBits(histogram, counts.data(), alphabet_size);
+         HWY_DYNAMIC_DISPATCH(EstimateDataBits)(histogram, counts.data(),
+                                                alphabet_size);
 }
 
 StatusOr<uint32_t> ComputeBestMethod(
@@ -574,6 +615,40 @@ template void EncodeUintConfigs(const std::vector<HybridUintConfig>&,
 
 namespace {
 
+// The values below 2^kMaxUintGroupSplitExponent are grouped alone, and the
+// larger ones by their number of bits, the kMaxUintGroupMsbInToken bits below
+// their leading one and their kMaxUintGroupLsbInToken lowest bits. All the
+// values of a group have the same token and extra bits in the configs that do
+// not exceed these.
+constexpr uint32_t kMaxUintGroupSplitExponent = 12;
+constexpr uint32_t kMaxUintGroupMsbInToken = 2;
+constexpr uint32_t kMaxUintGroupLsbInToken = 5;
+constexpr uint32_t kUintGroupsPerExponent =
+    1 << (kMaxUintGroupMsbInToken + kMaxUintGroupLsbInToken);
+
+uint32_t UintValueGroup(uint32_t value) {
+  if (value < (1u << kMaxUintGroupSplitExponent)) return value;
+  const uint32_t n = FloorLog2Nonzero(value);
+  const uint32_t msb = (value >> (n - kMaxUintGroupMsbInToken)) &
+                       ((1 << kMaxUintGroupMsbInToken) - 1);
+  const uint32_t lsb = value & ((1 << kMaxUintGroupLsbInToken) - 1);
+  return (1u << kMaxUintGroupSplitExponent) +
+         (n - kMaxUintGroupSplitExponent) * kUintGroupsPerExponent +
+         (msb << kMaxUintGroupLsbInToken) + lsb;
+}
+
+// Returns a value of the group.
+uint32_t UintGroupValue(uint32_t group) {
+  if (group < (1u << kMaxUintGroupSplitExponent)) return group;
+  group -= 1u << kMaxUintGroupSplitExponent;
+  const uint32_t n =
+      kMaxUintGroupSplitExponent + group / kUintGroupsPerExponent;
+  const uint32_t msb =
+      (group % kUintGroupsPerExponent) >> kMaxUintGroupLsbInToken;
+  const uint32_t lsb = group & ((1 << kMaxUintGroupLsbInToken) - 1);
+  return (1u << n) | (msb << (n - kMaxUintGroupMsbInToken)) | lsb;
+}
+
 Status ChooseUintConfigs(const HistogramParams& params,
                          const std::vector<std::vector<Token>>& tokens,
                          const std::vector<uint8_t>& context_map,
@@ -641,41 +716,50 @@ Status ChooseUintConfigs(const HistogramParams& params,
     };
   }
 
+  // Count the values of every histogram once, grouped so that all the values
+  // of a group are coded with the same token and number of extra bits by
+  // every config.
+  std::vector<std::vector<uint32_t>> value_counts(clustered_histograms->size());
+  for (const auto& stream : tokens) {
+    for (const auto& token : stream) {
+      // TODO(veluca): do not ignore lz77 commands.
+      if (token.is_lz77_length) continue;
+      std::vector<uint32_t>& counts = value_counts[context_map[token.context]];
+      const uint32_t group = UintValueGroup(token.value);
+      if (counts.size() <= group) counts.resize(group + 1);
+      ++counts[group];
+    }
+  }
+
   std::vector<float> costs(clustered_histograms->size(),
                            std::numeric_limits<float>::max());
-  std::vector<uint32_t> extra_bits(clustered_histograms->size());
-  std::vector<uint8_t> is_valid(clustered_histograms->size());
   size_t max_alpha =
       codes->use_prefix_code ? PREFIX_MAX_ALPHABET_SIZE : ANS_MAX_ALPHABET_SIZE;
+  Histogram histo;
   for (HybridUintConfig cfg : configs) {
-    std::fill(is_valid.begin(), is_valid.end(), true);
-    std::fill(extra_bits.begin(), extra_bits.end(), 0);
-
-    for (auto& histo : *clustered_histograms) {
+    JXL_ENSURE(cfg.split_exponent <= kMaxUintGroupSplitExponent &&
+               cfg.msb_in_token <= kMaxUintGroupMsbInToken &&
+               cfg.lsb_in_token <= kMaxUintGroupLsbInToken);
+    for (size_t i = 0; i < clustered_histograms->size(); i++) {
+      const std::vector<uint32_t>& counts = value_counts[i];
       histo.Clear();
-    }
-    for (const auto& stream : tokens) {
-      for (const auto& token : stream) {
-        // TODO(veluca): do not ignore lz77 commands.
-        if (token.is_lz77_length) continue;
-        size_t histo = context_map[token.context];
+      bool is_valid = true;
+      uint64_t extra_bits = 0;
+      for (uint32_t group = 0; group < counts.size(); group++) {
+        if (counts[group] == 0) continue;
         uint32_t tok, nbits, bits;
-        cfg.Encode(token.value, &tok, &nbits, &bits);
+        cfg.Encode(UintGroupValue(group), &tok, &nbits, &bits);
         if (tok >= max_alpha ||
             (codes->lz77.enabled && tok >= codes->lz77.min_symbol)) {
-          is_valid[histo] = JXL_FALSE;
-          continue;
+          is_valid = false;
+          break;
         }
-        extra_bits[histo] += nbits;
-        (*clustered_histograms)[histo].Add(tok);
+        extra_bits += static_cast<uint64_t>(nbits) * counts[group];
+        histo.Add(tok, counts[group]);
       }
-    }
-
-    for (size_t i = 0; i < clustered_histograms->size(); i++) {
-      if (!is_valid[i]) continue;
-      JXL_ASSIGN_OR_RETURN(float cost,
-                           (*clustered_histograms)[i].PopulationCost());
-      cost += extra_bits[i];
+      if (!is_valid) continue;
+      JXL_ASSIGN_OR_RETURN(float cost, histo.PopulationCost());
+      cost += extra_bits;
       // add signaling cost of the hybriduintconfig itself
       cost += CeilLog2Nonzero(cfg.split_exponent + 1);
       cost += CeilLog2Nonzero(cfg.split_exponent - cfg.msb_in_token + 1);
@@ -725,6 +809,48 @@ Histogram HistogramFromSymbolInfo(
   return histo;
 }
 
+float ClusteringEntropyRatio(const std::vector<Histogram>& histograms,
+                             const std::vector<Histogram>& clustered) {
+  float entropy = 0.0f;
+  for (const Histogram& histogram : histograms) {
+    entropy += histogram.ShannonEntropy();
+  }
+  float clustered_entropy = 0.0f;
+  for (const Histogram& histogram : clustered) {
+    clustered_entropy += histogram.ShannonEntropy();
+  }
+  return clustered_entropy / std::max(entropy, 1.0f);
+}
+
+// Clusters `histograms` with the context map of `hint`, if it fits them about
+// as well as the histograms it was found for. Otherwise, returns false and
+// leaves the outputs unchanged.
+bool ClusterWithHint(const HistogramParams& params,
+                     const std::vector<Histogram>& histograms,
+                     const ClusteringHint& hint, std::vector<Histogram>* out,
+                     std::vector<uint32_t>* histogram_symbols) {
+  if (hint.context_map.size() != histograms.size()) return false;
+  const size_t num_clusters =
+      *std::max_element(hint.context_map.begin(), hint.context_map.end()) + 1;
+  if (num_clusters > std::min(params.max_histograms, kClustersLimit)) {
+    return false;
+  }
+  std::vector<Histogram> clustered(num_clusters);
+  for (size_t i = 0; i < histograms.size(); i++) {
+    clustered[hint.context_map[i]].AddHistogram(histograms[i]);
+  }
+  for (const Histogram& histogram : clustered) {
+    if (histogram.total_count_ == 0) return false;
+  }
+  if (ClusteringEntropyRatio(histograms, clustered) >
+      hint.entropy_ratio * 1.01f) {
+    return false;
+  }
+  *out = std::move(clustered);
+  histogram_symbols->assign(hint.context_map.begin(), hint.context_map.end());
+  return true;
+}
+
 class HistogramBuilder {
  public:
   explicit HistogramBuilder(const size_t num_contexts)
@@ -753,9 +879,21 @@ class HistogramBuilder {
     if (histograms_.size() > 1) {
       if (!ans_fuzzer_friendly_) {
         std::vector<uint32_t> histogram_symbols;
-        JXL_RETURN_IF_ERROR(
-            ClusterHistograms(params, histograms_, kClustersLimit,
-                              &clustered_histograms, &histogram_symbols));
+        ClusteringHint* hint = params.clustering_hint;
+        if (hint == nullptr || prev_histograms != 0 ||
+            !ClusterWithHint(params, histograms_, *hint,
+                             &clustered_histograms, &histogram_symbols)) {
+          PhaseTimer timer(aux_out, EncoderPhase::Clustering);
+          JXL_RETURN_IF_ERROR(
+              ClusterHistograms(params, histograms_, kClustersLimit,
+                                &clustered_histograms, &histogram_symbols));
+          if (hint != nullptr && prev_histograms == 0) {
+            hint->context_map.assign(histogram_symbols.begin(),
+                                     histogram_symbols.end());
+            hint->entropy_ratio =
+                ClusteringEntropyRatio(histograms_, clustered_histograms);
+          }
+        }
         for (size_t c = 0; c < histograms_.size(); ++c) {
           (*context_map)[context_offset + c] =
               static_cast<uint8_t>(histogram_symbols[c]);
@@ -1276,23 +1414,26 @@ float DistCost(size_t dist) {
   return kCostTable[tok] + nbits;
 }
 
-void ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
-                    const std::vector<std::vector<Token>>& tokens,
-                    LZ77Params& lz77,
-                    std::vector<std::vector<Token>>& tokens_lz77) {
+Status ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
+                      const std::vector<std::vector<Token>>& tokens,
+                      LZ77Params& lz77,
+                      std::vector<std::vector<Token>>& tokens_lz77) {
   // TODO(veluca): tune heuristics here.
   SymbolCostEstimator sce(num_contexts, params.force_huffman, tokens, lz77);
-  float bit_decrease = 0;
   size_t total_symbols = 0;
+  for (const auto& stream : tokens) total_symbols += stream.size();
   tokens_lz77.resize(tokens.size());
-  HybridUintConfig uint_config;
-  std::vector<float> sym_cost;
-  for (size_t stream = 0; stream < tokens.size(); stream++) {
+  // The streams are independent, so they are searched in parallel.
+  std::vector<float> bit_decreases(tokens.size());
+  const auto process_stream = [&](const uint32_t stream,
+                                  size_t /* thread */) -> Status {
+    HybridUintConfig uint_config;
+    std::vector<float> sym_cost;
+    float& bit_decrease = bit_decreases[stream];
     size_t distance_multiplier =
         params.image_widths.size() > stream ? params.image_widths[stream] : 0;
     const auto& in = tokens[stream];
     auto& out = tokens_lz77[stream];
-    total_symbols += in.size();
     // Cumulative sum of bit costs.
     sym_cost.resize(in.size() + 1);
     for (size_t i = 0; i < in.size(); i++) {
@@ -1374,29 +1515,39 @@ void ApplyLZ77_LZ77(const HistogramParams& params, size_t num_contexts,
         // Literal, already pushed
       }
     }
-  }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(params.pool, 0, tokens.size(),
+                                ThreadPool::NoInit, process_stream, "LZ77"));
 
+  float bit_decrease = 0;
+  for (float stream_bit_decrease : bit_decreases) {
+    bit_decrease += stream_bit_decrease;
+  }
   if (bit_decrease > total_symbols * 0.2 + 16) {
     lz77.enabled = true;
   }
+  return true;
 }
 
-void ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
-                       const std::vector<std::vector<Token>>& tokens,
-                       LZ77Params& lz77,
-                       std::vector<std::vector<Token>>& tokens_lz77) {
+Status ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
+                         const std::vector<std::vector<Token>>& tokens,
+                         LZ77Params& lz77,
+                         std::vector<std::vector<Token>>& tokens_lz77) {
   std::vector<std::vector<Token>> tokens_for_cost_estimate;
-  ApplyLZ77_LZ77(params, num_contexts, tokens, lz77, tokens_for_cost_estimate);
+  JXL_RETURN_IF_ERROR(ApplyLZ77_LZ77(params, num_contexts, tokens, lz77,
+                                     tokens_for_cost_estimate));
   // If greedy-LZ77 does not give better compression than no-lz77, no reason to
   // run the optimal matching.
-  if (!lz77.enabled) return;
+  if (!lz77.enabled) return true;
   SymbolCostEstimator sce(num_contexts + 1, params.force_huffman,
                           tokens_for_cost_estimate, lz77);
   tokens_lz77.resize(tokens.size());
-  HybridUintConfig uint_config;
-  std::vector<float> sym_cost;
-  std::vector<uint32_t> dist_symbols;
-  for (size_t stream = 0; stream < tokens.size(); stream++) {
+  const auto process_stream = [&](const uint32_t stream,
+                                  size_t /* thread */) -> Status {
+    HybridUintConfig uint_config;
+    std::vector<float> sym_cost;
+    std::vector<uint32_t> dist_symbols;
     size_t distance_multiplier =
         params.image_widths.size() > stream ? params.image_widths[stream] : 0;
     const auto& in = tokens[stream];
@@ -1510,12 +1661,16 @@ void ApplyLZ77_Optimal(const HistogramParams& params, size_t num_contexts,
       pos -= prefix_costs[pos].len;
     }
     std::reverse(out.begin(), out.end());
-  }
+    return true;
+  };
+  return RunOnPool(params.pool, 0, tokens.size(), ThreadPool::NoInit,
+                   process_stream, "OptimalLZ77");
 }
 
-void ApplyLZ77(const HistogramParams& params, size_t num_contexts,
-               const std::vector<std::vector<Token>>& tokens, LZ77Params& lz77,
-               std::vector<std::vector<Token>>& tokens_lz77) {
+Status ApplyLZ77(const HistogramParams& params, size_t num_contexts,
+                 const std::vector<std::vector<Token>>& tokens,
+                 LZ77Params& lz77,
+                 std::vector<std::vector<Token>>& tokens_lz77) {
   if (params.initialize_global_state) {
     lz77.enabled = false;
   }
@@ -1526,17 +1681,17 @@ void ApplyLZ77(const HistogramParams& params, size_t num_contexts,
   }
   switch (params.lz77_method) {
     case HistogramParams::LZ77Method::kNone:
-      return;
+      return true;
     case HistogramParams::LZ77Method::kRLE:
       ApplyLZ77_RLE(params, num_contexts, tokens, lz77, tokens_lz77);
-      return;
+      return true;
     case HistogramParams::LZ77Method::kLZ77:
-      ApplyLZ77_LZ77(params, num_contexts, tokens, lz77, tokens_lz77);
-      return;
+      return ApplyLZ77_LZ77(params, num_contexts, tokens, lz77, tokens_lz77);
     case HistogramParams::LZ77Method::kOptimal:
-      ApplyLZ77_Optimal(params, num_contexts, tokens, lz77, tokens_lz77);
-      return;
+      return ApplyLZ77_Optimal(params, num_contexts, tokens, lz77,
+                               tokens_lz77);
   }
+  return true;
 }
 }  // namespace
 
@@ -1583,7 +1738,8 @@ StatusOr<size_t> BuildAndEncodeHistograms(
   size_t cost = 0;
   codes->lz77.nonserialized_distance_context = num_contexts;
   std::vector<std::vector<Token>> tokens_lz77;
-  ApplyLZ77(params, num_contexts, tokens, codes->lz77, tokens_lz77);
+  JXL_RETURN_IF_ERROR(
+      ApplyLZ77(params, num_contexts, tokens, codes->lz77, tokens_lz77));
   if (ans_fuzzer_friendly_) {
     codes->lz77.length_uint_config = HybridUintConfig(10, 0, 0);
     codes->lz77.min_symbol = 2048;
@@ -1888,6 +2044,11 @@ HistogramParams HistogramParams::ForModular(
     params.uint_method = HistogramParams::HybridUintMethod::k000;
     params.force_huffman = true;
   }
+  // Prefix codes decode faster than ANS, at the cost of a few percent.
+  if (cparams.decoding_speed_tier >= 4) {
+    params.force_huffman = true;
+  }
   return params;
 }
 }  // namespace jxl
+#endif  // HWY_ONCE
@@ -19,10 +19,20 @@ namespace jxl {
 
 // Forward declaration to break include cycle.
 struct CompressParams;
+class ThreadPool;
 
 // RebalanceHistogram requires a signed type.
 using ANSHistBin = int32_t;
 
+// Clustering of the histograms of a stream, which a similar later stream can
+// reuse instead of clustering its own histograms again.
+struct ClusteringHint {
+  std::vector<uint8_t> context_map;
+  // Entropy of the clustered histograms over the entropy of the histograms
+  // they were clustered from.
+  float entropy_ratio = 0.0f;
+};
+
 struct HistogramParams {
   enum class ClusteringType {
     kFastest,  // Only 4 clusters.
@@ -85,6 +95,14 @@ struct HistogramParams {
   bool streaming_mode = false;
   bool add_missing_symbols = false;
   bool add_fixed_histograms = false;
+  // If not null, the LZ77 search runs one task per stream on this pool, and
+  // the clustering of the histograms evaluates its distances and merge costs
+  // on it. Not owned.
+  ThreadPool* pool = nullptr;
+  // If not null, the histograms are clustered with its context map when it has
+  // one context per histogram and at most 1% more relative entropy than when
+  // it was found. Otherwise, it is set to the new clustering. Not owned.
+  ClusteringHint* clustering_hint = nullptr;
 };
 
 }  // namespace jxl
@@ -5,11 +5,16 @@
 
 #include "lib/jxl/enc_aux_out.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <ctime>
 
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/memory_manager_internal.h"
 
 namespace jxl {
 
@@ -83,6 +88,10 @@ void AuxOut::Assimilate(const AuxOut& victim) {
   num_dct32x64_blocks += victim.num_dct32x64_blocks;
   num_dct64_blocks += victim.num_dct64_blocks;
   num_butteraugli_iters += victim.num_butteraugli_iters;
+  estimated_decode_ns += victim.estimated_decode_ns;
+  for (size_t i = 0; i < kNumEncoderPhases; ++i) {
+    phases[i].Assimilate(victim.phases[i]);
+  }
 }
 
 void AuxOut::Print(size_t num_inputs) const {
@@ -119,4 +128,88 @@ void AuxOut::Print(size_t num_inputs) const {
   }
 }
 
+PhaseTimer::PhaseTimer(AuxOut* aux_out, EncoderPhase phase)
+    : aux_out_(aux_out), phase_(phase) {
+  if (aux_out_ == nullptr) return;
+  parent_ = aux_out_->current_timer;
+  aux_out_->current_timer = this;
+  if (aux_out_->memory_budget != nullptr) {
+    outer_peak_ = aux_out_->memory_budget->ResetPeak();
+  }
+  wall_start_ = WallNow();
+  cpu_start_ = CpuNow();
+  if (aux_out_->counter_reader != nullptr) {
+    aux_out_->counter_reader(aux_out_->counter_opaque, counts_start_);
+  }
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (aux_out_ == nullptr) return;
+  // The CPU clock may be coarser than the wall clock.
+  const uint64_t wall = WallNow() - wall_start_;
+  const uint64_t cpu = std::max(CpuNow(), cpu_start_) - cpu_start_;
+  AuxOut::PhaseTotals& totals = aux_out_->phase(phase_);
+  totals.wall_us += wall - std::min(wall, wall_excluded_);
+  totals.cpu_us += cpu - std::min(cpu, cpu_excluded_);
+  uint64_t counts[kMaxEncoderCounters] = {};
+  CountsSoFar(counts);
+  for (size_t i = 0; i < aux_out_->num_counters; ++i) {
+    totals.counts[i] += counts[i];
+  }
+  MemoryBudget* budget = aux_out_->memory_budget;
+  if (budget != nullptr) {
+    totals.peak_bytes = std::max(totals.peak_bytes, budget->peak());
+    budget->RaisePeak(outer_peak_);
+  }
+  if (parent_ != nullptr) {
+    parent_->wall_excluded_ += wall;
+    parent_->cpu_excluded_ += cpu;
+    for (size_t i = 0; i < aux_out_->num_counters; ++i) {
+      parent_->counts_excluded_[i] += counts[i] + counts_excluded_[i];
+    }
+  }
+  aux_out_->current_timer = parent_;
+}
+
+void PhaseTimer::MoveFraction(EncoderPhase phase, double fraction) {
+  if (aux_out_ == nullptr) return;
+  const uint64_t wall = WallNow() - wall_start_;
+  const uint64_t cpu = std::max(CpuNow(), cpu_start_) - cpu_start_;
+  const uint64_t moved_wall = static_cast<uint64_t>(
+      (wall - std::min(wall, wall_excluded_)) * fraction);
+  const uint64_t moved_cpu =
+      static_cast<uint64_t>((cpu - std::min(cpu, cpu_excluded_)) * fraction);
+  aux_out_->phase(phase).wall_us += moved_wall;
+  aux_out_->phase(phase).cpu_us += moved_cpu;
+  wall_excluded_ += moved_wall;
+  cpu_excluded_ += moved_cpu;
+  uint64_t counts[kMaxEncoderCounters] = {};
+  CountsSoFar(counts);
+  for (size_t i = 0; i < aux_out_->num_counters; ++i) {
+    const uint64_t moved = static_cast<uint64_t>(counts[i] * fraction);
+    aux_out_->phase(phase).counts[i] += moved;
+    counts_excluded_[i] += moved;
+  }
+}
+
+void PhaseTimer::CountsSoFar(uint64_t* counts) const {
+  if (aux_out_->counter_reader == nullptr) return;
+  aux_out_->counter_reader(aux_out_->counter_opaque, counts);
+  for (size_t i = 0; i < aux_out_->num_counters; ++i) {
+    const uint64_t count =
+        std::max(counts[i], counts_start_[i]) - counts_start_[i];
+    counts[i] = count - std::min(count, counts_excluded_[i]);
+  }
+}
+
+uint64_t PhaseTimer::WallNow() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+uint64_t PhaseTimer::CpuNow() {
+  return static_cast<uint64_t>(std::clock()) * 1000000 / CLOCKS_PER_SEC;
+}
+
 }  // namespace jxl
@@ -40,6 +40,30 @@ constexpr uint8_t kNumImageLayers =
 
 const char* LayerName(LayerType layer);
 
+// For AuxOut::phases[] index. Order does not matter.
+enum class EncoderPhase : uint8_t {
+  ToXyb = 0,
+  AcStrategy,
+  AdaptiveQuantization,
+  ChromaFromLuma,
+  Patches,
+  TreeLearning,
+  Clustering,
+  Tokenization,
+  Writing,
+};
+
+constexpr uint8_t kNumEncoderPhases =
+    static_cast<uint8_t>(EncoderPhase::Writing) + 1;
+
+class MemoryBudget;
+class PhaseTimer;
+
+// Same as JXL_ENC_STATS_MAX_COUNTERS.
+constexpr size_t kMaxEncoderCounters = 8;
+// Reads the counters of the calling thread, see AuxOut::counter_reader.
+using EncoderCounterReader = void (*)(void* opaque, uint64_t* values);
+
 // Statistics gathered during compression or decompression.
 struct AuxOut {
  private:
@@ -81,6 +105,47 @@ struct AuxOut {
 
   std::array<LayerTotals, kNumImageLayers> layers;
 
+  struct PhaseTotals {
+    void Assimilate(const PhaseTotals& victim) {
+      wall_us += victim.wall_us;
+      cpu_us += victim.cpu_us;
+      if (victim.peak_bytes > peak_bytes) peak_bytes = victim.peak_bytes;
+      for (size_t i = 0; i < kMaxEncoderCounters; ++i) {
+        counts[i] += victim.counts[i];
+      }
+    }
+
+    // Summed over the calls. The CPU time is that of all the threads of the
+    // process, so it only has a meaning if a single encoder is running.
+    uint64_t wall_us = 0;
+    uint64_t cpu_us = 0;
+    // Highest number of bytes allocated through memory_budget during a call.
+    uint64_t peak_bytes = 0;
+    // Increase of the counters read by counter_reader, summed over the calls.
+    uint64_t counts[kMaxEncoderCounters] = {};
+  };
+
+  // Filled by PhaseTimer.
+  std::array<PhaseTotals, kNumEncoderPhases> phases;
+
+  const PhaseTotals& phase(EncoderPhase idx) const {
+    return phases[static_cast<uint8_t>(idx)];
+  }
+  PhaseTotals& phase(EncoderPhase idx) {
+    return phases[static_cast<uint8_t>(idx)];
+  }
+
+  // Budget of the encoder, if PhaseTimer should measure the peak memory of the
+  // phases.
+  MemoryBudget* memory_budget = nullptr;
+  // Innermost running PhaseTimer.
+  PhaseTimer* current_timer = nullptr;
+  // If not null, PhaseTimer also measures the first num_counters counters
+  // read by counter_reader, such as hardware performance counters.
+  EncoderCounterReader counter_reader = nullptr;
+  void* counter_opaque = nullptr;
+  size_t num_counters = 0;
+
   const LayerTotals& layer(LayerType idx) const {
     return layers[static_cast<uint8_t>(idx)];
   }
@@ -104,7 +169,50 @@ struct AuxOut {
   size_t num_dct64_blocks = 0;
 
   int num_butteraugli_iters = 0;
+
+  // Decoding time of the frames on one thread, in nanoseconds, as estimated
+  // by the model of enc_decode_cost.h. Only counts frames not encoded in
+  // streaming mode.
+  uint64_t estimated_decode_ns = 0;
 };
+
+// Adds the time from its construction to its destruction, the peak of the
+// bytes allocated meanwhile and the increase of the counters of "aux_out", to a
+// phase of "aux_out", unless it is null. Must
+// be used on the thread that owns "aux_out". The time of a timer that runs
+// within another one only counts for the inner one.
+class PhaseTimer {
+ public:
+  PhaseTimer(AuxOut* aux_out, EncoderPhase phase);
+  ~PhaseTimer();
+  PhaseTimer(const PhaseTimer&) = delete;
+  PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+  // Moves "fraction" of the time so far to "phase", for parallel loops whose
+  // tasks do the work of several phases.
+  void MoveFraction(EncoderPhase phase, double fraction);
+
+  // Monotonic time, and CPU time of the process, in microseconds.
+  static uint64_t WallNow();
+  static uint64_t CpuNow();
+
+ private:
+  // Increase of the counters since the construction, minus the excluded ones.
+  void CountsSoFar(uint64_t* counts) const;
+
+  AuxOut* aux_out_;
+  EncoderPhase phase_;
+  PhaseTimer* parent_ = nullptr;
+  uint64_t wall_start_ = 0;
+  uint64_t cpu_start_ = 0;
+  // Time of the inner timers and of MoveFraction, not counted for this one.
+  uint64_t wall_excluded_ = 0;
+  uint64_t cpu_excluded_ = 0;
+  uint64_t outer_peak_ = 0;
+  uint64_t counts_start_[kMaxEncoderCounters] = {};
+  uint64_t counts_excluded_[kMaxEncoderCounters] = {};
+};
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_AUX_OUT_H_
@@ -8,9 +8,17 @@
 #include <jxl/cms_interface.h>
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
 
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -18,6 +26,7 @@
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
+#include "lib/jxl/image_ops.h"
 
 namespace jxl {
 
@@ -34,26 +43,78 @@ Status JxlButteraugliComparator::SetReferenceImage(const ImageBundle& ref) {
                          /*pool=*/nullptr, &store, &ref_linear_srgb)) {
     return false;
   }
-  JXL_ASSIGN_OR_RETURN(comparator_, ButteraugliComparator::Make(
-                                        ref_linear_srgb->color(), params_));
-  xsize_ = ref.xsize();
-  ysize_ = ref.ysize();
+  JXL_RETURN_IF_ERROR(SetLinearReference(ref_linear_srgb->color()));
   intensity_target_ = ref.metadata()->IntensityTarget();
   return true;
 }
 
 Status JxlButteraugliComparator::SetLinearReferenceImage(
     const Image3F& linear) {
-  JXL_ASSIGN_OR_RETURN(comparator_,
-                       ButteraugliComparator::Make(linear, params_));
+  return SetLinearReference(linear);
+}
+
+Status JxlButteraugliComparator::SetLinearReference(const Image3F& linear) {
+  comparator_.reset();
+  half_comparator_.reset();
+  sampled_tiles_.clear();
   xsize_ = linear.xsize();
   ysize_ = linear.ysize();
+  has_reference_ = true;
+  last_actual_ = Image3F();
+  last_diffmap_ = ImageF();
+  reference_ = Image3F();
+  if (approximate_ && xsize_ >= 2 * kApproximateTileDim &&
+      ysize_ >= 2 * kApproximateTileDim) {
+    return SetApproximateReference(linear);
+  }
+  if (tile_dim_ == 0) {
+    JXL_ASSIGN_OR_RETURN(comparator_,
+                         ButteraugliComparator::Make(linear, params_));
+  }
+  if (incremental_ || tile_dim_ != 0) {
+    JXL_ASSIGN_OR_RETURN(
+        reference_, Image3F::Create(linear.memory_manager(), xsize_, ysize_));
+    JXL_RETURN_IF_ERROR(CopyImageTo(linear, &reference_));
+  }
+  return true;
+}
+
+Status JxlButteraugliComparator::SetApproximateReference(
+    const Image3F& linear) {
+  JxlMemoryManager* memory_manager = linear.memory_manager();
+  JXL_ASSIGN_OR_RETURN(Image3F half, DownsampleImage(linear, 2));
+  JXL_ASSIGN_OR_RETURN(half_comparator_,
+                       ButteraugliComparator::Make(half, params_));
+  const Rect image_rect(0, 0, xsize_, ysize_);
+  const size_t xtiles = DivCeil(xsize_, kApproximateTileDim);
+  const size_t ytiles = DivCeil(ysize_, kApproximateTileDim);
+  // The sampled tiles are at the center of each period.
+  const size_t x_phase = (std::min(xtiles, kApproximatePeriod) - 1) / 2;
+  const size_t y_phase = (std::min(ytiles, kApproximatePeriod) - 1) / 2;
+  for (size_t ty = y_phase; ty < ytiles; ty += kApproximatePeriod) {
+    for (size_t tx = x_phase; tx < xtiles; tx += kApproximatePeriod) {
+      SampledTile tile;
+      tile.rect = Rect(tx * kApproximateTileDim, ty * kApproximateTileDim,
+                       kApproximateTileDim, kApproximateTileDim, xsize_,
+                       ysize_);
+      tile.crop = tile.rect.Extend(kButteraugliDiffmapSupport, image_rect);
+      JXL_ASSIGN_OR_RETURN(
+          Image3F reference_crop,
+          Image3F::Create(memory_manager, tile.crop.xsize(),
+                          tile.crop.ysize()));
+      JXL_RETURN_IF_ERROR(CopyImageTo(tile.crop, linear, Rect(reference_crop),
+                                      &reference_crop));
+      JXL_ASSIGN_OR_RETURN(tile.comparator, ButteraugliComparator::Make(
+                                                reference_crop, params_));
+      sampled_tiles_.push_back(std::move(tile));
+    }
+  }
   return true;
 }
 
 Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
                                              ImageF* diffmap, float* score) {
-  if (!comparator_) {
+  if (!has_reference_) {
     return JXL_FAILURE("Must set reference image first");
   }
   if (xsize_ != actual.xsize() || ysize_ != actual.ysize()) {
@@ -93,8 +154,19 @@ Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
       }
     }
   }
-  JXL_RETURN_IF_ERROR(
-      comparator_->Diffmap(*scaled_actual_linear_srgb, temp_diffmap));
+  if (half_comparator_) {
+    JXL_RETURN_IF_ERROR(
+        ApproximateDiffmap(*scaled_actual_linear_srgb, temp_diffmap));
+  } else if (incremental_) {
+    JXL_ASSIGN_OR_RETURN(Image3F actual_copy,
+                         Image3F::Create(memory_manager, xsize_, ysize_));
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(*scaled_actual_linear_srgb, &actual_copy));
+    JXL_RETURN_IF_ERROR(UpdateDiffmap(std::move(actual_copy)));
+    JXL_RETURN_IF_ERROR(CopyImageTo(last_diffmap_, &temp_diffmap));
+  } else {
+    JXL_RETURN_IF_ERROR(FullDiffmap(*scaled_actual_linear_srgb, temp_diffmap));
+  }
 
   if (score != nullptr) {
     *score = ButteraugliScoreFromDiffmap(temp_diffmap, &params_);
@@ -106,6 +178,195 @@ Status JxlButteraugliComparator::CompareWith(const ImageBundle& actual,
   return true;
 }
 
+Status JxlButteraugliComparator::UpdateDiffmap(Image3F&& actual) {
+  JxlMemoryManager* memory_manager = actual.memory_manager();
+  const Rect image_rect(0, 0, xsize_, ysize_);
+  std::vector<Rect> rects;
+  if (last_diffmap_.xsize() != 0) rects = ChangedRects(actual);
+  // The diffmap of a crop also has to process the reference.
+  size_t cost = 0;
+  for (const Rect& rect : rects) {
+    const Rect crop = rect.Extend(2 * kButteraugliDiffmapSupport, image_rect);
+    cost += 2 * crop.xsize() * crop.ysize();
+  }
+  if (last_diffmap_.xsize() == 0 || cost >= xsize_ * ysize_) {
+    JXL_ASSIGN_OR_RETURN(last_diffmap_,
+                         ImageF::Create(memory_manager, xsize_, ysize_));
+    JXL_RETURN_IF_ERROR(FullDiffmap(actual, last_diffmap_));
+    last_actual_ = std::move(actual);
+    return true;
+  }
+  for (const Rect& rect : rects) {
+    const Rect update = rect.Extend(kButteraugliDiffmapSupport, image_rect);
+    // Crops start at even coordinates, where they have the same half
+    // resolution pixels as the whole image.
+    const Rect crop = update.Extend(kButteraugliDiffmapSupport, image_rect);
+    JXL_ASSIGN_OR_RETURN(
+        Image3F reference_crop,
+        Image3F::Create(memory_manager, crop.xsize(), crop.ysize()));
+    JXL_RETURN_IF_ERROR(CopyImageTo(crop, reference_, Rect(reference_crop),
+                                    &reference_crop));
+    JXL_ASSIGN_OR_RETURN(
+        Image3F actual_crop,
+        Image3F::Create(memory_manager, crop.xsize(), crop.ysize()));
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(crop, actual, Rect(actual_crop), &actual_crop));
+    ImageF crop_diffmap;
+    JXL_RETURN_IF_ERROR(ButteraugliDiffmap(reference_crop, actual_crop,
+                                           params_, crop_diffmap));
+    const Rect update_in_crop(update.x0() - crop.x0(), update.y0() - crop.y0(),
+                              update.xsize(), update.ysize());
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(update_in_crop, crop_diffmap, update, &last_diffmap_));
+  }
+  last_actual_ = std::move(actual);
+  return true;
+}
+
+Status JxlButteraugliComparator::FullDiffmap(const Image3F& actual,
+                                             ImageF& diffmap) const {
+  if (comparator_) return comparator_->Diffmap(actual, diffmap);
+  return ButteraugliDiffmap(reference_, actual, params_, tile_dim_, pool_,
+                            diffmap);
+}
+
+Status JxlButteraugliComparator::ApproximateDiffmap(const Image3F& actual,
+                                                    ImageF& diffmap) const {
+  JxlMemoryManager* memory_manager = actual.memory_manager();
+  JXL_ASSIGN_OR_RETURN(Image3F half, DownsampleImage(actual, 2));
+  JXL_ASSIGN_OR_RETURN(
+      ImageF half_diffmap,
+      ImageF::Create(memory_manager, half.xsize(), half.ysize()));
+  JXL_RETURN_IF_ERROR(half_comparator_->Diffmap(half, half_diffmap));
+
+  const size_t num_tiles = sampled_tiles_.size();
+  std::vector<ImageF> tile_diffmaps(num_tiles);
+  const auto compare_tile = [&](const uint32_t i,
+                                size_t /*thread*/) -> Status {
+    const SampledTile& tile = sampled_tiles_[i];
+    JXL_ASSIGN_OR_RETURN(
+        Image3F actual_crop,
+        Image3F::Create(memory_manager, tile.crop.xsize(), tile.crop.ysize()));
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(tile.crop, actual, Rect(actual_crop), &actual_crop));
+    JXL_ASSIGN_OR_RETURN(
+        tile_diffmaps[i],
+        ImageF::Create(memory_manager, tile.crop.xsize(), tile.crop.ysize()));
+    return tile.comparator->Diffmap(actual_crop, tile_diffmaps[i]);
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool_, 0, num_tiles, ThreadPool::NoInit,
+                                compare_tile, "ButteraugliSampledTile"));
+
+  for (size_t y = 0; y < ysize_; ++y) {
+    const float* JXL_RESTRICT row_half = half_diffmap.ConstRow(y / 2);
+    float* JXL_RESTRICT row_out = diffmap.Row(y);
+    for (size_t x = 0; x < xsize_; ++x) {
+      row_out[x] = row_half[x / 2];
+    }
+  }
+  // The half resolution diffmap is scaled to match the full resolution ones
+  // on average over the sampled tiles.
+  double full_sum = 0.0;
+  double half_sum = 0.0;
+  for (size_t i = 0; i < num_tiles; ++i) {
+    const SampledTile& tile = sampled_tiles_[i];
+    const Rect in_crop(tile.rect.x0() - tile.crop.x0(),
+                       tile.rect.y0() - tile.crop.y0(), tile.rect.xsize(),
+                       tile.rect.ysize());
+    for (size_t y = 0; y < tile.rect.ysize(); ++y) {
+      const float* JXL_RESTRICT row_full =
+          in_crop.ConstRow(tile_diffmaps[i], y);
+      const float* JXL_RESTRICT row_half = tile.rect.ConstRow(diffmap, y);
+      for (size_t x = 0; x < tile.rect.xsize(); ++x) {
+        full_sum += row_full[x];
+        half_sum += row_half[x];
+      }
+    }
+  }
+  if (half_sum > 0.0) {
+    ScaleImage(static_cast<float>(full_sum / half_sum), &diffmap);
+  }
+  for (size_t i = 0; i < num_tiles; ++i) {
+    const SampledTile& tile = sampled_tiles_[i];
+    const Rect in_crop(tile.rect.x0() - tile.crop.x0(),
+                       tile.rect.y0() - tile.crop.y0(), tile.rect.xsize(),
+                       tile.rect.ysize());
+    JXL_RETURN_IF_ERROR(
+        CopyImageTo(in_crop, tile_diffmaps[i], tile.rect, &diffmap));
+  }
+  return true;
+}
+
+std::vector<Rect> JxlButteraugliComparator::ChangedRects(
+    const Image3F& actual) const {
+  const size_t xtiles = DivCeil(xsize_, kIncrementalTileDim);
+  const size_t ytiles = DivCeil(ysize_, kIncrementalTileDim);
+  const auto tile_rect = [&](size_t tx, size_t ty) {
+    return Rect(tx * kIncrementalTileDim, ty * kIncrementalTileDim,
+                kIncrementalTileDim, kIncrementalTileDim, xsize_, ysize_);
+  };
+  // 1 for changed tiles, 2 once they are in a rect.
+  std::vector<char> changed(xtiles * ytiles);
+  for (size_t ty = 0; ty < ytiles; ty++) {
+    for (size_t tx = 0; tx < xtiles; tx++) {
+      const Rect rect = tile_rect(tx, ty);
+      for (size_t c = 0; c < 3 && !changed[ty * xtiles + tx]; c++) {
+        for (size_t y = 0; y < rect.ysize(); y++) {
+          if (memcmp(rect.ConstPlaneRow(actual, c, y),
+                     rect.ConstPlaneRow(last_actual_, c, y),
+                     rect.xsize() * sizeof(float)) != 0) {
+            changed[ty * xtiles + tx] = 1;
+            break;
+          }
+        }
+      }
+    }
+  }
+  // Changed tiles close enough for their crops to overlap are diffed together,
+  // in their bounding rect.
+  const int max_gap = static_cast<int>(
+      DivCeil(2 * kButteraugliDiffmapSupport, kIncrementalTileDim));
+  std::vector<Rect> rects;
+  std::vector<size_t> stack;
+  for (size_t i = 0; i < changed.size(); i++) {
+    if (changed[i] != 1) continue;
+    size_t min_tx = xtiles;
+    size_t min_ty = ytiles;
+    size_t max_tx = 0;
+    size_t max_ty = 0;
+    changed[i] = 2;
+    stack.push_back(i);
+    while (!stack.empty()) {
+      const size_t tx = stack.back() % xtiles;
+      const size_t ty = stack.back() / xtiles;
+      stack.pop_back();
+      min_tx = std::min(min_tx, tx);
+      min_ty = std::min(min_ty, ty);
+      max_tx = std::max(max_tx, tx);
+      max_ty = std::max(max_ty, ty);
+      for (int dy = -max_gap; dy <= max_gap; dy++) {
+        for (int dx = -max_gap; dx <= max_gap; dx++) {
+          const int64_t nx = static_cast<int64_t>(tx) + dx;
+          const int64_t ny = static_cast<int64_t>(ty) + dy;
+          if (nx < 0 || ny < 0 || nx >= static_cast<int64_t>(xtiles) ||
+              ny >= static_cast<int64_t>(ytiles)) {
+            continue;
+          }
+          const size_t n = ny * xtiles + nx;
+          if (changed[n] != 1) continue;
+          changed[n] = 2;
+          stack.push_back(n);
+        }
+      }
+    }
+    const Rect first = tile_rect(min_tx, min_ty);
+    const Rect last = tile_rect(max_tx, max_ty);
+    rects.emplace_back(first.x0(), first.y0(), last.x1() - first.x0(),
+                       last.y1() - first.y0());
+  }
+  return rects;
+}
+
 float JxlButteraugliComparator::GoodQualityScore() const {
   return ButteraugliFuzzyInverse(1.5);
 }
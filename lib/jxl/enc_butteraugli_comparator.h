@@ -10,7 +10,10 @@
 #include <stddef.h>
 
 #include <memory>
+#include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/enc_comparator.h"
@@ -24,9 +27,56 @@ class JxlButteraugliComparator : public Comparator {
   explicit JxlButteraugliComparator(const ButteraugliParams& params,
                                     const JxlCmsInterface& cms);
 
+  // Makes CompareWith only recompute the diffmap around the tiles in which the
+  // image differs from the one of its previous call, for callers that compare
+  // several versions of an image that are only partly changed. Must be set
+  // before the reference image.
+  void SetIncremental(bool incremental) { incremental_ = incremental; }
+
+  // Makes CompareWith compute the diffmap in tiles of tile_dim x tile_dim
+  // pixels, in parallel on `pool`, see ButteraugliDiffmap, instead of keeping
+  // the frequency decomposition of the whole reference image. Must be set
+  // before the reference image.
+  void SetTiled(size_t tile_dim, ThreadPool* pool) {
+    tile_dim_ = tile_dim;
+    pool_ = pool;
+  }
+
+  // Makes CompareWith approximate the diffmap of large images: they are
+  // compared at half resolution, and at full resolution only in one of every
+  // kApproximatePeriod x kApproximatePeriod tiles. The full resolution
+  // diffmaps of these sampled tiles replace the half resolution one and scale
+  // it elsewhere, to account for the finest frequencies it misses. Images
+  // smaller than two tiles in either direction are compared exactly. The
+  // sampled tiles are compared in parallel on `pool`. Takes precedence over
+  // SetIncremental and SetTiled. Must be set before the reference image.
+  void SetApproximate(bool approximate, ThreadPool* pool) {
+    approximate_ = approximate;
+    pool_ = pool;
+  }
+
   Status SetReferenceImage(const ImageBundle& ref) override;
   Status SetLinearReferenceImage(const Image3F& linear);
 
+  // For callers that keep the comparator of a reference for later uses: forgets
+  // the image of the previous CompareWith, so that the next one compares the
+  // whole image as the first one did, and makes the comparator use `cms` and
+  // run on `pool`.
+  void Reuse(const JxlCmsInterface& cms, ThreadPool* pool) {
+    cms_ = cms;
+    ForgetLastImage();
+    pool_ = pool;
+  }
+  // Frees the image of the previous CompareWith and its diffmap, which were
+  // allocated with the memory manager of the compared image.
+  void ForgetLastImage() {
+    last_actual_ = Image3F();
+    last_diffmap_ = ImageF();
+  }
+  bool HasReference(size_t xsize, size_t ysize) const {
+    return has_reference_ && xsize_ == xsize && ysize_ == ysize;
+  }
+
   Status CompareWith(const ImageBundle& actual, ImageF* diffmap,
                      float* score) override;
 
@@ -34,12 +84,55 @@ class JxlButteraugliComparator : public Comparator {
   float BadQualityScore() const override;
 
  private:
+  // Side of the square tiles in which changes are tracked.
+  static constexpr size_t kIncrementalTileDim = 64;
+
+  // Side of the tiles of approximate mode, and period of the sampled ones.
+  static constexpr size_t kApproximateTileDim = 256;
+  static constexpr size_t kApproximatePeriod = 4;
+
+  Status SetLinearReference(const Image3F& linear);
+  // Sets up the half resolution and sampled tile comparators of approximate
+  // mode.
+  Status SetApproximateReference(const Image3F& linear);
+  Status ApproximateDiffmap(const Image3F& actual, ImageF& diffmap) const;
+  // Computes the diffmap of `actual` against the whole reference.
+  Status FullDiffmap(const Image3F& actual, ImageF& diffmap) const;
+  // Updates last_diffmap_ for last_actual_ changing to `actual` and makes
+  // `actual` the last image.
+  Status UpdateDiffmap(Image3F&& actual);
+  // Rects of last_actual_ that contain all its differences with `actual`.
+  std::vector<Rect> ChangedRects(const Image3F& actual) const;
+
   ButteraugliParams params_;
   JxlCmsInterface cms_;
   std::unique_ptr<ButteraugliComparator> comparator_;
   size_t xsize_ = 0;
   size_t ysize_ = 0;
+  bool has_reference_ = false;
   float intensity_target_ = 0.f;
+
+  bool incremental_ = false;
+  size_t tile_dim_ = 0;
+  ThreadPool* pool_ = nullptr;
+  // In incremental or tiled mode, the reference image, and in incremental
+  // mode the image of the previous CompareWith, in linear sRGB, with the
+  // diffmap between them.
+  Image3F reference_;
+  Image3F last_actual_;
+  ImageF last_diffmap_;
+
+  // In approximate mode, the comparator of the reference at half resolution,
+  // and the sampled tiles with the comparators of their crops, which have
+  // kButteraugliDiffmapSupport pixels of context around the tiles.
+  struct SampledTile {
+    Rect rect;
+    Rect crop;
+    std::unique_ptr<ButteraugliComparator> comparator;
+  };
+  bool approximate_ = false;
+  std::unique_ptr<ButteraugliComparator> half_comparator_;
+  std::vector<SampledTile> sampled_tiles_;
 };
 
 }  // namespace jxl
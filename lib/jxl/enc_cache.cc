@@ -102,6 +102,15 @@ Status InitializePassesEncoder(const FrameHeader& frame_header,
     shared.quantizer.RecomputeFromGlobalScale();
   }
 
+  // The butteraugli and maximum error searches of the quantization field, and
+  // the search of a target size, quantize the frame several times.
+  const CompressParams& cparams = enc_state->cparams;
+  if (!enc_state->streaming_mode && enc_state->transform_cache.empty() &&
+      (cparams.speed_tier <= SpeedTier::kKitten || cparams.max_error_mode ||
+       cparams.target_size > 0)) {
+    enc_state->transform_cache.resize(shared.frame_dim.num_groups);
+  }
+
   JXL_ASSIGN_OR_RETURN(
       Image3F dc, Image3F::Create(memory_manager, shared.frame_dim.xsize_blocks,
                                   shared.frame_dim.ysize_blocks));
@@ -122,6 +131,9 @@ Status InitializePassesEncoder(const FrameHeader& frame_header,
     cparams.gaborish = Override::kOff;
     cparams.epf = 0;
     cparams.resampling = 1;
+    cparams.target_size = 0;
+    cparams.analysis_cache = nullptr;
+    cparams.entropy_coding_cache = nullptr;
     cparams.ec_resampling = 1;
     // The DC frame will have alpha=0. Don't erase its contents.
     cparams.keep_invisible = Override::kOn;
@@ -12,18 +12,24 @@
 #include <cstddef>
 #include <cstdint>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/coeff_order_fwd.h"
 #include "lib/jxl/dct_util.h"
 #include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_ans_params.h"
 #include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_butteraugli_comparator.h"
+#include "lib/jxl/enc_noise.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/enc_progressive_split.h"
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/memory_manager_internal.h"
 #include "lib/jxl/passes_state.h"
 #include "lib/jxl/quant_weights.h"
 
@@ -40,8 +46,24 @@ struct PassesEncoderState {
 
   bool streaming_mode = false;
   bool initialize_global_state = true;
+  // Whether the coefficients are those of a recompressed JPEG.
+  bool jpeg_transcoding = false;
   size_t dc_group_index = 0;
 
+  // Streaming modular frames with a global MA tree first visit a sample of the
+  // DC groups to learn the tree: once to gather the samples that quantize the
+  // properties, once to gather the tree samples. Streaming VarDCT frames with
+  // estimated noise visit a sample of the DC groups to add crops of their XYB
+  // image to `noise_estimator`. Nothing is encoded in these passes.
+  enum class StreamingPass {
+    kPropertySamples,
+    kTreeSamples,
+    kNoiseSamples,
+    kEncode
+  };
+  StreamingPass streaming_pass = StreamingPass::kEncode;
+  NoiseEstimator noise_estimator;
+
   // Per-pass DCT coefficients for the image. One row per group.
   std::vector<std::unique_ptr<ACImage>> coeffs;
 
@@ -73,9 +95,84 @@ struct PassesEncoderState {
 
   ImageF initial_quant_masking1x1;
 
+  // Unquantized coefficients of the blocks of every group, stored by the first
+  // ComputeCoefficients call for the group and reused by the next ones, which
+  // only change the quantization. Only kept by InitializePassesEncoder when
+  // the frame is quantized several times, since it takes 12 bytes per pixel.
+  // The AC strategy and the image must not change once it is filled.
+  std::vector<AlignedMemory> transform_cache;
+
   JxlMemoryManager* memory_manager() const { return shared.memory_manager; }
 };
 
+// Analysis of a frame that does not depend on the distance, which encodes of
+// the same frame at other distances reuse when they are given the same
+// CompressParams::analysis_cache, or JxlEncoderAnalysisCache in the API. It is
+// filled by a VarDCT frame encoded with it in XYB, and only used when not
+// encoding in streaming mode. The analysis is kept for the frame of `key`, a
+// hash of the input pixels and of their color encoding, and a frame with other
+// content replaces it. A cache must only be shared by encodes with the same
+// parameters, other than the distance, and not by two encoders at the same
+// time.
+struct FrameAnalysisCache {
+  // Forgets the analysis unless it was made for the frame of `frame_key`.
+  void SetKey(uint64_t frame_key) {
+    if (has_key && key == frame_key) return;
+    opsin = Image3F();
+    linear = Image3F();
+    pre_erosion = ImageF();
+    mask1x1 = ImageF();
+    butteraugli.reset();
+    has_key = true;
+    key = frame_key;
+  }
+
+  // The images of the cache are allocated with `memory_manager` when
+  // `own_memory_manager` is set, since an API cache may outlive the encoders
+  // that fill it, and otherwise with the memory manager of the encoder.
+  JxlMemoryManager* MemoryManager(JxlMemoryManager* encoder_memory_manager) {
+    return own_memory_manager ? &memory_manager : encoder_memory_manager;
+  }
+
+  JxlMemoryManager memory_manager = {};
+  bool own_memory_manager = false;
+  bool has_key = false;
+  uint64_t key = 0;
+  // Output of the conversion to XYB, and the linear image if the encoder
+  // needed one.
+  Image3F opsin;
+  Image3F linear;
+  // Masking of InitialQuantField before it is scaled for the distance: the
+  // local differences at a quarter of the resolution, before erosion, and the
+  // blurred 1x1 mask.
+  ImageF pre_erosion;
+  ImageF mask1x1;
+  // Butteraugli comparator of FindBestQuantization, with the analysis of the
+  // linear image as reference.
+  std::unique_ptr<JxlButteraugliComparator> butteraugli;
+};
+
+// Coefficient orders and clustering of the AC histograms of the last VarDCT
+// frame that computed them with CompressParams::entropy_coding_cache. The next
+// frames take its orders instead of counting their zero coefficients when they
+// have the same size, passes and order kinds, and about the same fraction of
+// blocks of each kind. They take its clustering when it fits their histograms
+// about as well, as decided by ClusteringHint. Frames encoded in streaming mode
+// neither fill nor use the cache. A cache must not be used by two encoders at
+// the same time.
+struct EntropyCodingCache {
+  size_t xsize_blocks = 0;
+  size_t ysize_blocks = 0;
+  // Output of ComputeUsedOrders, and fraction of the blocks of each order kind.
+  std::pair<uint32_t, uint32_t> used_orders_info;
+  std::vector<float> order_fractions;
+  // Non-default orders of each pass, and the orders of all the passes.
+  std::vector<uint32_t> used_orders;
+  std::vector<coeff_order_t> coeff_orders;
+  // One per pass.
+  std::vector<ClusteringHint> ac_clustering;
+};
+
 // Initialize per-frame information.
 class ModularFrameEncoder;
 Status InitializePassesEncoder(const FrameHeader& frame_header,
@@ -11,6 +11,7 @@
 #include <cfloat>
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <hwy/base.h>  // HWY_ALIGN_MAX
 #include <limits>
 
@@ -209,8 +210,9 @@ Status ComputeTile(const Image3F& opsin, const Rect& opsin_rect,
                    const DequantMatrices& dequant,
                    const AcStrategyImage* ac_strategy,
                    const ImageI* raw_quant_field, const Quantizer* quantizer,
-                   const Rect& rect, bool fast, bool use_dct8, ImageSB* map_x,
-                   ImageSB* map_b, ImageF* dc_values, float* mem) {
+                   const Rect& rect, bool fast, bool use_dct8,
+                   bool reuse_dct8, ImageSB* map_x, ImageSB* map_b,
+                   ImageF* dc_values, float* mem) {
   static_assert(kEncTileDimInBlocks == kColorTileDimInBlocks,
                 "Invalid color tile dim");
   size_t xsize_blocks = opsin_rect.xsize() / kBlockDim;
@@ -243,10 +245,11 @@ Status ComputeTile(const Image3F& opsin, const Rect& opsin_rect,
   float* HWY_RESTRICT coeffs_yb = coeffs_x + kColorTileDim * kColorTileDim;
   float* HWY_RESTRICT coeffs_b = coeffs_yb + kColorTileDim * kColorTileDim;
   float* HWY_RESTRICT scratch_space = coeffs_b + kColorTileDim * kColorTileDim;
-  float* scratch_space_end =
+  float* HWY_RESTRICT dct8_coeffs =
       scratch_space + 2 * AcStrategy::kMaxCoeffArea + dct_scratch_size;
-  JXL_ENSURE(scratch_space_end == block_y + CfLHeuristics::ItemsPerThread());
-  (void)scratch_space_end;
+  float* dct8_coeffs_end = dct8_coeffs + kColorTileDim * kColorTileDim * 3;
+  JXL_ENSURE(dct8_coeffs_end == block_y + CfLHeuristics::ItemsPerThread());
+  (void)dct8_coeffs_end;
 
   // Small (~256 bytes each)
   HWY_ALIGN_MAX float
@@ -272,14 +275,33 @@ Status ComputeTile(const Image3F& opsin, const Rect& opsin_rect,
                            : ac_strategy->ConstRow(y)[x];
       if (!acs.IsFirstBlock()) continue;
       size_t xs = acs.covered_blocks_x();
-      TransformFromPixels(acs.Strategy(), row_y + x * kBlockDim, stride,
-                          block_y, scratch_space);
+      // Channels X, Y, B of the block, as AcStrategyHeuristics reads them.
+      float* block_dct8 =
+          dct8_coeffs +
+          ((y - y0) * kColorTileDimInBlocks + x - x0) * 3 * kDCTBlockSize;
+      if (reuse_dct8 && acs.Strategy() == AcStrategyType::DCT) {
+        memcpy(block_x, block_dct8, kDCTBlockSize * sizeof(float));
+        memcpy(block_y, block_dct8 + kDCTBlockSize,
+               kDCTBlockSize * sizeof(float));
+        memcpy(block_b, block_dct8 + 2 * kDCTBlockSize,
+               kDCTBlockSize * sizeof(float));
+      } else {
+        TransformFromPixels(acs.Strategy(), row_y + x * kBlockDim, stride,
+                            block_y, scratch_space);
+        TransformFromPixels(acs.Strategy(), row_x + x * kBlockDim, stride,
+                            block_x, scratch_space);
+        TransformFromPixels(acs.Strategy(), row_b + x * kBlockDim, stride,
+                            block_b, scratch_space);
+      }
+      if (use_dct8) {
+        memcpy(block_dct8, block_x, kDCTBlockSize * sizeof(float));
+        memcpy(block_dct8 + kDCTBlockSize, block_y,
+               kDCTBlockSize * sizeof(float));
+        memcpy(block_dct8 + 2 * kDCTBlockSize, block_b,
+               kDCTBlockSize * sizeof(float));
+      }
       DCFromLowestFrequencies(acs.Strategy(), block_y, dc_y, xs);
-      TransformFromPixels(acs.Strategy(), row_x + x * kBlockDim, stride,
-                          block_x, scratch_space);
       DCFromLowestFrequencies(acs.Strategy(), block_x, dc_x, xs);
-      TransformFromPixels(acs.Strategy(), row_b + x * kBlockDim, stride,
-                          block_b, scratch_space);
       DCFromLowestFrequencies(acs.Strategy(), block_b, dc_b, xs);
       const float* const JXL_RESTRICT qm_x =
           dequant.InvMatrix(acs.Strategy(), 0);
@@ -379,12 +401,18 @@ Status CfLHeuristics::ComputeTile(const Rect& r, const Image3F& opsin,
                                   const AcStrategyImage* ac_strategy,
                                   const ImageI* raw_quant_field,
                                   const Quantizer* quantizer, bool fast,
-                                  size_t thread, ColorCorrelationMap* cmap) {
+                                  size_t thread, ColorCorrelationMap* cmap,
+                                  bool reuse_dct8) {
   bool use_dct8 = ac_strategy == nullptr;
   return HWY_DYNAMIC_DISPATCH(ComputeTile)(
       opsin, opsin_rect, dequant, ac_strategy, raw_quant_field, quantizer, r,
-      fast, use_dct8, &cmap->ytox_map, &cmap->ytob_map, &dc_values,
-      mem.address<float>() + thread * ItemsPerThread());
+      fast, use_dct8, reuse_dct8 && !use_dct8, &cmap->ytox_map,
+      &cmap->ytob_map, &dc_values, Mem(thread));
+}
+
+const float* CfLHeuristics::Dct8Coefficients(size_t thread) const {
+  // Last in the memory of the thread.
+  return Mem(thread) + ItemsPerThread() - kColorTileDim * kColorTileDim * 3;
 }
 
 Status ColorCorrelationEncodeDC(const ColorCorrelation& color_correlation,
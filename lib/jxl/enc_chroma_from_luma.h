@@ -50,7 +50,15 @@ struct CfLHeuristics {
                      const Rect& opsin_rect, const DequantMatrices& dequant,
                      const AcStrategyImage* ac_strategy,
                      const ImageI* raw_quant_field, const Quantizer* quantizer,
-                     bool fast, size_t thread, ColorCorrelationMap* cmap);
+                     bool fast, size_t thread, ColorCorrelationMap* cmap,
+                     bool reuse_dct8 = false);
+
+  // DCT8 coefficients of the blocks of the tile of the last ComputeTile call
+  // of `thread` without AC strategy: the X, Y and B coefficients of a block
+  // follow one another, and the blocks are in raster order of a tile of
+  // kColorTileDimInBlocks blocks per row. AcStrategyHeuristics reuses them, as
+  // does a call with an AC strategy for the same tile given `reuse_dct8`.
+  const float* Dct8Coefficients(size_t thread) const;
 
   JxlMemoryManager* memory_manager;
   ImageF dc_values;
@@ -63,7 +71,13 @@ struct CfLHeuristics {
     return AcStrategy::kMaxCoeffArea * 3        // Blocks
            + kColorTileDim * kColorTileDim * 4  // AC coeff storage
            + AcStrategy::kMaxCoeffArea * 2      // Scratch space
-           + dct_scratch_size;
+           + dct_scratch_size
+           + kColorTileDim * kColorTileDim * 3;  // DCT8 coefficients
+  }
+
+ private:
+  float* Mem(size_t thread) const {
+    return mem.address<float>() + thread * ItemsPerThread();
   }
 };
 
@@ -14,8 +14,11 @@
 #include <numeric>
 #include <queue>
 #include <tuple>
+#include <utility>
 #include <vector>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_ans_params.h"
 
@@ -115,9 +118,11 @@ float HistogramKLDivergence(const Histogram& actual, const Histogram& coding) {
   return total_cost - actual.entropy_;
 }
 
-// First step of a k-means clustering with a fancy distance metric.
+// First step of a k-means clustering with a fancy distance metric. The
+// distances to every new cluster are computed on `pool`, if not null.
 Status FastClusterHistograms(const std::vector<Histogram>& in,
-                             size_t max_histograms, std::vector<Histogram>* out,
+                             size_t max_histograms, ThreadPool* pool,
+                             std::vector<Histogram>* out,
                              std::vector<uint32_t>* histogram_symbols) {
   const size_t prev_histograms = out->size();
   out->reserve(max_histograms);
@@ -155,14 +160,26 @@ Status FastClusterHistograms(const std::vector<Histogram>& in,
   }
 
   constexpr float kMinDistanceForDistinct = 48.0f;
+  constexpr size_t kHistogramsPerTask = 256;
+  const size_t num_tasks = DivCeil(in.size(), kHistogramsPerTask);
+  const auto update_dists = [&](const uint32_t task,
+                                size_t /* thread */) -> Status {
+    const size_t end = std::min((task + 1) * kHistogramsPerTask, in.size());
+    for (size_t i = task * kHistogramsPerTask; i < end; i++) {
+      if (dists[i] == 0.0f) continue;
+      dists[i] = std::min(HistogramDistance(in[i], out->back()), dists[i]);
+    }
+    return true;
+  };
   while (out->size() < max_histograms) {
     (*histogram_symbols)[largest_idx] = out->size();
     out->push_back(in[largest_idx]);
     dists[largest_idx] = 0.0f;
+    JXL_RETURN_IF_ERROR(RunOnPool(num_tasks > 1 ? pool : nullptr, 0,
+                                  num_tasks, ThreadPool::NoInit, update_dists,
+                                  "FastClusterHistograms"));
     largest_idx = 0;
     for (size_t i = 0; i < in.size(); i++) {
-      if (dists[i] == 0.0f) continue;
-      dists[i] = std::min(HistogramDistance(in[i], out->back()), dists[i]);
       if (dists[i] > dists[largest_idx]) largest_idx = i;
     }
     if (dists[largest_idx] < kMinDistanceForDistinct) break;
@@ -253,7 +270,8 @@ Status ClusterHistograms(const HistogramParams& params,
   }
 
   JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(FastClusterHistograms)(
-      in, prev_histograms + max_histograms, out, histogram_symbols));
+      in, prev_histograms + max_histograms, params.pool, out,
+      histogram_symbols));
 
   if (prev_histograms == 0 &&
       params.clustering == HistogramParams::ClusteringType::kBest) {
@@ -284,22 +302,51 @@ Status ClusterHistograms(const HistogramParams& params,
       }
     };
 
+    // Computes the change of the total cost from merging each pair of
+    // `candidates` into `costs`, on params.pool if not null.
+    std::vector<std::pair<uint32_t, uint32_t>> candidates;
+    std::vector<float> costs;
+    constexpr size_t kPairsPerTask = 16;
+    const auto compute_costs = [&]() -> Status {
+      costs.resize(candidates.size());
+      const size_t num_tasks = DivCeil(candidates.size(), kPairsPerTask);
+      const auto compute_task = [&](const uint32_t task,
+                                    size_t /* thread */) -> Status {
+        const size_t end =
+            std::min((task + 1) * kPairsPerTask, candidates.size());
+        for (size_t k = task * kPairsPerTask; k < end; k++) {
+          const Histogram& first = (*out)[candidates[k].first];
+          const Histogram& second = (*out)[candidates[k].second];
+          Histogram histo;
+          histo.AddHistogram(first);
+          histo.AddHistogram(second);
+          JXL_ASSIGN_OR_RETURN(
+              float cost,
+              ANSPopulationCost(histo.data_.data(), histo.data_.size()));
+          costs[k] = cost - (first.entropy_ + second.entropy_);
+        }
+        return true;
+      };
+      return RunOnPool(num_tasks > 1 ? params.pool : nullptr, 0, num_tasks,
+                       ThreadPool::NoInit, compute_task, "ClusterHistograms");
+    };
+
     // Create list of all pairs by increasing merging cost.
     std::priority_queue<HistogramPair> pairs_to_merge;
     for (uint32_t i = 0; i < out->size(); i++) {
       for (uint32_t j = i + 1; j < out->size(); j++) {
-        Histogram histo;
-        histo.AddHistogram((*out)[i]);
-        histo.AddHistogram((*out)[j]);
-        JXL_ASSIGN_OR_RETURN(float cost, ANSPopulationCost(histo.data_.data(),
-                                                           histo.data_.size()));
-        cost -= (*out)[i].entropy_ + (*out)[j].entropy_;
-        // Avoid enqueueing pairs that are not advantageous to merge.
-        if (cost >= 0) continue;
-        pairs_to_merge.push(
-            HistogramPair{cost, i, j, std::max(version[i], version[j])});
+        candidates.emplace_back(i, j);
       }
     }
+    JXL_RETURN_IF_ERROR(compute_costs());
+    for (size_t k = 0; k < candidates.size(); k++) {
+      // Avoid enqueueing pairs that are not advantageous to merge.
+      if (costs[k] >= 0) continue;
+      const uint32_t i = candidates[k].first;
+      const uint32_t j = candidates[k].second;
+      pairs_to_merge.push(
+          HistogramPair{costs[k], i, j, std::max(version[i], version[j])});
+    }
 
     // Merge the best pair to merge, add new pairs that get formed as a
     // consequence.
@@ -324,20 +371,19 @@ Status ClusterHistograms(const HistogramParams& params,
       }
       version[second] = 0;
       version[first] = next_version++;
+      candidates.clear();
       for (uint32_t j = 0; j < out->size(); j++) {
         if (j == first) continue;
         if (version[j] == 0) continue;
-        Histogram histo;
-        histo.AddHistogram((*out)[first]);
-        histo.AddHistogram((*out)[j]);
-        JXL_ASSIGN_OR_RETURN(
-            float merge_cost,
-            ANSPopulationCost(histo.data_.data(), histo.data_.size()));
-        merge_cost -= (*out)[first].entropy_ + (*out)[j].entropy_;
+        candidates.emplace_back(first, j);
+      }
+      JXL_RETURN_IF_ERROR(compute_costs());
+      for (size_t k = 0; k < candidates.size(); k++) {
+        const uint32_t j = candidates[k].second;
         // Avoid enqueueing pairs that are not advantageous to merge.
-        if (merge_cost >= 0) continue;
+        if (costs[k] >= 0) continue;
         pairs_to_merge.push(
-            HistogramPair{merge_cost, std::min(first, j), std::max(first, j),
+            HistogramPair{costs[k], std::min(first, j), std::max(first, j),
                           std::max(version[first], version[j])});
       }
     }
@@ -28,12 +28,12 @@ struct Histogram {
     data_.clear();
     total_count_ = 0;
   }
-  void Add(size_t symbol) {
+  void Add(size_t symbol, ANSHistBin count = 1) {
     if (data_.size() <= symbol) {
       data_.resize(DivCeil(symbol + 1, kRounding) * kRounding);
     }
-    ++data_[symbol];
-    ++total_count_;
+    data_[symbol] += count;
+    total_count_ += count;
   }
   void AddHistogram(const Histogram& other) {
     if (other.data_.size() > data_.size()) {
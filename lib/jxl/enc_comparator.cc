@@ -53,6 +53,15 @@ void AlphaBlend(const Image3F& in, const size_t c, float background_linear,
   }
 }
 
+Status ComputeScoreImpl(const ImageBundle& rgb0, const ImageBundle& rgb1,
+                        Comparator* comparator, ImageF* distmap, float& score) {
+  JXL_RETURN_IF_ERROR(comparator->SetReferenceImage(rgb0));
+  JXL_RETURN_IF_ERROR(comparator->CompareWith(rgb1, distmap, &score));
+  return true;
+}
+
+}  // namespace
+
 void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb) {
   // No alpha => all opaque.
   if (!io_linear_srgb->HasAlpha()) return;
@@ -63,15 +72,6 @@ void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb) {
   }
 }
 
-Status ComputeScoreImpl(const ImageBundle& rgb0, const ImageBundle& rgb1,
-                        Comparator* comparator, ImageF* distmap, float& score) {
-  JXL_RETURN_IF_ERROR(comparator->SetReferenceImage(rgb0));
-  JXL_RETURN_IF_ERROR(comparator->CompareWith(rgb1, distmap, &score));
-  return true;
-}
-
-}  // namespace
-
 Status ComputeScore(const ImageBundle& rgb0, const ImageBundle& rgb1,
                     Comparator* comparator, const JxlCmsInterface& cms,
                     float* score, ImageF* diffmap, ThreadPool* pool,
@@ -43,6 +43,11 @@ class Comparator {
   virtual float BadQualityScore() const = 0;
 };
 
+// Blends an image in linear sRGB with alpha channel against a gray background
+// of the given linear intensity, the way ComputeScore does, in gamma-compressed
+// space. Images without alpha are left as they are.
+void AlphaBlend(float background_linear, ImageBundle* io_linear_srgb);
+
 // Computes the score given images in any RGB color model, optionally with
 // alpha channel.
 Status ComputeScore(const ImageBundle& rgb0, const ImageBundle& rgb1,
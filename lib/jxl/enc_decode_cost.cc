@@ -0,0 +1,73 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_decode_cost.h"
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "lib/jxl/frame_dimensions.h"
+#include "lib/jxl/frame_header.h"
+#include "lib/jxl/loop_filter.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
+#include "lib/jxl/modular/encoding/dec_ma.h"
+#include "lib/jxl/modular/options.h"
+
+namespace jxl {
+
+TreeDecodeCost ComputeTreeDecodeCost(const Tree& tree) {
+  TreeDecodeCost cost;
+  if (tree.empty()) return cost;
+  size_t num_leaves = 0;
+  size_t total_depth = 0;
+  // Pairs of node and depth.
+  std::vector<std::pair<size_t, size_t>> stack = {{0, 0}};
+  while (!stack.empty()) {
+    const std::pair<size_t, size_t> node = stack.back();
+    stack.pop_back();
+    const PropertyDecisionNode& n = tree[node.first];
+    if (n.property < 0) {
+      num_leaves++;
+      total_depth += node.second;
+      if (n.predictor == Predictor::Weighted) cost.uses_wp = true;
+      continue;
+    }
+    if (static_cast<size_t>(n.property) == kWPProp) cost.uses_wp = true;
+    stack.emplace_back(n.lchild, node.second + 1);
+    stack.emplace_back(n.rchild, node.second + 1);
+  }
+  cost.mean_depth = static_cast<float>(total_depth) / num_leaves;
+  return cost;
+}
+
+float EstimateModularDecodeNs(const TreeDecodeCost& tree, size_t num_samples,
+                              bool lz77, const DecodeCostModel& model) {
+  float sample_ns =
+      model.modular_sample_ns + model.tree_level_ns * tree.mean_depth;
+  if (tree.uses_wp) sample_ns += model.weighted_predictor_ns;
+  if (lz77) sample_ns += model.lz77_sample_ns;
+  return sample_ns * num_samples;
+}
+
+float EstimateFrameDecodeNs(const FrameHeader& frame_header,
+                            size_t patch_pixels, const DecodeCostModel& model) {
+  const FrameDimensions frame_dim = frame_header.ToFrameDimensions();
+  const float pixels = static_cast<float>(frame_dim.xsize) * frame_dim.ysize;
+  const float output_pixels =
+      static_cast<float>(frame_dim.xsize_upsampled) * frame_dim.ysize_upsampled;
+  float ns = model.pixel_ns * output_pixels;
+  if (frame_header.encoding == FrameEncoding::kVarDCT) {
+    ns += model.vardct_pixel_ns * pixels;
+  }
+  const LoopFilter& lf = frame_header.loop_filter;
+  ns += model.epf_pass_ns * lf.epf_iters * pixels;
+  if (lf.gab) ns += model.gaborish_ns * pixels;
+  if (frame_header.upsampling > 1) ns += model.upsampling_ns * output_pixels;
+  ns += model.patch_pixel_ns * patch_pixels;
+  return ns;
+}
+
+}  // namespace jxl
@@ -0,0 +1,69 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_DECODE_COST_H_
+#define LIB_JXL_ENC_DECODE_COST_H_
+
+// Model of the time the decoder takes on the features of a frame, which the
+// encoder uses to fit CompressParams::decoding_budget.
+
+#include <cstddef>
+
+#include "lib/jxl/frame_header.h"
+#include "lib/jxl/modular/encoding/dec_ma.h"
+
+namespace jxl {
+
+// Nanoseconds taken by one thread of the decoder on one pixel or sample. The
+// defaults were measured on a recent x86 core with
+// tools/benchmark/decode_cost_calibration, which prints the values to use
+// for other machines.
+struct DecodeCostModel {
+  // Conversion of every pixel to the output color space.
+  float pixel_ns = 1.5f;
+  // Dequantization and inverse transforms of VarDCT pixels.
+  float vardct_pixel_ns = 6.0f;
+  // Each of the up to three passes of the edge-preserving filter.
+  float epf_pass_ns = 2.5f;
+  float gaborish_ns = 1.0f;
+  // Upsampling, per output pixel.
+  float upsampling_ns = 3.0f;
+  // Each pixel covered by a patch.
+  float patch_pixel_ns = 1.0f;
+  // Entropy decoding and prediction of a modular sample, and the extra time
+  // for each level of the MA tree it goes through, when the weighted predictor
+  // is computed for it, and when the stream uses LZ77.
+  float modular_sample_ns = 3.0f;
+  float tree_level_ns = 0.8f;
+  float weighted_predictor_ns = 5.0f;
+  float lz77_sample_ns = 0.5f;
+};
+
+// What the decoding time of a MA tree depends on: the mean depth of its
+// leaves, and whether the decoder has to compute the weighted predictor,
+// because a leaf uses it or a node splits on its error property.
+struct TreeDecodeCost {
+  float mean_depth = 0.0f;
+  bool uses_wp = false;
+};
+
+TreeDecodeCost ComputeTreeDecodeCost(const Tree& tree);
+
+// Estimated decoding time of `num_samples` modular samples coded with `tree`.
+float EstimateModularDecodeNs(const TreeDecodeCost& tree, size_t num_samples,
+                              bool lz77,
+                              const DecodeCostModel& model = DecodeCostModel());
+
+// Estimated decoding time of the parts of a frame that do not depend on its
+// modular streams: the color conversion, the VarDCT transforms, the loop
+// filters and upsampling given by `frame_header`, and `patch_pixels` pixels of
+// patches.
+float EstimateFrameDecodeNs(const FrameHeader& frame_header,
+                            size_t patch_pixels,
+                            const DecodeCostModel& model = DecodeCostModel());
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_DECODE_COST_H_
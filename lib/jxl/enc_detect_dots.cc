@@ -43,45 +43,35 @@ namespace jxl {
 namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
-using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::Sub;
 
-StatusOr<ImageF> SumOfSquareDifferences(const Image3F& forig,
-                                        const Image3F& smooth,
+// Weighted square differences of the Y channels; the weights of X and B are
+// zero, so they are not computed.
+StatusOr<ImageF> SumOfSquareDifferences(const ImageF& forig_y,
+                                        const ImageF& smooth_y,
                                         ThreadPool* pool) {
   const HWY_FULL(float) d;
-  const auto color_coef0 = Set(d, 0.0f);
   const auto color_coef1 = Set(d, 10.0f);
-  const auto color_coef2 = Set(d, 0.0f);
-  JxlMemoryManager* memory_manager = forig.memory_manager();
+  JxlMemoryManager* memory_manager = forig_y.memory_manager();
 
   JXL_ASSIGN_OR_RETURN(
       ImageF sum_of_squares,
-      ImageF::Create(memory_manager, forig.xsize(), forig.ysize()));
+      ImageF::Create(memory_manager, forig_y.xsize(), forig_y.ysize()));
   const auto process_row = [&](const uint32_t task, size_t thread) -> Status {
     const size_t y = static_cast<size_t>(task);
-    const float* JXL_RESTRICT orig_row0 = forig.Plane(0).ConstRow(y);
-    const float* JXL_RESTRICT orig_row1 = forig.Plane(1).ConstRow(y);
-    const float* JXL_RESTRICT orig_row2 = forig.Plane(2).ConstRow(y);
-    const float* JXL_RESTRICT smooth_row0 = smooth.Plane(0).ConstRow(y);
-    const float* JXL_RESTRICT smooth_row1 = smooth.Plane(1).ConstRow(y);
-    const float* JXL_RESTRICT smooth_row2 = smooth.Plane(2).ConstRow(y);
+    const float* JXL_RESTRICT orig_row1 = forig_y.ConstRow(y);
+    const float* JXL_RESTRICT smooth_row1 = smooth_y.ConstRow(y);
     float* JXL_RESTRICT sos_row = sum_of_squares.Row(y);
 
-    for (size_t x = 0; x < forig.xsize(); x += Lanes(d)) {
-      auto v0 = Sub(Load(d, orig_row0 + x), Load(d, smooth_row0 + x));
+    for (size_t x = 0; x < forig_y.xsize(); x += Lanes(d)) {
       auto v1 = Sub(Load(d, orig_row1 + x), Load(d, smooth_row1 + x));
-      auto v2 = Sub(Load(d, orig_row2 + x), Load(d, smooth_row2 + x));
-      v0 = Mul(Mul(v0, v0), color_coef0);
       v1 = Mul(Mul(v1, v1), color_coef1);
-      v2 = Mul(Mul(v2, v2), color_coef2);
-      const auto sos = Add(v0, Add(v1, v2));  // weighted sum of square diffs
-      Store(sos, d, sos_row + x);
+      Store(v1, d, sos_row + x);
     }
     return true;
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, forig.ysize(), ThreadPool::NoInit,
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, forig_y.ysize(), ThreadPool::NoInit,
                                 process_row, "ComputeEnergyImage"));
   return sum_of_squares;
 }
@@ -148,15 +138,13 @@ const WeightsSeparable5& WeightsSeparable5Gaussian3() {
   return weights;
 }
 
+// `smooth` must have the size of `orig`.
 StatusOr<ImageF> ComputeEnergyImage(const Image3F& orig, Image3F* smooth,
                                     ThreadPool* pool) {
   JxlMemoryManager* memory_manager = orig.memory_manager();
   // Prepare guidance images for dot selection.
   JXL_ASSIGN_OR_RETURN(
-      Image3F forig,
-      Image3F::Create(memory_manager, orig.xsize(), orig.ysize()));
-  JXL_ASSIGN_OR_RETURN(
-      *smooth, Image3F::Create(memory_manager, orig.xsize(), orig.ysize()));
+      ImageF forig, ImageF::Create(memory_manager, orig.xsize(), orig.ysize()));
   Rect rect(orig);
 
   const auto& weights1 = WeightsSeparable5Gaussian0_65();
@@ -165,14 +153,15 @@ StatusOr<ImageF> ComputeEnergyImage(const Image3F& orig, Image3F* smooth,
   for (size_t c = 0; c < 3; ++c) {
     // Use forig as temporary storage to reduce memory and keep it warmer.
     JXL_RETURN_IF_ERROR(
-        Separable5(orig.Plane(c), rect, weights3, pool, &forig.Plane(c)));
-    JXL_RETURN_IF_ERROR(
-        Separable5(forig.Plane(c), rect, weights3, pool, &smooth->Plane(c)));
+        Separable5(orig.Plane(c), rect, weights3, pool, &forig));
     JXL_RETURN_IF_ERROR(
-        Separable5(orig.Plane(c), rect, weights1, pool, &forig.Plane(c)));
+        Separable5(forig, rect, weights3, pool, &smooth->Plane(c)));
   }
+  // Only the Y channel has a weight in the energy.
+  JXL_RETURN_IF_ERROR(Separable5(orig.Plane(1), rect, weights1, pool, &forig));
 
-  return HWY_DYNAMIC_DISPATCH(SumOfSquareDifferences)(forig, *smooth, pool);
+  return HWY_DYNAMIC_DISPATCH(SumOfSquareDifferences)(forig, smooth->Plane(1),
+                                                      pool);
 }
 
 struct Pixel {
@@ -298,14 +287,17 @@ StatusOr<std::vector<ConnectedComponent>> FindCC(const ImageF& energy,
                                                  const Rect& rect, double t_low,
                                                  double t_high,
                                                  uint32_t maxWindow,
-                                                 double minScore) {
+                                                 double minScore,
+                                                 ThreadPool* pool) {
   const int kExtraRect = 4;
   JxlMemoryManager* memory_manager = energy.memory_manager();
   JXL_ASSIGN_OR_RETURN(
       ImageF img,
       ImageF::Create(memory_manager, energy.xsize(), energy.ysize()));
   JXL_RETURN_IF_ERROR(CopyImageTo(energy, &img));
-  std::vector<ConnectedComponent> ans;
+  // The flood fills clear the pixels they visit, so they run in order; the
+  // statistics of the components found are then computed in parallel.
+  std::vector<ConnectedComponent> candidates;
   for (size_t y = 0; y < rect.ysize(); y++) {
     float* JXL_RESTRICT row = rect.Row(&img, y);
     for (size_t x = 0; x < rect.xsize(); x++) {
@@ -323,20 +315,28 @@ StatusOr<std::vector<ConnectedComponent>> FindCC(const ImageF& energy,
 #endif  // JXL_DEBUG_DOT_DETECT
         Rect bounds = BoundingRectangle(pixels);
         if (bounds.xsize() < maxWindow && bounds.ysize() < maxWindow) {
-          ConnectedComponent cc{bounds, std::move(pixels)};
-          cc.CompStats(energy, rect, kExtraRect);
-          if (cc.score < minScore) continue;
-          JXL_DEBUG(JXL_DEBUG_DOT_DETECT,
-                    "cc mode: (%d,%d), max: %f, bgMean: %f bgVar: "
-                    "%f bound:(%" PRIuS ",%" PRIuS ",%" PRIuS ",%" PRIuS ")\n",
-                    cc.mode.x, cc.mode.y, cc.maxEnergy, cc.meanEnergy,
-                    cc.varEnergy, cc.bounds.x0(), cc.bounds.y0(),
-                    cc.bounds.xsize(), cc.bounds.ysize());
-          ans.push_back(cc);
+          candidates.emplace_back(bounds, std::move(pixels));
         }
       }
     }
   }
+  const auto comp_stats = [&](const uint32_t i, size_t /*thread*/) -> Status {
+    candidates[i].CompStats(energy, rect, kExtraRect);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, candidates.size(), ThreadPool::NoInit,
+                                comp_stats, "DotComponentStats"));
+  std::vector<ConnectedComponent> ans;
+  for (ConnectedComponent& cc : candidates) {
+    if (cc.score < minScore) continue;
+    JXL_DEBUG(JXL_DEBUG_DOT_DETECT,
+              "cc mode: (%d,%d), max: %f, bgMean: %f bgVar: "
+              "%f bound:(%" PRIuS ",%" PRIuS ",%" PRIuS ",%" PRIuS ")\n",
+              cc.mode.x, cc.mode.y, cc.maxEnergy, cc.meanEnergy, cc.varEnergy,
+              cc.bounds.x0(), cc.bounds.y0(), cc.bounds.xsize(),
+              cc.bounds.ysize());
+    ans.push_back(std::move(cc));
+  }
   return ans;
 }
 
@@ -360,6 +360,26 @@ void ComputeDotLosses(GaussianEllipse* ellipse, const ConnectedComponent& cc,
   double distMeanModeSq = (cc.mode.x - ellipse->x) * (cc.mode.x - ellipse->x) +
                           (cc.mode.y - ellipse->y) * (cc.mode.y - ellipse->y);
   ellipse->custom_loss = 0.0;
+  // The shapes of the dot and of the loss weight are the same in all channels:
+  // evaluate them once per pixel of the window.
+  const int window_xsize = static_cast<int>(cc.bounds.xsize()) + 2 * rectBounds;
+  const int window_ysize = static_cast<int>(cc.bounds.ysize()) + 2 * rectBounds;
+  std::vector<double> shapes(window_xsize * window_ysize);
+  std::vector<double> weights(window_xsize * window_ysize);
+  for (int sy = -rectBounds;
+       sy < (static_cast<int>(cc.bounds.ysize()) + rectBounds); sy++) {
+    int y = sy + cc.bounds.y0();
+    for (int sx = -rectBounds;
+         sx < (static_cast<int>(cc.bounds.xsize()) + rectBounds); sx++) {
+      int x = sx + cc.bounds.x0();
+      const size_t i = (sy + rectBounds) * window_xsize + sx + rectBounds;
+      shapes[i] = DotGaussianModel(x - ellipse->x, y - ellipse->y, ct, st,
+                                   ellipse->sigma_x, ellipse->sigma_y, 1.0);
+      weights[i] = DotGaussianModel(x - cc.mode.x, y - cc.mode.y, 1.0, 0.0,
+                                    1.0 + ellipse->sigma_x,
+                                    1.0 + ellipse->sigma_y, 1.0);
+    }
+  }
   for (int c = 0; c < 3; c++) {
     for (int sy = -rectBounds;
          sy < (static_cast<int>(cc.bounds.ysize()) + rectBounds); sy++) {
@@ -369,14 +389,16 @@ void ComputeDotLosses(GaussianEllipse* ellipse, const ConnectedComponent& cc,
       // bgrow is only used if kOptimizeBackground is false.
       // NOLINTNEXTLINE(clang-analyzer-deadcode.DeadStores)
       const float* JXL_RESTRICT bgrow = rect.ConstPlaneRow(background, c, y);
+      const double* JXL_RESTRICT shape_row =
+          shapes.data() + (sy + rectBounds) * window_xsize + rectBounds;
+      const double* JXL_RESTRICT weight_row =
+          weights.data() + (sy + rectBounds) * window_xsize + rectBounds;
       for (int sx = -rectBounds;
            sx < (static_cast<int>(cc.bounds.xsize()) + rectBounds); sx++) {
         int x = sx + cc.bounds.x0();
         if (x < 0 || static_cast<size_t>(x) >= rect.xsize()) continue;
         double target = row[x];
-        double dotDelta = DotGaussianModel(
-            x - ellipse->x, y - ellipse->y, ct, st, ellipse->sigma_x,
-            ellipse->sigma_y, ellipse->intensity[c]);
+        double dotDelta = ellipse->intensity[c] * shape_row[sx];
         if (dotDelta > target + kZeroEpsilon) {
           ellipse->neg_pixels++;
           ellipse->neg_value[c] += dotDelta - target;
@@ -388,10 +410,7 @@ void ComputeDotLosses(GaussianEllipse* ellipse, const ConnectedComponent& cc,
         double l1 = channelGains[c] * std::fabs(diff);
         ellipse->l2_loss += l2;
         ellipse->l1_loss += l1;
-        double w = DotGaussianModel(x - cc.mode.x, y - cc.mode.y, 1.0, 0.0,
-                                    1.0 + ellipse->sigma_x,
-                                    1.0 + ellipse->sigma_y, 1.0);
-        ellipse->custom_loss += w * l2;
+        ellipse->custom_loss += weight_row[sx] * l2;
         N++;
       }
     }
@@ -492,12 +511,21 @@ StatusOr<GaussianEllipse> FitGaussianFast(const ConnectedComponent& cc,
     GaussianEllipse* ellipse = &ans;
     double ct = cos(ans.angle);
     double st = sin(ans.angle);
+    int yc = static_cast<int>(cc.mode.y);
+    int xc = static_cast<int>(cc.mode.x);
+    // The Gaussian does not depend on the channel.
+    double gaussians[kEllipseWindowSize][kEllipseWindowSize];
+    for (int y = yc - kRectBounds; y <= yc + kRectBounds; y++) {
+      for (int x = xc - kRectBounds; x <= xc + kRectBounds; x++) {
+        gaussians[y - yc + kRectBounds][x - xc + kRectBounds] =
+            DotGaussianModel(x - ellipse->x, y - ellipse->y, ct, st,
+                             ellipse->sigma_x, ellipse->sigma_y, 1.0);
+      }
+    }
     // Estimate intensity with least squares (fixed background)
     for (int c = 0; c < 3; c++) {
       double gg = 0.0;
       double gd = 0.0;
-      int yc = static_cast<int>(cc.mode.y);
-      int xc = static_cast<int>(cc.mode.x);
       for (int y = yc - kRectBounds; y <= yc + kRectBounds; y++) {
         if (y < 0 || static_cast<size_t>(y) >= rect.ysize()) continue;
         const float* JXL_RESTRICT row = rect.ConstPlaneRow(img, c, y);
@@ -506,8 +534,7 @@ StatusOr<GaussianEllipse> FitGaussianFast(const ConnectedComponent& cc,
           if (x < 0 || static_cast<size_t>(x) >= rect.xsize()) continue;
           double target = row[x] - bgrow[x];
           double gaussian =
-              DotGaussianModel(x - ellipse->x, y - ellipse->y, ct, st,
-                               ellipse->sigma_x, ellipse->sigma_y, 1.0);
+              gaussians[y - yc + kRectBounds][x - xc + kRectBounds];
           gg += gaussian * gaussian;
           gd += gaussian * target;
         }
@@ -560,7 +587,7 @@ StatusOr<std::vector<PatchInfo>> DetectGaussianEllipses(
   JXL_ASSIGN_OR_RETURN(ImageF energy, ComputeEnergyImage(opsin, &smooth, pool));
   JXL_ASSIGN_OR_RETURN(std::vector<ConnectedComponent> components,
                        FindCC(energy, rect, params.t_low, params.t_high,
-                              params.maxWinSize, params.minScore));
+                              params.maxWinSize, params.minScore, pool));
   size_t numCC =
       std::min(params.maxCC, (components.size() * params.percCC) / 100);
   if (components.size() > numCC) {
@@ -571,9 +598,18 @@ StatusOr<std::vector<PatchInfo>> DetectGaussianEllipses(
         });
     components.erase(components.begin() + numCC, components.end());
   }
-  for (const auto& cc : components) {
-    JXL_ASSIGN_OR_RETURN(GaussianEllipse ellipse,
-                         FitGaussian(cc, rect, opsin, smooth));
+  // The fits are independent; the dots are then selected in order.
+  std::vector<GaussianEllipse> ellipses(components.size());
+  const auto fit = [&](const uint32_t i, size_t /*thread*/) -> Status {
+    JXL_ASSIGN_OR_RETURN(ellipses[i],
+                         FitGaussian(components[i], rect, opsin, smooth));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, components.size(), ThreadPool::NoInit,
+                                fit, "FitGaussians"));
+  for (size_t i = 0; i < components.size(); i++) {
+    const ConnectedComponent& cc = components[i];
+    const GaussianEllipse& ellipse = ellipses[i];
     if (ellipse.x < 0.0 ||
         std::ceil(ellipse.x) >= static_cast<double>(rect.xsize()) ||
         ellipse.y < 0.0 ||
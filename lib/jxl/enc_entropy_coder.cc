@@ -163,7 +163,8 @@ Status TokenizeCoefficients(const coeff_order_t* JXL_RESTRICT orders,
   const size_t xsize_blocks = rect.xsize();
   const size_t ysize_blocks = rect.ysize();
   output->clear();
-  // TODO(user): update the estimate: usually less coefficients are used.
+  // The worst case: callers keep `output` for the next groups and copy the
+  // tokens out, since usually less coefficients are used.
   output->reserve(3 * xsize_blocks * ysize_blocks * kDCTBlockSize);
 
   size_t offset[3] = {};
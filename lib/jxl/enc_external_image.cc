@@ -12,20 +12,122 @@
 #include <cstring>
 #include <utility>
 
-#include "lib/jxl/base/byte_order.h"
-#include "lib/jxl/base/common.h"
-#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
-#include "lib/jxl/base/float.h"
-#include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/enc_external_image.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/byte_order.h"
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/float.h"
+#include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/image_ops.h"
 
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::Mul;
+using hwy::HWY_NAMESPACE::Or;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+
+// Splits the "num_channels" interleaved unsigned samples of the pixels of
+// "in" into the rows of "out", as floats multiplied by "scale". Channels with
+// a null row are skipped. Only converts whole vectors of pixels, so that it
+// never reads past "num" pixels, and returns how many pixels it converted.
+template <typename T>
+size_t UintToFloatDeinterleaved(const T* in, size_t num_channels, size_t num,
+                                bool swap_endianness, float scale,
+                                float* JXL_RESTRICT* out) {
+  const HWY_FULL(float) d;
+  const Rebind<int32_t, decltype(d)> di;
+  const Rebind<T, decltype(d)> du;
+  const auto mul = Set(d, scale);
+  const auto low_byte = Set(di, 0xFF);
+
+  // Byte swapping is done after the promotion, where it works for both the
+  // 8 and 16-bit lanes; it is only requested for the latter.
+  const auto store = [&](const auto v, float* row, size_t x) {
+    if (row == nullptr) return;
+    auto i = PromoteTo(di, v);
+    if (swap_endianness) {
+      i = Or(ShiftLeft<8>(And(i, low_byte)), ShiftRight<8>(i));
+    }
+    Store(Mul(ConvertTo(d, i), mul), d, row + x);
+  };
+  const size_t N = Lanes(d);
+  size_t x = 0;
+  for (; x + N <= num; x += N) {
+    const T* p = in + x * num_channels;
+    if (num_channels == 1) {
+      store(LoadU(du, p), out[0], x);
+    } else if (num_channels == 2) {
+      auto v0 = Zero(du);
+      auto v1 = Zero(du);
+      LoadInterleaved2(du, p, v0, v1);
+      store(v0, out[0], x);
+      store(v1, out[1], x);
+    } else if (num_channels == 3) {
+      auto v0 = Zero(du);
+      auto v1 = Zero(du);
+      auto v2 = Zero(du);
+      LoadInterleaved3(du, p, v0, v1, v2);
+      store(v0, out[0], x);
+      store(v1, out[1], x);
+      store(v2, out[2], x);
+    } else {
+      auto v0 = Zero(du);
+      auto v1 = Zero(du);
+      auto v2 = Zero(du);
+      auto v3 = Zero(du);
+      LoadInterleaved4(du, p, v0, v1, v2, v3);
+      store(v0, out[0], x);
+      store(v1, out[1], x);
+      store(v2, out[2], x);
+      store(v3, out[3], x);
+    }
+  }
+  return x;
+}
+
+size_t U8ToFloatDeinterleaved(const uint8_t* in, size_t num_channels,
+                              size_t num, bool swap_endianness, float scale,
+                              float* JXL_RESTRICT* out) {
+  return UintToFloatDeinterleaved(in, num_channels, num, swap_endianness,
+                                  scale, out);
+}
+
+size_t U16ToFloatDeinterleaved(const uint16_t* in, size_t num_channels,
+                               size_t num, bool swap_endianness, float scale,
+                               float* JXL_RESTRICT* out) {
+  return UintToFloatDeinterleaved(in, num_channels, num, swap_endianness,
+                                  scale, out);
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
 namespace jxl {
+
+HWY_EXPORT(U8ToFloatDeinterleaved);
+HWY_EXPORT(U16ToFloatDeinterleaved);
+
 namespace {
 
 size_t JxlDataTypeBytes(JxlDataType data_type) {
@@ -43,6 +145,108 @@ size_t JxlDataTypeBytes(JxlDataType data_type) {
   }
 }
 
+Status CheckUintBitDepth(JxlDataType data_type, size_t bits_per_sample) {
+  if (data_type == JXL_TYPE_UINT8) {
+    JXL_RETURN_IF_ERROR(bits_per_sample > 0 && bits_per_sample <= 8);
+  } else if (data_type == JXL_TYPE_UINT16) {
+    JXL_RETURN_IF_ERROR(bits_per_sample > 8 && bits_per_sample <= 16);
+  } else if (data_type != JXL_TYPE_FLOAT16 && data_type != JXL_TYPE_FLOAT) {
+    JXL_FAILURE("unsupported pixel format data type %d", data_type);
+  }
+  return true;
+}
+
+// Checks that "size" bytes hold the image, and returns its stride.
+Status ExternalStride(size_t size, size_t xsize, size_t ysize,
+                      const JxlPixelFormat& format, size_t* stride) {
+  size_t bytes_per_channel = JxlDataTypeBytes(format.data_type);
+  size_t bytes_per_pixel = format.num_channels * bytes_per_channel;
+  const size_t last_row_size = xsize * bytes_per_pixel;
+  const size_t align = format.align;
+  const size_t row_size =
+      (align > 1 ? jxl::DivCeil(last_row_size, align) * align : last_row_size);
+  const size_t bytes_to_read = row_size * (ysize - 1) + last_row_size;
+  if (xsize == 0 || ysize == 0) return JXL_FAILURE("Empty image");
+  if (size > 0 && size < bytes_to_read) {
+    return JXL_FAILURE("Buffer size is too small, expected: %" PRIuS
+                       " got: %" PRIuS " (Image: %" PRIuS "x%" PRIuS
+                       "x%u, bytes_per_channel: %" PRIuS ")",
+                       bytes_to_read, size, xsize, ysize, format.num_channels,
+                       bytes_per_channel);
+  }
+  // Too large buffer is likely an application bug, so also fail for that.
+  // Do allow padding to stride in last row though.
+  if (size > row_size * ysize) {
+    return JXL_FAILURE("Buffer size is too large");
+  }
+  *stride = row_size;
+  return true;
+}
+
+// Converts the color channels of 8 or 16-bit interleaved samples, and the
+// last channel into "alpha" if it is not null, in a single pass over the
+// rows, instead of reading the whole buffer once per channel.
+Status ConvertUintFromExternal(const uint8_t* data, size_t xsize, size_t ysize,
+                               size_t stride, size_t color_channels,
+                               size_t bits_per_sample, JxlPixelFormat format,
+                               ThreadPool* pool, Image3F* color,
+                               ImageF* alpha) {
+  JXL_RETURN_IF_ERROR(CheckUintBitDepth(format.data_type, bits_per_sample));
+  JXL_ENSURE(color->xsize() == xsize && color->ysize() == ysize);
+  JXL_ENSURE(!alpha || (alpha->xsize() == xsize && alpha->ysize() == ysize));
+
+  const size_t num_channels = format.num_channels;
+  const size_t bytes_per_channel = JxlDataTypeBytes(format.data_type);
+  const size_t bytes_per_pixel = num_channels * bytes_per_channel;
+  const float scale = 1.0f / ((1ull << bits_per_sample) - 1);
+  const bool little_endian =
+      format.endianness == JXL_LITTLE_ENDIAN ||
+      (format.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+  const bool swap_endianness =
+      bytes_per_channel == 2 && little_endian != IsLittleEndian();
+  // The vector loads of 16-bit samples want them aligned to their size.
+  const bool use_simd =
+      bytes_per_channel == 1 ||
+      (reinterpret_cast<uintptr_t>(data) % 2 == 0 && stride % 2 == 0);
+
+  const auto convert_row = [&](const uint32_t task,
+                               size_t /*thread*/) -> Status {
+    const size_t y = task;
+    const uint8_t* row_in = data + y * stride;
+    float* JXL_RESTRICT rows_out[4] = {};
+    for (size_t c = 0; c < color_channels; ++c) {
+      rows_out[c] = color->PlaneRow(c, y);
+    }
+    if (alpha) rows_out[num_channels - 1] = alpha->Row(y);
+    size_t done = 0;
+    if (use_simd && bytes_per_channel == 1) {
+      done = HWY_DYNAMIC_DISPATCH(U8ToFloatDeinterleaved)(
+          row_in, num_channels, xsize, swap_endianness, scale, rows_out);
+    } else if (use_simd) {
+      done = HWY_DYNAMIC_DISPATCH(U16ToFloatDeinterleaved)(
+          reinterpret_cast<const uint16_t*>(row_in), num_channels, xsize,
+          swap_endianness, scale, rows_out);
+    }
+    // The remaining pixels that do not fill a vector.
+    for (size_t c = 0; c < num_channels; ++c) {
+      float* JXL_RESTRICT row_out = rows_out[c];
+      if (row_out == nullptr) continue;
+      const auto save_value = [&](size_t index, float value) {
+        row_out[done + index] = value;
+      };
+      JXL_RETURN_IF_ERROR(LoadFloatRow(
+          row_in + done * bytes_per_pixel + c * bytes_per_channel,
+          xsize - done, bytes_per_pixel, format.data_type, little_endian,
+          scale, save_value));
+    }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, static_cast<uint32_t>(ysize),
+                                ThreadPool::NoInit, convert_row,
+                                "ConvertUint"));
+  return true;
+}
+
 }  // namespace
 
 Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t xsize,
@@ -50,14 +254,7 @@ Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t xsize,
                                       size_t bits_per_sample,
                                       JxlPixelFormat format, size_t c,
                                       ThreadPool* pool, ImageF* channel) {
-  if (format.data_type == JXL_TYPE_UINT8) {
-    JXL_RETURN_IF_ERROR(bits_per_sample > 0 && bits_per_sample <= 8);
-  } else if (format.data_type == JXL_TYPE_UINT16) {
-    JXL_RETURN_IF_ERROR(bits_per_sample > 8 && bits_per_sample <= 16);
-  } else if (format.data_type != JXL_TYPE_FLOAT16 &&
-             format.data_type != JXL_TYPE_FLOAT) {
-    JXL_FAILURE("unsupported pixel format data type %d", format.data_type);
-  }
+  JXL_RETURN_IF_ERROR(CheckUintBitDepth(format.data_type, bits_per_sample));
 
   JXL_ENSURE(channel->xsize() == xsize);
   JXL_ENSURE(channel->ysize() == ysize);
@@ -108,10 +305,29 @@ Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t xsize,
 
   JXL_ASSIGN_OR_RETURN(Image3F color,
                        Image3F::Create(memory_manager, xsize, ysize));
-  for (size_t c = 0; c < color_channels; ++c) {
-    JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
-        data, xsize, ysize, stride, bits_per_sample, format, c, pool,
-        &color.Plane(c)));
+  // Passing an interleaved image with an alpha channel to an image that doesn't
+  // have alpha channel just discards the passed alpha channel.
+  const bool keep_alpha = has_alpha && ib->HasAlpha();
+  ImageF alpha;
+  if (keep_alpha) {
+    JXL_ASSIGN_OR_RETURN(alpha, ImageF::Create(memory_manager, xsize, ysize));
+  }
+  if (format.data_type == JXL_TYPE_UINT8 ||
+      format.data_type == JXL_TYPE_UINT16) {
+    JXL_RETURN_IF_ERROR(ConvertUintFromExternal(
+        data, xsize, ysize, stride, color_channels, bits_per_sample, format,
+        pool, &color, keep_alpha ? &alpha : nullptr));
+  } else {
+    for (size_t c = 0; c < color_channels; ++c) {
+      JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
+          data, xsize, ysize, stride, bits_per_sample, format, c, pool,
+          &color.Plane(c)));
+    }
+    if (keep_alpha) {
+      JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
+          data, xsize, ysize, stride, bits_per_sample, format,
+          format.num_channels - 1, pool, &alpha));
+    }
   }
   if (color_channels == 1) {
     JXL_RETURN_IF_ERROR(CopyImageTo(color.Plane(0), &color.Plane(1)));
@@ -119,14 +335,7 @@ Status ConvertFromExternalNoSizeCheck(const uint8_t* data, size_t xsize,
   }
   JXL_RETURN_IF_ERROR(ib->SetFromImage(std::move(color), c_current));
 
-  // Passing an interleaved image with an alpha channel to an image that doesn't
-  // have alpha channel just discards the passed alpha channel.
-  if (has_alpha && ib->HasAlpha()) {
-    JXL_ASSIGN_OR_RETURN(ImageF alpha,
-                         ImageF::Create(memory_manager, xsize, ysize));
-    JXL_RETURN_IF_ERROR(ConvertFromExternalNoSizeCheck(
-        data, xsize, ysize, stride, bits_per_sample, format,
-        format.num_channels - 1, pool, &alpha));
+  if (keep_alpha) {
     JXL_RETURN_IF_ERROR(ib->SetAlpha(std::move(alpha)));
   } else if (!has_alpha && ib->HasAlpha()) {
     // if alpha is not passed, but it is expected, then assume
@@ -144,26 +353,8 @@ Status ConvertFromExternal(const uint8_t* data, size_t size, size_t xsize,
                            size_t ysize, size_t bits_per_sample,
                            JxlPixelFormat format, size_t c, ThreadPool* pool,
                            ImageF* channel) {
-  size_t bytes_per_channel = JxlDataTypeBytes(format.data_type);
-  size_t bytes_per_pixel = format.num_channels * bytes_per_channel;
-  const size_t last_row_size = xsize * bytes_per_pixel;
-  const size_t align = format.align;
-  const size_t row_size =
-      (align > 1 ? jxl::DivCeil(last_row_size, align) * align : last_row_size);
-  const size_t bytes_to_read = row_size * (ysize - 1) + last_row_size;
-  if (xsize == 0 || ysize == 0) return JXL_FAILURE("Empty image");
-  if (size > 0 && size < bytes_to_read) {
-    return JXL_FAILURE("Buffer size is too small, expected: %" PRIuS
-                       " got: %" PRIuS " (Image: %" PRIuS "x%" PRIuS
-                       "x%u, bytes_per_channel: %" PRIuS ")",
-                       bytes_to_read, size, xsize, ysize, format.num_channels,
-                       bytes_per_channel);
-  }
-  // Too large buffer is likely an application bug, so also fail for that.
-  // Do allow padding to stride in last row though.
-  if (size > row_size * ysize) {
-    return JXL_FAILURE("Buffer size is too large");
-  }
+  size_t row_size;
+  JXL_RETURN_IF_ERROR(ExternalStride(size, xsize, ysize, format, &row_size));
   return ConvertFromExternalNoSizeCheck(
       data, xsize, ysize, row_size, bits_per_sample, format, c, pool, channel);
 }
@@ -172,46 +363,12 @@ Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
                            size_t color_channels, size_t bits_per_sample,
                            JxlPixelFormat format, ThreadPool* pool,
                            ImageBundle* ib) {
-  JxlMemoryManager* memory_manager = ib->memory_manager();
-  bool has_alpha = format.num_channels == 2 || format.num_channels == 4;
-  if (format.num_channels < color_channels) {
-    return JXL_FAILURE("Expected %" PRIuS
-                       " color channels, received only %u channels",
-                       color_channels, format.num_channels);
-  }
-
-  JXL_ASSIGN_OR_RETURN(Image3F color,
-                       Image3F::Create(memory_manager, xsize, ysize));
-  for (size_t c = 0; c < color_channels; ++c) {
-    JXL_RETURN_IF_ERROR(ConvertFromExternal(bytes.data(), bytes.size(), xsize,
-                                            ysize, bits_per_sample, format, c,
-                                            pool, &color.Plane(c)));
-  }
-  if (color_channels == 1) {
-    JXL_RETURN_IF_ERROR(CopyImageTo(color.Plane(0), &color.Plane(1)));
-    JXL_RETURN_IF_ERROR(CopyImageTo(color.Plane(0), &color.Plane(2)));
-  }
-  JXL_RETURN_IF_ERROR(ib->SetFromImage(std::move(color), c_current));
-
-  // Passing an interleaved image with an alpha channel to an image that doesn't
-  // have alpha channel just discards the passed alpha channel.
-  if (has_alpha && ib->HasAlpha()) {
-    JXL_ASSIGN_OR_RETURN(ImageF alpha,
-                         ImageF::Create(memory_manager, xsize, ysize));
-    JXL_RETURN_IF_ERROR(ConvertFromExternal(
-        bytes.data(), bytes.size(), xsize, ysize, bits_per_sample, format,
-        format.num_channels - 1, pool, &alpha));
-    JXL_RETURN_IF_ERROR(ib->SetAlpha(std::move(alpha)));
-  } else if (!has_alpha && ib->HasAlpha()) {
-    // if alpha is not passed, but it is expected, then assume
-    // it is all-opaque
-    JXL_ASSIGN_OR_RETURN(ImageF alpha,
-                         ImageF::Create(memory_manager, xsize, ysize));
-    FillImage(1.0f, &alpha);
-    JXL_RETURN_IF_ERROR(ib->SetAlpha(std::move(alpha)));
-  }
-
-  return true;
+  size_t row_size;
+  JXL_RETURN_IF_ERROR(
+      ExternalStride(bytes.size(), xsize, ysize, format, &row_size));
+  return ConvertFromExternalNoSizeCheck(bytes.data(), xsize, ysize, row_size,
+                                        c_current, color_channels,
+                                        bits_per_sample, format, pool, ib);
 }
 
 Status ConvertFromExternal(Span<const uint8_t> bytes, size_t xsize,
@@ -247,3 +404,4 @@ Status BufferToImageBundle(const JxlPixelFormat& pixel_format, uint32_t xsize,
 }
 
 }  // namespace jxl
+#endif  // HWY_ONCE
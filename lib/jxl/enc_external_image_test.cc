@@ -7,12 +7,17 @@
 
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
+#include "lib/jxl/alpha.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/dec_external_image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/test_memory_manager.h"
@@ -78,5 +83,94 @@ TEST(ExternalImageTest, AlphaPremultiplied) {
                                   ColorEncoding::SRGB(), &ib));
 }
 
+// The 8 and 16-bit conversions go through vectors of pixels followed by a
+// scalar tail, so the width is not a multiple of any vector size.
+TEST(ExternalImageTest, UintRoundTrip) {
+  const size_t xsize = 37;
+  const size_t ysize = 3;
+  Rng rng(123);
+  for (JxlDataType data_type : {JXL_TYPE_UINT8, JXL_TYPE_UINT16}) {
+    for (JxlEndianness endianness : {JXL_LITTLE_ENDIAN, JXL_BIG_ENDIAN}) {
+      for (uint32_t num_channels = 1; num_channels <= 4; ++num_channels) {
+        const size_t bits = data_type == JXL_TYPE_UINT8 ? 8 : 16;
+        const bool has_alpha = num_channels == 2 || num_channels == 4;
+        ImageMetadata im;
+        im.SetUintSamples(bits);
+        im.SetAlphaBits(has_alpha ? bits : 0);
+        ImageBundle ib(jxl::test::MemoryManager(), &im);
+        const size_t stride = xsize * num_channels * bits / 8;
+        std::vector<uint8_t> in(stride * ysize);
+        for (uint8_t& b : in) b = rng.UniformU(0, 256);
+        JxlPixelFormat format = {num_channels, data_type, endianness, 0};
+        ASSERT_TRUE(ConvertFromExternal(
+            Bytes(in), xsize, ysize,
+            /*c_current=*/ColorEncoding::SRGB(/*is_gray=*/num_channels < 3),
+            bits, format, nullptr, &ib));
+        std::vector<uint8_t> out(in.size());
+        ASSERT_TRUE(ConvertToExternal(ib, bits, /*float_out=*/false,
+                                      num_channels, endianness, stride,
+                                      nullptr, out.data(), out.size(),
+                                      /*out_callback=*/{},
+                                      Orientation::kIdentity));
+        EXPECT_EQ(in, out) << "bits " << bits << " channels " << num_channels
+                           << " endianness " << endianness;
+      }
+    }
+  }
+}
+
+// Premultiplied alpha is undone row by row during the conversion, after the
+// orientation is undone, also when alpha itself is not part of the output.
+TEST(ExternalImageTest, UnpremultiplyAlpha) {
+  const size_t xsize = 37;
+  const size_t ysize = 5;
+  Rng rng(123);
+  ImageMetadata im;
+  im.SetFloat32Samples();
+  im.SetAlphaBits(32, /*alpha_is_premultiplied=*/true);
+  ImageBundle ib(jxl::test::MemoryManager(), &im);
+  std::vector<float> in(xsize * ysize * 4);
+  for (size_t i = 0; i < in.size(); i += 4) {
+    const float alpha = rng.Bernoulli(0.2f) ? 0.0f : rng.UniformF(0.0f, 1.0f);
+    for (size_t c = 0; c < 3; ++c) in[i + c] = alpha * rng.UniformF(0, 1);
+    in[i + 3] = alpha;
+  }
+  JxlPixelFormat format = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  ASSERT_TRUE(ConvertFromExternal(
+      Bytes(reinterpret_cast<const uint8_t*>(in.data()),
+            in.size() * sizeof(float)),
+      xsize, ysize, ColorEncoding::SRGB(), 32, format, nullptr, &ib));
+  ASSERT_TRUE(ib.AlphaIsPremultiplied());
+  for (Orientation orientation :
+       {Orientation::kIdentity, Orientation::kRotate90}) {
+    const size_t out_xsize =
+        orientation == Orientation::kIdentity ? xsize : ysize;
+    std::vector<float> premul(in.size());
+    ASSERT_TRUE(ConvertToExternal(
+        ib, 32, /*float_out=*/true, 4, JXL_NATIVE_ENDIAN,
+        out_xsize * 4 * sizeof(float), nullptr, premul.data(),
+        premul.size() * sizeof(float), /*out_callback=*/{}, orientation,
+        /*unpremul_alpha=*/false));
+    for (size_t num_channels : {3, 4}) {
+      std::vector<float> out(xsize * ysize * num_channels);
+      ASSERT_TRUE(ConvertToExternal(
+          ib, 32, /*float_out=*/true, num_channels, JXL_NATIVE_ENDIAN,
+          out_xsize * num_channels * sizeof(float), nullptr, out.data(),
+          out.size() * sizeof(float), /*out_callback=*/{}, orientation,
+          /*unpremul_alpha=*/true));
+      for (size_t i = 0; i < xsize * ysize; ++i) {
+        const float alpha = premul[i * 4 + 3];
+        const float mul = 1.0f / std::max(kSmallAlpha, alpha);
+        for (size_t c = 0; c < 3; ++c) {
+          const float expected = premul[i * 4 + c] * mul;
+          EXPECT_NEAR(out[i * num_channels + c], expected,
+                      1e-6f * expected + 1e-7f);
+        }
+        if (num_channels == 4) EXPECT_EQ(out[i * 4 + 3], alpha);
+      }
+    }
+  }
+}
+
 }  // namespace
 }  // namespace jxl
@@ -10,6 +10,7 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -87,6 +88,16 @@ _mm512_cvtsi512_si32(__m512i __A) {
 #endif
 #endif  // !defined(FJXL_ENABLE_AVX512)
 
+#elif defined(__GNUC__) && !FJXL_ARCH_IS_X86  // ARCH
+
+// Other targets, such as RISC-V, use the vector extensions of the compiler.
+#if !defined(FJXL_ENABLE_VECTOR) && defined(__has_builtin)
+#if __has_builtin(__builtin_shufflevector) && \
+    __has_builtin(__builtin_convertvector)
+#define FJXL_ENABLE_VECTOR 1
+#endif
+#endif  // !defined(FJXL_ENABLE_VECTOR)
+
 #endif  // ARCH
 
 #ifndef FJXL_ENABLE_NEON
@@ -101,6 +112,10 @@ _mm512_cvtsi512_si32(__m512i __A) {
 #define FJXL_ENABLE_AVX512 0
 #endif
 
+#ifndef FJXL_ENABLE_VECTOR
+#define FJXL_ENABLE_VECTOR 0
+#endif
+
 namespace {
 
 enum class CpuFeature : uint32_t {
@@ -310,8 +325,6 @@ size_t SectionSize(const std::array<BitWriter, 4>& group_data) {
   return sz;
 }
 
-constexpr size_t kMaxFrameHeaderSize = 5;
-
 constexpr size_t kGroupSizeOffset[4] = {
     static_cast<size_t>(0),
     static_cast<size_t>(1024),
@@ -334,15 +347,122 @@ size_t TOCSize(const std::vector<size_t>& group_sizes) {
   }
   return (toc_bits + 7) / 8;
 }
+#endif
+
+// Writes the frame header of a width x height frame, up to the TOC.
+void WriteFrameHeader(const JxlFastLosslessFrameHeaderOptions& options,
+                      size_t width, size_t height, bool have_alpha,
+                      bool is_last, BitWriter* output) {
+  const int64_t x0 = options.x0;
+  const int64_t y0 = options.y0;
+  const int64_t image_width = options.image_width;
+  const int64_t image_height = options.image_height;
+  const bool custom_size_or_origin =
+      x0 != 0 || y0 != 0 || static_cast<int64_t>(width) != image_width ||
+      static_cast<int64_t>(height) != image_height;
+  const bool is_partial_frame =
+      x0 > 0 || y0 > 0 || x0 + static_cast<int64_t>(width) < image_width ||
+      y0 + static_cast<int64_t>(height) < image_height;
+  const uint32_t duration = options.have_animation ? options.duration : 0;
+  const uint32_t save_as_reference = is_last ? 0 : options.save_as_reference;
+  const bool can_be_referenced =
+      !is_last && (duration == 0 || save_as_reference != 0);
+  // U32(Bits(8), BitsOffset(11, 256), BitsOffset(14, 2304),
+  // BitsOffset(30, 18688)) of the frame position and size.
+  auto write_position = [output](uint32_t value) {
+    if (value < 256) {
+      output->Write(2, 0b00);
+      output->Write(8, value);
+    } else if (value < 2304) {
+      output->Write(2, 0b01);
+      output->Write(11, value - 256);
+    } else if (value < 18688) {
+      output->Write(2, 0b10);
+      output->Write(14, value - 2304);
+    } else {
+      output->Write(2, 0b11);
+      output->Write(30, value - 18688);
+    }
+  };
+  auto pack_signed = [](int32_t value) {
+    return (static_cast<uint32_t>(value) << 1) ^
+           static_cast<uint32_t>(value >> 31);
+  };
+
+  output->Write(1, 0);     // all_default
+  output->Write(2, 0b00);  // regular frame
+  output->Write(1, 1);     // modular
+  output->Write(2, 0b00);  // default flags
+  output->Write(1, 0);     // not YCbCr
+  output->Write(2, 0b00);  // no upsampling
+  if (have_alpha) {
+    output->Write(2, 0b00);  // no alpha upsampling
+  }
+  output->Write(2, 0b01);  // default group size
+  output->Write(2, 0b00);  // exactly one pass
+  output->Write(1, custom_size_or_origin);
+  if (custom_size_or_origin) {
+    write_position(pack_signed(options.x0));
+    write_position(pack_signed(options.y0));
+    write_position(width);
+    write_position(height);
+  }
+  output->Write(2, 0b00);  // kReplace blending mode
+  if (is_partial_frame) {
+    output->Write(2, options.source);
+  }
+  if (have_alpha) {
+    output->Write(2, 0b00);  // kReplace blending mode for alpha channel
+    if (is_partial_frame) {
+      output->Write(2, options.source);
+    }
+  }
+  if (options.have_animation) {
+    // U32(Val(0), Val(1), Bits(8), Bits(32))
+    if (duration <= 1) {
+      output->Write(2, duration);
+    } else if (duration < 256) {
+      output->Write(2, 0b10);
+      output->Write(8, duration);
+    } else {
+      output->Write(2, 0b11);
+      output->Write(32, duration);
+    }
+    if (options.have_timecodes) {
+      output->Write(32, options.timecode);
+    }
+  }
+  output->Write(1, is_last);  // is_last
+  if (!is_last) {
+    output->Write(2, save_as_reference);
+  }
+  if (can_be_referenced && !is_partial_frame) {
+    output->Write(1, 0);  // saved after the color transform
+  }
+  output->Write(2, 0b00);  // a frame has no name
+  output->Write(1, 0);     // loop filter is not all_default
+  output->Write(1, 0);     // no gaborish
+  output->Write(2, 0);     // 0 EPF iters
+  output->Write(2, 0b00);  // No LF extensions
+  output->Write(2, 0b00);  // No FH extensions
+
+  output->Write(1, 0);      // No TOC permutation
+  output->ZeroPadToByte();  // TOC is byte-aligned.
+}
 
-size_t FrameHeaderSize(bool have_alpha, bool is_last) {
-  size_t nbits = 28 + (have_alpha ? 4 : 0) + (is_last ? 0 : 2);
-  return (nbits + 7) / 8;
+size_t FrameHeaderSize(const JxlFastLosslessFrameHeaderOptions& options,
+                       size_t width, size_t height, bool have_alpha,
+                       bool is_last) {
+  BitWriter writer;
+  writer.Allocate(1000);
+  WriteFrameHeader(options, width, height, have_alpha, is_last, &writer);
+  return writer.bytes_written;
 }
-#endif
 
 void ComputeAcGroupDataOffset(size_t dc_global_size, size_t num_dc_groups,
-                              size_t num_ac_groups, size_t& min_dc_global_size,
+                              size_t num_ac_groups,
+                              size_t max_frame_header_size,
+                              size_t& min_dc_global_size,
                               size_t& ac_group_offset) {
   // Max AC group size is 768 kB, so max AC group TOC bits is 24.
   size_t ac_toc_max_bits = num_ac_groups * 24;
@@ -359,23 +479,27 @@ void ComputeAcGroupDataOffset(size_t dc_global_size, size_t num_dc_groups,
   size_t max_toc_bits =
       kTOCBits[dc_global_bucket] + 12 * (1 + num_dc_groups) + ac_toc_max_bits;
   size_t max_toc_size = (max_toc_bits + 7) / 8;
-  ac_group_offset = kMaxFrameHeaderSize + max_toc_size + min_dc_global_size;
+  ac_group_offset = max_frame_header_size + max_toc_size + min_dc_global_size;
 }
 
 #if !FJXL_STANDALONE
 size_t ComputeDcGlobalPadding(const std::vector<size_t>& group_sizes,
                               size_t ac_group_data_offset,
-                              size_t min_dc_global_size, bool have_alpha,
-                              bool is_last) {
+                              size_t min_dc_global_size,
+                              size_t frame_header_size) {
   std::vector<size_t> new_group_sizes = group_sizes;
   new_group_sizes[0] = min_dc_global_size;
   size_t toc_size = TOCSize(new_group_sizes);
-  size_t actual_offset =
-      FrameHeaderSize(have_alpha, is_last) + toc_size + group_sizes[0];
+  size_t actual_offset = frame_header_size + toc_size + group_sizes[0];
   return ac_group_data_offset - actual_offset;
 }
 #endif
 
+// Modular predictors that frames can use.
+constexpr uint8_t kPredictorWest = 1;
+constexpr uint8_t kPredictorNorth = 2;
+constexpr uint8_t kPredictorGradient = 5;
+
 constexpr size_t kNumRawSymbols = 19;
 constexpr size_t kNumLZ77 = 33;
 constexpr size_t kLZ77CacheSize = 32;
@@ -708,6 +832,9 @@ struct JxlFastLosslessFrameState {
   int big_endian;
   int effort;
   bool collided;
+  // Color transform and predictor of each channel, when not using a palette.
+  bool ycocg;
+  uint8_t predictors[4];
   PrefixCode hcode[4];
   std::vector<int16_t> lookup;
   BitWriter header;
@@ -720,8 +847,50 @@ struct JxlFastLosslessFrameState {
   size_t bits_in_buffer = 0;
   uint64_t bit_buffer = 0;
   bool process_done = false;
+  JxlFastLosslessFrameHeaderOptions header_options = {};
+};
+
+struct JxlFastLosslessCodes {
+  size_t nb_chans;
+  size_t bitdepth;
+  bool ycocg;
+  uint8_t predictors[4];
+  PrefixCode hcode[4];
 };
 
+JxlFastLosslessCodes* JxlFastLosslessCopyCodes(
+    const JxlFastLosslessFrameState* frame) {
+  if (!frame->collided) return nullptr;
+  JxlFastLosslessCodes* codes = new JxlFastLosslessCodes();
+  codes->nb_chans = frame->nb_chans;
+  codes->bitdepth = frame->bitdepth;
+  codes->ycocg = frame->ycocg;
+  std::copy(frame->predictors, frame->predictors + 4, codes->predictors);
+  std::copy(frame->hcode, frame->hcode + 4, codes->hcode);
+  return codes;
+}
+
+void JxlFastLosslessFreeCodes(JxlFastLosslessCodes* codes) { delete codes; }
+
+void JxlFastLosslessSetFrameHeaderOptions(
+    JxlFastLosslessFrameState* frame,
+    const JxlFastLosslessFrameHeaderOptions* options) {
+  assert(!frame->process_done);
+  frame->header_options = *options;
+  // In streaming mode, the AC groups are written after room for the largest
+  // frame header, which is the one of a frame that is not the last.
+  if (frame->group_sizes.size() > 1) {
+    bool have_alpha = (frame->nb_chans == 2 || frame->nb_chans == 4);
+    ComputeAcGroupDataOffset(
+        frame->group_sizes[0],
+        frame->num_dc_groups_x * frame->num_dc_groups_y,
+        frame->num_groups_x * frame->num_groups_y,
+        FrameHeaderSize(*options, frame->width, frame->height, have_alpha,
+                        /*is_last=*/false),
+        frame->min_dc_global_size, frame->ac_group_data_offset);
+  }
+}
+
 size_t JxlFastLosslessOutputSize(const JxlFastLosslessFrameState* frame) {
   size_t total_size_groups = 0;
   for (const auto& section : frame->group_data) {
@@ -822,37 +991,8 @@ void JxlFastLosslessPrepareHeader(JxlFastLosslessFrameState* frame,
 #else
   assert(!add_image_header);
 #endif
-  // Handcrafted frame header.
-  output->Write(1, 0);     // all_default
-  output->Write(2, 0b00);  // regular frame
-  output->Write(1, 1);     // modular
-  output->Write(2, 0b00);  // default flags
-  output->Write(1, 0);     // not YCbCr
-  output->Write(2, 0b00);  // no upsampling
-  if (have_alpha) {
-    output->Write(2, 0b00);  // no alpha upsampling
-  }
-  output->Write(2, 0b01);  // default group size
-  output->Write(2, 0b00);  // exactly one pass
-  output->Write(1, 0);     // no custom size or origin
-  output->Write(2, 0b00);  // kReplace blending mode
-  if (have_alpha) {
-    output->Write(2, 0b00);  // kReplace blending mode for alpha channel
-  }
-  output->Write(1, is_last);  // is_last
-  if (!is_last) {
-    output->Write(2, 0b00);  // can not be saved as reference
-  }
-  output->Write(2, 0b00);  // a frame has no name
-  output->Write(1, 0);     // loop filter is not all_default
-  output->Write(1, 0);     // no gaborish
-  output->Write(2, 0);     // 0 EPF iters
-  output->Write(2, 0b00);  // No LF extensions
-  output->Write(2, 0b00);  // No FH extensions
-
-  output->Write(1, 0);      // No TOC permutation
-  output->ZeroPadToByte();  // TOC is byte-aligned.
-  assert(add_image_header || output->bytes_written <= kMaxFrameHeaderSize);
+  WriteFrameHeader(frame->header_options, frame->width, frame->height,
+                   have_alpha, is_last, output);
   for (size_t group_size : frame->group_sizes) {
     size_t bucket = TOCBucket(group_size);
     output->Write(2, bucket);
@@ -2269,6 +2409,401 @@ struct Bits16 {
 
 #endif
 
+#ifdef FJXL_VECTOR
+#define FJXL_GENERIC_SIMD
+
+// 128-bit vectors of the GCC/Clang vector extensions, which the compiler
+// lowers to the vector instructions of the target, such as RVV, or splits
+// into scalar operations.
+template <typename T, size_t N>
+using VecN __attribute__((vector_size(sizeof(T) * N))) = T;
+
+using VecU64 = VecN<uint64_t, 2>;
+using VecU32 = VecN<uint32_t, 4>;
+using VecI32 = VecN<int32_t, 4>;
+using VecU16 = VecN<uint16_t, 8>;
+using VecI16 = VecN<int16_t, 8>;
+using VecU8 = VecN<uint8_t, 16>;
+
+template <typename V>
+FJXL_INLINE V LoadVec(const void* data) {
+  V v;
+  memcpy(&v, data, sizeof(v));
+  return v;
+}
+
+// Loads `bytes` bytes in `v`, which may be wider than the vectors of the
+// target, and clears the rest.
+template <size_t bytes, typename V>
+FJXL_INLINE void LoadWide(const void* data, V* v) {
+  memset(v, 0, sizeof(*v));
+  memcpy(v, data, bytes);
+}
+
+// Bit length of each lane of `v`, which must be below 2^24: the exponent of
+// the floats that represent the lanes exactly.
+template <size_t N>
+FJXL_INLINE VecN<uint32_t, N> BitLength(VecN<uint32_t, N> v) {
+  using VecF = VecN<float, N>;
+  using VecI = VecN<int32_t, N>;
+  VecF v_float = __builtin_convertvector(v, VecF);
+  VecI exponent = reinterpret_cast<VecI>(v_float) >> 23;
+  return reinterpret_cast<VecN<uint32_t, N>>((exponent - 126) &
+                                             (exponent != 0));
+}
+
+struct SIMDVec32;
+
+struct Mask32 {
+  VecU32 mask;
+  SIMDVec32 IfThenElse(const SIMDVec32& if_true, const SIMDVec32& if_false);
+  Mask32 And(const Mask32& oth) const { return Mask32{mask & oth.mask}; }
+  size_t CountPrefix() const {
+    size_t i = 0;
+    while (i < 4 && mask[i]) i++;
+    return i;
+  }
+};
+
+struct SIMDVec32 {
+  VecU32 vec;
+
+  static constexpr size_t kLanes = 4;
+
+  FJXL_INLINE static SIMDVec32 Load(const uint32_t* data) {
+    return SIMDVec32{LoadVec<VecU32>(data)};
+  }
+  FJXL_INLINE void Store(uint32_t* data) { memcpy(data, &vec, sizeof(vec)); }
+  FJXL_INLINE static SIMDVec32 Val(uint32_t v) {
+    return SIMDVec32{VecU32{v, v, v, v}};
+  }
+  FJXL_INLINE SIMDVec32 ValToToken() const {
+    // Lanes of 24 bits or more take the bit length of their top 24 bits.
+    VecU32 large = reinterpret_cast<VecU32>(vec >= (1u << 24));
+    VecU32 top_bits = (vec >> 8) & large;
+    VecU32 token = BitLength<4>((vec & ~large) | top_bits);
+    return SIMDVec32{token + (large & 8)};
+  }
+  FJXL_INLINE SIMDVec32 SatSubU(const SIMDVec32& to_subtract) const {
+    VecU32 gt = reinterpret_cast<VecU32>(vec > to_subtract.vec);
+    return SIMDVec32{(vec - to_subtract.vec) & gt};
+  }
+  FJXL_INLINE SIMDVec32 Sub(const SIMDVec32& to_subtract) const {
+    return SIMDVec32{vec - to_subtract.vec};
+  }
+  FJXL_INLINE SIMDVec32 Add(const SIMDVec32& oth) const {
+    return SIMDVec32{vec + oth.vec};
+  }
+  FJXL_INLINE SIMDVec32 Xor(const SIMDVec32& oth) const {
+    return SIMDVec32{vec ^ oth.vec};
+  }
+  FJXL_INLINE SIMDVec32 Pow2() const {
+    VecU32 in_range = reinterpret_cast<VecU32>(vec < 32);
+    return SIMDVec32{(Val(1).vec << (vec & 31)) & in_range};
+  }
+  FJXL_INLINE Mask32 Eq(const SIMDVec32& oth) const {
+    return Mask32{reinterpret_cast<VecU32>(vec == oth.vec)};
+  }
+  FJXL_INLINE Mask32 Gt(const SIMDVec32& oth) const {
+    return Mask32{reinterpret_cast<VecU32>(reinterpret_cast<VecI32>(vec) >
+                                           reinterpret_cast<VecI32>(oth.vec))};
+  }
+  template <size_t i>
+  FJXL_INLINE SIMDVec32 SignedShiftRight() const {
+    return SIMDVec32{
+        reinterpret_cast<VecU32>(reinterpret_cast<VecI32>(vec) >> i)};
+  }
+};
+
+struct SIMDVec16;
+
+struct Mask16 {
+  VecU16 mask;
+  SIMDVec16 IfThenElse(const SIMDVec16& if_true, const SIMDVec16& if_false);
+  Mask16 And(const Mask16& oth) const { return Mask16{mask & oth.mask}; }
+  size_t CountPrefix() const {
+    size_t i = 0;
+    while (i < 8 && mask[i]) i++;
+    return i;
+  }
+};
+
+struct SIMDVec16 {
+  VecU16 vec;
+
+  static constexpr size_t kLanes = 8;
+
+  FJXL_INLINE static SIMDVec16 Load(const uint16_t* data) {
+    return SIMDVec16{LoadVec<VecU16>(data)};
+  }
+  FJXL_INLINE void Store(uint16_t* data) { memcpy(data, &vec, sizeof(vec)); }
+  FJXL_INLINE static SIMDVec16 Val(uint16_t v) {
+    return SIMDVec16{VecU16{v, v, v, v, v, v, v, v}};
+  }
+  FJXL_INLINE static SIMDVec16 FromTwo32(const SIMDVec32& lo,
+                                         const SIMDVec32& hi) {
+    using VecU16x4 = VecN<uint16_t, 4>;
+    VecU16x4 lo16 = __builtin_convertvector(lo.vec, VecU16x4);
+    VecU16x4 hi16 = __builtin_convertvector(hi.vec, VecU16x4);
+    return SIMDVec16{
+        __builtin_shufflevector(lo16, hi16, 0, 1, 2, 3, 4, 5, 6, 7)};
+  }
+
+  FJXL_INLINE SIMDVec16 ValToToken() const {
+    VecPair<SIMDVec32> upcast = Upcast();
+    return FromTwo32(SIMDVec32{BitLength<4>(upcast.low.vec)},
+                     SIMDVec32{BitLength<4>(upcast.hi.vec)});
+  }
+  FJXL_INLINE SIMDVec16 SatSubU(const SIMDVec16& to_subtract) const {
+    VecU16 gt = reinterpret_cast<VecU16>(vec > to_subtract.vec);
+    return SIMDVec16{static_cast<VecU16>(vec - to_subtract.vec) & gt};
+  }
+  FJXL_INLINE SIMDVec16 Sub(const SIMDVec16& to_subtract) const {
+    return SIMDVec16{static_cast<VecU16>(vec - to_subtract.vec)};
+  }
+  FJXL_INLINE SIMDVec16 Add(const SIMDVec16& oth) const {
+    return SIMDVec16{static_cast<VecU16>(vec + oth.vec)};
+  }
+  FJXL_INLINE SIMDVec16 Min(const SIMDVec16& oth) const {
+    VecU16 lt = reinterpret_cast<VecU16>(vec < oth.vec);
+    return SIMDVec16{(vec & lt) | (oth.vec & ~lt)};
+  }
+  FJXL_INLINE Mask16 Eq(const SIMDVec16& oth) const {
+    return Mask16{reinterpret_cast<VecU16>(vec == oth.vec)};
+  }
+  FJXL_INLINE Mask16 Gt(const SIMDVec16& oth) const {
+    return Mask16{reinterpret_cast<VecU16>(reinterpret_cast<VecI16>(vec) >
+                                           reinterpret_cast<VecI16>(oth.vec))};
+  }
+  FJXL_INLINE SIMDVec16 Pow2() const {
+    VecU16 in_range = reinterpret_cast<VecU16>(vec < 16);
+    return SIMDVec16{static_cast<VecU16>(Val(1).vec << (vec & 15)) & in_range};
+  }
+  FJXL_INLINE SIMDVec16 Or(const SIMDVec16& oth) const {
+    return SIMDVec16{vec | oth.vec};
+  }
+  FJXL_INLINE SIMDVec16 Xor(const SIMDVec16& oth) const {
+    return SIMDVec16{vec ^ oth.vec};
+  }
+  FJXL_INLINE SIMDVec16 And(const SIMDVec16& oth) const {
+    return SIMDVec16{vec & oth.vec};
+  }
+  FJXL_INLINE SIMDVec16 HAdd(const SIMDVec16& oth) const {
+    return SIMDVec16{
+        static_cast<VecU16>((vec & oth.vec) + ((vec ^ oth.vec) >> 1))};
+  }
+  FJXL_INLINE SIMDVec16 PrepareForU8Lookup() const {
+    return SIMDVec16{vec | Val(0xFF00).vec};
+  }
+  FJXL_INLINE SIMDVec16 U8Lookup(const uint8_t* table) const {
+    VecU8 indices = reinterpret_cast<VecU8>(vec);
+#ifdef __clang__
+    VecU8 v;
+    for (size_t i = 0; i < 16; i++) {
+      v[i] = indices[i] < 16 ? table[indices[i]] : 0;
+    }
+    return SIMDVec16{reinterpret_cast<VecU16>(v)};
+#else
+    // GCC only uses the low 4 bits of the indices, the lookups of the high
+    // bytes are cleared instead.
+    VecU8 v = __builtin_shuffle(LoadVec<VecU8>(table), indices);
+    return SIMDVec16{reinterpret_cast<VecU16>(v) & Val(0xFF).vec};
+#endif
+  }
+  FJXL_INLINE VecPair<SIMDVec16> Interleave(const SIMDVec16& low) const {
+    return {SIMDVec16{__builtin_shufflevector(low.vec, vec, 0, 8, 1, 9, 2, 10,
+                                              3, 11)},
+            SIMDVec16{__builtin_shufflevector(low.vec, vec, 4, 12, 5, 13, 6,
+                                              14, 7, 15)}};
+  }
+  FJXL_INLINE VecPair<SIMDVec32> Upcast() const {
+    return {SIMDVec32{__builtin_convertvector(
+                __builtin_shufflevector(vec, vec, 0, 1, 2, 3), VecU32)},
+            SIMDVec32{__builtin_convertvector(
+                __builtin_shufflevector(vec, vec, 4, 5, 6, 7), VecU32)}};
+  }
+  template <size_t i>
+  FJXL_INLINE SIMDVec16 SignedShiftRight() const {
+    return SIMDVec16{reinterpret_cast<VecU16>(
+        static_cast<VecI16>(reinterpret_cast<VecI16>(vec) >> i))};
+  }
+
+  // Lanes `c`, `c + N`, ... of the 8 * N interleaved samples in `v`.
+  template <size_t N, size_t c, typename V>
+  FJXL_INLINE static SIMDVec16 Deinterleave(const V& v) {
+    return SIMDVec16{__builtin_convertvector(
+        __builtin_shufflevector(v, v, c, c + N, c + 2 * N, c + 3 * N,
+                                c + 4 * N, c + 5 * N, c + 6 * N, c + 7 * N),
+        VecU16)};
+  }
+
+  static std::array<SIMDVec16, 1> LoadG8(const unsigned char* data) {
+    return {SIMDVec16{__builtin_convertvector(
+        LoadVec<VecN<uint8_t, 8>>(data), VecU16)}};
+  }
+  static std::array<SIMDVec16, 1> LoadG16(const unsigned char* data) {
+    return {Load((const uint16_t*)data)};
+  }
+
+  static std::array<SIMDVec16, 2> LoadGA8(const unsigned char* data) {
+    VecU8 v = LoadVec<VecU8>(data);
+    return {Deinterleave<2, 0>(v), Deinterleave<2, 1>(v)};
+  }
+  static std::array<SIMDVec16, 2> LoadGA16(const unsigned char* data) {
+    VecN<uint16_t, 16> v;
+    LoadWide<sizeof(v)>(data, &v);
+    return {Deinterleave<2, 0>(v), Deinterleave<2, 1>(v)};
+  }
+
+  static std::array<SIMDVec16, 3> LoadRGB8(const unsigned char* data) {
+    VecN<uint8_t, 32> v;
+    LoadWide<24>(data, &v);
+    return {Deinterleave<3, 0>(v), Deinterleave<3, 1>(v),
+            Deinterleave<3, 2>(v)};
+  }
+  static std::array<SIMDVec16, 3> LoadRGB16(const unsigned char* data) {
+    VecN<uint16_t, 32> v;
+    LoadWide<48>(data, &v);
+    return {Deinterleave<3, 0>(v), Deinterleave<3, 1>(v),
+            Deinterleave<3, 2>(v)};
+  }
+
+  static std::array<SIMDVec16, 4> LoadRGBA8(const unsigned char* data) {
+    VecN<uint8_t, 32> v;
+    LoadWide<sizeof(v)>(data, &v);
+    return {Deinterleave<4, 0>(v), Deinterleave<4, 1>(v),
+            Deinterleave<4, 2>(v), Deinterleave<4, 3>(v)};
+  }
+  static std::array<SIMDVec16, 4> LoadRGBA16(const unsigned char* data) {
+    VecN<uint16_t, 32> v;
+    LoadWide<sizeof(v)>(data, &v);
+    return {Deinterleave<4, 0>(v), Deinterleave<4, 1>(v),
+            Deinterleave<4, 2>(v), Deinterleave<4, 3>(v)};
+  }
+
+  void SwapEndian() { vec = static_cast<VecU16>((vec >> 8) | (vec << 8)); }
+};
+
+SIMDVec16 Mask16::IfThenElse(const SIMDVec16& if_true,
+                             const SIMDVec16& if_false) {
+  return SIMDVec16{(if_true.vec & mask) | (if_false.vec & ~mask)};
+}
+
+SIMDVec32 Mask32::IfThenElse(const SIMDVec32& if_true,
+                             const SIMDVec32& if_false) {
+  return SIMDVec32{(if_true.vec & mask) | (if_false.vec & ~mask)};
+}
+
+struct Bits64 {
+  static constexpr size_t kLanes = 2;
+
+  VecU64 nbits;
+  VecU64 bits;
+
+  FJXL_INLINE void Store(uint64_t* nbits_out, uint64_t* bits_out) {
+    memcpy(nbits_out, &nbits, sizeof(nbits));
+    memcpy(bits_out, &bits, sizeof(bits));
+  }
+};
+
+struct Bits32 {
+  VecU32 nbits;
+  VecU32 bits;
+
+  static Bits32 FromRaw(SIMDVec32 nbits, SIMDVec32 bits) {
+    return Bits32{nbits.vec, bits.vec};
+  }
+
+  Bits64 Merge() const {
+    VecU64 nbits_lo =
+        __builtin_convertvector(__builtin_shufflevector(nbits, nbits, 0, 2),
+                                VecU64);
+    VecU64 nbits_hi =
+        __builtin_convertvector(__builtin_shufflevector(nbits, nbits, 1, 3),
+                                VecU64);
+    VecU64 bits_lo = __builtin_convertvector(
+        __builtin_shufflevector(bits, bits, 0, 2), VecU64);
+    VecU64 bits_hi = __builtin_convertvector(
+        __builtin_shufflevector(bits, bits, 1, 3), VecU64);
+    return Bits64{nbits_lo + nbits_hi, bits_lo | (bits_hi << nbits_lo)};
+  }
+
+  void Interleave(const Bits32& low) {
+    VecU32 in_range = reinterpret_cast<VecU32>(low.nbits < 32);
+    bits = ((bits << (low.nbits & 31)) & in_range) | low.bits;
+    nbits += low.nbits;
+  }
+
+  void ClipTo(size_t n) {
+    n = std::min<size_t>(n, 4);
+    constexpr uint32_t kMask[8] = {
+        ~0u, ~0u, ~0u, ~0u, 0, 0, 0, 0,
+    };
+    VecU32 mask = LoadVec<VecU32>(kMask + 4 - n);
+    nbits &= mask;
+    bits &= mask;
+  }
+  void Skip(size_t n) {
+    n = std::min<size_t>(n, 4);
+    constexpr uint32_t kMask[8] = {
+        0, 0, 0, 0, ~0u, ~0u, ~0u, ~0u,
+    };
+    VecU32 mask = LoadVec<VecU32>(kMask + 4 - n);
+    nbits &= mask;
+    bits &= mask;
+  }
+};
+
+struct Bits16 {
+  VecU16 nbits;
+  VecU16 bits;
+
+  static Bits16 FromRaw(SIMDVec16 nbits, SIMDVec16 bits) {
+    return Bits16{nbits.vec, bits.vec};
+  }
+
+  Bits32 Merge() const {
+    VecU32 nbits_lo = __builtin_convertvector(
+        __builtin_shufflevector(nbits, nbits, 0, 2, 4, 6), VecU32);
+    VecU32 nbits_hi = __builtin_convertvector(
+        __builtin_shufflevector(nbits, nbits, 1, 3, 5, 7), VecU32);
+    VecU32 bits_lo = __builtin_convertvector(
+        __builtin_shufflevector(bits, bits, 0, 2, 4, 6), VecU32);
+    VecU32 bits_hi = __builtin_convertvector(
+        __builtin_shufflevector(bits, bits, 1, 3, 5, 7), VecU32);
+    return Bits32{nbits_lo + nbits_hi, bits_lo | (bits_hi << nbits_lo)};
+  }
+
+  void Interleave(const Bits16& low) {
+    VecU16 in_range = reinterpret_cast<VecU16>(low.nbits < 16);
+    bits = (static_cast<VecU16>(bits << (low.nbits & 15)) & in_range) |
+           low.bits;
+    nbits += low.nbits;
+  }
+
+  void ClipTo(size_t n) {
+    n = std::min<size_t>(n, 8);
+    constexpr uint16_t kMask[16] = {
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+        0,      0,      0,      0,      0,      0,      0,      0,
+    };
+    VecU16 mask = LoadVec<VecU16>(kMask + 8 - n);
+    nbits &= mask;
+    bits &= mask;
+  }
+  void Skip(size_t n) {
+    n = std::min<size_t>(n, 8);
+    constexpr uint16_t kMask[16] = {
+        0,      0,      0,      0,      0,      0,      0,      0,
+        0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF,
+    };
+    VecU16 mask = LoadVec<VecU16>(kMask + 8 - n);
+    nbits &= mask;
+    bits &= mask;
+  }
+};
+#endif
+
 #ifdef FJXL_GENERIC_SIMD
 constexpr size_t SIMDVec32::kLanes;
 constexpr size_t SIMDVec16::kLanes;
@@ -2600,21 +3135,28 @@ using simd_t = typename detail::SIMDType<T>::type;
 template <typename T>
 size_t PredictPixels(const signed_t<T>* pixels, const signed_t<T>* pixels_left,
                      const signed_t<T>* pixels_top,
-                     const signed_t<T>* pixels_topleft,
+                     const signed_t<T>* pixels_topleft, uint8_t predictor,
                      unsigned_t<T>* residuals) {
   T px = T::Load((unsigned_t<T>*)pixels);
-  T left = T::Load((unsigned_t<T>*)pixels_left);
-  T top = T::Load((unsigned_t<T>*)pixels_top);
-  T topleft = T::Load((unsigned_t<T>*)pixels_topleft);
-  T ac = left.Sub(topleft);
-  T ab = left.Sub(top);
-  T bc = top.Sub(topleft);
-  T grad = ac.Add(top);
-  T d = ab.Xor(bc);
   T zero = T::Val(0);
-  T clamp = zero.Gt(d).IfThenElse(top, left);
-  T s = ac.Xor(bc);
-  T pred = zero.Gt(s).IfThenElse(grad, clamp);
+  T pred = zero;
+  if (predictor == kPredictorWest) {
+    pred = T::Load((unsigned_t<T>*)pixels_left);
+  } else if (predictor == kPredictorNorth) {
+    pred = T::Load((unsigned_t<T>*)pixels_top);
+  } else {
+    T left = T::Load((unsigned_t<T>*)pixels_left);
+    T top = T::Load((unsigned_t<T>*)pixels_top);
+    T topleft = T::Load((unsigned_t<T>*)pixels_topleft);
+    T ac = left.Sub(topleft);
+    T ab = left.Sub(top);
+    T bc = top.Sub(topleft);
+    T grad = ac.Add(top);
+    T d = ab.Xor(bc);
+    T clamp = zero.Gt(d).IfThenElse(top, left);
+    T s = ac.Xor(bc);
+    pred = zero.Gt(s).IfThenElse(grad, clamp);
+  }
   T res = px.Sub(pred);
   T res_times_2 = res.Add(res);
   res = zero.Gt(res).IfThenElse(T::Val(-1).Sub(res_times_2), res_times_2);
@@ -2634,7 +3176,7 @@ void EncodeHybridUint000(uint32_t value, uint32_t* token, uint32_t* nbits,
 
 #ifdef FJXL_AVX512
 constexpr static size_t kLogChunkSize = 5;
-#elif defined(FJXL_AVX2) || defined(FJXL_NEON)
+#elif defined(FJXL_AVX2) || defined(FJXL_NEON) || defined(FJXL_VECTOR)
 // Even if NEON only has 128-bit lanes, it is still significantly (~1.3x) faster
 // to process two vectors at a time.
 constexpr static size_t kLogChunkSize = 4;
@@ -2904,6 +3446,7 @@ constexpr uint8_t MoreThan14Bits::kMinRawLength[];
 constexpr uint8_t MoreThan14Bits::kMaxRawLength[];
 
 void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
+                           const uint8_t predictors[4],
                            const PrefixCode code[4], BitWriter* output) {
   output->Allocate(100000 + (is_single_group ? width * height * 16 : 0));
   // No patches, spline or noise.
@@ -2927,12 +3470,16 @@ void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
   // Huffman table + extra bits for the tree.
   uint8_t symbol_bits[6] = {0b00, 0b10, 0b001, 0b101, 0b0011, 0b0111};
   uint8_t symbol_nbits[6] = {2, 2, 3, 3, 4, 4};
-  // Write a tree with a leaf per channel, and gradient predictor for every
-  // leaf.
-  for (auto v : {1, 2, 1, 4, 1, 0, 0, 5, 0, 0, 0, 0, 5,
-                 0, 0, 0, 0, 5, 0, 0, 0, 0, 5, 0, 0, 0}) {
+  // Write a tree with a leaf per channel, from channel 3 to channel 0, each
+  // with the predictor of its channel.
+  for (auto v : {1, 2, 1, 4, 1, 0}) {
     output->Write(symbol_nbits[v], symbol_bits[v]);
   }
+  for (size_t i = 0; i < 4; i++) {
+    for (auto v : {0, static_cast<int>(predictors[3 - i]), 0, 0, 0}) {
+      output->Write(symbol_nbits[v], symbol_bits[v]);
+    }
+  }
 
   output->Write(1, 1);     // Enable lz77 for the main bitstream
   output->Write(2, 0b00);  // lz77 offset 224
@@ -2982,10 +3529,11 @@ void PrepareDCGlobalCommon(bool is_single_group, size_t width, size_t height,
 }
 
 void PrepareDCGlobal(bool is_single_group, size_t width, size_t height,
-                     size_t nb_chans, const PrefixCode code[4],
-                     BitWriter* output) {
-  PrepareDCGlobalCommon(is_single_group, width, height, code, output);
-  if (nb_chans > 2) {
+                     size_t nb_chans, bool ycocg, const uint8_t predictors[4],
+                     const PrefixCode code[4], BitWriter* output) {
+  PrepareDCGlobalCommon(is_single_group, width, height, predictors, code,
+                        output);
+  if (nb_chans > 2 && ycocg) {
     output->Write(2, 0b01);     // 1 transform
     output->Write(2, 0b00);     // RCT
     output->Write(5, 0b00000);  // Starting from ch 0
@@ -3088,9 +3636,9 @@ struct ChannelRowProcessor {
     constexpr size_t kNum =
         sizeof(pixel_t) == 2 ? SIMDVec16::kLanes : SIMDVec32::kLanes;
     for (size_t ix = 0; ix < kChunkSize; ix += kNum) {
-      size_t c =
-          PredictPixels<simd_t<pixel_t>>(row + ix, row_left + ix, row_top + ix,
-                                         row_topleft + ix, residuals + ix);
+      size_t c = PredictPixels<simd_t<pixel_t>>(
+          row + ix, row_left + ix, row_top + ix, row_topleft + ix, predictor,
+          residuals + ix);
       prefix_size =
           prefix_size == required_prefix_size ? prefix_size + c : prefix_size;
       required_prefix_size += kNum;
@@ -3101,15 +3649,22 @@ struct ChannelRowProcessor {
       pixel_t left = row_left[ix];
       pixel_t top = row_top[ix];
       pixel_t topleft = row_topleft[ix];
-      pixel_t ac = left - topleft;
-      pixel_t ab = left - top;
-      pixel_t bc = top - topleft;
-      pixel_t grad = static_cast<pixel_t>(static_cast<upixel_t>(ac) +
-                                          static_cast<upixel_t>(top));
-      pixel_t d = ab ^ bc;
-      pixel_t clamp = d < 0 ? top : left;
-      pixel_t s = ac ^ bc;
-      pixel_t pred = s < 0 ? grad : clamp;
+      pixel_t pred;
+      if (predictor == kPredictorWest) {
+        pred = left;
+      } else if (predictor == kPredictorNorth) {
+        pred = top;
+      } else {
+        pixel_t ac = left - topleft;
+        pixel_t ab = left - top;
+        pixel_t bc = top - topleft;
+        pixel_t grad = static_cast<pixel_t>(static_cast<upixel_t>(ac) +
+                                            static_cast<upixel_t>(top));
+        pixel_t d = ab ^ bc;
+        pixel_t clamp = d < 0 ? top : left;
+        pixel_t s = ac ^ bc;
+        pred = s < 0 ? grad : clamp;
+      }
       residuals[ix] = PackSigned(px - pred);
       prefix_size = prefix_size == required_prefix_size
                         ? prefix_size + (residuals[ix] == 0)
@@ -3143,6 +3698,7 @@ struct ChannelRowProcessor {
   void Finalize() { t->Finalize(run); }
   // Invariant: run == 0 or run > kLZ77MinLength.
   size_t run = 0;
+  uint8_t predictor = kPredictorGradient;
 };
 
 uint16_t LoadLE16(const unsigned char* ptr) {
@@ -3283,27 +3839,54 @@ void StoreYCoCg(SIMDVec16 r, SIMDVec16 g, SIMDVec16 b, int32_t* y, int32_t* co,
 }
 #endif
 
+// Stores the color channels converted to YCoCg, or as they are.
 template <typename pixel_t>
-void FillRowRGB8(const unsigned char* rgba, size_t oxs, pixel_t* y, pixel_t* co,
-                 pixel_t* cg) {
+void StoreColors(bool ycocg, pixel_t r, pixel_t g, pixel_t b, pixel_t* c0,
+                 pixel_t* c1, pixel_t* c2) {
+  if (ycocg) {
+    StoreYCoCg<pixel_t>(r, g, b, c0, c1, c2);
+  } else {
+    *c0 = r;
+    *c1 = g;
+    *c2 = b;
+  }
+}
+
+#ifdef FJXL_GENERIC_SIMD
+template <typename pixel_t>
+void StoreColors(bool ycocg, SIMDVec16 r, SIMDVec16 g, SIMDVec16 b,
+                 pixel_t* c0, pixel_t* c1, pixel_t* c2) {
+  if (ycocg) {
+    StoreYCoCg(r, g, b, c0, c1, c2);
+  } else {
+    StorePixels(r, c0);
+    StorePixels(g, c1);
+    StorePixels(b, c2);
+  }
+}
+#endif
+
+template <typename pixel_t>
+void FillRowRGB8(const unsigned char* rgba, size_t oxs, bool ycocg, pixel_t* y,
+                 pixel_t* co, pixel_t* cg) {
   size_t x = 0;
 #ifdef FJXL_GENERIC_SIMD
   for (; x + SIMDVec16::kLanes <= oxs; x += SIMDVec16::kLanes) {
     auto rgb = SIMDVec16::LoadRGB8(rgba + 3 * x);
-    StoreYCoCg(rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
+    StoreColors(ycocg, rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
   }
 #endif
   for (; x < oxs; x++) {
     uint16_t r = rgba[3 * x];
     uint16_t g = rgba[3 * x + 1];
     uint16_t b = rgba[3 * x + 2];
-    StoreYCoCg<pixel_t>(r, g, b, y + x, co + x, cg + x);
+    StoreColors<pixel_t>(ycocg, r, g, b, y + x, co + x, cg + x);
   }
 }
 
 template <bool big_endian, typename pixel_t>
-void FillRowRGB16(const unsigned char* rgba, size_t oxs, pixel_t* y,
-                  pixel_t* co, pixel_t* cg) {
+void FillRowRGB16(const unsigned char* rgba, size_t oxs, bool ycocg,
+                  pixel_t* y, pixel_t* co, pixel_t* cg) {
   size_t x = 0;
 #ifdef FJXL_GENERIC_SIMD
   for (; x + SIMDVec16::kLanes <= oxs; x += SIMDVec16::kLanes) {
@@ -3313,7 +3896,7 @@ void FillRowRGB16(const unsigned char* rgba, size_t oxs, pixel_t* y,
       rgb[1].SwapEndian();
       rgb[2].SwapEndian();
     }
-    StoreYCoCg(rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
+    StoreColors(ycocg, rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
   }
 #endif
   for (; x < oxs; x++) {
@@ -3325,18 +3908,18 @@ void FillRowRGB16(const unsigned char* rgba, size_t oxs, pixel_t* y,
       g = SwapEndian(g);
       b = SwapEndian(b);
     }
-    StoreYCoCg<pixel_t>(r, g, b, y + x, co + x, cg + x);
+    StoreColors<pixel_t>(ycocg, r, g, b, y + x, co + x, cg + x);
   }
 }
 
 template <typename pixel_t>
-void FillRowRGBA8(const unsigned char* rgba, size_t oxs, pixel_t* y,
-                  pixel_t* co, pixel_t* cg, pixel_t* alpha) {
+void FillRowRGBA8(const unsigned char* rgba, size_t oxs, bool ycocg,
+                  pixel_t* y, pixel_t* co, pixel_t* cg, pixel_t* alpha) {
   size_t x = 0;
 #ifdef FJXL_GENERIC_SIMD
   for (; x + SIMDVec16::kLanes <= oxs; x += SIMDVec16::kLanes) {
     auto rgb = SIMDVec16::LoadRGBA8(rgba + 4 * x);
-    StoreYCoCg(rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
+    StoreColors(ycocg, rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
     StorePixels(rgb[3], alpha + x);
   }
 #endif
@@ -3345,14 +3928,14 @@ void FillRowRGBA8(const unsigned char* rgba, size_t oxs, pixel_t* y,
     uint16_t g = rgba[4 * x + 1];
     uint16_t b = rgba[4 * x + 2];
     uint16_t a = rgba[4 * x + 3];
-    StoreYCoCg<pixel_t>(r, g, b, y + x, co + x, cg + x);
+    StoreColors<pixel_t>(ycocg, r, g, b, y + x, co + x, cg + x);
     alpha[x] = a;
   }
 }
 
 template <bool big_endian, typename pixel_t>
-void FillRowRGBA16(const unsigned char* rgba, size_t oxs, pixel_t* y,
-                   pixel_t* co, pixel_t* cg, pixel_t* alpha) {
+void FillRowRGBA16(const unsigned char* rgba, size_t oxs, bool ycocg,
+                   pixel_t* y, pixel_t* co, pixel_t* cg, pixel_t* alpha) {
   size_t x = 0;
 #ifdef FJXL_GENERIC_SIMD
   for (; x + SIMDVec16::kLanes <= oxs; x += SIMDVec16::kLanes) {
@@ -3363,7 +3946,7 @@ void FillRowRGBA16(const unsigned char* rgba, size_t oxs, pixel_t* y,
       rgb[2].SwapEndian();
       rgb[3].SwapEndian();
     }
-    StoreYCoCg(rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
+    StoreColors(ycocg, rgb[0], rgb[1], rgb[2], y + x, co + x, cg + x);
     StorePixels(rgb[3], alpha + x);
   }
 #endif
@@ -3378,7 +3961,7 @@ void FillRowRGBA16(const unsigned char* rgba, size_t oxs, pixel_t* y,
       b = SwapEndian(b);
       a = SwapEndian(a);
     }
-    StoreYCoCg<pixel_t>(r, g, b, y + x, co + x, cg + x);
+    StoreColors<pixel_t>(ycocg, r, g, b, y + x, co + x, cg + x);
     alpha[x] = a;
   }
 }
@@ -3387,7 +3970,7 @@ template <typename Processor, typename BitDepth>
 void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
                       size_t xs, size_t yskip, size_t ys, size_t row_stride,
                       BitDepth bitdepth, size_t nb_chans, bool big_endian,
-                      Processor* processors) {
+                      bool ycocg, Processor* processors) {
   constexpr size_t kPadding = 32;
 
   using pixel_t = typename BitDepth::pixel_t;
@@ -3419,7 +4002,7 @@ void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
       prow[i] = align(&group_data[i][(y - 1) & 1][kPadding]);
     }
 
-    // Pre-fill rows with YCoCg converted pixels.
+    // Pre-fill rows with the pixels, converted to YCoCg if requested.
     if (nb_chans == 1) {
       if (BitDepth::kInputBytes == 1) {
         FillRowG8(rgba_row, xs, crow[0]);
@@ -3438,23 +4021,24 @@ void ProcessImageArea(const unsigned char* rgba, size_t x0, size_t y0,
       }
     } else if (nb_chans == 3) {
       if (BitDepth::kInputBytes == 1) {
-        FillRowRGB8(rgba_row, xs, crow[0], crow[1], crow[2]);
+        FillRowRGB8(rgba_row, xs, ycocg, crow[0], crow[1], crow[2]);
       } else if (big_endian) {
-        FillRowRGB16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
-                                          crow[2]);
+        FillRowRGB16</*big_endian=*/true>(rgba_row, xs, ycocg, crow[0],
+                                          crow[1], crow[2]);
       } else {
-        FillRowRGB16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
-                                           crow[2]);
+        FillRowRGB16</*big_endian=*/false>(rgba_row, xs, ycocg, crow[0],
+                                           crow[1], crow[2]);
       }
     } else {
       if (BitDepth::kInputBytes == 1) {
-        FillRowRGBA8(rgba_row, xs, crow[0], crow[1], crow[2], crow[3]);
+        FillRowRGBA8(rgba_row, xs, ycocg, crow[0], crow[1], crow[2],
+                     crow[3]);
       } else if (big_endian) {
-        FillRowRGBA16</*big_endian=*/true>(rgba_row, xs, crow[0], crow[1],
-                                           crow[2], crow[3]);
+        FillRowRGBA16</*big_endian=*/true>(rgba_row, xs, ycocg, crow[0],
+                                           crow[1], crow[2], crow[3]);
       } else {
-        FillRowRGBA16</*big_endian=*/false>(rgba_row, xs, crow[0], crow[1],
-                                            crow[2], crow[3]);
+        FillRowRGBA16</*big_endian=*/false>(rgba_row, xs, ycocg, crow[0],
+                                            crow[1], crow[2], crow[3]);
       }
     }
     // Deal with x == 0.
@@ -3483,6 +4067,7 @@ template <typename BitDepth>
 void WriteACSection(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
                     size_t ys, size_t row_stride, bool is_single_group,
                     BitDepth bitdepth, size_t nb_chans, bool big_endian,
+                    bool ycocg, const uint8_t predictors[4],
                     const PrefixCode code[4],
                     std::array<BitWriter, 4>& output) {
   for (size_t i = 0; i < nb_chans; i++) {
@@ -3502,13 +4087,14 @@ void WriteACSection(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
   ChannelRowProcessor<ChunkEncoder<BitDepth>, BitDepth> row_encoders[4];
   for (size_t c = 0; c < nb_chans; c++) {
     row_encoders[c].t = &encoders[c];
+    row_encoders[c].predictor = predictors[c];
     encoders[c].output = &output[c];
     encoders[c].code = &code[c];
     encoders[c].PrepareForSimd();
   }
   ProcessImageArea<ChannelRowProcessor<ChunkEncoder<BitDepth>, BitDepth>>(
       rgba, x0, y0, xs, 0, ys, row_stride, bitdepth, nb_chans, big_endian,
-      row_encoders);
+      ycocg, row_encoders);
 }
 
 constexpr int kHashExp = 16;
@@ -3609,7 +4195,8 @@ void CollectSamples(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
                     uint64_t raw_counts[4][kNumRawSymbols],
                     uint64_t lz77_counts[4][kNumLZ77], bool is_single_group,
                     bool palette, BitDepth bitdepth, size_t nb_chans,
-                    bool big_endian, const int16_t* lookup) {
+                    bool big_endian, bool ycocg, const uint8_t predictors[4],
+                    const int16_t* lookup) {
   if (palette) {
     ChunkSampleCollector<UpTo8Bits> sample_collectors[4];
     ChannelRowProcessor<ChunkSampleCollector<UpTo8Bits>, UpTo8Bits>
@@ -3629,13 +4216,14 @@ void CollectSamples(const unsigned char* rgba, size_t x0, size_t y0, size_t xs,
         row_sample_collectors[4];
     for (size_t c = 0; c < nb_chans; c++) {
       row_sample_collectors[c].t = &sample_collectors[c];
+      row_sample_collectors[c].predictor = predictors[c];
       sample_collectors[c].raw_counts = raw_counts[c];
       sample_collectors[c].lz77_counts = lz77_counts[c];
     }
     ProcessImageArea<
         ChannelRowProcessor<ChunkSampleCollector<BitDepth>, BitDepth>>(
         rgba, x0, y0, xs, 1, 1 + row_count, row_stride, bitdepth, nb_chans,
-        big_endian, row_sample_collectors);
+        big_endian, ycocg, row_sample_collectors);
   }
 }
 
@@ -3643,7 +4231,10 @@ void PrepareDCGlobalPalette(bool is_single_group, size_t width, size_t height,
                             size_t nb_chans, const PrefixCode code[4],
                             const std::vector<uint32_t>& palette,
                             size_t pcolors, BitWriter* output) {
-  PrepareDCGlobalCommon(is_single_group, width, height, code, output);
+  const uint8_t predictors[4] = {kPredictorGradient, kPredictorGradient,
+                                 kPredictorGradient, kPredictorGradient};
+  PrepareDCGlobalCommon(is_single_group, width, height, predictors, code,
+                        output);
   output->Write(2, 0b01);     // 1 transform
   output->Write(2, 0b01);     // Palette
   output->Write(5, 0b00000);  // Starting from ch 0
@@ -3743,20 +4334,49 @@ bool detect_palette(const unsigned char* r, size_t width,
   return collided;
 }
 
+// Estimates the number of bits needed to encode the sampled symbols of a
+// channel, extra bits of the raw symbols included.
+double EstimateSampleBits(const uint64_t raw_counts[kNumRawSymbols],
+                          const uint64_t lz77_counts[kNumLZ77]) {
+  uint64_t total = 0;
+  for (size_t i = 0; i < kNumRawSymbols; i++) total += raw_counts[i];
+  for (size_t i = 0; i < kNumLZ77; i++) total += lz77_counts[i];
+  if (total == 0) return 0;
+  double bits = 0;
+  for (size_t i = 0; i < kNumRawSymbols; i++) {
+    if (raw_counts[i] == 0) continue;
+    double extra_bits = i == 0 ? 0 : i - 1;
+    double symbol_bits = std::log2(static_cast<double>(total) / raw_counts[i]);
+    bits += raw_counts[i] * (symbol_bits + extra_bits);
+  }
+  for (size_t i = 0; i < kNumLZ77; i++) {
+    if (lz77_counts[i] == 0) continue;
+    bits += lz77_counts[i] *
+            std::log2(static_cast<double>(total) / lz77_counts[i]);
+  }
+  return bits;
+}
+
 template <typename BitDepth>
 JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
                                      size_t width, size_t height,
                                      BitDepth bitdepth, size_t nb_chans,
-                                     bool big_endian, int effort, int oneshot) {
+                                     bool big_endian, int effort, int oneshot,
+                                     const JxlFastLosslessCodes* codes) {
   assert(width != 0);
   assert(height != 0);
+  if (codes != nullptr &&
+      (codes->nb_chans != nb_chans || codes->bitdepth != bitdepth.bitdepth)) {
+    codes = nullptr;
+  }
 
   // Count colors to try palette
   std::vector<uint32_t> palette(kHashSize);
   std::vector<int16_t> lookup(kHashSize);
   lookup[0] = 0;
   int pcolors = 0;
-  bool collided = effort < 2 || bitdepth.bitdepth != 8 || !oneshot;
+  bool collided =
+      codes != nullptr || effort < 2 || bitdepth.bitdepth != 8 || !oneshot;
   for (size_t y0 = 0; y0 < height && !collided; y0 += 256) {
     size_t ys = std::min<size_t>(height - y0, 256);
     for (size_t x0 = 0; x0 < width && !collided; x0 += 256) {
@@ -3841,7 +4461,14 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
 
   bool onegroup = num_groups_x == 1 && num_groups_y == 1;
 
-  auto sample_rows = [&](size_t xg, size_t yg, size_t num_rows) {
+  bool ycocg = true;
+  uint8_t predictors[4] = {kPredictorGradient, kPredictorGradient,
+                           kPredictorGradient, kPredictorGradient};
+
+  auto sample_rows = [&](size_t xg, size_t yg, size_t num_rows, bool ycocg,
+                         const uint8_t predictors[4],
+                         uint64_t raw_counts[4][kNumRawSymbols],
+                         uint64_t lz77_counts[4][kNumLZ77]) {
     size_t y0 = yg * 256;
     size_t x0 = xg * 256;
     size_t ys = std::min<size_t>(height - y0, 256);
@@ -3858,27 +4485,86 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
     int x_max = xs / kChunkSize * kChunkSize;
     CollectSamples(rgba, 0, y_begin_group, x_max, stride, y_count, raw_counts,
                    lz77_counts, onegroup, !collided, bitdepth, nb_chans,
-                   big_endian, lookup.data());
+                   big_endian, ycocg, predictors, lookup.data());
     input.release_buffer(input.opaque, buffer);
   };
 
-  // TODO(veluca): that `64` is an arbitrary constant, meant to correspond to
-  // the point where the number of processed rows is large enough that loading
-  // the entire image is cost-effective.
-  if (oneshot || effort >= 64) {
-    for (size_t g = 0; g < num_groups_y * num_groups_x; g++) {
-      size_t xg = g % num_groups_x;
-      size_t yg = g / num_groups_x;
-      size_t y0 = yg * 256;
-      size_t ys = std::min<size_t>(height - y0, 256);
-      size_t num_rows = 2 * effort * ys / 256;
-      sample_rows(xg, yg, num_rows);
+  auto sample_image = [&](bool ycocg, const uint8_t predictors[4],
+                          uint64_t raw_counts[4][kNumRawSymbols],
+                          uint64_t lz77_counts[4][kNumLZ77]) {
+    // TODO(veluca): that `64` is an arbitrary constant, meant to correspond to
+    // the point where the number of processed rows is large enough that
+    // loading the entire image is cost-effective.
+    if (oneshot || effort >= 64) {
+      for (size_t g = 0; g < num_groups_y * num_groups_x; g++) {
+        size_t xg = g % num_groups_x;
+        size_t yg = g / num_groups_x;
+        size_t y0 = yg * 256;
+        size_t ys = std::min<size_t>(height - y0, 256);
+        size_t num_rows = 2 * effort * ys / 256;
+        sample_rows(xg, yg, num_rows, ycocg, predictors, raw_counts,
+                    lz77_counts);
+      }
+    } else {
+      // sample the middle (effort * 2 * num_groups) rows of the center group
+      // (possibly all of them).
+      sample_rows((num_groups_x - 1) / 2, (num_groups_y - 1) / 2,
+                  2 * effort * num_groups_x * num_groups_y, ycocg, predictors,
+                  raw_counts, lz77_counts);
+    }
+  };
+
+  if (codes != nullptr) {
+    // The frame reuses the codes, and the transforms they were made for, no
+    // need for samples.
+    ycocg = codes->ycocg;
+    std::copy(codes->predictors, codes->predictors + 4, predictors);
+  } else if (collided && effort >= 3) {
+    // Sample the image with every predictor, with and without YCoCg, and keep
+    // the color transform that gives the smallest estimate with the best
+    // predictor of each channel.
+    constexpr uint8_t kPredictors[] = {kPredictorGradient, kPredictorWest,
+                                       kPredictorNorth};
+    constexpr size_t kNumPredictors = sizeof(kPredictors);
+    double best_bits = std::numeric_limits<double>::max();
+    for (bool try_ycocg : {true, false}) {
+      if (!try_ycocg && nb_chans <= 2) break;
+      uint64_t try_raw_counts[kNumPredictors][4][kNumRawSymbols] = {};
+      uint64_t try_lz77_counts[kNumPredictors][4][kNumLZ77] = {};
+      for (size_t p = 0; p < kNumPredictors; p++) {
+        const uint8_t try_predictors[4] = {kPredictors[p], kPredictors[p],
+                                           kPredictors[p], kPredictors[p]};
+        sample_image(try_ycocg, try_predictors, try_raw_counts[p],
+                     try_lz77_counts[p]);
+      }
+      double bits = 0;
+      size_t best_p[4] = {};
+      for (size_t c = 0; c < nb_chans; c++) {
+        double best_channel_bits = std::numeric_limits<double>::max();
+        for (size_t p = 0; p < kNumPredictors; p++) {
+          double channel_bits = EstimateSampleBits(try_raw_counts[p][c],
+                                                   try_lz77_counts[p][c]);
+          if (channel_bits < best_channel_bits) {
+            best_channel_bits = channel_bits;
+            best_p[c] = p;
+          }
+        }
+        bits += best_channel_bits;
+      }
+      if (bits >= best_bits) continue;
+      best_bits = bits;
+      ycocg = try_ycocg;
+      for (size_t c = 0; c < nb_chans; c++) {
+        predictors[c] = kPredictors[best_p[c]];
+        std::copy(try_raw_counts[best_p[c]][c],
+                  try_raw_counts[best_p[c]][c] + kNumRawSymbols,
+                  raw_counts[c]);
+        std::copy(try_lz77_counts[best_p[c]][c],
+                  try_lz77_counts[best_p[c]][c] + kNumLZ77, lz77_counts[c]);
+      }
     }
   } else {
-    // sample the middle (effort * 2 * num_groups) rows of the center group
-    // (possibly all of them).
-    sample_rows((num_groups_x - 1) / 2, (num_groups_y - 1) / 2,
-                2 * effort * num_groups_x * num_groups_y);
+    sample_image(ycocg, predictors, raw_counts, lz77_counts);
   }
 
   // TODO(veluca): can probably improve this and make it bitdepth-dependent.
@@ -3886,7 +4572,7 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
       3843, 852, 1270, 1214, 1014, 727, 481, 300, 159, 51,
       5,    1,   1,    1,    1,    1,   1,   1,   1};
 
-  bool doing_ycocg = nb_chans > 2 && collided;
+  bool doing_ycocg = nb_chans > 2 && collided && ycocg;
   bool large_palette = !collided || pcolors >= 256;
   for (size_t i = bitdepth.NumSymbols(doing_ycocg || large_palette);
        i < kNumRawSymbols; i++) {
@@ -3923,7 +4609,9 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
 
   JxlFastLosslessFrameState* frame_state = new JxlFastLosslessFrameState();
   for (size_t i = 0; i < 4; i++) {
-    frame_state->hcode[i] = PrefixCode(bitdepth, raw_counts[i], lz77_counts[i]);
+    frame_state->hcode[i] =
+        codes != nullptr ? codes->hcode[i]
+                         : PrefixCode(bitdepth, raw_counts[i], lz77_counts[i]);
   }
 
   size_t num_dc_groups = num_dc_groups_x * num_dc_groups_y;
@@ -3941,13 +4629,17 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
   frame_state->big_endian = big_endian;
   frame_state->effort = effort;
   frame_state->collided = collided;
+  frame_state->ycocg = ycocg;
+  std::copy(predictors, predictors + 4, frame_state->predictors);
   frame_state->lookup = lookup;
+  frame_state->header_options.image_width = width;
+  frame_state->header_options.image_height = height;
 
   frame_state->group_data = std::vector<std::array<BitWriter, 4>>(num_groups);
   frame_state->group_sizes.resize(num_groups);
   if (collided) {
-    PrepareDCGlobal(onegroup, width, height, nb_chans, frame_state->hcode,
-                    &frame_state->group_data[0][0]);
+    PrepareDCGlobal(onegroup, width, height, nb_chans, ycocg, predictors,
+                    frame_state->hcode, &frame_state->group_data[0][0]);
   } else {
     PrepareDCGlobalPalette(onegroup, width, height, nb_chans,
                            frame_state->hcode, palette, pcolors,
@@ -3955,9 +4647,12 @@ JxlFastLosslessFrameState* LLPrepare(JxlChunkedFrameInputSource input,
   }
   frame_state->group_sizes[0] = SectionSize(frame_state->group_data[0]);
   if (!onegroup) {
-    ComputeAcGroupDataOffset(frame_state->group_sizes[0], num_dc_groups,
-                             num_ac_groups, frame_state->min_dc_global_size,
-                             frame_state->ac_group_data_offset);
+    bool have_alpha = (nb_chans == 2 || nb_chans == 4);
+    ComputeAcGroupDataOffset(
+        frame_state->group_sizes[0], num_dc_groups, num_ac_groups,
+        FrameHeaderSize(frame_state->header_options, width, height, have_alpha,
+                        /*is_last=*/false),
+        frame_state->min_dc_global_size, frame_state->ac_group_data_offset);
   }
 
   return frame_state;
@@ -4024,6 +4719,7 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
       if (frame_state->collided) {
         WriteACSection(rgba, 0, 0, xs, ys, stride, onegroup, bitdepth,
                        frame_state->nb_chans, frame_state->big_endian,
+                       frame_state->ycocg, frame_state->predictors,
                        frame_state->hcode, gd);
       } else {
         WriteACSectionPalette(rgba, 0, 0, xs, ys, stride, onegroup,
@@ -4056,7 +4752,9 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
     bool have_alpha = frame_state->nb_chans == 2 || frame_state->nb_chans == 4;
     size_t padding = ComputeDcGlobalPadding(
         frame_state->group_sizes, frame_state->ac_group_data_offset,
-        frame_state->min_dc_global_size, have_alpha, is_last);
+        frame_state->min_dc_global_size,
+        FrameHeaderSize(frame_state->header_options, frame_state->width,
+                        frame_state->height, have_alpha, is_last));
 
     for (size_t i = 0; i < padding; ++i) {
       frame_state->group_data[0][0].Write(8, 0);
@@ -4083,25 +4781,25 @@ jxl::Status LLProcess(JxlFastLosslessFrameState* frame_state, bool is_last,
 
 JxlFastLosslessFrameState* JxlFastLosslessPrepareImpl(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
-    size_t nb_chans, size_t bitdepth, bool big_endian, int effort,
-    int oneshot) {
+    size_t nb_chans, size_t bitdepth, bool big_endian, int effort, int oneshot,
+    const JxlFastLosslessCodes* codes) {
   assert(bitdepth > 0);
   assert(nb_chans <= 4);
   assert(nb_chans != 0);
   if (bitdepth <= 8) {
     return LLPrepare(input, width, height, UpTo8Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     big_endian, effort, oneshot, codes);
   }
   if (bitdepth <= 13) {
     return LLPrepare(input, width, height, From9To13Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     big_endian, effort, oneshot, codes);
   }
   if (bitdepth == 14) {
     return LLPrepare(input, width, height, Exactly14Bits(bitdepth), nb_chans,
-                     big_endian, effort, oneshot);
+                     big_endian, effort, oneshot, codes);
   }
   return LLPrepare(input, width, height, MoreThan14Bits(bitdepth), nb_chans,
-                   big_endian, effort, oneshot);
+                   big_endian, effort, oneshot, codes);
 }
 
 jxl::Status JxlFastLosslessProcessFrameImpl(
@@ -4134,7 +4832,8 @@ jxl::Status JxlFastLosslessProcessFrameImpl(
 
 #define FJXL_SELF_INCLUDE
 
-// If we have NEON enabled, it is the default target.
+// If we have NEON or the vector extensions enabled, they are the default
+// target.
 #if FJXL_ENABLE_NEON
 
 namespace default_implementation {
@@ -4143,6 +4842,24 @@ namespace default_implementation {
 #undef FJXL_NEON
 }  // namespace default_implementation
 
+#elif FJXL_ENABLE_VECTOR
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+// Vector arguments give spurious ABI notes on targets without vector ISA.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+namespace default_implementation {
+#define FJXL_VECTOR
+#include "lib/jxl/enc_fast_lossless.cc"  // NOLINT
+#undef FJXL_VECTOR
+}  // namespace default_implementation
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
 #else                                    // FJXL_ENABLE_NEON
 
 namespace default_implementation {
@@ -4263,25 +4980,37 @@ JxlFastLosslessFrameState* JxlFastLosslessPrepareFrame(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
     size_t nb_chans, size_t bitdepth, bool big_endian, int effort,
     int oneshot) {
+  return JxlFastLosslessPrepareFrameWithCodes(input, width, height, nb_chans,
+                                              bitdepth, big_endian, effort,
+                                              oneshot, /*codes=*/nullptr);
+}
+
+JxlFastLosslessFrameState* JxlFastLosslessPrepareFrameWithCodes(
+    JxlChunkedFrameInputSource input, size_t width, size_t height,
+    size_t nb_chans, size_t bitdepth, bool big_endian, int effort, int oneshot,
+    const JxlFastLosslessCodes* codes) {
 #if FJXL_ENABLE_AVX512
   if (HasCpuFeature(CpuFeature::kAVX512CD) &&
       HasCpuFeature(CpuFeature::kVBMI) &&
       HasCpuFeature(CpuFeature::kAVX512BW) &&
       HasCpuFeature(CpuFeature::kAVX512F) &&
       HasCpuFeature(CpuFeature::kAVX512VL)) {
-    return AVX512::JxlFastLosslessPrepareImpl(
-        input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
+    return AVX512::JxlFastLosslessPrepareImpl(input, width, height, nb_chans,
+                                              bitdepth, big_endian, effort,
+                                              oneshot, codes);
   }
 #endif
 #if FJXL_ENABLE_AVX2
   if (HasCpuFeature(CpuFeature::kAVX2)) {
-    return AVX2::JxlFastLosslessPrepareImpl(
-        input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
+    return AVX2::JxlFastLosslessPrepareImpl(input, width, height, nb_chans,
+                                            bitdepth, big_endian, effort,
+                                            oneshot, codes);
   }
 #endif
 
   return default_implementation::JxlFastLosslessPrepareImpl(
-      input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot);
+      input, width, height, nb_chans, bitdepth, big_endian, effort, oneshot,
+      codes);
 }
 
 bool JxlFastLosslessProcessFrame(
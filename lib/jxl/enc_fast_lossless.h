@@ -5,6 +5,7 @@
 
 #ifndef LIB_JXL_ENC_FAST_LOSSLESS_H_
 #define LIB_JXL_ENC_FAST_LOSSLESS_H_
+#include <stdint.h>
 #include <stdlib.h>
 
 // FJXL_STANDALONE=1 for a stand-alone jxl encoder
@@ -62,11 +63,60 @@ size_t JxlFastLosslessEncode(const unsigned char* rgba, size_t width,
 struct JxlFastLosslessFrameState;
 
 // Returned JxlFastLosslessFrameState must be freed by calling
-// JxlFastLosslessFreeFrameState.
+// JxlFastLosslessFreeFrameState. From effort 3, frames that do not use a
+// palette try the gradient, west and north predictors for each channel, with
+// and without YCoCg, on the sampled rows, and keep the cheapest combination.
 JxlFastLosslessFrameState* JxlFastLosslessPrepareFrame(
     JxlChunkedFrameInputSource input, size_t width, size_t height,
     size_t nb_chans, size_t bitdepth, bool big_endian, int effort, int oneshot);
 
+// Prefix codes of a prepared frame, with its color transform and predictors,
+// which later frames with the same number of channels and bit depth may reuse
+// instead of sampling their own, for instance when encoding the similar frames
+// of an animation.
+struct JxlFastLosslessCodes;
+
+// Same as JxlFastLosslessPrepareFrame, but if `codes` is not null and was
+// copied from a frame with the same number of channels and bit depth, the frame
+// uses these codes instead of sampling the image and looking for a palette.
+JxlFastLosslessFrameState* JxlFastLosslessPrepareFrameWithCodes(
+    JxlChunkedFrameInputSource input, size_t width, size_t height,
+    size_t nb_chans, size_t bitdepth, bool big_endian, int effort, int oneshot,
+    const JxlFastLosslessCodes* codes);
+
+// Returns a copy of the prefix codes of the frame, which must be freed by
+// calling JxlFastLosslessFreeCodes, or null if the frame uses a palette, whose
+// codes cannot be reused.
+JxlFastLosslessCodes* JxlFastLosslessCopyCodes(
+    const JxlFastLosslessFrameState* frame);
+
+void JxlFastLosslessFreeCodes(JxlFastLosslessCodes* codes);
+
+// Frame header fields of the frames of an animation, or of frames that do not
+// cover the whole image. The parts of the image that such a frame does not
+// cover are those of reference frame `source`.
+// (when FJXL_STANDALONE=1, have_animation has to be 0)
+struct JxlFastLosslessFrameHeaderOptions {
+  int have_animation;
+  int have_timecodes;
+  uint32_t duration;
+  uint32_t timecode;
+  // Size of the image, and position of the frame in it.
+  size_t image_width;
+  size_t image_height;
+  int32_t x0;
+  int32_t y0;
+  uint32_t source;
+  // Ignored for the last frame.
+  uint32_t save_as_reference;
+};
+
+// Sets the frame header fields of a prepared frame, which by default is a full
+// frame of a still image. Cannot be called after JxlFastLosslessProcessFrame.
+void JxlFastLosslessSetFrameHeaderOptions(
+    JxlFastLosslessFrameState* frame,
+    const JxlFastLosslessFrameHeaderOptions* options);
+
 #if !FJXL_STANDALONE
 class JxlEncoderOutputProcessorWrapper;
 #endif
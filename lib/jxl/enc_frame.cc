@@ -16,6 +16,8 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <limits>
 #include <memory>
 #include <numeric>
 #include <utility>
@@ -50,6 +52,7 @@
 #include "lib/jxl/enc_chroma_from_luma.h"
 #include "lib/jxl/enc_coeff_order.h"
 #include "lib/jxl/enc_context_map.h"
+#include "lib/jxl/enc_decode_cost.h"
 #include "lib/jxl/enc_entropy_coder.h"
 #include "lib/jxl/enc_external_image.h"
 #include "lib/jxl/enc_fields.h"
@@ -270,6 +273,14 @@ Status LoopFilterFromParams(const CompressParams& cparams, bool streaming_mode,
                             FrameHeader* JXL_RESTRICT frame_header) {
   LoopFilter* loop_filter = &frame_header->loop_filter;
 
+  // Decoding speed tier 5 bounds the work of the decoder, so it leaves the
+  // loop filters out even when they were asked for.
+  if (cparams.decoding_speed_tier >= 5) {
+    loop_filter->gab = false;
+    loop_filter->epf_iters = 0;
+    return true;
+  }
+
   // Gaborish defaults to enabled in Hare or slower.
   loop_filter->gab = ApplyOverride(
       cparams.gaborish, cparams.speed_tier <= SpeedTier::kHare &&
@@ -313,6 +324,32 @@ Status LoopFilterFromParams(const CompressParams& cparams, bool streaming_mode,
   return true;
 }
 
+// Drops passes of EPF, then Gaborish, from a VarDCT frame until its estimated
+// decoding time fits cparams.decoding_budget, keeping the loop filters that
+// were set explicitly. The modular streams of VarDCT frames are small, so they
+// are left out of the estimate.
+void FitLoopFilterToDecodingBudget(const CompressParams& cparams,
+                                   FrameHeader* JXL_RESTRICT frame_header) {
+  if (cparams.decoding_budget <= 0.0f ||
+      frame_header->encoding != FrameEncoding::kVarDCT) {
+    return;
+  }
+  const FrameDimensions frame_dim = frame_header->ToFrameDimensions();
+  const float budget_ns = cparams.decoding_budget * frame_dim.xsize_upsampled *
+                          frame_dim.ysize_upsampled;
+  LoopFilter* loop_filter = &frame_header->loop_filter;
+  while (EstimateFrameDecodeNs(*frame_header, /*patch_pixels=*/0) >
+         budget_ns) {
+    if (cparams.epf == -1 && loop_filter->epf_iters > 0) {
+      loop_filter->epf_iters--;
+    } else if (cparams.gaborish == Override::kDefault && loop_filter->gab) {
+      loop_filter->gab = false;
+    } else {
+      break;
+    }
+  }
+}
+
 Status MakeFrameHeader(size_t xsize, size_t ysize,
                        const CompressParams& cparams,
                        const ProgressiveSplitter& progressive_splitter,
@@ -479,6 +516,8 @@ Status MakeFrameHeader(size_t xsize, size_t ysize,
     frame_header->UpdateFlag(true, FrameHeader::kSkipAdaptiveDCSmoothing);
   }
 
+  FitLoopFilterToDecodingBudget(cparams, frame_header);
+
   return true;
 }
 
@@ -492,24 +531,37 @@ Status MakeFrameHeader(size_t xsize, size_t ysize,
 // edge duplication but not more. It would probably be better to smear in all
 // directions. That requires an alpha-weighed convolution with a large enough
 // kernel though, which might be overkill...
+// Planes only depend on themselves and alpha, so rows are visited once for all
+// planes and rows without invisible pixels are skipped.
 void SimplifyInvisible(Image3F* image, const ImageF& alpha, bool lossless) {
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t y = 0; y < image->ysize(); ++y) {
+  for (size_t y = 0; y < image->ysize(); ++y) {
+    const float* JXL_RESTRICT a = alpha.Row(y);
+    // Counted without early exit, so that the loop vectorizes.
+    size_t num_invisible = 0;
+    for (size_t x = 0; x < image->xsize(); ++x) {
+      num_invisible += (a[x] == 0.f) ? 1 : 0;
+    }
+    if (num_invisible == 0) continue;
+    if (lossless) {
+      for (size_t c = 0; c < 3; ++c) {
+        float* JXL_RESTRICT row = image->PlaneRow(c, y);
+        for (size_t x = 0; x < image->xsize(); ++x) {
+          row[x] = (a[x] == 0.f) ? 0.f : row[x];
+        }
+      }
+      continue;
+    }
+    for (size_t c = 0; c < 3; ++c) {
       float* JXL_RESTRICT row = image->PlaneRow(c, y);
       const float* JXL_RESTRICT prow =
           (y > 0 ? image->PlaneRow(c, y - 1) : nullptr);
       const float* JXL_RESTRICT nrow =
           (y + 1 < image->ysize() ? image->PlaneRow(c, y + 1) : nullptr);
-      const float* JXL_RESTRICT a = alpha.Row(y);
       const float* JXL_RESTRICT pa = (y > 0 ? alpha.Row(y - 1) : nullptr);
       const float* JXL_RESTRICT na =
           (y + 1 < image->ysize() ? alpha.Row(y + 1) : nullptr);
       for (size_t x = 0; x < image->xsize(); ++x) {
         if (a[x] == 0) {
-          if (lossless) {
-            row[x] = 0;
-            continue;
-          }
           float d = 0.f;
           row[x] = 0;
           if (x > 0) {
@@ -657,6 +709,52 @@ void ComputeChromacityAdjustments(const CompressParams& cparams,
   frame_header->b_qm_scale = 2 + pixel_stats.HowMuchIsBChannelPixelized();
 }
 
+// Scale of the estimated noise at the distance of the encode.
+float NoiseQualityCoef(const CompressParams& cparams) {
+  // Don't start at zero amplitude since adding noise is expensive -- it
+  // significantly slows down decoding, and this is unlikely to
+  // completely go away even with advanced optimizations. After the
+  // kNoiseModelingRampUpDistanceRange we have reached the full level,
+  // i.e. noise is no longer represented by the compressed image, so we
+  // can add full noise by the noise modeling itself.
+  static const float kNoiseModelingRampUpDistanceRange = 0.6;
+  static const float kNoiseLevelAtStartOfRampUp = 0.25;
+  static const float kNoiseRampupStart = 1.0;
+  // TODO(user) test and properly select quality_coef with smooth
+  // filter
+  float quality_coef = 1.0f;
+  const float rampup = (cparams.butteraugli_distance - kNoiseRampupStart) /
+                       kNoiseModelingRampUpDistanceRange;
+  if (rampup < 1.0f) {
+    quality_coef = kNoiseLevelAtStartOfRampUp +
+                   (1.0f - kNoiseLevelAtStartOfRampUp) * rampup;
+  }
+  if (rampup < 0.0f) {
+    quality_coef = kNoiseRampupStart;
+  }
+  return quality_coef;
+}
+
+// Whether the noise of the frame is estimated from the image, rather than
+// given by the parameters.
+bool EstimatesNoise(const CompressParams& cparams,
+                    const FrameHeader& frame_header, bool color_is_jpeg) {
+  return cparams.photon_noise_iso <= 0 &&
+         cparams.manual_noise.size() != NoiseParams::kNumNoisePoints &&
+         frame_header.encoding == FrameEncoding::kVarDCT &&
+         (frame_header.flags & FrameHeader::kNoise) && !color_is_jpeg;
+}
+
+// Streaming encoding estimates the noise of the frame from crops of at most
+// this size, from at most kMaxStreamingNoiseSamples DC groups spread over the
+// frame, for the noise parameters that LfGlobal needs before the first DC
+// group is encoded. Only the statistics of their patches are kept, at most
+// 768 KiB.
+constexpr size_t kStreamingNoiseSampleDim = 512;
+constexpr size_t kMaxStreamingNoiseSamples = 16;
+
+// In streaming mode, estimated noise parameters are computed beforehand by
+// EncodeFrameStreaming, from samples of the frame.
 void ComputeNoiseParams(const CompressParams& cparams, bool streaming_mode,
                         bool color_is_jpeg, const Image3F& opsin,
                         const FrameDimensions& frame_dim,
@@ -668,31 +766,9 @@ void ComputeNoiseParams(const CompressParams& cparams, bool streaming_mode,
     for (size_t i = 0; i < NoiseParams::kNumNoisePoints; i++) {
       noise_params->lut[i] = cparams.manual_noise[i];
     }
-  } else if (frame_header->encoding == FrameEncoding::kVarDCT &&
-             frame_header->flags & FrameHeader::kNoise && !color_is_jpeg &&
+  } else if (EstimatesNoise(cparams, *frame_header, color_is_jpeg) &&
              !streaming_mode) {
-    // Don't start at zero amplitude since adding noise is expensive -- it
-    // significantly slows down decoding, and this is unlikely to
-    // completely go away even with advanced optimizations. After the
-    // kNoiseModelingRampUpDistanceRange we have reached the full level,
-    // i.e. noise is no longer represented by the compressed image, so we
-    // can add full noise by the noise modeling itself.
-    static const float kNoiseModelingRampUpDistanceRange = 0.6;
-    static const float kNoiseLevelAtStartOfRampUp = 0.25;
-    static const float kNoiseRampupStart = 1.0;
-    // TODO(user) test and properly select quality_coef with smooth
-    // filter
-    float quality_coef = 1.0f;
-    const float rampup = (cparams.butteraugli_distance - kNoiseRampupStart) /
-                         kNoiseModelingRampUpDistanceRange;
-    if (rampup < 1.0f) {
-      quality_coef = kNoiseLevelAtStartOfRampUp +
-                     (1.0f - kNoiseLevelAtStartOfRampUp) * rampup;
-    }
-    if (rampup < 0.0f) {
-      quality_coef = kNoiseRampupStart;
-    }
-    if (!GetNoiseParameter(opsin, noise_params, quality_coef)) {
+    if (!GetNoiseParameter(opsin, noise_params, NoiseQualityCoef(cparams))) {
       frame_header->flags &= ~FrameHeader::kNoise;
     }
   }
@@ -700,7 +776,8 @@ void ComputeNoiseParams(const CompressParams& cparams, bool streaming_mode,
 
 Status DownsampleColorChannels(const CompressParams& cparams,
                                const FrameHeader& frame_header,
-                               bool color_is_jpeg, Image3F* opsin) {
+                               bool color_is_jpeg, Image3F* opsin,
+                               ThreadPool* pool) {
   if (color_is_jpeg || frame_header.upsampling == 1 ||
       cparams.already_downsampled) {
     return true;
@@ -711,12 +788,9 @@ Status DownsampleColorChannels(const CompressParams& cparams,
     // coefficients, if there is are custom upscaling coefficients in
     // CustomTransformData
     if (cparams.speed_tier <= SpeedTier::kSquirrel) {
-      // TODO(lode): DownsampleImage2_Iterative is currently too slow to
-      // be used for squirrel, make it faster, and / or enable it only for
-      // kitten.
-      JXL_RETURN_IF_ERROR(DownsampleImage2_Iterative(opsin));
+      JXL_RETURN_IF_ERROR(DownsampleImage2_Iterative(opsin, pool));
     } else {
-      JXL_RETURN_IF_ERROR(DownsampleImage2_Sharper(opsin));
+      JXL_RETURN_IF_ERROR(DownsampleImage2_Sharper(opsin, pool));
     }
   } else {
     JXL_ASSIGN_OR_RETURN(*opsin,
@@ -759,6 +833,8 @@ Status ComputeJPEGTranscodingData(const jpeg::JPEGData& jpeg_data,
   const size_t xsize_blocks = frame_dim.xsize_blocks;
   const size_t ysize_blocks = frame_dim.ysize_blocks;
 
+  enc_state->jpeg_transcoding = true;
+
   // no-op chroma from luma
   JXL_ASSIGN_OR_RETURN(shared.cmap, ColorCorrelationMap::Create(
                                         memory_manager, xsize, ysize, false));
@@ -1106,19 +1182,75 @@ Status ComputeVarDCTEncodingData(const FrameHeader& frame_header,
   return true;
 }
 
+// Fraction of the blocks of each order kind.
+std::vector<float> OrderFractions(const AcStrategyImage& ac_strategy) {
+  std::vector<float> fractions(kNumOrders);
+  size_t num_blocks = 0;
+  for (size_t by = 0; by < ac_strategy.ysize(); ++by) {
+    AcStrategyRow acs_row = ac_strategy.ConstRow(by);
+    for (size_t bx = 0; bx < ac_strategy.xsize(); ++bx) {
+      if (!acs_row[bx].IsFirstBlock()) continue;
+      fractions[kStrategyOrder[acs_row[bx].RawStrategy()]] += 1.0f;
+      num_blocks++;
+    }
+  }
+  for (float& fraction : fractions) fraction /= std::max<size_t>(num_blocks, 1);
+  return fractions;
+}
+
 Status ComputeAllCoeffOrders(PassesEncoderState& enc_state,
                              const FrameDimensions& frame_dim) {
   auto used_orders_info = ComputeUsedOrders(
       enc_state.cparams.speed_tier, enc_state.shared.ac_strategy,
       Rect(enc_state.shared.raw_quant_field));
-  enc_state.used_orders.resize(enc_state.progressive_splitter.GetNumPasses());
-  for (size_t i = 0; i < enc_state.progressive_splitter.GetNumPasses(); i++) {
+  const size_t num_passes = enc_state.progressive_splitter.GetNumPasses();
+  const size_t orders_size = num_passes * enc_state.shared.coeff_order_size;
+  enc_state.used_orders.resize(num_passes);
+  EntropyCodingCache* cache = enc_state.cparams.entropy_coding_cache.get();
+  if (enc_state.streaming_mode) cache = nullptr;
+  std::vector<float> order_fractions;
+  if (cache != nullptr && used_orders_info.second != 0) {
+    order_fractions = OrderFractions(enc_state.shared.ac_strategy);
+    // At most this fraction of the blocks may change of order kind, which
+    // changes the sum of the differences of the fractions by twice as much.
+    constexpr float kMaxOrderFractionChange = 0.05f;
+    float change = 0.0f;
+    if (cache->order_fractions.size() == kNumOrders) {
+      for (size_t i = 0; i < kNumOrders; i++) {
+        change += std::abs(order_fractions[i] - cache->order_fractions[i]);
+      }
+    }
+    if (cache->xsize_blocks == frame_dim.xsize_blocks &&
+        cache->ysize_blocks == frame_dim.ysize_blocks &&
+        cache->used_orders.size() == num_passes &&
+        cache->coeff_orders.size() == orders_size &&
+        cache->used_orders_info == used_orders_info &&
+        cache->order_fractions.size() == kNumOrders &&
+        change <= 2 * kMaxOrderFractionChange) {
+      enc_state.used_orders = cache->used_orders;
+      std::copy(cache->coeff_orders.begin(), cache->coeff_orders.end(),
+                enc_state.shared.coeff_orders.begin());
+      enc_state.used_acs |= used_orders_info.first;
+      return true;
+    }
+  }
+  for (size_t i = 0; i < num_passes; i++) {
     JXL_RETURN_IF_ERROR(ComputeCoeffOrder(
         enc_state.cparams.speed_tier, *enc_state.coeffs[i],
         enc_state.shared.ac_strategy, frame_dim, enc_state.used_orders[i],
         enc_state.used_acs, used_orders_info.first, used_orders_info.second,
         &enc_state.shared.coeff_orders[i * enc_state.shared.coeff_order_size]));
   }
+  if (cache != nullptr && used_orders_info.second != 0) {
+    cache->xsize_blocks = frame_dim.xsize_blocks;
+    cache->ysize_blocks = frame_dim.ysize_blocks;
+    cache->used_orders_info = used_orders_info;
+    cache->order_fractions = std::move(order_fractions);
+    cache->used_orders = enc_state.used_orders;
+    cache->coeff_orders.assign(
+        enc_state.shared.coeff_orders.begin(),
+        enc_state.shared.coeff_orders.begin() + orders_size);
+  }
   enc_state.used_acs |= used_orders_info.first;
   return true;
 }
@@ -1136,6 +1268,10 @@ struct EncCache {
   }
   // TokenizeCoefficients
   Image3I num_nzeroes;
+  // Tokens of the group being tokenized. They are reserved for the worst
+  // case, one token per coefficient, which is kept by the cache, and copied
+  // into a vector of their exact size.
+  std::vector<Token> tokens;
 };
 
 Status TokenizeAllCoefficients(const FrameHeader& frame_header,
@@ -1160,13 +1296,15 @@ Status TokenizeAllCoefficients(const FrameHeader& frame_header,
           enc_state->coeffs[idx_pass]->PlaneRow(2, group_index, 0).ptr32,
       };
       // Ensure group cache is initialized.
-      JXL_RETURN_IF_ERROR(group_caches[thread].InitOnce(memory_manager));
+      EncCache& cache = group_caches[thread];
+      JXL_RETURN_IF_ERROR(cache.InitOnce(memory_manager));
       JXL_RETURN_IF_ERROR(TokenizeCoefficients(
           &shared.coeff_orders[idx_pass * shared.coeff_order_size], rect,
           ac_rows, shared.ac_strategy, frame_header.chroma_subsampling,
-          &group_caches[thread].num_nzeroes,
-          &enc_state->passes[idx_pass].ac_tokens[group_index], shared.quant_dc,
+          &cache.num_nzeroes, &cache.tokens, shared.quant_dc,
           shared.raw_quant_field, shared.block_ctx_map));
+      enc_state->passes[idx_pass].ac_tokens[group_index] =
+          std::vector<Token>(cache.tokens.begin(), cache.tokens.end());
     }
     return true;
   };
@@ -1188,11 +1326,42 @@ Status EncodeGlobalDCInfo(const PassesSharedState& shared, BitWriter* writer,
   return true;
 }
 
+// Clustering of the AC histograms in four clusters: the non-zero counts and
+// the coefficients, each of the block contexts of luma and of those only used
+// by chroma. It is taken whatever the entropy of the histograms, unless one of
+// its clusters is empty.
+ClusteringHint FixedACClustering(const BlockCtxMap& block_ctx_map) {
+  const size_t num_ctxs = block_ctx_map.num_ctxs;
+  std::vector<uint8_t> chroma(num_ctxs, 1);
+  // The luma block contexts come first in the ctx map, see
+  // BlockCtxMap::Context.
+  const size_t luma_size = kNumOrders *
+                           (block_ctx_map.qf_thresholds.size() + 1) *
+                           block_ctx_map.num_dc_ctxs;
+  for (size_t i = 0; i < luma_size; ++i) {
+    chroma[block_ctx_map.ctx_map[i]] = 0;
+  }
+  ClusteringHint hint;
+  hint.context_map.resize(block_ctx_map.NumACContexts());
+  for (size_t ctx = 0; ctx < num_ctxs; ++ctx) {
+    for (size_t i = 0; i < kNonZeroBuckets; ++i) {
+      hint.context_map[i * num_ctxs + ctx] = chroma[ctx];
+    }
+    const uint32_t offset = block_ctx_map.ZeroDensityContextsOffset(ctx);
+    for (size_t i = 0; i < kZeroDensityContextCount; ++i) {
+      hint.context_map[offset + i] = 2 + chroma[ctx];
+    }
+  }
+  hint.entropy_ratio = std::numeric_limits<float>::infinity();
+  return hint;
+}
+
 // In streaming mode, this function only performs the histogram clustering and
 // saves the histogram bitstreams in enc_state, the actual AC global bitstream
 // is written in OutputAcGlobal() function after all the groups are processed.
 Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
-                          ModularFrameEncoder* enc_modular, AuxOut* aux_out) {
+                          ModularFrameEncoder* enc_modular, ThreadPool* pool,
+                          AuxOut* aux_out) {
   PassesSharedState& shared = enc_state->shared;
   JxlMemoryManager* memory_manager = enc_state->memory_manager();
   JXL_RETURN_IF_ERROR(DequantMatricesEncode(memory_manager, shared.matrices,
@@ -1233,6 +1402,24 @@ Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
     if (enc_state->cparams.decoding_speed_tier >= 1) {
       hist_params.max_histograms = 6;
     }
+    EntropyCodingCache* cache = enc_state->cparams.entropy_coding_cache.get();
+    if (cache != nullptr && !enc_state->streaming_mode) {
+      if (cache->ac_clustering.size() <= i) cache->ac_clustering.resize(i + 1);
+      hist_params.clustering_hint = &cache->ac_clustering[i];
+    }
+    // The fastest JPEG recompression does not cluster the histograms.
+    ClusteringHint fixed_clustering;
+    if (enc_state->jpeg_transcoding &&
+        enc_state->cparams.speed_tier >= SpeedTier::kThunder &&
+        hist_params.clustering_hint == nullptr && shared.num_histograms == 1) {
+      fixed_clustering = FixedACClustering(shared.block_ctx_map);
+      hist_params.clustering_hint = &fixed_clustering;
+    }
+    // The fixed histograms of streaming mode are ANS histograms.
+    if (enc_state->cparams.decoding_speed_tier >= 4 &&
+        !enc_state->streaming_mode) {
+      hist_params.force_huffman = true;
+    }
     size_t num_histogram_groups = shared.num_histograms;
     if (enc_state->streaming_mode) {
       size_t prev_num_histograms =
@@ -1253,6 +1440,7 @@ Status EncodeGlobalACInfo(PassesEncoderState* enc_state, BitWriter* writer,
     }
     hist_params.streaming_mode = enc_state->streaming_mode;
     hist_params.initialize_global_state = enc_state->initialize_global_state;
+    hist_params.pool = pool;
     JXL_ASSIGN_OR_RETURN(
         size_t cost,
         BuildAndEncodeHistograms(
@@ -1319,8 +1507,8 @@ Status EncodeGroups(const FrameHeader& frame_header,
     if (frame_header.encoding == FrameEncoding::kVarDCT) {
       JXL_RETURN_IF_ERROR(EncodeGlobalDCInfo(shared, get_output(0), aux_out));
     }
-    JXL_RETURN_IF_ERROR(enc_modular->EncodeGlobalInfo(enc_state->streaming_mode,
-                                                      get_output(0), aux_out));
+    JXL_RETURN_IF_ERROR(enc_modular->EncodeGlobalInfo(
+        enc_state->streaming_mode, get_output(0), pool, aux_out));
     JXL_RETURN_IF_ERROR(enc_modular->EncodeStream(get_output(0), aux_out,
                                                   LayerType::ModularGlobal,
                                                   ModularStreamId::Global()));
@@ -1392,7 +1580,7 @@ Status EncodeGroups(const FrameHeader& frame_header,
   if (has_error) return JXL_FAILURE("EncodeDCGroup failed");
   if (frame_header.encoding == FrameEncoding::kVarDCT) {
     JXL_RETURN_IF_ERROR(EncodeGlobalACInfo(
-        enc_state, get_output(global_ac_index), enc_modular, aux_out));
+        enc_state, get_output(global_ac_index), enc_modular, pool, aux_out));
   }
 
   const auto process_group = [&](const uint32_t group_index,
@@ -1439,6 +1627,177 @@ Status EncodeGroups(const FrameHeader& frame_header,
   return true;
 }
 
+// Lossless modular uses local trees, unless at very slow speeds.
+bool UseGlobalModularTree(const CompressParams& cparams) {
+  return cparams.speed_tier < SpeedTier::kTortoise ||
+         !cparams.ModularPartIsLossless() || cparams.responsive ||
+         !cparams.custom_fixed_tree.empty();
+}
+
+bool UseTargetSize(const CompressParams& cparams,
+                   const PassesEncoderState& enc_state,
+                   const FrameHeader& frame_header,
+                   const jpeg::JPEGData* jpeg_data) {
+  return cparams.target_size > 0 && !enc_state.streaming_mode &&
+         frame_header.encoding == FrameEncoding::kVarDCT && !jpeg_data &&
+         !(frame_header.flags & FrameHeader::kUseDcFrame) &&
+         !cparams.modular_tree_cache;
+}
+
+// Encodes the groups of a VarDCT frame with the AC quantization step scaled
+// so that the frame gets close to cparams.target_size bytes without exceeding
+// it, if possible. The heuristics only run once: every step of the search
+// requantizes and tokenizes the coefficients again, keeping the AC strategy,
+// quantization field and color correlation of the first encoding.
+Status EncodeGroupsWithTargetSize(
+    const FrameHeader& frame_header, const Image3F& opsin, const Rect& rect,
+    const JxlCmsInterface& cms, ThreadPool* pool,
+    PassesEncoderState* enc_state, ModularFrameEncoder* enc_modular,
+    std::vector<std::unique_ptr<BitWriter>>* group_codes, AuxOut* aux_out) {
+  constexpr size_t kMaxSteps = 8;
+  constexpr float kTolerance = 0.02f;
+  PassesSharedState& shared = enc_state->shared;
+  JxlMemoryManager* memory_manager = enc_state->memory_manager();
+  const float target_size = enc_state->cparams.target_size;
+  const float quant_ac_rescale = enc_state->cparams.quant_ac_rescale;
+
+  // The search restarts every step from the quantization of the first
+  // encoding, which only changes in the global scale; the DC is kept.
+  const Quantizer quantizer = shared.quantizer;
+  float inv_dc_quant[3];
+  for (size_t c = 0; c < 3; c++) {
+    inv_dc_quant[c] = shared.matrices.InvDCQuant(c);
+  }
+  JXL_ASSIGN_OR_RETURN(ImageI raw_quant_field,
+                       ImageI::Create(memory_manager,
+                                      shared.raw_quant_field.xsize(),
+                                      shared.raw_quant_field.ysize()));
+  JXL_RETURN_IF_ERROR(CopyImageTo(shared.raw_quant_field, &raw_quant_field));
+  const float global_scale = quantizer.GetParams().global_scale;
+  const float min_scale = 1.0f / global_scale;
+  const float max_scale = (1 << 15) / global_scale;
+
+  size_t special_frames_size = 0;
+  for (const auto& special_frame : enc_state->special_frames) {
+    special_frames_size += special_frame->BitsWritten() / kBitsPerByte;
+  }
+
+  float current_scale = 1.0f;
+  const auto encode = [&](float scale, AuxOut* encode_aux_out) -> Status {
+    if (scale != current_scale) {
+      shared.quantizer = quantizer;
+      JXL_RETURN_IF_ERROR(DequantMatricesSetCustomDC(
+          memory_manager, &shared.matrices, inv_dc_quant));
+      JXL_RETURN_IF_ERROR(
+          CopyImageTo(raw_quant_field, &shared.raw_quant_field));
+      enc_state->cparams.quant_ac_rescale = scale;
+      JXL_RETURN_IF_ERROR(InitializePassesEncoder(frame_header, opsin, rect,
+                                                  cms, pool, enc_state,
+                                                  enc_modular, nullptr));
+      JXL_RETURN_IF_ERROR(ComputeACMetadata(pool, enc_state, enc_modular));
+      JXL_RETURN_IF_ERROR(ComputeAllCoeffOrders(*enc_state, shared.frame_dim));
+      JXL_RETURN_IF_ERROR(
+          TokenizeAllCoefficients(frame_header, pool, enc_state));
+      if (UseGlobalModularTree(enc_state->cparams)) {
+        JXL_RETURN_IF_ERROR(enc_modular->ComputeTree(pool));
+        JXL_RETURN_IF_ERROR(enc_modular->ComputeTokens(pool));
+      }
+      current_scale = scale;
+    }
+    // Entropy codes are appended to, so they have to go.
+    for (PassesEncoderState::PassData& pass : enc_state->passes) {
+      pass.codes = EntropyEncodingData();
+      pass.context_map.clear();
+    }
+    enc_modular->ClearEntropyCodes();
+    group_codes->clear();
+    return EncodeGroups(frame_header, enc_state, enc_modular, pool,
+                        group_codes, encode_aux_out);
+  };
+  const auto encoded_size = [&]() {
+    size_t bits = 0;
+    for (const auto& group_code : *group_codes) {
+      bits += group_code->BitsWritten();
+    }
+    return special_frames_size + bits / kBitsPerByte;
+  };
+
+  // Scales known to give a frame that fits, or that does not.
+  float fit_scale = 0.0f;
+  float no_fit_scale = 0.0f;
+  // Largest frame that fits, or else the smallest one.
+  float best_scale = 1.0f;
+  size_t best_size = 0;
+  float scale = 1.0f;
+  for (size_t step = 0; step < kMaxSteps; step++) {
+    JXL_RETURN_IF_ERROR(encode(scale, nullptr));
+    const size_t size = encoded_size();
+    const bool fits = size <= target_size;
+    const bool best_fits = best_size <= target_size;
+    if (step == 0 || (fits && (!best_fits || size > best_size)) ||
+        (!fits && !best_fits && size < best_size)) {
+      best_scale = scale;
+      best_size = size;
+    }
+    if (fits) {
+      fit_scale = scale;
+      if (size >= target_size * (1.0f - kTolerance)) break;
+    } else {
+      no_fit_scale = scale;
+    }
+    // A larger global scale means finer AC steps and a larger frame. The size
+    // does not grow quite as fast, which the bisection of the known bounds
+    // makes up for.
+    float next_scale = scale * target_size / std::max<size_t>(size, 1);
+    if (fit_scale > 0 && no_fit_scale > 0 &&
+        !(next_scale > fit_scale && next_scale < no_fit_scale)) {
+      next_scale = std::sqrt(fit_scale * no_fit_scale);
+    }
+    next_scale = Clamp1(next_scale, min_scale, max_scale);
+    if (std::abs(next_scale - scale) < 1e-3f * scale) break;
+    scale = next_scale;
+  }
+  if (best_scale != current_scale || aux_out != nullptr) {
+    JXL_RETURN_IF_ERROR(encode(best_scale, aux_out));
+  }
+  enc_state->cparams.quant_ac_rescale = quant_ac_rescale;
+  return true;
+}
+
+// Key of the frame in FrameAnalysisCache: FNV-1a of the input pixels, with
+// the color encoding and intensity target that the conversion to XYB depends
+// on.
+StatusOr<uint64_t> AnalysisCacheKey(const Image3F& color, const ImageF* black,
+                                    const ColorEncoding& c_enc,
+                                    float intensity_target, ThreadPool* pool) {
+  constexpr uint64_t kPrime = 0x100000001b3ull;
+  const size_t xsize = color.xsize();
+  const size_t ysize = color.ysize();
+  std::vector<uint64_t> row_hashes(ysize);
+  const auto hash_row = [&](const uint32_t y, size_t /* thread */) -> Status {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    const auto add_row = [&](const float* JXL_RESTRICT row) {
+      for (size_t x = 0; x < xsize; ++x) {
+        uint32_t bits;
+        memcpy(&bits, row + x, sizeof(bits));
+        hash = (hash ^ bits) * kPrime;
+      }
+    };
+    for (size_t c = 0; c < 3; ++c) add_row(color.ConstPlaneRow(c, y));
+    if (black) add_row(black->ConstRow(y));
+    row_hashes[y] = hash;
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, ysize, ThreadPool::NoInit, hash_row,
+                                "AnalysisCacheKey"));
+  uint64_t key = xsize * 0x9E3779B97F4A7C15ull + ysize;
+  for (uint64_t row_hash : row_hashes) key = (key ^ row_hash) * kPrime;
+  for (uint8_t byte : c_enc.ICC()) key = (key ^ byte) * kPrime;
+  uint32_t intensity_bits;
+  memcpy(&intensity_bits, &intensity_target, sizeof(intensity_bits));
+  return (key ^ intensity_bits) * kPrime;
+}
+
 Status ComputeEncodingData(
     const CompressParams& cparams, const FrameInfo& frame_info,
     const CodecMetadata* metadata, JxlEncoderChunkedFrameAdapter& frame_data,
@@ -1534,6 +1893,14 @@ Status ComputeEncodingData(
                                         pool, &extra_channels));
 
   enc_state.cparams = cparams;
+  // The analysis cache is keyed on the input of the conversion to XYB below,
+  // and the heuristics only use it for frames that checked the key.
+  if (jpeg_data || enc_state.streaming_mode ||
+      frame_header.encoding != FrameEncoding::kVarDCT ||
+      frame_header.color_transform != ColorTransform::kXYB ||
+      !frame_info.ib_needs_color_transform) {
+    enc_state.cparams.analysis_cache = nullptr;
+  }
 
   Image3F linear_storage;
   Image3F* linear = nullptr;
@@ -1548,8 +1915,44 @@ Status ComputeEncodingData(
                                              patch_rect.ysize()));
         linear = &linear_storage;
       }
-      JXL_RETURN_IF_ERROR(ToXYB(c_enc, metadata->m.IntensityTarget(), black,
-                                pool, &color, cms, linear));
+      FrameAnalysisCache* analysis_cache =
+          enc_state.cparams.analysis_cache.get();
+      if (analysis_cache) {
+        JXL_ASSIGN_OR_RETURN(
+            uint64_t key,
+            AnalysisCacheKey(color, black, c_enc, metadata->m.IntensityTarget(),
+                             pool));
+        analysis_cache->SetKey(key);
+      }
+      if (analysis_cache && SameSize(analysis_cache->opsin, color) &&
+          (!linear || SameSize(analysis_cache->linear, color))) {
+        JXL_RETURN_IF_ERROR(CopyImageTo(analysis_cache->opsin, &color));
+        if (linear) {
+          JXL_RETURN_IF_ERROR(CopyImageTo(analysis_cache->linear, linear));
+        }
+      } else {
+        {
+          PhaseTimer timer(aux_out, EncoderPhase::ToXyb);
+          JXL_RETURN_IF_ERROR(ToXYB(c_enc, metadata->m.IntensityTarget(),
+                                    black, pool, &color, cms, linear));
+        }
+        if (analysis_cache) {
+          JxlMemoryManager* cache_memory_manager =
+              analysis_cache->MemoryManager(memory_manager);
+          JXL_ASSIGN_OR_RETURN(analysis_cache->opsin,
+                               Image3F::Create(cache_memory_manager,
+                                               color.xsize(), color.ysize()));
+          JXL_RETURN_IF_ERROR(CopyImageTo(color, &analysis_cache->opsin));
+          analysis_cache->linear = Image3F();
+          if (linear) {
+            JXL_ASSIGN_OR_RETURN(
+                analysis_cache->linear,
+                Image3F::Create(cache_memory_manager, linear->xsize(),
+                                linear->ysize()));
+            JXL_RETURN_IF_ERROR(CopyImageTo(*linear, &analysis_cache->linear));
+          }
+        }
+      }
     } else {
       // Nothing to do.
       // RGB or YCbCr: forward YCbCr is not implemented, this is only used when
@@ -1576,6 +1979,21 @@ Status ComputeEncodingData(
   Rect group_rect(x0 - patch_rect.x0(), y0 - patch_rect.y0(),
                   RoundUpToBlockDim(xsize), RoundUpToBlockDim(ysize));
 
+  using StreamingPass = PassesEncoderState::StreamingPass;
+  if (enc_state.streaming_pass == StreamingPass::kNoiseSamples) {
+    // A crop from the middle of the DC group, in whole 8x8 patches.
+    const size_t sample_xsize =
+        std::min(kStreamingNoiseSampleDim, xsize / kBlockDim * kBlockDim);
+    const size_t sample_ysize =
+        std::min(kStreamingNoiseSampleDim, ysize / kBlockDim * kBlockDim);
+    if (sample_xsize == 0 || sample_ysize == 0) return true;
+    const Rect sample_rect(group_rect.x0() + (xsize - sample_xsize) / 2,
+                           group_rect.y0() + (ysize - sample_ysize) / 2,
+                           sample_xsize, sample_ysize);
+    enc_state.noise_estimator.AddImage(color, sample_rect);
+    return true;
+  }
+
   if (enc_state.initialize_global_state && !jpeg_data) {
     ComputeChromacityAdjustments(cparams, color, group_rect,
                                  &mutable_frame_header);
@@ -1583,11 +2001,12 @@ Status ComputeEncodingData(
 
   bool has_jpeg_data = (jpeg_data != nullptr);
   ComputeNoiseParams(cparams, enc_state.streaming_mode, has_jpeg_data, color,
-                     frame_dim, &mutable_frame_header,
+                     frame_header.ToFrameDimensions(), &mutable_frame_header,
                      &shared.image_features.noise_params);
 
   JXL_RETURN_IF_ERROR(
-      DownsampleColorChannels(cparams, frame_header, has_jpeg_data, &color));
+      DownsampleColorChannels(cparams, frame_header, has_jpeg_data, &color,
+                              pool));
 
   if (cparams.ec_resampling != 1 && !cparams.already_downsampled) {
     for (ImageF& ec : extra_channels) {
@@ -1617,6 +2036,7 @@ Status ComputeEncodingData(
       shared.num_histograms = 1;
       enc_state.histogram_idx.resize(frame_dim.num_groups);
     }
+    PhaseTimer timer(aux_out, EncoderPhase::Tokenization);
     JXL_RETURN_IF_ERROR(
         TokenizeAllCoefficients(frame_header, pool, &enc_state));
   }
@@ -1628,12 +2048,27 @@ Status ComputeEncodingData(
         /*do_color=*/cparams.modular_mode));
   }
 
+  if (enc_state.streaming_pass != StreamingPass::kEncode) {
+    if (enc_state.streaming_pass == StreamingPass::kPropertySamples) {
+      JXL_RETURN_IF_ERROR(enc_modular.AddStreamingPropertySamples());
+    } else {
+      JXL_RETURN_IF_ERROR(enc_modular.AddStreamingTreeSamples());
+    }
+    enc_modular.ClearModularStreamData();
+    return true;
+  }
+
+  if (enc_state.streaming_mode && enc_modular.HasTree()) {
+    PhaseTimer timer(aux_out, EncoderPhase::Tokenization);
+    JXL_RETURN_IF_ERROR(enc_modular.ComputeTokens(pool));
+  }
   if (!enc_state.streaming_mode) {
-    if (cparams.speed_tier < SpeedTier::kTortoise ||
-        !cparams.ModularPartIsLossless() || cparams.responsive ||
-        !cparams.custom_fixed_tree.empty()) {
-      // Use local trees if doing lossless modular, unless at very slow speeds.
-      JXL_RETURN_IF_ERROR(enc_modular.ComputeTree(pool));
+    if (UseGlobalModularTree(cparams)) {
+      {
+        PhaseTimer timer(aux_out, EncoderPhase::TreeLearning);
+        JXL_RETURN_IF_ERROR(enc_modular.ComputeTree(pool));
+      }
+      PhaseTimer timer(aux_out, EncoderPhase::Tokenization);
       JXL_RETURN_IF_ERROR(enc_modular.ComputeTokens(pool));
     }
     mutable_frame_header.UpdateFlag(shared.image_features.patches.HasAny(),
@@ -1642,8 +2077,15 @@ Status ComputeEncodingData(
                                     FrameHeader::kSplines);
   }
 
-  JXL_RETURN_IF_ERROR(EncodeGroups(frame_header, &enc_state, &enc_modular, pool,
-                                   group_codes, aux_out));
+  PhaseTimer timer(aux_out, EncoderPhase::Writing);
+  if (UseTargetSize(cparams, enc_state, frame_header, jpeg_data)) {
+    JXL_RETURN_IF_ERROR(EncodeGroupsWithTargetSize(
+        frame_header, color, group_rect, cms, pool, &enc_state, &enc_modular,
+        group_codes, aux_out));
+  } else {
+    JXL_RETURN_IF_ERROR(EncodeGroups(frame_header, &enc_state, &enc_modular,
+                                     pool, group_codes, aux_out));
+  }
   if (enc_state.streaming_mode) {
     const size_t group_index = enc_state.dc_group_index;
     enc_modular.ClearStreamData(ModularStreamId::VarDCTDC(group_index));
@@ -1653,19 +2095,11 @@ Status ComputeEncodingData(
   return true;
 }
 
-Status PermuteGroups(const CompressParams& cparams,
-                     const FrameDimensions& frame_dim, size_t num_passes,
-                     std::vector<coeff_order_t>* permutation,
-                     std::vector<std::unique_ptr<BitWriter>>* group_codes) {
-  const size_t num_groups = frame_dim.num_groups;
-  if (!cparams.centerfirst || (num_passes == 1 && num_groups == 1)) {
-    return true;
-  }
-  // Don't permute global DC/AC or DC.
-  permutation->resize(frame_dim.num_dc_groups + 2);
-  std::iota(permutation->begin(), permutation->end(), 0);
-  std::vector<coeff_order_t> ac_group_order(num_groups);
-  std::iota(ac_group_order.begin(), ac_group_order.end(), 0);
+// Sorts the AC groups in concentric squares around the center given by
+// `cparams`.
+Status SortGroupsFromCenter(const CompressParams& cparams,
+                            const FrameDimensions& frame_dim,
+                            std::vector<coeff_order_t>* ac_group_order) {
   size_t group_dim = frame_dim.group_dim;
 
   // The center of the image is either given by parameters or chosen
@@ -1711,10 +2145,56 @@ Status PermuteGroups(const CompressParams& cparams,
     // Concentric squares in clockwise order.
     return std::make_pair(std::max(std::abs(dx), std::abs(dy)), angle);
   };
-  std::sort(ac_group_order.begin(), ac_group_order.end(),
+  std::sort(ac_group_order->begin(), ac_group_order->end(),
             [&](coeff_order_t a, coeff_order_t b) {
               return get_distance_from_center(a) < get_distance_from_center(b);
             });
+  return true;
+}
+
+// Sorts the AC groups by decreasing mean of `quant_field` over their blocks,
+// so that the parts of the image that the adaptive quantization deems the
+// most sensitive are refined first.
+void SortGroupsBySaliency(const FrameDimensions& frame_dim,
+                          const ImageI& quant_field,
+                          std::vector<coeff_order_t>* ac_group_order) {
+  std::vector<float> saliency(frame_dim.num_groups);
+  for (size_t gid = 0; gid < frame_dim.num_groups; gid++) {
+    const Rect rect = frame_dim.BlockGroupRect(gid);
+    int64_t sum = 0;
+    for (size_t y = 0; y < rect.ysize(); y++) {
+      const int32_t* JXL_RESTRICT row = rect.ConstRow(quant_field, y);
+      for (size_t x = 0; x < rect.xsize(); x++) sum += row[x];
+    }
+    saliency[gid] = static_cast<float>(sum) / (rect.xsize() * rect.ysize());
+  }
+  std::stable_sort(ac_group_order->begin(), ac_group_order->end(),
+                   [&](coeff_order_t a, coeff_order_t b) {
+                     return saliency[a] > saliency[b];
+                   });
+}
+
+Status PermuteGroups(const CompressParams& cparams,
+                     const FrameDimensions& frame_dim, size_t num_passes,
+                     const ImageI* quant_field,
+                     std::vector<coeff_order_t>* permutation,
+                     std::vector<std::unique_ptr<BitWriter>>* group_codes) {
+  const size_t num_groups = frame_dim.num_groups;
+  if ((!cparams.centerfirst && !cparams.salientfirst) ||
+      (num_passes == 1 && num_groups == 1)) {
+    return true;
+  }
+  // Don't permute global DC/AC or DC.
+  permutation->resize(frame_dim.num_dc_groups + 2);
+  std::iota(permutation->begin(), permutation->end(), 0);
+  std::vector<coeff_order_t> ac_group_order(num_groups);
+  std::iota(ac_group_order.begin(), ac_group_order.end(), 0);
+  if (cparams.salientfirst && quant_field != nullptr) {
+    SortGroupsBySaliency(frame_dim, *quant_field, &ac_group_order);
+  } else {
+    JXL_RETURN_IF_ERROR(
+        SortGroupsFromCenter(cparams, frame_dim, &ac_group_order));
+  }
   std::vector<coeff_order_t> inv_ac_group_order(ac_group_order.size(), 0);
   for (size_t i = 0; i < ac_group_order.size(); i++) {
     inv_ac_group_order[ac_group_order[i]] = i;
@@ -1752,14 +2232,23 @@ bool CanDoStreamingEncoding(const CompressParams& cparams,
     }
   }
 
-  // TODO(veluca): handle different values of `buffering`.
-  if (frame_data.xsize <= 2048 && frame_data.ysize <= 2048) {
+  // Streaming reserves the TOC and patches it once all the groups are written
+  // through the output processor, so the sections of a DC group are emitted as
+  // soon as it is encoded. At buffering 2 and 3, this is worth it for any
+  // frame larger than one group, whose size modular frames can choose.
+  size_t group_dim = kGroupDim;
+  if (cparams.modular_mode && cparams.modular_group_size_shift >= 0) {
+    group_dim = (kGroupDim >> 1) << cparams.modular_group_size_shift;
+  }
+  const size_t max_buffered_size = cparams.buffering >= 2 ? group_dim : 2048;
+  if (frame_data.xsize <= max_buffered_size &&
+      frame_data.ysize <= max_buffered_size) {
     return false;
   }
   if (frame_data.IsJPEG()) {
     return false;
   }
-  if (cparams.noise == Override::kOn || cparams.patches == Override::kOn) {
+  if (cparams.patches == Override::kOn) {
     return false;
   }
   if (cparams.progressive_dc != 0 || frame_info.dc_level != 0) {
@@ -1771,6 +2260,9 @@ bool CanDoStreamingEncoding(const CompressParams& cparams,
   if (cparams.max_error_mode) {
     return false;
   }
+  if (cparams.target_size > 0 || cparams.analysis_cache) {
+    return false;
+  }
   if (!cparams.ModularPartIsLossless() || cparams.responsive > 0) {
     if (metadata.m.num_extra_channels > 0 || cparams.modular_mode) {
       return false;
@@ -1829,6 +2321,10 @@ Status ComputePermutationForStreaming(size_t xsize, size_t ysize,
   return true;
 }
 
+// Number of pixels that the global tree of a streaming modular frame is
+// learned from, the size of a frame of 8 DC groups of the default size.
+constexpr size_t kMaxStreamingTreePixels = size_t{1} << 25;
+
 constexpr size_t kGroupSizeOffset[4] = {
     static_cast<size_t>(0),
     static_cast<size_t>(1024),
@@ -1897,6 +2393,55 @@ size_t ComputeDcGlobalPadding(const std::vector<size_t>& group_sizes,
   return group_data_offset - actual_offset;
 }
 
+// Fills `offsets` from the number of bytes before the first section and the
+// sizes of the sections in the order in which they are stored. Section i of
+// the TOC is stored at position permutation[i], or i if `permutation` is
+// empty.
+Status ComputeProgressionOffsets(const FrameDimensions& frame_dim,
+                                 size_t num_passes, size_t sections_start,
+                                 const std::vector<size_t>& stored_sizes,
+                                 const std::vector<coeff_order_t>& permutation,
+                                 FrameProgressionOffsets* offsets) {
+  const size_t num_sections = stored_sizes.size();
+  JXL_ENSURE(permutation.empty() || permutation.size() == num_sections);
+  std::vector<size_t> stored_start(num_sections);
+  size_t pos = sections_start;
+  for (size_t i = 0; i < num_sections; i++) {
+    stored_start[i] = pos;
+    pos += stored_sizes[i];
+  }
+  offsets->frame_end = pos;
+  const auto stored_index = [&](size_t i) -> size_t {
+    return permutation.empty() ? i : permutation[i];
+  };
+  offsets->section_start.resize(num_sections);
+  for (size_t i = 0; i < num_sections; i++) {
+    offsets->section_start[i] = stored_start[stored_index(i)];
+  }
+  offsets->pass_end.assign(num_passes, pos);
+  if (num_sections == 1) {
+    offsets->dc_end = pos;
+    return true;
+  }
+  const size_t first_ac_group = frame_dim.num_dc_groups + 2;
+  JXL_ENSURE(num_sections ==
+             first_ac_group + num_passes * frame_dim.num_groups);
+  size_t end = 0;
+  const auto add_section = [&](size_t i) {
+    const size_t s = stored_index(i);
+    end = std::max(end, stored_start[s] + stored_sizes[s]);
+  };
+  for (size_t i = 0; i < first_ac_group; i++) add_section(i);
+  offsets->dc_end = end;
+  for (size_t p = 0; p < num_passes; p++) {
+    for (size_t g = 0; g < frame_dim.num_groups; g++) {
+      add_section(first_ac_group + p * frame_dim.num_groups + g);
+    }
+    offsets->pass_end[p] = end;
+  }
+  return true;
+}
+
 Status OutputGroups(std::vector<std::unique_ptr<BitWriter>>&& group_codes,
                     std::vector<size_t>* group_sizes,
                     JxlEncoderOutputProcessorWrapper* output_processor) {
@@ -1904,12 +2449,12 @@ Status OutputGroups(std::vector<std::unique_ptr<BitWriter>>&& group_codes,
   {
     PaddedBytes dc_group = std::move(*group_codes[1]).TakeBytes();
     group_sizes->push_back(dc_group.size());
-    JXL_RETURN_IF_ERROR(AppendData(*output_processor, dc_group));
+    JXL_RETURN_IF_ERROR(output_processor->AppendOwned(std::move(dc_group)));
   }
   for (size_t i = 3; i < group_codes.size(); ++i) {
     PaddedBytes ac_group = std::move(*group_codes[i]).TakeBytes();
     group_sizes->push_back(ac_group.size());
-    JXL_RETURN_IF_ERROR(AppendData(*output_processor, ac_group));
+    JXL_RETURN_IF_ERROR(output_processor->AppendOwned(std::move(ac_group)));
   }
   return true;
 }
@@ -1984,7 +2529,7 @@ Status OutputAcGlobal(PassesEncoderState& enc_state,
   }));
   PaddedBytes ac_global = std::move(writer).TakeBytes();
   group_sizes->push_back(ac_global.size());
-  JXL_RETURN_IF_ERROR(AppendData(*output_processor, ac_global));
+  JXL_RETURN_IF_ERROR(output_processor->AppendOwned(std::move(ac_global)));
   return true;
 }
 
@@ -2027,7 +2572,10 @@ Status EncodeFrameStreaming(JxlMemoryManager* memory_manager,
   PaddedBytes dc_global_bytes{memory_manager};
   std::vector<size_t> group_sizes;
   size_t start_pos = output_processor->CurrentPosition();
-  for (size_t i = 0; i < dc_group_order.size(); ++i) {
+  // Computes the encoding data of the i-th DC group in `dc_group_order`.
+  const auto compute_dc_group =
+      [&](size_t i,
+          std::vector<std::unique_ptr<BitWriter>>* group_codes) -> Status {
     size_t dc_ix = dc_group_order[i];
     size_t dc_y = dc_ix / dc_group_xsize;
     size_t dc_x = dc_ix % dc_group_xsize;
@@ -2043,15 +2591,65 @@ Status EncodeFrameStreaming(JxlMemoryManager* memory_manager,
                 ", %" PRIuS ")",
                 dc_ix, dc_y, dc_x, x0, y0, xsize, ysize);
     enc_state.streaming_mode = true;
-    enc_state.initialize_global_state = (i == 0);
+    enc_state.initialize_global_state =
+        (i == 0 && enc_state.streaming_pass ==
+                       PassesEncoderState::StreamingPass::kEncode);
     enc_state.dc_group_index = dc_ix;
     enc_state.histogram_idx = std::vector<size_t>(group_xsize * group_ysize, i);
-    std::vector<std::unique_ptr<BitWriter>> group_codes;
     JXL_RETURN_IF_ERROR(ComputeEncodingData(
         cparams, frame_info, metadata, frame_data, jpeg_data.get(), x0, y0,
         xsize, ysize, cms, pool, frame_header, enc_modular, enc_state,
-        &group_codes, aux_out));
+        group_codes, aux_out));
     JXL_ENSURE(enc_state.special_frames.empty());
+    return true;
+  };
+  if (EstimatesNoise(cparams, frame_header, jpeg_data != nullptr)) {
+    const size_t num_dc_groups = dc_group_order.size();
+    const size_t num_sampled =
+        std::min(num_dc_groups, kMaxStreamingNoiseSamples);
+    enc_state.streaming_pass = PassesEncoderState::StreamingPass::kNoiseSamples;
+    for (size_t k = 0; k < num_sampled; ++k) {
+      std::vector<std::unique_ptr<BitWriter>> group_codes;
+      JXL_RETURN_IF_ERROR(
+          compute_dc_group(k * num_dc_groups / num_sampled, &group_codes));
+    }
+    enc_state.streaming_pass = PassesEncoderState::StreamingPass::kEncode;
+    NoiseParams& noise_params = enc_state.shared.image_features.noise_params;
+    if (!enc_state.noise_estimator.GetNoiseParameter(
+            &noise_params, NoiseQualityCoef(cparams))) {
+      frame_header.flags &= ~FrameHeader::kNoise;
+    }
+    enc_state.noise_estimator = NoiseEstimator();
+  }
+  if (frame_header.encoding == FrameEncoding::kModular &&
+      cparams.speed_tier < SpeedTier::kTortoise &&
+      cparams.ModularPartIsLossless() && cparams.responsive <= 0 &&
+      cparams.custom_fixed_tree.empty()) {
+    // These efforts learn a global tree, which is learned here from at most
+    // kMaxStreamingTreePixels pixels of DC groups spread over the frame, so
+    // that memory use does not grow with the size of the frame.
+    const size_t num_dc_groups = dc_group_order.size();
+    const size_t num_sampled =
+        std::min(num_dc_groups,
+                 std::max<size_t>(1, kMaxStreamingTreePixels /
+                                         (dc_group_size * dc_group_size)));
+    using StreamingPass = PassesEncoderState::StreamingPass;
+    for (StreamingPass pass :
+         {StreamingPass::kPropertySamples, StreamingPass::kTreeSamples}) {
+      enc_state.streaming_pass = pass;
+      for (size_t k = 0; k < num_sampled; ++k) {
+        std::vector<std::unique_ptr<BitWriter>> group_codes;
+        JXL_RETURN_IF_ERROR(
+            compute_dc_group(k * num_dc_groups / num_sampled, &group_codes));
+      }
+    }
+    enc_state.streaming_pass = StreamingPass::kEncode;
+    PhaseTimer timer(aux_out, EncoderPhase::TreeLearning);
+    JXL_RETURN_IF_ERROR(enc_modular.ComputeStreamingTree(pool));
+  }
+  for (size_t i = 0; i < dc_group_order.size(); ++i) {
+    std::vector<std::unique_ptr<BitWriter>> group_codes;
+    JXL_RETURN_IF_ERROR(compute_dc_group(i, &group_codes));
     if (i == 0) {
       BitWriter writer{memory_manager};
       JXL_RETURN_IF_ERROR(WriteFrameHeader(frame_header, &writer, aux_out));
@@ -2106,6 +2704,12 @@ Status EncodeFrameStreaming(JxlMemoryManager* memory_manager,
               toc_bytes.size(), padding_size);
   JXL_ENSURE(output_processor->CurrentPosition() ==
              start_pos + group_data_offset);
+  if (frame_info.progression_offsets != nullptr) {
+    JXL_RETURN_IF_ERROR(ComputeProgressionOffsets(
+        frame_header.ToFrameDimensions(), num_passes,
+        frame_header_bytes.size() + toc_bytes.size(), group_sizes, permutation,
+        frame_info.progression_offsets));
+  }
   JXL_RETURN_IF_ERROR(output_processor->Seek(end_pos));
   return true;
 }
@@ -2139,21 +2743,52 @@ Status EncodeFrameOneShot(JxlMemoryManager* memory_manager,
       cparams, frame_info, metadata, frame_data, jpeg_data.get(), 0, 0,
       frame_data.xsize, frame_data.ysize, cms, pool, frame_header, enc_modular,
       enc_state, &group_codes, aux_out));
+  // The coefficients are converted and the frame is never encoded again from
+  // the JPEG, so its bulk does not need to stay around while writing.
+  jpeg_data.reset();
+  if (aux_out != nullptr) {
+    aux_out->estimated_decode_ns += static_cast<uint64_t>(
+        EstimateFrameDecodeNs(
+            frame_header,
+            enc_state.shared.image_features.patches.NumPatchPixels()) +
+        enc_modular.EstimatedDecodeNs());
+  }
 
   BitWriter writer{memory_manager};
   JXL_RETURN_IF_ERROR(writer.AppendByteAligned(enc_state.special_frames));
   JXL_RETURN_IF_ERROR(WriteFrameHeader(frame_header, &writer, aux_out));
 
   std::vector<coeff_order_t> permutation;
+  // The quant field of modular frames is not filled.
+  const ImageI* quant_field = frame_header.encoding == FrameEncoding::kVarDCT
+                                  ? &enc_state.shared.raw_quant_field
+                                  : nullptr;
   JXL_RETURN_IF_ERROR(PermuteGroups(cparams, enc_state.shared.frame_dim,
-                                    num_passes, &permutation, &group_codes));
+                                    num_passes, quant_field, &permutation,
+                                    &group_codes));
 
   JXL_RETURN_IF_ERROR(
       WriteGroupOffsets(group_codes, permutation, &writer, aux_out));
 
-  JXL_RETURN_IF_ERROR(writer.AppendByteAligned(group_codes));
   PaddedBytes frame_bytes = std::move(writer).TakeBytes();
-  JXL_RETURN_IF_ERROR(AppendData(*output_processor, frame_bytes));
+  if (frame_info.progression_offsets != nullptr) {
+    std::vector<size_t> stored_sizes;
+    for (const std::unique_ptr<BitWriter>& group_code : group_codes) {
+      stored_sizes.push_back(group_code->BitsWritten() / kBitsPerByte);
+    }
+    JXL_RETURN_IF_ERROR(ComputeProgressionOffsets(
+        enc_state.shared.frame_dim, num_passes, frame_bytes.size(),
+        stored_sizes, permutation, frame_info.progression_offsets));
+  }
+  JXL_RETURN_IF_ERROR(output_processor->AppendOwned(std::move(frame_bytes)));
+  // The sections go to the output straight from their writers, which are freed
+  // as soon as they are written, instead of being concatenated first.
+  for (std::unique_ptr<BitWriter>& group_code : group_codes) {
+    JXL_ENSURE(group_code->BitsWritten() % kBitsPerByte == 0);
+    JXL_RETURN_IF_ERROR(
+        output_processor->AppendOwned(std::move(*group_code).TakeBytes()));
+    group_code.reset();
+  }
 
   return true;
 }
@@ -2398,11 +3033,14 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
     std::vector<size_t> size;
     size.resize(all_params.size());
 
+    // The trials run in parallel, and their output is discarded.
+    FrameInfo trial_frame_info = frame_info;
+    trial_frame_info.progression_offsets = nullptr;
     const auto process_variant = [&](size_t task, size_t) -> Status {
       JxlEncoderOutputProcessorWrapper local_output(memory_manager);
       JXL_RETURN_IF_ERROR(EncodeFrame(memory_manager, all_params[task],
-                                      frame_info, metadata, frame_data, cms,
-                                      nullptr, &local_output, aux_out));
+                                      trial_frame_info, metadata, frame_data,
+                                      cms, nullptr, &local_output, aux_out));
       size[task] = local_output.CurrentPosition();
       return true;
     };
@@ -2507,32 +3145,36 @@ Status EncodeFrame(JxlMemoryManager* memory_manager,
                    ThreadPool* pool, BitWriter* writer, AuxOut* aux_out) {
   JxlEncoderChunkedFrameAdapter frame_data(ib.xsize(), ib.ysize(),
                                            ib.extra_channels().size());
-  std::vector<uint8_t> color;
+  // The buffers are not value-initialized, since the conversions below write
+  // every byte.
+  std::unique_ptr<uint8_t[]> color;
   if (ib.IsJPEG()) {
     frame_data.SetJPEGData(std::move(ib.jpeg_data));
   } else {
     uint32_t num_channels =
         ib.IsGray() && frame_info.ib_needs_color_transform ? 1 : 3;
     size_t stride = ib.xsize() * num_channels * 4;
-    color.resize(ib.ysize() * stride);
+    const size_t color_size = ib.ysize() * stride;
+    color.reset(new uint8_t[color_size]);
     JXL_RETURN_IF_ERROR(ConvertToExternal(
         ib, /*bits_per_sample=*/32, /*float_out=*/true, num_channels,
-        JXL_NATIVE_ENDIAN, stride, pool, color.data(), color.size(),
+        JXL_NATIVE_ENDIAN, stride, pool, color.get(), color_size,
         /*out_callback=*/{}, Orientation::kIdentity));
     JxlPixelFormat format{num_channels, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
-    frame_data.SetFromBuffer(0, color.data(), color.size(), format);
+    frame_data.SetFromBuffer(0, color.get(), color_size, format);
   }
   for (size_t ec = 0; ec < ib.extra_channels().size(); ++ec) {
     JxlPixelFormat ec_format{1, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
     size_t ec_stride = ib.xsize() * 4;
-    std::vector<uint8_t> ec_data(ib.ysize() * ec_stride);
+    const size_t ec_size = ib.ysize() * ec_stride;
+    std::unique_ptr<uint8_t[]> ec_data(new uint8_t[ec_size]);
     const ImageF* channel = &ib.extra_channels()[ec];
     JXL_RETURN_IF_ERROR(ConvertChannelsToExternal(
         &channel, 1,
         /*bits_per_sample=*/32,
-        /*float_out=*/true, JXL_NATIVE_ENDIAN, ec_stride, pool, ec_data.data(),
-        ec_data.size(), /*out_callback=*/{}, Orientation::kIdentity));
-    frame_data.SetFromBuffer(1 + ec, ec_data.data(), ec_data.size(), ec_format);
+        /*float_out=*/true, JXL_NATIVE_ENDIAN, ec_stride, pool, ec_data.get(),
+        ec_size, /*out_callback=*/{}, Orientation::kIdentity));
+    frame_data.SetFromBuffer(1 + ec, ec_data.get(), ec_size, ec_format);
   }
   FrameInfo fi = frame_info;
   fi.origin = ib.origin;
@@ -83,6 +83,9 @@ struct FrameInfo {
   // extra channel info and allows more options. The non-API cjxl leaves it
   // empty and relies on the default behavior.
   std::vector<BlendingInfo> extra_channel_blending_info;
+
+  // If not null, receives where the parts of the frame are in the output.
+  FrameProgressionOffsets* progression_offsets = nullptr;
 };
 
 // Checks and adjusts CompressParams when they are all initialized.
@@ -12,6 +12,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/status.h"
@@ -416,6 +417,20 @@ Status ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
                        AlignedMemory::Create(memory_manager, fmem_bytes));
   float* JXL_RESTRICT scratch_space =
       fmem.address<float>() + 3 * AcStrategy::kMaxCoeffArea;
+  // Transforms of the blocks of the group, in the order of the loop below.
+  float* cached_coeffs = nullptr;
+  bool fill_cache = false;
+  if (!enc_state->transform_cache.empty()) {
+    AlignedMemory& cache = enc_state->transform_cache[group_idx];
+    fill_cache = !cache;
+    if (fill_cache) {
+      JXL_ASSIGN_OR_RETURN(
+          cache, AlignedMemory::Create(memory_manager,
+                                       3 * xsize_blocks * ysize_blocks *
+                                           kDCTBlockSize * sizeof(float)));
+    }
+    cached_coeffs = cache.address<float>();
+  }
   {
     // Only use error diffusion in Squirrel mode or slower.
     const bool error_diffusion = cparams.speed_tier <= SpeedTier::kSquirrel;
@@ -476,11 +491,19 @@ Status ComputeCoefficients(size_t group_idx, PassesEncoderState* enc_state,
 
           // DCT Y channel, roundtrip-quantize it and set DC.
           int32_t quant_ac = row_quant_ac[bx];
-          for (size_t c : {0, 1, 2}) {
-            TransformFromPixels(acs.Strategy(), opsin_rows[c] + bx * kBlockDim,
-                                opsin_stride, coeffs_in + c * size,
-                                scratch_space);
+          if (cached_coeffs != nullptr && !fill_cache) {
+            memcpy(coeffs_in, cached_coeffs, 3 * size * sizeof(float));
+          } else {
+            for (size_t c : {0, 1, 2}) {
+              TransformFromPixels(acs.Strategy(),
+                                  opsin_rows[c] + bx * kBlockDim, opsin_stride,
+                                  coeffs_in + c * size, scratch_space);
+            }
+            if (fill_cache) {
+              memcpy(cached_coeffs, coeffs_in, 3 * size * sizeof(float));
+            }
           }
+          if (cached_coeffs != nullptr) cached_coeffs += 3 * size;
           DCFromLowestFrequencies(acs.Strategy(), coeffs_in + size,
                                   dc_rows[1] + bx, dc_stride);
 
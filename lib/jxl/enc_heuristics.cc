@@ -29,7 +29,6 @@
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
-#include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/chroma_from_luma.h"
 #include "lib/jxl/coeff_order.h"
 #include "lib/jxl/coeff_order_fwd.h"
@@ -38,9 +37,9 @@
 #include "lib/jxl/dec_cache.h"
 #include "lib/jxl/dec_group.h"
 #include "lib/jxl/dec_noise.h"
-#include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/enc_ac_strategy.h"
 #include "lib/jxl/enc_adaptive_quantization.h"
+#include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_chroma_from_luma.h"
 #include "lib/jxl/enc_gaborish.h"
@@ -230,6 +229,50 @@ Status FindBestDequantMatrices(JxlMemoryManager* memory_manager,
   return true;
 }
 
+// The speed tier at which the transforms and the color correlation of every
+// tile of kEncTileDimInBlocks blocks are searched, in raster order. With
+// adaptive_effort, the tiles where the detail of every block, as measured by
+// the masking of InitialQuantField, is below kFlatTileDetail times the
+// average of the frame use a speed tier two steps faster, but not faster than
+// kHare: the slower searches rarely find better transforms there.
+std::vector<SpeedTier> TileSpeedTiers(const CompressParams& cparams,
+                                      const ImageF& initial_quant_masking,
+                                      size_t xsize_tiles, size_t ysize_tiles) {
+  std::vector<SpeedTier> speed_tiers(xsize_tiles * ysize_tiles,
+                                     cparams.speed_tier);
+  if (!cparams.adaptive_effort || cparams.speed_tier >= SpeedTier::kHare ||
+      cparams.disable_perceptual_optimizations) {
+    return speed_tiers;
+  }
+  constexpr float kFlatTileDetail = 0.5f;
+  const SpeedTier flat_speed_tier = static_cast<SpeedTier>(std::min(
+      static_cast<int>(cparams.speed_tier) + 2,
+      static_cast<int>(SpeedTier::kHare)));
+  const size_t xsize = initial_quant_masking.xsize();
+  const size_t ysize = initial_quant_masking.ysize();
+  // The mask is the inverse of the local detail, offset by 0.001.
+  const auto detail = [](float mask) { return 1.0f / mask - 0.001f; };
+  std::vector<float> max_detail(speed_tiers.size());
+  double sum_detail = 0.0;
+  for (size_t by = 0; by < ysize; by++) {
+    const float* JXL_RESTRICT row = initial_quant_masking.ConstRow(by);
+    float* tile_row =
+        max_detail.data() + (by / kEncTileDimInBlocks) * xsize_tiles;
+    for (size_t bx = 0; bx < xsize; bx++) {
+      const float d = detail(row[bx]);
+      sum_detail += d;
+      float& tile_detail = tile_row[bx / kEncTileDimInBlocks];
+      tile_detail = std::max(tile_detail, d);
+    }
+  }
+  const float max_flat_detail =
+      kFlatTileDetail * sum_detail / std::max<size_t>(xsize * ysize, 1);
+  for (size_t i = 0; i < speed_tiers.size(); i++) {
+    if (max_detail[i] < max_flat_detail) speed_tiers[i] = flat_speed_tier;
+  }
+  return speed_tiers;
+}
+
 void StoreMin2(const float v, float& min1, float& min2) {
   if (v < min2) {
     if (v < min1) {
@@ -275,7 +318,8 @@ void CreateMask(const ImageF& image, ImageF& mask) {
 // by the decoder. Ringing is slightly reduced by clamping the values of the
 // resulting pixels within certain bounds of a small region in the original
 // image.
-Status DownsampleImage2_Sharper(const ImageF& input, ImageF* output) {
+Status DownsampleImage2_Sharper(const ImageF& input, ImageF* output,
+                                ThreadPool* pool) {
   const int64_t kernelx = 12;
   const int64_t kernely = 12;
   JxlMemoryManager* memory_manager = input.memory_manager();
@@ -343,7 +387,8 @@ Status DownsampleImage2_Sharper(const ImageF& input, ImageF* output) {
                                       box_downsample.ysize()));
   CreateMask(box_downsample, mask);
 
-  for (size_t y = 0; y < output->ysize(); y++) {
+  const auto process_row = [&](const uint32_t y,
+                               size_t /* thread */) -> Status {
     float* row_out = output->Row(y);
     const float* row_in[kernely];
     const float* row_mask = mask.Row(y);
@@ -399,13 +444,15 @@ Status DownsampleImage2_Sharper(const ImageF& input, ImageF* output) {
         row_out[x] = clip_max;
       }
     }
-  }
-  return true;
+    return true;
+  };
+  return RunOnPool(pool, 0, output->ysize(), ThreadPool::NoInit, process_row,
+                   "DownsampleImage2_Sharper");
 }
 
 }  // namespace
 
-Status DownsampleImage2_Sharper(Image3F* opsin) {
+Status DownsampleImage2_Sharper(Image3F* opsin, ThreadPool* pool) {
   // Allocate extra space to avoid a reallocation when padding.
   JxlMemoryManager* memory_manager = opsin->memory_manager();
   JXL_ASSIGN_OR_RETURN(
@@ -417,7 +464,7 @@ Status DownsampleImage2_Sharper(Image3F* opsin) {
 
   for (size_t c = 0; c < 3; c++) {
     JXL_RETURN_IF_ERROR(
-        DownsampleImage2_Sharper(opsin->Plane(c), &downsampled.Plane(c)));
+        DownsampleImage2_Sharper(opsin->Plane(c), &downsampled.Plane(c), pool));
   }
   *opsin = std::move(downsampled);
   return true;
@@ -457,63 +504,57 @@ const float kernel11[25] = {
     -0.00624645f, -0.02921014f, -0.04022174f, -0.03452303f, -0.01716200f,
 };
 
-// Does exactly the same as the Upsampler in dec_upsampler for 2x2 pixels, with
-// default CustomTransformData.
+// Does exactly the same as the Upsampler in dec_upsampler for output pixel
+// (x, y) of 2x2 upsampling, with default CustomTransformData.
 // TODO(lode): use Upsampler instead. However, it requires pre-initialization
 // and padding on the left side of the image which requires refactoring the
 // other code using this.
-void UpsampleImage(const ImageF& input, ImageF* output) {
+float UpsamplePixel(const ImageF& input, int64_t x, int64_t y) {
   int64_t xsize = input.xsize();
   int64_t ysize = input.ysize();
-  int64_t xsize2 = output->xsize();
-  int64_t ysize2 = output->ysize();
-  for (int64_t y = 0; y < ysize2; y++) {
-    for (int64_t x = 0; x < xsize2; x++) {
-      const auto* kernel = kernel00;
-      if ((x & 1) && (y & 1)) {
-        kernel = kernel11;
-      } else if (x & 1) {
-        kernel = kernel10;
-      } else if (y & 1) {
-        kernel = kernel01;
-      }
-      float sum = 0;
-      int64_t x2 = x / 2;
-      int64_t y2 = y / 2;
-
-      // get min and max values of the original image in the support
-      float min = std::numeric_limits<float>::max();
-      float max = std::numeric_limits<float>::min();
-
-      for (int64_t ky = 0; ky < kSize; ky++) {
-        for (int64_t kx = 0; kx < kSize; kx++) {
-          int64_t xi = x2 - kSize / 2 + kx;
-          int64_t yi = y2 - kSize / 2 + ky;
-          if (xi < 0) xi = 0;
-          if (xi >= xsize) xi = input.xsize() - 1;
-          if (yi < 0) yi = 0;
-          if (yi >= ysize) yi = input.ysize() - 1;
-          min = std::min<float>(min, input.Row(yi)[xi]);
-          max = std::max<float>(max, input.Row(yi)[xi]);
-        }
-      }
+  const auto* kernel = kernel00;
+  if ((x & 1) && (y & 1)) {
+    kernel = kernel11;
+  } else if (x & 1) {
+    kernel = kernel10;
+  } else if (y & 1) {
+    kernel = kernel01;
+  }
+  float sum = 0;
+  int64_t x2 = x / 2;
+  int64_t y2 = y / 2;
+
+  // get min and max values of the original image in the support
+  float min = std::numeric_limits<float>::max();
+  float max = std::numeric_limits<float>::min();
+
+  for (int64_t ky = 0; ky < kSize; ky++) {
+    for (int64_t kx = 0; kx < kSize; kx++) {
+      int64_t xi = x2 - kSize / 2 + kx;
+      int64_t yi = y2 - kSize / 2 + ky;
+      if (xi < 0) xi = 0;
+      if (xi >= xsize) xi = input.xsize() - 1;
+      if (yi < 0) yi = 0;
+      if (yi >= ysize) yi = input.ysize() - 1;
+      min = std::min<float>(min, input.Row(yi)[xi]);
+      max = std::max<float>(max, input.Row(yi)[xi]);
+    }
+  }
 
-      for (int64_t ky = 0; ky < kSize; ky++) {
-        for (int64_t kx = 0; kx < kSize; kx++) {
-          int64_t xi = x2 - kSize / 2 + kx;
-          int64_t yi = y2 - kSize / 2 + ky;
-          if (xi < 0) xi = 0;
-          if (xi >= xsize) xi = input.xsize() - 1;
-          if (yi < 0) yi = 0;
-          if (yi >= ysize) yi = input.ysize() - 1;
-          sum += input.Row(yi)[xi] * kernel[ky * kSize + kx];
-        }
-      }
-      output->Row(y)[x] = sum;
-      if (output->Row(y)[x] < min) output->Row(y)[x] = min;
-      if (output->Row(y)[x] > max) output->Row(y)[x] = max;
+  for (int64_t ky = 0; ky < kSize; ky++) {
+    for (int64_t kx = 0; kx < kSize; kx++) {
+      int64_t xi = x2 - kSize / 2 + kx;
+      int64_t yi = y2 - kSize / 2 + ky;
+      if (xi < 0) xi = 0;
+      if (xi >= xsize) xi = input.xsize() - 1;
+      if (yi < 0) yi = 0;
+      if (yi >= ysize) yi = input.ysize() - 1;
+      sum += input.Row(yi)[xi] * kernel[ky * kSize + kx];
     }
   }
+  if (sum < min) sum = min;
+  if (sum > max) sum = max;
+  return sum;
 }
 
 // Returns the derivative of Upsampler, with respect to input pixel x2, y2, to
@@ -539,122 +580,67 @@ float UpsamplerDeriv(int64_t x2, int64_t y2, int64_t x, int64_t y) {
   return kernel[ky * kSize + kx];
 }
 
-// Apply the derivative of the Upsampler to the input, reversing the effect of
-// its coefficients. The output image is 2x2 times smaller than the input.
-void AntiUpsample(const ImageF& input, ImageF* d) {
+// Applies the derivative of the Upsampler to the input, reversing the effect
+// of its coefficients, and returns pixel (x2, y2) of the result, which is 2x2
+// times smaller than the input.
+float AntiUpsamplePixel(const ImageF& input, int64_t x2, int64_t y2) {
   int64_t xsize = input.xsize();
   int64_t ysize = input.ysize();
-  int64_t xsize2 = d->xsize();
-  int64_t ysize2 = d->ysize();
   int64_t k0 = kSize - 1;
   int64_t k1 = kSize;
-  for (int64_t y2 = 0; y2 < ysize2; ++y2) {
-    auto* row = d->Row(y2);
-    for (int64_t x2 = 0; x2 < xsize2; ++x2) {
-      int64_t x0 = x2 * 2 - k0;
-      if (x0 < 0) x0 = 0;
-      int64_t x1 = x2 * 2 + k1 + 1;
-      if (x1 > xsize) x1 = xsize;
-      int64_t y0 = y2 * 2 - k0;
-      if (y0 < 0) y0 = 0;
-      int64_t y1 = y2 * 2 + k1 + 1;
-      if (y1 > ysize) y1 = ysize;
-
-      float sum = 0;
-      for (int64_t y = y0; y < y1; ++y) {
-        const auto* row_in = input.Row(y);
-        for (int64_t x = x0; x < x1; ++x) {
-          double deriv = UpsamplerDeriv(x2, y2, x, y);
-          sum += deriv * row_in[x];
-        }
-      }
-      row[x2] = sum;
+  int64_t x0 = x2 * 2 - k0;
+  if (x0 < 0) x0 = 0;
+  int64_t x1 = x2 * 2 + k1 + 1;
+  if (x1 > xsize) x1 = xsize;
+  int64_t y0 = y2 * 2 - k0;
+  if (y0 < 0) y0 = 0;
+  int64_t y1 = y2 * 2 + k1 + 1;
+  if (y1 > ysize) y1 = ysize;
+
+  float sum = 0;
+  for (int64_t y = y0; y < y1; ++y) {
+    const auto* row_in = input.Row(y);
+    for (int64_t x = x0; x < x1; ++x) {
+      double deriv = UpsamplerDeriv(x2, y2, x, y);
+      sum += deriv * row_in[x];
     }
   }
+  return sum;
 }
 
-// Element-wise multiplies two images.
-template <typename T>
-Status ElwiseMul(const Plane<T>& image1, const Plane<T>& image2,
-                 Plane<T>* out) {
-  const size_t xsize = image1.xsize();
-  const size_t ysize = image1.ysize();
-  JXL_ENSURE(xsize == image2.xsize());
-  JXL_ENSURE(ysize == image2.ysize());
-  JXL_ENSURE(xsize == out->xsize());
-  JXL_ENSURE(ysize == out->ysize());
-  for (size_t y = 0; y < ysize; ++y) {
-    const T* const JXL_RESTRICT row1 = image1.Row(y);
-    const T* const JXL_RESTRICT row2 = image2.Row(y);
-    T* const JXL_RESTRICT row_out = out->Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
-      row_out[x] = row1[x] * row2[x];
-    }
-  }
-  return true;
-}
-
-// Element-wise divides two images.
-template <typename T>
-Status ElwiseDiv(const Plane<T>& image1, const Plane<T>& image2,
-                 Plane<T>* out) {
-  const size_t xsize = image1.xsize();
-  const size_t ysize = image1.ysize();
-  JXL_ENSURE(xsize == image2.xsize());
-  JXL_ENSURE(ysize == image2.ysize());
-  JXL_ENSURE(xsize == out->xsize());
-  JXL_ENSURE(ysize == out->ysize());
-  for (size_t y = 0; y < ysize; ++y) {
-    const T* const JXL_RESTRICT row1 = image1.Row(y);
-    const T* const JXL_RESTRICT row2 = image2.Row(y);
-    T* const JXL_RESTRICT row_out = out->Row(y);
-    for (size_t x = 0; x < xsize; ++x) {
-      row_out[x] = row1[x] / row2[x];
+// Returns the value v of pixel (x, y) of the downsampled image, clamped
+// within the values of a small area of `initial` to prevent ringing.
+float ReduceRinging(const ImageF& initial, const ImageF& mask, int64_t x,
+                    int64_t y, float v) {
+  int64_t xsize2 = initial.xsize();
+  int64_t ysize2 = initial.ysize();
+  float min = initial.Row(y)[x];
+  float max = initial.Row(y)[x];
+  for (int64_t yi = -1; yi < 2; yi++) {
+    for (int64_t xi = -1; xi < 2; xi++) {
+      int64_t x2 = x + xi;
+      int64_t y2 = y + yi;
+      if (x2 < 0 || y2 < 0 || x2 >= xsize2 || y2 >= ysize2) continue;
+      min = std::min<float>(min, initial.Row(y2)[x2]);
+      max = std::max<float>(max, initial.Row(y2)[x2]);
     }
   }
-  return true;
-}
-
-void ReduceRinging(const ImageF& initial, const ImageF& mask, ImageF& down) {
-  int64_t xsize2 = down.xsize();
-  int64_t ysize2 = down.ysize();
 
-  for (size_t y = 0; y < down.ysize(); y++) {
-    const float* row_mask = mask.Row(y);
-    float* row_out = down.Row(y);
-    for (size_t x = 0; x < down.xsize(); x++) {
-      float v = down.Row(y)[x];
-      float min = initial.Row(y)[x];
-      float max = initial.Row(y)[x];
-      for (int64_t yi = -1; yi < 2; yi++) {
-        for (int64_t xi = -1; xi < 2; xi++) {
-          int64_t x2 = static_cast<int64_t>(x) + xi;
-          int64_t y2 = static_cast<int64_t>(y) + yi;
-          if (x2 < 0 || y2 < 0 || x2 >= xsize2 || y2 >= ysize2) continue;
-          min = std::min<float>(min, initial.Row(y2)[x2]);
-          max = std::max<float>(max, initial.Row(y2)[x2]);
-        }
-      }
-
-      row_out[x] = v;
-
-      // Clamp the pixel within the value  of a small area to prevent ringning.
-      // The mask determines how much to clamp, clamp more to reduce more
-      // ringing in smooth areas, clamp less in noisy areas to get more
-      // sharpness. Higher mask_multiplier gives less clamping, so less
-      // ringing reduction.
-      const constexpr float mask_multiplier = 2;
-      float a = row_mask[x] * mask_multiplier;
-      float clip_min = min - a;
-      float clip_max = max + a;
-      if (row_out[x] < clip_min) row_out[x] = clip_min;
-      if (row_out[x] > clip_max) row_out[x] = clip_max;
-    }
-  }
+  // The mask determines how much to clamp, clamp more to reduce more ringing
+  // in smooth areas, clamp less in noisy areas to get more sharpness. Higher
+  // mask_multiplier gives less clamping, so less ringing reduction.
+  const constexpr float mask_multiplier = 2;
+  float a = mask.Row(y)[x] * mask_multiplier;
+  float clip_min = min - a;
+  float clip_max = max + a;
+  if (v < clip_min) v = clip_min;
+  if (v > clip_max) v = clip_max;
+  return v;
 }
 
 // TODO(lode): move this to a separate file enc_downsample.cc
-Status DownsampleImage2_Iterative(const ImageF& orig, ImageF* output) {
+Status DownsampleImage2_Iterative(const ImageF& orig, ImageF* output,
+                                  ThreadPool* pool) {
   int64_t xsize = orig.xsize();
   int64_t ysize = orig.ysize();
   int64_t xsize2 = DivCeil(orig.xsize(), 2);
@@ -680,17 +666,14 @@ Status DownsampleImage2_Iterative(const ImageF& orig, ImageF* output) {
                      DivCeil(orig.ysize(), 2) + kBlockDim));
   JXL_RETURN_IF_ERROR(initial.ShrinkTo(initial.xsize() - kBlockDim,
                                        initial.ysize() - kBlockDim));
-  JXL_RETURN_IF_ERROR(DownsampleImage2_Sharper(orig, &initial));
+  JXL_RETURN_IF_ERROR(DownsampleImage2_Sharper(orig, &initial, pool));
 
   JXL_ASSIGN_OR_RETURN(
       ImageF down,
       ImageF::Create(memory_manager, initial.xsize(), initial.ysize()));
   JXL_RETURN_IF_ERROR(CopyImageTo(initial, &down));
-  JXL_ASSIGN_OR_RETURN(ImageF up, ImageF::Create(memory_manager, xsize, ysize));
   JXL_ASSIGN_OR_RETURN(ImageF corr,
                        ImageF::Create(memory_manager, xsize, ysize));
-  JXL_ASSIGN_OR_RETURN(ImageF corr2,
-                       ImageF::Create(memory_manager, xsize2, ysize2));
 
   // In the weights map, relatively higher values will allow less ringing but
   // also less sharpness. With all constant values, it optimizes equally
@@ -701,35 +684,85 @@ Status DownsampleImage2_Iterative(const ImageF& orig, ImageF* output) {
   // reducing ringing based on the mask, and taking clamping into account.
   JXL_ASSIGN_OR_RETURN(ImageF weights,
                        ImageF::Create(memory_manager, xsize, ysize));
-  for (size_t y = 0; y < weights.ysize(); y++) {
-    auto* row = weights.Row(y);
-    for (size_t x = 0; x < weights.xsize(); x++) {
-      row[x] = 1;
-    }
-  }
+  FillImage(1.0f, &weights);
   JXL_ASSIGN_OR_RETURN(ImageF weights2,
                        ImageF::Create(memory_manager, xsize2, ysize2));
-  AntiUpsample(weights, &weights2);
 
-  const size_t num_it = 3;
-  for (size_t it = 0; it < num_it; ++it) {
-    UpsampleImage(down, &up);
-    JXL_ASSIGN_OR_RETURN(corr, LinComb<float>(1, orig, -1, up));
-    JXL_RETURN_IF_ERROR(ElwiseMul(corr, weights, &corr));
-    AntiUpsample(corr, &corr2);
-    JXL_RETURN_IF_ERROR(ElwiseDiv(corr2, weights2, &corr2));
-
-    JXL_ASSIGN_OR_RETURN(down, LinComb<float>(1, down, 1, corr2));
-  }
+  // The pixels are processed in bands of kBandRows rows of the downsampled
+  // image, and of the 2 * kBandRows rows of the original image that they
+  // upsample to. Each iteration first computes the correction of the rows of
+  // the original image, then the update of the downsampled ones, whose
+  // support is within the adjacent bands. A band whose update is below
+  // kConvergedDelta is no longer updated, and its correction is only computed
+  // for the bands next to it.
+  constexpr int64_t kBandRows = 16;
+  constexpr float kConvergedDelta = 1e-5f;
+  const size_t num_bands = DivCeil(ysize2, kBandRows);
+  std::vector<uint8_t> converged(num_bands, 0);
+  const auto run_on_bands = [&](int64_t band_rows, int64_t num_rows,
+                                const char* caller, const auto& process_row) {
+    // Rows below `num_rows` of band `band`.
+    const auto process_band = [&](const uint32_t band,
+                                  size_t /* thread */) -> Status {
+      const int64_t y0 = band * band_rows;
+      const int64_t y1 = std::min(y0 + band_rows, num_rows);
+      for (int64_t y = y0; y < y1; y++) process_row(band, y);
+      return true;
+    };
+    return RunOnPool(pool, 0, num_bands, ThreadPool::NoInit, process_band,
+                     caller);
+  };
 
-  ReduceRinging(initial, mask, down);
+  JXL_RETURN_IF_ERROR(run_on_bands(
+      kBandRows, ysize2, "DownsampleWeights", [&](size_t, int64_t y2) {
+        float* JXL_RESTRICT row = weights2.Row(y2);
+        for (int64_t x2 = 0; x2 < xsize2; x2++) {
+          row[x2] = AntiUpsamplePixel(weights, x2, y2);
+        }
+      }));
 
-  // can't just use CopyImage, because the output image was prepared with
-  // padding.
-  for (size_t y = 0; y < down.ysize(); y++) {
-    for (size_t x = 0; x < down.xsize(); x++) {
-      float v = down.Row(y)[x];
-      output->Row(y)[x] = v;
+  const size_t num_it = 3;
+  std::vector<float> max_delta(num_bands);
+  for (size_t it = 0; it < num_it; ++it) {
+    const bool last = it + 1 == num_it;
+    JXL_RETURN_IF_ERROR(run_on_bands(
+        2 * kBandRows, ysize, "DownsampleCorrection",
+        [&](size_t band, int64_t y) {
+          if (converged[band] && (band == 0 || converged[band - 1]) &&
+              (band + 1 == num_bands || converged[band + 1])) {
+            return;
+          }
+          const float* JXL_RESTRICT row_orig = orig.Row(y);
+          const float* JXL_RESTRICT row_weights = weights.Row(y);
+          float* JXL_RESTRICT row_corr = corr.Row(y);
+          for (int64_t x = 0; x < xsize; x++) {
+            row_corr[x] =
+                (row_orig[x] - UpsamplePixel(down, x, y)) * row_weights[x];
+          }
+        }));
+    std::fill(max_delta.begin(), max_delta.end(), 0.0f);
+    JXL_RETURN_IF_ERROR(run_on_bands(
+        kBandRows, ysize2, "DownsampleUpdate", [&](size_t band, int64_t y2) {
+          float* JXL_RESTRICT row_down = down.Row(y2);
+          const float* JXL_RESTRICT row_weights2 = weights2.Row(y2);
+          if (!converged[band]) {
+            for (int64_t x2 = 0; x2 < xsize2; x2++) {
+              float delta = AntiUpsamplePixel(corr, x2, y2) / row_weights2[x2];
+              row_down[x2] += delta;
+              max_delta[band] = std::max(max_delta[band], std::abs(delta));
+            }
+          }
+          if (last) {
+            // Can't just use CopyImage, because the output image was
+            // prepared with padding.
+            float* JXL_RESTRICT row_out = output->Row(y2);
+            for (int64_t x2 = 0; x2 < xsize2; x2++) {
+              row_out[x2] = ReduceRinging(initial, mask, x2, y2, row_down[x2]);
+            }
+          }
+        }));
+    for (size_t band = 0; band < num_bands; band++) {
+      if (max_delta[band] < kConvergedDelta) converged[band] = 1;
     }
   }
   return true;
@@ -737,7 +770,7 @@ Status DownsampleImage2_Iterative(const ImageF& orig, ImageF* output) {
 
 }  // namespace
 
-Status DownsampleImage2_Iterative(Image3F* opsin) {
+Status DownsampleImage2_Iterative(Image3F* opsin, ThreadPool* pool) {
   JxlMemoryManager* memory_manager = opsin->memory_manager();
   // Allocate extra space to avoid a reallocation when padding.
   JXL_ASSIGN_OR_RETURN(
@@ -747,28 +780,9 @@ Status DownsampleImage2_Iterative(Image3F* opsin) {
   JXL_RETURN_IF_ERROR(downsampled.ShrinkTo(downsampled.xsize() - kBlockDim,
                                            downsampled.ysize() - kBlockDim));
 
-  JXL_ASSIGN_OR_RETURN(
-      Image3F rgb,
-      Image3F::Create(memory_manager, opsin->xsize(), opsin->ysize()));
-  OpsinParams opsin_params;  // TODO(user): use the ones that are actually used
-  opsin_params.Init(kDefaultIntensityTarget);
-  JXL_RETURN_IF_ERROR(
-      OpsinToLinear(*opsin, Rect(rgb), nullptr, &rgb, opsin_params));
-
-  JXL_ASSIGN_OR_RETURN(
-      ImageF mask,
-      ImageF::Create(memory_manager, opsin->xsize(), opsin->ysize()));
-  ButteraugliParams butter_params;
-  JXL_ASSIGN_OR_RETURN(std::unique_ptr<ButteraugliComparator> butter,
-                       ButteraugliComparator::Make(rgb, butter_params));
-  JXL_RETURN_IF_ERROR(butter->Mask(&mask));
-  JXL_ASSIGN_OR_RETURN(
-      ImageF mask_fuzzy,
-      ImageF::Create(memory_manager, opsin->xsize(), opsin->ysize()));
-
   for (size_t c = 0; c < 3; c++) {
-    JXL_RETURN_IF_ERROR(
-        DownsampleImage2_Iterative(opsin->Plane(c), &downsampled.Plane(c)));
+    JXL_RETURN_IF_ERROR(DownsampleImage2_Iterative(
+        opsin->Plane(c), &downsampled.Plane(c), pool));
   }
   *opsin = std::move(downsampled);
   return true;
@@ -815,6 +829,7 @@ StatusOr<Image3F> ReconstructImage(
   options.coalescing = false;
   options.render_spotcolors = false;
   options.render_noise = true;
+  options.defer_rendering = false;
 
   JXL_RETURN_IF_ERROR(dec_state.PreparePipeline(
       frame_header, &shared.metadata->m, &decoded, options));
@@ -1050,6 +1065,7 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
   if (!streaming_mode &&
       ApplyOverride(cparams.patches,
                     cparams.speed_tier <= SpeedTier::kSquirrel)) {
+    PhaseTimer timer(aux_out, EncoderPhase::Patches);
     JXL_RETURN_IF_ERROR(
         FindBestPatchDictionary(*opsin, enc_state, cms, pool, aux_out));
     JXL_RETURN_IF_ERROR(
@@ -1111,11 +1127,18 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
     if (!frame_header.loop_filter.gab) {
       butteraugli_distance_for_iqf *= 0.62f;
     }
+    // Splines and patches are subtracted from the image that is analysed.
+    FrameAnalysisCache* analysis_cache =
+        !streaming_mode && !image_features.splines.HasAny() &&
+                !image_features.patches.HasAny()
+            ? cparams.analysis_cache.get()
+            : nullptr;
+    PhaseTimer timer(aux_out, EncoderPhase::AdaptiveQuantization);
     JXL_ASSIGN_OR_RETURN(
         initial_quant_field,
         InitialQuantField(butteraugli_distance_for_iqf, *opsin, rect, pool,
                           1.0f, &initial_quant_masking,
-                          &initial_quant_masking1x1));
+                          &initial_quant_masking1x1, analysis_cache));
     float q = 0.39 / cparams.butteraugli_distance;
     quantizer.ComputeGlobalScaleAndQuant(quant_dc, q, 0);
   }
@@ -1139,13 +1162,23 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
         memory_manager, cparams, modular_frame_encoder, &matrices));
   }
 
+  // The tiles choose the block sizes and the CfL map, whose share of the time
+  // of the tiles is moved to its phase.
+  PhaseTimer acs_timer(aux_out, EncoderPhase::AcStrategy);
+  std::vector<uint64_t> tile_us;
+  std::vector<uint64_t> cfl_us;
   JXL_RETURN_IF_ERROR(cfl_heuristics.Init(rect));
   JXL_RETURN_IF_ERROR(acs_heuristics.Init(*opsin, rect, initial_quant_field,
                                           initial_quant_masking,
                                           initial_quant_masking1x1, &matrices));
 
+  const size_t n_enc_tiles =
+      DivCeil(frame_dim.xsize_blocks, kEncTileDimInBlocks);
+  const std::vector<SpeedTier> tile_speed_tiers = TileSpeedTiers(
+      cparams, initial_quant_masking, n_enc_tiles,
+      DivCeil(frame_dim.ysize_blocks, kEncTileDimInBlocks));
+
   auto process_tile = [&](const uint32_t tid, const size_t thread) -> Status {
-    size_t n_enc_tiles = DivCeil(frame_dim.xsize_blocks, kEncTileDimInBlocks);
     size_t tx = tid % n_enc_tiles;
     size_t ty = tid / n_enc_tiles;
     size_t by0 = ty * kEncTileDimInBlocks;
@@ -1156,19 +1189,27 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
         std::min((tx + 1) * kEncTileDimInBlocks, frame_dim.xsize_blocks);
     Rect r(bx0, by0, bx1 - bx0, by1 - by0);
 
+    const SpeedTier speed_tier = tile_speed_tiers[tid];
+    const bool timed = aux_out != nullptr;
+    const uint64_t tile_start = timed ? PhaseTimer::WallNow() : 0;
+
     // For speeds up to Wombat, we only compute the color correlation map
     // once we know the transform type and the quantization map.
-    if (cparams.speed_tier <= SpeedTier::kSquirrel) {
+    const bool have_dct8 = speed_tier <= SpeedTier::kSquirrel;
+    if (have_dct8) {
+      const uint64_t cfl_start = timed ? PhaseTimer::WallNow() : 0;
       JXL_RETURN_IF_ERROR(cfl_heuristics.ComputeTile(
           r, *opsin, rect, matrices,
           /*ac_strategy=*/nullptr,
           /*raw_quant_field=*/nullptr,
           /*quantizer=*/nullptr, /*fast=*/false, thread, &cmap));
+      if (timed) cfl_us[thread] += PhaseTimer::WallNow() - cfl_start;
     }
 
-    // Choose block sizes.
-    JXL_RETURN_IF_ERROR(
-        acs_heuristics.ProcessRect(r, cmap, &ac_strategy, thread));
+    // Choose block sizes, with the DCT8 coefficients of the first CfL pass.
+    JXL_RETURN_IF_ERROR(acs_heuristics.ProcessRect(
+        r, cmap, &ac_strategy, thread, speed_tier,
+        have_dct8 ? cfl_heuristics.Dct8Coefficients(thread) : nullptr));
 
     // Always set the initial quant field, so we can compute the CfL map with
     // more accuracy. The initial quant field might change in slower modes, but
@@ -1179,22 +1220,35 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
     quantizer.SetQuantFieldRect(initial_quant_field, r, &raw_quant_field);
 
     // Compute a non-default CfL map if we are at Hare speed, or slower.
-    if (cparams.speed_tier <= SpeedTier::kHare) {
+    if (speed_tier <= SpeedTier::kHare) {
+      const uint64_t cfl_start = timed ? PhaseTimer::WallNow() : 0;
       JXL_RETURN_IF_ERROR(cfl_heuristics.ComputeTile(
           r, *opsin, rect, matrices, &ac_strategy, &raw_quant_field, &quantizer,
-          /*fast=*/cparams.speed_tier >= SpeedTier::kWombat, thread, &cmap));
+          /*fast=*/speed_tier >= SpeedTier::kWombat, thread, &cmap,
+          /*reuse_dct8=*/have_dct8));
+      if (timed) cfl_us[thread] += PhaseTimer::WallNow() - cfl_start;
     }
+    if (timed) tile_us[thread] += PhaseTimer::WallNow() - tile_start;
     return true;
   };
-  size_t num_tiles = DivCeil(frame_dim.xsize_blocks, kEncTileDimInBlocks) *
-                     DivCeil(frame_dim.ysize_blocks, kEncTileDimInBlocks);
+  size_t num_tiles = tile_speed_tiers.size();
   const auto prepare = [&](const size_t num_threads) -> Status {
-    JXL_RETURN_IF_ERROR(acs_heuristics.PrepareForThreads(num_threads));
+    JXL_RETURN_IF_ERROR(acs_heuristics.PrepareForThreads(pool));
     JXL_RETURN_IF_ERROR(cfl_heuristics.PrepareForThreads(num_threads));
+    tile_us.assign(num_threads, 0);
+    cfl_us.assign(num_threads, 0);
     return true;
   };
   JXL_RETURN_IF_ERROR(
       RunOnPool(pool, 0, num_tiles, prepare, process_tile, "Enc Heuristics"));
+  const uint64_t total_tile_us =
+      std::accumulate(tile_us.begin(), tile_us.end(), uint64_t{0});
+  if (total_tile_us != 0) {
+    acs_timer.MoveFraction(
+        EncoderPhase::ChromaFromLuma,
+        std::accumulate(cfl_us.begin(), cfl_us.end(), uint64_t{0}) * 1.0 /
+            total_tile_us);
+  }
 
   JXL_RETURN_IF_ERROR(acs_heuristics.Finalize(frame_dim, ac_strategy, aux_out));
 
@@ -1202,6 +1256,7 @@ Status LossyFrameHeuristics(const FrameHeader& frame_header,
   if (!streaming_mode && !cparams.disable_perceptual_optimizations) {
     ImageB& epf_sharpness = shared.epf_sharpness;
     FillPlane(static_cast<uint8_t>(4), &epf_sharpness, Rect(epf_sharpness));
+    PhaseTimer timer(aux_out, EncoderPhase::AdaptiveQuantization);
     JXL_RETURN_IF_ERROR(FindBestQuantizer(frame_header, linear, *opsin,
                                           initial_quant_field, enc_state, cms,
                                           pool, aux_out));
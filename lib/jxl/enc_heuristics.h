@@ -43,8 +43,8 @@ Status ComputeARHeuristics(const FrameHeader& frame_header,
 
 void FindBestBlockEntropyModel(PassesEncoderState& enc_state);
 
-Status DownsampleImage2_Iterative(Image3F* opsin);
-Status DownsampleImage2_Sharper(Image3F* opsin);
+Status DownsampleImage2_Iterative(Image3F* opsin, ThreadPool* pool);
+Status DownsampleImage2_Sharper(Image3F* opsin, ThreadPool* pool);
 
 }  // namespace jxl
 
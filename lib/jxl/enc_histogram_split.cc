@@ -0,0 +1,96 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/enc_histogram_split.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+
+#include "lib/jxl/ans_params.h"
+#include "lib/jxl/base/status.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/enc_histogram_split.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/fast_math-inl.h"
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Eq;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::Max;
+
+const HWY_FULL(float) df;
+const HWY_FULL(int32_t) di;
+
+size_t HistogramSplitAlignment() { return Lanes(df); }
+
+// Compute entropy of the histogram, taking into account the minimum probability
+// for symbols with non-zero counts.
+float EstimateHistogramBits(const int32_t* counts, size_t num_symbols) {
+  int32_t total = std::accumulate(counts, counts + num_symbols, 0);
+  const auto zero = Zero(df);
+  const auto minprob = Set(df, 1.0f / ANS_TAB_SIZE);
+  const auto inv_total = Set(df, 1.0f / total);
+  auto bits_lanes = Zero(df);
+  auto total_v = Set(di, total);
+  for (size_t i = 0; i < num_symbols; i += Lanes(df)) {
+    const auto counts_iv = LoadU(di, &counts[i]);
+    const auto counts_fv = ConvertTo(df, counts_iv);
+    const auto probs = Mul(counts_fv, inv_total);
+    const auto mprobs = Max(probs, minprob);
+    const auto nbps = IfThenElse(Eq(counts_iv, total_v), BitCast(di, zero),
+                                 BitCast(di, FastLog2f(df, mprobs)));
+    bits_lanes = Sub(bits_lanes, Mul(counts_fv, BitCast(df, nbps)));
+  }
+  return GetLane(SumOfLanes(df, bits_lanes));
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(HistogramSplitAlignment);
+HWY_EXPORT(EstimateHistogramBits);
+
+size_t HistogramSplitAlignment() {
+  return HWY_DYNAMIC_DISPATCH(HistogramSplitAlignment)();
+}
+
+float EstimateHistogramBits(const int32_t* counts, size_t num_symbols) {
+  return HWY_DYNAMIC_DISPATCH(EstimateHistogramBits)(counts, num_symbols);
+}
+
+void HistogramSplitter::Reset(const int32_t* counts, size_t num_symbols,
+                              size_t extra_bits) {
+  num_symbols_ = num_symbols;
+  right_.assign(counts, counts + num_symbols);
+  left_.assign(num_symbols, 0);
+  left_extra_bits_ = 0;
+  total_extra_bits_ = extra_bits;
+}
+
+void HistogramSplitter::MoveToLeft(int32_t* bucket, size_t extra_bits) {
+  left_extra_bits_ += extra_bits;
+  JXL_DASSERT(left_extra_bits_ <= total_extra_bits_);
+  for (size_t sym = 0; sym < num_symbols_; sym++) {
+    right_[sym] -= bucket[sym];
+    left_[sym] += bucket[sym];
+  }
+  memset(bucket, 0, num_symbols_ * sizeof(*bucket));
+}
+
+}  // namespace jxl
+#endif  // HWY_ONCE
@@ -0,0 +1,68 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_ENC_HISTOGRAM_SPLIT_H_
+#define LIB_JXL_ENC_HISTOGRAM_SPLIT_H_
+
+// Estimation of the cost of coding a set of samples from the histogram of their
+// tokens, and incremental evaluation of the ways to split such a set in two.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace jxl {
+
+// The number of symbols of the histograms passed to the functions below must
+// be a multiple of this.
+size_t HistogramSplitAlignment();
+
+// Returns the estimated number of bits of coding the tokens counted in
+// "counts", which has "num_symbols" entries, with ANS: their entropy, where
+// every symbol has a probability of at least 1 / ANS_TAB_SIZE.
+float EstimateHistogramBits(const int32_t* counts, size_t num_symbols);
+
+// Cost model of a HistogramSplitter: the estimated number of bits of the
+// tokens of a histogram, without their extra bits.
+using HistogramCostFunc = float (*)(const int32_t* counts, size_t num_symbols);
+
+// Evaluates the splits of a set of samples in two, given as buckets that are
+// moved one at a time from the right side to the left one, e.g. the samples
+// with each value of a property in increasing order. Since only the histograms
+// of the sides change, evaluating a split costs O(num_symbols), however many
+// samples the buckets have.
+class HistogramSplitter {
+ public:
+  explicit HistogramSplitter(HistogramCostFunc cost = &EstimateHistogramBits)
+      : cost_(cost) {}
+
+  // Puts all the samples on the right side. "counts" is their histogram, with
+  // "num_symbols" entries, and "extra_bits" their total number of extra bits.
+  void Reset(const int32_t* counts, size_t num_symbols, size_t extra_bits);
+
+  // Moves a bucket of samples, with histogram "bucket" and "extra_bits" extra
+  // bits, to the left side. Clears "bucket", so that it can be filled again.
+  void MoveToLeft(int32_t* bucket, size_t extra_bits);
+
+  float LeftCost() const {
+    return cost_(left_.data(), num_symbols_) + left_extra_bits_;
+  }
+  float RightCost() const {
+    return cost_(right_.data(), num_symbols_) + total_extra_bits_ -
+           left_extra_bits_;
+  }
+
+ private:
+  HistogramCostFunc cost_;
+  size_t num_symbols_ = 0;
+  std::vector<int32_t> left_;
+  std::vector<int32_t> right_;
+  size_t left_extra_bits_ = 0;
+  size_t total_extra_bits_ = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_ENC_HISTOGRAM_SPLIT_H_
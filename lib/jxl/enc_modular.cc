@@ -17,6 +17,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <memory>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -39,6 +40,7 @@
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_cluster.h"
+#include "lib/jxl/enc_decode_cost.h"
 #include "lib/jxl/enc_fields.h"
 #include "lib/jxl/enc_gaborish.h"
 #include "lib/jxl/enc_params.h"
@@ -142,6 +144,8 @@ void QuantizeChannel(Channel& ch, const int q) {
   }
 }
 
+}  // namespace
+
 // convert binary32 float that corresponds to custom [bits]-bit float (with
 // [exp_bits] exponent bits) to a [bits]-bit integer representation that should
 // fit in pixel_type
@@ -218,6 +222,8 @@ Status float_to_int(const float* const row_in, pixel_type* const row_out,
   return true;
 }
 
+namespace {
+
 float EstimateWPCost(const Image& img, size_t i) {
   size_t extra_bits = 0;
   float histo_cost = 0;
@@ -269,7 +275,10 @@ float EstimateWPCost(const Image& img, size_t i) {
   return histo_cost + extra_bits;
 }
 
-float EstimateCost(const Image& img) {
+// Estimated cost of the rows y of `img` with y % row_step == row_offset, each
+// predicted from the rows above it.
+float EstimateCost(const Image& img, size_t row_step = 1,
+                   size_t row_offset = 0) {
   // TODO(veluca): consider SIMDfication of this code.
   size_t extra_bits = 0;
   float histo_cost = 0;
@@ -280,7 +289,7 @@ float EstimateCost(const Image& img) {
   Histogram histo[nc] = {};
   for (const Channel& ch : img.channel) {
     const intptr_t onerow = ch.plane.PixelsPerRow();
-    for (size_t y = 0; y < ch.h; y++) {
+    for (size_t y = row_offset; y < ch.h; y += row_step) {
       const pixel_type* JXL_RESTRICT r = ch.Row(y);
       for (size_t x = 0; x < ch.w; x++) {
         pixel_type_w left = (x ? r[x - 1] : y ? *(r + x - onerow) : 0);
@@ -467,9 +476,32 @@ Status ModularFrameEncoder::Init(const FrameHeader& frame_header,
                                  bool streaming_mode) {
   frame_dim_ = frame_header.ToFrameDimensions();
   cparams_ = cparams_orig;
+  can_use_tree_cache_ = cparams_.modular_tree_cache != nullptr &&
+                        frame_header.encoding == FrameEncoding::kModular &&
+                        frame_header.frame_type == FrameType::kRegularFrame &&
+                        cparams_.ModularPartIsLossless() && !streaming_mode;
+
+  if (cparams_.decoding_budget > 0.0f &&
+      frame_header.encoding == FrameEncoding::kModular) {
+    const float budget_ns = cparams_.decoding_budget *
+                            frame_dim_.xsize_upsampled *
+                            frame_dim_.ysize_upsampled;
+    modular_budget_ns_ = std::max(
+        0.0f,
+        budget_ns - EstimateFrameDecodeNs(frame_header, /*patch_pixels=*/0));
+    may_drop_wp_ = cparams_orig.options.predictor == kUndefinedPredictor;
+  }
 
   size_t num_streams =
       ModularStreamId::Num(frame_dim_, frame_header.passes.num_passes);
+  // The local trees of the streams are cached for frames with the same
+  // streams as the one that filled the cache.
+  if (can_use_tree_cache_) {
+    std::vector<StreamTreeCache>& streams =
+        cparams_.modular_tree_cache->streams;
+    if (streams.empty()) streams.resize(num_streams);
+    use_stream_tree_cache_ = streams.size() == num_streams;
+  }
   if (cparams_.ModularPartIsLossless()) {
     switch (cparams_.decoding_speed_tier) {
       case 0:
@@ -682,6 +714,7 @@ Status ModularFrameEncoder::ComputeEncodingData(
   if (do_color && metadata.bit_depth.bits_per_sample <= 16 &&
       cparams_.speed_tier < SpeedTier::kCheetah &&
       cparams_.decoding_speed_tier < 2 && !groupwise) {
+    PhaseTimer timer(aux_out, EncoderPhase::Patches);
     JXL_RETURN_IF_ERROR(FindBestPatchDictionary(
         *color, enc_state, cms, nullptr, aux_out,
         cparams_.color_transform == ColorTransform::kXYB));
@@ -1037,12 +1070,15 @@ Status ModularFrameEncoder::ComputeEncodingData(
     }
     JXL_RETURN_IF_ERROR(PrepareStreamParams(
         stream_params_[i].rect, cparams_, stream_params_[i].minShift,
-        stream_params_[i].maxShift, stream_params_[i].id, do_color, groupwise));
+        stream_params_[i].maxShift, stream_params_[i].id, do_color, groupwise,
+        pool));
     return true;
   };
-  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, stream_params_.size(),
-                                ThreadPool::NoInit, process_row,
-                                "ChooseParams"));
+  // Nestable, so that the threads left idle by frames of few groups help
+  // with the RCT search of the others.
+  JXL_RETURN_IF_ERROR(RunNestableOnPool(pool, 0, stream_params_.size(),
+                                        ThreadPool::NoInit, process_row,
+                                        "ChooseParams"));
   {
     // Clear out channels that have been copied to groups.
     Image& full_image = stream_images_[0];
@@ -1061,7 +1097,16 @@ Status ModularFrameEncoder::ComputeEncodingData(
   return true;
 }
 
+float ModularFrameEncoder::EstimatedDecodeNs() const {
+  return EstimateModularDecodeNs(ComputeTreeDecodeCost(tree_), num_samples_,
+                                 code().lz77.enabled);
+}
+
 Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
+  num_samples_ = 0;
+  for (const Image& image : stream_images_) {
+    for (const Channel& ch : image.channel) num_samples_ += ch.w * ch.h;
+  }
   std::vector<ModularMultiplierInfo> multiplier_info;
   if (!quants_.empty()) {
     for (uint32_t stream_id = 0; stream_id < stream_images_.size();
@@ -1120,8 +1165,15 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
     multiplier_info.resize(new_num);
   }
 
+  ModularTreeCache* cache =
+      can_use_tree_cache_ && multiplier_info.empty()
+          ? cparams_.modular_tree_cache.get()
+          : nullptr;
   if (!cparams_.custom_fixed_tree.empty()) {
     tree_ = cparams_.custom_fixed_tree;
+    cache = nullptr;
+  } else if (cache && !cache->tree.empty()) {
+    tree_ = cache->tree;
   } else if (cparams_.speed_tier < SpeedTier::kFalcon ||
              !cparams_.modular_mode) {
     // Avoid creating a tree with leaves that don't correspond to any pixels.
@@ -1196,19 +1248,34 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
                                    &tree_samples, &total_pixels));
       }
 
-      // TODO(veluca): parallelize more.
       JXL_ASSIGN_OR_RETURN(
           trees[chunk],
           LearnTree(std::move(tree_samples), total_pixels,
-                    stream_options_[start], multiplier_info, range));
+                    stream_options_[start], multiplier_info, range, pool));
       return true;
     };
-    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, useful_splits.size() - 1,
-                                  ThreadPool::NoInit, process_chunk,
-                                  "LearnTrees"));
-    tree_.clear();
-    JXL_RETURN_IF_ERROR(
-        MergeTrees(trees, useful_splits, 0, useful_splits.size() - 1, &tree_));
+    const auto learn_trees = [&]() -> Status {
+      // There are often fewer chunks than threads, so let tree learning fold
+      // its own parallel work into this call.
+      JXL_RETURN_IF_ERROR(RunNestableOnPool(pool, 0, useful_splits.size() - 1,
+                                            ThreadPool::NoInit, process_chunk,
+                                            "LearnTrees"));
+      tree_.clear();
+      return MergeTrees(trees, useful_splits, 0, useful_splits.size() - 1,
+                        &tree_);
+    };
+    JXL_RETURN_IF_ERROR(learn_trees());
+    // The weighted predictor costs the decoder more than anything else in a
+    // tree, so a tree over the decoding budget is learned again without it.
+    if (modular_budget_ns_ >= 0.0f && may_drop_wp_ &&
+        EstimatedDecodeNs() > modular_budget_ns_ &&
+        ComputeTreeDecodeCost(tree_).uses_wp) {
+      for (ModularOptions& options : stream_options_) {
+        options.predictor = Predictor::Gradient;
+        options.wp_tree_mode = ModularOptions::TreeMode::kNoWP;
+      }
+      JXL_RETURN_IF_ERROR(learn_trees());
+    }
   } else {
     // Fixed tree.
     size_t total_pixels = 0;
@@ -1230,12 +1297,11 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
       tree_ = {PropertyDecisionNode::Leaf(Predictor::Gradient)};
     }
   }
-  tree_tokens_.resize(1);
-  tree_tokens_[0].clear();
-  Tree decoded_tree;
-  JXL_RETURN_IF_ERROR(TokenizeTree(tree_, tree_tokens_.data(), &decoded_tree));
-  JXL_ENSURE(tree_.size() == decoded_tree.size());
-  tree_ = std::move(decoded_tree);
+  JXL_RETURN_IF_ERROR(StoreTree());
+  if (cache) {
+    if (cache->tree.empty()) cache->tree = tree_;
+    tree_cache_ = cache;
+  }
 
   /* TODO(szabadka) Add text output callback to cparams
   if (kPrintTree && WantDebugOutput(aux_out)) {
@@ -1249,6 +1315,85 @@ Status ModularFrameEncoder::ComputeTree(ThreadPool* pool) {
   return true;
 }
 
+Status ModularFrameEncoder::StoreTree() {
+  tree_tokens_.resize(1);
+  tree_tokens_[0].clear();
+  Tree decoded_tree;
+  JXL_RETURN_IF_ERROR(TokenizeTree(tree_, tree_tokens_.data(), &decoded_tree));
+  JXL_ENSURE(tree_.size() == decoded_tree.size());
+  tree_ = std::move(decoded_tree);
+  return true;
+}
+
+Status ModularFrameEncoder::AddStreamingPropertySamples() {
+  if (!streaming_tree_samples_) {
+    streaming_tree_samples_ = jxl::make_unique<StreamingTreeSamples>();
+    StreamingTreeSamples& samples = *streaming_tree_samples_;
+    samples.options = stream_options_[0];
+    // Splits on the group id would not carry over to the groups that are not
+    // sampled.
+    std::vector<uint32_t>& properties =
+        samples.options.splitting_heuristics_properties;
+    properties.erase(std::remove(properties.begin(), properties.end(), 1),
+                     properties.end());
+    JXL_RETURN_IF_ERROR(samples.tree_samples.SetPredictor(
+        samples.options.predictor, samples.options.wp_tree_mode));
+    JXL_RETURN_IF_ERROR(samples.tree_samples.SetProperties(
+        properties, samples.options.wp_tree_mode));
+  }
+  StreamingTreeSamples& samples = *streaming_tree_samples_;
+  JXL_ENSURE(!samples.properties_quantized);
+  // Stream 0 only holds the channels that are copied to the groups.
+  for (uint32_t i = 1; i < stream_images_.size(); i++) {
+    if (stream_images_[i].empty()) continue;
+    samples.max_c =
+        std::max<uint32_t>(stream_images_[i].channel.size(), samples.max_c);
+    CollectPixelSamples(stream_images_[i], stream_options_[i], i,
+                        samples.group_pixel_count, samples.channel_pixel_count,
+                        samples.pixel_samples, samples.diff_samples);
+  }
+  return true;
+}
+
+Status ModularFrameEncoder::AddStreamingTreeSamples() {
+  JXL_ENSURE(streaming_tree_samples_);
+  StreamingTreeSamples& samples = *streaming_tree_samples_;
+  if (!samples.properties_quantized) {
+    StaticPropRange range;
+    range[0] = {{0, samples.max_c}};
+    range[1] = {{0, static_cast<uint32_t>(stream_images_.size())}};
+    samples.tree_samples.PreQuantizeProperties(
+        range, /*multiplier_info=*/{}, samples.group_pixel_count,
+        samples.channel_pixel_count, samples.pixel_samples,
+        samples.diff_samples, samples.options.max_property_values);
+    samples.pixel_samples = std::vector<pixel_type>();
+    samples.diff_samples = std::vector<pixel_type>();
+    samples.properties_quantized = true;
+  }
+  for (uint32_t i = 1; i < stream_images_.size(); i++) {
+    if (stream_images_[i].empty()) continue;
+    JXL_RETURN_IF_ERROR(ModularGenericCompress(
+        stream_images_[i], stream_options_[i], /*writer=*/nullptr,
+        /*aux_out=*/nullptr, LayerType::Header, i, &samples.tree_samples,
+        &samples.total_pixels));
+  }
+  return true;
+}
+
+Status ModularFrameEncoder::ComputeStreamingTree(ThreadPool* pool) {
+  JXL_ENSURE(streaming_tree_samples_);
+  std::unique_ptr<StreamingTreeSamples> samples =
+      std::move(streaming_tree_samples_);
+  JXL_ENSURE(samples->properties_quantized);
+  StaticPropRange range;
+  range[0] = {{0, samples->max_c}};
+  range[1] = {{0, static_cast<uint32_t>(stream_images_.size())}};
+  JXL_ASSIGN_OR_RETURN(
+      tree_, LearnTree(std::move(samples->tree_samples), samples->total_pixels,
+                       samples->options, /*multiplier_info=*/{}, range, pool));
+  return StoreTree();
+}
+
 Status ModularFrameEncoder::ComputeTokens(ThreadPool* pool) {
   size_t num_streams = stream_images_.size();
   stream_headers_.resize(num_streams);
@@ -1256,8 +1401,9 @@ Status ModularFrameEncoder::ComputeTokens(ThreadPool* pool) {
   image_widths_.resize(num_streams);
   const auto process_stream = [&](const uint32_t stream_id,
                                   size_t /* thread */) -> Status {
-    AuxOut my_aux_out;
     tokens_[stream_id].clear();
+    if (stream_images_[stream_id].channel.empty()) return true;
+    AuxOut my_aux_out;
     JXL_RETURN_IF_ERROR(ModularGenericCompress(
         stream_images_[stream_id], stream_options_[stream_id],
         /*writer=*/nullptr, &my_aux_out, LayerType::Header, stream_id,
@@ -1275,6 +1421,7 @@ Status ModularFrameEncoder::ComputeTokens(ThreadPool* pool) {
 
 Status ModularFrameEncoder::EncodeGlobalInfo(bool streaming_mode,
                                              BitWriter* writer,
+                                             ThreadPool* pool,
                                              AuxOut* aux_out) {
   JxlMemoryManager* memory_manager = writer->memory_manager();
   bool skip_rest = false;
@@ -1294,6 +1441,7 @@ Status ModularFrameEncoder::EncodeGlobalInfo(bool streaming_mode,
   // Write tree
   HistogramParams params =
       HistogramParams::ForModular(cparams_, extra_dc_precision, streaming_mode);
+  params.pool = pool;
   {
     EntropyEncodingData tree_code;
     std::vector<uint8_t> tree_context_map;
@@ -1307,14 +1455,24 @@ Status ModularFrameEncoder::EncodeGlobalInfo(bool streaming_mode,
                                     tree_context_map, 0, writer,
                                     LayerType::ModularTree, aux_out));
   }
-  params.streaming_mode = streaming_mode;
-  params.add_missing_symbols = streaming_mode;
+  if (tree_cache_ && !tree_cache_->context_map.empty()) {
+    return EncodeHistograms(tree_cache_->context_map, tree_cache_->code,
+                            writer, LayerType::ModularGlobal, aux_out);
+  }
+  // Histograms stored in the cache must code any image without LZ77, and be
+  // kept encoded so that they can be written again, as in streaming mode.
+  params.streaming_mode = streaming_mode || tree_cache_;
+  params.add_missing_symbols = streaming_mode || tree_cache_;
+  if (tree_cache_) params.lz77_method = HistogramParams::LZ77Method::kNone;
   params.image_widths = image_widths_;
+  EntropyEncodingData* code = tree_cache_ ? &tree_cache_->code : &code_;
+  std::vector<uint8_t>* context_map =
+      tree_cache_ ? &tree_cache_->context_map : &context_map_;
   // Write histograms.
   JXL_ASSIGN_OR_RETURN(
       size_t cost,
       BuildAndEncodeHistograms(memory_manager, params, (tree_.size() + 1) / 2,
-                               tokens_, &code_, &context_map_, writer,
+                               tokens_, code, context_map, writer,
                                LayerType::ModularGlobal, aux_out));
   (void)cost;
   return true;
@@ -1329,14 +1487,22 @@ Status ModularFrameEncoder::EncodeStream(BitWriter* writer, AuxOut* aux_out,
     return true;  // Image with no channels, header never gets decoded.
   }
   if (tokens_.empty()) {
+    // Local trees are cached per stream.
+    StreamTreeCache* stream_cache =
+        use_stream_tree_cache_ && stream_options_[stream_id].tree_kind ==
+                                      ModularOptions::TreeKind::kLearn
+            ? &cparams_.modular_tree_cache->streams[stream_id]
+            : nullptr;
     JXL_RETURN_IF_ERROR(ModularGenericCompress(
         stream_images_[stream_id], stream_options_[stream_id], writer, aux_out,
-        layer, stream_id));
+        layer, stream_id, /*tree_samples=*/nullptr, /*total_pixels=*/nullptr,
+        /*tree=*/nullptr, /*header=*/nullptr, /*tokens=*/nullptr,
+        /*widths=*/nullptr, stream_cache));
   } else {
     JXL_RETURN_IF_ERROR(
         Bundle::Write(stream_headers_[stream_id], writer, layer, aux_out));
-    JXL_RETURN_IF_ERROR(WriteTokens(tokens_[stream_id], code_, context_map_, 0,
-                                    writer, layer, aux_out));
+    JXL_RETURN_IF_ERROR(WriteTokens(tokens_[stream_id], code(), context_map(),
+                                    0, writer, layer, aux_out));
   }
   return true;
 }
@@ -1345,6 +1511,8 @@ void ModularFrameEncoder::ClearStreamData(const ModularStreamId& stream) {
   size_t stream_id = stream.ID(frame_dim_);
   Image empty_image(stream_images_[stream_id].memory_manager());
   std::swap(stream_images_[stream_id], empty_image);
+  if (stream_id < tokens_.size()) tokens_[stream_id] = std::vector<Token>();
+  if (stream_id < gi_channel_.size()) gi_channel_[stream_id].clear();
 }
 
 void ModularFrameEncoder::ClearModularStreamData() {
@@ -1369,7 +1537,8 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
                                                 const CompressParams& cparams,
                                                 int minShift, int maxShift,
                                                 const ModularStreamId& stream,
-                                                bool do_color, bool groupwise) {
+                                                bool do_color, bool groupwise,
+                                                ThreadPool* pool) {
   size_t stream_id = stream.ID(frame_dim_);
   if (stream_id == 0 && frame_dim_.num_groups != 1) {
     // If we have multiple groups, then the stream with ID 0 holds the full
@@ -1465,8 +1634,7 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
         nb_rcts_to_try = 19;
         break;
     }
-    float best_cost = std::numeric_limits<float>::max();
-    size_t best_rct = 0;
+    std::vector<int> rcts;
     // These should be 19 actually different transforms; the remaining ones
     // are equivalent to one of these (note that the first two are do-nothing
     // and YCoCg) modulo channel reordering (which only matters in the case of
@@ -1475,22 +1643,55 @@ Status ModularFrameEncoder::PrepareStreamParams(const Rect& rect,
                   5 * 7 + 5, 1 * 7 + 5, 2 * 7 + 5, 1 * 7 + 1, 0 * 7 + 4,
                   1 * 7 + 2, 2 * 7 + 1, 2 * 7 + 2, 2 * 7 + 3, 4 * 7 + 4,
                   4 * 7 + 5, 0 * 7 + 2, 0 * 7 + 1, 0 * 7 + 3}) {
-      if (nb_rcts_to_try == 0) break;
-      sg.rct_type = i;
-      nb_rcts_to_try--;
-      if (do_transform(gi, sg, weighted::Header())) {
-        float cost = EstimateCost(gi);
-        if (cost < best_cost) {
-          best_rct = i;
-          best_cost = cost;
+      if (rcts.size() == nb_rcts_to_try) break;
+      rcts.push_back(i);
+    }
+    // Returns, for each of `row_offsets`, the index in rcts of the RCT with
+    // the lowest estimated cost on the rows y with y % row_step == offset.
+    const auto find_best_rcts = [&](size_t row_step,
+                                    const std::vector<size_t>& row_offsets)
+        -> StatusOr<std::vector<size_t>> {
+      // Indexed by RCT, then by offset. The RCTs that do not apply cost the
+      // most.
+      std::vector<std::vector<float>> costs(
+          rcts.size(), std::vector<float>(row_offsets.size(),
+                                          std::numeric_limits<float>::max()));
+      const auto estimate_rct = [&](const uint32_t i,
+                                    size_t /* thread */) -> Status {
+        JXL_ASSIGN_OR_RETURN(Image candidate, Image::Clone(gi));
+        Transform t = sg;
+        t.rct_type = rcts[i];
+        if (!do_transform(candidate, t, weighted::Header())) return true;
+        for (size_t k = 0; k < row_offsets.size(); k++) {
+          costs[i][k] = EstimateCost(candidate, row_step, row_offsets[k]);
+        }
+        return true;
+      };
+      JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, rcts.size(), ThreadPool::NoInit,
+                                    estimate_rct, "EstimateRCTs"));
+      std::vector<size_t> best(row_offsets.size(), 0);
+      for (size_t k = 0; k < row_offsets.size(); k++) {
+        for (size_t i = 1; i < rcts.size(); i++) {
+          if (costs[i][k] < costs[best[k]][k]) best[k] = i;
         }
-        Transform t = gi.transform.back();
-        JXL_RETURN_IF_ERROR(t.Inverse(gi, weighted::Header(), nullptr));
-        gi.transform.pop_back();
       }
+      return best;
+    };
+    // Below effort 9, tall enough groups compare the RCTs on two disjoint
+    // samples of their rows. When the samples do not agree on the best RCT,
+    // they do not represent the group and all the rows are used instead.
+    constexpr size_t kRowSampleStep = 8;
+    std::vector<size_t> best_rct = {0};
+    if (cparams.speed_tier > SpeedTier::kTortoise &&
+        ysize >= 8 * kRowSampleStep && rcts.size() > 1) {
+      JXL_ASSIGN_OR_RETURN(best_rct, find_best_rcts(kRowSampleStep,
+                                                    {0, kRowSampleStep / 2}));
+    }
+    if (best_rct.size() != 2 || best_rct[0] != best_rct[1]) {
+      JXL_ASSIGN_OR_RETURN(best_rct, find_best_rcts(1, {0}));
     }
     // Apply the best RCT to the image for future encoding.
-    sg.rct_type = best_rct;
+    sg.rct_type = rcts.empty() ? 0 : rcts[best_rct[0]];
     do_transform(gi, sg, weighted::Header());
   } else {
     // No need to try anything, just use the default options.
@@ -11,6 +11,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
@@ -27,6 +28,8 @@
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
+#include "lib/jxl/modular/encoding/enc_encoding.h"
+#include "lib/jxl/modular/encoding/enc_ma.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/options.h"
@@ -37,6 +40,22 @@ namespace jxl {
 struct AuxOut;
 enum class LayerType : uint8_t;
 
+// Tree and histograms learned by the first lossless modular frame encoded with
+// CompressParams::modular_tree_cache, which the frames after it reuse: they
+// skip tree learning and histogram building, at the cost of a slightly larger
+// size. The histograms give a non-zero probability to every symbol, so that
+// they can code the tokens of any image. Frames that use a global tree share
+// `tree`, and frames that use local trees share those of `streams`, per
+// stream, when they have as many streams as the frame that filled them.
+// Frames encoded in streaming mode neither fill nor use the cache. A cache
+// must not be used by two encoders at the same time.
+struct ModularTreeCache {
+  Tree tree;
+  EntropyEncodingData code;
+  std::vector<uint8_t> context_map;
+  std::vector<StreamTreeCache> streams;
+};
+
 class ModularFrameEncoder {
  public:
   static StatusOr<ModularFrameEncoder> Create(
@@ -51,9 +70,23 @@ class ModularFrameEncoder {
       bool do_color);
   Status ComputeTree(ThreadPool* pool);
   Status ComputeTokens(ThreadPool* pool);
-  // Encodes global info (tree + histograms) in the `writer`.
+  // Learns a global tree in streaming mode, where only one DC group is in
+  // memory at a time. Every sampled DC group must be passed to
+  // AddStreamingPropertySamples before any of them is passed to
+  // AddStreamingTreeSamples; ComputeStreamingTree then learns the tree from the
+  // samples, and ComputeTokens uses it for the DC groups that come after.
+  Status AddStreamingPropertySamples();
+  Status AddStreamingTreeSamples();
+  Status ComputeStreamingTree(ThreadPool* pool);
+  bool HasTree() const { return !tree_.empty(); }
+  // Estimated decoding time of the modular streams of the frame with the tree
+  // of ComputeTree, and the entropy code of EncodeGlobalInfo once it ran. 0 in
+  // streaming mode.
+  float EstimatedDecodeNs() const;
+  // Encodes global info (tree + histograms) in the `writer`. The histograms
+  // are clustered on `pool`.
   Status EncodeGlobalInfo(bool streaming_mode, BitWriter* writer,
-                          AuxOut* aux_out);
+                          ThreadPool* pool, AuxOut* aux_out);
   // Encodes a specific modular image (identified by `stream`) in the `writer`,
   // assigning bits to the provided `layer`.
   Status EncodeStream(BitWriter* writer, AuxOut* aux_out, LayerType layer,
@@ -61,6 +94,12 @@ class ModularFrameEncoder {
 
   void ClearStreamData(const ModularStreamId& stream);
   void ClearModularStreamData();
+  // Drops the histograms built by EncodeGlobalInfo, which extends them, so
+  // that the streams can be encoded again after they changed.
+  void ClearEntropyCodes() {
+    code_ = EntropyEncodingData();
+    context_map_.clear();
+  }
   size_t ComputeStreamingAbsoluteAcGroupId(
       size_t dc_group_id, size_t ac_group_id,
       const FrameDimensions& patch_dim) const;
@@ -102,7 +141,19 @@ class ModularFrameEncoder {
   Status PrepareStreamParams(const Rect& rect, const CompressParams& cparams,
                              int minShift, int maxShift,
                              const ModularStreamId& stream, bool do_color,
-                             bool groupwise);
+                             bool groupwise, ThreadPool* pool);
+  // Tokenizes `tree_` into `tree_tokens_` and replaces it with the tree that
+  // the decoder reads back.
+  Status StoreTree();
+  // The entropy code of the modular streams: the one of `tree_cache_` if the
+  // frame uses it, the one learned for the frame otherwise.
+  const EntropyEncodingData& code() const {
+    return tree_cache_ ? tree_cache_->code : code_;
+  }
+  const std::vector<uint8_t>& context_map() const {
+    return tree_cache_ ? tree_cache_->context_map : context_map_;
+  }
+
   JxlMemoryManager* memory_manager_;
   std::vector<Image> stream_images_;
   std::vector<ModularOptions> stream_options_;
@@ -119,6 +170,34 @@ class ModularFrameEncoder {
   std::vector<size_t> tree_splits_;
   std::vector<std::vector<uint32_t>> gi_channel_;
   std::vector<size_t> image_widths_;
+  // Whether CompressParams::modular_tree_cache applies to the frame, whether
+  // its local trees go through the cache of their stream, and the cache once
+  // the frame fills or reuses its global tree.
+  bool can_use_tree_cache_ = false;
+  bool use_stream_tree_cache_ = false;
+  ModularTreeCache* tree_cache_ = nullptr;
+  // Part of CompressParams::decoding_budget left to the modular streams of a
+  // modular frame, or -1 if there is no budget to fit, and whether the tree
+  // may be learned again without the weighted predictor to fit it, which is
+  // only done when no predictor was set.
+  float modular_budget_ns_ = -1.0f;
+  bool may_drop_wp_ = false;
+  // Number of samples of the modular streams, counted by ComputeTree.
+  size_t num_samples_ = 0;
+
+  // Samples of the streaming tree, see AddStreamingPropertySamples.
+  struct StreamingTreeSamples {
+    TreeSamples tree_samples;
+    ModularOptions options;
+    std::vector<pixel_type> pixel_samples;
+    std::vector<pixel_type> diff_samples;
+    std::vector<uint32_t> group_pixel_count;
+    std::vector<uint32_t> channel_pixel_count;
+    uint32_t max_c = 0;
+    size_t total_pixels = 0;
+    bool properties_quantized = false;
+  };
+  std::unique_ptr<StreamingTreeSamples> streaming_tree_samples_;
 
   struct GroupParams {
     Rect rect;
@@ -129,6 +208,13 @@ class ModularFrameEncoder {
   std::vector<GroupParams> stream_params_;
 };
 
+// Converts the floats of `row_in`, which must be representable as [bits]-bit
+// floats with [exp_bits] exponent bits if `fp` is true, to the integers that
+// modular images store for them. Integer samples are scaled by `dfactor`.
+Status float_to_int(const float* row_in, pixel_type* row_out, size_t xsize,
+                    unsigned int bits, unsigned int exp_bits, bool fp,
+                    double dfactor);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_ENC_MODULAR_H_
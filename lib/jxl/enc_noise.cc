@@ -14,6 +14,7 @@
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_bit_writer.h"
@@ -26,6 +27,14 @@ namespace {
 
 using OptimizeArray = optimize::Array<double, NoiseParams::kNumNoisePoints>;
 
+// The size of a patch in decoder might be different from encoder's patch
+// size.
+// For encoder: the patch size should be big enough to estimate
+//              noise level, but, at the same time, it should be not too big
+//              to be able to estimate intensity value of the patch
+constexpr size_t kPatchSize = 8;
+constexpr size_t kNumBin = 256;
+
 float GetScoreSumsOfAbsoluteDifferences(const Image3F& opsin, const int x,
                                         const int y, const int block_size) {
   const int small_bl_size_x = 3;
@@ -232,11 +241,9 @@ void OptimizeNoiseParameters(const std::vector<NoiseLevel>& noise_level,
   }
 }
 
-std::vector<NoiseLevel> GetNoiseLevel(
-    const Image3F& opsin, const std::vector<float>& texture_strength,
-    const float threshold, const size_t block_s) {
-  std::vector<NoiseLevel> noise_level_per_intensity;
-
+// Mean intensity and noise level of the block_s x block_s patch at (x, y).
+NoiseLevel GetPatchNoiseLevel(const Image3F& opsin, const size_t x,
+                              const size_t y, const size_t block_s) {
   const int filt_size = 1;
   static const float kLaplFilter[filt_size * 2 + 1][filt_size * 2 + 1] = {
       {-0.25f, -1.0f, -0.25f},
@@ -246,74 +253,81 @@ std::vector<NoiseLevel> GetNoiseLevel(
 
   // The noise model is built based on channel 0.5 * (X+Y) as we notice that it
   // is similar to the model 0.5 * (Y-X)
-  size_t patch_index = 0;
 
-  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
-    for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
-      if (texture_strength[patch_index] <= threshold) {
-        // Calculate mean value
-        float mean_int = 0;
-        for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
-          for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
-            mean_int += 0.5f * (opsin.PlaneRow(1, y + y_bl)[x + x_bl] +
-                                opsin.PlaneRow(0, y + y_bl)[x + x_bl]);
+  // Calculate mean value
+  float mean_int = 0;
+  for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
+    for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
+      mean_int += 0.5f * (opsin.PlaneRow(1, y + y_bl)[x + x_bl] +
+                          opsin.PlaneRow(0, y + y_bl)[x + x_bl]);
+    }
+  }
+  mean_int /= block_s * block_s;
+
+  // Calculate Noise level
+  float noise_level = 0;
+  size_t count = 0;
+  for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
+    for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
+      float filtered_value = 0;
+      for (int y_f = -1 * filt_size; y_f <= filt_size; ++y_f) {
+        if ((static_cast<ssize_t>(y_bl) + y_f) >= 0 && (y_bl + y_f) < block_s) {
+          for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
+            if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
+                (x_bl + x_f) < block_s) {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl + x_f] +
+                   opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl + x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            } else {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl - x_f] +
+                   opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl - x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            }
           }
-        }
-        mean_int /= block_s * block_s;
-
-        // Calculate Noise level
-        float noise_level = 0;
-        size_t count = 0;
-        for (size_t y_bl = 0; y_bl < block_s; ++y_bl) {
-          for (size_t x_bl = 0; x_bl < block_s; ++x_bl) {
-            float filtered_value = 0;
-            for (int y_f = -1 * filt_size; y_f <= filt_size; ++y_f) {
-              if ((static_cast<ssize_t>(y_bl) + y_f) >= 0 &&
-                  (y_bl + y_f) < block_s) {
-                for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
-                  if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
-                      (x_bl + x_f) < block_s) {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl + x_f] +
-                         opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl + x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  } else {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl + y_f)[x + x_bl - x_f] +
-                         opsin.PlaneRow(0, y + y_bl + y_f)[x + x_bl - x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  }
-                }
-              } else {
-                for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
-                  if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
-                      (x_bl + x_f) < block_s) {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl + x_f] +
-                         opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl + x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  } else {
-                    filtered_value +=
-                        0.5f *
-                        (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl - x_f] +
-                         opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl - x_f]) *
-                        kLaplFilter[y_f + filt_size][x_f + filt_size];
-                  }
-                }
-              }
+        } else {
+          for (int x_f = -1 * filt_size; x_f <= filt_size; ++x_f) {
+            if ((static_cast<ssize_t>(x_bl) + x_f) >= 0 &&
+                (x_bl + x_f) < block_s) {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl + x_f] +
+                   opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl + x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
+            } else {
+              filtered_value +=
+                  0.5f *
+                  (opsin.PlaneRow(1, y + y_bl - y_f)[x + x_bl - x_f] +
+                   opsin.PlaneRow(0, y + y_bl - y_f)[x + x_bl - x_f]) *
+                  kLaplFilter[y_f + filt_size][x_f + filt_size];
             }
-            noise_level += std::abs(filtered_value);
-            ++count;
           }
         }
-        noise_level /= count;
-        NoiseLevel nl;
-        nl.intensity = mean_int;
-        nl.noise_level = noise_level;
-        noise_level_per_intensity.push_back(nl);
+      }
+      noise_level += std::abs(filtered_value);
+      ++count;
+    }
+  }
+  noise_level /= count;
+  NoiseLevel nl;
+  nl.intensity = mean_int;
+  nl.noise_level = noise_level;
+  return nl;
+}
+
+std::vector<NoiseLevel> GetNoiseLevel(
+    const Image3F& opsin, const std::vector<float>& texture_strength,
+    const float threshold, const size_t block_s) {
+  std::vector<NoiseLevel> noise_level_per_intensity;
+  size_t patch_index = 0;
+  for (size_t y = 0; y + block_s <= opsin.ysize(); y += block_s) {
+    for (size_t x = 0; x + block_s <= opsin.xsize(); x += block_s) {
+      if (texture_strength[patch_index] <= threshold) {
+        noise_level_per_intensity.push_back(
+            GetPatchNoiseLevel(opsin, x, y, block_s));
       }
       ++patch_index;
     }
@@ -329,36 +343,73 @@ Status EncodeFloatParam(float val, float precision, BitWriter* writer) {
   return true;
 }
 
+// If threshold is too large, the image has a strong pattern. This pattern
+// fools our model and it will add too much noise. Therefore, we do not add
+// noise for such images
+bool IsUsableSADThreshold(const float sad_threshold) {
+  return sad_threshold <= 0.15f && sad_threshold > 0.0f;
+}
+
+// Noise parameters that fit the levels of the flat patches.
+Status NoiseParamsFromLevels(const std::vector<NoiseLevel>& nl,
+                             NoiseParams* noise_params, float quality_coef) {
+  if (nl.empty()) {
+    noise_params->Clear();
+    return false;
+  }
+
+  OptimizeNoiseParameters(nl, noise_params);
+  for (float& i : noise_params->lut) {
+    i *= quality_coef * 1.4;
+  }
+  return noise_params->HasAny();
+}
+
 }  // namespace
 
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
                          float quality_coef) {
-  // The size of a patch in decoder might be different from encoder's patch
-  // size.
-  // For encoder: the patch size should be big enough to estimate
-  //              noise level, but, at the same time, it should be not too big
-  //              to be able to estimate intensity value of the patch
-  const size_t block_s = 8;
-  const size_t kNumBin = 256;
   NoiseHistogram sad_histogram;
   std::vector<float> sad_scores =
-      GetSADScoresForPatches(opsin, block_s, kNumBin, &sad_histogram);
+      GetSADScoresForPatches(opsin, kPatchSize, kNumBin, &sad_histogram);
   float sad_threshold = GetSADThreshold(sad_histogram, kNumBin);
-  // If threshold is too large, the image has a strong pattern. This pattern
-  // fools our model and it will add too much noise. Therefore, we do not add
-  // noise for such images
-  if (sad_threshold > 0.15f || sad_threshold <= 0.0f) {
+  if (!IsUsableSADThreshold(sad_threshold)) {
     noise_params->Clear();
     return false;
   }
-  std::vector<NoiseLevel> nl =
-      GetNoiseLevel(opsin, sad_scores, sad_threshold, block_s);
+  return NoiseParamsFromLevels(
+      GetNoiseLevel(opsin, sad_scores, sad_threshold, kPatchSize), noise_params,
+      quality_coef);
+}
 
-  OptimizeNoiseParameters(nl, noise_params);
-  for (float& i : noise_params->lut) {
-    i *= quality_coef * 1.4;
+void NoiseEstimator::AddImage(const Image3F& opsin, const Rect& rect) {
+  for (size_t y = rect.y0(); y + kPatchSize <= rect.y0() + rect.ysize();
+       y += kPatchSize) {
+    for (size_t x = rect.x0(); x + kPatchSize <= rect.x0() + rect.xsize();
+         x += kPatchSize) {
+      sad_scores_.push_back(GetScoreSumsOfAbsoluteDifferences(
+          opsin, static_cast<int>(x), static_cast<int>(y), kPatchSize));
+      noise_levels_.push_back(GetPatchNoiseLevel(opsin, x, y, kPatchSize));
+    }
   }
-  return noise_params->HasAny();
+}
+
+Status NoiseEstimator::GetNoiseParameter(NoiseParams* noise_params,
+                                         float quality_coef) const {
+  NoiseHistogram sad_histogram;
+  for (float sad_score : sad_scores_) {
+    sad_histogram.Increment(sad_score * kNumBin);
+  }
+  float sad_threshold = GetSADThreshold(sad_histogram, kNumBin);
+  if (!IsUsableSADThreshold(sad_threshold)) {
+    noise_params->Clear();
+    return false;
+  }
+  std::vector<NoiseLevel> nl;
+  for (size_t i = 0; i < sad_scores_.size(); ++i) {
+    if (sad_scores_[i] <= sad_threshold) nl.push_back(noise_levels_[i]);
+  }
+  return NoiseParamsFromLevels(nl, noise_params, quality_coef);
 }
 
 Status EncodeNoise(const NoiseParams& noise_params, BitWriter* writer,
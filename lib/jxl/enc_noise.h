@@ -9,7 +9,9 @@
 // Noise parameter estimation.
 
 #include <cstdint>
+#include <vector>
 
+#include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/image.h"
@@ -25,6 +27,25 @@ enum class LayerType : uint8_t;
 Status GetNoiseParameter(const Image3F& opsin, NoiseParams* noise_params,
                          float quality_coef);
 
+// Estimates the noise parameters from images added one at a time, e.g. crops
+// of a frame that is not in memory at once, as GetNoiseParameter does from
+// a single image. Only keeps the statistics of their 8x8 patches, 12 bytes per
+// patch.
+class NoiseEstimator {
+ public:
+  // Adds the whole 8x8 patches of `rect` of `opsin`.
+  void AddImage(const Image3F& opsin, const Rect& rect);
+
+  // Same as GetNoiseParameter, from the patches of all the images added.
+  Status GetNoiseParameter(NoiseParams* noise_params,
+                           float quality_coef) const;
+
+ private:
+  // Texture strength and noise level of each patch.
+  std::vector<float> sad_scores_;
+  std::vector<NoiseLevel> noise_levels_;
+};
+
 // Does not write anything if `noise_params` are empty. Otherwise, caller must
 // set FrameHeader.flags.kNoise.
 Status EncodeNoise(const NoiseParams& noise_params, BitWriter* writer,
@@ -12,6 +12,7 @@
 #include <jxl/encode.h>
 #include <stddef.h>
 
+#include <memory>
 #include <vector>
 
 #include "lib/jxl/base/override.h"
@@ -25,6 +26,10 @@
 
 namespace jxl {
 
+struct EntropyCodingCache;
+struct FrameAnalysisCache;
+struct ModularTreeCache;
+
 // NOLINTNEXTLINE(clang-analyzer-optin.performance.Padding)
 struct CompressParams {
   float butteraugli_distance = 1.0f;
@@ -42,6 +47,11 @@ struct CompressParams {
   SpeedTier speed_tier = SpeedTier::kSquirrel;
   int brotli_effort = -1;
 
+  // Whether the butteraugli iterations compare large images approximately, at
+  // half resolution and in sampled tiles, which is faster but changes the
+  // output. Default: off.
+  Override approximate_butteraugli = Override::kDefault;
+
   // 0 = default.
   // 1 = slightly worse quality.
   // 4 = fastest speed, lowest quality
@@ -72,6 +82,11 @@ struct CompressParams {
   // Put center groups first in the bitstream.
   bool centerfirst = false;
 
+  // Put the groups of VarDCT frames with the finest adaptive quantization,
+  // where the encoder expects the errors to be most visible, first in the
+  // bitstream. Other frames use the center-first order.
+  bool salientfirst = false;
+
   // Pixel coordinates of the center. First group will contain that center.
   size_t center_x = static_cast<size_t>(-1);
   size_t center_y = static_cast<size_t>(-1);
@@ -163,6 +178,28 @@ struct CompressParams {
 
   float quant_ac_rescale = 1.0;
 
+  // If positive, the AC quantization of VarDCT frames is scaled so that they
+  // get close to this many bytes. See JXL_ENC_FRAME_SETTING_TARGET_SIZE.
+  size_t target_size = 0;
+
+  // If positive, the encoder turns off the features that slow down the
+  // decoder until the frame is estimated to decode in this many nanoseconds
+  // per pixel on one thread. See JXL_ENC_FRAME_SETTING_DECODING_BUDGET.
+  float decoding_budget = 0.0f;
+
+  // The AC strategy search does not try the transforms covering a square of
+  // 32x32 or 64x64 pixels, or its halves, when at least this fraction of its
+  // 8x8 blocks is best coded with an 8x8 transform other than DCT8X8. This
+  // makes the search faster but changes its result, so it is disabled by
+  // default, as are all values above 1.
+  float large_transform_max_detail = 2.0f;
+
+  // If true, the 64x64 tiles of lossy VarDCT frames that are much flatter than
+  // the rest of the frame choose their transforms and color correlation at a
+  // faster speed tier than speed_tier, but not faster than kHare. See
+  // JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT.
+  bool adaptive_effort = false;
+
   // Codestream level to conform to.
   // -1: don't care
   int level = -1;
@@ -181,6 +218,18 @@ struct CompressParams {
   // If not empty, these custom splines will be used instead of the computed
   // ones. Used in jxl_from_tee tool.
   Splines custom_splines;
+  // If not null, the first lossless modular frame encoded with this cache
+  // stores the tree and histograms it learns in it, and the frames after it
+  // reuse them instead of learning their own. See ModularTreeCache.
+  std::shared_ptr<ModularTreeCache> modular_tree_cache;
+  // If not null, the first VarDCT frame encoded with this cache stores the
+  // analysis that does not depend on the distance in it, and the encodes of
+  // the same frame at other distances reuse it. See FrameAnalysisCache.
+  std::shared_ptr<FrameAnalysisCache> analysis_cache;
+  // If not null, VarDCT frames reuse the coefficient orders and the clustering
+  // of the AC histograms of the previous frame encoded with this cache when
+  // they are similar, as in animations. See EntropyCodingCache.
+  std::shared_ptr<EntropyCodingCache> entropy_coding_cache;
   // If not null, overrides progressive mode settings. Used in decode_test.
   const ProgressiveMode* custom_progressive_mode = nullptr;
 
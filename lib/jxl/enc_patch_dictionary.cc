@@ -14,6 +14,8 @@
 #include <cmath>
 #include <cstdint>
 #include <cstdlib>
+#include <iterator>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -223,6 +225,18 @@ struct PatchColorspaceInfo {
   }
 };
 
+// Hash of the size and the quantized pixels of a patch.
+uint64_t HashPatch(const QuantizedPatch& patch) {
+  uint64_t hash = patch.xsize * 0x9E3779B97F4A7C15ull + patch.ysize;
+  const size_t num_pixels = patch.xsize * patch.ysize;
+  for (const auto& pixels : patch.pixels) {
+    for (size_t i = 0; i < num_pixels; i++) {
+      hash = (hash ^ static_cast<uint8_t>(pixels[i])) * 0x100000001B3ull;
+    }
+  }
+  return hash;
+}
+
 StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
     const CompressParams& cparams, const Image3F& opsin,
     const PassesEncoderState* JXL_RESTRICT state, ThreadPool* pool,
@@ -408,7 +422,6 @@ StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
   queue.clear();
 
   ImageF ccs;
-  Rng rng(0);
   bool paint_ccs = false;
   if (WantDebugOutput(cparams)) {
     JXL_RETURN_IF_ERROR(
@@ -438,119 +451,155 @@ StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
   constexpr int kHasSimilarRadius = 2;
 
   // Find small CC outside the "similar enough" areas, compute bounding boxes,
-  // and run heuristics to exclude some patches.
-  JXL_ASSIGN_OR_RETURN(
-      ImageB visited,
-      ImageB::Create(memory_manager, frame_dim.xsize, frame_dim.ysize));
-  ZeroFillImage(&visited);
-  uint8_t* JXL_RESTRICT visited_row = visited.Row(0);
-  const size_t visited_stride = visited.PixelsPerRow();
-  std::vector<std::pair<uint32_t, uint32_t>> cc;
-  std::vector<std::pair<uint32_t, uint32_t>> stack;
-  for (size_t y = 0; y < frame_dim.ysize; y++) {
-    for (size_t x = 0; x < frame_dim.xsize; x++) {
-      if (is_background_row[y * is_background_stride + x]) continue;
-      cc.clear();
-      stack.clear();
-      stack.emplace_back(x, y);
-      size_t min_x = x;
-      size_t max_x = x;
-      size_t min_y = y;
-      size_t max_y = y;
-      std::pair<uint32_t, uint32_t> reference;
-      bool found_border = false;
-      bool all_similar = true;
-      while (!stack.empty()) {
-        std::pair<uint32_t, uint32_t> cur = stack.back();
-        stack.pop_back();
-        if (visited_row[cur.second * visited_stride + cur.first]) continue;
-        visited_row[cur.second * visited_stride + cur.first] = 1;
-        if (cur.first < min_x) min_x = cur.first;
-        if (cur.first > max_x) max_x = cur.first;
-        if (cur.second < min_y) min_y = cur.second;
-        if (cur.second > max_y) max_y = cur.second;
-        if (paint_ccs) {
-          cc.push_back(cur);
-        }
-        for (int dx = -kSearchRadius; dx <= kSearchRadius; dx++) {
-          for (int dy = -kSearchRadius; dy <= kSearchRadius; dy++) {
-            if (dx == 0 && dy == 0) continue;
-            int next_first = static_cast<int32_t>(cur.first) + dx;
-            int next_second = static_cast<int32_t>(cur.second) + dy;
-            if (next_first < 0 || next_second < 0 ||
-                static_cast<uint32_t>(next_first) >= frame_dim.xsize ||
-                static_cast<uint32_t>(next_second) >= frame_dim.ysize) {
-              continue;
-            }
-            std::pair<uint32_t, uint32_t> next{next_first, next_second};
-            if (!is_background_row[next.second * is_background_stride +
-                                   next.first]) {
-              stack.push_back(next);
-            } else {
-              if (!found_border) {
-                reference = next;
-                found_border = true;
+  // and run heuristics to exclude some patches. Every stripe of group_dim rows
+  // is searched by its own task for the CCs whose first row it contains. The
+  // CCs that can become patches are less than kMaxPatchSize rows high, so the
+  // task only visits kMaxPatchSize more rows above and below the stripe: the
+  // CCs reaching further are too large, and their pixels beyond are skipped.
+  const size_t stripe_ysize = frame_dim.group_dim;
+  const size_t num_stripes = DivCeil(frame_dim.ysize, stripe_ysize);
+  std::vector<std::vector<PatchInfo>> stripe_info(num_stripes);
+  const auto find_ccs = [&](const uint32_t stripe,
+                            size_t /* thread */) -> Status {
+    const size_t y0 = stripe * stripe_ysize;
+    const size_t y1 = std::min(y0 + stripe_ysize, frame_dim.ysize);
+    const size_t visited_y0 = y0 - std::min(y0, kMaxPatchSize);
+    const size_t visited_y1 = std::min(y1 + kMaxPatchSize, frame_dim.ysize);
+    JXL_ASSIGN_OR_RETURN(ImageB visited,
+                         ImageB::Create(memory_manager, frame_dim.xsize,
+                                        visited_y1 - visited_y0));
+    ZeroFillImage(&visited);
+    // Rows of `visited` start at visited_y0.
+    uint8_t* JXL_RESTRICT visited_row = visited.Row(0);
+    const size_t visited_stride = visited.PixelsPerRow();
+    std::vector<PatchInfo>& patches = stripe_info[stripe];
+    Rng rng(stripe);
+    std::vector<std::pair<uint32_t, uint32_t>> cc;
+    std::vector<std::pair<uint32_t, uint32_t>> stack;
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t x = 0; x < frame_dim.xsize; x++) {
+        if (is_background_row[y * is_background_stride + x]) continue;
+        cc.clear();
+        stack.clear();
+        stack.emplace_back(x, y);
+        size_t min_x = x;
+        size_t max_x = x;
+        size_t min_y = y;
+        size_t max_y = y;
+        std::pair<uint32_t, uint32_t> reference;
+        bool found_border = false;
+        bool all_similar = true;
+        bool too_tall = false;
+        while (!stack.empty()) {
+          std::pair<uint32_t, uint32_t> cur = stack.back();
+          stack.pop_back();
+          uint8_t& cur_visited =
+              visited_row[(cur.second - visited_y0) * visited_stride +
+                          cur.first];
+          if (cur_visited) continue;
+          cur_visited = 1;
+          if (cur.first < min_x) min_x = cur.first;
+          if (cur.first > max_x) max_x = cur.first;
+          if (cur.second < min_y) min_y = cur.second;
+          if (cur.second > max_y) max_y = cur.second;
+          if (paint_ccs) {
+            cc.push_back(cur);
+          }
+          for (int dx = -kSearchRadius; dx <= kSearchRadius; dx++) {
+            for (int dy = -kSearchRadius; dy <= kSearchRadius; dy++) {
+              if (dx == 0 && dy == 0) continue;
+              int next_first = static_cast<int32_t>(cur.first) + dx;
+              int next_second = static_cast<int32_t>(cur.second) + dy;
+              if (next_first < 0 || next_second < 0 ||
+                  static_cast<uint32_t>(next_first) >= frame_dim.xsize ||
+                  static_cast<uint32_t>(next_second) >= frame_dim.ysize) {
+                continue;
+              }
+              std::pair<uint32_t, uint32_t> next{next_first, next_second};
+              if (!is_background_row[next.second * is_background_stride +
+                                     next.first]) {
+                if (next.second < visited_y0 || next.second >= visited_y1) {
+                  too_tall = true;
+                  continue;
+                }
+                stack.push_back(next);
               } else {
-                if (!is_similar_b(next, reference)) all_similar = false;
+                if (!found_border) {
+                  reference = next;
+                  found_border = true;
+                } else {
+                  if (!is_similar_b(next, reference)) all_similar = false;
+                }
               }
             }
           }
         }
-      }
-      if (!found_border || !all_similar || max_x - min_x >= kMaxPatchSize ||
-          max_y - min_y >= kMaxPatchSize) {
-        continue;
-      }
-      size_t bpos = background_stride * reference.second + reference.first;
-      float ref[3] = {background_rows[0][bpos], background_rows[1][bpos],
-                      background_rows[2][bpos]};
-      bool has_similar = false;
-      for (size_t iy = std::max<int>(
-               static_cast<int32_t>(min_y) - kHasSimilarRadius, 0);
-           iy < std::min(max_y + kHasSimilarRadius + 1, frame_dim.ysize);
-           iy++) {
-        for (size_t ix = std::max<int>(
-                 static_cast<int32_t>(min_x) - kHasSimilarRadius, 0);
-             ix < std::min(max_x + kHasSimilarRadius + 1, frame_dim.xsize);
-             ix++) {
-          size_t opos = opsin_stride * iy + ix;
-          float px[3] = {opsin_rows[0][opos], opsin_rows[1][opos],
-                         opsin_rows[2][opos]};
-          if (pci.is_similar_v(ref, px, kHasSimilarThreshold)) {
-            has_similar = true;
+        // The CCs starting in an earlier stripe are found by its task.
+        if (min_y < y0) continue;
+        if (too_tall || !found_border || !all_similar ||
+            max_x - min_x >= kMaxPatchSize || max_y - min_y >= kMaxPatchSize) {
+          continue;
+        }
+        size_t bpos = background_stride * reference.second + reference.first;
+        float ref[3] = {background_rows[0][bpos], background_rows[1][bpos],
+                        background_rows[2][bpos]};
+        bool has_similar = false;
+        for (size_t iy = std::max<int>(
+                 static_cast<int32_t>(min_y) - kHasSimilarRadius, 0);
+             iy < std::min(max_y + kHasSimilarRadius + 1, frame_dim.ysize);
+             iy++) {
+          for (size_t ix = std::max<int>(
+                   static_cast<int32_t>(min_x) - kHasSimilarRadius, 0);
+               ix < std::min(max_x + kHasSimilarRadius + 1, frame_dim.xsize);
+               ix++) {
+            size_t opos = opsin_stride * iy + ix;
+            float px[3] = {opsin_rows[0][opos], opsin_rows[1][opos],
+                           opsin_rows[2][opos]};
+            if (pci.is_similar_v(ref, px, kHasSimilarThreshold)) {
+              has_similar = true;
+            }
           }
         }
-      }
-      if (!has_similar) continue;
-      info.emplace_back();
-      info.back().second.emplace_back(min_x, min_y);
-      QuantizedPatch& patch = info.back().first;
-      patch.xsize = max_x - min_x + 1;
-      patch.ysize = max_y - min_y + 1;
-      int max_value = 0;
-      for (size_t c : {1, 0, 2}) {
-        for (size_t iy = min_y; iy <= max_y; iy++) {
-          for (size_t ix = min_x; ix <= max_x; ix++) {
-            size_t offset = (iy - min_y) * patch.xsize + ix - min_x;
-            patch.fpixels[c][offset] =
-                opsin_rows[c][iy * opsin_stride + ix] - ref[c];
-            int val = pci.Quantize(patch.fpixels[c][offset], c);
-            patch.pixels[c][offset] = val;
-            if (std::abs(val) > max_value) max_value = std::abs(val);
+        if (!has_similar) continue;
+        patches.emplace_back();
+        patches.back().second.emplace_back(min_x, min_y);
+        QuantizedPatch& patch = patches.back().first;
+        patch.xsize = max_x - min_x + 1;
+        patch.ysize = max_y - min_y + 1;
+        int max_value = 0;
+        for (size_t c : {1, 0, 2}) {
+          for (size_t iy = min_y; iy <= max_y; iy++) {
+            for (size_t ix = min_x; ix <= max_x; ix++) {
+              size_t offset = (iy - min_y) * patch.xsize + ix - min_x;
+              patch.fpixels[c][offset] =
+                  opsin_rows[c][iy * opsin_stride + ix] - ref[c];
+              int val = pci.Quantize(patch.fpixels[c][offset], c);
+              patch.pixels[c][offset] = val;
+              if (std::abs(val) > max_value) max_value = std::abs(val);
+            }
           }
         }
-      }
-      if (max_value < kMinPeak) {
-        info.pop_back();
-        continue;
-      }
-      if (paint_ccs) {
-        float cc_color = rng.UniformF(0.5, 1.0);
-        for (std::pair<uint32_t, uint32_t> p : cc) {
-          ccs.Row(p.second)[p.first] = cc_color;
+        if (max_value < kMinPeak) {
+          patches.pop_back();
+          continue;
+        }
+        // The accepted CCs of the tasks do not overlap.
+        if (paint_ccs) {
+          float cc_color = rng.UniformF(0.5, 1.0);
+          for (std::pair<uint32_t, uint32_t> p : cc) {
+            ccs.Row(p.second)[p.first] = cc_color;
+          }
         }
       }
     }
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, num_stripes, ThreadPool::NoInit,
+                                find_ccs, "FindTextLikeCCs"));
+  for (std::vector<PatchInfo>& patches : stripe_info) {
+    info.insert(info.end(), std::make_move_iterator(patches.begin()),
+                std::make_move_iterator(patches.end()));
+    patches.clear();
   }
 
   if (paint_ccs) {
@@ -561,25 +610,34 @@ StatusOr<std::vector<PatchInfo>> FindTextLikePatches(
     return info;
   }
 
-  // Remove duplicates.
+  // Remove duplicates. The candidates are indexed by a hash of their quantized
+  // pixels, so that only those with the same hash are compared. The patches
+  // are kept in the order of their first occurrence.
   constexpr size_t kMinPatchOccurrences = 2;
-  std::sort(info.begin(), info.end());
-  size_t unique = 0;
-  for (size_t i = 1; i < info.size(); i++) {
-    if (info[i].first == info[unique].first) {
-      info[unique].second.insert(info[unique].second.end(),
-                                 info[i].second.begin(), info[i].second.end());
-    } else {
-      if (info[unique].second.size() >= kMinPatchOccurrences) {
-        unique++;
+  std::unordered_map<uint64_t, std::vector<size_t>> index;
+  index.reserve(info.size());
+  size_t num_distinct = 0;
+  for (size_t i = 0; i < info.size(); i++) {
+    std::vector<size_t>& same_hash = index[HashPatch(info[i].first)];
+    bool merged = false;
+    for (size_t j : same_hash) {
+      if (info[j].first == info[i].first) {
+        info[j].second.push_back(info[i].second[0]);
+        merged = true;
+        break;
       }
-      info[unique] = info[i];
     }
+    if (merged) continue;
+    if (num_distinct != i) info[num_distinct] = std::move(info[i]);
+    same_hash.push_back(num_distinct++);
   }
-  if (info[unique].second.size() >= kMinPatchOccurrences) {
-    unique++;
-  }
-  info.resize(unique);
+  info.resize(num_distinct);
+  info.erase(std::remove_if(info.begin(), info.end(),
+                            [](const PatchInfo& patch) {
+                              return patch.second.size() <
+                                     kMinPatchOccurrences;
+                            }),
+             info.end());
 
   size_t max_patch_size = 0;
 
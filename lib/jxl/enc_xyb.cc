@@ -122,22 +122,27 @@ V LinearFromSRGB(V encoded) {
   return TF_SRGB().DisplayFromEncoded(encoded);
 }
 
+// Converts `linear` into `image`, which may be the same image.
 Status LinearSRGBToXYB(const float* JXL_RESTRICT premul_absorb,
-                       ThreadPool* pool, Image3F* JXL_RESTRICT image) {
+                       ThreadPool* pool, const Image3F& linear,
+                       Image3F* image) {
   const size_t xsize = image->xsize();
 
   const HWY_FULL(float) d;
   const auto process_row = [&](const uint32_t task,
                                size_t /*thread*/) -> Status {
     const size_t y = static_cast<size_t>(task);
-    float* JXL_RESTRICT row0 = image->PlaneRow(0, y);
-    float* JXL_RESTRICT row1 = image->PlaneRow(1, y);
-    float* JXL_RESTRICT row2 = image->PlaneRow(2, y);
+    const float* row_in0 = linear.ConstPlaneRow(0, y);
+    const float* row_in1 = linear.ConstPlaneRow(1, y);
+    const float* row_in2 = linear.ConstPlaneRow(2, y);
+    float* row0 = image->PlaneRow(0, y);
+    float* row1 = image->PlaneRow(1, y);
+    float* row2 = image->PlaneRow(2, y);
 
     for (size_t x = 0; x < xsize; x += Lanes(d)) {
-      const auto in_r = Load(d, row0 + x);
-      const auto in_g = Load(d, row1 + x);
-      const auto in_b = Load(d, row2 + x);
+      const auto in_r = Load(d, row_in0 + x);
+      const auto in_g = Load(d, row_in1 + x);
+      const auto in_b = Load(d, row_in2 + x);
       LinearRGBToXYB(in_r, in_g, in_b, premul_absorb, row0 + x, row1 + x,
                      row2 + x);
     }
@@ -260,7 +265,7 @@ Status ToXYB(const ColorEncoding& c_current, float intensity_target,
     if (want_linear) {
       JXL_RETURN_IF_ERROR(CopyImageTo(*image, linear));
     }
-    JXL_RETURN_IF_ERROR(LinearSRGBToXYB(premul_absorb, pool, image));
+    JXL_RETURN_IF_ERROR(LinearSRGBToXYB(premul_absorb, pool, *image, image));
     return true;
   }
 
@@ -280,10 +285,9 @@ Status ToXYB(const ColorEncoding& c_current, float intensity_target,
   JXL_RETURN_IF_ERROR(ApplyColorTransform(
       c_current, intensity_target, *image, black, Rect(*image), c_linear_srgb,
       cms, pool, want_linear ? linear : image));
-  if (want_linear) {
-    JXL_RETURN_IF_ERROR(CopyImageTo(*linear, image));
-  }
-  JXL_RETURN_IF_ERROR(LinearSRGBToXYB(premul_absorb, pool, image));
+  // Reads the linear image directly instead of copying it first.
+  JXL_RETURN_IF_ERROR(LinearSRGBToXYB(premul_absorb, pool,
+                                      want_linear ? *linear : *image, image));
   return true;
 }
 
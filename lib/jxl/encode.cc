@@ -21,6 +21,7 @@
 #include <cstdint>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,6 +33,7 @@
 #include "lib/jxl/base/exif.h"
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
@@ -45,6 +47,7 @@
 #include "lib/jxl/enc_fields.h"
 #include "lib/jxl/enc_frame.h"
 #include "lib/jxl/enc_icc_codec.h"
+#include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/frame_header.h"
@@ -171,6 +174,30 @@ JxlEncoderOutputProcessorWrapper::GetBuffer(size_t min_size,
                                   this);
 }
 
+jxl::Status JxlEncoderOutputProcessorWrapper::AppendOwned(
+    jxl::PaddedBytes&& data) {
+  JXL_ENSURE(!has_buffer_);
+  if (data.empty()) return true;
+  if (stop_requested_) return jxl::StatusCode::kNotEnoughBytes;
+  const size_t size = data.size();
+  // Without an external processor, the bytes that do not fit in `avail_out_`
+  // are buffered until the next call to JxlEncoderProcessOutput.
+  const bool fits_avail_out =
+      avail_out_ != nullptr &&
+      position_ - output_position_ + size < *avail_out_;
+  auto next = internal_buffers_.lower_bound(position_);
+  if (external_output_processor_ || fits_avail_out ||
+      (next != internal_buffers_.end() && next->first < position_ + size)) {
+    return AppendData(*this, data);
+  }
+  InternalBuffer buffer(memory_manager_);
+  buffer.owned_data = std::move(data);
+  buffer.written_bytes = size;
+  internal_buffers_.emplace(position_, std::move(buffer));
+  position_ += size;
+  return true;
+}
+
 jxl::Status JxlEncoderOutputProcessorWrapper::Seek(size_t pos) {
   JXL_ENSURE(!has_buffer_);
   if (external_output_processor_ && external_output_processor_->seek) {
@@ -220,6 +247,23 @@ jxl::Status JxlEncoderOutputProcessorWrapper::CopyOutput(
   return true;
 }
 
+jxl::Status JxlEncoderOutputProcessorWrapper::CopyOutput(
+    jxl::PaddedBytes& output) {
+  JXL_RETURN_IF_ERROR(output.resize(64));
+  size_t avail_out = output.size();
+  uint8_t* next_out = output.data();
+  while (HasOutputToWrite()) {
+    JXL_RETURN_IF_ERROR(FlushOutput(&next_out, &avail_out));
+    if (avail_out == 0) {
+      size_t offset = next_out - output.data();
+      JXL_RETURN_IF_ERROR(output.resize(output.size() * 2));
+      next_out = output.data() + offset;
+      avail_out = output.size() - offset;
+    }
+  }
+  return output.resize(output.size() - avail_out);
+}
+
 jxl::Status JxlEncoderOutputProcessorWrapper::ReleaseBuffer(size_t bytes_used) {
   JXL_ENSURE(has_buffer_);
   has_buffer_ = false;
@@ -390,6 +434,193 @@ size_t WriteBoxHeader(const jxl::BoxType& type, size_t size, bool unbounded,
   }
   return idx;
 }
+
+const void* FastLosslessFloatInput::GetColorChannelDataAt(size_t xpos,
+                                                          size_t ypos,
+                                                          size_t x_size,
+                                                          size_t y_size,
+                                                          size_t* row_offset) {
+  size_t in_row_offset;
+  const void* in_buffer = input_.get_color_channel_data_at(
+      input_.opaque, xpos, ypos, x_size, y_size, &in_row_offset);
+  if (in_buffer == nullptr) return nullptr;
+  const bool little_endian =
+      format_.endianness == JXL_LITTLE_ENDIAN ||
+      (format_.endianness == JXL_NATIVE_ENDIAN && IsLittleEndian());
+  const size_t row_size = x_size * format_.num_channels;
+  std::unique_ptr<uint16_t[]> buffer(new uint16_t[row_size * y_size]);
+  std::vector<float> row_in(row_size);
+  std::vector<pixel_type> row_out(row_size);
+  for (size_t y = 0; y < y_size; y++) {
+    const uint8_t* in_row =
+        static_cast<const uint8_t*>(in_buffer) + y * in_row_offset;
+    for (size_t i = 0; i < row_size; i++) {
+      row_in[i] = little_endian ? LoadLEFloat(in_row + 4 * i)
+                                : LoadBEFloat(in_row + 4 * i);
+    }
+    if (!float_to_int(row_in.data(), row_out.data(), row_size, /*bits=*/16,
+                      /*exp_bits=*/5, /*fp=*/true, /*dfactor=*/1.0)) {
+      has_error_.store(true);
+      std::fill(row_out.begin(), row_out.end(), 0);
+    }
+    uint16_t* out_row = buffer.get() + y * row_size;
+    for (size_t i = 0; i < row_size; i++) {
+      out_row[i] = static_cast<uint16_t>(row_out[i]);
+    }
+  }
+  input_.release_buffer(input_.opaque, in_buffer);
+  *row_offset = row_size * sizeof(uint16_t);
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffers_.emplace_back(std::move(buffer));
+  return buffers_.back().get();
+}
+
+void FastLosslessFloatInput::ReleaseCurrentData(const void* buffer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = buffers_.begin(); it != buffers_.end(); ++it) {
+      if (it->get() == buffer) {
+        buffers_.erase(it);
+        return;
+      }
+    }
+  }
+  input_.release_buffer(input_.opaque, buffer);
+}
+
+namespace {
+
+bool SameCms(const JxlCmsInterface& a, const JxlCmsInterface& b) {
+  return a.init_data == b.init_data && a.init == b.init &&
+         a.get_src_buf == b.get_src_buf && a.get_dst_buf == b.get_dst_buf &&
+         a.run == b.run && a.destroy == b.destroy;
+}
+
+std::vector<uint8_t> ProfileIcc(const JxlColorProfile* profile) {
+  return std::vector<uint8_t>(profile->icc.data,
+                              profile->icc.data + profile->icc.size);
+}
+
+}  // namespace
+
+struct CmsTransformCache::Transform {
+  CmsTransformCache* cache;
+  JxlCmsInterface cms;
+  void* data;
+  // What the transform was created for. Profiles are only compared by their
+  // ICC, so transforms of profiles without one are not cached.
+  std::vector<uint8_t> input_icc;
+  std::vector<uint8_t> output_icc;
+  size_t input_channels;
+  size_t output_channels;
+  float intensity_target;
+  size_t num_threads;
+  size_t pixels_per_thread;
+};
+
+CmsTransformCache::CmsTransformCache() = default;
+
+CmsTransformCache::~CmsTransformCache() {
+  for (auto& transform : cached_) transform->cms.destroy(transform->data);
+}
+
+JxlCmsInterface CmsTransformCache::Wrap(const JxlCmsInterface& cms) {
+  std::vector<std::unique_ptr<Transform>> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!SameCms(cms_, cms)) {
+      dropped.swap(cached_);
+      cms_ = cms;
+    }
+  }
+  for (auto& transform : dropped) transform->cms.destroy(transform->data);
+  JxlCmsInterface wrapped = cms;
+  wrapped.init_data = this;
+  wrapped.init = &Init;
+  wrapped.get_src_buf = &GetSrcBuf;
+  wrapped.get_dst_buf = &GetDstBuf;
+  wrapped.run = &Run;
+  wrapped.destroy = &Destroy;
+  return wrapped;
+}
+
+void* CmsTransformCache::Init(void* init_data, size_t num_threads,
+                              size_t pixels_per_thread,
+                              const JxlColorProfile* input,
+                              const JxlColorProfile* output,
+                              float intensity_target) {
+  auto* cache = static_cast<CmsTransformCache*>(init_data);
+  std::vector<uint8_t> input_icc = ProfileIcc(input);
+  std::vector<uint8_t> output_icc = ProfileIcc(output);
+  JxlCmsInterface cms;
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    cms = cache->cms_;
+    for (auto it = cache->cached_.begin(); it != cache->cached_.end(); ++it) {
+      const Transform& cached = **it;
+      if (cached.input_icc == input_icc && cached.output_icc == output_icc &&
+          cached.input_channels == input->num_channels &&
+          cached.output_channels == output->num_channels &&
+          cached.intensity_target == intensity_target &&
+          cached.num_threads == num_threads &&
+          cached.pixels_per_thread == pixels_per_thread) {
+        Transform* transform = it->release();
+        cache->cached_.erase(it);
+        return transform;
+      }
+    }
+  }
+  void* data = cms.init(cms.init_data, num_threads, pixels_per_thread, input,
+                        output, intensity_target);
+  if (data == nullptr) return nullptr;
+  return new Transform{cache,
+                       cms,
+                       data,
+                       std::move(input_icc),
+                       std::move(output_icc),
+                       input->num_channels,
+                       output->num_channels,
+                       intensity_target,
+                       num_threads,
+                       pixels_per_thread};
+}
+
+float* CmsTransformCache::GetSrcBuf(void* user_data, size_t thread) {
+  const Transform* transform = static_cast<const Transform*>(user_data);
+  return transform->cms.get_src_buf(transform->data, thread);
+}
+
+float* CmsTransformCache::GetDstBuf(void* user_data, size_t thread) {
+  const Transform* transform = static_cast<const Transform*>(user_data);
+  return transform->cms.get_dst_buf(transform->data, thread);
+}
+
+JXL_BOOL CmsTransformCache::Run(void* user_data, size_t thread,
+                                const float* input, float* output,
+                                size_t num_pixels) {
+  const Transform* transform = static_cast<const Transform*>(user_data);
+  return transform->cms.run(transform->data, thread, input, output,
+                            num_pixels);
+}
+
+void CmsTransformCache::Destroy(void* user_data) {
+  std::unique_ptr<Transform> transform(static_cast<Transform*>(user_data));
+  CmsTransformCache* cache = transform->cache;
+  std::unique_ptr<Transform> evicted;
+  if (!transform->input_icc.empty() && !transform->output_icc.empty()) {
+    std::lock_guard<std::mutex> lock(cache->mutex_);
+    if (SameCms(transform->cms, cache->cms_)) {
+      cache->cached_.push_back(std::move(transform));
+      if (cache->cached_.size() > kMaxCachedTransforms) {
+        evicted = std::move(cache->cached_.front());
+        cache->cached_.erase(cache->cached_.begin());
+      }
+    }
+  }
+  if (transform) transform->cms.destroy(transform->data);
+  if (evicted) evicted->cms.destroy(evicted->data);
+}
+
 }  // namespace jxl
 
 template <typename WriteBox>
@@ -477,10 +708,13 @@ void QueueFrame(
   frame_settings->enc->num_queued_frames++;
 }
 
-void QueueFastLosslessFrame(const JxlEncoderFrameSettings* frame_settings,
-                            JxlFastLosslessFrameState* fast_lossless_frame) {
+void QueueFastLosslessFrame(
+    const JxlEncoderFrameSettings* frame_settings,
+    JxlFastLosslessFrameState* fast_lossless_frame,
+    std::unique_ptr<jxl::FastLosslessFloatInput> float_input) {
   jxl::JxlEncoderQueuedInput queued_input(frame_settings->enc->memory_manager);
   queued_input.fast_lossless_frame.reset(fast_lossless_frame);
+  queued_input.fast_lossless_float_input = std::move(float_input);
   frame_settings->enc->input_queue.emplace_back(std::move(queued_input));
   frame_settings->enc->num_queued_frames++;
 }
@@ -732,6 +966,46 @@ bool EncodeFrameIndexBox(const jxl::JxlEncoderFrameIndexBox& frame_index_box,
   return ok;
 }
 
+// Contents of the jxpi box, all varints: the number of frames, then for each
+// frame its offset in the codestream, counted like the offsets of the frame
+// index box, the end of its DC, the number of passes and the end of each of
+// them, and the number of sections and the start of each of them, in the
+// order of the TOC. The ends and starts are relative to the offset of the
+// frame, which includes the frames of its patches and progressive DC.
+bool EncodeProgressionIndexBox(
+    const std::vector<jxl::JxlEncoderProgressionIndexEntry>& entries,
+    std::vector<uint8_t>& buffer_vec) {
+  static const size_t kVarintMaxLength = 10;
+  size_t num_values = 1;
+  for (const jxl::JxlEncoderProgressionIndexEntry& entry : entries) {
+    num_values += 4 + entry.offsets.pass_end.size() +
+                  entry.offsets.section_start.size();
+  }
+  buffer_vec.resize(num_values * kVarintMaxLength);
+  uint8_t* buffer = buffer_vec.data();
+  size_t output_pos = 0;
+  bool ok =
+      EncodeVarInt(entries.size(), buffer_vec.size(), &output_pos, buffer);
+  for (const jxl::JxlEncoderProgressionIndexEntry& entry : entries) {
+    const jxl::FrameProgressionOffsets& offsets = entry.offsets;
+    ok &= EncodeVarInt(entry.codestream_offset, buffer_vec.size(), &output_pos,
+                       buffer);
+    ok &= EncodeVarInt(offsets.dc_end, buffer_vec.size(), &output_pos, buffer);
+    ok &= EncodeVarInt(offsets.pass_end.size(), buffer_vec.size(), &output_pos,
+                       buffer);
+    for (size_t end : offsets.pass_end) {
+      ok &= EncodeVarInt(end, buffer_vec.size(), &output_pos, buffer);
+    }
+    ok &= EncodeVarInt(offsets.section_start.size(), buffer_vec.size(),
+                       &output_pos, buffer);
+    for (size_t start : offsets.section_start) {
+      ok &= EncodeVarInt(start, buffer_vec.size(), &output_pos, buffer);
+    }
+  }
+  if (ok) buffer_vec.resize(output_pos);
+  return ok;
+}
+
 struct RunnerTicket {
   explicit RunnerTicket(jxl::ThreadPool* pool) : pool(pool) {}
   jxl::ThreadPool* pool;
@@ -752,8 +1026,216 @@ void FastLosslessRunnerAdapter(void* void_ticket, void* opaque,
   }
 }
 
+// Returns whether ProcessOneEnqueuedInput would accept the settings of "frame"
+// without reporting an API usage error.
+bool QueuedFrameIsValid(const jxl::JxlEncoderQueuedFrame& frame) {
+  for (uint8_t initialized : frame.ec_initialized) {
+    if (!initialized) return false;
+  }
+  return frame.option_values.header.layer_info.save_as_reference < 3;
+}
+
+// Makes the large allocations of the frames encoded next follow
+// JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS of "values".
+void SetLargeAllocationPolicy(const jxl::JxlEncoderFrameSettingsValues& values,
+                              jxl::ThreadPool* pool, jxl::MemoryArena* arena) {
+  jxl::LargeAllocationPolicy policy;
+  policy.huge_pages = (values.large_allocations & 1) != 0;
+  policy.prefault = (values.large_allocations & 2) != 0;
+  policy.pool = pool;
+  arena->SetLargeAllocationPolicy(policy);
+}
+
+void SetColorTransform(const jxl::CodecMetadata& metadata,
+                       jxl::JxlEncoderQueuedFrame* frame) {
+  if (metadata.m.xyb_encoded) {
+    frame->option_values.cparams.color_transform = jxl::ColorTransform::kXYB;
+  } else {
+    // TODO(zond): Figure out when to use kYCbCr instead.
+    frame->option_values.cparams.color_transform = jxl::ColorTransform::kNone;
+  }
+}
+
+jxl::FrameInfo GetFrameInfo(jxl::JxlEncoderQueuedFrame& frame,
+                            const jxl::CodecMetadata& metadata,
+                            bool last_frame) {
+  const jxl::JxlEncoderFrameSettingsValues& values = frame.option_values;
+  jxl::FrameInfo frame_info;
+  frame_info.is_last = last_frame;
+  if (values.progression_index) {
+    frame_info.progression_offsets = &frame.progression_offsets;
+  }
+  frame_info.save_as_reference = values.header.layer_info.save_as_reference;
+  frame_info.source = values.header.layer_info.blend_info.source;
+  frame_info.clamp = FROM_JXL_BOOL(values.header.layer_info.blend_info.clamp);
+  frame_info.alpha_channel = values.header.layer_info.blend_info.alpha;
+  frame_info.extra_channel_blending_info.resize(metadata.m.num_extra_channels);
+  // If extra channel blend info has not been set, use the blend mode from the
+  // layer_info.
+  JxlBlendInfo default_blend_info = values.header.layer_info.blend_info;
+  for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
+    auto& to = frame_info.extra_channel_blending_info[i];
+    const auto& from = i < values.extra_channel_blend_info.size()
+                           ? values.extra_channel_blend_info[i]
+                           : default_blend_info;
+    to.mode = static_cast<jxl::BlendMode>(from.blendmode);
+    to.source = from.source;
+    to.alpha_channel = from.alpha;
+    to.clamp = (from.clamp != 0);
+  }
+  frame_info.origin.x0 = values.header.layer_info.crop_x0;
+  frame_info.origin.y0 = values.header.layer_info.crop_y0;
+  const JxlBlendMode blendmode = values.header.layer_info.blend_info.blendmode;
+  frame_info.blendmode = static_cast<jxl::BlendMode>(blendmode);
+  frame_info.blend = blendmode != JXL_BLEND_REPLACE;
+  frame_info.image_bit_depth = values.image_bit_depth;
+  if (metadata.m.have_animation) {
+    frame_info.duration = values.header.duration;
+    frame_info.timecode = values.header.timecode;
+  } else {
+    // If have_animation is false, the encoder should ignore the duration and
+    // timecode values. However, assigning them to ib will cause the encoder
+    // to write an invalid frame header that can't be decoded so ensure
+    // they're the default value of 0 here.
+    frame_info.duration = 0;
+    frame_info.timecode = 0;
+  }
+  frame_info.name = values.frame_name;
+  return frame_info;
+}
+
+// Compresses `box` into its brob contents, prepending its type. Leaves the box
+// to be compressed again when it is processed if this fails.
+void CompressBoxAhead(JxlMemoryManager* memory_manager, int brotli_effort,
+                      jxl::JxlEncoderQueuedBox* box) {
+  jxl::PaddedBytes compressed(memory_manager);
+  if (!compressed.append(box->type) ||
+      BrotliCompress((brotli_effort >= 0 ? brotli_effort : 4),
+                     box->contents.data(), box->contents.size(),
+                     &compressed) != JXL_ENC_SUCCESS) {
+    return;
+  }
+  box->compressed.assign(compressed.data(),
+                         compressed.data() + compressed.size());
+  box->compressed_ahead = true;
+}
+
+std::vector<jxl::JxlEncoderQueuedBox*> BoxesToCompress(
+    std::vector<jxl::JxlEncoderQueuedInput>& input_queue) {
+  std::vector<jxl::JxlEncoderQueuedBox*> boxes;
+  for (jxl::JxlEncoderQueuedInput& input : input_queue) {
+    jxl::JxlEncoderQueuedBox* box = input.box.get();
+    if (box && box->compress_box && !box->compressed_ahead) {
+      boxes.push_back(box);
+    }
+  }
+  return boxes;
+}
+
 }  // namespace
 
+jxl::Status JxlEncoderStruct::EncodeQueuedFramesAhead() {
+  std::vector<jxl::JxlEncoderQueuedFrame*> frames;
+  std::vector<jxl::FrameInfo> frame_infos;
+  size_t frames_left = num_queued_frames;
+  for (jxl::JxlEncoderQueuedInput& input : input_queue) {
+    if (frames.size() == max_frames_in_flight) break;
+    if (input.box) continue;
+    frames_left--;
+    jxl::JxlEncoderQueuedFrame* frame = input.frame.get();
+    // Streaming input is only guaranteed to be available while its own frame
+    // is processed, and collecting statistics is not thread-safe. EncodeFrame
+    // takes the coefficients of JPEG frames, which could then not be encoded
+    // again if encoding them here failed.
+    if (!frame || frame->encoded_ahead || frame->frame_data.StreamingInput() ||
+        frame->frame_data.IsJPEG() || frame->option_values.aux_out != nullptr ||
+        !QueuedFrameIsValid(*frame)) {
+      break;
+    }
+    // Neither are the caches shared between frames.
+    if (frame->option_values.cparams.entropy_coding_cache ||
+        frame->option_values.cparams.analysis_cache ||
+        frame->option_values.cparams.modular_tree_cache) {
+      break;
+    }
+    // Until the frames are closed, the last queued frame may or may not turn
+    // out to be the last frame.
+    if (frames_left == 0 && !frames_closed) break;
+    // The frames share the allocation policy of the first one.
+    if (!frames.empty() && frame->option_values.large_allocations !=
+                               frames[0]->option_values.large_allocations) {
+      break;
+    }
+    SetColorTransform(metadata, frame);
+    frames.push_back(frame);
+    frame_infos.push_back(
+        GetFrameInfo(*frame, metadata, frames_closed && frames_left == 0));
+  }
+  if (frames.size() < 2) return true;
+  SetLargeAllocationPolicy(frames[0]->option_values, thread_pool.get(),
+                           &frame_arena);
+  const JxlCmsInterface frame_cms = cms_cache.Wrap(cms);
+
+  // Frames whose encoding fails here are encoded again, in order, by
+  // ProcessOneEnqueuedInput, which then reports the error.
+  const auto encode_frame = [&](const uint32_t i, size_t) -> jxl::Status {
+    jxl::JxlEncoderQueuedFrame* frame = frames[i];
+    JxlEncoderOutputProcessorWrapper local_output(&memory_manager);
+    if (jxl::EncodeFrame(&frame_memory_manager, frame->option_values.cparams,
+                         frame_infos[i], &metadata, frame->frame_data,
+                         frame_cms, thread_pool.get(), &local_output,
+                         /*aux_out=*/nullptr) &&
+        local_output.SetFinalizedPosition() &&
+        local_output.CopyOutput(frame->encoded_bytes)) {
+      frame->encoded_ahead = true;
+      frame->encoded_as_last = frame_infos[i].is_last;
+    }
+    return true;
+  };
+  // Each frame alone often has less parallelism than there are threads, so let
+  // the frames fold their own parallel work into this call.
+  return jxl::RunNestableOnPool(thread_pool.get(), 0, frames.size(),
+                                jxl::ThreadPool::NoInit, encode_frame,
+                                "EncodeQueuedFramesAhead");
+}
+
+jxl::Status JxlEncoderStruct::EncodeFrameCompressingBoxes(
+    jxl::JxlEncoderQueuedFrame* frame, const jxl::FrameInfo& frame_info) {
+  const JxlCmsInterface frame_cms = cms_cache.Wrap(cms);
+  const auto encode_frame = [&]() -> jxl::Status {
+    return jxl::EncodeFrame(&frame_memory_manager, frame->option_values.cparams,
+                            frame_info, &metadata, frame->frame_data, frame_cms,
+                            thread_pool.get(), &output_processor,
+                            frame->option_values.aux_out);
+  };
+  std::vector<jxl::JxlEncoderQueuedBox*> boxes = BoxesToCompress(input_queue);
+  // Streaming input is read on the calling thread.
+  if (boxes.empty() || !thread_pool || frame->frame_data.StreamingInput()) {
+    return encode_frame();
+  }
+  // Task 0 encodes the frame, and folds its own parallel work into this call.
+  const auto process = [&](const uint32_t i, size_t) -> jxl::Status {
+    if (i == 0) return encode_frame();
+    CompressBoxAhead(&memory_manager, brotli_effort, boxes[i - 1]);
+    return true;
+  };
+  return jxl::RunNestableOnPool(thread_pool.get(), 0, boxes.size() + 1,
+                                jxl::ThreadPool::NoInit, process,
+                                "EncodeFrameCompressingBoxes");
+}
+
+jxl::Status JxlEncoderStruct::CompressQueuedBoxesAhead() {
+  std::vector<jxl::JxlEncoderQueuedBox*> boxes = BoxesToCompress(input_queue);
+  if (boxes.size() < 2) return true;
+  const auto compress = [&](const uint32_t i, size_t) -> jxl::Status {
+    CompressBoxAhead(&memory_manager, brotli_effort, boxes[i]);
+    return true;
+  };
+  return jxl::RunOnPool(thread_pool.get(), 0, boxes.size(),
+                        jxl::ThreadPool::NoInit, compress,
+                        "CompressQueuedBoxesAhead");
+}
+
 jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
   jxl::PaddedBytes header_bytes{&memory_manager};
 
@@ -871,6 +1353,15 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
 
   JXL_RETURN_IF_ERROR(output_processor.SetFinalizedPosition());
 
+  if (input.frame && !input.frame->encoded_ahead && max_frames_in_flight > 1 &&
+      thread_pool) {
+    JXL_RETURN_IF_ERROR(EncodeQueuedFramesAhead());
+  }
+  if (input.box && input.box->compress_box && !input.box->compressed_ahead &&
+      thread_pool) {
+    JXL_RETURN_IF_ERROR(CompressQueuedBoxesAhead());
+  }
+
   // Choose frame or box processing: exactly one of the two unique pointers (box
   // or frame) in the input queue item is non-null.
   if (input.frame || input.fast_lossless_frame) {
@@ -878,6 +1369,8 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
         std::move(input.frame);
     jxl::FJXLFrameUniquePtr fast_lossless_frame =
         std::move(input.fast_lossless_frame);
+    std::unique_ptr<jxl::FastLosslessFloatInput> fast_lossless_float_input =
+        std::move(input.fast_lossless_float_input);
     input_queue.erase(input_queue.begin());
     num_queued_frames--;
     if (input_frame) {
@@ -896,28 +1389,7 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
       //             JxlEncoderCloseFrames has been called and if the frame
       //             queue is empty (to see if it's the last animation frame).
 
-      if (metadata.m.xyb_encoded) {
-        input_frame->option_values.cparams.color_transform =
-            jxl::ColorTransform::kXYB;
-      } else {
-        // TODO(zond): Figure out when to use kYCbCr instead.
-        input_frame->option_values.cparams.color_transform =
-            jxl::ColorTransform::kNone;
-      }
-    }
-
-    uint32_t duration;
-    uint32_t timecode;
-    if (input_frame && metadata.m.have_animation) {
-      duration = input_frame->option_values.header.duration;
-      timecode = input_frame->option_values.header.timecode;
-    } else {
-      // If have_animation is false, the encoder should ignore the duration and
-      // timecode values. However, assigning them to ib will cause the encoder
-      // to write an invalid frame header that can't be decoded so ensure
-      // they're the default value of 0 here.
-      duration = 0;
-      timecode = 0;
+      SetColorTransform(metadata, input_frame.get());
     }
 
     const bool last_frame = frames_closed && (num_queued_frames == 0);
@@ -959,7 +1431,12 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
     JXL_RETURN_IF_ERROR(AppendData(output_processor, header_bytes));
 
     if (input_frame) {
-      frame_index_box.AddFrame(codestream_bytes_written_end_of_frame, duration,
+      const jxl::FrameInfo frame_info =
+          GetFrameInfo(*input_frame, metadata, last_frame);
+      const size_t frame_codestream_offset =
+          codestream_bytes_written_end_of_frame;
+      frame_index_box.AddFrame(codestream_bytes_written_end_of_frame,
+                               frame_info.duration,
                                input_frame->option_values.frame_index_box);
 
       size_t save_as_reference =
@@ -971,53 +1448,22 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
             static_cast<int>(save_as_reference));
       }
 
-      jxl::FrameInfo frame_info;
-      frame_info.is_last = last_frame;
-      frame_info.save_as_reference = save_as_reference;
-      frame_info.source =
-          input_frame->option_values.header.layer_info.blend_info.source;
-      frame_info.clamp = FROM_JXL_BOOL(
-          input_frame->option_values.header.layer_info.blend_info.clamp);
-      frame_info.alpha_channel =
-          input_frame->option_values.header.layer_info.blend_info.alpha;
-      frame_info.extra_channel_blending_info.resize(
-          metadata.m.num_extra_channels);
-      // If extra channel blend info has not been set, use the blend mode from
-      // the layer_info.
-      JxlBlendInfo default_blend_info =
-          input_frame->option_values.header.layer_info.blend_info;
-      for (size_t i = 0; i < metadata.m.num_extra_channels; ++i) {
-        auto& to = frame_info.extra_channel_blending_info[i];
-        const auto& from =
-            i < input_frame->option_values.extra_channel_blend_info.size()
-                ? input_frame->option_values.extra_channel_blend_info[i]
-                : default_blend_info;
-        to.mode = static_cast<jxl::BlendMode>(from.blendmode);
-        to.source = from.source;
-        to.alpha_channel = from.alpha;
-        to.clamp = (from.clamp != 0);
-      }
-      frame_info.origin.x0 =
-          input_frame->option_values.header.layer_info.crop_x0;
-      frame_info.origin.y0 =
-          input_frame->option_values.header.layer_info.crop_y0;
-      frame_info.blendmode = static_cast<jxl::BlendMode>(
-          input_frame->option_values.header.layer_info.blend_info.blendmode);
-      frame_info.blend =
-          input_frame->option_values.header.layer_info.blend_info.blendmode !=
-          JXL_BLEND_REPLACE;
-      frame_info.image_bit_depth = input_frame->option_values.image_bit_depth;
-      frame_info.duration = duration;
-      frame_info.timecode = timecode;
-      frame_info.name = input_frame->option_values.frame_name;
-
-      if (!jxl::EncodeFrame(&memory_manager, input_frame->option_values.cparams,
-                            frame_info, &metadata, input_frame->frame_data, cms,
-                            thread_pool.get(), &output_processor,
-                            input_frame->option_values.aux_out)) {
+      SetLargeAllocationPolicy(input_frame->option_values, thread_pool.get(),
+                               &frame_arena);
+      if (input_frame->encoded_ahead &&
+          input_frame->encoded_as_last == last_frame) {
+        JXL_RETURN_IF_ERROR(output_processor.AppendOwned(
+            std::move(input_frame->encoded_bytes)));
+      } else if (!EncodeFrameCompressingBoxes(input_frame.get(), frame_info)) {
         return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC,
                              "Failed to encode frame");
       }
+      frame_arena.Reset();
+      if (input_frame->option_values.progression_index) {
+        progression_index.push_back(
+            {frame_codestream_offset,
+             std::move(input_frame->progression_offsets)});
+      }
     } else {
       JXL_ENSURE(fast_lossless_frame);
       RunnerTicket ticket{thread_pool.get()};
@@ -1028,6 +1474,10 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
         return JXL_API_ERROR(this, JXL_ENC_ERR_GENERIC,
                              "Internal: JxlFastLosslessProcessFrame failed");
       }
+      if (fast_lossless_float_input && fast_lossless_float_input->has_error()) {
+        return JXL_API_ERROR(this, JXL_ENC_ERR_BAD_INPUT,
+                             "Float samples are not representable as binary16");
+      }
     }
 
     const size_t frame_codestream_end = output_processor.CurrentPosition();
@@ -1078,6 +1528,13 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
       JXL_RETURN_IF_ERROR(AppendBoxWithContents(jxl::MakeBoxType("jxli"),
                                                 jxl::Bytes(index_box_content)));
     }
+    if (last_frame && !progression_index.empty()) {
+      std::vector<uint8_t> index_box_content;
+      JXL_ENSURE(
+          EncodeProgressionIndexBox(progression_index, index_box_content));
+      JXL_RETURN_IF_ERROR(AppendBoxWithContents(jxl::MakeBoxType("jxpi"),
+                                                jxl::Bytes(index_box_content)));
+    }
   } else {
     // Not a frame, so is a box instead
     jxl::MemoryManagerUniquePtr<jxl::JxlEncoderQueuedBox> box =
@@ -1085,7 +1542,10 @@ jxl::Status JxlEncoderStruct::ProcessOneEnqueuedInput() {
     input_queue.erase(input_queue.begin());
     num_queued_boxes--;
 
-    if (box->compress_box) {
+    if (box->compressed_ahead) {
+      JXL_RETURN_IF_ERROR(
+          AppendBoxWithContents(jxl::MakeBoxType("brob"), box->compressed));
+    } else if (box->compress_box) {
       jxl::PaddedBytes compressed(&memory_manager);
       // Prepend the original box type in the brob box contents
       JXL_RETURN_IF_ERROR(compressed.append(box->type));
@@ -1586,7 +2046,6 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
     case JXL_ENC_FRAME_SETTING_GABORISH:
     case JXL_ENC_FRAME_SETTING_MODULAR:
     case JXL_ENC_FRAME_SETTING_KEEP_INVISIBLE:
-    case JXL_ENC_FRAME_SETTING_GROUP_ORDER:
     case JXL_ENC_FRAME_SETTING_RESPONSIVE:
     case JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC:
     case JXL_ENC_FRAME_SETTING_QPROGRESSIVE_AC:
@@ -1596,6 +2055,7 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_EXIF:
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_XMP:
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_JUMBF:
+    case JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI:
       if (value < -1 || value > 1) {
         return JXL_API_ERROR(
             frame_settings->enc, JXL_ENC_ERR_API_USAGE,
@@ -1633,9 +2093,9 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       frame_settings->enc->brotli_effort = value;
       break;
     case JXL_ENC_FRAME_SETTING_DECODING_SPEED:
-      if (value < 0 || value > 4) {
+      if (value < 0 || value > 5) {
         return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
-                             "Decoding speed has to be in [0..4]");
+                             "Decoding speed has to be in [0..5]");
       }
       frame_settings->values.cparams.decoding_speed_tier = value;
       break;
@@ -1694,7 +2154,12 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
           static_cast<jxl::Override>(value);
       break;
     case JXL_ENC_FRAME_SETTING_GROUP_ORDER:
+      if (value < -1 || value > 2) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Group order has to be in [-1..2]");
+      }
       frame_settings->values.cparams.centerfirst = (value == 1);
+      frame_settings->values.cparams.salientfirst = (value == 2);
       break;
     case JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X:
       if (value < -1) {
@@ -1798,6 +2263,7 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       }
       break;
     case JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL:
+      frame_settings->values.jpeg_recon_cfl = value;
       frame_settings->values.cparams.force_cfl_jpeg_recompression =
           default_to_true(value);
       break;
@@ -1808,6 +2274,22 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
       }
       frame_settings->values.frame_index_box = true;
       break;
+    case JXL_ENC_FRAME_SETTING_PROGRESSION_INDEX_BOX:
+      if (value < 0 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be 0 or 1");
+      }
+      if (value == 1 && !frame_settings->enc->MustUseContainer()) {
+        if (frame_settings->enc->wrote_bytes) {
+          return JXL_API_ERROR(
+              frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+              "The progression index box needs the container, which must be "
+              "set before output is written");
+        }
+        frame_settings->enc->use_container = true;
+      }
+      frame_settings->values.progression_index = (value == 1);
+      break;
     case JXL_ENC_FRAME_SETTING_PHOTON_NOISE:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Float option, try setting it with "
@@ -1855,6 +2337,82 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetOption(
             "Set uses_original_profile=true for non-perceptual encoding");
       }
       break;
+    case JXL_ENC_FRAME_SETTING_TARGET_SIZE:
+      if (value < -1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Target size has to be positive, 0 or -1");
+      }
+      frame_settings->values.cparams.target_size =
+          value == -1 ? 0 : static_cast<size_t>(value);
+      break;
+    case JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.cparams.adaptive_effort = value == 1;
+      break;
+    case JXL_ENC_FRAME_SETTING_FAST_LOSSLESS_REUSE_CODES:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.fast_lossless_reuse_codes = value == 1;
+      break;
+    case JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      if (value == 1) {
+        if (!frame_settings->enc->entropy_coding_cache) {
+          frame_settings->enc->entropy_coding_cache =
+              std::make_shared<jxl::EntropyCodingCache>();
+        }
+        frame_settings->values.cparams.entropy_coding_cache =
+            frame_settings->enc->entropy_coding_cache;
+      } else {
+        frame_settings->values.cparams.entropy_coding_cache = nullptr;
+      }
+      break;
+    case JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      if (value == 1) {
+        if (!frame_settings->enc->modular_tree_cache) {
+          frame_settings->enc->modular_tree_cache =
+              std::make_shared<jxl::ModularTreeCache>();
+        }
+        frame_settings->values.cparams.modular_tree_cache =
+            frame_settings->enc->modular_tree_cache;
+      } else {
+        frame_settings->values.cparams.modular_tree_cache = nullptr;
+      }
+      break;
+    case JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS:
+      if (value < -1 || value > 3) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..3]");
+      }
+      frame_settings->values.large_allocations = std::max<int64_t>(value, 0);
+      break;
+    case JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS:
+      if (value < -1 || value > 1) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                             "Option value has to be in [-1..1]");
+      }
+      frame_settings->values.borrow_input_buffers = value == 1;
+      break;
+    case JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI:
+      frame_settings->values.cparams.approximate_butteraugli =
+          static_cast<jxl::Override>(value);
+      break;
+    case JXL_ENC_FRAME_SETTING_DECODING_BUDGET:
+      return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
+                           "Float option, try setting it with "
+                           "JxlEncoderFrameSettingsSetFloatOption");
 
     default:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
@@ -1915,6 +2473,13 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
         frame_settings->values.cparams.channel_colors_percent = value;
       }
       return JxlErrorOrStatus::Success();
+    case JXL_ENC_FRAME_SETTING_DECODING_BUDGET:
+      if (value < -1.f) {
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
+                             "Decoding budget has to be positive, 0 or -1");
+      }
+      frame_settings->values.cparams.decoding_budget = std::max(value, 0.f);
+      return JxlErrorOrStatus::Success();
     case JXL_ENC_FRAME_SETTING_EFFORT:
     case JXL_ENC_FRAME_SETTING_DECODING_SPEED:
     case JXL_ENC_FRAME_SETTING_RESAMPLING:
@@ -1951,6 +2516,15 @@ JxlEncoderStatus JxlEncoderFrameSettingsSetFloatOption(
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_XMP:
     case JXL_ENC_FRAME_SETTING_JPEG_KEEP_JUMBF:
     case JXL_ENC_FRAME_SETTING_USE_FULL_IMAGE_HEURISTICS:
+    case JXL_ENC_FRAME_SETTING_TARGET_SIZE:
+    case JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT:
+    case JXL_ENC_FRAME_SETTING_FAST_LOSSLESS_REUSE_CODES:
+    case JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS:
+    case JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS:
+    case JXL_ENC_FRAME_SETTING_PROGRESSION_INDEX_BOX:
+    case JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI:
+    case JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING:
+    case JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE:
       return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_NOT_SUPPORTED,
                            "Int option, try setting it with "
                            "JxlEncoderFrameSettingsSetOption");
@@ -1969,7 +2543,8 @@ JxlEncoder* JxlEncoderCreate(const JxlMemoryManager* memory_manager) {
       jxl::MemoryManagerAlloc(&local_memory_manager, sizeof(JxlEncoder));
   if (!alloc) return nullptr;
   JxlEncoder* enc = new (alloc) JxlEncoder();
-  enc->memory_manager = local_memory_manager;
+  enc->memory_budget.Init(local_memory_manager, &enc->memory_manager);
+  enc->frame_arena.Init(enc->memory_manager, &enc->frame_memory_manager);
   // TODO(sboukortt): add an API function to set this.
   enc->cms = *JxlGetDefaultCms();
   enc->cms_set = true;
@@ -1987,6 +2562,7 @@ void JxlEncoderReset(JxlEncoder* enc) {
   enc->num_queued_boxes = 0;
   enc->encoder_options.clear();
   enc->codestream_bytes_written_end_of_frame = 0;
+  enc->progression_index.clear();
   enc->wrote_bytes = false;
   enc->jxlp_counter = 0;
   enc->metadata = jxl::CodecMetadata();
@@ -2000,8 +2576,13 @@ void JxlEncoderReset(JxlEncoder* enc) {
   enc->use_boxes = false;
   enc->store_jpeg_metadata = false;
   enc->codestream_level = -1;
+  enc->max_frames_in_flight = 1;
+  enc->fast_lossless_codes.reset();
+  enc->entropy_coding_cache.reset();
   enc->output_processor =
       JxlEncoderOutputProcessorWrapper(&enc->memory_manager);
+  // The free slabs of the arena were trimmed to what the last frame needed
+  // when it was done, and are kept for the frames of the next image.
   JxlEncoderInitBasicInfo(&enc->basic_info);
 
   // jxl::JxlEncoderFrameIndexBox frame_index_box;
@@ -2012,7 +2593,7 @@ void JxlEncoderReset(JxlEncoder* enc) {
 
 void JxlEncoderDestroy(JxlEncoder* enc) {
   if (enc) {
-    JxlMemoryManager local_memory_manager = enc->memory_manager;
+    JxlMemoryManager local_memory_manager = enc->memory_budget.inner();
     // Call destructor directly since custom free function is used.
     enc->~JxlEncoder();
     jxl::MemoryManagerFree(&local_memory_manager, enc);
@@ -2079,6 +2660,16 @@ JxlEncoderStatus JxlEncoderSetParallelRunner(JxlEncoder* enc,
   return JxlErrorOrStatus::Success();
 }
 
+JxlEncoderStatus JxlEncoderSetMaxFramesInFlight(JxlEncoder* enc,
+                                                size_t max_frames_in_flight) {
+  if (max_frames_in_flight == 0) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE,
+                         "at least one frame must be in flight");
+  }
+  enc->max_frames_in_flight = max_frames_in_flight;
+  return JxlErrorOrStatus::Success();
+}
+
 namespace {
 JxlEncoderStatus GetCurrentDimensions(
     const JxlEncoderFrameSettings* frame_settings, size_t& xsize,
@@ -2198,7 +2789,17 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
                            "Need to preserve EXIF and XMP to allow JPEG "
                            "bitstream reconstruction");
     }
-    jxl::jpeg::JPEGData data_in = *io.Main().jpeg_data;
+    // The reconstruction data does not include the DCT coefficients, which
+    // are the bulk of the JPEGData, so they are not copied.
+    jxl::jpeg::JPEGData& jpeg_in = *io.Main().jpeg_data;
+    std::vector<std::vector<jxl::jpeg::coeff_t>> coeffs;
+    for (jxl::jpeg::JPEGComponent& component : jpeg_in.components) {
+      coeffs.emplace_back(std::move(component.coeffs));
+    }
+    jxl::jpeg::JPEGData data_in = jpeg_in;
+    for (size_t c = 0; c < coeffs.size(); c++) {
+      jpeg_in.components[c].coeffs = std::move(coeffs[c]);
+    }
     std::vector<uint8_t> jpeg_data;
     if (!jxl::jpeg::EncodeJPEGData(&frame_settings->enc->memory_manager,
                                    data_in, &jpeg_data,
@@ -2219,12 +2820,19 @@ JxlEncoderStatus JxlEncoderAddJPEGFrame(
       // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
       // default move constructor there.
       jxl::JxlEncoderQueuedFrame{
-          frame_settings->values, std::move(frame_data), {}});
+          frame_settings->values, std::move(frame_data), {}, false, false,
+          jxl::PaddedBytes(&frame_settings->enc->memory_manager)});
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
                          "No frame queued?");
   }
+  // Searching the chroma from luma factors takes most of the time of the
+  // recompression at efforts 1 and 2, where it is off unless requested.
+  if (frame_settings->values.jpeg_recon_cfl == -1 &&
+      frame_settings->values.cparams.speed_tier >= jxl::SpeedTier::kThunder) {
+    queued_frame->option_values.cparams.force_cfl_jpeg_recompression = false;
+  }
   queued_frame->ec_initialized.resize(
       frame_settings->enc->metadata.m.num_extra_channels);
 
@@ -2240,16 +2848,36 @@ static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
   }
   // TODO(veluca): many of the following options could be made to work, but are
   // just not implemented in FJXL's frame header handling yet.
-  if (frame_settings->values.frame_index_box) {
+  if (frame_settings->values.frame_index_box ||
+      frame_settings->values.progression_index) {
     return false;
   }
-  if (frame_settings->values.header.layer_info.have_crop) {
+  // Frames can be cropped and part of an animation, but are always replaced
+  // on the image or on a reference frame.
+  const JxlLayerInfo& layer_info = frame_settings->values.header.layer_info;
+  if (layer_info.blend_info.blendmode != JXL_BLEND_REPLACE ||
+      layer_info.save_as_reference >= 3) {
     return false;
   }
-  if (frame_settings->enc->metadata.m.have_animation) {
-    return false;
+  for (const JxlBlendInfo& blend_info :
+       frame_settings->values.extra_channel_blend_info) {
+    if (blend_info.blendmode != JXL_BLEND_REPLACE ||
+        blend_info.source != layer_info.blend_info.source) {
+      return false;
+    }
   }
-  if (frame_settings->values.cparams.speed_tier != jxl::SpeedTier::kLightning) {
+  // Effort 1 always uses FJXL. Effort 2 uses its predictor and color
+  // transform search, unless the modular tools it does not pick from were
+  // requested.
+  const jxl::CompressParams& cparams = frame_settings->values.cparams;
+  if (cparams.speed_tier == jxl::SpeedTier::kThunder) {
+    if (cparams.options.predictor != jxl::kUndefinedPredictor ||
+        cparams.colorspace >= 0 || cparams.responsive == 1 ||
+        (cparams.modular_group_size_shift >= 0 &&
+         cparams.modular_group_size_shift != 1)) {
+      return false;
+    }
+  } else if (cparams.speed_tier != jxl::SpeedTier::kLightning) {
     return false;
   }
   if (frame_settings->values.image_bit_depth.type ==
@@ -2272,17 +2900,43 @@ static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
       frame_settings->enc->metadata.m.num_extra_channels != 0) {
     return false;
   }
-  if (frame_settings->enc->metadata.m.bit_depth.bits_per_sample > 16) {
+  const jxl::BitDepth& bit_depth = frame_settings->enc->metadata.m.bit_depth;
+  if (bit_depth.bits_per_sample > 16) {
     return false;
   }
-  if (pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT16 &&
+  if (pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT &&
+      pixel_format->data_type != JxlDataType::JXL_TYPE_FLOAT16 &&
       pixel_format->data_type != JxlDataType::JXL_TYPE_UINT16 &&
       pixel_format->data_type != JxlDataType::JXL_TYPE_UINT8) {
     return false;
   }
-  if ((frame_settings->enc->metadata.m.bit_depth.bits_per_sample > 8) !=
-      (pixel_format->data_type == JxlDataType::JXL_TYPE_UINT16 ||
-       pixel_format->data_type == JxlDataType::JXL_TYPE_FLOAT16)) {
+  // Float samples are encoded as the integers with the same bits, which FJXL
+  // reads as 16-bit samples, so only binary16 samples are supported. Alpha
+  // must have the same format, since FJXL reads it with the color channels.
+  const bool float_input =
+      pixel_format->data_type == JxlDataType::JXL_TYPE_FLOAT ||
+      pixel_format->data_type == JxlDataType::JXL_TYPE_FLOAT16;
+  if (float_input != bit_depth.floating_point_sample) {
+    return false;
+  }
+  if (bit_depth.floating_point_sample) {
+    if (bit_depth.bits_per_sample != 16 ||
+        bit_depth.exponent_bits_per_sample != 5) {
+      return false;
+    }
+    if (has_alpha &&
+        (!frame_settings->enc->metadata.m.extra_channel_info[0]
+              .bit_depth.floating_point_sample ||
+         frame_settings->enc->metadata.m.extra_channel_info[0]
+                 .bit_depth.bits_per_sample != 16 ||
+         frame_settings->enc->metadata.m.extra_channel_info[0]
+                 .bit_depth.exponent_bits_per_sample != 5)) {
+      return false;
+    }
+  }
+  if ((bit_depth.bits_per_sample > 8) !=
+      (float_input ||
+       pixel_format->data_type == JxlDataType::JXL_TYPE_UINT16)) {
     return false;
   }
   if (!((pixel_format->num_channels == 1 || pixel_format->num_channels == 3) &&
@@ -2296,6 +2950,12 @@ static bool CanDoFastLossless(const JxlEncoderFrameSettings* frame_settings,
 }
 
 namespace {
+// FJXL effort for the libjxl effort: from 3, FJXL searches the predictors and
+// the color transform.
+int FastLosslessEffort(jxl::SpeedTier speed_tier) {
+  return speed_tier == jxl::SpeedTier::kLightning ? 2 : 3;
+}
+
 JxlEncoderStatus JxlEncoderAddImageFrameInternal(
     const JxlEncoderFrameSettings* frame_settings, size_t xsize, size_t ysize,
     bool streaming, jxl::JxlEncoderChunkedFrameAdapter&& frame_data) {
@@ -2356,30 +3016,72 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
 
   // All required conditions to do fast-lossless.
   if (CanDoFastLossless(frame_settings, &pixel_format, has_alpha)) {
-    const bool big_endian =
+    bool big_endian =
         pixel_format.endianness == JXL_BIG_ENDIAN ||
         (pixel_format.endianness == JXL_NATIVE_ENDIAN && !IsLittleEndian());
+    JxlChunkedFrameInputSource input = frame_data.GetInputSource();
+    // FJXL reads binary16 samples, 32-bit floats are converted as they are
+    // requested.
+    std::unique_ptr<jxl::FastLosslessFloatInput> float_input;
+    if (pixel_format.data_type == JXL_TYPE_FLOAT) {
+      float_input = jxl::make_unique<jxl::FastLosslessFloatInput>(input);
+      input = float_input->GetInputSource();
+      big_endian = !IsLittleEndian();
+    }
 
     RunnerTicket ticket{frame_settings->enc->thread_pool.get()};
     JXL_BOOL oneshot = TO_JXL_BOOL(!frame_data.StreamingInput());
-    auto* frame_state = JxlFastLosslessPrepareFrame(
-        frame_data.GetInputSource(), xsize, ysize, num_channels,
+    const JxlFastLosslessCodes* codes =
+        frame_settings->values.fast_lossless_reuse_codes
+            ? frame_settings->enc->fast_lossless_codes.get()
+            : nullptr;
+    auto* frame_state = JxlFastLosslessPrepareFrameWithCodes(
+        input, xsize, ysize, num_channels,
         frame_settings->enc->metadata.m.bit_depth.bits_per_sample, big_endian,
-        /*effort=*/2, oneshot);
+        FastLosslessEffort(frame_settings->values.cparams.speed_tier), oneshot,
+        codes);
+    frame_settings->enc->fast_lossless_codes.reset(
+        JxlFastLosslessCopyCodes(frame_state));
+
+    const jxl::CodecMetadata& metadata = frame_settings->enc->metadata;
+    const JxlFrameHeader& header = frame_settings->values.header;
+    JxlFastLosslessFrameHeaderOptions header_options = {};
+    header_options.have_animation = TO_JXL_BOOL(metadata.m.have_animation);
+    header_options.have_timecodes =
+        TO_JXL_BOOL(metadata.m.animation.have_timecodes);
+    header_options.duration = header.duration;
+    header_options.timecode = header.timecode;
+    header_options.image_width = metadata.xsize();
+    header_options.image_height = metadata.ysize();
+    header_options.x0 = header.layer_info.crop_x0;
+    header_options.y0 = header.layer_info.crop_y0;
+    header_options.source = header.layer_info.blend_info.source;
+    header_options.save_as_reference = header.layer_info.save_as_reference;
+    JxlFastLosslessSetFrameHeaderOptions(frame_state, &header_options);
     if (!streaming) {
       bool ok =
           JxlFastLosslessProcessFrame(frame_state, /*is_last=*/false, &ticket,
                                       &FastLosslessRunnerAdapter, nullptr);
       if (!ok || ticket.has_error) {
+        JxlFastLosslessFreeFrameState(frame_state);
         return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_GENERIC,
                              "Internal: JxlFastLosslessProcessFrame failed");
       }
+      if (float_input && float_input->has_error()) {
+        JxlFastLosslessFreeFrameState(frame_state);
+        return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_BAD_INPUT,
+                             "Float samples are not representable as binary16");
+      }
     }
-    QueueFastLosslessFrame(frame_settings, frame_state);
+    QueueFastLosslessFrame(frame_settings, frame_state, std::move(float_input));
     return JxlErrorOrStatus::Success();
   }
 
-  if (!streaming) {
+  // Buffers are borrowed as long as the caller keeps them, see
+  // JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS.
+  const bool borrowed = frame_settings->values.borrow_input_buffers &&
+                        !frame_data.StreamingInput();
+  if (!streaming && !borrowed) {
     // The input callbacks are only guaranteed to be available during frame
     // encoding when both the input and the output is streaming. In all other
     // cases we need to create an internal copy of the frame data.
@@ -2405,7 +3107,8 @@ JxlEncoderStatus JxlEncoderAddImageFrameInternal(
       // JxlEncoderQueuedFrame is a struct with no constructors, so we use the
       // default move constructor there.
       jxl::JxlEncoderQueuedFrame{
-          frame_settings->values, std::move(frame_data), {}});
+          frame_settings->values, std::move(frame_data), {}, false, false,
+          jxl::PaddedBytes(&frame_settings->enc->memory_manager)});
 
   if (!queued_frame) {
     // TODO(jon): when can this happen? is this an API usage error?
@@ -2450,6 +3153,67 @@ JxlEncoderStatus JxlEncoderAddImageFrame(
                                          std::move(frame_data));
 }
 
+JxlEncoderStatus JxlEncoderPrewarm(
+    const JxlEncoderFrameSettings* frame_settings) {
+  JxlEncoder* enc = frame_settings->enc;
+  if (!enc->basic_info_set) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_API_USAGE, "Basic info not set yet");
+  }
+  size_t xsize;
+  size_t ysize;
+  if (GetCurrentDimensions(frame_settings, xsize, ysize) != JXL_ENC_SUCCESS) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "bad dimensions");
+  }
+  const uint32_t num_channels = enc->basic_info.num_color_channels;
+  const JxlPixelFormat color_format = {num_channels, JXL_TYPE_UINT8,
+                                       JXL_NATIVE_ENDIAN, 0};
+  const JxlPixelFormat ec_format = {1, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  // The fast lossless encoder has nothing to keep.
+  if (CanDoFastLossless(frame_settings, &color_format,
+                        enc->metadata.m.HasAlpha())) {
+    return JxlErrorOrStatus::Success();
+  }
+  // Noise, so that the frame uses buffers and transforms like real content.
+  std::vector<uint8_t> pixels(xsize * ysize * num_channels);
+  jxl::Rng rng(0);
+  for (uint8_t& sample : pixels) sample = rng.UniformU(0, 256);
+  const size_t num_extra_channels = enc->metadata.m.num_extra_channels;
+  jxl::JxlEncoderChunkedFrameAdapter frame_data(xsize, ysize,
+                                                num_extra_channels);
+  if (!frame_data.SetFromBuffer(0, pixels.data(), pixels.size(),
+                                color_format)) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "Invalid frame size");
+  }
+  for (size_t i = 0; i < num_extra_channels; ++i) {
+    if (!frame_data.SetFromBuffer(1 + i, pixels.data(), xsize * ysize,
+                                  ec_format)) {
+      return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "Invalid frame size");
+    }
+  }
+  if (!enc->color_encoding_set) {
+    enc->metadata.m.color_encoding = jxl::ColorEncoding::SRGB(num_channels < 3);
+  }
+  jxl::JxlEncoderQueuedFrame frame{
+      frame_settings->values, std::move(frame_data), {}, false, false,
+      jxl::PaddedBytes(&enc->memory_manager)};
+  frame.option_values.cparams.level = enc->codestream_level;
+  SetColorTransform(enc->metadata, &frame);
+  const jxl::FrameInfo frame_info =
+      GetFrameInfo(frame, enc->metadata, /*last_frame=*/true);
+  SetLargeAllocationPolicy(frame.option_values, enc->thread_pool.get(),
+                           &enc->frame_arena);
+  JxlEncoderOutputProcessorWrapper output(&enc->memory_manager);
+  const bool ok = jxl::EncodeFrame(
+      &enc->frame_memory_manager, frame.option_values.cparams, frame_info,
+      &enc->metadata, frame.frame_data, enc->cms_cache.Wrap(enc->cms),
+      enc->thread_pool.get(), &output, /*aux_out=*/nullptr);
+  enc->frame_arena.Reset();
+  if (!ok) {
+    return JXL_API_ERROR(enc, JXL_ENC_ERR_GENERIC, "Failed to encode frame");
+  }
+  return JxlErrorOrStatus::Success();
+}
+
 JxlEncoderStatus JxlEncoderAddChunkedFrame(
     const JxlEncoderFrameSettings* frame_settings, JXL_BOOL is_last_frame,
     JxlChunkedFrameInputSource chunked_frame_input) {
@@ -2560,8 +3324,9 @@ JXL_EXPORT JxlEncoderStatus JxlEncoderSetExtraChannelBuffer(
   }
   const uint8_t* uint8_buffer = reinterpret_cast<const uint8_t*>(buffer);
   auto* queued_frame = frame_settings->enc->input_queue.back().frame.get();
-  if (!queued_frame->frame_data.SetFromBuffer(1 + index, uint8_buffer, size,
-                                              ec_format)) {
+  if (!queued_frame->frame_data.SetFromBuffer(
+          1 + index, uint8_buffer, size, ec_format,
+          queued_frame->option_values.borrow_input_buffers)) {
     return JXL_API_ERROR(frame_settings->enc, JXL_ENC_ERR_API_USAGE,
                          "provided image buffer too small");
   }
@@ -2730,10 +3495,34 @@ JXL_EXPORT JxlEncoderStats* JxlEncoderStatsCreate() {
 
 JXL_EXPORT void JxlEncoderStatsDestroy(JxlEncoderStats* stats) { delete stats; }
 
+JXL_EXPORT JxlEncoderAnalysisCache* JxlEncoderAnalysisCacheCreate(
+    const JxlMemoryManager* memory_manager) {
+  auto cache = std::make_shared<jxl::FrameAnalysisCache>();
+  if (!jxl::MemoryManagerInit(&cache->memory_manager, memory_manager)) {
+    return nullptr;
+  }
+  cache->own_memory_manager = true;
+  JxlEncoderAnalysisCache* result = new JxlEncoderAnalysisCache();
+  result->cache = std::move(cache);
+  return result;
+}
+
+JXL_EXPORT void JxlEncoderAnalysisCacheDestroy(JxlEncoderAnalysisCache* cache) {
+  delete cache;
+}
+
+JXL_EXPORT JxlEncoderStatus JxlEncoderFrameSettingsSetAnalysisCache(
+    JxlEncoderFrameSettings* frame_settings, JxlEncoderAnalysisCache* cache) {
+  frame_settings->values.cparams.analysis_cache =
+      cache ? cache->cache : nullptr;
+  return JxlErrorOrStatus::Success();
+}
+
 JXL_EXPORT void JxlEncoderCollectStats(JxlEncoderFrameSettings* frame_settings,
                                        JxlEncoderStats* stats) {
   if (!stats) return;
   frame_settings->values.aux_out = stats->aux_out.get();
+  stats->aux_out->memory_budget = &frame_settings->enc->memory_budget;
 }
 
 JXL_EXPORT size_t JxlEncoderStatsGet(const JxlEncoderStats* stats,
@@ -2793,9 +3582,61 @@ JXL_EXPORT size_t JxlEncoderStatsGet(const JxlEncoderStats* stats,
       return aux_out.num_dct64_blocks;
     case JXL_ENC_STAT_NUM_BUTTERAUGLI_ITERS:
       return aux_out.num_butteraugli_iters;
+    case JXL_ENC_STAT_ESTIMATED_DECODE_NS:
+      return aux_out.estimated_decode_ns;
     default:
-      return 0;
+      break;
+  }
+  // Three keys per phase, in the order of jxl::EncoderPhase.
+  static_assert(JXL_ENC_STAT_WRITING_PEAK_BYTES + 1 -
+                        JXL_ENC_STAT_TO_XYB_WALL_US ==
+                    3 * jxl::kNumEncoderPhases,
+                "JxlEncoderStatsKey and EncoderPhase do not match");
+  static_assert(JXL_ENC_STAT_WRITING_WALL_US - JXL_ENC_STAT_TO_XYB_WALL_US ==
+                    3 * static_cast<int>(jxl::EncoderPhase::Writing),
+                "JxlEncoderStatsKey and EncoderPhase do not match");
+  if (key < JXL_ENC_STAT_TO_XYB_WALL_US ||
+      key > JXL_ENC_STAT_WRITING_PEAK_BYTES) {
+    return 0;
+  }
+  const int index = key - JXL_ENC_STAT_TO_XYB_WALL_US;
+  const jxl::AuxOut::PhaseTotals& phase = aux_out.phases[index / 3];
+  switch (index % 3) {
+    case 0:
+      return phase.wall_us;
+    case 1:
+      return phase.cpu_us;
+    default:
+      return phase.peak_bytes;
+  }
+}
+
+static_assert(jxl::kMaxEncoderCounters == JXL_ENC_STATS_MAX_COUNTERS,
+              "counter limits differ");
+
+JXL_EXPORT JXL_BOOL JxlEncoderStatsSetCounters(
+    JxlEncoderStats* stats, size_t num_counters,
+    JxlEncoderStatsCounterReader reader, void* opaque) {
+  if (!stats || num_counters > JXL_ENC_STATS_MAX_COUNTERS ||
+      (num_counters != 0 && !reader)) {
+    return JXL_FALSE;
+  }
+  stats->aux_out->counter_reader = num_counters != 0 ? reader : nullptr;
+  stats->aux_out->counter_opaque = opaque;
+  stats->aux_out->num_counters = num_counters;
+  return JXL_TRUE;
+}
+
+JXL_EXPORT uint64_t JxlEncoderStatsGetCounter(const JxlEncoderStats* stats,
+                                              JxlEncoderStatsKey key,
+                                              size_t counter) {
+  if (!stats || counter >= JXL_ENC_STATS_MAX_COUNTERS ||
+      key < JXL_ENC_STAT_TO_XYB_WALL_US ||
+      key > JXL_ENC_STAT_WRITING_PEAK_BYTES) {
+    return 0;
   }
+  const int index = key - JXL_ENC_STAT_TO_XYB_WALL_US;
+  return stats->aux_out->phases[index / 3].counts[counter];
 }
 
 JXL_EXPORT void JxlEncoderStatsMerge(JxlEncoderStats* stats,
@@ -0,0 +1,91 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/encode.h>
+#include <jxl/stats.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <hwy/targets.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/enc/jxl.h"
+#include "lib/extras/packed_image.h"
+#include "lib/jxl/base/span.h"
+#include "tools/file_io.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+// Encodes flower.png from the test data at distance 1 and effort 7 on a single
+// thread, with the code of `target`, and reports the wall time of the encoder
+// phase whose time is the stat `key`, such as the AC strategy search or the
+// chroma from luma heuristics. Items are pixels.
+void BM_EncoderPhase(benchmark::State& state, int64_t target,
+                     JxlEncoderStatsKey key) {
+  std::vector<uint8_t> png;
+  BM_CHECK(jpegxl::tools::ReadFile(
+      std::string(TEST_DATA_PATH "/jxl/flower/flower.png"), &png));
+  extras::PackedPixelFile ppf;
+  BM_CHECK(extras::DecodeBytes(Bytes(png), extras::ColorHints(), &ppf));
+
+  hwy::SetSupportedTargetsForTest(target);
+  for (auto _ : state) {
+    (void)_;
+    JxlEncoderStats* stats = JxlEncoderStatsCreate();
+    extras::JXLCompressParams cparams;
+    cparams.distance = 1.0f;
+    cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 7);
+    cparams.stats = stats;
+    std::vector<uint8_t> compressed;
+    const bool ok = extras::EncodeImageJXL(cparams, ppf,
+                                           /*jpeg_bytes=*/nullptr, &compressed);
+    const size_t wall_us = JxlEncoderStatsGet(stats, key);
+    JxlEncoderStatsDestroy(stats);
+    BM_CHECK(ok);
+    state.SetIterationTime(wall_us * 1e-6);
+  }
+  hwy::SetSupportedTargetsForTest(0);
+
+  state.SetItemsProcessed(ppf.info.xsize * ppf.info.ysize *
+                          state.iterations());
+}
+
+}  // namespace
+}  // namespace jxl
+
+// Registers the benchmarks of the encoder phases, once for each SIMD target, as
+// "<phase>/<target>". They time only that phase of full encodes.
+void RegisterEncoderBenchmarks();
+
+void RegisterEncoderBenchmarks() {
+  const std::pair<const char*, JxlEncoderStatsKey> phases[] = {
+      {"AcStrategy", JXL_ENC_STAT_AC_STRATEGY_WALL_US},
+      {"ChromaFromLuma", JXL_ENC_STAT_CHROMA_FROM_LUMA_WALL_US},
+  };
+  for (const auto& phase : phases) {
+    for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+      std::string name =
+          std::string(phase.first) + "/" + hwy::TargetName(target);
+      benchmark::RegisterBenchmark(name.c_str(), jxl::BM_EncoderPhase, target,
+                                   phase.second)
+          ->UseManualTime();
+    }
+  }
+}
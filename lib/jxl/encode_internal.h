@@ -15,12 +15,14 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
@@ -39,6 +41,8 @@
 
 namespace jxl {
 
+struct FrameInfo;
+
 /* Frame index box 'jxli' will start with Varint() for
 NF: has type Varint(): number of frames listed in the index.
 TNUM: has type u32: numerator of tick unit.
@@ -117,6 +121,28 @@ typedef struct JxlEncoderFrameIndexBoxStruct {
   }
 } JxlEncoderFrameIndexBox;
 
+// Where the parts of a frame are in the output of EncodeFrame for it, in bytes
+// from the start of that output, which begins with the frames of its patches
+// and progressive DC, if any. Recorded for the progression index box.
+struct FrameProgressionOffsets {
+  // End of the DC global, DC group and AC global sections, after which the
+  // frame can be rendered from its DC.
+  size_t dc_end = 0;
+  // End of the AC groups of each pass, and of all the sections before them.
+  std::vector<size_t> pass_end;
+  // Start of each section, in the order of the TOC.
+  std::vector<size_t> section_start;
+  size_t frame_end = 0;
+};
+
+// A frame of the progression index box: the offset of the output of its
+// EncodeFrame in the codestream, counted like the offsets of the frame index
+// box, and the offsets of its parts from there.
+struct JxlEncoderProgressionIndexEntry {
+  uint64_t codestream_offset;
+  FrameProgressionOffsets offsets;
+};
+
 // The encoder options (such as quality, compression speed, ...) for a single
 // frame, but not encoder-wide options such as box-related options.
 typedef struct JxlEncoderFrameSettingsValuesStruct {
@@ -129,6 +155,13 @@ typedef struct JxlEncoderFrameSettingsValuesStruct {
   std::string frame_name;
   JxlBitDepth image_bit_depth;
   bool frame_index_box = false;
+  bool progression_index = false;
+  bool fast_lossless_reuse_codes = false;
+  // Bits of JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS.
+  int64_t large_allocations = 0;
+  bool borrow_input_buffers = false;
+  // Value of JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL, -1 if it was not set.
+  int64_t jpeg_recon_cfl = -1;
   jxl::AuxOut* aux_out = nullptr;
 } JxlEncoderFrameSettingsValues;
 
@@ -202,13 +235,15 @@ class JxlEncoderChunkedFrameAdapter {
     has_input_source_ = true;
   }
 
+  // Unless "borrow" is set, the buffers of extra channels are copied right
+  // away, and the color one by CopyBuffers.
   bool SetFromBuffer(size_t channel, const uint8_t* buffer, size_t size,
-                     JxlPixelFormat format) {
+                     JxlPixelFormat format, bool borrow = false) {
     if (channel >= channels_.size()) return false;
     if (!channels_[channel].SetFromBuffer(buffer, size, format, xsize, ysize)) {
       return false;
     }
-    if (channel > 0) channels_[channel].CopyBuffer();
+    if (channel > 0 && !borrow) channels_[channel].CopyBuffer();
     return true;
   }
 
@@ -315,7 +350,8 @@ class JxlEncoderChunkedFrameAdapter {
     size_t ysize_;
     size_t bytes_per_pixel_;
     size_t stride_;
-    std::vector<uint8_t> copy_;
+    // Not value-initialized, since it is always overwritten right away.
+    std::unique_ptr<uint8_t[]> copy_;
 
     void SetFormatAndDimensions(JxlPixelFormat format, size_t x_size,
                                 size_t y_size) {
@@ -343,9 +379,9 @@ class JxlEncoderChunkedFrameAdapter {
                         size_t x_size, size_t y_size, size_t row_offset) {
       SetFormatAndDimensions(format, x_size, y_size);
       buffer_ = nullptr;
-      copy_.resize(y_size * stride_);
+      copy_.reset(new uint8_t[y_size * stride_]);
       for (size_t y = 0; y < y_size; ++y) {
-        memcpy(copy_.data() + y * stride_,
+        memcpy(copy_.get() + y * stride_,
                reinterpret_cast<const uint8_t*>(buffer) + y * row_offset,
                stride_);
       }
@@ -353,14 +389,15 @@ class JxlEncoderChunkedFrameAdapter {
 
     void CopyBuffer() {
       if (buffer_) {
-        copy_ = std::vector<uint8_t>(buffer_, buffer_ + buffer_size_);
+        copy_.reset(new uint8_t[buffer_size_]);
+        memcpy(copy_.get(), buffer_, buffer_size_);
         buffer_ = nullptr;
       }
     }
 
     const void* GetDataAt(size_t xpos, size_t ypos, size_t x_size,
                           size_t y_size, size_t* row_offset) const {
-      const uint8_t* buffer = copy_.empty() ? buffer_ : copy_.data();
+      const uint8_t* buffer = copy_ ? copy_.get() : buffer_;
       JXL_DASSERT(ypos + y_size <= ysize_);
       JXL_DASSERT(xpos + x_size <= xsize_);
       JXL_DASSERT(buffer);
@@ -371,21 +408,96 @@ class JxlEncoderChunkedFrameAdapter {
   std::vector<Channel> channels_;
 };
 
+// Input source of the fast lossless encoder for binary16 images given as 32-bit
+// floats: hands out the requested regions converted to binary16, the same
+// integers as the modular encoder stores for these samples. Samples that
+// binary16 cannot represent exactly are replaced by zero and set has_error().
+class FastLosslessFloatInput {
+ public:
+  explicit FastLosslessFloatInput(JxlChunkedFrameInputSource input)
+      : input_(input) {
+    input_.get_color_channels_pixel_format(input_.opaque, &format_);
+  }
+
+  JxlChunkedFrameInputSource GetInputSource() {
+    return JxlChunkedFrameInputSource{
+        this,
+        METHOD_TO_C_CALLBACK(
+            &FastLosslessFloatInput::GetColorChannelsPixelFormat),
+        METHOD_TO_C_CALLBACK(&FastLosslessFloatInput::GetColorChannelDataAt),
+        METHOD_TO_C_CALLBACK(
+            &FastLosslessFloatInput::GetExtraChannelPixelFormat),
+        METHOD_TO_C_CALLBACK(&FastLosslessFloatInput::GetExtraChannelDataAt),
+        METHOD_TO_C_CALLBACK(&FastLosslessFloatInput::ReleaseCurrentData)};
+  }
+
+  bool has_error() const { return has_error_.load(); }
+
+ private:
+  void GetColorChannelsPixelFormat(JxlPixelFormat* pixel_format) {
+    *pixel_format = format_;
+    pixel_format->data_type = JXL_TYPE_FLOAT16;
+    pixel_format->endianness = JXL_NATIVE_ENDIAN;
+    pixel_format->align = 0;
+  }
+
+  const void* GetColorChannelDataAt(size_t xpos, size_t ypos, size_t x_size,
+                                    size_t y_size, size_t* row_offset);
+
+  void GetExtraChannelPixelFormat(size_t ec_index,
+                                  JxlPixelFormat* pixel_format) {
+    input_.get_extra_channel_pixel_format(input_.opaque, ec_index,
+                                          pixel_format);
+  }
+
+  const void* GetExtraChannelDataAt(size_t ec_index, size_t xpos, size_t ypos,
+                                    size_t x_size, size_t y_size,
+                                    size_t* row_offset) {
+    return input_.get_extra_channel_data_at(input_.opaque, ec_index, xpos,
+                                            ypos, x_size, y_size, row_offset);
+  }
+
+  // Extra channel buffers come from the wrapped source, color buffers from
+  // GetColorChannelDataAt.
+  void ReleaseCurrentData(const void* buffer);
+
+  JxlChunkedFrameInputSource input_;
+  JxlPixelFormat format_ = {4, JXL_TYPE_FLOAT, JXL_NATIVE_ENDIAN, 0};
+  // Color buffers handed out and not released yet. Regions can be requested
+  // by several threads at once.
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<uint16_t[]>> buffers_;
+  std::atomic<bool> has_error_{false};
+};
+
 struct JxlEncoderQueuedFrame {
   JxlEncoderFrameSettingsValues option_values;
   JxlEncoderChunkedFrameAdapter frame_data;
   std::vector<uint8_t> ec_initialized;
+  // Codestream of the frame, if it was encoded ahead of time together with
+  // other queued frames, and whether it was encoded as the last frame.
+  bool encoded_ahead;
+  bool encoded_as_last;
+  PaddedBytes encoded_bytes;
+  // Filled by EncodeFrame if option_values.progression_index is set.
+  FrameProgressionOffsets progression_offsets;
 };
 
 struct JxlEncoderQueuedBox {
   BoxType type;
   std::vector<uint8_t> contents;
   bool compress_box;
+  // Contents of the brob box, if they were compressed ahead of time on the
+  // runner. Value initialized when the box is queued.
+  bool compressed_ahead;
+  std::vector<uint8_t> compressed;
 };
 
 using FJXLFrameUniquePtr =
     std::unique_ptr<JxlFastLosslessFrameState,
                     decltype(&JxlFastLosslessFreeFrameState)>;
+using FJXLCodesUniquePtr =
+    std::unique_ptr<JxlFastLosslessCodes, decltype(&JxlFastLosslessFreeCodes)>;
 
 // Either a frame, or a box, not both.
 // Can also be a FJXL frame.
@@ -397,6 +509,44 @@ struct JxlEncoderQueuedInput {
   MemoryManagerUniquePtr<JxlEncoderQueuedBox> box;
   FJXLFrameUniquePtr fast_lossless_frame = {nullptr,
                                             JxlFastLosslessFreeFrameState};
+  // Input of the fast lossless frame, when the frame converts it.
+  std::unique_ptr<FastLosslessFloatInput> fast_lossless_float_input;
+};
+
+// Keeps the color transforms of the frames once they are done, for the next
+// frames and images that convert between the same profiles with the same CMS.
+// Creating a transform parses both ICC profiles, which can take longer than
+// converting a small image.
+class CmsTransformCache {
+ public:
+  CmsTransformCache();
+  CmsTransformCache(const CmsTransformCache&) = delete;
+  CmsTransformCache& operator=(const CmsTransformCache&) = delete;
+  ~CmsTransformCache();
+
+  // Returns a CMS that takes its transforms from this cache, or creates them
+  // with `cms`, and returns them to this cache when they are destroyed. It is
+  // valid as long as this cache. The transforms of another CMS are dropped.
+  JxlCmsInterface Wrap(const JxlCmsInterface& cms);
+
+ private:
+  struct Transform;
+
+  static void* Init(void* init_data, size_t num_threads,
+                    size_t pixels_per_thread, const JxlColorProfile* input,
+                    const JxlColorProfile* output, float intensity_target);
+  static float* GetSrcBuf(void* user_data, size_t thread);
+  static float* GetDstBuf(void* user_data, size_t thread);
+  static JXL_BOOL Run(void* user_data, size_t thread, const float* input,
+                      float* output, size_t num_pixels);
+  static void Destroy(void* user_data);
+
+  static constexpr size_t kMaxCachedTransforms = 8;
+
+  std::mutex mutex_;
+  JxlCmsInterface cms_ = {};
+  // Transforms that are not in use, least recently used first.
+  std::vector<std::unique_ptr<Transform>> cached_;
 };
 
 static constexpr size_t kSmallBoxHeaderSize = 8;
@@ -444,6 +594,11 @@ class JxlEncoderOutputProcessorWrapper {
   jxl::StatusOr<JxlOutputProcessorBuffer> GetBuffer(size_t min_size,
                                                     size_t requested_size = 0);
 
+  // Writes `data` at the current position. Bytes that could not go to the
+  // output right away would be copied to an internal buffer: in that case,
+  // `data` itself becomes the buffer. Requires that no buffer is taken.
+  jxl::Status AppendOwned(jxl::PaddedBytes&& data);
+
   jxl::Status Seek(size_t pos);
 
   jxl::Status SetFinalizedPosition();
@@ -462,6 +617,7 @@ class JxlEncoderOutputProcessorWrapper {
 
   // TODO(eustas): consider extra copy elimination
   jxl::Status CopyOutput(std::vector<uint8_t>& output);
+  jxl::Status CopyOutput(jxl::PaddedBytes& output);
 
  private:
   jxl::Status ReleaseBuffer(size_t bytes_used);
@@ -596,7 +752,14 @@ jxl::Status AppendData(JxlEncoderOutputProcessorWrapper& output_processor,
 // JxlEncoderCreate.
 struct JxlEncoderStruct {
   JxlEncoderStruct() : output_processor(&memory_manager) {}
+  // Allocates through memory_budget from the memory manager of the user, so
+  // that the stats can report the peak memory of the encoding phases.
+  jxl::MemoryBudget memory_budget;
   JxlMemoryManager memory_manager;
+  // Allocates the intermediates of the frames through frame_arena from
+  // memory_manager. Declared before everything that may hold its allocations.
+  jxl::MemoryArena frame_arena;
+  JxlMemoryManager frame_memory_manager;
   jxl::MemoryManagerUniquePtr<jxl::ThreadPool> thread_pool{
       nullptr, jxl::MemoryManagerDeleteHelper(&memory_manager)};
   std::vector<jxl::MemoryManagerUniquePtr<JxlEncoderFrameSettings>>
@@ -615,9 +778,13 @@ struct JxlEncoderStruct {
   // or across multiple jxlp boxes.
   size_t codestream_bytes_written_end_of_frame;
   jxl::JxlEncoderFrameIndexBox frame_index_box;
+  // Frames for the progression index box, stored after the last frame.
+  std::vector<jxl::JxlEncoderProgressionIndexEntry> progression_index;
 
   JxlCmsInterface cms;
   bool cms_set;
+  // Color transforms of the frames encoded with cms, kept by JxlEncoderReset.
+  jxl::CmsTransformCache cms_cache;
 
   // Force using the container even if not needed
   bool use_container;
@@ -654,11 +821,39 @@ struct JxlEncoderStruct {
   bool intensity_target_set;
   bool allow_expert_options = false;
   int brotli_effort = -1;
+  // How many queued frames may be encoded concurrently.
+  size_t max_frames_in_flight = 1;
+  // Prefix codes of the last frame added with the fast lossless encoder, for
+  // the next one if it reuses them.
+  jxl::FJXLCodesUniquePtr fast_lossless_codes{nullptr,
+                                              JxlFastLosslessFreeCodes};
+  // Coefficient orders and AC clustering of the last lossy frame with
+  // JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING, shared with the CompressParams
+  // of the frame settings that enable it.
+  std::shared_ptr<jxl::EntropyCodingCache> entropy_coding_cache;
+  // MA trees and histograms of the first lossless modular frame with
+  // JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE, kept by JxlEncoderReset.
+  std::shared_ptr<jxl::ModularTreeCache> modular_tree_cache;
 
   // Takes the first frame in the input_queue, encodes it, and appends
   // the bytes to the output_byte_queue.
   jxl::Status ProcessOneEnqueuedInput();
 
+  // Concurrently encodes up to max_frames_in_flight frames from the start of
+  // the input_queue into memory, so that ProcessOneEnqueuedInput only has to
+  // append them to the output, in order.
+  jxl::Status EncodeQueuedFramesAhead();
+
+  // Encodes the first queued frame, which must not be encoded ahead, to the
+  // output, while the other threads of the runner compress the queued boxes
+  // that are to be written as brob boxes.
+  jxl::Status EncodeFrameCompressingBoxes(jxl::JxlEncoderQueuedFrame* frame,
+                                          const jxl::FrameInfo& frame_info);
+
+  // Concurrently compresses the queued boxes that are to be written as brob
+  // boxes, so that ProcessOneEnqueuedInput only has to append them.
+  jxl::Status CompressQueuedBoxesAhead();
+
   bool MustUseContainer() const {
     return use_container || (codestream_level != 5 && codestream_level != -1) ||
            store_jpeg_metadata || use_boxes;
@@ -685,4 +880,9 @@ struct JxlEncoderStatsStruct {
   std::unique_ptr<jxl::AuxOut> aux_out;
 };
 
+struct JxlEncoderAnalysisCacheStruct {
+  // Shared with the CompressParams of the frame settings that use the cache.
+  std::shared_ptr<jxl::FrameAnalysisCache> cache;
+};
+
 #endif  // LIB_JXL_ENCODE_INTERNAL_H_
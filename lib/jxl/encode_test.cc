@@ -12,8 +12,12 @@
 #include <jxl/encode.h>
 #include <jxl/encode_cxx.h>
 #include <jxl/memory_manager.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
 #include <jxl/types.h>
 
+#include <atomic>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
@@ -34,9 +38,12 @@
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/c_callback_support.h"
 #include "lib/jxl/base/override.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
+#include "lib/jxl/enc_cache.h"
+#include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/encode_internal.h"
 #include "lib/jxl/modular/options.h"
@@ -271,6 +278,104 @@ TEST(EncodeTest, EncoderResetTest) {
                       false);
 }
 
+TEST(EncodeTest, EncoderResetKeepsFrameMemory) {
+  size_t allocs = 0;
+  JxlMemoryManager mm;
+  mm.opaque = &allocs;
+  mm.alloc = [](void* opaque, size_t size) {
+    (*reinterpret_cast<size_t*>(opaque))++;
+    return malloc(size);
+  };
+  mm.free = [](void* opaque, void* address) { free(address); };
+
+  JxlEncoderPtr enc = JxlEncoderMake(&mm);
+  EXPECT_NE(nullptr, enc.get());
+  const size_t allocs_before_first = allocs;
+  VerifyFrameEncoding(enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  const size_t first_allocs = allocs - allocs_before_first;
+  JxlEncoderReset(enc.get());
+  const size_t allocs_before_second = allocs;
+  VerifyFrameEncoding(enc.get(),
+                      JxlEncoderFrameSettingsCreate(enc.get(), nullptr));
+  // The same image needs no new memory for the intermediates of the frame.
+  EXPECT_LT(allocs - allocs_before_second, first_allocs);
+}
+
+// The default CMS, counting the transforms that it creates.
+struct CountingCms {
+  CountingCms() : cms(*JxlGetDefaultCms()), inner(cms) {
+    cms.init_data = this;
+    cms.init = +[](void* init_data, size_t num_threads,
+                   size_t pixels_per_thread,
+                   const JxlColorProfile* input_profile,
+                   const JxlColorProfile* output_profile,
+                   float intensity_target) {
+      CountingCms* self = static_cast<CountingCms*>(init_data);
+      ++self->num_transforms;
+      return self->inner.init(self->inner.init_data, num_threads,
+                              pixels_per_thread, input_profile, output_profile,
+                              intensity_target);
+    };
+  }
+  CountingCms(const CountingCms&) = delete;
+  CountingCms& operator=(const CountingCms&) = delete;
+
+  JxlCmsInterface cms;
+  JxlCmsInterface inner;
+  size_t num_transforms = 0;
+};
+
+// Effort 8 compares the frame to its decoded version in linear sRGB, through
+// the CMS.
+JxlEncoderFrameSettings* CmsFrameSettings(JxlEncoder* enc) {
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc, nullptr);
+  JxlEncoderSetFrameLossless(frame_settings, JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(frame_settings,
+                                             JXL_ENC_FRAME_SETTING_EFFORT, 8));
+  return frame_settings;
+}
+
+TEST(EncodeTest, EncoderResetKeepsColorTransforms) {
+  CountingCms counting_cms;
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlEncoderSetCms(enc.get(), counting_cms.cms);
+  VerifyFrameEncoding(enc.get(), CmsFrameSettings(enc.get()));
+  const size_t num_transforms = counting_cms.num_transforms;
+  EXPECT_GT(num_transforms, 0u);
+  JxlEncoderReset(enc.get());
+  JxlEncoderSetCms(enc.get(), counting_cms.cms);
+  VerifyFrameEncoding(enc.get(), CmsFrameSettings(enc.get()));
+  EXPECT_EQ(num_transforms, counting_cms.num_transforms);
+}
+
+TEST(EncodeTest, PrewarmTest) {
+  CountingCms counting_cms;
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlEncoderSetCms(enc.get(), counting_cms.cms);
+  JxlEncoderFrameSettings* frame_settings = CmsFrameSettings(enc.get());
+  EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderPrewarm(frame_settings));
+  // The image of VerifyFrameEncoding.
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = 63;
+  basic_info.ysize = 129;
+  basic_info.uses_original_profile = JXL_FALSE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetCodestreamLevel(enc.get(), 10));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  ASSERT_EQ(JXL_ENC_SUCCESS, JxlEncoderPrewarm(frame_settings));
+  const size_t num_transforms = counting_cms.num_transforms;
+  EXPECT_GT(num_transforms, 0u);
+  // The real frame needs no new transform.
+  VerifyFrameEncoding(enc.get(), frame_settings);
+  EXPECT_EQ(num_transforms, counting_cms.num_transforms);
+}
+
 TEST(EncodeTest, CmsTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -306,6 +411,101 @@ TEST(EncodeTest, CmsTest) {
   EXPECT_TRUE(cms_called);
 }
 
+TEST(EncodeTest, CollectStatsTest) {
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  JxlEncoderStats* stats = JxlEncoderStatsCreate();
+  JxlEncoderCollectStats(frame_settings, stats);
+  VerifyFrameEncoding(256, 256, enc.get(), frame_settings, 100000,
+                      /*lossy_use_original_profile=*/false);
+
+  EXPECT_GT(JxlEncoderStatsGet(stats, JXL_ENC_STAT_HEADER_BITS), 0u);
+  size_t wall_us = 0;
+  for (int key = JXL_ENC_STAT_TO_XYB_WALL_US;
+       key <= JXL_ENC_STAT_WRITING_WALL_US; key += 3) {
+    wall_us += JxlEncoderStatsGet(stats, static_cast<JxlEncoderStatsKey>(key));
+  }
+  EXPECT_GT(wall_us, 0u);
+  // The XYB image and the tokens are allocated during their phases.
+  const size_t to_xyb_peak =
+      JxlEncoderStatsGet(stats, JXL_ENC_STAT_TO_XYB_PEAK_BYTES);
+  EXPECT_GT(to_xyb_peak, 256u * 256u * 3u * sizeof(float));
+  EXPECT_GT(JxlEncoderStatsGet(stats, JXL_ENC_STAT_TOKENIZATION_PEAK_BYTES),
+            0u);
+  // Butteraugli iterations only run at effort 8 and up.
+  EXPECT_EQ(0u, JxlEncoderStatsGet(stats, JXL_ENC_STAT_NUM_BUTTERAUGLI_ITERS));
+  EXPECT_GT(JxlEncoderStatsGet(stats, JXL_ENC_STAT_ESTIMATED_DECODE_NS),
+            256u * 256u);
+
+  JxlEncoderStats* merged = JxlEncoderStatsCreate();
+  JxlEncoderStatsMerge(merged, stats);
+  JxlEncoderStatsMerge(merged, stats);
+  EXPECT_EQ(2 * JxlEncoderStatsGet(stats, JXL_ENC_STAT_WRITING_WALL_US),
+            JxlEncoderStatsGet(merged, JXL_ENC_STAT_WRITING_WALL_US));
+  EXPECT_EQ(to_xyb_peak,
+            JxlEncoderStatsGet(merged, JXL_ENC_STAT_TO_XYB_PEAK_BYTES));
+  JxlEncoderStatsDestroy(merged);
+  JxlEncoderStatsDestroy(stats);
+}
+
+TEST(EncodeTest, CollectStatsCountersTest) {
+  // Two counters that increase with each read, the second one twice as fast.
+  std::atomic<uint64_t> reads{0};
+  const auto read_counters = [](void* opaque, uint64_t* values) {
+    const uint64_t n =
+        static_cast<std::atomic<uint64_t>*>(opaque)->fetch_add(1) + 1;
+    values[0] = n;
+    values[1] = 2 * n;
+  };
+  JxlEncoderStats* stats = JxlEncoderStatsCreate();
+  EXPECT_FALSE(JxlEncoderStatsSetCounters(stats, JXL_ENC_STATS_MAX_COUNTERS + 1,
+                                          read_counters, &reads));
+  EXPECT_FALSE(JxlEncoderStatsSetCounters(stats, 2, nullptr, nullptr));
+  ASSERT_TRUE(JxlEncoderStatsSetCounters(stats, 2, read_counters, &reads));
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  JxlEncoderCollectStats(frame_settings, stats);
+  VerifyFrameEncoding(256, 256, enc.get(), frame_settings, 100000,
+                      /*lossy_use_original_profile=*/false);
+
+  EXPECT_GT(reads.load(), 0u);
+  EXPECT_GT(JxlEncoderStatsGetCounter(stats, JXL_ENC_STAT_TO_XYB_WALL_US, 0),
+            0u);
+  EXPECT_GT(JxlEncoderStatsGetCounter(stats, JXL_ENC_STAT_WRITING_WALL_US, 0),
+            0u);
+  uint64_t counts[2] = {};
+  for (int key = JXL_ENC_STAT_TO_XYB_WALL_US;
+       key <= JXL_ENC_STAT_WRITING_WALL_US; key += 3) {
+    const JxlEncoderStatsKey phase = static_cast<JxlEncoderStatsKey>(key);
+    // The three keys of a phase give its counts.
+    EXPECT_EQ(JxlEncoderStatsGetCounter(stats, phase, 0),
+              JxlEncoderStatsGetCounter(
+                  stats, static_cast<JxlEncoderStatsKey>(key + 2), 0));
+    counts[0] += JxlEncoderStatsGetCounter(stats, phase, 0);
+    counts[1] += JxlEncoderStatsGetCounter(stats, phase, 1);
+    EXPECT_EQ(0u, JxlEncoderStatsGetCounter(stats, phase, 2));
+  }
+  // Nested phases are not counted twice.
+  EXPECT_LT(counts[0], reads.load());
+  EXPECT_GE(counts[1], counts[0]);
+  EXPECT_EQ(0u,
+            JxlEncoderStatsGetCounter(stats, JXL_ENC_STAT_HEADER_BITS, 0));
+
+  JxlEncoderStats* merged = JxlEncoderStatsCreate();
+  JxlEncoderStatsMerge(merged, stats);
+  JxlEncoderStatsMerge(merged, stats);
+  EXPECT_EQ(
+      2 * JxlEncoderStatsGetCounter(stats, JXL_ENC_STAT_WRITING_WALL_US, 1),
+      JxlEncoderStatsGetCounter(merged, JXL_ENC_STAT_WRITING_WALL_US, 1));
+  JxlEncoderStatsDestroy(merged);
+  JxlEncoderStatsDestroy(stats);
+}
+
 TEST(EncodeTest, FrameSettingsTest) {
   {
     JxlEncoderPtr enc = JxlEncoderMake(nullptr);
@@ -507,6 +707,21 @@ TEST(EncodeTest, FrameSettingsTest) {
     EXPECT_EQ(5, enc->last_used_cparams.center_x);
   }
 
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_GROUP_ORDER, 2));
+    // Several groups, so that they are reordered.
+    VerifyFrameEncoding(300, 300, enc.get(), frame_settings, 300 * 300 * 4,
+                        /*lossy_use_original_profile=*/false);
+    EXPECT_EQ(false, enc->last_used_cparams.centerfirst);
+    EXPECT_EQ(true, enc->last_used_cparams.salientfirst);
+  }
+
   {
     JxlEncoderPtr enc = JxlEncoderMake(nullptr);
     EXPECT_NE(nullptr, enc.get());
@@ -627,6 +842,110 @@ TEST(EncodeTest, FrameSettingsTest) {
     VerifyFrameEncoding(enc.get(), frame_settings);
     EXPECT_EQ(true, enc->last_used_cparams.force_cfl_jpeg_recompression);
   }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_SIZE, -2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_TARGET_SIZE, 5000));
+    // The target only covers the frame, not the container and headers.
+    VerifyFrameEncoding(63, 129, enc.get(), frame_settings, 5500,
+                        /*lossy_use_original_profile=*/false);
+    EXPECT_EQ(5000u, enc->last_used_cparams.target_size);
+  }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT, 2));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT, 1));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+    EXPECT_EQ(true, enc->last_used_cparams.adaptive_effort);
+  }
+
+  {
+    // A tight decoding budget turns the loop filters off, which lowers the
+    // estimated decoding time.
+    size_t estimated_ns[2];
+    for (int budget = 0; budget < 2; budget++) {
+      JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+      EXPECT_NE(nullptr, enc.get());
+      JxlEncoderFrameSettings* frame_settings =
+          JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+      EXPECT_EQ(JXL_ENC_ERROR,
+                JxlEncoderFrameSettingsSetOption(
+                    frame_settings, JXL_ENC_FRAME_SETTING_DECODING_BUDGET, 4));
+      EXPECT_EQ(JXL_ENC_ERROR,
+                JxlEncoderFrameSettingsSetFloatOption(
+                    frame_settings, JXL_ENC_FRAME_SETTING_DECODING_BUDGET,
+                    -2.0f));
+      if (budget) {
+        EXPECT_EQ(JXL_ENC_SUCCESS,
+                  JxlEncoderFrameSettingsSetFloatOption(
+                      frame_settings, JXL_ENC_FRAME_SETTING_DECODING_BUDGET,
+                      4.0f));
+      }
+      JxlEncoderStats* stats = JxlEncoderStatsCreate();
+      JxlEncoderCollectStats(frame_settings, stats);
+      VerifyFrameEncoding(enc.get(), frame_settings);
+      estimated_ns[budget] =
+          JxlEncoderStatsGet(stats, JXL_ENC_STAT_ESTIMATED_DECODE_NS);
+      JxlEncoderStatsDestroy(stats);
+      EXPECT_EQ(budget ? 4.0f : 0.0f,
+                enc->last_used_cparams.decoding_budget);
+    }
+    EXPECT_LT(estimated_ns[1], estimated_ns[0]);
+  }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    ASSERT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS, 4));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS, 3));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS, 3));
+    VerifyFrameEncoding(enc.get(), frame_settings);
+  }
+
+  {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    ASSERT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS,
+                  2));
+    EXPECT_EQ(JXL_ENC_ERROR,
+              JxlEncoderFrameSettingsSetFloatOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS,
+                  1));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS,
+                  1));
+    // The pixels stay alive until the output is processed.
+    VerifyFrameEncoding(enc.get(), frame_settings);
+  }
 }
 
 TEST(EncodeTest, LossyEncoderUseOriginalProfileTest) {
@@ -1043,6 +1362,195 @@ static void ProcessEncoder(JxlEncoder* enc, std::vector<uint8_t>& compressed,
   EXPECT_EQ(JXL_ENC_SUCCESS, process_result);
 }
 
+// Efforts 1 and 2 recompress JPEGs without chroma from luma unless it is
+// requested, and with a fixed clustering of the histograms, which grayscale
+// JPEGs do not fill. The JPEG is still reconstructed exactly.
+JXL_TRANSCODE_JPEG_TEST(EncodeTest, FastJPEGReconstructionTest) {
+  std::vector<uint8_t> orig;
+  // A "cfl" of -2 leaves JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL unset.
+  const auto encode = [&](int64_t effort, int64_t cfl) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderStoreJPEGMetadata(enc.get(), JXL_TRUE));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, effort));
+    if (cfl != -2) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderFrameSettingsSetOption(
+                    frame_settings, JXL_ENC_FRAME_SETTING_JPEG_RECON_CFL, cfl));
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddJPEGFrame(frame_settings, orig.data(), orig.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    return compressed;
+  };
+  const auto expect_reconstruction = [&](const std::vector<uint8_t>& jxl) {
+    jxl::extras::JXLDecompressParams dparams;
+    jxl::test::DefaultAcceptedFormats(dparams);
+    std::vector<uint8_t> decoded_jpeg_bytes;
+    jxl::extras::PackedPixelFile ppf;
+    EXPECT_TRUE(DecodeImageJXL(jxl.data(), jxl.size(), dparams, nullptr, &ppf,
+                               &decoded_jpeg_bytes));
+    EXPECT_EQ(orig, decoded_jpeg_bytes);
+  };
+
+  orig = jxl::test::ReadTestData("jxl/flower/flower.png.im_q85_444.jpg");
+  for (int64_t effort : {1, 2}) {
+    const std::vector<uint8_t> fast = encode(effort, -2);
+    EXPECT_EQ(encode(effort, 0), fast);
+    expect_reconstruction(fast);
+    // Chroma from luma can still be requested, and changes the codestream.
+    const std::vector<uint8_t> with_cfl = encode(effort, 1);
+    EXPECT_NE(with_cfl, fast);
+    expect_reconstruction(with_cfl);
+  }
+  // Slower efforts keep chroma from luma by default.
+  EXPECT_EQ(encode(3, 1), encode(3, -2));
+
+  orig = jxl::test::ReadTestData("jxl/flower/flower.png.im_q85_gray.jpg");
+  for (int64_t effort : {1, 2}) {
+    expect_reconstruction(encode(effort, -2));
+  }
+}
+
+TEST(EncodeTest, AnalysisCacheTest) {
+  // Counts the allocations of the cache that are not freed yet.
+  size_t live_allocs = 0;
+  JxlMemoryManager mm;
+  mm.opaque = &live_allocs;
+  mm.alloc = [](void* opaque, size_t size) {
+    (*reinterpret_cast<size_t*>(opaque))++;
+    return malloc(size);
+  };
+  mm.free = [](void* opaque, void* address) {
+    if (address) (*reinterpret_cast<size_t*>(opaque))--;
+    free(address);
+  };
+
+  const size_t xsize = 256;
+  const size_t ysize = 256;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const auto encode = [&](const std::vector<uint8_t>& pixels, float distance,
+                          JxlEncoderAnalysisCache* cache) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = JXL_FALSE;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_EFFORT, 8));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameDistance(frame_settings, distance));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetAnalysisCache(frame_settings, cache));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  const std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  const std::vector<uint8_t> other_pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 1);
+  JxlEncoderAnalysisCache* cache = JxlEncoderAnalysisCacheCreate(&mm);
+  ASSERT_NE(nullptr, cache);
+  // The encodes after the first one reuse the analysis, and give the same
+  // codestreams as without the cache.
+  for (float distance : {1.0f, 2.5f, 1.0f}) {
+    EXPECT_EQ(encode(pixels, distance, nullptr),
+              encode(pixels, distance, cache));
+  }
+  // An image of the same size with other pixels replaces the analysis.
+  EXPECT_EQ(encode(other_pixels, 1.0f, nullptr),
+            encode(other_pixels, 1.0f, cache));
+  // The analysis is allocated with the memory manager of the cache, and kept
+  // after the encoders are destroyed.
+  EXPECT_GT(live_allocs, 0u);
+  JxlEncoderAnalysisCacheDestroy(cache);
+  EXPECT_EQ(0u, live_allocs);
+}
+
+TEST(EncodeTest, ReuseModularTreeTest) {
+  const size_t xsize = 256;
+  const size_t ysize = 256;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  // An encoder reset between the images keeps the trees.
+  for (uint32_t seed = 0; seed < 2; ++seed) {
+    JxlEncoderReset(enc.get());
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = JXL_TRUE;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameLossless(frame_settings, 1));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE, 1));
+    const std::vector<uint8_t> pixels =
+        jxl::test::GetSomeTestImage(xsize, ysize, 3, seed);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+    jxl::extras::JXLDecompressParams dparams;
+    dparams.accepted_formats = {pixel_format};
+    jxl::extras::PackedPixelFile ppf;
+    ASSERT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                               nullptr, &ppf, nullptr));
+    ASSERT_EQ(1u, ppf.frames.size());
+    const jxl::extras::PackedImage& color = ppf.frames[0].color;
+    ASSERT_EQ(pixels.size(), color.pixels_size);
+    EXPECT_EQ(0, memcmp(pixels.data(), color.pixels(), pixels.size()));
+
+    // The default effort learns a tree per group, which the encoder keeps.
+    ASSERT_NE(nullptr, enc->modular_tree_cache);
+    EXPECT_TRUE(enc->modular_tree_cache->tree.empty());
+    size_t num_stream_trees = 0;
+    for (const jxl::StreamTreeCache& stream :
+         enc->modular_tree_cache->streams) {
+      if (!stream.tree.empty()) num_stream_trees++;
+    }
+    EXPECT_GT(num_stream_trees, 0u);
+  }
+}
+
 TEST(EncodeTest, BasicInfoTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -1258,6 +1766,61 @@ TEST(EncodeTest, AnimationHeaderTest) {
 
   EXPECT_EQ(true, seen_frame);
 }
+TEST(EncodeTest, MaxFramesInFlightTest) {
+  const size_t xsize = 64;
+  const size_t ysize = 48;
+  const size_t kNumFrames = 5;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const auto encode = [&](size_t max_frames_in_flight) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlThreadParallelRunnerPtr runner =
+        JxlThreadParallelRunnerMake(nullptr, /*num_worker_threads=*/4);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                          runner.get()));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetMaxFramesInFlight(enc.get(), max_frames_in_flight));
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderUseContainer(enc.get(), JXL_TRUE));
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.have_animation = JXL_TRUE;
+    basic_info.animation.tps_numerator = 1000;
+    basic_info.animation.tps_denominator = 1;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    for (size_t i = 0; i < kNumFrames; ++i) {
+      std::vector<uint8_t> pixels =
+          jxl::test::GetSomeTestImage(xsize, ysize, 4, i);
+      JxlFrameHeader header;
+      JxlEncoderInitFrameHeader(&header);
+      header.duration = 10 * (i + 1);
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderSetFrameHeader(frame_settings, &header));
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        pixels.data(), pixels.size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    return compressed;
+  };
+
+  // Encoding frames concurrently must not change the output.
+  const std::vector<uint8_t> expected = encode(1);
+  EXPECT_EQ(expected, encode(3));
+  EXPECT_EQ(expected, encode(kNumFrames));
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_EQ(JXL_ENC_ERROR, JxlEncoderSetMaxFramesInFlight(enc.get(), 0));
+}
+
 TEST(EncodeTest, CroppedFrameTest) {
   JxlEncoderPtr enc = JxlEncoderMake(nullptr);
   EXPECT_NE(nullptr, enc.get());
@@ -1344,6 +1907,249 @@ TEST(EncodeTest, CroppedFrameTest) {
   EXPECT_EQ(true, seen_frame);
 }
 
+TEST(EncodeTest, ReuseEntropyCodingTest) {
+  const size_t xsize = 256;
+  const size_t ysize = 256;
+  const size_t kNumFrames = 3;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  const std::vector<uint8_t> pixels =
+      jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  const auto encode = [&](bool reuse, size_t* cache_xsize_blocks) {
+    JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+    EXPECT_NE(nullptr, enc.get());
+    JxlBasicInfo basic_info;
+    jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+    basic_info.xsize = xsize;
+    basic_info.ysize = ysize;
+    basic_info.uses_original_profile = JXL_FALSE;
+    basic_info.have_animation = JXL_TRUE;
+    basic_info.animation.tps_numerator = 1000;
+    basic_info.animation.tps_denominator = 1;
+    EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+    JxlColorEncoding color_encoding;
+    JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+    JxlEncoderFrameSettings* frame_settings =
+        JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings, JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING,
+                  reuse ? 1 : 0));
+    EXPECT_EQ(reuse,
+              frame_settings->values.cparams.entropy_coding_cache != nullptr);
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    for (size_t i = 0; i < kNumFrames; ++i) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        pixels.data(), pixels.size()));
+    }
+    JxlEncoderCloseInput(enc.get());
+    std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+    uint8_t* next_out = compressed.data();
+    size_t avail_out = compressed.size();
+    ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+    *cache_xsize_blocks = enc->entropy_coding_cache
+                              ? enc->entropy_coding_cache->xsize_blocks
+                              : 0;
+    return compressed;
+  };
+
+  size_t cache_xsize_blocks;
+  const std::vector<uint8_t> compressed_alone =
+      encode(/*reuse=*/false, &cache_xsize_blocks);
+  EXPECT_EQ(0u, cache_xsize_blocks);
+  // The frames after the first one reuse its orders and clustering, which
+  // fit them as well since they are the same image.
+  const std::vector<uint8_t> compressed =
+      encode(/*reuse=*/true, &cache_xsize_blocks);
+  EXPECT_EQ(xsize / 8, cache_xsize_blocks);
+  EXPECT_NEAR(compressed.size(), compressed_alone.size(),
+              compressed_alone.size() / 100);
+
+  jxl::extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {pixel_format};
+  jxl::extras::PackedPixelFile ppf;
+  jxl::extras::PackedPixelFile ppf_alone;
+  ASSERT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                             nullptr, &ppf, nullptr));
+  ASSERT_TRUE(DecodeImageJXL(compressed_alone.data(), compressed_alone.size(),
+                             dparams, nullptr, &ppf_alone, nullptr));
+  ASSERT_EQ(kNumFrames, ppf.frames.size());
+  ASSERT_EQ(kNumFrames, ppf_alone.frames.size());
+  // The first frame has nothing to reuse yet, and is encoded the same.
+  const jxl::extras::PackedImage& first = ppf.frames[0].color;
+  const jxl::extras::PackedImage& first_alone = ppf_alone.frames[0].color;
+  ASSERT_EQ(first_alone.pixels_size, first.pixels_size);
+  EXPECT_EQ(0, memcmp(first_alone.pixels(), first.pixels(), first.pixels_size));
+}
+
+TEST(EncodeTest, FastLosslessAnimationTest) {
+  const size_t xsize = 300;
+  const size_t ysize = 200;
+  const size_t kBytesPerPixel = 8;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_UINT16, JXL_BIG_ENDIAN, 0};
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  basic_info.have_animation = JXL_TRUE;
+  basic_info.animation.tps_numerator = 1000;
+  basic_info.animation.tps_denominator = 1;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameLossless(frame_settings, 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(frame_settings,
+                                             JXL_ENC_FRAME_SETTING_EFFORT, 1));
+
+  // A full frame, followed by frames that only replace the part of it that
+  // changed, reusing the prefix codes of the previous frame.
+  struct Crop {
+    size_t x0, y0, xsize, ysize;
+  };
+  const Crop crops[] = {
+      {0, 0, xsize, ysize}, {40, 30, 100, 80}, {280, 0, 20, 200}};
+  std::vector<uint8_t> expected =
+      jxl::test::GetSomeTestImage(xsize, ysize, 4, 0);
+  std::vector<std::vector<uint8_t>> expected_frames;
+  for (size_t i = 0; i < 3; ++i) {
+    const Crop& crop = crops[i];
+    std::vector<uint8_t> changed =
+        jxl::test::GetSomeTestImage(xsize, ysize, 4, i);
+    std::vector<uint8_t> pixels(crop.xsize * crop.ysize * kBytesPerPixel);
+    for (size_t y = 0; y < crop.ysize; ++y) {
+      const size_t offset = ((crop.y0 + y) * xsize + crop.x0) * kBytesPerPixel;
+      const size_t row_size = crop.xsize * kBytesPerPixel;
+      memcpy(&pixels[y * row_size], &changed[offset], row_size);
+      memcpy(&expected[offset], &changed[offset], row_size);
+    }
+    expected_frames.push_back(expected);
+
+    JxlFrameHeader header;
+    JxlEncoderInitFrameHeader(&header);
+    header.duration = 10;
+    header.layer_info.have_crop = TO_JXL_BOOL(i != 0);
+    header.layer_info.crop_x0 = crop.x0;
+    header.layer_info.crop_y0 = crop.y0;
+    header.layer_info.xsize = crop.xsize;
+    header.layer_info.ysize = crop.ysize;
+    header.layer_info.blend_info.source = 1;
+    header.layer_info.save_as_reference = 1;
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderSetFrameHeader(frame_settings, &header));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderFrameSettingsSetOption(
+                  frame_settings,
+                  JXL_ENC_FRAME_SETTING_FAST_LOSSLESS_REUSE_CODES, i != 0));
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                      pixels.data(), pixels.size()));
+  }
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  jxl::extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {pixel_format};
+  jxl::extras::PackedPixelFile ppf;
+  EXPECT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                             nullptr, &ppf, nullptr));
+  ASSERT_EQ(expected_frames.size(), ppf.frames.size());
+  for (size_t i = 0; i < expected_frames.size(); ++i) {
+    const jxl::extras::PackedImage& color = ppf.frames[i].color;
+    ASSERT_EQ(expected_frames[i].size(), color.pixels_size);
+    EXPECT_EQ(0, memcmp(expected_frames[i].data(), color.pixels(),
+                        color.pixels_size));
+  }
+}
+
+TEST(EncodeTest, FastLosslessFloatTest) {
+  const size_t xsize = 300;
+  const size_t ysize = 200;
+  JxlPixelFormat pixel_format = {4, JXL_TYPE_FLOAT, JXL_LITTLE_ENDIAN, 0};
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  EXPECT_NE(nullptr, enc.get());
+  // The image stores binary16 samples, given as 32-bit floats.
+  const JxlPixelFormat image_format = {4, JXL_TYPE_FLOAT16, JXL_LITTLE_ENDIAN,
+                                       0};
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &image_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  basic_info.uses_original_profile = JXL_TRUE;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToLinearSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameLossless(frame_settings, 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(frame_settings,
+                                             JXL_ENC_FRAME_SETTING_EFFORT, 1));
+
+  // Floats that binary16 represents exactly, negative ones and zeros
+  // included.
+  std::vector<float> pixels(xsize * ysize * 4);
+  jxl::Rng rng(0);
+  for (float& sample : pixels) {
+    float value = std::ldexp(rng.UniformI(0, 2048), rng.UniformI(-24, 5));
+    sample = rng.UniformI(0, 2) == 0 ? value : -value;
+  }
+  std::vector<float> invalid = pixels;
+  invalid[1234] = 1.0f / 3;
+  EXPECT_EQ(JXL_ENC_ERROR,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    invalid.data(),
+                                    invalid.size() * sizeof(float)));
+  EXPECT_EQ(JXL_ENC_ERR_BAD_INPUT, JxlEncoderGetError(enc.get()));
+
+  JxlEncoderReset(enc.get());
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  frame_settings = JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetFrameLossless(frame_settings, 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderFrameSettingsSetOption(frame_settings,
+                                             JXL_ENC_FRAME_SETTING_EFFORT, 1));
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                    pixels.data(),
+                                    pixels.size() * sizeof(float)));
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed = std::vector<uint8_t>(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  jxl::extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {pixel_format};
+  jxl::extras::PackedPixelFile ppf;
+  EXPECT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                             nullptr, &ppf, nullptr));
+  ASSERT_EQ(1, ppf.frames.size());
+  const jxl::extras::PackedImage& color = ppf.frames[0].color;
+  ASSERT_EQ(pixels.size() * sizeof(float), color.pixels_size);
+  EXPECT_EQ(0, memcmp(pixels.data(), color.pixels(), color.pixels_size));
+}
+
 struct EncodeBoxTest : public testing::TestWithParam<std::tuple<bool, size_t>> {
 };
 
@@ -1474,6 +2280,83 @@ JXL_BOXES_TEST_P(EncodeBoxTest, BoxTest) {
   EXPECT_EQ(0, memcmp(xml_data, dec_xml_box.data(), xml_size));
 }
 
+JXL_BOXES_TEST(EncodeTest, CompressedBoxesWithRunnerTest) {
+  // Two brob boxes are queued before the frame, and compressed together, and
+  // two after it, compressed while the frame is encoded.
+  const char* types[4] = {"Exif", "xml ", "jumb", "abcd"};
+  std::vector<std::vector<uint8_t>> contents(4);
+  jxl::Rng rng(0);
+  for (size_t i = 0; i < 4; i++) {
+    // Compressible, but not trivially so, with the TIFF offset of Exif first.
+    contents[i].resize(4 + 100000 * (i + 1));
+    for (size_t j = 4; j < contents[i].size(); j++) {
+      contents[i][j] = static_cast<uint8_t>('a' + rng.UniformU(0, 4));
+    }
+  }
+
+  JxlEncoderPtr enc = JxlEncoderMake(nullptr);
+  JxlThreadParallelRunnerPtr runner =
+      JxlThreadParallelRunnerMake(nullptr, /*num_worker_threads=*/4);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetParallelRunner(enc.get(), JxlThreadParallelRunner,
+                                        runner.get()));
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderUseBoxes(enc.get()));
+  JxlEncoderFrameSettings* frame_settings =
+      JxlEncoderFrameSettingsCreate(enc.get(), nullptr);
+  size_t xsize = 256;
+  size_t ysize = 256;
+  JxlPixelFormat pixel_format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels = jxl::test::GetSomeTestImage(xsize, ysize, 3, 0);
+  JxlBasicInfo basic_info;
+  jxl::test::JxlBasicInfoSetFromPixelFormat(&basic_info, &pixel_format);
+  basic_info.xsize = xsize;
+  basic_info.ysize = ysize;
+  EXPECT_EQ(JXL_ENC_SUCCESS, JxlEncoderSetBasicInfo(enc.get(), &basic_info));
+  JxlColorEncoding color_encoding;
+  JxlColorEncodingSetToSRGB(&color_encoding, /*is_gray=*/JXL_FALSE);
+  EXPECT_EQ(JXL_ENC_SUCCESS,
+            JxlEncoderSetColorEncoding(enc.get(), &color_encoding));
+  for (size_t i = 0; i < 4; i++) {
+    if (i == 2) {
+      EXPECT_EQ(JXL_ENC_SUCCESS,
+                JxlEncoderAddImageFrame(frame_settings, &pixel_format,
+                                        pixels.data(), pixels.size()));
+    }
+    EXPECT_EQ(JXL_ENC_SUCCESS,
+              JxlEncoderAddBox(enc.get(), types[i], contents[i].data(),
+                               contents[i].size(), JXL_TRUE));
+  }
+  JxlEncoderCloseInput(enc.get());
+  std::vector<uint8_t> compressed(64);
+  uint8_t* next_out = compressed.data();
+  size_t avail_out = compressed.size();
+  ProcessEncoder(enc.get(), compressed, next_out, avail_out);
+
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderSetDecompressBoxes(dec.get(), JXL_TRUE));
+  EXPECT_EQ(JXL_DEC_SUCCESS,
+            JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_FRAME | JXL_DEC_BOX));
+  JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
+  JxlDecoderCloseInput(dec.get());
+  std::vector<std::vector<uint8_t>> decoded(4);
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    if (status == JXL_DEC_SUCCESS) break;
+    if (status == JXL_DEC_FRAME) continue;
+    ASSERT_EQ(JXL_DEC_BOX, status);
+    JxlDecoderReleaseBoxBuffer(dec.get());
+    JxlBoxType type;
+    EXPECT_EQ(JXL_DEC_SUCCESS, JxlDecoderGetBoxType(dec.get(), type, true));
+    for (size_t i = 0; i < 4; i++) {
+      if (memcmp(type, types[i], 4) != 0) continue;
+      decoded[i].resize(contents[i].size());
+      JxlDecoderSetBoxBuffer(dec.get(), decoded[i].data(), decoded[i].size());
+    }
+  }
+  JxlDecoderReleaseBoxBuffer(dec.get());
+  for (size_t i = 0; i < 4; i++) EXPECT_EQ(contents[i], decoded[i]);
+}
+
 std::string nameBoxTest(
     const ::testing::TestParamInfo<std::tuple<bool, size_t>>& info) {
   return (std::get<0>(info.param) ? "C" : "Unc") + std::string("ompressed") +
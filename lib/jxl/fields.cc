@@ -152,10 +152,21 @@ class AllDefaultVisitor : public VisitorBase {
   bool all_default_ = true;
 };
 
-class ReadVisitor : public VisitorBase {
+class ReadVisitor final : public VisitorBase {
  public:
   explicit ReadVisitor(BitReader* reader) : reader_(reader) {}
 
+  // Most header fields are flags: read them directly instead of going through
+  // Bits and its range check.
+  Status Bool(bool /*default_value*/, bool* JXL_RESTRICT value) override {
+    *value = reader_->ReadFixedBits<1>() != 0;
+    if (!reader_->AllReadsWithinBounds()) {
+      return JXL_STATUS(StatusCode::kNotEnoughBytes,
+                        "Not enough bytes for header");
+    }
+    return true;
+  }
+
   Status Bits(const size_t bits, const uint32_t /*default_value*/,
               uint32_t* JXL_RESTRICT value) override {
     *value = BitsCoder::Read(bits, reader_);
@@ -10,7 +10,13 @@
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
 
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_ans.h"
 #include "lib/jxl/dec_bit_reader.h"
@@ -30,25 +36,17 @@ namespace {
 // scanline order but with missing elements skipped (which may occur in multiple
 // locations), the output is the result matrix in scanline order (with
 // no need to skip missing elements as they are past the end of the data).
-Status Shuffle(JxlMemoryManager* memory_manager, uint8_t* data, size_t size,
-               size_t width) {
+// The result is written to `out`, which must not overlap `data`.
+void Shuffle(const uint8_t* data, size_t size, size_t width, uint8_t* out) {
   size_t height = (size + width - 1) / width;  // amount of rows of output
-  PaddedBytes result(memory_manager);
-  JXL_ASSIGN_OR_RETURN(result,
-                       PaddedBytes::WithInitialSpace(memory_manager, size));
   // i = output index, j input index
   size_t s = 0;
   size_t j = 0;
   for (size_t i = 0; i < size; i++) {
-    result[i] = data[j];
+    out[i] = data[j];
     j += height;
     if (j >= size) j = ++s;
   }
-
-  for (size_t i = 0; i < size; i++) {
-    data[i] = result[i];
-  }
-  return true;
 }
 
 // TODO(eustas): should be 20, or even 18, once DecodeVarInt is improved;
@@ -225,28 +223,17 @@ Status UnpredictICC(const uint8_t* enc, size_t size, PaddedBytes* result) {
       if (cpos >= commands_end) return JXL_FAILURE("Out of bounds");
       uint64_t num = DecodeVarInt(enc, size, &cpos);
       JXL_RETURN_IF_ERROR(CheckOutOfBounds(pos, num, size));
-      for (size_t i = 0; i < num; i++) {
-        JXL_RETURN_IF_ERROR(result->push_back(enc[pos++]));
-      }
+      JXL_RETURN_IF_ERROR(result->append(enc + pos, enc + pos + num));
+      pos += num;
     } else if (command == kCommandShuffle2 || command == kCommandShuffle4) {
       if (cpos >= commands_end) return JXL_FAILURE("Out of bounds");
       uint64_t num = DecodeVarInt(enc, size, &cpos);
       JXL_RETURN_IF_ERROR(CheckOutOfBounds(pos, num, size));
-      PaddedBytes shuffled(memory_manager);
-      JXL_ASSIGN_OR_RETURN(shuffled,
-                           PaddedBytes::WithInitialSpace(memory_manager, num));
-      for (size_t i = 0; i < num; i++) {
-        shuffled[i] = enc[pos + i];
-      }
-      if (command == kCommandShuffle2) {
-        JXL_RETURN_IF_ERROR(Shuffle(memory_manager, shuffled.data(), num, 2));
-      } else if (command == kCommandShuffle4) {
-        JXL_RETURN_IF_ERROR(Shuffle(memory_manager, shuffled.data(), num, 4));
-      }
-      for (size_t i = 0; i < num; i++) {
-        JXL_RETURN_IF_ERROR(result->push_back(shuffled[i]));
-        pos++;
-      }
+      size_t start = result->size();
+      JXL_RETURN_IF_ERROR(result->resize(start + num));
+      Shuffle(enc + pos, num, command == kCommandShuffle2 ? 2 : 4,
+              result->data() + start);
+      pos += num;
     } else if (command == kCommandPredict) {
       JXL_RETURN_IF_ERROR(CheckOutOfBounds(cpos, 2, commands_end));
       uint8_t flags = enc[cpos++];
@@ -278,23 +265,21 @@ Status UnpredictICC(const uint8_t* enc, size_t size, PaddedBytes* result) {
       uint64_t num = DecodeVarInt(enc, size, &cpos);  // in bytes
       JXL_RETURN_IF_ERROR(CheckOutOfBounds(pos, num, size));
 
-      PaddedBytes shuffled(memory_manager);
-      JXL_ASSIGN_OR_RETURN(shuffled,
-                           PaddedBytes::WithInitialSpace(memory_manager, num));
-
-      for (size_t i = 0; i < num; i++) {
-        shuffled[i] = enc[pos + i];
-      }
+      // The residuals are unshuffled to the end of the result, and the
+      // predictions added to them in place: they only depend on the bytes
+      // before the predicted one, which are final by then.
+      size_t start = result->size();
+      JXL_RETURN_IF_ERROR(result->resize(start + num));
+      uint8_t* out = result->data();
       if (width > 1) {
-        JXL_RETURN_IF_ERROR(
-            Shuffle(memory_manager, shuffled.data(), num, width));
+        Shuffle(enc + pos, num, width, out + start);
+      } else {
+        memcpy(out + start, enc + pos, num);
       }
-
-      size_t start = result->size();
       for (size_t i = 0; i < num; i++) {
-        uint8_t predicted = LinearPredictICCValue(result->data(), start, i,
-                                                  stride, width, order);
-        JXL_RETURN_IF_ERROR(result->push_back(predicted + shuffled[i]));
+        uint8_t predicted =
+            LinearPredictICCValue(out, start, i, stride, width, order);
+        out[start + i] = static_cast<uint8_t>(out[start + i] + predicted);
       }
       pos += num;
     } else if (command == kCommandXYZ) {
@@ -303,9 +288,8 @@ Status UnpredictICC(const uint8_t* enc, size_t size, PaddedBytes* result) {
         JXL_RETURN_IF_ERROR(result->push_back(0));
       }
       JXL_RETURN_IF_ERROR(CheckOutOfBounds(pos, 12, size));
-      for (size_t i = 0; i < 12; i++) {
-        JXL_RETURN_IF_ERROR(result->push_back(enc[pos++]));
-      }
+      JXL_RETURN_IF_ERROR(result->append(enc + pos, enc + pos + 12));
+      pos += 12;
     } else if (command >= kCommandTypeStartFirst &&
                command < kCommandTypeStartFirst + kNumTypeStrings) {
       JXL_RETURN_IF_ERROR(AppendKeyword(
@@ -414,4 +398,81 @@ Status ICCReader::CheckEOI(BitReader* reader) {
                     "Not enough bytes for reading ICC profile");
 }
 
+namespace {
+
+constexpr size_t kMaxCachedICCs = 8;
+// Limit of the size of the stream and the profile of each entry.
+constexpr size_t kMaxCachedICCBytes = 1 << 19;
+
+struct CachedICC {
+  size_t skip_bits;
+  // The ICC stream, with the bits that precede it in the first byte cleared.
+  std::vector<uint8_t> stream;
+  std::vector<uint8_t> icc;
+
+  bool Matches(Span<const uint8_t> other, size_t other_skip_bits) const {
+    if (other_skip_bits != skip_bits || other.size() < stream.size()) {
+      return false;
+    }
+    const uint8_t mask = static_cast<uint8_t>(0xFF << skip_bits);
+    return (other[0] & mask) == stream[0] &&
+           memcmp(other.data() + 1, stream.data() + 1, stream.size() - 1) ==
+               0;
+  }
+};
+
+// Never freed.
+struct DecodedICCCache {
+  std::mutex mutex;
+  // Most recently used last.
+  std::vector<CachedICC> entries;
+};
+
+DecodedICCCache* GetDecodedICCCache() {
+  static DecodedICCCache* const cache = new DecodedICCCache();
+  return cache;
+}
+
+}  // namespace
+
+size_t LookupDecodedICC(Span<const uint8_t> stream, size_t skip_bits,
+                        std::vector<uint8_t>* icc) {
+  if (stream.empty()) return 0;
+  DecodedICCCache* cache = GetDecodedICCCache();
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  std::vector<CachedICC>& entries = cache->entries;
+  for (size_t i = entries.size(); i-- > 0;) {
+    if (!entries[i].Matches(stream, skip_bits)) continue;
+    CachedICC entry = std::move(entries[i]);
+    entries.erase(entries.begin() + i);
+    *icc = entry.icc;
+    const size_t size = entry.stream.size();
+    entries.push_back(std::move(entry));
+    return size;
+  }
+  return 0;
+}
+
+void CacheDecodedICC(Span<const uint8_t> stream, size_t skip_bits,
+                     const std::vector<uint8_t>& icc) {
+  if (stream.empty() || skip_bits >= kBitsPerByte ||
+      stream.size() + icc.size() > kMaxCachedICCBytes) {
+    return;
+  }
+  CachedICC entry;
+  entry.skip_bits = skip_bits;
+  entry.stream.assign(stream.begin(), stream.end());
+  entry.stream[0] &= static_cast<uint8_t>(0xFF << skip_bits);
+  entry.icc = icc;
+  DecodedICCCache* cache = GetDecodedICCCache();
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  std::vector<CachedICC>& entries = cache->entries;
+  for (const CachedICC& other : entries) {
+    // Added by another decoder in the meantime.
+    if (other.stream == entry.stream && other.skip_bits == skip_bits) return;
+  }
+  if (entries.size() == kMaxCachedICCs) entries.erase(entries.begin());
+  entries.push_back(std::move(entry));
+}
+
 }  // namespace jxl
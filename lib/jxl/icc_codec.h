@@ -14,6 +14,7 @@
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_ans.h"
 #include "lib/jxl/dec_bit_reader.h"
@@ -44,6 +45,23 @@ struct ICCReader {
   PaddedBytes decompressed_;
 };
 
+// Process-wide cache of the ICC profiles decoded from codestreams, so that
+// decoding the same file again, or another file with the same profile, skips
+// the decompression of the profile. Entries are keyed by the bytes of the
+// compressed ICC stream up to the byte boundary that follows it, and a hit
+// gives exactly what decoding these bytes would. `skip_bits` is the number of
+// low bits of `stream[0]` that precede the ICC stream.
+
+// Returns the size in bytes of the cached ICC stream that `stream` starts with
+// and sets `icc` to its profile, or returns 0 if there is none.
+size_t LookupDecodedICC(Span<const uint8_t> stream, size_t skip_bits,
+                        std::vector<uint8_t>* icc);
+
+// Adds `icc`, decoded from all of `stream`, to the cache. Evicts the least
+// recently used profiles to keep the cache small.
+void CacheDecodedICC(Span<const uint8_t> stream, size_t skip_bits,
+                     const std::vector<uint8_t>& icc);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_ICC_CODEC_H_
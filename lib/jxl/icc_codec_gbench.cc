@@ -0,0 +1,72 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/memory_manager.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/cms/color_encoding_cms.h"
+#include "lib/jxl/color_encoding_internal.h"
+#include "lib/jxl/dec_bit_reader.h"
+#include "lib/jxl/enc_aux_out.h"
+#include "lib/jxl/enc_bit_writer.h"
+#include "lib/jxl/enc_icc_codec.h"
+#include "lib/jxl/icc_codec.h"
+#include "lib/jxl/padded_bytes.h"
+#include "tools/no_memory_manager.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+// Decodes an ICC profile created by the library: sRGB if the argument is 0,
+// Display P3 if it is 1, and Rec. 2100 PQ, whose tone curves are tables like
+// the ones of camera profiles, if it is 2. Items are bytes of the profile.
+void BM_DecodeICC(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  ColorEncoding c = ColorEncoding::SRGB();
+  if (state.range(0) == 1) {
+    BM_CHECK(c.SetPrimariesType(cms::Primaries::kP3));
+  } else if (state.range(0) == 2) {
+    BM_CHECK(c.SetPrimariesType(cms::Primaries::k2100));
+    c.Tf().SetTransferFunction(cms::TransferFunction::kPQ);
+  }
+  BM_CHECK(c.CreateICC());
+  const IccBytes& icc = c.ICC();
+
+  BitWriter writer{memory_manager};
+  BM_CHECK(WriteICC(Bytes(icc), &writer, LayerType::Header, nullptr));
+  writer.ZeroPadToByte();
+
+  for (auto _ : state) {
+    (void)_;
+    BitReader br(writer.GetSpan());
+    ICCReader reader{memory_manager};
+    PaddedBytes decoded{memory_manager};
+    BM_CHECK(reader.Init(&br));
+    BM_CHECK(reader.Process(&br, &decoded));
+    BM_CHECK(br.Close());
+    BM_CHECK(decoded.size() == icc.size());
+  }
+
+  state.SetItemsProcessed(icc.size() * state.iterations());
+}
+
+BENCHMARK(BM_DecodeICC)->Arg(0)->Arg(1)->Arg(2);
+
+}  // namespace
+}  // namespace jxl
@@ -16,6 +16,7 @@
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_icc_codec.h"
+#include "lib/jxl/icc_codec.h"
 #include "lib/jxl/test_memory_manager.h"
 #include "lib/jxl/test_utils.h"
 #include "lib/jxl/testing.h"
@@ -213,4 +214,33 @@ TEST(IccCodecTest, EncodedIccProfile) {
   }
 }
 
+TEST(IccCodecTest, DecodedICCCache) {
+  // Not a real ICC stream; the cache only compares the bytes.
+  const std::vector<uint8_t> stream = {0xA5, 0x17, 0x3C, 0xE2, 0x09};
+  const std::vector<uint8_t> icc = {1, 2, 3, 4, 5, 6, 7};
+  CacheDecodedICC(Bytes(stream), 3, icc);
+
+  // The bits of the first byte before the stream and the bytes after it may
+  // differ.
+  std::vector<uint8_t> input = stream;
+  input[0] ^= 0x07;
+  input.push_back(0xFF);
+  std::vector<uint8_t> cached;
+  EXPECT_EQ(stream.size(), LookupDecodedICC(Bytes(input), 3, &cached));
+  EXPECT_EQ(icc, cached);
+
+  // The stream itself may not.
+  cached.clear();
+  input = stream;
+  input[0] ^= 0x08;
+  EXPECT_EQ(0, LookupDecodedICC(Bytes(input), 3, &cached));
+  input = stream;
+  input.back() ^= 1;
+  EXPECT_EQ(0, LookupDecodedICC(Bytes(input), 3, &cached));
+  EXPECT_EQ(0, LookupDecodedICC(Bytes(stream), 2, &cached));
+  EXPECT_EQ(0, LookupDecodedICC(Bytes(stream.data(), stream.size() - 1), 3,
+                                &cached));
+  EXPECT_TRUE(cached.empty());
+}
+
 }  // namespace jxl
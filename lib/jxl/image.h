@@ -144,6 +144,9 @@ class Plane : public detail::PlaneBase {
 
   Plane() = default;
 
+  // The samples are not initialized, so that planes that are written in full
+  // are touched only once; under MSAN they stay poisoned until written, except
+  // for the padding of the rows that vector loads may read.
   static StatusOr<Plane> Create(JxlMemoryManager* memory_manager,
                                 const size_t xsize, const size_t ysize,
                                 const size_t pre_padding = 0) {
@@ -20,6 +20,7 @@
 #include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/jpeg/dec_jpeg_output_chunk.h"
@@ -724,6 +725,167 @@ bool EncodeRefinementBits(const coeff_t* coeffs, HuffmanCodeTable* ac_huff,
   return true;
 }
 
+// Minimum number of blocks encoded by one task of EncodeSequentialScanOnPool.
+const size_t kMinBlocksPerScanTask = 16384;
+
+size_t NumScanMcus(const JPEGData& jpg, const JPEGScanInfo& scan_info) {
+  int MCUs_per_row = 0;
+  int MCU_rows = 0;
+  jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
+  return static_cast<size_t>(MCUs_per_row) * MCU_rows;
+}
+
+// All the MCUs of a scan have the same number of blocks.
+size_t BlocksPerMcu(const JPEGData& jpg, const JPEGScanInfo& scan_info) {
+  if (scan_info.num_components == 1) return 1;
+  size_t num_blocks = 0;
+  for (size_t i = 0; i < scan_info.num_components; ++i) {
+    const JPEGComponent& c = jpg.components[scan_info.components[i].comp_idx];
+    num_blocks += c.h_samp_factor * c.v_samp_factor;
+  }
+  return num_blocks;
+}
+
+// Returns the number of restart intervals of the sequential scan that every
+// task of EncodeSequentialScanOnPool encodes, or 0 if the scan is encoded on
+// one thread. Since there is no state carried across restart markers other
+// than the padding bits, the scan can be split at these markers when its
+// padding bits are all ones.
+size_t RestartIntervalsPerScanTask(const JPEGData& jpg,
+                                   const JPEGScanInfo& scan_info,
+                                   size_t restart_interval,
+                                   const SerializationState& state) {
+  if (state.pool == nullptr || restart_interval == 0) return 0;
+  if (state.pad_bits != nullptr) return 0;
+  for (size_t i = 0; i < scan_info.num_components; ++i) {
+    const JPEGComponentScanInfo& si = scan_info.components[i];
+    if (!state.dc_huff_table[si.dc_tbl_idx].initialized ||
+        !state.ac_huff_table[si.ac_tbl_idx].initialized) {
+      return 0;
+    }
+  }
+  // Tasks find their first extra zero run by bisection.
+  const auto& extra_zero_runs = scan_info.extra_zero_runs;
+  for (size_t i = 1; i < extra_zero_runs.size(); ++i) {
+    if (extra_zero_runs[i - 1].block_idx >= extra_zero_runs[i].block_idx) {
+      return 0;
+    }
+  }
+  const size_t num_intervals =
+      DivCeil(NumScanMcus(jpg, scan_info), restart_interval);
+  const size_t intervals_per_task = DivCeil(
+      kMinBlocksPerScanTask, restart_interval * BlocksPerMcu(jpg, scan_info));
+  return num_intervals > intervals_per_task ? intervals_per_task : 0;
+}
+
+// Encodes the body of a sequential scan on state->pool, in tasks of
+// "intervals_per_task" restart intervals having their own bit writer, and
+// appends their output in order. This gives the same bytes as
+// DoEncodeScan<0>.
+SerializationStatus EncodeSequentialScanOnPool(const JPEGData& jpg,
+                                               const JPEGScanInfo& scan_info,
+                                               size_t restart_interval,
+                                               size_t intervals_per_task,
+                                               SerializationState* state) {
+  const bool is_interleaved = (scan_info.num_components > 1);
+  int MCUs_per_row = 0;
+  int MCU_rows = 0;
+  jpg.CalculateMcuSize(scan_info, &MCUs_per_row, &MCU_rows);
+  const size_t num_mcus = static_cast<size_t>(MCUs_per_row) * MCU_rows;
+  const size_t num_intervals = DivCeil(num_mcus, restart_interval);
+  const size_t num_tasks = DivCeil(num_intervals, intervals_per_task);
+  const size_t blocks_per_mcu = BlocksPerMcu(jpg, scan_info);
+  const auto& extra_zero_runs = scan_info.extra_zero_runs;
+
+  std::vector<std::deque<OutputChunk>> task_output(num_tasks);
+  const auto encode_task = [&](const uint32_t task,
+                               size_t /* thread */) -> Status {
+    JpegBitWriter bw;
+    JpegBitWriterInit(&bw, &task_output[task]);
+    const uint8_t* pad_bits = nullptr;
+    const size_t interval_begin = task * intervals_per_task;
+    const size_t interval_end =
+        std::min(interval_begin + intervals_per_task, num_intervals);
+    uint32_t block_scan_index = static_cast<uint32_t>(
+        interval_begin * restart_interval * blocks_per_mcu);
+    size_t extra_zero_runs_pos =
+        std::lower_bound(extra_zero_runs.begin(), extra_zero_runs.end(),
+                         block_scan_index,
+                         [](const JPEGScanInfo::ExtraZeroRunInfo& info,
+                            uint32_t block_idx) {
+                           return info.block_idx < block_idx;
+                         }) -
+        extra_zero_runs.begin();
+    coeff_t last_dc_coeff[kMaxComponents];
+    for (size_t interval = interval_begin; interval < interval_end;
+         ++interval) {
+      if (interval > 0) {
+        if (!JumpToByteBoundary(&bw, &pad_bits, nullptr)) {
+          return JXL_FAILURE("Invalid padding bits");
+        }
+        EmitMarker(&bw, 0xD0 + ((interval - 1) & 0x7));
+      }
+      memset(last_dc_coeff, 0, sizeof(last_dc_coeff));
+      const size_t mcu_end =
+          std::min((interval + 1) * restart_interval, num_mcus);
+      for (size_t mcu = interval * restart_interval; mcu < mcu_end; ++mcu) {
+        const int mcu_y = mcu / MCUs_per_row;
+        const int mcu_x = mcu % MCUs_per_row;
+        for (size_t i = 0; i < scan_info.num_components; ++i) {
+          const JPEGComponentScanInfo& si = scan_info.components[i];
+          const JPEGComponent& c = jpg.components[si.comp_idx];
+          HuffmanCodeTable* dc_huff = &state->dc_huff_table[si.dc_tbl_idx];
+          HuffmanCodeTable* ac_huff = &state->ac_huff_table[si.ac_tbl_idx];
+          int n_blocks_y = is_interleaved ? c.v_samp_factor : 1;
+          int n_blocks_x = is_interleaved ? c.h_samp_factor : 1;
+          for (int iy = 0; iy < n_blocks_y; ++iy) {
+            for (int ix = 0; ix < n_blocks_x; ++ix) {
+              int block_y = mcu_y * n_blocks_y + iy;
+              int block_x = mcu_x * n_blocks_x + ix;
+              int block_idx = block_y * c.width_in_blocks + block_x;
+              int num_zero_runs = 0;
+              if (extra_zero_runs_pos < extra_zero_runs.size() &&
+                  extra_zero_runs[extra_zero_runs_pos].block_idx ==
+                      block_scan_index) {
+                num_zero_runs =
+                    extra_zero_runs[extra_zero_runs_pos].num_extra_zero_runs;
+                ++extra_zero_runs_pos;
+              }
+              const coeff_t* coeffs = &c.coeffs[block_idx << 6];
+              // compressed size per block cannot be more than 512 bytes
+              Reserve(&bw, 512);
+              if (!EncodeDCTBlockSequential(coeffs, dc_huff, ac_huff,
+                                            num_zero_runs,
+                                            last_dc_coeff + si.comp_idx,
+                                            &bw)) {
+                return JXL_FAILURE("Invalid DCT coefficients");
+              }
+              ++block_scan_index;
+            }
+          }
+        }
+      }
+    }
+    if (!JumpToByteBoundary(&bw, &pad_bits, nullptr)) {
+      return JXL_FAILURE("Invalid padding bits");
+    }
+    JpegBitWriterFinish(&bw);
+    if (!bw.healthy) return JXL_FAILURE("JPEG bit writer error");
+    return true;
+  };
+  if (!RunOnPool(state->pool, 0, num_tasks, ThreadPool::NoInit, encode_task,
+                 "EncodeJpegScan")) {
+    return SerializationStatus::ERROR;
+  }
+  for (auto& output : task_output) {
+    for (auto& chunk : output) {
+      state->output_queue.emplace_back(std::move(chunk));
+    }
+  }
+  state->scan_index++;
+  return SerializationStatus::DONE;
+}
+
 template <int kMode>
 SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
                                               SerializationState* state) {
@@ -749,8 +911,19 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
     }
   };
 
+  const bool all_rows_available = state->available_rows >= jpg.height;
+
   if (ss.stage == EncodeScanState::HEAD) {
     if (!EncodeSOS(jpg, scan_info, state)) return SerializationStatus::ERROR;
+    if (kMode == 0 && all_rows_available) {
+      const size_t intervals_per_task = RestartIntervalsPerScanTask(
+          jpg, scan_info, static_cast<size_t>(restart_interval), *state);
+      if (intervals_per_task != 0) {
+        return EncodeSequentialScanOnPool(
+            jpg, scan_info, static_cast<size_t>(restart_interval),
+            intervals_per_task, state);
+      }
+    }
     JpegBitWriterInit(&ss.bw, &state->output_queue);
     DCTCodingStateInit(&ss.coding_state);
     ss.restarts_to_go = restart_interval;
@@ -783,25 +956,21 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
   // DC-only is defined by [0..0] spectral range.
   const bool want_ac = ((Ss != 0) || (Se != 0));
   const bool want_dc = (Ss == 0);
-  // TODO(user): support streaming decoding again.
-  const bool complete_ac = true;
-  const bool has_ac = true;
-  if (want_ac && !has_ac) return SerializationStatus::NEEDS_MORE_INPUT;
-
-  // |has_ac| implies |complete_dc| but not vice versa; for the sake of
-  // simplicity we pretend they are equal, because they are separated by just a
-  // few bytes of input.
-  const bool complete_dc = has_ac;
-  const bool complete = want_ac ? complete_ac : complete_dc;
-  // When "incomplete" |ac_dc| tracks information about current ("incomplete")
-  // band parsing progress.
-
-  // FIXME: Is this always complete?
-  // const int last_mcu_y =
-  //     complete ? MCU_rows : parsing_state.internal->ac_dc.next_mcu_y *
-  //     v_group;
-  (void)complete;
-  const int last_mcu_y = complete ? MCU_rows : 0;
+
+  // Only the MCU rows that are entirely in the available rows are encoded.
+  int last_mcu_y = MCU_rows;
+  if (!all_rows_available) {
+    int max_v_samp_factor = 1;
+    for (const auto& c : jpg.components) {
+      max_v_samp_factor = std::max(c.v_samp_factor, max_v_samp_factor);
+    }
+    const int v_group =
+        is_interleaved
+            ? 1
+            : jpg.components[scan_info.components[0].comp_idx].v_samp_factor;
+    const size_t mcu_height = 8 * max_v_samp_factor / v_group;
+    last_mcu_y = std::min<int>(MCU_rows, state->available_rows / mcu_height);
+  }
 
   for (; ss.mcu_y < last_mcu_y; ++ss.mcu_y) {
     for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
@@ -876,6 +1045,8 @@ SerializationStatus JXL_NOINLINE DoEncodeScan(const JPEGData& jpg,
   }
   if (ss.mcu_y < MCU_rows) {
     if (!bw->healthy) return SerializationStatus::ERROR;
+    // Outputs the bytes of the MCU rows encoded so far.
+    if (bw->pos != 0) SwapBuffer(bw);
     return SerializationStatus::NEEDS_MORE_INPUT;
   }
   Flush(coding_state, bw);
@@ -977,7 +1148,8 @@ SerializationStatus SerializeSection(uint8_t marker, SerializationState* state,
   }
 }
 
-// TODO(veluca): add streaming support again.
+// Can be called again with the same "ss" after it failed with
+// kNotEnoughBytes, to continue where "out" stopped writing.
 Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
                          SerializationState* ss) {
   const auto maybe_push_output = [&]() -> Status {
@@ -989,6 +1161,7 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
           return StatusMessage(Status(StatusCode::kNotEnoughBytes),
                                "Failed to write output");
         }
+        chunk.next += num_written;
         chunk.len -= num_written;
         if (chunk.len == 0) {
           ss->output_queue.pop_front();
@@ -999,6 +1172,9 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
   };
 
   while (true) {
+    // The output of the previous stage is pushed before moving on, so that
+    // nothing is serialized twice when the output is full.
+    JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
     switch (ss->stage) {
       case SerializationState::STAGE_INIT: {
         // Valid Brunsli requires, at least, 0xD9 marker.
@@ -1016,7 +1192,6 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
         }
 
         EncodeSOI(ss);
-        JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
         ss->stage = SerializationState::STAGE_SERIALIZE_SECTION;
         break;
       }
@@ -1033,9 +1208,10 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
           ss->stage = SerializationState::STAGE_ERROR;
           break;
         }
-        JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
         if (status == SerializationStatus::NEEDS_MORE_INPUT) {
-          return JXL_FAILURE("Incomplete serialization data");
+          // Continues the scan when more rows are available.
+          JXL_QUIET_RETURN_IF_ERROR(maybe_push_output());
+          return true;
         } else if (status != SerializationStatus::DONE) {
           ss->stage = SerializationState::STAGE_ERROR;
           return JXL_FAILURE("Internal logic error");
@@ -1060,9 +1236,28 @@ Status WriteJpegInternal(const JPEGData& jpg, const JPEGOutput& out,
 
 }  // namespace
 
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out) {
-  auto ss = jxl::make_unique<SerializationState>();
-  return WriteJpegInternal(jpg, out, ss.get());
+JPEGWriter::JPEGWriter(const JPEGData& jpg, ThreadPool* pool)
+    : jpg_(jpg), state_(jxl::make_unique<SerializationState>()) {
+  state_->pool = pool;
+}
+
+JPEGWriter::~JPEGWriter() = default;
+
+void JPEGWriter::SetAvailableRows(size_t num_rows) {
+  state_->available_rows = num_rows;
+}
+
+Status JPEGWriter::Write(const JPEGOutput& out) {
+  return WriteJpegInternal(jpg_, out, state_.get());
+}
+
+bool JPEGWriter::IsDone() const {
+  return state_->stage == SerializationState::STAGE_DONE;
+}
+
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out, ThreadPool* pool) {
+  JPEGWriter writer(jpg, pool);
+  return writer.Write(out);
 }
 
 }  // namespace jpeg
@@ -11,7 +11,9 @@
 #include <cstddef>
 #include <cstdint>
 #include <functional>
+#include <memory>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
@@ -22,7 +24,41 @@ namespace jpeg {
 // written.
 using JPEGOutput = std::function<size_t(const uint8_t* buf, size_t len)>;
 
-Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out);
+struct SerializationState;
+
+// Writes a JPEGData to a series of outputs. When "out" writes nothing, Write
+// fails with StatusCode::kNotEnoughBytes and can be called again, with an
+// output having more room, to continue from where it stopped. The scans with
+// restart markers are encoded on "pool", if not null, when this gives the
+// same bytes. "jpg" must outlive the writer.
+//
+// With SetAvailableRows, the JPEG can be written while its coefficients are
+// decoded: Write then stops at the first MCU row that is not available yet,
+// and succeeds without IsDone. It continues from there once more rows are
+// available.
+class JPEGWriter {
+ public:
+  JPEGWriter(const JPEGData& jpg, ThreadPool* pool);
+  ~JPEGWriter();
+
+  // Sets the number of rows of pixels, from the top, whose coefficients are
+  // final, and which the scans can therefore be encoded up to. All the rows
+  // are available by default.
+  void SetAvailableRows(size_t num_rows);
+
+  Status Write(const JPEGOutput& out);
+
+  // Returns whether the whole JPEG has been written.
+  bool IsDone() const;
+
+ private:
+  const JPEGData& jpg_;
+  std::unique_ptr<SerializationState> state_;
+};
+
+// Writes "jpg" in one go with a JPEGWriter.
+Status WriteJpeg(const JPEGData& jpg, const JPEGOutput& out,
+                 ThreadPool* pool = nullptr);
 
 }  // namespace jpeg
 }  // namespace jxl
@@ -0,0 +1,121 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/jpeg/dec_jpeg_idct.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jxl/base/compiler_specific.h"
+
+namespace jxl {
+namespace jpeg {
+
+namespace {
+
+// The rotations of the Loeffler-Ligtenberg-Moschytz IDCT use constants with
+// 13 fractional bits, and the first pass keeps 2 more bits than its input.
+constexpr int kConstBits = 13;
+constexpr int kPass1Bits = 2;
+
+constexpr int64_t kFix_0_298631336 = 2446;
+constexpr int64_t kFix_0_390180644 = 3196;
+constexpr int64_t kFix_0_541196100 = 4433;
+constexpr int64_t kFix_0_765366865 = 6270;
+constexpr int64_t kFix_0_899976223 = 7373;
+constexpr int64_t kFix_1_175875602 = 9633;
+constexpr int64_t kFix_1_501321110 = 12299;
+constexpr int64_t kFix_1_847759065 = 15137;
+constexpr int64_t kFix_1_961570560 = 16069;
+constexpr int64_t kFix_2_053119869 = 16819;
+constexpr int64_t kFix_2_562915447 = 20995;
+constexpr int64_t kFix_3_072711026 = 25172;
+
+// Divides by 2^n, rounding to nearest.
+JXL_INLINE int64_t Descale(int64_t x, int n) {
+  return (x + (int64_t{1} << (n - 1))) >> n;
+}
+
+// One dimensional IDCT of the 8 values in[0], in[step], ..., in[7 * step].
+// The outputs are scaled by 2^kConstBits and not yet descaled.
+void IDCT1D(const int64_t* in, size_t step, int64_t* out) {
+  // Even part.
+  int64_t z2 = in[2 * step];
+  int64_t z3 = in[6 * step];
+  int64_t z1 = (z2 + z3) * kFix_0_541196100;
+  int64_t tmp2 = z1 - z3 * kFix_1_847759065;
+  int64_t tmp3 = z1 + z2 * kFix_0_765366865;
+  z2 = in[0];
+  z3 = in[4 * step];
+  int64_t tmp0 = (z2 + z3) * (int64_t{1} << kConstBits);
+  int64_t tmp1 = (z2 - z3) * (int64_t{1} << kConstBits);
+  const int64_t tmp10 = tmp0 + tmp3;
+  const int64_t tmp13 = tmp0 - tmp3;
+  const int64_t tmp11 = tmp1 + tmp2;
+  const int64_t tmp12 = tmp1 - tmp2;
+
+  // Odd part.
+  tmp0 = in[7 * step];
+  tmp1 = in[5 * step];
+  tmp2 = in[3 * step];
+  tmp3 = in[1 * step];
+  z1 = tmp0 + tmp3;
+  z2 = tmp1 + tmp2;
+  z3 = tmp0 + tmp2;
+  int64_t z4 = tmp1 + tmp3;
+  const int64_t z5 = (z3 + z4) * kFix_1_175875602;
+  tmp0 *= kFix_0_298631336;
+  tmp1 *= kFix_2_053119869;
+  tmp2 *= kFix_3_072711026;
+  tmp3 *= kFix_1_501321110;
+  z1 *= -kFix_0_899976223;
+  z2 *= -kFix_2_562915447;
+  z3 = z3 * -kFix_1_961570560 + z5;
+  z4 = z4 * -kFix_0_390180644 + z5;
+  tmp0 += z1 + z3;
+  tmp1 += z2 + z4;
+  tmp2 += z2 + z3;
+  tmp3 += z1 + z4;
+
+  out[0] = tmp10 + tmp3;
+  out[7] = tmp10 - tmp3;
+  out[1] = tmp11 + tmp2;
+  out[6] = tmp11 - tmp2;
+  out[2] = tmp12 + tmp1;
+  out[5] = tmp12 - tmp1;
+  out[3] = tmp13 + tmp0;
+  out[4] = tmp13 - tmp0;
+}
+
+}  // namespace
+
+void InverseDCTIntegerISlow(const int32_t* JXL_RESTRICT coeffs,
+                            uint8_t* JXL_RESTRICT pixels, size_t stride) {
+  // 64 bit arithmetic, so that no coefficient can overflow.
+  int64_t in[64];
+  std::copy(coeffs, coeffs + 64, in);
+  int64_t workspace[64];
+  int64_t out[8];
+  // Columns, into the transposed workspace.
+  for (size_t x = 0; x < 8; x++) {
+    IDCT1D(in + x, 8, out);
+    for (size_t y = 0; y < 8; y++) {
+      workspace[x * 8 + y] = Descale(out[y], kConstBits - kPass1Bits);
+    }
+  }
+  // Rows, with the 1/8 of the 2D transform and the level shift.
+  for (size_t y = 0; y < 8; y++) {
+    IDCT1D(workspace + y, 8, out);
+    for (size_t x = 0; x < 8; x++) {
+      const int64_t v = Descale(out[x], kConstBits + kPass1Bits + 3) + 128;
+      pixels[y * stride + x] =
+          static_cast<uint8_t>(std::min<int64_t>(std::max<int64_t>(v, 0), 255));
+    }
+  }
+}
+
+}  // namespace jpeg
+}  // namespace jxl
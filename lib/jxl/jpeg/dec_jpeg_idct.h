@@ -0,0 +1,26 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_JPEG_DEC_JPEG_IDCT_H_
+#define LIB_JXL_JPEG_DEC_JPEG_IDCT_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "lib/jxl/base/compiler_specific.h"
+
+namespace jxl {
+namespace jpeg {
+
+// Inverse DCT of a block of dequantized JPEG coefficients, in natural order,
+// with the fixed point arithmetic of the "islow" method of libjpeg, which is
+// its default. Writes the 8 rows of 8 samples, in [0, 255], to `pixels`.
+void InverseDCTIntegerISlow(const int32_t* JXL_RESTRICT coeffs,
+                            uint8_t* JXL_RESTRICT pixels, size_t stride);
+
+}  // namespace jpeg
+}  // namespace jxl
+
+#endif  // LIB_JXL_JPEG_DEC_JPEG_IDCT_H_
@@ -0,0 +1,89 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/jpeg/dec_jpeg_idct.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/testing.h"
+
+namespace jxl {
+namespace jpeg {
+namespace {
+
+// The inverse DCT of the JPEG specification, in double precision, with the
+// level shift and clamping to [0, 255].
+void ReferenceIDCT(const int32_t* coeffs, double* pixels) {
+  for (size_t y = 0; y < 8; y++) {
+    for (size_t x = 0; x < 8; x++) {
+      double sum = 0;
+      for (size_t v = 0; v < 8; v++) {
+        for (size_t u = 0; u < 8; u++) {
+          const double cu = u == 0 ? 1 / std::sqrt(2.0) : 1.0;
+          const double cv = v == 0 ? 1 / std::sqrt(2.0) : 1.0;
+          sum += cu * cv * coeffs[v * 8 + u] *
+                 std::cos((2 * x + 1) * u * kPi / 16) *
+                 std::cos((2 * y + 1) * v * kPi / 16);
+        }
+      }
+      pixels[y * 8 + x] = std::min(std::max(sum / 4 + 128, 0.0), 255.0);
+    }
+  }
+}
+
+TEST(JpegIDCTTest, FlatBlock) {
+  int32_t coeffs[64] = {};
+  uint8_t pixels[64];
+  for (int dc = -1024; dc <= 1016; dc += 8) {
+    coeffs[0] = dc;
+    InverseDCTIntegerISlow(coeffs, pixels, 8);
+    for (uint8_t p : pixels) {
+      ASSERT_EQ(dc / 8 + 128, p);
+    }
+  }
+}
+
+// The dequantized coefficients of typical JPEGs: a DC and a few AC of
+// decreasing magnitude.
+TEST(JpegIDCTTest, MatchesFloatWithinOne) {
+  Rng rng(0);
+  int32_t coeffs[64];
+  uint8_t pixels[64];
+  double expected[64];
+  for (size_t iter = 0; iter < 2000; ++iter) {
+    coeffs[0] = rng.UniformI(-1024, 1024);
+    for (size_t i = 1; i < 64; i++) {
+      const int range = 512 / (1 + i);
+      coeffs[i] = rng.Bernoulli(0.3f) ? rng.UniformI(-range, range + 1) : 0;
+    }
+    InverseDCTIntegerISlow(coeffs, pixels, 8);
+    ReferenceIDCT(coeffs, expected);
+    for (size_t i = 0; i < 64; i++) {
+      ASSERT_LE(std::abs(pixels[i] - expected[i]), 1.0)
+          << "iter " << iter << " pixel " << i;
+    }
+  }
+}
+
+// Coefficients far outside of the range of valid JPEGs are clamped.
+TEST(JpegIDCTTest, LargeCoefficients) {
+  int32_t coeffs[64];
+  uint8_t pixels[64];
+  for (int sign : {-1, 1}) {
+    std::fill(coeffs, coeffs + 64, sign * (1 << 30));
+    InverseDCTIntegerISlow(coeffs, pixels, 8);
+    EXPECT_EQ(sign > 0 ? 255 : 0, pixels[0]);
+  }
+}
+
+}  // namespace
+}  // namespace jpeg
+}  // namespace jxl
@@ -12,6 +12,7 @@
 #include <deque>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/jpeg/dec_jpeg_output_chunk.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
@@ -93,6 +94,11 @@ struct SerializationState {
   const uint8_t* pad_bits_end = nullptr;
   bool seen_dri_marker = false;
   bool is_progressive = false;
+  // Optional, used to encode the sequential scans with restart markers.
+  ThreadPool* pool = nullptr;
+  // Number of rows of pixels, from the top, whose coefficients are final. The
+  // scans stop before the first MCU row below them.
+  size_t available_rows = ~static_cast<size_t>(0);
 
   EncodeScanState scan_state;
 };
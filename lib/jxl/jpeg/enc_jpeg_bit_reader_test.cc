@@ -0,0 +1,154 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/jpeg/enc_jpeg_bit_reader.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/jpeg/jpeg_data.h"
+#include "lib/jxl/testing.h"
+
+namespace jxl {
+namespace jpeg {
+namespace {
+
+// Reads the bits one byte at a time, which is what BitReaderState does when
+// the next eight bytes contain a 0xff.
+struct BytewiseReader {
+  BytewiseReader(const uint8_t* data, const size_t len, size_t pos)
+      : data(data), len(len), pos(pos), next_marker_pos(len - 2) {}
+
+  uint8_t GetNextByte() {
+    if (pos >= next_marker_pos) {
+      ++pos;
+      return 0;
+    }
+    uint8_t c = data[pos++];
+    if (c == 0xff) {
+      if (data[pos] == 0) {
+        ++pos;
+      } else {
+        next_marker_pos = pos - 1;
+      }
+    }
+    return c;
+  }
+
+  int ReadBits(int nbits) {
+    while (bits_left < nbits) {
+      val = (val << 8) | GetNextByte();
+      bits_left += 8;
+    }
+    bits_left -= nbits;
+    return (val >> bits_left) & ((1ULL << nbits) - 1);
+  }
+
+  // The position after the last byte that a bit was read from, or past the
+  // marker if the data ran out.
+  size_t EndPos() const {
+    size_t end = pos;
+    for (int unused = bits_left >> 3; unused > 0; --unused) {
+      --end;
+      if (end < next_marker_pos && data[end] == 0 && data[end - 1] == 0xff) {
+        --end;
+      }
+    }
+    return end;
+  }
+
+  const uint8_t* data;
+  const size_t len;
+  size_t pos;
+  size_t next_marker_pos;
+  uint64_t val = 0;
+  int bits_left = 0;
+};
+
+// A byte of the scan header, then entropy coded data of "size" bytes, made of
+// random bytes with many 0xff, each stuffed with a 0x00, optionally followed
+// by a restart marker and more data, and always ending with an EOI marker.
+std::vector<uint8_t> RandomScan(Rng& rng, size_t size, size_t* marker_pos) {
+  std::vector<uint8_t> data = {0x00};
+  const auto append_data = [&](size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      if (rng.Bernoulli(0.2f)) {
+        data.push_back(0xff);
+        data.push_back(0x00);
+      } else {
+        data.push_back(rng.UniformU(0, 0xff));
+      }
+    }
+  };
+  append_data(size);
+  *marker_pos = data.size();
+  if (rng.Bernoulli(0.5f)) {
+    data.push_back(0xff);
+    data.push_back(0xd0 + rng.UniformU(0, 8));
+    append_data(rng.UniformU(0, 16));
+  }
+  data.push_back(0xff);
+  data.push_back(0xd9);
+  return data;
+}
+
+TEST(JpegBitReaderTest, MatchesBytewiseReading) {
+  Rng rng(0);
+  for (size_t iter = 0; iter < 2000; ++iter) {
+    size_t marker_pos;
+    const std::vector<uint8_t> data =
+        RandomScan(rng, rng.UniformU(0, 40), &marker_pos);
+    BitReaderState br(data.data(), data.size(), 1);
+    BytewiseReader expected(data.data(), data.size(), 1);
+    // Up to a few bytes past the marker, which read as zeros.
+    const size_t num_bits = 8 * rng.UniformU(0, marker_pos + 4);
+    size_t bits_read = 0;
+    while (bits_read < num_bits) {
+      const int nbits = rng.UniformU(1, 17);
+      ASSERT_EQ(expected.ReadBits(nbits), br.ReadBits(nbits))
+          << "iter " << iter << " bit " << bits_read;
+      bits_read += nbits;
+    }
+    JPEGData jpg;
+    size_t pos = 0;
+    const bool finished = br.FinishStream(&jpg, &pos);
+    const size_t expected_pos = expected.EndPos();
+    EXPECT_EQ(expected_pos <= expected.next_marker_pos, finished)
+        << "iter " << iter;
+    if (finished) {
+      EXPECT_EQ(expected_pos, pos) << "iter " << iter;
+      // The reader stops at the marker, stuffing included.
+      EXPECT_LE(pos, marker_pos);
+    }
+    EXPECT_EQ((8 - bits_read % 8) % 8, jpg.padding_bits.size())
+        << "iter " << iter;
+  }
+}
+
+// After a restart marker, reading resumes at the next segment.
+TEST(JpegBitReaderTest, ResetAfterMarker) {
+  const std::vector<uint8_t> data = {0x12, 0xff, 0x00, 0x34, 0x56, 0xff, 0xd0,
+                                     0x80, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04,
+                                     0x05, 0x06, 0x07, 0x08, 0xff, 0xd9};
+  BitReaderState br(data.data(), data.size(), 0);
+  EXPECT_EQ(0x12ff, br.ReadBits(16));
+  EXPECT_EQ(0x3456, br.ReadBits(16));
+  JPEGData jpg;
+  size_t pos;
+  ASSERT_TRUE(br.FinishStream(&jpg, &pos));
+  EXPECT_EQ(5u, pos);
+  br.Reset(pos + 2);
+  EXPECT_EQ(0x80ff, br.ReadBits(16));
+  for (int i = 1; i <= 8; ++i) EXPECT_EQ(i, br.ReadBits(8));
+  // Past the EOI marker, the bits are zero.
+  EXPECT_EQ(0, br.ReadBits(16));
+  EXPECT_FALSE(br.FinishStream(&jpg, &pos));
+}
+
+}  // namespace
+}  // namespace jpeg
+}  // namespace jxl
@@ -12,10 +12,13 @@
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/byte_order.h"
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/frame_dimensions.h"
+#include "lib/jxl/jpeg/enc_jpeg_bit_reader.h"
 #include "lib/jxl/jpeg/enc_jpeg_huffman_decode.h"
 #include "lib/jxl/jpeg/jpeg_data.h"
 
@@ -379,101 +382,6 @@ bool ProcessCOM(const uint8_t* data, const size_t len, size_t* pos,
   return true;
 }
 
-// Helper structure to read bits from the entropy coded data segment.
-struct BitReaderState {
-  BitReaderState(const uint8_t* data, const size_t len, size_t pos)
-      : data_(data), len_(len) {
-    Reset(pos);
-  }
-
-  void Reset(size_t pos) {
-    pos_ = pos;
-    val_ = 0;
-    bits_left_ = 0;
-    next_marker_pos_ = len_ - 2;
-    FillBitWindow();
-  }
-
-  // Returns the next byte and skips the 0xff/0x00 escape sequences.
-  uint8_t GetNextByte() {
-    if (pos_ >= next_marker_pos_) {
-      ++pos_;
-      return 0;
-    }
-    uint8_t c = data_[pos_++];
-    if (c == 0xff) {
-      uint8_t escape = data_[pos_];
-      if (escape == 0) {
-        ++pos_;
-      } else {
-        // 0xff was followed by a non-zero byte, which means that we found the
-        // start of the next marker segment.
-        next_marker_pos_ = pos_ - 1;
-      }
-    }
-    return c;
-  }
-
-  void FillBitWindow() {
-    if (bits_left_ <= 16) {
-      while (bits_left_ <= 56) {
-        val_ <<= 8;
-        val_ |= static_cast<uint64_t>(GetNextByte());
-        bits_left_ += 8;
-      }
-    }
-  }
-
-  int ReadBits(int nbits) {
-    FillBitWindow();
-    uint64_t val = (val_ >> (bits_left_ - nbits)) & ((1ULL << nbits) - 1);
-    bits_left_ -= nbits;
-    return val;
-  }
-
-  // Sets *pos to the next stream position where parsing should continue.
-  // Enqueue the padding bits seen (0 or 1).
-  // Returns false if there is inconsistent or invalid padding or the stream
-  // ended too early.
-  bool FinishStream(JPEGData* jpg, size_t* pos) {
-    int npadbits = bits_left_ & 7;
-    if (npadbits > 0) {
-      uint64_t padmask = (1ULL << npadbits) - 1;
-      uint64_t padbits = (val_ >> (bits_left_ - npadbits)) & padmask;
-      if (padbits != padmask) {
-        jpg->has_zero_padding_bit = true;
-      }
-      for (int i = npadbits - 1; i >= 0; --i) {
-        jpg->padding_bits.push_back((padbits >> i) & 1);
-      }
-    }
-    // Give back some bytes that we did not use.
-    int unused_bytes_left = bits_left_ >> 3;
-    while (unused_bytes_left-- > 0) {
-      --pos_;
-      // If we give back a 0 byte, we need to check if it was a 0xff/0x00 escape
-      // sequence, and if yes, we need to give back one more byte.
-      if (pos_ < next_marker_pos_ && data_[pos_] == 0 &&
-          data_[pos_ - 1] == 0xff) {
-        --pos_;
-      }
-    }
-    if (pos_ > next_marker_pos_) {
-      // Data ran out before the scan was complete.
-      return JXL_FAILURE("Unexpected end of scan.");
-    }
-    *pos = pos_;
-    return true;
-  }
-
-  const uint8_t* data_;
-  const size_t len_;
-  size_t pos_;
-  uint64_t val_;
-  int bits_left_;
-  size_t next_marker_pos_;
-};
-
 // Returns the next Huffman-coded symbol.
 int ReadSymbol(const HuffmanTableEntry* table, BitReaderState* br) {
   int nbits;
@@ -532,9 +440,45 @@ int HuffExtend(int x, int s) {
   }
 }
 
+// An AC coefficient whose Huffman code and extra bits together fit in the
+// first kJpegHuffmanRootTableBits bits of the stream, so that both are decoded
+// with a single lookup.
+struct FastACEntry {
+  uint8_t bits = 0;  // Huffman code and extra bits, 0 if not a fast entry.
+  uint8_t run = 0;
+  int16_t value = 0;  // Coefficient before the Al shift.
+};
+
+// Fills the 2^kJpegHuffmanRootTableBits entries of "fast_ac" for the AC
+// Huffman table "ac_huff", leaving out the coefficients that would be out of
+// range with the point transform "Al" so that the regular path reports them.
+void BuildFastACTable(const HuffmanTableEntry* ac_huff, int Al,
+                      FastACEntry* fast_ac) {
+  constexpr int kRootBits = kJpegHuffmanRootTableBits;
+  for (int i = 0; i < (1 << kRootBits); ++i) {
+    fast_ac[i] = FastACEntry();
+    const HuffmanTableEntry& entry = ac_huff[i];
+    // Longer codes and invalid symbols have bits > kRootBits or value >= 256.
+    if (entry.bits > kRootBits || entry.value >= kJpegHuffmanAlphabetSize) {
+      continue;
+    }
+    const int r = entry.value >> 4;
+    const int s = entry.value & 15;
+    if (s == 0 || entry.bits + s > kRootBits ||
+        s + Al >= kJpegDCAlphabetSize) {
+      continue;
+    }
+    const int extra = (i >> (kRootBits - entry.bits - s)) & ((1 << s) - 1);
+    fast_ac[i].bits = entry.bits + s;
+    fast_ac[i].run = r;
+    fast_ac[i].value = HuffExtend(extra, s);
+  }
+}
+
 // Decodes one 8x8 block of DCT coefficients from the bit stream.
 bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
-                    const HuffmanTableEntry* ac_huff, int Ss, int Se, int Al,
+                    const HuffmanTableEntry* ac_huff,
+                    const FastACEntry* fast_ac, int Ss, int Se, int Al,
                     int* eobrun, bool* reset_state, int* num_zero_runs,
                     BitReaderState* br, JPEGData* jpg, coeff_t* last_dc_coeff,
                     coeff_t* coeffs) {
@@ -570,6 +514,21 @@ bool DecodeDCTBlock(const HuffmanTableEntry* dc_huff,
   }
   *num_zero_runs = 0;
   for (int k = Ss; k <= Se; k++) {
+    br->FillBitWindow();
+    const FastACEntry& fast =
+        fast_ac[(br->val_ >> (br->bits_left_ - kJpegHuffmanRootTableBits)) &
+                ((1 << kJpegHuffmanRootTableBits) - 1)];
+    if (fast.bits != 0) {
+      k += fast.run;
+      if (k > Se) {
+        return JXL_FAILURE("Out-of-band coefficient %d band was %d-%d", k, Ss,
+                           Se);
+      }
+      br->bits_left_ -= fast.bits;
+      coeffs[kJPEGNaturalOrder[k]] = fast.value * Am;
+      *num_zero_runs = 0;
+      continue;
+    }
     int sr = ReadSymbol(ac_huff, br);
     if (sr >= kJpegHuffmanAlphabetSize) {
       return JXL_FAILURE("Invalid Huffman symbol %d for AC coefficient %d", sr,
@@ -800,6 +759,15 @@ bool ProcessScan(const uint8_t* data, const size_t len,
   if (Al > 10) {
     return JXL_FAILURE("Scan parameter Al=%d is not supported.", Al);
   }
+  FastACEntry fast_ac[kMaxComponents][1 << kJpegHuffmanRootTableBits];
+  if (Ah == 0) {
+    for (size_t i = 0; i < scan_info->num_components; ++i) {
+      BuildFastACTable(
+          &ac_huff_lut[scan_info->components[i].ac_tbl_idx *
+                       kJpegHuffmanLutSize],
+          Al, fast_ac[i]);
+    }
+  }
   for (int mcu_y = 0; mcu_y < MCU_rows; ++mcu_y) {
     for (int mcu_x = 0; mcu_x < MCUs_per_row; ++mcu_x) {
       // Handle the restart intervals.
@@ -837,9 +805,9 @@ bool ProcessScan(const uint8_t* data, const size_t len,
             int num_zero_runs = 0;
             coeff_t* coeffs = &c->coeffs[block_idx * kDCTBlockSize];
             if (Ah == 0) {
-              if (!DecodeDCTBlock(dc_lut, ac_lut, Ss, Se, Al, &eobrun,
-                                  &reset_state, &num_zero_runs, &br, jpg,
-                                  &last_dc_coeff[si->comp_idx], coeffs)) {
+              if (!DecodeDCTBlock(dc_lut, ac_lut, fast_ac[i], Ss, Se, Al,
+                                  &eobrun, &reset_state, &num_zero_runs, &br,
+                                  jpg, &last_dc_coeff[si->comp_idx], coeffs)) {
                 return false;
               }
             } else {
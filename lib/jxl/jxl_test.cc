@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <cstring>
 #include <future>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <tuple>
@@ -35,6 +36,7 @@
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
+#include "lib/jxl/enc_cache.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/fake_parallel_runner_testonly.h"
 #include "lib/jxl/image.h"
@@ -334,6 +336,178 @@ TEST(JxlTest, RoundtripMultiGroup) {
                                2.0f, 38887u, 15.5);
 }
 
+// Approximate butteraugli is opt-in: the default encode is the same as with
+// the option off, and turning it on stays within a bounded distance.
+JXL_SLOW_TEST(JxlTest, RoundtripApproximateButteraugli) {
+  ThreadPoolForTests pool(4);
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(1024, 1024));
+
+  auto encode = [&](int approximate, PackedPixelFile* ppf_out) {
+    JXLCompressParams cparams;
+    cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 8);
+    if (approximate >= 0) {
+      cparams.AddOption(JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI,
+                        approximate);
+    }
+    extras::JXLDecompressParams dparams;
+    return Roundtrip(t.ppf(), cparams, dparams, pool.get(), ppf_out);
+  };
+
+  PackedPixelFile ppf_default;
+  PackedPixelFile ppf_off;
+  PackedPixelFile ppf_on;
+  size_t size_default = encode(-1, &ppf_default);
+  size_t size_off = encode(0, &ppf_off);
+  size_t size_on = encode(1, &ppf_on);
+  EXPECT_EQ(size_default, size_off);
+  EXPECT_EQ(0.0, ComputeDistance2(ppf_default, ppf_off));
+  EXPECT_NEAR(size_on, size_off, size_off / 20);
+  const double distance_off = ButteraugliDistance(t.ppf(), ppf_off);
+  const double distance_on = ButteraugliDistance(t.ppf(), ppf_on);
+  EXPECT_NEAR(distance_on, distance_off, 0.1 * distance_off);
+}
+
+// Pruning the large transforms of detailed squares changes the chosen AC
+// strategy, so it only happens when requested.
+TEST(JxlTest, RoundtripLargeTransformPruning) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  ThreadPoolForTests pool(4);
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io{memory_manager};
+  ASSERT_TRUE(SetFromBytes(Bytes(orig), &io, pool.get()));
+  ASSERT_TRUE(io.ShrinkTo(512, 512));
+
+  CompressParams cparams;
+  cparams.butteraugli_distance = 1.0f;
+  std::vector<uint8_t> compressed_default;
+  ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed_default, pool.get()));
+
+  // Any value above 1 leaves the search unchanged.
+  cparams.large_transform_max_detail = 1.5f;
+  std::vector<uint8_t> compressed_disabled;
+  ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed_disabled, pool.get()));
+  EXPECT_EQ(compressed_default, compressed_disabled);
+
+  // Pruning every square gives other transforms.
+  cparams.large_transform_max_detail = 0.0f;
+  std::vector<uint8_t> compressed_pruned;
+  ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed_pruned, pool.get()));
+  EXPECT_NE(compressed_default, compressed_pruned);
+  CodecInOut io_pruned{memory_manager};
+  ASSERT_TRUE(test::DecodeFile({}, Bytes(compressed_pruned), &io_pruned));
+  EXPECT_EQ(512u, io_pruned.xsize());
+}
+
+TEST(JxlTest, RoundtripSharedAnalysis) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  ThreadPoolForTests pool(4);
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io{memory_manager};
+  ASSERT_TRUE(SetFromBytes(Bytes(orig), &io, pool.get()));
+  ASSERT_TRUE(io.ShrinkTo(512, 512));
+
+  CompressParams cparams;
+  cparams.analysis_cache = std::make_shared<FrameAnalysisCache>();
+  // The encodes after the first one reuse the analysis, and must give the
+  // same codestream as without it.
+  for (float distance : {1.0f, 2.5f, 0.5f}) {
+    cparams.butteraugli_distance = distance;
+    CompressParams cparams_alone = cparams;
+    cparams_alone.analysis_cache = nullptr;
+    std::vector<uint8_t> compressed;
+    std::vector<uint8_t> compressed_alone;
+    ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed, pool.get()));
+    ASSERT_TRUE(
+        test::EncodeFile(cparams_alone, &io, &compressed_alone, pool.get()));
+    EXPECT_EQ(compressed_alone, compressed);
+  }
+  const FrameAnalysisCache& cache = *cparams.analysis_cache;
+  EXPECT_EQ(512u, cache.opsin.xsize());
+  EXPECT_EQ(128u, cache.pre_erosion.xsize());
+
+  // The cache is keyed on the pixels, so an image of the same size that only
+  // differs in one of them replaces the analysis.
+  const uint64_t key = cache.key;
+  io.Main().color()->PlaneRow(1, 100)[100] += 0.25f;
+  CompressParams cparams_alone = cparams;
+  cparams_alone.analysis_cache = nullptr;
+  std::vector<uint8_t> compressed;
+  std::vector<uint8_t> compressed_alone;
+  ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed, pool.get()));
+  ASSERT_TRUE(
+      test::EncodeFile(cparams_alone, &io, &compressed_alone, pool.get()));
+  EXPECT_EQ(compressed_alone, compressed);
+  EXPECT_NE(key, cache.key);
+}
+
+// At the speeds that compare the image with butteraugli, its reference is also
+// kept in the cache.
+TEST(JxlTest, RoundtripSharedButteraugliReference) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  ThreadPoolForTests pool(4);
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io{memory_manager};
+  ASSERT_TRUE(SetFromBytes(Bytes(orig), &io, pool.get()));
+  ASSERT_TRUE(io.ShrinkTo(256, 256));
+
+  CompressParams cparams;
+  cparams.speed_tier = SpeedTier::kKitten;
+  cparams.analysis_cache = std::make_shared<FrameAnalysisCache>();
+  for (float distance : {1.0f, 3.0f}) {
+    cparams.butteraugli_distance = distance;
+    CompressParams cparams_alone = cparams;
+    cparams_alone.analysis_cache = nullptr;
+    std::vector<uint8_t> compressed;
+    std::vector<uint8_t> compressed_alone;
+    ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed, pool.get()));
+    ASSERT_TRUE(
+        test::EncodeFile(cparams_alone, &io, &compressed_alone, pool.get()));
+    EXPECT_EQ(compressed_alone, compressed);
+  }
+  const FrameAnalysisCache& cache = *cparams.analysis_cache;
+  ASSERT_NE(nullptr, cache.butteraugli);
+  EXPECT_TRUE(cache.butteraugli->HasReference(256, 256));
+}
+
+TEST(JxlTest, RoundtripEntropyCodingCache) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  ThreadPoolForTests pool(4);
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  CodecInOut io{memory_manager};
+  ASSERT_TRUE(SetFromBytes(Bytes(orig), &io, pool.get()));
+  ASSERT_TRUE(io.ShrinkTo(512, 512));
+
+  CompressParams cparams;
+  std::vector<uint8_t> compressed_alone;
+  ASSERT_TRUE(test::EncodeFile(cparams, &io, &compressed_alone, pool.get()));
+
+  // The first frame fills the cache and the second one, the same image,
+  // reuses its coefficient orders and clustering.
+  cparams.entropy_coding_cache = std::make_shared<EntropyCodingCache>();
+  for (size_t i = 0; i < 2; i++) {
+    CodecInOut io2{memory_manager};
+    size_t compressed_size;
+    JXL_EXPECT_OK(
+        Roundtrip(&io, cparams, {}, &io2, _, &compressed_size, pool.get()));
+    EXPECT_NEAR(compressed_size, compressed_alone.size(),
+                compressed_alone.size() / 100);
+    EXPECT_SLIGHTLY_BELOW(
+        ButteraugliDistance(io.frames, io2.frames, ButteraugliParams(),
+                            *JxlGetDefaultCms(),
+                            /*distmap=*/nullptr, pool.get()),
+        1.5);
+  }
+  const EntropyCodingCache& cache = *cparams.entropy_coding_cache;
+  EXPECT_EQ(64u, cache.xsize_blocks);
+  EXPECT_FALSE(cache.coeff_orders.empty());
+  ASSERT_EQ(1u, cache.ac_clustering.size());
+  EXPECT_FALSE(cache.ac_clustering[0].context_map.empty());
+}
+
 TEST(JxlTest, RoundtripRGBToGrayscale) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   ThreadPoolForTests pool(4);
@@ -1102,6 +1276,67 @@ JXL_SLOW_TEST(JxlTest, RoundtripLossless8ThunderGradient) {
   EXPECT_EQ(ComputeDistance2(t.ppf(), ppf_out), 0.0);
 }
 
+JXL_SLOW_TEST(JxlTest, RoundtripLossless8ThunderFastLossless) {
+  ThreadPoolForTests pool(8);
+  const std::vector<uint8_t> orig =
+      ReadTestData("external/wesaturate/500px/tmshre_riaphotographs_srgb8.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(t.ppf().frames[0].color.format);
+
+  // Effort 2 goes through the fast lossless predictor and RCT search...
+  JXLCompressParams cparams = test::CompressParamsForLossless();
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 2);  // kThunder
+  PackedPixelFile ppf_out;
+  size_t fast_size = Roundtrip(t.ppf(), cparams, dparams, pool.get(), &ppf_out);
+  EXPECT_EQ(ComputeDistance2(t.ppf(), ppf_out), 0.0);
+
+  // ... which does better than effort 1, with its fixed gradient and YCoCg...
+  JXLCompressParams lightning_cparams = test::CompressParamsForLossless();
+  lightning_cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 1);  // kLightning
+  PackedPixelFile lightning_out;
+  size_t lightning_size = Roundtrip(t.ppf(), lightning_cparams, dparams,
+                                    pool.get(), &lightning_out);
+  EXPECT_SLIGHTLY_BELOW(fast_size, lightning_size);
+
+  // ... and stays close to the modular encoder, which effort 2 used before
+  // and still uses when a predictor is requested.
+  JXLCompressParams modular_cparams = test::CompressParamsForLossless();
+  modular_cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 2);  // kThunder
+  modular_cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 5);
+  PackedPixelFile modular_out;
+  size_t modular_size =
+      Roundtrip(t.ppf(), modular_cparams, dparams, pool.get(), &modular_out);
+  EXPECT_EQ(ComputeDistance2(t.ppf(), modular_out), 0.0);
+  EXPECT_LE(fast_size, modular_size * 11 / 10);
+}
+
+TEST(JxlTest, RoundtripLossless8ThunderFastLosslessAlpha) {
+  ThreadPoolForTests pool(8);
+  TestImage t;
+  ASSERT_TRUE(t.SetDimensions(300, 280));
+  ASSERT_TRUE(t.SetChannels(4));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, t.AddFrame());
+  frame.ZeroFill();
+  for (size_t y = 0; y < 280; y++) {
+    for (size_t x = 0; x < 300; x++) {
+      ASSERT_TRUE(frame.SetValue(y, x, 0, ((x * 7 + y) % 256) / 255.f));
+      ASSERT_TRUE(frame.SetValue(y, x, 1, ((x * y) % 256) / 255.f));
+      ASSERT_TRUE(frame.SetValue(y, x, 2, ((x * 5 + 9) % 256) / 255.f));
+      ASSERT_TRUE(frame.SetValue(y, x, 3, (y % 256) / 255.f));
+    }
+  }
+  JXLCompressParams cparams = test::CompressParamsForLossless();
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 2);  // kThunder
+  JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(t.ppf().frames[0].color.format);
+  PackedPixelFile ppf_out;
+  Roundtrip(t.ppf(), cparams, dparams, pool.get(), &ppf_out);
+  EXPECT_EQ(ComputeDistance2(t.ppf(), ppf_out), 0.0);
+}
+
 JXL_SLOW_TEST(JxlTest, RoundtripLossless8LightningGradient) {
   ThreadPoolForTests pool(8);
   const std::vector<uint8_t> orig =
@@ -1419,6 +1654,86 @@ TEST(JxlTest, RoundtripAnimationPatches) {
   EXPECT_SLIGHTLY_BELOW(ButteraugliDistance(t.ppf(), ppf_out), 1.85);
 }
 
+TEST(JxlTest, DecodeAnimationWithFrameDecoders) {
+  TestImage t;
+  ASSERT_TRUE(t.SetDimensions(64, 48));
+  JxlBasicInfo& info = t.ppf().info;
+  info.have_animation = JXL_TRUE;
+  info.animation.tps_numerator = 1000;
+  info.animation.tps_denominator = 1;
+  const size_t kNumFrames = 5;
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    JXL_TEST_ASSIGN_OR_DIE(auto frame, t.AddFrame());
+    frame.RandomFill(/*seed=*/static_cast<uint16_t>(i));
+    t.ppf().frames.back().frame_info.duration = 10 * (i + 1);
+  }
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(extras::EncodeImageJXL({}, t.ppf(), /*jpeg_bytes=*/nullptr,
+                                     &compressed));
+
+  JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(t.ppf().frames[0].color.format);
+  PackedPixelFile expected;
+  ASSERT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                             nullptr, &expected));
+  ASSERT_EQ(kNumFrames, expected.frames.size());
+
+  for (size_t num_frame_decoders : {2, 3, 8}) {
+    dparams.num_frame_decoders = num_frame_decoders;
+    PackedPixelFile ppf_out;
+    size_t decoded_bytes = 0;
+    ASSERT_TRUE(DecodeImageJXL(compressed.data(), compressed.size(), dparams,
+                               &decoded_bytes, &ppf_out));
+    EXPECT_EQ(compressed.size(), decoded_bytes);
+    ASSERT_EQ(kNumFrames, ppf_out.frames.size());
+    for (size_t i = 0; i < kNumFrames; ++i) {
+      EXPECT_EQ(expected.frames[i].frame_info.duration,
+                ppf_out.frames[i].frame_info.duration);
+      EXPECT_TRUE(test::SamePixels(expected.frames[i].color,
+                                   ppf_out.frames[i].color));
+    }
+  }
+}
+
+TEST(JxlTest, RoundtripAnimationCropUnchangedRegions) {
+  TestImage t;
+  ASSERT_TRUE(t.SetDimensions(128, 96));
+  JxlBasicInfo& info = t.ppf().info;
+  info.have_animation = JXL_TRUE;
+  info.animation.tps_numerator = 1000;
+  info.animation.tps_denominator = 1;
+  // The same random frame, with a few pixels changed in the second one and
+  // none in the third one.
+  const size_t kNumFrames = 4;
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    JXL_TEST_ASSIGN_OR_DIE(auto frame, t.AddFrame());
+    frame.RandomFill();
+    t.ppf().frames.back().frame_info.duration = 10;
+    if (i == 1 || i == 2) {
+      ASSERT_TRUE(frame.SetValue(20, 30, 0, 1.0f));
+      ASSERT_TRUE(frame.SetValue(25, 40, 1, 0.0f));
+    }
+    if (i == 3) ASSERT_TRUE(frame.SetValue(90, 120, 2, 0.5f));
+  }
+
+  JXLCompressParams cparams = test::CompressParamsForLossless();
+  JXLDecompressParams dparams;
+  dparams.accepted_formats.push_back(t.ppf().frames[0].color.format);
+  PackedPixelFile ppf_full;
+  const size_t full_size =
+      Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_full);
+  cparams.crop_unchanged_regions = true;
+  PackedPixelFile ppf_out;
+  const size_t cropped_size =
+      Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_LT(cropped_size * 2, full_size);
+  ASSERT_EQ(kNumFrames, ppf_out.frames.size());
+  for (size_t i = 0; i < kNumFrames; ++i) {
+    EXPECT_TRUE(test::SamePixels(t.ppf().frames[i].color,
+                                 ppf_out.frames[i].color));
+  }
+}
+
 size_t RoundtripJpeg(const std::vector<uint8_t>& jpeg_in, ThreadPool* pool) {
   std::vector<uint8_t> compressed;
   EXPECT_TRUE(extras::EncodeImageJXL({}, extras::PackedPixelFile(), &jpeg_in,
@@ -1971,5 +2286,129 @@ JXL_GTEST_INSTANTIATE_TEST_SUITE_P(
     JxlStreamingTest, JxlStreamingEncodingTest,
     testing::ValuesIn(StreamingEncodingTestParam::All()));
 
+// Efforts 10 and above learn one tree for the frame, which streaming encoding
+// learns from a sample of the DC groups.
+JXL_SLOW_TEST(JxlTest, StreamingLosslessGlobalTree) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  jxl::test::TestImage image;
+  ASSERT_TRUE(image.DecodeFromBytes(orig));
+  ASSERT_TRUE(image.SetDimensions(2268, 256));
+
+  JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 10);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_BUFFERING, 3);
+  extras::JXLDecompressParams dparams;
+
+  ThreadPoolForTests pool(8);
+  PackedPixelFile ppf_out;
+  Roundtrip(image.ppf(), cparams, dparams, pool.get(), &ppf_out);
+  EXPECT_TRUE(jxl::test::SamePixels(image.ppf(), ppf_out));
+}
+
+// Streaming encoding estimates the noise from crops of a few DC groups, which
+// ends up close to estimating it from the whole frame.
+JXL_SLOW_TEST(JxlTest, StreamingNoise) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  jxl::test::TestImage image;
+  ASSERT_TRUE(image.DecodeFromBytes(orig));
+  ASSERT_TRUE(image.SetDimensions(2268, 1024));
+
+  JXLCompressParams cparams;
+  cparams.distance = 2.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 7);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_NOISE, 1);
+  extras::JXLDecompressParams dparams;
+
+  ThreadPoolForTests pool(8);
+  PackedPixelFile ppf_out;
+  const size_t size = Roundtrip(image.ppf(), cparams, dparams, pool.get(),
+                                &ppf_out);
+
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_BUFFERING, 3);
+  PackedPixelFile ppf_out_streaming;
+  const size_t size_streaming = Roundtrip(image.ppf(), cparams, dparams,
+                                          pool.get(), &ppf_out_streaming);
+  EXPECT_NEAR(size_streaming, size, size / 10);
+  EXPECT_NEAR(ButteraugliDistance(image.ppf(), ppf_out_streaming),
+              ButteraugliDistance(image.ppf(), ppf_out), 0.2);
+}
+
+JXL_SLOW_TEST(JxlTest, AdaptiveEffort) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+
+  JXLCompressParams cparams;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 8);
+  ThreadPoolForTests pool(8);
+  PackedPixelFile ppf_out;
+  const size_t size = Roundtrip(t.ppf(), cparams, {}, pool.get(), &ppf_out);
+
+  // The flat tiles are searched at effort 6 instead of 8.
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_ADAPTIVE_EFFORT, 1);
+  PackedPixelFile ppf_out_adaptive;
+  const size_t size_adaptive =
+      Roundtrip(t.ppf(), cparams, {}, pool.get(), &ppf_out_adaptive);
+  EXPECT_NEAR(size_adaptive, size, size / 20);
+  EXPECT_NEAR(ButteraugliDistance(t.ppf(), ppf_out_adaptive),
+              ButteraugliDistance(t.ppf(), ppf_out), 0.1);
+}
+
+TEST(JxlTest, RoundtripPrefixCodesDecodingSpeed4) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  ASSERT_TRUE(t.SetDimensions(512, 512));  // Crop, to save time.
+
+  ThreadPoolForTests pool(8);
+  for (int modular = 0; modular <= 1; modular++) {
+    JXLCompressParams cparams;
+    cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR, modular);
+    PackedPixelFile ppf_out;
+    const size_t size = Roundtrip(t.ppf(), cparams, {}, pool.get(), &ppf_out);
+
+    // Decoding speed 4 uses prefix codes instead of ANS, on top of the
+    // restrictions of the lower tiers.
+    cparams.AddOption(JXL_ENC_FRAME_SETTING_DECODING_SPEED, 4);
+    PackedPixelFile ppf_out_fast;
+    const size_t size_fast =
+        Roundtrip(t.ppf(), cparams, {}, pool.get(), &ppf_out_fast);
+    EXPECT_LE(size_fast, size * 3 / 2);
+    EXPECT_SLIGHTLY_BELOW(ButteraugliDistance(t.ppf(), ppf_out_fast),
+                          ButteraugliDistance(t.ppf(), ppf_out) + 0.5);
+  }
+}
+
+TEST(JxlTest, RoundtripDecodingSpeedTier5) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  ASSERT_TRUE(t.SetDimensions(512, 512));  // Crop, to save time.
+
+  ThreadPoolForTests pool(8);
+  JXLCompressParams cparams;
+  cparams.distance = 3.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 7);
+  // Tier 5 leaves out the loop filters even when they are asked for.
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EPF, 2);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_GABORISH, 1);
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_DECODING_SPEED, 5);
+  JxlEncoderStats* stats = JxlEncoderStatsCreate();
+  cparams.stats = stats;
+  PackedPixelFile ppf_out;
+  Roundtrip(t.ppf(), cparams, {}, pool.get(), &ppf_out);
+  for (JxlEncoderStatsKey key :
+       {JXL_ENC_STAT_NUM_SMALL_BLOCKS, JXL_ENC_STAT_NUM_DCT4X8_BLOCKS,
+        JXL_ENC_STAT_NUM_AFV_BLOCKS, JXL_ENC_STAT_NUM_DCT8X32_BLOCKS,
+        JXL_ENC_STAT_NUM_DCT16X32_BLOCKS, JXL_ENC_STAT_NUM_DCT32_BLOCKS,
+        JXL_ENC_STAT_NUM_DCT32X64_BLOCKS, JXL_ENC_STAT_NUM_DCT64_BLOCKS}) {
+    EXPECT_EQ(0u, JxlEncoderStatsGet(stats, key));
+  }
+  EXPECT_GT(JxlEncoderStatsGet(stats, JXL_ENC_STAT_NUM_DCT16_BLOCKS), 0u);
+  JxlEncoderStatsDestroy(stats);
+  EXPECT_SLIGHTLY_BELOW(ButteraugliDistance(t.ppf(), ppf_out), 6.0);
+}
+
 }  // namespace
 }  // namespace jxl
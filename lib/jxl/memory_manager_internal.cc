@@ -13,12 +13,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>     // memcpy
+#include <limits>
+#include <mutex>
 #include <hwy/base.h>  // kMaxVectorSize
 
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/simd_util.h"
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
 namespace jxl {
 
 namespace {
@@ -57,6 +64,235 @@ Status MemoryManagerInit(JxlMemoryManager* self,
   return true;
 }
 
+void MemoryBudget::Init(const JxlMemoryManager& inner,
+                        JxlMemoryManager* wrapper) {
+  inner_ = inner;
+  wrapper->opaque = this;
+  wrapper->alloc = &MemoryBudget::Alloc;
+  wrapper->free = &MemoryBudget::Free;
+}
+
+void* MemoryBudget::Alloc(void* opaque, size_t size) {
+  MemoryBudget* self = static_cast<MemoryBudget*>(opaque);
+  if (size > std::numeric_limits<size_t>::max() - kHeaderSize) return nullptr;
+  const size_t total = size + kHeaderSize;
+  const uint64_t limit = self->limit_.load(std::memory_order_relaxed);
+  const uint64_t used =
+      self->used_.fetch_add(total, std::memory_order_relaxed) + total;
+  if (limit != 0 && used > limit) {
+    self->used_.fetch_sub(total, std::memory_order_relaxed);
+    self->exceeded_.store(true, std::memory_order_relaxed);
+    return nullptr;
+  }
+  uint8_t* allocation =
+      static_cast<uint8_t*>(self->inner_.alloc(self->inner_.opaque, total));
+  if (allocation == nullptr) {
+    self->used_.fetch_sub(total, std::memory_order_relaxed);
+    return nullptr;
+  }
+  memcpy(allocation, &total, sizeof(total));
+  self->allocated_.fetch_add(total, std::memory_order_relaxed);
+  self->RaisePeak(used);
+  return allocation + kHeaderSize;
+}
+
+void MemoryBudget::Free(void* opaque, void* address) {
+  if (address == nullptr) return;
+  MemoryBudget* self = static_cast<MemoryBudget*>(opaque);
+  uint8_t* allocation = static_cast<uint8_t*>(address) - kHeaderSize;
+  size_t total;
+  memcpy(&total, allocation, sizeof(total));
+  self->used_.fetch_sub(total, std::memory_order_relaxed);
+  self->inner_.free(self->inner_.opaque, allocation);
+}
+
+// A slab starts with this header, followed by its allocations, each of them
+// preceded by the address of the slab. Allocations made directly are preceded
+// by nullptr and the address given by the inner memory manager.
+struct MemoryArena::Slab {
+  // Shard that allocates from the slab while it is in use.
+  Shard* shard;
+  // Both guarded by the mutex of the shard.
+  size_t used;
+  size_t live;
+};
+
+const size_t MemoryArena::kSlabHeaderSize =
+    RoundUpTo(sizeof(Slab), alignof(std::max_align_t));
+
+MemoryArena::~MemoryArena() {
+  for (Shard& shard : shards_) {
+    if (shard.current == nullptr) continue;
+    JXL_DASSERT(shard.current->live == 0);
+    ReturnSlab(shard.current);
+    shard.current = nullptr;
+  }
+  JXL_DASSERT(slabs_in_use_ == 0);
+  for (Slab* slab : free_slabs_) inner_.free(inner_.opaque, slab);
+}
+
+void MemoryArena::Init(const JxlMemoryManager& inner,
+                       JxlMemoryManager* wrapper) {
+  inner_ = inner;
+  wrapper->opaque = this;
+  wrapper->alloc = &MemoryArena::Alloc;
+  wrapper->free = &MemoryArena::Free;
+}
+
+namespace {
+
+constexpr size_t kPageSize = 4096;
+constexpr size_t kHugePageSize = size_t{2} << 20;
+
+uint8_t* RoundUpAddress(uint8_t* address, size_t align) {
+  return reinterpret_cast<uint8_t*>(
+      RoundUpTo(reinterpret_cast<uintptr_t>(address), align));
+}
+
+void PrepareLargeAllocation(const LargeAllocationPolicy& policy,
+                            uint8_t* address, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (policy.huge_pages) {
+    uint8_t* begin = RoundUpAddress(address, kPageSize);
+    uint8_t* end = reinterpret_cast<uint8_t*>(
+        reinterpret_cast<uintptr_t>(address + size) & ~(kPageSize - 1));
+    // Only advice: the allocation works either way.
+    if (end > begin) madvise(begin, end - begin, MADV_HUGEPAGE);
+  }
+#endif
+  if (!policy.prefault) return;
+  constexpr size_t kChunkSize = size_t{4} << 20;
+  const auto touch = [&](const uint32_t chunk, size_t /*thread*/) -> Status {
+    volatile uint8_t* row = address;
+    const size_t end = std::min(size, (chunk + 1) * kChunkSize);
+    for (size_t i = chunk * kChunkSize; i < end; i += kPageSize) row[i] = 0;
+    return true;
+  };
+  // Nothing is lost if this fails: the pages are faulted in when written.
+  (void)RunOnPool(policy.pool, 0,
+                  static_cast<uint32_t>(DivCeil(size, kChunkSize)),
+                  ThreadPool::NoInit, touch, "PrefaultAllocation");
+}
+
+}  // namespace
+
+void* MemoryArena::AllocDirect(size_t size) {
+  const LargeAllocationPolicy& policy = large_allocation_policy_;
+  const bool large =
+      size >= policy.min_size && (policy.huge_pages || policy.prefault);
+  const size_t extra = large && policy.huge_pages ? kHugePageSize - 1 : 0;
+  if (size > std::numeric_limits<size_t>::max() - kHeaderSize - extra) {
+    return nullptr;
+  }
+  uint8_t* allocation = static_cast<uint8_t*>(
+      inner_.alloc(inner_.opaque, size + kHeaderSize + extra));
+  if (allocation == nullptr) return nullptr;
+  uint8_t* address = allocation + kHeaderSize;
+  if (extra != 0) address = RoundUpAddress(address, kHugePageSize);
+  const Slab* no_slab = nullptr;
+  memcpy(address - kHeaderSize, &no_slab, sizeof(no_slab));
+  memcpy(address - kHeaderSize + sizeof(no_slab), &allocation,
+         sizeof(allocation));
+  if (large) PrepareLargeAllocation(policy, address, size);
+  return address;
+}
+
+MemoryArena::Slab* MemoryArena::TakeSlab() {
+  Slab* slab = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_slabs_.empty()) {
+      slab = free_slabs_.back();
+      free_slabs_.pop_back();
+    }
+  }
+  if (slab == nullptr) {
+    slab = static_cast<Slab*>(inner_.alloc(inner_.opaque, kSlabSize));
+    if (slab == nullptr) return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  slabs_in_use_++;
+  peak_slabs_in_use_ = std::max(peak_slabs_in_use_, slabs_in_use_);
+  return slab;
+}
+
+void MemoryArena::ReturnSlab(Slab* slab) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_slabs_.push_back(slab);
+  slabs_in_use_--;
+}
+
+void* MemoryArena::Alloc(void* opaque, size_t size) {
+  MemoryArena* self = static_cast<MemoryArena*>(opaque);
+  if (size > kMaxSlabAllocation) return self->AllocDirect(size);
+  const size_t total = RoundUpTo(size + kHeaderSize, kHeaderSize);
+  // Each thread sticks to one shard, so that threads seldom wait for each
+  // other.
+  static std::atomic<uint32_t> next_shard{0};
+  thread_local const size_t shard_index =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kNumShards;
+  Shard& shard = self->shards_[shard_index];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Slab* slab = shard.current;
+  if (slab == nullptr || slab->used + total > kSlabSize) {
+    Slab* fresh = self->TakeSlab();
+    if (fresh == nullptr) return self->AllocDirect(size);
+    // A full slab goes back once its last allocation is freed.
+    if (slab != nullptr && slab->live == 0) self->ReturnSlab(slab);
+    fresh->shard = &shard;
+    fresh->used = kSlabHeaderSize;
+    fresh->live = 0;
+    shard.current = slab = fresh;
+  }
+  uint8_t* allocation = reinterpret_cast<uint8_t*>(slab) + slab->used;
+  slab->used += total;
+  slab->live++;
+  memcpy(allocation, &slab, sizeof(slab));
+  return allocation + kHeaderSize;
+}
+
+void MemoryArena::Free(void* opaque, void* address) {
+  if (address == nullptr) return;
+  MemoryArena* self = static_cast<MemoryArena*>(opaque);
+  uint8_t* allocation = static_cast<uint8_t*>(address) - kHeaderSize;
+  Slab* slab;
+  memcpy(&slab, allocation, sizeof(slab));
+  if (slab == nullptr) {
+    memcpy(&allocation, allocation + sizeof(slab), sizeof(allocation));
+    self->inner_.free(self->inner_.opaque, allocation);
+    return;
+  }
+  // The shard of a slab does not change while it has live allocations.
+  Shard& shard = *slab->shard;
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (--slab->live != 0) return;
+  if (slab == shard.current) {
+    slab->used = kSlabHeaderSize;
+  } else {
+    self->ReturnSlab(slab);
+  }
+}
+
+void MemoryArena::Trim(bool keep_peak) {
+  for (Shard& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.current == nullptr || shard.current->live != 0) continue;
+    ReturnSlab(shard.current);
+    shard.current = nullptr;
+  }
+  std::vector<Slab*> released;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const size_t keep = keep_peak ? peak_slabs_in_use_ - slabs_in_use_ : 0;
+    while (free_slabs_.size() > keep) {
+      released.push_back(free_slabs_.back());
+      free_slabs_.pop_back();
+    }
+    peak_slabs_in_use_ = slabs_in_use_;
+  }
+  for (Slab* slab : released) inner_.free(inner_.opaque, slab);
+}
+
 size_t BytesPerRow(const size_t xsize, const size_t sizeof_t) {
   // Special case: we don't allow any ops -> don't need extra padding/
   if (xsize == 0) {
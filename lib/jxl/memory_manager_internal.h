@@ -10,15 +10,22 @@
 
 #include <jxl/memory_manager.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <utility>
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/status.h"
 
 namespace jxl {
 
+class ThreadPool;
+
 namespace memory_manager_internal {
 
 // To avoid RFOs, match L2 fill size (pairs of lines); 2 x cache line size.
@@ -85,6 +92,145 @@ JXL_INLINE MemoryManagerUniquePtr<T> MemoryManagerMakeUnique(
                                    MemoryManagerDeleteHelper(memory_manager));
 }
 
+// Memory manager that forwards to another one, but fails the allocations that
+// would bring the total size of the live allocations made through it above a
+// limit. Alloc and Free may be called from any thread.
+class MemoryBudget {
+ public:
+  // Makes "*wrapper" allocate through this budget from "inner". Every
+  // allocation made through "*wrapper" must also be freed through it.
+  void Init(const JxlMemoryManager& inner, JxlMemoryManager* wrapper);
+
+  const JxlMemoryManager& inner() const { return inner_; }
+
+  // A limit of 0 means no limit. Live allocations are not affected.
+  void SetLimit(uint64_t limit) {
+    limit_.store(limit, std::memory_order_relaxed);
+  }
+  bool limited() const { return limit_.load(std::memory_order_relaxed) != 0; }
+
+  // Whether an allocation failed because of the limit since the last
+  // ClearExceeded.
+  bool exceeded() const { return exceeded_.load(std::memory_order_relaxed); }
+  void ClearExceeded() { exceeded_.store(false, std::memory_order_relaxed); }
+
+  // Bytes of all the allocations made so far, including freed ones.
+  uint64_t allocated() const {
+    return allocated_.load(std::memory_order_relaxed);
+  }
+  // Highest number of bytes of live allocations since the last ResetPeak.
+  uint64_t peak() const { return peak_.load(std::memory_order_relaxed); }
+  // Returns the peak before the reset.
+  uint64_t ResetPeak() {
+    return peak_.exchange(used_.load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+  }
+  void RaisePeak(uint64_t bytes) {
+    uint64_t peak = peak_.load(std::memory_order_relaxed);
+    while (bytes > peak && !peak_.compare_exchange_weak(
+                               peak, bytes, std::memory_order_relaxed)) {
+    }
+  }
+
+ private:
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+
+  // Room for the size of an allocation in front of it, keeping the alignment
+  // guaranteed by the inner memory manager.
+  static constexpr size_t kHeaderSize = alignof(std::max_align_t);
+
+  JxlMemoryManager inner_ = {};
+  std::atomic<uint64_t> limit_{0};
+  std::atomic<uint64_t> used_{0};
+  std::atomic<uint64_t> allocated_{0};
+  std::atomic<uint64_t> peak_{0};
+  std::atomic<bool> exceeded_{false};
+};
+
+// How a MemoryArena makes the allocations that do not fit in its slabs, which
+// are mostly the planes of large images.
+struct LargeAllocationPolicy {
+  // Allocations of at least this many bytes follow the policy.
+  size_t min_size = size_t{16} << 20;
+  // Aligns the allocations to huge pages and asks the OS to back them with
+  // transparent huge pages, which saves TLB misses in column-wise passes.
+  bool huge_pages = false;
+  // Touches every page of the allocations when they are made, in parallel on
+  // `pool` unless the allocation is made by a task of that pool, rather than
+  // one page fault at a time in the first pass that writes them.
+  bool prefault = false;
+  ThreadPool* pool = nullptr;
+};
+
+// Memory manager that serves the allocations made through it from large slabs
+// of another one, so that the many images and buffers of a frame do not each
+// go to the memory manager of the user and fault in fresh pages. Each thread
+// bump-allocates from the current slab of one of a few shards, and a slab is
+// reused once all of its allocations are freed. Allocations larger than
+// kMaxSlabAllocation, or made when no slab can be allocated, go to the other
+// memory manager directly. Alloc and Free may be called from any thread, and
+// allocations may outlive a frame, but not the arena.
+class MemoryArena {
+ public:
+  static constexpr size_t kSlabSize = size_t{4} << 20;
+  static constexpr size_t kMaxSlabAllocation = kSlabSize / 8;
+
+  MemoryArena() = default;
+  MemoryArena(const MemoryArena&) = delete;
+  MemoryArena& operator=(const MemoryArena&) = delete;
+  ~MemoryArena();
+
+  // Makes "*wrapper" allocate through this arena from "inner". Every
+  // allocation made through "*wrapper" must also be freed through it.
+  void Init(const JxlMemoryManager& inner, JxlMemoryManager* wrapper);
+
+  // To be called at the end of a frame: returns to the inner memory manager
+  // the free slabs that the frame did not need, keeping enough of them for a
+  // next frame of the same size.
+  void Reset() { Trim(/*keep_peak=*/true); }
+  // Returns all the free slabs to the inner memory manager.
+  void ReleaseFreeSlabs() { Trim(/*keep_peak=*/false); }
+
+  // Must not be called while allocations are made through the arena.
+  void SetLargeAllocationPolicy(const LargeAllocationPolicy& policy) {
+    large_allocation_policy_ = policy;
+  }
+
+ private:
+  struct Slab;
+  struct Shard {
+    std::mutex mutex;
+    Slab* current = nullptr;
+  };
+
+  static void* Alloc(void* opaque, size_t size);
+  static void Free(void* opaque, void* address);
+  void* AllocDirect(size_t size);
+  Slab* TakeSlab();
+  void ReturnSlab(Slab* slab);
+  void Trim(bool keep_peak);
+
+  static constexpr size_t kNumShards = 4;
+  // Room for the slab of an allocation in front of it, or for the address
+  // given by the inner memory manager if it has no slab, keeping the alignment
+  // guaranteed by the inner memory manager.
+  static constexpr size_t kHeaderSize =
+      std::max(alignof(std::max_align_t), 2 * sizeof(void*));
+  static const size_t kSlabHeaderSize;
+
+  JxlMemoryManager inner_ = {};
+  LargeAllocationPolicy large_allocation_policy_;
+  Shard shards_[kNumShards];
+  // Guards the fields below. Taken after the mutex of a shard, if any.
+  std::mutex mutex_;
+  std::vector<Slab*> free_slabs_;
+  // Slabs that are current or have live allocations, and their highest
+  // number since the last Reset.
+  size_t slabs_in_use_ = 0;
+  size_t peak_slabs_in_use_ = 0;
+};
+
 // Returns recommended distance in bytes between the start of two consecutive
 // rows.
 size_t BytesPerRow(size_t xsize, size_t sizeof_t);
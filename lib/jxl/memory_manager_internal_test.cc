@@ -0,0 +1,155 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/memory_manager_internal.h"
+
+#include <jxl/memory_manager.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "lib/jxl/test_memory_manager.h"
+#include "lib/jxl/testing.h"
+
+namespace jxl {
+namespace {
+
+// The arena allocates from a budget, which counts the bytes of its slabs.
+struct ArenaForTest {
+  ArenaForTest() {
+    budget.Init(*test::MemoryManager(), &budget_manager);
+    arena.Init(budget_manager, &manager);
+  }
+  void* Alloc(size_t size) { return manager.alloc(manager.opaque, size); }
+  void Free(void* address) { manager.free(manager.opaque, address); }
+
+  MemoryBudget budget;
+  JxlMemoryManager budget_manager;
+  MemoryArena arena;
+  JxlMemoryManager manager;
+};
+
+TEST(MemoryArenaTest, SmallAllocationsShareSlabs) {
+  ArenaForTest t;
+  std::vector<void*> allocations;
+  for (size_t i = 0; i < 100; i++) {
+    void* allocation = t.Alloc(1000 + i);
+    ASSERT_NE(allocation, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(allocation) %
+                  alignof(std::max_align_t),
+              0u);
+    memset(allocation, static_cast<int>(i), 1000 + i);
+    allocations.push_back(allocation);
+  }
+  EXPECT_LT(t.budget.allocated(), 2 * MemoryArena::kSlabSize);
+  for (size_t i = 0; i < allocations.size(); i++) {
+    EXPECT_EQ(static_cast<uint8_t*>(allocations[i])[999],
+              static_cast<uint8_t>(i));
+    t.Free(allocations[i]);
+  }
+  // The emptied slab is reused from its start.
+  const uint64_t allocated = t.budget.allocated();
+  void* again = t.Alloc(1000);
+  EXPECT_EQ(again, allocations[0]);
+  EXPECT_EQ(t.budget.allocated(), allocated);
+  t.Free(again);
+}
+
+TEST(MemoryArenaTest, LargeAllocationsAreDirect) {
+  ArenaForTest t;
+  const size_t size = MemoryArena::kMaxSlabAllocation + 1;
+  void* allocation = t.Alloc(size);
+  ASSERT_NE(allocation, nullptr);
+  EXPECT_LT(t.budget.allocated(), MemoryArena::kSlabSize);
+  t.Free(allocation);
+}
+
+TEST(MemoryArenaTest, LargeAllocationPolicy) {
+  ArenaForTest t;
+  LargeAllocationPolicy policy;
+  policy.min_size = MemoryArena::kMaxSlabAllocation + 1;
+  policy.huge_pages = true;
+  policy.prefault = true;
+  t.arena.SetLargeAllocationPolicy(policy);
+  for (size_t i = 0; i < 3; i++) {
+    const size_t size = (size_t{9} << 20) + i * 4099;
+    uint8_t* allocation = static_cast<uint8_t*>(t.Alloc(size));
+    ASSERT_NE(allocation, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(allocation) % (size_t{2} << 20), 0u);
+    EXPECT_EQ(allocation[0], 0);
+    EXPECT_EQ(allocation[size - 1 - (size - 1) % 4096], 0);
+    memset(allocation, 1, size);
+    t.Free(allocation);
+  }
+}
+
+TEST(MemoryArenaTest, FallsBackWhenNoSlabFits) {
+  ArenaForTest t;
+  t.budget.SetLimit(MemoryArena::kSlabSize / 2);
+  void* allocation = t.Alloc(1000);
+  ASSERT_NE(allocation, nullptr);
+  t.Free(allocation);
+}
+
+TEST(MemoryArenaTest, ResetKeepsWhatTheFrameNeeded) {
+  ArenaForTest t;
+  const size_t size = MemoryArena::kMaxSlabAllocation;
+  std::vector<void*> allocations;
+  for (size_t i = 0; i < 32; i++) allocations.push_back(t.Alloc(size));
+  for (void* allocation : allocations) t.Free(allocation);
+  t.arena.Reset();
+  const uint64_t used = t.budget.ResetPeak();
+  EXPECT_GE(used, 4 * MemoryArena::kSlabSize);
+
+  // A frame of the same size allocates no new slab.
+  const uint64_t allocated = t.budget.allocated();
+  for (void*& allocation : allocations) allocation = t.Alloc(size);
+  for (void* allocation : allocations) t.Free(allocation);
+  EXPECT_EQ(t.budget.allocated(), allocated);
+
+  // A smaller frame after it releases the slabs that it did not need.
+  t.arena.Reset();
+  t.Free(t.Alloc(size));
+  t.arena.Reset();
+  t.budget.ResetPeak();
+  EXPECT_LT(t.budget.peak(), 2 * MemoryArena::kSlabSize);
+
+  t.arena.ReleaseFreeSlabs();
+  t.budget.ResetPeak();
+  EXPECT_EQ(t.budget.peak(), 0u);
+}
+
+TEST(MemoryArenaTest, ManyThreads) {
+  ArenaForTest t;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 8; i++) {
+    threads.emplace_back([&t, i] {
+      std::vector<uint8_t*> allocations;
+      for (size_t j = 0; j < 2000; j++) {
+        const size_t size = 1 + (i * 7919 + j * 104729) % 100000;
+        uint8_t* allocation = static_cast<uint8_t*>(t.Alloc(size));
+        ASSERT_NE(allocation, nullptr);
+        allocation[0] = allocation[size - 1] = static_cast<uint8_t>(i);
+        allocations.push_back(allocation);
+        if (j % 3 == 2) {
+          EXPECT_EQ(allocations[0][0], static_cast<uint8_t>(i));
+          t.Free(allocations[0]);
+          allocations.erase(allocations.begin());
+        }
+      }
+      for (uint8_t* allocation : allocations) t.Free(allocation);
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  t.arena.ReleaseFreeSlabs();
+  t.budget.ResetPeak();
+  EXPECT_EQ(t.budget.peak(), 0u);
+}
+
+}  // namespace
+}  // namespace jxl
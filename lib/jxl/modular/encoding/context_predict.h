@@ -66,10 +66,22 @@ struct Header : public Fields {
   uint32_t w[kNumPredictors] = {};
 };
 
+// Predict and UpdateErrors must be called for every pixel of a channel, in
+// scan order.
 struct State {
+  // Errors of all the sub-predictors at one position, kept together so that
+  // the per-predictor loops below operate on one vector.
+  struct alignas(16) PredErrors {
+    uint32_t e[kNumPredictors];
+  };
+
   pixel_type_w prediction[kNumPredictors] = {};
   pixel_type_w pred = 0;  // *before* removing the added bits.
-  std::vector<uint32_t> pred_errors[kNumPredictors];
+  // Errors of the previous and of the current row.
+  std::vector<PredErrors> pred_errors;
+  // Errors of the last two pixels of the current row.
+  PredErrors errors_W = {};
+  PredErrors errors_WW = {};
   std::vector<int32_t> error;
   const Header &header;
 
@@ -93,9 +105,7 @@ struct State {
   State(const Header &header, size_t xsize, size_t ysize) : header(header) {
     // Extra margin to avoid out-of-bounds writes.
     // All have space for two rows of data.
-    for (auto &pred_error : pred_errors) {
-      pred_error.resize((xsize + 2) * 2);
-    }
+    pred_errors.resize((xsize + 2) * 2);
     error.resize((xsize + 2) * 2);
   }
 
@@ -141,12 +151,28 @@ struct State {
     size_t pos_N = prev_row + x;
     size_t pos_NE = x < xsize - 1 ? pos_N + 1 : pos_N;
     size_t pos_NW = x > 0 ? pos_N - 1 : pos_N;
+    const uint32_t *JXL_RESTRICT errors_N = pred_errors[pos_N].e;
+    const uint32_t *JXL_RESTRICT errors_NE = pred_errors[pos_NE].e;
+    const uint32_t *JXL_RESTRICT errors_NW = pred_errors[pos_NW].e;
     std::array<uint32_t, kNumPredictors> weights;
     for (size_t i = 0; i < kNumPredictors; i++) {
-      // pred_errors[pos_N] also contains the error of pixel W.
-      // pred_errors[pos_NW] also contains the error of pixel WW.
-      weights[i] = pred_errors[i][pos_N] + pred_errors[i][pos_NE] +
-                   pred_errors[i][pos_NW];
+      weights[i] = errors_N[i] + errors_NE[i] + errors_NW[i];
+    }
+    // The error of pixel W counts for N (and for NE on the last column) and
+    // the error of pixel WW for NW. They are added from registers rather than
+    // to the previous row, so that the next pixel does not wait for a store.
+    if (x > 0) {
+      const uint32_t num_W = pos_NE == pos_N ? 2 : 1;
+      for (size_t i = 0; i < kNumPredictors; i++) {
+        weights[i] += num_W * errors_W.e[i];
+      }
+      if (x > 1) {
+        for (size_t i = 0; i < kNumPredictors; i++) {
+          weights[i] += errors_WW.e[i];
+        }
+      }
+    }
+    for (size_t i = 0; i < kNumPredictors; i++) {
       weights[i] = ErrorWeight(weights[i], header.w[i]);
     }
 
@@ -195,18 +221,15 @@ struct State {
   JXL_INLINE void UpdateErrors(pixel_type_w val, size_t x, size_t y,
                                size_t xsize) {
     size_t cur_row = y & 1 ? 0 : (xsize + 2);
-    size_t prev_row = y & 1 ? (xsize + 2) : 0;
     val = AddBits(val);
     error[cur_row + x] = pred - val;
+    errors_WW = errors_W;
     for (size_t i = 0; i < kNumPredictors; i++) {
-      pixel_type_w err =
+      errors_W.e[i] =
           (std::abs(prediction[i] - val) + kPredictionRound) >> kPredExtraBits;
-      // For predicting in the next row.
-      pred_errors[i][cur_row + x] = err;
-      // Add the error on this pixel to the error on the NE pixel. This has the
-      // effect of adding the error on this pixel to the E and EE pixels.
-      pred_errors[i][prev_row + x + 1] += err;
     }
+    // For predicting in the next row.
+    pred_errors[cur_row + x] = errors_W;
   }
 };
 
@@ -351,6 +374,125 @@ static constexpr size_t kNumNonrefProperties =
 constexpr size_t kWPProp = kNumNonrefProperties - weighted::kNumProperties;
 constexpr size_t kGradientProp = 9;
 
+// Complete binary tree of fixed depth, built from a FlatTree without reference
+// properties by padding shallow leaves with dummy decisions on a static
+// property. A lookup always takes "depth" steps without data-dependent
+// branches, which avoids the mispredictions of MATreeLookup on noisy images.
+class CompiledMATree {
+ public:
+  static constexpr size_t kMaxDepth = 10;
+
+  // Returns false if the tree is deeper than "max_depth" decisions or uses
+  // reference properties.
+  bool Compile(const FlatTree &tree, size_t max_depth) {
+    constexpr int32_t gradient_prop = kGradientProp;
+    constexpr int32_t wp_prop = kWPProp;
+    uses_ffv1_ = false;
+    uses_wp_ = false;
+    // Depth of the subtree of every node; children come after their parents.
+    std::vector<uint32_t> depth(tree.size());
+    for (size_t i = tree.size(); i-- > 0;) {
+      const FlatDecisionNode &node = tree[i];
+      if (node.property0 < 0) {
+        uses_wp_ |= node.predictor == Predictor::Weighted;
+        depth[i] = 0;
+        continue;
+      }
+      uint32_t d = 0;
+      for (size_t c = 0; c < 2; c++) {
+        const size_t child = node.childID + 2 * c;
+        // Property 0 marks a placeholder decision in front of a leaf.
+        d = std::max(d, node.properties[c] == 0
+                            ? depth[child]
+                            : 1 + std::max(depth[child], depth[child + 1]));
+      }
+      depth[i] = d + 1;
+      if (depth[i] > max_depth) return false;
+      for (int32_t property :
+           {node.property0, static_cast<int32_t>(node.properties[0]),
+            static_cast<int32_t>(node.properties[1])}) {
+        if (property > wp_prop) return false;
+        uses_ffv1_ |= property > gradient_prop && property < wp_prop;
+        uses_wp_ |= property == wp_prop;
+      }
+    }
+    depth_ = tree.empty() ? 0 : depth[0];
+    nodes_.assign((size_t{1} << depth_) - 1, Node{0, 0});
+    leaves_.resize(size_t{1} << depth_);
+
+    // Node "pos" at level "level" of the complete tree has children 2*pos+1
+    // (property > splitval) and 2*pos+2; "child" is -1 for the top node of the
+    // flat node, or the index of one of its two children.
+    struct Item {
+      uint32_t flat;
+      int32_t child;
+      size_t pos;
+      size_t level;
+    };
+    std::vector<Item> stack = {{0, -1, 0, 0}};
+    while (!stack.empty()) {
+      const Item item = stack.back();
+      stack.pop_back();
+      const FlatDecisionNode &node = tree[item.flat];
+      if (item.child < 0 && node.property0 < 0) {
+        const size_t num = size_t{1} << (depth_ - item.level);
+        const size_t first = (item.pos + 1) * num - 1 - nodes_.size();
+        std::fill_n(leaves_.begin() + first, num,
+                    MATreeLookup::LookupResult{node.childID, node.predictor,
+                                               node.predictor_offset,
+                                               node.multiplier});
+      } else if (item.child < 0) {
+        nodes_[item.pos] = {node.property0, node.splitval0};
+        for (int32_t c = 0; c < 2; c++) {
+          const size_t pos = 2 * item.pos + 1 + static_cast<size_t>(c);
+          stack.push_back({item.flat, c, pos, item.level + 1});
+        }
+      } else {
+        const uint32_t child =
+            node.childID + 2 * static_cast<uint32_t>(item.child);
+        if (node.properties[item.child] == 0) {
+          stack.push_back({child, -1, item.pos, item.level});
+          continue;
+        }
+        nodes_[item.pos] = {node.properties[item.child],
+                            node.splitvals[item.child]};
+        for (uint32_t c = 0; c < 2; c++) {
+          const size_t pos = 2 * item.pos + 1 + c;
+          stack.push_back({child + c, -1, pos, item.level + 1});
+        }
+      }
+    }
+    return true;
+  }
+
+  // Whether the tree uses the FFV1 properties (after the local gradient).
+  bool uses_ffv1() const { return uses_ffv1_; }
+  // Whether the tree uses the weighted predictor or its property.
+  bool uses_wp() const { return uses_wp_; }
+
+  JXL_INLINE MATreeLookup::LookupResult Lookup(
+      const Properties &properties) const {
+    size_t pos = 0;
+    for (size_t i = 0; i < depth_; i++) {
+      const Node &node = nodes_[pos];
+      pos = 2 * pos + 1 +
+            static_cast<size_t>(properties[node.property] <= node.splitval);
+    }
+    return leaves_[pos - nodes_.size()];
+  }
+
+ private:
+  struct Node {
+    int32_t property;
+    PropertyVal splitval;
+  };
+  size_t depth_ = 0;
+  bool uses_ffv1_ = false;
+  bool uses_wp_ = false;
+  std::vector<Node> nodes_;
+  std::vector<MATreeLookup::LookupResult> leaves_;
+};
+
 // Clamps gradient to the min/max of n, w (and l, implicitly).
 static JXL_INLINE int32_t ClampedGradient(const int32_t n, const int32_t w,
                                           const int32_t l) {
@@ -436,7 +578,8 @@ enum PredictorMode {
   kUseWP = 2,
   kForceComputeProperties = 4,
   kAllPredictions = 8,
-  kNoEdgeCases = 16
+  kNoEdgeCases = 16,
+  kFFV1Properties = 32
 };
 
 JXL_INLINE pixel_type_w PredictOne(Predictor p, pixel_type_w left,
@@ -558,6 +701,55 @@ JXL_INLINE PredictionResult Predict(
 
   return result;
 }
+
+// Like Predict<kUseTree | (mode & (kUseWP | kNoEdgeCases))>, but only computes
+// the FFV1 properties with kFFV1Properties, and does not support references.
+template <int mode>
+JXL_INLINE PredictionResult PredictCompiled(Properties *p, size_t w,
+                                            const pixel_type *JXL_RESTRICT pp,
+                                            const intptr_t onerow,
+                                            const size_t x, const size_t y,
+                                            const CompiledMATree &tree,
+                                            weighted::State *wp_state) {
+  constexpr bool nec = mode & kNoEdgeCases;
+  pixel_type_w left = (nec || x ? pp[-1] : (y ? pp[-onerow] : 0));
+  pixel_type_w top = (nec || y ? pp[-onerow] : left);
+  pixel_type_w topleft = (nec || (x && y) ? pp[-1 - onerow] : left);
+  pixel_type_w topright = (nec || (x + 1 < w && y) ? pp[1 - onerow] : top);
+  pixel_type_w leftleft = (nec || x > 1 ? pp[-2] : left);
+  pixel_type_w toptop = (nec || y > 1 ? pp[-onerow - onerow] : top);
+  pixel_type_w toprightright =
+      (nec || (x + 2 < w && y) ? pp[2 - onerow] : topright);
+
+  (*p)[3] = x;
+  (*p)[4] = top > 0 ? top : -top;
+  (*p)[5] = left > 0 ? left : -left;
+  (*p)[6] = top;
+  (*p)[7] = left;
+  (*p)[8] = left - (*p)[kGradientProp];
+  (*p)[kGradientProp] = left + top - topleft;
+  if (mode & kFFV1Properties) {
+    (*p)[10] = left - topleft;
+    (*p)[11] = topleft - top;
+    (*p)[12] = top - topright;
+    (*p)[13] = top - toptop;
+    (*p)[14] = left - leftleft;
+  }
+  pixel_type_w wp_pred = 0;
+  if (mode & kUseWP) {
+    wp_pred = wp_state->Predict</*compute_properties=*/true>(
+        x, y, w, top, left, topright, topleft, toptop, p, kWPProp);
+  }
+  MATreeLookup::LookupResult lr = tree.Lookup(*p);
+  PredictionResult result;
+  result.context = lr.context;
+  result.guess = lr.offset + PredictOne(lr.predictor, left, top, toptop,
+                                        topleft, topright, leftleft,
+                                        toprightright, wp_pred);
+  result.predictor = lr.predictor;
+  result.multiplier = lr.multiplier;
+  return result;
+}
 }  // namespace detail
 
 inline PredictionResult PredictNoTreeNoWP(size_t w,
@@ -0,0 +1,53 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/random.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
+#include "lib/jxl/modular/options.h"
+
+namespace jxl {
+namespace {
+
+// Predicts and updates the weighted predictor for every pixel of a noisy
+// 8-bit channel, as the decoder does for residuals that are all zero. Items
+// are pixels.
+void BM_WeightedPredictor(benchmark::State& state) {
+  const size_t xsize = state.range(0);
+  const size_t ysize = 256;
+  // One extra row on top and padding on the left, so that the neighbours of
+  // border pixels can be read like in a Channel.
+  const size_t stride = xsize + 8;
+  std::vector<pixel_type> pixels(stride * (ysize + 2));
+  Rng rng(0);
+  for (pixel_type& p : pixels) p = rng.UniformI(0, 256);
+  const weighted::Header header;
+
+  for (auto _ : state) {
+    (void)_;
+    weighted::State wp_state(header, xsize, ysize);
+    pixel_type_w sum = 0;
+    for (size_t y = 0; y < ysize; y++) {
+      const pixel_type* row = pixels.data() + (y + 2) * stride + 4;
+      for (size_t x = 0; x < xsize; x++) {
+        PredictionResult res = PredictNoTreeWP(
+            xsize, row + x, stride, x, y, Predictor::Weighted, &wp_state);
+        wp_state.UpdateErrors(row[x], x, y, xsize);
+        sum += res.guess;
+      }
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(xsize * ysize * state.iterations());
+}
+
+BENCHMARK(BM_WeightedPredictor)->Arg(64)->Arg(1024);
+
+}  // namespace
+}  // namespace jxl
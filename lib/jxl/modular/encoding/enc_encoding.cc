@@ -18,6 +18,7 @@
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_ans.h"
@@ -30,6 +31,7 @@
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
+#include "lib/jxl/modular/encoding/enc_encoding.h"
 #include "lib/jxl/modular/encoding/enc_ma.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/encoding/ma_common.h"
@@ -299,8 +301,8 @@ Tree PredefinedTree(ModularOptions::TreeKind tree_kind, size_t total_pixels,
 StatusOr<Tree> LearnTree(
     TreeSamples &&tree_samples, size_t total_pixels,
     const ModularOptions &options,
-    const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-    StaticPropRange static_prop_range = {}) {
+    const std::vector<ModularMultiplierInfo> &multiplier_info,
+    StaticPropRange static_prop_range, ThreadPool *pool) {
   Tree tree;
   for (size_t i = 0; i < kNumStaticProperties; i++) {
     if (static_prop_range[i][1] == 0) {
@@ -321,7 +323,7 @@ StatusOr<Tree> LearnTree(
   JXL_RETURN_IF_ERROR(ComputeBestTree(
       tree_samples, options.splitting_heuristics_node_threshold * required_cost,
       multiplier_info, static_prop_range, options.fast_decode_multiplier,
-      &tree));
+      pool, &tree));
   return tree;
 }
 
@@ -558,7 +560,7 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
                      size_t group_id, TreeSamples *tree_samples,
                      size_t *total_pixels, const Tree *tree,
                      GroupHeader *header, std::vector<Token> *tokens,
-                     size_t *width) {
+                     size_t *width, StreamTreeCache *stream_cache) {
   if (image.error) return JXL_FAILURE("Invalid image");
   JxlMemoryManager *memory_manager = image.memory_manager();
   size_t nb_channels = image.channel.size();
@@ -600,8 +602,10 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
     }
     *total_pixels = std::max<size_t>(*total_pixels, 1);
   }
+  JXL_ENSURE(!stream_cache || (tree == nullptr && tree_samples == nullptr));
+  const bool reuse_stream_cache = stream_cache && !stream_cache->tree.empty();
   // If there's no tree, compute one (or gather data to).
-  if (tree == nullptr &&
+  if (tree == nullptr && !reuse_stream_cache &&
       options.tree_kind == ModularOptions::TreeKind::kLearn) {
     bool gather_data = tree_samples != nullptr;
     if (tree_samples == nullptr) {
@@ -648,7 +652,9 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
     std::vector<uint8_t> context_map;
 
     std::vector<std::vector<Token>> tree_tokens(1);
-    if (options.tree_kind == ModularOptions::TreeKind::kLearn) {
+    if (reuse_stream_cache) {
+      tree_storage = stream_cache->tree;
+    } else if (options.tree_kind == ModularOptions::TreeKind::kLearn) {
       JXL_ASSIGN_OR_RETURN(
           tree_storage,
           LearnTree(std::move(tree_samples_storage), *total_pixels, options));
@@ -663,6 +669,7 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
     JXL_RETURN_IF_ERROR(TokenizeTree(*tree, tree_tokens.data(), &decoded_tree));
     JXL_ENSURE(tree->size() == decoded_tree.size());
     tree_storage = std::move(decoded_tree);
+    if (stream_cache && !reuse_stream_cache) stream_cache->tree = tree_storage;
 
     /* TODO(szabadka) Add text output callback
     if (kWantDebug && kPrintTree && WantDebugOutput(aux_out)) {
@@ -717,18 +724,36 @@ Status ModularEncode(const Image &image, const ModularOptions &options,
   }
 
   // Write data if not using a global tree/ANS stream.
-  if (!header->use_global_tree) {
-    EntropyEncodingData code;
-    std::vector<uint8_t> context_map;
+  if (!header->use_global_tree && reuse_stream_cache) {
+    JXL_RETURN_IF_ERROR(EncodeHistograms(stream_cache->context_map,
+                                         stream_cache->code, writer, layer,
+                                         aux_out));
+    JXL_RETURN_IF_ERROR(WriteTokens(tokens_storage[0], stream_cache->code,
+                                    stream_cache->context_map, 0, writer,
+                                    layer, aux_out));
+  } else if (!header->use_global_tree) {
+    EntropyEncodingData code_storage;
+    std::vector<uint8_t> context_map_storage;
+    EntropyEncodingData *code =
+        stream_cache ? &stream_cache->code : &code_storage;
+    std::vector<uint8_t> *context_map =
+        stream_cache ? &stream_cache->context_map : &context_map_storage;
     HistogramParams histo_params = options.histogram_params;
     histo_params.image_widths.push_back(image_width);
+    if (stream_cache) {
+      // Histograms stored in the cache must code the tokens of any image
+      // without LZ77, and be kept encoded, as in streaming mode.
+      histo_params.streaming_mode = true;
+      histo_params.add_missing_symbols = true;
+      histo_params.lz77_method = HistogramParams::LZ77Method::kNone;
+    }
     JXL_ASSIGN_OR_RETURN(
         size_t cost,
         BuildAndEncodeHistograms(memory_manager, histo_params,
-                                 (tree->size() + 1) / 2, tokens_storage, &code,
-                                 &context_map, writer, layer, aux_out));
+                                 (tree->size() + 1) / 2, tokens_storage, code,
+                                 context_map, writer, layer, aux_out));
     (void)cost;
-    JXL_RETURN_IF_ERROR(WriteTokens(tokens_storage[0], code, context_map, 0,
+    JXL_RETURN_IF_ERROR(WriteTokens(tokens_storage[0], *code, *context_map, 0,
                                     writer, layer, aux_out));
   } else {
     *width = image_width;
@@ -741,7 +766,8 @@ Status ModularGenericCompress(Image &image, const ModularOptions &opts,
                               LayerType layer, size_t group_id,
                               TreeSamples *tree_samples, size_t *total_pixels,
                               const Tree *tree, GroupHeader *header,
-                              std::vector<Token> *tokens, size_t *width) {
+                              std::vector<Token> *tokens, size_t *width,
+                              StreamTreeCache *stream_cache) {
   if (image.w == 0 || image.h == 0) return true;
   ModularOptions options = opts;  // Make a copy to modify it.
 
@@ -752,7 +778,7 @@ Status ModularGenericCompress(Image &image, const ModularOptions &opts,
   size_t bits = writer ? writer->BitsWritten() : 0;
   JXL_RETURN_IF_ERROR(ModularEncode(image, options, writer, aux_out, layer,
                                     group_id, tree_samples, total_pixels, tree,
-                                    header, tokens, width));
+                                    header, tokens, width, stream_cache));
   bits = writer ? writer->BitsWritten() - bits : 0;
   if (writer) {
     JXL_DEBUG_V(4,
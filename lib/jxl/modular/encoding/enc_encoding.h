@@ -10,6 +10,7 @@
 #include <cstdint>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/enc_ans.h"
 #include "lib/jxl/enc_bit_writer.h"
@@ -31,7 +32,17 @@ StatusOr<Tree> LearnTree(
     TreeSamples &&tree_samples, size_t total_pixels,
     const ModularOptions &options,
     const std::vector<ModularMultiplierInfo> &multiplier_info = {},
-    StaticPropRange static_prop_range = {});
+    StaticPropRange static_prop_range = {}, ThreadPool *pool = nullptr);
+
+// Local tree and histograms of a stream, which a stream encoded with a local
+// tree stores when it is empty, and uses instead of learning its own
+// otherwise. The histograms give a non-zero probability to every symbol and
+// are kept encoded, so that they can code and be written for any image.
+struct StreamTreeCache {
+  Tree tree;
+  EntropyEncodingData code;
+  std::vector<uint8_t> context_map;
+};
 
 // TODO(veluca): make cleaner interfaces.
 
@@ -43,7 +54,9 @@ Status ModularGenericCompress(
     TreeSamples *tree_samples = nullptr, size_t *total_pixels = nullptr,
     // For encoding with global tree.
     const Tree *tree = nullptr, GroupHeader *header = nullptr,
-    std::vector<Token> *tokens = nullptr, size_t *widths = nullptr);
+    std::vector<Token> *tokens = nullptr, size_t *widths = nullptr,
+    // For encoding with a local tree that is cached between frames.
+    StreamTreeCache *stream_cache = nullptr);
 }  // namespace jxl
 
 #endif  // LIB_JXL_MODULAR_ENCODING_ENC_ENCODING_H_
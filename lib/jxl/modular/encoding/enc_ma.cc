@@ -8,66 +8,29 @@
 #include <algorithm>
 #include <cstdint>
 #include <cstdlib>
-#include <cstring>
 #include <limits>
 #include <numeric>
 #include <queue>
+#include <utility>
 #include <vector>
 
-#include "lib/jxl/ans_params.h"
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/random.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/enc_ans.h"
+#include "lib/jxl/enc_histogram_split.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/encoding/dec_ma.h"
 #include "lib/jxl/modular/encoding/ma_common.h"
 #include "lib/jxl/modular/modular_image.h"
-
-#undef HWY_TARGET_INCLUDE
-#define HWY_TARGET_INCLUDE "lib/jxl/modular/encoding/enc_ma.cc"
-#include <hwy/foreach_target.h>
-#include <hwy/highway.h>
-
-#include "lib/jxl/base/fast_math-inl.h"
-#include "lib/jxl/base/random.h"
-#include "lib/jxl/enc_ans.h"
-#include "lib/jxl/modular/encoding/context_predict.h"
 #include "lib/jxl/modular/options.h"
 #include "lib/jxl/pack_signed.h"
-HWY_BEFORE_NAMESPACE();
-namespace jxl {
-namespace HWY_NAMESPACE {
-
-// These templates are not found via ADL.
-using hwy::HWY_NAMESPACE::Eq;
-using hwy::HWY_NAMESPACE::IfThenElse;
-using hwy::HWY_NAMESPACE::Lt;
-using hwy::HWY_NAMESPACE::Max;
-
-const HWY_FULL(float) df;
-const HWY_FULL(int32_t) di;
-size_t Padded(size_t x) { return RoundUpTo(x, Lanes(df)); }
 
-// Compute entropy of the histogram, taking into account the minimum probability
-// for symbols with non-zero counts.
-float EstimateBits(const int32_t *counts, size_t num_symbols) {
-  int32_t total = std::accumulate(counts, counts + num_symbols, 0);
-  const auto zero = Zero(df);
-  const auto minprob = Set(df, 1.0f / ANS_TAB_SIZE);
-  const auto inv_total = Set(df, 1.0f / total);
-  auto bits_lanes = Zero(df);
-  auto total_v = Set(di, total);
-  for (size_t i = 0; i < num_symbols; i += Lanes(df)) {
-    const auto counts_iv = LoadU(di, &counts[i]);
-    const auto counts_fv = ConvertTo(df, counts_iv);
-    const auto probs = Mul(counts_fv, inv_total);
-    const auto mprobs = Max(probs, minprob);
-    const auto nbps = IfThenElse(Eq(counts_iv, total_v), BitCast(di, zero),
-                                 BitCast(di, FastLog2f(df, mprobs)));
-    bits_lanes = Sub(bits_lanes, Mul(counts_fv, BitCast(df, nbps)));
-  }
-  return GetLane(SumOfLanes(df, bits_lanes));
-}
+namespace jxl {
+namespace {
 
 void MakeSplitNode(size_t pos, int property, int splitval, Predictor lpred,
                    int64_t loff, Predictor rpred, int64_t roff, Tree *tree) {
@@ -169,327 +132,479 @@ void SplitTreeSamples(TreeSamples &tree_samples, size_t begin, size_t pos,
   }
 }
 
-void FindBestSplit(TreeSamples &tree_samples, float threshold,
-                   const std::vector<ModularMultiplierInfo> &mul_info,
-                   StaticPropRange initial_static_prop_range,
-                   float fast_decode_multiplier, Tree *tree) {
-  struct NodeInfo {
-    size_t pos;
-    size_t begin;
-    size_t end;
-    uint64_t used_properties;
-    StaticPropRange static_prop_range;
-  };
-  std::vector<NodeInfo> nodes;
-  nodes.push_back(NodeInfo{0, 0, tree_samples.NumDistinctSamples(), 0,
-                           initial_static_prop_range});
+struct SplitInfo {
+  size_t prop = 0;
+  uint32_t val = 0;
+  size_t pos = 0;
+  float lcost = std::numeric_limits<float>::max();
+  float rcost = std::numeric_limits<float>::max();
+  Predictor lpred = Predictor::Zero;
+  Predictor rpred = Predictor::Zero;
+  float Cost() const { return lcost + rcost; }
+};
 
-  size_t num_predictors = tree_samples.NumPredictors();
-  size_t num_properties = tree_samples.NumProperties();
+// Best splits of a node, by kind of split, among the splits along the
+// properties searched so far.
+struct SplitCandidates {
+  SplitInfo static_constant;
+  SplitInfo static_prop;
+  SplitInfo nonstatic;
+  SplitInfo nowp;
+};
 
-  // TODO(veluca): consider parallelizing the search (processing multiple nodes
-  // at a time).
-  while (!nodes.empty()) {
-    size_t pos = nodes.back().pos;
-    size_t begin = nodes.back().begin;
-    size_t end = nodes.back().end;
-    uint64_t used_properties = nodes.back().used_properties;
-    StaticPropRange static_prop_range = nodes.back().static_prop_range;
-    nodes.pop_back();
-    if (begin == end) continue;
+struct NodeInfo {
+  size_t pos;
+  size_t begin;
+  size_t end;
+  uint64_t used_properties;
+  StaticPropRange static_prop_range;
+};
 
-    struct SplitInfo {
-      size_t prop = 0;
-      uint32_t val = 0;
-      size_t pos = 0;
-      float lcost = std::numeric_limits<float>::max();
-      float rcost = std::numeric_limits<float>::max();
-      Predictor lpred = Predictor::Zero;
-      Predictor rpred = Predictor::Zero;
-      float Cost() const { return lcost + rcost; }
-    };
+// A node of the tree being split, with the histograms of its samples.
+struct NodeSplit {
+  NodeInfo info;
+  Predictor predictor;
+  uint32_t multiplier;
+  size_t max_symbols;
+  // Histogram of the tokens of every predictor, max_symbols entries each.
+  std::vector<int32_t> counts;
+  std::vector<uint32_t> tot_extra_bits;
+  float base_bits;
+  // Whether the properties are searched for a split, in
+  // candidates[first_candidates, first_candidates + NumProperties()).
+  bool search;
+  size_t first_candidates;
+  // The chosen split, valid if "split" is true.
+  bool forced;
+  bool split;
+  SplitInfo best;
+};
 
-    SplitInfo best_split_static_constant;
-    SplitInfo best_split_static;
-    SplitInfo best_split_nonstatic;
-    SplitInfo best_split_nowp;
+// Buffers of the split search along one property, reused by each thread. The
+// increments are zero between two searches.
+struct SplitScratch {
+  std::vector<int> prop_value_used_count;
+  std::vector<int> count_increase;
+  std::vector<size_t> extra_bits_increase;
+  // For each split value, the cost of each side with the best predictor.
+  struct CostInfo {
+    float cost = std::numeric_limits<float>::max();
+    float extra_cost = 0;
+    float Cost() const { return cost + extra_cost; }
+    Predictor pred;  // will be uninitialized in some cases, but never used.
+  };
+  std::vector<CostInfo> costs_l;
+  std::vector<CostInfo> costs_r;
+  HistogramSplitter splitter;
+};
 
-    JXL_DASSERT(begin <= end);
-    JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
+// Computes the histograms of the node and the cost of leaving it as a leaf,
+// and applies the multiplier ranges, which may force a split.
+void PrepareNode(const TreeSamples &tree_samples, float threshold,
+                 const std::vector<ModularMultiplierInfo> &mul_info,
+                 NodeSplit *node) {
+  const size_t begin = node->info.begin;
+  const size_t end = node->info.end;
+  const size_t num_predictors = tree_samples.NumPredictors();
+  JXL_DASSERT(begin <= end);
+  JXL_DASSERT(end <= tree_samples.NumDistinctSamples());
 
-    // Compute the maximum token in the range.
-    size_t max_symbols = 0;
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        uint32_t tok = tree_samples.Token(pred, i);
-        max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
-      }
+  // Compute the maximum token in the range.
+  size_t max_symbols = 0;
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      uint32_t tok = tree_samples.Token(pred, i);
+      max_symbols = max_symbols > tok + 1 ? max_symbols : tok + 1;
     }
-    max_symbols = Padded(max_symbols);
-    std::vector<int32_t> counts(max_symbols * num_predictors);
-    std::vector<uint32_t> tot_extra_bits(num_predictors);
-    for (size_t pred = 0; pred < num_predictors; pred++) {
-      for (size_t i = begin; i < end; i++) {
-        counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
-            tree_samples.Count(i);
-        tot_extra_bits[pred] +=
-            tree_samples.NBits(pred, i) * tree_samples.Count(i);
-      }
+  }
+  max_symbols = RoundUpTo(max_symbols, HistogramSplitAlignment());
+  node->max_symbols = max_symbols;
+  std::vector<int32_t> &counts = node->counts;
+  std::vector<uint32_t> &tot_extra_bits = node->tot_extra_bits;
+  counts.assign(max_symbols * num_predictors, 0);
+  tot_extra_bits.assign(num_predictors, 0);
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    for (size_t i = begin; i < end; i++) {
+      counts[pred * max_symbols + tree_samples.Token(pred, i)] +=
+          tree_samples.Count(i);
+      tot_extra_bits[pred] +=
+          tree_samples.NBits(pred, i) * tree_samples.Count(i);
     }
+  }
 
-    float base_bits;
-    {
-      size_t pred = tree_samples.PredictorIndex((*tree)[pos].predictor);
-      base_bits =
-          EstimateBits(counts.data() + pred * max_symbols, max_symbols) +
-          tot_extra_bits[pred];
+  {
+    size_t pred = tree_samples.PredictorIndex(node->predictor);
+    node->base_bits =
+        EstimateHistogramBits(counts.data() + pred * max_symbols,
+                              max_symbols) +
+        tot_extra_bits[pred];
+  }
+
+  node->forced = false;
+  // The multiplier ranges cut halfway through the current ranges of static
+  // properties. We do this even if the current node is not a leaf, to
+  // minimize the number of nodes in the resulting tree.
+  for (const auto &mmi : mul_info) {
+    uint32_t axis;
+    uint32_t val;
+    IntersectionType t =
+        BoxIntersects(node->info.static_prop_range, mmi.range, axis, val);
+    if (t == IntersectionType::kNone) continue;
+    if (t == IntersectionType::kInside) {
+      node->multiplier = mmi.multiplier;
+      break;
+    }
+    if (t == IntersectionType::kPartial) {
+      SplitInfo *best = &node->best;
+      *best = SplitInfo();
+      best->val = tree_samples.QuantizeProperty(axis, val);
+      best->prop = axis;
+      best->lcost = best->rcost = node->base_bits / 2 - threshold;
+      best->lpred = best->rpred = node->predictor;
+      best->pos = begin;
+      JXL_DASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
+      for (size_t x = begin; x < end; x++) {
+        if (tree_samples.Property(best->prop, x) <= best->val) {
+          best->pos++;
+        }
+      }
+      node->forced = true;
+      break;
     }
+  }
+  node->search = !node->forced && node->base_bits > threshold;
+}
+
+// Finds the best split of each kind along property "prop".
+void FindBestSplitAlongProperty(const TreeSamples &tree_samples,
+                                float threshold, const NodeSplit &node,
+                                size_t prop, SplitScratch *scratch,
+                                SplitCandidates *candidates) {
+  const size_t begin = node.info.begin;
+  const size_t end = node.info.end;
+  const size_t max_symbols = node.max_symbols;
+  const size_t num_predictors = tree_samples.NumPredictors();
+  std::vector<int> &prop_value_used_count = scratch->prop_value_used_count;
+  std::vector<int> &count_increase = scratch->count_increase;
+  std::vector<size_t> &extra_bits_increase = scratch->extra_bits_increase;
+  std::vector<SplitScratch::CostInfo> &costs_l = scratch->costs_l;
+  std::vector<SplitScratch::CostInfo> &costs_r = scratch->costs_r;
+  HistogramSplitter &splitter = scratch->splitter;
+
+  // For the property, compute which of its values are used, and what tokens
+  // correspond to those usages. Then, iterate through the values, and compute
+  // the entropy of each side of the split (of the form `prop > threshold`).
+  // Finally, find the split that minimizes the cost.
+  // The lower the threshold, the higher the expected noisiness of the
+  // estimate. Thus, discourage changing predictors.
+  float change_pred_penalty = 800.0f / (100.0f + threshold);
+  costs_l.clear();
+  costs_r.clear();
+  size_t prop_size = tree_samples.NumPropertyValues(prop);
+  if (count_increase.size() < prop_size * max_symbols) {
+    count_increase.resize(prop_size * max_symbols);
+  }
+  if (extra_bits_increase.size() < prop_size) {
+    extra_bits_increase.resize(prop_size);
+  }
+  // Clear prop_value_used_count (which cannot be cleared "on the go")
+  prop_value_used_count.clear();
+  prop_value_used_count.resize(prop_size);
 
-    SplitInfo *best = &best_split_nonstatic;
+  size_t first_used = prop_size;
+  size_t last_used = 0;
 
-    SplitInfo forced_split;
-    // The multiplier ranges cut halfway through the current ranges of static
-    // properties. We do this even if the current node is not a leaf, to
-    // minimize the number of nodes in the resulting tree.
-    for (const auto &mmi : mul_info) {
-      uint32_t axis;
-      uint32_t val;
-      IntersectionType t =
-          BoxIntersects(static_prop_range, mmi.range, axis, val);
-      if (t == IntersectionType::kNone) continue;
-      if (t == IntersectionType::kInside) {
-        (*tree)[pos].multiplier = mmi.multiplier;
-        break;
+  // TODO(veluca): consider finding multiple splits along a single
+  // property at the same time, possibly with a bottom-up approach.
+  for (size_t i = begin; i < end; i++) {
+    size_t p = tree_samples.Property(prop, i);
+    prop_value_used_count[p]++;
+    last_used = std::max(last_used, p);
+    first_used = std::min(first_used, p);
+  }
+  costs_l.resize(last_used - first_used);
+  costs_r.resize(last_used - first_used);
+  // For all predictors, compute the right and left costs of each split.
+  for (size_t pred = 0; pred < num_predictors; pred++) {
+    // Compute cost and histogram increments for each property value.
+    for (size_t i = begin; i < end; i++) {
+      size_t p = tree_samples.Property(prop, i);
+      size_t cnt = tree_samples.Count(i);
+      size_t sym = tree_samples.Token(pred, i);
+      count_increase[p * max_symbols + sym] += cnt;
+      extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
+    }
+    splitter.Reset(node.counts.data() + pred * max_symbols, max_symbols,
+                   node.tot_extra_bits[pred]);
+    // Exclude last used: this ensures neither side is empty.
+    for (size_t i = first_used; i < last_used; i++) {
+      if (!prop_value_used_count[i]) continue;
+      // The increase for this property value has been used, and will not
+      // be used again: clear it.
+      splitter.MoveToLeft(&count_increase[i * max_symbols],
+                          extra_bits_increase[i]);
+      extra_bits_increase[i] = 0;
+      float rcost = splitter.RightCost();
+      float lcost = splitter.LeftCost();
+      float penalty = 0;
+      // Never discourage moving away from the Weighted predictor.
+      if (tree_samples.PredictorFromIndex(pred) != node.predictor &&
+          node.predictor != Predictor::Weighted) {
+        penalty = change_pred_penalty;
       }
-      if (t == IntersectionType::kPartial) {
-        forced_split.val = tree_samples.QuantizeProperty(axis, val);
-        forced_split.prop = axis;
-        forced_split.lcost = forced_split.rcost = base_bits / 2 - threshold;
-        forced_split.lpred = forced_split.rpred = (*tree)[pos].predictor;
-        best = &forced_split;
-        best->pos = begin;
-        JXL_DASSERT(best->prop == tree_samples.PropertyFromIndex(best->prop));
-        for (size_t x = begin; x < end; x++) {
-          if (tree_samples.Property(best->prop, x) <= best->val) {
-            best->pos++;
-          }
-        }
-        break;
+      // If everything else is equal, disfavour Weighted (slower) and
+      // favour Zero (faster if it's the only predictor used in a
+      // group+channel combination)
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
+        penalty += 1e-8;
+      }
+      if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
+        penalty -= 1e-8;
+      }
+      if (rcost + penalty < costs_r[i - first_used].Cost()) {
+        costs_r[i - first_used].cost = rcost;
+        costs_r[i - first_used].extra_cost = penalty;
+        costs_r[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
+      }
+      if (lcost + penalty < costs_l[i - first_used].Cost()) {
+        costs_l[i - first_used].cost = lcost;
+        costs_l[i - first_used].extra_cost = penalty;
+        costs_l[i - first_used].pred = tree_samples.PredictorFromIndex(pred);
       }
     }
+  }
+  // Iterate through the possible splits and find the one with minimum sum
+  // of costs of the two sides.
+  size_t split = begin;
+  for (size_t i = first_used; i < last_used; i++) {
+    if (!prop_value_used_count[i]) continue;
+    split += prop_value_used_count[i];
+    float rcost = costs_r[i - first_used].cost;
+    float lcost = costs_l[i - first_used].cost;
+    // WP was not used + we would use the WP property or predictor
+    bool adds_wp =
+        (tree_samples.PropertyFromIndex(prop) == kWPProp &&
+         (node.info.used_properties & (1LU << prop)) == 0) ||
+        ((costs_l[i - first_used].pred == Predictor::Weighted ||
+          costs_r[i - first_used].pred == Predictor::Weighted) &&
+         node.predictor != Predictor::Weighted);
+    bool zero_entropy_side = rcost == 0 || lcost == 0;
 
-    if (best != &forced_split) {
-      std::vector<int> prop_value_used_count;
-      std::vector<int> count_increase;
-      std::vector<size_t> extra_bits_increase;
-      // For each property, compute which of its values are used, and what
-      // tokens correspond to those usages. Then, iterate through the values,
-      // and compute the entropy of each side of the split (of the form `prop >
-      // threshold`). Finally, find the split that minimizes the cost.
-      struct CostInfo {
-        float cost = std::numeric_limits<float>::max();
-        float extra_cost = 0;
-        float Cost() const { return cost + extra_cost; }
-        Predictor pred;  // will be uninitialized in some cases, but never used.
-      };
-      std::vector<CostInfo> costs_l;
-      std::vector<CostInfo> costs_r;
+    SplitInfo &best_ref =
+        prop < kNumStaticProperties
+            ? (zero_entropy_side ? candidates->static_constant
+                                 : candidates->static_prop)
+            : (adds_wp ? candidates->nonstatic : candidates->nowp);
+    if (lcost + rcost < best_ref.Cost()) {
+      best_ref.prop = prop;
+      best_ref.val = i;
+      best_ref.pos = split;
+      best_ref.lcost = lcost;
+      best_ref.lpred = costs_l[i - first_used].pred;
+      best_ref.rcost = rcost;
+      best_ref.rpred = costs_r[i - first_used].pred;
+    }
+  }
+  // Clear extra_bits_increase and cost_increase for last_used.
+  extra_bits_increase[last_used] = 0;
+  for (size_t sym = 0; sym < max_symbols; sym++) {
+    count_increase[last_used * max_symbols + sym] = 0;
+  }
+}
 
-      std::vector<int32_t> counts_above(max_symbols);
-      std::vector<int32_t> counts_below(max_symbols);
+// Chooses the split of the node among the candidates of all its properties,
+// if any is worth it, and partitions the samples of the node accordingly.
+void ChooseSplit(TreeSamples &tree_samples, float threshold,
+                 float fast_decode_multiplier,
+                 const SplitCandidates *candidates, NodeSplit *node) {
+  if (!node->forced) {
+    // Keeps the first best split of each kind, in the order of the
+    // properties, like a single search through all of them.
+    SplitCandidates merged;
+    const auto merge = [](const SplitInfo &from, SplitInfo *to) {
+      if (from.Cost() < to->Cost()) *to = from;
+    };
+    for (size_t prop = 0; node->search && prop < tree_samples.NumProperties();
+         prop++) {
+      const SplitCandidates &c = candidates[node->first_candidates + prop];
+      merge(c.static_constant, &merged.static_constant);
+      merge(c.static_prop, &merged.static_prop);
+      merge(c.nonstatic, &merged.nonstatic);
+      merge(c.nowp, &merged.nowp);
+    }
+    const float base_bits = node->base_bits;
+    const SplitInfo *best = &merged.nonstatic;
+    // Try to avoid introducing WP.
+    if (merged.nowp.Cost() + threshold < base_bits &&
+        merged.nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &merged.nowp;
+    }
+    // Split along static props if possible and not significantly more
+    // expensive.
+    if (merged.static_prop.Cost() + threshold < base_bits &&
+        merged.static_prop.Cost() <= fast_decode_multiplier * best->Cost()) {
+      best = &merged.static_prop;
+    }
+    // Split along static props to create constant nodes if possible.
+    if (merged.static_constant.Cost() + threshold < base_bits) {
+      best = &merged.static_constant;
+    }
+    node->best = *best;
+  }
+  node->split = node->best.Cost() + threshold < node->base_bits;
+  if (node->split) {
+    // "Sort" according to winning property
+    SplitTreeSamples(tree_samples, node->info.begin, node->best.pos,
+                     node->info.end, node->best.prop);
+  }
+}
 
-      // The lower the threshold, the higher the expected noisiness of the
-      // estimate. Thus, discourage changing predictors.
-      float change_pred_penalty = 800.0f / (100.0f + threshold);
-      for (size_t prop = 0; prop < num_properties && base_bits > threshold;
-           prop++) {
-        costs_l.clear();
-        costs_r.clear();
-        size_t prop_size = tree_samples.NumPropertyValues(prop);
-        if (extra_bits_increase.size() < prop_size) {
-          count_increase.resize(prop_size * max_symbols);
-          extra_bits_increase.resize(prop_size);
-        }
-        // Clear prop_value_used_count (which cannot be cleared "on the go")
-        prop_value_used_count.clear();
-        prop_value_used_count.resize(prop_size);
+// Renumbers the nodes of "tree" in the order in which a depth-first search
+// creates them, processing the left child of each node first.
+void NumberDepthFirst(Tree *tree) {
+  Tree numbered;
+  numbered.reserve(tree->size());
+  numbered.push_back((*tree)[0]);
+  // Position in "tree" and in "numbered" of the nodes left to visit.
+  std::vector<std::pair<size_t, size_t>> nodes = {{0, 0}};
+  while (!nodes.empty()) {
+    const PropertyDecisionNode &node = (*tree)[nodes.back().first];
+    const size_t pos = nodes.back().second;
+    nodes.pop_back();
+    if (node.property < 0) continue;
+    numbered[pos].lchild = numbered.size();
+    numbered[pos].rchild = numbered.size() + 1;
+    numbered.push_back((*tree)[node.lchild]);
+    numbered.push_back((*tree)[node.rchild]);
+    nodes.emplace_back(node.rchild, numbered[pos].rchild);
+    nodes.emplace_back(node.lchild, numbered[pos].lchild);
+  }
+  JXL_DASSERT(numbered.size() == tree->size());
+  *tree = std::move(numbered);
+}
 
-        size_t first_used = prop_size;
-        size_t last_used = 0;
+// Splits the nodes of each level of the tree at the same time: the search of
+// every node along every property, and the partitioning of the samples of
+// every node, are independent tasks on "pool". The decisions for a node only
+// depend on its samples, so the resulting tree is the same as when splitting
+// one node at a time; its nodes are numbered like that too.
+Status FindBestSplit(TreeSamples &tree_samples, float threshold,
+                     const std::vector<ModularMultiplierInfo> &mul_info,
+                     StaticPropRange initial_static_prop_range,
+                     float fast_decode_multiplier, ThreadPool *pool,
+                     Tree *tree) {
+  const size_t num_properties = tree_samples.NumProperties();
 
-        // TODO(veluca): consider finding multiple splits along a single
-        // property at the same time, possibly with a bottom-up approach.
-        for (size_t i = begin; i < end; i++) {
-          size_t p = tree_samples.Property(prop, i);
-          prop_value_used_count[p]++;
-          last_used = std::max(last_used, p);
-          first_used = std::min(first_used, p);
-        }
-        costs_l.resize(last_used - first_used);
-        costs_r.resize(last_used - first_used);
-        // For all predictors, compute the right and left costs of each split.
-        for (size_t pred = 0; pred < num_predictors; pred++) {
-          // Compute cost and histogram increments for each property value.
-          for (size_t i = begin; i < end; i++) {
-            size_t p = tree_samples.Property(prop, i);
-            size_t cnt = tree_samples.Count(i);
-            size_t sym = tree_samples.Token(pred, i);
-            count_increase[p * max_symbols + sym] += cnt;
-            extra_bits_increase[p] += tree_samples.NBits(pred, i) * cnt;
-          }
-          memcpy(counts_above.data(), counts.data() + pred * max_symbols,
-                 max_symbols * sizeof counts_above[0]);
-          memset(counts_below.data(), 0, max_symbols * sizeof counts_below[0]);
-          size_t extra_bits_below = 0;
-          // Exclude last used: this ensures neither counts_above nor
-          // counts_below is empty.
-          for (size_t i = first_used; i < last_used; i++) {
-            if (!prop_value_used_count[i]) continue;
-            extra_bits_below += extra_bits_increase[i];
-            // The increase for this property value has been used, and will not
-            // be used again: clear it. Also below.
-            extra_bits_increase[i] = 0;
-            for (size_t sym = 0; sym < max_symbols; sym++) {
-              counts_above[sym] -= count_increase[i * max_symbols + sym];
-              counts_below[sym] += count_increase[i * max_symbols + sym];
-              count_increase[i * max_symbols + sym] = 0;
-            }
-            float rcost = EstimateBits(counts_above.data(), max_symbols) +
-                          tot_extra_bits[pred] - extra_bits_below;
-            float lcost = EstimateBits(counts_below.data(), max_symbols) +
-                          extra_bits_below;
-            JXL_DASSERT(extra_bits_below <= tot_extra_bits[pred]);
-            float penalty = 0;
-            // Never discourage moving away from the Weighted predictor.
-            if (tree_samples.PredictorFromIndex(pred) !=
-                    (*tree)[pos].predictor &&
-                (*tree)[pos].predictor != Predictor::Weighted) {
-              penalty = change_pred_penalty;
-            }
-            // If everything else is equal, disfavour Weighted (slower) and
-            // favour Zero (faster if it's the only predictor used in a
-            // group+channel combination)
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Weighted) {
-              penalty += 1e-8;
-            }
-            if (tree_samples.PredictorFromIndex(pred) == Predictor::Zero) {
-              penalty -= 1e-8;
-            }
-            if (rcost + penalty < costs_r[i - first_used].Cost()) {
-              costs_r[i - first_used].cost = rcost;
-              costs_r[i - first_used].extra_cost = penalty;
-              costs_r[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-            if (lcost + penalty < costs_l[i - first_used].Cost()) {
-              costs_l[i - first_used].cost = lcost;
-              costs_l[i - first_used].extra_cost = penalty;
-              costs_l[i - first_used].pred =
-                  tree_samples.PredictorFromIndex(pred);
-            }
-          }
-        }
-        // Iterate through the possible splits and find the one with minimum sum
-        // of costs of the two sides.
-        size_t split = begin;
-        for (size_t i = first_used; i < last_used; i++) {
-          if (!prop_value_used_count[i]) continue;
-          split += prop_value_used_count[i];
-          float rcost = costs_r[i - first_used].cost;
-          float lcost = costs_l[i - first_used].cost;
-          // WP was not used + we would use the WP property or predictor
-          bool adds_wp =
-              (tree_samples.PropertyFromIndex(prop) == kWPProp &&
-               (used_properties & (1LU << prop)) == 0) ||
-              ((costs_l[i - first_used].pred == Predictor::Weighted ||
-                costs_r[i - first_used].pred == Predictor::Weighted) &&
-               (*tree)[pos].predictor != Predictor::Weighted);
-          bool zero_entropy_side = rcost == 0 || lcost == 0;
+  std::vector<NodeSplit> level(1);
+  level[0].info = NodeInfo{0, 0, tree_samples.NumDistinctSamples(), 0,
+                           initial_static_prop_range};
+  std::vector<NodeSplit> next_level;
+  // Pairs of node index in "level" and property to search.
+  std::vector<std::pair<uint32_t, uint32_t>> searches;
+  std::vector<SplitCandidates> candidates;
+  std::vector<SplitScratch> scratch;
 
-          SplitInfo &best_ref =
-              prop < kNumStaticProperties
-                  ? (zero_entropy_side ? best_split_static_constant
-                                       : best_split_static)
-                  : (adds_wp ? best_split_nonstatic : best_split_nowp);
-          if (lcost + rcost < best_ref.Cost()) {
-            best_ref.prop = prop;
-            best_ref.val = i;
-            best_ref.pos = split;
-            best_ref.lcost = lcost;
-            best_ref.lpred = costs_l[i - first_used].pred;
-            best_ref.rcost = rcost;
-            best_ref.rpred = costs_r[i - first_used].pred;
-          }
-        }
-        // Clear extra_bits_increase and cost_increase for last_used.
-        extra_bits_increase[last_used] = 0;
-        for (size_t sym = 0; sym < max_symbols; sym++) {
-          count_increase[last_used * max_symbols + sym] = 0;
-        }
-      }
+  while (!level.empty()) {
+    for (NodeSplit &node : level) {
+      node.predictor = (*tree)[node.info.pos].predictor;
+      node.multiplier = (*tree)[node.info.pos].multiplier;
+    }
+    const auto prepare_node = [&](const uint32_t i,
+                                  size_t /* thread */) -> Status {
+      PrepareNode(tree_samples, threshold, mul_info, &level[i]);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, level.size(), ThreadPool::NoInit,
+                                  prepare_node, "PrepareTreeNodes"));
 
-      // Try to avoid introducing WP.
-      if (best_split_nowp.Cost() + threshold < base_bits &&
-          best_split_nowp.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_nowp;
-      }
-      // Split along static props if possible and not significantly more
-      // expensive.
-      if (best_split_static.Cost() + threshold < base_bits &&
-          best_split_static.Cost() <= fast_decode_multiplier * best->Cost()) {
-        best = &best_split_static;
-      }
-      // Split along static props to create constant nodes if possible.
-      if (best_split_static_constant.Cost() + threshold < base_bits) {
-        best = &best_split_static_constant;
+    searches.clear();
+    for (size_t i = 0; i < level.size(); i++) {
+      level[i].first_candidates = searches.size();
+      if (!level[i].search) continue;
+      for (size_t prop = 0; prop < num_properties; prop++) {
+        searches.emplace_back(i, prop);
       }
     }
+    candidates.assign(searches.size(), SplitCandidates());
+    const auto init_scratch = [&](size_t num_threads) -> Status {
+      if (scratch.size() < num_threads) scratch.resize(num_threads);
+      return true;
+    };
+    const auto search = [&](const uint32_t task, size_t thread) -> Status {
+      FindBestSplitAlongProperty(tree_samples, threshold,
+                                 level[searches[task].first],
+                                 searches[task].second, &scratch[thread],
+                                 &candidates[task]);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, searches.size(), init_scratch,
+                                  search, "FindTreeSplits"));
+
+    const auto choose_split = [&](const uint32_t i,
+                                  size_t /* thread */) -> Status {
+      ChooseSplit(tree_samples, threshold, fast_decode_multiplier,
+                  candidates.data(), &level[i]);
+      return true;
+    };
+    JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, level.size(), ThreadPool::NoInit,
+                                  choose_split, "SplitTreeNodes"));
 
-    if (best->Cost() + threshold < base_bits) {
+    next_level.clear();
+    for (const NodeSplit &node : level) {
+      const size_t pos = node.info.pos;
+      (*tree)[pos].multiplier = node.multiplier;
+      if (!node.split) continue;
+      const SplitInfo *best = &node.best;
       uint32_t p = tree_samples.PropertyFromIndex(best->prop);
       pixel_type dequant =
           tree_samples.UnquantizeProperty(best->prop, best->val);
       // Split node and try to split children.
       MakeSplitNode(pos, p, dequant, best->lpred, 0, best->rpred, 0, tree);
-      // "Sort" according to winning property
-      SplitTreeSamples(tree_samples, begin, best->pos, end, best->prop);
+      uint64_t used_properties = node.info.used_properties;
       if (p >= kNumStaticProperties) {
         used_properties |= 1 << best->prop;
       }
+      const StaticPropRange &static_prop_range = node.info.static_prop_range;
       auto new_sp_range = static_prop_range;
       if (p < kNumStaticProperties) {
         JXL_DASSERT(static_cast<uint32_t>(dequant + 1) <= new_sp_range[p][1]);
         new_sp_range[p][1] = dequant + 1;
         JXL_DASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
       }
-      nodes.push_back(NodeInfo{(*tree)[pos].rchild, begin, best->pos,
-                               used_properties, new_sp_range});
+      next_level.emplace_back();
+      next_level.back().info =
+          NodeInfo{(*tree)[pos].rchild, node.info.begin, best->pos,
+                   used_properties, new_sp_range};
       new_sp_range = static_prop_range;
       if (p < kNumStaticProperties) {
         JXL_DASSERT(new_sp_range[p][0] <= static_cast<uint32_t>(dequant + 1));
         new_sp_range[p][0] = dequant + 1;
         JXL_DASSERT(new_sp_range[p][0] < new_sp_range[p][1]);
       }
-      nodes.push_back(NodeInfo{(*tree)[pos].lchild, best->pos, end,
-                               used_properties, new_sp_range});
+      next_level.emplace_back();
+      next_level.back().info =
+          NodeInfo{(*tree)[pos].lchild, best->pos, node.info.end,
+                   used_properties, new_sp_range};
     }
+    // Nodes without samples stay leaves.
+    next_level.erase(std::remove_if(next_level.begin(), next_level.end(),
+                                    [](const NodeSplit &node) {
+                                      return node.info.begin == node.info.end;
+                                    }),
+                     next_level.end());
+    level.swap(next_level);
   }
+  NumberDepthFirst(tree);
+  return true;
 }
 
-// NOLINTNEXTLINE(google-readability-namespace-comments)
-}  // namespace HWY_NAMESPACE
-}  // namespace jxl
-HWY_AFTER_NAMESPACE();
-
-#if HWY_ONCE
-namespace jxl {
-
-HWY_EXPORT(FindBestSplit);  // Local function.
+}  // namespace
 
 Status ComputeBestTree(TreeSamples &tree_samples, float threshold,
                        const std::vector<ModularMultiplierInfo> &mul_info,
                        StaticPropRange static_prop_range,
-                       float fast_decode_multiplier, Tree *tree) {
+                       float fast_decode_multiplier, ThreadPool *pool,
+                       Tree *tree) {
   // TODO(veluca): take into account that different contexts can have different
   // uint configs.
   //
@@ -503,10 +618,8 @@ Status ComputeBestTree(TreeSamples &tree_samples, float threshold,
 
   JXL_ENSURE(tree_samples.NumDistinctSamples() <=
              std::numeric_limits<uint32_t>::max());
-  HWY_DYNAMIC_DISPATCH(FindBestSplit)
-  (tree_samples, threshold, mul_info, static_prop_range, fast_decode_multiplier,
-   tree);
-  return true;
+  return FindBestSplit(tree_samples, threshold, mul_info, static_prop_range,
+                       fast_decode_multiplier, pool, tree);
 }
 
 #if JXL_CXX_LANG < JXL_CXX_17
@@ -1028,4 +1141,3 @@ Status TokenizeTree(const Tree &tree, std::vector<Token> *tokens,
 }
 
 }  // namespace jxl
-#endif  // HWY_ONCE
@@ -12,12 +12,15 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
+#include <memory>
 #include <queue>
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/scope_guard.h"
 #include "lib/jxl/base/status.h"
@@ -145,6 +148,95 @@ FlatTree FilterTree(const Tree &global_tree,
 }
 
 namespace detail {
+template <bool uses_lz77, int mode>
+JXL_INLINE pixel_type DecodePixelWithCompiledTree(
+    BitReader *br, ANSSymbolReader *reader, const CompiledMATree &tree,
+    Properties *properties, size_t w, const pixel_type *JXL_RESTRICT pp,
+    const intptr_t onerow, size_t x, size_t y, weighted::State *wp_state) {
+  PredictionResult res = detail::PredictCompiled<mode>(properties, w, pp,
+                                                       onerow, x, y, tree,
+                                                       wp_state);
+  uint64_t v =
+      (mode & detail::kNoEdgeCases)
+          ? reader->ReadHybridUintClusteredInlined<uses_lz77>(res.context, br)
+          : reader->ReadHybridUintClustered<uses_lz77>(res.context, br);
+  JXL_DASSERT((v & 0xFFFFFFFF) == v);
+  pixel_type val = static_cast<pixel_type_w>(UnpackSigned(v)) *
+                       res.multiplier +
+                   res.guess;
+  if (mode & detail::kUseWP) wp_state->UpdateErrors(val, x, y, w);
+  return val;
+}
+
+// Decodes a channel with a tree compiled by CompiledMATree, computing only the
+// properties and predictions selected by "mode".
+template <bool uses_lz77, int mode>
+Status DecodeChannelWithCompiledTree(
+    BitReader *br, ANSSymbolReader *reader, const CompiledMATree &tree,
+    const weighted::Header &wp_header,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    Channel *channel) {
+  constexpr int nec_mode = mode | detail::kNoEdgeCases;
+  const size_t w = channel->w;
+  const intptr_t onerow = channel->plane.PixelsPerRow();
+  Properties properties(kNumNonrefProperties);
+  std::unique_ptr<weighted::State> wp_state;
+  if (mode & detail::kUseWP) {
+    wp_state = jxl::make_unique<weighted::State>(wp_header, w, channel->h);
+  }
+  for (size_t y = 0; y < channel->h; y++) {
+    pixel_type *JXL_RESTRICT p = channel->Row(y);
+    InitPropsRow(&properties, static_props, y);
+    if (y > 1 && w > 8) {
+      for (size_t x = 0; x < 2; x++) {
+        p[x] = DecodePixelWithCompiledTree<uses_lz77, mode>(
+            br, reader, tree, &properties, w, p + x, onerow, x, y,
+            wp_state.get());
+      }
+      for (size_t x = 2; x < w - 2; x++) {
+        p[x] = DecodePixelWithCompiledTree<uses_lz77, nec_mode>(
+            br, reader, tree, &properties, w, p + x, onerow, x, y,
+            wp_state.get());
+      }
+      for (size_t x = w - 2; x < w; x++) {
+        p[x] = DecodePixelWithCompiledTree<uses_lz77, mode>(
+            br, reader, tree, &properties, w, p + x, onerow, x, y,
+            wp_state.get());
+      }
+    } else {
+      for (size_t x = 0; x < w; x++) {
+        p[x] = DecodePixelWithCompiledTree<uses_lz77, mode>(
+            br, reader, tree, &properties, w, p + x, onerow, x, y,
+            wp_state.get());
+      }
+    }
+  }
+  return true;
+}
+
+template <bool uses_lz77>
+Status DecodeChannelWithCompiledTree(
+    BitReader *br, ANSSymbolReader *reader, const CompiledMATree &tree,
+    const weighted::Header &wp_header,
+    const std::array<pixel_type, kNumStaticProperties> &static_props,
+    Channel *channel) {
+  constexpr int kFFV1 = detail::kFFV1Properties;
+  constexpr int kWP = detail::kUseWP;
+  if (tree.uses_ffv1() && tree.uses_wp()) {
+    return DecodeChannelWithCompiledTree<uses_lz77, kFFV1 | kWP>(
+        br, reader, tree, wp_header, static_props, channel);
+  } else if (tree.uses_ffv1()) {
+    return DecodeChannelWithCompiledTree<uses_lz77, kFFV1>(
+        br, reader, tree, wp_header, static_props, channel);
+  } else if (tree.uses_wp()) {
+    return DecodeChannelWithCompiledTree<uses_lz77, kWP>(
+        br, reader, tree, wp_header, static_props, channel);
+  } else {
+    return DecodeChannelWithCompiledTree<uses_lz77, 0>(
+        br, reader, tree, wp_header, static_props, channel);
+  }
+}
+
 template <bool uses_lz77>
 Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
                                  const std::vector<uint8_t> &context_map,
@@ -191,6 +283,13 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
     return val * multiplier + offset;
   };
 
+  // Compiling the tree takes time proportional to 2^depth, so deeper trees
+  // are only compiled for larger channels.
+  CompiledMATree compiled_tree;
+  const size_t max_compiled_depth =
+      std::min(size_t{CompiledMATree::kMaxDepth},
+               FloorLog2Nonzero(channel.w * channel.h));
+
   if (tree.size() == 1) {
     // special optimized case: no meta-adaptation, so no need
     // to compute properties.
@@ -213,12 +312,17 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
       } else {
         JXL_DEBUG_V(8, "Fast track.");
         if (multiplier == 1 && offset == 0) {
+          // The pixels are the residuals, so whole rows are read at once,
+          // which copies LZ77 matches in bulk.
+          static_assert(sizeof(pixel_type) == sizeof(uint32_t),
+                        "Residuals are read in place");
           for (size_t y = 0; y < channel.h; y++) {
             pixel_type *JXL_RESTRICT r = channel.Row(y);
+            uint32_t *v = reinterpret_cast<uint32_t *>(r);
+            reader->ReadHybridUintClusteredBatch<uses_lz77>(ctx_id, br, v,
+                                                            channel.w);
             for (size_t x = 0; x < channel.w; x++) {
-              uint32_t v =
-                  reader->ReadHybridUintClusteredInlined<uses_lz77>(ctx_id, br);
-              r[x] = UnpackSigned(v);
+              r[x] = UnpackSigned(v[x]);
             }
           }
         } else {
@@ -378,6 +482,12 @@ Status DecodeModularChannelMAANS(BitReader *br, ANSSymbolReader *reader,
         wp_state.UpdateErrors(r[x], x, y, channel.w);
       }
     }
+  } else if (compiled_tree.Compile(tree, max_compiled_depth)) {
+    // special optimized case: no reference properties and a shallow tree,
+    // which can be looked up without branches.
+    JXL_DEBUG_V(8, "Compiled tree track.");
+    JXL_RETURN_IF_ERROR(DecodeChannelWithCompiledTree<uses_lz77>(
+        br, reader, compiled_tree, wp_header, static_props, &channel));
   } else if (!tree_has_wp_prop_or_pred) {
     // special optimized case: the weighted predictor and its properties are not
     // used, so no need to compute weights and properties.
@@ -670,7 +780,7 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
                                 ModularOptions *options, bool undo_transforms,
                                 const Tree *tree, const ANSCode *code,
                                 const std::vector<uint8_t> *ctx_map,
-                                bool allow_truncated_group) {
+                                bool allow_truncated_group, ThreadPool *pool) {
   std::vector<std::pair<uint32_t, uint32_t>> req_sizes;
   req_sizes.reserve(image.channel.size());
   for (const auto &c : image.channel) {
@@ -683,7 +793,7 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
                                   code, ctx_map, allow_truncated_group);
   if (!allow_truncated_group) JXL_RETURN_IF_ERROR(dec_status);
   if (dec_status.IsFatalError()) return dec_status;
-  if (undo_transforms) image.undo_transforms(header->wp_header);
+  if (undo_transforms) image.undo_transforms(header->wp_header, pool);
   if (image.error) return JXL_FAILURE("Corrupt file. Aborting.");
   JXL_DEBUG_V(4,
               "Modular-decoded a %" PRIuS "x%" PRIuS " nbchans=%" PRIuS
@@ -13,6 +13,7 @@
 #include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/field_encodings.h"
 #include "lib/jxl/modular/encoding/context_predict.h"
@@ -146,7 +147,8 @@ Status ModularGenericDecompress(BitReader *br, Image &image,
                                 const Tree *tree = nullptr,
                                 const ANSCode *code = nullptr,
                                 const std::vector<uint8_t> *ctx_map = nullptr,
-                                bool allow_truncated_group = false);
+                                bool allow_truncated_group = false,
+                                ThreadPool *pool = nullptr);
 }  // namespace jxl
 
 #endif  // LIB_JXL_MODULAR_ENCODING_ENCODING_H_
@@ -91,9 +91,15 @@ StatusOr<Image> Image::Clone(const Image &that) {
   clone.error = that.error;
   clone.transform = that.transform;
   for (const Channel &ch : that.channel) {
-    JXL_ASSIGN_OR_RETURN(Channel a, Channel::Create(memory_manager, ch.w, ch.h,
-                                                    ch.hshift, ch.vshift));
-    JXL_RETURN_IF_ERROR(CopyImageTo(ch.plane, &a.plane));
+    // Channels whose samples are stored elsewhere have no plane, nor does
+    // their clone.
+    const bool has_plane = ch.plane.xsize() != 0;
+    JXL_ASSIGN_OR_RETURN(
+        Channel a, Channel::Create(memory_manager, has_plane ? ch.w : 0,
+                                   has_plane ? ch.h : 0, ch.hshift, ch.vshift));
+    a.w = ch.w;
+    a.h = ch.h;
+    if (has_plane) JXL_RETURN_IF_ERROR(CopyImageTo(ch.plane, &a.plane));
     clone.channel.push_back(std::move(a));
   }
   return clone;
@@ -15,7 +15,6 @@
 #include <cstdlib>
 #include <limits>
 #include <map>
-#include <set>
 #include <utility>
 #include <vector>
 
@@ -107,6 +106,77 @@ static int QuantizeColorToImplicitPaletteIndex(
   }
 }
 
+// Open-addressing hash table from the colors of a fixed number of channels to
+// a value, which counts them or indexes them in a palette. The colors are kept
+// in the order in which they were added.
+class ColorTable {
+ public:
+  explicit ColorTable(size_t nb) : nb_(nb), slots_(kMinSlots, 0) {}
+
+  size_t size() const { return values_.size(); }
+  const pixel_type *Color(size_t i) const { return colors_.data() + i * nb_; }
+  uint32_t Value(size_t i) const { return values_[i]; }
+
+  // Returns the value of `color`, after adding it with a value of 0 if it was
+  // not in the table, which `added` tells. The reference is only valid until
+  // the next call to Get.
+  uint32_t &Get(const pixel_type *color, bool *added) {
+    const size_t slot = FindSlot(color);
+    *added = slots_[slot] == 0;
+    if (!*added) return values_[slots_[slot] - 1];
+    colors_.insert(colors_.end(), color, color + nb_);
+    values_.push_back(0);
+    slots_[slot] = values_.size();
+    if (2 * values_.size() > slots_.size()) Grow();
+    return values_.back();
+  }
+  uint32_t &Get(const pixel_type *color) {
+    bool added;
+    return Get(color, &added);
+  }
+
+  // Returns the value of `color`, or 0 if it is not in the table.
+  uint32_t Find(const pixel_type *color) const {
+    const uint32_t entry = slots_[FindSlot(color)];
+    return entry == 0 ? 0 : values_[entry - 1];
+  }
+
+ private:
+  static constexpr size_t kMinSlots = 64;
+
+  size_t FindSlot(const pixel_type *color) const {
+    uint64_t hash = 0;
+    for (size_t c = 0; c < nb_; c++) {
+      hash = (hash + static_cast<uint32_t>(color[c])) * 0x9E3779B97F4A7C15ull;
+    }
+    const size_t mask = slots_.size() - 1;
+    for (size_t slot = (hash >> 32) & mask;; slot = (slot + 1) & mask) {
+      const uint32_t entry = slots_[slot];
+      if (entry == 0 || std::equal(color, color + nb_, Color(entry - 1))) {
+        return slot;
+      }
+    }
+  }
+
+  void Grow() {
+    std::vector<uint32_t> slots(2 * slots_.size(), 0);
+    slots_.swap(slots);
+    for (size_t i = 0; i < values_.size(); i++) {
+      slots_[FindSlot(Color(i))] = i + 1;
+    }
+  }
+
+  size_t nb_;
+  std::vector<pixel_type> colors_;
+  std::vector<uint32_t> values_;
+  // 0 for empty slots, 1 + the index of the color otherwise.
+  std::vector<uint32_t> slots_;
+};
+
+// Pixels of a sample of the image, in both directions, that is checked for too
+// many colors before the whole image is.
+static constexpr size_t kColorSampleStep = 8;
+
 }  // namespace palette_internal
 
 int RoundInt(int value, int div) {  // symmetric rounding around 0
@@ -197,42 +267,33 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
     size_t lookup_table_size =
         static_cast<int64_t>(maxval) - static_cast<int64_t>(minval) + 1;
     if (lookup_table_size > palette_internal::kMaxPaletteLookupTableSize) {
-      // a lookup table would use too much memory, instead use a slower approach
-      // with std::set
-      std::set<pixel_type> chpalette;
-      pixel_type idx = 0;
+      // a lookup table would use too much memory, instead use a hash table
+      palette_internal::ColorTable chpalette(1);
       for (size_t y = 0; y < h; y++) {
         const pixel_type *p = input.channel[begin_c].Row(y);
         for (size_t x = 0; x < w; x++) {
-          const bool new_color = chpalette.insert(p[x]).second;
-          if (new_color) {
-            idx++;
-            if (idx > static_cast<int>(nb_colors)) return false;
-          }
+          chpalette.Get(p + x);
+          if (chpalette.size() > nb_colors) return false;
         }
       }
+      pixel_type idx = chpalette.size();
       JXL_DEBUG_V(6, "Channel %i uses only %i colors.", begin_c, idx);
       JXL_ASSIGN_OR_RETURN(Channel pch,
                            Channel::Create(memory_manager, idx, 1));
       pch.hshift = -1;
       pch.vshift = -1;
       nb_colors = idx;
-      idx = 0;
       pixel_type *JXL_RESTRICT p_palette = pch.Row(0);
-      for (pixel_type p : chpalette) {
-        p_palette[idx++] = p;
+      for (idx = 0; idx < static_cast<int>(nb_colors); idx++) {
+        p_palette[idx] = *chpalette.Color(idx);
+      }
+      std::sort(p_palette, p_palette + nb_colors);
+      for (idx = 0; idx < static_cast<int>(nb_colors); idx++) {
+        chpalette.Get(p_palette + idx) = idx;
       }
       for (size_t y = 0; y < h; y++) {
         pixel_type *p = input.channel[begin_c].Row(y);
-        for (size_t x = 0; x < w; x++) {
-          for (idx = 0;
-               p[x] != p_palette[idx] && idx < static_cast<int>(nb_colors);
-               idx++) {
-            // no-op
-          }
-          JXL_DASSERT(idx < static_cast<int>(nb_colors));
-          p[x] = idx;
-        }
+        for (size_t x = 0; x < w; x++) p[x] = chpalette.Find(p + x);
       }
       predictor = Predictor::Zero;
       input.nb_meta_channels++;
@@ -291,19 +352,19 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       begin_c, end_c, nb_colors);
   nb_deltas = 0;
   bool delta_used = false;
-  std::set<std::vector<pixel_type>> candidate_palette;
+  // Number of occurrences of the candidate colors in the image.
+  palette_internal::ColorTable candidate_palette(nb);
   std::vector<std::vector<pixel_type>> candidate_palette_imageorder;
   std::vector<pixel_type> color(nb);
   std::vector<float> color_with_error(nb);
   std::vector<const pixel_type *> p_in(nb);
-  std::map<std::vector<pixel_type>, size_t> inv_palette;
 
   if (lossy) {
     palette_iteration_data.FindFrequentColorDeltas(w * h, input.bitdepth);
     nb_deltas = palette_iteration_data.frequent_deltas[0].size();
 
     // Count color frequency for colors that make a cross.
-    std::map<std::vector<pixel_type>, size_t> color_freq_map;
+    palette_internal::ColorTable cross_color_freq(nb);
     for (size_t y = 1; y + 1 < h; y++) {
       for (uint32_t c = 0; c < nb; c++) {
         p_in[c] = input.channel[begin_c + c].Row(y);
@@ -323,21 +384,30 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
             }
           }
         }
-        if (makes_cross) color_freq_map[color] += 1;
+        if (makes_cross) cross_color_freq.Get(color.data()) += 1;
       }
     }
-    // Add colors satisfying frequency condition to the palette.
+    // Add colors satisfying frequency condition to the palette, in increasing
+    // order.
     constexpr float kImageFraction = 0.01f;
     size_t color_frequency_lower_bound = 5 + input.h * input.w * kImageFraction;
-    for (const auto &color_freq : color_freq_map) {
-      if (color_freq.second > color_frequency_lower_bound) {
-        candidate_palette.insert(color_freq.first);
-        candidate_palette_imageorder.push_back(color_freq.first);
+    for (size_t i = 0; i < cross_color_freq.size(); i++) {
+      if (cross_color_freq.Value(i) > color_frequency_lower_bound) {
+        const pixel_type *cross_color = cross_color_freq.Color(i);
+        candidate_palette_imageorder.emplace_back(cross_color,
+                                                  cross_color + nb);
       }
     }
+    std::sort(candidate_palette_imageorder.begin(),
+              candidate_palette_imageorder.end());
+    for (const std::vector<pixel_type> &cross_color :
+         candidate_palette_imageorder) {
+      candidate_palette.Get(cross_color.data());
+    }
   }
 
-  std::map<std::vector<pixel_type>, bool> implicit_color;
+  // 1 + the index of the implicit colors, the last one if several are equal.
+  palette_internal::ColorTable implicit_color(nb);
   std::vector<std::vector<pixel_type>> implicit_colors;
   implicit_colors.reserve(palette_internal::kImplicitPaletteSize);
   for (size_t k = 0; k < palette_internal::kImplicitPaletteSize; k++) {
@@ -345,11 +415,33 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       color[i] = palette_internal::GetPaletteValue(nullptr, k, i, 0, 0,
                                                    input.bitdepth);
     }
-    implicit_color[color] = true;
+    implicit_color.Get(color.data()) = k + 1;
     implicit_colors.push_back(color);
   }
 
-  std::map<std::vector<pixel_type>, size_t> color_freq_map;
+  if (!lossy) {
+    // Images that have too many colors usually show it in a sample of their
+    // pixels, before the scan below gets to them.
+    palette_internal::ColorTable sample_palette(nb);
+    size_t num_explicit_colors = 0;
+    for (size_t y = 0; y < h; y += palette_internal::kColorSampleStep) {
+      for (uint32_t c = 0; c < nb; c++) {
+        p_in[c] = input.channel[begin_c + c].Row(y);
+      }
+      for (size_t x = 0; x < w; x += palette_internal::kColorSampleStep) {
+        for (uint32_t c = 0; c < nb; c++) {
+          color[c] = p_in[c][x];
+        }
+        bool new_color;
+        sample_palette.Get(color.data(), &new_color);
+        if (new_color && implicit_color.Find(color.data()) == 0 &&
+            ++num_explicit_colors > nb_colors) {
+          return false;  // too many colors
+        }
+      }
+    }
+  }
+
   uint32_t implicit_colors_used = 0;
   for (size_t y = 0; y < h; y++) {
     for (uint32_t c = 0; c < nb; c++) {
@@ -360,9 +452,10 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       for (uint32_t c = 0; c < nb; c++) {
         color[c] = p_in[c][x];
       }
-      const bool new_color = candidate_palette.insert(color).second;
+      bool new_color;
+      candidate_palette.Get(color.data(), &new_color) += 1;
       if (new_color) {
-        if (implicit_color[color]) {
+        if (implicit_color.Find(color.data()) != 0) {
           implicit_colors_used++;
         } else {
           candidate_palette_imageorder.push_back(color);
@@ -371,7 +464,6 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
           }
         }
       }
-      color_freq_map[color] += 1;
     }
   }
 
@@ -385,14 +477,15 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
   for (size_t k = 0; k < palette_internal::kImplicitPaletteSize; k++) {
     color = implicit_colors[k];
     // still add the color to the explicit palette if it is frequent enough
-    if (color_freq_map[color] > 10) {
+    if (candidate_palette.Find(color.data()) > 10) {
       nb_colors++;
       candidate_palette_imageorder.push_back(color);
     }
   }
+  // Index of the colors in the palette.
+  palette_internal::ColorTable inv_palette(nb);
   for (size_t k = 0; k < palette_internal::kImplicitPaletteSize; k++) {
-    color = implicit_colors[k];
-    inv_palette[color] = nb_colors + k;
+    inv_palette.Get(implicit_colors[k].data()) = nb_colors + k;
   }
 
   JXL_DEBUG_V(6, "Channels %i-%i can be represented using a %i-color palette.",
@@ -434,8 +527,10 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
                 if (bp.size() > 3) by *= 1.f + bp[3];
                 // put common colors first, transparent dark to opaque bright,
                 // then rare colors, bright to dark
-                ay = color_freq_map[ap] > freq_threshold ? -ay : ay;
-                by = color_freq_map[bp] > freq_threshold ? -by : by;
+                ay = candidate_palette.Find(ap.data()) > freq_threshold ? -ay
+                                                                        : ay;
+                by = candidate_palette.Find(bp.data()) > freq_threshold ? -by
+                                                                        : by;
                 return ay < by;
               });
   } else {
@@ -448,7 +543,7 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       p_palette[nb_deltas + i * onerow + clr] = pcol[i];
       JXL_DEBUG_V(9, "%i ", pcol[i]);
     }
-    inv_palette[pcol] = clr;
+    inv_palette.Get(pcol.data()) = clr;
     clr++;
   }
   std::vector<weighted::State> wp_states;
@@ -478,7 +573,7 @@ Status FwdPaletteIteration(Image &input, uint32_t begin_c, uint32_t end_c,
       int index;
       if (!lossy) {
         for (size_t c = 0; c < nb; c++) color[c] = p_in[c][x];
-        index = inv_palette[color];
+        index = inv_palette.Find(color.data());
       } else {
         int best_index = 0;
         bool best_is_delta = false;
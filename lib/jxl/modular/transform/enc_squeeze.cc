@@ -8,23 +8,54 @@
 #include <jxl/memory_manager.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <utility>
 #include <vector>
 
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/transform/squeeze.h"
 #include "lib/jxl/modular/transform/squeeze_params.h"
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/modular/transform/enc_squeeze.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
 
+#include "lib/jxl/modular/transform/squeeze-inl.h"
+
+HWY_BEFORE_NAMESPACE();
 namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElseZero;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
 
 #define AVERAGE(X, Y) (((X) + (Y) + (((X) > (Y)) ? 1 : 0)) >> 1)
 
-Status FwdHSqueeze(Image &input, int c, int rc) {
+// Rows of the output that each task of the pool squeezes.
+constexpr size_t kRowsPerTask = 16;
+
+#if HWY_TARGET != HWY_SCALAR
+
+// Equivalent to AVERAGE(a, b) on each lane.
+template <class D, class V>
+JXL_INLINE V FastAverage(D d, V a, V b) {
+  return ShiftRight<1>(Add(Add(a, b), IfThenElseZero(Gt(a, b), Set(d, 1))));
+}
+
+#endif
+
+Status FwdHSqueeze(Image &input, int c, int rc, ThreadPool *pool) {
   const Channel &chin = input.channel[c];
   JxlMemoryManager *memory_manager = input.memory_manager();
 
@@ -38,11 +69,11 @@ Status FwdHSqueeze(Image &input, int c, int rc) {
                        Channel::Create(memory_manager, chin.w - chout.w,
                                        chout.h, chin.hshift + 1, chin.vshift));
 
-  for (size_t y = 0; y < chout.h; y++) {
+  const auto squeeze_row = [&](size_t y) {
     const pixel_type *JXL_RESTRICT p_in = chin.Row(y);
     pixel_type *JXL_RESTRICT p_out = chout.Row(y);
     pixel_type *JXL_RESTRICT p_res = chout_residual.Row(y);
-    for (size_t x = 0; x < chout_residual.w; x++) {
+    const auto squeeze_pixel = [&](size_t x) {
       pixel_type A = p_in[x * 2];
       pixel_type B = p_in[x * 2 + 1];
       pixel_type avg = AVERAGE(A, B);
@@ -62,18 +93,52 @@ Status FwdHSqueeze(Image &input, int c, int rc) {
       pixel_type tendency = SmoothTendency(left, avg, next_avg);
 
       p_res[x] = diff - tendency;
+    };
+    size_t x = 0;
+#if HWY_TARGET != HWY_SCALAR
+    // The vectors skip the first and last pixels, which have no left
+    // neighbour or next pair.
+    const HWY_FULL(pixel_type) d;
+    const size_t N = Lanes(d);
+    if (chout_residual.w > N + 1) {
+      squeeze_pixel(0);
+      for (x = 1; x + N < chout_residual.w; x += N) {
+        auto A = Zero(d);
+        auto B = Zero(d);
+        auto C = Zero(d);
+        auto D = Zero(d);
+        auto left = Zero(d);
+        auto right = Zero(d);
+        LoadInterleaved2(d, p_in + x * 2, A, B);
+        LoadInterleaved2(d, p_in + x * 2 + 2, C, D);
+        LoadInterleaved2(d, p_in + x * 2 - 1, left, right);
+        auto avg = FastAverage(d, A, B);
+        auto next_avg = FastAverage(d, C, D);
+        StoreU(avg, d, p_out + x);
+        StoreU(Sub(Sub(A, B), FastSmoothTendency(d, left, avg, next_avg)), d,
+               p_res + x);
+      }
     }
-    if (chin.w & 1) {
-      int x = chout.w - 1;
-      p_out[x] = p_in[x * 2];
-    }
-  }
+#endif
+    for (; x < chout_residual.w; x++) squeeze_pixel(x);
+    if (chin.w & 1) p_out[chout.w - 1] = p_in[(chout.w - 1) * 2];
+  };
+  const auto squeeze_rows = [&](const uint32_t task,
+                                size_t /* thread */) -> Status {
+    const size_t y0 = task * kRowsPerTask;
+    const size_t y1 = std::min(y0 + kRowsPerTask, chout.h);
+    for (size_t y = y0; y < y1; y++) squeeze_row(y);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0, DivCeil(chout.h, kRowsPerTask),
+                                ThreadPool::NoInit, squeeze_rows,
+                                "FwdHorizontalSqueeze"));
   input.channel[c] = std::move(chout);
   input.channel.insert(input.channel.begin() + rc, std::move(chout_residual));
   return true;
 }
 
-Status FwdVSqueeze(Image &input, int c, int rc) {
+Status FwdVSqueeze(Image &input, int c, int rc, ThreadPool *pool) {
   const Channel &chin = input.channel[c];
   JxlMemoryManager *memory_manager = input.memory_manager();
 
@@ -87,11 +152,33 @@ Status FwdVSqueeze(Image &input, int c, int rc) {
                        Channel::Create(memory_manager, chin.w, chin.h - chout.h,
                                        chin.hshift, chin.vshift + 1));
   intptr_t onerow_in = chin.plane.PixelsPerRow();
-  for (size_t y = 0; y < chout_residual.h; y++) {
+  const auto squeeze_row = [&](size_t y) {
     const pixel_type *JXL_RESTRICT p_in = chin.Row(y * 2);
     pixel_type *JXL_RESTRICT p_out = chout.Row(y);
     pixel_type *JXL_RESTRICT p_res = chout_residual.Row(y);
-    for (size_t x = 0; x < chout.w; x++) {
+    size_t x = 0;
+#if HWY_TARGET != HWY_SCALAR
+    const HWY_FULL(pixel_type) d;
+    const size_t N = Lanes(d);
+    for (; x + N <= chout.w; x += N) {
+      auto A = LoadU(d, p_in + x);
+      auto B = LoadU(d, p_in + x + onerow_in);
+      auto avg = FastAverage(d, A, B);
+      StoreU(avg, d, p_out + x);
+      auto next_avg = avg;
+      if (y + 1 < chout_residual.h) {
+        next_avg = FastAverage(d, LoadU(d, p_in + x + 2 * onerow_in),
+                               LoadU(d, p_in + x + 3 * onerow_in));
+      } else if (chin.h & 1) {
+        next_avg = LoadU(d, p_in + x + 2 * onerow_in);
+      }
+      auto top = avg;
+      if (y > 0) top = LoadU(d, p_in + x - onerow_in);
+      StoreU(Sub(Sub(A, B), FastSmoothTendency(d, top, avg, next_avg)), d,
+             p_res + x);
+    }
+#endif
+    for (; x < chout.w; x++) {
       pixel_type A = p_in[x];
       pixel_type B = p_in[x + onerow_in];
       pixel_type avg = AVERAGE(A, B);
@@ -113,7 +200,18 @@ Status FwdVSqueeze(Image &input, int c, int rc) {
 
       p_res[x] = diff - tendency;
     }
-  }
+  };
+  const auto squeeze_rows = [&](const uint32_t task,
+                                size_t /* thread */) -> Status {
+    const size_t y0 = task * kRowsPerTask;
+    const size_t y1 = std::min(y0 + kRowsPerTask, chout_residual.h);
+    for (size_t y = y0; y < y1; y++) squeeze_row(y);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnPool(pool, 0,
+                                DivCeil(chout_residual.h, kRowsPerTask),
+                                ThreadPool::NoInit, squeeze_rows,
+                                "FwdVertSqueeze"));
   if (chin.h & 1) {
     size_t y = chout.h - 1;
     const pixel_type *p_in = chin.Row(y * 2);
@@ -127,6 +225,8 @@ Status FwdVSqueeze(Image &input, int c, int rc) {
   return true;
 }
 
+#undef AVERAGE
+
 Status FwdSqueeze(Image &input, std::vector<SqueezeParams> parameters,
                   ThreadPool *pool) {
   if (parameters.empty()) {
@@ -149,13 +249,29 @@ Status FwdSqueeze(Image &input, std::vector<SqueezeParams> parameters,
     }
     for (uint32_t c = beginc; c <= endc; c++) {
       if (horizontal) {
-        JXL_RETURN_IF_ERROR(FwdHSqueeze(input, c, offset + c - beginc));
+        JXL_RETURN_IF_ERROR(FwdHSqueeze(input, c, offset + c - beginc, pool));
       } else {
-        JXL_RETURN_IF_ERROR(FwdVSqueeze(input, c, offset + c - beginc));
+        JXL_RETURN_IF_ERROR(FwdVSqueeze(input, c, offset + c - beginc, pool));
       }
     }
   }
   return true;
 }
 
+}  // namespace HWY_NAMESPACE
 }  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace jxl {
+
+HWY_EXPORT(FwdSqueeze);
+Status FwdSqueeze(Image &input, std::vector<SqueezeParams> parameters,
+                  ThreadPool *pool) {
+  return HWY_DYNAMIC_DISPATCH(FwdSqueeze)(input, std::move(parameters), pool);
+}
+
+}  // namespace jxl
+
+#endif
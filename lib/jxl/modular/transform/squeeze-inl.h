@@ -0,0 +1,86 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// SIMD version of SmoothTendency, shared by the forward and inverse squeeze,
+// which must compute the same tendencies.
+
+#if defined(LIB_JXL_MODULAR_TRANSFORM_SQUEEZE_INL_H_) == \
+    defined(HWY_TARGET_TOGGLE)
+#ifdef LIB_JXL_MODULAR_TRANSFORM_SQUEEZE_INL_H_
+#undef LIB_JXL_MODULAR_TRANSFORM_SQUEEZE_INL_H_
+#else
+#define LIB_JXL_MODULAR_TRANSFORM_SQUEEZE_INL_H_
+#endif
+
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/modular/modular_image.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+#if HWY_TARGET != HWY_SCALAR
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Abs;
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::And;
+using hwy::HWY_NAMESPACE::Gt;
+using hwy::HWY_NAMESPACE::IfThenElse;
+using hwy::HWY_NAMESPACE::IfThenZeroElse;
+using hwy::HWY_NAMESPACE::Lt;
+using hwy::HWY_NAMESPACE::MulEven;
+using hwy::HWY_NAMESPACE::Ne;
+using hwy::HWY_NAMESPACE::Neg;
+using hwy::HWY_NAMESPACE::OddEven;
+using hwy::HWY_NAMESPACE::ShiftLeft;
+using hwy::HWY_NAMESPACE::ShiftRight;
+using hwy::HWY_NAMESPACE::Sub;
+using hwy::HWY_NAMESPACE::Xor;
+
+// Equivalent to SmoothTendency(top, avg, next_avg) on each lane, but without
+// branches.
+template <class D, class V>
+JXL_INLINE V FastSmoothTendency(D d, V top, V avg, V next_avg) {
+  auto onethird = Set(d, 0x55555556);
+  // typo:off
+  auto Ba = Sub(top, avg);
+  auto an = Sub(avg, next_avg);
+  auto nonmono = Xor(Ba, an);
+  auto absBa = Abs(Ba);
+  auto absan = Abs(an);
+  auto absBn = Abs(Sub(top, next_avg));
+  // Compute a3 = absBa / 3
+  auto a3e = BitCast(d, ShiftRight<32>(MulEven(absBa, onethird)));
+  auto a3oi = MulEven(Reverse(d, absBa), onethird);
+  auto a3o = BitCast(
+      d, Reverse(hwy::HWY_NAMESPACE::Repartition<pixel_type_w, D>(), a3oi));
+  auto a3 = OddEven(a3o, a3e);
+  a3 = Add(a3, Add(absBn, Set(d, 2)));
+  auto absdiff = ShiftRight<2>(a3);
+  auto skipdiff = Ne(Ba, Zero(d));
+  skipdiff = And(skipdiff, Ne(an, Zero(d)));
+  skipdiff = And(skipdiff, Lt(nonmono, Zero(d)));
+  auto absBa2 = Add(ShiftLeft<1>(absBa), And(absdiff, Set(d, 1)));
+  absdiff = IfThenElse(Gt(absdiff, absBa2),
+                       Add(ShiftLeft<1>(absBa), Set(d, 1)), absdiff);
+  // typo:on
+  auto absan2 = ShiftLeft<1>(absan);
+  absdiff = IfThenElse(Gt(Add(absdiff, And(absdiff, Set(d, 1))), absan2),
+                       absan2, absdiff);
+  auto diff1 = IfThenElse(Lt(top, next_avg), Neg(absdiff), absdiff);
+  return IfThenZeroElse(skipdiff, diff1);
+}
+
+#endif
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#endif  // LIB_JXL_MODULAR_TRANSFORM_SQUEEZE_INL_H_
@@ -25,6 +25,7 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/modular/transform/squeeze-inl.h"
 #include "lib/jxl/simd_util-inl.h"
 
 HWY_BEFORE_NAMESPACE();
@@ -32,22 +33,10 @@ namespace jxl {
 namespace HWY_NAMESPACE {
 
 // These templates are not found via ADL.
-using hwy::HWY_NAMESPACE::Abs;
 using hwy::HWY_NAMESPACE::Add;
-using hwy::HWY_NAMESPACE::And;
-using hwy::HWY_NAMESPACE::Gt;
-using hwy::HWY_NAMESPACE::IfThenElse;
-using hwy::HWY_NAMESPACE::IfThenZeroElse;
-using hwy::HWY_NAMESPACE::Lt;
-using hwy::HWY_NAMESPACE::MulEven;
-using hwy::HWY_NAMESPACE::Ne;
-using hwy::HWY_NAMESPACE::Neg;
-using hwy::HWY_NAMESPACE::OddEven;
 using hwy::HWY_NAMESPACE::RebindToUnsigned;
-using hwy::HWY_NAMESPACE::ShiftLeft;
 using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::Sub;
-using hwy::HWY_NAMESPACE::Xor;
 
 #if HWY_TARGET != HWY_SCALAR
 
@@ -60,40 +49,11 @@ JXL_INLINE void FastUnsqueeze(const pixel_type *JXL_RESTRICT p_residual,
   const HWY_CAPPED(pixel_type, 8) d;
   const RebindToUnsigned<decltype(d)> du;
   const size_t N = Lanes(d);
-  auto onethird = Set(d, 0x55555556);
   for (size_t x = 0; x < 8; x += N) {
     auto avg = Load(d, p_avg + x);
     auto next_avg = Load(d, p_navg + x);
     auto top = Load(d, p_pout + x);
-    // Equivalent to SmoothTendency(top,avg,next_avg), but without branches
-    // typo:off
-    auto Ba = Sub(top, avg);
-    auto an = Sub(avg, next_avg);
-    auto nonmono = Xor(Ba, an);
-    auto absBa = Abs(Ba);
-    auto absan = Abs(an);
-    auto absBn = Abs(Sub(top, next_avg));
-    // Compute a3 = absBa / 3
-    auto a3e = BitCast(d, ShiftRight<32>(MulEven(absBa, onethird)));
-    auto a3oi = MulEven(Reverse(d, absBa), onethird);
-    auto a3o = BitCast(
-        d, Reverse(hwy::HWY_NAMESPACE::Repartition<pixel_type_w, decltype(d)>(),
-                   a3oi));
-    auto a3 = OddEven(a3o, a3e);
-    a3 = Add(a3, Add(absBn, Set(d, 2)));
-    auto absdiff = ShiftRight<2>(a3);
-    auto skipdiff = Ne(Ba, Zero(d));
-    skipdiff = And(skipdiff, Ne(an, Zero(d)));
-    skipdiff = And(skipdiff, Lt(nonmono, Zero(d)));
-    auto absBa2 = Add(ShiftLeft<1>(absBa), And(absdiff, Set(d, 1)));
-    absdiff = IfThenElse(Gt(absdiff, absBa2),
-                         Add(ShiftLeft<1>(absBa), Set(d, 1)), absdiff);
-    // typo:on
-    auto absan2 = ShiftLeft<1>(absan);
-    absdiff = IfThenElse(Gt(Add(absdiff, And(absdiff, Set(d, 1))), absan2),
-                         absan2, absdiff);
-    auto diff1 = IfThenElse(Lt(top, next_avg), Neg(absdiff), absdiff);
-    auto tendency = IfThenZeroElse(skipdiff, diff1);
+    auto tendency = FastSmoothTendency(d, top, avg, next_avg);
 
     auto diff_minus_tendency = Load(d, p_residual + x);
     auto diff = Add(diff_minus_tendency, tendency);
@@ -6,8 +6,11 @@
 #include <jxl/cms.h>
 #include <jxl/encode.h>
 #include <jxl/memory_manager.h>
+#include <jxl/thread_parallel_runner_cxx.h>
 #include <jxl/types.h>
 
+#include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
@@ -25,6 +28,7 @@
 #include "lib/extras/packed_image.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/random.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
@@ -35,6 +39,7 @@
 #include "lib/jxl/enc_aux_out.h"
 #include "lib/jxl/enc_bit_writer.h"
 #include "lib/jxl/enc_fields.h"
+#include "lib/jxl/enc_modular.h"
 #include "lib/jxl/enc_params.h"
 #include "lib/jxl/enc_toc.h"
 #include "lib/jxl/fields.h"
@@ -45,10 +50,14 @@
 #include "lib/jxl/image_metadata.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
+#include "lib/jxl/modular/encoding/context_predict.h"
+#include "lib/jxl/modular/encoding/dec_ma.h"
 #include "lib/jxl/modular/encoding/enc_encoding.h"
 #include "lib/jxl/modular/encoding/encoding.h"
 #include "lib/jxl/modular/modular_image.h"
 #include "lib/jxl/modular/options.h"
+#include "lib/jxl/modular/transform/enc_squeeze.h"
+#include "lib/jxl/modular/transform/squeeze.h"
 #include "lib/jxl/modular/transform/squeeze_params.h"
 #include "lib/jxl/modular/transform/transform.h"
 #include "lib/jxl/padded_bytes.h"
@@ -65,7 +74,7 @@ using ::jxl::test::ReadTestData;
 using ::jxl::test::Roundtrip;
 using ::jxl::test::TestImage;
 
-void TestLosslessGroups(size_t group_size_shift) {
+void TestLosslessGroups(size_t group_size_shift, ThreadPool* pool = nullptr) {
   const std::vector<uint8_t> orig = ReadTestData("jxl/flower/flower.png");
   TestImage t;
   ASSERT_TRUE(t.DecodeFromBytes(orig));
@@ -80,7 +89,7 @@ void TestLosslessGroups(size_t group_size_shift) {
 
   extras::PackedPixelFile ppf_out;
   size_t compressed_size =
-      Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+      Roundtrip(t.ppf(), cparams, dparams, pool, &ppf_out);
   EXPECT_LE(compressed_size, 280000u);
   EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
 }
@@ -95,6 +104,125 @@ JXL_TSAN_SLOW_TEST(ModularTest, RoundtripLosslessGroups1024) {
   TestLosslessGroups(3);
 }
 
+// The image is a single group, whose transforms and conversion to the render
+// pipeline run on the threads of the pool.
+TEST(ModularTest, RoundtripLosslessSingleGroupThreaded) {
+  test::ThreadPoolForTests pool(4);
+  TestLosslessGroups(3, pool.get());
+}
+
+// The tree is learned on the threads of the runner, without changing it.
+TEST(ModularTest, TreeLearningThreadedIsDeterministic) {
+  const std::vector<uint8_t> orig =
+      ReadTestData("external/wesaturate/500px/u76c0g_bliznaca_srgb8.png");
+  TestImage t;
+  ASSERT_TRUE(t.DecodeFromBytes(orig));
+  t.ClearMetadata();
+  ASSERT_TRUE(t.SetDimensions(256, 256));
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_EFFORT, 9);
+  std::vector<uint8_t> compressed;
+  ASSERT_TRUE(extras::EncodeImageJXL(cparams, t.ppf(), /*jpeg_bytes=*/nullptr,
+                                     &compressed));
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 8);
+  cparams.runner_opaque = runner.get();
+  std::vector<uint8_t> compressed_threaded;
+  ASSERT_TRUE(extras::EncodeImageJXL(cparams, t.ppf(), /*jpeg_bytes=*/nullptr,
+                                     &compressed_threaded));
+  EXPECT_EQ(compressed, compressed_threaded);
+}
+
+TEST(ModularTest, RoundtripLosslessReusedTree) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  CodecInOut first{memory_manager};
+  ASSERT_TRUE(SetFromBytes(
+      Bytes(ReadTestData(
+          "external/wesaturate/500px/u76c0g_bliznaca_srgb8.png")),
+      &first));
+  ASSERT_TRUE(first.ShrinkTo(256, 256));
+  CodecInOut second{memory_manager};
+  ASSERT_TRUE(
+      SetFromBytes(Bytes(ReadTestData("jxl/flower/flower.png")), &second));
+  ASSERT_TRUE(second.ShrinkTo(256, 256));
+
+  // Squirrel learns a tree per group, which the cache keeps per stream, and
+  // glacier learns a global tree.
+  for (SpeedTier speed_tier : {SpeedTier::kSquirrel, SpeedTier::kGlacier}) {
+    const bool global_tree = speed_tier == SpeedTier::kGlacier;
+    CompressParams cparams;
+    cparams.SetLossless();
+    cparams.speed_tier = speed_tier;
+    cparams.modular_tree_cache = std::make_shared<ModularTreeCache>();
+    extras::JXLDecompressParams dparams;
+
+    CodecInOut first_out{memory_manager};
+    JXL_EXPECT_OK(Roundtrip(&first, cparams, dparams, &first_out, _));
+    JXL_EXPECT_OK(
+        SamePixels(*first.Main().color(), *first_out.Main().color(), _));
+    const ModularTreeCache& cache = *cparams.modular_tree_cache;
+    EXPECT_EQ(global_tree, !cache.tree.empty());
+    EXPECT_EQ(global_tree, !cache.context_map.empty());
+    std::vector<size_t> tree_sizes;
+    for (const StreamTreeCache& stream : cache.streams) {
+      tree_sizes.push_back(stream.tree.size());
+      EXPECT_EQ(stream.tree.empty(), stream.context_map.empty());
+    }
+    const size_t num_stream_trees =
+        tree_sizes.size() -
+        std::count(tree_sizes.begin(), tree_sizes.end(), size_t{0});
+    if (global_tree) {
+      EXPECT_EQ(0u, num_stream_trees);
+    } else {
+      EXPECT_GT(num_stream_trees, 0u);
+    }
+    const size_t tree_size = cache.tree.size();
+
+    // The second image, of the same size, is coded with the trees and
+    // histograms of the first one.
+    CodecInOut second_out{memory_manager};
+    JXL_EXPECT_OK(Roundtrip(&second, cparams, dparams, &second_out, _));
+    JXL_EXPECT_OK(
+        SamePixels(*second.Main().color(), *second_out.Main().color(), _));
+    EXPECT_EQ(tree_size, cache.tree.size());
+    ASSERT_EQ(tree_sizes.size(), cache.streams.size());
+    for (size_t i = 0; i < tree_sizes.size(); ++i) {
+      EXPECT_EQ(tree_sizes[i], cache.streams[i].tree.size());
+    }
+  }
+}
+
+// An image of a few colors spanning several groups, whose global palette the
+// decoder undoes group by group.
+TEST(ModularTest, RoundtripLosslessGlobalPaletteGroups) {
+  TestImage t;
+  ASSERT_TRUE(t.SetDimensions(300, 200));
+  t.SetDataType(JXL_TYPE_UINT8);
+  ASSERT_TRUE(t.SetChannels(3));
+  JXL_TEST_ASSIGN_OR_DIE(auto frame, t.AddFrame());
+  const uint8_t colors[5][3] = {
+      {0, 0, 0}, {255, 0, 0}, {30, 200, 90}, {10, 20, 250}, {255, 255, 255}};
+  for (size_t y = 0; y < 200; y++) {
+    for (size_t x = 0; x < 300; x++) {
+      const uint8_t* color = colors[(x / 16 + y / 24) % 5];
+      for (size_t c = 0; c < 3; c++) {
+        ASSERT_TRUE(frame.SetValue(y, x, c, color[c] / 255.0f));
+      }
+    }
+  }
+
+  extras::JXLCompressParams cparams;
+  cparams.distance = 0.0f;
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, 0);
+  extras::JXLDecompressParams dparams;
+  dparams.accepted_formats = {{3, JXL_TYPE_UINT8, JXL_LITTLE_ENDIAN, 0}};
+
+  extras::PackedPixelFile ppf_out;
+  Roundtrip(t.ppf(), cparams, dparams, nullptr, &ppf_out);
+  EXPECT_EQ(0.0f, test::ComputeDistance2(t.ppf(), ppf_out));
+}
+
 TEST(ModularTest, RoundtripLosslessCustomWpPermuteRCT) {
   const std::vector<uint8_t> orig =
       ReadTestData("external/wesaturate/500px/u76c0g_bliznaca_srgb8.png");
@@ -380,6 +508,60 @@ TEST_P(ModularTestParam, RoundtripLossless) {
   EXPECT_EQ(different, 0);
 }
 
+// The decoded samples are not bounded by the bit depth of the image. Those of
+// the top right group do not fit in the 16-bit storage of the channels of the
+// squeezed 8-bit image, and must be kept in 32 bits until they are rendered.
+TEST(ModularTest, RoundtripLosslessCompactChannelOverflow) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 300;
+  const size_t ysize = 300;
+  CodecInOut io{memory_manager};
+  ASSERT_TRUE(io.SetSize(xsize, ysize));
+  io.metadata.m.color_encoding = jxl::ColorEncoding::SRGB(false);
+  io.metadata.m.SetUintSamples(8);
+  const float factor = 255.0f;
+  JXL_TEST_ASSIGN_OR_DIE(Image3F image,
+                         Image3F::Create(memory_manager, xsize, ysize));
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < ysize; y++) {
+      float* row = image.PlaneRow(c, y);
+      for (size_t x = 0; x < xsize; x++) {
+        // Neighbors that differ that much give residuals beyond 16 bits.
+        const bool large = x >= kGroupDim && y < kGroupDim;
+        const uint32_t u = large ? ((x + y) % 2 ? 65000 - c : c)
+                                 : (x + 3 * y + 50 * c) % 256;
+        row[x] = u / factor;
+      }
+    }
+  }
+  ASSERT_TRUE(
+      io.SetFromImage(std::move(image), jxl::ColorEncoding::SRGB(false)));
+
+  CompressParams cparams;
+  cparams.modular_mode = true;
+  cparams.color_transform = jxl::ColorTransform::kNone;
+  cparams.butteraugli_distance = 0.f;
+  cparams.speed_tier = SpeedTier::kThunder;
+  cparams.responsive = 1;
+  cparams.modular_group_size_shift = 1;
+  extras::JXLDecompressParams dparams;
+  CodecInOut io2{memory_manager};
+  JXL_EXPECT_OK(Roundtrip(&io, cparams, dparams, &io2, _));
+  size_t different = 0;
+  for (size_t c = 0; c < 3; c++) {
+    for (size_t y = 0; y < ysize; y++) {
+      const float* in = io.Main().color()->ConstPlaneRow(c, y);
+      const float* out = io2.Main().color()->ConstPlaneRow(c, y);
+      for (size_t x = 0; x < xsize; x++) {
+        if (std::lround(in[x] * factor) != std::lround(out[x] * factor)) {
+          different++;
+        }
+      }
+    }
+  }
+  EXPECT_EQ(different, 0);
+}
+
 TEST(ModularTest, RoundtripLosslessCustomFloat) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   CodecInOut io{memory_manager};
@@ -475,6 +657,74 @@ void WriteHistograms(BitWriter* writer) {
   writer->Write(32, 0x10003);  // all bit lengths 8
 }
 
+TEST(ModularTest, CompiledTreeMatchesLookup) {
+  Rng rng(0);
+  for (size_t iter = 0; iter < 20; iter++) {
+    // Random tree of depth at most 5 that also splits on static properties.
+    Tree tree(1);
+    std::vector<size_t> depth = {0};
+    for (size_t i = 0; i < tree.size(); i++) {
+      if (depth[i] < 5 && rng.UniformU(0, 4) != 0) {
+        tree[i] = PropertyDecisionNode::Split(
+            rng.UniformI(0, kNumNonrefProperties), rng.UniformI(-4, 4),
+            tree.size());
+        const size_t child_depth = depth[i] + 1;
+        tree.resize(tree.size() + 2);
+        depth.resize(tree.size(), child_depth);
+      } else {
+        tree[i] = PropertyDecisionNode::Leaf(
+            static_cast<Predictor>(rng.UniformU(0, kNumModularPredictors)),
+            rng.UniformI(-2, 2), rng.UniformU(1, 3));
+        tree[i].lchild = static_cast<uint32_t>(i);
+      }
+    }
+    std::array<pixel_type, kNumStaticProperties> static_props = {{1, 0}};
+    size_t num_props;
+    bool use_wp;
+    bool wp_only;
+    bool gradient_only;
+    FlatTree flat_tree = FilterTree(tree, static_props, &num_props, &use_wp,
+                                    &wp_only, &gradient_only);
+    CompiledMATree compiled_tree;
+    ASSERT_TRUE(compiled_tree.Compile(flat_tree, CompiledMATree::kMaxDepth));
+    EXPECT_EQ(use_wp, compiled_tree.uses_wp());
+
+    MATreeLookup tree_lookup(flat_tree);
+    Properties properties(kNumNonrefProperties);
+    for (size_t i = 0; i < 100; i++) {
+      for (size_t p = 0; p < properties.size(); p++) {
+        properties[p] =
+            p < kNumStaticProperties ? static_props[p] : rng.UniformI(-5, 5);
+      }
+      MATreeLookup::LookupResult expected = tree_lookup.Lookup(properties);
+      MATreeLookup::LookupResult actual = compiled_tree.Lookup(properties);
+      EXPECT_EQ(expected.context, actual.context);
+      EXPECT_EQ(expected.predictor, actual.predictor);
+      EXPECT_EQ(expected.offset, actual.offset);
+      EXPECT_EQ(expected.multiplier, actual.multiplier);
+    }
+  }
+  // Deeper trees are rejected.
+  Tree chain;
+  for (size_t i = 0; i < 4; i++) {
+    chain.push_back(PropertyDecisionNode::Split(kGradientProp, 0,
+                                                chain.size() + 1,
+                                                chain.size() + 2));
+    chain.push_back(PropertyDecisionNode::Leaf(Predictor::Zero));
+  }
+  chain.push_back(PropertyDecisionNode::Leaf(Predictor::Left));
+  std::array<pixel_type, kNumStaticProperties> static_props = {{0, 0}};
+  size_t num_props;
+  bool use_wp;
+  bool wp_only;
+  bool gradient_only;
+  FlatTree flat_chain = FilterTree(chain, static_props, &num_props, &use_wp,
+                                   &wp_only, &gradient_only);
+  CompiledMATree compiled_chain;
+  EXPECT_TRUE(compiled_chain.Compile(flat_chain, 4));
+  EXPECT_FALSE(compiled_chain.Compile(flat_chain, 3));
+}
+
 TEST(ModularTest, PredictorIntegerOverflow) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   const size_t xsize = 1;
@@ -567,5 +817,46 @@ TEST(ModularTest, UnsqueezeIntegerOverflow) {
   }
 }
 
+// The odd sizes leave pixels to both the vectors and the scalar code, and the
+// rows of the channels are split between the threads of the pool.
+TEST(ModularTest, FwdSqueezeThreadedIsInvertible) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const size_t xsize = 301;
+  const size_t ysize = 203;
+  JXL_TEST_ASSIGN_OR_DIE(Image image, Image::Create(memory_manager, xsize,
+                                                    ysize, /*bitdepth=*/16, 3));
+  Rng rng(0);
+  for (size_t y = 0; y < ysize; y++) {
+    for (size_t x = 0; x < xsize; x++) {
+      // Noise, and gradients whose tendencies are mostly not zero.
+      image.channel[0].Row(y)[x] = rng.UniformI(-32768, 32768);
+      image.channel[1].Row(y)[x] = x * 7 + y * 3 + rng.UniformI(-4, 5);
+      image.channel[2].Row(y)[x] = 40000 - x * y + rng.UniformI(-2, 3);
+    }
+  }
+  std::vector<SqueezeParams> params;
+  DefaultSqueezeParameters(&params, image);
+  JXL_TEST_ASSIGN_OR_DIE(Image single, Image::Clone(image));
+  JXL_TEST_ASSIGN_OR_DIE(Image threaded, Image::Clone(image));
+  test::ThreadPoolForTests pool(4);
+  ASSERT_TRUE(FwdSqueeze(single, params, nullptr));
+  ASSERT_TRUE(FwdSqueeze(threaded, params, pool.get()));
+  ASSERT_EQ(single.channel.size(), threaded.channel.size());
+  for (size_t c = 0; c < single.channel.size(); c++) {
+    std::stringstream failures;
+    EXPECT_TRUE(SamePixels(single.channel[c].plane, threaded.channel[c].plane,
+                           failures))
+        << "c = " << c << ": " << failures.str();
+  }
+  ASSERT_TRUE(InvSqueeze(threaded, params, pool.get()));
+  ASSERT_EQ(image.channel.size(), threaded.channel.size());
+  for (size_t c = 0; c < image.channel.size(); c++) {
+    std::stringstream failures;
+    EXPECT_TRUE(SamePixels(image.channel[c].plane, threaded.channel[c].plane,
+                           failures))
+        << "c = " << c << ": " << failures.str();
+  }
+}
+
 }  // namespace
 }  // namespace jxl
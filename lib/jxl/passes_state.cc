@@ -19,6 +19,21 @@
 
 namespace jxl {
 
+namespace {
+
+// Keeps the buffer of "image" if it already has the requested size, as for the
+// frames of an animation. The contents are only valid once the frame wrote
+// them either way.
+template <typename ImageT>
+Status ReuseOrCreate(JxlMemoryManager* memory_manager, size_t xsize,
+                     size_t ysize, ImageT* image) {
+  if (image->xsize() == xsize && image->ysize() == ysize) return true;
+  JXL_ASSIGN_OR_RETURN(*image, ImageT::Create(memory_manager, xsize, ysize));
+  return true;
+}
+
+}  // namespace
+
 Status InitializePassesSharedState(const FrameHeader& frame_header,
                                    PassesSharedState* JXL_RESTRICT shared,
                                    bool encoder) {
@@ -30,16 +45,14 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
   const FrameDimensions& frame_dim = shared->frame_dim;
   JxlMemoryManager* memory_manager = shared->memory_manager;
 
-  JXL_ASSIGN_OR_RETURN(
-      shared->ac_strategy,
-      AcStrategyImage::Create(memory_manager, frame_dim.xsize_blocks,
-                              frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared->raw_quant_field,
-                       ImageI::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
-  JXL_ASSIGN_OR_RETURN(shared->epf_sharpness,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
+  const size_t xsize_blocks = frame_dim.xsize_blocks;
+  const size_t ysize_blocks = frame_dim.ysize_blocks;
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, xsize_blocks, ysize_blocks,
+                                    &shared->ac_strategy));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, xsize_blocks, ysize_blocks,
+                                    &shared->raw_quant_field));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, xsize_blocks, ysize_blocks,
+                                    &shared->epf_sharpness));
   JXL_ASSIGN_OR_RETURN(
       shared->cmap, ColorCorrelationMap::Create(memory_manager, frame_dim.xsize,
                                                 frame_dim.ysize));
@@ -55,9 +68,8 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
                                 kCoeffOrderMaxSize);
   }
 
-  JXL_ASSIGN_OR_RETURN(shared->quant_dc,
-                       ImageB::Create(memory_manager, frame_dim.xsize_blocks,
-                                      frame_dim.ysize_blocks));
+  JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, xsize_blocks, ysize_blocks,
+                                    &shared->quant_dc));
 
   bool use_dc_frame = ((frame_header.flags & FrameHeader::kUseDcFrame) != 0u);
   if (!encoder && use_dc_frame) {
@@ -75,9 +87,8 @@ Status InitializePassesSharedState(const FrameHeader& frame_header,
     }
     ZeroFillImage(&shared->quant_dc);
   } else {
-    JXL_ASSIGN_OR_RETURN(shared->dc_storage,
-                         Image3F::Create(memory_manager, frame_dim.xsize_blocks,
-                                         frame_dim.ysize_blocks));
+    JXL_RETURN_IF_ERROR(ReuseOrCreate(memory_manager, xsize_blocks,
+                                      ysize_blocks, &shared->dc_storage));
     shared->dc = &shared->dc_storage;
   }
 
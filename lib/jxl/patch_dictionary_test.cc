@@ -25,6 +25,7 @@ using ::jxl::test::ButteraugliDistance;
 using ::jxl::test::GetImage;
 using ::jxl::test::ReadTestData;
 using ::jxl::test::Roundtrip;
+using ::jxl::test::ThreadPoolForTests;
 
 TEST(PatchDictionaryTest, GrayscaleModular) {
   const std::vector<uint8_t> orig = ReadTestData("jxl/grayscale_patches.png");
@@ -61,5 +62,27 @@ TEST(PatchDictionaryTest, GrayscaleVarDCT) {
   EXPECT_LE(ButteraugliDistance(ppf, ppf2), 1.1);
 }
 
+TEST(PatchDictionaryTest, GrayscaleModularThreads) {
+  const std::vector<uint8_t> orig = ReadTestData("jxl/grayscale_patches.png");
+  extras::PackedPixelFile ppf;
+  ASSERT_TRUE(DecodeBytes(Bytes(orig), jxl::extras::ColorHints(), &ppf));
+
+  extras::JXLCompressParams cparams = jxl::test::CompressParamsForLossless();
+  cparams.AddOption(JXL_ENC_FRAME_SETTING_PATCHES, 1);
+  extras::JXLDecompressParams dparams;
+
+  // The patches are found in stripes of rows by several threads, and must be
+  // the same as those found by one thread.
+  extras::PackedPixelFile ppf2;
+  size_t compressed_size = Roundtrip(ppf, cparams, dparams, nullptr, &ppf2);
+  ThreadPoolForTests pool(8);
+  extras::PackedPixelFile ppf3;
+  EXPECT_EQ(compressed_size,
+            Roundtrip(ppf, cparams, dparams, pool.get(), &ppf3));
+  JXL_TEST_ASSIGN_OR_DIE(ImageF image, GetImage(ppf));
+  JXL_TEST_ASSIGN_OR_DIE(ImageF image3, GetImage(ppf3));
+  JXL_TEST_ASSERT_OK(VerifyRelativeError(image, image3, 1e-7f, 0, _));
+}
+
 }  // namespace
 }  // namespace jxl
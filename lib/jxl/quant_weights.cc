@@ -6,10 +6,12 @@
 
 #include <jxl/memory_manager.h>
 
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <mutex>
 #include <vector>
 
 #include "lib/jxl/ac_strategy.h"
@@ -25,6 +27,7 @@
 
 #undef HWY_TARGET_INCLUDE
 #define HWY_TARGET_INCLUDE "lib/jxl/quant_weights.cc"
+#include <hwy/aligned_allocator.h>
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
@@ -1189,36 +1192,49 @@ const QuantEncoding* DequantMatrices::Library() {
 
 DequantMatrices::DequantMatrices() {
   encodings_.resize(kNumQuantTables, QuantEncoding::Library<0>());
-  size_t pos = 0;
-  size_t offsets[kNumQuantTables * 3];
-  for (size_t i = 0; i < static_cast<size_t>(kNumQuantTables); i++) {
-    size_t num = required_size_x[i] * required_size_y[i] * kDCTBlockSize;
-    for (size_t c = 0; c < 3; c++) {
-      offsets[3 * i + c] = pos + c * num;
-    }
-    pos += 3 * num;
-  }
-  for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
-    for (size_t c = 0; c < 3; c++) {
-      table_offsets_[i * 3 + c] =
-          offsets[static_cast<size_t>(kAcStrategyToQuantTableMap[i]) * 3 + c];
-    }
-  }
 }
 
+namespace {
+
+// Tables of the library encodings, which are the same for every image, and
+// their inverses, computed on first use. Never freed.
+struct LibraryTables {
+  std::mutex mutex;
+  std::atomic<const float*> tables[kNumQuantTables];
+};
+
+LibraryTables* GetLibraryTables() {
+  static LibraryTables* const tables = new LibraryTables();
+  return tables;
+}
+
+// Returns 2 * `size` floats: the table `table` of the library, for the three
+// channels, followed by its inverse.
+StatusOr<const float*> LibraryTable(size_t table, size_t size) {
+  LibraryTables* library_tables = GetLibraryTables();
+  std::atomic<const float*>& entry = library_tables->tables[table];
+  const float* result = entry.load(std::memory_order_acquire);
+  if (result != nullptr) return result;
+  std::lock_guard<std::mutex> lock(library_tables->mutex);
+  result = entry.load(std::memory_order_relaxed);
+  if (result != nullptr) return result;
+  hwy::AlignedFreeUniquePtr<float[]> storage =
+      hwy::AllocateAligned<float>(2 * size);
+  if (!storage) return JXL_FAILURE("Failed to allocate library table");
+  size_t offset = 0;
+  JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+      DequantMatrices::Library()[table], storage.get(), storage.get() + size,
+      table, QuantTable(table), &offset));
+  JXL_ENSURE(offset == size);
+  result = storage.release();
+  entry.store(result, std::memory_order_release);
+  return result;
+}
+
+}  // namespace
+
 Status DequantMatrices::EnsureComputed(JxlMemoryManager* memory_manager,
                                        uint32_t acs_mask) {
-  const QuantEncoding* library = Library();
-
-  if (!table_storage_) {
-    size_t table_storage_bytes = 2 * kTotalTableSize * sizeof(float);
-    JXL_ASSIGN_OR_RETURN(
-        table_storage_,
-        AlignedMemory::Create(memory_manager, table_storage_bytes));
-    table_ = table_storage_.address<float>();
-    inv_table_ = table_ + kTotalTableSize;
-  }
-
   size_t offsets[kNumQuantTables * 3 + 1];
   size_t pos = 0;
   for (size_t i = 0; i < kNumQuantTables; i++) {
@@ -1244,21 +1260,41 @@ Status DequantMatrices::EnsureComputed(JxlMemoryManager* memory_manager,
           1u << static_cast<uint32_t>(kAcStrategyToQuantTableMap[i]);
     }
   }
+  // Start of the table and of the inverse table of each quant table.
+  const float* tables[kNumQuantTables] = {};
+  const float* inv_tables[kNumQuantTables] = {};
   for (size_t table = 0; table < kNumQuantTables; table++) {
     if ((1 << table) & computed_kind_mask) continue;
     if ((1 << table) & ~kind_mask) continue;
-    size_t offset = offsets[table * 3];
-    float* mutable_table = table_storage_.address<float>();
+    const size_t size = offsets[table * 3 + 3] - offsets[table * 3];
     if (encodings_[table].mode == QuantEncoding::kQuantModeLibrary) {
-      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          library[table], mutable_table, mutable_table + kTotalTableSize, table,
-          QuantTable(table), &offset));
-    } else {
-      JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
-          encodings_[table], mutable_table, mutable_table + kTotalTableSize,
-          table, QuantTable(table), &offset));
+      JXL_ASSIGN_OR_RETURN(tables[table], LibraryTable(table, size));
+      inv_tables[table] = tables[table] + size;
+      continue;
+    }
+    if (!table_storage_) {
+      size_t table_storage_bytes = 2 * kTotalTableSize * sizeof(float);
+      JXL_ASSIGN_OR_RETURN(
+          table_storage_,
+          AlignedMemory::Create(memory_manager, table_storage_bytes));
     }
+    size_t offset = offsets[table * 3];
+    float* mutable_table = table_storage_.address<float>();
+    JXL_RETURN_IF_ERROR(HWY_DYNAMIC_DISPATCH(ComputeQuantTable)(
+        encodings_[table], mutable_table, mutable_table + kTotalTableSize,
+        table, QuantTable(table), &offset));
     JXL_ENSURE(offset == offsets[table * 3 + 3]);
+    tables[table] = mutable_table + offsets[table * 3];
+    inv_tables[table] = tables[table] + kTotalTableSize;
+  }
+  for (size_t i = 0; i < AcStrategy::kNumValidStrategies; i++) {
+    const size_t table = static_cast<size_t>(kAcStrategyToQuantTableMap[i]);
+    if (tables[table] == nullptr) continue;
+    for (size_t c = 0; c < 3; c++) {
+      const size_t channel_offset = offsets[table * 3 + c] - offsets[table * 3];
+      matrices_[i * 3 + c] = tables[table] + channel_offset;
+      inv_matrices_[i * 3 + c] = inv_tables[table] + channel_offset;
+    }
   }
   computed_mask_ |= acs_mask;
 
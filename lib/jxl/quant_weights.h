@@ -370,13 +370,13 @@ class DequantMatrices {
   // Returns aligned memory.
   JXL_INLINE const float* Matrix(AcStrategyType quant_kind, size_t c) const {
     JXL_DASSERT((1 << static_cast<uint32_t>(quant_kind)) & computed_mask_);
-    return &table_[table_offsets_[static_cast<size_t>(quant_kind) * 3 + c]];
+    return matrices_[static_cast<size_t>(quant_kind) * 3 + c];
   }
 
   JXL_INLINE const float* InvMatrix(AcStrategyType quant_kind, size_t c) const {
     size_t quant_table_idx = static_cast<uint32_t>(quant_kind);
     JXL_DASSERT((1 << quant_table_idx) & computed_mask_);
-    return &inv_table_[table_offsets_[quant_table_idx * 3 + c]];
+    return inv_matrices_[quant_table_idx * 3 + c];
   }
 
   // DC quants are used in modular mode for XYB multipliers.
@@ -418,19 +418,24 @@ class DequantMatrices {
   // MUST be equal `sum(dot(required_size_x, required_size_y))`.
   static constexpr size_t kSumRequiredXy = 2056;
 
+  // Computes the tables of the strategies in `acs_mask` that are not computed
+  // yet. Tables with the default (library) encoding are computed once per
+  // process and shared by all the instances; the others are stored in memory
+  // allocated from `memory_manager`.
   Status EnsureComputed(JxlMemoryManager* memory_manager, uint32_t acs_mask);
 
  private:
   static constexpr size_t kTotalTableSize = kSumRequiredXy * kDCTBlockSize * 3;
 
   uint32_t computed_mask_ = 0;
-  // kTotalTableSize entries followed by kTotalTableSize for inv_table
+  // kTotalTableSize entries followed by kTotalTableSize for inv_table, for the
+  // tables that are not shared. Allocated on first use.
   AlignedMemory table_storage_;
-  const float* table_;
-  const float* inv_table_;
+  // Start of the table and inverse table of every channel of every strategy.
+  const float* matrices_[AcStrategy::kNumValidStrategies * 3] = {};
+  const float* inv_matrices_[AcStrategy::kNumValidStrategies * 3] = {};
   float dc_quant_[3] = {kDCQuant[0], kDCQuant[1], kDCQuant[2]};
   float inv_dc_quant_[3] = {kInvDCQuant[0], kInvDCQuant[1], kInvDCQuant[2]};
-  size_t table_offsets_[AcStrategy::kNumValidStrategies * 3];
   std::vector<QuantEncoding> encodings_;
 };
 
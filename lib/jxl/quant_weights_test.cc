@@ -137,6 +137,33 @@ TEST(QuantWeightsTest, AllDefault) {
   RoundtripMatrices(encodings);
 }
 
+TEST(QuantWeightsTest, LibraryTablesAreShared) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const AcStrategyType dct = AcStrategyType::DCT;
+  DequantMatrices dct_only;
+  ASSERT_TRUE(
+      dct_only.EnsureComputed(memory_manager, AcStrategy::TypeBit(dct)));
+  DequantMatrices all;
+  ASSERT_TRUE(all.EnsureComputed(memory_manager, ~0u));
+  // Same encodings of the tables, but not marked as coming from the library.
+  std::vector<QuantEncoding> encodings(kNumQuantTables,
+                                       QuantEncoding::Library<0>());
+  encodings[static_cast<size_t>(QuantTable::DCT)] =
+      DequantMatrices::Library()[static_cast<size_t>(QuantTable::DCT)];
+  DequantMatrices custom;
+  custom.SetEncodings(encodings);
+  ASSERT_TRUE(custom.EnsureComputed(memory_manager, AcStrategy::TypeBit(dct)));
+  for (size_t c = 0; c < 3; c++) {
+    EXPECT_EQ(dct_only.Matrix(dct, c), all.Matrix(dct, c));
+    EXPECT_EQ(dct_only.InvMatrix(dct, c), all.InvMatrix(dct, c));
+    EXPECT_NE(dct_only.Matrix(dct, c), custom.Matrix(dct, c));
+    for (size_t i = 0; i < kDCTBlockSize; i++) {
+      EXPECT_EQ(dct_only.Matrix(dct, c)[i], custom.Matrix(dct, c)[i]);
+      EXPECT_EQ(dct_only.InvMatrix(dct, c)[i], custom.InvMatrix(dct, c)[i]);
+    }
+  }
+}
+
 void TestSingleQuantMatrix(QuantTable kind) {
   std::vector<QuantEncoding> encodings(kNumQuantTables,
                                        QuantEncoding::Library<0>());
@@ -0,0 +1,98 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/render_pipeline/gpu_offload.h"
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/common.h"  // JPEGXL_ENABLE_CUDA
+#include "lib/jxl/image.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+
+#if JPEGXL_ENABLE_CUDA
+#include "lib/jxl/render_pipeline/gpu_offload_kernels.h"
+#endif
+
+namespace jxl {
+
+#if JPEGXL_ENABLE_CUDA
+namespace {
+
+CudaPlane PlaneOf(ImageF* image) {
+  return {image->Row(kRenderPipelineXOffset) + kRenderPipelineXOffset,
+          image->PixelsPerRow()};
+}
+
+StatusOr<bool> ToResult(CudaStatus status) {
+  if (status == CudaStatus::kError) {
+    return JXL_FAILURE("CUDA error while reading back the stage output");
+  }
+  return status == CudaStatus::kOk;
+}
+
+class GPURenderPipelineOffload : public RenderPipelineOffload {
+ public:
+  StatusOr<bool> RunStage(
+      const OffloadKernel& kernel, const std::vector<ImageF*>& channels,
+      const std::vector<ImageF*>& outputs,
+      const std::vector<std::pair<size_t, size_t>>& input_sizes) override {
+    switch (kernel.type) {
+      case OffloadKernel::Type::kXYB:
+      case OffloadKernel::Type::kGaborish: {
+        // The color channels have the same size when converted or filtered.
+        if (input_sizes[1] != input_sizes[0] ||
+            input_sizes[2] != input_sizes[0]) {
+          return false;
+        }
+        const size_t xsize = input_sizes[0].first;
+        const size_t ysize = input_sizes[0].second;
+        CudaPlane planes[3];
+        for (size_t c = 0; c < 3; c++) planes[c] = PlaneOf(channels[c]);
+        if (kernel.type == OffloadKernel::Type::kXYB) {
+          return ToResult(CudaRunXYB(kernel.inverse_opsin_matrix,
+                                     kernel.opsin_biases,
+                                     kernel.opsin_biases_cbrt, planes, xsize,
+                                     ysize));
+        }
+        CudaPlane out[3];
+        for (size_t c = 0; c < 3; c++) {
+          JXL_ENSURE(outputs[c] != nullptr);
+          out[c] = PlaneOf(outputs[c]);
+        }
+        return ToResult(CudaRunGaborish(kernel.gaborish_weights, planes, out,
+                                        xsize, ysize));
+      }
+      case OffloadKernel::Type::kUpsampling: {
+        const size_t c = kernel.upsampling_c;
+        JXL_ENSURE(outputs[c] != nullptr);
+        return ToResult(CudaRunUpsampling(
+            &kernel.upsampling_weights[0][0], kernel.upsampling_shift,
+            PlaneOf(channels[c]), PlaneOf(outputs[c]), input_sizes[c].first,
+            input_sizes[c].second));
+      }
+    }
+    return false;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<RenderPipelineOffload> CreateGPURenderPipelineOffload() {
+  if (!CudaDeviceAvailable()) return nullptr;
+  return jxl::make_unique<GPURenderPipelineOffload>();
+}
+#else
+std::unique_ptr<RenderPipelineOffload> CreateGPURenderPipelineOffload() {
+  return nullptr;
+}
+#endif  // JPEGXL_ENABLE_CUDA
+
+}  // namespace jxl
@@ -0,0 +1,22 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_H_
+#define LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_H_
+
+#include <memory>
+
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
+
+namespace jxl {
+
+// Returns an offload that runs the XYB, Gaborish and upsampling stages with
+// CUDA, or nullptr if libjxl is built without JPEGXL_ENABLE_CUDA or there is
+// no CUDA device.
+std::unique_ptr<RenderPipelineOffload> CreateGPURenderPipelineOffload();
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_H_
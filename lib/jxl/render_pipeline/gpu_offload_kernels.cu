@@ -0,0 +1,235 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/render_pipeline/gpu_offload_kernels.h"
+
+#include <cuda_runtime.h>
+
+#include <cstddef>
+#include <memory>
+
+namespace jxl {
+
+namespace {
+
+constexpr unsigned kBlockX = 32;
+constexpr unsigned kBlockY = 8;
+
+// A pitched buffer of floats on the device.
+class DeviceImage {
+ public:
+  DeviceImage(size_t xsize, size_t ysize) : xsize_(xsize), ysize_(ysize) {
+    size_t pitch = 0;
+    if (cudaMallocPitch(reinterpret_cast<void**>(&data_), &pitch,
+                        xsize * sizeof(float), ysize) != cudaSuccess) {
+      data_ = nullptr;
+    }
+    stride_ = pitch / sizeof(float);
+  }
+  DeviceImage(const DeviceImage&) = delete;
+  DeviceImage& operator=(const DeviceImage&) = delete;
+  ~DeviceImage() {
+    if (data_ != nullptr) cudaFree(data_);
+  }
+
+  bool ok() const { return data_ != nullptr; }
+  float* data() const { return data_; }
+  std::ptrdiff_t stride() const { return stride_; }
+
+  // Copies the xsize_ * ysize_ floats whose first one is at `host`.
+  bool Upload(const float* host, std::ptrdiff_t host_stride) {
+    return cudaMemcpy2D(data_, stride_ * sizeof(float), host,
+                        host_stride * sizeof(float), xsize_ * sizeof(float),
+                        ysize_, cudaMemcpyHostToDevice) == cudaSuccess;
+  }
+  bool Download(float* host, std::ptrdiff_t host_stride) const {
+    return cudaMemcpy2D(host, host_stride * sizeof(float), data_,
+                        stride_ * sizeof(float), xsize_ * sizeof(float),
+                        ysize_, cudaMemcpyDeviceToHost) == cudaSuccess;
+  }
+
+ private:
+  float* data_ = nullptr;
+  std::ptrdiff_t stride_ = 0;
+  size_t xsize_;
+  size_t ysize_;
+};
+
+dim3 GridFor(size_t xsize, size_t ysize) {
+  return dim3(static_cast<unsigned>((xsize + kBlockX - 1) / kBlockX),
+              static_cast<unsigned>((ysize + kBlockY - 1) / kBlockY));
+}
+
+bool LaunchSucceeded() {
+  return cudaGetLastError() == cudaSuccess &&
+         cudaDeviceSynchronize() == cudaSuccess;
+}
+
+struct XYBParams {
+  float m[9];
+  float bias[3];
+  float bias_cbrt[3];
+};
+
+__global__ void XYBKernel(XYBParams p, float* plane_x, float* plane_y,
+                          float* plane_b, std::ptrdiff_t stride, size_t xsize,
+                          size_t ysize) {
+  const size_t x = blockIdx.x * blockDim.x + threadIdx.x;
+  const size_t y = blockIdx.y * blockDim.y + threadIdx.y;
+  if (x >= xsize || y >= ysize) return;
+  const std::ptrdiff_t i = y * stride + x;
+  const float opsin_x = plane_x[i];
+  const float opsin_y = plane_y[i];
+  const float opsin_b = plane_b[i];
+  const float gamma_r = opsin_y + opsin_x - p.bias_cbrt[0];
+  const float gamma_g = opsin_y - opsin_x - p.bias_cbrt[1];
+  const float gamma_b = opsin_b - p.bias_cbrt[2];
+  const float mixed_r = fmaf(gamma_r * gamma_r, gamma_r, p.bias[0]);
+  const float mixed_g = fmaf(gamma_g * gamma_g, gamma_g, p.bias[1]);
+  const float mixed_b = fmaf(gamma_b * gamma_b, gamma_b, p.bias[2]);
+  plane_x[i] = fmaf(p.m[2], mixed_b, fmaf(p.m[1], mixed_g, p.m[0] * mixed_r));
+  plane_y[i] = fmaf(p.m[5], mixed_b, fmaf(p.m[4], mixed_g, p.m[3] * mixed_r));
+  plane_b[i] = fmaf(p.m[8], mixed_b, fmaf(p.m[7], mixed_g, p.m[6] * mixed_r));
+}
+
+// `input` points to the pixel (-1, -1).
+__global__ void GaborishKernel(float w0, float w1, float w2,
+                               const float* input, std::ptrdiff_t in_stride,
+                               float* output, std::ptrdiff_t out_stride,
+                               size_t xsize, size_t ysize) {
+  const size_t x = blockIdx.x * blockDim.x + threadIdx.x;
+  const size_t y = blockIdx.y * blockDim.y + threadIdx.y;
+  if (x >= xsize || y >= ysize) return;
+  const float* c = input + (y + 1) * in_stride + x + 1;
+  const float sum1 = (c[-1] + c[1]) + (c[-in_stride] + c[in_stride]);
+  const float sum2 = (c[-in_stride - 1] + c[-in_stride + 1]) +
+                     (c[in_stride - 1] + c[in_stride + 1]);
+  output[y * out_stride + x] = fmaf(sum2, w2, fmaf(sum1, w1, c[0] * w0));
+}
+
+// `input` points to the pixel (-2, -2). Each thread computes the n * n output
+// pixels of one input pixel.
+__global__ void UpsamplingKernel(const float* weights, size_t n,
+                                 const float* input, std::ptrdiff_t in_stride,
+                                 float* output, std::ptrdiff_t out_stride,
+                                 size_t xsize, size_t ysize) {
+  const size_t x = blockIdx.x * blockDim.x + threadIdx.x;
+  const size_t y = blockIdx.y * blockDim.y + threadIdx.y;
+  if (x >= xsize || y >= ysize) return;
+  const float* c = input + (y + 2) * in_stride + x + 2;
+  float in[25];
+  float min = c[0];
+  float max = c[0];
+  for (int iy = -2; iy <= 2; iy++) {
+    for (int ix = -2; ix <= 2; ix++) {
+      const float v = c[iy * in_stride + ix];
+      in[(iy + 2) * 5 + ix + 2] = v;
+      min = fminf(v, min);
+      max = fmaxf(v, max);
+    }
+  }
+  for (size_t oy = 0; oy < n; oy++) {
+    float* row = output + (y * n + oy) * out_stride + x * n;
+    for (size_t ox = 0; ox < n; ox++) {
+      const float* w = weights + (oy * n + ox) * 25;
+      float result = w[0] * in[0];
+      for (size_t k = 1; k < 25; k++) {
+        result = fmaf(w[k], in[k], result);
+      }
+      row[ox] = fminf(fmaxf(result, min), max);
+    }
+  }
+}
+
+}  // namespace
+
+bool CudaDeviceAvailable() {
+  int count = 0;
+  return cudaGetDeviceCount(&count) == cudaSuccess && count > 0;
+}
+
+CudaStatus CudaRunXYB(const float inverse_opsin_matrix[9],
+                      const float opsin_biases[3],
+                      const float opsin_biases_cbrt[3],
+                      const CudaPlane planes[3], size_t xsize, size_t ysize) {
+  XYBParams params;
+  for (size_t i = 0; i < 9; i++) params.m[i] = inverse_opsin_matrix[i];
+  for (size_t c = 0; c < 3; c++) {
+    params.bias[c] = opsin_biases[c];
+    params.bias_cbrt[c] = opsin_biases_cbrt[c];
+  }
+  DeviceImage x(xsize, ysize);
+  DeviceImage y(xsize, ysize);
+  DeviceImage b(xsize, ysize);
+  // Images of the same size have the same pitch.
+  if (!x.ok() || !y.ok() || !b.ok() || x.stride() != y.stride() ||
+      x.stride() != b.stride()) {
+    return CudaStatus::kNotRun;
+  }
+  DeviceImage* device[3] = {&x, &y, &b};
+  for (size_t c = 0; c < 3; c++) {
+    if (!device[c]->Upload(planes[c].pixels, planes[c].stride)) {
+      return CudaStatus::kNotRun;
+    }
+  }
+  XYBKernel<<<GridFor(xsize, ysize), dim3(kBlockX, kBlockY)>>>(
+      params, x.data(), y.data(), b.data(), x.stride(), xsize, ysize);
+  if (!LaunchSucceeded()) return CudaStatus::kNotRun;
+  for (size_t c = 0; c < 3; c++) {
+    if (!device[c]->Download(planes[c].pixels, planes[c].stride)) {
+      return CudaStatus::kError;
+    }
+  }
+  return CudaStatus::kOk;
+}
+
+CudaStatus CudaRunGaborish(const float weights[9], const CudaPlane input[3],
+                           const CudaPlane output[3], size_t xsize,
+                           size_t ysize) {
+  std::unique_ptr<DeviceImage> in[3];
+  std::unique_ptr<DeviceImage> out[3];
+  for (size_t c = 0; c < 3; c++) {
+    in[c].reset(new DeviceImage(xsize + 2, ysize + 2));
+    out[c].reset(new DeviceImage(xsize, ysize));
+    if (!in[c]->ok() || !out[c]->ok() ||
+        !in[c]->Upload(input[c].pixels - input[c].stride - 1,
+                       input[c].stride)) {
+      return CudaStatus::kNotRun;
+    }
+  }
+  for (size_t c = 0; c < 3; c++) {
+    GaborishKernel<<<GridFor(xsize, ysize), dim3(kBlockX, kBlockY)>>>(
+        weights[3 * c], weights[3 * c + 1], weights[3 * c + 2], in[c]->data(),
+        in[c]->stride(), out[c]->data(), out[c]->stride(), xsize, ysize);
+  }
+  if (!LaunchSucceeded()) return CudaStatus::kNotRun;
+  for (size_t c = 0; c < 3; c++) {
+    if (!out[c]->Download(output[c].pixels, output[c].stride)) {
+      return CudaStatus::kError;
+    }
+  }
+  return CudaStatus::kOk;
+}
+
+CudaStatus CudaRunUpsampling(const float* weights, size_t shift,
+                             CudaPlane input, CudaPlane output, size_t xsize,
+                             size_t ysize) {
+  const size_t n = size_t{1} << shift;
+  DeviceImage w(n * n * 25, 1);
+  DeviceImage in(xsize + 4, ysize + 4);
+  DeviceImage out(xsize * n, ysize * n);
+  if (!w.ok() || !in.ok() || !out.ok() || !w.Upload(weights, n * n * 25) ||
+      !in.Upload(input.pixels - 2 * input.stride - 2, input.stride)) {
+    return CudaStatus::kNotRun;
+  }
+  UpsamplingKernel<<<GridFor(xsize, ysize), dim3(kBlockX, kBlockY)>>>(
+      w.data(), n, in.data(), in.stride(), out.data(), out.stride(), xsize,
+      ysize);
+  if (!LaunchSucceeded()) return CudaStatus::kNotRun;
+  if (!out.Download(output.pixels, output.stride)) return CudaStatus::kError;
+  return CudaStatus::kOk;
+}
+
+}  // namespace jxl
@@ -0,0 +1,56 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_KERNELS_H_
+#define LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_KERNELS_H_
+
+// Interface to the CUDA kernels of gpu_offload_kernels.cu, which is only
+// built with JPEGXL_ENABLE_CUDA. It does not depend on other headers of
+// libjxl, so that the kernels are compiled by the CUDA compiler alone.
+
+#include <cstddef>
+
+namespace jxl {
+
+// A plane on the host: its pixel (0, 0), and the number of floats per row.
+struct CudaPlane {
+  float* pixels;
+  std::ptrdiff_t stride;
+};
+
+enum class CudaStatus {
+  kOk,
+  // A CUDA error occurred before any output plane was written.
+  kNotRun,
+  // A CUDA error occurred while copying the output planes back.
+  kError,
+};
+
+// Whether there is a CUDA device to run the kernels on.
+bool CudaDeviceAvailable();
+
+// The functions below copy the planes they read to the device, and the planes
+// they write back to the host once all the kernels ran.
+
+// XYB to linear RGB, in place, as XybToRgb.
+CudaStatus CudaRunXYB(const float inverse_opsin_matrix[9],
+                      const float opsin_biases[3],
+                      const float opsin_biases_cbrt[3],
+                      const CudaPlane planes[3], size_t xsize, size_t ysize);
+
+// Gaborish convolution of three planes, which have a border of 1.
+CudaStatus CudaRunGaborish(const float weights[9], const CudaPlane input[3],
+                           const CudaPlane output[3], size_t xsize,
+                           size_t ysize);
+
+// Upsampling by 2^shift of a plane with a border of 2, with the weights of
+// GetUpsamplingStage.
+CudaStatus CudaRunUpsampling(const float* weights, size_t shift,
+                             CudaPlane input, CudaPlane output, size_t xsize,
+                             size_t ysize);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_RENDER_PIPELINE_GPU_OFFLOAD_KERNELS_H_
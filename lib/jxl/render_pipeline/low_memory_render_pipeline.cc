@@ -16,13 +16,93 @@
 #include "lib/jxl/base/bits.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"  // ssize_t
+#include "lib/jxl/base/os_macros.h"
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
+#if JXL_OS_LINUX
+#include <unistd.h>
+#endif
+
 namespace jxl {
+
+namespace {
+
+// Column strips are a multiple of this many pixels of the color channels wide,
+// which keeps the rows of all channels and stages aligned.
+constexpr size_t kStripXAlign = 64;
+
+// Size of the L2 cache of the CPU, or a typical one if it is unknown.
+size_t L2CacheSize() {
+#if JXL_OS_LINUX && defined(_SC_LEVEL2_CACHE_SIZE)
+  const long size = sysconf(_SC_LEVEL2_CACHE_SIZE);  // NOLINT
+  if (size > 0) return size;
+#endif
+  return 256 << 10;
+}
+
+}  // namespace
+
+void LowMemoryRenderPipeline::UseColumnStrips(size_t cache_size) {
+  // The group data and the decoder's own buffers share the cache with the
+  // stage rows, so the latter only get half of a detected cache.
+  strip_cache_size_ = cache_size != 0 ? cache_size : L2CacheSize() / 2;
+}
+
+std::vector<size_t> LowMemoryRenderPipeline::StageBufferYSizes(
+    size_t c) const {
+  std::vector<size_t> ysizes(stages_.size());
+  size_t next_y_border = 0;
+  for (size_t i = stages_.size(); i-- > 0;) {
+    if (stages_[i]->GetChannelMode(c) == RenderPipelineChannelMode::kInOut) {
+      size_t stage_buffer_ysize =
+          2 * next_y_border + (1 << stages_[i]->settings_.shift_y);
+      ysizes[i] = 1 << CeilLog2Nonzero(stage_buffer_ysize);
+      next_y_border = stages_[i]->settings_.border_y;
+    }
+  }
+  return ysizes;
+}
+
+size_t LowMemoryRenderPipeline::StripXSize() const {
+  if (strip_cache_size_ == 0) return 0;
+  // Bytes of the rows that are live while rendering a strip of kStripXAlign
+  // color channel pixels: the stage buffers and the input rows of the stages
+  // reading the group data.
+  const size_t strip_xsize_upsampled = kStripXAlign << base_color_shift_;
+  size_t bytes = 0;
+  for (size_t c = 0; c < channel_shifts_[0].size(); c++) {
+    const std::vector<size_t> ysizes = StageBufferYSizes(c);
+    bool reads_input = true;
+    for (size_t i = 0; i < stages_.size(); i++) {
+      const RenderPipelineChannelMode mode = stages_[i]->GetChannelMode(c);
+      if (mode == RenderPipelineChannelMode::kIgnored) continue;
+      if (reads_input) {
+        bytes += sizeof(float) * (2 * stages_[i]->settings_.border_y + 1) *
+                 DivCeil(strip_xsize_upsampled,
+                         size_t{1} << channel_shifts_[i][c].first);
+        reads_input = false;
+      }
+      if (mode == RenderPipelineChannelMode::kInOut) {
+        bytes += sizeof(float) * ysizes[i] *
+                 DivCeil(strip_xsize_upsampled,
+                         size_t{1} << channel_shifts_[i + 1][c].first);
+      }
+    }
+  }
+  const size_t strip_xsize =
+      std::max<size_t>(strip_cache_size_ / std::max<size_t>(bytes, 1), 1) *
+      kStripXAlign;
+  // Groups that fit are rendered in full, without the overlap of strips.
+  if (strip_xsize >= frame_dimensions_.group_dim + 2 * group_border_.first) {
+    return 0;
+  }
+  return strip_xsize;
+}
+
 std::pair<size_t, size_t>
 LowMemoryRenderPipeline::ColorDimensionsToChannelDimensions(
     std::pair<size_t, size_t> in, size_t c, size_t stage) const {
@@ -193,6 +273,7 @@ Status LowMemoryRenderPipeline::EnsureBordersStorage() {
     borders_vertical_.resize(shifts.size());
   }
   for (size_t c = 0; c < shifts.size(); c++) {
+    if (!channel_is_used_[c]) continue;
     auto borders = BorderToStore(c);
     size_t borderx = borders.first;
     size_t bordery = borders.second;
@@ -262,6 +343,10 @@ Status LowMemoryRenderPipeline::Init() {
   constexpr size_t kGroupXAlign = 16;
 #endif
   group_border_.first = RoundUpTo(group_border_.first, kGroupXAlign);
+  // Ensure that the rects rendered in a group start and end on even rows, so
+  // that both rows of the 2x2 blocks of 4:2:0 planar output are rendered
+  // together.
+  group_border_.second = RoundUpTo(group_border_.second, 2);
   // Allocate borders in group images that are just enough for storing the
   // borders to be copied in, plus any rounding to ensure alignment.
   std::pair<size_t, size_t> max_border = {0, 0};
@@ -309,6 +394,11 @@ Status LowMemoryRenderPipeline::Init() {
       break;
     }
   }
+  // The parts of the image outside of the frame are rendered with the groups
+  // that are next to them.
+  if (defer_rendering_ && first_image_dim_stage_ != stages_.size()) {
+    return JXL_FAILURE("Cannot defer rendering when switching to image size");
+  }
   for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
     if (stages_[i]->SwitchToImageDimensions()) {
       return JXL_UNREACHABLE(
@@ -373,50 +463,47 @@ Status LowMemoryRenderPipeline::Init() {
       }
     }
   }
+  strip_xsize_ = StripXSize();
   return true;
 }
 
 Status LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
                                                           bool use_group_ids) {
   const auto& shifts = channel_shifts_[0];
-  use_group_ids_ = use_group_ids;
+  // Deferred rendering needs the input of all the groups.
+  use_group_ids_ = use_group_ids || defer_rendering_;
   size_t num_buffers = use_group_ids_ ? frame_dimensions_.num_groups : num;
   for (size_t t = group_data_.size(); t < num_buffers; t++) {
     group_data_.emplace_back();
     group_data_[t].resize(shifts.size());
     for (size_t c = 0; c < shifts.size(); c++) {
+      if (!channel_is_used_[c]) continue;
       JXL_ASSIGN_OR_RETURN(
           group_data_[t][c],
-          ImageF::Create(memory_manager_,
-                         GroupInputXSize(c) + group_data_x_border_ * 2,
-                         GroupInputYSize(c) + group_data_y_border_ * 2,
-                         kRenderPipelineXOffset));
+          CreateBuffer(GroupInputXSize(c) + group_data_x_border_ * 2,
+                       GroupInputYSize(c) + group_data_y_border_ * 2,
+                       kRenderPipelineXOffset));
     }
   }
-  // TODO(veluca): avoid reallocating buffers if not needed.
-  stage_data_.resize(num);
+  // The buffers of earlier calls are kept, only those of new threads are
+  // allocated.
+  const size_t first_new_thread = stage_data_.size();
+  if (num > first_new_thread) stage_data_.resize(num);
   size_t upsampling = 1u << base_color_shift_;
   size_t group_dim = frame_dimensions_.group_dim * upsampling;
   size_t padding =
       2 * group_data_x_border_ * upsampling +  // maximum size of a rect
       2 * kRenderPipelineXOffset;              // extra padding for processing
   size_t stage_buffer_xsize = group_dim + padding;
-  for (size_t t = 0; t < num; t++) {
+  for (size_t t = first_new_thread; t < num; t++) {
     stage_data_[t].resize(shifts.size());
     for (size_t c = 0; c < shifts.size(); c++) {
       stage_data_[t][c].resize(stages_.size());
-      size_t next_y_border = 0;
-      for (size_t i = stages_.size(); i-- > 0;) {
-        if (stages_[i]->GetChannelMode(c) ==
-            RenderPipelineChannelMode::kInOut) {
-          size_t stage_buffer_ysize =
-              2 * next_y_border + (1 << stages_[i]->settings_.shift_y);
-          stage_buffer_ysize = 1 << CeilLog2Nonzero(stage_buffer_ysize);
-          next_y_border = stages_[i]->settings_.border_y;
-          JXL_ASSIGN_OR_RETURN(
-              stage_data_[t][c][i],
-              ImageF::Create(memory_manager_, stage_buffer_xsize,
-                             stage_buffer_ysize));
+      const std::vector<size_t> ysizes = StageBufferYSizes(c);
+      for (size_t i = 0; i < stages_.size(); i++) {
+        if (ysizes[i] != 0) {
+          JXL_ASSIGN_OR_RETURN(stage_data_[t][c][i],
+                               CreateBuffer(stage_buffer_xsize, ysizes[i]));
         }
       }
     }
@@ -436,16 +523,35 @@ Status LowMemoryRenderPipeline::PrepareForThreadsInternal(size_t num,
     size_t out_of_frame_xsize =
         padding +
         std::max(left_padding, std::max(middle_padding, right_padding));
-    out_of_frame_data_.resize(num);
-    for (size_t t = 0; t < num; t++) {
-      JXL_ASSIGN_OR_RETURN(
-          out_of_frame_data_[t],
-          ImageF::Create(memory_manager_, out_of_frame_xsize, shifts.size()));
+    if (num > first_new_thread) out_of_frame_data_.resize(num);
+    for (size_t t = first_new_thread; t < num; t++) {
+      JXL_ASSIGN_OR_RETURN(out_of_frame_data_[t],
+                           CreateBuffer(out_of_frame_xsize, shifts.size()));
     }
   }
   return true;
 }
 
+void LowMemoryRenderPipeline::ReleaseBuffers(
+    std::vector<SpareBuffer>* buffers) {
+  const auto release = [buffers](ImageF* image, size_t pre_padding) {
+    if (image->xsize() == 0) return;
+    buffers->push_back({std::move(*image), pre_padding});
+  };
+  for (auto& group_data : group_data_) {
+    for (ImageF& image : group_data) release(&image, kRenderPipelineXOffset);
+  }
+  for (auto& thread_data : stage_data_) {
+    for (auto& channel_data : thread_data) {
+      for (ImageF& image : channel_data) release(&image, 0);
+    }
+  }
+  for (ImageF& image : out_of_frame_data_) release(&image, 0);
+  group_data_.clear();
+  stage_data_.clear();
+  out_of_frame_data_.clear();
+}
+
 std::vector<std::pair<ImageF*, Rect>> LowMemoryRenderPipeline::PrepareBuffers(
     size_t group_id, size_t thread_id) {
   std::vector<std::pair<ImageF*, Rect>> ret(channel_shifts_[0].size());
@@ -544,6 +650,8 @@ class Rows {
     }
 
     for (size_t c = 0; c < input_data.size(); c++) {
+      // Unused channels have no input buffer.
+      if (input_data[c].xsize() == 0) continue;
       auto tmp = data_max_color_channel_rect.As<ssize_t>()
                      .Translate(-group_data_x_border, -group_data_y_border)
                      .ShiftLeft(base_color_shift);
@@ -736,8 +844,8 @@ Status LowMemoryRenderPipeline::RenderRect(size_t thread_id,
       prepare_io_rows(y, i);
 
       // Produce output rows.
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows[i], output_rows, xpadding_for_output_[i],
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows[i], output_rows, xpadding_for_output_[i],
           group_rect[i].xsize(), group_rect[i].x0(), image_y, thread_id));
     }
 
@@ -747,6 +855,7 @@ Status LowMemoryRenderPipeline::RenderRect(size_t thread_id,
     int y = vy - num_extra_rows;
 
     for (size_t c = 0; c < input_data.size(); c++) {
+      if (!channel_is_used_[c]) continue;
       // Skip pixels that are not part of the actual final image area.
       input_rows[first_trailing_stage_][c][0] =
           rows.GetBuffer(stage_input_for_channel_[first_trailing_stage_][c], y,
@@ -778,8 +887,8 @@ Status LowMemoryRenderPipeline::RenderRect(size_t thread_id,
           i < first_image_dim_stage_ ? full_image_x0 - frame_x0 : full_image_x0;
       size_t y0 =
           i < first_image_dim_stage_ ? full_image_y - frame_y0 : full_image_y;
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows[first_trailing_stage_], output_rows,
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows[first_trailing_stage_], output_rows,
           /*xextra=*/0, full_image_x1 - full_image_x0, x0, y0, thread_id));
     }
   }
@@ -800,8 +909,8 @@ Status LowMemoryRenderPipeline::RenderPadding(size_t thread_id, Rect rect) {
     stages_[first_image_dim_stage_ - 1]->ProcessPaddingRow(
         input_rows, rect.xsize(), rect.x0(), rect.y0() + y);
     for (size_t i = first_image_dim_stage_; i < stages_.size(); i++) {
-      JXL_RETURN_IF_ERROR(stages_[i]->ProcessRow(
-          input_rows, output_rows,
+      JXL_RETURN_IF_ERROR(ProcessStageRow(
+          i, input_rows, output_rows,
           /*xextra=*/0, rect.xsize(), rect.x0(), rect.y0() + y, thread_id));
     }
   }
@@ -815,8 +924,11 @@ Status LowMemoryRenderPipeline::ProcessBuffers(size_t group_id,
 
   // Copy the group borders to the border storage.
   for (size_t c = 0; c < input_data.size(); c++) {
+    if (!channel_is_used_[c]) continue;
     JXL_RETURN_IF_ERROR(SaveBorders(group_id, c, input_data[c]));
   }
+  // The group is rendered later, by RenderGroup.
+  if (defer_rendering_) return true;
 
   size_t gy = group_id / frame_dimensions_.xsize_groups;
   size_t gx = group_id % frame_dimensions_.xsize_groups;
@@ -892,22 +1004,62 @@ Status LowMemoryRenderPipeline::ProcessBuffers(size_t group_id,
                                    group_border_.second, ready_rects,
                                    &num_ready_rects);
   for (size_t i = 0; i < num_ready_rects; i++) {
-    const Rect& image_max_color_channel_rect = ready_rects[i];
-    for (size_t c = 0; c < input_data.size(); c++) {
-      JXL_RETURN_IF_ERROR(LoadBorders(group_id, c, image_max_color_channel_rect,
-                                      &input_data[c]));
-    }
-    Rect data_max_color_channel_rect(
-        group_data_x_border_ + image_max_color_channel_rect.x0() -
-            gx * frame_dimensions_.group_dim,
-        group_data_y_border_ + image_max_color_channel_rect.y0() -
-            gy * frame_dimensions_.group_dim,
-        image_max_color_channel_rect.xsize(),
-        image_max_color_channel_rect.ysize());
-    JXL_RETURN_IF_ERROR(RenderRect(thread_id, input_data,
-                                   data_max_color_channel_rect,
-                                   image_max_color_channel_rect));
+    JXL_RETURN_IF_ERROR(
+        RenderGroupRect(group_id, thread_id, input_data, ready_rects[i]));
   }
   return true;
 }
+
+Status LowMemoryRenderPipeline::RenderGroupRect(
+    size_t group_id, size_t thread_id, std::vector<ImageF>& input_data,
+    const Rect& image_max_color_channel_rect) {
+  size_t gy = group_id / frame_dimensions_.xsize_groups;
+  size_t gx = group_id % frame_dimensions_.xsize_groups;
+  for (size_t c = 0; c < input_data.size(); c++) {
+    if (!channel_is_used_[c]) continue;
+    JXL_RETURN_IF_ERROR(LoadBorders(group_id, c, image_max_color_channel_rect,
+                                    &input_data[c]));
+  }
+  Rect data_max_color_channel_rect(
+      group_data_x_border_ + image_max_color_channel_rect.x0() -
+          gx * frame_dimensions_.group_dim,
+      group_data_y_border_ + image_max_color_channel_rect.y0() -
+          gy * frame_dimensions_.group_dim,
+      image_max_color_channel_rect.xsize(),
+      image_max_color_channel_rect.ysize());
+  // In column strip mode, every strip goes through all the stages before the
+  // next one; strips overlap by the columns that stages with borders need,
+  // which are rendered twice.
+  const size_t xsize = image_max_color_channel_rect.xsize();
+  const size_t strip_xsize = strip_xsize_ != 0 ? strip_xsize_ : xsize;
+  for (size_t x = 0; x < xsize; x += strip_xsize) {
+    const size_t x1 = std::min(x + strip_xsize, xsize);
+    JXL_RETURN_IF_ERROR(RenderRect(
+        thread_id, input_data,
+        Rect(data_max_color_channel_rect.x0() + x,
+             data_max_color_channel_rect.y0(), x1 - x,
+             data_max_color_channel_rect.ysize()),
+        Rect(image_max_color_channel_rect.x0() + x,
+             image_max_color_channel_rect.y0(), x1 - x,
+             image_max_color_channel_rect.ysize())));
+  }
+  return true;
+}
+
+Status LowMemoryRenderPipeline::RenderGroup(size_t group_id,
+                                            size_t thread_id) {
+  JXL_ENSURE(defer_rendering_);
+  JXL_ENSURE(group_id < group_completed_passes_.size());
+  JXL_ENSURE(PassesWithAllInput() > 0);
+  JXL_ENSURE(thread_id < stage_data_.size());
+  const size_t gx = group_id % frame_dimensions_.xsize_groups;
+  const size_t gy = group_id / frame_dimensions_.xsize_groups;
+  const size_t group_dim = frame_dimensions_.group_dim;
+  // Once all the groups have their input, the borders of every group are
+  // stored, so any part of a group can be rendered with only its own data.
+  return RenderGroupRect(
+      group_id, thread_id, group_data_[group_id],
+      Rect(gx * group_dim, gy * group_dim, group_dim, group_dim,
+           frame_dimensions_.xsize, frame_dimensions_.ysize));
+}
 }  // namespace jxl
@@ -29,25 +29,48 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
   explicit LowMemoryRenderPipeline(JxlMemoryManager* memory_manager)
       : RenderPipeline(memory_manager) {}
 
+  // See RenderPipeline::Builder::UseColumnStrips. Must be called before Init.
+  void UseColumnStrips(size_t cache_size);
+  // See RenderPipeline::Builder::DeferRendering. Must be called before Init.
+  void DeferRendering() { defer_rendering_ = true; }
+
+  Status RenderGroup(size_t group_id, size_t thread_id) override;
+
  private:
   std::vector<std::pair<ImageF*, Rect>> PrepareBuffers(
       size_t group_id, size_t thread_id) override;
 
   Status PrepareForThreadsInternal(size_t num, bool use_group_ids) override;
+  void ReleaseBuffers(std::vector<SpareBuffer>* buffers) override;
 
   Status ProcessBuffers(size_t group_id, size_t thread_id) override;
 
   void ClearDone(size_t i) override { group_border_assigner_.ClearDone(i); }
 
+  std::pair<size_t, size_t> GroupBorder() const override {
+    return group_border_;
+  }
+
   Status Init() override;
 
   Status EnsureBordersStorage();
+  // Number of rows of the output buffer of every stage for channel "c", 0 for
+  // stages that do not have kInOut mode for it.
+  std::vector<size_t> StageBufferYSizes(size_t c) const;
+  // Width of the column strips, in color channel pixels, or 0 to render
+  // groups in full.
+  size_t StripXSize() const;
   size_t GroupInputXSize(size_t c) const;
   size_t GroupInputYSize(size_t c) const;
   Status RenderRect(size_t thread_id, std::vector<ImageF>& input_data,
                     Rect data_max_color_channel_rect,
                     Rect image_max_color_channel_rect);
   Status RenderPadding(size_t thread_id, Rect rect);
+  // Renders `image_max_color_channel_rect`, which must be inside group
+  // `group_id` and its border, from `input_data` and the stored borders.
+  Status RenderGroupRect(size_t group_id, size_t thread_id,
+                         std::vector<ImageF>& input_data,
+                         const Rect& image_max_color_channel_rect);
 
   Status SaveBorders(size_t group_id, size_t c, const ImageF& in);
   Status LoadBorders(size_t group_id, size_t c, const Rect& r, ImageF* out);
@@ -117,6 +140,15 @@ class LowMemoryRenderPipeline final : public RenderPipeline {
   size_t full_image_xsize_;
   size_t full_image_ysize_;
   size_t first_image_dim_stage_;
+
+  // Bytes that the rows of a column strip should fit in, 0 if groups are not
+  // split into strips.
+  size_t strip_cache_size_ = 0;
+  size_t strip_xsize_ = 0;
+
+  // Whether groups are only rendered by RenderGroup, once all the groups have
+  // their input.
+  bool defer_rendering_ = false;
 };
 
 }  // namespace jxl
@@ -5,6 +5,7 @@
 
 #include "lib/jxl/render_pipeline/render_pipeline.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
 #include <utility>
@@ -14,6 +15,7 @@
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/render_pipeline/low_memory_render_pipeline.h"
@@ -31,6 +33,38 @@ Status RenderPipeline::Builder::AddStage(
 
 StatusOr<std::unique_ptr<RenderPipeline>> RenderPipeline::Builder::Finalize(
     FrameDimensions frame_dimensions) && {
+  // Finds the used channels from the last stage to the first. A stage uses all
+  // the channels it does not ignore, since it may compute any of them from the
+  // others, if it writes the output of some of them (kInput) or changes a used
+  // channel. The other stages are removed.
+  std::vector<bool> channel_is_used(num_c_, false);
+  for (size_t c = 0; c < std::min(first_droppable_c_, num_c_); c++) {
+    channel_is_used[c] = true;
+  }
+  std::vector<std::unique_ptr<RenderPipelineStage>> used_stages;
+  for (size_t i = stages_.size(); i-- > 0;) {
+    const RenderPipelineStage& stage = *stages_[i];
+    bool is_used = stage.SwitchToImageDimensions();
+    bool has_channels = false;
+    for (size_t c = 0; c < num_c_; c++) {
+      const RenderPipelineChannelMode mode = stage.GetChannelMode(c);
+      if (mode == RenderPipelineChannelMode::kIgnored) continue;
+      has_channels = true;
+      if (mode == RenderPipelineChannelMode::kInput || channel_is_used[c]) {
+        is_used = true;
+      }
+    }
+    if (has_channels && !is_used) continue;
+    for (size_t c = 0; c < num_c_; c++) {
+      if (stage.GetChannelMode(c) != RenderPipelineChannelMode::kIgnored) {
+        channel_is_used[c] = true;
+      }
+    }
+    used_stages.push_back(std::move(stages_[i]));
+  }
+  std::reverse(used_stages.begin(), used_stages.end());
+  stages_ = std::move(used_stages);
+
   // Check that the last stage is not a kInOut stage for any channel, and that
   // there is at least one stage.
   JXL_ENSURE(!stages_.empty());
@@ -40,10 +74,16 @@ StatusOr<std::unique_ptr<RenderPipeline>> RenderPipeline::Builder::Finalize(
   }
 
   std::unique_ptr<RenderPipeline> res;
-  if (use_simple_implementation_) {
-    res = jxl::make_unique<SimpleRenderPipeline>(memory_manager_);
+  if (use_simple_implementation_ || offload_) {
+    JXL_ENSURE(!defer_rendering_);
+    auto pipeline = jxl::make_unique<SimpleRenderPipeline>(memory_manager_);
+    if (offload_) pipeline->SetOffload(std::move(offload_));
+    res = std::move(pipeline);
   } else {
-    res = jxl::make_unique<LowMemoryRenderPipeline>(memory_manager_);
+    auto pipeline = jxl::make_unique<LowMemoryRenderPipeline>(memory_manager_);
+    if (use_column_strips_) pipeline->UseColumnStrips(strip_cache_size_);
+    if (defer_rendering_) pipeline->DeferRendering();
+    res = std::move(pipeline);
   }
 
   res->padding_.resize(stages_.size());
@@ -68,6 +108,7 @@ StatusOr<std::unique_ptr<RenderPipeline>> RenderPipeline::Builder::Finalize(
   }
 
   res->frame_dimensions_ = frame_dimensions;
+  res->channel_is_used_ = std::move(channel_is_used);
   res->group_completed_passes_.resize(frame_dimensions.num_groups);
   res->channel_shifts_.resize(stages_.size());
   res->channel_shifts_[0].resize(num_c_);
@@ -119,6 +160,7 @@ Status RenderPipeline::InputReady(
   group_completed_passes_[group_id]++;
   for (size_t i = 0; i < buffers.size(); ++i) {
     (void)i;
+    if (!channel_is_used_[i]) continue;
     JXL_CHECK_PLANE_INITIALIZED(*buffers[i].first, buffers[i].second, i);
   }
 
@@ -126,14 +168,37 @@ Status RenderPipeline::InputReady(
   return true;
 }
 
+void RenderPipeline::SetStats(DecoderStats* stats) {
+  stats_ = stats;
+  stage_stats_.clear();
+  for (const auto& stage : stages_) {
+    stage_stats_.push_back(stats->StageIndex(stage->GetName()));
+  }
+}
+
 Status RenderPipeline::PrepareForThreads(size_t num, bool use_group_ids) {
   for (const auto& stage : stages_) {
     JXL_RETURN_IF_ERROR(stage->PrepareForThreads(num));
   }
   JXL_RETURN_IF_ERROR(PrepareForThreadsInternal(num, use_group_ids));
+  spare_buffers_.clear();
   return true;
 }
 
+StatusOr<ImageF> RenderPipeline::CreateBuffer(size_t xsize, size_t ysize,
+                                              size_t pre_padding) {
+  for (SpareBuffer& spare : spare_buffers_) {
+    if (spare.image.xsize() == xsize && spare.image.ysize() == ysize &&
+        spare.pre_padding == pre_padding) {
+      ImageF image = std::move(spare.image);
+      std::swap(spare, spare_buffers_.back());
+      spare_buffers_.pop_back();
+      return image;
+    }
+  }
+  return ImageF::Create(memory_manager_, xsize, ysize, pre_padding);
+}
+
 Status RenderPipelineInput::Done() {
   JXL_ENSURE(pipeline_);
   JXL_RETURN_IF_ERROR(pipeline_->InputReady(group_id_, thread_id_, buffers_));
@@ -17,8 +17,10 @@
 
 #include "lib/jxl/base/rect.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_stats.h"
 #include "lib/jxl/frame_dimensions.h"
 #include "lib/jxl/image.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 namespace jxl {
@@ -49,6 +51,8 @@ class RenderPipelineInput {
     return buffers_[c];
   }
 
+  size_t group_id() const { return group_id_; }
+
  private:
   RenderPipeline* pipeline_ = nullptr;
   size_t group_id_;
@@ -62,7 +66,9 @@ class RenderPipeline {
   class Builder {
    public:
     explicit Builder(JxlMemoryManager* memory_manager, size_t num_c)
-        : memory_manager_(memory_manager), num_c_(num_c) {
+        : memory_manager_(memory_manager),
+          num_c_(num_c),
+          first_droppable_c_(num_c) {
       JXL_DASSERT(num_c > 0);
     }
 
@@ -74,6 +80,34 @@ class RenderPipeline {
     // the pipeline.
     void UseSimpleImplementation() { use_simple_implementation_ = true; }
 
+    // Makes the low-memory implementation render the groups in column strips
+    // that go through all the stages one after the other, so that the rows of
+    // all the stages stay in `cache_size` bytes of cache, or in the L2 cache if
+    // `cache_size` is 0. Groups whose rows already fit are rendered in full.
+    void UseColumnStrips(size_t cache_size = 0) {
+      use_column_strips_ = true;
+      strip_cache_size_ = cache_size;
+    }
+
+    // Makes the low-memory implementation keep the input of every group,
+    // instead of rendering it, so that RenderGroup can render any group on
+    // demand once all of them have their input. Not supported by the simple
+    // implementation, nor with stages that switch to image dimensions.
+    void DeferRendering() { defer_rendering_ = true; }
+
+    // Makes the pipeline use the simple implementation, and run the stages
+    // that `offload` accepts on it instead of on the CPU. Not supported with
+    // DeferRendering.
+    void UseOffload(std::unique_ptr<RenderPipelineOffload> offload) {
+      offload_ = std::move(offload);
+    }
+
+    // Makes Finalize drop the channels from `first_c` on that are not read by
+    // a stage with kInput channels, directly or through the stages before it.
+    // Stages that only change such channels are removed and the channels get
+    // no input buffer, which must then not be written (see IsChannelUsed).
+    void DropUnusedChannels(size_t first_c) { first_droppable_c_ = first_c; }
+
     // Finalizes setup of the pipeline. Shifts for all channels should be 0 at
     // this point.
     StatusOr<std::unique_ptr<RenderPipeline>> Finalize(
@@ -83,7 +117,12 @@ class RenderPipeline {
     JxlMemoryManager* memory_manager_;
     std::vector<std::unique_ptr<RenderPipelineStage>> stages_;
     size_t num_c_;
+    size_t first_droppable_c_;
     bool use_simple_implementation_ = false;
+    bool use_column_strips_ = false;
+    size_t strip_cache_size_ = 0;
+    bool defer_rendering_ = false;
+    std::unique_ptr<RenderPipelineOffload> offload_;
   };
 
   friend class Builder;
@@ -109,6 +148,10 @@ class RenderPipeline {
   // different threads, provided that a different `thread_id` is given.
   RenderPipelineInput GetInputBuffers(size_t group_id, size_t thread_id);
 
+  // Whether channel `c` is used by the stages. The input buffers of unused
+  // channels, see Builder::DropUnusedChannels, must not be accessed.
+  bool IsChannelUsed(size_t c) const { return channel_is_used_[c]; }
+
   size_t PassesWithAllInput() const {
     return *std::min_element(group_completed_passes_.begin(),
                              group_completed_passes_.end());
@@ -116,11 +159,70 @@ class RenderPipeline {
 
   virtual void ClearDone(size_t i) {}
 
+  // Renders group `group_id` of a pipeline built with Builder::DeferRendering,
+  // once all the groups have their input. May be called again for the same
+  // group, and concurrently for different groups with different `thread_id`,
+  // which must be smaller than the number of threads of PrepareForThreads.
+  virtual Status RenderGroup(size_t group_id, size_t thread_id) {
+    return JXL_UNREACHABLE("rendering is not deferred");
+  }
+
+  // Returns the size, in frame pixels before upsampling, of the border around
+  // each group that is only rendered once the neighbouring groups are done too.
+  // Pipelines which only render once all groups are done return {0, 0}.
+  virtual std::pair<size_t, size_t> GroupBorder() const { return {0, 0}; }
+
+  struct SpareBuffer {
+    ImageF image;
+    size_t pre_padding;
+  };
+
+  // Moves the buffers of this pipeline, which is about to be replaced, to
+  // "buffers". The pipeline cannot be run anymore.
+  void ReleaseBuffersTo(std::vector<SpareBuffer>* buffers) {
+    ReleaseBuffers(buffers);
+  }
+
+  // Takes the buffers released by an earlier pipeline. The next call to
+  // PrepareForThreads reuses those with the dimensions it needs, instead of
+  // allocating them again, and frees the others.
+  void ReuseBuffers(std::vector<SpareBuffer>* buffers) {
+    for (SpareBuffer& buffer : *buffers) {
+      spare_buffers_.push_back(std::move(buffer));
+    }
+    buffers->clear();
+  }
+
+  // Makes the stages add the time they spend to "stats", by name.
+  void SetStats(DecoderStats* stats);
+
  protected:
   explicit RenderPipeline(JxlMemoryManager* memory_manager)
       : memory_manager_(memory_manager) {}
   JxlMemoryManager* memory_manager_;
 
+  // Returns a spare buffer with the given dimensions and padding, or a new one
+  // if there is none. The contents of spare buffers are left as they are.
+  StatusOr<ImageF> CreateBuffer(size_t xsize, size_t ysize,
+                                size_t pre_padding = 0);
+
+  // Calls ProcessRow of stage "i", timing it if stats are collected.
+  Status ProcessStageRow(size_t i,
+                         const RenderPipelineStage::RowInfo& input_rows,
+                         const RenderPipelineStage::RowInfo& output_rows,
+                         size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                         size_t thread_id) const {
+    if (stats_ == nullptr) {
+      return stages_[i]->ProcessRow(input_rows, output_rows, xextra, xsize,
+                                    xpos, ypos, thread_id);
+    }
+    const DecoderStats::Start start = stats_->Begin();
+    Status status = stages_[i]->ProcessRow(input_rows, output_rows, xextra,
+                                           xsize, xpos, ypos, thread_id);
+    stats_->AddStageTime(stage_stats_[i], start);
+    return status;
+  }
+
   std::vector<std::unique_ptr<RenderPipelineStage>> stages_;
   // Shifts for every channel at the input of each stage.
   std::vector<std::vector<std::pair<size_t, size_t>>> channel_shifts_;
@@ -131,8 +233,14 @@ class RenderPipeline {
 
   FrameDimensions frame_dimensions_;
 
+  std::vector<bool> channel_is_used_;
+
   std::vector<uint8_t> group_completed_passes_;
 
+  DecoderStats* stats_ = nullptr;
+  // Index in stats_ of each stage.
+  std::vector<size_t> stage_stats_;
+
   friend class RenderPipelineInput;
 
  private:
@@ -150,6 +258,11 @@ class RenderPipeline {
 
   // Called once frame dimensions and stages are known.
   virtual Status Init() { return true; }
+
+  // Moves the buffers that CreateBuffer can reuse to "buffers".
+  virtual void ReleaseBuffers(std::vector<SpareBuffer>* buffers) {}
+
+  std::vector<SpareBuffer> spare_buffers_;
 };
 
 }  // namespace jxl
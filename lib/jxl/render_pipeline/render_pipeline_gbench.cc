@@ -0,0 +1,271 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/memory_manager.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <hwy/targets.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "benchmark/benchmark.h"
+#include "lib/jxl/base/bits.h"
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/rect.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_cache.h"
+#include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/epf.h"
+#include "lib/jxl/frame_dimensions.h"
+#include "lib/jxl/image.h"
+#include "lib/jxl/image_metadata.h"
+#include "lib/jxl/image_ops.h"
+#include "lib/jxl/loop_filter.h"
+#include "lib/jxl/render_pipeline/render_pipeline.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+#include "lib/jxl/render_pipeline/stage_epf.h"
+#include "lib/jxl/render_pipeline/stage_gaborish.h"
+#include "lib/jxl/render_pipeline/stage_upsampling.h"
+#include "lib/jxl/render_pipeline/stage_xyb.h"
+#include "lib/jxl/render_pipeline/test_render_pipeline_stages.h"
+#include "tools/no_memory_manager.h"
+
+namespace jxl {
+namespace {
+
+#define QUIT(M)           \
+  state.SkipWithError(M); \
+  return;
+
+#define BM_CHECK(C) \
+  if (!(C)) {       \
+    QUIT(#C)        \
+  }
+
+// Reads every pixel of the final rows, so that they are not optimized out.
+class SumFinalStage : public RenderPipelineStage {
+ public:
+  SumFinalStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    float sum = 0.0f;
+    for (size_t c = 0; c < input_rows.size(); c++) {
+      const float* row = GetInputRow(input_rows, c, 0);
+      for (size_t x = 0; x < xsize; x++) sum += row[x];
+    }
+    benchmark::DoNotOptimize(sum);
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInput;
+  }
+
+  const char* GetName() const override { return "SumFinal"; }
+};
+
+// Renders an 8-channel frame through three stages with borders, like the
+// three passes of EPF, in full groups or, if the argument is not 0, in column
+// strips fitting in that many KiB.
+void BM_LowMemoryRenderPipeline(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const size_t strip_cache_kib = state.range(0);
+  constexpr size_t kNumChannels = 8;
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize_px=*/2048, /*ysize_px=*/2048,
+                       /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+
+  RenderPipeline::Builder builder(memory_manager, kNumChannels);
+  for (size_t i = 0; i < 3; i++) {
+    BM_CHECK(builder.AddStage(jxl::make_unique<BlurSlowStage>()));
+  }
+  BM_CHECK(builder.AddStage(jxl::make_unique<SumFinalStage>()));
+  if (strip_cache_kib != 0) builder.UseColumnStrips(strip_cache_kib << 10);
+  JXL_ASSIGN_OR_QUIT(std::unique_ptr<RenderPipeline> pipeline,
+                     std::move(builder).Finalize(frame_dimensions),
+                     "Failed to create the pipeline.");
+  BM_CHECK(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+
+  for (auto _ : state) {
+    (void)_;
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      pipeline->ClearDone(i);
+    }
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      auto input_buffers = pipeline->GetInputBuffers(i, 0);
+      for (size_t c = 0; c < kNumChannels; c++) {
+        const auto& buffer = input_buffers.GetBuffer(c);
+        FillPlane(0.5f, buffer.first, buffer.second);
+      }
+      BM_CHECK(input_buffers.Done());
+    }
+  }
+
+  state.SetItemsProcessed(frame_dimensions.xsize * frame_dimensions.ysize *
+                          state.iterations());
+}
+
+BENCHMARK(BM_LowMemoryRenderPipeline)->Arg(0)->Arg(32)->Arg(128)->Arg(512);
+
+// Upsamples a 1-channel frame by 2, 4 or 8 with the default weights. Items are
+// output pixels.
+void BM_UpsamplingStage(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const size_t upsampling = state.range(0);
+  const size_t shift = CeilLog2Nonzero(upsampling);
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize_px=*/2048, /*ysize_px=*/2048,
+                       /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, upsampling);
+
+  const CustomTransformData ups_factors;
+  RenderPipeline::Builder builder(memory_manager, 1);
+  BM_CHECK(builder.AddStage(GetUpsamplingStage(ups_factors, 0, shift)));
+  BM_CHECK(builder.AddStage(jxl::make_unique<SumFinalStage>()));
+  JXL_ASSIGN_OR_QUIT(std::unique_ptr<RenderPipeline> pipeline,
+                     std::move(builder).Finalize(frame_dimensions),
+                     "Failed to create the pipeline.");
+  BM_CHECK(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+
+  for (auto _ : state) {
+    (void)_;
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      pipeline->ClearDone(i);
+    }
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      auto input_buffers = pipeline->GetInputBuffers(i, 0);
+      const auto& buffer = input_buffers.GetBuffer(0);
+      FillPlane(0.5f, buffer.first, buffer.second);
+      BM_CHECK(input_buffers.Done());
+    }
+  }
+
+  state.SetItemsProcessed(frame_dimensions.xsize_upsampled *
+                          frame_dimensions.ysize_upsampled *
+                          state.iterations());
+}
+
+BENCHMARK(BM_UpsamplingStage)->Arg(2)->Arg(4)->Arg(8);
+
+// What the stages benchmarked by BM_Stage are made from: EPF with all its
+// passes and a sigma near the one of distance 1, Gaborish, and the default
+// conversion from XYB.
+struct StageInputs {
+  LoopFilter lf;
+  ImageF sigma;
+  OutputEncodingInfo output_encoding_info;
+};
+
+using StageFactory =
+    std::unique_ptr<RenderPipelineStage> (*)(const StageInputs& inputs);
+
+// Renders a 3-channel frame through the stage returned by `make_stage`, which
+// is called with only `target` enabled so that the stage uses the code of that
+// target. The input varies across the frame, so that the filters see edges of
+// different strengths. Items are pixels.
+void BM_Stage(benchmark::State& state, int64_t target,
+              StageFactory make_stage) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  constexpr size_t kNumChannels = 3;
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize_px=*/2048, /*ysize_px=*/2048,
+                       /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+
+  StageInputs inputs;
+  inputs.lf.gab = true;
+  inputs.lf.epf_iters = 3;
+  JXL_ASSIGN_OR_QUIT(
+      inputs.sigma,
+      ImageF::Create(memory_manager,
+                     frame_dimensions.xsize_blocks + 2 * kSigmaPadding,
+                     frame_dimensions.ysize_blocks + 2 * kSigmaPadding),
+      "Failed to allocate sigma.");
+  FillImage(kInvSigmaNum / 1.5f, &inputs.sigma);
+  BM_CHECK(inputs.output_encoding_info.SetFromMetadata(CodecMetadata()));
+
+  RenderPipeline::Builder builder(memory_manager, kNumChannels);
+  hwy::SetSupportedTargetsForTest(target);
+  std::unique_ptr<RenderPipelineStage> stage = make_stage(inputs);
+  hwy::SetSupportedTargetsForTest(0);
+  BM_CHECK(stage != nullptr);
+  BM_CHECK(builder.AddStage(std::move(stage)));
+  BM_CHECK(builder.AddStage(jxl::make_unique<SumFinalStage>()));
+  JXL_ASSIGN_OR_QUIT(std::unique_ptr<RenderPipeline> pipeline,
+                     std::move(builder).Finalize(frame_dimensions),
+                     "Failed to create the pipeline.");
+  BM_CHECK(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+
+  for (auto _ : state) {
+    (void)_;
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      pipeline->ClearDone(i);
+    }
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      auto input_buffers = pipeline->GetInputBuffers(i, 0);
+      for (size_t c = 0; c < kNumChannels; c++) {
+        const auto& buffer = input_buffers.GetBuffer(c);
+        const Rect& rect = buffer.second;
+        for (size_t y = 0; y < rect.ysize(); y++) {
+          float* JXL_RESTRICT row = rect.Row(buffer.first, y);
+          for (size_t x = 0; x < rect.xsize(); x++) {
+            row[x] = ((x * 7 + y * 13 + c * 5) % 23) * (1.0f / 64) + 0.1f * c;
+          }
+        }
+      }
+      BM_CHECK(input_buffers.Done());
+    }
+  }
+
+  state.SetItemsProcessed(frame_dimensions.xsize * frame_dimensions.ysize *
+                          state.iterations());
+}
+
+}  // namespace
+}  // namespace jxl
+
+// Registers the benchmarks of the stages whose code depends on the SIMD
+// target, once for each target, as "<stage>/<target>".
+void RegisterRenderPipelineBenchmarks();
+
+void RegisterRenderPipelineBenchmarks() {
+  using jxl::StageInputs;
+  const std::pair<const char*, jxl::StageFactory> stages[] = {
+      {"EPF0",
+       [](const StageInputs& in) {
+         return jxl::GetEPFStage(in.lf, in.sigma, jxl::EpfStage::Zero);
+       }},
+      {"EPF1",
+       [](const StageInputs& in) {
+         return jxl::GetEPFStage(in.lf, in.sigma, jxl::EpfStage::One);
+       }},
+      {"EPF2",
+       [](const StageInputs& in) {
+         return jxl::GetEPFStage(in.lf, in.sigma, jxl::EpfStage::Two);
+       }},
+      {"Gaborish",
+       [](const StageInputs& in) { return jxl::GetGaborishStage(in.lf); }},
+      {"XYB",
+       [](const StageInputs& in) {
+         return jxl::GetXYBStage(in.output_encoding_info);
+       }},
+  };
+  for (const auto& stage : stages) {
+    for (int64_t target : hwy::SupportedAndGeneratedTargets()) {
+      std::string name =
+          std::string(stage.first) + "/" + hwy::TargetName(target);
+      benchmark::RegisterBenchmark(name.c_str(), jxl::BM_Stage, target,
+                                   stage.second);
+    }
+  }
+}
@@ -0,0 +1,71 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_OFFLOAD_H_
+#define LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_OFFLOAD_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/image.h"
+
+namespace jxl {
+
+// The computation of a stage that a RenderPipelineOffload may run instead of
+// the stage, with its parameters, as given by
+// RenderPipelineStage::GetOffloadKernel.
+struct OffloadKernel {
+  enum class Type {
+    // XYB to linear RGB of channels 0 to 2, in place, as XybToRgb.
+    kXYB,
+    // 3x3 convolution of channels 0 to 2, with a border of 1.
+    kGaborish,
+    // Upsampling of one channel by 2, 4 or 8, with a border of 2.
+    kUpsampling,
+  };
+  Type type;
+
+  // kXYB: the entries of the inverse opsin matrix, in row-major order, and
+  // the biases of OpsinParams.
+  float inverse_opsin_matrix[9];
+  float opsin_biases[3];
+  float opsin_biases_cbrt[3];
+
+  // kGaborish: the weights of the center, the sides and the corners of each
+  // channel.
+  float gaborish_weights[9];
+
+  // kUpsampling: the channel, the log2 of the factor N, and the 25 weights of
+  // the 5x5 neighbourhood, in row-major order, of each of the N*N output
+  // pixels of an input pixel. The output is clamped to the range of the
+  // neighbourhood.
+  size_t upsampling_c;
+  size_t upsampling_shift;
+  float upsampling_weights[64][25];
+};
+
+// Runs some of the stages of a simple render pipeline on another device, such
+// as a GPU, on the whole frame at once.
+class RenderPipelineOffload {
+ public:
+  virtual ~RenderPipelineOffload() = default;
+
+  // Runs `kernel` on the full frame planes of the channels, which are padded
+  // by kRenderPipelineXOffset on each side and have the mirrored border of
+  // the stage, and whose sizes are `input_sizes`. Channels that the stage
+  // changes in place are written to `channels`, and those with a new output
+  // to the planes of `outputs`, which have the same padding. Returns false,
+  // without writing any plane, if the stage must run on the CPU instead.
+  virtual StatusOr<bool> RunStage(
+      const OffloadKernel& kernel, const std::vector<ImageF*>& channels,
+      const std::vector<ImageF*>& outputs,
+      const std::vector<std::pair<size_t, size_t>>& input_sizes) = 0;
+};
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_RENDER_PIPELINE_RENDER_PIPELINE_OFFLOAD_H_
@@ -25,6 +25,10 @@ Status RenderPipelineStage::PrepareForThreads(size_t num_threads) {
 
 Status RenderPipelineStage::IsInitialized() const { return true; }
 
+bool RenderPipelineStage::GetOffloadKernel(OffloadKernel* kernel) const {
+  return false;
+}
+
 RenderPipelineStage::~RenderPipelineStage() = default;
 
 void RenderPipelineStage::ProcessPaddingRow(const RowInfo& output_rows,
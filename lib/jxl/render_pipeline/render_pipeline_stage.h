@@ -42,6 +42,7 @@ enum class RenderPipelineChannelMode {
 };
 
 class RenderPipeline;
+struct OffloadKernel;
 
 class RenderPipelineStage {
  protected:
@@ -123,6 +124,10 @@ class RenderPipelineStage {
 
   virtual Status PrepareForThreads(size_t num_threads);
 
+  // Describes the computation of the stage for a RenderPipelineOffload, and
+  // returns true, if the stage can be offloaded. Called after SetInputSizes.
+  virtual bool GetOffloadKernel(OffloadKernel* kernel) const;
+
   // Returns a pointer to the input row of channel `c` with offset `y`.
   // `y` must be in [-settings_.border_y, settings_.border_y]. `c` must be such
   // that `GetChannelMode(c) != kIgnored`. The returned pointer points to the
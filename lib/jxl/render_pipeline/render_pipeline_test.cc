@@ -41,6 +41,15 @@
 #include "lib/jxl/image_ops.h"
 #include "lib/jxl/image_test_utils.h"
 #include "lib/jxl/jpeg/enc_jpeg_data.h"
+#include "lib/jxl/loop_filter.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+#include "lib/jxl/render_pipeline/stage_chroma_upsampling.h"
+#include "lib/jxl/render_pipeline/stage_from_linear.h"
+#include "lib/jxl/render_pipeline/stage_gaborish.h"
+#include "lib/jxl/render_pipeline/stage_upsampling.h"
+#include "lib/jxl/render_pipeline/stage_write.h"
+#include "lib/jxl/render_pipeline/stage_xyb.h"
 #include "lib/jxl/render_pipeline/test_render_pipeline_stages.h"
 #include "lib/jxl/splines.h"
 #include "lib/jxl/test_memory_manager.h"
@@ -189,6 +198,323 @@ TEST(RenderPipelineTest, CallAllGroupsFast) {
   EXPECT_EQ(pipeline->PassesWithAllInput(), 1);
 }
 
+TEST(RenderPipelineTest, ColumnStrips) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize_px=*/600, /*ysize_px=*/400,
+                       /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+  // Renders the frame in full groups, then in the narrowest strips.
+  Image3F images[2];
+  for (size_t strips = 0; strips < 2; strips++) {
+    RenderPipeline::Builder builder(memory_manager, /*num_c=*/3);
+    ASSERT_TRUE(builder.AddStage(jxl::make_unique<UpsampleXSlowStage>()));
+    ASSERT_TRUE(builder.AddStage(jxl::make_unique<BlurSlowStage>()));
+    ASSERT_TRUE(builder.AddStage(jxl::make_unique<BlurSlowStage>()));
+    ASSERT_TRUE(builder.AddStage(
+        GetWriteToImage3FStage(memory_manager, &images[strips])));
+    if (strips) builder.UseColumnStrips(/*cache_size=*/1);
+    JXL_TEST_ASSIGN_OR_DIE(auto pipeline,
+                           std::move(builder).Finalize(frame_dimensions));
+    ASSERT_TRUE(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+    for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+      auto input_buffers = pipeline->GetInputBuffers(i, 0);
+      for (size_t c = 0; c < 3; c++) {
+        const auto& buffer = input_buffers.GetBuffer(c);
+        for (size_t y = 0; y < buffer.second.ysize(); y++) {
+          float* JXL_RESTRICT row = buffer.second.Row(buffer.first, y);
+          for (size_t x = 0; x < buffer.second.xsize(); x++) {
+            row[x] = ((x * 7 + y * 13 + i * 3 + c) % 32) / 32.0f;
+          }
+        }
+      }
+      ASSERT_TRUE(input_buffers.Done());
+    }
+  }
+  JXL_TEST_ASSERT_OK(
+      VerifyRelativeError(images[0], images[1], 1e-6f, 1e-6f, _));
+}
+
+TEST(RenderPipelineTest, DropUnusedChannels) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  FrameDimensions frame_dimensions;
+  frame_dimensions.Set(/*xsize_px=*/600, /*ysize_px=*/400,
+                       /*group_size_shift=*/1,
+                       /*max_hshift=*/0, /*max_vshift=*/0,
+                       /*modular_mode=*/false, /*upsampling=*/1);
+  // Channel 3 is upsampled, but not written.
+  for (bool use_slow_pipeline : {false, true}) {
+    for (bool drop : {false, true}) {
+      RenderPipeline::Builder builder(memory_manager, /*num_c=*/4);
+      ASSERT_TRUE(builder.AddStage(
+          GetChromaUpsamplingStage(/*channel=*/3, /*horizontal=*/true)));
+      Image3F image;
+      ASSERT_TRUE(
+          builder.AddStage(GetWriteToImage3FStage(memory_manager, &image)));
+      if (use_slow_pipeline) builder.UseSimpleImplementation();
+      if (drop) builder.DropUnusedChannels(/*first_c=*/3);
+      JXL_TEST_ASSIGN_OR_DIE(auto pipeline,
+                             std::move(builder).Finalize(frame_dimensions));
+      for (size_t c = 0; c < 3; c++) EXPECT_TRUE(pipeline->IsChannelUsed(c));
+      EXPECT_EQ(pipeline->IsChannelUsed(3), !drop);
+      ASSERT_TRUE(pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+      for (size_t i = 0; i < frame_dimensions.num_groups; i++) {
+        auto input_buffers = pipeline->GetInputBuffers(i, 0);
+        for (size_t c = 0; c < 4; c++) {
+          if (!pipeline->IsChannelUsed(c)) continue;
+          const auto& buffer = input_buffers.GetBuffer(c);
+          FillPlane(c * 0.25f, buffer.first, buffer.second);
+        }
+        ASSERT_TRUE(input_buffers.Done());
+      }
+      for (size_t c = 0; c < 3; c++) {
+        for (size_t y = 0; y < image.ysize(); y++) {
+          const float* JXL_RESTRICT row = image.ConstPlaneRow(c, y);
+          for (size_t x = 0; x < image.xsize(); x++) {
+            ASSERT_EQ(row[x], c * 0.25f);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Renders a frame with varying XYB values to "output", with an XYB stage
+// followed by a FromLinear stage or, if "fused", with the stage doing both.
+Status RenderXYB(const OutputEncodingInfo& output_encoding_info, bool fused,
+                 const FrameDimensions& frame_dim, Image3F* output) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  RenderPipeline::Builder builder(memory_manager, /*num_c=*/3);
+  if (fused) {
+    JXL_RETURN_IF_ERROR(
+        builder.AddStage(GetXYBFromLinearStage(output_encoding_info)));
+  } else {
+    JXL_RETURN_IF_ERROR(builder.AddStage(GetXYBStage(output_encoding_info)));
+    JXL_RETURN_IF_ERROR(
+        builder.AddStage(GetFromLinearStage(output_encoding_info)));
+  }
+  JXL_RETURN_IF_ERROR(
+      builder.AddStage(GetWriteToImage3FStage(memory_manager, output)));
+  JXL_ASSIGN_OR_RETURN(auto pipeline, std::move(builder).Finalize(frame_dim));
+  JXL_RETURN_IF_ERROR(
+      pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+  for (size_t i = 0; i < frame_dim.num_groups; i++) {
+    auto input_buffers = pipeline->GetInputBuffers(i, 0);
+    for (size_t c = 0; c < 3; c++) {
+      const auto& buffer = input_buffers.GetBuffer(c);
+      for (size_t y = 0; y < buffer.second.ysize(); y++) {
+        float* JXL_RESTRICT row = buffer.second.Row(buffer.first, y);
+        for (size_t x = 0; x < buffer.second.xsize(); x++) {
+          const float v = ((x * 7 + y * 13 + i * 3 + c) % 32) / 32.0f;
+          row[x] = c == 0 ? 0.02f * v - 0.01f : 0.8f * v;
+        }
+      }
+    }
+    JXL_RETURN_IF_ERROR(input_buffers.Done());
+  }
+  return true;
+}
+
+TEST(RenderPipelineTest, FusedXYBFromLinear) {
+  CodecMetadata metadata;
+  metadata.m.xyb_encoded = true;
+  for (bool linear : {false, true}) {
+    metadata.m.color_encoding = ColorEncoding::SRGB(/*is_gray=*/false);
+    if (linear) {
+      metadata.m.color_encoding = ColorEncoding::LinearSRGB(/*is_gray=*/false);
+    }
+    OutputEncodingInfo output_encoding_info;
+    ASSERT_TRUE(output_encoding_info.SetFromMetadata(metadata));
+    FrameDimensions frame_dim;
+    frame_dim.Set(/*xsize_px=*/300, /*ysize_px=*/200,
+                  /*group_size_shift=*/1,
+                  /*max_hshift=*/0, /*max_vshift=*/0,
+                  /*modular_mode=*/false, /*upsampling=*/1);
+    Image3F separate;
+    Image3F fused;
+    ASSERT_TRUE(RenderXYB(output_encoding_info, /*fused=*/false, frame_dim,
+                          &separate));
+    ASSERT_TRUE(
+        RenderXYB(output_encoding_info, /*fused=*/true, frame_dim, &fused));
+    JXL_TEST_ASSERT_OK(VerifyRelativeError(separate, fused, 1e-6f, 1e-6f, _));
+  }
+}
+
+// A RenderPipelineOffload that records the kernels it is offered, and runs
+// the Gaborish kernel with scalar code if `run_gaborish`, declining the others
+// so that they run on the CPU.
+class FakeOffload : public RenderPipelineOffload {
+ public:
+  FakeOffload(bool run_gaborish, std::vector<OffloadKernel::Type>* offered)
+      : run_gaborish_(run_gaborish), offered_(offered) {}
+
+  StatusOr<bool> RunStage(
+      const OffloadKernel& kernel, const std::vector<ImageF*>& channels,
+      const std::vector<ImageF*>& outputs,
+      const std::vector<std::pair<size_t, size_t>>& input_sizes) override {
+    offered_->push_back(kernel.type);
+    if (!run_gaborish_ || kernel.type != OffloadKernel::Type::kGaborish) {
+      return false;
+    }
+    for (size_t c = 0; c < 3; c++) {
+      const float* w = kernel.gaborish_weights + 3 * c;
+      for (size_t y = 0; y < input_sizes[c].second; y++) {
+        const float* rows[3];
+        for (size_t i = 0; i < 3; i++) {
+          rows[i] = channels[c]->Row(kRenderPipelineXOffset + y + i - 1) +
+                    kRenderPipelineXOffset;
+        }
+        float* row_out = outputs[c]->Row(kRenderPipelineXOffset + y) +
+                         kRenderPipelineXOffset;
+        for (ssize_t x = 0; x < static_cast<ssize_t>(input_sizes[c].first);
+             x++) {
+          const float sides =
+              rows[1][x - 1] + rows[1][x + 1] + rows[0][x] + rows[2][x];
+          const float corners = rows[0][x - 1] + rows[0][x + 1] +
+                                rows[2][x - 1] + rows[2][x + 1];
+          row_out[x] = rows[1][x] * w[0] + sides * w[1] + corners * w[2];
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  bool run_gaborish_;
+  std::vector<OffloadKernel::Type>* offered_;
+};
+
+// Renders a frame through Gaborish, upsampling by 2 and XYB stages, on the
+// simple pipeline with `offload` or, if it is nullptr, without.
+Status RenderWithOffload(std::unique_ptr<RenderPipelineOffload> offload,
+                         Image3F* output) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  CodecMetadata metadata;
+  metadata.m.xyb_encoded = true;
+  OutputEncodingInfo output_encoding_info;
+  JXL_RETURN_IF_ERROR(output_encoding_info.SetFromMetadata(metadata));
+  const LoopFilter lf;
+  const CustomTransformData ups_factors;
+  FrameDimensions frame_dim;
+  frame_dim.Set(/*xsize_px=*/300, /*ysize_px=*/200, /*group_size_shift=*/1,
+                /*max_hshift=*/0, /*max_vshift=*/0,
+                /*modular_mode=*/false, /*upsampling=*/2);
+  RenderPipeline::Builder builder(memory_manager, /*num_c=*/3);
+  JXL_RETURN_IF_ERROR(builder.AddStage(GetGaborishStage(lf)));
+  for (size_t c = 0; c < 3; c++) {
+    JXL_RETURN_IF_ERROR(
+        builder.AddStage(GetUpsamplingStage(ups_factors, c, /*shift=*/1)));
+  }
+  JXL_RETURN_IF_ERROR(builder.AddStage(GetXYBStage(output_encoding_info)));
+  JXL_RETURN_IF_ERROR(
+      builder.AddStage(GetWriteToImage3FStage(memory_manager, output)));
+  if (offload) {
+    builder.UseOffload(std::move(offload));
+  } else {
+    builder.UseSimpleImplementation();
+  }
+  JXL_ASSIGN_OR_RETURN(auto pipeline, std::move(builder).Finalize(frame_dim));
+  JXL_RETURN_IF_ERROR(
+      pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+  for (size_t i = 0; i < frame_dim.num_groups; i++) {
+    auto input_buffers = pipeline->GetInputBuffers(i, 0);
+    for (size_t c = 0; c < 3; c++) {
+      const auto& buffer = input_buffers.GetBuffer(c);
+      for (size_t y = 0; y < buffer.second.ysize(); y++) {
+        float* JXL_RESTRICT row = buffer.second.Row(buffer.first, y);
+        for (size_t x = 0; x < buffer.second.xsize(); x++) {
+          const float v = ((x * 7 + y * 13 + i * 3 + c) % 32) / 32.0f;
+          row[x] = c == 0 ? 0.02f * v - 0.01f : 0.8f * v;
+        }
+      }
+    }
+    JXL_RETURN_IF_ERROR(input_buffers.Done());
+  }
+  return true;
+}
+
+TEST(RenderPipelineTest, OffloadFallsBackToCPU) {
+  Image3F expected;
+  ASSERT_TRUE(RenderWithOffload(nullptr, &expected));
+  std::vector<OffloadKernel::Type> offered;
+  Image3F declined;
+  ASSERT_TRUE(RenderWithOffload(
+      jxl::make_unique<FakeOffload>(/*run_gaborish=*/false, &offered),
+      &declined));
+  const std::vector<OffloadKernel::Type> stage_kernels = {
+      OffloadKernel::Type::kGaborish, OffloadKernel::Type::kUpsampling,
+      OffloadKernel::Type::kUpsampling, OffloadKernel::Type::kUpsampling,
+      OffloadKernel::Type::kXYB};
+  EXPECT_EQ(offered, stage_kernels);
+  JXL_TEST_ASSERT_OK(VerifyRelativeError(expected, declined, 0.0f, 0.0f, _));
+
+  // The planes given to the offload have the mirrored border of the stage.
+  offered.clear();
+  Image3F offloaded;
+  ASSERT_TRUE(RenderWithOffload(
+      jxl::make_unique<FakeOffload>(/*run_gaborish=*/true, &offered),
+      &offloaded));
+  EXPECT_EQ(offered, stage_kernels);
+  JXL_TEST_ASSERT_OK(
+      VerifyRelativeError(expected, offloaded, 1e-6f, 1e-6f, _));
+}
+
+// Renders a frame with 4:2:0 chroma to "output", with separate horizontal and
+// vertical upsampling stages or, if "fused", with the stage doing both.
+Status RenderChroma420(bool fused, const FrameDimensions& frame_dim,
+                       bool use_slow_pipeline, Image3F* output) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  RenderPipeline::Builder builder(memory_manager, /*num_c=*/3);
+  for (size_t c : {0, 2}) {
+    if (fused) {
+      JXL_RETURN_IF_ERROR(builder.AddStage(GetChromaUpsampling2x2Stage(c)));
+    } else {
+      JXL_RETURN_IF_ERROR(builder.AddStage(
+          GetChromaUpsamplingStage(c, /*horizontal=*/true)));
+      JXL_RETURN_IF_ERROR(builder.AddStage(
+          GetChromaUpsamplingStage(c, /*horizontal=*/false)));
+    }
+  }
+  JXL_RETURN_IF_ERROR(
+      builder.AddStage(GetWriteToImage3FStage(memory_manager, output)));
+  if (use_slow_pipeline) builder.UseSimpleImplementation();
+  JXL_ASSIGN_OR_RETURN(auto pipeline, std::move(builder).Finalize(frame_dim));
+  JXL_RETURN_IF_ERROR(
+      pipeline->PrepareForThreads(1, /*use_group_ids=*/false));
+  for (size_t i = 0; i < frame_dim.num_groups; i++) {
+    auto input_buffers = pipeline->GetInputBuffers(i, 0);
+    for (size_t c = 0; c < 3; c++) {
+      const auto& buffer = input_buffers.GetBuffer(c);
+      for (size_t y = 0; y < buffer.second.ysize(); y++) {
+        float* JXL_RESTRICT row = buffer.second.Row(buffer.first, y);
+        for (size_t x = 0; x < buffer.second.xsize(); x++) {
+          row[x] = ((x * 7 + y * 13 + i * 3 + c) % 32) / 32.0f - 0.5f;
+        }
+      }
+    }
+    JXL_RETURN_IF_ERROR(input_buffers.Done());
+  }
+  return true;
+}
+
+TEST(RenderPipelineTest, FusedChromaUpsampling) {
+  FrameDimensions frame_dim;
+  frame_dim.Set(/*xsize_px=*/301, /*ysize_px=*/203,
+                /*group_size_shift=*/1,
+                /*max_hshift=*/1, /*max_vshift=*/1,
+                /*modular_mode=*/false, /*upsampling=*/1);
+  for (bool use_slow_pipeline : {false, true}) {
+    Image3F separate;
+    Image3F fused;
+    ASSERT_TRUE(RenderChroma420(/*fused=*/false, frame_dim, use_slow_pipeline,
+                                &separate));
+    ASSERT_TRUE(RenderChroma420(/*fused=*/true, frame_dim, use_slow_pipeline,
+                                &fused));
+    JXL_TEST_ASSERT_OK(SamePixels(separate, fused, _));
+  }
+}
+
 struct RenderPipelineTestInputSettings {
   // Input image.
   std::string input_path;
@@ -22,6 +22,7 @@
 #include "lib/jxl/frame_header.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 namespace jxl {
@@ -34,7 +35,8 @@ Status SimpleRenderPipeline::PrepareForThreadsInternal(size_t num,
   auto ch_size = [](size_t frame_size, size_t shift) {
     return DivCeil(frame_size, 1 << shift) + kRenderPipelineXOffset * 2;
   };
-  for (auto& entry : channel_shifts_[0]) {
+  for (size_t c = 0; c < channel_shifts_[0].size(); c++) {
+    const auto& entry = channel_shifts_[0][c];
     JXL_ASSIGN_OR_RETURN(
         ImageF ch,
         ImageF::Create(
@@ -42,7 +44,12 @@ Status SimpleRenderPipeline::PrepareForThreadsInternal(size_t num,
             ch_size(frame_dimensions_.xsize_upsampled, entry.first),
             ch_size(frame_dimensions_.ysize_upsampled, entry.second)));
     channel_data_.push_back(std::move(ch));
-    msan::PoisonImage(channel_data_.back());
+    // Unused channels are never written, but still copied around.
+    if (channel_is_used_[c]) {
+      msan::PoisonImage(channel_data_.back());
+    } else {
+      ZeroFillImage(&channel_data_.back());
+    }
   }
   return true;
 }
@@ -183,8 +190,19 @@ Status SimpleRenderPipeline::ProcessBuffers(size_t group_id, size_t thread_id) {
     // Run the pipeline.
     {
       JXL_RETURN_IF_ERROR(stage->SetInputSizes(input_sizes));
+      bool offloaded = false;
+      OffloadKernel kernel;
+      if (offload_ && stage->GetOffloadKernel(&kernel)) {
+        std::vector<ImageF*> channels(channel_data_.size());
+        for (size_t c = 0; c < channel_data_.size(); c++) {
+          channels[c] = &channel_data_[c];
+        }
+        JXL_ASSIGN_OR_RETURN(offloaded, offload_->RunStage(kernel, channels,
+                                                           output_channels,
+                                                           input_sizes));
+      }
       int border_y = stage->settings_.border_y;
-      for (size_t y = 0; y < ysize; y++) {
+      for (size_t y = 0; !offloaded && y < ysize; y++) {
         // Prepare input rows.
         for (size_t c = 0; c < channel_data_.size(); c++) {
           if (stage->GetChannelMode(c) == RenderPipelineChannelMode::kIgnored) {
@@ -205,9 +223,9 @@ Status SimpleRenderPipeline::ProcessBuffers(size_t group_id, size_t thread_id) {
                 (y << stage->settings_.shift_y) + iy + kRenderPipelineXOffset);
           }
         }
-        JXL_RETURN_IF_ERROR(stage->ProcessRow(input_rows, output_rows,
-                                              /*xextra=*/0, xsize,
-                                              /*xpos=*/0, y, thread_id));
+        JXL_RETURN_IF_ERROR(ProcessStageRow(stage_id, input_rows, output_rows,
+                                            /*xextra=*/0, xsize,
+                                            /*xpos=*/0, y, thread_id));
       }
     }
 
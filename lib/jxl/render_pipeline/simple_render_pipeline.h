@@ -9,6 +9,7 @@
 #include <jxl/memory_manager.h>
 
 #include <cstddef>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -16,6 +17,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/render_pipeline/render_pipeline.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 
 namespace jxl {
 
@@ -34,11 +36,17 @@ class SimpleRenderPipeline : public RenderPipeline {
   // kRenderPipelineXOffset.
   std::vector<ImageF> channel_data_;
   size_t processed_passes_ = 0;
+  std::unique_ptr<RenderPipelineOffload> offload_;
 
  public:
   explicit SimpleRenderPipeline(JxlMemoryManager* memory_manager)
       : RenderPipeline(memory_manager) {}
 
+  // Runs the stages that `offload` accepts on it.
+  void SetOffload(std::unique_ptr<RenderPipelineOffload> offload) {
+    offload_ = std::move(offload);
+  }
+
  private:
   Rect MakeChannelRect(size_t group_id, size_t channel);
 };
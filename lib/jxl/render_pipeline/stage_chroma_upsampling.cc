@@ -109,6 +109,63 @@ class VerticalChromaUpsamplingStage : public RenderPipelineStage {
   size_t c_;
 };
 
+// Does the work of a HorizontalChromaUpsamplingStage followed by a
+// VerticalChromaUpsamplingStage, with the same arithmetic, but keeps the
+// horizontally upsampled rows in registers instead of writing them to a
+// full-width intermediate row.
+class ChromaUpsampling2x2Stage : public RenderPipelineStage {
+ public:
+  explicit ChromaUpsampling2x2Stage(size_t channel)
+      : RenderPipelineStage(RenderPipelineStage::Settings::Symmetric(
+            /*shift=*/1, /*border=*/1)),
+        c_(channel) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    HWY_FULL(float) df;
+    xextra = RoundUpTo(xextra, Lanes(df));
+    auto threefour = Set(df, 0.75f);
+    auto onefour = Set(df, 0.25f);
+    const float* row_top = GetInputRow(input_rows, c_, -1);
+    const float* row_mid = GetInputRow(input_rows, c_, 0);
+    const float* row_bot = GetInputRow(input_rows, c_, 1);
+    float* row_out0 = GetOutputRow(output_rows, c_, 0);
+    float* row_out1 = GetOutputRow(output_rows, c_, 1);
+    // Horizontally upsampled pixels 2 * x and 2 * x + 1 of "row".
+    const auto left = [&](const float* row, ssize_t x) {
+      return MulAdd(onefour, LoadU(df, row + x - 1),
+                    Mul(LoadU(df, row + x), threefour));
+    };
+    const auto right = [&](const float* row, ssize_t x) {
+      return MulAdd(onefour, LoadU(df, row + x + 1),
+                    Mul(LoadU(df, row + x), threefour));
+    };
+    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
+         x += Lanes(df)) {
+      auto mid_left = Mul(left(row_mid, x), threefour);
+      auto mid_right = Mul(right(row_mid, x), threefour);
+      StoreInterleaved(df, MulAdd(left(row_top, x), onefour, mid_left),
+                       MulAdd(right(row_top, x), onefour, mid_right),
+                       row_out0 + x * 2);
+      StoreInterleaved(df, MulAdd(left(row_bot, x), onefour, mid_left),
+                       MulAdd(right(row_bot, x), onefour, mid_right),
+                       row_out1 + x * 2);
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c == c_ ? RenderPipelineChannelMode::kInOut
+                   : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "ChromaUps2x2"; }
+
+ private:
+  size_t c_;
+};
+
 std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
                                                               bool horizontal) {
   if (horizontal) {
@@ -118,6 +175,11 @@ std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
   }
 }
 
+std::unique_ptr<RenderPipelineStage> GetChromaUpsampling2x2Stage(
+    size_t channel) {
+  return jxl::make_unique<ChromaUpsampling2x2Stage>(channel);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -133,5 +195,12 @@ std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
   return HWY_DYNAMIC_DISPATCH(GetChromaUpsamplingStage)(channel, horizontal);
 }
 
+HWY_EXPORT(GetChromaUpsampling2x2Stage);
+
+std::unique_ptr<RenderPipelineStage> GetChromaUpsampling2x2Stage(
+    size_t channel) {
+  return HWY_DYNAMIC_DISPATCH(GetChromaUpsampling2x2Stage)(channel);
+}
+
 }  // namespace jxl
 #endif
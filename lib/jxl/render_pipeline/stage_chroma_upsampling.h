@@ -18,6 +18,11 @@ namespace jxl {
 // channel.
 std::unique_ptr<RenderPipelineStage> GetChromaUpsamplingStage(size_t channel,
                                                               bool horizontal);
+
+// Applies both the horizontal and the vertical upsampling to the given
+// channel, as done for 4:2:0 chroma, in a single stage.
+std::unique_ptr<RenderPipelineStage> GetChromaUpsampling2x2Stage(
+    size_t channel);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_CHROMA_UPSAMPLING_H_
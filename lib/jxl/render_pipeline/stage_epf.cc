@@ -5,8 +5,10 @@
 
 #include "lib/jxl/render_pipeline/stage_epf.h"
 
+#include <algorithm>
 #include <array>
 #include <cstddef>
+#include <cstring>
 #include <memory>
 #include <utility>
 
@@ -43,6 +45,29 @@ using hwy::HWY_NAMESPACE::Vec;
 using hwy::HWY_NAMESPACE::VFromD;
 using hwy::HWY_NAMESPACE::ZeroIfNegative;
 
+// Copies the pixels of the center rows to the output rows from "x", which is
+// in a block whose sigma is too small for the filter to change anything, to
+// the end of the run of such blocks or "end", and returns the end. Copying
+// the whole run at once spares the per-vector sigma checks, loads and stores.
+JXL_INLINE ssize_t CopyUnfilteredRun(const float* JXL_RESTRICT row_sigma,
+                                     ssize_t x, ssize_t end, size_t xpos,
+                                     float* const* rows_in,
+                                     float* const* rows_out) {
+  // Blocks are indexed from the left padding of the sigma image.
+  const ssize_t block_dim = kBlockDim;
+  const ssize_t x0 = static_cast<ssize_t>(xpos + kSigmaPadding * kBlockDim);
+  ssize_t run_end = x;
+  while (run_end < end && row_sigma[(run_end + x0) / block_dim] < kMinSigma) {
+    // Vectors do not cross blocks, so the next one starts at a block border.
+    const ssize_t block_end = ((run_end + x0) / block_dim + 1) * block_dim - x0;
+    run_end = std::min(block_end, end);
+  }
+  for (size_t c = 0; c < 3; c++) {
+    memcpy(rows_out[c] + x, rows_in[c] + x, (run_end - x) * sizeof(float));
+  }
+  return run_end;
+}
+
 JXL_INLINE Vec<DF> Weight(Vec<DF> sad, Vec<DF> inv_sigma, Vec<DF> thres) {
   auto v = MulAdd(sad, inv_sigma, Set(DF(), 1.0f));
   return ZeroIfNegative(v);
@@ -110,16 +135,22 @@ class EPF0Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* rows_center[3] = {rows[0][3], rows[1][3], rows[2][3]};
+    float* rows_out[3] = {GetOutputRow(output_rows, 0, 0),
+                          GetOutputRow(output_rows, 1, 0),
+                          GetOutputRow(output_rows, 2, 0)};
+    // Whole vectors, as the filter stores them.
+    const ssize_t x_end =
+        static_cast<ssize_t>(RoundUpTo(xsize + xextra, Lanes(df)));
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][3 + 0] + x);
-          StoreU(px, df, GetOutputRow(output_rows, c, 0) + x);
-        }
+        // The loop steps by vectors from the end of the run.
+        x = CopyUnfilteredRun(row_sigma, x, x_end, xpos, rows_center,
+                              rows_out) -
+            Lanes(df);
         continue;
       }
 
@@ -245,16 +276,22 @@ class EPF1Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* rows_center[3] = {rows[0][2], rows[1][2], rows[2][2]};
+    float* rows_out[3] = {GetOutputRow(output_rows, 0, 0),
+                          GetOutputRow(output_rows, 1, 0),
+                          GetOutputRow(output_rows, 2, 0)};
+    // Whole vectors, as the filter stores them.
+    const ssize_t x_end =
+        static_cast<ssize_t>(RoundUpTo(xsize + xextra, Lanes(df)));
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][2 + 0] + x);
-          Store(px, df, GetOutputRow(output_rows, c, 0) + x);
-        }
+        // The loop steps by vectors from the end of the run.
+        x = CopyUnfilteredRun(row_sigma, x, x_end, xpos, rows_center,
+                              rows_out) -
+            Lanes(df);
         continue;
       }
 
@@ -431,16 +468,22 @@ class EPF2Stage : public RenderPipelineStage {
             ? sad_mul_border
             : sad_mul_center;
 
-    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
-         x += Lanes(df)) {
+    float* rows_center[3] = {rows[0][1], rows[1][1], rows[2][1]};
+    float* rows_out[3] = {GetOutputRow(output_rows, 0, 0),
+                          GetOutputRow(output_rows, 1, 0),
+                          GetOutputRow(output_rows, 2, 0)};
+    // Whole vectors, as the filter stores them.
+    const ssize_t x_end =
+        static_cast<ssize_t>(RoundUpTo(xsize + xextra, Lanes(df)));
+    for (ssize_t x = -xextra; x < x_end; x += Lanes(df)) {
       size_t bx = (x + xpos + kSigmaPadding * kBlockDim) / kBlockDim;
       size_t ix = (x + xpos) % kBlockDim;
 
       if (row_sigma[bx] < kMinSigma) {
-        for (size_t c = 0; c < 3; c++) {
-          auto px = Load(df, rows[c][1 + 0] + x);
-          Store(px, df, GetOutputRow(output_rows, c, 0) + x);
-        }
+        // The loop steps by vectors from the end of the run.
+        x = CopyUnfilteredRun(row_sigma, x, x_end, xpos, rows_center,
+                              rows_out) -
+            Lanes(df);
         continue;
       }
 
@@ -0,0 +1,135 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Conversions from linear light to the transfer function of the output, shared
+// by the stages that end with one.
+
+#include <memory>
+
+#include "lib/jxl/base/matrix_ops.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+
+#if defined(LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_INL_H_) == \
+    defined(HWY_TARGET_TOGGLE)
+#ifdef LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_INL_H_
+#undef LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_INL_H_
+#else
+#define LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_INL_H_
+#endif
+
+#include <hwy/highway.h>
+
+#include "lib/jxl/cms/tone_mapping-inl.h"
+#include "lib/jxl/cms/transfer_functions-inl.h"
+#include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
+#include "lib/jxl/dec_xyb-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+namespace {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::IfThenZeroElse;
+
+struct OpLinear {
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {}
+};
+
+struct OpRgb {
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    for (T* val : {r, g, b}) {
+#if JXL_HIGH_PRECISION
+      *val = TF_SRGB().EncodedFromDisplay(d, *val);
+#else
+      *val = FastLinearToSRGB(d, *val);
+#endif
+    }
+  }
+};
+
+struct OpPq {
+  explicit OpPq(const float intensity_target) : tf_pq_(intensity_target) {}
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    for (T* val : {r, g, b}) {
+      *val = tf_pq_.EncodedFromDisplay(d, *val);
+    }
+  }
+  TF_PQ tf_pq_;
+};
+
+struct OpHlg {
+  explicit OpHlg(const Vector3& luminances, const float intensity_target)
+      : hlg_ootf_(HlgOOTF::ToSceneLight(/*display_luminance=*/intensity_target,
+                                        luminances)) {}
+
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    hlg_ootf_.Apply(r, g, b);
+    for (T* val : {r, g, b}) {
+      *val = TF_HLG().EncodedFromDisplay(d, *val);
+    }
+  }
+  HlgOOTF hlg_ootf_;
+};
+
+struct Op709 {
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    for (T* val : {r, g, b}) {
+      *val = TF_709().EncodedFromDisplay(d, *val);
+    }
+  }
+};
+
+struct OpGamma {
+  const float inverse_gamma;
+  template <typename D, typename T>
+  void Transform(D d, T* r, T* g, T* b) const {
+    for (T* val : {r, g, b}) {
+      *val = IfThenZeroElse(Le(*val, Set(d, 1e-5f)),
+                            FastPowf(d, *val, Set(d, inverse_gamma)));
+    }
+  }
+};
+
+// Returns the stage that `make` creates from the op converting linear light to
+// the transfer function of `output_encoding_info.color_encoding`.
+template <typename Make>
+std::unique_ptr<RenderPipelineStage> MakeStageWithFromLinearOp(
+    const OutputEncodingInfo& output_encoding_info, const Make& make) {
+  const auto& tf = output_encoding_info.color_encoding.Tf();
+  if (tf.IsLinear()) {
+    return make(OpLinear());
+  } else if (tf.IsSRGB()) {
+    return make(OpRgb());
+  } else if (tf.IsPQ()) {
+    return make(OpPq(output_encoding_info.orig_intensity_target));
+  } else if (tf.IsHLG()) {
+    return make(OpHlg(output_encoding_info.luminances,
+                      output_encoding_info.desired_intensity_target));
+  } else if (tf.Is709()) {
+    return make(Op709());
+  } else if (tf.have_gamma || tf.IsDCI()) {
+    return make(OpGamma{output_encoding_info.inverse_gamma});
+  } else {
+    // This is a programming error.
+    JXL_DEBUG_ABORT("Invalid target encoding");
+    return nullptr;
+  }
+}
+
+}  // namespace
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#endif  // LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_INL_H_
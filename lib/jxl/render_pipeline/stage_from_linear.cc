@@ -8,10 +8,10 @@
 #include <cstddef>
 #include <cstdio>
 #include <memory>
+#include <utility>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
-#include "lib/jxl/base/matrix_ops.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/dec_xyb.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
@@ -22,88 +22,23 @@
 #include <hwy/highway.h>
 
 #include "lib/jxl/base/sanitizers.h"
-#include "lib/jxl/cms/tone_mapping-inl.h"
-#include "lib/jxl/cms/transfer_functions-inl.h"
-#include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
+#include "lib/jxl/dec_xyb-inl.h"
+#include "lib/jxl/render_pipeline/stage_from_linear-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 namespace {
 
-// These templates are not found via ADL.
-using hwy::HWY_NAMESPACE::IfThenZeroElse;
-
-struct OpLinear {
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {}
-};
-
-struct OpRgb {
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {
-    for (T* val : {r, g, b}) {
-#if JXL_HIGH_PRECISION
-      *val = TF_SRGB().EncodedFromDisplay(d, *val);
-#else
-      *val = FastLinearToSRGB(d, *val);
-#endif
-    }
-  }
-};
-
-struct OpPq {
-  explicit OpPq(const float intensity_target) : tf_pq_(intensity_target) {}
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {
-    for (T* val : {r, g, b}) {
-      *val = tf_pq_.EncodedFromDisplay(d, *val);
-    }
-  }
-  TF_PQ tf_pq_;
-};
-
-struct OpHlg {
-  explicit OpHlg(const Vector3& luminances, const float intensity_target)
-      : hlg_ootf_(HlgOOTF::ToSceneLight(/*display_luminance=*/intensity_target,
-                                        luminances)) {}
-
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {
-    hlg_ootf_.Apply(r, g, b);
-    for (T* val : {r, g, b}) {
-      *val = TF_HLG().EncodedFromDisplay(d, *val);
-    }
-  }
-  HlgOOTF hlg_ootf_;
-};
-
-struct Op709 {
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {
-    for (T* val : {r, g, b}) {
-      *val = TF_709().EncodedFromDisplay(d, *val);
-    }
-  }
-};
-
-struct OpGamma {
-  const float inverse_gamma;
-  template <typename D, typename T>
-  void Transform(D d, T* r, T* g, T* b) const {
-    for (T* val : {r, g, b}) {
-      *val = IfThenZeroElse(Le(*val, Set(d, 1e-5f)),
-                            FastPowf(d, *val, Set(d, inverse_gamma)));
-    }
-  }
-};
-
-template <typename Op>
+// With kFromXYB, the input is XYB and is first converted to linear, so that
+// the data goes through both conversions in a single pass.
+template <typename Op, bool kFromXYB>
 class FromLinearStage : public RenderPipelineStage {
  public:
-  explicit FromLinearStage(Op&& op)
+  FromLinearStage(Op&& op, const OpsinParams& opsin_params)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
-        op_(std::move(op)) {}
+        op_(std::move(op)),
+        opsin_params_(opsin_params) {}
 
   Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
                     size_t xextra, size_t xsize, size_t xpos, size_t ypos,
@@ -124,6 +59,12 @@ class FromLinearStage : public RenderPipelineStage {
       auto r = LoadU(d, row0 + x);
       auto g = LoadU(d, row1 + x);
       auto b = LoadU(d, row2 + x);
+      if (kFromXYB) {
+        const auto opsin_x = r;
+        const auto opsin_y = g;
+        const auto opsin_b = b;
+        XybToRgb(d, opsin_x, opsin_y, opsin_b, opsin_params_, &r, &g, &b);
+      }
       op_.Transform(d, &r, &g, &b);
       StoreU(r, d, row0 + x);
       StoreU(g, d, row1 + x);
@@ -140,40 +81,35 @@ class FromLinearStage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
-  const char* GetName() const override { return "FromLinear"; }
+  const char* GetName() const override {
+    return kFromXYB ? "XYBFromLinear" : "FromLinear";
+  }
 
  private:
   Op op_;
+  const OpsinParams opsin_params_;
 };
 
-template <typename Op>
-std::unique_ptr<FromLinearStage<Op>> MakeFromLinearStage(Op&& op) {
-  return jxl::make_unique<FromLinearStage<Op>>(std::forward<Op>(op));
+template <bool kFromXYB>
+std::unique_ptr<RenderPipelineStage> MakeStageForTf(
+    const OutputEncodingInfo& output_encoding_info) {
+  return MakeStageWithFromLinearOp(
+      output_encoding_info,
+      [&](auto op) -> std::unique_ptr<RenderPipelineStage> {
+        using Op = decltype(op);
+        return jxl::make_unique<FromLinearStage<Op, kFromXYB>>(
+            std::move(op), output_encoding_info.opsin_params);
+      });
 }
 
 std::unique_ptr<RenderPipelineStage> GetFromLinearStage(
     const OutputEncodingInfo& output_encoding_info) {
-  const auto& tf = output_encoding_info.color_encoding.Tf();
-  if (tf.IsLinear()) {
-    return MakeFromLinearStage(OpLinear());
-  } else if (tf.IsSRGB()) {
-    return MakeFromLinearStage(OpRgb());
-  } else if (tf.IsPQ()) {
-    return MakeFromLinearStage(
-        OpPq(output_encoding_info.orig_intensity_target));
-  } else if (tf.IsHLG()) {
-    return MakeFromLinearStage(
-        OpHlg(output_encoding_info.luminances,
-              output_encoding_info.desired_intensity_target));
-  } else if (tf.Is709()) {
-    return MakeFromLinearStage(Op709());
-  } else if (tf.have_gamma || tf.IsDCI()) {
-    return MakeFromLinearStage(OpGamma{output_encoding_info.inverse_gamma});
-  } else {
-    // This is a programming error.
-    JXL_DEBUG_ABORT("Invalid target encoding");
-    return nullptr;
-  }
+  return MakeStageForTf<false>(output_encoding_info);
+}
+
+std::unique_ptr<RenderPipelineStage> GetXYBFromLinearStage(
+    const OutputEncodingInfo& output_encoding_info) {
+  return MakeStageForTf<true>(output_encoding_info);
 }
 
 }  // namespace
@@ -192,5 +128,12 @@ std::unique_ptr<RenderPipelineStage> GetFromLinearStage(
   return HWY_DYNAMIC_DISPATCH(GetFromLinearStage)(output_encoding_info);
 }
 
+HWY_EXPORT(GetXYBFromLinearStage);
+
+std::unique_ptr<RenderPipelineStage> GetXYBFromLinearStage(
+    const OutputEncodingInfo& output_encoding_info) {
+  return HWY_DYNAMIC_DISPATCH(GetXYBFromLinearStage)(output_encoding_info);
+}
+
 }  // namespace jxl
 #endif
@@ -17,6 +17,11 @@ namespace jxl {
 std::unique_ptr<RenderPipelineStage> GetFromLinearStage(
     const OutputEncodingInfo& output_encoding_info);
 
+// Converts the color channels from XYB to the specified output encoding, doing
+// the work of an XYB stage followed by a FromLinear stage in one pass.
+std::unique_ptr<RenderPipelineStage> GetXYBFromLinearStage(
+    const OutputEncodingInfo& output_encoding_info);
+
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_FROM_LINEAR_H_
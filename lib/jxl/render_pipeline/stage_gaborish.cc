@@ -12,6 +12,7 @@
 #include "lib/jxl/base/compiler_specific.h"  // ssize_t
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/loop_filter.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -101,6 +102,12 @@ class GaborishStage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
+  bool GetOffloadKernel(OffloadKernel* kernel) const final {
+    kernel->type = OffloadKernel::Type::kGaborish;
+    for (size_t i = 0; i < 9; i++) kernel->gaborish_weights[i] = weights_[i];
+    return true;
+  }
+
   const char* GetName() const override { return "Gab"; }
 
  private:
@@ -0,0 +1,159 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/jxl/render_pipeline/stage_gain_map.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "lib/jxl/base/common.h"
+#include "lib/jxl/base/compiler_specific.h"  // ssize_t
+#include "lib/jxl/base/sanitizers.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "lib/jxl/render_pipeline/stage_gain_map.cc"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+
+#include "lib/jxl/base/fast_math-inl.h"
+
+HWY_BEFORE_NAMESPACE();
+namespace jxl {
+namespace HWY_NAMESPACE {
+
+// These templates are not found via ADL.
+using hwy::HWY_NAMESPACE::Add;
+using hwy::HWY_NAMESPACE::Clamp;
+using hwy::HWY_NAMESPACE::ConvertTo;
+using hwy::HWY_NAMESPACE::Floor;
+using hwy::HWY_NAMESPACE::GatherIndex;
+using hwy::HWY_NAMESPACE::Iota;
+using hwy::HWY_NAMESPACE::Min;
+using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::Sub;
+
+// Position of the center of pixel `pos` in a gain map with `scale` times
+// fewer pixels, clamped to the centers of its edge pixels.
+float GainMapPosition(float pos, float scale, size_t size) {
+  return std::min(std::max((pos + 0.5f) * scale - 0.5f, 0.0f),
+                  static_cast<float>(size - 1));
+}
+
+class GainMapStage : public RenderPipelineStage {
+ public:
+  GainMapStage(const GainMap& gain_map, size_t xsize, size_t ysize)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        gain_map_(gain_map),
+        x_scale_(static_cast<float>(gain_map.xsize) / xsize),
+        y_scale_(static_cast<float>(gain_map.ysize) / ysize) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    const HWY_FULL(float) d;
+    const Rebind<int32_t, decltype(d)> di;
+    const GainMap& gm = gain_map_;
+    const size_t stride = gm.xsize * gm.channels;
+    const float py = GainMapPosition(ypos, y_scale_, gm.ysize);
+    const size_t y0 = static_cast<size_t>(py);
+    const auto fy = Set(d, py - y0);
+    const float* JXL_RESTRICT row0 = gm.values.data() + y0 * stride;
+    const float* JXL_RESTRICT row1 =
+        gm.values.data() + std::min(y0 + 1, gm.ysize - 1) * stride;
+    const size_t xsize_v = RoundUpTo(xsize, Lanes(d));
+    float* JXL_RESTRICT p[3];
+    for (size_t c = 0; c < 3; c++) {
+      p[c] = GetInputRow(input_rows, c, 0);
+      // The padding lanes are processed too, and only their results are
+      // uninitialized.
+      msan::UnpoisonMemory(p[c] + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+    const auto max_x = Set(d, static_cast<float>(gm.xsize - 1));
+    const auto max_xi = Set(di, static_cast<int32_t>(gm.xsize - 1));
+    const auto channels = Set(di, static_cast<int32_t>(gm.channels));
+    for (ssize_t x = -xextra; x < static_cast<ssize_t>(xsize + xextra);
+         x += Lanes(d)) {
+      const auto pos = Iota(d, static_cast<float>(xpos) + x + 0.5f);
+      const auto px =
+          Clamp(MulAdd(pos, Set(d, x_scale_), Set(d, -0.5f)), Zero(d), max_x);
+      const auto x0 = Floor(px);
+      const auto fx = Sub(px, x0);
+      const auto xi0 = ConvertTo(di, x0);
+      const auto i0 = Mul(xi0, channels);
+      const auto i1 = Mul(Min(Add(xi0, Set(di, 1)), max_xi), channels);
+      for (size_t c = 0; c < 3; c++) {
+        const size_t gc = gm.channels == 1 ? 0 : c;
+        const auto top0 = GatherIndex(d, row0 + gc, i0);
+        const auto top1 = GatherIndex(d, row0 + gc, i1);
+        const auto bottom0 = GatherIndex(d, row1 + gc, i0);
+        const auto bottom1 = GatherIndex(d, row1 + gc, i1);
+        const auto top = MulAdd(fx, Sub(top1, top0), top0);
+        const auto bottom = MulAdd(fx, Sub(bottom1, bottom0), bottom0);
+        auto g = MulAdd(fy, Sub(bottom, top), top);
+        if (gm.inv_gamma[c] != 1.0f) {
+          // Gain map values of 0 would have an infinitely negative log.
+          g = FastPow2f(d, Max(Mul(FastLog2f(d, Max(g, Set(d, 1e-30f))),
+                                   Set(d, gm.inv_gamma[c])),
+                               Set(d, -126.0f)));
+        }
+        const auto log2_gain =
+            MulAdd(g, Set(d, gm.log2_max[c] - gm.log2_min[c]),
+                   Set(d, gm.log2_min[c]));
+        const auto gain =
+            FastPow2f(d, Clamp(log2_gain, Set(d, -126.0f), Set(d, 127.0f)));
+        const auto v = LoadU(d, p[c] + x);
+        StoreU(MulSub(Add(v, Set(d, gm.base_offset[c])), gain,
+                      Set(d, gm.alternate_offset[c])),
+               d, p[c] + x);
+      }
+    }
+    for (size_t c = 0; c < 3; c++) {
+      msan::PoisonMemory(p[c] + xsize, sizeof(float) * (xsize_v - xsize));
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 ? RenderPipelineChannelMode::kInPlace
+                 : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "GainMap"; }
+
+ private:
+  const GainMap& gain_map_;
+  float x_scale_;
+  float y_scale_;
+};
+
+std::unique_ptr<RenderPipelineStage> GetGainMapStage(const GainMap& gain_map,
+                                                     size_t xsize,
+                                                     size_t ysize) {
+  return jxl::make_unique<GainMapStage>(gain_map, xsize, ysize);
+}
+
+// NOLINTNEXTLINE(google-readability-namespace-comments)
+}  // namespace HWY_NAMESPACE
+}  // namespace jxl
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+namespace jxl {
+
+HWY_EXPORT(GetGainMapStage);
+
+std::unique_ptr<RenderPipelineStage> GetGainMapStage(const GainMap& gain_map,
+                                                     size_t xsize,
+                                                     size_t ysize) {
+  return HWY_DYNAMIC_DISPATCH(GetGainMapStage)(gain_map, xsize, ysize);
+}
+
+}  // namespace jxl
+#endif
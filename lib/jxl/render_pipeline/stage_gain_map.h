@@ -0,0 +1,45 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_JXL_RENDER_PIPELINE_STAGE_GAIN_MAP_H_
+#define LIB_JXL_RENDER_PIPELINE_STAGE_GAIN_MAP_H_
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "lib/jxl/render_pipeline/render_pipeline_stage.h"
+
+namespace jxl {
+
+// A gain map set with JxlDecoderSetGainMap, with its parameters for the
+// headroom of the target display.
+struct GainMap {
+  // For each color channel, the log2 of the gain for gain map values 0 and 1,
+  // times the weight of the gain map for the display.
+  std::array<float, 3> log2_min;
+  std::array<float, 3> log2_max;
+  std::array<float, 3> inv_gamma;
+  std::array<float, 3> base_offset;
+  std::array<float, 3> alternate_offset;
+  size_t xsize = 0;
+  size_t ysize = 0;
+  // 1, or 3 for a gain per color channel.
+  size_t channels = 0;
+  // Samples in [0, 1], interleaved by pixel. Empty if there is no gain map.
+  std::vector<float> values;
+};
+
+// Applies `gain_map` to the color channels of a frame of `xsize` x `ysize`
+// pixels, which must be in linear space, upsampling the gain map bilinearly
+// to the size of the frame.
+std::unique_ptr<RenderPipelineStage> GetGainMapStage(const GainMap& gain_map,
+                                                     size_t xsize,
+                                                     size_t ysize);
+
+}  // namespace jxl
+
+#endif  // LIB_JXL_RENDER_PIPELINE_STAGE_GAIN_MAP_H_
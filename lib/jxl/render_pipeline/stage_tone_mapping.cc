@@ -22,17 +22,23 @@
 #include <hwy/highway.h>
 
 #include "lib/jxl/cms/tone_mapping-inl.h"
+#include "lib/jxl/common.h"  // JXL_HIGH_PRECISION
 #include "lib/jxl/dec_xyb-inl.h"
+#include "lib/jxl/render_pipeline/stage_from_linear-inl.h"
 
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
 
+// Op converts the tone mapped colors from linear, so that the common case of
+// tone mapping to an SDR display goes through a single stage.
+template <typename Op>
 class ToneMappingStage : public RenderPipelineStage {
  public:
-  explicit ToneMappingStage(OutputEncodingInfo output_encoding_info)
+  ToneMappingStage(OutputEncodingInfo output_encoding_info, Op&& op)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
-        output_encoding_info_(std::move(output_encoding_info)) {
+        output_encoding_info_(std::move(output_encoding_info)),
+        op_(std::move(op)) {
     if (output_encoding_info_.desired_intensity_target ==
         output_encoding_info_.orig_intensity_target) {
       // No tone mapping requested.
@@ -102,6 +108,7 @@ class ToneMappingStage : public RenderPipelineStage {
       r = Mul(r, Set(d, from_desired_intensity_target_));
       g = Mul(g, Set(d, from_desired_intensity_target_));
       b = Mul(b, Set(d, from_desired_intensity_target_));
+      op_.Transform(d, &r, &g, &b);
       StoreU(r, d, row0 + x);
       StoreU(g, d, row1 + x);
       StoreU(b, d, row2 + x);
@@ -120,8 +127,13 @@ class ToneMappingStage : public RenderPipelineStage {
   const char* GetName() const override { return "ToneMapping"; }
 
  private:
+#if JXL_HIGH_PRECISION
   using ToneMapper = Rec2408ToneMapper<HWY_FULL(float)>;
+#else
+  using ToneMapper = Rec2408ToneMapperLut<HWY_FULL(float)>;
+#endif
   OutputEncodingInfo output_encoding_info_;
+  Op op_;
   std::unique_ptr<ToneMapper> tone_mapper_;
   std::unique_ptr<HlgOOTF> hlg_ootf_;
   // When the target colorspace is PQ, 1 represents 10000 nits instead of
@@ -131,13 +143,25 @@ class ToneMappingStage : public RenderPipelineStage {
   float from_desired_intensity_target_ = 1.f;
 };
 
-std::unique_ptr<RenderPipelineStage> GetToneMappingStage(
-    const OutputEncodingInfo& output_encoding_info) {
-  auto stage = jxl::make_unique<ToneMappingStage>(output_encoding_info);
+template <typename Op>
+std::unique_ptr<RenderPipelineStage> MakeToneMappingStage(
+    const OutputEncodingInfo& output_encoding_info, Op&& op) {
+  auto stage = jxl::make_unique<ToneMappingStage<Op>>(output_encoding_info,
+                                                      std::forward<Op>(op));
   if (!stage->IsNeeded()) return nullptr;
   return stage;
 }
 
+std::unique_ptr<RenderPipelineStage> GetToneMappingStage(
+    const OutputEncodingInfo& output_encoding_info, bool from_linear) {
+  if (!from_linear) {
+    return MakeToneMappingStage(output_encoding_info, OpLinear());
+  }
+  return MakeStageWithFromLinearOp(output_encoding_info, [&](auto op) {
+    return MakeToneMappingStage(output_encoding_info, std::move(op));
+  });
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -149,8 +173,9 @@ namespace jxl {
 HWY_EXPORT(GetToneMappingStage);
 
 std::unique_ptr<RenderPipelineStage> GetToneMappingStage(
-    const OutputEncodingInfo& output_encoding_info) {
-  return HWY_DYNAMIC_DISPATCH(GetToneMappingStage)(output_encoding_info);
+    const OutputEncodingInfo& output_encoding_info, bool from_linear) {
+  return HWY_DYNAMIC_DISPATCH(GetToneMappingStage)(output_encoding_info,
+                                                   from_linear);
 }
 
 }  // namespace jxl
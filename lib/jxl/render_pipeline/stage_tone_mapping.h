@@ -24,9 +24,13 @@ namespace jxl {
 // `output_encoding_info.desired_intensity_target` nits, except in the PQ
 // special case in which it remains 10000.
 //
+// With `from_linear`, the stage also does the work of the FromLinear stage that
+// would follow it, and the image is in `output_encoding_info.color_encoding`
+// after it.
+//
 // If no tone mapping is necessary, this will return nullptr.
 std::unique_ptr<RenderPipelineStage> GetToneMappingStage(
-    const OutputEncodingInfo& output_encoding_info);
+    const OutputEncodingInfo& output_encoding_info, bool from_linear = false);
 
 }  // namespace jxl
 
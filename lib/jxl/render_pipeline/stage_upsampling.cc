@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <memory>
 
 #include "lib/jxl/base/common.h"
@@ -14,6 +15,7 @@
 #include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image_metadata.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -31,6 +33,7 @@ namespace HWY_NAMESPACE {
 using hwy::HWY_NAMESPACE::Clamp;
 using hwy::HWY_NAMESPACE::Max;
 using hwy::HWY_NAMESPACE::Min;
+using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::MulAdd;
 
 class UpsamplingStage : public RenderPipelineStage {
@@ -44,14 +47,18 @@ class UpsamplingStage : public RenderPipelineStage {
                            : shift == 2 ? ups_factors.upsampling4_weights
                                         : ups_factors.upsampling8_weights;
     size_t N = 1 << (shift - 1);
+    float kernel[4][4][5][5];
     for (size_t i = 0; i < 5 * N; i++) {
       for (size_t j = 0; j < 5 * N; j++) {
         size_t y = std::min(i, j);
         size_t x = std::max(i, j);
-        kernel_[j / 5][i / 5][j % 5][i % 5] =
+        kernel[j / 5][i / 5][j % 5][i % 5] =
             weights[5 * N * y - y * (y - 1) / 2 + x - y];
       }
     }
+    if (shift == 1) InitWeights<2>(kernel);
+    if (shift == 2) InitWeights<4>(kernel);
+    if (shift == 3) InitWeights<8>(kernel);
   }
 
   Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
@@ -90,26 +97,51 @@ class UpsamplingStage : public RenderPipelineStage {
                    : RenderPipelineChannelMode::kIgnored;
   }
 
+  bool GetOffloadKernel(OffloadKernel* kernel) const final {
+    kernel->type = OffloadKernel::Type::kUpsampling;
+    kernel->upsampling_c = c_;
+    kernel->upsampling_shift = settings_.shift_x;
+    memcpy(kernel->upsampling_weights, weights_, sizeof(weights_));
+    return true;
+  }
+
   const char* GetName() const override { return "Upsample"; }
 
  private:
   template <size_t N>
-  JXL_INLINE float Kernel(size_t x, size_t y, ssize_t ix, ssize_t iy) const {
+  static JXL_INLINE float Kernel(const float (&kernel)[4][4][5][5], size_t x,
+                                 size_t y, ssize_t ix, ssize_t iy) {
     static_assert(N == 2 || N == 4 || N == 8, "N must be 2, 4, or 8");
     ix += 2;
     iy += 2;
     if (N == 2) {
-      return kernel_[0][0][y % 2 ? 4 - iy : iy][x % 2 ? 4 - ix : ix];
+      return kernel[0][0][y % 2 ? 4 - iy : iy][x % 2 ? 4 - ix : ix];
     }
     if (N == 4) {
-      return kernel_[y % 4 < 2 ? y % 2 : 1 - y % 2]
-                    [x % 4 < 2 ? x % 2 : 1 - x % 2][y % 4 < 2 ? iy : 4 - iy]
-                    [x % 4 < 2 ? ix : 4 - ix];
+      return kernel[y % 4 < 2 ? y % 2 : 1 - y % 2]
+                   [x % 4 < 2 ? x % 2 : 1 - x % 2][y % 4 < 2 ? iy : 4 - iy]
+                   [x % 4 < 2 ? ix : 4 - ix];
     }
     if (N == 8) {
-      return kernel_[y % 8 < 4 ? y % 4 : 3 - y % 4]
-                    [x % 8 < 4 ? x % 4 : 3 - x % 4][y % 8 < 4 ? iy : 4 - iy]
-                    [x % 8 < 4 ? ix : 4 - ix];
+      return kernel[y % 8 < 4 ? y % 4 : 3 - y % 4]
+                   [x % 8 < 4 ? x % 4 : 3 - x % 4][y % 8 < 4 ? iy : 4 - iy]
+                   [x % 8 < 4 ? ix : 4 - ix];
+    }
+  }
+
+  // Unfolds the symmetries of the kernel, so that ProcessRowImpl reads the
+  // 25 weights of each output pixel consecutively.
+  template <size_t N>
+  void InitWeights(const float (&kernel)[4][4][5][5]) {
+    for (size_t oy = 0; oy < N; oy++) {
+      for (size_t ox = 0; ox < N; ox++) {
+        for (ssize_t iy = -2; iy <= 2; iy++) {
+          for (ssize_t ix = -2; ix <= 2; ix++) {
+            weights_[oy * N + ox][(iy + 2) * 5 + ix + 2] =
+                Kernel<N>(kernel, ox, oy, ix, iy);
+          }
+        }
+      }
     }
   }
 
@@ -139,40 +171,58 @@ class UpsamplingStage : public RenderPipelineStage {
       ups[7] = &ups7;
     }
 
+    const float* rows[5];
+    for (ssize_t iy = -2; iy <= 2; iy++) {
+      rows[iy + 2] = GetInputRow(input_rows, c_, iy);
+    }
+    float* dst_rows[N];
     for (size_t oy = 0; oy < N; oy++) {
-      float* dst_row = GetOutputRow(output_rows, c_, oy);
-      for (ssize_t x = x0; x < x1; x += Lanes(df)) {
+      dst_rows[oy] = GetOutputRow(output_rows, c_, oy);
+    }
+
+    for (ssize_t x = x0; x < x1; x += Lanes(df)) {
+      // The 5x5 neighbourhood and its range are shared by the N*N output
+      // pixels of each input pixel.
+      V in[25];
+      auto min = LoadU(df, rows[2] + x);
+      auto max = min;
+      for (size_t iy = 0; iy < 5; iy++) {
+        for (ssize_t ix = -2; ix <= 2; ix++) {
+          const V v = LoadU(df, rows[iy] + x + ix);
+          in[iy * 5 + ix + 2] = v;
+          min = Min(v, min);
+          max = Max(v, max);
+        }
+      }
+      for (size_t oy = 0; oy < N; oy++) {
         for (size_t ox = 0; ox < N; ox++) {
-          auto result = Zero(df);
-          auto min = LoadU(df, GetInputRow(input_rows, c_, 0) + x);
-          auto max = min;
-          for (ssize_t iy = -2; iy <= 2; iy++) {
-            for (ssize_t ix = -2; ix <= 2; ix++) {
-              auto v = LoadU(df, GetInputRow(input_rows, c_, iy) + x + ix);
-              result = MulAdd(Set(df, Kernel<N>(ox, oy, ix, iy)), v, result);
-              min = Min(v, min);
-              max = Max(v, max);
-            }
+          const float* JXL_RESTRICT w = weights_[oy * N + ox];
+          auto result = Mul(Set(df, w[0]), in[0]);
+          for (size_t k = 1; k < 25; k++) {
+            result = MulAdd(Set(df, w[k]), in[k], result);
           }
           // Avoid overshooting.
           *ups[ox] = Clamp(result, min, max);
         }
+        float* dst = dst_rows[oy] + x * N;
         if (N == 2) {
-          StoreInterleaved(df, ups0, ups1, dst_row + x * N);
+          StoreInterleaved(df, ups0, ups1, dst);
         }
         if (N == 4) {
-          StoreInterleaved(df, ups0, ups1, ups2, ups3, dst_row + x * N);
+          StoreInterleaved(df, ups0, ups1, ups2, ups3, dst);
         }
         if (N == 8) {
           StoreInterleaved(df, ups0, ups1, ups2, ups3, ups4, ups5, ups6, ups7,
-                           dst_row + x * N);
+                           dst);
         }
       }
     }
   }
 
   size_t c_;
-  float kernel_[4][4][5][5];
+  // Weights of the 5x5 neighbourhood, in row-major order, for each of the
+  // N*N output pixels of an input pixel.
+  float weights_[64][25];
 };
 
 std::unique_ptr<RenderPipelineStage> GetUpsamplingStage(
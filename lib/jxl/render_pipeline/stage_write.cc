@@ -9,10 +9,13 @@
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -28,6 +31,7 @@
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_metadata.h"
+#include "lib/jxl/image_ops.h"
 #include "lib/jxl/memory_manager_internal.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
@@ -36,6 +40,9 @@
 #include <hwy/foreach_target.h>
 #include <hwy/highway.h>
 
+#include "lib/jxl/dec_xyb-inl.h"
+#include "lib/jxl/render_pipeline/stage_from_linear-inl.h"
+
 HWY_BEFORE_NAMESPACE();
 namespace jxl {
 namespace HWY_NAMESPACE {
@@ -49,7 +56,9 @@ using hwy::HWY_NAMESPACE::Mul;
 using hwy::HWY_NAMESPACE::NearestInt;
 using hwy::HWY_NAMESPACE::Or;
 using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftLeft;
 using hwy::HWY_NAMESPACE::ShiftLeftSame;
+using hwy::HWY_NAMESPACE::ShiftRight;
 using hwy::HWY_NAMESPACE::ShiftRightSame;
 using hwy::HWY_NAMESPACE::VFromD;
 
@@ -129,15 +138,17 @@ class WriteToOutputStage : public RenderPipelineStage {
   WriteToOutputStage(const ImageOutput& main_output, size_t width,
                      size_t height, bool has_alpha, bool unpremul_alpha,
                      size_t alpha_c, Orientation undo_orientation,
+                     size_t downsampling,
                      const std::vector<ImageOutput>& extra_output,
                      JxlMemoryManager* memory_manager)
       : RenderPipelineStage(RenderPipelineStage::Settings()),
         width_(width),
         height_(height),
+        downsampling_(downsampling),
         main_(main_output),
         num_color_(main_.num_channels_ < 3 ? 1 : 3),
         want_alpha_(main_.num_channels_ == 2 || main_.num_channels_ == 4),
-        has_alpha_(has_alpha),
+        has_alpha_(has_alpha && want_alpha_),
         unpremul_alpha_(unpremul_alpha),
         alpha_c_(alpha_c),
         flip_x_(ShouldFlipX(undo_orientation)),
@@ -175,6 +186,9 @@ class WriteToOutputStage : public RenderPipelineStage {
                     size_t thread_id) const final {
     JXL_ENSURE(xextra == 0);
     JXL_ENSURE(main_.run_opaque_ || main_.buffer_);
+    if (downsampling_ > 1) {
+      return ProcessDownsampledRow(input_rows, xsize, xpos, ypos, thread_id);
+    }
     if (ypos >= height_) return true;
     if (xpos >= width_) return true;
     if (flip_y_) {
@@ -191,18 +205,11 @@ class WriteToOutputStage : public RenderPipelineStage {
       }
       if (has_alpha_) {
         line_buffers[num_color_] = GetInputRow(input_rows, alpha_c_, 0) + x0;
-      } else {
-        // opaque_alpha_ is a way to set all values to 1.0f.
-        line_buffers[num_color_] = opaque_alpha_.data();
-      }
-      if (has_alpha_ && want_alpha_ && unpremul_alpha_) {
-        UnpremulAlpha(thread_id, len, line_buffers);
-      }
-      OutputBuffers(main_, thread_id, ypos, xstart, len, line_buffers);
-      for (const auto& extra : extra_channels_) {
-        line_buffers[0] = GetInputRow(input_rows, extra.channel_index_, 0) + x0;
-        OutputBuffers(extra, thread_id, ypos, xstart, len, line_buffers);
       }
+      WritePixels(thread_id, ypos, xstart, len, line_buffers, [&](size_t ec) {
+        return GetInputRow(input_rows, extra_channels_[ec].channel_index_, 0) +
+               x0;
+      });
     }
     return true;
   }
@@ -276,8 +283,188 @@ class WriteToOutputStage : public RenderPipelineStage {
             temp, AlignedMemory::Create(memory_manager_, alloc_size));
       }
     }
+    if (downsampling_ > 1) {
+      temp_sampled_.resize(num_threads * kMaxChannels);
+      for (AlignedMemory& temp : temp_sampled_) {
+        size_t alloc_size = sizeof(float) * kMaxPixelsPerCall;
+        JXL_ASSIGN_OR_RETURN(
+            temp, AlignedMemory::Create(memory_manager_, alloc_size));
+      }
+    }
+    return true;
+  }
+
+  Status SetInputSizes(
+      const std::vector<std::pair<size_t, size_t>>& input_sizes) override {
+    if (downsampling_ == 1) return true;
+    JXL_ENSURE(!input_sizes.empty());
+    full_xsize_ = input_sizes[0].first;
+    full_ysize_ = input_sizes[0].second;
+    JXL_ENSURE(DivCeil(full_xsize_, downsampling_) == width_);
+    JXL_ENSURE(DivCeil(full_ysize_, downsampling_) == height_);
+    block_sums_ = jxl::make_unique<BlockSums>();
+    const size_t num_slots = FirstExtraSlot() + extra_channels_.size();
+    for (size_t s = 0; s < num_slots; s++) {
+      JXL_ASSIGN_OR_RETURN(
+          ImageF left, ImageF::Create(memory_manager_, width_, full_ysize_));
+      JXL_ASSIGN_OR_RETURN(
+          ImageF right, ImageF::Create(memory_manager_, width_, full_ysize_));
+      block_sums_->left.push_back(std::move(left));
+      block_sums_->right.push_back(std::move(right));
+    }
+    JXL_ASSIGN_OR_RETURN(block_sums_->rows_done,
+                         ImageB::Create(memory_manager_, width_, full_ysize_));
+    ZeroFillImage(&block_sums_->rows_done);
     return true;
   }
+
+  // Outputs `len` pixels of output row `ypos` from `xstart` on. `color` holds
+  // the color rows, followed by alpha if the stage has it, and `extra_row(i)`
+  // returns the row of the i-th extra channel output; it is only called once
+  // the main output is written.
+  template <typename ExtraRow>
+  void WritePixels(size_t thread_id, size_t ypos, size_t xstart, size_t len,
+                   const float* color[4], const ExtraRow& extra_row) const {
+    const float* line_buffers[4];
+    std::copy(color, color + num_color_ + (has_alpha_ ? 1 : 0), line_buffers);
+    if (!has_alpha_) {
+      // opaque_alpha_ is a way to set all values to 1.0f.
+      line_buffers[num_color_] = opaque_alpha_.data();
+    }
+    if (has_alpha_ && want_alpha_ && unpremul_alpha_) {
+      UnpremulAlpha(thread_id, len, line_buffers);
+    }
+    OutputBuffers(main_, thread_id, ypos, xstart, len, line_buffers);
+    for (size_t ec = 0; ec < extra_channels_.size(); ++ec) {
+      line_buffers[0] = extra_row(ec);
+      OutputBuffers(extra_channels_[ec], thread_id, ypos, xstart, len,
+                    line_buffers);
+    }
+  }
+
+  // When downsampling, the pixels of the output are the averages of the
+  // blocks of the image, whose rows may be rendered by different threads and
+  // in any order. The sum of every row of each block is kept until the last
+  // of its rows arrives, and the block is output then. The rows are
+  // overwritten if they are rendered again, e.g. after a progressive flush,
+  // which outputs the blocks again.
+  Status ProcessDownsampledRow(const RowInfo& input_rows, size_t xsize,
+                               size_t xpos, size_t ypos,
+                               size_t thread_id) const {
+    const size_t factor = downsampling_;
+    if (ypos >= full_ysize_ || xpos >= full_xsize_) return true;
+    const size_t xend = std::min(xpos + xsize, full_xsize_);
+    const size_t ox0 = xpos / factor;
+    const size_t ox1 = DivCeil(xend, factor);
+    const size_t oy = ypos / factor;
+    BlockSums& sums = *block_sums_;
+    std::lock_guard<std::mutex> lock(sums.mutex[oy % kNumBlockRowMutexes]);
+    uint8_t* JXL_RESTRICT done = sums.rows_done.Row(ypos);
+    for (size_t s = 0; s < sums.left.size(); s++) {
+      const float* JXL_RESTRICT row =
+          GetInputRow(input_rows, SlotChannel(s), 0) - xpos;
+      float* JXL_RESTRICT left = sums.left[s].Row(ypos);
+      float* JXL_RESTRICT right = sums.right[s].Row(ypos);
+      for (size_t ox = ox0; ox < ox1; ox++) {
+        const size_t bx0 = std::max(ox * factor, xpos);
+        const size_t bx1 = std::min((ox + 1) * factor, xend);
+        float sum = 0.0f;
+        for (size_t x = bx0; x < bx1; x++) sum += row[x];
+        // A block split between two calls gets its left part from the first
+        // one and its right part from the second one. Calls narrower than a
+        // block, which only happen for frames that are narrower too, are
+        // counted as right parts.
+        if (bx0 == ox * factor) {
+          left[ox] = sum;
+          if (bx1 == std::min((ox + 1) * factor, full_xsize_)) right[ox] = 0;
+        } else {
+          right[ox] = sum;
+        }
+      }
+    }
+    for (size_t ox = ox0; ox < ox1; ox++) {
+      const bool starts = std::max(ox * factor, xpos) == ox * factor;
+      const bool ends = std::min((ox + 1) * factor, xend) ==
+                        std::min((ox + 1) * factor, full_xsize_);
+      if (starts && ends) {
+        done[ox] = kLeftDone | kRightDone;
+      } else {
+        done[ox] |= starts ? kLeftDone : kRightDone;
+      }
+    }
+
+    // Outputs the runs of blocks that are complete.
+    const size_t y0 = oy * factor;
+    const size_t y1 = std::min(y0 + factor, full_ysize_);
+    const auto block_done = [&](size_t ox) {
+      for (size_t y = y0; y < y1; y++) {
+        if (sums.rows_done.ConstRow(y)[ox] != (kLeftDone | kRightDone)) {
+          return false;
+        }
+      }
+      return true;
+    };
+    for (size_t ox = ox0; ox < ox1;) {
+      if (!block_done(ox)) {
+        ox++;
+        continue;
+      }
+      size_t end = ox + 1;
+      while (end < ox1 && end - ox < kMaxPixelsPerCall && block_done(end)) {
+        end++;
+      }
+      WriteBlocks(thread_id, oy, ox, end - ox);
+      ox = end;
+    }
+    return true;
+  }
+
+  // Outputs the averages of `len` complete blocks of output row `oy` from
+  // `ox` on.
+  void WriteBlocks(size_t thread_id, size_t oy, size_t ox, size_t len) const {
+    const float* color[4];
+    for (size_t s = 0; s < FirstExtraSlot(); s++) {
+      color[s] = AverageBlocks(thread_id, s, s, oy, ox, len);
+    }
+    const size_t ypos = flip_y_ ? height_ - 1u - oy : oy;
+    WritePixels(thread_id, ypos, ox, len, color, [&](size_t ec) {
+      return AverageBlocks(thread_id, /*temp=*/0, FirstExtraSlot() + ec, oy, ox,
+                           len);
+    });
+  }
+
+  // Writes the averages of the blocks of `slot` to the temporary row `temp`
+  // of the thread.
+  const float* AverageBlocks(size_t thread_id, size_t temp, size_t slot,
+                             size_t oy, size_t ox, size_t len) const {
+    const BlockSums& sums = *block_sums_;
+    const size_t factor = downsampling_;
+    const size_t y0 = oy * factor;
+    const size_t y1 = std::min(y0 + factor, full_ysize_);
+    float* JXL_RESTRICT out =
+        temp_sampled_[thread_id * kMaxChannels + temp].address<float>();
+    std::fill(out, out + len, 0.0f);
+    for (size_t y = y0; y < y1; y++) {
+      const float* JXL_RESTRICT left = sums.left[slot].ConstRow(y) + ox;
+      const float* JXL_RESTRICT right = sums.right[slot].ConstRow(y) + ox;
+      for (size_t i = 0; i < len; i++) out[i] += left[i] + right[i];
+    }
+    for (size_t i = 0; i < len; i++) {
+      const size_t x0 = (ox + i) * factor;
+      const size_t x1 = std::min(x0 + factor, full_xsize_);
+      out[i] /= static_cast<float>((x1 - x0) * (y1 - y0));
+    }
+    return out;
+  }
+
+  // The downsampled channels are the color channels, alpha if the stage has
+  // it, then the extra channel outputs.
+  size_t FirstExtraSlot() const { return num_color_ + (has_alpha_ ? 1 : 0); }
+  size_t SlotChannel(size_t slot) const {
+    if (slot < num_color_) return slot;
+    if (slot < FirstExtraSlot()) return alpha_c_;
+    return extra_channels_[slot - FirstExtraSlot()].channel_index_;
+  }
   static bool ShouldFlipX(Orientation undo_orientation) {
     return (undo_orientation == Orientation::kFlipHorizontal ||
             undo_orientation == Orientation::kRotate180 ||
@@ -301,22 +488,24 @@ class WriteToOutputStage : public RenderPipelineStage {
                      const float** line_buffers) const {
     const HWY_FULL(float) d;
     auto one = Set(d, 1.0f);
+    // The color channels are written to the temporary rows of the thread as
+    // they are unpremultiplied, alpha is left where it is.
     float* temp_in[4];
-    for (size_t c = 0; c < main_.num_channels_; ++c) {
+    for (size_t c = 0; c < num_color_; ++c) {
       size_t tix = thread_id * main_.num_channels_ + c;
       temp_in[c] = temp_in_[tix].address<float>();
-      memcpy(temp_in[c], line_buffers[c], sizeof(float) * len);
     }
+    const float* JXL_RESTRICT alpha_row = line_buffers[num_color_];
     auto small_alpha = Set(d, kSmallAlpha);
     for (size_t ix = 0; ix < len; ix += Lanes(d)) {
-      auto alpha = LoadU(d, temp_in[num_color_] + ix);
+      auto alpha = LoadU(d, alpha_row + ix);
       auto mul = Div(one, Max(small_alpha, alpha));
       for (size_t c = 0; c < num_color_; ++c) {
-        auto val = LoadU(d, temp_in[c] + ix);
+        auto val = LoadU(d, line_buffers[c] + ix);
         StoreU(Mul(val, mul), d, temp_in[c] + ix);
       }
     }
-    for (size_t c = 0; c < main_.num_channels_; ++c) {
+    for (size_t c = 0; c < num_color_; ++c) {
       line_buffers[c] = temp_in[c];
     }
   }
@@ -348,6 +537,15 @@ class WriteToOutputStage : public RenderPipelineStage {
         }
       }
       WriteToOutput(out, thread_id, ypos, xstart, len, temp);
+    } else if (out.data_type_ == JXL_TYPE_UINT32_RGB10_A2) {
+      uint32_t* JXL_RESTRICT temp = temp_out_[thread_id].address<uint32_t>();
+      StoreRGB10A2Row(out, input, len, temp);
+      if (out.swap_endianness_) {
+        for (size_t j = 0; j < len; ++j) {
+          temp[j] = JXL_BSWAP32(temp[j]);
+        }
+      }
+      WriteToOutput(out, thread_id, ypos, xstart, len, temp);
     } else if (out.data_type_ == JXL_TYPE_FLOAT) {
       float* JXL_RESTRICT temp = temp_out_[thread_id].address<float>();
       StoreFloatRow(out, input, len, temp);
@@ -428,6 +626,37 @@ class WriteToOutputStage : public RenderPipelineStage {
                        sizeof(output[0]) * out.num_channels_ * padding);
   }
 
+  // Packs the color channels and, for 4 channels, alpha of "input" into one
+  // 32-bit value per pixel, from the least significant bit: 10 bits each of
+  // red, green and blue, then 2 bits of alpha.
+  static void StoreRGB10A2Row(const Output& out, const float* input[4],
+                              size_t len, uint32_t* output) {
+    const HWY_FULL(float) d;
+    const Rebind<uint32_t, decltype(d)> du;
+    const auto mul = Set(d, 1023.0f);
+    const auto alpha_mul = Set(d, 3.0f);
+    const size_t padding = RoundUpTo(len, Lanes(d)) - len;
+    for (size_t c = 0; c < out.num_channels_; ++c) {
+      msan::UnpoisonMemory(input[c] + len, sizeof(input[c][0]) * padding);
+    }
+    const auto quantize = [&](const float* row, size_t i, decltype(mul) m) {
+      // Clamp turns NaN to 0.
+      const auto v = Clamp(Zero(d), Mul(LoadU(d, row + i), m), m);
+      return BitCast(du, NearestInt(v));
+    };
+    for (size_t i = 0; i < len; i += Lanes(d)) {
+      const auto r = quantize(input[0], i, mul);
+      const auto g = quantize(input[1], i, mul);
+      const auto b = quantize(input[2], i, mul);
+      auto a = Set(du, 3u);
+      if (out.num_channels_ == 4) a = quantize(input[3], i, alpha_mul);
+      const auto rg = Or(r, ShiftLeft<10>(g));
+      const auto ba = Or(ShiftLeft<20>(b), ShiftLeft<30>(a));
+      StoreU(Or(rg, ba), du, output + i);
+    }
+    msan::PoisonMemory(output + len, sizeof(output[0]) * padding);
+  }
+
   static void StoreFloat16Row(const Output& out, const float* input[4],
                               size_t len, uint16_t* output) {
     const HWY_FULL(float) d;
@@ -501,17 +730,20 @@ class WriteToOutputStage : public RenderPipelineStage {
   template <typename T>
   void WriteToOutput(const Output& out, size_t thread_id, size_t ypos,
                      size_t xstart, size_t len, T* output) const {
+    // Number of values of type T per pixel.
+    const size_t num_values =
+        (out.data_type_ == JXL_TYPE_UINT32_RGB10_A2 ? 1 : out.num_channels_);
     if (transpose_) {
       // TODO(szabadka) Buffer 8x8 chunks and transpose with SIMD.
       if (out.run_opaque_) {
-        for (size_t i = 0, j = 0; i < len; ++i, j += out.num_channels_) {
+        for (size_t i = 0, j = 0; i < len; ++i, j += num_values) {
           out.pixel_callback_.run(out.run_opaque_, thread_id, ypos, xstart + i,
                                   1, output + j);
         }
       } else {
-        const size_t pixel_stride = out.num_channels_ * sizeof(T);
+        const size_t pixel_stride = num_values * sizeof(T);
         const size_t offset = xstart * out.stride_ + ypos * pixel_stride;
-        for (size_t i = 0, j = 0; i < len; ++i, j += out.num_channels_) {
+        for (size_t i = 0, j = 0; i < len; ++i, j += num_values) {
           const size_t ix = offset + i * out.stride_;
           JXL_DASSERT(ix + pixel_stride <= out.buffer_size_);
           memcpy(reinterpret_cast<uint8_t*>(out.buffer_) + ix, output + j,
@@ -523,7 +755,7 @@ class WriteToOutputStage : public RenderPipelineStage {
         out.pixel_callback_.run(out.run_opaque_, thread_id, xstart, ypos, len,
                                 output);
       } else {
-        const size_t pixel_stride = out.num_channels_ * sizeof(T);
+        const size_t pixel_stride = num_values * sizeof(T);
         const size_t offset = ypos * out.stride_ + xstart * pixel_stride;
         JXL_DASSERT(offset + len * pixel_stride <= out.buffer_size_);
         memcpy(reinterpret_cast<uint8_t*>(out.buffer_) + offset, output,
@@ -533,8 +765,27 @@ class WriteToOutputStage : public RenderPipelineStage {
   }
 
   static constexpr size_t kMaxPixelsPerCall = 1024;
+  static constexpr size_t kMaxChannels = 4;
+  static constexpr size_t kNumBlockRowMutexes = 64;
+  static constexpr uint8_t kLeftDone = 1;
+  static constexpr uint8_t kRightDone = 2;
+
+  // Row sums of the blocks of every downsampled channel, in output columns and
+  // image rows, for blocks split between two calls the sums of the parts
+  // before and after the split, and which parts of each row of the blocks
+  // were rendered.
+  struct BlockSums {
+    std::vector<ImageF> left;
+    std::vector<ImageF> right;
+    ImageB rows_done;
+    // Guards the rows of the blocks of every kNumBlockRowMutexes-th row of
+    // the output.
+    std::array<std::mutex, kNumBlockRowMutexes> mutex;
+  };
+
   size_t width_;
   size_t height_;
+  size_t downsampling_;
   Output main_;  // color + alpha
   size_t num_color_;
   bool want_alpha_;
@@ -549,19 +800,198 @@ class WriteToOutputStage : public RenderPipelineStage {
   JxlMemoryManager* memory_manager_;
   std::vector<AlignedMemory> temp_in_;
   std::vector<AlignedMemory> temp_out_;
+  std::vector<AlignedMemory> temp_sampled_;
+  size_t full_xsize_ = 0;
+  size_t full_ysize_ = 0;
+  std::unique_ptr<BlockSums> block_sums_;
 };
 
 #if JXL_CXX_LANG < JXL_CXX_17
 constexpr size_t WriteToOutputStage::kMaxPixelsPerCall;
+constexpr size_t WriteToOutputStage::kMaxChannels;
+constexpr size_t WriteToOutputStage::kNumBlockRowMutexes;
+constexpr uint8_t WriteToOutputStage::kLeftDone;
+constexpr uint8_t WriteToOutputStage::kRightDone;
 #endif
 
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
     const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
     bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager) {
+    size_t downsampling, std::vector<ImageOutput>& extra_output,
+    JxlMemoryManager* memory_manager) {
   return jxl::make_unique<WriteToOutputStage>(
       main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output, memory_manager);
+      undo_orientation, downsampling, extra_output, memory_manager);
+}
+
+// Converts the color channels from XYB to the output encoding and writes them
+// with alpha to the interleaved image buffer, doing the work of an
+// XYBFromLinear stage followed by a WriteToOutput stage without storing the
+// converted rows in between. T is the type of the output samples.
+template <typename Op, typename T>
+class XYBToOutputStage : public RenderPipelineStage {
+ public:
+  XYBToOutputStage(Op&& op, const OpsinParams& opsin_params,
+                   const ImageOutput& main_output, size_t width, size_t height,
+                   bool has_alpha, size_t alpha_c,
+                   JxlMemoryManager* memory_manager)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        op_(std::move(op)),
+        opsin_params_(opsin_params),
+        buffer_(reinterpret_cast<uint8_t*>(main_output.buffer)),
+        stride_(main_output.stride),
+        num_channels_(main_output.format.num_channels),
+        swap_endianness_(SwapEndianness(main_output.format.endianness)),
+        bits_per_sample_(main_output.bits_per_sample),
+        width_(width),
+        height_(height),
+        has_alpha_(has_alpha && num_channels_ == 4),
+        alpha_c_(alpha_c),
+        memory_manager_(memory_manager) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    JXL_ENSURE(xextra == 0);
+    if (ypos >= height_ || xpos >= width_) return true;
+    const HWY_FULL(float) d;
+    const size_t len = std::min(xsize, width_ - xpos);
+    const size_t len_v = RoundUpTo(len, Lanes(d));
+    const float* JXL_RESTRICT rows[4] = {
+        GetInputRow(input_rows, 0, 0), GetInputRow(input_rows, 1, 0),
+        GetInputRow(input_rows, 2, 0),
+        has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr};
+    for (const float* row : rows) {
+      if (row) msan::UnpoisonMemory(row + len, sizeof(float) * (len_v - len));
+    }
+    const size_t pixel_size = num_channels_ * sizeof(T);
+    uint8_t* JXL_RESTRICT out = buffer_ + ypos * stride_ + xpos * pixel_size;
+    // The last vector of the row does not fit in the buffer.
+    T* JXL_RESTRICT tail = tail_[thread_id].address<T>();
+    const auto mul = Set(d, (1u << bits_per_sample_) - 1);
+    const auto one = Set(d, 1.0f);
+    for (size_t x = 0; x < len; x += Lanes(d)) {
+      const auto opsin_x = LoadU(d, rows[0] + x);
+      const auto opsin_y = LoadU(d, rows[1] + x);
+      const auto opsin_b = LoadU(d, rows[2] + x);
+      auto r = Undefined(d);
+      auto g = Undefined(d);
+      auto b = Undefined(d);
+      XybToRgb(d, opsin_x, opsin_y, opsin_b, opsin_params_, &r, &g, &b);
+      op_.Transform(d, &r, &g, &b);
+      const auto a = rows[3] ? LoadU(d, rows[3] + x) : one;
+      const bool partial = x + Lanes(d) > len;
+      T* dest = partial ? tail : reinterpret_cast<T*>(out + x * pixel_size);
+      StorePixels(d, r, g, b, a, xpos + x, ypos, mul, dest);
+      if (partial) memcpy(out + x * pixel_size, tail, (len - x) * pixel_size);
+    }
+    for (const float* row : rows) {
+      if (row) msan::PoisonMemory(row + len, sizeof(float) * (len_v - len));
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 || (has_alpha_ && c == alpha_c_)
+               ? RenderPipelineChannelMode::kInput
+               : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "XYBToOutput"; }
+
+ private:
+  Status PrepareForThreads(size_t num_threads) override {
+    const HWY_FULL(float) d;
+    tail_.resize(num_threads);
+    for (AlignedMemory& temp : tail_) {
+      JXL_ASSIGN_OR_RETURN(
+          temp, AlignedMemory::Create(memory_manager_,
+                                      sizeof(T) * Lanes(d) * num_channels_));
+    }
+    return true;
+  }
+
+  template <class D, class V>
+  void StorePixels(D d, V r, V g, V b, V a, size_t x0, size_t y0, V mul,
+                   uint8_t* out) const {
+    const Rebind<uint8_t, D> du;
+    Interleave(du, MakeUnsigned<uint8_t>(r, x0, y0, mul),
+                     MakeUnsigned<uint8_t>(g, x0, y0, mul),
+                     MakeUnsigned<uint8_t>(b, x0, y0, mul),
+                     MakeUnsigned<uint8_t>(a, x0, y0, mul), out);
+  }
+
+  template <class D, class V>
+  void StorePixels(D d, V r, V g, V b, V a, size_t x0, size_t y0, V mul,
+                   uint16_t* out) const {
+    const Rebind<uint16_t, D> du;
+    const auto swap = [&](VFromD<decltype(du)> v) {
+      return swap_endianness_ ? Or(ShiftRight<8>(v), ShiftLeft<8>(v)) : v;
+    };
+    Interleave(du, swap(MakeUnsigned<uint16_t>(r, x0, y0, mul)),
+                     swap(MakeUnsigned<uint16_t>(g, x0, y0, mul)),
+                     swap(MakeUnsigned<uint16_t>(b, x0, y0, mul)),
+                     swap(MakeUnsigned<uint16_t>(a, x0, y0, mul)), out);
+  }
+
+  template <class D, class V>
+  void StorePixels(D d, V r, V g, V b, V a, size_t /*x0*/, size_t /*y0*/,
+                   V /*mul*/, float* out) const {
+    // Only native endianness, see GetXYBToOutputStage.
+    Interleave(d, r, g, b, a, out);
+  }
+
+  template <class D, class V, typename U>
+  void Interleave(D d, V r, V g, V b, V a, U* out) const {
+    if (num_channels_ == 3) {
+      StoreInterleaved3(r, g, b, d, out);
+    } else {
+      StoreInterleaved4(r, g, b, a, d, out);
+    }
+  }
+
+  Op op_;
+  const OpsinParams opsin_params_;
+  uint8_t* buffer_;
+  size_t stride_;
+  size_t num_channels_;
+  bool swap_endianness_;
+  size_t bits_per_sample_;
+  size_t width_;
+  size_t height_;
+  bool has_alpha_;
+  size_t alpha_c_;
+  JxlMemoryManager* memory_manager_;
+  std::vector<AlignedMemory> tail_;
+};
+
+std::unique_ptr<RenderPipelineStage> GetXYBToOutputStage(
+    const OutputEncodingInfo& output_encoding_info,
+    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
+    size_t alpha_c, JxlMemoryManager* memory_manager) {
+  const JxlPixelFormat& format = main_output.format;
+  if (format.num_channels < 3 ||
+      output_encoding_info.color_encoding.GetColorSpace() != ColorSpace::kRGB) {
+    return nullptr;
+  }
+  const auto make = [&](auto tag) {
+    using T = decltype(tag);
+    return MakeStageWithFromLinearOp(
+        output_encoding_info,
+        [&](auto op) -> std::unique_ptr<RenderPipelineStage> {
+          using Op = decltype(op);
+          return jxl::make_unique<XYBToOutputStage<Op, T>>(
+              std::move(op), output_encoding_info.opsin_params, main_output,
+              width, height, has_alpha, alpha_c, memory_manager);
+        });
+  };
+  if (format.data_type == JXL_TYPE_UINT8) return make(uint8_t());
+  if (format.data_type == JXL_TYPE_UINT16) return make(uint16_t());
+  if (format.data_type == JXL_TYPE_FLOAT &&
+      !SwapEndianness(format.endianness)) {
+    return make(float());
+  }
+  return nullptr;
 }
 
 // NOLINTNEXTLINE(google-readability-namespace-comments)
@@ -574,6 +1004,7 @@ HWY_AFTER_NAMESPACE();
 namespace jxl {
 
 HWY_EXPORT(GetWriteToOutputStage);
+HWY_EXPORT(GetXYBToOutputStage);
 
 namespace {
 class WriteToImageBundleStage : public RenderPipelineStage {
@@ -681,6 +1112,202 @@ class WriteToImage3FStage : public RenderPipelineStage {
   Image3F* image_;
 };
 
+class WriteToPlanarStage : public RenderPipelineStage {
+ public:
+  WriteToPlanarStage(const JxlPlanarImageOutBuffer& planes, size_t width,
+                     size_t height, bool is_gray, bool input_is_ycbcr)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        planes_(planes),
+        width_(width),
+        height_(height),
+        is_gray_(is_gray),
+        input_is_ycbcr_(input_is_ycbcr),
+        subsampled_(planes.layout != JXL_PLANAR_YCBCR_444),
+        interleaved_(planes.layout == JXL_SEMIPLANAR_NV12),
+        sample_size_(planes.data_type == JXL_TYPE_UINT8 ? 1 : 2),
+        bits_per_sample_(planes.bits_per_sample != 0 ? planes.bits_per_sample
+                                                     : 8 * sample_size_),
+        big_endian_(planes.endianness == JXL_BIG_ENDIAN ||
+                    (planes.endianness == JXL_NATIVE_ENDIAN &&
+                     !IsLittleEndian())),
+        max_value_((1u << bits_per_sample_) - 1),
+        // The chroma value of gray, e.g. 128 for 8 bits.
+        chroma_offset_((1u << (bits_per_sample_ - 1)) / max_value_) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    JXL_ENSURE(xextra == 0);
+    if (ypos >= height_ || xpos >= width_) return true;
+    const size_t len = std::min(xsize, width_ - xpos);
+    const float* rows[3];
+    for (size_t c = 0; c < 3; ++c) {
+      rows[c] = GetInputRow(input_rows, is_gray_ ? 0 : c, 0);
+    }
+    uint8_t* JXL_RESTRICT out_y = PlaneRow(0, ypos) + xpos * sample_size_;
+    float y;
+    float cb;
+    float cr;
+    if (!subsampled_) {
+      uint8_t* JXL_RESTRICT out_cb = PlaneRow(1, ypos) + xpos * sample_size_;
+      uint8_t* JXL_RESTRICT out_cr = PlaneRow(2, ypos) + xpos * sample_size_;
+      for (size_t i = 0; i < len; ++i) {
+        ToYCbCr(rows, i, &y, &cb, &cr);
+        StoreSample(y, out_y + i * sample_size_);
+        StoreSample(cb, out_cb + i * sample_size_);
+        StoreSample(cr, out_cr + i * sample_size_);
+      }
+      return true;
+    }
+    for (size_t i = 0; i < len; ++i) {
+      ToYCbCr(rows, i, &y, &cb, &cr);
+      StoreSample(y, out_y + i * sample_size_);
+    }
+    // The chroma sample of a 2x2 block is the average of its four pixels. The
+    // top row writes the average of its two pixels and keeps it, and the
+    // bottom row, which the same thread renders next, writes the average of
+    // both rows. A bottom row rendered apart from its top row, as can happen
+    // for frames at an odd y offset, leaves the chroma of the top row.
+    TopRow& top = top_rows_[thread_id];
+    const bool is_top = ypos % 2 == 0;
+    const bool has_top = !is_top && top.y + 1 == ypos && top.x0 <= xpos &&
+                         xpos + len <= top.x1;
+    if (!is_top && !has_top) return true;
+    if (is_top) {
+      top.y = ypos;
+      top.x0 = xpos;
+      top.x1 = xpos + len;
+    }
+    uint8_t* JXL_RESTRICT out_c = PlaneRow(1, ypos / 2);
+    uint8_t* JXL_RESTRICT out_cr =
+        interleaved_ ? nullptr : PlaneRow(2, ypos / 2);
+    for (size_t i = xpos % 2; i < len; i += 2) {
+      ToYCbCr(rows, i, &y, &cb, &cr);
+      if (i + 1 < len) {
+        float cb1;
+        float cr1;
+        ToYCbCr(rows, i + 1, &y, &cb1, &cr1);
+        cb = 0.5f * (cb + cb1);
+        cr = 0.5f * (cr + cr1);
+      }
+      const size_t cx = (xpos + i) / 2;
+      if (is_top) {
+        top.chroma[2 * cx] = cb;
+        top.chroma[2 * cx + 1] = cr;
+      } else {
+        cb = 0.5f * (cb + top.chroma[2 * cx]);
+        cr = 0.5f * (cr + top.chroma[2 * cx + 1]);
+      }
+      if (interleaved_) {
+        StoreSample(cb, out_c + 2 * cx * sample_size_);
+        StoreSample(cr, out_c + (2 * cx + 1) * sample_size_);
+      } else {
+        StoreSample(cb, out_c + cx * sample_size_);
+        StoreSample(cr, out_cr + cx * sample_size_);
+      }
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 ? RenderPipelineChannelMode::kInput
+                 : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "WritePlanar"; }
+
+ private:
+  Status PrepareForThreads(size_t num_threads) override {
+    if (!subsampled_) return true;
+    top_rows_.resize(num_threads);
+    for (TopRow& top : top_rows_) {
+      top.y = std::numeric_limits<size_t>::max();
+      top.chroma.resize(2 * DivCeil(width_, 2));
+    }
+    return true;
+  }
+
+  uint8_t* PlaneRow(size_t plane, size_t y) const {
+    return static_cast<uint8_t*>(planes_.planes[plane]) +
+           y * planes_.strides[plane];
+  }
+
+  // Converts pixel "x" of "rows" to full range YCbCr with the BT.601 matrix,
+  // or only adds the offsets if the rows are the (Cb, Y, Cr) channels of a
+  // kYCbCr frame, which are centered around 0.
+  void ToYCbCr(const float* rows[3], size_t x, float* y, float* cb,
+               float* cr) const {
+    if (input_is_ycbcr_) {
+      *y = rows[1][x] + 128.0f / 255;
+      *cb = rows[0][x] + chroma_offset_;
+      *cr = rows[2][x] + chroma_offset_;
+      return;
+    }
+    const float r = rows[0][x];
+    const float g = rows[1][x];
+    const float b = rows[2][x];
+    *y = 0.299f * r + 0.587f * g + 0.114f * b;
+    *cb = chroma_offset_ + (b - *y) * (0.5f / (1.0f - 0.114f));
+    *cr = chroma_offset_ + (r - *y) * (0.5f / (1.0f - 0.299f));
+  }
+
+  void StoreSample(float value, uint8_t* p) const {
+    const float clamped = std::min(std::max(value, 0.0f), 1.0f);
+    if (sample_size_ == 1) {
+      *p = static_cast<uint8_t>(clamped * 255.0f + 0.5f);
+      return;
+    }
+    // Samples with fewer bits are stored in the most significant ones.
+    const uint32_t sample = static_cast<uint32_t>(clamped * max_value_ + 0.5f)
+                            << (16 - bits_per_sample_);
+    if (big_endian_) {
+      StoreBE16(sample, p);
+    } else {
+      StoreLE16(sample, p);
+    }
+  }
+
+  JxlPlanarImageOutBuffer planes_;
+  size_t width_;
+  size_t height_;
+  bool is_gray_;
+  bool input_is_ycbcr_;
+  bool subsampled_;
+  bool interleaved_;
+  size_t sample_size_;
+  uint32_t bits_per_sample_;
+  bool big_endian_;
+  float max_value_;
+  float chroma_offset_;
+
+  // The chroma of the last top row of 2x2 blocks that a thread rendered.
+  struct TopRow {
+    size_t y;
+    size_t x0;
+    size_t x1;
+    // Interleaved Cb and Cr of each block.
+    std::vector<float> chroma;
+  };
+  mutable std::vector<TopRow> top_rows_;
+};
+
+class DirectOutputStage : public RenderPipelineStage {
+ public:
+  DirectOutputStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "DirectOutput"; }
+};
+
 }  // namespace
 
 std::unique_ptr<RenderPipelineStage> GetWriteToImageBundleStage(
@@ -694,13 +1321,34 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(
   return jxl::make_unique<WriteToImage3FStage>(memory_manager, image);
 }
 
+std::unique_ptr<RenderPipelineStage> GetWriteToPlanarStage(
+    const ImageOutput& main_output, size_t width, size_t height, bool is_gray,
+    bool input_is_ycbcr) {
+  return jxl::make_unique<WriteToPlanarStage>(main_output.planes, width, height,
+                                              is_gray, input_is_ycbcr);
+}
+
+std::unique_ptr<RenderPipelineStage> GetDirectOutputStage() {
+  return jxl::make_unique<DirectOutputStage>();
+}
+
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
     const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
     bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager) {
+    size_t downsampling, std::vector<ImageOutput>& extra_output,
+    JxlMemoryManager* memory_manager) {
   return HWY_DYNAMIC_DISPATCH(GetWriteToOutputStage)(
       main_output, width, height, has_alpha, unpremul_alpha, alpha_c,
-      undo_orientation, extra_output, memory_manager);
+      undo_orientation, downsampling, extra_output, memory_manager);
+}
+
+std::unique_ptr<RenderPipelineStage> GetXYBToOutputStage(
+    const OutputEncodingInfo& output_encoding_info,
+    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
+    size_t alpha_c, JxlMemoryManager* memory_manager) {
+  return HWY_DYNAMIC_DISPATCH(GetXYBToOutputStage)(
+      output_encoding_info, main_output, width, height, has_alpha, alpha_c,
+      memory_manager);
 }
 
 }  // namespace jxl
@@ -28,11 +28,36 @@ std::unique_ptr<RenderPipelineStage> GetWriteToImageBundleStage(
 std::unique_ptr<RenderPipelineStage> GetWriteToImage3FStage(
     JxlMemoryManager* memory_manager, Image3F* image);
 
-// Gets a stage to write to a pixel callback or image buffer.
+// Gets a stage to write to a pixel callback or image buffer. If `downsampling`
+// is larger than 1, the average of every `downsampling` x `downsampling`
+// block is written and `width` and `height` are those of the smaller output.
 std::unique_ptr<RenderPipelineStage> GetWriteToOutputStage(
     const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
     bool unpremul_alpha, size_t alpha_c, Orientation undo_orientation,
-    std::vector<ImageOutput>& extra_output, JxlMemoryManager* memory_manager);
+    size_t downsampling, std::vector<ImageOutput>& extra_output,
+    JxlMemoryManager* memory_manager);
+
+// Gets a stage that converts the color channels from XYB to the output encoding
+// and writes them to the interleaved image buffer of `main_output`, doing the
+// work of an XYBFromLinear stage followed by a WriteToOutput stage in one
+// pass. Only supports RGB(A) output as uint8, uint16 or native endian float,
+// and returns nullptr for the other outputs.
+std::unique_ptr<RenderPipelineStage> GetXYBToOutputStage(
+    const OutputEncodingInfo& output_encoding_info,
+    const ImageOutput& main_output, size_t width, size_t height, bool has_alpha,
+    size_t alpha_c, JxlMemoryManager* memory_manager);
+
+// Gets a stage to write the color channels as YCbCr planes to
+// `main_output.planes`, see JxlDecoderSetImageOutPlanes. If `input_is_ycbcr`,
+// the color channels are those of a kYCbCr frame, before the YCbCr stage.
+std::unique_ptr<RenderPipelineStage> GetWriteToPlanarStage(
+    const ImageOutput& main_output, size_t width, size_t height, bool is_gray,
+    bool input_is_ycbcr);
+
+// Gets a stage that uses no channel and writes nothing, the only stage of
+// frames whose decoder writes the pixels to the image buffer itself, see
+// PassesDecoderState::direct_modular_output.
+std::unique_ptr<RenderPipelineStage> GetDirectOutputStage();
 
 }  // namespace jxl
 
@@ -15,6 +15,7 @@
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
 #include "lib/jxl/dec_xyb.h"
+#include "lib/jxl/render_pipeline/render_pipeline_offload.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
 #undef HWY_TARGET_INCLUDE
@@ -101,6 +102,21 @@ class XYBStage : public RenderPipelineStage {
                  : RenderPipelineChannelMode::kIgnored;
   }
 
+  bool GetOffloadKernel(OffloadKernel* kernel) const final {
+    if (output_is_xyb_) return false;
+    kernel->type = OffloadKernel::Type::kXYB;
+    for (size_t i = 0; i < 9; i++) {
+      // OpsinParams broadcasts each entry to 4 lanes.
+      kernel->inverse_opsin_matrix[i] =
+          opsin_params_.inverse_opsin_matrix[4 * i];
+    }
+    for (size_t c = 0; c < 3; c++) {
+      kernel->opsin_biases[c] = opsin_params_.opsin_biases[c];
+      kernel->opsin_biases_cbrt[c] = opsin_params_.opsin_biases_cbrt[c];
+    }
+    return true;
+  }
+
   const char* GetName() const override { return "XYB"; }
 
  private:
@@ -140,7 +156,7 @@ class FastXYBStage : public RenderPipelineStage {
         width_(width),
         height_(height),
         rgba_(rgba),
-        has_alpha_(has_alpha),
+        has_alpha_(has_alpha && rgba),
         alpha_c_(alpha_c) {}
 
   Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
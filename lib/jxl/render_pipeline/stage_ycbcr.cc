@@ -6,10 +6,13 @@
 #include "lib/jxl/render_pipeline/stage_ycbcr.h"
 
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/sanitizers.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
 
@@ -25,6 +28,8 @@ namespace HWY_NAMESPACE {
 // These templates are not found via ADL.
 using hwy::HWY_NAMESPACE::Add;
 using hwy::HWY_NAMESPACE::MulAdd;
+using hwy::HWY_NAMESPACE::Rebind;
+using hwy::HWY_NAMESPACE::ShiftRight;
 
 class kYCbCrStage : public RenderPipelineStage {
  public:
@@ -74,6 +79,118 @@ std::unique_ptr<RenderPipelineStage> GetYCbCrStage() {
   return jxl::make_unique<kYCbCrStage>();
 }
 
+// Computes the same conversion as kYCbCrStage and writes the result. The
+// arithmetic works on 8-bit samples with 6 fractional bits in int16 lanes,
+// which take half the space of float lanes. Unlike the float write stage, this
+// does not dither, like libjpeg does not for the 8-bit JPEG sources of such
+// frames.
+class FastYCbCrStage : public RenderPipelineStage {
+ public:
+  FastYCbCrStage(uint8_t* rgb, size_t stride, size_t width, size_t height,
+                 bool rgba, bool has_alpha, size_t alpha_c)
+      : RenderPipelineStage(RenderPipelineStage::Settings()),
+        rgb_(rgb),
+        stride_(stride),
+        width_(width),
+        height_(height),
+        rgba_(rgba),
+        has_alpha_(has_alpha && rgba),
+        alpha_c_(alpha_c) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    if (ypos >= height_) return true;
+    JXL_ENSURE(xextra == 0);
+    const size_t len = xsize + xpos <= width_ ? xsize : width_ - xpos;
+    const HWY_FULL(float) df;
+    const Rebind<int16_t, decltype(df)> di16;
+    const Rebind<uint8_t, decltype(df)> du8;
+    constexpr int kFracBits = 6;
+    const auto scale = Set(df, 255.0f * (1 << kFracBits));
+    const auto y_offset = Set(di16, 128 << kFracBits);
+    const auto half = Set(di16, 1 << (kFracBits - 1));
+    // Fractional parts of the coefficients of kYCbCrStage, scaled for
+    // MulHigh: 1.402 = 1 + 0.402, 0.714136 = 0.5 + 0.214136, and
+    // 1.772 = 1.5 + 0.272.
+    const auto crcr = Set(di16, 26345);
+    const auto cgcb = Set(di16, 22553);
+    const auto cgcr = Set(di16, 14034);
+    const auto cbcb = Set(di16, 17826);
+    const auto to_fixed = [&](const float* row, size_t x) {
+      return DemoteTo(di16, NearestInt(Mul(LoadU(df, row + x), scale)));
+    };
+    const auto to_uint8 = [&](decltype(y_offset) v) {
+      return DemoteTo(du8, ShiftRight<kFracBits>(SaturatedAdd(v, half)));
+    };
+
+    const float* JXL_RESTRICT row_cb = GetInputRow(input_rows, 0, 0);
+    const float* JXL_RESTRICT row_y = GetInputRow(input_rows, 1, 0);
+    const float* JXL_RESTRICT row_cr = GetInputRow(input_rows, 2, 0);
+    const float* JXL_RESTRICT row_a =
+        has_alpha_ ? GetInputRow(input_rows, alpha_c_, 0) : nullptr;
+    const size_t padding = RoundUpTo(len, Lanes(df)) - len;
+    for (const float* row : {row_cb, row_y, row_cr, row_a}) {
+      if (row) msan::UnpoisonMemory(row + len, sizeof(float) * padding);
+    }
+    const size_t bytes_per_pixel = rgba_ ? 4 : 3;
+    uint8_t* JXL_RESTRICT out = rgb_ + stride_ * ypos + bytes_per_pixel * xpos;
+    // The last vector goes through "tail", not to write past the row.
+    HWY_ALIGN uint8_t tail[HWY_MAX_BYTES];
+    for (size_t x = 0; x < len; x += Lanes(df)) {
+      const auto y = SaturatedAdd(to_fixed(row_y, x), y_offset);
+      const auto cb = to_fixed(row_cb, x);
+      const auto cr = to_fixed(row_cr, x);
+      const auto r = SaturatedAdd(SaturatedAdd(y, cr), MulHigh(cr, crcr));
+      const auto g = SaturatedSub(
+          SaturatedSub(y, MulHigh(cb, cgcb)),
+          SaturatedAdd(ShiftRight<1>(cr), MulHigh(cr, cgcr)));
+      const auto b = SaturatedAdd(
+          SaturatedAdd(y, cb), Add(ShiftRight<1>(cb), MulHigh(cb, cbcb)));
+      const bool last = x + Lanes(df) > len;
+      uint8_t* JXL_RESTRICT pos = last ? tail : out + bytes_per_pixel * x;
+      if (rgba_) {
+        const auto a =
+            has_alpha_ ? to_uint8(to_fixed(row_a, x)) : Set(du8, 255);
+        StoreInterleaved4(to_uint8(r), to_uint8(g), to_uint8(b), a, du8, pos);
+      } else {
+        StoreInterleaved3(to_uint8(r), to_uint8(g), to_uint8(b), du8, pos);
+      }
+      if (last) {
+        memcpy(out + bytes_per_pixel * x, tail, bytes_per_pixel * (len - x));
+      }
+    }
+    for (const float* row : {row_cb, row_y, row_cr, row_a}) {
+      if (row) msan::PoisonMemory(row + len, sizeof(float) * padding);
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return c < 3 || (has_alpha_ && c == alpha_c_)
+               ? RenderPipelineChannelMode::kInput
+               : RenderPipelineChannelMode::kIgnored;
+  }
+
+  const char* GetName() const override { return "FastYCbCr"; }
+
+ private:
+  uint8_t* rgb_;
+  size_t stride_;
+  size_t width_;
+  size_t height_;
+  bool rgba_;
+  bool has_alpha_;
+  size_t alpha_c_;
+};
+
+std::unique_ptr<RenderPipelineStage> GetFastYCbCrToRGB8Stage(
+    uint8_t* rgb, size_t stride, size_t width, size_t height, bool rgba,
+    bool has_alpha, size_t alpha_c) {
+  return jxl::make_unique<FastYCbCrStage>(rgb, stride, width, height, rgba,
+                                          has_alpha, alpha_c);
+}
+
 // NOLINTNEXTLINE(google-readability-namespace-comments)
 }  // namespace HWY_NAMESPACE
 }  // namespace jxl
@@ -88,5 +205,14 @@ std::unique_ptr<RenderPipelineStage> GetYCbCrStage() {
   return HWY_DYNAMIC_DISPATCH(GetYCbCrStage)();
 }
 
+HWY_EXPORT(GetFastYCbCrToRGB8Stage);
+
+std::unique_ptr<RenderPipelineStage> GetFastYCbCrToRGB8Stage(
+    uint8_t* rgb, size_t stride, size_t width, size_t height, bool rgba,
+    bool has_alpha, size_t alpha_c) {
+  return HWY_DYNAMIC_DISPATCH(GetFastYCbCrToRGB8Stage)(
+      rgb, stride, width, height, rgba, has_alpha, alpha_c);
+}
+
 }  // namespace jxl
 #endif
@@ -7,6 +7,8 @@
 #define LIB_JXL_RENDER_PIPELINE_STAGE_YCBCR_H_
 
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 
 #include "lib/jxl/render_pipeline/render_pipeline_stage.h"
@@ -15,6 +17,14 @@ namespace jxl {
 
 // Converts the color channels from YCbCr to RGB.
 std::unique_ptr<RenderPipelineStage> GetYCbCrStage();
+
+// Gets a stage to convert with fixed point arithmetic from YCbCr to 8-bit RGB
+// and write to a uint8 buffer. Its input rows, like those of every stage and
+// the group buffers that the IDCT writes, are still float: the stages before
+// it, such as chroma upsampling, run in float as for any other frame.
+std::unique_ptr<RenderPipelineStage> GetFastYCbCrToRGB8Stage(
+    uint8_t* rgb, size_t stride, size_t width, size_t height, bool rgba,
+    bool has_alpha, size_t alpha_c);
 }  // namespace jxl
 
 #endif  // LIB_JXL_RENDER_PIPELINE_STAGE_YCBCR_H_
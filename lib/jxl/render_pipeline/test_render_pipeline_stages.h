@@ -77,6 +77,37 @@ class UpsampleYSlowStage : public RenderPipelineStage {
   const char* GetName() const override { return "TEST::UpsampleYSlowStage"; }
 };
 
+class BlurSlowStage : public RenderPipelineStage {
+ public:
+  BlurSlowStage()
+      : RenderPipelineStage(
+            RenderPipelineStage::Settings::SymmetricBorderOnly(1)) {}
+
+  Status ProcessRow(const RowInfo& input_rows, const RowInfo& output_rows,
+                    size_t xextra, size_t xsize, size_t xpos, size_t ypos,
+                    size_t thread_id) const final {
+    for (size_t c = 0; c < input_rows.size(); c++) {
+      const float* rowp = GetInputRow(input_rows, c, -1);
+      const float* rowc = GetInputRow(input_rows, c, 0);
+      const float* rown = GetInputRow(input_rows, c, 1);
+      float* row_out = GetOutputRow(output_rows, c, 0);
+      for (int64_t x = -xextra; x < static_cast<int64_t>(xsize + xextra); x++) {
+        *(row_out + x) = *(rowc + x) * 0.5f +
+                         (*(rowc + x - 1) + *(rowc + x + 1) + *(rowp + x) +
+                          *(rown + x)) *
+                             0.125f;
+      }
+    }
+    return true;
+  }
+
+  RenderPipelineChannelMode GetChannelMode(size_t c) const final {
+    return RenderPipelineChannelMode::kInOut;
+  }
+
+  const char* GetName() const override { return "TEST::BlurSlowStage"; }
+};
+
 class Check0FinalStage : public RenderPipelineStage {
  public:
   Check0FinalStage() : RenderPipelineStage(RenderPipelineStage::Settings()) {}
@@ -119,10 +119,11 @@ void DrawSegment(const SplineSegment& segment, const bool add, const size_t y,
   }
 }
 
-void ComputeSegments(const Spline::Point& center, const float intensity,
-                     const float color[3], const float sigma,
-                     std::vector<SplineSegment>& segments,
-                     std::vector<std::pair<size_t, size_t>>& segments_by_y) {
+void ComputeSegments(
+    const Spline::Point& center, const float intensity, const float color[3],
+    const float sigma, const size_t xsize, const size_t ysize,
+    std::vector<SplineSegment>& segments,
+    std::vector<std::pair<size_t, size_t>>& segments_by_bucket) {
   // Sanity check sigma, inverse sigma and intensity
   if (!(std::isfinite(sigma) && sigma != 0.0f && std::isfinite(1.0f / sigma) &&
         std::isfinite(intensity))) {
@@ -154,8 +155,22 @@ void ComputeSegments(const Spline::Point& center, const float intensity,
   ssize_t y0 = std::llround(center.y - maximum_distance);
   ssize_t y1 =
       std::llround(center.y + maximum_distance) + 1;  // one-past-the-end
+  // Columns of the image that the segment overlaps, none if it is entirely
+  // outside of the image.
+  const ssize_t column_width = kSplineColumnWidth;
+  const ssize_t num_columns = DivCeil(xsize, kSplineColumnWidth);
+  const ssize_t x0 = std::max<ssize_t>(
+      std::llround(center.x - maximum_distance), 0);
+  const ssize_t x1 = std::min<ssize_t>(
+      std::llround(center.x + maximum_distance) + 1, xsize);
+  const ssize_t column0 = x0 / column_width;
+  const ssize_t column1 = x1 > x0 ? (x1 - 1) / column_width + 1 : column0;
+  y1 = std::min<ssize_t>(y1, ysize);
   for (ssize_t y = std::max<ssize_t>(y0, 0); y < y1; y++) {
-    segments_by_y.emplace_back(y, segments.size());
+    for (ssize_t column = column0; column < column1; column++) {
+      segments_by_bucket.emplace_back(y * num_columns + column,
+                                      segments.size());
+    }
   }
   segments.push_back(segment);
 }
@@ -164,18 +179,31 @@ void DrawSegments(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
                   float* JXL_RESTRICT row_b, size_t y, size_t x0, size_t x1,
                   const bool add, const SplineSegment* segments,
                   const size_t* segment_indices,
-                  const size_t* segment_y_start) {
+                  const size_t* segment_column_start, size_t num_columns) {
   float* JXL_RESTRICT rows[3] = {row_x - x0, row_y - x0, row_b - x0};
-  for (size_t i = segment_y_start[y]; i < segment_y_start[y + 1]; i++) {
-    DrawSegment(segments[segment_indices[i]], add, y, x0, x1, rows);
+  const size_t* JXL_RESTRICT row_start = segment_column_start + y * num_columns;
+  const size_t end_column =
+      std::min(num_columns, DivCeil(x1, kSplineColumnWidth));
+  // Each segment is drawn on the part of each of its columns that is in
+  // [x0, x1), so that the pixels get the segments in the same order as when
+  // the whole row is drawn at once.
+  for (size_t column = x0 / kSplineColumnWidth; column < end_column;
+       column++) {
+    const size_t column_x0 = std::max(x0, column * kSplineColumnWidth);
+    const size_t column_x1 = std::min(x1, (column + 1) * kSplineColumnWidth);
+    for (size_t i = row_start[column]; i < row_start[column + 1]; i++) {
+      DrawSegment(segments[segment_indices[i]], add, y, column_x0, column_x1,
+                  rows);
+    }
   }
 }
 
 void SegmentsFromPoints(
     const Spline& spline,
     const std::vector<std::pair<Spline::Point, float>>& points_to_draw,
-    const float arc_length, std::vector<SplineSegment>& segments,
-    std::vector<std::pair<size_t, size_t>>& segments_by_y) {
+    const float arc_length, const size_t xsize, const size_t ysize,
+    std::vector<SplineSegment>& segments,
+    std::vector<std::pair<size_t, size_t>>& segments_by_bucket) {
   const float inv_arc_length = 1.0f / arc_length;
   int k = 0;
   for (const auto& point_to_draw : points_to_draw) {
@@ -191,7 +219,8 @@ void SegmentsFromPoints(
     }
     const float sigma =
         ContinuousIDCT(spline.sigma_dct, (32 - 1) * progress_along_arc);
-    ComputeSegments(point, multiplier, color, sigma, segments, segments_by_y);
+    ComputeSegments(point, multiplier, color, sigma, xsize, ysize, segments,
+                    segments_by_bucket);
   }
 }
 }  // namespace
@@ -577,7 +606,8 @@ void Splines::Clear() {
   starting_points_.clear();
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
+  segment_column_start_.clear();
+  num_columns_ = 0;
 }
 
 Status Splines::Decode(JxlMemoryManager* memory_manager, jxl::BitReader* br,
@@ -642,8 +672,10 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
   // boundaries.
   segments_.clear();
   segment_indices_.clear();
-  segment_y_start_.clear();
-  std::vector<std::pair<size_t, size_t>> segments_by_y;
+  segment_column_start_.clear();
+  num_columns_ = DivCeil(image_xsize, kSplineColumnWidth);
+  // Pairs of y * num_columns_ + column and segment index.
+  std::vector<std::pair<size_t, size_t>> segments_by_bucket;
   std::vector<Spline::Point> intermediate_points;
   uint64_t total_estimated_area_reached = 0;
   std::vector<Spline> splines;
@@ -693,22 +725,21 @@ Status Splines::InitializeDrawCache(const size_t image_xsize,
       continue;
     }
     HWY_DYNAMIC_DISPATCH(SegmentsFromPoints)
-    (spline, points_to_draw, arc_length, segments_, segments_by_y);
+    (spline, points_to_draw, arc_length, image_xsize, image_ysize, segments_,
+     segments_by_bucket);
   }
 
   // TODO(eustas): consider linear sorting here.
-  std::sort(segments_by_y.begin(), segments_by_y.end());
-  segment_indices_.resize(segments_by_y.size());
-  segment_y_start_.resize(image_ysize + 1);
-  for (size_t i = 0; i < segments_by_y.size(); i++) {
-    segment_indices_[i] = segments_by_y[i].second;
-    size_t y = segments_by_y[i].first;
-    if (y < image_ysize) {
-      segment_y_start_[y + 1]++;
-    }
+  std::sort(segments_by_bucket.begin(), segments_by_bucket.end());
+  const size_t num_buckets = image_ysize * num_columns_;
+  segment_indices_.resize(segments_by_bucket.size());
+  segment_column_start_.assign(num_buckets + 1, 0);
+  for (size_t i = 0; i < segments_by_bucket.size(); i++) {
+    segment_indices_[i] = segments_by_bucket[i].second;
+    segment_column_start_[segments_by_bucket[i].first + 1]++;
   }
-  for (size_t y = 0; y < image_ysize; y++) {
-    segment_y_start_[y + 1] += segment_y_start_[y];
+  for (size_t i = 0; i < num_buckets; i++) {
+    segment_column_start_[i + 1] += segment_column_start_[i];
   }
   return true;
 }
@@ -720,7 +751,7 @@ void Splines::ApplyToRow(float* JXL_RESTRICT row_x, float* JXL_RESTRICT row_y,
   if (segments_.empty()) return;
   HWY_DYNAMIC_DISPATCH(DrawSegments)
   (row_x, row_y, row_b, y, x0, x1, add, segments_.data(),
-   segment_indices_.data(), segment_y_start_.data());
+   segment_indices_.data(), segment_column_start_.data(), num_columns_);
 }
 
 template <bool add>
@@ -86,6 +86,10 @@ class QuantizedSpline {
   int sigma_dct_[32] = {};
 };
 
+// Width of the columns in which the segments of each row are indexed, so that
+// drawing a part of a row only goes through the segments that overlap it.
+constexpr size_t kSplineColumnWidth = 64;
+
 // A single "drawable unit" of a spline, i.e. a line of the region in which we
 // render each Gaussian. The structure doesn't actually depend on the exact
 // row, which allows reuse for different y values (which are tracked
@@ -148,8 +152,12 @@ class Splines {
   std::vector<QuantizedSpline> splines_;
   std::vector<Spline::Point> starting_points_;
   std::vector<SplineSegment> segments_;
+  // Indices in segments_ of the segments that overlap each column of
+  // kSplineColumnWidth pixels of each row, starting at
+  // segment_column_start_[y * num_columns_ + column].
   std::vector<size_t> segment_indices_;
-  std::vector<size_t> segment_y_start_;
+  std::vector<size_t> segment_column_start_;
+  size_t num_columns_ = 0;
 };
 
 }  // namespace jxl
@@ -3,6 +3,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <algorithm>
 #include <cstddef>
 #include <utility>
 #include <vector>
@@ -74,7 +75,61 @@ void BM_Splines(benchmark::State& state) {
   state.SetItemsProcessed(n * state.iterations());
 }
 
+// Draws many small splines spread over a large image in column tiles of
+// state.range() pixels, as the render pipeline does for each group.
+void BM_SplinesColumnTiles(benchmark::State& state) {
+  const size_t tile_xsize = state.range();
+  constexpr size_t kSize = 1024;
+  std::vector<Spline> spline_data;
+  for (size_t y = 16; y < kSize; y += 64) {
+    for (size_t x = 16; x < kSize; x += 64) {
+      const float fx = x;
+      const float fy = y;
+      spline_data.push_back(Spline{
+          /*control_points=*/{{fx, fy}, {fx + 30, fy + 20}, {fx + 10, fy + 40}},
+          /*color_dct=*/
+          {Dct32{0.03125f, 0.00625f}, Dct32{1.f, 0.321875f},
+           Dct32{1.f, 0.24375f}},
+          /*sigma_dct=*/{0.3125f, 0.f, 0.f, 0.0625f}});
+    }
+  }
+  std::vector<QuantizedSpline> quantized_splines;
+  std::vector<Spline::Point> starting_points;
+  for (const Spline& spline : spline_data) {
+    JXL_ASSIGN_OR_QUIT(
+        QuantizedSpline qspline,
+        QuantizedSpline::Create(spline, kQuantizationAdjustment, kYToX, kYToB),
+        "Failed to create spline.");
+    quantized_splines.emplace_back(std::move(qspline));
+    starting_points.push_back(spline.control_points.front());
+  }
+  Splines splines(kQuantizationAdjustment, std::move(quantized_splines),
+                  std::move(starting_points));
+
+  JXL_ASSIGN_OR_QUIT(
+      Image3F drawing_area,
+      Image3F::Create(jpegxl::tools::NoMemoryManager(), kSize, kSize),
+      "Failed to allocate drawing plane.");
+  ZeroFillImage(&drawing_area);
+  BM_CHECK(splines.InitializeDrawCache(
+      drawing_area.xsize(), drawing_area.ysize(), color_correlation));
+  for (auto _ : state) {
+    (void)_;
+    for (size_t x0 = 0; x0 < kSize; x0 += tile_xsize) {
+      const size_t x1 = std::min(x0 + tile_xsize, kSize);
+      for (size_t y = 0; y < kSize; y++) {
+        splines.AddToRow(drawing_area.PlaneRow(0, y) + x0,
+                         drawing_area.PlaneRow(1, y) + x0,
+                         drawing_area.PlaneRow(2, y) + x0, y, x0, x1);
+      }
+    }
+  }
+
+  state.SetItemsProcessed(kSize * kSize * state.iterations());
+}
+
 BENCHMARK(BM_Splines)->Range(1, 1 << 10);
+BENCHMARK(BM_SplinesColumnTiles)->Range(64, 1024);
 
 }  // namespace
 }  // namespace jxl
@@ -340,6 +340,45 @@ TEST(SplinesTest, Drawing) {
       *io_expected.Main().color(), *io_actual.Main().color(), 1e-2f, 1e-1f, _));
 }
 
+TEST(SplinesTest, DrawingInColumnTiles) {
+  JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
+  const Spline spline{
+      /*control_points=*/{
+          {9, 54}, {118, 159}, {97, 3}, {10, 40}, {150, 25}, {120, 300}},
+      /*color_dct=*/
+      {Dct32{1.f, 0.2f, 0.1f}, Dct32{35.7f, 10.3f}, Dct32{35.7f, 7.8f}},
+      /*sigma_dct=*/{10.f, 0.f, 0.f, 2.f}};
+  std::vector<QuantizedSpline> quantized_splines;
+  JXL_TEST_ASSIGN_OR_DIE(
+      QuantizedSpline qspline,
+      QuantizedSpline::Create(spline, kQuantizationAdjustment, kYToX, kYToB));
+  quantized_splines.emplace_back(std::move(qspline));
+  Splines splines(kQuantizationAdjustment, std::move(quantized_splines),
+                  {spline.control_points.front()});
+
+  JXL_TEST_ASSIGN_OR_DIE(Image3F whole,
+                         Image3F::Create(memory_manager, 320, 320));
+  ZeroFillImage(&whole);
+  ASSERT_TRUE(splines.InitializeDrawCache(whole.xsize(), whole.ysize(),
+                                          color_correlation));
+  splines.AddTo(&whole, Rect(whole));
+
+  // Tiles that do not line up with the columns of the segment index must get
+  // the same pixels.
+  JXL_TEST_ASSIGN_OR_DIE(Image3F tiled,
+                         Image3F::Create(memory_manager, 320, 320));
+  ZeroFillImage(&tiled);
+  const size_t tile_x[] = {0, 37, 64, 100, 250, 320};
+  for (size_t y = 0; y < tiled.ysize(); y++) {
+    for (size_t i = 0; i + 1 < sizeof(tile_x) / sizeof(*tile_x); i++) {
+      const size_t x0 = tile_x[i];
+      splines.AddToRow(tiled.PlaneRow(0, y) + x0, tiled.PlaneRow(1, y) + x0,
+                       tiled.PlaneRow(2, y) + x0, y, x0, tile_x[i + 1]);
+    }
+  }
+  JXL_TEST_ASSERT_OK(SamePixels(whole, tiled, _));
+}
+
 TEST(SplinesTest, ClearedEveryFrame) {
   JxlMemoryManager* memory_manager = jxl::test::MemoryManager();
   CodecInOut io_expected{memory_manager};
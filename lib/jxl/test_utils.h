@@ -214,9 +214,11 @@ StatusOr<Image3F> GetColorImage(const extras::PackedPixelFile& ppf);
 
 class ThreadPoolForTests {
  public:
-  explicit ThreadPoolForTests(int num_threads) {
-    runner_ =
-        JxlThreadParallelRunnerMake(/* memory_manager */ nullptr, num_threads);
+  explicit ThreadPoolForTests(
+      int num_threads, JxlThreadParallelRunnerMode mode =
+                           JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER) {
+    runner_ = JxlThreadParallelRunnerMakeWithMode(/* memory_manager */ nullptr,
+                                                  num_threads, mode);
     pool_ =
         jxl::make_unique<ThreadPool>(JxlThreadParallelRunner, runner_.get());
   }
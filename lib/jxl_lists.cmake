@@ -28,6 +28,7 @@ set(JPEGXL_INTERNAL_BASE_SOURCES
   jxl/base/sanitizer_definitions.h
   jxl/base/sanitizers.h
   jxl/base/scope_guard.h
+  jxl/base/scratch_arena.h
   jxl/base/span.h
   jxl/base/status.h
 )
@@ -114,6 +115,8 @@ set(JPEGXL_INTERNAL_DEC_JPEG_SOURCES
   jxl/jpeg/dec_jpeg_data.h
   jxl/jpeg/dec_jpeg_data_writer.cc
   jxl/jpeg/dec_jpeg_data_writer.h
+  jxl/jpeg/dec_jpeg_idct.cc
+  jxl/jpeg/dec_jpeg_idct.h
   jxl/jpeg/dec_jpeg_output_chunk.h
   jxl/jpeg/dec_jpeg_serialization_state.h
   jxl/jpeg/jpeg_data.cc
@@ -147,6 +150,7 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/convolve_separable5.cc
   jxl/convolve_slow.cc
   jxl/convolve_symmetric5.cc
+  jxl/data_parallel.cc
   jxl/dct-inl.h
   jxl/dct_block-inl.h
   jxl/dct_scales.cc
@@ -176,6 +180,8 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/dec_noise.h
   jxl/dec_patch_dictionary.cc
   jxl/dec_patch_dictionary.h
+  jxl/dec_stats.cc
+  jxl/dec_stats.h
   jxl/dec_transforms-inl.h
   jxl/dec_xyb-inl.h
   jxl/dec_xyb.cc
@@ -228,6 +234,7 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/modular/transform/palette.h
   jxl/modular/transform/rct.cc
   jxl/modular/transform/rct.h
+  jxl/modular/transform/squeeze-inl.h
   jxl/modular/transform/squeeze.cc
   jxl/modular/transform/squeeze.h
   jxl/modular/transform/squeeze_params.cc
@@ -247,10 +254,14 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/quantizer-inl.h
   jxl/quantizer.cc
   jxl/quantizer.h
+  jxl/render_pipeline/gpu_offload.cc
+  jxl/render_pipeline/gpu_offload.h
+  jxl/render_pipeline/gpu_offload_kernels.h
   jxl/render_pipeline/low_memory_render_pipeline.cc
   jxl/render_pipeline/low_memory_render_pipeline.h
   jxl/render_pipeline/render_pipeline.cc
   jxl/render_pipeline/render_pipeline.h
+  jxl/render_pipeline/render_pipeline_offload.h
   jxl/render_pipeline/render_pipeline_stage.cc
   jxl/render_pipeline/render_pipeline_stage.h
   jxl/render_pipeline/simple_render_pipeline.cc
@@ -263,10 +274,13 @@ set(JPEGXL_INTERNAL_DEC_SOURCES
   jxl/render_pipeline/stage_cms.h
   jxl/render_pipeline/stage_epf.cc
   jxl/render_pipeline/stage_epf.h
+  jxl/render_pipeline/stage_from_linear-inl.h
   jxl/render_pipeline/stage_from_linear.cc
   jxl/render_pipeline/stage_from_linear.h
   jxl/render_pipeline/stage_gaborish.cc
   jxl/render_pipeline/stage_gaborish.h
+  jxl/render_pipeline/stage_gain_map.cc
+  jxl/render_pipeline/stage_gain_map.h
   jxl/render_pipeline/stage_noise.cc
   jxl/render_pipeline/stage_noise.h
   jxl/render_pipeline/stage_patches.cc
@@ -328,6 +342,8 @@ set(JPEGXL_INTERNAL_ENC_SOURCES
   jxl/enc_context_map.h
   jxl/enc_debug_image.cc
   jxl/enc_debug_image.h
+  jxl/enc_decode_cost.cc
+  jxl/enc_decode_cost.h
   jxl/enc_detect_dots.cc
   jxl/enc_detect_dots.h
   jxl/enc_dot_dictionary.cc
@@ -349,6 +365,8 @@ set(JPEGXL_INTERNAL_ENC_SOURCES
   jxl/enc_group.h
   jxl/enc_heuristics.cc
   jxl/enc_heuristics.h
+  jxl/enc_histogram_split.cc
+  jxl/enc_histogram_split.h
   jxl/enc_huffman.cc
   jxl/enc_huffman.h
   jxl/enc_huffman_tree.cc
@@ -384,6 +402,7 @@ set(JPEGXL_INTERNAL_ENC_SOURCES
   jxl/enc_xyb.h
   jxl/encode.cc
   jxl/encode_internal.h
+  jxl/jpeg/enc_jpeg_bit_reader.h
   jxl/jpeg/enc_jpeg_data.cc
   jxl/jpeg/enc_jpeg_data.h
   jxl/jpeg/enc_jpeg_data_reader.cc
@@ -439,16 +458,25 @@ set(JPEGXL_INTERNAL_EXTRAS_SOURCES
   extras/mmap.cc
   extras/mmap.h
   extras/packed_image.h
+  extras/progression_index.cc
+  extras/progression_index.h
   extras/size_constraints.h
   extras/time.cc
   extras/time.h
 )
 
 set(JPEGXL_INTERNAL_GBENCH_SOURCES
+  extras/jpegli_gbench.cc
   extras/tone_mapping_gbench.cc
+  jxl/ans_gbench.cc
   jxl/dct_gbench.cc
   jxl/dec_external_image_gbench.cc
+  jxl/decode_gbench.cc
   jxl/enc_external_image_gbench.cc
+  jxl/encode_gbench.cc
+  jxl/icc_codec_gbench.cc
+  jxl/modular/encoding/context_predict_gbench.cc
+  jxl/render_pipeline/render_pipeline_gbench.cc
   jxl/splines_gbench.cc
   jxl/tf_gbench.cc
 )
@@ -547,6 +575,7 @@ set(JPEGXL_INTERNAL_PUBLIC_HEADERS
   include/jxl/compressed_icc.h
   include/jxl/decode.h
   include/jxl/decode_cxx.h
+  include/jxl/decode_stats.h
   include/jxl/encode.h
   include/jxl/encode_cxx.h
   include/jxl/gain_map.h
@@ -579,6 +608,7 @@ set(JPEGXL_INTERNAL_TESTS
   extras/dec/pgx_test.cc
   extras/gain_map_test.cc
   extras/jpegli_test.cc
+  extras/progression_index_test.cc
   jxl/ac_strategy_test.cc
   jxl/alpha_test.cc
   jxl/ans_common_test.cc
@@ -612,8 +642,11 @@ set(JPEGXL_INTERNAL_TESTS
   jxl/icc_codec_test.cc
   jxl/image_bundle_test.cc
   jxl/image_ops_test.cc
+  jxl/jpeg/dec_jpeg_idct_test.cc
+  jxl/jpeg/enc_jpeg_bit_reader_test.cc
   jxl/jxl_test.cc
   jxl/lehmer_code_test.cc
+  jxl/memory_manager_internal_test.cc
   jxl/modular_test.cc
   jxl/opsin_image_test.cc
   jxl/opsin_inverse_test.cc
@@ -631,18 +664,26 @@ set(JPEGXL_INTERNAL_TESTS
   jxl/splines_test.cc
   jxl/toc_test.cc
   jxl/xorshift128plus_test.cc
+  threads/resizable_parallel_runner_test.cc
+  threads/shared_parallel_runner_test.cc
   threads/thread_parallel_runner_test.cc
 )
 
 set(JPEGXL_INTERNAL_THREADS_PUBLIC_HEADERS
   include/jxl/resizable_parallel_runner.h
   include/jxl/resizable_parallel_runner_cxx.h
+  include/jxl/shared_parallel_runner.h
+  include/jxl/shared_parallel_runner_cxx.h
   include/jxl/thread_parallel_runner.h
   include/jxl/thread_parallel_runner_cxx.h
 )
 
 set(JPEGXL_INTERNAL_THREADS_SOURCES
   threads/resizable_parallel_runner.cc
+  threads/runner_tracer.h
+  threads/shared_parallel_runner.cc
+  threads/thread_affinity.cc
+  threads/thread_affinity.h
   threads/thread_parallel_runner.cc
   threads/thread_parallel_runner_internal.cc
   threads/thread_parallel_runner_internal.h
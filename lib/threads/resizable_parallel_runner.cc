@@ -7,6 +7,7 @@
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
 #include <jxl/resizable_parallel_runner.h>
+#include <jxl/types.h>
 
 #include <algorithm>
 #include <atomic>
@@ -17,6 +18,9 @@
 #include <thread>
 #include <vector>
 
+#include "lib/threads/runner_tracer.h"
+#include "lib/threads/thread_affinity.h"
+
 namespace jpegxl {
 namespace {
 
@@ -36,6 +40,9 @@ struct ResizeableParallelRunner {
     if (workers_.size() < num) {
       for (size_t i = workers_.size(); i < num; i++) {
         workers_.emplace_back([this, i]() { WorkerBody(i); });
+        // Best effort: the placement already failed in SetAffinity() if it is
+        // not supported.
+        (void)ApplyThreadAffinity(affinity_, i, &workers_.back());
       }
     }
     if (workers_.size() > num) {
@@ -46,29 +53,71 @@ struct ResizeableParallelRunner {
     }
   }
 
+  // Applies "affinity" to all current and future workers.
+  bool SetAffinity(const ThreadAffinity& affinity) {
+    if (!ThreadAffinitySupported()) return false;
+    affinity_ = affinity;
+    bool ok = true;
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      ok &= ApplyThreadAffinity(affinity_, i, &workers_[i]);
+    }
+    return ok;
+  }
+
+  void SetAutotune(bool enabled) { autotune_ = enabled; }
+
+  void SetTracer(const JxlParallelRunnerTracer* tracer) {
+    tracer_.Set(tracer);
+  }
+
+  // Describes the frames processed by the next Run() calls.
+  void SetWorkload(uint64_t xsize, uint64_t ysize, bool modular,
+                   uint32_t effort) {
+    const uint64_t kGroupDim = 256;
+    num_groups_ = ((xsize + kGroupDim - 1) / kGroupDim) *
+                  ((ysize + kGroupDim - 1) / kGroupDim);
+    // Modular groups cost more than VarDCT ones, since every pixel goes
+    // through the MA tree, and higher encoder efforts do more work per group.
+    task_cost_ = modular ? 2 : 1;
+    if (effort >= 7) task_cost_ *= 2;
+    if (effort >= 9) task_cost_ *= 2;
+  }
+
   ~ResizeableParallelRunner() { SetNumThreads(0); }
 
   JxlParallelRetCode Run(void* jxl_opaque, JxlParallelRunInit init,
                          JxlParallelRunFunction func, uint32_t start,
                          uint32_t end) {
-    if (start + 1 == end) {
-      JxlParallelRetCode ret = init(jxl_opaque, 1);
-      if (ret != 0) return ret;
+    const uint32_t num_tasks = end - start;
+    size_t num_threads = std::min<size_t>(workers_.size() + 1, num_tasks);
+    if (autotune_) {
+      num_threads = std::min(num_threads, AutotunedThreads(num_tasks));
+    }
 
-      func(jxl_opaque, start, 0);
+    JxlParallelRetCode ret = init(jxl_opaque, std::max<size_t>(num_threads, 1));
+    if (ret != 0) {
       return ret;
     }
 
-    size_t num_workers = std::min<size_t>(workers_.size() + 1, end - start);
-    JxlParallelRetCode ret = init(jxl_opaque, num_workers);
-    if (ret != 0) {
+    RunnerTracer::TracedCall traced_call;
+    const bool traced = tracer_.enabled();
+    if (traced) {
+      tracer_.RunBegin(start, end, std::max<size_t>(num_threads, 1), &func,
+                       &jxl_opaque, &traced_call);
+    }
+
+    if (num_threads <= 1) {
+      for (uint32_t task = start; task < end; ++task) {
+        func(jxl_opaque, task, 0);
+      }
+      if (traced) tracer_.RunEnd(traced_call);
       return ret;
     }
 
     {
       std::unique_lock<std::mutex> l(state_mutex_);
       // Avoid waking up more workers than needed.
-      max_running_workers_ = end - start - 1;
+      max_running_workers_ = num_threads - 1;
       next_task_ = start;
       end_task_ = end;
       func_ = func;
@@ -86,11 +135,27 @@ struct ResizeableParallelRunner {
       work_done_.wait(l);
     }
 
+    if (traced) tracer_.RunEnd(traced_call);
     return ret;
   }
 
  private:
+  // Number of threads worth waking up for "num_tasks" tasks. Each thread
+  // should get enough work to amortize the cost of waking it up and of its
+  // per-thread storage, and a frame with few groups does not benefit from
+  // more threads than it has groups, even if a call has many small tasks.
+  size_t AutotunedThreads(uint32_t num_tasks) const {
+    // Minimum work of a thread, in units of task_cost_.
+    const uint64_t kMinWorkPerThread = 4;
+    uint64_t num_threads = num_tasks * task_cost_ / kMinWorkPerThread;
+    if (num_groups_ != 0) {
+      num_threads = std::min(num_threads, num_groups_ * task_cost_ / 2);
+    }
+    return std::max<uint64_t>(num_threads, 1);
+  }
+
   void WorkerBody(size_t worker_id) {
+    uint64_t wait_begin = RunnerTracer::Now();
     while (true) {
       {
         std::unique_lock<std::mutex> l(state_mutex_);
@@ -105,7 +170,9 @@ struct ResizeableParallelRunner {
         }
         num_running_workers_++;
       }
+      tracer_.Waited(worker_id + 1, wait_begin);
       DequeueTasks(worker_id + 1);
+      wait_begin = RunnerTracer::Now();
     }
   }
 
@@ -137,6 +204,18 @@ struct ResizeableParallelRunner {
 
   std::vector<std::thread> workers_;
 
+  // Placement of the workers; only accessed by the thread owning the runner.
+  ThreadAffinity affinity_;
+
+  RunnerTracer tracer_;
+
+  // Autotuning state; only accessed by the thread owning the runner.
+  bool autotune_ = false;
+  // Number of groups of the current frames, or 0 if unknown.
+  uint64_t num_groups_ = 0;
+  // Relative cost of a task.
+  uint64_t task_cost_ = 1;
+
   // Protects all the remaining variables, except for func_, jxl_opaque_ and
   // end_task_ (for which only the write by the main thread is protected, and
   // subsequent uses by workers happen-after it) and next_task_ (which is
@@ -187,6 +266,45 @@ JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetThreads(
       ->SetNumThreads(num_threads);
 }
 
+JXL_THREADS_EXPORT JXL_BOOL JxlResizableParallelRunnerSetCpuAffinity(
+    void* runner_opaque, const uint32_t* cpus, size_t num_cpus) {
+  if (cpus == nullptr || num_cpus == 0) return JXL_FALSE;
+  jpegxl::ThreadAffinity affinity;
+  affinity.cpus.assign(cpus, cpus + num_cpus);
+  affinity.pin_each = true;
+  return TO_JXL_BOOL(
+      static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque)
+          ->SetAffinity(affinity));
+}
+
+JXL_THREADS_EXPORT JXL_BOOL
+JxlResizableParallelRunnerSetNumaNode(void* runner_opaque, uint32_t node) {
+  jpegxl::ThreadAffinity affinity;
+  if (!jpegxl::GetNumaNodeCpus(node, &affinity.cpus)) return JXL_FALSE;
+  return TO_JXL_BOOL(
+      static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque)
+          ->SetAffinity(affinity));
+}
+
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetAutotune(
+    void* runner_opaque, JXL_BOOL enabled) {
+  static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque)
+      ->SetAutotune(FROM_JXL_BOOL(enabled));
+}
+
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetWorkload(
+    void* runner_opaque, uint64_t xsize, uint64_t ysize, JXL_BOOL modular,
+    uint32_t effort) {
+  static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque)
+      ->SetWorkload(xsize, ysize, FROM_JXL_BOOL(modular), effort);
+}
+
+JXL_THREADS_EXPORT void JxlResizableParallelRunnerSetTracer(
+    void* runner_opaque, const JxlParallelRunnerTracer* tracer) {
+  static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque)
+      ->SetTracer(tracer);
+}
+
 JXL_THREADS_EXPORT void JxlResizableParallelRunnerDestroy(void* runner_opaque) {
   delete static_cast<jpegxl::ResizeableParallelRunner*>(runner_opaque);
 }
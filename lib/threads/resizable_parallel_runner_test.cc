@@ -0,0 +1,127 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/parallel_runner.h>
+#include <jxl/resizable_parallel_runner.h>
+#include <jxl/resizable_parallel_runner_cxx.h>
+#include <jxl/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/testing.h"
+
+namespace jpegxl {
+namespace {
+
+// Runs "num_tasks" tasks on "runner", checks that every task is visited
+// exactly once and returns the number of threads passed to the init function.
+size_t RunTasks(void* runner, uint32_t num_tasks) {
+  jxl::ThreadPool pool(JxlResizableParallelRunner, runner);
+  std::vector<std::atomic<int>> visits(num_tasks);
+  size_t num_threads = 0;
+  const auto init = [&num_threads](size_t num) -> jxl::Status {
+    num_threads = num;
+    return true;
+  };
+  const auto do_task = [&](const uint32_t task,
+                           const size_t thread) -> jxl::Status {
+    EXPECT_LT(thread, num_threads);
+    visits[task].fetch_add(1, std::memory_order_relaxed);
+    return true;
+  };
+  EXPECT_TRUE(pool.Run(0, num_tasks, init, do_task, "RunTasks"));
+  for (uint32_t i = 0; i < num_tasks; ++i) {
+    EXPECT_EQ(1, visits[i].load());
+  }
+  return num_threads;
+}
+
+TEST(ResizableParallelRunnerTest, TestPool) {
+  JxlResizableParallelRunnerPtr runner =
+      JxlResizableParallelRunnerMake(nullptr);
+  ASSERT_TRUE(runner);
+  JxlResizableParallelRunnerSetThreads(runner.get(), 4);
+  EXPECT_EQ(1, RunTasks(runner.get(), 1));
+  EXPECT_EQ(2, RunTasks(runner.get(), 2));
+  EXPECT_EQ(4, RunTasks(runner.get(), 100));
+  JxlResizableParallelRunnerSetThreads(runner.get(), 1);
+  EXPECT_EQ(1, RunTasks(runner.get(), 100));
+}
+
+TEST(ResizableParallelRunnerTest, TestAutotune) {
+  JxlResizableParallelRunnerPtr runner =
+      JxlResizableParallelRunnerMake(nullptr);
+  ASSERT_TRUE(runner);
+  JxlResizableParallelRunnerSetThreads(runner.get(), 4);
+  JxlResizableParallelRunnerSetAutotune(runner.get(), JXL_TRUE);
+
+  // Without a workload, only the number of tasks matters.
+  EXPECT_EQ(1, RunTasks(runner.get(), 2));
+  EXPECT_EQ(4, RunTasks(runner.get(), 100));
+
+  // A single VarDCT group is decoded on one thread, however many tasks a call
+  // has, but encoding it at a high effort is worth more threads, and even more
+  // so in modular mode.
+  JxlResizableParallelRunnerSetWorkload(runner.get(), 200, 200, JXL_FALSE, 0);
+  EXPECT_EQ(1, RunTasks(runner.get(), 100));
+  JxlResizableParallelRunnerSetWorkload(runner.get(), 200, 200, JXL_FALSE, 9);
+  EXPECT_EQ(2, RunTasks(runner.get(), 100));
+  JxlResizableParallelRunnerSetWorkload(runner.get(), 200, 200, JXL_TRUE, 9);
+  EXPECT_EQ(4, RunTasks(runner.get(), 100));
+
+  // Modular tasks are more expensive, so fewer of them are worth a thread.
+  JxlResizableParallelRunnerSetWorkload(runner.get(), 4096, 4096, JXL_FALSE,
+                                        0);
+  EXPECT_EQ(1, RunTasks(runner.get(), 4));
+  JxlResizableParallelRunnerSetWorkload(runner.get(), 4096, 4096, JXL_TRUE, 0);
+  EXPECT_EQ(2, RunTasks(runner.get(), 4));
+  EXPECT_EQ(4, RunTasks(runner.get(), 100));
+
+  JxlResizableParallelRunnerSetAutotune(runner.get(), JXL_FALSE);
+  EXPECT_EQ(2, RunTasks(runner.get(), 2));
+}
+
+TEST(ResizableParallelRunnerTest, TestTracer) {
+  JxlResizableParallelRunnerPtr runner =
+      JxlResizableParallelRunnerMake(nullptr);
+  ASSERT_TRUE(runner);
+  JxlResizableParallelRunnerSetThreads(runner.get(), 4);
+  std::atomic<int> num_tasks{0};
+  int num_runs = 0;
+  JxlParallelRunnerTracer tracer = {};
+  tracer.run_begin = [](void* opaque, uint64_t run_id, uint32_t start_range,
+                        uint32_t end_range, size_t num_threads) {
+    ++*static_cast<int*>(opaque);
+  };
+  tracer.opaque = &num_runs;
+  JxlResizableParallelRunnerSetTracer(runner.get(), &tracer);
+  RunTasks(runner.get(), 1);
+  RunTasks(runner.get(), 100);
+  EXPECT_EQ(2, num_runs);
+
+  // Tasks are reported from all threads.
+  tracer.opaque = &num_tasks;
+  tracer.run_begin = nullptr;
+  tracer.task_end = [](void* opaque, uint64_t run_id, uint32_t task,
+                       size_t thread) {
+    static_cast<std::atomic<int>*>(opaque)->fetch_add(1);
+  };
+  JxlResizableParallelRunnerSetTracer(runner.get(), &tracer);
+  RunTasks(runner.get(), 100);
+  EXPECT_EQ(100, num_tasks.load());
+
+  JxlResizableParallelRunnerSetTracer(runner.get(), nullptr);
+  RunTasks(runner.get(), 100);
+  EXPECT_EQ(100, num_tasks.load());
+  EXPECT_EQ(2, num_runs);
+}
+
+}  // namespace
+}  // namespace jpegxl
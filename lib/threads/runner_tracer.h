@@ -0,0 +1,99 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_THREADS_RUNNER_TRACER_H_
+#define LIB_THREADS_RUNNER_TRACER_H_
+
+// Forwarding of runner events to a JxlParallelRunnerTracer.
+
+#include <jxl/parallel_runner.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace jpegxl {
+
+class RunnerTracer {
+ public:
+  // State of one traced runner call. Its TaskFunc, with the TracedCall as
+  // opaque pointer, replaces the JxlParallelRunFunction of the call and
+  // reports every task.
+  struct TracedCall {
+    static void TaskFunc(void* opaque, uint32_t task, size_t thread) {
+      const TracedCall* self = static_cast<const TracedCall*>(opaque);
+      const JxlParallelRunnerTracer& tracer = *self->tracer;
+      if (tracer.task_begin) {
+        tracer.task_begin(tracer.opaque, self->run_id, task, thread);
+      }
+      self->func(self->jpegxl_opaque, task, thread);
+      if (tracer.task_end) {
+        tracer.task_end(tracer.opaque, self->run_id, task, thread);
+      }
+    }
+
+    const JxlParallelRunnerTracer* tracer;
+    uint64_t run_id;
+    JxlParallelRunFunction func;
+    void* jpegxl_opaque;
+  };
+
+  // Sets or, if "tracer" is null, clears the tracer. Must not be called
+  // concurrently with a runner call.
+  void Set(const JxlParallelRunnerTracer* tracer) {
+    if (tracer != nullptr) tracer_ = *tracer;
+    enabled_.store(tracer != nullptr, std::memory_order_relaxed);
+  }
+
+  // Only meaningful on the thread calling the runner, or on workers after
+  // they were handed work.
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Reports the start of a call and, in "call", wraps "*func" and
+  // "*jpegxl_opaque" so that their tasks are reported too. Requires enabled().
+  void RunBegin(uint32_t start_range, uint32_t end_range, size_t num_threads,
+                JxlParallelRunFunction* func, void** jpegxl_opaque,
+                TracedCall* call) {
+    *call = {&tracer_, next_run_id_++, *func, *jpegxl_opaque};
+    if (tracer_.run_begin) {
+      tracer_.run_begin(tracer_.opaque, call->run_id, start_range, end_range,
+                        num_threads);
+    }
+    *func = &TracedCall::TaskFunc;
+    *jpegxl_opaque = call;
+  }
+
+  // Requires enabled().
+  void RunEnd(const TracedCall& call) const {
+    if (tracer_.run_end) tracer_.run_end(tracer_.opaque, call.run_id);
+  }
+
+  // Reports that worker "thread" got work after waiting since "wait_begin", a
+  // value of Now().
+  void Waited(size_t thread, uint64_t wait_begin) const {
+    if (!enabled() || !tracer_.wait) return;
+    tracer_.wait(tracer_.opaque, thread, Now() - wait_begin);
+  }
+
+  // Monotonic time in nanoseconds.
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+ private:
+  // Written by the thread owning the runner while no call is running, read by
+  // workers after they were handed work, which happens-after the write.
+  JxlParallelRunnerTracer tracer_ = {};
+  std::atomic<bool> enabled_{false};
+  // Only accessed by the thread calling the runner.
+  uint64_t next_run_id_ = 0;
+};
+
+}  // namespace jpegxl
+
+#endif  // LIB_THREADS_RUNNER_TRACER_H_
@@ -0,0 +1,241 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/jxl_threads_export.h>
+#include <jxl/memory_manager.h>
+#include <jxl/parallel_runner.h>
+#include <jxl/shared_parallel_runner.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace jpegxl {
+namespace {
+
+// State of a single JxlSharedParallelRunner call. Lives on the stack of the
+// calling thread, which only returns once no worker is attached to it anymore.
+struct SharedRunnerJob {
+  // Reserves the next chunk of tasks. Like the "guided" schedule of
+  // ThreadParallelRunner, chunks get smaller as fewer tasks remain.
+  bool Reserve(uint32_t* begin, uint32_t* end) {
+    const uint32_t reserved = next_task.load(std::memory_order_relaxed);
+    const uint32_t remaining = end_task - std::min(reserved, end_task);
+    const uint32_t size = std::max(remaining / chunk_divisor, 1u);
+    *begin = next_task.fetch_add(size, std::memory_order_relaxed);
+    *end = std::min(*begin + size, end_task);
+    return *begin < *end;
+  }
+
+  // Runs chunks of tasks on "thread" until all tasks are reserved or, if
+  // "generation" is not null, until it no longer matches "seen_generation".
+  // Returns whether all tasks are reserved.
+  bool RunChunks(size_t thread, const std::atomic<uint64_t>* generation,
+                 uint64_t seen_generation) {
+    for (;;) {
+      uint32_t begin;
+      uint32_t end;
+      if (!Reserve(&begin, &end)) return true;
+      for (uint32_t task = begin; task < end; ++task) {
+        func(jpegxl_opaque, task, thread);
+      }
+      if (generation != nullptr &&
+          generation->load(std::memory_order_relaxed) != seen_generation) {
+        return false;
+      }
+    }
+  }
+
+  // Written by the calling thread before the job is queued.
+  JxlParallelRunFunction func;
+  void* jpegxl_opaque;
+  uint32_t end_task;
+  uint32_t chunk_divisor;
+  int32_t priority;
+  uint64_t sequence;
+
+  std::atomic<uint32_t> next_task;
+
+  // Guarded by the pool mutex.
+  size_t num_attached_workers = 0;
+  bool queued = false;
+};
+
+class SharedRunnerPool {
+ public:
+  explicit SharedRunnerPool(size_t num_worker_threads) {
+    workers_.reserve(num_worker_threads);
+    for (size_t i = 0; i < num_worker_threads; ++i) {
+      // Thread 0 is reserved for the thread calling Run().
+      workers_.emplace_back([this, i]() { WorkerBody(i + 1); });
+    }
+  }
+
+  ~SharedRunnerPool() {
+    {
+      std::unique_lock<std::mutex> l(mutex_);
+      exit_ = true;
+      work_available_.notify_all();
+    }
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  JxlParallelRetCode Run(int32_t priority, void* jpegxl_opaque,
+                         JxlParallelRunInit init, JxlParallelRunFunction func,
+                         uint32_t start, uint32_t end) {
+    if (start > end) return JXL_PARALLEL_RET_RUNNER_ERROR;
+    if (start == end) return JXL_PARALLEL_RET_SUCCESS;
+
+    const size_t num_threads = workers_.size() + 1;
+    JxlParallelRetCode ret = init(jpegxl_opaque, num_threads);
+    if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
+
+    if (workers_.empty() || start + 1 == end) {
+      for (uint32_t task = start; task < end; ++task) {
+        func(jpegxl_opaque, task, 0);
+      }
+      return JXL_PARALLEL_RET_SUCCESS;
+    }
+
+    SharedRunnerJob job;
+    job.func = func;
+    job.jpegxl_opaque = jpegxl_opaque;
+    job.end_task = end;
+    job.chunk_divisor = num_threads * 4;
+    job.priority = priority;
+    job.next_task.store(start, std::memory_order_relaxed);
+    {
+      std::unique_lock<std::mutex> l(mutex_);
+      job.sequence = next_sequence_++;
+      job.queued = true;
+      jobs_.push_back(&job);
+      // Makes attached workers re-evaluate which job to work on.
+      queue_generation_.fetch_add(1, std::memory_order_relaxed);
+      work_available_.notify_all();
+    }
+
+    job.RunChunks(/*thread=*/0, /*generation=*/nullptr, 0);
+
+    std::unique_lock<std::mutex> l(mutex_);
+    Dequeue(&job);
+    while (job.num_attached_workers != 0) {
+      job_detached_.wait(l);
+    }
+    return JXL_PARALLEL_RET_SUCCESS;
+  }
+
+ private:
+  // Returns the queued job with the highest priority, the oldest one among
+  // those, or null if there is none. Requires mutex_.
+  SharedRunnerJob* BestJob() const {
+    SharedRunnerJob* best = nullptr;
+    for (SharedRunnerJob* job : jobs_) {
+      if (best == nullptr || job->priority > best->priority ||
+          (job->priority == best->priority && job->sequence < best->sequence)) {
+        best = job;
+      }
+    }
+    return best;
+  }
+
+  // Requires mutex_.
+  void Dequeue(SharedRunnerJob* job) {
+    if (!job->queued) return;
+    job->queued = false;
+    jobs_.erase(std::find(jobs_.begin(), jobs_.end(), job));
+  }
+
+  void WorkerBody(size_t thread) {
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+      if (exit_) return;
+      SharedRunnerJob* job = BestJob();
+      if (job == nullptr) {
+        work_available_.wait(l);
+        continue;
+      }
+      job->num_attached_workers++;
+      const uint64_t generation =
+          queue_generation_.load(std::memory_order_relaxed);
+      l.unlock();
+      const bool exhausted =
+          job->RunChunks(thread, &queue_generation_, generation);
+      l.lock();
+      if (exhausted) Dequeue(job);
+      // The calling thread may destroy the job as soon as the lock is
+      // released, so this is the last access to it.
+      if (--job->num_attached_workers == 0 && !job->queued) {
+        job_detached_.notify_all();
+      }
+    }
+  }
+
+  std::vector<std::thread> workers_;
+
+  // Protects all the remaining variables, except for queue_generation_ which
+  // is only written with the mutex held but also polled by running workers.
+  std::mutex mutex_;
+  // Signaled when a job is queued or the pool is destroyed.
+  std::condition_variable work_available_;
+  // Signaled when the last worker detaches from a job that is not queued.
+  std::condition_variable job_detached_;
+
+  // Jobs which may still have unreserved tasks.
+  std::vector<SharedRunnerJob*> jobs_;
+  uint64_t next_sequence_ = 0;
+  std::atomic<uint64_t> queue_generation_{0};
+  bool exit_ = false;
+};
+
+struct SharedParallelRunner {
+  SharedRunnerPool* pool;
+  int32_t priority;
+};
+
+}  // namespace
+}  // namespace jpegxl
+
+extern "C" {
+JXL_THREADS_EXPORT JxlParallelRetCode JxlSharedParallelRunner(
+    void* runner_opaque, void* jpegxl_opaque, JxlParallelRunInit init,
+    JxlParallelRunFunction func, uint32_t start_range, uint32_t end_range) {
+  auto* runner = static_cast<jpegxl::SharedParallelRunner*>(runner_opaque);
+  return runner->pool->Run(runner->priority, jpegxl_opaque, init, func,
+                           start_range, end_range);
+}
+
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerPoolCreate(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads) {
+  return new jpegxl::SharedRunnerPool(num_worker_threads);
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerPoolDestroy(void* pool) {
+  delete static_cast<jpegxl::SharedRunnerPool*>(pool);
+}
+
+JXL_THREADS_EXPORT void* JxlSharedParallelRunnerCreate(void* pool,
+                                                      int32_t priority) {
+  if (pool == nullptr) return nullptr;
+  return new jpegxl::SharedParallelRunner{
+      static_cast<jpegxl::SharedRunnerPool*>(pool), priority};
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerSetPriority(void* runner_opaque,
+                                                          int32_t priority) {
+  static_cast<jpegxl::SharedParallelRunner*>(runner_opaque)->priority =
+      priority;
+}
+
+JXL_THREADS_EXPORT void JxlSharedParallelRunnerDestroy(void* runner_opaque) {
+  delete static_cast<jpegxl::SharedParallelRunner*>(runner_opaque);
+}
+}
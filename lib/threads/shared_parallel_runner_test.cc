@@ -0,0 +1,87 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <jxl/shared_parallel_runner.h>
+#include <jxl/shared_parallel_runner_cxx.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "lib/jxl/base/data_parallel.h"
+#include "lib/jxl/base/status.h"
+#include "lib/jxl/testing.h"
+
+namespace jpegxl {
+namespace {
+
+// Runs a few calls with different ranges on "runner" and checks that every
+// task is visited exactly once, with a thread number within bounds.
+void CheckRuns(void* runner) {
+  jxl::ThreadPool pool(JxlSharedParallelRunner, runner);
+  for (uint32_t num_tasks = 0; num_tasks < 64; num_tasks += 7) {
+    for (uint32_t begin = 0; begin < 5; ++begin) {
+      std::vector<std::atomic<int>> visits(num_tasks);
+      size_t num_threads = 0;
+      const auto init = [&num_threads](size_t num) -> jxl::Status {
+        num_threads = num;
+        return true;
+      };
+      const auto do_task = [&](const uint32_t task,
+                               const size_t thread) -> jxl::Status {
+        EXPECT_LT(thread, num_threads);
+        EXPECT_GE(task, begin);
+        EXPECT_LT(task, begin + num_tasks);
+        visits[task - begin].fetch_add(1, std::memory_order_relaxed);
+        return true;
+      };
+      EXPECT_TRUE(
+          pool.Run(begin, begin + num_tasks, init, do_task, "CheckRuns"));
+      for (uint32_t i = 0; i < num_tasks; ++i) {
+        EXPECT_EQ(1, visits[i].load());
+      }
+    }
+  }
+}
+
+TEST(SharedParallelRunnerTest, NoWorkers) {
+  JxlSharedParallelRunnerPoolPtr pool =
+      JxlSharedParallelRunnerPoolMake(nullptr, 0);
+  ASSERT_TRUE(pool);
+  JxlSharedParallelRunnerPtr runner = JxlSharedParallelRunnerMake(pool.get());
+  ASSERT_TRUE(runner);
+  CheckRuns(runner.get());
+}
+
+TEST(SharedParallelRunnerTest, ConcurrentRunners) {
+  const size_t kNumWorkers = 4;
+  const int kNumRunners = 6;
+  JxlSharedParallelRunnerPoolPtr pool =
+      JxlSharedParallelRunnerPoolMake(nullptr, kNumWorkers);
+  ASSERT_TRUE(pool);
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kNumRunners; ++i) {
+    clients.emplace_back([&pool, i]() {
+      JxlSharedParallelRunnerPtr runner =
+          JxlSharedParallelRunnerMake(pool.get(), /*priority=*/i % 3);
+      ASSERT_TRUE(runner);
+      CheckRuns(runner.get());
+      JxlSharedParallelRunnerSetPriority(runner.get(), -i);
+      CheckRuns(runner.get());
+    });
+  }
+  for (std::thread& client : clients) {
+    client.join();
+  }
+}
+
+TEST(SharedParallelRunnerTest, InvalidPool) {
+  EXPECT_EQ(nullptr, JxlSharedParallelRunnerCreate(nullptr, 0));
+}
+
+}  // namespace
+}  // namespace jpegxl
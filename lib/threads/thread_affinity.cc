@@ -0,0 +1,92 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "lib/threads/thread_affinity.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "lib/jxl/base/os_macros.h"
+
+#if JXL_OS_LINUX && !defined(__ANDROID__)
+#define JXL_THREADS_HAVE_AFFINITY 1
+#include <pthread.h>
+#include <sched.h>
+#else
+#define JXL_THREADS_HAVE_AFFINITY 0
+#endif
+
+namespace jpegxl {
+
+bool ThreadAffinitySupported() { return JXL_THREADS_HAVE_AFFINITY; }
+
+bool GetNumaNodeCpus(uint32_t node, std::vector<uint32_t>* cpus) {
+  cpus->clear();
+#if JXL_OS_LINUX
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist",
+           node);
+  FILE* file = fopen(path, "r");
+  if (file == nullptr) return false;
+  // The list has the form "0-3,8,10-11".
+  bool ok = true;
+  for (;;) {
+    unsigned first;
+    unsigned last;
+    if (fscanf(file, "%u", &first) != 1) break;
+    last = first;
+    int c = fgetc(file);
+    if (c == '-') {
+      if (fscanf(file, "%u", &last) != 1 || last < first) {
+        ok = false;
+        break;
+      }
+      c = fgetc(file);
+    }
+    for (unsigned cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+    if (c != ',') break;
+  }
+  fclose(file);
+  if (!ok) cpus->clear();
+  return !cpus->empty();
+#else
+  (void)node;
+  return false;
+#endif
+}
+
+bool ApplyThreadAffinity(const ThreadAffinity& affinity, size_t worker,
+                         std::thread* thread) {
+  if (affinity.cpus.empty()) return true;
+#if JXL_THREADS_HAVE_AFFINITY
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  const auto add = [&set](uint32_t cpu) {
+    if (cpu >= CPU_SETSIZE) return false;
+    CPU_SET(cpu, &set);
+    return true;
+  };
+  if (affinity.pin_each) {
+    if (!add(affinity.cpus[worker % affinity.cpus.size()])) return false;
+  } else {
+    for (uint32_t cpu : affinity.cpus) {
+      if (!add(cpu)) return false;
+    }
+  }
+  return pthread_setaffinity_np(thread->native_handle(), sizeof(set), &set) ==
+         0;
+#else
+  (void)worker;
+  (void)thread;
+  return false;
+#endif
+}
+
+}  // namespace jpegxl
@@ -0,0 +1,44 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef LIB_THREADS_THREAD_AFFINITY_H_
+#define LIB_THREADS_THREAD_AFFINITY_H_
+
+// Helpers to place the worker threads of the parallel runners on specific CPUs
+// or NUMA nodes. Only implemented on Linux; elsewhere all functions fail and
+// threads keep the default placement of the OS scheduler.
+
+#include <cstddef>
+#include <cstdint>
+#include <thread>  //NOLINT
+#include <vector>
+
+namespace jpegxl {
+
+// Placement policy of the workers of a runner.
+struct ThreadAffinity {
+  // CPUs the workers may run on. Empty means no restriction.
+  std::vector<uint32_t> cpus;
+  // If true, worker i is pinned to cpus[i % cpus.size()]; otherwise every
+  // worker may run on any of the cpus.
+  bool pin_each = false;
+};
+
+// Returns whether the current platform supports ApplyThreadAffinity.
+bool ThreadAffinitySupported();
+
+// Fills "cpus" with the CPUs of NUMA node "node". Returns false if the node is
+// unknown or the platform does not expose the topology.
+bool GetNumaNodeCpus(uint32_t node, std::vector<uint32_t>* cpus);
+
+// Restricts "thread", the worker with index "worker", according to
+// "affinity". Returns false if the placement could not be applied; the thread
+// then keeps its previous placement.
+bool ApplyThreadAffinity(const ThreadAffinity& affinity, size_t worker,
+                         std::thread* thread);
+
+}  // namespace jpegxl
+
+#endif  // LIB_THREADS_THREAD_AFFINITY_H_
@@ -11,7 +11,9 @@
 #include <cstdint>
 #include <cstdlib>
 #include <thread>
+#include <vector>
 
+#include "lib/threads/thread_affinity.h"
 #include "lib/threads/thread_parallel_runner_internal.h"
 
 namespace {
@@ -76,6 +78,18 @@ JxlParallelRetCode JxlThreadParallelRunner(
 /// run on the main thread.
 void* JxlThreadParallelRunnerCreate(const JxlMemoryManager* memory_manager,
                                     size_t num_worker_threads) {
+  return JxlThreadParallelRunnerCreateWithMode(
+      memory_manager, num_worker_threads,
+      JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER);
+}
+
+void* JxlThreadParallelRunnerCreateWithMode(
+    const JxlMemoryManager* memory_manager, size_t num_worker_threads,
+    JxlThreadParallelRunnerMode mode) {
+  if (mode != JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER &&
+      mode != JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING) {
+    return nullptr;
+  }
   JxlMemoryManager local_memory_manager;
   if (!ThreadMemoryManagerInit(&local_memory_manager, memory_manager))
     return nullptr;
@@ -85,7 +99,7 @@ void* JxlThreadParallelRunnerCreate(const JxlMemoryManager* memory_manager,
   if (!alloc) return nullptr;
   // Placement new constructor on allocated memory
   jpegxl::ThreadParallelRunner* runner =
-      new (alloc) jpegxl::ThreadParallelRunner(num_worker_threads);
+      new (alloc) jpegxl::ThreadParallelRunner(num_worker_threads, mode);
   runner->memory_manager = local_memory_manager;
 
   return runner;
@@ -102,6 +116,32 @@ void JxlThreadParallelRunnerDestroy(void* runner_opaque) {
   }
 }
 
+JXL_BOOL JxlThreadParallelRunnerSetCpuAffinity(void* runner_opaque,
+                                               const uint32_t* cpus,
+                                               size_t num_cpus) {
+  if (cpus == nullptr || num_cpus == 0) return JXL_FALSE;
+  jpegxl::ThreadAffinity affinity;
+  affinity.cpus.assign(cpus, cpus + num_cpus);
+  affinity.pin_each = true;
+  return TO_JXL_BOOL(
+      static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque)
+          ->SetAffinity(affinity));
+}
+
+JXL_BOOL JxlThreadParallelRunnerSetNumaNode(void* runner_opaque,
+                                            uint32_t node) {
+  jpegxl::ThreadAffinity affinity;
+  if (!jpegxl::GetNumaNodeCpus(node, &affinity.cpus)) return JXL_FALSE;
+  return TO_JXL_BOOL(
+      static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque)
+          ->SetAffinity(affinity));
+}
+
+void JxlThreadParallelRunnerSetTracer(void* runner_opaque,
+                                      const JxlParallelRunnerTracer* tracer) {
+  static_cast<jpegxl::ThreadParallelRunner*>(runner_opaque)->SetTracer(tracer);
+}
+
 // Get default value for num_worker_threads parameter of
 // InitJxlThreadParallelRunner.
 size_t JxlThreadParallelRunnerDefaultNumWorkerThreads() {
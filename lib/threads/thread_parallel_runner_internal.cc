@@ -15,9 +15,71 @@
 #include <mutex>
 #include <thread>
 
+#include "lib/jxl/base/arch_macros.h"
 #include "lib/jxl/base/compiler_specific.h"
 
 namespace jpegxl {
+namespace {
+
+// Number of polling iterations before a waiting thread parks on a condition
+// variable in work-stealing mode. With ~100 cycles per CpuRelax this is in the
+// order of tens of microseconds, which covers the gap between consecutive
+// RunOnPool calls of a typical decoder or encoder stage. Spinning is disabled
+// when there are not more hardware threads than workers, since a spinning
+// thread would then steal time from the ones doing the work.
+constexpr uint32_t kSpinIterations = 2000;
+
+JXL_INLINE void CpuRelax() {
+#if JXL_ARCH_X64 && (JXL_COMPILER_GCC || JXL_COMPILER_CLANG)
+  __builtin_ia32_pause();
+#elif JXL_ARCH_ARM && (JXL_COMPILER_GCC || JXL_COMPILER_CLANG)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  std::this_thread::yield();
+#endif
+}
+
+constexpr uint64_t PackRange(uint32_t begin, uint32_t end) {
+  return (static_cast<uint64_t>(begin) << 32) + end;
+}
+
+constexpr uint32_t RangeBegin(uint64_t range) { return range >> 32; }
+constexpr uint32_t RangeEnd(uint64_t range) { return range & 0xFFFFFFFF; }
+
+// Reserves the first task of "range", if any.
+bool PopFront(std::atomic<uint64_t>* range, uint32_t* task) {
+  uint64_t current = range->load(std::memory_order_relaxed);
+  for (;;) {
+    const uint32_t begin = RangeBegin(current);
+    const uint32_t end = RangeEnd(current);
+    if (begin >= end) return false;
+    if (range->compare_exchange_weak(current, PackRange(begin + 1, end),
+                                     std::memory_order_relaxed)) {
+      *task = begin;
+      return true;
+    }
+  }
+}
+
+// Reserves the back half (rounded up) of the tasks of "range", if any.
+bool StealBack(std::atomic<uint64_t>* range, uint32_t* stolen_begin,
+               uint32_t* stolen_end) {
+  uint64_t current = range->load(std::memory_order_relaxed);
+  for (;;) {
+    const uint32_t begin = RangeBegin(current);
+    const uint32_t end = RangeEnd(current);
+    if (begin >= end) return false;
+    const uint32_t mid = begin + (end - begin) / 2;
+    if (range->compare_exchange_weak(current, PackRange(begin, mid),
+                                     std::memory_order_relaxed)) {
+      *stolen_begin = mid;
+      *stolen_end = end;
+      return true;
+    }
+  }
+}
+
+}  // namespace
 
 // static
 JxlParallelRetCode ThreadParallelRunner::Runner(
@@ -28,9 +90,17 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
   if (start_range > end_range) return JXL_PARALLEL_RET_RUNNER_ERROR;
   if (start_range == end_range) return JXL_PARALLEL_RET_SUCCESS;
 
-  int ret = init(jpegxl_opaque, std::max<size_t>(self->num_worker_threads_, 1));
+  const size_t num_threads = std::max<size_t>(self->num_worker_threads_, 1);
+  int ret = init(jpegxl_opaque, num_threads);
   if (ret != JXL_PARALLEL_RET_SUCCESS) return ret;
 
+  RunnerTracer::TracedCall traced_call;
+  const bool traced = self->tracer_.enabled();
+  if (traced) {
+    self->tracer_.RunBegin(start_range, end_range, num_threads, &func,
+                           &jpegxl_opaque, &traced_call);
+  }
+
   // Use a sequential run when num_worker_threads_ is zero since we have no
   // worker threads.
   if (self->num_worker_threads_ == 0) {
@@ -38,6 +108,7 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
     for (uint32_t task = start_range; task < end_range; ++task) {
       func(jpegxl_opaque, task, thread);
     }
+    if (traced) self->tracer_.RunEnd(traced_call);
     return JXL_PARALLEL_RET_SUCCESS;
   }
 
@@ -55,10 +126,24 @@ JxlParallelRetCode ThreadParallelRunner::Runner(
 
   self->data_func_ = func;
   self->jpegxl_opaque_ = jpegxl_opaque;
-  self->num_reserved_.store(0, std::memory_order_relaxed);
+  if (self->mode_ == JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING) {
+    // Hand out one contiguous slice per worker; the release store of the
+    // command generation publishes them.
+    const uint64_t num_tasks = end_range - start_range;
+    const uint32_t num_worker_threads = self->num_worker_threads_;
+    for (uint32_t i = 0; i < num_worker_threads; ++i) {
+      const uint32_t begin = start_range + num_tasks * i / num_worker_threads;
+      const uint32_t end =
+          start_range + num_tasks * (i + 1) / num_worker_threads;
+      self->worker_ranges_[i].range.store(PackRange(begin, end),
+                                          std::memory_order_relaxed);
+    }
+  } else {
+    self->num_reserved_.store(0, std::memory_order_relaxed);
+  }
 
-  self->StartWorkers(worker_command);
-  self->WorkersReadyBarrier();
+  self->RunCommand(worker_command);
+  if (traced) self->tracer_.RunEnd(traced_call);
 
   if (self->depth_.fetch_add(-1, std::memory_order_acq_rel) != 1) {
     return JXL_PARALLEL_RET_RUNNER_ERROR;
@@ -109,6 +194,41 @@ void ThreadParallelRunner::RunRange(ThreadParallelRunner* self,
   }
 }
 
+// static
+void ThreadParallelRunner::StealingRunRange(ThreadParallelRunner* self,
+                                            const int thread) {
+  const uint32_t num_worker_threads = self->num_worker_threads_;
+  std::atomic<uint64_t>* own_range = &self->worker_ranges_[thread].range;
+  for (;;) {
+    uint32_t task;
+    while (PopFront(own_range, &task)) {
+      self->data_func_(self->jpegxl_opaque_, task, thread);
+    }
+
+    // Own slice is exhausted: look for a victim, starting with the next worker
+    // so that thieves spread out over the victims.
+    bool stole = false;
+    for (uint32_t i = 1; i < num_worker_threads && !stole; ++i) {
+      const uint32_t victim = (thread + i) % num_worker_threads;
+      uint32_t stolen_begin;
+      uint32_t stolen_end;
+      if (!StealBack(&self->worker_ranges_[victim].range, &stolen_begin,
+                     &stolen_end)) {
+        continue;
+      }
+      // Make the rest of the stolen tasks available to other thieves before
+      // running the first one.
+      own_range->store(PackRange(stolen_begin + 1, stolen_end),
+                       std::memory_order_relaxed);
+      self->data_func_(self->jpegxl_opaque_, stolen_begin, thread);
+      stole = true;
+    }
+    // All slices are empty, so all tasks are reserved. Tasks that were stolen
+    // but not yet re-published are run by their thief.
+    if (!stole) break;
+  }
+}
+
 // static
 void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
                                       const int thread) {
@@ -119,6 +239,7 @@ void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
     if (++self->workers_ready_ == self->num_threads_) {
       self->workers_ready_cv_.notify_one();
     }
+    const uint64_t wait_begin = RunnerTracer::Now();
   RESUME_WAIT:
     // Wait for a command.
     self->worker_start_cv_.wait(lock);
@@ -134,24 +255,122 @@ void ThreadParallelRunner::ThreadFunc(ThreadParallelRunner* self,
         return;  // exits thread
       default:
         lock.unlock();
+        self->tracer_.Waited(thread, wait_begin);
         RunRange(self, command, thread);
         break;
     }
   }
 }
 
-ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
+// static
+void ThreadParallelRunner::StealingThreadFunc(ThreadParallelRunner* self,
+                                              const int thread) {
+  uint64_t seen_generation = 0;
+  // Until kWorkerExit command received:
+  for (;;) {
+    const uint64_t wait_begin = RunnerTracer::Now();
+    // Spin for a while, then park until a new command is published.
+    uint64_t generation =
+        self->command_generation_.load(std::memory_order_acquire);
+    for (uint32_t i = 0;
+         i < self->spin_iterations_ && generation == seen_generation; ++i) {
+      CpuRelax();
+      generation = self->command_generation_.load(std::memory_order_acquire);
+    }
+    if (generation == seen_generation) {
+      std::unique_lock<std::mutex> lock(self->mutex_);
+      self->worker_start_cv_.wait(lock, [self, &generation, seen_generation] {
+        generation = self->command_generation_.load(std::memory_order_acquire);
+        return generation != seen_generation;
+      });
+    }
+    seen_generation = generation;
+
+    // The main thread does not modify the command until all workers are done.
+    const WorkerCommand command = self->worker_start_command_;
+    switch (command) {
+      case kWorkerOnce:
+        self->data_func_(self->jpegxl_opaque_, thread, thread);
+        break;
+      case kWorkerExit:
+        return;  // exits thread
+      default:
+        self->tracer_.Waited(thread, wait_begin);
+        StealingRunRange(self, thread);
+        break;
+    }
+
+    if (self->num_busy_workers_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      // Last worker done; the lock ensures the main thread is either not yet
+      // checking or already waiting.
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      self->workers_ready_cv_.notify_one();
+    }
+  }
+}
+
+void ThreadParallelRunner::StartStealingWorkers(
+    const WorkerCommand worker_command) {
+  worker_start_command_ = worker_command;
+  num_busy_workers_.store(num_worker_threads_, std::memory_order_relaxed);
+  command_generation_.fetch_add(1, std::memory_order_acq_rel);
+  // Parked workers check the generation with the lock held, so taking it here
+  // guarantees that the notification below is not lost.
+  mutex_.lock();
+  mutex_.unlock();
+  worker_start_cv_.notify_all();
+}
+
+void ThreadParallelRunner::StealingWorkersDoneBarrier() {
+  for (uint32_t i = 0; i < spin_iterations_; ++i) {
+    if (num_busy_workers_.load(std::memory_order_acquire) == 0) return;
+    CpuRelax();
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  workers_ready_cv_.wait(lock, [this] {
+    return num_busy_workers_.load(std::memory_order_acquire) == 0;
+  });
+}
+
+void ThreadParallelRunner::RunCommand(const WorkerCommand worker_command) {
+  if (mode_ == JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING) {
+    StartStealingWorkers(worker_command);
+    StealingWorkersDoneBarrier();
+  } else {
+    StartWorkers(worker_command);
+    WorkersReadyBarrier();
+  }
+}
+
+ThreadParallelRunner::ThreadParallelRunner(
+    const int num_worker_threads, const JxlThreadParallelRunnerMode mode)
     : num_worker_threads_(num_worker_threads),
-      num_threads_(std::max(num_worker_threads, 1)) {
+      num_threads_(std::max(num_worker_threads, 1)),
+      mode_(mode),
+      spin_iterations_(
+          std::thread::hardware_concurrency() > num_threads_ ? kSpinIterations
+                                                             : 0) {
   threads_.reserve(num_worker_threads_);
 
   // Suppress "unused-private-field" warning.
   (void)padding1;
   (void)padding2;
+  (void)padding3;
+  (void)padding4;
 
   // Safely handle spurious worker wakeups.
   worker_start_command_ = kWorkerWait;
 
+  if (mode_ == JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING) {
+    worker_ranges_ = std::vector<WorkerRange>(num_worker_threads_);
+    for (uint32_t i = 0; i < num_worker_threads_; ++i) {
+      threads_.emplace_back(StealingThreadFunc, this, i);
+    }
+    // Workers start out spinning on the command generation and need no
+    // ready barrier.
+    return;
+  }
+
   for (uint32_t i = 0; i < num_worker_threads_; ++i) {
     threads_.emplace_back(ThreadFunc, this, i);
   }
@@ -161,9 +380,21 @@ ThreadParallelRunner::ThreadParallelRunner(const int num_worker_threads)
   }
 }
 
+bool ThreadParallelRunner::SetAffinity(const ThreadAffinity& affinity) {
+  bool ok = true;
+  for (size_t i = 0; i < threads_.size(); ++i) {
+    ok &= ApplyThreadAffinity(affinity, i, &threads_[i]);
+  }
+  return ok;
+}
+
 ThreadParallelRunner::~ThreadParallelRunner() {
   if (num_worker_threads_ != 0) {
-    StartWorkers(kWorkerExit);
+    if (mode_ == JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING) {
+      StartStealingWorkers(kWorkerExit);
+    } else {
+      StartWorkers(kWorkerExit);
+    }
   }
 
   for (std::thread& thread : threads_) {
@@ -24,6 +24,14 @@
 // 10-20x higher when using std::async, and ~200x for a queue-based thread
 // pool.
 //
+// In the alternative JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING mode, the
+// range is instead split into one contiguous slice per worker. Workers consume
+// their own slice from the front and, once it is exhausted, steal the back half
+// of the remaining slice of another worker, so that no cache line is shared by
+// all workers in the common case. Between calls, workers spin for a short while
+// before parking on the condition variable, which avoids most of the wake-up
+// cost of back-to-back calls with small ranges.
+//
 // Usage:
 //   ThreadParallelRunner runner;
 //   JxlDecode(
@@ -34,6 +42,7 @@
 
 #include <jxl/memory_manager.h>
 #include <jxl/parallel_runner.h>
+#include <jxl/thread_parallel_runner.h>
 
 #include <atomic>
 #include <condition_variable>  //NOLINT
@@ -44,6 +53,9 @@
 #include <thread>  //NOLINT
 #include <vector>
 
+#include "lib/threads/runner_tracer.h"
+#include "lib/threads/thread_affinity.h"
+
 namespace jpegxl {
 
 // Main helper class implementing the ::JxlParallelRunner interface.
@@ -57,9 +69,12 @@ class ThreadParallelRunner {
 
   // Starts the given number of worker threads and blocks until they are ready.
   // "num_worker_threads" defaults to one per hyperthread. If zero, all tasks
-  // run on the main thread.
+  // run on the main thread. "mode" selects the scheduling strategy of the
+  // workers.
   explicit ThreadParallelRunner(
-      int num_worker_threads = std::thread::hardware_concurrency());
+      int num_worker_threads = std::thread::hardware_concurrency(),
+      JxlThreadParallelRunnerMode mode =
+          JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER);
 
   // Waits for all threads to exit.
   ~ThreadParallelRunner();
@@ -68,6 +83,16 @@ class ThreadParallelRunner {
   // for allocating per-thread storage.
   size_t NumThreads() const { return num_threads_; }
 
+  // Applies "affinity" to all worker threads. Returns false if it could not be
+  // applied to at least one of them. Not thread-safe with respect to Runner().
+  bool SetAffinity(const ThreadAffinity& affinity);
+
+  // Sets or, if null, clears the tracer receiving the events of Runner().
+  // Not thread-safe with respect to Runner().
+  void SetTracer(const JxlParallelRunnerTracer* tracer) {
+    tracer_.Set(tracer);
+  }
+
   // Runs func(thread, thread) on all thread(s) that may participate in Run.
   // If NumThreads() == 0, runs on the main thread with thread == 0, otherwise
   // concurrently called by each worker thread in [0, NumThreads()).
@@ -81,8 +106,7 @@ class ThreadParallelRunner {
 
     data_func_ = reinterpret_cast<JxlParallelRunFunction>(&CallClosure<Func>);
     jpegxl_opaque_ = const_cast<void*>(static_cast<const void*>(&func));
-    StartWorkers(kWorkerOnce);
-    WorkersReadyBarrier();
+    RunCommand(kWorkerOnce);
   }
 
   JxlMemoryManager memory_manager;
@@ -130,21 +154,45 @@ class ThreadParallelRunner {
     worker_start_cv_.notify_all();
   }
 
+  // Work-stealing mode: publishes "worker_command" to all workers, which may
+  // still be spinning or already parked. Precondition: all workers are done
+  // with the previous command.
+  void StartStealingWorkers(WorkerCommand worker_command);
+
+  // Work-stealing mode: blocks until all workers are done with the command
+  // published by the last StartStealingWorkers() call.
+  void StealingWorkersDoneBarrier();
+
+  // Sends "worker_command" to all workers and waits until they are done.
+  void RunCommand(WorkerCommand worker_command);
+
   // Attempts to reserve and perform some work from the global range of tasks,
   // which is encoded within "command". Returns after all tasks are reserved.
   static void RunRange(ThreadParallelRunner* self, WorkerCommand command,
                        int thread);
 
+  // Work-stealing mode counterpart of RunRange: performs the tasks of the
+  // slice owned by "thread", then steals from the other workers. Returns after
+  // all tasks are reserved.
+  static void StealingRunRange(ThreadParallelRunner* self, int thread);
+
   static void ThreadFunc(ThreadParallelRunner* self, int thread);
 
+  static void StealingThreadFunc(ThreadParallelRunner* self, int thread);
+
   // Unmodified after ctor, but cannot be const because we call thread::join().
   std::vector<std::thread> threads_;
 
   const uint32_t num_worker_threads_;  // == threads_.size()
   const uint32_t num_threads_;
+  const JxlThreadParallelRunnerMode mode_;
+  // Work-stealing mode: how long waiting threads poll before parking.
+  const uint32_t spin_iterations_;
 
   std::atomic<int> depth_{0};  // detects if Run is re-entered (not supported).
 
+  RunnerTracer tracer_;
+
   std::mutex mutex_;  // guards both cv and their variables.
   std::condition_variable workers_ready_cv_;
   uint32_t workers_ready_ = 0;
@@ -159,6 +207,22 @@ class ThreadParallelRunner {
   uint8_t padding1[64];
   std::atomic<uint32_t> num_reserved_{0};
   uint8_t padding2[64];
+
+  // Tasks of one worker slice in work-stealing mode, encoded as
+  // (begin << 32) + end. Only the owner takes tasks from the front and only
+  // thieves take them from the back, both with a compare-exchange of the whole
+  // range. Aligned to avoid false sharing between workers.
+  struct alignas(64) WorkerRange {
+    std::atomic<uint64_t> range{0};
+  };
+  std::vector<WorkerRange> worker_ranges_;
+
+  // Work-stealing mode: incremented by the main thread whenever a new command
+  // is published, and the number of workers that have not finished it yet.
+  std::atomic<uint64_t> command_generation_{0};
+  uint8_t padding3[64];
+  std::atomic<uint32_t> num_busy_workers_{0};
+  uint8_t padding4[64];
 };
 
 }  // namespace jpegxl
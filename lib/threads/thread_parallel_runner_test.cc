@@ -3,9 +3,16 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/parallel_runner.h>
+#include <jxl/thread_parallel_runner.h>
+#include <jxl/thread_parallel_runner_cxx.h>
+#include <jxl/types.h>
+
 #include <algorithm>
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
+#include <string>
 #include <vector>
 
 #include "lib/jxl/base/data_parallel.h"
@@ -18,6 +25,11 @@ using ::jxl::test::ThreadPoolForTests;
 namespace jpegxl {
 namespace {
 
+constexpr JxlThreadParallelRunnerMode kModes[] = {
+    JXL_THREAD_PARALLEL_RUNNER_MODE_SHARED_COUNTER,
+    JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING,
+};
+
 int PopulationCount(uint64_t bits) {
   int num_set = 0;
   while (bits != 0) {
@@ -31,27 +43,29 @@ int PopulationCount(uint64_t bits) {
 // pool can be reused (multiple consecutive Run calls), pool can be destroyed
 // (joining with its threads), num_threads=0 works (runs on current thread).
 TEST(ThreadParallelRunnerTest, TestPool) {
-  for (int num_threads = 0; num_threads <= 18; ++num_threads) {
-    ThreadPoolForTests pool(num_threads);
-    for (int num_tasks = 0; num_tasks < 32; ++num_tasks) {
-      std::vector<int> mementos(num_tasks);
-      for (int begin = 0; begin < 32; ++begin) {
-        std::fill(mementos.begin(), mementos.end(), 0);
-        const auto do_task = [begin, num_tasks, &mementos](
-                                 const int task,
-                                 const int thread) -> jxl::Status {
-          // Parameter is in the given range
-          EXPECT_GE(task, begin);
-          EXPECT_LT(task, begin + num_tasks);
-
-          // Store mementos to be sure we visited each task.
-          mementos.at(task - begin) = 1000 + task;
-          return true;
-        };
-        EXPECT_TRUE(RunOnPool(pool.get(), begin, begin + num_tasks,
-                              jxl::ThreadPool::NoInit, do_task, "TestPool"));
-        for (int task = begin; task < begin + num_tasks; ++task) {
-          EXPECT_EQ(1000 + task, mementos.at(task - begin));
+  for (JxlThreadParallelRunnerMode mode : kModes) {
+    for (int num_threads = 0; num_threads <= 18; ++num_threads) {
+      ThreadPoolForTests pool(num_threads, mode);
+      for (int num_tasks = 0; num_tasks < 32; ++num_tasks) {
+        std::vector<int> mementos(num_tasks);
+        for (int begin = 0; begin < 32; ++begin) {
+          std::fill(mementos.begin(), mementos.end(), 0);
+          const auto do_task = [begin, num_tasks, &mementos](
+                                   const int task,
+                                   const int thread) -> jxl::Status {
+            // Parameter is in the given range
+            EXPECT_GE(task, begin);
+            EXPECT_LT(task, begin + num_tasks);
+
+            // Store mementos to be sure we visited each task.
+            mementos.at(task - begin) = 1000 + task;
+            return true;
+          };
+          EXPECT_TRUE(RunOnPool(pool.get(), begin, begin + num_tasks,
+                                jxl::ThreadPool::NoInit, do_task, "TestPool"));
+          for (int task = begin; task < begin + num_tasks; ++task) {
+            EXPECT_EQ(1000 + task, mementos.at(task - begin));
+          }
         }
       }
     }
@@ -102,27 +116,156 @@ struct Counter {
 
 TEST(ThreadParallelRunnerTest, TestCounter) {
   const int kNumThreads = 12;
-  ThreadPoolForTests pool(kNumThreads);
-  alignas(128) Counter counters[kNumThreads];
+  for (JxlThreadParallelRunnerMode mode : kModes) {
+    ThreadPoolForTests pool(kNumThreads, mode);
+    alignas(128) Counter counters[kNumThreads];
+
+    const int kNumTasks = kNumThreads * 19;
+    const auto count = [&counters](const int task,
+                                   const int thread) -> jxl::Status {
+      counters[thread].counter += task;
+      return true;
+    };
+    EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks, jxl::ThreadPool::NoInit,
+                          count, "TestCounter"));
 
-  const int kNumTasks = kNumThreads * 19;
-  const auto count = [&counters](const int task,
-                                 const int thread) -> jxl::Status {
-    counters[thread].counter += task;
+    int expected = 0;
+    for (int i = 0; i < kNumTasks; ++i) {
+      expected += i;
+    }
+
+    for (int i = 1; i < kNumThreads; ++i) {
+      counters[0].Assimilate(counters[i]);
+    }
+    EXPECT_EQ(expected, counters[0].counter);
+  }
+}
+
+// Work-stealing mode must rebalance when the tasks of one slice are much more
+// expensive than the others.
+TEST(ThreadParallelRunnerTest, TestWorkStealingImbalance) {
+  const int kNumThreads = 4;
+  ThreadPoolForTests pool(kNumThreads,
+                          JXL_THREAD_PARALLEL_RUNNER_MODE_WORK_STEALING);
+  const int kNumTasks = 1000;
+  std::vector<std::atomic<int>> visits(kNumTasks);
+  std::atomic<uint64_t> sink{0};
+  const auto do_task = [&](const int task, const int thread) -> jxl::Status {
+    EXPECT_LT(thread, kNumThreads);
+    visits[task].fetch_add(1, std::memory_order_relaxed);
+    // The first slice is ~100x more expensive than the others.
+    const int work = task < kNumTasks / kNumThreads ? 10000 : 100;
+    uint64_t acc = task;
+    for (int i = 0; i < work; ++i) acc = acc * 6364136223846793005ULL + i;
+    sink.fetch_add(acc, std::memory_order_relaxed);
     return true;
   };
-  EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks, jxl::ThreadPool::NoInit,
-                        count, "TestCounter"));
+  for (int iter = 0; iter < 10; ++iter) {
+    std::fill(visits.begin(), visits.end(), 0);
+    EXPECT_TRUE(RunOnPool(pool.get(), 0, kNumTasks, jxl::ThreadPool::NoInit,
+                          do_task, "TestWorkStealingImbalance"));
+    for (int task = 0; task < kNumTasks; ++task) {
+      EXPECT_EQ(1, visits[task].load());
+    }
+  }
+}
 
-  int expected = 0;
-  for (int i = 0; i < kNumTasks; ++i) {
-    expected += i;
+TEST(ThreadParallelRunnerTest, TestAffinity) {
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(nullptr, 3);
+  ASSERT_TRUE(runner);
+  EXPECT_FALSE(
+      JxlThreadParallelRunnerSetCpuAffinity(runner.get(), nullptr, 0));
+  const uint32_t kInvalidCpu = 1u << 30;
+  EXPECT_FALSE(
+      JxlThreadParallelRunnerSetCpuAffinity(runner.get(), &kInvalidCpu, 1));
+  EXPECT_FALSE(JxlThreadParallelRunnerSetNumaNode(runner.get(), 1u << 30));
+  // Node 0 exists whenever the platform exposes the topology; all tasks must
+  // then run on it.
+  if (JxlThreadParallelRunnerSetNumaNode(runner.get(), 0)) {
+    jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+    std::atomic<int> num_off_node{0};
+    const auto do_task = [&num_off_node](const int task,
+                                         const int thread) -> jxl::Status {
+      if (jxl::ThreadPool::CurrentNumaNode() != 0) num_off_node++;
+      return true;
+    };
+    EXPECT_TRUE(RunOnPool(&pool, 0, 100, jxl::ThreadPool::NoInit, do_task,
+                          "TestAffinity"));
+    EXPECT_EQ(0, num_off_node.load());
   }
+}
 
-  for (int i = 1; i < kNumThreads; ++i) {
-    counters[0].Assimilate(counters[i]);
+// Counts the events reported to a JxlParallelRunnerTracer.
+struct TraceCounter {
+  static void RunBegin(void* opaque, uint64_t run_id, uint32_t start_range,
+                       uint32_t end_range, size_t num_threads) {
+    TraceCounter* self = static_cast<TraceCounter*>(opaque);
+    self->num_runs++;
+    self->last_run_id = run_id;
+    self->last_num_threads = num_threads;
+    const char* tag = JxlParallelRunTag();
+    self->last_tag = tag != nullptr ? tag : "";
+  }
+  static void RunEnd(void* opaque, uint64_t run_id) {
+    TraceCounter* self = static_cast<TraceCounter*>(opaque);
+    EXPECT_EQ(self->last_run_id, run_id);
+    EXPECT_EQ(self->num_tasks_begun.load(), self->num_tasks_ended.load());
+    self->num_runs_ended++;
+  }
+  static void TaskBegin(void* opaque, uint64_t run_id, uint32_t task,
+                        size_t thread) {
+    TraceCounter* self = static_cast<TraceCounter*>(opaque);
+    EXPECT_EQ(self->last_run_id, run_id);
+    EXPECT_LT(thread, self->last_num_threads);
+    self->num_tasks_begun++;
+  }
+  static void TaskEnd(void* opaque, uint64_t run_id, uint32_t task,
+                      size_t thread) {
+    static_cast<TraceCounter*>(opaque)->num_tasks_ended++;
+  }
+
+  JxlParallelRunnerTracer Tracer() {
+    return {this, &RunBegin, &RunEnd, &TaskBegin, &TaskEnd, nullptr};
+  }
+
+  int num_runs = 0;
+  int num_runs_ended = 0;
+  uint64_t last_run_id = 0;
+  size_t last_num_threads = 0;
+  std::string last_tag;
+  std::atomic<int> num_tasks_begun{0};
+  std::atomic<int> num_tasks_ended{0};
+};
+
+TEST(ThreadParallelRunnerTest, TestTracer) {
+  for (JxlThreadParallelRunnerMode mode : kModes) {
+    for (int num_threads : {0, 3}) {
+      JxlThreadParallelRunnerPtr runner =
+          JxlThreadParallelRunnerMakeWithMode(nullptr, num_threads, mode);
+      ASSERT_TRUE(runner);
+      TraceCounter counter;
+      const JxlParallelRunnerTracer tracer = counter.Tracer();
+      JxlThreadParallelRunnerSetTracer(runner.get(), &tracer);
+      jxl::ThreadPool pool(JxlThreadParallelRunner, runner.get());
+      const auto do_task = [](const int task, const int thread) -> jxl::Status {
+        return true;
+      };
+      EXPECT_TRUE(RunOnPool(&pool, 0, 100, jxl::ThreadPool::NoInit, do_task,
+                            "TracedStage"));
+      EXPECT_EQ(1, counter.num_runs);
+      EXPECT_EQ(1, counter.num_runs_ended);
+      EXPECT_EQ("TracedStage", counter.last_tag);
+      EXPECT_EQ(100, counter.num_tasks_ended.load());
+      // The tag is only set while the runner is called.
+      EXPECT_EQ(nullptr, JxlParallelRunTag());
+
+      JxlThreadParallelRunnerSetTracer(runner.get(), nullptr);
+      EXPECT_TRUE(RunOnPool(&pool, 0, 100, jxl::ThreadPool::NoInit, do_task,
+                            "UntracedStage"));
+      EXPECT_EQ(1, counter.num_runs);
+      EXPECT_EQ(100, counter.num_tasks_ended.load());
+    }
   }
-  EXPECT_EQ(expected, counters[0].counter);
 }
 
 }  // namespace
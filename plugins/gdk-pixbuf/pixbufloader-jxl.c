@@ -36,7 +36,9 @@ struct _GdkPixbufJxlAnimation {
 
   // All frames known so far; a frame is added when the JXL_DEC_FRAME event is
   // received from the decoder; initially frame.decoded is FALSE, until
-  // the JXL_DEC_IMAGE event is received.
+  // the JXL_DEC_IMAGE event is received. Only the first frame is decoded while
+  // loading, the others are decoded when an iterator reaches them, and their
+  // frame.data is NULL until then.
   GArray *frames;
 
   // JPEG XL decoder and related structures.
@@ -44,9 +46,39 @@ struct _GdkPixbufJxlAnimation {
   JxlDecoder *decoder;
   JxlPixelFormat pixel_format;
 
+  // Bytes passed to load_increment that the decoder did not consume yet start
+  // at input_offset. The consumed bytes are dropped, except for animations,
+  // whose frames are decoded from them later.
+  GByteArray *input;
+  size_t input_offset;
+
+  // Whether the first frame is being decoded into its GdkPixbuf, which is then
+  // flushed each time more input arrives.
+  gboolean frame_in_progress;
+
+  // Decoder of the frames of animations after the first one: the index of the
+  // next frame it outputs, the number of bytes of input it consumed, and the
+  // frame it decoded last, whose GdkPixbuf is freed when it decodes another
+  // one, or 0 if none.
+  JxlDecoder *frame_decoder;
+  size_t frame_decoder_next;
+  size_t frame_decoder_offset;
+  size_t lazy_frame;
+
+  // Color encoding requested from the decoders, if any.
+  gboolean has_preferred_color;
+  JxlColorEncoding preferred_color;
+
+  // Factor by which the decoders downsample the frames, chosen from the size
+  // that the size callback asks for, e.g. that of a thumbnail. The pixbufs
+  // have the downsampled size, which gdk-pixbuf scales to the asked one.
+  uint32_t output_downsampling;
+
   // Decoding is `done` when JXL_DEC_SUCCESS is received; calling
-  // load_increment afterwards gives an error.
+  // load_increment afterwards gives an error. A downsampled still image is
+  // done once its frame is decoded, without waiting for the rest of the file.
   gboolean done;
+  gboolean stopped_early;
 
   // Image information.
   size_t xsize;
@@ -134,17 +166,123 @@ static void gdk_pixbuf_jxl_animation_finalize(GObject *obj) {
   GdkPixbufJxlAnimation *decoder_state = (GdkPixbufJxlAnimation *)obj;
   if (decoder_state->frames != NULL) {
     for (size_t i = 0; i < decoder_state->frames->len; i++) {
-      g_object_unref(
+      GdkPixbuf *data =
           g_array_index(decoder_state->frames, GdkPixbufJxlAnimationFrame, i)
-              .data);
+              .data;
+      if (data != NULL) g_object_unref(data);
     }
     g_array_free(decoder_state->frames, /*free_segment=*/TRUE);
   }
+  if (decoder_state->input != NULL) {
+    g_byte_array_free(decoder_state->input, /*free_segment=*/TRUE);
+  }
+  JxlDecoderDestroy(decoder_state->frame_decoder);
   JxlResizableParallelRunnerDestroy(decoder_state->parallel_runner);
   JxlDecoderDestroy(decoder_state->decoder);
   g_free(decoder_state->icc_base64);
 }
 
+// Starts the frame decoder of the animation again from the first frame.
+static void gdk_pixbuf_jxl_animation_rewind_frame_decoder(
+    GdkPixbufJxlAnimation *anim) {
+  JxlDecoderReleaseInput(anim->frame_decoder);
+  JxlDecoderRewind(anim->frame_decoder);
+  anim->frame_decoder_next = 0;
+  anim->frame_decoder_offset = 0;
+}
+
+// Decodes frame `index` of the animation, if all of it is loaded, and frees
+// the frame decoded before it, so that only the first frame and the current
+// one are kept. The frame decoder goes on from the frame it decoded last when
+// the iterator moves forward, and starts again from the first frame when the
+// animation loops.
+static gboolean gdk_pixbuf_jxl_animation_decode_frame(
+    GdkPixbufJxlAnimation *anim, size_t index) {
+  if (index >= anim->frames->len) return FALSE;
+  if (g_array_index(anim->frames, GdkPixbufJxlAnimationFrame, index).decoded) {
+    return TRUE;
+  }
+  // The first frame is decoded while loading.
+  if (index == 0) return FALSE;
+
+  if (anim->frame_decoder == NULL) {
+    if (!(anim->frame_decoder = JxlDecoderCreate(NULL))) return FALSE;
+    if (JxlDecoderSetParallelRunner(anim->frame_decoder,
+                                    JxlResizableParallelRunner,
+                                    anim->parallel_runner) != JXL_DEC_SUCCESS ||
+        JxlDecoderSubscribeEvents(anim->frame_decoder,
+                                  JXL_DEC_COLOR_ENCODING |
+                                      JXL_DEC_FULL_IMAGE) != JXL_DEC_SUCCESS ||
+        JxlDecoderSetOutputDownsampling(anim->frame_decoder,
+                                        anim->output_downsampling) !=
+            JXL_DEC_SUCCESS) {
+      JxlDecoderDestroy(anim->frame_decoder);
+      anim->frame_decoder = NULL;
+      return FALSE;
+    }
+    anim->frame_decoder_next = 0;
+    anim->frame_decoder_offset = 0;
+  } else if (index < anim->frame_decoder_next) {
+    gdk_pixbuf_jxl_animation_rewind_frame_decoder(anim);
+  }
+
+  JxlDecoder *decoder = anim->frame_decoder;
+  JxlDecoderSkipFrames(decoder, index - anim->frame_decoder_next);
+  const size_t offset = anim->frame_decoder_offset;
+  if (JxlDecoderSetInput(decoder, anim->input->data + offset,
+                         anim->input->len - offset) != JXL_DEC_SUCCESS) {
+    gdk_pixbuf_jxl_animation_rewind_frame_decoder(anim);
+    return FALSE;
+  }
+  if (anim->done) JxlDecoderCloseInput(decoder);
+
+  GdkPixbuf *output = NULL;
+  for (;;) {
+    JxlDecoderStatus status = JxlDecoderProcessInput(decoder);
+    if (status == JXL_DEC_COLOR_ENCODING) {
+      if (anim->has_preferred_color) {
+        JxlDecoderSetPreferredColorProfile(decoder, &anim->preferred_color);
+      }
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      output = gdk_pixbuf_new(GDK_COLORSPACE_RGB, anim->has_alpha,
+                              /*bits_per_sample=*/8, anim->xsize, anim->ysize);
+      if (output == NULL) break;
+      gdk_pixbuf_set_option(output, "icc-profile", anim->icc_base64);
+      JxlPixelFormat format = anim->pixel_format;
+      format.align = gdk_pixbuf_get_rowstride(output);
+      guint size;
+      guchar *dst = gdk_pixbuf_get_pixels_with_length(output, &size);
+      if (JxlDecoderSetImageOutBuffer(decoder, &format, dst, size) !=
+          JXL_DEC_SUCCESS) {
+        break;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      anim->frame_decoder_offset =
+          anim->input->len - JxlDecoderReleaseInput(decoder);
+      anim->frame_decoder_next = index + 1;
+      if (anim->lazy_frame != 0) {
+        GdkPixbufJxlAnimationFrame *previous = &g_array_index(
+            anim->frames, GdkPixbufJxlAnimationFrame, anim->lazy_frame);
+        g_object_unref(previous->data);
+        previous->data = NULL;
+        previous->decoded = FALSE;
+      }
+      GdkPixbufJxlAnimationFrame *frame =
+          &g_array_index(anim->frames, GdkPixbufJxlAnimationFrame, index);
+      frame->data = output;
+      frame->decoded = TRUE;
+      anim->lazy_frame = index;
+      return TRUE;
+    } else {
+      // Not all of the frame is loaded yet, or it is corrupt.
+      break;
+    }
+  }
+  if (output != NULL) g_object_unref(output);
+  gdk_pixbuf_jxl_animation_rewind_frame_decoder(anim);
+  return FALSE;
+}
+
 static void gdk_pixbuf_jxl_animation_class_init(
     GdkPixbufJxlAnimationClass *klass) {
   G_OBJECT_CLASS(klass)->finalize = gdk_pixbuf_jxl_animation_finalize;
@@ -176,11 +314,16 @@ static int gdk_pixbuf_jxl_animation_iter_get_delay_time(
 static GdkPixbuf *gdk_pixbuf_jxl_animation_iter_get_pixbuf(
     GdkPixbufAnimationIter *iter) {
   GdkPixbufJxlAnimationIter *jxl_iter = (GdkPixbufJxlAnimationIter *)iter;
-  if (jxl_iter->animation->frames->len <= jxl_iter->current_frame) {
+  GdkPixbufJxlAnimation *anim = jxl_iter->animation;
+  if (anim->frames->len <= jxl_iter->current_frame) {
     return NULL;
   }
-  return g_array_index(jxl_iter->animation->frames, GdkPixbufJxlAnimationFrame,
-                       jxl_iter->current_frame)
+  GdkPixbufJxlAnimationFrame *frame = &g_array_index(
+      anim->frames, GdkPixbufJxlAnimationFrame, jxl_iter->current_frame);
+  if (frame->data != NULL) return frame->data;
+  // Until the current frame is loaded, shows the frame decoded last.
+  return g_array_index(anim->frames, GdkPixbufJxlAnimationFrame,
+                       anim->lazy_frame)
       .data;
 }
 
@@ -233,6 +376,8 @@ static gboolean gdk_pixbuf_jxl_animation_iter_advance(
     }
   }
 
+  gdk_pixbuf_jxl_animation_decode_frame(jxl_iter->animation,
+                                        jxl_iter->current_frame);
   return old_frame != jxl_iter->current_frame;
 }
 G_GNUC_END_IGNORE_DEPRECATIONS
@@ -280,6 +425,12 @@ static gpointer begin_load(GdkPixbufModuleSizeFunc size_func,
     goto cleanup;
   }
 
+  if (!(decoder_state->input = g_byte_array_new())) {
+    g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                "Creation of the input buffer failed");
+    goto cleanup;
+  }
+
   if (!(decoder_state->parallel_runner =
             JxlResizableParallelRunnerCreate(NULL))) {
     g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
@@ -331,13 +482,19 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
                                GError **error) {
   GdkPixbufJxlAnimation *decoder_state = context;
   if (decoder_state->done == TRUE) {
-    g_warning_once("Trailing data found at end of JXL file");
+    if (!decoder_state->stopped_early) {
+      g_warning_once("Trailing data found at end of JXL file");
+    }
     return TRUE;
   }
 
   JxlDecoderStatus status;
 
-  if ((status = JxlDecoderSetInput(decoder_state->decoder, buf, size)) !=
+  GByteArray *input = decoder_state->input;
+  g_byte_array_append(input, buf, size);
+  if ((status = JxlDecoderSetInput(decoder_state->decoder,
+                                   input->data + decoder_state->input_offset,
+                                   input->len - decoder_state->input_offset)) !=
       JXL_DEC_SUCCESS) {
     // Should never happen if things are done properly.
     g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
@@ -349,7 +506,26 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
     status = JxlDecoderProcessInput(decoder_state->decoder);
     switch (status) {
       case JXL_DEC_NEED_MORE_INPUT: {
-        JxlDecoderReleaseInput(decoder_state->decoder);
+        decoder_state->input_offset =
+            input->len - JxlDecoderReleaseInput(decoder_state->decoder);
+        // The frames of animations are decoded from the input later. Until the
+        // basic info tells, the input is kept.
+        if (decoder_state->xsize != 0 && !decoder_state->has_animation) {
+          g_byte_array_remove_range(input, 0, decoder_state->input_offset);
+          decoder_state->input_offset = 0;
+        }
+        // Shows the part of the first frame decoded so far; the decoder only
+        // renders the groups that changed since the previous flush.
+        if (decoder_state->frame_in_progress &&
+            decoder_state->area_updated_callback &&
+            JxlDecoderFlushImage(decoder_state->decoder) == JXL_DEC_SUCCESS) {
+          GdkPixbuf *output = g_array_index(decoder_state->frames,
+                                            GdkPixbufJxlAnimationFrame, 0)
+                                  .data;
+          decoder_state->area_updated_callback(
+              output, 0, 0, gdk_pixbuf_get_width(output),
+              gdk_pixbuf_get_height(output), decoder_state->user_data);
+        }
         return TRUE;
       }
 
@@ -386,6 +562,29 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
           return TRUE;
         }
 
+        // Decodes at the smallest scale that is still at least as large as
+        // the asked size, which gdk-pixbuf then scales down to it.
+        decoder_state->output_downsampling = 1;
+        for (uint32_t factor = 8; factor > 1; factor /= 2) {
+          if ((info.xsize + factor - 1) / factor >= (size_t)width &&
+              (info.ysize + factor - 1) / factor >= (size_t)height) {
+            decoder_state->output_downsampling = factor;
+            break;
+          }
+        }
+        if (decoder_state->output_downsampling > 1) {
+          if (JxlDecoderSetOutputDownsampling(
+                  decoder_state->decoder,
+                  decoder_state->output_downsampling) != JXL_DEC_SUCCESS) {
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "JxlDecoderSetOutputDownsampling failed");
+            return FALSE;
+          }
+          const uint32_t factor = decoder_state->output_downsampling;
+          decoder_state->xsize = (info.xsize + factor - 1) / factor;
+          decoder_state->ysize = (info.ysize + factor - 1) / factor;
+        }
+
         // Set an appropriate number of threads for the image size.
         JxlResizableParallelRunnerSetThreads(
             decoder_state->parallel_runner,
@@ -406,6 +605,8 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
           // this fails
           JxlDecoderSetPreferredColorProfile(decoder_state->decoder,
                                              &color_encoding);
+          decoder_state->has_preferred_color = TRUE;
+          decoder_state->preferred_color = color_encoding;
         }
         if (JXL_DEC_SUCCESS != JxlDecoderGetICCProfileSize(
                                    decoder_state->decoder,
@@ -440,7 +641,6 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
       }
 
       case JXL_DEC_FRAME: {
-        // TODO(veluca): support rescaling.
         JxlFrameHeader frame_header;
         if (JxlDecoderGetFrameHeader(decoder_state->decoder, &frame_header) !=
             JXL_DEC_SUCCESS) {
@@ -449,6 +649,19 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
           return FALSE;
         }
 
+        if (decoder_state->frames->len > 0) {
+          // Only the duration of the other frames is needed until an iterator
+          // reaches them, so they are skipped when they need a buffer.
+          GdkPixbufJxlAnimationFrame frame;
+          frame.decoded = FALSE;
+          frame.duration_ms =
+              frame_header.duration * decoder_state->tick_duration_us / 1000;
+          decoder_state->total_duration_ms += frame.duration_ms;
+          frame.data = NULL;
+          g_array_append_val(decoder_state->frames, frame);
+          break;
+        }
+
         {
           GdkPixbufJxlAnimationFrame frame;
           frame.decoded = FALSE;
@@ -485,6 +698,15 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
       }
 
       case JXL_DEC_NEED_IMAGE_OUT_BUFFER: {
+        if (decoder_state->frames->len > 1) {
+          if (JxlDecoderSkipCurrentFrame(decoder_state->decoder) !=
+              JXL_DEC_SUCCESS) {
+            g_set_error(error, GDK_PIXBUF_ERROR, GDK_PIXBUF_ERROR_FAILED,
+                        "JxlDecoderSkipCurrentFrame failed");
+            return FALSE;
+          }
+          break;
+        }
         GdkPixbuf *output =
             g_array_index(decoder_state->frames, GdkPixbufJxlAnimationFrame,
                           decoder_state->frames->len - 1)
@@ -499,11 +721,12 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
                       "JxlDecoderSetImageOutBuffer failed");
           return FALSE;
         }
+        decoder_state->frame_in_progress = TRUE;
         break;
       }
 
       case JXL_DEC_FULL_IMAGE: {
-        // TODO(veluca): consider doing partial updates.
+        decoder_state->frame_in_progress = FALSE;
         if (decoder_state->area_updated_callback) {
           GdkPixbuf *output = g_array_index(decoder_state->frames,
                                             GdkPixbufJxlAnimationFrame, 0)
@@ -515,10 +738,20 @@ static gboolean load_increment(gpointer context, const guchar *buf, guint size,
         g_array_index(decoder_state->frames, GdkPixbufJxlAnimationFrame,
                       decoder_state->frames->len - 1)
             .decoded = TRUE;
+        // A still image asked for at a smaller size, e.g. by a thumbnailer,
+        // needs nothing after its frame, such as metadata boxes at the end.
+        if (decoder_state->output_downsampling > 1 &&
+            !decoder_state->has_animation) {
+          decoder_state->done = TRUE;
+          decoder_state->stopped_early = TRUE;
+          return TRUE;
+        }
         break;
       }
 
       case JXL_DEC_SUCCESS: {
+        decoder_state->input_offset =
+            input->len - JxlDecoderReleaseInput(decoder_state->decoder);
         decoder_state->done = TRUE;
         return TRUE;
       }
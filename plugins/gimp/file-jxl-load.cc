@@ -16,7 +16,6 @@
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
-#include <memory>
 #include <string>
 
 #define _PROFILE_ORIGIN_ JXL_COLOR_PROFILE_TARGET_ORIGINAL
@@ -25,23 +24,25 @@
 
 namespace jxl {
 
-bool SetJpegXlOutBuffer(
-    std::unique_ptr<JxlDecoderStruct, JxlDecoderDestroyStruct> *dec,
-    JxlPixelFormat *format, size_t *buffer_size, gpointer *pixels_buffer_1) {
-  if (JXL_DEC_SUCCESS !=
-      JxlDecoderImageOutBufferSize(dec->get(), format, buffer_size)) {
-    g_printerr(LOAD_PROC " Error: JxlDecoderImageOutBufferSize failed\n");
-    return false;
-  }
-  *pixels_buffer_1 = g_malloc(*buffer_size);
-  if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutBuffer(dec->get(), format,
-                                                     *pixels_buffer_1,
-                                                     *buffer_size)) {
-    g_printerr(LOAD_PROC " Error: JxlDecoderSetImageOutBuffer failed\n");
-    return false;
+namespace {
+
+// Layer that the decoder writes the pixels of a frame into, one row of pixels
+// at a time, which GEGL converts from `source_format` to the format of the
+// layer, so that no copy of the whole frame is made. The rows come from the
+// threads of the parallel runner, which GEGL buffers allow.
+struct GeglOutput {
+  GeglBuffer *buffer = nullptr;
+  const Babl *source_format = nullptr;
+
+  static void WriteRow(void *opaque, size_t x, size_t y, size_t num_pixels,
+                       const void *pixels) {
+    const GeglOutput *output = static_cast<const GeglOutput *>(opaque);
+    gegl_buffer_set(output->buffer, GEGL_RECTANGLE(x, y, num_pixels, 1), 0,
+                    output->source_format, pixels, GEGL_AUTO_ROWSTRIDE);
   }
-  return true;
-}
+};
+
+}  // namespace
 
 bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   bool stop_processing = false;
@@ -59,11 +60,8 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   double tps_denom = 1.f;
   double tps_numerator = 1.f;
 
-  gint32 layer;
-
-  gpointer pixels_buffer_1 = nullptr;
-  gpointer pixels_buffer_2 = nullptr;
-  size_t buffer_size = 0;
+  gint32 layer = -1;
+  GeglOutput output;
 
   GimpImageBaseType image_type = GIMP_RGB;
   GimpImageType layer_type = GIMP_RGB_IMAGE;
@@ -98,10 +96,10 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
 
   auto dec = JxlDecoderMake(nullptr);
   if (JXL_DEC_SUCCESS !=
-      JxlDecoderSubscribeEvents(
-          dec.get(), JXL_DEC_BASIC_INFO | JXL_DEC_COLOR_ENCODING |
-                         JXL_DEC_FULL_IMAGE | JXL_DEC_FRAME_PROGRESSION |
-                         JXL_DEC_FRAME)) {
+      JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                               JXL_DEC_COLOR_ENCODING |
+                                               JXL_DEC_FULL_IMAGE |
+                                               JXL_DEC_FRAME)) {
     g_printerr(LOAD_PROC " Error: JxlDecoderSubscribeEvents failed\n");
     return false;
   }
@@ -122,12 +120,6 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
   // grand decode loop...
   JxlDecoderSetInput(dec.get(), compressed.data(), compressed.size());
 
-  if (JXL_DEC_SUCCESS != JxlDecoderSetProgressiveDetail(
-                             dec.get(), JxlProgressiveDetail::kPasses)) {
-    g_printerr(LOAD_PROC " Error: JxlDecoderSetProgressiveDetail failed\n");
-    return false;
-  }
-
   while (true) {
     gimp_load_progress.update();
 
@@ -356,11 +348,6 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
         g_printerr(LOAD_PROC " Warning: No color profile.\n");
       }
     } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
-      // get image from decoder in FLOAT
-      format.data_type = JXL_TYPE_FLOAT;
-      if (!SetJpegXlOutBuffer(&dec, &format, &buffer_size, &pixels_buffer_1))
-        return false;
-    } else if (status == JXL_DEC_FULL_IMAGE) {
       // create and insert layer
       gchar *layer_name;
       if (layer_idx == 0 && !info.have_animation) {
@@ -388,10 +375,7 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
 
       gimp_image_insert_layer(*image_id, layer, /*parent_id=*/-1,
                               /*position=*/0);
-
-      pixels_buffer_2 = g_malloc(buffer_size);
-      GeglBuffer *buffer = gimp_drawable_get_buffer(layer);
-      const Babl *destination_format = gegl_buffer_set_format(buffer, nullptr);
+      g_free(layer_name);
 
       std::string babl_format_str = "";
       if (is_gray) {
@@ -404,20 +388,21 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       }
       babl_format_str += " float";
 
-      const Babl *source_format = babl_format(babl_format_str.c_str());
-
-      babl_process(babl_fish(source_format, destination_format),
-                   pixels_buffer_1, pixels_buffer_2, xsize * ysize);
-
-      gegl_buffer_set(buffer, GEGL_RECTANGLE(0, 0, xsize, ysize), 0, nullptr,
-                      pixels_buffer_2, GEGL_AUTO_ROWSTRIDE);
+      // get image from decoder in FLOAT
+      format.data_type = JXL_TYPE_FLOAT;
+      output.buffer = gimp_drawable_get_buffer(layer);
+      output.source_format = babl_format(babl_format_str.c_str());
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderSetImageOutCallback(dec.get(), &format,
+                                        &GeglOutput::WriteRow, &output)) {
+        g_printerr(LOAD_PROC " Error: JxlDecoderSetImageOutCallback failed\n");
+        g_clear_object(&output.buffer);
+        return false;
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
       gimp_item_transform_translate(layer, crop_x0, crop_y0);
-
-      g_clear_object(&buffer);
-      g_free(pixels_buffer_1);
-      g_free(pixels_buffer_2);
+      g_clear_object(&output.buffer);
       if (stop_processing) status = JXL_DEC_SUCCESS;
-      g_free(layer_name);
       layer_idx++;
     } else if (status == JXL_DEC_FRAME) {
       JxlFrameHeader frame_header;
@@ -454,9 +439,10 @@ bool LoadJpegXlImage(const gchar *const filename, gint32 *const image_id) {
       // It's not required to call JxlDecoderReleaseInput(dec.get())
       // since the decoder will be destroyed.
       break;
-    } else if (status == JXL_DEC_NEED_MORE_INPUT ||
-               status == JXL_DEC_FRAME_PROGRESSION) {
-      stop_processing = status != JXL_DEC_FRAME_PROGRESSION;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      // The file is truncated: the layer of the current frame gets what was
+      // decoded of it.
+      stop_processing = true;
       if (JxlDecoderFlushImage(dec.get()) == JXL_DEC_SUCCESS) {
         status = JXL_DEC_FULL_IMAGE;
         continue;
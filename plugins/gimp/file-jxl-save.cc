@@ -11,11 +11,14 @@
 #include <jxl/encode_cxx.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <cstdio>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include "gobject/gsignal.h"
 
@@ -117,6 +120,105 @@ class JpegXlSaveGui {
 
 JpegXlSaveGui jxl_save_gui;
 
+// Gives the encoder the pixels of a layer one rectangle at a time, which GEGL
+// converts from the format of the layer to `format`, so that no copy of the
+// whole layer is made. The encoder asks for rectangles from the threads of the
+// parallel runner, which GEGL buffers allow.
+class GeglChunkedInput {
+ public:
+  GeglChunkedInput(GeglBuffer* buffer, const Babl* format,
+                   const JxlPixelFormat& pixel_format)
+      : buffer_(buffer), format_(format), pixel_format_(pixel_format) {}
+
+  JxlChunkedFrameInputSource GetInputSource() {
+    return JxlChunkedFrameInputSource{this,
+                                      &GetColorChannelsPixelFormat,
+                                      &GetColorChannelDataAt,
+                                      &GetExtraChannelPixelFormat,
+                                      &GetExtraChannelDataAt,
+                                      &ReleaseBuffer};
+  }
+
+ private:
+  static void GetColorChannelsPixelFormat(void* opaque,
+                                          JxlPixelFormat* pixel_format) {
+    *pixel_format = static_cast<GeglChunkedInput*>(opaque)->pixel_format_;
+  }
+
+  static const void* GetColorChannelDataAt(void* opaque, size_t xpos,
+                                           size_t ypos, size_t xsize,
+                                           size_t ysize, size_t* row_offset) {
+    const GeglChunkedInput* self = static_cast<GeglChunkedInput*>(opaque);
+    *row_offset = xsize * self->pixel_format_.num_channels * sizeof(float);
+    gpointer pixels = g_malloc(*row_offset * ysize);
+    gegl_buffer_get(self->buffer_, GEGL_RECTANGLE(xpos, ypos, xsize, ysize),
+                    1.0, self->format_, pixels, *row_offset, GEGL_ABYSS_NONE);
+    return pixels;
+  }
+
+  // The alpha channel, if any, is interleaved with the color channels.
+  static void GetExtraChannelPixelFormat(void* opaque, size_t ec_index,
+                                         JxlPixelFormat* pixel_format) {
+    *pixel_format = static_cast<GeglChunkedInput*>(opaque)->pixel_format_;
+    pixel_format->num_channels = 1;
+  }
+
+  static const void* GetExtraChannelDataAt(void* opaque, size_t ec_index,
+                                           size_t xpos, size_t ypos,
+                                           size_t xsize, size_t ysize,
+                                           size_t* row_offset) {
+    return nullptr;
+  }
+
+  static void ReleaseBuffer(void* opaque, const void* buffer) {
+    g_free(const_cast<void*>(buffer));
+  }
+
+  GeglBuffer* buffer_;
+  const Babl* format_;
+  JxlPixelFormat pixel_format_;
+};
+
+// Writes the output of the encoder to the file as it is produced.
+class FileOutput {
+ public:
+  explicit FileOutput(FILE* file) : file_(file) {}
+
+  JxlEncoderOutputProcessor GetOutputProcessor() {
+    return JxlEncoderOutputProcessor{this, &GetBuffer, &ReleaseBuffer, &Seek,
+                                     &SetFinalizedPosition};
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  static void* GetBuffer(void* opaque, size_t* size) {
+    FileOutput* self = static_cast<FileOutput*>(opaque);
+    *size = std::min<size_t>(*size, 1u << 16);
+    if (self->output_.size() < *size) self->output_.resize(*size);
+    return self->output_.data();
+  }
+
+  static void ReleaseBuffer(void* opaque, size_t written_bytes) {
+    FileOutput* self = static_cast<FileOutput*>(opaque);
+    if (fwrite(self->output_.data(), 1, written_bytes, self->file_) !=
+        written_bytes) {
+      self->ok_ = false;
+    }
+  }
+
+  static void Seek(void* opaque, uint64_t position) {
+    FileOutput* self = static_cast<FileOutput*>(opaque);
+    if (fseek(self->file_, position, SEEK_SET) != 0) self->ok_ = false;
+  }
+
+  static void SetFinalizedPosition(void* opaque, uint64_t finalized_position) {}
+
+  FILE* file_;
+  std::vector<uint8_t> output_;
+  bool ok_ = true;
+};
+
 bool JpegXlSaveGui::GuiOnChangeQuality(GtkAdjustment* adj_qual,
                                        void* this_pointer) {
   JpegXlSaveGui* self = static_cast<JpegXlSaveGui*>(this_pointer);
@@ -720,9 +822,24 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
       JxlResizableParallelRunnerSuggestThreads(jxl_save_opts.basic_info.xsize,
                                                jxl_save_opts.basic_info.ysize));
 
+  FILE* file = fopen(filename, "wb");
+  if (file == nullptr) {
+    g_printerr(SAVE_PROC " Error: Could not open %s for writing\n", filename);
+    return false;
+  }
+  std::unique_ptr<FILE, int (*)(FILE*)> file_closer(file, &fclose);
+  FileOutput output(file);
+
   auto enc = JxlEncoderMake(/*memory_manager=*/nullptr);
   JxlEncoderUseContainer(enc.get(), jxl_save_opts.use_container);
 
+  // The encoder writes the file as it encodes the layers.
+  if (JXL_ENC_SUCCESS !=
+      JxlEncoderSetOutputProcessor(enc.get(), output.GetOutputProcessor())) {
+    g_printerr(SAVE_PROC " Error: JxlEncoderSetOutputProcessor failed\n");
+    return false;
+  }
+
   if (JXL_ENC_SUCCESS != JxlEncoderSetParallelRunner(enc.get(),
                                                      JxlResizableParallelRunner,
                                                      runner.get())) {
@@ -808,89 +925,43 @@ bool SaveJpegXlImage(const gint32 image_id, const gint32 drawable_id,
   }
 
   // process layers and compress into JXL
-  size_t buffer_size =
-      jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize *
-      jxl_save_opts.pixel_format.num_channels * 4;  // bytes per sample
+  jxl_save_opts.SetModel(jxl_save_opts.is_linear);
+  jxl_save_opts.pixel_format.data_type = JXL_TYPE_FLOAT;
+  jxl_save_opts.SetBablType("float");
+  // use babl to fix gamma mismatch issues
+  const Babl* destination_format =
+      babl_format(jxl_save_opts.babl_format_str.c_str());
 
   for (int i = nlayers - 1; i >= 0; i--) {
     gimp_save_progress.update();
 
-    // copy image into buffer...
-    gpointer pixels_buffer_1;
-    gpointer pixels_buffer_2;
-    pixels_buffer_1 = g_malloc(buffer_size);
-    pixels_buffer_2 = g_malloc(buffer_size);
-
     gimp_layer_resize_to_image_size(layers[i]);
 
     GeglBuffer* buffer = gimp_drawable_get_buffer(layers[i]);
+    GeglChunkedInput input(buffer, destination_format,
+                           jxl_save_opts.pixel_format);
 
-    // using gegl_buffer_set_format to get the format because
-    // gegl_buffer_get_format doesn't always get the original format
-    const Babl* native_format = gegl_buffer_set_format(buffer, nullptr);
-
-    gegl_buffer_get(buffer,
-                    GEGL_RECTANGLE(0, 0, jxl_save_opts.basic_info.xsize,
-                                   jxl_save_opts.basic_info.ysize),
-                    1.0, native_format, pixels_buffer_1, GEGL_AUTO_ROWSTRIDE,
-                    GEGL_ABYSS_NONE);
+    // send layer to encoder, which reads and encodes it in chunks
+    const JxlEncoderStatus status = JxlEncoderAddChunkedFrame(
+        frame_settings, TO_JXL_BOOL(i == 0), input.GetInputSource());
     g_clear_object(&buffer);
-
-    // use babl to fix gamma mismatch issues
-    jxl_save_opts.SetModel(jxl_save_opts.is_linear);
-    jxl_save_opts.pixel_format.data_type = JXL_TYPE_FLOAT;
-    jxl_save_opts.SetBablType("float");
-    const Babl* destination_format =
-        babl_format(jxl_save_opts.babl_format_str.c_str());
-
-    babl_process(
-        babl_fish(native_format, destination_format), pixels_buffer_1,
-        pixels_buffer_2,
-        jxl_save_opts.basic_info.xsize * jxl_save_opts.basic_info.ysize);
-
-    gimp_save_progress.update();
-
-    // send layer to encoder
-    if (JXL_ENC_SUCCESS !=
-        JxlEncoderAddImageFrame(frame_settings, &jxl_save_opts.pixel_format,
-                                pixels_buffer_2, buffer_size)) {
-      g_printerr(SAVE_PROC " Error: JxlEncoderAddImageFrame failed\n");
+    if (JXL_ENC_SUCCESS != status) {
+      g_printerr(SAVE_PROC " Error: JxlEncoderAddChunkedFrame failed\n");
       return false;
     }
   }
 
-  JxlEncoderCloseInput(enc.get());
-
-  // get data from encoder
-  std::vector<uint8_t> compressed;
-  compressed.resize(262144);
-  uint8_t* next_out = compressed.data();
-  size_t avail_out = compressed.size();
-
-  JxlEncoderStatus process_result = JXL_ENC_NEED_MORE_OUTPUT;
-  while (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
-    gimp_save_progress.update();
+  gimp_save_progress.update();
 
-    process_result = JxlEncoderProcessOutput(enc.get(), &next_out, &avail_out);
-    if (process_result == JXL_ENC_NEED_MORE_OUTPUT) {
-      size_t offset = next_out - compressed.data();
-      compressed.resize(compressed.size() + 262144);
-      next_out = compressed.data() + offset;
-      avail_out = compressed.size() - offset;
-    }
+  if (JXL_ENC_SUCCESS != JxlEncoderFlushInput(enc.get())) {
+    g_printerr(SAVE_PROC " Error: JxlEncoderFlushInput failed\n");
+    return false;
   }
-  compressed.resize(next_out - compressed.data());
-
-  if (JXL_ENC_SUCCESS != process_result) {
-    g_printerr(SAVE_PROC " Error: JxlEncoderProcessOutput failed\n");
+  if (!output.ok() || fflush(file) != 0) {
+    g_printerr(SAVE_PROC " Error: Failed to write %s\n", filename);
     return false;
   }
 
-  // write file
-  std::ofstream outstream(filename, std::ios::out | std::ios::binary);
-  copy(compressed.begin(), compressed.end(),
-       std::ostream_iterator<uint8_t>(outstream));
-
   gimp_save_progress.finished();
   return true;
 }  // SaveJpegXlImage()
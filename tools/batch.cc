@@ -0,0 +1,100 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "tools/batch.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include "third_party/dirent.h"
+#else
+#include <dirent.h>
+#endif
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+bool IsDirectory(const std::string& path) {
+  struct stat s;
+  return stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+bool IsRegularFile(const std::string& path) {
+  struct stat s;
+  return stat(path.c_str(), &s) == 0 && S_ISREG(s.st_mode);
+}
+
+bool ListDirectory(const std::string& dirname,
+                   std::vector<std::string>* paths) {
+  DIR* dir = opendir(dirname.c_str());
+  if (dir == nullptr) return false;
+  std::vector<std::string> names;
+  while (dirent* ent = readdir(dir)) {
+    const std::string path = dirname + "/" + ent->d_name;
+    if (IsRegularFile(path)) names.push_back(ent->d_name);
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+  for (const std::string& name : names) paths->push_back(dirname + "/" + name);
+  return true;
+}
+
+bool ReadList(const std::string& filename, std::vector<std::string>* paths) {
+  std::ifstream list(filename);
+  if (!list) return false;
+  std::string line;
+  while (std::getline(list, line)) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    if (!line.empty()) paths->push_back(line);
+  }
+  return true;
+}
+
+// Name of the file at `path`, without its directory and extension.
+std::string Stem(const std::string& path) {
+  const size_t slash = path.find_last_of("/\\");
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  const size_t dot = name.rfind('.');
+  if (dot != std::string::npos && dot != 0) name.resize(dot);
+  return name;
+}
+
+}  // namespace
+
+bool ListBatchFiles(const std::string& input, const std::string& output_pattern,
+                    std::vector<BatchFile>* files) {
+  const size_t placeholder = output_pattern.find("%s");
+  if (placeholder == std::string::npos) {
+    fprintf(stderr, "The output pattern of a batch must contain %%s.\n");
+    return false;
+  }
+  std::vector<std::string> paths;
+  if (IsDirectory(input)) {
+    if (!ListDirectory(input, &paths)) {
+      fprintf(stderr, "Could not list the directory %s\n", input.c_str());
+      return false;
+    }
+  } else if (!ReadList(input, &paths)) {
+    fprintf(stderr, "Could not read the file list %s\n", input.c_str());
+    return false;
+  }
+  for (const std::string& path : paths) {
+    std::string output = output_pattern;
+    output.replace(placeholder, 2, Stem(path));
+    files->push_back(BatchFile{path, output});
+  }
+  return true;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
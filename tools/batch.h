@@ -0,0 +1,83 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_BATCH_H_
+#define TOOLS_BATCH_H_
+
+// Batch mode of cjxl and djxl, which process many files in one process, with
+// the same thread pool and the same settings.
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "tools/input_bytes.h"
+
+namespace jpegxl {
+namespace tools {
+
+// Input of a batch and the path its output is written to.
+struct BatchFile {
+  std::string input;
+  std::string output;
+};
+
+// Lists the files of a batch. `input` is either a directory, whose regular
+// files are taken in the order of their names, or a text file with one input
+// path per line. In `output_pattern`, "%s" is replaced by the name of each
+// input without its directory and extension, e.g. "out/%s.jxl".
+bool ListBatchFiles(const std::string& input, const std::string& output_pattern,
+                    std::vector<BatchFile>* files);
+
+// Reads the inputs of a batch one file ahead, on another thread, so that
+// reading the next input overlaps with processing the current one. Regular
+// files are memory-mapped, so reading ahead touches every page of the mapping,
+// which brings the file into memory.
+class BatchReader {
+ public:
+  explicit BatchReader(const std::vector<BatchFile>& files) : files_(files) {
+    if (!files_.empty()) next_ = Start(files_[0].input);
+  }
+
+  // Returns false once all the files were returned. Otherwise, sets `index` to
+  // the next file of the batch and `input` to its contents, or to nullptr if
+  // it could not be read, and starts reading the file after it.
+  bool Next(size_t* index, std::unique_ptr<InputBytes>* input) {
+    if (next_index_ >= files_.size()) return false;
+    *index = next_index_;
+    *input = next_.get();
+    if (++next_index_ < files_.size()) {
+      next_ = Start(files_[next_index_].input);
+    }
+    return true;
+  }
+
+ private:
+  static std::future<std::unique_ptr<InputBytes>> Start(std::string path) {
+    return std::async(
+        std::launch::async, [path]() -> std::unique_ptr<InputBytes> {
+          std::unique_ptr<InputBytes> input(new InputBytes());
+          if (!input->Read(path)) return nullptr;
+          volatile uint8_t sink = 0;
+          for (size_t i = 0; i < input->size(); i += 4096) {
+            sink = sink + input->data()[i];
+          }
+          return input;
+        });
+  }
+
+  const std::vector<BatchFile>& files_;
+  size_t next_index_ = 0;
+  std::future<std::unique_ptr<InputBytes>> next_;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BATCH_H_
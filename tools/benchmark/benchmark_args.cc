@@ -20,6 +20,7 @@
 #include "tools/benchmark/benchmark_codec_custom.h"  // for AddCommand..
 #include "tools/benchmark/benchmark_codec_jpeg.h"    // for AddCommand..
 #include "tools/benchmark/benchmark_codec_jxl.h"
+#include "tools/benchmark/benchmark_perf_counters.h"
 
 #ifdef BENCHMARK_PNG
 #include "tools/benchmark/benchmark_codec_png.h"
@@ -186,6 +187,41 @@ Status BenchmarkArgs::AddCommandLineOptions() {
               "Defaults to 1.",
               1);
 
+  AddDouble(&load_seconds, "load_seconds",
+            "If nonzero, instead of the per-image statistics, runs independent "
+            "jobs, each encoding and decoding the next image with the next "
+            "codec, for this many seconds and prints the sustained throughput, "
+            "the latency percentiles of the jobs and the peak memory use.",
+            0.0);
+  AddUnsigned(&load_concurrency, "load_concurrency",
+              "The number of jobs running at the same time with "
+              "--load_seconds. Defaults to 1 job per CPU core (if 0).",
+              0);
+  AddFlag(&load_shared_runner, "load_shared_runner",
+          "If true, the jobs of --load_seconds share a single pool of "
+          "--inner_threads worker threads, instead of having their own.",
+          false);
+
+  AddString(&perf_counters, "perf_counters",
+            "Comma-separated hardware performance counters, such as "
+            "cycles,instructions,branch-misses,LLC-misses, to count per pixel "
+            "in the encodes and decodes, in extra columns. Only the thread "
+            "running each task is counted, so use --inner_threads=0 to count "
+            "all the work. Requires Linux perf events.");
+  AddString(&json_output, "json_output",
+            "If not empty, writes the size and the time of every encode and "
+            "decode repetition of each image and codec to this JSON file.");
+  AddString(&baseline, "baseline",
+            "If not empty, compares the results with those of this file, "
+            "written by --json_output, prints the statistically significant "
+            "speed regressions and the size increases per image and codec, "
+            "and fails if there are any. Use --encode_reps and --decode_reps "
+            "of at least 5 for the speed comparison.");
+  AddDouble(&baseline_min_slowdown, "baseline_min_slowdown",
+            "Smallest relative increase of the median time that --baseline "
+            "reports as a regression.",
+            0.02);
+
   AddString(&sample_tmp_dir, "sample_tmp_dir",
             "Directory to put samples from input images.");
 
@@ -267,6 +303,20 @@ Status BenchmarkArgs::ValidateArgs() {
 
   if (print_details_csv) print_details = true;
 
+  perf_counter_names.clear();
+  for (const std::string& name : SplitString(perf_counters, ',')) {
+    if (name.empty()) continue;
+    if (!PerfCounters::IsKnown(name)) {
+      return JXL_FAILURE("Unknown or unsupported performance counter %s",
+                         name.c_str());
+    }
+    perf_counter_names.push_back(name);
+  }
+
+  if (load_seconds < 0) {
+    return JXL_FAILURE("load_seconds must be >= 0");
+  }
+
   if (override_bitdepth > 32) {
     return JXL_FAILURE("override_bitdepth must be <= 32");
   }
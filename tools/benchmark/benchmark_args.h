@@ -146,6 +146,10 @@ struct BenchmarkArgs {
   size_t encode_reps;
   size_t generations;
 
+  double load_seconds;
+  size_t load_concurrency;
+  bool load_shared_runner;
+
   std::string sample_tmp_dir;
 
   int num_samples;
@@ -156,6 +160,13 @@ struct BenchmarkArgs {
 
   std::string extra_metrics;
 
+  std::string perf_counters;
+  std::vector<std::string> perf_counter_names;  // determined by perf_counters
+
+  std::string json_output;
+  std::string baseline;
+  double baseline_min_slowdown;
+
   jpegxl::tools::CommandLineParser cmdline;
 
  private:
@@ -144,6 +144,10 @@ class JPEGCodec : public ImageCodec {
       enable_adaptive_quant_ = false;
       return true;
     }
+    if (param == "fastaq") {
+      fast_adaptive_quant_ = true;
+      return true;
+    }
 #if JPEGXL_ENABLE_JPEGLI
     if (param == "xyb") {
       xyb_mode_ = true;
@@ -245,6 +249,7 @@ class JPEGCodec : public ImageCodec {
       }
       settings.chroma_subsampling = chroma_subsampling_;
       settings.use_adaptive_quantization = enable_adaptive_quant_;
+      settings.fast_adaptive_quantization = fast_adaptive_quant_;
       settings.libjpeg_quality = libjpeg_quality_;
       settings.libjpeg_chroma_subsampling = libjpeg_chroma_subsampling_;
       settings.optimize_coding = !fix_codes_;
@@ -354,6 +359,7 @@ class JPEGCodec : public ImageCodec {
   bool use_std_tables_ = false;
 #endif
   bool enable_adaptive_quant_ = true;
+  bool fast_adaptive_quant_ = false;
   // JPEG decoder and its parameters
   std::string jpeg_decoder_ = "libjpeg";
   int num_colors_ = 0;
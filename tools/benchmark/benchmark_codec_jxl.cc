@@ -5,11 +5,13 @@
 #include "tools/benchmark/benchmark_codec_jxl.h"
 
 #include <jxl/color_encoding.h>
+#include <jxl/decode_stats.h>
 #include <jxl/encode.h>
 #include <jxl/memory_manager.h>
 #include <jxl/stats.h>
 #include <jxl/types.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstdlib>
@@ -31,10 +33,12 @@
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
 #include "tools/benchmark/benchmark_file_io.h"
+#include "tools/benchmark/benchmark_perf_counters.h"
 #include "tools/benchmark/benchmark_stats.h"
 #include "tools/file_io.h"
 #include "tools/speed_stats.h"
 #include "tools/thread_pool_internal.h"
+#include "tools/tracking_memory_manager.h"
 
 namespace jpegxl {
 namespace tools {
@@ -133,7 +137,10 @@ class JxlCodec : public ImageCodec {
   JxlCodec(const BenchmarkArgs& args, JxlMemoryManager* memory_manager)
       : ImageCodec(args),
         memory_manager_(memory_manager),
-        stats_(nullptr, JxlEncoderStatsDestroy) {}
+        stats_(nullptr, JxlEncoderStatsDestroy),
+        dec_stats_(nullptr, JxlDecoderStatsDestroy) {
+    if (memory_manager != nullptr) tracking_.SetInner(memory_manager);
+  }
 
   Status ParseParam(const std::string& param) override {
     const std::string kMaxPassesPrefix = "max_passes=";
@@ -254,6 +261,14 @@ class JxlCodec : public ImageCodec {
     } else if (param.substr(0, 16) == "faster_decoding=") {
       val = strtol(param.substr(16).c_str(), nullptr, 10);
       cparams_.AddOption(JXL_ENC_FRAME_SETTING_DECODING_SPEED, val);
+    } else if (param.substr(0, 14) == "decode_budget=") {
+      fval = strtof(param.substr(14).c_str(), nullptr);
+      cparams_.AddFloatOption(JXL_ENC_FRAME_SETTING_DECODING_BUDGET, fval);
+    } else if (param.substr(0, 18) == "large_allocations=") {
+      val = strtol(param.substr(18).c_str(), nullptr, 10);
+      cparams_.AddOption(JXL_ENC_FRAME_SETTING_LARGE_ALLOCATIONS, val);
+    } else if (param == "borrow_input") {
+      cparams_.AddOption(JXL_ENC_FRAME_SETTING_BORROW_INPUT_BUFFERS, 1);
     } else if (param == "noperc") {
       cparams_.AddOption(JXL_ENC_FRAME_SETTING_DISABLE_PERCEPTUAL_HEURISTICS,
                          1);
@@ -270,7 +285,8 @@ class JxlCodec : public ImageCodec {
                   jpegxl::tools::SpeedStats* speed_stats) override {
     cparams_.runner = pool->runner();
     cparams_.runner_opaque = pool->runner_opaque();
-    cparams_.memory_manager = memory_manager_;
+    JXL_RETURN_IF_ERROR(tracking_.Reset());
+    cparams_.memory_manager = tracking_.get();
     cparams_.distance = butteraugli_target_;
     cparams_.AddOption(JXL_ENC_FRAME_SETTING_NOISE,
                        static_cast<int>(jxlargs->noise));
@@ -293,11 +309,18 @@ class JxlCodec : public ImageCodec {
     if (args_.print_more_stats) {
       stats_.reset(JxlEncoderStatsCreate());
       cparams_.stats = stats_.get();
+      // The --perf_counters, which count this thread during the encode.
+      PerfCounters* counters = PerfCounters::Running();
+      if (counters != nullptr) {
+        JxlEncoderStatsSetCounters(stats_.get(), counters->num_stats_counters(),
+                                   &PerfCounters::ReadStats, counters);
+      }
     }
     const double start = jxl::Now();
     JXL_RETURN_IF_ERROR(jxl::extras::EncodeImageJXL(
         cparams_, ppf, /*jpeg_bytes=*/nullptr, compressed));
     const double end = jxl::Now();
+    NoteMemoryUse(&encode_memory_);
     if (ticket.has_error) return false;
     speed_stats->NotifyElapsed(end - start);
     return true;
@@ -309,7 +332,8 @@ class JxlCodec : public ImageCodec {
                     jpegxl::tools::SpeedStats* speed_stats) override {
     dparams_.runner = pool->runner();
     dparams_.runner_opaque = pool->runner_opaque();
-    dparams_.memory_manager = memory_manager_;
+    JXL_RETURN_IF_ERROR(tracking_.Reset());
+    dparams_.memory_manager = tracking_.get();
     JxlDataType data_type = uint8_ ? JXL_TYPE_UINT8 : JXL_TYPE_FLOAT;
     for (uint32_t c = 1; c <= 4; ++c) {
       dparams_.accepted_formats.push_back({c, data_type, JXL_LITTLE_ENDIAN, 0});
@@ -320,11 +344,22 @@ class JxlCodec : public ImageCodec {
     // originals, so we must set the option to keep the original orientation
     // instead.
     dparams_.keep_orientation = true;
+    if (args_.print_more_stats) {
+      dec_stats_.reset(JxlDecoderStatsCreate());
+      dparams_.stats = dec_stats_.get();
+      PerfCounters* counters = PerfCounters::Running();
+      if (counters != nullptr) {
+        JxlDecoderStatsSetCounters(dec_stats_.get(),
+                                   counters->num_stats_counters(),
+                                   &PerfCounters::ReadStats, counters);
+      }
+    }
     size_t decoded_bytes;
     const double start = jxl::Now();
     JXL_RETURN_IF_ERROR(jxl::extras::DecodeImageJXL(
         compressed.data(), compressed.size(), dparams_, &decoded_bytes, ppf));
     const double end = jxl::Now();
+    NoteMemoryUse(&decode_memory_);
     speed_stats->NotifyElapsed(end - start);
     return true;
   }
@@ -332,6 +367,17 @@ class JxlCodec : public ImageCodec {
   void GetMoreStats(BenchmarkStats* stats) override {
     stats->jxl_stats.num_inputs += 1;
     JxlEncoderStatsMerge(stats->jxl_stats.stats.get(), stats_.get());
+    JxlDecoderStatsMerge(stats->jxl_stats.dec_stats.get(), dec_stats_.get());
+    stats->encode_peak_bytes = encode_memory_.peak_bytes;
+    stats->decode_peak_bytes = decode_memory_.peak_bytes;
+    if (encode_memory_.calls != 0) {
+      stats->encode_allocations =
+          encode_memory_.allocations / encode_memory_.calls;
+    }
+    if (decode_memory_.calls != 0) {
+      stats->decode_allocations =
+          decode_memory_.allocations / decode_memory_.calls;
+    }
   }
 
  protected:
@@ -342,6 +388,25 @@ class JxlCodec : public ImageCodec {
   bool uint8_ = false;
   JxlMemoryManager* memory_manager_;
   std::unique_ptr<JxlEncoderStats, decltype(JxlEncoderStatsDestroy)*> stats_;
+  std::unique_ptr<JxlDecoderStats, decltype(JxlDecoderStatsDestroy)*>
+      dec_stats_;
+
+  // Memory use of the successful encodes or decodes so far, measured by
+  // `tracking_`, which wraps memory_manager_.
+  struct MemoryUse {
+    size_t peak_bytes = 0;
+    size_t allocations = 0;
+    size_t calls = 0;
+  };
+  void NoteMemoryUse(MemoryUse* use) {
+    use->peak_bytes = std::max<size_t>(use->peak_bytes,
+                                       tracking_.max_bytes_in_use);
+    use->allocations += tracking_.total_allocations;
+    use->calls++;
+  }
+  TrackingMemoryManager tracking_;
+  MemoryUse encode_memory_;
+  MemoryUse decode_memory_;
 
  private:
   struct DebugTicket {
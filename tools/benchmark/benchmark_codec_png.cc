@@ -58,7 +58,7 @@ class PNGCodec : public ImageCodec {
                     jpegxl::tools::SpeedStats* speed_stats) override {
     const double start = jxl::Now();
     JXL_RETURN_IF_ERROR(jxl::extras::DecodeImageAPNG(
-        compressed, jxl::extras::ColorHints(), ppf));
+        compressed, jxl::extras::ColorHints(), ppf, nullptr, pool));
     const double end = jxl::Now();
     speed_stats->NotifyElapsed(end - start);
     return true;
@@ -0,0 +1,174 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "tools/benchmark/benchmark_perf_counters.h"
+
+#include <jxl/decode_stats.h>
+#include <jxl/stats.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+#if defined(__linux__)
+
+struct CounterType {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+constexpr uint64_t CacheConfig(uint64_t cache, uint64_t result) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+}
+
+const CounterType kCounterTypes[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+    {"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1-dcache-loads", PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"L1-dcache-load-misses", PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC-loads", PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_ACCESS)},
+    {"LLC-load-misses", PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+    {"LLC-misses", PERF_TYPE_HW_CACHE,
+     CacheConfig(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+};
+
+const CounterType* FindCounterType(const std::string& name) {
+  for (const CounterType& type : kCounterTypes) {
+    if (name == type.name) return &type;
+  }
+  return nullptr;
+}
+
+#endif  // defined(__linux__)
+
+// The counters started on the calling thread and not stopped yet.
+thread_local PerfCounters* running_counters = nullptr;
+
+}  // namespace
+
+PerfCounters::~PerfCounters() {
+#if defined(__linux__)
+  for (int fd : fds_) close(fd);
+#endif
+}
+
+bool PerfCounters::IsKnown(const std::string& name) {
+#if defined(__linux__)
+  return FindCounterType(name) != nullptr;
+#else
+  return false;
+#endif
+}
+
+Status PerfCounters::Open(const std::vector<std::string>& names) {
+#if defined(__linux__)
+  JXL_ENSURE(fds_.empty());
+  for (const std::string& name : names) {
+    const CounterType* type = FindCounterType(name);
+    if (type == nullptr) {
+      return JXL_FAILURE("Unknown performance counter %s", name.c_str());
+    }
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type->type;
+    attr.config = type->config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // The calling thread, on any CPU.
+    const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+      for (int open_fd : fds_) close(open_fd);
+      fds_.clear();
+      return JXL_FAILURE("Failed to open performance counter %s: %s",
+                         name.c_str(), strerror(errno));
+    }
+    fds_.push_back(static_cast<int>(fd));
+  }
+  return true;
+#else
+  return JXL_FAILURE("Performance counters are only supported on Linux");
+#endif
+}
+
+void PerfCounters::Start() {
+#if defined(__linux__)
+  for (int fd : fds_) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+#endif
+  running_counters = this;
+}
+
+void PerfCounters::Stop(std::vector<double>* counts) {
+  running_counters = nullptr;
+#if defined(__linux__)
+  for (size_t i = 0; i < fds_.size(); ++i) {
+    ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t count = 0;
+    if (read(fds_[i], &count, sizeof(count)) == sizeof(count)) {
+      (*counts)[i] += static_cast<double>(count);
+    }
+  }
+#endif
+}
+
+PerfCounters* PerfCounters::Running() { return running_counters; }
+
+void PerfCounters::Read(size_t num, uint64_t* values) const {
+  JXL_DASSERT(num <= fds_.size());
+  for (size_t i = 0; i < num; ++i) {
+    values[i] = 0;
+#if defined(__linux__)
+    if (running_counters == this &&
+        read(fds_[i], &values[i], sizeof(values[i])) != sizeof(values[i])) {
+      values[i] = 0;
+    }
+#endif
+  }
+}
+
+size_t PerfCounters::num_stats_counters() const {
+  static_assert(JXL_ENC_STATS_MAX_COUNTERS == JXL_DEC_STATS_MAX_COUNTERS,
+                "counter limits differ");
+  return std::min<size_t>(fds_.size(), JXL_ENC_STATS_MAX_COUNTERS);
+}
+
+void PerfCounters::ReadStats(void* opaque, uint64_t* values) {
+  const PerfCounters* counters = static_cast<const PerfCounters*>(opaque);
+  counters->Read(counters->num_stats_counters(), values);
+}
+
+}  // namespace tools
+}  // namespace jpegxl
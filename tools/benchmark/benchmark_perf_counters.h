@@ -0,0 +1,69 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_BENCHMARK_BENCHMARK_PERF_COUNTERS_H_
+#define TOOLS_BENCHMARK_BENCHMARK_PERF_COUNTERS_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+
+namespace jpegxl {
+namespace tools {
+
+using ::jxl::Status;
+
+// Hardware performance counters of the calling thread, read with the Linux
+// perf_event_open system call. They can not be opened on other systems, or
+// when the kernel does not allow it (see perf_event_paranoid).
+class PerfCounters final {
+ public:
+  PerfCounters() = default;
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+  ~PerfCounters();
+
+  // Whether `name` is a counter that Open supports, with the names used by the
+  // perf tool: cycles, instructions, cache-references, cache-misses, branches,
+  // branch-misses, L1-dcache-loads, L1-dcache-load-misses, LLC-loads and
+  // LLC-load-misses (or LLC-misses).
+  static bool IsKnown(const std::string& name);
+
+  // Opens the counters called `names` for the calling thread, which must be
+  // the only one to use this object.
+  Status Open(const std::vector<std::string>& names);
+  bool is_open() const { return !fds_.empty(); }
+  size_t size() const { return fds_.size(); }
+
+  // Starts counting from zero.
+  void Start();
+  // Stops counting and adds the counts since Start to `counts`, which must have
+  // one entry per counter.
+  void Stop(std::vector<double>* counts);
+
+  // The counters started on the calling thread and not stopped yet, if any.
+  static PerfCounters* Running();
+
+  // Reads the first `num` counts since Start without stopping, or zeros if the
+  // calling thread is not the one that started these counters.
+  void Read(size_t num, uint64_t* values) const;
+  // Number of counters that ReadStats reads, at most the limit of
+  // JxlEncoderStatsSetCounters and JxlDecoderStatsSetCounters.
+  size_t num_stats_counters() const;
+  // Reads the first num_stats_counters() counts of the PerfCounters `opaque`,
+  // for JxlEncoderStatsSetCounters and JxlDecoderStatsSetCounters.
+  static void ReadStats(void* opaque, uint64_t* values);
+
+ private:
+  std::vector<int> fds_;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BENCHMARK_BENCHMARK_PERF_COUNTERS_H_
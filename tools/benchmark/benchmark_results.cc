@@ -0,0 +1,347 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "tools/benchmark/benchmark_results.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/status.h"
+#include "tools/file_io.h"
+
+namespace jpegxl {
+namespace tools {
+
+namespace {
+
+constexpr int kVersion = 1;
+
+std::string QuoteString(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+std::string FormatTimes(const std::vector<double>& times) {
+  std::string out = "[";
+  for (size_t i = 0; i < times.size(); ++i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%s%.9g", i == 0 ? "" : ", ", times[i]);
+    out += buf;
+  }
+  return out + "]";
+}
+
+// Parses the subset of JSON that WriteBenchmarkResults writes, skipping the
+// values of keys it does not know.
+class Reader {
+ public:
+  explicit Reader(const std::vector<uint8_t>& bytes)
+      : pos_(reinterpret_cast<const char*>(bytes.data())),
+        end_(pos_ + bytes.size()) {}
+
+  bool Consume(char c) {
+    SkipSpace();
+    if (pos_ == end_ || *pos_ != c) return false;
+    ++pos_;
+    return true;
+  }
+
+  ::jxl::Status Expect(char c) {
+    if (!Consume(c)) return JXL_FAILURE("Expected '%c' in results", c);
+    return true;
+  }
+
+  ::jxl::Status String(std::string* s) {
+    JXL_RETURN_IF_ERROR(Expect('"'));
+    s->clear();
+    while (pos_ != end_ && *pos_ != '"') {
+      char c = *pos_++;
+      if (c == '\\') {
+        if (pos_ == end_) break;
+        c = *pos_++;
+        if (c == 'u') {
+          if (end_ - pos_ < 4) break;
+          c = static_cast<char>(strtol(std::string(pos_, 4).c_str(), nullptr,
+                                       16));
+          pos_ += 4;
+        } else if (c == 'n') {
+          c = '\n';
+        } else if (c == 't') {
+          c = '\t';
+        }
+      }
+      *s += c;
+    }
+    return Expect('"');
+  }
+
+  ::jxl::Status Number(double* value) {
+    SkipSpace();
+    const std::string rest(pos_, std::min<size_t>(end_ - pos_, 64));
+    char* num_end;
+    *value = strtod(rest.c_str(), &num_end);
+    if (num_end == rest.c_str()) return JXL_FAILURE("Expected a number");
+    pos_ += num_end - rest.c_str();
+    return true;
+  }
+
+  ::jxl::Status Numbers(std::vector<double>* values) {
+    JXL_RETURN_IF_ERROR(Expect('['));
+    values->clear();
+    if (Consume(']')) return true;
+    do {
+      double value;
+      JXL_RETURN_IF_ERROR(Number(&value));
+      values->push_back(value);
+    } while (Consume(','));
+    return Expect(']');
+  }
+
+  ::jxl::Status Skip() {
+    SkipSpace();
+    if (pos_ == end_) return JXL_FAILURE("Unexpected end of results");
+    if (*pos_ == '"') {
+      std::string s;
+      return String(&s);
+    }
+    if (*pos_ == '[' || *pos_ == '{') {
+      const char close = *pos_ == '[' ? ']' : '}';
+      ++pos_;
+      if (Consume(close)) return true;
+      do {
+        if (close == '}') {
+          std::string key;
+          JXL_RETURN_IF_ERROR(String(&key));
+          JXL_RETURN_IF_ERROR(Expect(':'));
+        }
+        JXL_RETURN_IF_ERROR(Skip());
+      } while (Consume(','));
+      return Expect(close);
+    }
+    // Numbers and literals.
+    const char* start = pos_;
+    while (pos_ != end_ && *pos_ != ',' && *pos_ != ']' && *pos_ != '}' &&
+           *pos_ != ' ' && *pos_ != '\n') {
+      ++pos_;
+    }
+    if (pos_ == start) return JXL_FAILURE("Invalid value in results");
+    return true;
+  }
+
+  // Calls `field(key)` for every key of an object, which must read its value.
+  template <typename Field>
+  ::jxl::Status Object(const Field& field) {
+    JXL_RETURN_IF_ERROR(Expect('{'));
+    if (Consume('}')) return true;
+    do {
+      std::string key;
+      JXL_RETURN_IF_ERROR(String(&key));
+      JXL_RETURN_IF_ERROR(Expect(':'));
+      JXL_RETURN_IF_ERROR(field(key));
+    } while (Consume(','));
+    return Expect('}');
+  }
+
+  bool AtEnd() {
+    SkipSpace();
+    return pos_ == end_;
+  }
+
+ private:
+  void SkipSpace() {
+    while (pos_ != end_ &&
+           (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\r' || *pos_ == '\t')) {
+      ++pos_;
+    }
+  }
+
+  const char* pos_;
+  const char* end_;
+};
+
+::jxl::Status ReadResult(Reader* reader, BenchmarkResult* result) {
+  return reader->Object([&](const std::string& key) -> ::jxl::Status {
+    double value;
+    if (key == "codec") return reader->String(&result->codec);
+    if (key == "image") return reader->String(&result->image);
+    if (key == "encode_seconds") {
+      return reader->Numbers(&result->encode_seconds);
+    }
+    if (key == "decode_seconds") {
+      return reader->Numbers(&result->decode_seconds);
+    }
+    if (key == "pixels" || key == "compressed_size" || key == "errors") {
+      JXL_RETURN_IF_ERROR(reader->Number(&value));
+      size_t* field = key == "pixels"            ? &result->pixels
+                      : key == "compressed_size" ? &result->compressed_size
+                                                 : &result->errors;
+      *field = static_cast<size_t>(value);
+      return true;
+    }
+    return reader->Skip();
+  });
+}
+
+double Median(std::vector<double> values) {
+  if (values.empty()) return 0.0;
+  std::sort(values.begin(), values.end());
+  const size_t mid = values.size() / 2;
+  return values.size() % 2 ? values[mid]
+                           : (values[mid - 1] + values[mid]) * 0.5;
+}
+
+// Whether the `times` are larger than the `baseline` ones at the 1% level,
+// according to a one-sided Mann-Whitney U test with the normal approximation.
+bool SignificantlySlower(const std::vector<double>& baseline,
+                         const std::vector<double>& times) {
+  const double n = baseline.size();
+  const double m = times.size();
+  if (n == 0 || m == 0) return false;
+  double u = 0;
+  for (double a : baseline) {
+    for (double b : times) {
+      u += b > a ? 1.0 : b == a ? 0.5 : 0.0;
+    }
+  }
+  const double mean = n * m / 2;
+  const double sigma = std::sqrt(n * m * (n + m + 1) / 12);
+  // One-sided critical value of the standard normal distribution for 1%.
+  constexpr double kCritical = 2.326;
+  return (u - mean - 0.5) / sigma > kCritical;
+}
+
+}  // namespace
+
+::jxl::Status WriteBenchmarkResults(const std::vector<BenchmarkResult>& results,
+                                    const std::string& filename) {
+  std::string out = "{\n  \"version\": " + std::to_string(kVersion) +
+                    ",\n  \"results\": [";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchmarkResult& r = results[i];
+    out += i == 0 ? "\n" : ",\n";
+    out += "    {\n";
+    out += "      \"codec\": " + QuoteString(r.codec) + ",\n";
+    out += "      \"image\": " + QuoteString(r.image) + ",\n";
+    out += "      \"pixels\": " + std::to_string(r.pixels) + ",\n";
+    out += "      \"compressed_size\": " + std::to_string(r.compressed_size) +
+           ",\n";
+    out += "      \"errors\": " + std::to_string(r.errors) + ",\n";
+    out += "      \"encode_seconds\": " + FormatTimes(r.encode_seconds) + ",\n";
+    out += "      \"decode_seconds\": " + FormatTimes(r.decode_seconds) + "\n";
+    out += "    }";
+  }
+  out += "\n  ]\n}\n";
+  if (!WriteFile(filename, out)) {
+    return JXL_FAILURE("Failed to write %s", filename.c_str());
+  }
+  return true;
+}
+
+::jxl::Status ReadBenchmarkResults(const std::string& filename,
+                                   std::vector<BenchmarkResult>* results) {
+  std::vector<uint8_t> bytes;
+  if (!ReadFile(filename, &bytes)) {
+    return JXL_FAILURE("Failed to read %s", filename.c_str());
+  }
+  Reader reader(bytes);
+  results->clear();
+  double version = 0;
+  const auto field = [&](const std::string& key) -> ::jxl::Status {
+    if (key == "version") return reader.Number(&version);
+    if (key != "results") return reader.Skip();
+    JXL_RETURN_IF_ERROR(reader.Expect('['));
+    if (reader.Consume(']')) return true;
+    do {
+      results->emplace_back();
+      JXL_RETURN_IF_ERROR(ReadResult(&reader, &results->back()));
+    } while (reader.Consume(','));
+    return reader.Expect(']');
+  };
+  JXL_RETURN_IF_ERROR(reader.Object(field));
+  if (!reader.AtEnd()) {
+    return JXL_FAILURE("Trailing data in %s", filename.c_str());
+  }
+  if (version != kVersion) {
+    return JXL_FAILURE("Unsupported version of %s", filename.c_str());
+  }
+  return true;
+}
+
+size_t CompareBenchmarkResults(const std::vector<BenchmarkResult>& baseline,
+                               const std::vector<BenchmarkResult>& results,
+                               double min_slowdown) {
+  std::map<std::pair<std::string, std::string>, const BenchmarkResult*> index;
+  for (const BenchmarkResult& r : baseline) index[{r.codec, r.image}] = &r;
+
+  size_t num_compared = 0;
+  size_t num_regressions = 0;
+  size_t num_missing = 0;
+  const auto speed = [&](const char* what, const BenchmarkResult& r,
+                         const std::vector<double>& base_times,
+                         const std::vector<double>& times) {
+    const double base_median = Median(base_times);
+    const double median = Median(times);
+    if (base_median <= 0 || median <= base_median * (1 + min_slowdown)) return;
+    if (!SignificantlySlower(base_times, times)) return;
+    printf("REGRESSION %s %s: %s time %.6f s -> %.6f s (%+.1f%%)\n",
+           r.codec.c_str(), r.image.c_str(), what, base_median, median,
+           (median / base_median - 1) * 100);
+    ++num_regressions;
+  };
+  for (const BenchmarkResult& r : results) {
+    auto it = index.find({r.codec, r.image});
+    if (it == index.end()) {
+      ++num_missing;
+      continue;
+    }
+    const BenchmarkResult& base = *it->second;
+    ++num_compared;
+    if (r.errors > base.errors) {
+      printf("REGRESSION %s %s: errors %" PRIuS " -> %" PRIuS "\n",
+             r.codec.c_str(), r.image.c_str(), base.errors, r.errors);
+      ++num_regressions;
+    }
+    if (base.compressed_size != 0 &&
+        r.compressed_size > base.compressed_size) {
+      const double ratio =
+          static_cast<double>(r.compressed_size) / base.compressed_size;
+      printf("REGRESSION %s %s: size %" PRIuS " -> %" PRIuS
+             " bytes (%+.3f%%)\n",
+             r.codec.c_str(), r.image.c_str(), base.compressed_size,
+             r.compressed_size, (ratio - 1) * 100);
+      ++num_regressions;
+    }
+    speed("encode", r, base.encode_seconds, r.encode_seconds);
+    speed("decode", r, base.decode_seconds, r.decode_seconds);
+  }
+  printf("Compared %" PRIuS " results with the baseline (%" PRIuS
+         " not in it): %" PRIuS " regressions\n",
+         num_compared, num_missing, num_regressions);
+  return num_regressions;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
@@ -0,0 +1,69 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_BENCHMARK_BENCHMARK_RESULTS_H_
+#define TOOLS_BENCHMARK_BENCHMARK_RESULTS_H_
+
+// Machine-readable results of benchmark_xl, to compare runs with each other.
+//
+// The results are stored as JSON:
+//   {
+//     "version": 1,
+//     "results": [
+//       {
+//         "codec": "jxl:d1",
+//         "image": "/path/image.png",
+//         "pixels": 1048576,
+//         "compressed_size": 123456,
+//         "errors": 0,
+//         "encode_seconds": [0.25, 0.24],
+//         "decode_seconds": [0.03, 0.031]
+//       }
+//     ]
+//   }
+// with one entry per image and codec, and the time taken by every repetition
+// of the encode and decode (see --encode_reps and --decode_reps).
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/status.h"
+
+namespace jpegxl {
+namespace tools {
+
+struct BenchmarkResult {
+  std::string codec;
+  std::string image;
+  size_t pixels = 0;
+  size_t compressed_size = 0;
+  size_t errors = 0;
+  std::vector<double> encode_seconds;
+  std::vector<double> decode_seconds;
+};
+
+::jxl::Status WriteBenchmarkResults(const std::vector<BenchmarkResult>& results,
+                                    const std::string& filename);
+
+::jxl::Status ReadBenchmarkResults(const std::string& filename,
+                                   std::vector<BenchmarkResult>* results);
+
+// Compares the results with those of `baseline` of the same image and codec,
+// and prints those that are significantly slower to encode or decode, or
+// larger, together with the totals. Returns the number of such regressions.
+//
+// A speed is only a regression when the median time is more than
+// `min_slowdown` (a fraction) larger and a one-sided Mann-Whitney U test of the
+// times of the repetitions finds the difference significant at the 1% level,
+// so comparing runs with at least 5 repetitions is recommended.
+size_t CompareBenchmarkResults(const std::vector<BenchmarkResult>& baseline,
+                               const std::vector<BenchmarkResult>& results,
+                               double min_slowdown);
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_BENCHMARK_BENCHMARK_RESULTS_H_
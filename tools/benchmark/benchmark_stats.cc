@@ -5,9 +5,11 @@
 
 #include "tools/benchmark/benchmark_stats.h"
 
+#include <jxl/decode_stats.h>
 #include <jxl/stats.h>
 
 #include <algorithm>
+#include <cinttypes>
 #include <cmath>
 #include <cstdarg>
 #include <cstddef>
@@ -55,6 +57,57 @@ const char* JxlStatsName(JxlEncoderStatsKey key) {
     ADD_NAME(NUM_DCT32X64_BLOCKS, "Number of 32x64 blocks");
     ADD_NAME(NUM_DCT64_BLOCKS, "Number of 64x64 blocks");
     ADD_NAME(NUM_BUTTERAUGLI_ITERS, "Butteraugli iters");
+    ADD_NAME(TO_XYB_WALL_US, "ToXYB wall us");
+    ADD_NAME(TO_XYB_CPU_US, "ToXYB CPU us");
+    ADD_NAME(TO_XYB_PEAK_BYTES, "ToXYB peak bytes");
+    ADD_NAME(AC_STRATEGY_WALL_US, "AC strategy wall us");
+    ADD_NAME(AC_STRATEGY_CPU_US, "AC strategy CPU us");
+    ADD_NAME(AC_STRATEGY_PEAK_BYTES, "AC strategy peak bytes");
+    ADD_NAME(ADAPTIVE_QUANTIZATION_WALL_US, "Adaptive quant wall us");
+    ADD_NAME(ADAPTIVE_QUANTIZATION_CPU_US, "Adaptive quant CPU us");
+    ADD_NAME(ADAPTIVE_QUANTIZATION_PEAK_BYTES, "Adaptive quant peak bytes");
+    ADD_NAME(CHROMA_FROM_LUMA_WALL_US, "CfL wall us");
+    ADD_NAME(CHROMA_FROM_LUMA_CPU_US, "CfL CPU us");
+    ADD_NAME(CHROMA_FROM_LUMA_PEAK_BYTES, "CfL peak bytes");
+    ADD_NAME(PATCHES_WALL_US, "Patches wall us");
+    ADD_NAME(PATCHES_CPU_US, "Patches CPU us");
+    ADD_NAME(PATCHES_PEAK_BYTES, "Patches peak bytes");
+    ADD_NAME(TREE_LEARNING_WALL_US, "Tree learning wall us");
+    ADD_NAME(TREE_LEARNING_CPU_US, "Tree learning CPU us");
+    ADD_NAME(TREE_LEARNING_PEAK_BYTES, "Tree learning peak bytes");
+    ADD_NAME(CLUSTERING_WALL_US, "Clustering wall us");
+    ADD_NAME(CLUSTERING_CPU_US, "Clustering CPU us");
+    ADD_NAME(CLUSTERING_PEAK_BYTES, "Clustering peak bytes");
+    ADD_NAME(TOKENIZATION_WALL_US, "Tokenization wall us");
+    ADD_NAME(TOKENIZATION_CPU_US, "Tokenization CPU us");
+    ADD_NAME(TOKENIZATION_PEAK_BYTES, "Tokenization peak bytes");
+    ADD_NAME(WRITING_WALL_US, "Writing wall us");
+    ADD_NAME(WRITING_CPU_US, "Writing CPU us");
+    ADD_NAME(WRITING_PEAK_BYTES, "Writing peak bytes");
+    ADD_NAME(ESTIMATED_DECODE_NS, "Estimated decode ns");
+    default:
+      return "";
+  };
+  return "";
+}
+#undef ADD_NAME
+
+#define ADD_NAME(val, name) \
+  case JXL_DEC_STAT_##val:  \
+    return name
+const char* JxlDecoderStatsName(JxlDecoderStatsKey key) {
+  switch (key) {
+    ADD_NAME(TOTAL_NS, "Decode total");
+    ADD_NAME(DC_GLOBAL_NS, "Decode DC global");
+    ADD_NAME(DC_GROUPS_NS, "Decode DC groups");
+    ADD_NAME(AC_GLOBAL_NS, "Decode AC global");
+    ADD_NAME(AC_GROUPS_NS, "Decode AC groups");
+    ADD_NAME(FINALIZE_NS, "Decode finalize");
+    ADD_NAME(RENDER_NS, "Decode render");
+    ADD_NAME(CMS_NS, "Decode CMS");
+    ADD_NAME(OUTPUT_NS, "Decode output");
+    ADD_NAME(BYTES_ALLOCATED, "Decode bytes allocated");
+    ADD_NAME(PEAK_BYTES, "Decode peak bytes");
     default:
       return "";
   };
@@ -68,6 +121,52 @@ void JxlStats::Print() const {
     size_t value = JxlEncoderStatsGet(stats.get(), key);
     if (value) printf("%-25s  %10" PRIuS "\n", JxlStatsName(key), value);
   }
+  // The --perf_counters, measured in each phase and stage.
+  const std::vector<std::string>& counters = Args()->perf_counter_names;
+  const size_t num_counters =
+      std::min<size_t>(counters.size(), JXL_ENC_STATS_MAX_COUNTERS);
+  for (int key = JXL_ENC_STAT_TO_XYB_WALL_US;
+       key <= JXL_ENC_STAT_WRITING_WALL_US; key += 3) {
+    const JxlEncoderStatsKey phase = static_cast<JxlEncoderStatsKey>(key);
+    // The name of the phase, without the " wall us" of its time.
+    std::string name = JxlStatsName(phase);
+    name.resize(name.size() - strlen(" wall us"));
+    for (size_t c = 0; c < num_counters; ++c) {
+      uint64_t value = JxlEncoderStatsGetCounter(stats.get(), phase, c);
+      if (value) {
+        printf("%-25s  %10" PRIu64 "\n",
+               (name + " " + counters[c]).c_str(), value);
+      }
+    }
+  }
+
+  for (int i = 0; i < JXL_DEC_NUM_STATS; ++i) {
+    JxlDecoderStatsKey key = static_cast<JxlDecoderStatsKey>(i);
+    uint64_t value = JxlDecoderStatsGet(dec_stats.get(), key);
+    if (value == 0) continue;
+    const bool is_time = key <= JXL_DEC_STAT_OUTPUT_NS;
+    printf("%-25s  %10" PRIu64 "\n",
+           (std::string(JxlDecoderStatsName(key)) + (is_time ? " ns" : ""))
+               .c_str(),
+           value);
+    for (size_t c = 0; is_time && c < num_counters; ++c) {
+      value = JxlDecoderStatsGetCounter(dec_stats.get(), key, c);
+      printf("%-25s  %10" PRIu64 "\n",
+             (std::string(JxlDecoderStatsName(key)) + " " + counters[c])
+                 .c_str(),
+             value);
+    }
+  }
+  for (size_t i = 0; i < JxlDecoderStatsNumStages(dec_stats.get()); ++i) {
+    const std::string name =
+        std::string("Stage ") + JxlDecoderStatsStageName(dec_stats.get(), i);
+    printf("%-25s  %10" PRIu64 "\n", (name + " ns").c_str(),
+           JxlDecoderStatsStageTime(dec_stats.get(), i));
+    for (size_t c = 0; c < num_counters; ++c) {
+      printf("%-25s  %10" PRIu64 "\n", (name + " " + counters[c]).c_str(),
+             JxlDecoderStatsStageCounter(dec_stats.get(), i, c));
+    }
+  }
 }
 
 namespace {
@@ -139,9 +238,22 @@ std::vector<ColumnDescriptor> GetColumnDescriptors(size_t num_extra_metrics) {
       {{"BPP*pnorm"},      16, 12, TYPE_POSITIVE_FLOAT, false},
       {{"QABPP"},           8,  3, TYPE_POSITIVE_FLOAT, false},
       {{"Bugs"},            7,  5, TYPE_COUNT, false},
+      {{"E MiB"},           9,  2, TYPE_POSITIVE_FLOAT, true},
+      {{"E allocs/MP"},    12,  1, TYPE_POSITIVE_FLOAT, true},
+      {{"D MiB"},           9,  2, TYPE_POSITIVE_FLOAT, true},
+      {{"D allocs/MP"},    12,  1, TYPE_POSITIVE_FLOAT, true},
   };
   // clang-format on
 
+  // Counts per pixel of the --perf_counters.
+  for (const char* prefix : {"E ", "D "}) {
+    for (const std::string& name : Args()->perf_counter_names) {
+      const std::string label = prefix + name;
+      result.push_back({label, std::max<uint32_t>(label.size() + 2, 10), 3,
+                        TYPE_POSITIVE_FLOAT, false});
+    }
+  }
+
   for (size_t i = 0; i < num_extra_metrics; i++) {
     result.push_back(ExtraMetricDescriptor());
   }
@@ -190,6 +302,10 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   total_adj_compressed_size += victim.total_adj_compressed_size;
   total_time_encode += victim.total_time_encode;
   total_time_decode += victim.total_time_decode;
+  encode_times.insert(encode_times.end(), victim.encode_times.begin(),
+                      victim.encode_times.end());
+  decode_times.insert(decode_times.end(), victim.decode_times.begin(),
+                      victim.decode_times.end());
   max_distance += pow(victim.max_distance, 2.0) * victim.total_input_pixels;
   distance_p_norm += victim.distance_p_norm;
   ssimulacra2 += victim.ssimulacra2;
@@ -200,6 +316,17 @@ void BenchmarkStats::Assimilate(const BenchmarkStats& victim) {
   ssimulacra2s.insert(ssimulacra2s.end(), victim.ssimulacra2s.begin(),
                       victim.ssimulacra2s.end());
   total_errors += victim.total_errors;
+  encode_peak_bytes = std::max(encode_peak_bytes, victim.encode_peak_bytes);
+  encode_allocations += victim.encode_allocations;
+  decode_peak_bytes = std::max(decode_peak_bytes, victim.decode_peak_bytes);
+  decode_allocations += victim.decode_allocations;
+  const auto add_counts = [](const std::vector<double>& from,
+                             std::vector<double>* to) {
+    if (to->size() < from.size()) to->resize(from.size());
+    for (size_t i = 0; i < from.size(); i++) (*to)[i] += from[i];
+  };
+  add_counts(victim.encode_counts, &encode_counts);
+  add_counts(victim.decode_counts, &decode_counts);
   jxl_stats.Assimilate(victim.jxl_stats);
   if (extra_metrics.size() < victim.extra_metrics.size()) {
     extra_metrics.resize(victim.extra_metrics.size());
@@ -284,8 +411,19 @@ std::vector<ColumnValue> BenchmarkStats::ComputeColumns(
   values[10].f = bpp_p_norm;
   values[11].f = adj_comp_bpp;
   values[12].i = total_errors;
+  values[13].f = encode_peak_bytes / (1024.0 * 1024.0);
+  values[14].f = encode_allocations / (total_input_pixels * 1E-6);
+  values[15].f = decode_peak_bytes / (1024.0 * 1024.0);
+  values[16].f = decode_allocations / (total_input_pixels * 1E-6);
+  size_t column = 17;
+  for (const std::vector<double>* counts : {&encode_counts, &decode_counts}) {
+    for (size_t i = 0; i < Args()->perf_counter_names.size(); i++) {
+      values[column++].f =
+          i < counts->size() ? (*counts)[i] / total_input_pixels : 0.0;
+    }
+  }
   for (size_t i = 0; i < extra_metrics.size(); i++) {
-    values[13 + i].f = extra_metrics[i] / total_input_files;
+    values[column + i].f = extra_metrics[i] / total_input_files;
   }
   return values;
 }
@@ -6,6 +6,7 @@
 #ifndef TOOLS_BENCHMARK_BENCHMARK_STATS_H_
 #define TOOLS_BENCHMARK_BENCHMARK_STATS_H_
 
+#include <jxl/decode_stats.h>
 #include <jxl/stats.h>
 
 #include <cstddef>
@@ -22,15 +23,20 @@ std::string StringPrintf(const char* format, ...);
 
 struct JxlStats {
   JxlStats()
-      : num_inputs(0), stats(JxlEncoderStatsCreate(), JxlEncoderStatsDestroy) {}
+      : num_inputs(0),
+        stats(JxlEncoderStatsCreate(), JxlEncoderStatsDestroy),
+        dec_stats(JxlDecoderStatsCreate(), JxlDecoderStatsDestroy) {}
   void Assimilate(const JxlStats& victim) {
     num_inputs += victim.num_inputs;
     JxlEncoderStatsMerge(stats.get(), victim.stats.get());
+    JxlDecoderStatsMerge(dec_stats.get(), victim.dec_stats.get());
   }
   void Print() const;
 
   size_t num_inputs;
   std::unique_ptr<JxlEncoderStats, decltype(JxlEncoderStatsDestroy)*> stats;
+  std::unique_ptr<JxlDecoderStats, decltype(JxlDecoderStatsDestroy)*>
+      dec_stats;
 };
 
 // The value of an entry in the table. Depending on the ColumnType, the string,
@@ -56,6 +62,9 @@ struct BenchmarkStats {
   size_t total_adj_compressed_size = 0;
   double total_time_encode = 0.0;
   double total_time_decode = 0.0;
+  // Time of every repetition of the encodes and decodes, in seconds.
+  std::vector<double> encode_times;
+  std::vector<double> decode_times;
   float max_distance = -1.0;  // Max butteraugli score
   // sum of 8th powers of butteraugli distmap pixels.
   double distance_p_norm = 0.0;
@@ -65,6 +74,17 @@ struct BenchmarkStats {
   std::vector<float> pnorms;
   std::vector<float> ssimulacra2s;
   size_t total_errors = 0;
+  // Memory use reported by the codecs that track it: the highest peak of an
+  // encode or decode of any image, and the sum over the images of the number
+  // of allocations of one encode or decode.
+  size_t encode_peak_bytes = 0;
+  size_t encode_allocations = 0;
+  size_t decode_peak_bytes = 0;
+  size_t decode_allocations = 0;
+  // Average count of each of the --perf_counters in an encode or decode,
+  // summed over the images.
+  std::vector<double> encode_counts;
+  std::vector<double> decode_counts;
   JxlStats jxl_stats;
   std::vector<float> extra_metrics;
 };
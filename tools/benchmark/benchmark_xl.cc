@@ -7,9 +7,12 @@
 #include <jxl/cms_interface.h>
 #include <jxl/decode.h>
 #include <jxl/memory_manager.h>
+#include <jxl/shared_parallel_runner.h>
+#include <jxl/shared_parallel_runner_cxx.h>
 #include <jxl/types.h>
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
@@ -30,6 +33,7 @@
 #include "lib/extras/metrics.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/packed_image_convert.h"
+#include "lib/extras/time.h"
 #include "lib/jxl/base/common.h"
 #include "lib/jxl/base/compiler_specific.h"
 #include "lib/jxl/base/data_parallel.h"
@@ -40,8 +44,6 @@
 #include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/codec_in_out.h"
 #include "lib/jxl/color_encoding_internal.h"
-#include "lib/jxl/enc_butteraugli_comparator.h"
-#include "lib/jxl/enc_comparator.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 #include "lib/jxl/image_ops.h"
@@ -49,6 +51,8 @@
 #include "tools/benchmark/benchmark_args.h"
 #include "tools/benchmark/benchmark_codec.h"
 #include "tools/benchmark/benchmark_file_io.h"
+#include "tools/benchmark/benchmark_perf_counters.h"
+#include "tools/benchmark/benchmark_results.h"
 #include "tools/benchmark/benchmark_stats.h"
 #include "tools/benchmark/benchmark_utils.h"
 #include "tools/cmdline.h"
@@ -60,6 +64,10 @@
 #include "tools/thread_pool_internal.h"
 #include "tools/tracking_memory_manager.h"
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/resource.h>
+#endif
+
 namespace jpegxl {
 namespace tools {
 namespace {
@@ -73,7 +81,8 @@ using ::jxl::ColorEncoding;
 using ::jxl::Image3F;
 using ::jxl::ImageBundle;
 using ::jxl::ImageF;
-using ::jxl::JxlButteraugliComparator;
+using ::jxl::ImageMetrics;
+using ::jxl::MetricsReference;
 using ::jxl::Rng;
 using ::jxl::Status;
 using ::jxl::StatusOr;
@@ -99,6 +108,21 @@ void PrintStats(const TrackingMemoryManager& memory_manager) {
           static_cast<double>(memory_manager.max_bytes_in_use));
 }
 
+// Peak resident set size of the process in bytes, or 0 where it is unknown.
+size_t PeakRss() {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return static_cast<size_t>(usage.ru_maxrss);
+#else
+  return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
 Status ReadPNG(const std::string& filename, Image3F* image) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
   CodecInOut io{memory_manager};
@@ -141,7 +165,8 @@ std::string CodecToExtension(const std::string& codec_name, char sep) {
 Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
                   const std::vector<std::string>& extra_metrics_commands,
                   ImageCodec* codec, ThreadPool* inner_pool,
-                  std::vector<uint8_t>* compressed, BenchmarkStats* s) {
+                  PerfCounters* perf_counters, std::vector<uint8_t>* compressed,
+                  BenchmarkStats* s) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
   ++s->total_input_files;
 
@@ -170,6 +195,16 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
   const PackedPixelFile* ppf1 = &ppf;
   PackedPixelFile ppf2;
 
+  // Counts of the --perf_counters, summed over the encodes or decodes.
+  const size_t num_counters = Args()->perf_counter_names.size();
+  std::vector<double> encode_counts(num_counters);
+  std::vector<double> decode_counts(num_counters);
+  size_t num_encodes = 0;
+  size_t num_decodes = 0;
+  if (perf_counters != nullptr && !perf_counters->is_open()) {
+    JXL_RETURN_IF_ERROR(perf_counters->Open(Args()->perf_counter_names));
+  }
+
   for (size_t generation = 0; generation <= Args()->generations; generation++) {
     std::string ext = FileExtension(filename);
     if (valid && !Args()->decode_only) {
@@ -180,8 +215,11 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
           JXL_RETURN_IF_ERROR(codec->RecompressJpeg(filename, data_in,
                                                     compressed, &speed_stats));
         } else {
+          if (perf_counters != nullptr) perf_counters->Start();
           Status status = codec->Compress(filename, *ppf1, inner_pool,
                                           compressed, &speed_stats);
+          if (perf_counters != nullptr) perf_counters->Stop(&encode_counts);
+          num_encodes++;
           if (!status) {
             valid = false;
             if (!Args()->silent_errors) {
@@ -199,6 +237,9 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_encode += summary.central_tendency;
+      s->encode_times.insert(s->encode_times.end(),
+                             speed_stats.elapsed().begin(),
+                             speed_stats.elapsed().end());
     }
 
     if (valid && Args()->decode_only) {
@@ -211,8 +252,12 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
     if (valid) {
       speed_stats = jpegxl::tools::SpeedStats();
       for (size_t i = 0; i < Args()->decode_reps; ++i) {
-        if (!codec->Decompress(filename, Bytes(*compressed), inner_pool, &ppf2,
-                               &speed_stats)) {
+        if (perf_counters != nullptr) perf_counters->Start();
+        const Status status = codec->Decompress(
+            filename, Bytes(*compressed), inner_pool, &ppf2, &speed_stats);
+        if (perf_counters != nullptr) perf_counters->Stop(&decode_counts);
+        num_decodes++;
+        if (!status) {
           if (!Args()->silent_errors) {
             fprintf(stderr,
                     "%s failed to decompress encoded image. Original source:"
@@ -224,9 +269,24 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
       }
       JXL_RETURN_IF_ERROR(speed_stats.GetSummary(&summary));
       s->total_time_decode += summary.central_tendency;
+      s->decode_times.insert(s->decode_times.end(),
+                             speed_stats.elapsed().begin(),
+                             speed_stats.elapsed().end());
     }
     ppf1 = &ppf2;
   }
+  if (perf_counters != nullptr) {
+    s->encode_counts.resize(num_counters);
+    s->decode_counts.resize(num_counters);
+    for (size_t i = 0; i < num_counters; ++i) {
+      if (num_encodes != 0) {
+        s->encode_counts[i] += encode_counts[i] / num_encodes;
+      }
+      if (num_decodes != 0) {
+        s->decode_counts[i] += decode_counts[i] / num_decodes;
+      }
+    }
+  }
 
   std::string name = FileBaseName(filename);
   std::string codec_name = codec->description();
@@ -256,6 +316,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
   bool skip_butteraugli = Args()->skip_butteraugli || Args()->decode_only;
   ImageF distmap;
   float distance = 1.0f;
+  double psnr = 0.0;
 
   if (valid && !skip_butteraugli) {
     CodecInOut ppf_io{memory_manager};
@@ -277,11 +338,17 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
                                 : transfer_function.IsHLG() ? 1000.f
                                                             : 80.f;
 
-      const JxlCmsInterface& cms = *JxlGetDefaultCms();
-      JxlButteraugliComparator comparator(params, cms);
-      JXL_RETURN_IF_ERROR(ComputeScore(ib1, ib2, &comparator, cms, &distance,
-                                       &distmap, inner_pool,
-                                       codec->IgnoreAlpha()));
+      // Converts the decoded image once for the butteraugli distance and the
+      // PSNR.
+      JXL_ASSIGN_OR_RETURN(
+          MetricsReference reference,
+          MetricsReference::Create(ib1, params, *JxlGetDefaultCms(),
+                                   codec->IgnoreAlpha(), inner_pool));
+      JXL_ASSIGN_OR_RETURN(
+          ImageMetrics metrics,
+          reference.Compare(ib2, Args()->error_pnorm, inner_pool, &distmap));
+      distance = metrics.butteraugli;
+      psnr = metrics.psnr;
     } else {
       // TODO(veluca): re-upsample and compute proper distance.
       distance = 1e+4f;
@@ -289,10 +356,7 @@ Status DoCompress(const std::string& filename, const PackedPixelFile& ppf,
       distmap.Row(0)[0] = distance;
     }
     // Update stats
-    s->psnr +=
-        compressed->empty()
-            ? 0
-            : jxl::ComputePSNR(ib1, ib2, *JxlGetDefaultCms()) * input_pixels;
+    s->psnr += compressed->empty() ? 0 : psnr * input_pixels;
     JXL_ASSIGN_OR_RETURN(
         double pnorm,
         ComputeDistanceP(distmap, ButteraugliParams(), Args()->error_pnorm));
@@ -836,7 +900,16 @@ class Benchmark {
   static Status Run() {
     TrackingMemoryManager memory_manager{};
     bool ok = true;
-    {
+    if (Args()->load_seconds > 0) {
+      const StringVec methods = GetMethods();
+      const StringVec fnames = GetFilenames();
+      ThreadPoolInternal pool;
+      std::vector<PackedPixelFile> loaded_images =
+          LoadImages(fnames, pool.get());
+      if (!RunLoad(methods, fnames, loaded_images, memory_manager.get())) {
+        ok = false;
+      }
+    } else {
       const StringVec methods = GetMethods();
       const StringVec extra_metrics_names = GetExtraMetricsNames();
       const StringVec extra_metrics_commands = GetExtraMetricsCommands();
@@ -864,6 +937,7 @@ class Benchmark {
           fprintf(stderr, "There were error(s) in the benchmark.\n");
         }
       }
+      if (!SaveAndCompareResults(methods, fnames, tasks)) ok = false;
     }
 
     PrintStats(memory_manager);
@@ -937,6 +1011,166 @@ class Benchmark {
     }
   }
 
+  // Runs Args()->load_concurrency independent jobs at a time for
+  // Args()->load_seconds, like a server would: each job encodes the next image
+  // with the next method and decodes it. Prints the throughput sustained over
+  // the whole run, the percentiles of the job latencies and the peak memory
+  // use of the process.
+  static Status RunLoad(const StringVec& methods, const StringVec& fnames,
+                        const std::vector<PackedPixelFile>& loaded_images,
+                        JxlMemoryManager* memory_manager) {
+    const size_t num_hw_threads = std::thread::hardware_concurrency();
+    const size_t concurrency = Args()->load_concurrency != 0
+                                   ? Args()->load_concurrency
+                                   : std::max<size_t>(num_hw_threads, 1);
+    const size_t num_inner = NumInnerThreads(num_hw_threads, concurrency);
+    fprintf(stderr,
+            "Load test of %.1f s: %" PRIuS " concurrent jobs, %" PRIuS
+            " inner threads %s\n",
+            Args()->load_seconds, concurrency, num_inner,
+            Args()->load_shared_runner ? "shared by all jobs" : "per job");
+
+    // With decode_only, the inputs are the compressed files.
+    std::vector<std::vector<uint8_t>> inputs(fnames.size());
+    if (Args()->decode_only) {
+      for (size_t i = 0; i < fnames.size(); ++i) {
+        JXL_RETURN_IF_ERROR(ReadFile(fnames[i], &inputs[i]));
+      }
+    }
+
+    struct Worker {
+      // ImageCodec is only thread-compatible, so every worker has its own.
+      std::vector<ImageCodecPtr> codecs;
+      std::unique_ptr<ThreadPoolInternal> own_pool;
+      JxlSharedParallelRunnerPtr runner;
+      std::unique_ptr<ThreadPool> shared_pool;
+      ThreadPool* pool = nullptr;
+      std::vector<double> latencies;
+      size_t pixels = 0;
+      size_t errors = 0;
+    };
+    JxlSharedParallelRunnerPoolPtr runner_pool;
+    if (Args()->load_shared_runner) {
+      runner_pool = JxlSharedParallelRunnerPoolMake(nullptr, num_inner);
+      JXL_ENSURE(runner_pool);
+    }
+    std::vector<Worker> workers(concurrency);
+    for (Worker& w : workers) {
+      for (const std::string& method : methods) {
+        w.codecs.push_back(CreateImageCodec(method, memory_manager));
+      }
+      if (runner_pool) {
+        w.runner = JxlSharedParallelRunnerMake(
+            runner_pool.get(), JXL_SHARED_PARALLEL_RUNNER_DEFAULT_PRIORITY);
+        JXL_ENSURE(w.runner);
+        w.shared_pool = jxl::make_unique<ThreadPool>(JxlSharedParallelRunner,
+                                                     w.runner.get());
+        w.pool = w.shared_pool.get();
+      } else {
+        w.own_pool = jxl::make_unique<ThreadPoolInternal>(num_inner);
+        w.pool = w.own_pool->get();
+      }
+    }
+
+    const size_t num_kinds = fnames.size() * methods.size();
+    std::atomic<size_t> next_job{0};
+    const double start = jxl::Now();
+    const double end = start + Args()->load_seconds;
+    const auto run_worker = [&](Worker* w) {
+      std::vector<uint8_t> compressed;
+      while (jxl::Now() < end) {
+        const size_t job = next_job.fetch_add(1) % num_kinds;
+        const size_t idx_image = job / methods.size();
+        ImageCodec* codec = w->codecs[job % methods.size()].get();
+        const std::string& filename = fnames[idx_image];
+        SpeedStats speed_stats;
+        PackedPixelFile decoded;
+        const double job_start = jxl::Now();
+        if (Args()->decode_only) {
+          compressed = inputs[idx_image];
+        } else if (!codec->Compress(filename, loaded_images[idx_image],
+                                    w->pool, &compressed, &speed_stats)) {
+          ++w->errors;
+          continue;
+        }
+        if (!codec->Decompress(filename, Bytes(compressed), w->pool, &decoded,
+                               &speed_stats)) {
+          ++w->errors;
+          continue;
+        }
+        w->latencies.push_back(jxl::Now() - job_start);
+        w->pixels += decoded.info.xsize * decoded.info.ysize;
+      }
+    };
+    std::vector<std::thread> threads;
+    for (Worker& w : workers) threads.emplace_back(run_worker, &w);
+    for (std::thread& thread : threads) thread.join();
+    // Includes the jobs still running at the deadline.
+    const double elapsed = jxl::Now() - start;
+
+    std::vector<double> latencies;
+    size_t pixels = 0;
+    size_t errors = 0;
+    for (const Worker& w : workers) {
+      latencies.insert(latencies.end(), w.latencies.begin(),
+                       w.latencies.end());
+      pixels += w.pixels;
+      errors += w.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile_ms = [&](double p) {
+      if (latencies.empty()) return 0.0;
+      const size_t i = std::min(latencies.size() - 1,
+                                static_cast<size_t>(p * latencies.size()));
+      return latencies[i] * 1E3;
+    };
+    printf("Jobs: %" PRIuS " in %.3f s, %" PRIuS " errors\n",
+           latencies.size(), elapsed, errors);
+    printf("Throughput: %.3f MP/s, %.3f jobs/s\n", pixels * 1E-6 / elapsed,
+           latencies.size() / elapsed);
+    printf("Latency: p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+           percentile_ms(0.5), percentile_ms(0.99), percentile_ms(0.999),
+           latencies.empty() ? 0.0 : latencies.back() * 1E3);
+    const size_t peak_rss = PeakRss();
+    if (peak_rss != 0) {
+      printf("Peak RSS: %.3f MiB\n", peak_rss / (1024.0 * 1024.0));
+    }
+    if (errors != 0) return JXL_FAILURE("Errors in the load test");
+    return true;
+  }
+
+  // Writes the results of the tasks to --json_output and compares them with
+  // those of --baseline.
+  static Status SaveAndCompareResults(const StringVec& methods,
+                                      const StringVec& fnames,
+                                      const std::vector<Task>& tasks) {
+    if (Args()->json_output.empty() && Args()->baseline.empty()) return true;
+    std::vector<BenchmarkResult> results;
+    for (const Task& t : tasks) {
+      BenchmarkResult r;
+      r.codec = methods[t.idx_method];
+      r.image = fnames[t.idx_image];
+      r.pixels = t.stats.total_input_pixels;
+      r.compressed_size = t.stats.total_compressed_size;
+      r.errors = t.stats.total_errors;
+      r.encode_seconds = t.stats.encode_times;
+      r.decode_seconds = t.stats.decode_times;
+      results.push_back(std::move(r));
+    }
+    if (!Args()->json_output.empty()) {
+      JXL_RETURN_IF_ERROR(WriteBenchmarkResults(results, Args()->json_output));
+    }
+    if (!Args()->baseline.empty()) {
+      std::vector<BenchmarkResult> baseline;
+      JXL_RETURN_IF_ERROR(ReadBenchmarkResults(Args()->baseline, &baseline));
+      if (CompareBenchmarkResults(baseline, results,
+                                  Args()->baseline_min_slowdown) != 0) {
+        return JXL_FAILURE("Regressions compared to the baseline");
+      }
+    }
+    return true;
+  }
+
   static StringVec GetMethods() {
     StringVec methods = SplitString(Args()->codec, ',');
     for (auto it = methods.begin(); it != methods.end();) {
@@ -1129,9 +1363,17 @@ class Benchmark {
 
     std::vector<uint64_t> errors_thread;
 
+    // Opened by the thread that uses them, which is the only one they count.
+    std::vector<std::unique_ptr<PerfCounters>> perf_counters;
+
     const auto init = [&](const size_t num_threads) -> Status {
       // Reduce false sharing by only writing every 8th slot (64 bytes).
       errors_thread.resize(8 * num_threads);
+      if (!Args()->perf_counter_names.empty()) {
+        for (size_t i = 0; i < num_threads; ++i) {
+          perf_counters.emplace_back(jxl::make_unique<PerfCounters>());
+        }
+      }
       return true;
     };
     const auto do_task = [&](const uint32_t i, const size_t thread) -> Status {
@@ -1139,9 +1381,11 @@ class Benchmark {
       const PackedPixelFile& image = loaded_images[t.idx_image];
       t.image = &image;
       std::vector<uint8_t> compressed;
+      PerfCounters* thread_counters =
+          perf_counters.empty() ? nullptr : perf_counters[thread].get();
       if (!DoCompress(fnames[t.idx_image], image, extra_metrics_commands,
-                      t.codec.get(), inner_pools[thread]->get(), &compressed,
-                      &t.stats)) {
+                      t.codec.get(), inner_pools[thread]->get(),
+                      thread_counters, &compressed, &t.stats)) {
         t.stats.total_errors++;
       } else if (!printer.TaskDone(i, t)) {
         t.stats.total_errors++;
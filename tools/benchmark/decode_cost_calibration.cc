@@ -0,0 +1,222 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Calibrates the model of the decoding time that the encoder uses for
+// JXL_ENC_FRAME_SETTING_DECODING_BUDGET: encodes the given images with
+// settings that each add one feature of the model, decodes them on one
+// thread, and compares the measured times with the estimates of the encoder.
+// Prints, for each setting, the estimated and measured nanoseconds per pixel,
+// and the DecodeCostModel values that would have matched the measurements on
+// this machine.
+
+#include <jxl/encode.h>
+#include <jxl/stats.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/extras/dec/color_hints.h"
+#include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/jxl.h"
+#include "lib/extras/enc/jxl.h"
+#include "lib/extras/packed_image.h"
+#include "lib/extras/time.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/enc_decode_cost.h"
+#include "tools/file_io.h"
+
+namespace {
+
+using jxl::extras::JXLCompressParams;
+using jxl::extras::PackedPixelFile;
+
+struct Setting {
+  const char* name;
+  // 0 for lossless.
+  float distance;
+  std::vector<std::pair<JxlEncoderFrameSettingId, int64_t>> options;
+  std::vector<std::pair<JxlEncoderFrameSettingId, float>> float_options;
+  // Total estimated and measured decoding times.
+  double estimated_ns = 0;
+  double measured_ns = 0;
+};
+
+// Lossy settings keep to VarDCT without loop filters and patches, lossless
+// ones to a single gradient predictor without palettes, so that each of the
+// other settings only adds one feature. None of them encodes in streaming
+// mode, which has no estimate.
+std::vector<Setting> Settings() {
+  const std::vector<std::pair<JxlEncoderFrameSettingId, int64_t>> vardct = {
+      {JXL_ENC_FRAME_SETTING_EPF, 0},
+      {JXL_ENC_FRAME_SETTING_GABORISH, 0},
+      {JXL_ENC_FRAME_SETTING_PATCHES, 0},
+      {JXL_ENC_FRAME_SETTING_BUFFERING, 0}};
+  const std::vector<std::pair<JxlEncoderFrameSettingId, int64_t>> modular = {
+      {JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 5},
+      {JXL_ENC_FRAME_SETTING_PALETTE_COLORS, 0},
+      {JXL_ENC_FRAME_SETTING_PATCHES, 0},
+      {JXL_ENC_FRAME_SETTING_BUFFERING, 0}};
+  const std::vector<std::pair<JxlEncoderFrameSettingId, float>> no_tree = {
+      {JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT, 0.0f},
+      {JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GLOBAL_PERCENT, 0.0f},
+      {JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GROUP_PERCENT, 0.0f}};
+  std::vector<Setting> settings = {
+      {"vardct", 1.0f, vardct, {}},
+      {"gaborish", 1.0f, vardct, {}},
+      {"epf3", 1.0f, vardct, {}},
+      {"modular", 0.0f, modular, no_tree},
+      {"weighted", 0.0f, modular, no_tree},
+      {"tree", 0.0f, modular, no_tree},
+      {"lz77", 0.0f, modular, no_tree},
+  };
+  // Later options override the earlier ones.
+  settings[1].options.emplace_back(JXL_ENC_FRAME_SETTING_GABORISH, 1);
+  settings[2].options.emplace_back(JXL_ENC_FRAME_SETTING_EPF, 3);
+  settings[4].options.emplace_back(JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, 6);
+  settings[5].float_options[0].second = 50.0f;
+  settings[6].options.emplace_back(JXL_ENC_FRAME_SETTING_DECODING_SPEED, 3);
+  return settings;
+}
+
+bool Measure(const PackedPixelFile& ppf, size_t reps, Setting* setting) {
+  JXLCompressParams params;
+  params.distance = setting->distance;
+  for (const auto& option : setting->options) {
+    params.AddOption(option.first, option.second);
+  }
+  for (const auto& option : setting->float_options) {
+    params.AddFloatOption(option.first, option.second);
+  }
+  JxlEncoderStats* stats = JxlEncoderStatsCreate();
+  params.stats = stats;
+  std::vector<uint8_t> compressed;
+  const bool ok =
+      jxl::extras::EncodeImageJXL(params, ppf, nullptr, &compressed);
+  const size_t estimated_ns =
+      JxlEncoderStatsGet(stats, JXL_ENC_STAT_ESTIMATED_DECODE_NS);
+  JxlEncoderStatsDestroy(stats);
+  if (!ok) {
+    fprintf(stderr, "Failed to encode with %s\n", setting->name);
+    return false;
+  }
+
+  // Without a runner, the decoder runs on one thread.
+  jxl::extras::JXLDecompressParams dparams;
+  double best = 0;
+  for (size_t i = 0; i < reps; i++) {
+    PackedPixelFile decoded;
+    const double start = jxl::Now();
+    if (!jxl::extras::DecodeImageJXL(compressed.data(), compressed.size(),
+                                     dparams, nullptr, &decoded)) {
+      fprintf(stderr, "Failed to decode with %s\n", setting->name);
+      return false;
+    }
+    const double elapsed = jxl::Now() - start;
+    if (i == 0 || elapsed < best) best = elapsed;
+  }
+  setting->estimated_ns += estimated_ns;
+  setting->measured_ns += best * 1E9;
+  return true;
+}
+
+const Setting& Find(const std::vector<Setting>& settings, const char* name) {
+  return *std::find_if(settings.begin(), settings.end(), [&](const Setting& s) {
+    return std::string(s.name) == name;
+  });
+}
+
+// Prints the value of a model term that would have made the estimate of the
+// difference between `with` and `base` match the measurement.
+void PrintTerm(const char* term, float value, const Setting& base,
+               const Setting& with) {
+  const double estimated = with.estimated_ns - base.estimated_ns;
+  const double measured = with.measured_ns - base.measured_ns;
+  if (estimated <= 0) {
+    printf("%-22s %8.2f %8s\n", term, value, "n/a");
+    return;
+  }
+  printf("%-22s %8.2f %8.2f\n", term, value, value * measured / estimated);
+}
+
+// Same for a term that the setting `with` adds to the conversion of the
+// pixels to the output color space.
+void PrintBaseTerm(const char* term, float value, const Setting& with,
+                   double pixel_part_ns) {
+  Setting base = with;
+  base.estimated_ns = base.measured_ns = pixel_part_ns;
+  PrintTerm(term, value, base, with);
+}
+
+int DecodeCostCalibration(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s [--reps=N] image...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t reps = 3;
+  std::vector<Setting> settings = Settings();
+  double pixels = 0;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 7, "--reps=") == 0) {
+      reps = std::max<size_t>(1, strtoull(arg.c_str() + 7, nullptr, 10));
+      continue;
+    }
+    std::vector<uint8_t> bytes;
+    PackedPixelFile ppf;
+    if (!jpegxl::tools::ReadFile(arg, &bytes) ||
+        !jxl::extras::DecodeBytes(jxl::Bytes(bytes),
+                                  jxl::extras::ColorHints(), &ppf)) {
+      fprintf(stderr, "Failed to read %s\n", arg.c_str());
+      return EXIT_FAILURE;
+    }
+    for (Setting& setting : settings) {
+      if (!Measure(ppf, reps, &setting)) return EXIT_FAILURE;
+    }
+    pixels += static_cast<double>(ppf.xsize()) * ppf.ysize();
+  }
+  if (pixels == 0) {
+    fprintf(stderr, "No images given\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%-10s %13s %13s %7s\n", "setting", "est ns/px", "meas ns/px",
+         "ratio");
+  for (const Setting& setting : settings) {
+    printf("%-10s %13.2f %13.2f %7.3f\n", setting.name,
+           setting.estimated_ns / pixels, setting.measured_ns / pixels,
+           setting.measured_ns / setting.estimated_ns);
+  }
+
+  // The conversion to the output color space is not calibrated, since every
+  // setting has it.
+  const jxl::DecodeCostModel model;
+  const double pixel_part_ns = model.pixel_ns * pixels;
+  printf("\n%-22s %8s %8s\n", "DecodeCostModel", "current", "fitted");
+  PrintBaseTerm("vardct_pixel_ns", model.vardct_pixel_ns,
+                Find(settings, "vardct"), pixel_part_ns);
+  PrintTerm("gaborish_ns", model.gaborish_ns, Find(settings, "vardct"),
+            Find(settings, "gaborish"));
+  PrintTerm("epf_pass_ns", model.epf_pass_ns, Find(settings, "vardct"),
+            Find(settings, "epf3"));
+  PrintBaseTerm("modular_sample_ns", model.modular_sample_ns,
+                Find(settings, "modular"), pixel_part_ns);
+  PrintTerm("weighted_predictor_ns", model.weighted_predictor_ns,
+            Find(settings, "modular"), Find(settings, "weighted"));
+  PrintTerm("tree_level_ns", model.tree_level_ns, Find(settings, "modular"),
+            Find(settings, "tree"));
+  PrintTerm("lz77_sample_ns", model.lz77_sample_ns, Find(settings, "modular"),
+            Find(settings, "lz77"));
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) { return DecodeCostCalibration(argc, argv); }
@@ -8,6 +8,7 @@
 #include <jxl/memory_manager.h>
 #include <jxl/types.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -58,7 +59,7 @@ Status RunButteraugli(const char* pathname1, const char* pathname2,
                       const std::string& distmap_filename,
                       const std::string& raw_distmap_filename,
                       const std::string& colorspace_hint, double p,
-                      float intensity_target) {
+                      float intensity_target, size_t tile_dim) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
   jxl::extras::ColorHints color_hints;
   if (!colorspace_hint.empty()) {
@@ -110,6 +111,7 @@ Status RunButteraugli(const char* pathname1, const char* pathname2,
   }
   const JxlCmsInterface& cms = *JxlGetDefaultCms();
   JxlButteraugliComparator comparator(butteraugli_params, cms);
+  comparator.SetTiled(tile_dim, pool.get());
   float distance;
   JXL_RETURN_IF_ERROR(ComputeScore(io1.Main(), io2.Main(), &comparator, cms,
                                    &distance, &distmap, pool.get(),
@@ -151,11 +153,14 @@ int main(int argc, char** argv) {
             "  [--intensity_target <intensity_target>]\n"
             "  [--colorspace <colorspace_hint>]\n"
             "  [--pnorm <pth norm>]\n"
+            "  [--tile_dim <tile_dim>]\n"
             "NOTE: images get converted to linear sRGB for butteraugli. Images"
             " without attached profiles (such as ppm or pfm) are interpreted"
             " as nonlinear sRGB. The hint format is RGB_D65_SRG_Rel_Lin for"
             " linear sRGB. Intensity target is viewing conditions screen nits"
-            ", defaults to 80 for SDR input.\n",
+            ", defaults to 80 for SDR input. A nonzero tile dimension compares"
+            " tiles of that size in parallel, which bounds the memory use for"
+            " large images.\n",
             argv[0]);
     return 1;
   }
@@ -164,6 +169,7 @@ int main(int argc, char** argv) {
   std::string colorspace;
   double p = 3;
   float intensity_target = 0.f;
+  size_t tile_dim = 0;
   for (int i = 3; i < argc; i++) {
     if (std::string(argv[i]) == "--distmap" && i + 1 < argc) {
       distmap = argv[++i];
@@ -180,6 +186,8 @@ int main(int argc, char** argv) {
         fprintf(stderr, "Failed to parse pnorm \"%s\".\n", argv[i]);
         return 1;
       }
+    } else if (std::string(argv[i]) == "--tile_dim" && i + 1 < argc) {
+      tile_dim = std::stoul(std::string(argv[++i]));
     } else {
       fprintf(stderr, "Unrecognized flag \"%s\".\n", argv[i]);
       return 1;
@@ -187,6 +195,6 @@ int main(int argc, char** argv) {
   }
 
   Status result = RunButteraugli(argv[1], argv[2], distmap, raw_distmap,
-                                 colorspace, p, intensity_target);
+                                 colorspace, p, intensity_target, tile_dim);
   return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -3,6 +3,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/thread_parallel_runner.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +22,7 @@
 #include "tools/cmdline.h"
 #include "tools/file_io.h"
 #include "tools/speed_stats.h"
+#include "tools/thread_pool_internal.h"
 
 namespace jpegxl {
 namespace tools {
@@ -84,6 +86,18 @@ struct Args {
         '\0', "noadaptive_quantization", "Disable adaptive quantization.",
         &settings.use_adaptive_quantization, &SetBooleanFalse, 1);
 
+    cmdline->AddOptionFlag(
+        '\0', "fast_adaptive_quantization",
+        "Compute an approximate adaptive quantization field, which is faster\n"
+        "    but gives slightly larger or lower quality outputs.",
+        &settings.fast_adaptive_quantization, &SetBooleanTrue, 2);
+
+    cmdline->AddOptionFlag(
+        '\0', "search_scan_script",
+        "Choose the progressive scans of each component with the smallest\n"
+        "    estimated size, instead of those of the progressive level.",
+        &settings.search_scan_script, &SetBooleanTrue, 2);
+
     cmdline->AddOptionFlag(
         '\0', "fixed_code",
         "Disable Huffman code optimization. Must be used together with -p 0.",
@@ -96,6 +110,11 @@ struct Args {
         "    Mutually exclusive with --distance and --quality.",
         &settings.target_size, &ParseUnsigned, 2);
 
+    cmdline->AddOptionValue('\0', "num_threads", "N",
+                            "Number of worker threads (-1 == use machine "
+                            "default, 0 == do not use multithreading).",
+                            &num_threads, &ParseSigned, 1);
+
     cmdline->AddOptionValue('\0', "num_reps", "N",
                             "How many times to compress. (For benchmarking).",
                             &num_reps, &ParseUnsigned, 1);
@@ -116,6 +135,7 @@ struct Args {
   jxl::extras::JpegSettings settings;
   int quality = 90;
   size_t num_reps = 1;
+  int32_t num_threads = -1;
   bool quiet = false;
   bool verbose = false;
   // References (ids) of specific options to check if they were matched.
@@ -142,6 +162,10 @@ bool ValidateArgs(const Args& args) {
     fprintf(stderr, "Invalid --progressive_level argument\n");
     return false;
   }
+  if (args.num_threads < -1) {
+    fprintf(stderr, "Invalid --num_threads argument\n");
+    return false;
+  }
   if (settings.progressive_level > 0 && !settings.optimize_coding) {
     fprintf(stderr, "--fixed_code must be used together with -p 0\n");
     return false;
@@ -225,11 +249,18 @@ int CJpegliMain(int argc, const char* argv[]) {
             s.optimize_coding ? "OPT" : "FIX");
   }
 
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  if (args.num_threads > -1) {
+    num_worker_threads = args.num_threads;
+  }
+  ThreadPoolInternal pool(num_worker_threads);
+
   jpegxl::tools::SpeedStats stats;
   std::vector<uint8_t> jpeg_bytes;
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
     const double t0 = jxl::Now();
-    if (!jxl::extras::EncodeJpeg(ppf, args.settings, nullptr, &jpeg_bytes)) {
+    if (!jxl::extras::EncodeJpeg(ppf, args.settings, pool.get(),
+                                 &jpeg_bytes)) {
       fprintf(stderr, "jpegli encoding failed\n");
       return EXIT_FAILURE;
     }
@@ -22,30 +22,38 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "lib/extras/dec/color_hints.h"
 #include "lib/extras/dec/decode.h"
+#include "lib/extras/dec/exr.h"
 #include "lib/extras/dec/pnm.h"
 #include "lib/extras/enc/jxl.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
 #include "lib/jxl/base/c_callback_support.h"
 #include "lib/jxl/base/common.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/exif.h"
 #include "lib/jxl/base/override.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/span.h"
 #include "lib/jxl/base/status.h"
 #include "tools/args.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
 #include "tools/codec_config.h"
 #include "tools/file_io.h"
+#include "tools/input_bytes.h"
 #include "tools/speed_stats.h"
 
 namespace jpegxl {
@@ -146,11 +154,12 @@ struct CompressArgs {
                            &progressive, &SetBooleanTrue, 1);
 
     cmdline->AddOptionValue(
-        '\0', "group_order", "0|1",
+        '\0', "group_order", "0|1|2",
         "Order in which groups are stored in the codestream for progressive "
         "rendering, default = 0.\n"
-        "    0 = scanline order. 1 = center-first order.",
-        &group_order, &ParseOverride, 1);
+        "    0 = scanline order. 1 = center-first order.\n"
+        "    2 = saliency-first order, from the adaptive quantization.",
+        &group_order, &ParseInt64, 1);
 
     cmdline->AddOptionValue(
         '\0', "container", "0|1",
@@ -187,6 +196,29 @@ struct CompressArgs {
                             "multithreading.",
                             &num_threads, &ParseSigned, 1);
 
+    cmdline->AddOptionValue(
+        '\0', "frames_in_flight", "N",
+        "Number of frames of an animation encoded concurrently, default = 1.\n"
+        "    Speeds up animations of small frames, which have little "
+        "parallelism each, at the cost of the memory of N frames.",
+        &frames_in_flight, &ParseUnsigned, 1);
+
+    cmdline->AddOptionFlag(
+        '\0', "crop_unchanged",
+        "Encode each frame of an animation as only the rect that changed "
+        "since the previous frame, e.g. for screen recordings.",
+        &crop_unchanged, &SetBooleanTrue, 1);
+
+    cmdline->AddOptionFlag(
+        '\0', "batch",
+        "Encode many files in one run: INPUT is a directory or a text file "
+        "with one input path per line, and OUTPUT a pattern in which %s is "
+        "replaced by the name of each input without its extension, e.g. "
+        "'out/%s.jxl'.\n"
+        "    The files are encoded one after the other with the same threads, "
+        "while the next one is read.",
+        &batch, &SetBooleanTrue, 1);
+
     cmdline->AddOptionValue('\0', "photon_noise_iso", "ISO_FILM_SPEED",
                             "Add noise to the image emulating photographic "
                             "film or sensor noise, default = 0.\n"
@@ -238,10 +270,12 @@ struct CompressArgs {
                             "The codestream level.", &codestream_level,
                             &ParseInt64, 2);
 
-    cmdline->AddOptionValue('\0', "faster_decoding", "0..4",
+    cmdline->AddOptionValue('\0', "faster_decoding", "0..5",
                             "Higher values improve decode speed "
                             "at the expense of quality or density, "
-                            "default = 0.",
+                            "default = 0.\n"
+                            "    5 = only small DCTs and no loop filters, "
+                            "which bounds the decoding work per pixel.",
                             &faster_decoding, &ParseUnsigned, 2);
 
     cmdline->AddOptionValue('\0', "premultiply", "-1|0|1",
@@ -349,7 +383,7 @@ struct CompressArgs {
 
     cmdline->AddOptionFlag('\0', "streaming_input",
                            "Enable streaming processing of the input file, "
-                           "supported for PPM and PGM input.",
+                           "supported for PGM, PPM, PAM, PFM and EXR input.",
                            &streaming_input, &SetBooleanTrue, 3);
 
     cmdline->AddOptionFlag('\0', "streaming_output",
@@ -372,6 +406,27 @@ struct CompressArgs {
         "Default = encoder chooses.",
         &patches, &ParseOverride, 3);
 
+    cmdline->AddOptionValue(
+        '\0', "approximate_butteraugli", "0|1",
+        "Compare large images approximately in the butteraugli iterations of "
+        "effort 8 and above, which is faster but less exact. 0 = disable "
+        "(default). 1 = enable.",
+        &approximate_butteraugli, &ParseOverride, 3);
+
+    cmdline->AddOptionValue(
+        '\0', "reuse_entropy_coding", "0|1",
+        "Reuse the coefficient orders and AC histogram clustering of the "
+        "previous frame of an animation for similar lossy frames, which is "
+        "faster but may be larger. 0 = disable (default). 1 = enable.",
+        &reuse_entropy_coding, &ParseOverride, 3);
+
+    cmdline->AddOptionValue(
+        '\0', "reuse_modular_tree", "0|1",
+        "Reuse the MA trees and histograms of the first lossless modular frame "
+        "for the next ones, which is faster but may be larger. "
+        "0 = disable (default). 1 = enable.",
+        &reuse_modular_tree, &ParseOverride, 3);
+
     cmdline->AddOptionValue(
         '\0', "frame_indexing", "INDICES",
         // TODO(tfish): Add a more convenient vanilla alternative.
@@ -473,6 +528,7 @@ struct CompressArgs {
   jxl::Override container = jxl::Override::kDefault;
   bool quiet = false;
   bool disable_output = false;
+  bool batch = false;
 
   jxl::Override print_profile = jxl::Override::kDefault;
   bool streaming_input = false;
@@ -487,6 +543,8 @@ struct CompressArgs {
   size_t override_bitdepth = 0;
   size_t num_reps = 1;
   int32_t num_threads = -1;
+  size_t frames_in_flight = 1;
+  bool crop_unchanged = false;
   float intensity_target = 0;
 
   // Whether to perform lossless transcoding with kVarDCT or kJPEG encoding.
@@ -511,8 +569,11 @@ struct CompressArgs {
   jxl::Override keep_invisible = jxl::Override::kDefault;
   jxl::Override dots = jxl::Override::kDefault;
   jxl::Override patches = jxl::Override::kDefault;
+  jxl::Override approximate_butteraugli = jxl::Override::kDefault;
+  jxl::Override reuse_entropy_coding = jxl::Override::kDefault;
+  jxl::Override reuse_modular_tree = jxl::Override::kDefault;
   jxl::Override gaborish = jxl::Override::kDefault;
-  jxl::Override group_order = jxl::Override::kDefault;
+  int64_t group_order = -1;
   jxl::Override compress_boxes = jxl::Override::kDefault;
   jxl::Override noise = jxl::Override::kDefault;
 
@@ -608,7 +669,7 @@ void PrintMode(jxl::extras::PackedPixelFile& ppf, const double decode_mps,
   cmdline.VerbosePrintf(0, "]\n");
 }
 
-bool IsJPG(const std::vector<uint8_t>& image_data) {
+bool IsJPG(jxl::Span<const uint8_t> image_data) {
   return (image_data.size() >= 2 && image_data[0] == 0xFF &&
           image_data[1] == 0xD8);
 }
@@ -617,7 +678,7 @@ using flag_check_fn = std::function<std::string(int64_t)>;
 using flag_check_float_fn = std::function<std::string(float)>;
 
 template <typename T>
-void ProcessFlag(
+bool ProcessFlag(
     const char* flag_name, T flag_value,
     JxlEncoderFrameSettingId encoder_option,
     jxl::extras::JXLCompressParams* params,
@@ -626,10 +687,11 @@ void ProcessFlag(
   if (!error.empty()) {
     std::cerr << "Invalid flag value for --" << flag_name << ": " << error
               << "\n";
-    exit(EXIT_FAILURE);
+    return false;
   }
   params->options.emplace_back(
       jxl::extras::JXLOption(encoder_option, flag_value, 0));
+  return true;
 }
 
 void ProcessBoolFlag(jxl::Override flag_value,
@@ -641,7 +703,7 @@ void ProcessBoolFlag(jxl::Override flag_value,
   }
 }
 
-void SetDistanceFromFlags(CommandLineParser* cmdline, CompressArgs* args,
+bool SetDistanceFromFlags(CommandLineParser* cmdline, CompressArgs* args,
                           jxl::extras::JXLCompressParams* params,
                           const jxl::extras::Codec& codec) {
   bool distance_set = cmdline->GetOption(args->opt_distance_id)->matched();
@@ -651,17 +713,17 @@ void SetDistanceFromFlags(CommandLineParser* cmdline, CompressArgs* args,
   if ((distance_set && (args->distance != 0.0)) && args->lossless_jpeg) {
     std::cerr << "Must not set non-zero distance in combination with "
                  "--lossless_jpeg=1, which is set by default.\n";
-    exit(EXIT_FAILURE);
+    return false;
   }
   if ((quality_set && (args->quality != 100)) && args->lossless_jpeg) {
     std::cerr << "Must not set quality below 100 in combination with "
                  "--lossless_jpeg=1, which is set by default.\n";
-    exit(EXIT_FAILURE);
+    return false;
   }
   if (quality_set) {
     if (distance_set) {
       std::cerr << "Must not set both --distance and --quality.\n";
-      exit(EXIT_FAILURE);
+      return false;
     }
     args->distance = JxlEncoderDistanceFromQuality(args->quality);
     distance_set = true;
@@ -676,9 +738,10 @@ void SetDistanceFromFlags(CommandLineParser* cmdline, CompressArgs* args,
   }
   params->distance = args->distance;
   params->alpha_distance = alpha_distance_set ? args->alpha_distance : 0;
+  return true;
 }
 
-void ProcessFlags(const jxl::extras::Codec codec,
+bool ProcessFlags(const jxl::extras::Codec codec,
                   const jxl::extras::PackedPixelFile& ppf,
                   const std::vector<uint8_t>* jpeg_bytes,
                   CommandLineParser* cmdline, CompressArgs* args,
@@ -689,8 +752,23 @@ void ProcessFlags(const jxl::extras::Codec codec,
                   params);
   ProcessBoolFlag(args->dots, JXL_ENC_FRAME_SETTING_DOTS, params);
   ProcessBoolFlag(args->patches, JXL_ENC_FRAME_SETTING_PATCHES, params);
+  ProcessBoolFlag(args->approximate_butteraugli,
+                  JXL_ENC_FRAME_SETTING_APPROXIMATE_BUTTERAUGLI, params);
+  ProcessBoolFlag(args->reuse_entropy_coding,
+                  JXL_ENC_FRAME_SETTING_REUSE_ENTROPY_CODING, params);
+  ProcessBoolFlag(args->reuse_modular_tree,
+                  JXL_ENC_FRAME_SETTING_REUSE_MODULAR_TREE, params);
   ProcessBoolFlag(args->gaborish, JXL_ENC_FRAME_SETTING_GABORISH, params);
-  ProcessBoolFlag(args->group_order, JXL_ENC_FRAME_SETTING_GROUP_ORDER, params);
+  if (args->group_order != -1) {
+    if (!ProcessFlag("group_order", args->group_order,
+                     JXL_ENC_FRAME_SETTING_GROUP_ORDER, params,
+                     [](int64_t x) -> std::string {
+                       return (x < 0 || x > 2) ? "Valid values are 0, 1 and 2."
+                                               : "";
+                     })) {
+      return false;
+    }
+  }
   ProcessBoolFlag(args->noise, JXL_ENC_FRAME_SETTING_NOISE, params);
 
   params->allow_expert_options = args->allow_expert_options;
@@ -705,56 +783,76 @@ void ProcessFlags(const jxl::extras::Codec codec,
         if (must_be_all_zeros) {
           std::cerr << "Invalid --frame_indexing. If the first character is "
                        "'0', all must be '0'.\n";
-          exit(EXIT_FAILURE);
+          return false;
         }
       } else if (c != '0') {
         std::cerr << "Invalid --frame_indexing. Must match the pattern "
                      "'^(0*|1[01]*)$'.\n";
-        exit(EXIT_FAILURE);
+        return false;
       }
     }
   }
 
-  ProcessFlag(
-      "effort", static_cast<int64_t>(args->effort),
-      JXL_ENC_FRAME_SETTING_EFFORT, params, [args](int64_t x) -> std::string {
-        if (args->allow_expert_options) {
-          return (1 <= x && x <= 11) ? "" : "Valid range is {1, 2, ..., 11}.";
-        } else {
-          return (1 <= x && x <= 10) ? "" : "Valid range is {1, 2, ..., 10}.";
-        }
-      });
-  ProcessFlag("brotli_effort", static_cast<int64_t>(args->brotli_effort),
-              JXL_ENC_FRAME_SETTING_BROTLI_EFFORT, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 11)
-                           ? ""
-                           : "Valid range is {-1, 0, 1, ..., 11}.";
-              });
-  ProcessFlag(
-      "epf", args->epf, JXL_ENC_FRAME_SETTING_EPF, params,
-      [](int64_t x) -> std::string {
-        return (-1 <= x && x <= 3) ? "" : "Valid range is {-1, 0, 1, 2, 3}.\n";
-      });
-  ProcessFlag("faster_decoding", static_cast<int64_t>(args->faster_decoding),
-              JXL_ENC_FRAME_SETTING_DECODING_SPEED, params,
-              [](int64_t x) -> std::string {
-                return (0 <= x && x <= 4) ? ""
-                                          : "Valid range is {0, 1, 2, 3, 4}.\n";
-              });
-  ProcessFlag("resampling", args->resampling, JXL_ENC_FRAME_SETTING_RESAMPLING,
-              params, [](int64_t x) -> std::string {
-                return (x == -1 || x == 1 || x == 2 || x == 4 || x == 8)
-                           ? ""
-                           : "Valid values are {-1, 1, 2, 4, 8}.\n";
-              });
-  ProcessFlag("ec_resampling", args->ec_resampling,
-              JXL_ENC_FRAME_SETTING_EXTRA_CHANNEL_RESAMPLING, params,
-              [](int64_t x) -> std::string {
-                return (x == -1 || x == 1 || x == 2 || x == 4 || x == 8)
-                           ? ""
-                           : "Valid values are {-1, 1, 2, 4, 8}.\n";
-              });
+  if (!ProcessFlag("effort", static_cast<int64_t>(args->effort),
+                   JXL_ENC_FRAME_SETTING_EFFORT, params,
+                   [args](int64_t x) -> std::string {
+                     if (args->allow_expert_options) {
+                       return (1 <= x && x <= 11)
+                                  ? ""
+                                  : "Valid range is {1, 2, ..., 11}.";
+                     } else {
+                       return (1 <= x && x <= 10)
+                                  ? ""
+                                  : "Valid range is {1, 2, ..., 10}.";
+                     }
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("brotli_effort", static_cast<int64_t>(args->brotli_effort),
+                   JXL_ENC_FRAME_SETTING_BROTLI_EFFORT, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 11)
+                                ? ""
+                                : "Valid range is {-1, 0, 1, ..., 11}.";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("epf", args->epf, JXL_ENC_FRAME_SETTING_EPF, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 3)
+                                ? ""
+                                : "Valid range is {-1, 0, 1, 2, 3}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("faster_decoding",
+                   static_cast<int64_t>(args->faster_decoding),
+                   JXL_ENC_FRAME_SETTING_DECODING_SPEED, params,
+                   [](int64_t x) -> std::string {
+                     return (0 <= x && x <= 4)
+                                ? ""
+                                : "Valid range is {0, 1, 2, 3, 4}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("resampling", args->resampling,
+                   JXL_ENC_FRAME_SETTING_RESAMPLING, params,
+                   [](int64_t x) -> std::string {
+                     return (x == -1 || x == 1 || x == 2 || x == 4 || x == 8)
+                                ? ""
+                                : "Valid values are {-1, 1, 2, 4, 8}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("ec_resampling", args->ec_resampling,
+                   JXL_ENC_FRAME_SETTING_EXTRA_CHANNEL_RESAMPLING, params,
+                   [](int64_t x) -> std::string {
+                     return (x == -1 || x == 1 || x == 2 || x == 4 || x == 8)
+                                ? ""
+                                : "Valid values are {-1, 1, 2, 4, 8}.\n";
+                   })) {
+    return false;
+  }
   ProcessFlag("photon_noise_iso", args->photon_noise_iso,
               JXL_ENC_FRAME_SETTING_PHOTON_NOISE, params);
   ProcessFlag("already_downsampled",
@@ -762,40 +860,49 @@ void ProcessFlags(const jxl::extras::Codec codec,
               JXL_ENC_FRAME_SETTING_ALREADY_DOWNSAMPLED, params);
   if (args->already_downsampled) params->already_downsampled = args->resampling;
 
-  SetDistanceFromFlags(cmdline, args, params, codec);
+  if (!SetDistanceFromFlags(cmdline, args, params, codec)) {
+    return false;
+  }
 
-  if (args->group_order != jxl::Override::kOn &&
+  if (args->group_order != 1 &&
       (args->center_x != -1 || args->center_y != -1)) {
     std::cerr << "Invalid flag combination. Setting --center_x or --center_y "
               << "requires setting --group_order=1.\n";
-    exit(EXIT_FAILURE);
+    return false;
+  }
+  if (!ProcessFlag("center_x", args->center_x,
+                   JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X, params,
+                   [](int64_t x) -> std::string {
+                     if (x < -1) {
+                       return "Valid values are: -1 or [0 .. xsize).";
+                     }
+                     return "";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("center_y", args->center_y,
+                   JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_Y, params,
+                   [](int64_t x) -> std::string {
+                     if (x < -1) {
+                       return "Valid values are: -1 or [0 .. ysize).";
+                     }
+                     return "";
+                   })) {
+    return false;
   }
-  ProcessFlag("center_x", args->center_x,
-              JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_X, params,
-              [](int64_t x) -> std::string {
-                if (x < -1) {
-                  return "Valid values are: -1 or [0 .. xsize).";
-                }
-                return "";
-              });
-  ProcessFlag("center_y", args->center_y,
-              JXL_ENC_FRAME_SETTING_GROUP_ORDER_CENTER_Y, params,
-              [](int64_t x) -> std::string {
-                if (x < -1) {
-                  return "Valid values are: -1 or [0 .. ysize).";
-                }
-                return "";
-              });
 
   // Progressive/responsive mode settings.
   bool responsive_set = cmdline->GetOption(args->opt_responsive_id)->matched();
 
-  ProcessFlag("progressive_dc", args->progressive_dc,
-              JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 2) ? ""
-                                           : "Valid range is {-1, 0, 1, 2}.\n";
-              });
+  if (!ProcessFlag("progressive_dc", args->progressive_dc,
+                   JXL_ENC_FRAME_SETTING_PROGRESSIVE_DC, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 2)
+                                ? ""
+                                : "Valid range is {-1, 0, 1, 2}.\n";
+                   })) {
+    return false;
+  }
   ProcessFlag("progressive_ac", static_cast<int64_t>(args->progressive_ac),
               JXL_ENC_FRAME_SETTING_PROGRESSIVE_AC, params);
 
@@ -814,47 +921,57 @@ void ProcessFlags(const jxl::extras::Codec codec,
   }
 
   // Modular mode related.
-  ProcessFlag("modular_group_size", args->modular_group_size,
-              JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 3)
-                           ? ""
-                           : "Invalid --modular_group_size. Valid "
-                             "range is {-1, 0, 1, 2, 3}.\n";
-              });
-  ProcessFlag("modular_predictor", args->modular_predictor,
-              JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 15)
-                           ? ""
-                           : "Invalid --modular_predictor. Valid "
-                             "range is {-1, 0, 1, ..., 15}.\n";
-              });
-  ProcessFlag("modular_colorspace", args->modular_colorspace,
-              JXL_ENC_FRAME_SETTING_MODULAR_COLOR_SPACE, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 41)
-                           ? ""
-                           : "Invalid --modular_colorspace. Valid range is "
-                             "{-1, 0, 1, ..., 41}.\n";
-              });
-  ProcessFlag("modular_ma_tree_learning_percent",
-              args->modular_ma_tree_learning_percent,
-              JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT, params,
-              [](float x) -> std::string {
-                return -1 <= x && x <= 100
-                           ? ""
-                           : "Invalid --modular_ma_tree_learning_percent, Valid"
-                             "rang is [-1, 100].\n";
-              });
-  ProcessFlag("modular_nb_prev_channels", args->modular_nb_prev_channels,
-              JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS, params,
-              [](int64_t x) -> std::string {
-                return (-1 <= x && x <= 11)
-                           ? ""
-                           : "Invalid --modular_nb_prev_channels. Valid "
-                             "range is {-1, 0, 1, ..., 11}.\n";
-              });
+  if (!ProcessFlag("modular_group_size", args->modular_group_size,
+                   JXL_ENC_FRAME_SETTING_MODULAR_GROUP_SIZE, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 3)
+                                ? ""
+                                : "Invalid --modular_group_size. Valid "
+                                  "range is {-1, 0, 1, 2, 3}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_predictor", args->modular_predictor,
+                   JXL_ENC_FRAME_SETTING_MODULAR_PREDICTOR, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 15)
+                                ? ""
+                                : "Invalid --modular_predictor. Valid "
+                                  "range is {-1, 0, 1, ..., 15}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_colorspace", args->modular_colorspace,
+                   JXL_ENC_FRAME_SETTING_MODULAR_COLOR_SPACE, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 41)
+                                ? ""
+                                : "Invalid --modular_colorspace. Valid range "
+                                  "is {-1, 0, 1, ..., 41}.\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_ma_tree_learning_percent",
+                   args->modular_ma_tree_learning_percent,
+                   JXL_ENC_FRAME_SETTING_MODULAR_MA_TREE_LEARNING_PERCENT,
+                   params, [](float x) -> std::string {
+                     return -1 <= x && x <= 100
+                                ? ""
+                                : "Invalid --modular_ma_tree_learning_percent, "
+                                  "Valid rang is [-1, 100].\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_nb_prev_channels", args->modular_nb_prev_channels,
+                   JXL_ENC_FRAME_SETTING_MODULAR_NB_PREV_CHANNELS, params,
+                   [](int64_t x) -> std::string {
+                     return (-1 <= x && x <= 11)
+                                ? ""
+                                : "Invalid --modular_nb_prev_channels. Valid "
+                                  "range is {-1, 0, 1, ..., 11}.\n";
+                   })) {
+    return false;
+  }
   if (args->modular_lossy_palette) {
     if (args->progressive || args->qprogressive_ac) {
       fprintf(stderr,
@@ -866,38 +983,49 @@ void ProcessFlags(const jxl::extras::Codec codec,
   ProcessFlag("modular_lossy_palette",
               static_cast<int64_t>(args->modular_lossy_palette),
               JXL_ENC_FRAME_SETTING_LOSSY_PALETTE, params);
-  ProcessFlag("modular_palette_colors", args->modular_palette_colors,
-              JXL_ENC_FRAME_SETTING_PALETTE_COLORS, params,
-              [](int64_t x) -> std::string {
-                return -1 <= x ? ""
-                               : "Invalid --modular_palette_colors, must "
-                                 "be -1 or non-negative\n";
-              });
-  ProcessFlag("modular_channel_colors_global_percent",
-              args->modular_channel_colors_global_percent,
-              JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GLOBAL_PERCENT, params,
-              [](float x) -> std::string {
-                return (-1 <= x && x <= 100)
-                           ? ""
-                           : "Invalid --modular_channel_colors_global_percent. "
-                             "Valid "
-                             "range is [-1, 100].\n";
-              });
-  ProcessFlag("modular_channel_colors_group_percent",
-              args->modular_channel_colors_group_percent,
-              JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GROUP_PERCENT, params,
-              [](float x) -> std::string {
-                return (-1 <= x && x <= 100)
-                           ? ""
-                           : "Invalid --modular_channel_colors_group_percent. "
-                             "Valid "
-                             "range is [-1, 100].\n";
-              });
+  if (!ProcessFlag("modular_palette_colors", args->modular_palette_colors,
+                   JXL_ENC_FRAME_SETTING_PALETTE_COLORS, params,
+                   [](int64_t x) -> std::string {
+                     return -1 <= x ? ""
+                                    : "Invalid --modular_palette_colors, must "
+                                      "be -1 or non-negative\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_channel_colors_global_percent",
+                   args->modular_channel_colors_global_percent,
+                   JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GLOBAL_PERCENT, params,
+                   [](float x) -> std::string {
+                     return (-1 <= x && x <= 100)
+                                ? ""
+                                : "Invalid "
+                                  "--modular_channel_colors_global_percent. "
+                                  "Valid range is [-1, 100].\n";
+                   })) {
+    return false;
+  }
+  if (!ProcessFlag("modular_channel_colors_group_percent",
+                   args->modular_channel_colors_group_percent,
+                   JXL_ENC_FRAME_SETTING_CHANNEL_COLORS_GROUP_PERCENT, params,
+                   [](float x) -> std::string {
+                     return (-1 <= x && x <= 100)
+                                ? ""
+                                : "Invalid "
+                                  "--modular_channel_colors_group_percent. "
+                                  "Valid range is [-1, 100].\n";
+                   })) {
+    return false;
+  }
 
   if (args->num_threads < -1) {
     std::cerr
         << "Invalid flag value for --num_threads: must be -1, 0 or positive.\n";
-    exit(EXIT_FAILURE);
+    return false;
+  }
+  if (args->frames_in_flight == 0) {
+    std::cerr
+        << "Invalid flag value for --frames_in_flight: must be positive.\n";
+    return false;
   }
   // JPEG specific options.
   if (jpeg_bytes) {
@@ -923,6 +1051,7 @@ void ProcessFlags(const jxl::extras::Codec codec,
   params->premultiply = args->premultiply;
   params->compress_boxes = args->compress_boxes != jxl::Override::kOff;
   params->upsampling_mode = args->upsampling_mode;
+  params->crop_unchanged_regions = args->crop_unchanged;
 
   // If a metadata field is set to an empty value, it is stripped.
   // Make sure we also strip it when the input image is read with AddJPEGFrame
@@ -936,9 +1065,14 @@ void ProcessFlags(const jxl::extras::Codec codec,
         }
         return true;
       });
+  return true;
 }
 
+// Writes the output of the encoder to a file on a background thread, so that
+// encoding goes on while the previous buffers are written.
 struct JxlOutputProcessor {
+  ~JxlOutputProcessor() { (void)Finish(); }
+
   bool SetOutputPath(const std::string& path) {
     outfile = jxl::make_unique<FileWrapper>(path, "wb");
     if (!*outfile) {
@@ -948,9 +1082,23 @@ struct JxlOutputProcessor {
               path.c_str(), strerror(errno));
       return false;
     }
+    writer = std::thread(&JxlOutputProcessor::WriteLoop, this);
     return true;
   }
 
+  // Waits until everything is written, and returns whether it was.
+  bool Finish() {
+    if (writer.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+      }
+      has_work.notify_one();
+      writer.join();
+    }
+    return write_ok;
+  }
+
   JxlEncoderOutputProcessor GetOutputProcessor() {
     return JxlEncoderOutputProcessor{
         this, METHOD_TO_C_CALLBACK(&JxlOutputProcessor::GetBuffer),
@@ -961,6 +1109,13 @@ struct JxlOutputProcessor {
 
   void* GetBuffer(size_t* size) {
     *size = std::min<size_t>(*size, 1u << 16);
+    if (output.empty()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!free_buffers.empty()) {
+        output = std::move(free_buffers.back());
+        free_buffers.pop_back();
+      }
+    }
     if (output.size() < *size) {
       output.resize(*size);
     }
@@ -968,95 +1123,128 @@ struct JxlOutputProcessor {
   }
 
   void ReleaseBuffer(size_t written_bytes) {
-    if (*outfile &&
-        fwrite(output.data(), 1, written_bytes, *outfile) != written_bytes) {
-      JXL_WARNING("Failed to write %" PRIuS " bytes to output", written_bytes);
+    if (!writer.joinable()) {
+      output.clear();
+      return;
     }
+    output.resize(written_bytes);
+    Push(PendingWrite{std::move(output), false, 0});
     output.clear();
   }
 
   void Seek(uint64_t position) {  // NOLINT
-    if (*outfile && fseek(*outfile, position, SEEK_SET) != 0) {
-      JXL_WARNING("Failed to seek output.");
-    }
+    if (writer.joinable()) Push(PendingWrite{{}, true, position});
   }
 
   void SetFinalizedPosition(uint64_t finalized_position) {
     this->finalized_position = finalized_position;
   }
 
-  std::vector<uint8_t> output;
-  size_t finalized_position = 0;
-  std::unique_ptr<FileWrapper> outfile;
-};
-
-}  // namespace tools
-}  // namespace jpegxl
-
-int main(int argc, char** argv) {
-  std::string version = jpegxl::tools::CodecConfigString(JxlEncoderVersion());
-  jpegxl::tools::CompressArgs args;
-  jpegxl::tools::CommandLineParser cmdline;
-  args.AddCommandLineOptions(&cmdline);
-
-  if (!cmdline.Parse(argc, const_cast<const char**>(argv))) {
-    // Parse already printed the actual error cause.
-    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
-    return jpegxl::tools::CjxlRetCode::ERR_PARSE;
-  }
-
-  if (args.version) {
-    fprintf(stdout, "cjxl %s\n", version.c_str());
-    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
-    return jpegxl::tools::CjxlRetCode::OK;
-  }
-
-  if (!args.quiet) {
-    fprintf(stderr, "JPEG XL encoder %s\n", version.c_str());
+  // Buffers written by the encoder, or seeks, in the order they were made.
+  struct PendingWrite {
+    std::vector<uint8_t> bytes;
+    bool seek;
+    uint64_t position;
+  };
+
+  // Bounds the memory held by buffers that were not written yet, when the
+  // encoder is faster than the disk.
+  static constexpr size_t kMaxPendingWrites = 64;
+
+  void Push(PendingWrite&& write) {
+    std::unique_lock<std::mutex> lock(mutex);
+    has_space.wait(lock, [this] { return pending.size() < kMaxPendingWrites; });
+    pending.push_back(std::move(write));
+    lock.unlock();
+    has_work.notify_one();
   }
 
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
-    cmdline.PrintHelp();
-    return jpegxl::tools::CjxlRetCode::OK;
-  }
-
-  if (!args.file_out && !args.disable_output) {
-    std::cerr
-        << "No output file specified and --disable_output flag not passed.\n";
-    exit(EXIT_FAILURE);
+  void WriteLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      has_work.wait(lock, [this] { return done || !pending.empty(); });
+      if (pending.empty()) return;
+      PendingWrite write = std::move(pending.front());
+      pending.pop_front();
+      lock.unlock();
+      has_space.notify_one();
+      if (write.seek) {
+        if (fseek(*outfile, write.position, SEEK_SET) != 0) {
+          JXL_WARNING("Failed to seek output.");
+          write_ok = false;
+        }
+      } else if (fwrite(write.bytes.data(), 1, write.bytes.size(), *outfile) !=
+                 write.bytes.size()) {
+        JXL_WARNING("Failed to write %" PRIuS " bytes to output",
+                    write.bytes.size());
+        write_ok = false;
+      }
+      lock.lock();
+      if (!write.seek && free_buffers.size() < 2) {
+        free_buffers.push_back(std::move(write.bytes));
+      }
+    }
   }
 
-  if (args.file_out && args.disable_output && !args.quiet) {
-    fprintf(stderr,
-            "Encoding will be performed, but the result will be discarded.\n");
-  }
+  std::vector<uint8_t> output;
+  size_t finalized_position = 0;
+  std::unique_ptr<FileWrapper> outfile;
+  std::thread writer;
+  std::mutex mutex;
+  std::condition_variable has_work;
+  std::condition_variable has_space;
+  std::deque<PendingWrite> pending;
+  std::vector<std::vector<uint8_t>> free_buffers;
+  bool done = false;
+  // Only changed by the writer thread before Finish() joins it.
+  bool write_ok = true;
+};
 
+// Encodes args.file_in to args.file_out, with the flags of `args`, and returns
+// the exit code of cjxl for it. `input` has the contents of args.file_in if
+// they were already read.
+int CompressFile(CompressArgs args, CommandLineParser* cmdline, void* runner,
+                 size_t num_worker_threads, jxl::ThreadPool* decode_pool,
+                 std::unique_ptr<InputBytes> input) {
   jxl::extras::JXLCompressParams params;
   jxl::extras::PackedPixelFile ppf;
   jxl::extras::Codec codec = jxl::extras::Codec::kUnknown;
-  std::vector<uint8_t> image_data;
+  // Copy of the input when it is a JPEG to transcode.
+  std::vector<uint8_t> jpeg_data;
   std::vector<uint8_t>* jpeg_bytes = nullptr;
   size_t input_bytes = 0;
   double decode_mps = 0;
   size_t pixels = 0;
   bool try_non_streaming = true;
   jxl::extras::ChunkedPNMDecoder pnm_dec;
+  jxl::extras::ChunkedEXRDecoder exr_dec;
   if (args.streaming_input) {
+    const bool is_exr = jxl::extras::CodecFromPath(args.file_in) ==
+                        jxl::extras::Codec::kEXR;
     bool ok = [&]() -> jxl::Status {
+      if (is_exr) {
+        JXL_ASSIGN_OR_RETURN(
+            exr_dec, jxl::extras::ChunkedEXRDecoder::Init(
+                         args.file_in, static_cast<int>(num_worker_threads)));
+        return true;
+      }
       JXL_ASSIGN_OR_RETURN(pnm_dec,
                            jxl::extras::ChunkedPNMDecoder::Init(args.file_in));
       return true;
     }();
     if (!ok) {
-      std::cerr << "Warning PPM/PGM streaming decoding failed, trying "
-                   "non-streaming mode.\n";
+      std::cerr << "Warning " << (is_exr ? "EXR" : "PNM")
+                << " streaming decoding failed, trying non-streaming mode.\n";
     } else {  // ok
-      if (!pnm_dec.InitializePPF(args.color_hints_proxy.target, &ppf)) {
+      const jxl::Status ppf_ok =
+          is_exr ? exr_dec.InitializePPF(args.color_hints_proxy.target, &ppf)
+                 : pnm_dec.InitializePPF(args.color_hints_proxy.target, &ppf);
+      if (!ppf_ok) {
         std::cerr
             << "Failed to initialize decoding with the given color hints\n";
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
       }
-      codec = jxl::extras::Codec::kPNM;
+      codec = is_exr ? jxl::extras::Codec::kEXR : jxl::extras::Codec::kPNM;
       args.lossless_jpeg = JXL_FALSE;
       pixels = ppf.info.xsize * ppf.info.ysize;
       try_non_streaming = false;
@@ -1066,32 +1254,34 @@ int main(int argc, char** argv) {
     // Loading the input.
     // Depending on flags-settings, we want to either load a JPEG and
     // faithfully convert it to JPEG XL, or load (JPEG or non-JPEG)
-    // pixel data.
-    jpegxl::tools::FileWrapper f(args.file_in, "rb");
-    if (!f) {
-      std::cerr << "Reading image data failed.\n";
-      exit(EXIT_FAILURE);
-    }
-    if (!jpegxl::tools::ReadFile(f, &image_data)) {
-      std::cerr << "Reading image data failed.\n";
-      exit(EXIT_FAILURE);
+    // pixel data. The input is memory-mapped when possible, so that the
+    // decoders read large files without a copy.
+    if (!input) {
+      input = jxl::make_unique<InputBytes>();
+      if (!input->Read(args.file_in)) {
+        std::cerr << "Reading image data failed.\n";
+        return EXIT_FAILURE;
+      }
     }
+    const jxl::Span<const uint8_t> image_data = input->bytes();
     input_bytes = image_data.size();
     if (!jpegxl::tools::IsJPG(image_data)) args.lossless_jpeg = JXL_FALSE;
-    ProcessFlags(codec, ppf, jpeg_bytes, &cmdline, &args, &params);
+    if (!ProcessFlags(codec, ppf, jpeg_bytes, cmdline, &args, &params)) {
+      return EXIT_FAILURE;
+    }
     if (!FROM_JXL_BOOL(args.lossless_jpeg)) {
       const double t0 = jxl::Now();
-      jxl::Status status = jxl::extras::DecodeBytes(
-          jxl::Bytes(image_data), args.color_hints_proxy.target, &ppf, nullptr,
-          &codec);
+      jxl::Status status =
+          jxl::extras::DecodeBytes(image_data, args.color_hints_proxy.target,
+                                   &ppf, nullptr, &codec, decode_pool);
 
       if (!status) {
         std::cerr << "Getting pixel data failed.\n";
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
       }
       if (ppf.frames.empty()) {
         std::cerr << "No frames on input file.\n";
-        exit(EXIT_FAILURE);
+        return EXIT_FAILURE;
       }
       pixels = ppf.info.xsize * ppf.info.ysize;
       const double t1 = jxl::Now();
@@ -1099,35 +1289,39 @@ int main(int argc, char** argv) {
     }
 
     if (FROM_JXL_BOOL(args.lossless_jpeg) && jpegxl::tools::IsJPG(image_data)) {
-      if (!cmdline.GetOption(args.opt_lossless_jpeg_id)->matched()) {
+      if (!cmdline->GetOption(args.opt_lossless_jpeg_id)->matched()) {
         std::cerr << "Note: Implicit-default for JPEG is lossless-transcoding. "
                   << "To silence this message, set --lossless_jpeg=(1|0).\n";
       }
-      jpeg_bytes = &image_data;
+      jpeg_data = image_data.Copy();
+      jpeg_bytes = &jpeg_data;
       if (args.allow_jpeg_reconstruction) {
-        (void)args.color_hints_proxy.target.Foreach([](const std::string& key,
-                                                       const std::string& value)
-                                                        -> jxl::Status {
-          if (value.empty()) {
-            if (key != "jumbf") {
-              std::cerr
-                  << "Cannot strip " << key
-                  << " metadata, try setting --allow_jpeg_reconstruction=0. "
-                     "Note that with that setting byte exact reconstruction "
-                     "of the JPEG file won't be possible.\n";
-              exit(EXIT_FAILURE);
-            }
-          }
-          return true;
-        });
+        const jxl::Status can_strip = args.color_hints_proxy.target.Foreach(
+            [](const std::string& key,
+               const std::string& value) -> jxl::Status {
+              if (value.empty()) {
+                if (key != "jumbf") {
+                  std::cerr
+                      << "Cannot strip " << key
+                      << " metadata, try setting --allow_jpeg_reconstruction=0."
+                         " Note that with that setting byte exact "
+                         "reconstruction of the JPEG file won't be possible.\n";
+                  return false;
+                }
+              }
+              return true;
+            });
+        if (!can_strip) return EXIT_FAILURE;
       }
     }
   }
 
-  ProcessFlags(codec, ppf, jpeg_bytes, &cmdline, &args, &params);
+  if (!ProcessFlags(codec, ppf, jpeg_bytes, cmdline, &args, &params)) {
+    return EXIT_FAILURE;
+  }
 
   if (!args.quiet) {
-    PrintMode(ppf, decode_mps, input_bytes, args, cmdline);
+    PrintMode(ppf, decode_mps, input_bytes, args, *cmdline);
   }
 
   if (!ppf.metadata.exif.empty()) {
@@ -1142,7 +1336,7 @@ int main(int argc, char** argv) {
     if (args.container == jxl::Override::kDefault) {
       args.container = jxl::Override::kOn;
     } else if (args.container == jxl::Override::kOff) {
-      cmdline.VerbosePrintf(
+      cmdline->VerbosePrintf(
           1, "Stripping all metadata due to explicit container=0\n");
       ppf.metadata.exif.clear();
       ppf.metadata.xmp.clear();
@@ -1153,15 +1347,9 @@ int main(int argc, char** argv) {
     }
   }
 
-  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
-  int64_t flag_num_worker_threads = args.num_threads;
-  if (flag_num_worker_threads > -1) {
-    num_worker_threads = flag_num_worker_threads;
-  }
-  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
-      /*memory_manager=*/nullptr, num_worker_threads);
   params.runner = JxlThreadParallelRunner;
-  params.runner_opaque = runner.get();
+  params.runner_opaque = runner;
+  params.max_frames_in_flight = args.frames_in_flight;
 
   if (args.streaming_input) {
     params.options.emplace_back(JXL_ENC_FRAME_SETTING_BUFFERING,
@@ -1194,6 +1382,10 @@ int main(int argc, char** argv) {
     stats.NotifyElapsed(t1 - t0);
     stats.SetImageSize(ppf.info.xsize, ppf.info.ysize);
   }
+  if (args.streaming_output && !output_processor.Finish()) {
+    std::cerr << "Could not write jxl file.\n";
+    return EXIT_FAILURE;
+  }
   size_t compressed_size = args.streaming_output
                                ? output_processor.finalized_position
                                : compressed.size();
@@ -1206,26 +1398,130 @@ int main(int argc, char** argv) {
   }
   if (!args.quiet) {
     if (compressed_size < 100000) {
-      cmdline.VerbosePrintf(0, "Compressed to %" PRIuS " bytes ",
+      cmdline->VerbosePrintf(0, "Compressed to %" PRIuS " bytes ",
                             compressed_size);
     } else {
-      cmdline.VerbosePrintf(0, "Compressed to %.1f kB ",
+      cmdline->VerbosePrintf(0, "Compressed to %.1f kB ",
                             compressed_size * 0.001);
     }
     // For lossless jpeg-reconstruction, we don't print some stats, since we
     // don't have easy access to the image dimensions.
     if (args.container == jxl::Override::kOn) {
-      cmdline.VerbosePrintf(0, "including container ");
+      cmdline->VerbosePrintf(0, "including container ");
     }
     if (!FROM_JXL_BOOL(args.lossless_jpeg)) {
       const double bpp =
           static_cast<double>(compressed_size * jxl::kBitsPerByte) / pixels;
-      cmdline.VerbosePrintf(0, "(%.3f bpp%s).\n", bpp / ppf.num_frames(),
+      cmdline->VerbosePrintf(0, "(%.3f bpp%s).\n", bpp / ppf.num_frames(),
                             ppf.num_frames() == 1 ? "" : "/frame");
       JPEGXL_TOOLS_CHECK(stats.Print(num_worker_threads));
     } else {
-      cmdline.VerbosePrintf(0, "\n");
+      cmdline->VerbosePrintf(0, "\n");
     }
   }
   return EXIT_SUCCESS;
 }
+
+// Encodes the files listed by args.file_in to the paths given by the pattern
+// args.file_out, and returns the exit code of cjxl for the batch. A file that
+// fails to encode does not stop the batch.
+int CompressBatch(const CompressArgs& args, CommandLineParser* cmdline,
+                  void* runner, size_t num_worker_threads,
+                  jxl::ThreadPool* decode_pool) {
+  std::vector<BatchFile> files;
+  if (!ListBatchFiles(args.file_in, args.file_out, &files)) {
+    return EXIT_FAILURE;
+  }
+  const double t0 = jxl::Now();
+  BatchReader reader(files);
+  size_t index;
+  std::unique_ptr<InputBytes> input;
+  size_t num_failed = 0;
+  while (reader.Next(&index, &input)) {
+    CompressArgs file_args = args;
+    file_args.file_in = files[index].input.c_str();
+    file_args.file_out = files[index].output.c_str();
+    if (!input) {
+      fprintf(stderr, "Reading %s failed.\n", file_args.file_in);
+      num_failed++;
+      continue;
+    }
+    if (!args.quiet) cmdline->VerbosePrintf(0, "%s\n", file_args.file_in);
+    if (CompressFile(file_args, cmdline, runner, num_worker_threads,
+                     decode_pool, std::move(input)) != EXIT_SUCCESS) {
+      fprintf(stderr, "Failed to encode %s\n", file_args.file_in);
+      num_failed++;
+    }
+  }
+  if (!args.quiet) {
+    fprintf(stderr, "Encoded %" PRIuS " of %" PRIuS " files in %.3f s.\n",
+            files.size() - num_failed, files.size(), jxl::Now() - t0);
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace tools
+}  // namespace jpegxl
+
+int main(int argc, char** argv) {
+  std::string version = jpegxl::tools::CodecConfigString(JxlEncoderVersion());
+  jpegxl::tools::CompressArgs args;
+  jpegxl::tools::CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+
+  if (!cmdline.Parse(argc, const_cast<const char**>(argv))) {
+    // Parse already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
+    return jpegxl::tools::CjxlRetCode::ERR_PARSE;
+  }
+
+  if (args.version) {
+    fprintf(stdout, "cjxl %s\n", version.c_str());
+    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
+    return jpegxl::tools::CjxlRetCode::OK;
+  }
+
+  if (!args.quiet) {
+    fprintf(stderr, "JPEG XL encoder %s\n", version.c_str());
+  }
+
+  if (cmdline.HelpFlagPassed() || !args.file_in) {
+    cmdline.PrintHelp();
+    return jpegxl::tools::CjxlRetCode::OK;
+  }
+
+  if (!args.file_out && !args.disable_output) {
+    std::cerr
+        << "No output file specified and --disable_output flag not passed.\n";
+    exit(EXIT_FAILURE);
+  }
+
+  if (args.file_out && args.disable_output && !args.quiet) {
+    fprintf(stderr,
+            "Encoding will be performed, but the result will be discarded.\n");
+  }
+
+  if (args.batch && (strcmp(args.file_in, "-") == 0 || !args.file_out ||
+                     strcmp(args.file_out, "-") == 0)) {
+    std::cerr << "--batch needs an input and an output pattern, not stdin or "
+                 "stdout.\n";
+    return EXIT_FAILURE;
+  }
+
+  // The decoders of the input share the threads of the encoder.
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  int64_t flag_num_worker_threads = args.num_threads;
+  if (flag_num_worker_threads > -1) {
+    num_worker_threads = flag_num_worker_threads;
+  }
+  JxlThreadParallelRunnerPtr runner = JxlThreadParallelRunnerMake(
+      /*memory_manager=*/nullptr, num_worker_threads);
+  jxl::ThreadPool decode_pool(JxlThreadParallelRunner, runner.get());
+
+  if (args.batch) {
+    return jpegxl::tools::CompressBatch(args, &cmdline, runner.get(),
+                                        num_worker_threads, &decode_pool);
+  }
+  return jpegxl::tools::CompressFile(args, &cmdline, runner.get(),
+                                     num_worker_threads, &decode_pool, nullptr);
+}
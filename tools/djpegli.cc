@@ -3,6 +3,7 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <jxl/thread_parallel_runner.h>
 #include <jxl/types.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,6 +21,7 @@
 #include "tools/cmdline.h"
 #include "tools/file_io.h"
 #include "tools/speed_stats.h"
+#include "tools/thread_pool_internal.h"
 
 namespace jpegxl {
 namespace tools {
@@ -44,6 +46,11 @@ struct Args {
                             "or 16. Has no impact on PFM output.",
                             &bitdepth, &ParseUnsigned);
 
+    cmdline->AddOptionValue('\0', "num_threads", "N",
+                            "Number of worker threads (-1 == use machine "
+                            "default, 0 == do not use multithreading).",
+                            &num_threads, &ParseSigned);
+
     cmdline->AddOptionValue('\0', "num_reps", "N",
                             "Sets the number of times to decompress the image. "
                             "Used for benchmarking, the default is 1.",
@@ -58,6 +65,7 @@ struct Args {
   bool disable_output = false;
   size_t bitdepth = 8;
   size_t num_reps = 1;
+  int32_t num_threads = -1;
   bool quiet = false;
 };
 
@@ -66,6 +74,10 @@ bool ValidateArgs(const Args& args) {
     fprintf(stderr, "Invalid --bitdepth argument\n");
     return false;
   }
+  if (args.num_threads < -1) {
+    fprintf(stderr, "Invalid --num_threads argument\n");
+    return false;
+  }
   return true;
 }
 
@@ -141,11 +153,17 @@ int DJpegliMain(int argc, const char* argv[]) {
   jxl::extras::JpegDecompressParams dparams;
   SetDecompressParams(args, extension, &dparams);
 
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  if (args.num_threads > -1) {
+    num_worker_threads = args.num_threads;
+  }
+  ThreadPoolInternal pool(num_worker_threads);
+
   jxl::extras::PackedPixelFile ppf;
   jpegxl::tools::SpeedStats stats;
   for (size_t num_rep = 0; num_rep < args.num_reps; ++num_rep) {
     const double t0 = jxl::Now();
-    if (!jxl::extras::DecodeJpeg(jpeg_bytes, dparams, nullptr, &ppf)) {
+    if (!jxl::extras::DecodeJpeg(jpeg_bytes, dparams, pool.get(), &ppf)) {
       fprintf(stderr, "jpegli decoding failed\n");
       return EXIT_FAILURE;
     }
@@ -23,14 +23,20 @@
 #include "lib/extras/alpha_blend.h"
 #include "lib/extras/dec/decode.h"
 #include "lib/extras/dec/jxl.h"
+#include "lib/extras/enc/apng.h"
 #include "lib/extras/enc/encode.h"
 #include "lib/extras/enc/jpg.h"
 #include "lib/extras/packed_image.h"
 #include "lib/extras/time.h"
+#include "lib/jxl/base/common.h"
 #include "lib/jxl/base/printf_macros.h"
+#include "lib/jxl/base/span.h"
+#include "lib/jxl/base/status.h"
+#include "tools/batch.h"
 #include "tools/cmdline.h"
 #include "tools/codec_config.h"
 #include "tools/file_io.h"
+#include "tools/input_bytes.h"
 #include "tools/speed_stats.h"
 
 namespace jpegxl {
@@ -120,6 +126,16 @@ struct DecompressArgs {
                            "Allow decoding of truncated files.",
                            &allow_partial_files, &SetBooleanTrue, 1);
 
+    cmdline->AddOptionFlag(
+        '\0', "batch",
+        "Decode many files in one run: INPUT is a directory or a text file "
+        "with one input path per line, and OUTPUT a pattern in which %s is "
+        "replaced by the name of each input without its extension, e.g. "
+        "'out/%s.png'.\n"
+        "    The files are decoded one after the other with the same threads, "
+        "while the next one is read.",
+        &batch, &SetBooleanTrue, 1);
+
     if (jxl::extras::GetJPEGEncoder()) {
       cmdline->AddOptionFlag(
           'j', "pixels_to_jpeg",
@@ -212,6 +228,13 @@ struct DecompressArgs {
                            "(default is white).",
                            &alpha_blend, &SetBooleanTrue, 2);
 
+    cmdline->AddOptionFlag(
+        '\0', "streaming_output",
+        "Writes a still PNG image while it is decoded, instead of keeping the "
+        "whole image in memory.\n"
+        "    Extra channels are not written.",
+        &streaming_output, &SetBooleanTrue, 2);
+
     cmdline->AddOptionFlag('\0', "print_read_bytes",
                            "Print total number of decoded bytes.",
                            &print_read_bytes, &SetBooleanTrue, 2);
@@ -230,6 +253,23 @@ struct DecompressArgs {
           "Invalid flag value for --num_threads: must be -1, 0 or positive.\n");
       return false;
     }
+    if (batch && (strcmp(file_in, "-") == 0 ||
+                  (file_out && strcmp(file_out, "-") == 0) ||
+                  !preview_out.empty() || !icc_out.empty() ||
+                  !orig_icc_out.empty() || !metadata_out.empty())) {
+      fprintf(stderr,
+              "--batch does not work with stdin or stdout, --preview_out, "
+              "--icc_out, --orig_icc_out and --metadata_out.\n");
+      return false;
+    }
+    if (streaming_output &&
+        (alpha_blend || output_extra_channels || output_frames ||
+         num_reps > 1)) {
+      fprintf(stderr,
+              "--streaming_output does not work with --alpha_blend, "
+              "--output_extra_channels, --output_frames and --num_reps.\n");
+      return false;
+    }
     return true;
   }
 
@@ -246,6 +286,7 @@ struct DecompressArgs {
   std::string color_space;
   uint32_t downsampling = 0;
   bool allow_partial_files = false;
+  bool batch = false;
   bool pixels_to_jpeg = false;
   size_t jpeg_quality = 95;
   bool use_sjpeg = false;
@@ -259,6 +300,7 @@ struct DecompressArgs {
   std::string background_spec = "white";
   bool alpha_blend = false;
   bool print_read_bytes = false;
+  bool streaming_output = false;
   bool quiet = false;
   // References (ids) of specific options to check if they were matched.
   CommandLineParser::OptionId opt_bits_per_sample_id = -1;
@@ -346,7 +388,7 @@ bool ParseBackgroundColor(const std::string& background_desc,
 }
 
 bool DecompressJxlReconstructJPEG(const jpegxl::tools::DecompressArgs& args,
-                                  const std::vector<uint8_t>& compressed,
+                                  jxl::Span<const uint8_t> compressed,
                                   void* runner,
                                   std::vector<uint8_t>* jpeg_bytes,
                                   jpegxl::tools::SpeedStats* stats) {
@@ -371,10 +413,11 @@ bool DecompressJxlReconstructJPEG(const jpegxl::tools::DecompressArgs& args,
 
 bool DecompressJxlToPackedPixelFile(
     const jpegxl::tools::DecompressArgs& args,
-    const std::vector<uint8_t>& compressed,
+    jxl::Span<const uint8_t> compressed,
     const std::vector<JxlPixelFormat>& accepted_formats, void* runner,
     jxl::extras::PackedPixelFile* ppf, size_t* decoded_bytes,
-    jpegxl::tools::SpeedStats* stats) {
+    jpegxl::tools::SpeedStats* stats,
+    jxl::extras::PixelSink* pixel_sink = nullptr) {
   jxl::extras::JXLDecompressParams dparams;
   dparams.max_downsampling = args.downsampling;
   dparams.accepted_formats = accepted_formats;
@@ -384,6 +427,7 @@ bool DecompressJxlToPackedPixelFile(
   dparams.runner = JxlThreadParallelRunner;
   dparams.runner_opaque = runner;
   dparams.allow_partial_input = args.allow_partial_files;
+  dparams.pixel_sink = pixel_sink;
   if (args.bits_per_sample == 0) {
     dparams.output_bitdepth.type = JXL_BIT_DEPTH_FROM_CODESTREAM;
   } else if (args.bits_per_sample > 0) {
@@ -403,51 +447,12 @@ bool DecompressJxlToPackedPixelFile(
   return true;
 }
 
-}  // namespace
-
-int main(int argc, const char* argv[]) {
-  std::string version = jpegxl::tools::CodecConfigString(JxlDecoderVersion());
-  jpegxl::tools::DecompressArgs args;
-  jpegxl::tools::CommandLineParser cmdline;
-  args.AddCommandLineOptions(&cmdline);
-
-  if (!cmdline.Parse(argc, argv)) {
-    // Parse already printed the actual error cause.
-    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  if (args.version) {
-    fprintf(stdout, "djxl %s\n", version.c_str());
-    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
-    return EXIT_SUCCESS;
-  }
-  if (!args.quiet) {
-    fprintf(stderr, "JPEG XL decoder %s\n", version.c_str());
-  }
-
-  if (cmdline.HelpFlagPassed() || !args.file_in) {
-    cmdline.PrintHelp();
-    return EXIT_SUCCESS;
-  }
-
-  if (!args.ValidateArgs(cmdline)) {
-    // ValidateArgs already printed the actual error cause.
-    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
-    return EXIT_FAILURE;
-  }
-
-  std::vector<uint8_t> compressed;
-  // Reading compressed JPEG XL input
-  if (!jpegxl::tools::ReadFile(args.file_in, &compressed)) {
-    fprintf(stderr, "couldn't load %s\n", args.file_in);
-    return EXIT_FAILURE;
-  }
-  if (!args.quiet) {
-    cmdline.VerbosePrintf(1, "Read %" PRIuS " compressed bytes.\n",
-                          compressed.size());
-  }
-
+// Decodes `compressed` to args.file_out, with the flags of `args`, and returns
+// the exit code of djxl for it.
+int DecompressFile(jpegxl::tools::DecompressArgs args,
+                   const jpegxl::tools::CommandLineParser& cmdline,
+                   void* runner, jxl::Span<const uint8_t> compressed,
+                   jpegxl::tools::SpeedStats* stats) {
   if (!args.file_out && !args.disable_output) {
     std::cerr
         << "No output file specified and --disable_output flag not passed.\n";
@@ -481,17 +486,6 @@ int main(int argc, const char* argv[]) {
     args.bits_per_sample = 0;
   }
 
-  jpegxl::tools::SpeedStats stats;
-  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
-  {
-    int64_t flag_num_worker_threads = args.num_threads;
-    if (flag_num_worker_threads > -1) {
-      num_worker_threads = flag_num_worker_threads;
-    }
-  }
-  auto runner = JxlThreadParallelRunnerMake(
-      /*memory_manager=*/nullptr, num_worker_threads);
-
   bool decode_to_pixels = (codec != jxl::extras::Codec::kJPG);
   if (args.opt_jpeg_quality_id >= 0 &&
       (args.pixels_to_jpeg ||
@@ -503,8 +497,8 @@ int main(int argc, const char* argv[]) {
   if (!decode_to_pixels) {
     std::vector<uint8_t> bytes;
     for (size_t i = 0; i < num_reps; ++i) {
-      if (!DecompressJxlReconstructJPEG(args, compressed, runner.get(), &bytes,
-                                        &stats)) {
+      if (!DecompressJxlReconstructJPEG(args, compressed, runner, &bytes,
+                                        stats)) {
         if (bytes.empty()) {
           if (!args.quiet) {
             fprintf(stderr,
@@ -555,12 +549,42 @@ int main(int argc, const char* argv[]) {
         }
       }
     }
+    // With --streaming_output, the PNG is written while decoding, and `ppf`
+    // only gets the headers of the image.
+    std::unique_ptr<jpegxl::tools::FileWrapper> streaming_file;
+    std::unique_ptr<jxl::extras::PixelSink> pixel_sink;
+    if (args.streaming_output && encoder) {
+      if (extension != ".png") {
+        fprintf(stderr, "--streaming_output only writes PNG files.\n");
+        return EXIT_FAILURE;
+      }
+      streaming_file =
+          jxl::make_unique<jpegxl::tools::FileWrapper>(filename_out, "wb");
+      FILE* file = *streaming_file;
+      if (file == nullptr) {
+        fprintf(stderr, "Could not open %s for writing\n",
+                filename_out.c_str());
+        return EXIT_FAILURE;
+      }
+      pixel_sink = jxl::extras::GetPNGStreamWriter(
+          [file](const uint8_t* data, size_t size) -> jxl::Status {
+            if (fwrite(data, 1, size, file) != size) {
+              return JXL_FAILURE("Failed to write output");
+            }
+            return true;
+          });
+      if (pixel_sink == nullptr) {
+        fprintf(stderr, "PNG support is not compiled in.\n");
+        return EXIT_FAILURE;
+      }
+      encoder.reset();
+    }
     jxl::extras::PackedPixelFile ppf;
     size_t decoded_bytes = 0;
     for (size_t i = 0; i < num_reps; ++i) {
       if (!DecompressJxlToPackedPixelFile(args, compressed, accepted_formats,
-                                          runner.get(), &ppf, &decoded_bytes,
-                                          &stats)) {
+                                          runner, &ppf, &decoded_bytes,
+                                          stats, pixel_sink.get())) {
         fprintf(stderr, "DecompressJxlToPackedPixelFile failed\n");
         return EXIT_FAILURE;
       }
@@ -569,6 +593,15 @@ int main(int argc, const char* argv[]) {
     if (args.print_read_bytes) {
       fprintf(stderr, "Decoded bytes: %" PRIuS "\n", decoded_bytes);
     }
+    if (pixel_sink) {
+      if (!args.quiet) {
+        cmdline.VerbosePrintf(1, "Wrote output to %s\n", filename_out.c_str());
+      }
+      if (!WriteOptionalOutput(args.icc_out, ppf.icc) ||
+          !WriteOptionalOutput(args.orig_icc_out, ppf.orig_icc)) {
+        return EXIT_FAILURE;
+      }
+    }
     // When --disable_output was parsed, `filename_out` is empty and we don't
     // need to write files.
     if (encoder) {
@@ -622,6 +655,114 @@ int main(int argc, const char* argv[]) {
       }
     }
   }
+  return EXIT_SUCCESS;
+}
+
+// Decodes the files listed by args.file_in to the paths given by the pattern
+// args.file_out, and returns the exit code of djxl for the batch. A file that
+// fails to decode does not stop the batch.
+int DecompressBatch(const jpegxl::tools::DecompressArgs& args,
+                    const jpegxl::tools::CommandLineParser& cmdline,
+                    void* runner) {
+  std::vector<jpegxl::tools::BatchFile> files;
+  if (!jpegxl::tools::ListBatchFiles(
+          args.file_in, args.file_out ? args.file_out : "%s", &files)) {
+    return EXIT_FAILURE;
+  }
+  const double t0 = jxl::Now();
+  jpegxl::tools::BatchReader reader(files);
+  size_t index;
+  std::unique_ptr<jpegxl::tools::InputBytes> input;
+  size_t num_failed = 0;
+  while (reader.Next(&index, &input)) {
+    jpegxl::tools::DecompressArgs file_args = args;
+    file_args.file_in = files[index].input.c_str();
+    if (args.file_out) file_args.file_out = files[index].output.c_str();
+    if (!input) {
+      fprintf(stderr, "couldn't load %s\n", file_args.file_in);
+      num_failed++;
+      continue;
+    }
+    if (!args.quiet) {
+      cmdline.VerbosePrintf(1, "Decoding %s\n", file_args.file_in);
+    }
+    // The speed of each file is not printed.
+    jpegxl::tools::SpeedStats stats;
+    if (DecompressFile(file_args, cmdline, runner, input->bytes(), &stats) !=
+        EXIT_SUCCESS) {
+      fprintf(stderr, "Failed to decode %s\n", file_args.file_in);
+      num_failed++;
+    }
+  }
+  if (!args.quiet) {
+    fprintf(stderr, "Decoded %" PRIuS " of %" PRIuS " files in %.3f s.\n",
+            files.size() - num_failed, files.size(), jxl::Now() - t0);
+  }
+  return num_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}  // namespace
+
+int main(int argc, const char* argv[]) {
+  std::string version = jpegxl::tools::CodecConfigString(JxlDecoderVersion());
+  jpegxl::tools::DecompressArgs args;
+  jpegxl::tools::CommandLineParser cmdline;
+  args.AddCommandLineOptions(&cmdline);
+
+  if (!cmdline.Parse(argc, argv)) {
+    // Parse already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (args.version) {
+    fprintf(stdout, "djxl %s\n", version.c_str());
+    fprintf(stdout, "Copyright (c) the JPEG XL Project\n");
+    return EXIT_SUCCESS;
+  }
+  if (!args.quiet) {
+    fprintf(stderr, "JPEG XL decoder %s\n", version.c_str());
+  }
+
+  if (cmdline.HelpFlagPassed() || !args.file_in) {
+    cmdline.PrintHelp();
+    return EXIT_SUCCESS;
+  }
+
+  if (!args.ValidateArgs(cmdline)) {
+    // ValidateArgs already printed the actual error cause.
+    fprintf(stderr, "Use '%s -h' for more information\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  jpegxl::tools::SpeedStats stats;
+  size_t num_worker_threads = JxlThreadParallelRunnerDefaultNumWorkerThreads();
+  {
+    int64_t flag_num_worker_threads = args.num_threads;
+    if (flag_num_worker_threads > -1) {
+      num_worker_threads = flag_num_worker_threads;
+    }
+  }
+  auto runner = JxlThreadParallelRunnerMake(
+      /*memory_manager=*/nullptr, num_worker_threads);
+
+  if (args.batch) return DecompressBatch(args, cmdline, runner.get());
+
+  // Reading compressed JPEG XL input, memory-mapped when possible.
+  jpegxl::tools::InputBytes input;
+  if (!input.Read(args.file_in)) {
+    fprintf(stderr, "couldn't load %s\n", args.file_in);
+    return EXIT_FAILURE;
+  }
+  const jxl::Span<const uint8_t> compressed = input.bytes();
+  if (!args.quiet) {
+    cmdline.VerbosePrintf(1, "Read %" PRIuS " compressed bytes.\n",
+                          compressed.size());
+  }
+
+  const int ret =
+      DecompressFile(args, cmdline, runner.get(), compressed, &stats);
+  if (ret != EXIT_SUCCESS) return ret;
   if (!args.quiet) {
     stats.Print(num_worker_threads);
   }
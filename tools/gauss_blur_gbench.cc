@@ -9,6 +9,7 @@
 #include <cstdlib>
 
 #include "benchmark/benchmark.h"
+#include "lib/jxl/butteraugli/butteraugli.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/image.h"
 #include "lib/jxl/image_ops.h"
@@ -88,8 +89,35 @@ void BM_GaussBlur2d(benchmark::State& state) {
   state.SetItemsProcessed(xsize * ysize * state.iterations());
 }
 
+// The truncated FIR of butteraugli, for comparison with BM_GaussBlur2d.
+void BM_ButteraugliBlur2d(benchmark::State& state) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  const size_t xsize = state.range();
+  const size_t ysize = xsize;
+  const float sigma = 7.0f;
+  JXL_ASSIGN_OR_QUIT(ImageF in, ImageF::Create(memory_manager, xsize, ysize),
+                     "Failed to allocate image.");
+  const float expected = xsize + ysize;
+  FillImage(expected, &in);
+
+  JXL_ASSIGN_OR_QUIT(ImageF out, ImageF::Create(memory_manager, xsize, ysize),
+                     "Failed to allocate image.");
+  const ButteraugliParams params;
+  BlurTemp temp;
+  for (auto _ : state) {
+    (void)_;
+    BM_CHECK(Blur(in, sigma, params, &temp, &out));
+    // Prevent optimizing out
+    BM_CHECK(std::abs(out.ConstRow(ysize / 2)[xsize / 2] - expected) /
+                 expected <
+             9E-5);
+  }
+  state.SetItemsProcessed(xsize * ysize * state.iterations());
+}
+
 BENCHMARK(BM_GaussBlur1d)->Range(1 << 8, 1 << 14);
 BENCHMARK(BM_GaussBlur2d)->Range(1 << 7, 1 << 10);
+BENCHMARK(BM_ButteraugliBlur2d)->Range(1 << 7, 1 << 10);
 
 }  // namespace
 }  // namespace jxl
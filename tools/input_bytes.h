@@ -0,0 +1,54 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef TOOLS_INPUT_BYTES_H_
+#define TOOLS_INPUT_BYTES_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "lib/extras/mmap.h"
+#include "lib/jxl/base/span.h"
+#include "tools/file_io.h"
+
+namespace jpegxl {
+namespace tools {
+
+// Contents of an input file. Regular files are memory-mapped, so that large
+// inputs are neither copied nor read fully before decoding starts; stdin,
+// pipes and files that cannot be mapped are read into memory.
+class InputBytes {
+ public:
+  bool Read(const std::string& filename) {
+    if (filename != "-") {
+      auto mapped = jxl::MemoryMappedFile::Init(filename.c_str());
+      if (mapped.ok()) {
+        mapped_ = std::move(mapped).value_();
+        bytes_ = jxl::Bytes(mapped_.data(), mapped_.size());
+        if (!bytes_.empty()) return true;
+      }
+    }
+    if (!ReadFile(filename, &read_)) return false;
+    bytes_ = jxl::Bytes(read_);
+    return true;
+  }
+
+  jxl::Span<const uint8_t> bytes() const { return bytes_; }
+  const uint8_t* data() const { return bytes_.data(); }
+  size_t size() const { return bytes_.size(); }
+
+ private:
+  jxl::MemoryMappedFile mapped_;
+  std::vector<uint8_t> read_;
+  jxl::Span<const uint8_t> bytes_;
+};
+
+}  // namespace tools
+}  // namespace jpegxl
+
+#endif  // TOOLS_INPUT_BYTES_H_
@@ -15,6 +15,10 @@ import java.nio.Buffer;
 class DecoderJni {
   private static native void nativeGetBasicInfo(int[] context, Buffer data);
   private static native void nativeGetPixels(int[] context, Buffer data, Buffer pixels, Buffer icc);
+  private static native long nativeCreate();
+  private static native void nativeDestroy(long handle);
+  private static native void nativeDecode(
+      long handle, int[] context, Buffer data, Buffer pixels, Buffer icc);
 
   static Status makeStatus(int statusCode) {
     switch (statusCode) {
@@ -24,6 +28,8 @@ class DecoderJni {
         return Status.INVALID_STREAM;
       case 1:
         return Status.NOT_ENOUGH_INPUT;
+      case 2:
+        return Status.BUFFER_TOO_SMALL;
       default:
         throw new IllegalStateException("Unknown status code");
     }
@@ -68,6 +74,38 @@ class DecoderJni {
     return makeStatus(context[0]);
   }
 
+  /** Create a native decoder that is reused across images; 0 on failure. */
+  static long create() {
+    return nativeCreate();
+  }
+
+  /** Destroy a native decoder created with {@link #create}. */
+  static void destroy(long handle) {
+    nativeDestroy(handle);
+  }
+
+  /**
+   * Decode stream information, and the pixels and ICC profile if they fit in the buffers, in one
+   * pass with the native decoder {@code handle}.
+   */
+  static StreamInfo decode(long handle, Buffer data, Buffer pixels, Buffer icc,
+      PixelFormat pixelFormat, int downsampling) {
+    if (!data.isDirect()) {
+      throw new IllegalArgumentException("data must be direct buffer");
+    }
+    if (pixels != null && !pixels.isDirect()) {
+      throw new IllegalArgumentException("pixels must be direct buffer");
+    }
+    if (icc != null && !icc.isDirect()) {
+      throw new IllegalArgumentException("icc must be direct buffer");
+    }
+    int[] context = new int[6];
+    context[0] = pixelFormat.ordinal();
+    context[1] = downsampling;
+    nativeDecode(handle, context, data, pixels, icc);
+    return makeStreamInfo(context);
+  }
+
   /** Utility library, disable object construction. */
   private DecoderJni() {}
 }
@@ -99,6 +99,44 @@ public class DecoderTest {
     }
   }
 
+  static void testReusableDecoder() {
+    try (ReusableDecoder decoder = new ReusableDecoder()) {
+      // The same decoder decodes several images.
+      for (int i = 0; i < 2; ++i) {
+        checkSimpleImageData(decoder.decode(makeSimpleImage(), PixelFormat.RGBA_8888, 1));
+      }
+      ImageData imageData = decoder.decode(makeSimpleImage(), PixelFormat.RGB_888, 2);
+      int dim = SIMPLE_IMAGE_DIM / 2;
+      if (imageData.width != dim || imageData.height != dim) {
+        throw new IllegalStateException("Invalid downsampled width / height");
+      }
+      if (imageData.pixels.limit() != dim * dim * 3) {
+        throw new IllegalStateException("Unexpected downsampled pixels size");
+      }
+    }
+  }
+
+  static void testReusableDecoderBufferTooSmall() {
+    try (ReusableDecoder decoder = new ReusableDecoder()) {
+      ByteBuffer pixels = ByteBuffer.allocateDirect(16);
+      StreamInfo streamInfo =
+          decoder.decodeInto(makeSimpleImage(), pixels, null, PixelFormat.RGBA_8888, 1);
+      if (streamInfo.status != Status.BUFFER_TOO_SMALL) {
+        throw new IllegalStateException(
+            "Expected 'buffer too small', but got " + streamInfo.status);
+      }
+      int pixelsSize = streamInfo.getPixelsSize();
+      if (pixelsSize != SIMPLE_IMAGE_DIM * SIMPLE_IMAGE_DIM * 4) {
+        throw new IllegalStateException("Unexpected pixels size");
+      }
+      pixels = ByteBuffer.allocateDirect(pixelsSize);
+      streamInfo = decoder.decodeInto(makeSimpleImage(), pixels, null, PixelFormat.RGBA_8888, 1);
+      if (streamInfo.status != Status.OK) {
+        throw new IllegalStateException("Unexpected decoding error");
+      }
+    }
+  }
+
   // Simple executable to avoid extra dependencies.
   public static void main(String[] args) {
     testRgba();
@@ -108,5 +146,7 @@ public class DecoderTest {
     testGetInfoNoAlpha();
     testGetInfoAlpha();
     testNotEnoughInput();
+    testReusableDecoder();
+    testReusableDecoderBufferTooSmall();
   }
 }
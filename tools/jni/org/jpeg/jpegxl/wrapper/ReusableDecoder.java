@@ -0,0 +1,72 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+package org.jpeg.jpegxl.wrapper;
+
+import java.nio.Buffer;
+import java.nio.ByteBuffer;
+
+/**
+ * JPEG XL decoder that keeps its native state and thread pool across images, e.g. to decode a
+ * gallery. Not thread-safe: use one instance per thread.
+ */
+public class ReusableDecoder implements AutoCloseable {
+  static {
+    JniHelper.ensureInitialized();
+  }
+
+  private long handle;
+
+  public ReusableDecoder() {
+    handle = DecoderJni.create();
+    if (handle == 0) {
+      throw new IllegalStateException("Failed to create decoder");
+    }
+  }
+
+  private long getHandle() {
+    if (handle == 0) {
+      throw new IllegalStateException("Decoder is closed");
+    }
+    return handle;
+  }
+
+  /**
+   * Decodes the image in one pass into {@code pixels}, downsampled by {@code downsampling} (1, 2,
+   * 4 or 8), and its ICC profile into {@code icc}, which may be null. If a buffer is too small, the
+   * status is {@link Status#BUFFER_TOO_SMALL} and the sizes the buffers need are in the result.
+   * The width and height of the result are those of the downsampled image.
+   */
+  public StreamInfo decodeInto(
+      Buffer data, Buffer pixels, Buffer icc, PixelFormat pixelFormat, int downsampling) {
+    return DecoderJni.decode(getHandle(), data, pixels, icc, pixelFormat, downsampling);
+  }
+
+  /** Decodes the image, downsampled by {@code downsampling} (1, 2, 4 or 8). */
+  public ImageData decode(Buffer data, PixelFormat pixelFormat, int downsampling) {
+    StreamInfo info = decodeInto(data, null, null, pixelFormat, downsampling);
+    if (info.status != Status.OK) {
+      throw new IllegalStateException("Decoding failed");
+    }
+    if (info.width < 0 || info.height < 0 || info.pixelsSize < 0 || info.iccSize < 0) {
+      throw new IllegalStateException("JNI has returned negative size");
+    }
+    Buffer pixels = ByteBuffer.allocateDirect(info.pixelsSize);
+    Buffer icc = ByteBuffer.allocateDirect(info.iccSize);
+    info = decodeInto(data, pixels, icc, pixelFormat, downsampling);
+    if (info.status != Status.OK) {
+      throw new IllegalStateException("Decoding failed");
+    }
+    return new ImageData(info.width, info.height, pixels, icc, pixelFormat);
+  }
+
+  @Override
+  public void close() {
+    if (handle != 0) {
+      DecoderJni.destroy(handle);
+      handle = 0;
+    }
+  }
+}
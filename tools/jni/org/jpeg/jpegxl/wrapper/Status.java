@@ -13,5 +13,8 @@ public enum Status {
   NOT_ENOUGH_INPUT,
 
   /** Stream is corrupted. */
-  INVALID_STREAM
+  INVALID_STREAM,
+
+  /** Output buffers are too small; stream information is available. */
+  BUFFER_TOO_SMALL
 }
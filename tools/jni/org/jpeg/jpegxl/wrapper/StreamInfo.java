@@ -15,4 +15,14 @@ public class StreamInfo {
   // package-private
   int pixelsSize;
   int iccSize;
+
+  /** Size in bytes of the buffer that the pixels need. */
+  public int getPixelsSize() {
+    return pixelsSize;
+  }
+
+  /** Size in bytes of the buffer that the ICC profile needs. */
+  public int getIccSize() {
+    return iccSize;
+  }
 }
@@ -8,9 +8,10 @@
 #include <jni.h>
 #include <jxl/codestream_header.h>
 #include <jxl/decode.h>
-#include <jxl/thread_parallel_runner.h>
+#include <jxl/resizable_parallel_runner.h>
 #include <jxl/types.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 
@@ -35,7 +36,12 @@ bool BufferToSpan(JNIEnv* env, jobject buffer, uint8_t** data, size_t* size) {
   return StaticCast(env->GetDirectBufferCapacity(buffer), size);
 }
 
-enum class Status { OK = 0, FATAL_ERROR = -1, NOT_ENOUGH_INPUT = 1 };
+enum class Status {
+  OK = 0,
+  FATAL_ERROR = -1,
+  NOT_ENOUGH_INPUT = 1,
+  BUFFER_TOO_SMALL = 2
+};
 
 bool IsOk(Status status) { return status == Status::OK; }
 
@@ -65,10 +71,40 @@ JxlPixelFormat ToPixelFormat(size_t pixel_format) {
   }
 }
 
-Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
-                size_t* info_icc_size, JxlBasicInfo* info, size_t pixel_format,
-                jobject pixels_buffer, jobject icc_buffer) {
+// Decoder and thread pool kept by DecoderJni across images, so that decoding
+// a series of images does not create them for each of them.
+struct NativeDecoder {
+  NativeDecoder()
+      : dec(JxlDecoderCreate(nullptr)),
+        runner(JxlResizableParallelRunnerCreate(nullptr)) {}
+  ~NativeDecoder() {
+    JxlResizableParallelRunnerDestroy(runner);
+    JxlDecoderDestroy(dec);
+  }
+  NativeDecoder(const NativeDecoder&) = delete;
+  NativeDecoder& operator=(const NativeDecoder&) = delete;
+
+  JxlDecoder* dec;
+  void* runner;
+};
+
+// Decodes the image in `data_buffer` with `native`, whose runner is only given
+// threads if `use_threads`, and downsamples it by `downsampling`.
+//
+// Without `pixels_buffer`, only the info is decoded. With it, the info and the
+// pixels are decoded in one pass, unless the pixels or the ICC profile do not
+// fit in their buffers, in which case BUFFER_TOO_SMALL is returned once their
+// sizes are known.
+Status DoDecode(JNIEnv* env, NativeDecoder* native, bool use_threads,
+                size_t downsampling, jobject data_buffer,
+                size_t* info_pixels_size, size_t* info_icc_size,
+                JxlBasicInfo* info, size_t pixel_format, jobject pixels_buffer,
+                jobject icc_buffer) {
   if (data_buffer == nullptr) return FAILURE("No data buffer");
+  if (native == nullptr || native->dec == nullptr ||
+      native->runner == nullptr) {
+    return FAILURE("No decoder");
+  }
 
   uint8_t* data = nullptr;
   size_t data_size = 0;
@@ -88,22 +124,13 @@ Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
     return FAILURE("Failed to access ICC buffer");
   }
 
-  JxlDecoder* dec = JxlDecoderCreate(nullptr);
-
-  constexpr size_t kNumThreads = 0;  // Do everything in this thread.
-  void* runner = JxlThreadParallelRunnerCreate(nullptr, kNumThreads);
+  JxlDecoder* dec = native->dec;
+  JxlDecoderReset(dec);
+  // Without threads, everything is done in this thread.
+  JxlResizableParallelRunnerSetThreads(native->runner, 0);
 
-  struct Defer {
-    JxlDecoder* dec;
-    void* runner;
-    ~Defer() {
-      JxlThreadParallelRunnerDestroy(runner);
-      JxlDecoderDestroy(dec);
-    }
-  } defer{dec, runner};
-
-  auto status =
-      JxlDecoderSetParallelRunner(dec, JxlThreadParallelRunner, runner);
+  auto status = JxlDecoderSetParallelRunner(dec, JxlResizableParallelRunner,
+                                            native->runner);
   if (status != JXL_DEC_SUCCESS) {
     return FAILURE("Failed to set parallel runner");
   }
@@ -112,6 +139,10 @@ Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
   if (status != JXL_DEC_SUCCESS) {
     return FAILURE("Failed to subscribe for events");
   }
+  status = JxlDecoderSetOutputDownsampling(dec, downsampling);
+  if (status != JXL_DEC_SUCCESS) {
+    return FAILURE("Failed to set downsampling");
+  }
   status = JxlDecoderSetInput(dec, data, data_size);
   if (status != JXL_DEC_SUCCESS) {
     return FAILURE("Failed to set input");
@@ -123,27 +154,38 @@ Status DoDecode(JNIEnv* env, jobject data_buffer, size_t* info_pixels_size,
   if (status != JXL_DEC_BASIC_INFO) {
     return FAILURE("Unexpected notification (want: basic info)");
   }
-  if (info_pixels_size) {
+  JxlBasicInfo basic_info;
+  status = JxlDecoderGetBasicInfo(dec, &basic_info);
+  if (status != JXL_DEC_SUCCESS) {
+    return FAILURE("Failed to get basic info");
+  }
+  if (info) *info = basic_info;
+  size_t needed_pixels_size = 0;
+  if (info_pixels_size || pixels) {
     JxlPixelFormat format = ToPixelFormat(pixel_format);
-    status = JxlDecoderImageOutBufferSize(dec, &format, info_pixels_size);
+    status = JxlDecoderImageOutBufferSize(dec, &format, &needed_pixels_size);
     if (status != JXL_DEC_SUCCESS) {
       return FAILURE("Failed to get pixels size");
     }
+    if (info_pixels_size) *info_pixels_size = needed_pixels_size;
   }
-  if (info) {
-    status = JxlDecoderGetBasicInfo(dec, info);
-    if (status != JXL_DEC_SUCCESS) {
-      return FAILURE("Failed to get basic info");
-    }
+  if (use_threads) {
+    JxlResizableParallelRunnerSetThreads(
+        native->runner, JxlResizableParallelRunnerSuggestThreads(
+                            basic_info.xsize, basic_info.ysize));
   }
   status = JxlDecoderProcessInput(dec);
   if (status != JXL_DEC_COLOR_ENCODING) {
     return FAILURE("Unexpected notification (want: color encoding)");
   }
-  if (info_icc_size) {
-    status = JxlDecoderGetICCProfileSize(dec, JXL_COLOR_PROFILE_TARGET_DATA,
-                                         info_icc_size);
-    if (status != JXL_DEC_SUCCESS) *info_icc_size = 0;
+  size_t needed_icc_size = 0;
+  status = JxlDecoderGetICCProfileSize(dec, JXL_COLOR_PROFILE_TARGET_DATA,
+                                       &needed_icc_size);
+  if (status != JXL_DEC_SUCCESS) needed_icc_size = 0;
+  if (info_icc_size) *info_icc_size = needed_icc_size;
+  if (pixels && (pixels_size < needed_pixels_size ||
+                 (icc && icc_size < needed_icc_size))) {
+    return Status::BUFFER_TOO_SMALL;
   }
   if (icc && icc_size > 0) {
     status = JxlDecoderGetColorAsICCProfile(dec, JXL_COLOR_PROFILE_TARGET_DATA,
@@ -204,16 +246,21 @@ Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetBasicInfo(
   }
 
   if (IsOk(status)) {
+    NativeDecoder native;
     bool want_output_size = (pixel_format != kNoPixelFormat);
     if (want_output_size) {
-      status = DoDecode(
-          env, data_buffer, &pixels_size, &icc_size, &info, pixel_format,
-          /* pixels_buffer= */ nullptr, /* icc_buffer= */ nullptr);
+      status = DoDecode(env, &native, /* use_threads= */ false,
+                        /* downsampling= */ 1, data_buffer, &pixels_size,
+                        &icc_size, &info, pixel_format,
+                        /* pixels_buffer= */ nullptr,
+                        /* icc_buffer= */ nullptr);
     } else {
-      status =
-          DoDecode(env, data_buffer, /* info_pixels_size= */ nullptr,
-                   /* info_icc_size= */ nullptr, &info, pixel_format,
-                   /* pixels_buffer= */ nullptr, /* icc_buffer= */ nullptr);
+      status = DoDecode(env, &native, /* use_threads= */ false,
+                        /* downsampling= */ 1, data_buffer,
+                        /* info_pixels_size= */ nullptr,
+                        /* info_icc_size= */ nullptr, &info, pixel_format,
+                        /* pixels_buffer= */ nullptr,
+                        /* icc_buffer= */ nullptr);
     }
   }
 
@@ -258,7 +305,10 @@ JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetPixels(
   }
 
   if (IsOk(status)) {
-    status = DoDecode(env, data_buffer, /* info_pixels_size= */ nullptr,
+    NativeDecoder native;
+    status = DoDecode(env, &native, /* use_threads= */ false,
+                      /* downsampling= */ 1, data_buffer,
+                      /* info_pixels_size= */ nullptr,
                       /* info_icc_size= */ nullptr, /* info= */ nullptr,
                       pixel_format, pixels_buffer, icc_buffer);
   }
@@ -267,6 +317,69 @@ JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetPixels(
   env->SetIntArrayRegion(ctx, 0, 1, context);
 }
 
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeCreate(
+    JNIEnv* /* env */, jobject /* jobj */) {
+  NativeDecoder* native = new NativeDecoder();
+  if (native->dec == nullptr || native->runner == nullptr) {
+    delete native;
+    return 0;
+  }
+  return reinterpret_cast<jlong>(native);
+}
+
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDestroy(
+    JNIEnv* /* env */, jobject /* jobj */, jlong handle) {
+  delete reinterpret_cast<NativeDecoder*>(handle);
+}
+
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDecode(
+    JNIEnv* env, jobject /* jobj */, jlong handle, jintArray ctx,
+    jobject data_buffer, jobject pixels_buffer, jobject icc_buffer) {
+  jint context[6] = {0};
+  env->GetIntArrayRegion(ctx, 0, 2, context);
+
+  JxlBasicInfo info = {};
+  size_t pixels_size = 0;
+  size_t icc_size = 0;
+  size_t pixel_format = 0;
+  size_t downsampling = 1;
+
+  Status status = Status::OK;
+
+  if (IsOk(status)) {
+    pixel_format = context[0];
+    if (pixel_format > kLastPixelFormat) {
+      status = FAILURE("Unrecognized pixel format");
+    }
+    if (!StaticCast(context[1], &downsampling)) {
+      status = FAILURE("Invalid downsampling");
+    }
+  }
+
+  if (IsOk(status)) {
+    status = DoDecode(env, reinterpret_cast<NativeDecoder*>(handle),
+                      /* use_threads= */ true, downsampling, data_buffer,
+                      &pixels_size, &icc_size, &info, pixel_format,
+                      pixels_buffer, icc_buffer);
+  }
+
+  if (IsOk(status) || status == Status::BUFFER_TOO_SMALL) {
+    // The size of the pixels, which are downsampled.
+    bool ok = true;
+    ok &= StaticCast((info.xsize + downsampling - 1) / downsampling,
+                     context + 1);
+    ok &= StaticCast((info.ysize + downsampling - 1) / downsampling,
+                     context + 2);
+    ok &= StaticCast(pixels_size, context + 3);
+    ok &= StaticCast(icc_size, context + 4);
+    ok &= StaticCast(info.alpha_bits, context + 5);
+    if (!ok) status = FAILURE("Invalid value");
+  }
+
+  context[0] = static_cast<int>(status);
+  env->SetIntArrayRegion(ctx, 0, 6, context);
+}
+
 #undef FAILURE
 
 #ifdef __cplusplus
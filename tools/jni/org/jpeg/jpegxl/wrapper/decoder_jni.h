@@ -36,6 +36,37 @@ JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeGetPixels(
     JNIEnv* env, jobject /*jobj*/, jintArray ctx, jobject data_buffer,
     jobject pixels_buffer, jobject icc_buffer);
 
+/**
+ * Create a decoder that keeps its state and thread pool across images.
+ *
+ * @return handle of the decoder, or 0 on failure
+ */
+JNIEXPORT jlong JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeCreate(
+    JNIEnv* env, jobject /*jobj*/);
+
+/**
+ * Destroy a decoder created with nativeCreate.
+ *
+ * @param handle [in] handle of the decoder
+ */
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDestroy(
+    JNIEnv* env, jobject /*jobj*/, jlong handle);
+
+/**
+ * Get basic image information and, if they fit in the buffers, image pixel
+ * data and ICC profile, in one pass.
+ *
+ * @param handle [in] handle of the decoder
+ * @param ctx {in_pixel_format_out_status, in_downsampling_out_width,
+ *             out_height, pixels_size, icc_size, alpha_bits} tuple
+ * @param data [in] Buffer with encoded JXL stream
+ * @param pixels [out] Buffer to place pixels to, or null for info only
+ * @param icc [out] Buffer to place ICC profile to, or null
+ */
+JNIEXPORT void JNICALL Java_org_jpeg_jpegxl_wrapper_DecoderJni_nativeDecode(
+    JNIEnv* env, jobject /*jobj*/, jlong handle, jintArray ctx,
+    jobject data_buffer, jobject pixels_buffer, jobject icc_buffer);
+
 #ifdef __cplusplus
 }
 #endif
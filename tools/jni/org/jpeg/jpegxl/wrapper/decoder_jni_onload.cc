@@ -18,6 +18,13 @@ static char* kGetBasicInfoSig = const_cast<char*>("([ILjava/nio/Buffer;)V");
 static char* kGetPixelsName = const_cast<char*>("nativeGetPixels");
 static char* kGetPixelsInfoSig = const_cast<char*>(
     "([ILjava/nio/Buffer;Ljava/nio/Buffer;Ljava/nio/Buffer;)V");
+static char* kCreateName = const_cast<char*>("nativeCreate");
+static char* kCreateSig = const_cast<char*>("()J");
+static char* kDestroyName = const_cast<char*>("nativeDestroy");
+static char* kDestroySig = const_cast<char*>("(J)V");
+static char* kDecodeName = const_cast<char*>("nativeDecode");
+static char* kDecodeSig = const_cast<char*>(
+    "(J[ILjava/nio/Buffer;Ljava/nio/Buffer;Ljava/nio/Buffer;)V");
 
 #define JXL_JNI_METHOD(NAME) \
   (reinterpret_cast<void*>(  \
@@ -25,9 +32,12 @@ static char* kGetPixelsInfoSig = const_cast<char*>(
 
 static const JNINativeMethod kDecoderMethods[] = {
     {kGetBasicInfoName, kGetBasicInfoSig, JXL_JNI_METHOD(GetBasicInfo)},
-    {kGetPixelsName, kGetPixelsInfoSig, JXL_JNI_METHOD(GetPixels)}};
+    {kGetPixelsName, kGetPixelsInfoSig, JXL_JNI_METHOD(GetPixels)},
+    {kCreateName, kCreateSig, JXL_JNI_METHOD(Create)},
+    {kDestroyName, kDestroySig, JXL_JNI_METHOD(Destroy)},
+    {kDecodeName, kDecodeSig, JXL_JNI_METHOD(Decode)}};
 
-static const size_t kNumDecoderMethods = 2;
+static const size_t kNumDecoderMethods = 5;
 
 #undef JXL_JNI_METHOD
 
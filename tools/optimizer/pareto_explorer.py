@@ -0,0 +1,170 @@
+#!/usr/bin/python
+# Copyright (c) the JPEG XL Project Authors. All rights reserved.
+#
+# Use of this source code is governed by a BSD-style
+# license that can be found in the LICENSE file.
+
+"""pareto_explorer.py: Finds the encoder settings worth using in production.
+
+The tool runs benchmark_xl over a corpus once for every combination of the
+given efforts, distances, encoder heuristic toggles and thread counts, and
+measures the compressed size, the encode and decode times and the SSIMULACRA2
+score of each combination over the whole corpus. It then prints the
+combinations that are Pareto-optimal, i.e. that no other combination beats on
+all of bits per pixel, SSIMULACRA2, encode CPU time and decode CPU time.
+
+CPU time is the wall time times the number of threads, in core-milliseconds
+per megapixel, which is what a server running many images in parallel pays.
+The --max_encode_cpu and --max_decode_cpu flags drop the combinations over
+that budget before computing the frontier.
+
+The toggles are benchmark_xl jxl codec parameters, e.g. "noperc", "gab0",
+"epf0" or "fi1", which map to the matching JXL_ENC_FRAME_SETTING_* options.
+Each toggle is tried both on and off. Example:
+
+  pareto_explorer.py --benchmark_xl=build/tools/benchmark_xl \\
+      --input='/corpus/*.png' --efforts=3,5,7 --distances=1 \\
+      --toggles=noperc,gab0 --threads=1,4 --max_encode_cpu=500
+"""
+
+from __future__ import absolute_import
+from __future__ import division
+from __future__ import print_function
+import argparse
+import csv
+import io
+import itertools
+import subprocess
+import sys
+
+
+def Configs(args):
+  """Yields (codec, threads) for every combination to benchmark."""
+  toggles = [t for t in args.toggles.split(',') if t]
+  for effort, distance, threads in itertools.product(
+      args.efforts.split(','), args.distances.split(','),
+      args.threads.split(',')):
+    for enabled in itertools.product([False, True], repeat=len(toggles)):
+      params = ['jxl', effort, 'd' + distance]
+      params += [t for t, on in zip(toggles, enabled) if on]
+      yield ':'.join(params), int(threads)
+
+
+def RunBenchmark(args, codec, threads):
+  """Runs benchmark_xl and returns the totals of the corpus, or None."""
+  cmd = [args.benchmark_xl, '--input=' + args.input, '--codec=' + codec,
+         '--print_details_csv', '--num_threads=0',
+         '--inner_threads=%d' % threads,
+         '--encode_reps=%d' % args.reps, '--decode_reps=%d' % args.reps]
+  cmd += args.extra_args
+  print(' '.join(cmd), file=sys.stderr)
+  try:
+    output = subprocess.check_output(cmd, universal_newlines=True)
+  except subprocess.CalledProcessError as e:
+    print('benchmark_xl failed with %d' % e.returncode, file=sys.stderr)
+    return None
+  # Only the CSV lines start with the codec name, since the header starts
+  # with "method" and the summary table is not printed with details.
+  lines = [l for l in output.splitlines()
+           if l.startswith('method,') or l.startswith(codec + ',')]
+  pixels = size = errors = 0
+  encode_seconds = decode_seconds = ssimulacra2 = 0.0
+  for row in csv.DictReader(io.StringIO('\n'.join(lines))):
+    if row['method'] != codec:
+      continue
+    image_pixels = int(row['pixels'])
+    pixels += image_pixels
+    size += int(row['size'])
+    errors += int(row['error'])
+    encode_seconds += image_pixels / (float(row['enc_speed']) * 1e6)
+    decode_seconds += image_pixels / (float(row['dec_speed']) * 1e6)
+    ssimulacra2 += float(row['ssimulacra2']) * image_pixels
+  if pixels == 0:
+    return None
+  mp = pixels * 1e-6
+  return {
+      'codec': codec,
+      'threads': threads,
+      'errors': errors,
+      'bpp': size * 8.0 / pixels,
+      'ssimulacra2': ssimulacra2 / pixels,
+      'enc_ms': encode_seconds * 1000 / mp,
+      'dec_ms': decode_seconds * 1000 / mp,
+      'enc_cpu': encode_seconds * 1000 * threads / mp,
+      'dec_cpu': decode_seconds * 1000 * threads / mp,
+  }
+
+
+def Dominates(a, b):
+  """Whether `a` is at least as good as `b` everywhere and better somewhere."""
+  lower_is_better = ['bpp', 'enc_cpu', 'dec_cpu']
+  if any(a[k] > b[k] for k in lower_is_better):
+    return False
+  if a['ssimulacra2'] < b['ssimulacra2']:
+    return False
+  return (any(a[k] < b[k] for k in lower_is_better) or
+          a['ssimulacra2'] > b['ssimulacra2'])
+
+
+def ParetoFrontier(results):
+  return [r for r in results
+          if not any(Dominates(o, r) for o in results if o is not r)]
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+  parser.add_argument('--benchmark_xl', default='benchmark_xl',
+                      help='path to the benchmark_xl binary')
+  parser.add_argument('--input', required=True,
+                      help='glob of the images of the corpus')
+  parser.add_argument('--efforts', default='1,2,3,4,5,6,7,8,9',
+                      help='comma-separated efforts, as numbers or names')
+  parser.add_argument('--distances', default='1',
+                      help='comma-separated Butteraugli distances')
+  parser.add_argument('--toggles', default='',
+                      help='comma-separated jxl codec parameters, each '
+                      'tried on and off')
+  parser.add_argument('--threads', default='1',
+                      help='comma-separated numbers of encoder and decoder '
+                      'threads')
+  parser.add_argument('--reps', type=int, default=1,
+                      help='encode and decode repetitions, to reduce noise')
+  parser.add_argument('--max_encode_cpu', type=float, default=0,
+                      help='encode budget in core-ms per megapixel, 0 for none')
+  parser.add_argument('--max_decode_cpu', type=float, default=0,
+                      help='decode budget in core-ms per megapixel, 0 for none')
+  parser.add_argument('extra_args', nargs='*',
+                      help='more arguments to pass to benchmark_xl, after --')
+  args = parser.parse_args()
+
+  results = []
+  for codec, threads in Configs(args):
+    result = RunBenchmark(args, codec, threads)
+    if result is None:
+      continue
+    if result['errors']:
+      print('%s has %d errors, skipped' % (codec, result['errors']),
+            file=sys.stderr)
+      continue
+    if args.max_encode_cpu and result['enc_cpu'] > args.max_encode_cpu:
+      continue
+    if args.max_decode_cpu and result['dec_cpu'] > args.max_decode_cpu:
+      continue
+    results.append(result)
+
+  frontier = ParetoFrontier(results)
+  frontier.sort(key=lambda r: (r['enc_cpu'], r['bpp']))
+  print('%-40s %7s %9s %11s %9s %9s %10s %10s' %
+        ('codec', 'threads', 'bpp', 'ssimulacra2', 'enc ms/MP', 'dec ms/MP',
+         'enc cpu', 'dec cpu'))
+  for r in frontier:
+    print('%-40s %7d %9.5f %11.4f %9.2f %9.2f %10.2f %10.2f' %
+          (r['codec'], r['threads'], r['bpp'], r['ssimulacra2'], r['enc_ms'],
+           r['dec_ms'], r['enc_cpu'], r['dec_cpu']))
+  print('%d of %d configurations are Pareto-optimal' %
+        (len(frontier), len(results)), file=sys.stderr)
+
+
+if __name__ == '__main__':
+  main()
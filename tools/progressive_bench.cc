@@ -0,0 +1,198 @@
+// Copyright (c) the JPEG XL Project Authors. All rights reserved.
+//
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+// Measures how a progressive codestream renders while it arrives over the
+// network: feeds it to the decoder in chunks, as they would arrive, flushes
+// the image at every progression step and reports, for each step, how many
+// bytes it needed, the CPU time spent by the decoder so far and per byte
+// received, and the time at which it would be shown on a link of the given
+// bandwidth.
+
+#include <jxl/codestream_header.h>
+#include <jxl/decode.h>
+#include <jxl/decode_cxx.h>
+#include <jxl/types.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "lib/jxl/base/printf_macros.h"
+#include "tools/file_io.h"
+
+namespace {
+
+// CPU time of the process in seconds.
+double CpuNow() { return static_cast<double>(std::clock()) / CLOCKS_PER_SEC; }
+
+struct Step {
+  const char* event;
+  size_t bytes;
+  size_t downsampling;
+  // CPU time of the decoder, including the flush, until the step.
+  double cpu;
+  double flush_cpu;
+  // Time at which the step is rendered, if the bytes arrive at the bandwidth
+  // and the decoder uses them as soon as they arrive.
+  double time;
+};
+
+bool ParseDetail(const char* s, JxlProgressiveDetail* detail) {
+  if (!strcmp(s, "dc")) {
+    *detail = kDC;
+  } else if (!strcmp(s, "lastpasses")) {
+    *detail = kLastPasses;
+  } else if (!strcmp(s, "passes")) {
+    *detail = kPasses;
+  } else if (!strcmp(s, "dcprogressive")) {
+    *detail = kDCProgressive;
+  } else if (!strcmp(s, "groups")) {
+    *detail = kGroups;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool Run(const std::vector<uint8_t>& data, size_t chunk_size, double kbps,
+         JxlProgressiveDetail detail, std::vector<Step>* steps) {
+  JxlDecoderPtr dec = JxlDecoderMake(nullptr);
+  if (JXL_DEC_SUCCESS !=
+      JxlDecoderSubscribeEvents(dec.get(), JXL_DEC_BASIC_INFO |
+                                               JXL_DEC_FRAME_PROGRESSION |
+                                               JXL_DEC_FULL_IMAGE)) {
+    fprintf(stderr, "JxlDecoderSubscribeEvents failed\n");
+    return false;
+  }
+  if (JXL_DEC_SUCCESS != JxlDecoderSetProgressiveDetail(dec.get(), detail)) {
+    fprintf(stderr, "JxlDecoderSetProgressiveDetail failed\n");
+    return false;
+  }
+
+  const double bytes_per_second = kbps * 1000 / 8;
+  const auto arrival = [&](size_t bytes) {
+    return bytes_per_second > 0 ? bytes / bytes_per_second : 0.0;
+  };
+  size_t avail_end = std::min(chunk_size, data.size());
+  JxlDecoderSetInput(dec.get(), data.data(), avail_end);
+  if (avail_end == data.size()) JxlDecoderCloseInput(dec.get());
+
+  JxlPixelFormat format = {4, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  std::vector<uint8_t> pixels;
+  double cpu = 0;
+  double time = arrival(avail_end);
+  for (;;) {
+    const double start = CpuNow();
+    JxlDecoderStatus status = JxlDecoderProcessInput(dec.get());
+    const double elapsed = CpuNow() - start;
+    cpu += elapsed;
+    time += elapsed;
+    if (status == JXL_DEC_ERROR) {
+      fprintf(stderr, "Decoder error\n");
+      return false;
+    } else if (status == JXL_DEC_NEED_MORE_INPUT) {
+      if (avail_end == data.size()) {
+        fprintf(stderr, "Truncated codestream\n");
+        return false;
+      }
+      const size_t remaining = JxlDecoderReleaseInput(dec.get());
+      const size_t offset = avail_end - remaining;
+      avail_end = std::min(avail_end + chunk_size, data.size());
+      JxlDecoderSetInput(dec.get(), data.data() + offset, avail_end - offset);
+      if (avail_end == data.size()) JxlDecoderCloseInput(dec.get());
+      time = std::max(time, arrival(avail_end));
+    } else if (status == JXL_DEC_BASIC_INFO) {
+      JxlBasicInfo info;
+      if (JXL_DEC_SUCCESS != JxlDecoderGetBasicInfo(dec.get(), &info)) {
+        fprintf(stderr, "JxlDecoderGetBasicInfo failed\n");
+        return false;
+      }
+      format.num_channels = info.num_color_channels + (info.alpha_bits ? 1 : 0);
+    } else if (status == JXL_DEC_NEED_IMAGE_OUT_BUFFER) {
+      size_t buffer_size;
+      if (JXL_DEC_SUCCESS !=
+          JxlDecoderImageOutBufferSize(dec.get(), &format, &buffer_size)) {
+        fprintf(stderr, "JxlDecoderImageOutBufferSize failed\n");
+        return false;
+      }
+      pixels.resize(buffer_size);
+      if (JXL_DEC_SUCCESS != JxlDecoderSetImageOutBuffer(dec.get(), &format,
+                                                         pixels.data(),
+                                                         pixels.size())) {
+        fprintf(stderr, "JxlDecoderSetImageOutBuffer failed\n");
+        return false;
+      }
+    } else if (status == JXL_DEC_FRAME_PROGRESSION) {
+      const size_t downsampling =
+          JxlDecoderGetIntendedDownsamplingRatio(dec.get());
+      const double flush_start = CpuNow();
+      const bool flushed = JxlDecoderFlushImage(dec.get()) == JXL_DEC_SUCCESS;
+      const double flush_cpu = CpuNow() - flush_start;
+      cpu += flush_cpu;
+      time += flush_cpu;
+      if (flushed) {
+        steps->push_back({"progression", avail_end, downsampling, cpu,
+                          flush_cpu, time});
+      }
+    } else if (status == JXL_DEC_FULL_IMAGE) {
+      steps->push_back({"full image", avail_end, 1, cpu, 0.0, time});
+    } else if (status == JXL_DEC_SUCCESS) {
+      return true;
+    } else {
+      fprintf(stderr, "Unexpected decoder status %d\n",
+              static_cast<int>(status));
+      return false;
+    }
+  }
+}
+
+int ProgressiveBench(int argc, char** argv) {
+  if (argc < 2 || argc > 5) {
+    fprintf(stderr,
+            "Usage: %s in.jxl [chunk_bytes=16384] [kbps=0] "
+            "[dc|lastpasses|passes|dcprogressive|groups=passes]\n"
+            "With kbps=0, the bytes arrive instantly.\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  std::vector<uint8_t> data;
+  if (!jpegxl::tools::ReadFile(argv[1], &data)) {
+    fprintf(stderr, "Failed to read %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  const size_t chunk_size = argc > 2 ? strtoull(argv[2], nullptr, 10) : 16384;
+  const double kbps = argc > 3 ? strtod(argv[3], nullptr) : 0.0;
+  JxlProgressiveDetail detail = kPasses;
+  if (chunk_size == 0 || kbps < 0 ||
+      (argc > 4 && !ParseDetail(argv[4], &detail))) {
+    fprintf(stderr, "Invalid arguments\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Step> steps;
+  if (!Run(data, chunk_size, kbps, detail, &steps)) return EXIT_FAILURE;
+
+  printf("%" PRIuS " bytes in chunks of %" PRIuS " bytes\n", data.size(),
+         chunk_size);
+  printf("%-12s %10s %7s %6s %10s %10s %11s %10s\n", "step", "bytes", "bytes%",
+         "ratio", "cpu ms", "flush ms", "cpu ns/B", "time ms");
+  for (const Step& step : steps) {
+    printf("%-12s %10" PRIuS " %7.2f %6" PRIuS " %10.3f %10.3f %11.2f %10.3f\n",
+           step.event, step.bytes, 100.0 * step.bytes / data.size(),
+           step.downsampling, step.cpu * 1E3, step.flush_cpu * 1E3,
+           step.cpu * 1E9 / step.bytes, step.time * 1E3);
+  }
+  return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) { return ProgressiveBench(argc, argv); }
@@ -101,6 +101,44 @@ roundtrip_test() {
   fi
 }
 
+# Encodes and decodes a directory and a list of files with --batch. A file that
+# fails does not stop the batch, but makes it fail.
+batch_test() {
+  local indir="$(mktemp -d -p "$tmpdir")"
+  local jxldir="$(mktemp -d -p "$tmpdir")"
+  local outdir="$(mktemp -d -p "$tmpdir")"
+  local names=("flower_small.rgb.depth8" "flower_small.rgb.depth16")
+  for name in "${names[@]}"; do
+    cp "${JPEGXL_TEST_DATA_PATH}/jxl/flower/${name}.ppm" "${indir}/"
+  done
+
+  "${encoder}" --batch "${indir}" "${jxldir}/%s.jxl" -d 0 -e 1
+  "${decoder}" --batch "${jxldir}" "${outdir}/%s.ppm"
+  for name in "${names[@]}"; do
+    diff "${indir}/${name}.ppm" "${outdir}/${name}.ppm"
+  done
+
+  local listfn="$(mktemp -p "$tmpdir")"
+  echo "${indir}/${names[0]}.ppm" > "${listfn}"
+  echo "${indir}/missing.ppm" >> "${listfn}"
+  echo "${indir}/${names[1]}.ppm" >> "${listfn}"
+  rm "${jxldir}"/*.jxl
+  if "${encoder}" --batch "${listfn}" "${jxldir}/%s.jxl" -d 0 -e 1; then
+    echo "A batch with a missing file succeeded" >&2
+    return 1
+  fi
+  test -f "${jxldir}/${names[0]}.jxl"
+  test -f "${jxldir}/${names[1]}.jxl"
+
+  # Invalid flags fail each file instead of stopping the process.
+  rm "${jxldir}"/*.jxl
+  if "${encoder}" --batch "${indir}" "${jxldir}/%s.jxl" --epf 7; then
+    echo "A batch with invalid flags succeeded" >&2
+    return 1
+  fi
+  test -z "$(ls -A "${jxldir}")"
+}
+
 main() {
   local tmpdir=$(mktemp -d)
   CLEANUP_FILES+=("${tmpdir}")
@@ -128,6 +166,8 @@ main() {
 
   roundtrip_test "jxl/flower/flower.png" "-e 6" 0.02
 
+  batch_test
+
   roundtrip_lossless_pnm_test "jxl/flower/flower_small.rgb.depth1.ppm"
   roundtrip_lossless_pnm_test "jxl/flower/flower_small.g.depth1.pgm"
   for i in `seq 2 16`; do
@@ -30,6 +30,9 @@ class SpeedStats {
   // Non-const, may sort elapsed_.
   bool GetSummary(Summary* summary);
 
+  // Elapsed times passed to NotifyElapsed, in no particular order.
+  const std::vector<double>& elapsed() const { return elapsed_; }
+
   // Sets the image size to allow computing MP/s values.
   void SetImageSize(size_t xsize, size_t ysize) {
     xsize_ = xsize;
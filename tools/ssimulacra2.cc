@@ -29,10 +29,14 @@ Design:
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <utility>
+#include <vector>
 
 #include "lib/jxl/base/compiler_specific.h"
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/printf_macros.h"
 #include "lib/jxl/base/status.h"
 #include "lib/jxl/color_encoding_internal.h"
@@ -80,76 +84,70 @@ StatusOr<Image3F> Downsample(const Image3F& in, size_t fx, size_t fy) {
   return out;
 }
 
-void Multiply(const Image3F& a, const Image3F& b, Image3F* mul) {
-  for (size_t c = 0; c < 3; ++c) {
-    for (size_t y = 0; y < a.ysize(); ++y) {
-      const float* JXL_RESTRICT in1 = a.PlaneRow(c, y);
-      const float* JXL_RESTRICT in2 = b.PlaneRow(c, y);
-      float* JXL_RESTRICT out = mul->PlaneRow(c, y);
-      for (size_t x = 0; x < a.xsize(); ++x) {
-        out[x] = in1[x] * in2[x];
-      }
+void Multiply(const ImageF& a, const ImageF& b, ImageF* mul) {
+  for (size_t y = 0; y < a.ysize(); ++y) {
+    const float* JXL_RESTRICT in1 = a.Row(y);
+    const float* JXL_RESTRICT in2 = b.Row(y);
+    float* JXL_RESTRICT out = mul->Row(y);
+    for (size_t x = 0; x < a.xsize(); ++x) {
+      out[x] = in1[x] * in2[x];
     }
   }
 }
 
-// Temporary storage for Gaussian blur, reused for multiple images.
-class Blur {
- public:
-  static StatusOr<Blur> Create(const size_t xsize, const size_t ysize) {
-    JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
-    Blur result;
-    JXL_ASSIGN_OR_RETURN(result.temp_,
-                         ImageF::Create(memory_manager, xsize, ysize));
-    return result;
-  }
+// Gaussian blur, with `temp` at least as large as `in`.
+StatusOr<ImageF> Blur(const jxl::RecursiveGaussian& rg, const ImageF& in,
+                      ImageF* temp) {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  JXL_ASSIGN_OR_RETURN(ImageF out,
+                       ImageF::Create(memory_manager, in.xsize(), in.ysize()));
+  JXL_RETURN_IF_ERROR(FastGaussian(
+      memory_manager, rg, in.xsize(), in.ysize(),
+      [&](size_t y) { return in.ConstRow(y); },
+      [&](size_t y) { return temp->Row(y); },
+      [&](size_t y) { return out.Row(y); }));
+  return out;
+}
 
-  Status BlurPlane(const ImageF& in, ImageF* JXL_RESTRICT out) {
-    JXL_RETURN_IF_ERROR(FastGaussian(
-        in.memory_manager(), rg_, in.xsize(), in.ysize(),
-        [&](size_t y) { return in.ConstRow(y); },
-        [&](size_t y) { return temp_.Row(y); },
-        [&](size_t y) { return out->Row(y); }));
+// Runs `func(scale, c, temp)` for every channel of `num_scales` scales, in
+// parallel, with a temporary plane of Blur for every thread.
+template <typename Func>
+Status RunOnScaleChannels(size_t num_scales, size_t xsize, size_t ysize,
+                          jxl::ThreadPool* pool, const Func& func) {
+  std::vector<ImageF> temps;
+  const auto init = [&](const size_t num_threads) -> Status {
+    temps.clear();
+    for (size_t i = 0; i < num_threads; ++i) {
+      JXL_ASSIGN_OR_RETURN(
+          ImageF temp,
+          ImageF::Create(jpegxl::tools::NoMemoryManager(), xsize, ysize));
+      temps.emplace_back(std::move(temp));
+    }
     return true;
-  }
-
-  StatusOr<Image3F> operator()(const Image3F& in) {
-    JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
-    JXL_ASSIGN_OR_RETURN(
-        Image3F out, Image3F::Create(memory_manager, in.xsize(), in.ysize()));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(0), &out.Plane(0)));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(1), &out.Plane(1)));
-    JXL_RETURN_IF_ERROR(BlurPlane(in.Plane(2), &out.Plane(2)));
-    return out;
-  }
-
-  // Allows reusing across scales.
-  Status ShrinkTo(const size_t xsize, const size_t ysize) {
-    return temp_.ShrinkTo(xsize, ysize);
-  }
-
- private:
-  Blur() : rg_(jxl::CreateRecursiveGaussian(1.5)) {}
-  jxl::RecursiveGaussian rg_;
-  ImageF temp_;
-};
+  };
+  const auto process = [&](const uint32_t task, const size_t thread) {
+    return func(task / 3, task % 3, &temps[thread]);
+  };
+  return RunOnPool(pool, 0, num_scales * 3, init, process, "Ssimulacra2");
+}
 
 double quartic(double x) {
   x *= x;
   x *= x;
   return x;
 }
-void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
-             const Image3F& s22, const Image3F& s12, double* plane_averages) {
+// Averages of one channel.
+void SSIMMap(const ImageF& m1, const ImageF& m2, const ImageF& s11,
+             const ImageF& s22, const ImageF& s12, double* plane_averages) {
   const double onePerPixels = 1.0 / (m1.ysize() * m1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
+  {
     double sum1[2] = {0.0};
     for (size_t y = 0; y < m1.ysize(); ++y) {
-      const float* JXL_RESTRICT row_m1 = m1.PlaneRow(c, y);
-      const float* JXL_RESTRICT row_m2 = m2.PlaneRow(c, y);
-      const float* JXL_RESTRICT row_s11 = s11.PlaneRow(c, y);
-      const float* JXL_RESTRICT row_s22 = s22.PlaneRow(c, y);
-      const float* JXL_RESTRICT row_s12 = s12.PlaneRow(c, y);
+      const float* JXL_RESTRICT row_m1 = m1.Row(y);
+      const float* JXL_RESTRICT row_m2 = m2.Row(y);
+      const float* JXL_RESTRICT row_s11 = s11.Row(y);
+      const float* JXL_RESTRICT row_s22 = s22.Row(y);
+      const float* JXL_RESTRICT row_s12 = s12.Row(y);
       for (size_t x = 0; x < m1.xsize(); ++x) {
         float mu1 = row_m1[x];
         float mu2 = row_m2[x];
@@ -181,21 +179,22 @@ void SSIMMap(const Image3F& m1, const Image3F& m2, const Image3F& s11,
         sum1[1] += quartic(d);
       }
     }
-    plane_averages[c * 2] = onePerPixels * sum1[0];
-    plane_averages[c * 2 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
+    plane_averages[0] = onePerPixels * sum1[0];
+    plane_averages[1] = sqrt(sqrt(onePerPixels * sum1[1]));
   }
 }
 
-void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
-                 const Image3F& mu2, double* plane_averages) {
+// Averages of one channel.
+void EdgeDiffMap(const ImageF& img1, const ImageF& mu1, const ImageF& img2,
+                 const ImageF& mu2, double* plane_averages) {
   const double onePerPixels = 1.0 / (img1.ysize() * img1.xsize());
-  for (size_t c = 0; c < 3; ++c) {
+  {
     double sum1[4] = {0.0};
     for (size_t y = 0; y < img1.ysize(); ++y) {
-      const float* JXL_RESTRICT row1 = img1.PlaneRow(c, y);
-      const float* JXL_RESTRICT row2 = img2.PlaneRow(c, y);
-      const float* JXL_RESTRICT rowm1 = mu1.PlaneRow(c, y);
-      const float* JXL_RESTRICT rowm2 = mu2.PlaneRow(c, y);
+      const float* JXL_RESTRICT row1 = img1.Row(y);
+      const float* JXL_RESTRICT row2 = img2.Row(y);
+      const float* JXL_RESTRICT rowm1 = mu1.Row(y);
+      const float* JXL_RESTRICT rowm2 = mu2.Row(y);
       for (size_t x = 0; x < img1.xsize(); ++x) {
         double d1 = (1.0 + std::abs(row2[x] - rowm2[x])) /
                         (1.0 + std::abs(row1[x] - rowm1[x])) -
@@ -214,10 +213,10 @@ void EdgeDiffMap(const Image3F& img1, const Image3F& mu1, const Image3F& img2,
         sum1[3] += quartic(detail_lost);
       }
     }
-    plane_averages[c * 4] = onePerPixels * sum1[0];
-    plane_averages[c * 4 + 1] = sqrt(sqrt(onePerPixels * sum1[1]));
-    plane_averages[c * 4 + 2] = onePerPixels * sum1[2];
-    plane_averages[c * 4 + 3] = sqrt(sqrt(onePerPixels * sum1[3]));
+    plane_averages[0] = onePerPixels * sum1[0];
+    plane_averages[1] = sqrt(sqrt(onePerPixels * sum1[1]));
+    plane_averages[2] = onePerPixels * sum1[2];
+    plane_averages[3] = sqrt(sqrt(onePerPixels * sum1[3]));
   }
 }
 
@@ -260,17 +259,51 @@ void AlphaBlend(ImageBundle& img, float bg) {
   }
 }
 
-Status ToXYB(const ImageBundle& in, Image3F* JXL_RESTRICT xyb) {
+Status ToXYB(const ImageBundle& in, jxl::ThreadPool* pool,
+             Image3F* JXL_RESTRICT xyb) {
   JxlMemoryManager* memory_manager = in.memory_manager();
   JXL_ASSIGN_OR_RETURN(*xyb,
                        Image3F::Create(memory_manager, in.xsize(), in.ysize()));
   JXL_RETURN_IF_ERROR(CopyImageTo(in.color(), xyb));
   JXL_RETURN_IF_ERROR(ToXYB(in.c_current(), in.metadata()->IntensityTarget(),
-                            in.black(), nullptr, xyb, *JxlGetDefaultCms(),
+                            in.black(), pool, xyb, *JxlGetDefaultCms(),
                             nullptr));
   return true;
 }
 
+// Copy of `in` in linear sRGB, blended against a gray background of intensity
+// `bg` in case of alpha transparency.
+StatusOr<ImageBundle> ToLinear(const ImageBundle& in, float bg) {
+  JXL_ASSIGN_OR_RETURN(ImageBundle out, in.Copy());
+  if (in.HasAlpha()) AlphaBlend(out, bg);
+  out.ClearExtraChannels();
+  JXL_RETURN_IF_ERROR(out.TransformTo(
+      jxl::ColorEncoding::LinearSRGB(out.IsGray()), *JxlGetDefaultCms()));
+  return out;
+}
+
+// Positive XYB images of every scale of the linear image. Downscaling stops
+// after the first scale smaller than 8 pixels in a dimension.
+StatusOr<std::vector<Image3F>> XybScales(ImageBundle&& linear,
+                                         jxl::ThreadPool* pool) {
+  std::vector<Image3F> scales;
+  for (int scale = 0; scale < kNumScales; scale++) {
+    if (linear.xsize() < 8 || linear.ysize() < 8) {
+      break;
+    }
+    if (scale) {
+      JXL_ASSIGN_OR_RETURN(Image3F tmp, Downsample(*linear.color(), 2, 2));
+      JXL_RETURN_IF_ERROR(linear.SetFromImage(
+          std::move(tmp), jxl::ColorEncoding::LinearSRGB(linear.IsGray())));
+    }
+    Image3F xyb;
+    JXL_RETURN_IF_ERROR(ToXYB(linear, pool, &xyb));
+    MakePositiveXYB(xyb);
+    scales.emplace_back(std::move(xyb));
+  }
+  return scales;
+}
+
 }  // namespace
 
 /*
@@ -456,81 +489,83 @@ double Msssim::Score() const {
   return ssim;
 }
 
-StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
-                                    const ImageBundle& dist, float bg) {
+StatusOr<Ssimulacra2Reference> Ssimulacra2Reference::Create(
+    const ImageBundle& orig, float bg, jxl::ThreadPool* pool) {
   JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
-  Msssim msssim;
-
-  JXL_ASSIGN_OR_RETURN(
-      Image3F img1,
-      Image3F::Create(memory_manager, orig.xsize(), orig.ysize()));
-  JXL_ASSIGN_OR_RETURN(
-      Image3F img2,
-      Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
-
-  JXL_ASSIGN_OR_RETURN(ImageBundle orig2, orig.Copy());
-  JXL_ASSIGN_OR_RETURN(ImageBundle dist2, dist.Copy());
-
-  if (orig.HasAlpha()) AlphaBlend(orig2, bg);
-  if (dist.HasAlpha()) AlphaBlend(dist2, bg);
-  orig2.ClearExtraChannels();
-  dist2.ClearExtraChannels();
-
-  JXL_RETURN_IF_ERROR(orig2.TransformTo(
-      jxl::ColorEncoding::LinearSRGB(orig2.IsGray()), *JxlGetDefaultCms()));
-  JXL_RETURN_IF_ERROR(dist2.TransformTo(
-      jxl::ColorEncoding::LinearSRGB(dist2.IsGray()), *JxlGetDefaultCms()));
-
-  JXL_RETURN_IF_ERROR(ToXYB(orig2, &img1));
-  JXL_RETURN_IF_ERROR(ToXYB(dist2, &img2));
-  MakePositiveXYB(img1);
-  MakePositiveXYB(img2);
-
-  JXL_ASSIGN_OR_RETURN(
-      Image3F mul, Image3F::Create(memory_manager, img1.xsize(), img1.ysize()));
-  JXL_ASSIGN_OR_RETURN(Blur blur, Blur::Create(img1.xsize(), img1.ysize()));
-
-  for (int scale = 0; scale < kNumScales; scale++) {
-    if (img1.xsize() < 8 || img1.ysize() < 8) {
-      break;
-    }
-    if (scale) {
-      JXL_ASSIGN_OR_RETURN(Image3F tmp, Downsample(*orig2.color(), 2, 2));
-      JXL_RETURN_IF_ERROR(orig2.SetFromImage(
-          std::move(tmp), jxl::ColorEncoding::LinearSRGB(orig2.IsGray())));
-      JXL_ASSIGN_OR_RETURN(tmp, Downsample(*dist2.color(), 2, 2));
-      JXL_RETURN_IF_ERROR(dist2.SetFromImage(
-          std::move(tmp), jxl::ColorEncoding::LinearSRGB(dist2.IsGray())));
-      JXL_RETURN_IF_ERROR(img1.ShrinkTo(orig2.xsize(), orig2.ysize()));
-      JXL_RETURN_IF_ERROR(img2.ShrinkTo(orig2.xsize(), orig2.ysize()));
-      JXL_RETURN_IF_ERROR(ToXYB(orig2, &img1));
-      JXL_RETURN_IF_ERROR(ToXYB(dist2, &img2));
-      MakePositiveXYB(img1);
-      MakePositiveXYB(img2);
-    }
-    JXL_RETURN_IF_ERROR(mul.ShrinkTo(img1.xsize(), img1.ysize()));
-    JXL_RETURN_IF_ERROR(blur.ShrinkTo(img1.xsize(), img1.ysize()));
+  Ssimulacra2Reference reference;
+  reference.xsize_ = orig.xsize();
+  reference.ysize_ = orig.ysize();
+  reference.bg_ = bg;
+  JXL_ASSIGN_OR_RETURN(ImageBundle linear, ToLinear(orig, bg));
+  JXL_ASSIGN_OR_RETURN(std::vector<Image3F> xyb,
+                       XybScales(std::move(linear), pool));
+  reference.scales_.resize(xyb.size());
+  for (size_t s = 0; s < xyb.size(); ++s) {
+    reference.scales_[s].xyb = std::move(xyb[s]);
+  }
 
+  const jxl::RecursiveGaussian rg = jxl::CreateRecursiveGaussian(1.5);
+  const auto process = [&](size_t s, size_t c, ImageF* temp) -> Status {
+    Scale& scale = reference.scales_[s];
+    const ImageF& img1 = scale.xyb.Plane(c);
+    JXL_ASSIGN_OR_RETURN(
+        ImageF mul, ImageF::Create(memory_manager, img1.xsize(), img1.ysize()));
     Multiply(img1, img1, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma1_sq, blur(mul));
+    JXL_ASSIGN_OR_RETURN(scale.sigma_sq.Plane(c), Blur(rg, mul, temp));
+    JXL_ASSIGN_OR_RETURN(scale.mu.Plane(c), Blur(rg, img1, temp));
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(RunOnScaleChannels(reference.scales_.size(),
+                                         reference.xsize_, reference.ysize_,
+                                         pool, process));
+  return reference;
+}
 
-    Multiply(img2, img2, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma2_sq, blur(mul));
+StatusOr<Msssim> Ssimulacra2Reference::Compare(const ImageBundle& distorted,
+                                               jxl::ThreadPool* pool) const {
+  JxlMemoryManager* memory_manager = jpegxl::tools::NoMemoryManager();
+  if (distorted.xsize() != xsize_ || distorted.ysize() != ysize_) {
+    return JXL_FAILURE("Image size mismatch");
+  }
+  JXL_ASSIGN_OR_RETURN(ImageBundle linear, ToLinear(distorted, bg_));
+  JXL_ASSIGN_OR_RETURN(std::vector<Image3F> xyb,
+                       XybScales(std::move(linear), pool));
+  JXL_ENSURE(xyb.size() == scales_.size());
 
+  Msssim msssim;
+  msssim.scales.resize(scales_.size());
+  const jxl::RecursiveGaussian rg = jxl::CreateRecursiveGaussian(1.5);
+  const auto process = [&](size_t s, size_t c, ImageF* temp) -> Status {
+    const Scale& scale = scales_[s];
+    const ImageF& img1 = scale.xyb.Plane(c);
+    const ImageF& img2 = xyb[s].Plane(c);
+    JXL_ASSIGN_OR_RETURN(
+        ImageF mul, ImageF::Create(memory_manager, img2.xsize(), img2.ysize()));
+    Multiply(img2, img2, &mul);
+    JXL_ASSIGN_OR_RETURN(ImageF sigma2_sq, Blur(rg, mul, temp));
     Multiply(img1, img2, &mul);
-    JXL_ASSIGN_OR_RETURN(Image3F sigma12, blur(mul));
-
-    JXL_ASSIGN_OR_RETURN(Image3F mu1, blur(img1));
-    JXL_ASSIGN_OR_RETURN(Image3F mu2, blur(img2));
-
-    MsssimScale sscale;
-    SSIMMap(mu1, mu2, sigma1_sq, sigma2_sq, sigma12, sscale.avg_ssim);
-    EdgeDiffMap(img1, mu1, img2, mu2, sscale.avg_edgediff);
-    msssim.scales.push_back(sscale);
-  }
+    JXL_ASSIGN_OR_RETURN(ImageF sigma12, Blur(rg, mul, temp));
+    JXL_ASSIGN_OR_RETURN(ImageF mu2, Blur(rg, img2, temp));
+
+    MsssimScale& sscale = msssim.scales[s];
+    SSIMMap(scale.mu.Plane(c), mu2, scale.sigma_sq.Plane(c), sigma2_sq,
+            sigma12, sscale.avg_ssim + c * 2);
+    EdgeDiffMap(img1, scale.mu.Plane(c), img2, mu2,
+                sscale.avg_edgediff + c * 4);
+    return true;
+  };
+  JXL_RETURN_IF_ERROR(
+      RunOnScaleChannels(scales_.size(), xsize_, ysize_, pool, process));
   return msssim;
 }
 
+StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
+                                    const ImageBundle& dist, float bg) {
+  JXL_ASSIGN_OR_RETURN(Ssimulacra2Reference reference,
+                       Ssimulacra2Reference::Create(orig, bg));
+  return reference.Compare(dist);
+}
+
 StatusOr<Msssim> ComputeSSIMULACRA2(const ImageBundle& orig,
                                     const ImageBundle& distorted) {
   return ComputeSSIMULACRA2(orig, distorted, 0.5f);
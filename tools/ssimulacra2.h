@@ -6,9 +6,12 @@
 #ifndef TOOLS_SSIMULACRA2_H_
 #define TOOLS_SSIMULACRA2_H_
 
+#include <cstddef>
 #include <vector>
 
+#include "lib/jxl/base/data_parallel.h"
 #include "lib/jxl/base/status.h"
+#include "lib/jxl/image.h"
 #include "lib/jxl/image_bundle.h"
 
 struct MsssimScale {
@@ -31,4 +34,37 @@ jxl::StatusOr<Msssim> ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
 jxl::StatusOr<Msssim> ComputeSSIMULACRA2(const jxl::ImageBundle &orig,
                                          const jxl::ImageBundle &distorted);
 
+// The part of ComputeSSIMULACRA2 that only depends on the reference image: its
+// XYB image at every scale, blurred and squared then blurred.
+// Comparing many distorted images with the same reference only computes it
+// once.
+class Ssimulacra2Reference {
+ public:
+  // In case of alpha transparency, the reference and the distorted images are
+  // blended against a gray background of intensity 'bg'. The work of every
+  // scale is split by channel on 'pool'.
+  static jxl::StatusOr<Ssimulacra2Reference> Create(
+      const jxl::ImageBundle &orig, float bg = 0.5f,
+      jxl::ThreadPool *pool = nullptr);
+
+  // Same as ComputeSSIMULACRA2 of the reference and 'distorted', which must
+  // have the same size. May be called concurrently.
+  jxl::StatusOr<Msssim> Compare(const jxl::ImageBundle &distorted,
+                                jxl::ThreadPool *pool = nullptr) const;
+
+ private:
+  struct Scale {
+    jxl::Image3F xyb;
+    jxl::Image3F mu;
+    jxl::Image3F sigma_sq;
+  };
+
+  Ssimulacra2Reference() = default;
+
+  size_t xsize_ = 0;
+  size_t ysize_ = 0;
+  float bg_ = 0.5f;
+  std::vector<Scale> scales_;
+};
+
 #endif  // TOOLS_SSIMULACRA2_H_
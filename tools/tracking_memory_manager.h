@@ -25,7 +25,9 @@ class TrackingMemoryManager {
  public:
   explicit TrackingMemoryManager(uint64_t cap = 0, uint64_t total_cap = 0);
 
-  // void setInner(JxlMemoryManager* inner) { inner_ = inner; }
+  // Allocates through `inner` instead of the default allocator. Must be called
+  // before the first allocation.
+  void SetInner(JxlMemoryManager* inner) { inner_ = inner; }
 
   JxlMemoryManager* get() { return &outer_; }
 